@@ -53,8 +53,37 @@ static ngx_cached_open_file_t *
 static void ngx_open_file_cache_remove(ngx_event_t *ev);
 
 
+/* errors are saved to cache when enabled by open_file_cache_errors, or when not found errors are cached explicitly */
+#define ngx_async_open_file_is_cacheable(of, params)                          \
+    ((of)->err != 0 && ((of)->errors ||                                       \
+        ((params)->not_found_valid != 0 &&                                    \
+        ((of)->err == NGX_ENOENT || (of)->err == NGX_ENOTDIR))))
+
+
+static time_t
+ngx_async_open_file_get_valid(ngx_open_file_info_t *of,
+    ngx_async_open_file_params_t *params, ngx_cached_open_file_t *file)
+{
+    if (file->err != 0) {
+        if (params->not_found_valid != 0
+            && (file->err == NGX_ENOENT || file->err == NGX_ENOTDIR))
+        {
+            return params->not_found_valid;
+        }
+
+        return of->valid;
+    }
+
+    if (params->immutable_valid != 0 && !file->is_dir) {
+        return params->immutable_valid;
+    }
+
+    return of->valid;
+}
+
+
 static ngx_int_t
-ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t *file, ngx_str_t *name, uint32_t hash,
+ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_async_open_file_params_t *params, ngx_cached_open_file_t *file, ngx_str_t *name, uint32_t hash,
     ngx_open_file_info_t *of, ngx_log_t *log, ngx_pool_cleanup_t *cln, ngx_int_t open_rc)
 {
     time_t                          now;
@@ -66,7 +95,7 @@ ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t
 
         file->count--;
 
-        if (open_rc != NGX_OK && (of->err == 0 || !of->errors)) {
+        if (open_rc != NGX_OK && !ngx_async_open_file_is_cacheable(of, params)) {
 
             ngx_open_file_del_event(file);
 
@@ -135,7 +164,7 @@ ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t
         if (file->fd == NGX_INVALID_FILE && file->err == 0 && !file->is_dir) {
 
             /* file was not used often enough to keep open */
-            if (open_rc != NGX_OK && (of->err == 0 || !of->errors)) {
+            if (open_rc != NGX_OK && !ngx_async_open_file_is_cacheable(of, params)) {
                 goto failed;
             }
 
@@ -145,7 +174,7 @@ ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t
         if (file->use_event
             || (file->event == NULL
                 && (of->uniq == 0 || of->uniq == file->uniq)
-                && now - file->created < of->valid
+                && now - file->created < ngx_async_open_file_get_valid(of, params, file)
 #if (NGX_HAVE_OPENAT)
                 && of->disable_symlinks == file->disable_symlinks
                 && of->disable_symlinks_from == file->disable_symlinks_from
@@ -199,7 +228,7 @@ ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t
             goto found;
         }
 
-        if (open_rc != NGX_OK && (of->err == 0 || !of->errors)) {
+        if (open_rc != NGX_OK && !ngx_async_open_file_is_cacheable(of, params)) {
             goto failed;
         }
         
@@ -251,7 +280,7 @@ ngx_save_open_file_to_cache(ngx_open_file_cache_t *cache, ngx_cached_open_file_t
 
     /* not found */
     
-    if (open_rc != NGX_OK && (of->err == 0 || !of->errors)) {
+    if (open_rc != NGX_OK && !ngx_async_open_file_is_cacheable(of, params)) {
         goto failed;
     }
 
@@ -1114,7 +1143,7 @@ ngx_open_file_cache_remove(ngx_event_t *ev)
 
 /* Note: returns NGX_DONE on cache miss */
 static ngx_int_t
-ngx_get_open_file_from_cache(ngx_open_file_cache_t *cache, ngx_str_t *name,
+ngx_get_open_file_from_cache(ngx_open_file_cache_t *cache, ngx_async_open_file_params_t *params, ngx_str_t *name,
 uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log, ngx_pool_cleanup_t *cln, ngx_cached_open_file_t **out_file)
 {
     time_t                          now;
@@ -1139,7 +1168,7 @@ uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log, ngx_pool_cleanup_t *cln
     if (!file->use_event
         && (file->event != NULL
             || (of->uniq != 0 && of->uniq != file->uniq)
-            || now - file->created >= of->valid
+            || now - file->created >= ngx_async_open_file_get_valid(of, params, file)
 #if (NGX_HAVE_OPENAT)
             || of->disable_symlinks != file->disable_symlinks
             || of->disable_symlinks_from != file->disable_symlinks_from
@@ -1234,6 +1263,7 @@ uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log, ngx_pool_cleanup_t *cln
 
 typedef struct {
 	ngx_open_file_cache_t *cache;
+	ngx_async_open_file_params_t params;
 	ngx_str_t name;
 	uint32_t hash;
 	ngx_open_file_info_t *of;
@@ -1264,7 +1294,7 @@ ngx_async_open_thread_event_handler(ngx_event_t *ev)
 
 	if (ctx->cache != NULL)
 	{
-		rc = ngx_save_open_file_to_cache(ctx->cache, ctx->file, &ctx->name, ctx->hash, ctx->of, ctx->log, ctx->cln, ctx->err);
+		rc = ngx_save_open_file_to_cache(ctx->cache, &ctx->params, ctx->file, &ctx->name, ctx->hash, ctx->of, ctx->log, ctx->cln, ctx->err);
 	}
 	else
 	{
@@ -1288,6 +1318,7 @@ ngx_async_open_thread_event_handler(ngx_event_t *ev)
 ngx_int_t
 ngx_async_open_cached_file(
 	ngx_open_file_cache_t *cache, 
+	ngx_async_open_file_params_t *params,
 	ngx_str_t *name,
 	ngx_open_file_info_t *of, 
 	ngx_pool_t *pool, 
@@ -1317,7 +1348,7 @@ ngx_async_open_cached_file(
 		hash = ngx_crc32_long(name->data, name->len);
 
 		// try to fetch from cache
-		rc = ngx_get_open_file_from_cache(cache, name, hash, of, pool->log, cln, &file);
+		rc = ngx_get_open_file_from_cache(cache, params, name, hash, of, pool->log, cln, &file);
 		if (rc != NGX_DONE)
 		{
 			return rc;
@@ -1354,6 +1385,7 @@ ngx_async_open_cached_file(
 	// initialize the context
 	ctx = task->ctx;
 	ctx->cache = cache;
+	ctx->params = *params;
 	ctx->name = *name;
 	ctx->hash = hash;
 	ctx->of = of;
@@ -16,9 +16,15 @@
 
 typedef void(*ngx_async_open_file_callback_t)(void* context, ngx_int_t rc);
 
+typedef struct {
+	time_t not_found_valid;		// when non-zero, not found errors are cached for this duration
+	time_t immutable_valid;		// when non-zero, files are not revalidated for this duration
+} ngx_async_open_file_params_t;
+
 
 ngx_int_t ngx_async_open_cached_file(
 	ngx_open_file_cache_t *cache, 
+	ngx_async_open_file_params_t *params,
 	ngx_str_t *name,
     ngx_open_file_info_t *of, 
 	ngx_pool_t *pool, 
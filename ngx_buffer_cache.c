@@ -4,32 +4,81 @@
 	shared memory layout:
 		shared memory start
 		fixed size headers
-		entries_start
+		shard #0 entries_start
 		...
-		entries_end
+		shard #0 entries_end
 
-		buffers_start
+		shard #0 buffers_start
 		...
-		buffers_end
+		shard #0 buffers_end
+		shard #1 entries_start
+		...
+		shard #N-1 buffers_end
 		shared memory end
 
-	the shared memory is composed of 3 sections:
+	the shared memory is composed of a fixed size header section followed by
+	N equally sized shards. each shard is an independent cache with its own mutex,
+	the shard of a key is chosen according to the hash of the key.
+
 	1. fixed size headers - contains the ngx_slab_pool_t struct allocated by nginx,
-		the log context string and ngx_buffer_cache_sh_t
-	2. entries - an array of ngx_buffer_cache_entry_t, each entry has a key and 
+		the log context string and an array of ngx_buffer_cache_sh_t (one per shard)
+	
+	each shard is composed of 2 sections (3 when using BUFFER_CACHE_POLICY_TINYLFU):
+	0. sketch - an array of access frequency counters (count-min sketch), byte counters saturating
+		at 15, used for deciding whether a new entry should be admitted when the shard is full.
+		an entry is admitted only if its key was accessed more frequently than the key
+		of the entry that has to be evicted for it. the counters are halved periodically, 
+		so that the frequencies reflect recent accesses
+	1. entries - an array of ngx_buffer_cache_entry_t, each entry has a key and 
 		points to a buffer in the buffers section. the entries are connected with a 
 		red/black tree for fast lookup by key. the entries section grows as needed until 
 		it bumps into the buffers section. each entry is a member of one of 2 doubly 
 		linked lists - the free queue and the used queue. the entries move between these 
 		queues as they are allocated / deallocated
-	3. buffers - a cyclic queue of variable size buffers. the buffers section starts
-		at the end of the shared memory and grows towards its beginning until it bumps
+	2. buffers - a cyclic queue of variable size buffers. the buffers section starts
+		at the end of the shard and grows towards its beginning until it bumps
 		into the entries section. the buffers section has 2 pointers:
 		a. when a buffer is allocated, it is allocated before the write head
 		b. when an entry is freed, the read head of the buffers section moves
 
+	lookups (fetch / release) are first attempted without taking the shard mutex.
+	any change to the structure of the shard is performed under the mutex, and is wrapped
+	by increments of the shard version (seqlock). an unlocked lookup that overlapped a 
+	change is discarded, and the operation is retried with the mutex locked.
+
+	when the cache is partitioned by numa node, the shards are divided into numa_node_count
+	groups of equal size, the memory of each group is page aligned and bound to its node.
+	a worker process uses only the shards of the node it runs on.
+
+	when huge pages are enabled, the kernel is advised to back the zone with transparent
+	huge pages before the shards are initialized, and the numa node groups are aligned 
+	to the huge page size instead of the page size.
+
+	on reload, a zone whose name and size did not change is reused as is by nginx.
+	when the size changes, nginx allocates a new zone, the entries of the previous zone 
+	are copied to it in write order before the previous zone is freed.
+
 */
 
+#if (NGX_LINUX)
+#include <sys/syscall.h>
+
+#define NUMA_MPOL_PREFERRED (1)
+#define NUMA_NODES_POSSIBLE_PATH "/sys/devices/system/node/possible"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SMAPS_PATH "/proc/self/smaps"
+#define SMAPS_HUGE_PAGES_FIELD "ShmemPmdMapped:"
+#endif // NGX_LINUX
+
+// globals
+static ngx_uint_t ngx_buffer_cache_numa_node = 0;
+
+// forward decls
+static void ngx_buffer_cache_load(ngx_buffer_cache_t* cache, ngx_log_t* log);
+static ngx_buffer_cache_t* ngx_buffer_cache_get_previous(ngx_shm_zone_t *shm_zone);
+static void ngx_buffer_cache_migrate(ngx_buffer_cache_t* cache, ngx_buffer_cache_t* ocache, ngx_log_t* log);
+
 // Note: code taken from ngx_str_rbtree_insert_value, updated the node comparison
 static void
 ngx_buffer_cache_rbtree_insert_value(
@@ -110,6 +159,126 @@ ngx_buffer_cache_rbtree_lookup(ngx_rbtree_t *rbtree, const u_char* key, uint32_t
 	return NULL;
 }
 
+/* Note: must be called with the mutex locked */
+static ngx_inline void
+ngx_buffer_cache_write_begin(ngx_buffer_cache_sh_t *cache)
+{
+	// Note: the version may already be odd if a process was killed while modifying the shard
+	if ((cache->version & 1) == 0)
+	{
+		(void)ngx_atomic_fetch_add(&cache->version, 1);
+	}
+}
+
+/* Note: must be called with the mutex locked */
+static ngx_inline void
+ngx_buffer_cache_write_end(ngx_buffer_cache_sh_t *cache)
+{
+	if (cache->version & 1)
+	{
+		(void)ngx_atomic_fetch_add(&cache->version, 1);
+	}
+}
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+/* Note: called without the mutex, the tree may be modified concurrently. since the nodes may
+	be inconsistent, every node is verified to be inside the shard, and the depth is bounded */
+static ngx_buffer_cache_entry_t *
+ngx_buffer_cache_rbtree_lookup_unlocked(ngx_buffer_cache_sh_t *cache, const u_char* key, uint32_t hash)
+{
+	ngx_buffer_cache_entry_t *n;
+	ngx_rbtree_node_t *node, *sentinel;
+	ngx_uint_t depth;
+	ngx_int_t rc;
+
+	node = cache->rbtree.root;
+	sentinel = &cache->sentinel;
+
+	for (depth = 0; depth < MAX_UNLOCKED_LOOKUP_DEPTH && node != sentinel; depth++)
+	{
+		if ((u_char*)node < (u_char*)cache->entries_start ||
+			(u_char*)node + sizeof(*n) > cache->buffers_end)
+		{
+			return NULL;
+		}
+
+		n = (ngx_buffer_cache_entry_t *)node;
+
+		if (hash != node->key)
+		{
+			node = (hash < node->key) ? node->left : node->right;
+			continue;
+		}
+
+		rc = ngx_memcmp(key, n->key, BUFFER_CACHE_KEY_SIZE);
+		if (rc < 0)
+		{
+			node = node->left;
+			continue;
+		}
+
+		if (rc > 0)
+		{
+			node = node->right;
+			continue;
+		}
+
+		return n;
+	}
+
+	return NULL;
+}
+
+#endif // NGX_HAVE_ATOMIC_OPS
+
+// returns the histogram bucket of a value, bucket i holds the values up to 2^(min_bits + i)
+static ngx_uint_t
+ngx_buffer_cache_get_histogram_bucket(uint64_t value, ngx_uint_t min_bits)
+{
+	ngx_uint_t index;
+
+	if (value <= ((uint64_t)1 << min_bits))
+	{
+		return 0;
+	}
+
+	for (value = (value - 1) >> min_bits, index = 0; value != 0; value >>= 1)
+	{
+		index++;
+	}
+
+	return index < BUFFER_CACHE_HISTOGRAM_BUCKETS ? index : BUFFER_CACHE_HISTOGRAM_BUCKETS - 1;
+}
+
+ngx_uint_t
+ngx_buffer_cache_get_histogram_bound(ngx_uint_t index, ngx_uint_t min_bits)
+{
+	return (ngx_uint_t)1 << (min_bits + index);
+}
+
+// Note: the age is measured from the write time, using the cached time of the worker
+static ngx_inline ngx_uint_t
+ngx_buffer_cache_get_age(time_t write_time)
+{
+	time_t now = ngx_time();
+
+	return now > write_time ? (ngx_uint_t)(now - write_time) : 0;
+}
+
+// Note: the hit stats are updated atomically since they are also updated without the mutex
+static ngx_inline void
+ngx_buffer_cache_add_hit_age(ngx_buffer_cache_sh_t *cache, time_t write_time)
+{
+	ngx_uint_t age;
+
+	age = ngx_buffer_cache_get_age(write_time);
+
+	(void)ngx_atomic_fetch_add(&cache->stats.hit_age_buckets[
+		ngx_buffer_cache_get_histogram_bucket(age, BUFFER_CACHE_AGE_HISTOGRAM_MIN_BITS)], 1);
+	(void)ngx_atomic_fetch_add(&cache->stats.hit_age_sum, age);
+}
+
 static void
 ngx_buffer_cache_reset(ngx_buffer_cache_sh_t *cache)
 {
@@ -118,6 +287,7 @@ ngx_buffer_cache_reset(ngx_buffer_cache_sh_t *cache)
 	cache->buffers_read = cache->buffers_end;
 	cache->buffers_write = cache->buffers_end;
 	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_buffer_cache_rbtree_insert_value);
+	ngx_rbtree_init(&cache->tag_rbtree, &cache->tag_sentinel, ngx_rbtree_insert_value);
 	ngx_queue_init(&cache->used_queue);
 	ngx_queue_init(&cache->free_queue);
 
@@ -126,20 +296,268 @@ ngx_buffer_cache_reset(ngx_buffer_cache_sh_t *cache)
 	cache->stats.evicted_bytes = cache->stats.store_bytes;
 }
 
+static u_char*
+ngx_buffer_cache_sketch_init(ngx_buffer_cache_sketch_t* sketch, u_char* p, size_t shard_size)
+{
+	ngx_uint_t width;
+
+	for (width = SKETCH_MIN_WIDTH; 
+		width < SKETCH_MAX_WIDTH && width * 2 * SKETCH_BYTES_PER_COUNTER <= shard_size; 
+		width *= 2);
+
+	sketch->counters = p;
+	sketch->width_mask = width - 1;
+	sketch->additions = 0;
+	sketch->aging = 0;
+	sketch->sample_size = width * SKETCH_SAMPLE_FACTOR;
+
+	ngx_memzero(p, SKETCH_DEPTH * width);
+
+	return ngx_align_ptr(p + SKETCH_DEPTH * width, sizeof(void *));
+}
+
+static ngx_inline void
+ngx_buffer_cache_sketch_indexes(ngx_buffer_cache_sketch_t* sketch, const u_char* key, uint32_t* indexes)
+{
+	uint32_t i;
+
+	// Note: the keys are md5 digests, so every 32 bit word of the key can be used as an independent hash
+	ngx_memcpy(indexes, key, SKETCH_DEPTH * sizeof(indexes[0]));
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		indexes[i] = i * (sketch->width_mask + 1) + (indexes[i] & sketch->width_mask);
+	}
+}
+
+static void
+ngx_buffer_cache_sketch_age(ngx_buffer_cache_sketch_t* sketch)
+{
+	u_char* cur;
+	u_char* end;
+
+	if (!ngx_atomic_cmp_set(&sketch->aging, 0, 1))
+	{
+		return;		// another process is already aging the counters
+	}
+
+	end = sketch->counters + SKETCH_DEPTH * (sketch->width_mask + 1);
+	for (cur = sketch->counters; cur < end; cur++)
+	{
+		*cur >>= 1;
+	}
+
+	sketch->additions = 0;
+	sketch->aging = 0;
+}
+
+/* Note: called without the mutex, concurrent increments of the same counter may be lost,
+	this only makes the frequency estimation slightly less accurate */
+static void
+ngx_buffer_cache_sketch_increment(ngx_buffer_cache_sketch_t* sketch, const u_char* key)
+{
+	uint32_t indexes[SKETCH_DEPTH];
+	uint32_t i;
+	u_char* counter;
+
+	ngx_buffer_cache_sketch_indexes(sketch, key, indexes);
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		counter = sketch->counters + indexes[i];
+		if (*counter < SKETCH_MAX_COUNT)
+		{
+			(*counter)++;
+		}
+	}
+
+	if (ngx_atomic_fetch_add(&sketch->additions, 1) + 1 >= sketch->sample_size)
+	{
+		ngx_buffer_cache_sketch_age(sketch);
+	}
+}
+
+static ngx_uint_t
+ngx_buffer_cache_sketch_estimate(ngx_buffer_cache_sketch_t* sketch, const u_char* key)
+{
+	uint32_t indexes[SKETCH_DEPTH];
+	uint32_t i;
+	ngx_uint_t result;
+
+	ngx_buffer_cache_sketch_indexes(sketch, key, indexes);
+
+	result = SKETCH_MAX_COUNT;
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		result = ngx_min(result, sketch->counters[indexes[i]]);
+	}
+
+	return result;
+}
+
+static void
+ngx_buffer_cache_bind_numa_node(ngx_shm_zone_t *shm_zone, u_char* start, size_t size, ngx_uint_t node)
+{
+#if (NGX_LINUX)
+	unsigned long node_mask[BUFFER_CACHE_MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1];
+
+	ngx_memzero(node_mask, sizeof(node_mask));
+	node_mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+	// Note: a preferred policy falls back to other nodes when the node runs out of memory
+	if (syscall(SYS_mbind, start, size, NUMA_MPOL_PREFERRED, node_mask, sizeof(node_mask) * 8, 0) != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, ngx_errno,
+			"buffer cache \"%V\" failed to bind the shards of numa node %ui",
+			&shm_zone->shm.name, node);
+	}
+#endif // NGX_LINUX
+}
+
+static void
+ngx_buffer_cache_advise_huge_pages(ngx_shm_zone_t *shm_zone)
+{
+#if (NGX_LINUX) && defined(MADV_HUGEPAGE)
+	u_char* start;
+	u_char* end;
+
+	// Note: only the huge page aligned part of the zone can be backed by huge pages
+	start = ngx_align_ptr(shm_zone->shm.addr, HUGE_PAGE_SIZE);
+	end = (u_char*)((uintptr_t)(shm_zone->shm.addr + shm_zone->shm.size) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+	if (end <= start)
+	{
+		return;
+	}
+
+	if (madvise(start, end - start, MADV_HUGEPAGE) != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, ngx_errno,
+			"buffer cache \"%V\" failed to enable huge pages",
+			&shm_zone->shm.name);
+	}
+#endif // NGX_LINUX && MADV_HUGEPAGE
+}
+
+static ngx_int_t
+ngx_buffer_cache_init_shard(ngx_buffer_cache_t *cache, ngx_buffer_cache_sh_t *cur_sh, u_char* p, size_t shard_size)
+{
+	ngx_memzero(cur_sh, sizeof(*cur_sh));
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	if (ngx_shmtx_create(&cur_sh->mutex, &cur_sh->lock, NULL) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+#else
+	// Note: without atomic ops the mutex is a file lock, all shards share the lock of the slab pool
+	cur_sh->mutex = cache->shpool->mutex;
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	// initialize fixed cache fields
+	cur_sh->buffers_end = p + shard_size;
+
+	if (cache->policy == BUFFER_CACHE_POLICY_TINYLFU)
+	{
+		p = ngx_buffer_cache_sketch_init(&cur_sh->sketch, p, shard_size);
+	}
+
+	cur_sh->entries_start = (ngx_buffer_cache_entry_t*)p;
+	cur_sh->access_time = 0;
+
+	// reset the cache status
+	ngx_buffer_cache_reset(cur_sh);
+	cur_sh->reset = 0;
+
+	return NGX_OK;
+}
+
+// the shards of the partitions follow the shards of the cache, in the order the partitions were added
+static void
+ngx_buffer_cache_init_partitions(ngx_buffer_cache_t *cache)
+{
+	ngx_buffer_cache_t **partitions = cache->partitions.elts;
+	ngx_uint_t i;
+
+	for (i = 0; i < cache->partitions.nelts; i++)
+	{
+		partitions[i]->sh = cache->sh + (i + 1) * cache->shard_count;
+		partitions[i]->shpool = cache->shpool;
+	}
+}
+
 static ngx_int_t
 ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
 	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_t **opartitions;
+	ngx_buffer_cache_t **partitions;
 	ngx_buffer_cache_t *ocache = data;
 	ngx_buffer_cache_t *cache;
+	ngx_uint_t node_shard_count;
+	ngx_uint_t i;
+	ngx_uint_t j;
+	size_t partitions_size;
+	size_t node_alignment;
+	size_t shard_size;
+	size_t node_size;
+	u_char* node_start;
 	u_char* p;
 
 	cache = shm_zone->data;
+	partitions = cache->partitions.elts;
 
 	if (ocache)
 	{
+		if (ocache->shard_count != cache->shard_count)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" uses %ui shards while previously it used %ui shards",
+				&shm_zone->shm.name, cache->shard_count, ocache->shard_count);
+			return NGX_ERROR;
+		}
+
+		if (ocache->numa_node_count != cache->numa_node_count)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" uses %ui numa nodes while previously it used %ui numa nodes",
+				&shm_zone->shm.name, cache->numa_node_count, ocache->numa_node_count);
+			return NGX_ERROR;
+		}
+
+		if (ocache->policy != cache->policy)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" uses a different policy than previously",
+				&shm_zone->shm.name);
+			return NGX_ERROR;
+		}
+
+		if (ocache->partitions.nelts != cache->partitions.nelts)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" uses %ui partitions while previously it used %ui partitions",
+				&shm_zone->shm.name, cache->partitions.nelts, ocache->partitions.nelts);
+			return NGX_ERROR;
+		}
+
+		opartitions = ocache->partitions.elts;
+		for (i = 0; i < cache->partitions.nelts; i++)
+		{
+			if (partitions[i]->partition_size != opartitions[i]->partition_size ||
+				partitions[i]->partition_name.len != opartitions[i]->partition_name.len ||
+				ngx_strncmp(partitions[i]->partition_name.data, opartitions[i]->partition_name.data, 
+					partitions[i]->partition_name.len) != 0)
+			{
+				ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+					"partition \"%V\" of buffer cache \"%V\" was changed",
+					&partitions[i]->partition_name, &shm_zone->shm.name);
+				return NGX_ERROR;
+			}
+		}
+
 		cache->sh = ocache->sh;
 		cache->shpool = ocache->shpool;
+		ngx_buffer_cache_init_partitions(cache);
 		return NGX_OK;
 	}
 
@@ -148,9 +566,20 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 	if (shm_zone->shm.exists) 
 	{
 		cache->sh = cache->shpool->data;
+		ngx_buffer_cache_init_partitions(cache);
 		return NGX_OK;
 	}
 
+	node_alignment = ngx_pagesize;
+	if (cache->huge_pages)
+	{
+		// Note: the advice must precede the first access to the pages of the shards
+		ngx_buffer_cache_advise_huge_pages(shm_zone);
+#if (NGX_LINUX)
+		node_alignment = HUGE_PAGE_SIZE;
+#endif // NGX_LINUX
+	}
+
 	// start following the ngx_slab_pool_t that was allocated at the beginning of the chunk
 	p = shm_zone->shm.addr + sizeof(ngx_slab_pool_t);
 
@@ -161,78 +590,207 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 	// allocate the shared cache state
 	p = ngx_align_ptr(p, sizeof(void *));
 	sh = (ngx_buffer_cache_sh_t*)p;
-	p += sizeof(*sh);
+	p += sizeof(*sh) * cache->shard_count * (cache->partitions.nelts + 1);
 	cache->sh = sh;
 
 	cache->shpool->data = sh;
 
-	// initialize fixed cache fields
-	p = ngx_align_ptr(p, sizeof(void *));
-	sh->entries_start = (ngx_buffer_cache_entry_t*)p;
-	sh->buffers_end = shm_zone->shm.addr + shm_zone->shm.size;
-	sh->access_time = 0;
-
-	// reset the stats
-	ngx_memzero(&sh->stats, sizeof(sh->stats));
-
-	// reset the cache status
-	ngx_buffer_cache_reset(sh);
-	sh->reset = 0;
-
-	return NGX_OK;
-}
+	// divide the remaining space between the numa nodes and the shards of each node
+	node_shard_count = cache->shard_count / cache->numa_node_count;
+	if (cache->numa_node_count > 1)
+	{
+		p = ngx_align_ptr(p, node_alignment);
+		node_size = p < shm_zone->shm.addr + shm_zone->shm.size ?
+			((size_t)(shm_zone->shm.addr + shm_zone->shm.size - p) / cache->numa_node_count) & ~(node_alignment - 1) : 0;
+	}
+	else
+	{
+		// Note: partitions are not supported with numa, their sizes are taken from the end of the zone
+		partitions_size = 0;
+		for (i = 0; i < cache->partitions.nelts; i++)
+		{
+			partitions_size += partitions[i]->partition_size;
+		}
 
-/* Note: must be called with the mutex locked */
-static ngx_buffer_cache_entry_t*
-ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration)
-{
-	ngx_buffer_cache_entry_t* entry;
+		p = ngx_align_ptr(p, BUFFER_ALIGNMENT);
+		node_size = (size_t)(shm_zone->shm.addr + shm_zone->shm.size - p);
+		node_size = node_size > partitions_size ? (node_size - partitions_size) & ~(BUFFER_ALIGNMENT - 1) : 0;
+	}
 
-	// verify we have an entry to free
-	if (ngx_queue_empty(&cache->used_queue))
+	shard_size = (node_size / node_shard_count) & ~(BUFFER_ALIGNMENT - 1);
+	if (shard_size < MIN_SHARD_SIZE)
 	{
-		return NULL;
+		ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+			"buffer cache \"%V\" is too small for %ui shards",
+			&shm_zone->shm.name, cache->shard_count);
+		return NGX_ERROR;
 	}
 
-	// verify the entry is not locked
-	entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
-	if (entry->ref_count > 0 &&
-		ngx_time() < entry->access_time + ENTRY_LOCK_EXPIRATION)
+	node_start = p;
+
+	for (i = 0; i < cache->shard_count; i++)
 	{
-		return NULL;
+		if (cache->numa_node_count > 1 && i % node_shard_count == 0)
+		{
+			// Note: the binding must precede the first access to the pages of the node
+			p = node_start + (i / node_shard_count) * node_size;
+			ngx_buffer_cache_bind_numa_node(shm_zone, p, node_size, i / node_shard_count);
+		}
+
+		if (ngx_buffer_cache_init_shard(cache, &sh[i], p, shard_size) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+
+		p += shard_size;
 	}
 
-	// make sure the entry is expired, if that is the requirement
-	if (expiration && ngx_time() < (time_t)(entry->write_time + expiration))
+	// initialize the shards of the partitions
+	p = node_start + node_size;
+
+	for (i = 0; i < cache->partitions.nelts; i++)
 	{
-		return NULL;
-	}
-	
-	// update the state
-	entry->state = CES_FREE;
+		shard_size = (partitions[i]->partition_size / cache->shard_count) & ~(BUFFER_ALIGNMENT - 1);
+		if (shard_size < MIN_SHARD_SIZE)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"partition \"%V\" of buffer cache \"%V\" is too small for %ui shards",
+				&partitions[i]->partition_name, &shm_zone->shm.name, cache->shard_count);
+			return NGX_ERROR;
+		}
 
-	// remove from rb tree
-	ngx_rbtree_delete(&cache->rbtree, &entry->node);
+		for (j = 0; j < cache->shard_count; j++)
+		{
+			if (ngx_buffer_cache_init_shard(cache, &sh[(i + 1) * cache->shard_count + j], p, shard_size) != NGX_OK)
+			{
+				return NGX_ERROR;
+			}
 
-	// move from used_queue to free_queue
-	ngx_queue_remove(&entry->queue_node);
-	ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
+			p += shard_size;
+		}
+	}
 
-	if (ngx_queue_empty(&cache->used_queue))
+	ngx_buffer_cache_init_partitions(cache);
+
+	// the zone was resized on reload, the previous zone is freed after all zones are initialized
+	ocache = ngx_buffer_cache_get_previous(shm_zone);
+	if (ocache != NULL)
 	{
-		// queue is empty reset the read/write pointers
-		cache->buffers_read = cache->buffers_end;
-		cache->buffers_write = cache->buffers_end;
+		ngx_buffer_cache_migrate(cache, ocache, shm_zone->shm.log);
 	}
-	else
+	else if (cache->persist_path.len > 0)
 	{
-		// update the read buffer pointer
-		cache->buffers_read = entry->start_offset;
+		ngx_buffer_cache_load(cache, shm_zone->shm.log);
 	}
 
-	// update stats
-	cache->stats.evicted++;
+	return NGX_OK;
+}
+
+static ngx_inline ngx_buffer_cache_sh_t*
+ngx_buffer_cache_get_shard(ngx_buffer_cache_t* cache, uint32_t hash)
+{
+	ngx_uint_t node_shard_count;
+
+	if (cache->shard_count == 1)
+	{
+		return cache->sh;
+	}
+
+	if (cache->numa_node_count > 1)
+	{
+		node_shard_count = cache->shard_count / cache->numa_node_count;
+		return &cache->sh[(ngx_buffer_cache_numa_node % cache->numa_node_count) * node_shard_count + 
+			hash % node_shard_count];
+	}
+
+	return &cache->sh[hash % cache->shard_count];
+}
+
+/* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_insert_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry, uint32_t tag)
+{
+	ngx_rbtree_insert(&cache->rbtree, &entry->node);
+
+	entry->tag_node.key = tag;
+	if (tag != 0)
+	{
+		ngx_rbtree_insert(&cache->tag_rbtree, &entry->tag_node);
+	}
+}
+
+/* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_delete_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	ngx_rbtree_delete(&cache->rbtree, &entry->node);
+
+	if (entry->tag_node.key != 0)
+	{
+		ngx_rbtree_delete(&cache->tag_rbtree, &entry->tag_node);
+	}
+}
+
+/* Note: must be called with the mutex locked */
+static ngx_buffer_cache_entry_t*
+ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration, ngx_atomic_t* reason)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_uint_t age;
+
+	// verify we have an entry to free
+	if (ngx_queue_empty(&cache->used_queue))
+	{
+		return NULL;
+	}
+
+	// verify the entry is not locked
+	entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
+	if (entry->ref_count > 0 &&
+		ngx_time() < entry->access_time + ENTRY_LOCK_EXPIRATION)
+	{
+		return NULL;
+	}
+
+	// make sure the entry is expired, if that is the requirement
+	if (expiration && ngx_time() < (time_t)(entry->write_time + expiration))
+	{
+		return NULL;
+	}
+	
+	// remove from rb tree (detached entries were already removed)
+	if (entry->state != CES_DETACHED)
+	{
+		ngx_buffer_cache_delete_entry(cache, entry);
+	}
+
+	// update the state
+	entry->state = CES_FREE;
+
+	// move from used_queue to free_queue
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
+
+	if (ngx_queue_empty(&cache->used_queue))
+	{
+		// queue is empty reset the read/write pointers
+		cache->buffers_read = cache->buffers_end;
+		cache->buffers_write = cache->buffers_end;
+	}
+	else
+	{
+		// update the read buffer pointer
+		cache->buffers_read = entry->start_offset;
+	}
+
+	// update stats
+	age = ngx_buffer_cache_get_age(entry->write_time);
+
+	cache->stats.evicted++;
 	cache->stats.evicted_bytes += entry->buffer_size;
+	cache->stats.evicted_age_buckets[ngx_buffer_cache_get_histogram_bucket(age, BUFFER_CACHE_AGE_HISTOGRAM_MIN_BITS)]++;
+	cache->stats.evicted_age_sum += age;
+	(*reason)++;
 
 	return entry;
 }
@@ -261,7 +819,7 @@ ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache)
 		return entry;
 	}
 	
-	return ngx_buffer_cache_free_oldest_entry(cache, 0);
+	return ngx_buffer_cache_free_oldest_entry(cache, 0, &cache->stats.evicted_no_entries);
 }
 
 /* Note: must be called with the mutex locked */
@@ -313,7 +871,7 @@ ngx_buffer_cache_get_free_buffer(
 		}
 
 		// not enough room, free an entry
-		if (ngx_buffer_cache_free_oldest_entry(cache, 0) == NULL)
+		if (ngx_buffer_cache_free_oldest_entry(cache, 0, &cache->stats.evicted_no_space) == NULL)
 		{
 			break;
 		}
@@ -322,262 +880,1942 @@ ngx_buffer_cache_get_free_buffer(
 	return NULL;
 }
 
-ngx_flag_t
-ngx_buffer_cache_fetch(
-	ngx_buffer_cache_t* cache,
-	u_char* key,
-	ngx_str_t* buffer,
-	uint32_t* token)
+/* Note: must be called with the mutex locked. this function follows the logic of
+	ngx_buffer_cache_get_free_entry / ngx_buffer_cache_get_free_buffer, without evicting */
+static ngx_flag_t
+ngx_buffer_cache_has_room(
+	ngx_buffer_cache_sh_t *cache,
+	size_t size)
 {
-	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	ngx_flag_t result = 0;
-	uint32_t hash;
+	u_char* buffer_start;
 
-	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	if (ngx_queue_empty(&cache->used_queue))
+	{
+		return 1;
+	}
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	// check whether a new entry can be allocated
+	if (ngx_queue_empty(&cache->free_queue) && 
+		(u_char*)(cache->entries_end + 1) >= cache->buffers_start)
+	{
+		return 0;
+	}
 
-	if (!sh->reset)
+	buffer_start = (u_char*)((intptr_t)(cache->buffers_write - size) & (~(BUFFER_ALIGNMENT - 1)));
+
+	// Layout:	S	W/////R		E
+	if (cache->buffers_write < cache->buffers_read)
 	{
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL && entry->state == CES_READY && 
-			(cache->expiration == 0 || ngx_time() < (time_t)(entry->write_time + cache->expiration)))
+		if (buffer_start >= cache->buffers_start ||
+			buffer_start > (u_char*)(cache->entries_end + ENTRIES_ALLOC_MARGIN))
 		{
-			result = 1;
+			return 1;
+		}
 
-			// update stats
-			sh->stats.fetch_hit++;
-			sh->stats.fetch_bytes += entry->buffer_size;
+		// the write position will move to the end
+		buffer_start = (u_char*)((intptr_t)(cache->buffers_end - size) & (~(BUFFER_ALIGNMENT - 1)));
+	}
 
-			// copy buffer pointer and size
-			buffer->data = entry->start_offset;
-			buffer->len = entry->buffer_size;
-			*token = entry->write_time;
+	// Layout:	S////R		W///E
+	return buffer_start > cache->buffers_read;
+}
 
-			// Note: setting the access time of the entry and cache to prevent it 
-			//		from being freed while the caller uses the buffer
-			sh->access_time = entry->access_time = ngx_time();
-			(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
-		}
-		else
-		{
-			// update stats
-			sh->stats.fetch_miss++;
-		}
+/* Note: must be called with the mutex locked */
+static ngx_flag_t
+ngx_buffer_cache_admit(
+	ngx_buffer_cache_sh_t *cache,
+	u_char* key,
+	size_t size)
+{
+	ngx_buffer_cache_entry_t* victim;
+
+	if (ngx_buffer_cache_has_room(cache, size))
+	{
+		return 1;
 	}
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	victim = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
 
-	return result;
+	return ngx_buffer_cache_sketch_estimate(&cache->sketch, key) > 
+		ngx_buffer_cache_sketch_estimate(&cache->sketch, victim->key);
 }
 
-void
-ngx_buffer_cache_release(
+/* returns BUFFER_CACHE_FETCH_FRESH / BUFFER_CACHE_FETCH_STALE, or NGX_DECLINED if the entry
+	cannot be returned. stale entries are returned only when state is not null */
+static ngx_int_t
+ngx_buffer_cache_get_entry_state(
 	ngx_buffer_cache_t* cache,
-	u_char* key,
-	uint32_t token)
+	ngx_buffer_cache_entry_t* entry,
+	ngx_uint_t* state)
 {
-	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	uint32_t hash;
+	time_t expires;
 
-	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	if (entry->state != CES_READY)
+	{
+		return NGX_DECLINED;
+	}
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	if (cache->expiration == 0)
+	{
+		return BUFFER_CACHE_FETCH_FRESH;
+	}
 
-	if (!sh->reset)
+	expires = entry->write_time + cache->expiration;
+	if (ngx_time() < expires)
 	{
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL && entry->state == CES_READY && (uint32_t)entry->write_time == token)
-		{
-			(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
-		}
+		return BUFFER_CACHE_FETCH_FRESH;
+	}
+
+	if (state == NULL || ngx_time() >= expires + (time_t)cache->stale)
+	{
+		return NGX_DECLINED;
 	}
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	return BUFFER_CACHE_FETCH_STALE;
 }
 
-ngx_flag_t
-ngx_buffer_cache_store_gather(
-	ngx_buffer_cache_t* cache, 
-	u_char* key, 
-	ngx_str_t* buffers,
-	size_t buffer_count)
+/* elects a single caller for refreshing a stale entry, the caller must hold a reference to the entry */
+static ngx_uint_t
+ngx_buffer_cache_get_stale_state(ngx_buffer_cache_entry_t* entry)
 {
-	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	ngx_str_t* cur_buffer;
-	ngx_str_t* last_buffer;
-	size_t buffer_size;
-	uint32_t hash;
-	uint32_t evictions;
-	u_char* target_buffer;
+	ngx_atomic_uint_t refresh_time;
 
-	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	refresh_time = entry->refresh_time;
+	if (ngx_time() >= (time_t)(refresh_time + ENTRY_REFRESH_LOCK_EXPIRATION) &&
+		ngx_atomic_cmp_set(&entry->refresh_time, refresh_time, ngx_time()))
+	{
+		return BUFFER_CACHE_FETCH_STALE_REFRESH;
+	}
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	return BUFFER_CACHE_FETCH_STALE;
+}
 
-	if (sh->reset)
-	{
-		// a previous store operation was killed in progress, need to reset the cache
-		// since the data structures may be corrupt. we can only reset the cache after
-		// the access time expires since other processes may still be reading from / 
-		// writing to the cache
-		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION)
-		{
-			ngx_shmtx_unlock(&cache->shpool->mutex);
-			return 0;
-		}
+#if (NGX_HAVE_ATOMIC_OPS)
 
-		// reset the cache, leave the reset flag enabled
-		ngx_buffer_cache_reset(sh);
+/* returns NGX_OK on hit, NGX_DECLINED on miss and NGX_AGAIN if the lookup overlapped a change 
+	to the shard and has to be performed with the mutex locked */
+static ngx_int_t
+ngx_buffer_cache_fetch_unlocked(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t *sh,
+	u_char* key,
+	uint32_t hash,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_atomic_uint_t version;
+	ngx_int_t entry_state;
 
-		// update stats
-		sh->stats.reset++;
+	version = sh->version;
+	if ((version & 1) || sh->reset)
+	{
+		return NGX_AGAIN;
 	}
-	else
+
+	ngx_memory_barrier();
+
+	entry = ngx_buffer_cache_rbtree_lookup_unlocked(sh, key, hash);
+	if (entry == NULL)
 	{
-		// remove expired entries
-		if (cache->expiration)
-		{
-			for (evictions = MAX_EVICTIONS_PER_STORE; evictions > 0; evictions--)
-			{
-				if (!ngx_buffer_cache_free_oldest_entry(sh, cache->expiration))
-				{
-					break;
-				}
-			}
-		}
+		ngx_memory_barrier();
 
-		// make sure the entry does not already exist
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL)
+		if (sh->version != version)
 		{
-			sh->stats.store_exists++;
-			ngx_shmtx_unlock(&cache->shpool->mutex);
-			return 0;
+			return NGX_AGAIN;
 		}
 
-		// enable the reset flag before we start making any changes
-		sh->reset = 1;
+		(void)ngx_atomic_fetch_add(&sh->stats.fetch_miss, 1);
+		return NGX_DECLINED;
 	}
 
-	// allocate a new entry
-	entry = ngx_buffer_cache_get_free_entry(sh);
-	if (entry == NULL)
+	// Note: the entry is referenced before it is validated, in order to prevent it from 
+	//		being freed once the version is verified. ngx_atomic_fetch_add is a full barrier
+	entry->access_time = ngx_time();
+	(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
+
+	if (sh->version != version)
 	{
-		goto error;
+		(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+		return NGX_AGAIN;
 	}
 
-	// calculate the buffer size
-	last_buffer = buffers + buffer_count;
-	buffer_size = 0;
-	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	entry_state = ngx_buffer_cache_get_entry_state(cache, entry, state);
+	if (entry_state == NGX_DECLINED)
 	{
-		buffer_size += cur_buffer->len;
+		(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+		(void)ngx_atomic_fetch_add(&sh->stats.fetch_miss, 1);
+		return NGX_DECLINED;
 	}
 
-	// allocate a buffer to hold the data
-	target_buffer = ngx_buffer_cache_get_free_buffer(sh, buffer_size + 1);
-	if (target_buffer == NULL)
+	if (entry_state == BUFFER_CACHE_FETCH_STALE)
 	{
-		goto error;
+		*state = ngx_buffer_cache_get_stale_state(entry);
+		(void)ngx_atomic_fetch_add(&sh->stats.fetch_stale, 1);
+	}
+	else if (state != NULL)
+	{
+		*state = BUFFER_CACHE_FETCH_FRESH;
 	}
 
-	// initialize the entry
-	entry->state = CES_ALLOCATED;
-	entry->ref_count = 1;
-	entry->node.key = hash;
-	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
-	entry->start_offset = target_buffer;
-	entry->buffer_size = buffer_size;
+	// update stats
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_hit, 1);
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_bytes, entry->buffer_size);
+	ngx_buffer_cache_add_hit_age(sh, entry->write_time);
 
-	// update the write position
-	sh->buffers_write = target_buffer;
+	// copy buffer pointer and size
+	buffer->data = entry->start_offset;
+	buffer->len = entry->buffer_size;
+	*token = entry->write_time;
 
-	// move from free_queue to used_queue
-	ngx_queue_remove(&entry->queue_node);
-	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
+	sh->access_time = ngx_time();
 
-	// insert to rbtree
-	ngx_rbtree_insert(&sh->rbtree, &entry->node);
+	return NGX_OK;
+}
 
-	// update stats
-	sh->stats.store_ok++;
-	sh->stats.store_bytes += buffer_size;
+/* returns the version of the shard, if the shared entry of the key exists and has the given write time,
+	otherwise, returns an odd value */
+static ngx_atomic_uint_t
+ngx_buffer_cache_local_validate(ngx_buffer_cache_sh_t *sh, u_char* key, uint32_t hash, time_t write_time)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_atomic_uint_t version;
 
-	// Note: the memcpy is performed after releasing the lock to avoid holding the lock for a long time
-	//		setting the access time of the entry and cache prevents it from being freed
-	sh->access_time = entry->access_time = ngx_time();
-	entry->write_time = ngx_time();
+	version = sh->version;
+	if ((version & 1) || sh->reset)
+	{
+		return 1;
+	}
 
-	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	ngx_memory_barrier();
 
-	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	entry = ngx_buffer_cache_rbtree_lookup_unlocked(sh, key, hash);
+	if (entry == NULL || 
+		entry->state != CES_READY || 
+		entry->write_time != write_time)
 	{
-		target_buffer = ngx_copy(target_buffer, cur_buffer->data, cur_buffer->len);
+		return 1;
 	}
-	*target_buffer = '\0';
 
-	// Note: no need to obtain the lock since state is ngx_atomic_t
-	entry->state = CES_READY;
-	(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+	ngx_memory_barrier();
 
-	return 1;
+	if (sh->version != version)
+	{
+		return 1;
+	}
+
+	return version;
+}
+
+static void
+ngx_buffer_cache_local_retire(ngx_buffer_cache_local_t* local, ngx_buffer_cache_local_entry_t** slot)
+{
+	ngx_buffer_cache_local_entry_t* entry = *slot;
+
+	*slot = NULL;
+
+	if (entry->ref_count <= 0)
+	{
+		ngx_free(entry);
+		return;
+	}
+
+	entry->retired = 1;
+	ngx_queue_insert_tail(&local->retired, &entry->retired_node);
+}
+
+/* Note: returns only fresh entries, the expired / stale entries are handled by the shared memory */
+static ngx_flag_t
+ngx_buffer_cache_local_fetch(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t *sh,
+	u_char* key,
+	uint32_t hash,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	ngx_buffer_cache_local_entry_t** slot;
+	ngx_buffer_cache_local_entry_t* entry;
+	ngx_buffer_cache_local_t* local = cache->local;
+	ngx_atomic_uint_t version;
+
+	slot = &local->entries[hash & local->mask];
+	entry = *slot;
+	if (entry == NULL || ngx_memcmp(entry->key, key, BUFFER_CACHE_KEY_SIZE) != 0)
+	{
+		return 0;
+	}
+
+	if (cache->expiration != 0 && ngx_time() >= entry->write_time + (time_t)cache->expiration)
+	{
+		ngx_buffer_cache_local_retire(local, slot);
+		return 0;
+	}
+
+	if (sh->version != entry->version)
+	{
+		// the shard was modified, make sure the entry was not replaced
+		version = ngx_buffer_cache_local_validate(sh, key, hash, entry->write_time);
+		if (version & 1)
+		{
+			ngx_buffer_cache_local_retire(local, slot);
+			return 0;
+		}
+
+		entry->version = version;
+	}
+
+	entry->ref_count++;
+
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_hit, 1);
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_local_hit, 1);
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_bytes, entry->buffer_size);
+	ngx_buffer_cache_add_hit_age(sh, entry->write_time);
+
+	buffer->data = entry->buffer;
+	buffer->len = entry->buffer_size;
+	*token = entry->token;
+
+	if (state != NULL)
+	{
+		*state = BUFFER_CACHE_FETCH_FRESH;
+	}
+
+	return 1;
+}
+
+/* copies a fetched shared entry to the local table, the caller holds a reference to the shared entry */
+static void
+ngx_buffer_cache_local_add(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t *sh,
+	u_char* key,
+	uint32_t hash,
+	ngx_str_t* buffer,
+	uint32_t token)
+{
+	ngx_buffer_cache_local_entry_t** slot;
+	ngx_buffer_cache_local_entry_t* entry;
+	ngx_buffer_cache_local_t* local = cache->local;
+	ngx_atomic_uint_t version;
+
+	if (buffer->len > local->max_entry_size)
+	{
+		return;
+	}
+
+	version = ngx_buffer_cache_local_validate(sh, key, hash, token);
+	if (version & 1)
+	{
+		return;
+	}
+
+	entry = ngx_alloc(sizeof(*entry) + buffer->len, ngx_cycle->log);
+	if (entry == NULL)
+	{
+		return;
+	}
+
+	entry->sh = sh;
+	entry->version = version;
+	entry->write_time = token;
+	entry->token = local->next_token++ | LOCAL_TOKEN_FLAG;
+	entry->ref_count = 0;
+	entry->retired = 0;
+	entry->buffer_size = buffer->len;
+	entry->buffer = (u_char*)(entry + 1);
+	ngx_memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
+	ngx_memcpy(entry->buffer, buffer->data, buffer->len);
+
+	slot = &local->entries[hash & local->mask];
+	if (*slot != NULL)
+	{
+		ngx_buffer_cache_local_retire(local, slot);
+	}
+
+	*slot = entry;
+}
+
+static void
+ngx_buffer_cache_local_release(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t hash,
+	uint32_t token)
+{
+	ngx_buffer_cache_local_entry_t* entry;
+	ngx_buffer_cache_local_t* local = cache->local;
+	ngx_queue_t* q;
+
+	entry = local->entries[hash & local->mask];
+	if (entry != NULL && entry->token == token)
+	{
+		entry->ref_count--;
+		return;
+	}
+
+	for (q = ngx_queue_head(&local->retired);
+		q != ngx_queue_sentinel(&local->retired);
+		q = ngx_queue_next(q))
+	{
+		entry = ngx_queue_data(q, ngx_buffer_cache_local_entry_t, retired_node);
+		if (entry->token != token || ngx_memcmp(entry->key, key, BUFFER_CACHE_KEY_SIZE) != 0)
+		{
+			continue;
+		}
+
+		entry->ref_count--;
+		if (entry->ref_count <= 0)
+		{
+			ngx_queue_remove(q);
+			ngx_free(entry);
+		}
+		return;
+	}
+}
+
+#endif // NGX_HAVE_ATOMIC_OPS
+
+static ngx_flag_t
+ngx_buffer_cache_fetch_internal(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_flag_t result = 0;
+	ngx_int_t entry_state;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	sh = ngx_buffer_cache_get_shard(cache, hash);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	// Note: the access frequency of locally copied entries is not tracked, they are already cached
+	if (cache->local != NULL && 
+		ngx_buffer_cache_local_fetch(cache, sh, key, hash, buffer, token, state))
+	{
+		return 1;
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	if (cache->policy == BUFFER_CACHE_POLICY_TINYLFU)
+	{
+		ngx_buffer_cache_sketch_increment(&sh->sketch, key);
+	}
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	switch (ngx_buffer_cache_fetch_unlocked(cache, sh, key, hash, buffer, token, state))
+	{
+	case NGX_OK:
+		if (cache->local != NULL && (state == NULL || *state == BUFFER_CACHE_FETCH_FRESH))
+		{
+			ngx_buffer_cache_local_add(cache, sh, key, hash, buffer, *token);
+		}
+		return 1;
+
+	case NGX_DECLINED:
+		return 0;
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	if (!sh->reset)
+	{
+		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+		entry_state = entry != NULL ? ngx_buffer_cache_get_entry_state(cache, entry, state) : NGX_DECLINED;
+		if (entry_state != NGX_DECLINED)
+		{
+			result = 1;
+
+			if (entry_state == BUFFER_CACHE_FETCH_STALE)
+			{
+				*state = ngx_buffer_cache_get_stale_state(entry);
+				(void)ngx_atomic_fetch_add(&sh->stats.fetch_stale, 1);
+			}
+			else if (state != NULL)
+			{
+				*state = BUFFER_CACHE_FETCH_FRESH;
+			}
+
+			// update stats
+			// Note: the fetch stats are updated atomically since they are also updated without the mutex
+			(void)ngx_atomic_fetch_add(&sh->stats.fetch_hit, 1);
+			(void)ngx_atomic_fetch_add(&sh->stats.fetch_bytes, entry->buffer_size);
+			ngx_buffer_cache_add_hit_age(sh, entry->write_time);
+
+			// copy buffer pointer and size
+			buffer->data = entry->start_offset;
+			buffer->len = entry->buffer_size;
+			*token = entry->write_time;
+
+			// Note: setting the access time of the entry and cache to prevent it 
+			//		from being freed while the caller uses the buffer
+			sh->access_time = entry->access_time = ngx_time();
+			(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
+		}
+		else
+		{
+			// update stats
+			(void)ngx_atomic_fetch_add(&sh->stats.fetch_miss, 1);
+		}
+	}
+
+	ngx_shmtx_unlock(&sh->mutex);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	if (result && cache->local != NULL && (state == NULL || *state == BUFFER_CACHE_FETCH_FRESH))
+	{
+		ngx_buffer_cache_local_add(cache, sh, key, hash, buffer, *token);
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	return result;
+}
+
+ngx_flag_t
+ngx_buffer_cache_fetch(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffer,
+	uint32_t* token)
+{
+	return ngx_buffer_cache_fetch_internal(cache, key, buffer, token, NULL);
+}
+
+ngx_flag_t
+ngx_buffer_cache_fetch_stale(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	return ngx_buffer_cache_fetch_internal(cache, key, buffer, token, state);
+}
+
+void
+ngx_buffer_cache_release(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t token)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	if (token & LOCAL_TOKEN_FLAG)
+	{
+		if (cache->local != NULL)
+		{
+			ngx_buffer_cache_local_release(cache, key, hash, token);
+		}
+		return;
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	sh = ngx_buffer_cache_get_shard(cache, hash);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+	// Note: the caller holds a reference to the entry, so it cannot be freed (unless the 
+	//		entry lock expired). if the entry is found with a matching token, it's safe to 
+	//		release it without validating the version
+	entry = ngx_buffer_cache_rbtree_lookup_unlocked(sh, key, hash);
+	if (entry != NULL && entry->state == CES_READY && (uint32_t)entry->write_time == token)
+	{
+		(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+		return;
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	if (!sh->reset)
+	{
+		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+		if (entry != NULL && entry->state == CES_READY && (uint32_t)entry->write_time == token)
+		{
+			(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+		}
+	}
+
+	ngx_shmtx_unlock(&sh->mutex);
+}
+
+void
+ngx_buffer_cache_touch(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t token)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	uint32_t hash;
+
+	if (token & LOCAL_TOKEN_FLAG)
+	{
+		// local entries are not freed while they are referenced
+		return;
+	}
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	sh = ngx_buffer_cache_get_shard(cache, hash);
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	if (!sh->reset)
+	{
+		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+		if (entry != NULL && entry->state == CES_READY && (uint32_t)entry->write_time == token)
+		{
+			entry->access_time = ngx_time();
+		}
+	}
+
+	ngx_shmtx_unlock(&sh->mutex);
+}
+
+ngx_flag_t
+ngx_buffer_cache_store_tagged(
+	ngx_buffer_cache_t* cache, 
+	u_char* key, 
+	uint32_t tag,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_buffer_cache_entry_t* stale_entry;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_str_t* cur_buffer;
+	ngx_str_t* last_buffer;
+	size_t buffer_size;
+	uint32_t hash;
+	uint32_t evictions;
+	u_char* target_buffer;
+
+	// calculate the buffer size
+	last_buffer = buffers + buffer_count;
+	buffer_size = 0;
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		buffer_size += cur_buffer->len;
+	}
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	sh = ngx_buffer_cache_get_shard(cache, hash);
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	ngx_buffer_cache_write_begin(sh);
+
+	if (sh->reset)
+	{
+		// a previous store operation was killed in progress, need to reset the cache
+		// since the data structures may be corrupt. we can only reset the cache after
+		// the access time expires since other processes may still be reading from / 
+		// writing to the cache
+		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION)
+		{
+			ngx_buffer_cache_write_end(sh);
+			ngx_shmtx_unlock(&sh->mutex);
+			return 0;
+		}
+
+		// reset the cache, leave the reset flag enabled
+		ngx_buffer_cache_reset(sh);
+
+		// update stats
+		sh->stats.reset++;
+	}
+	else
+	{
+		// remove expired entries (stale entries are kept until the end of the stale period)
+		if (cache->expiration)
+		{
+			for (evictions = MAX_EVICTIONS_PER_STORE; evictions > 0; evictions--)
+			{
+				if (!ngx_buffer_cache_free_oldest_entry(sh, cache->expiration + cache->stale, &sh->stats.evicted_expired))
+				{
+					break;
+				}
+			}
+
+			if (evictions == 0)
+			{
+				sh->stats.expire_limit_reached++;
+			}
+		}
+
+		// make sure the entry does not already exist, expired entries are replaced
+		stale_entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+		if (stale_entry != NULL && 
+			(stale_entry->state != CES_READY ||
+			cache->expiration == 0 || 
+			ngx_time() < (time_t)(stale_entry->write_time + cache->expiration)))
+		{
+			sh->stats.store_exists++;
+			ngx_buffer_cache_write_end(sh);
+			ngx_shmtx_unlock(&sh->mutex);
+			return 0;
+		}
+
+		// make sure the entry is not too large, was requested enough times, and is more popular 
+		//	than the entry it would evict
+		if ((cache->max_entry_size > 0 && buffer_size > cache->max_entry_size) ||
+			(cache->policy == BUFFER_CACHE_POLICY_TINYLFU &&
+			((cache->min_uses > 1 && ngx_buffer_cache_sketch_estimate(&sh->sketch, key) < cache->min_uses) ||
+			!ngx_buffer_cache_admit(sh, key, buffer_size + 1))))
+		{
+			sh->stats.store_rejected++;
+			ngx_buffer_cache_write_end(sh);
+			ngx_shmtx_unlock(&sh->mutex);
+			return 0;
+		}
+
+		// enable the reset flag before we start making any changes
+		sh->reset = 1;
+
+		// Note: the replaced entry is only removed from the tree, its buffer is freed when it reaches
+		//	the head of the used queue. the write time of the new entry is different, so releasing 
+		//	the replaced entry will not affect the new one.
+		if (stale_entry != NULL)
+		{
+			ngx_buffer_cache_delete_entry(sh, stale_entry);
+			stale_entry->state = CES_DETACHED;
+		}
+	}
+
+	// allocate a new entry
+	entry = ngx_buffer_cache_get_free_entry(sh);
+	if (entry == NULL)
+	{
+		goto error;
+	}
+
+	// allocate a buffer to hold the data
+	target_buffer = ngx_buffer_cache_get_free_buffer(sh, buffer_size + 1);
+	if (target_buffer == NULL)
+	{
+		goto error;
+	}
+
+	// initialize the entry
+	entry->state = CES_ALLOCATED;
+	entry->ref_count = 1;
+	entry->refresh_time = 0;
+	entry->node.key = hash;
+	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
+	entry->start_offset = target_buffer;
+	entry->buffer_size = buffer_size;
+
+	// update the write position
+	sh->buffers_write = target_buffer;
+
+	// move from free_queue to used_queue
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
+
+	// insert to rbtree
+	ngx_buffer_cache_insert_entry(sh, entry, tag);
+
+	// update stats
+	sh->stats.store_ok++;
+	sh->stats.store_bytes += buffer_size;
+	sh->stats.store_size_buckets[ngx_buffer_cache_get_histogram_bucket(buffer_size, BUFFER_CACHE_SIZE_HISTOGRAM_MIN_BITS)]++;
+
+	// Note: the memcpy is performed after releasing the lock to avoid holding the lock for a long time
+	//		setting the access time of the entry and cache prevents it from being freed
+	sh->access_time = entry->access_time = ngx_time();
+	entry->write_time = ngx_time();
+
+	sh->reset = 0;
+	ngx_buffer_cache_write_end(sh);
+	ngx_shmtx_unlock(&sh->mutex);
+
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		target_buffer = ngx_copy(target_buffer, cur_buffer->data, cur_buffer->len);
+	}
+	*target_buffer = '\0';
+
+	// Note: no need to obtain the lock since state is ngx_atomic_t
+	entry->state = CES_READY;
+	(void)ngx_atomic_fetch_add(&entry->ref_count, -1);
+
+	return 1;
+
+error:
+	sh->stats.store_err++;
+	sh->reset = 0;
+	ngx_buffer_cache_write_end(sh);
+	ngx_shmtx_unlock(&sh->mutex);
+	return 0;
+}
+
+ngx_flag_t
+ngx_buffer_cache_store_gather(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	return ngx_buffer_cache_store_tagged(cache, key, 0, buffers, buffer_count);
+}
+
+ngx_flag_t
+ngx_buffer_cache_store(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char* source_buffer,
+	size_t buffer_size)
+{
+	ngx_str_t buffer;
+
+	buffer.data = source_buffer;
+	buffer.len = buffer_size;
+
+	return ngx_buffer_cache_store_tagged(cache, key, 0, &buffer, 1);
+}
+
+uint32_t
+ngx_buffer_cache_get_tag(ngx_str_t* name)
+{
+	uint32_t tag;
+
+	tag = ngx_crc32_long(name->data, name->len);
+
+	return tag != 0 ? tag : 1;
+}
+
+ngx_uint_t
+ngx_buffer_cache_purge(ngx_buffer_cache_t* cache, uint32_t tag)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_rbtree_node_t *sentinel;
+	ngx_rbtree_node_t *first;
+	ngx_rbtree_node_t *next;
+	ngx_rbtree_node_t *node;
+	ngx_uint_t shard_count;
+	ngx_uint_t result = 0;
+	ngx_uint_t i;
+
+	// Note: the shards of the partitions follow the shards of the cache
+	shard_count = cache->shard_count * (cache->partitions.nelts + 1);
+
+	for (i = 0; i < shard_count; i++)
+	{
+		sh = &cache->sh[i];
+
+		ngx_shmtx_lock(&sh->mutex);
+
+		if (sh->reset)
+		{
+			// the shard will be reset by the next store
+			ngx_shmtx_unlock(&sh->mutex);
+			continue;
+		}
+
+		ngx_buffer_cache_write_begin(sh);
+
+		// find the first entry that has the tag, entries with the same tag are adjacent in the tree
+		sentinel = sh->tag_rbtree.sentinel;
+		first = NULL;
+
+		for (node = sh->tag_rbtree.root; node != sentinel; )
+		{
+			if (tag <= node->key)
+			{
+				if (tag == node->key)
+				{
+					first = node;
+				}
+
+				node = node->left;
+			}
+			else
+			{
+				node = node->right;
+			}
+		}
+
+		for (node = first; node != NULL && node->key == tag; node = next)
+		{
+			// Note: deleting a node does not move the other nodes
+			next = ngx_rbtree_next(&sh->tag_rbtree, node);
+
+			// entries that are being stored are skipped, their state is updated without the lock
+			entry = container_of(node, ngx_buffer_cache_entry_t, tag_node);
+			if (entry->state != CES_READY)
+			{
+				continue;
+			}
+
+			ngx_buffer_cache_delete_entry(sh, entry);
+			entry->state = CES_DETACHED;
+
+			sh->stats.purged++;
+			result++;
+		}
+
+		ngx_buffer_cache_write_end(sh);
+
+		ngx_shmtx_unlock(&sh->mutex);
+	}
+
+	return result;
+}
+
+/* allocates an entry and a buffer for a loaded entry, returns NULL if the entry can not be added.
+	Note: must be called before the shard is accessed by worker processes */
+static u_char*
+ngx_buffer_cache_load_alloc(
+	ngx_buffer_cache_sh_t *sh, 
+	u_char* key, 
+	uint32_t hash, 
+	uint64_t size, 
+	ngx_buffer_cache_entry_t** result)
+{
+	u_char* buffer;
+
+	if (size >= (uint64_t)(sh->buffers_end - (u_char*)sh->entries_start) ||
+		ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash) != NULL)
+	{
+		return NULL;
+	}
+
+	// Note: when the shard is full, the entries that were loaded first are evicted, 
+	//	the entries are loaded in write order, so these are the oldest entries
+	*result = ngx_buffer_cache_get_free_entry(sh);
+	if (*result == NULL)
+	{
+		return NULL;
+	}
+
+	buffer = ngx_buffer_cache_get_free_buffer(sh, size + 1);
+	if (buffer == NULL)
+	{
+		return NULL;
+	}
+
+	buffer[size] = '\0';
+
+	return buffer;
+}
+
+/* adds an entry that was allocated with ngx_buffer_cache_load_alloc, after its buffer was filled */
+static void
+ngx_buffer_cache_load_commit(
+	ngx_buffer_cache_sh_t *sh,
+	ngx_buffer_cache_entry_t* entry,
+	u_char* key,
+	uint32_t hash,
+	u_char* buffer,
+	size_t size,
+	time_t write_time,
+	uint32_t tag)
+{
+	// initialize the entry
+	entry->state = CES_READY;
+	entry->ref_count = 0;
+	entry->refresh_time = 0;
+	entry->node.key = hash;
+	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
+	entry->start_offset = buffer;
+	entry->buffer_size = size;
+	entry->access_time = ngx_time();
+	entry->write_time = write_time;
+
+	// update the write position
+	sh->buffers_write = buffer;
+
+	// move from free_queue to used_queue
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
+
+	// insert to rbtree
+	ngx_buffer_cache_insert_entry(sh, entry, tag);
+}
+
+/* Note: called when the shared memory is created, before any other process can access it,
+	so the shards are not locked. the entries are read directly into the buffers of the shards */
+static void
+ngx_buffer_cache_load(ngx_buffer_cache_t* cache, ngx_log_t* log)
+{
+	ngx_buffer_cache_file_header_t header;
+	ngx_buffer_cache_file_entry_t file_entry;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_uint_t node_shard_count;
+	ngx_uint_t skipped = 0;
+	ngx_uint_t loaded = 0;
+	ngx_uint_t node;
+	ngx_file_t file;
+	uint32_t hash;
+	ssize_t n;
+	off_t offset;
+	u_char* first_buffer;
+	u_char* target_buffer;
+
+	ngx_memzero(&file, sizeof(file));
+	file.name = cache->persist_path;
+	file.log = log;
+
+	file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (file.fd == NGX_INVALID_FILE)
+	{
+		if (ngx_errno != NGX_ENOENT)
+		{
+			ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+				"ngx_buffer_cache_load: failed to open \"%V\"", &file.name);
+		}
+		return;
+	}
+
+	n = ngx_read_file(&file, (u_char*)&header, sizeof(header), 0);
+	if (n != sizeof(header) ||
+		header.magic != BUFFER_CACHE_FILE_MAGIC ||
+		header.version != BUFFER_CACHE_FILE_VERSION)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_buffer_cache_load: invalid header in \"%V\"", &file.name);
+		goto done;
+	}
+
+	offset = sizeof(header);
+	node_shard_count = cache->shard_count / cache->numa_node_count;
+
+	for (;;)
+	{
+		n = ngx_read_file(&file, (u_char*)&file_entry, sizeof(file_entry), offset);
+		if (n == 0)
+		{
+			break;
+		}
+
+		if (n != sizeof(file_entry))
+		{
+			ngx_log_error(NGX_LOG_WARN, log, 0,
+				"ngx_buffer_cache_load: \"%V\" is truncated", &file.name);
+			break;
+		}
+
+		offset += sizeof(file_entry);
+
+		if (cache->expiration &&
+			ngx_time() >= (time_t)(file_entry.write_time + cache->expiration + cache->stale))
+		{
+			skipped++;
+			offset += file_entry.size;
+			continue;
+		}
+
+		hash = ngx_crc32_short(file_entry.key, BUFFER_CACHE_KEY_SIZE);
+		first_buffer = NULL;
+
+		// each numa node gets its own copy of the entry
+		for (node = 0; node < cache->numa_node_count; node++)
+		{
+			sh = &cache->sh[node * node_shard_count + hash % node_shard_count];
+
+			target_buffer = ngx_buffer_cache_load_alloc(sh, file_entry.key, hash, file_entry.size, &entry);
+			if (target_buffer == NULL)
+			{
+				continue;
+			}
+
+			if (first_buffer == NULL)
+			{
+				n = ngx_read_file(&file, target_buffer, file_entry.size, offset);
+				if (n != (ssize_t)file_entry.size)
+				{
+					ngx_log_error(NGX_LOG_WARN, log, 0,
+						"ngx_buffer_cache_load: \"%V\" is truncated", &file.name);
+					goto done;
+				}
+
+				first_buffer = target_buffer;
+			}
+			else
+			{
+				ngx_memcpy(target_buffer, first_buffer, file_entry.size);
+			}
+
+			ngx_buffer_cache_load_commit(sh, entry, file_entry.key, hash, 
+				target_buffer, file_entry.size, file_entry.write_time, 0);
+		}
+
+		if (first_buffer != NULL)
+		{
+			loaded++;
+		}
+		else
+		{
+			skipped++;
+		}
+
+		offset += file_entry.size;
+	}
+
+done:
+
+	ngx_close_file(file.fd);
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0,
+		"ngx_buffer_cache_load: loaded %ui entries from \"%V\", skipped %ui", loaded, &file.name, skipped);
+}
+
+static ngx_buffer_cache_t*
+ngx_buffer_cache_get_previous(ngx_shm_zone_t *shm_zone)
+{
+	ngx_shm_zone_t *oshm_zone;
+	ngx_list_part_t *part;
+	ngx_uint_t i;
+
+	// Note: while the configuration is reloaded, ngx_cycle still points to the previous cycle,
+	//	a zone of the previous cycle that has the same name was not reused, since its size is different
+	part = (ngx_list_part_t*)&ngx_cycle->shared_memory.part;
+	oshm_zone = part->elts;
+
+	for (i = 0; /* void */ ; i++)
+	{
+		if (i >= part->nelts)
+		{
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			oshm_zone = part->elts;
+			i = 0;
+		}
+
+		if (oshm_zone[i].tag != shm_zone->tag ||
+			oshm_zone[i].init != ngx_buffer_cache_init ||
+			oshm_zone[i].data == NULL ||
+			oshm_zone[i].shm.name.len != shm_zone->shm.name.len ||
+			ngx_strncmp(oshm_zone[i].shm.name.data, shm_zone->shm.name.data, shm_zone->shm.name.len) != 0)
+		{
+			continue;
+		}
+
+		return oshm_zone[i].data;
+	}
+
+	return NULL;
+}
+
+/* copies the entries of a shard of the previous cache to the matching shards of the new cache.
+	the previous shard is still used by the worker processes of the previous cycle, the keys are
+	snapshotted first, and the entries are copied one by one, like in ngx_buffer_cache_dump */
+static ngx_int_t
+ngx_buffer_cache_migrate_shard(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t* osh,
+	ngx_log_t* log,
+	ngx_uint_t* migrated,
+	ngx_uint_t* skipped)
+{
+	ngx_buffer_cache_entry_t* target_entry;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_queue_t* node;
+	ngx_uint_t node_shard_count;
+	ngx_uint_t key_count;
+	ngx_uint_t max_keys;
+	ngx_uint_t numa_node;
+	ngx_uint_t i;
+	ngx_flag_t copied;
+	uint32_t hash;
+	u_char (*keys)[BUFFER_CACHE_KEY_SIZE];
+	u_char* target_buffer;
+
+	ngx_shmtx_lock(&osh->mutex);
+	max_keys = osh->reset ? 0 : osh->entries_end - osh->entries_start;
+	ngx_shmtx_unlock(&osh->mutex);
+
+	if (max_keys == 0)
+	{
+		return NGX_OK;
+	}
+
+	keys = ngx_alloc(max_keys * BUFFER_CACHE_KEY_SIZE, log);
+	if (keys == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	key_count = 0;
+
+	ngx_shmtx_lock(&osh->mutex);
+
+	for (node = ngx_queue_head(&osh->used_queue);
+		node != ngx_queue_sentinel(&osh->used_queue) && key_count < max_keys && !osh->reset;
+		node = ngx_queue_next(node))
+	{
+		entry = container_of(node, ngx_buffer_cache_entry_t, queue_node);
+		if (entry->state != CES_READY)
+		{
+			continue;
+		}
+
+		ngx_memcpy(keys[key_count], entry->key, BUFFER_CACHE_KEY_SIZE);
+		key_count++;
+	}
+
+	ngx_shmtx_unlock(&osh->mutex);
+
+	node_shard_count = cache->shard_count / cache->numa_node_count;
+
+	for (i = 0; i < key_count; i++)
+	{
+		hash = ngx_crc32_short(keys[i], BUFFER_CACHE_KEY_SIZE);
+
+		ngx_shmtx_lock(&osh->mutex);
+
+		entry = osh->reset ? NULL : ngx_buffer_cache_rbtree_lookup(&osh->rbtree, keys[i], hash);
+		if (entry == NULL ||
+			entry->state != CES_READY ||
+			(cache->expiration &&
+			ngx_time() >= (time_t)(entry->write_time + cache->expiration + cache->stale)))
+		{
+			ngx_shmtx_unlock(&osh->mutex);
+			(*skipped)++;
+			continue;
+		}
+
+		// each numa node gets its own copy of the entry
+		copied = 0;
+
+		for (numa_node = 0; numa_node < cache->numa_node_count; numa_node++)
+		{
+			sh = &cache->sh[numa_node * node_shard_count + hash % node_shard_count];
+
+			target_buffer = ngx_buffer_cache_load_alloc(sh, entry->key, hash, entry->buffer_size, &target_entry);
+			if (target_buffer == NULL)
+			{
+				continue;
+			}
+
+			ngx_memcpy(target_buffer, entry->start_offset, entry->buffer_size);
+
+			ngx_buffer_cache_load_commit(sh, target_entry, entry->key, hash,
+				target_buffer, entry->buffer_size, entry->write_time, entry->tag_node.key);
+			copied = 1;
+		}
+
+		ngx_shmtx_unlock(&osh->mutex);
+
+		if (copied)
+		{
+			(*migrated)++;
+		}
+		else
+		{
+			(*skipped)++;
+		}
+	}
+
+	ngx_free(keys);
+
+	return NGX_OK;
+}
+
+/* copies the entries of the cache and its partitions from the zone of the previous cycle.
+	the shards of the previous zone are copied one after the other, when the new zone is smaller,
+	the entries of the shards that are copied last are more likely to be retained */
+static void
+ngx_buffer_cache_migrate(ngx_buffer_cache_t* cache, ngx_buffer_cache_t* ocache, ngx_log_t* log)
+{
+	ngx_buffer_cache_t **opartitions;
+	ngx_buffer_cache_t *target;
+	ngx_buffer_cache_t *source;
+	ngx_uint_t migrated = 0;
+	ngx_uint_t skipped = 0;
+	ngx_uint_t shard;
+	ngx_uint_t i;
+
+	opartitions = ocache->partitions.elts;
+
+	// the unpartitioned shards are migrated first, followed by the shards of each partition
+	for (i = 0; i <= ocache->partitions.nelts; i++)
+	{
+		if (i == 0)
+		{
+			source = ocache;
+			target = cache;
+		}
+		else
+		{
+			// Note: a partition that no longer exists is migrated to the unpartitioned shards
+			source = opartitions[i - 1];
+			target = ngx_buffer_cache_get_partition(cache, &source->partition_name);
+		}
+
+		for (shard = 0; shard < source->shard_count; shard++)
+		{
+			if (ngx_buffer_cache_migrate_shard(target, &source->sh[shard], log, &migrated, &skipped) != NGX_OK)
+			{
+				ngx_log_error(NGX_LOG_WARN, log, 0,
+					"ngx_buffer_cache_migrate: failed to migrate the entries of \"%V\"", &cache->shm_zone->shm.name);
+				goto done;
+			}
+		}
+	}
+
+done:
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0,
+		"ngx_buffer_cache_migrate: migrated %ui entries to \"%V\", skipped %ui", 
+		migrated, &cache->shm_zone->shm.name, skipped);
+}
+
+static ngx_int_t
+ngx_buffer_cache_write_fully(ngx_fd_t fd, u_char* buf, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0)
+	{
+		n = ngx_write_fd(fd, buf, size);
+		if (n <= 0)
+		{
+			return NGX_ERROR;
+		}
+
+		buf += n;
+		size -= n;
+	}
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_buffer_cache_dump(ngx_buffer_cache_t* cache, ngx_log_t* log, ngx_uint_t* count)
+{
+	ngx_buffer_cache_file_header_t header;
+	ngx_buffer_cache_file_entry_t file_entry;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_queue_t* node;
+	ngx_uint_t key_count;
+	ngx_uint_t max_keys;
+	ngx_uint_t shard;
+	ngx_uint_t i;
+	ngx_int_t rc = NGX_ERROR;
+	ngx_fd_t fd;
+	uint32_t hash;
+	size_t buffer_size = 0;
+	u_char (*keys)[BUFFER_CACHE_KEY_SIZE];
+	u_char* temp_path;
+	u_char* buffer = NULL;
+
+	*count = 0;
+
+	if (cache->persist_path.len == 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	// write to a temp file and rename, so that a failure does not corrupt the previous dump
+	temp_path = ngx_alloc(cache->persist_path.len + sizeof(".tmp"), log);
+	if (temp_path == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(temp_path, "%V.tmp%Z", &cache->persist_path);
+
+	fd = ngx_open_file(temp_path, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_buffer_cache_dump: failed to open \"%s\"", temp_path);
+		ngx_free(temp_path);
+		return NGX_ERROR;
+	}
+
+	header.magic = BUFFER_CACHE_FILE_MAGIC;
+	header.version = BUFFER_CACHE_FILE_VERSION;
+	if (ngx_buffer_cache_write_fully(fd, (u_char*)&header, sizeof(header)) != NGX_OK)
+	{
+		goto failed;
+	}
 
-error:
-	sh->stats.store_err++;
-	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
-	return 0;
+	for (shard = 0; shard < cache->shard_count; shard++)
+	{
+		sh = &cache->sh[shard];
+
+		// snapshot the keys of the shard in write order, the entries are copied one by one, 
+		//	so that the shard is not locked for the whole dump
+		ngx_shmtx_lock(&sh->mutex);
+		max_keys = sh->entries_end - sh->entries_start;
+		ngx_shmtx_unlock(&sh->mutex);
+
+		if (max_keys == 0)
+		{
+			continue;
+		}
+
+		keys = ngx_alloc(max_keys * BUFFER_CACHE_KEY_SIZE, log);
+		if (keys == NULL)
+		{
+			goto failed;
+		}
+
+		key_count = 0;
+
+		ngx_shmtx_lock(&sh->mutex);
+
+		for (node = ngx_queue_head(&sh->used_queue);
+			node != ngx_queue_sentinel(&sh->used_queue) && key_count < max_keys;
+			node = ngx_queue_next(node))
+		{
+			entry = container_of(node, ngx_buffer_cache_entry_t, queue_node);
+			if (entry->state != CES_READY)
+			{
+				continue;
+			}
+
+			ngx_memcpy(keys[key_count], entry->key, BUFFER_CACHE_KEY_SIZE);
+			key_count++;
+		}
+
+		ngx_shmtx_unlock(&sh->mutex);
+
+		for (i = 0; i < key_count; i++)
+		{
+			hash = ngx_crc32_short(keys[i], BUFFER_CACHE_KEY_SIZE);
+
+			ngx_shmtx_lock(&sh->mutex);
+
+			entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, keys[i], hash);
+			if (entry == NULL || 
+				entry->state != CES_READY ||
+				(cache->expiration && 
+				ngx_time() >= (time_t)(entry->write_time + cache->expiration + cache->stale)))
+			{
+				ngx_shmtx_unlock(&sh->mutex);
+				continue;
+			}
+
+			if (entry->buffer_size > buffer_size)
+			{
+				ngx_free(buffer);
+
+				buffer_size = entry->buffer_size;
+				buffer = ngx_alloc(buffer_size, log);
+				if (buffer == NULL)
+				{
+					ngx_shmtx_unlock(&sh->mutex);
+					ngx_free(keys);
+					goto failed;
+				}
+			}
+
+			ngx_memcpy(file_entry.key, entry->key, BUFFER_CACHE_KEY_SIZE);
+			file_entry.write_time = entry->write_time;
+			file_entry.size = entry->buffer_size;
+			ngx_memcpy(buffer, entry->start_offset, entry->buffer_size);
+
+			ngx_shmtx_unlock(&sh->mutex);
+
+			if (ngx_buffer_cache_write_fully(fd, (u_char*)&file_entry, sizeof(file_entry)) != NGX_OK ||
+				ngx_buffer_cache_write_fully(fd, buffer, file_entry.size) != NGX_OK)
+			{
+				ngx_free(keys);
+				goto failed;
+			}
+
+			(*count)++;
+		}
+
+		ngx_free(keys);
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		fd = NGX_INVALID_FILE;
+		goto failed;
+	}
+
+	fd = NGX_INVALID_FILE;
+
+	if (ngx_rename_file(temp_path, cache->persist_path.data) == NGX_FILE_ERROR)
+	{
+		goto failed;
+	}
+
+	rc = NGX_OK;
+	goto done;
+
+failed:
+
+	ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+		"ngx_buffer_cache_dump: failed to write \"%V\"", &cache->persist_path);
+
+	if (fd != NGX_INVALID_FILE)
+	{
+		ngx_close_file(fd);
+	}
+
+	ngx_delete_file(temp_path);
+
+done:
+
+	ngx_free(buffer);
+	ngx_free(temp_path);
+
+	return rc;
 }
 
-ngx_flag_t
-ngx_buffer_cache_store(
+void
+ngx_buffer_cache_set_persist_path(ngx_buffer_cache_t* cache, ngx_str_t* path)
+{
+	cache->persist_path = *path;
+}
+
+void
+ngx_buffer_cache_set_admission(
 	ngx_buffer_cache_t* cache,
-	u_char* key,
-	u_char* source_buffer,
-	size_t buffer_size)
+	size_t max_entry_size,
+	ngx_uint_t min_uses)
 {
-	ngx_str_t buffer;
+	cache->max_entry_size = max_entry_size;
+	cache->min_uses = min_uses;
+}
 
-	buffer.data = source_buffer;
-	buffer.len = buffer_size;
+ngx_int_t
+ngx_buffer_cache_set_local(
+	ngx_conf_t *cf,
+	ngx_buffer_cache_t* cache,
+	ngx_uint_t count,
+	size_t max_entry_size)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+	ngx_buffer_cache_local_t* local;
+
+	// Note: allocated on the configuration pool, each worker process gets its own copy when it is forked
+	local = ngx_pcalloc(cf->pool, sizeof(*local));
+	if (local == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	local->entries = ngx_pcalloc(cf->pool, sizeof(local->entries[0]) * count);
+	if (local->entries == NULL)
+	{
+		return NGX_ERROR;
+	}
 
-	return ngx_buffer_cache_store_gather(cache, key, &buffer, 1);
+	local->mask = count - 1;
+	local->max_entry_size = max_entry_size;
+	ngx_queue_init(&local->retired);
+
+	cache->local = local;
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	return NGX_OK;
 }
 
 void
-ngx_buffer_cache_get_stats(
+ngx_buffer_cache_set_numa(ngx_buffer_cache_t* cache, ngx_uint_t node_count)
+{
+	cache->numa_node_count = node_count;
+	cache->shard_count *= node_count;
+}
+
+ngx_buffer_cache_t*
+ngx_buffer_cache_add_partition(
+	ngx_conf_t *cf,
+	ngx_buffer_cache_t* cache,
+	ngx_str_t* name,
+	size_t size)
+{
+	ngx_buffer_cache_t** partition_ptr;
+	ngx_buffer_cache_t* partition;
+
+	if (cache->partitions.elts == NULL &&
+		ngx_array_init(&cache->partitions, cf->pool, 4, sizeof(ngx_buffer_cache_t*)) != NGX_OK)
+	{
+		return NULL;
+	}
+
+	partition = ngx_palloc(cf->pool, sizeof(*partition));
+	if (partition == NULL)
+	{
+		return NULL;
+	}
+
+	partition_ptr = ngx_array_push(&cache->partitions);
+	if (partition_ptr == NULL)
+	{
+		return NULL;
+	}
+
+	// Note: sh / shpool are set when the shared memory is initialized
+	*partition = *cache;
+	ngx_memzero(&partition->partitions, sizeof(partition->partitions));
+	ngx_str_null(&partition->persist_path);
+	partition->local = NULL;
+	partition->partition_name = *name;
+	partition->partition_size = size;
+
+	*partition_ptr = partition;
+
+	return partition;
+}
+
+ngx_buffer_cache_t*
+ngx_buffer_cache_get_partition(ngx_buffer_cache_t* cache, ngx_str_t* name)
+{
+	ngx_buffer_cache_t** partitions = cache->partitions.elts;
+	ngx_uint_t i;
+
+	for (i = 0; i < cache->partitions.nelts; i++)
+	{
+		if (partitions[i]->partition_name.len == name->len &&
+			ngx_strncmp(partitions[i]->partition_name.data, name->data, name->len) == 0)
+		{
+			return partitions[i];
+		}
+	}
+
+	return cache;
+}
+
+ngx_uint_t
+ngx_buffer_cache_get_partitions(ngx_buffer_cache_t* cache, ngx_buffer_cache_t*** result)
+{
+	*result = cache->partitions.elts;
+	return cache->partitions.nelts;
+}
+
+ngx_str_t*
+ngx_buffer_cache_get_partition_name(ngx_buffer_cache_t* partition)
+{
+	return &partition->partition_name;
+}
+
+ngx_uint_t
+ngx_buffer_cache_get_numa_node_count(ngx_buffer_cache_t* cache)
+{
+	return cache->numa_node_count;
+}
+
+void
+ngx_buffer_cache_set_huge_pages(ngx_buffer_cache_t* cache)
+{
+	cache->huge_pages = 1;
+}
+
+#if (NGX_LINUX) && defined(MADV_HUGEPAGE)
+/* parses a line of smaps - a line that starts with an address range opens a mapping, 
+	the field lines that follow it describe the mapping. returns NGX_OK when the field was found */
+static ngx_int_t
+ngx_buffer_cache_parse_smaps_line(ngx_buffer_cache_t* cache, u_char* line, u_char* end, ngx_flag_t* in_zone, size_t* size)
+{
+	ngx_int_t value;
+	u_char* p;
+
+	if ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f'))
+	{
+		p = ngx_strlchr(line, end, '-');
+		*in_zone = p != NULL && 
+			ngx_hextoi(line, p - line) == (ngx_int_t)(uintptr_t)cache->shm_zone->shm.addr;
+		return NGX_DECLINED;
+	}
+
+	if (!*in_zone || 
+		(size_t)(end - line) < sizeof(SMAPS_HUGE_PAGES_FIELD) - 1 ||
+		ngx_strncmp(line, SMAPS_HUGE_PAGES_FIELD, sizeof(SMAPS_HUGE_PAGES_FIELD) - 1) != 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	// the format is "<field>:   <value> kB"
+	line += sizeof(SMAPS_HUGE_PAGES_FIELD) - 1;
+	for (; line < end && *line == ' '; line++);
+	for (p = line; p < end && *p >= '0' && *p <= '9'; p++);
+
+	value = ngx_atoi(line, p - line);
+	if (value == NGX_ERROR)
+	{
+		return NGX_DECLINED;
+	}
+
+	*size = (size_t)value * 1024;
+	return NGX_OK;
+}
+#endif // NGX_LINUX && MADV_HUGEPAGE
+
+ngx_int_t
+ngx_buffer_cache_get_huge_pages_size(ngx_buffer_cache_t* cache, ngx_log_t* log, size_t* size)
+{
+#if (NGX_LINUX) && defined(MADV_HUGEPAGE)
+	ngx_file_t file;
+	ngx_flag_t in_zone = 0;
+	ngx_int_t rc = NGX_OK;
+	ssize_t n;
+	size_t left = 0;
+	off_t offset = 0;
+	u_char buf[4096];
+	u_char* line;
+	u_char* end;
+	u_char* p;
+
+	if (!cache->huge_pages)
+	{
+		return NGX_DECLINED;
+	}
+
+	*size = 0;
+
+	ngx_memzero(&file, sizeof(file));
+	file.name.data = (u_char*)SMAPS_PATH;
+	file.name.len = sizeof(SMAPS_PATH) - 1;
+	file.log = log;
+
+	file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (file.fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_buffer_cache_get_huge_pages_size: " ngx_open_file_n " \"%V\" failed", &file.name);
+		return NGX_ERROR;
+	}
+
+	for ( ;; )
+	{
+		n = ngx_read_file(&file, buf + left, sizeof(buf) - left, offset);
+		if (n == NGX_ERROR)
+		{
+			rc = NGX_ERROR;
+			break;
+		}
+
+		if (n == 0)
+		{
+			break;
+		}
+
+		offset += n;
+		end = buf + left + n;
+
+		for (line = buf; ; line = p + 1)
+		{
+			p = ngx_strlchr(line, end, '\n');
+			if (p == NULL)
+			{
+				break;
+			}
+
+			if (p > line && ngx_buffer_cache_parse_smaps_line(cache, line, p, &in_zone, size) == NGX_OK)
+			{
+				goto done;
+			}
+		}
+
+		// move the partial line to the beginning of the buffer, lines longer than the buffer are skipped
+		left = end - line;
+		if (left >= sizeof(buf))
+		{
+			left = 0;
+			continue;
+		}
+
+		ngx_memmove(buf, line, left);
+	}
+
+done:
+
+	ngx_close_file(file.fd);
+
+	return rc;
+#else
+	return NGX_DECLINED;
+#endif // NGX_LINUX && MADV_HUGEPAGE
+}
+
+ngx_uint_t
+ngx_buffer_cache_detect_numa_node_count(ngx_log_t* log)
+{
+#if (NGX_LINUX)
+	ngx_file_t file;
+	ngx_int_t last;
+	ssize_t n;
+	u_char buf[64];
+	u_char* p;
+	u_char* end;
+
+	ngx_memzero(&file, sizeof(file));
+	file.name.data = (u_char*)NUMA_NODES_POSSIBLE_PATH;
+	file.name.len = sizeof(NUMA_NODES_POSSIBLE_PATH) - 1;
+	file.log = log;
+
+	file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (file.fd == NGX_INVALID_FILE)
+	{
+		return 1;
+	}
+
+	n = ngx_read_file(&file, buf, sizeof(buf), 0);
+
+	ngx_close_file(file.fd);
+
+	if (n <= 0)
+	{
+		return 1;
+	}
+
+	// the format is a node range list, e.g. "0" or "0-3", the nodes are numbered sequentially
+	end = buf + n;
+	for (p = end; p > buf && (p[-1] < '0' || p[-1] > '9'); p--);
+	end = p;
+	for (; p > buf && p[-1] >= '0' && p[-1] <= '9'; p--);
+
+	last = ngx_atoi(p, end - p);
+	if (last == NGX_ERROR || last >= BUFFER_CACHE_MAX_NUMA_NODES)
+	{
+		return 1;
+	}
+
+	return last + 1;
+#else
+	return 1;
+#endif // NGX_LINUX
+}
+
+void
+ngx_buffer_cache_init_numa_node(ngx_log_t* log)
+{
+#if (NGX_LINUX) && defined(SYS_getcpu)
+	unsigned cpu;
+	unsigned node;
+
+	// Note: the node is sampled once, the workers are expected to be pinned with worker_cpu_affinity
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+			"ngx_buffer_cache_init_numa_node: getcpu failed");
+		return;
+	}
+
+	ngx_buffer_cache_numa_node = node;
+#endif // NGX_LINUX
+}
+
+ngx_uint_t
+ngx_buffer_cache_get_shard_count(ngx_buffer_cache_t* cache)
+{
+	return cache->shard_count;
+}
+
+time_t
+ngx_buffer_cache_get_expiration(ngx_buffer_cache_t* cache)
+{
+	return cache->expiration;
+}
+
+ngx_int_t
+ngx_buffer_cache_get_uses(ngx_buffer_cache_t* cache, u_char* key, ngx_uint_t* uses)
+{
+	ngx_buffer_cache_sh_t *sh;
+
+	if (cache->policy != BUFFER_CACHE_POLICY_TINYLFU)
+	{
+		return NGX_DECLINED;
+	}
+
+	sh = ngx_buffer_cache_get_shard(cache, ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE));
+
+	*uses = ngx_buffer_cache_sketch_estimate(&sh->sketch, key);
+
+	return NGX_OK;
+}
+
+void
+ngx_buffer_cache_get_shard_stats(
 	ngx_buffer_cache_t* cache,
+	ngx_uint_t shard,
 	ngx_buffer_cache_stats_t* stats)
 {
-	ngx_buffer_cache_sh_t *sh = cache->sh;
+	ngx_buffer_cache_sh_t *sh = &cache->sh[shard];
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	ngx_shmtx_lock(&sh->mutex);
 
 	memcpy(stats, &sh->stats, sizeof(sh->stats));
 
 	stats->entries = sh->entries_end - sh->entries_start;
 	stats->data_size = sh->buffers_end - sh->buffers_start;
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	ngx_shmtx_unlock(&sh->mutex);
+}
+
+void
+ngx_buffer_cache_get_stats(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_stats_t* stats)
+{
+	ngx_buffer_cache_stats_t shard_stats;
+	ngx_atomic_t* dest;
+	ngx_atomic_t* src;
+	ngx_uint_t i;
+	ngx_uint_t j;
+
+	ngx_memzero(stats, sizeof(*stats));
+
+	for (i = 0; i < cache->shard_count; i++)
+	{
+		ngx_buffer_cache_get_shard_stats(cache, i, &shard_stats);
+
+		// Note: all the fields of the stats struct are ngx_atomic_t
+		dest = (ngx_atomic_t*)stats;
+		src = (ngx_atomic_t*)&shard_stats;
+		for (j = 0; j < sizeof(*stats) / sizeof(*dest); j++)
+		{
+			dest[j] += src[j];
+		}
+	}
 }
 
 void
 ngx_buffer_cache_reset_stats(ngx_buffer_cache_t* cache)
 {
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	ngx_buffer_cache_sh_t *sh;
+	ngx_uint_t i;
 
-	ngx_memzero(&cache->sh->stats, sizeof(cache->sh->stats));
+	for (i = 0; i < cache->shard_count; i++)
+	{
+		sh = &cache->sh[i];
+
+		ngx_shmtx_lock(&sh->mutex);
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_memzero(&sh->stats, sizeof(sh->stats));
+
+		ngx_shmtx_unlock(&sh->mutex);
+	}
 }
 
 ngx_buffer_cache_t*
-ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t expiration, void *tag)
+ngx_buffer_cache_create(
+	ngx_conf_t *cf, 
+	ngx_str_t *name, 
+	size_t size, 
+	time_t expiration, 
+	time_t stale,
+	ngx_uint_t shard_count, 
+	ngx_uint_t policy, 
+	void *tag)
 {
 	ngx_buffer_cache_t* cache;
 
@@ -588,6 +2826,10 @@ ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t exp
 	}
 
 	cache->expiration = expiration;
+	cache->stale = stale;
+	cache->shard_count = shard_count;
+	cache->numa_node_count = 1;
+	cache->policy = policy;
 
 	cache->shm_zone = ngx_shared_memory_add(cf, name, size, tag);
 	if (cache->shm_zone == NULL)
@@ -6,6 +6,26 @@
 
 // constants
 #define BUFFER_CACHE_KEY_SIZE (16)
+#define BUFFER_CACHE_MAX_SHARDS (64)
+#define BUFFER_CACHE_MAX_NUMA_NODES (64)
+#define BUFFER_CACHE_MAX_MIN_USES (15)		// the maximum value of the access frequency counters
+#define BUFFER_CACHE_MAX_LOCAL_COUNT (65536)
+#define BUFFER_CACHE_MAX_PARTITIONS (16)
+#define BUFFER_CACHE_HISTOGRAM_BUCKETS (16)		// log2 buckets, the last bucket holds all the larger values
+#define BUFFER_CACHE_SIZE_HISTOGRAM_MIN_BITS (10)	// the first size bucket holds entries up to 1KB
+#define BUFFER_CACHE_AGE_HISTOGRAM_MIN_BITS (0)		// the first age bucket holds entries up to 1 sec old
+
+// enums
+enum {
+	BUFFER_CACHE_POLICY_FIFO,			// evict in write order
+	BUFFER_CACHE_POLICY_TINYLFU,		// evict in write order, admit new entries by access frequency
+};
+
+enum {
+	BUFFER_CACHE_FETCH_FRESH,
+	BUFFER_CACHE_FETCH_STALE,			// expired, but within the stale period
+	BUFFER_CACHE_FETCH_STALE_REFRESH,	// same as stale, the caller should refresh the entry
+};
 
 // typedefs
 struct ngx_buffer_cache_s;
@@ -16,12 +36,27 @@ typedef struct {
 	ngx_atomic_t store_bytes;
 	ngx_atomic_t store_err;
 	ngx_atomic_t store_exists;
+	ngx_atomic_t store_rejected;
 	ngx_atomic_t fetch_hit;
 	ngx_atomic_t fetch_bytes;
 	ngx_atomic_t fetch_miss;
+	ngx_atomic_t fetch_stale;
+	ngx_atomic_t fetch_local_hit;		// included in fetch_hit
 	ngx_atomic_t evicted;
 	ngx_atomic_t evicted_bytes;
+	ngx_atomic_t evicted_expired;		// evicted since they expired (and passed the stale period)
+	ngx_atomic_t evicted_no_entries;	// evicted since the entries table is exhausted
+	ngx_atomic_t evicted_no_space;		// evicted since the ring buffer wrapped over them
+	ngx_atomic_t expire_limit_reached;	// stores that evicted MAX_EVICTIONS_PER_STORE expired entries, more may remain
 	ngx_atomic_t reset;
+	ngx_atomic_t purged;
+
+	// histograms, see ngx_buffer_cache_get_histogram_bound
+	ngx_atomic_t store_size_buckets[BUFFER_CACHE_HISTOGRAM_BUCKETS];	// bytes, the sum is store_bytes
+	ngx_atomic_t evicted_age_buckets[BUFFER_CACHE_HISTOGRAM_BUCKETS];	// seconds since the entry was written
+	ngx_atomic_t evicted_age_sum;
+	ngx_atomic_t hit_age_buckets[BUFFER_CACHE_HISTOGRAM_BUCKETS];		// seconds since the entry was written
+	ngx_atomic_t hit_age_sum;
 
 	// updated only when the stats are fetched
 	ngx_atomic_t entries;
@@ -35,11 +70,28 @@ ngx_flag_t ngx_buffer_cache_fetch(
 	ngx_str_t* buffer,
 	uint32_t* token);
 
+// same as ngx_buffer_cache_fetch, but can also return entries that expired less than the stale 
+//	time ago. only one caller gets BUFFER_CACHE_FETCH_STALE_REFRESH for a stale entry, until either
+//	the entry is replaced (stores replace expired entries) or the refresh lock expires
+ngx_flag_t ngx_buffer_cache_fetch_stale(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state);
+
 void ngx_buffer_cache_release(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
 	uint32_t token);
 
+// extends the lock of a fetched entry, an entry that is held for longer than a few seconds 
+//	must be touched periodically, otherwise the entry may be evicted while it is still in use
+void ngx_buffer_cache_touch(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t token);
+
 ngx_flag_t ngx_buffer_cache_store(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
@@ -52,17 +104,114 @@ ngx_flag_t ngx_buffer_cache_store_gather(
 	ngx_str_t* buffers,
 	size_t buffer_count);
 
+// same as ngx_buffer_cache_store_gather, the entry can later be removed by ngx_buffer_cache_purge,
+//	using the same tag. a zero tag stores an untagged entry
+ngx_flag_t ngx_buffer_cache_store_tagged(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t tag,
+	ngx_str_t* buffers,
+	size_t buffer_count);
+
+// returns the (non-zero) tag of a name, e.g. the id of a title
+uint32_t ngx_buffer_cache_get_tag(ngx_str_t* name);
+
+// removes the entries that were stored with the specified tag from the cache and its partitions, 
+//	returns the number of removed entries. entries that are being stored during the purge are not removed
+ngx_uint_t ngx_buffer_cache_purge(ngx_buffer_cache_t* cache, uint32_t tag);
+
 void ngx_buffer_cache_get_stats(
 	ngx_buffer_cache_t* cache,
 	ngx_buffer_cache_stats_t* stats);
 
+ngx_uint_t ngx_buffer_cache_get_shard_count(ngx_buffer_cache_t* cache);
+
+time_t ngx_buffer_cache_get_expiration(ngx_buffer_cache_t* cache);
+
+// returns the estimated number of recent fetches of the key, returns NGX_DECLINED when the cache does not
+//	track the fetches (only BUFFER_CACHE_POLICY_TINYLFU does)
+ngx_int_t ngx_buffer_cache_get_uses(ngx_buffer_cache_t* cache, u_char* key, ngx_uint_t* uses);
+
+void ngx_buffer_cache_get_shard_stats(
+	ngx_buffer_cache_t* cache,
+	ngx_uint_t shard,
+	ngx_buffer_cache_stats_t* stats);
+
 void ngx_buffer_cache_reset_stats(ngx_buffer_cache_t* cache);
 
+// returns the inclusive upper bound of a histogram bucket, must not be called for the last bucket
+ngx_uint_t ngx_buffer_cache_get_histogram_bound(ngx_uint_t index, ngx_uint_t min_bits);
+
 ngx_buffer_cache_t* ngx_buffer_cache_create(
 	ngx_conf_t *cf, 
 	ngx_str_t *name, 
 	size_t size, 
 	time_t expiration, 
+	time_t stale,
+	ngx_uint_t shard_count,
+	ngx_uint_t policy,
 	void *tag);
 
+// limits the entries that are stored in the cache - entries larger than max_entry_size are rejected,
+//	and with BUFFER_CACHE_POLICY_TINYLFU, entries whose key was fetched less than min_uses times are rejected.
+//	zero disables the respective limit
+void ngx_buffer_cache_set_admission(
+	ngx_buffer_cache_t* cache,
+	size_t max_entry_size,
+	ngx_uint_t min_uses);
+
+// sets the file that holds the entries of the cache across restarts - the file is loaded when
+//	the shared memory is created, and written by ngx_buffer_cache_dump
+void ngx_buffer_cache_set_persist_path(ngx_buffer_cache_t* cache, ngx_str_t* path);
+
+// writes the fresh entries of the cache to the persist file, returns NGX_DECLINED
+//	when the cache has no persist file
+ngx_int_t ngx_buffer_cache_dump(ngx_buffer_cache_t* cache, ngx_log_t* log, ngx_uint_t* count);
+
+// adds a table of private copies of the hottest entries in front of the shared memory, in each worker process.
+//	entries up to max_entry_size are copied on fetch, a fetch of a copied entry does not access the tree of the
+//	shard, unless the shard was modified since the entry was copied. count must be a power of 2
+ngx_int_t ngx_buffer_cache_set_local(
+	ngx_conf_t *cf,
+	ngx_buffer_cache_t* cache,
+	ngx_uint_t count,
+	size_t max_entry_size);
+
+// partitions the cache by numa node - each node gets its own copy of the configured shards,
+//	placed in memory local to the node. must be called before the shared memory is initialized
+void ngx_buffer_cache_set_numa(ngx_buffer_cache_t* cache, ngx_uint_t node_count);
+
+ngx_uint_t ngx_buffer_cache_get_numa_node_count(ngx_buffer_cache_t* cache);
+
+// advises the kernel to back the shared memory with transparent huge pages, the boundaries of the numa nodes 
+//	are aligned to the huge page size. must be called before the shared memory is initialized
+void ngx_buffer_cache_set_huge_pages(ngx_buffer_cache_t* cache);
+
+// returns the size of the shared memory that is mapped with huge pages in the calling process,
+//	returns NGX_DECLINED when the cache does not use huge pages
+ngx_int_t ngx_buffer_cache_get_huge_pages_size(ngx_buffer_cache_t* cache, ngx_log_t* log, size_t* size);
+
+// adds a partition to the cache - a separate set of shards that is evicted independently of the cache,
+//	and of the other partitions. the size of the partition is taken from the size of the cache. 
+//	must be called before the shared memory is initialized, the partition is not persisted / copied locally
+ngx_buffer_cache_t* ngx_buffer_cache_add_partition(
+	ngx_conf_t *cf,
+	ngx_buffer_cache_t* cache,
+	ngx_str_t* name,
+	size_t size);
+
+// returns the partition with the given name, or the cache itself, when there is no such partition
+ngx_buffer_cache_t* ngx_buffer_cache_get_partition(ngx_buffer_cache_t* cache, ngx_str_t* name);
+
+// returns the number of partitions of the cache, and sets result to the array of partitions
+ngx_uint_t ngx_buffer_cache_get_partitions(ngx_buffer_cache_t* cache, ngx_buffer_cache_t*** result);
+
+ngx_str_t* ngx_buffer_cache_get_partition_name(ngx_buffer_cache_t* partition);
+
+// returns the number of numa nodes of the machine, 1 when it cannot be determined
+ngx_uint_t ngx_buffer_cache_detect_numa_node_count(ngx_log_t* log);
+
+// sets the numa node of the calling worker process
+void ngx_buffer_cache_init_numa_node(ngx_log_t* log);
+
 #endif // _NGX_BUFFER_CACHE_H_INCLUDED_
@@ -10,15 +10,31 @@
 // constants
 #define CACHE_LOCK_EXPIRATION (5)
 #define ENTRY_LOCK_EXPIRATION (5)
+#define ENTRY_REFRESH_LOCK_EXPIRATION (10)	// a stale entry is refreshed by a single caller during this period
 #define ENTRIES_ALLOC_MARGIN (1024)		// 1K entries ~= 100KB, we reserve this space to make sure allocating entries does not become the bottleneck
 #define BUFFER_ALIGNMENT (16)
 #define MAX_EVICTIONS_PER_STORE (128)
+#define MIN_SHARD_SIZE (256 * 1024)
+#define MAX_UNLOCKED_LOOKUP_DEPTH (128)	// the depth of a red/black tree is at most 2 * log2(n + 1)
+
+#define SKETCH_DEPTH (4)
+#define SKETCH_BYTES_PER_COUNTER (1024)	// shard bytes per sketch column
+#define SKETCH_MIN_WIDTH (256)
+#define SKETCH_MAX_WIDTH (1024 * 1024)
+#define SKETCH_MAX_COUNT (15)
+#define SKETCH_SAMPLE_FACTOR (10)		// the counters are halved every (width * factor) increments
+
+#define LOCAL_TOKEN_FLAG (0x80000000)	// set on the tokens of local entries, the tokens of shared entries are write times
+
+#define BUFFER_CACHE_FILE_MAGIC (0x43444f56)		// VODC
+#define BUFFER_CACHE_FILE_VERSION (1)
 
 // enums
 enum {
 	CES_FREE,
 	CES_ALLOCATED,
 	CES_READY,
+	CES_DETACHED,		// replaced by a newer entry or purged, removed from the tree, freed in write order
 };
 
 // typedefs
@@ -31,14 +47,66 @@ typedef struct {
 	ngx_atomic_t ref_count;
 	time_t access_time;
 	time_t write_time;
+	ngx_atomic_t refresh_time;
+	ngx_rbtree_node_t tag_node;		// the key is the tag of the entry, untagged entries (zero) are not in the tag tree
 	u_char key[BUFFER_CACHE_KEY_SIZE];
 } ngx_buffer_cache_entry_t;
 
+// a private copy of a shared entry, held by a single worker process. the copy is valid as long as 
+//	the version of the shard did not change, or the shared entry still has the same write time
 typedef struct {
+	ngx_queue_t retired_node;
+	struct ngx_buffer_cache_sh_s* sh;
+	ngx_atomic_uint_t version;		// the version of the shard when the entry was last validated
+	time_t write_time;
+	uint32_t token;
+	ngx_uint_t ref_count;
+	ngx_flag_t retired;				// replaced in the table, freed when the last reference is released
+	size_t buffer_size;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* buffer;
+} ngx_buffer_cache_local_entry_t;
+
+typedef struct {
+	ngx_buffer_cache_local_entry_t** entries;		// direct mapped by the hash of the key
+	ngx_uint_t mask;
+	size_t max_entry_size;
+	uint32_t next_token;
+	ngx_queue_t retired;
+} ngx_buffer_cache_local_t;
+
+// count-min sketch of the key access frequency, used by BUFFER_CACHE_POLICY_TINYLFU
+typedef struct {
+	u_char* counters;				// SKETCH_DEPTH rows of width counters
+	ngx_uint_t width_mask;
+	ngx_atomic_t additions;
+	ngx_atomic_t aging;
+	ngx_atomic_uint_t sample_size;
+} ngx_buffer_cache_sketch_t;
+
+// persisted cache file - a header followed by the entries of the shards in write order,
+//	each entry is an ngx_buffer_cache_file_entry_t followed by the data
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} ngx_buffer_cache_file_header_t;
+
+typedef struct {
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	uint64_t write_time;
+	uint64_t size;
+} ngx_buffer_cache_file_entry_t;
+
+typedef struct ngx_buffer_cache_sh_s {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
+	ngx_atomic_t version;			// odd while the shard is being modified
 	ngx_atomic_t reset;
 	time_t access_time;
 	ngx_rbtree_t rbtree;
 	ngx_rbtree_node_t sentinel;
+	ngx_rbtree_t tag_rbtree;		// the tagged entries that are in rbtree, by tag
+	ngx_rbtree_node_t tag_sentinel;
 	ngx_queue_t used_queue;
 	ngx_queue_t free_queue;
 	ngx_buffer_cache_entry_t* entries_start;
@@ -47,14 +115,29 @@ typedef struct {
 	u_char* buffers_end;
 	u_char* buffers_read;
 	u_char* buffers_write;
+	ngx_buffer_cache_sketch_t sketch;
 	ngx_buffer_cache_stats_t stats;
 } ngx_buffer_cache_sh_t;
 
 struct ngx_buffer_cache_s {
-	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_sh_t *sh;		// array of shard_count shards
 	ngx_slab_pool_t *shpool;
 
 	uint32_t expiration;
+	uint32_t stale;
+	ngx_uint_t shard_count;			// total, numa_node_count groups of equal size
+	ngx_uint_t numa_node_count;
+	ngx_flag_t huge_pages;
+	ngx_uint_t policy;
+	size_t max_entry_size;
+	ngx_uint_t min_uses;
+	ngx_str_t persist_path;
+	ngx_buffer_cache_local_t* local;
+
+	// partitions - each partition is a cache object that has its own shards, placed after the shards of the cache
+	ngx_array_t partitions;			// ngx_buffer_cache_t*, set on the cache that owns the shared memory
+	ngx_str_t partition_name;		// set on partitions
+	size_t partition_size;
 
 	ngx_shm_zone_t *shm_zone;
 };
@@ -0,0 +1,223 @@
+#include "ngx_cache_key.h"
+
+// macros
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define READ_LE64(p)								\
+	(((uint64_t)(p)[0])			|					\
+	((uint64_t)(p)[1] << 8)		|					\
+	((uint64_t)(p)[2] << 16)	|					\
+	((uint64_t)(p)[3] << 24)	|					\
+	((uint64_t)(p)[4] << 32)	|					\
+	((uint64_t)(p)[5] << 40)	|					\
+	((uint64_t)(p)[6] << 48)	|					\
+	((uint64_t)(p)[7] << 56))
+
+#define WRITE_LE64(p, v)							\
+	{												\
+		(p)[0] = (u_char)(v);						\
+		(p)[1] = (u_char)((v) >> 8);				\
+		(p)[2] = (u_char)((v) >> 16);				\
+		(p)[3] = (u_char)((v) >> 24);				\
+		(p)[4] = (u_char)((v) >> 32);				\
+		(p)[5] = (u_char)((v) >> 40);				\
+		(p)[6] = (u_char)((v) >> 48);				\
+		(p)[7] = (u_char)((v) >> 56);				\
+	}
+
+#define SIPROUND(v)									\
+	{												\
+		v[0] += v[1];								\
+		v[1] = ROTL64(v[1], 13);					\
+		v[1] ^= v[0];								\
+		v[0] = ROTL64(v[0], 32);					\
+		v[2] += v[3];								\
+		v[3] = ROTL64(v[3], 16);					\
+		v[3] ^= v[2];								\
+		v[0] += v[3];								\
+		v[3] = ROTL64(v[3], 21);					\
+		v[3] ^= v[0];								\
+		v[2] += v[1];								\
+		v[1] = ROTL64(v[1], 17);					\
+		v[1] ^= v[2];								\
+		v[2] = ROTL64(v[2], 32);					\
+	}
+
+// globals
+static uint64_t ngx_cache_key_secret[2];
+static ngx_flag_t ngx_cache_key_secret_initialized = 0;
+
+ngx_int_t
+ngx_cache_key_init_secret(ngx_log_t* log)
+{
+	u_char buf[sizeof(ngx_cache_key_secret)];
+	ngx_fd_t fd;
+	ssize_t n;
+
+	if (ngx_cache_key_secret_initialized)
+	{
+		return NGX_OK;
+	}
+
+	fd = ngx_open_file("/dev/urandom", NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			"ngx_cache_key_init_secret: " ngx_open_file_n " \"/dev/urandom\" failed");
+		return NGX_ERROR;
+	}
+
+	n = ngx_read_fd(fd, buf, sizeof(buf));
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_cache_key_init_secret: " ngx_close_file_n " \"/dev/urandom\" failed");
+	}
+
+	if (n != (ssize_t)sizeof(buf))
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			"ngx_cache_key_init_secret: read from \"/dev/urandom\" failed %z", n);
+		return NGX_ERROR;
+	}
+
+	ngx_cache_key_secret[0] = READ_LE64(buf);
+	ngx_cache_key_secret[1] = READ_LE64(buf + 8);
+	ngx_cache_key_secret_initialized = 1;
+
+	return NGX_OK;
+}
+
+static void
+ngx_siphash_init(ngx_siphash_t* ctx)
+{
+	ctx->v[0] = ngx_cache_key_secret[0] ^ 0x736f6d6570736575ULL;
+	ctx->v[1] = ngx_cache_key_secret[1] ^ 0x646f72616e646f6dULL ^ 0xee;		// 128 bit output
+	ctx->v[2] = ngx_cache_key_secret[0] ^ 0x6c7967656e657261ULL;
+	ctx->v[3] = ngx_cache_key_secret[1] ^ 0x7465646279746573ULL;
+	ctx->len = 0;
+}
+
+static ngx_inline void
+ngx_siphash_compress(uint64_t* v, uint64_t m)
+{
+	v[3] ^= m;
+	SIPROUND(v);
+	SIPROUND(v);
+	v[0] ^= m;
+}
+
+static void
+ngx_siphash_update(ngx_siphash_t* ctx, const u_char* data, size_t size)
+{
+	const u_char* end = data + size;
+	size_t tail_size;
+	size_t copy_size;
+
+	tail_size = ctx->len & 7;
+	ctx->len += size;
+
+	// complete the pending tail
+	if (tail_size > 0)
+	{
+		copy_size = ngx_min(8 - tail_size, size);
+		ngx_memcpy(ctx->tail + tail_size, data, copy_size);
+		data += copy_size;
+
+		if (tail_size + copy_size < 8)
+		{
+			return;
+		}
+
+		ngx_siphash_compress(ctx->v, READ_LE64(ctx->tail));
+	}
+
+	for (; end - data >= 8; data += 8)
+	{
+		ngx_siphash_compress(ctx->v, READ_LE64(data));
+	}
+
+	ngx_memcpy(ctx->tail, data, end - data);
+}
+
+static void
+ngx_siphash_final(u_char result[CACHE_KEY_SIZE], ngx_siphash_t* ctx)
+{
+	uint64_t* v = ctx->v;
+	uint64_t b;
+	size_t tail_size;
+	size_t i;
+
+	b = ctx->len << 56;
+	tail_size = ctx->len & 7;
+	for (i = 0; i < tail_size; i++)
+	{
+		b |= (uint64_t)ctx->tail[i] << (8 * i);
+	}
+
+	ngx_siphash_compress(v, b);
+
+	v[2] ^= 0xee;
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	b = v[0] ^ v[1] ^ v[2] ^ v[3];
+	WRITE_LE64(result, b);
+
+	v[1] ^= 0xdd;
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	b = v[0] ^ v[1] ^ v[2] ^ v[3];
+	WRITE_LE64(result + 8, b);
+}
+
+void
+ngx_cache_key_init(ngx_cache_key_t* ctx, ngx_uint_t type)
+{
+	ctx->type = type;
+
+	switch (type)
+	{
+	case CACHE_KEY_HASH_SIPHASH:
+		ngx_siphash_init(&ctx->u.siphash);
+		break;
+
+	default:
+		ngx_md5_init(&ctx->u.md5);
+		break;
+	}
+}
+
+void
+ngx_cache_key_update(ngx_cache_key_t* ctx, const void* data, size_t size)
+{
+	switch (ctx->type)
+	{
+	case CACHE_KEY_HASH_SIPHASH:
+		ngx_siphash_update(&ctx->u.siphash, data, size);
+		break;
+
+	default:
+		ngx_md5_update(&ctx->u.md5, data, size);
+		break;
+	}
+}
+
+void
+ngx_cache_key_final(u_char result[CACHE_KEY_SIZE], ngx_cache_key_t* ctx)
+{
+	switch (ctx->type)
+	{
+	case CACHE_KEY_HASH_SIPHASH:
+		ngx_siphash_final(result, &ctx->u.siphash);
+		break;
+
+	default:
+		ngx_md5_final(result, &ctx->u.md5);
+		break;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _NGX_CACHE_KEY_H_INCLUDED_
+#define _NGX_CACHE_KEY_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_md5.h>
+
+// constants
+#define CACHE_KEY_SIZE (16)
+
+// enums
+enum {
+	CACHE_KEY_HASH_MD5,
+	CACHE_KEY_HASH_SIPHASH,			// keyed siphash-2-4 with a 128 bit output
+};
+
+// typedefs
+typedef struct {
+	uint64_t v[4];
+	uint64_t len;
+	u_char tail[8];
+} ngx_siphash_t;
+
+typedef struct {
+	ngx_uint_t type;
+	union {
+		ngx_md5_t md5;
+		ngx_siphash_t siphash;
+	} u;
+} ngx_cache_key_t;
+
+// functions
+
+// generates the secret key of the siphash function, the key is generated only once per master process,
+//	so that the keys of the entries that are already in shared memory remain valid after a reload
+ngx_int_t ngx_cache_key_init_secret(ngx_log_t* log);
+
+void ngx_cache_key_init(ngx_cache_key_t* ctx, ngx_uint_t type);
+
+void ngx_cache_key_update(ngx_cache_key_t* ctx, const void* data, size_t size);
+
+void ngx_cache_key_final(u_char result[CACHE_KEY_SIZE], ngx_cache_key_t* ctx);
+
+#endif // _NGX_CACHE_KEY_H_INCLUDED_
@@ -6,19 +6,87 @@
 
 #include "ngx_child_http_request.h"
 #include "ngx_http_vod_module.h"
+#include "ngx_probes.h"
 
 // constants
 #define RANGE_FORMAT "bytes=%O-%O"
 
+#if defined(nginx_version) && nginx_version >= 1013010
+#define NGX_CHILD_REQUEST_HEDGE (1)
+#endif
+
+#define HEDGE_LATENCY_BUCKETS (64)
+#define HEDGE_LATENCY_LINEAR_BUCKETS (16)
+#define HEDGE_MIN_SAMPLES (100)
+#define HEDGE_SAMPLE_WINDOW (1024)		// the histogram is halved every time it reaches this count
+
+#define SHARED_LIMIT_POLL_INTERVAL (10)		// msec
+
 // macros
 #define is_in_memory(ctx) (ctx->response_buffer != NULL)
 
 // typedefs
+#if (NGX_CHILD_REQUEST_HEDGE)
+typedef struct {
+	ngx_http_request_t* r;
+	ngx_child_request_callback_t callback;
+	void* callback_context;
+	ngx_str_t internal_location;
+	ngx_child_request_params_t params;
+	ngx_buf_t* response_buffer;
+	ngx_event_t timer;
+	ngx_uint_t pending;
+	ngx_flag_t completed;
+} ngx_child_request_hedge_t;
+#endif // NGX_CHILD_REQUEST_HEDGE
+
+typedef struct {
+	ngx_queue_t queue;
+	ngx_str_t location;
+	ngx_uint_t active;
+	ngx_uint_t max_active;			// 0 = unlimited
+	ngx_queue_t waiters;
+	ngx_uint_t waiter_count;
+	ngx_event_t event;
+	ngx_shared_limit_counter_t* shared;
+	ngx_uint_t shared_max_active;
+	ngx_uint_t shared_reserved;		// shared slots that were taken for requests that are about to be sent
+	ngx_event_t poll;
+} ngx_child_request_limit_t;
+
+typedef struct {
+	ngx_child_request_limit_t* limit;
+	ngx_shared_limit_counter_t* shared;
+	ngx_flag_t released;
+} ngx_child_request_slot_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	ngx_child_request_limit_t* limit;		// null once the waiter is removed from the queue
+	ngx_http_request_t* r;
+	ngx_child_request_callback_t callback;
+	void* callback_context;
+	ngx_str_t internal_location;
+	ngx_child_request_params_t params;
+	ngx_buf_t* response_buffer;
+} ngx_child_request_waiter_t;
+
 typedef struct {
 
 	// fixed
 	ngx_child_request_callback_t callback;
 	void* callback_context;
+	ngx_uint_t method;
+	ngx_flag_t allow_not_found;
+	ngx_perf_counters_t* perf_counters;
+	int perf_counter;
+	ngx_perf_counter_context(perf_counter_context);
+	ngx_child_request_slot_t* slot;
+#if (NGX_CHILD_REQUEST_HEDGE)
+	ngx_flag_t background;
+	ngx_child_request_hedge_t* hedge;
+	ngx_msec_t start_time;
+#endif // NGX_CHILD_REQUEST_HEDGE
 
 	// deferred init
 	ngx_buf_t* response_buffer;
@@ -46,6 +114,7 @@ typedef struct {
 
 // constants
 static ngx_str_t ngx_http_vod_head_method = { 4, (u_char *) "HEAD " };
+static ngx_str_t ngx_http_vod_put_method = { 3, (u_char *) "PUT " };
 
 static ngx_str_t range_key = ngx_string("Range");
 static u_char* range_lowcase_key = (u_char*)"range";
@@ -88,36 +157,409 @@ static ngx_child_request_hide_header_t hide_headers[] = {
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 static ngx_hash_t hide_headers_hash;
 
+// the concurrency limits of the internal locations, in the current worker process
+static ngx_queue_t limits;
+
+#if (NGX_CHILD_REQUEST_HEDGE)
+// upstream latency histogram of the current worker process, used to calculate the hedge delay
+static ngx_uint_t hedge_latency_buckets[HEDGE_LATENCY_BUCKETS];
+static ngx_uint_t hedge_latency_count;
+
+// forward declarations
+static void ngx_child_request_hedge_completed(
+	ngx_child_request_context_t* ctx,
+	ngx_int_t rc,
+	ngx_buf_t* b,
+	off_t content_length);
+#endif // NGX_CHILD_REQUEST_HEDGE
+
+static ngx_int_t ngx_child_request_send(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer);
+
+static void ngx_child_request_limit_event_handler(ngx_event_t* ev);
+
 static void
-ngx_child_request_wev_handler(ngx_http_request_t *r)
+ngx_child_request_limit_set_params(ngx_child_request_limit_t* limit, ngx_child_request_params_t* params)
 {
-	ngx_child_request_context_t* ctx;
-	ngx_http_upstream_t *u;
-	ngx_http_request_t* sr;
-	ngx_buf_t* b;
-	ngx_int_t rc;
-	off_t content_length;
+	limit->max_active = params->max_concurrency;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (params->shared_limit == NULL)
+	{
+		limit->shared = NULL;
+		return;
+	}
 
-	// restore the write event handler
-	r->write_event_handler = ctx->original_write_event_handler;
-	ctx->original_write_event_handler = NULL;
+	if (limit->shared == NULL)
+	{
+		// Note: when the zone has no room for the location, only the local limit is applied
+		limit->shared = ngx_shared_limit_get_counter(params->shared_limit, &limit->location);
+		if (limit->shared == NULL)
+		{
+			ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+				"ngx_child_request_limit_set_params: no room for %V in the shared limit zone", &limit->location);
+		}
+	}
 
-	// restore the original context
-	ngx_http_set_ctx(r, ctx->original_context, ngx_http_vod_module);
+	limit->shared_max_active = params->shared_max_concurrency;
+}
 
-	// get the completed upstream
-	sr = ctx->sr;
-	ctx->sr = NULL;
+static ngx_child_request_limit_t*
+ngx_child_request_get_limit(ngx_str_t* location, ngx_child_request_params_t* params, ngx_log_t* log)
+{
+	ngx_child_request_limit_t* limit;
+	ngx_queue_t* q;
 
-	if (sr == NULL)
+	if (limits.next == NULL)
+	{
+		ngx_queue_init(&limits);
+	}
+
+	for (q = ngx_queue_head(&limits); q != ngx_queue_sentinel(&limits); q = ngx_queue_next(q))
+	{
+		limit = ngx_queue_data(q, ngx_child_request_limit_t, queue);
+		if (limit->location.len == location->len &&
+			ngx_memcmp(limit->location.data, location->data, location->len) == 0)
+		{
+			ngx_child_request_limit_set_params(limit, params);
+			return limit;
+		}
+	}
+
+	// Note: the limits are kept for the lifetime of the worker process, there is one per internal location
+	limit = ngx_calloc(sizeof(*limit) + location->len, log);
+	if (limit == NULL)
+	{
+		return NULL;
+	}
+
+	limit->location.data = (u_char*)(limit + 1);
+	limit->location.len = location->len;
+	ngx_memcpy(limit->location.data, location->data, location->len);
+
+	ngx_queue_init(&limit->waiters);
+
+	limit->event.handler = ngx_child_request_limit_event_handler;
+	limit->event.data = limit;
+	limit->event.log = ngx_cycle->log;
+
+	limit->poll.handler = ngx_child_request_limit_event_handler;
+	limit->poll.data = limit;
+	limit->poll.log = ngx_cycle->log;
+	limit->poll.cancelable = 1;
+
+	ngx_child_request_limit_set_params(limit, params);
+
+	ngx_queue_insert_tail(&limits, &limit->queue);
+
+	return limit;
+}
+
+// takes a slot for a request that is about to be sent, returns 0 if the location reached its limits
+static ngx_flag_t
+ngx_child_request_limit_reserve(ngx_child_request_limit_t* limit)
+{
+	if (limit->max_active > 0 && limit->active >= limit->max_active)
+	{
+		return 0;
+	}
+
+	if (limit->shared != NULL)
+	{
+		if (!ngx_shared_limit_try_acquire(limit->shared, limit->shared_max_active))
+		{
+			return 0;
+		}
+
+		limit->shared_reserved++;
+	}
+
+	return 1;
+}
+
+// returns the shared slot that was reserved for a request, if the request failed before taking it
+static void
+ngx_child_request_limit_unreserve(ngx_child_request_limit_t* limit)
+{
+	if (limit->shared_reserved <= 0)
+	{
+		return;
+	}
+
+	limit->shared_reserved--;
+	if (limit->shared != NULL)
+	{
+		ngx_shared_limit_release(limit->shared);
+	}
+}
+
+static void
+ngx_child_request_release_slot(ngx_child_request_slot_t* slot)
+{
+	ngx_child_request_limit_t* limit = slot->limit;
+
+	if (slot->released)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_child_request_wev_handler: unexpected, subrequest is null");
 		return;
 	}
 
+	slot->released = 1;
+	limit->active--;
+
+	if (slot->shared != NULL)
+	{
+		ngx_shared_limit_release(slot->shared);
+	}
+
+	// Note: the waiters are started from a posted event, since the completing request may be 
+	//		in the middle of its finalization
+	if (!ngx_queue_empty(&limit->waiters) && !limit->event.posted)
+	{
+		ngx_post_event(&limit->event, &ngx_posted_events);
+	}
+}
+
+static void
+ngx_child_request_slot_cleanup(void* data)
+{
+	// Note: releases the slot in case the subrequest did not complete (e.g. the request was terminated)
+	ngx_child_request_release_slot(data);
+}
+
+static ngx_int_t
+ngx_child_request_acquire_slot(
+	ngx_http_request_t *r,
+	ngx_child_request_context_t* child_ctx,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params)
+{
+	ngx_child_request_limit_t* limit;
+	ngx_child_request_slot_t* slot;
+	ngx_pool_cleanup_t* cln;
+
+	limit = ngx_child_request_get_limit(internal_location, params, r->connection->log);
+	if (limit == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_acquire_slot: ngx_child_request_get_limit failed");
+		return NGX_ERROR;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(*slot));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_acquire_slot: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	slot = cln->data;
+	slot->limit = limit;
+	slot->shared = limit->shared;
+	slot->released = 0;
+
+	cln->handler = ngx_child_request_slot_cleanup;
+
+	limit->active++;
+	child_ctx->slot = slot;
+
+	if (limit->shared != NULL)
+	{
+		// Note: requests that did not wait for the slot (hedges) take a shared slot even when the limit is reached
+		if (limit->shared_reserved > 0)
+		{
+			limit->shared_reserved--;
+		}
+		else
+		{
+			ngx_shared_limit_acquire(limit->shared);
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_child_request_waiter_cleanup(void* data)
+{
+	ngx_child_request_waiter_t* waiter = data;
+
+	if (waiter->limit != NULL)
+	{
+		ngx_queue_remove(&waiter->queue);
+		waiter->limit->waiter_count--;
+
+		if (waiter->limit->shared != NULL)
+		{
+			(void)ngx_atomic_fetch_add(&waiter->limit->shared->queued, -1);
+		}
+
+		waiter->limit = NULL;
+	}
+}
+
+// queues the request if the internal location reached its concurrency limit
+static ngx_int_t
+ngx_child_request_wait_for_slot(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer,
+	ngx_child_request_limit_t** result)
+{
+	ngx_child_request_waiter_t* waiter;
+	ngx_child_request_limit_t* limit;
+	ngx_pool_cleanup_t* cln;
+
+	limit = ngx_child_request_get_limit(internal_location, params, r->connection->log);
+	if (limit == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_wait_for_slot: ngx_child_request_get_limit failed");
+		return NGX_ERROR;
+	}
+
+	// Note: requests that arrive while others are waiting are queued behind them
+	if (ngx_queue_empty(&limit->waiters) && ngx_child_request_limit_reserve(limit))
+	{
+		*result = limit;
+		return NGX_DECLINED;
+	}
+
+	if (params->max_queued > 0 && limit->waiter_count >= params->max_queued)
+	{
+		if (limit->shared != NULL)
+		{
+			(void)ngx_atomic_fetch_add(&limit->shared->rejected, 1);
+		}
+
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"ngx_child_request_wait_for_slot: %ui requests are waiting for %V, request rejected", 
+			limit->waiter_count, internal_location);
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(*waiter));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_wait_for_slot: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	waiter = cln->data;
+	waiter->limit = limit;
+	waiter->r = r;
+	waiter->callback = callback;
+	waiter->callback_context = callback_context;
+	waiter->internal_location = *internal_location;
+	waiter->params = *params;
+	waiter->response_buffer = response_buffer;
+
+	cln->handler = ngx_child_request_waiter_cleanup;
+
+	ngx_queue_insert_tail(&limit->waiters, &waiter->queue);
+	limit->waiter_count++;
+
+	if (limit->shared != NULL)
+	{
+		(void)ngx_atomic_fetch_add(&limit->shared->queued, 1);
+		(void)ngx_atomic_fetch_add(&limit->shared->waited, 1);
+
+		if (!limit->poll.timer_set)
+		{
+			ngx_add_timer(&limit->poll, SHARED_LIMIT_POLL_INTERVAL);
+		}
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_child_request_wait_for_slot: %ui requests in flight to %V, request queued", 
+		limit->active, internal_location);
+
+	return NGX_AGAIN;
+}
+
+static void
+ngx_child_request_limit_event_handler(ngx_event_t* ev)
+{
+	ngx_child_request_waiter_t* waiter;
+	ngx_child_request_limit_t* limit = ev->data;
+	ngx_http_request_t* r;
+	ngx_connection_t* c;
+	ngx_queue_t* q;
+	ngx_int_t rc;
+
+	while (!ngx_queue_empty(&limit->waiters) && ngx_child_request_limit_reserve(limit))
+	{
+		q = ngx_queue_head(&limit->waiters);
+		ngx_queue_remove(q);
+		limit->waiter_count--;
+
+		if (limit->shared != NULL)
+		{
+			(void)ngx_atomic_fetch_add(&limit->shared->queued, -1);
+		}
+
+		waiter = ngx_queue_data(q, ngx_child_request_waiter_t, queue);
+		waiter->limit = NULL;
+
+		r = waiter->r;
+		c = r->connection;
+
+		rc = ngx_child_request_send(
+			r,
+			waiter->callback,
+			waiter->callback_context,
+			&waiter->internal_location,
+			&waiter->params,
+			waiter->response_buffer);
+
+		ngx_child_request_limit_unreserve(limit);
+
+		if (rc != NGX_AGAIN)
+		{
+			ngx_log_error(NGX_LOG_ERR, c->log, 0,
+				"ngx_child_request_limit_event_handler: failed to send the queued request %i", rc);
+
+			if (waiter->callback != NULL)
+			{
+				waiter->callback(waiter->callback_context, rc != NGX_OK ? rc : NGX_ERROR, NULL, 0);
+			}
+			else
+			{
+				ngx_http_finalize_request(r, rc != NGX_OK ? rc : NGX_ERROR);
+			}
+		}
+
+		ngx_http_run_posted_requests(c);
+	}
+
+	// Note: the completions of other worker processes are not notified, poll until the queue drains
+	if (limit->shared != NULL && !ngx_queue_empty(&limit->waiters) && !limit->poll.timer_set)
+	{
+		ngx_add_timer(&limit->poll, SHARED_LIMIT_POLL_INTERVAL);
+	}
+}
+
+// gets the result of a completed subrequest, returns NGX_ABORT if the completion state is invalid
+static ngx_int_t
+ngx_child_request_get_result(
+	ngx_child_request_context_t* ctx,
+	ngx_http_request_t *sr,
+	ngx_buf_t** result_buf,
+	off_t* result_length)
+{
+	ngx_http_upstream_t *u;
+	ngx_buf_t* b;
+	ngx_int_t rc;
+	off_t content_length;
+
 	u = sr->upstream;
 
 #if defined(nginx_version) && nginx_version >= 1013010
@@ -125,9 +567,9 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 	{
 		if (sr->out == NULL || sr->out->buf == NULL)
 		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_child_request_wev_handler: unexpected, output buffer is null");
-			return;
+			ngx_log_error(NGX_LOG_ERR, sr->connection->log, 0,
+				"ngx_child_request_get_result: unexpected, output buffer is null");
+			return NGX_ABORT;
 		}
 
 		b = sr->out->buf;
@@ -139,32 +581,14 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 #else
 	if (u == NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_child_request_wev_handler: unexpected, upstream is null");
-		return;
+		ngx_log_error(NGX_LOG_ERR, sr->connection->log, 0,
+			"ngx_child_request_get_result: unexpected, upstream is null");
+		return NGX_ABORT;
 	}
 
 	b = &u->buffer;
 #endif
 
-	// code taken from echo-nginx-module to work around nginx subrequest issues
-	if (r == r->connection->data && r->postponed) {
-
-		if (r->postponed->request) {
-			r->connection->data = r->postponed->request;
-
-#if defined(nginx_version) && nginx_version >= 8012
-			ngx_http_post_request(r->postponed->request, NULL);
-#else
-			ngx_http_post_request(r->postponed->request);
-#endif
-
-		}
-		else {
-			ngx_http_output_filter(r, NULL);
-		}
-	}
-
 	// get the final error code
 	rc = ctx->error_code;
 	if (rc == NGX_OK && is_in_memory(ctx) && u != NULL)
@@ -175,8 +599,8 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 		case NGX_HTTP_PARTIAL_CONTENT:
 			if (u->headers_in.content_length_n > 0 && u->headers_in.content_length_n != b->last - b->pos)
 			{
-				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-					"ngx_child_request_wev_handler: upstream connection was closed with %O bytes left to read", 
+				ngx_log_error(NGX_LOG_ERR, sr->connection->log, 0,
+					"ngx_child_request_get_result: upstream connection was closed with %O bytes left to read", 
 					u->headers_in.content_length_n - (b->last - b->pos));
 				rc = NGX_HTTP_BAD_GATEWAY;
 			}
@@ -188,16 +612,32 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 			b->last = b->pos;
 			break;
 
+		case NGX_HTTP_CREATED:
+		case NGX_HTTP_NO_CONTENT:
+			if (ctx->method == NGX_HTTP_PUT)
+			{
+				break;
+			}
+			// fall through
+
 		default:
+			if (u->headers_in.status_n == NGX_HTTP_NOT_FOUND && ctx->allow_not_found)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+					"ngx_child_request_get_result: upstream returned not found");
+				rc = NGX_HTTP_NOT_FOUND;
+				break;
+			}
+
 			if (u->headers_in.status_n != 0)
 			{
-				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-					"ngx_child_request_wev_handler: upstream returned a bad status %ui", u->headers_in.status_n);
+				ngx_log_error(NGX_LOG_ERR, sr->connection->log, 0,
+					"ngx_child_request_get_result: upstream returned a bad status %ui", u->headers_in.status_n);
 			}
 			else
 			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_child_request_wev_handler: failed to get upstream status");
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+					"ngx_child_request_get_result: failed to get upstream status");
 			}
 			rc = NGX_HTTP_BAD_GATEWAY;
 			break;
@@ -205,8 +645,8 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 	}
 	else if (rc == NGX_ERROR)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_child_request_wev_handler: got error -1, changing to 502");
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+			"ngx_child_request_get_result: got error -1, changing to 502");
 		rc = NGX_HTTP_BAD_GATEWAY;
 	}
 
@@ -215,19 +655,85 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 		rc = ctx->send_header_result;
 	}
 
-	// get the content length
-	if (is_in_memory(ctx))
+	// get the content length
+	if (is_in_memory(ctx))
+	{
+		content_length = b->last - b->pos;
+	}
+	else if (u != NULL && u->state != NULL)
+	{
+		content_length = u->state->response_length;
+	}
+	else
+	{
+		content_length = 0;
+	}
+
+	*result_buf = b;
+	*result_length = content_length;
+	return rc;
+}
+
+static void
+ngx_child_request_wev_handler(ngx_http_request_t *r)
+{
+	ngx_child_request_context_t* ctx;
+	ngx_http_request_t* sr;
+	ngx_buf_t* b;
+	ngx_int_t rc;
+	off_t content_length;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	// restore the write event handler
+	r->write_event_handler = ctx->original_write_event_handler;
+	ctx->original_write_event_handler = NULL;
+
+	// restore the original context
+	ngx_http_set_ctx(r, ctx->original_context, ngx_http_vod_module);
+
+	// get the completed upstream
+	sr = ctx->sr;
+	ctx->sr = NULL;
+
+	if (sr == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_child_request_wev_handler: unexpected, subrequest is null");
+		return;
+	}
+
+	rc = ngx_child_request_get_result(ctx, sr, &b, &content_length);
+	if (rc == NGX_ABORT)
 	{
-		content_length = b->last - b->pos;
+		return;
 	}
-	else if (u != NULL && u->state != NULL)
-	{
-		content_length = u->state->response_length;
+
+	// code taken from echo-nginx-module to work around nginx subrequest issues
+	if (r == r->connection->data && r->postponed) {
+
+		if (r->postponed->request) {
+			r->connection->data = r->postponed->request;
+
+#if defined(nginx_version) && nginx_version >= 8012
+			ngx_http_post_request(r->postponed->request, NULL);
+#else
+			ngx_http_post_request(r->postponed->request);
+#endif
+
+		}
+		else {
+			ngx_http_output_filter(r, NULL);
+		}
 	}
-	else
+
+#if (NGX_CHILD_REQUEST_HEDGE)
+	if (ctx->hedge != NULL)
 	{
-		content_length = 0;
+		ngx_child_request_hedge_completed(ctx, rc, b, content_length);
+		return;
 	}
+#endif // NGX_CHILD_REQUEST_HEDGE
 
 	if (ctx->callback != NULL)
 	{
@@ -258,6 +764,10 @@ ngx_child_request_finished_handler(
 {
 	ngx_http_request_t          *pr;
 	ngx_child_request_context_t* ctx;
+#if (NGX_CHILD_REQUEST_HEDGE)
+	ngx_buf_t* b;
+	off_t content_length;
+#endif // NGX_CHILD_REQUEST_HEDGE
 
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 		"ngx_child_request_finished_handler: error code %i", rc);
@@ -277,6 +787,45 @@ ngx_child_request_finished_handler(
 	ctx->sr = r;
 	ctx->error_code = rc;
 
+	ngx_vod_probe3(child_request_done, r, rc, r->headers_out.status);
+
+	if (ctx->slot != NULL)
+	{
+		ngx_child_request_release_slot(ctx->slot);
+	}
+
+	// update the upstream perf counters, media requests that were sent over a cached connection are
+	// counted separately to make the upstream keepalive usage measurable
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter);
+
+	if (ctx->perf_counter == PC_FETCH_UPSTREAM && 
+		r->upstream != NULL && r->upstream->peer.cached)
+	{
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_FETCH_UPSTREAM_KEEPALIVE);
+	}
+
+#if (NGX_CHILD_REQUEST_HEDGE)
+	// background requests are completed here, without waking up the parent request, 
+	//	since the parent may be in the middle of another child request
+	if (ctx->background)
+	{
+		rc = ngx_child_request_get_result(ctx, r, &b, &content_length);
+		if (rc != NGX_ABORT)
+		{
+			ctx->callback(ctx->callback_context, rc, b, content_length);
+		}
+		return NGX_OK;
+	}
+
+	// hedged attempts that complete after the winning attempt are finalized here as well,
+	//	the parent request may already be running another child request / finalized
+	if (ctx->hedge != NULL && ctx->hedge->completed)
+	{
+		ngx_child_request_hedge_completed(ctx, rc, NULL, 0);
+		return NGX_OK;
+	}
+#endif // NGX_CHILD_REQUEST_HEDGE
+
 	if (ctx->original_write_event_handler != NULL)
 	{
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -295,6 +844,15 @@ ngx_child_request_finished_handler(
 	ctx->original_context = ngx_http_get_module_ctx(pr, ngx_http_vod_module);
 	ngx_http_set_ctx(pr, ctx, ngx_http_vod_module);
 
+#if (NGX_CHILD_REQUEST_HEDGE)
+	// nginx does not wake up the parent of a background subrequest
+	if (r->background)
+	{
+		ngx_http_post_request(pr, NULL);
+		return NGX_OK;
+	}
+#endif // NGX_CHILD_REQUEST_HEDGE
+
 	// work-around issues in nginx's event module (from echo-nginx-module)
 	if (r != r->connection->data
 		&& r->postponed
@@ -545,14 +1103,15 @@ ngx_child_request_copy_headers(
 	return NGX_OK;
 }
 
-ngx_int_t
-ngx_child_request_start(
+static ngx_int_t
+ngx_child_request_create(
 	ngx_http_request_t *r,
 	ngx_child_request_callback_t callback,
 	void* callback_context,
 	ngx_str_t* internal_location,
 	ngx_child_request_params_t* params,
-	ngx_buf_t* response_buffer)
+	ngx_buf_t* response_buffer,
+	void* hedge)
 {
 	ngx_child_request_context_t* child_ctx;
 	ngx_http_post_subrequest_t *psr;
@@ -573,7 +1132,25 @@ ngx_child_request_start(
 
 	child_ctx->callback = callback;
 	child_ctx->callback_context = callback_context;
+	child_ctx->method = params->method;
+	child_ctx->allow_not_found = params->allow_not_found;
 	child_ctx->response_buffer = response_buffer;
+	child_ctx->perf_counters = params->perf_counters;
+	child_ctx->perf_counter = params->perf_counter;
+
+	if (params->max_concurrency > 0 || params->shared_limit != NULL)
+	{
+		rc = ngx_child_request_acquire_slot(r, child_ctx, internal_location, params);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+#if (NGX_CHILD_REQUEST_HEDGE)
+	child_ctx->background = params->background;
+	child_ctx->hedge = hedge;
+	child_ctx->start_time = ngx_current_msec;
+#endif // NGX_CHILD_REQUEST_HEDGE
 
 #if defined(nginx_version) && nginx_version >= 1013010
 	if (response_buffer != NULL)
@@ -626,6 +1203,15 @@ ngx_child_request_start(
 		}
 
 		flags = NGX_HTTP_SUBREQUEST_WAITED | NGX_HTTP_SUBREQUEST_IN_MEMORY;
+
+#if (NGX_CHILD_REQUEST_HEDGE)
+		// Note: hedged requests must not block the output of the parent request, since the losing 
+		//	request may remain active long after the parent request continued
+		if (hedge != NULL || params->background)
+		{
+			flags |= NGX_HTTP_SUBREQUEST_BACKGROUND;
+		}
+#endif // NGX_CHILD_REQUEST_HEDGE
 	}
 	else
 	{
@@ -651,10 +1237,27 @@ ngx_child_request_start(
 	}
 
 	// Note: ngx_http_subrequest always sets the subrequest method to GET
-	if (params->method == NGX_HTTP_HEAD)
+	switch (params->method)
 	{
+	case NGX_HTTP_HEAD:
 		sr->method = NGX_HTTP_HEAD;
 		sr->method_name = ngx_http_vod_head_method;
+		break;
+
+	case NGX_HTTP_PUT:
+		sr->method = NGX_HTTP_PUT;
+		sr->method_name = ngx_http_vod_put_method;
+
+		sr->request_body = ngx_pcalloc(r->pool, sizeof(*sr->request_body));
+		if (sr->request_body == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_child_request_start: ngx_pcalloc failed (2)");
+			return NGX_ERROR;
+		}
+
+		sr->request_body->bufs = params->request_body;
+		break;
 	}
 	
 	// build the request headers
@@ -664,12 +1267,388 @@ ngx_child_request_start(
 		return rc;
 	}
 
+	if (params->method == NGX_HTTP_PUT)
+	{
+		// the proxy module sends the content length of the subrequest body
+		sr->headers_in.content_length = NULL;
+		sr->headers_in.content_length_n = params->request_body_length;
+	}
+
+	ngx_perf_counter_start(child_ctx->perf_counter_context);
+
+	ngx_vod_probe4(child_request_start, r, sr, uri.data, uri.len);
+
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 		"ngx_child_request_start: completed successfully sr=%p", sr);
 
 	return NGX_AGAIN;
 }
 
+#if (NGX_CHILD_REQUEST_HEDGE)
+static ngx_uint_t
+ngx_child_request_get_latency_bucket(ngx_msec_t latency)
+{
+	ngx_uint_t result;
+	ngx_uint_t bits;
+
+	// linear buckets for low latencies, 4 buckets per power of 2 above them
+	if (latency < HEDGE_LATENCY_LINEAR_BUCKETS)
+	{
+		return latency;
+	}
+
+	for (bits = 4; bits < 8 * sizeof(latency) - 1 && (latency >> (bits + 1)) != 0; bits++);
+
+	result = HEDGE_LATENCY_LINEAR_BUCKETS + (bits - 4) * 4 + ((latency >> (bits - 2)) & 3);
+
+	return ngx_min(result, HEDGE_LATENCY_BUCKETS - 1);
+}
+
+static ngx_msec_t
+ngx_child_request_get_bucket_upper_bound(ngx_uint_t bucket)
+{
+	ngx_uint_t bits;
+
+	if (bucket < HEDGE_LATENCY_LINEAR_BUCKETS)
+	{
+		return bucket + 1;
+	}
+
+	bucket -= HEDGE_LATENCY_LINEAR_BUCKETS;
+	bits = bucket / 4 + 4;
+
+	return ((ngx_msec_t)(4 + bucket % 4 + 1)) << (bits - 2);
+}
+
+static void
+ngx_child_request_add_latency_sample(ngx_msec_t latency)
+{
+	ngx_uint_t i;
+
+	hedge_latency_buckets[ngx_child_request_get_latency_bucket(latency)]++;
+	hedge_latency_count++;
+
+	if (hedge_latency_count < HEDGE_SAMPLE_WINDOW)
+	{
+		return;
+	}
+
+	// decay the old samples
+	hedge_latency_count = 0;
+	for (i = 0; i < HEDGE_LATENCY_BUCKETS; i++)
+	{
+		hedge_latency_buckets[i] /= 2;
+		hedge_latency_count += hedge_latency_buckets[i];
+	}
+}
+
+static ngx_msec_t
+ngx_child_request_get_hedge_delay(ngx_child_request_params_t* params)
+{
+	ngx_msec_t result;
+	ngx_uint_t threshold;
+	ngx_uint_t sum;
+	ngx_uint_t i;
+
+	// not enough samples, use the max delay
+	if (hedge_latency_count < HEDGE_MIN_SAMPLES)
+	{
+		return params->hedge_max_delay;
+	}
+
+	threshold = (hedge_latency_count * params->hedge_percentile + 99) / 100;
+	sum = 0;
+	for (i = 0; i < HEDGE_LATENCY_BUCKETS - 1; i++)
+	{
+		sum += hedge_latency_buckets[i];
+		if (sum >= threshold)
+		{
+			break;
+		}
+	}
+
+	result = ngx_child_request_get_bucket_upper_bound(i);
+
+	if (result < params->hedge_min_delay)
+	{
+		return params->hedge_min_delay;
+	}
+
+	if (result > params->hedge_max_delay)
+	{
+		return params->hedge_max_delay;
+	}
+
+	return result;
+}
+
+static ngx_int_t
+ngx_child_request_hedge_start_attempt(ngx_child_request_hedge_t* hedge)
+{
+	ngx_buf_t* b;
+	ngx_int_t rc;
+
+	// each attempt gets a private buffer, the response of the first attempt that completes is copied 
+	//	to the buffer of the caller
+	b = ngx_create_temp_buf(hedge->r->pool, hedge->response_buffer->end - hedge->response_buffer->last);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, hedge->r->connection->log, 0,
+			"ngx_child_request_hedge_start_attempt: ngx_create_temp_buf failed");
+		return NGX_ERROR;
+	}
+
+	rc = ngx_child_request_create(
+		hedge->r,
+		hedge->callback,
+		hedge->callback_context,
+		&hedge->internal_location,
+		&hedge->params,
+		b,
+		hedge);
+	if (rc == NGX_AGAIN)
+	{
+		hedge->pending++;
+	}
+
+	return rc;
+}
+
+static void
+ngx_child_request_hedge_timer_handler(ngx_event_t *ev)
+{
+	ngx_child_request_hedge_t* hedge = ev->data;
+	ngx_connection_t* c;
+	ngx_int_t rc;
+
+	if (hedge->completed)
+	{
+		return;
+	}
+
+	c = hedge->r->connection;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+		"ngx_child_request_hedge_timer_handler: sending a hedged request");
+
+	rc = ngx_child_request_hedge_start_attempt(hedge);
+	if (rc != NGX_AGAIN)
+	{
+		// keep waiting for the original request
+		ngx_log_error(NGX_LOG_WARN, c->log, 0,
+			"ngx_child_request_hedge_timer_handler: failed to send the hedged request %i", rc);
+		return;
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_child_request_hedge_cleanup(void* data)
+{
+	ngx_child_request_hedge_t* hedge = data;
+
+	if (hedge->timer.timer_set)
+	{
+		ngx_del_timer(&hedge->timer);
+	}
+}
+
+static void
+ngx_child_request_hedge_completed(
+	ngx_child_request_context_t* ctx,
+	ngx_int_t rc,
+	ngx_buf_t* b,
+	off_t content_length)
+{
+	ngx_child_request_hedge_t* hedge = ctx->hedge;
+	ngx_buf_t* target = hedge->response_buffer;
+
+	hedge->pending--;
+
+	ngx_child_request_add_latency_sample(ngx_current_msec - ctx->start_time);
+
+	if (hedge->completed || (rc != NGX_OK && hedge->pending > 0))
+	{
+		// the request was already completed by another attempt / let the other attempt complete
+		ngx_pfree(hedge->r->pool, ctx->response_buffer->start);
+		return;
+	}
+
+	hedge->completed = 1;
+
+	if (hedge->timer.timer_set)
+	{
+		ngx_del_timer(&hedge->timer);
+	}
+
+	if (b != NULL)
+	{
+		target->last = ngx_copy(target->last, b->pos, b->last - b->pos);
+	}
+
+	ngx_pfree(hedge->r->pool, ctx->response_buffer->start);
+
+	hedge->callback(hedge->callback_context, rc, target, content_length);
+}
+
+// sends the request, and if it does not complete within the hedge delay, sends a duplicate request,
+//	the first successful response is returned to the caller
+static ngx_int_t
+ngx_child_request_start_hedged(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer)
+{
+	ngx_child_request_hedge_t* hedge;
+	ngx_pool_cleanup_t* cln;
+	ngx_int_t rc;
+
+	hedge = ngx_pcalloc(r->pool, sizeof(*hedge));
+	if (hedge == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_start_hedged: ngx_pcalloc failed");
+		return NGX_ERROR;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_start_hedged: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	hedge->r = r;
+	hedge->callback = callback;
+	hedge->callback_context = callback_context;
+	hedge->internal_location = *internal_location;
+	hedge->params = *params;
+	hedge->response_buffer = response_buffer;
+
+	hedge->timer.handler = ngx_child_request_hedge_timer_handler;
+	hedge->timer.data = hedge;
+	hedge->timer.log = r->connection->log;
+
+	cln->handler = ngx_child_request_hedge_cleanup;
+	cln->data = hedge;
+
+	rc = ngx_child_request_hedge_start_attempt(hedge);
+	if (rc != NGX_AGAIN)
+	{
+		return rc;
+	}
+
+	ngx_add_timer(&hedge->timer, ngx_child_request_get_hedge_delay(params));
+
+	return NGX_AGAIN;
+}
+#endif // NGX_CHILD_REQUEST_HEDGE
+
+static ngx_int_t
+ngx_child_request_send(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer)
+{
+#if (NGX_CHILD_REQUEST_HEDGE)
+	if (params->hedge_percentile > 0 &&
+		!params->background &&
+		params->method == NGX_HTTP_GET &&
+		callback != NULL &&
+		response_buffer != NULL)
+	{
+		return ngx_child_request_start_hedged(
+			r,
+			callback,
+			callback_context,
+			internal_location,
+			params,
+			response_buffer);
+	}
+#endif // NGX_CHILD_REQUEST_HEDGE
+
+	return ngx_child_request_create(
+		r,
+		callback,
+		callback_context,
+		internal_location,
+		params,
+		response_buffer,
+		NULL);
+}
+
+ngx_int_t
+ngx_child_request_start(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer)
+{
+	ngx_child_request_limit_t* limit;
+	ngx_int_t rc;
+
+	if (params->background && (callback == NULL || response_buffer == NULL))
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_child_request_start: background requests must have a callback and a response buffer");
+		return NGX_ERROR;
+	}
+
+#if !(NGX_CHILD_REQUEST_HEDGE)
+	if (params->background)
+	{
+		// background subrequests are not supported by this version of nginx
+		return NGX_DECLINED;
+	}
+#endif // NGX_CHILD_REQUEST_HEDGE
+
+	if (params->max_concurrency > 0 || params->shared_limit != NULL)
+	{
+		rc = ngx_child_request_wait_for_slot(
+			r,
+			callback,
+			callback_context,
+			internal_location,
+			params,
+			response_buffer,
+			&limit);
+		if (rc != NGX_DECLINED)
+		{
+			return rc;
+		}
+
+		rc = ngx_child_request_send(
+			r,
+			callback,
+			callback_context,
+			internal_location,
+			params,
+			response_buffer);
+
+		ngx_child_request_limit_unreserve(limit);
+
+		return rc;
+	}
+
+	return ngx_child_request_send(
+		r,
+		callback,
+		callback_context,
+		internal_location,
+		params,
+		response_buffer);
+}
+
 static ngx_int_t
 ngx_child_request_header_filter(ngx_http_request_t *r)
 {
@@ -3,6 +3,8 @@
 
 // includes
 #include <ngx_http.h>
+#include "ngx_perf_counters.h"
+#include "ngx_shared_limit.h"
 
 // typedefs
 typedef void(*ngx_child_request_callback_t)(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
@@ -16,6 +18,19 @@ typedef struct {
 	ngx_table_elt_t extra_header;
 	ngx_flag_t proxy_range;
 	ngx_flag_t proxy_all_headers;
+	ngx_flag_t allow_not_found;		// return NGX_HTTP_NOT_FOUND without logging an error on 404
+	ngx_chain_t* request_body;		// PUT only
+	off_t request_body_length;
+	ngx_perf_counters_t* perf_counters;		// optional, measures the upstream requests and their connection reuse
+	int perf_counter;			// the counter (PC_xxx) that measures the request, used when perf_counters is set
+	ngx_uint_t hedge_percentile;		// GET with response buffer only, 0 = disabled
+	ngx_msec_t hedge_min_delay;
+	ngx_msec_t hedge_max_delay;
+	ngx_flag_t background;		// the parent request does not wait for the response, requires a callback and a response buffer
+	ngx_uint_t max_concurrency;		// max requests in flight to the internal location per worker process, 0 = unlimited
+	ngx_shared_limit_t* shared_limit;		// optional, limits the requests in flight to the internal location across workers
+	ngx_uint_t shared_max_concurrency;		// max requests in flight to the internal location, used when shared_limit is set
+	ngx_uint_t max_queued;		// max requests waiting for a slot of the internal location per worker process, 0 = unlimited
 } ngx_child_request_params_t;
 
 // functions
@@ -26,6 +41,18 @@ typedef struct {
 //	2. response_buffer is optional, if it is not supplied, the upstream response gets written
 //		to the parent request. when a response buffer is supplied, the response is written to it, 
 //		the buffer should be large enough to contain both the response body and the response headers.
+//	3. when hedge_percentile is set, a duplicate request is sent if the response did not arrive within
+//		the specified percentile of the recent upstream latencies (clamped to hedge_min/max_delay),
+//		the first successful response is returned.
+//	4. background requests do not wake up the parent request when they complete, the callback is
+//		called from the completion of the subrequest, and must not resume the state of the parent.
+//		NGX_DECLINED is returned if the nginx version does not support background subrequests.
+//	5. when max_concurrency is set and the internal location has max_concurrency requests in flight,
+//		the request is queued and sent once another request to the location completes. if the queued 
+//		request can not be sent, the callback is called with the error (or the request is finalized).
+//		the same applies to shared_max_concurrency, across all the worker processes - since the workers 
+//		are not notified of the completions of other workers, the queue is polled periodically.
+//		when the queue has max_queued requests, NGX_HTTP_SERVICE_UNAVAILABLE is returned.
 ngx_int_t ngx_child_request_start(
 	ngx_http_request_t *r,
 	ngx_child_request_callback_t callback,
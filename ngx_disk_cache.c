@@ -0,0 +1,390 @@
+#include "ngx_disk_cache.h"
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif // NGX_THREADS
+
+/*
+	Disk cache - a persistent second tier that can be placed behind a buffer cache.
+
+	Each entry is saved as a separate file in the cache directory, the name of the file is the hex 
+	representation of the cache key. The file contains a small header followed by the entry data.
+	Stores write the data to a temporary file and rename it to its final name, so that a concurrent
+	fetch (possibly from another worker process) never sees a partially written entry.
+	The header holds the time the entry was written, so that the expiration of the owning buffer cache
+	is applied to the entries of the disk cache as well.
+
+	When a thread pool is passed to ngx_disk_cache_store, the data is copied to a pool that is owned by
+	the write, and the file is written on the thread pool (write-behind). Fetches are synchronous, the caller
+	is expected to run them on a thread pool when the disk may be slow.
+
+	The cache does not manage the size of the directory / evict entries, old files can be deleted 
+	externally at any time (e.g. by a cron job).
+*/
+
+// constants
+#define DISK_CACHE_MAGIC (0x63646f76)		// vodc
+#define DISK_CACHE_VERSION (2)
+
+// typedefs
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t time;				// the time the entry was written
+} ngx_disk_cache_header_t;
+
+typedef struct {
+	ngx_pool_t* pool;
+	ngx_str_t path;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t data;
+} ngx_disk_cache_write_ctx_t;
+
+// globals
+static ngx_atomic_t ngx_disk_cache_temp_index;
+
+static u_char*
+ngx_disk_cache_get_file_name(ngx_pool_t* pool, ngx_str_t* path, u_char* key, size_t extra_size)
+{
+	u_char* result;
+	u_char* p;
+
+	result = ngx_pnalloc(pool, path->len + sizeof("/") - 1 + BUFFER_CACHE_KEY_SIZE * 2 + extra_size + 1);
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	p = ngx_copy(result, path->data, path->len);
+	*p++ = '/';
+	p = ngx_hex_dump(p, key, BUFFER_CACHE_KEY_SIZE);
+	*p = '\0';
+
+	return result;
+}
+
+ngx_flag_t
+ngx_disk_cache_fetch(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* path,
+	u_char* key,
+	time_t expiration,
+	ngx_str_t* buffer)
+{
+	ngx_disk_cache_header_t header;
+	ngx_file_info_t fi;
+	ngx_flag_t result = 0;
+	ngx_fd_t fd;
+	ssize_t n;
+	u_char* name;
+	u_char* data;
+
+	name = ngx_disk_cache_get_file_name(pool, path, key, 0);
+	if (name == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_fetch: ngx_pnalloc failed");
+		return 0;
+	}
+
+	fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		if (ngx_errno != NGX_ENOENT)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+				"ngx_disk_cache_fetch: " ngx_open_file_n " \"%s\" failed", name);
+		}
+		return 0;
+	}
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_fetch: " ngx_fd_info_n " \"%s\" failed", name);
+		goto done;
+	}
+
+	n = ngx_read_fd(fd, &header, sizeof(header));
+	if (n != sizeof(header))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_disk_cache_fetch: failed to read the header of \"%s\"", name);
+		goto done;
+	}
+
+	if (header.magic != DISK_CACHE_MAGIC ||
+		header.version != DISK_CACHE_VERSION ||
+		(off_t)(header.size + sizeof(header)) != ngx_file_size(&fi))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_disk_cache_fetch: invalid header in \"%s\"", name);
+		goto done;
+	}
+
+	if (expiration > 0 && (time_t)header.time + expiration < ngx_time())
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_fetch: \"%s\" expired", name);
+		goto done;
+	}
+
+	data = ngx_palloc(pool, header.size);
+	if (data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_fetch: ngx_palloc failed");
+		goto done;
+	}
+
+	n = ngx_read_fd(fd, data, header.size);
+	if (n < 0 || (uint64_t)n != header.size)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_fetch: failed to read \"%s\"", name);
+		goto done;
+	}
+
+	buffer->data = data;
+	buffer->len = header.size;
+	result = 1;
+
+done:
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_disk_cache_fetch: " ngx_close_file_n " \"%s\" failed", name);
+	}
+
+	return result;
+}
+
+static ngx_flag_t
+ngx_disk_cache_write(ngx_fd_t fd, void* data, size_t size)
+{
+	ssize_t n;
+	u_char* p = data;
+
+	while (size > 0)
+	{
+		n = ngx_write_fd(fd, p, size);
+		if (n <= 0)
+		{
+			return 0;
+		}
+
+		p += n;
+		size -= n;
+	}
+
+	return 1;
+}
+
+static ngx_flag_t
+ngx_disk_cache_write_file(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* path,
+	u_char* key,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_disk_cache_header_t header;
+	ngx_str_t* buffers_end = buffers + buffer_count;
+	ngx_str_t* cur_buffer;
+	ngx_fd_t fd;
+	u_char* temp_name;
+	u_char* name;
+	u_char* p;
+
+	name = ngx_disk_cache_get_file_name(pool, path, key, 0);
+	temp_name = ngx_disk_cache_get_file_name(pool, path, key,
+		sizeof(".") - 1 + NGX_INT_T_LEN + sizeof(".") - 1 + NGX_ATOMIC_T_LEN);
+	if (name == NULL || temp_name == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_write_file: ngx_pnalloc failed");
+		return 0;
+	}
+
+	// the pid and a sequence number are appended to the temp file name, to avoid collisions between
+	// different worker processes / threads
+	p = temp_name + path->len + sizeof("/") - 1 + BUFFER_CACHE_KEY_SIZE * 2;
+	p = ngx_sprintf(p, ".%P.%uA", ngx_pid, ngx_atomic_fetch_add(&ngx_disk_cache_temp_index, 1));
+	*p = '\0';
+
+	header.magic = DISK_CACHE_MAGIC;
+	header.version = DISK_CACHE_VERSION;
+	header.size = 0;
+	header.time = ngx_time();
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		header.size += cur_buffer->len;
+	}
+
+	fd = ngx_open_file(temp_name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_write_file: " ngx_open_file_n " \"%s\" failed", temp_name);
+		return 0;
+	}
+
+	if (!ngx_disk_cache_write(fd, &header, sizeof(header)))
+	{
+		goto failed;
+	}
+
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		if (!ngx_disk_cache_write(fd, cur_buffer->data, cur_buffer->len))
+		{
+			goto failed;
+		}
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_write_file: " ngx_close_file_n " \"%s\" failed", temp_name);
+		goto delete;
+	}
+
+	if (ngx_rename_file(temp_name, name) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_write_file: " ngx_rename_file_n " \"%s\" to \"%s\" failed", temp_name, name);
+		goto delete;
+	}
+
+	return 1;
+
+failed:
+
+	ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+		"ngx_disk_cache_write_file: " ngx_write_fd_n " \"%s\" failed", temp_name);
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_disk_cache_write_file: " ngx_close_file_n " \"%s\" failed", temp_name);
+	}
+
+delete:
+
+	if (ngx_delete_file(temp_name) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_disk_cache_write_file: " ngx_delete_file_n " \"%s\" failed", temp_name);
+	}
+
+	return 0;
+}
+
+#if (NGX_THREADS)
+static void
+ngx_disk_cache_write_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_disk_cache_write_ctx_t* ctx = data;
+
+	(void)ngx_disk_cache_write_file(ctx->pool, log, &ctx->path, ctx->key, &ctx->data, 1);
+}
+
+static void
+ngx_disk_cache_write_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_disk_cache_write_ctx_t* ctx = ev->data;
+
+	// Note: the task is allocated on the pool
+	ngx_destroy_pool(ctx->pool);
+}
+#endif // NGX_THREADS
+
+ngx_flag_t
+ngx_disk_cache_store(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* path,
+	u_char* key,
+	ngx_str_t* buffers,
+	size_t buffer_count,
+	struct ngx_thread_pool_s* thread_pool)
+{
+#if (NGX_THREADS)
+	ngx_disk_cache_write_ctx_t* ctx;
+	ngx_thread_task_t* task;
+	ngx_str_t* buffers_end = buffers + buffer_count;
+	ngx_str_t* cur_buffer;
+	ngx_pool_t* write_pool;
+	size_t size;
+	u_char* p;
+
+	if (thread_pool == NULL)
+	{
+		return ngx_disk_cache_write_file(pool, log, path, key, buffers, buffer_count);
+	}
+
+	size = 0;
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		size += cur_buffer->len;
+	}
+
+	// Note: the write may complete after the request is freed, so it uses its own pool / log
+	write_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+	if (write_pool == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_store: ngx_create_pool failed");
+		return 0;
+	}
+
+	task = ngx_thread_task_alloc(write_pool, sizeof(*ctx));
+	p = ngx_pnalloc(write_pool, path->len + size);
+	if (task == NULL || p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_store: alloc failed");
+		goto failed;
+	}
+
+	ctx = task->ctx;
+	ctx->pool = write_pool;
+	ngx_memcpy(ctx->key, key, sizeof(ctx->key));
+
+	ctx->path.data = p;
+	ctx->path.len = path->len;
+	p = ngx_copy(p, path->data, path->len);
+
+	ctx->data.data = p;
+	ctx->data.len = size;
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		p = ngx_copy(p, cur_buffer->data, cur_buffer->len);
+	}
+
+	task->handler = ngx_disk_cache_write_thread_handler;
+	task->event.data = ctx;
+	task->event.handler = ngx_disk_cache_write_thread_event_handler;
+
+	// Note: the post fails when the queue of the thread pool is full, the entry is not saved in this case
+	if (ngx_thread_task_post(thread_pool, task) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_disk_cache_store: ngx_thread_task_post failed");
+		goto failed;
+	}
+
+	return 1;
+
+failed:
+
+	ngx_destroy_pool(write_pool);
+	return 0;
+#else
+	return ngx_disk_cache_write_file(pool, log, path, key, buffers, buffer_count);
+#endif // NGX_THREADS
+}
@@ -0,0 +1,31 @@
+#ifndef _NGX_DISK_CACHE_H_INCLUDED_
+#define _NGX_DISK_CACHE_H_INCLUDED_
+
+// includes
+#include <ngx_core.h>
+#include "ngx_buffer_cache.h"
+
+// typedefs
+struct ngx_thread_pool_s;
+
+// functions
+// reads the entry synchronously, entries that were written more than expiration seconds ago are ignored (0 = no expiration)
+ngx_flag_t ngx_disk_cache_fetch(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* path,
+	u_char* key,
+	time_t expiration,
+	ngx_str_t* buffer);
+
+// when thread_pool is not null, the buffers are copied and the file is written on the thread pool after the function returns
+ngx_flag_t ngx_disk_cache_store(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* path,
+	u_char* key,
+	ngx_str_t* buffers,
+	size_t buffer_count,
+	struct ngx_thread_pool_s* thread_pool);
+
+#endif // _NGX_DISK_CACHE_H_INCLUDED_
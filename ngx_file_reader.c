@@ -1,6 +1,15 @@
 #include "ngx_file_reader.h"
+#include "ngx_probes.h"
 #include <ngx_event.h>
 
+// typedefs
+struct ngx_file_reader_mapping_s {
+	off_t file_size;
+	u_char* data;
+	size_t size;			// page aligned, the bytes past the end of the file are zero
+	ngx_log_t* log;
+};
+
 static ngx_int_t
 ngx_file_reader_init_open_file_info(
 	ngx_open_file_info_t* of, 
@@ -35,6 +44,8 @@ ngx_file_reader_update_state_file_info(ngx_file_reader_state_t* state, ngx_open_
 {
 	ngx_uint_t level;
 
+	ngx_vod_probe4(file_open, state->r, state->file.name.data, state->file.name.len, rc);
+
 	if (rc != NGX_OK)
 	{
 		switch (of->err)
@@ -114,11 +125,17 @@ ngx_file_reader_init(
 	state->directio = clcf->directio;
 	state->log_not_found = clcf->log_not_found;
 	state->log = r->connection->log;
+	state->mapping = NULL;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif // NGX_HAVE_FILE_AIO
+#if (NGX_HAVE_IO_URING)
+	state->use_io_uring = (flags & OPEN_FILE_IO_URING) != 0;
+#endif // NGX_HAVE_IO_URING
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
-#endif // NGX_HAVE_FILE_AIO
+#endif // NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING
 
 	rc = ngx_file_reader_init_open_file_info(&of, r, clcf, path);
 	if (rc != NGX_OK)
@@ -168,6 +185,7 @@ ngx_file_reader_init_async(
 	ngx_file_reader_state_t* state,
 	void** context,
 	ngx_thread_pool_t *thread_pool,
+	ngx_async_open_file_params_t *open_params,
 	ngx_async_open_file_callback_t open_callback,
 	ngx_async_read_callback_t read_callback,
 	void* callback_context,
@@ -185,11 +203,17 @@ ngx_file_reader_init_async(
 	state->directio = clcf->directio;
 	state->log_not_found = clcf->log_not_found;
 	state->log = r->connection->log;
+	state->mapping = NULL;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif // NGX_HAVE_FILE_AIO
+#if (NGX_HAVE_IO_URING)
+	state->use_io_uring = (flags & OPEN_FILE_IO_URING) != 0;
+#endif // NGX_HAVE_IO_URING
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
-#endif // NGX_HAVE_FILE_AIO
+#endif // NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING
 
 	open_context = *context;
 
@@ -220,6 +244,7 @@ ngx_file_reader_init_async(
 
 	rc = ngx_async_open_cached_file(
 		(flags & OPEN_FILE_NO_CACHE) != 0 ? NULL : clcf->open_file_cache, 
+		open_params,
 		path,
 		&open_context->of,
 		r->pool,
@@ -322,6 +347,116 @@ ngx_file_reader_enable_directio(ngx_file_reader_state_t* state)
 	return NGX_OK;
 }
 
+static void
+ngx_file_reader_unmap(void* data)
+{
+	ngx_file_reader_mapping_t* mapping = data;
+
+	if (munmap(mapping->data, mapping->size) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, mapping->log, ngx_errno,
+			"ngx_file_reader_unmap: munmap failed");
+	}
+}
+
+ngx_int_t
+ngx_file_reader_enable_mmap(ngx_file_reader_state_t* state, size_t padding)
+{
+	ngx_file_reader_mapping_t* mapping;
+	ngx_pool_cleanup_t* cln;
+	u_char* data;
+	size_t size;
+
+	if (state->mapping != NULL)
+	{
+		return NGX_OK;
+	}
+
+	if (state->file_size <= 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	// Note: the mapping is released when the request completes, it is not shared with other requests,
+	//	so that a file that is replaced is not served from a stale mapping
+	cln = ngx_pool_cleanup_add(state->r->pool, sizeof(*mapping));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_file_reader_enable_mmap: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	size = ngx_align((size_t)state->file_size, ngx_pagesize);
+
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, state->file.fd, 0);
+	if (data == MAP_FAILED)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, ngx_errno,
+			"ngx_file_reader_enable_mmap: mmap \"%s\" failed", state->file.name.data);
+		return NGX_ERROR;
+	}
+
+	// the frames of a segment are read in increasing offsets
+	if (madvise(data, size, MADV_SEQUENTIAL) == -1)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, ngx_errno,
+			"ngx_file_reader_enable_mmap: madvise \"%s\" failed", state->file.name.data);
+	}
+
+	mapping = cln->data;
+	mapping->file_size = state->file_size;
+	mapping->data = data;
+	mapping->size = size;
+	mapping->log = state->log;
+
+	cln->handler = ngx_file_reader_unmap;
+
+	state->mapping = mapping;
+	state->mapping_padding = padding;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
+		"ngx_file_reader_enable_mmap: mapped \"%s\"", state->file.name.data);
+
+	return NGX_OK;
+}
+
+void
+ngx_file_reader_reset_read_range(ngx_file_reader_state_t* state)
+{
+	state->read_start = 0;
+	state->read_end = 0;
+}
+
+void
+ngx_file_reader_advise(ngx_file_reader_state_t* state, off_t offset, off_t size, ngx_flag_t will_need)
+{
+#if (NGX_HAVE_POSIX_FADVISE)
+	ngx_err_t err;
+
+	if (offset >= state->file_size)
+	{
+		return;
+	}
+
+	size = ngx_min(size, state->file_size - offset);
+	if (size <= 0)
+	{
+		return;
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, state->log, 0,
+		"ngx_file_reader_advise: offset %O size %O will need %i", offset, size, will_need);
+
+	err = posix_fadvise(state->file.fd, offset, size, will_need ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+	if (err != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, err,
+			"ngx_file_reader_advise: posix_fadvise \"%s\" failed", state->file.name.data);
+	}
+#endif // NGX_HAVE_POSIX_FADVISE
+}
+
 size_t 
 ngx_file_reader_get_size(void* context)
 {
@@ -338,6 +473,117 @@ ngx_file_reader_get_path(void* context, ngx_str_t* path)
 	*path = ctx->file.name;
 }
 
+static void
+ngx_file_reader_update_read_range(ngx_file_reader_state_t* state, size_t size, off_t offset)
+{
+	if (state->read_end <= state->read_start)
+	{
+		state->read_start = offset;
+		state->read_end = offset + size;
+		return;
+	}
+
+	state->read_start = ngx_min(state->read_start, offset);
+	state->read_end = ngx_max(state->read_end, (off_t)(offset + size));
+}
+
+static ngx_int_t
+ngx_file_reader_mapped_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_file_reader_mapping_t* mapping = state->mapping;
+
+	if (offset >= mapping->file_size)
+	{
+		size = 0;
+	}
+	else if ((off_t)size > mapping->file_size - offset)
+	{
+		size = mapping->file_size - offset;
+	}
+
+	if (buf->pos == buf->last && (size_t)offset + size + state->mapping_padding <= mapping->size)
+	{
+		// zero copy, buf->start remains the allocated buffer, so that it can be reused by later reads
+		buf->pos = mapping->data + offset;
+		buf->last = buf->pos + size;
+	}
+	else
+	{
+		buf->last = ngx_cpymem(buf->last, mapping->data + offset, size);
+	}
+
+	ngx_vod_probe3(file_read_done, state->r, NGX_OK, size);
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_file_reader_mapped_read: returned %uz", size);
+
+	return NGX_OK;
+}
+
+#if (NGX_HAVE_IO_URING)
+
+static void
+ngx_async_io_uring_read_completed(ngx_io_uring_task_t* task, ssize_t result)
+{
+	ngx_file_reader_state_t* state;
+	ngx_http_request_t *r;
+	ngx_connection_t *c;
+	ssize_t bytes_read;
+	ngx_int_t rc;
+
+	state = task->data;
+	r = state->r;
+	c = r->connection;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (result < 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, state->log, -result,
+			"ngx_async_io_uring_read_completed: read failed");
+		bytes_read = 0;
+		rc = NGX_ERROR;
+	}
+	else
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_io_uring_read_completed: read returned %z", result);
+		state->buf->last += result;
+		bytes_read = result;
+		rc = NGX_OK;
+	}
+
+	ngx_vod_probe3(file_read_done, r, rc, bytes_read);
+
+	state->read_callback(state->callback_context, rc, NULL, bytes_read);
+
+	ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t
+ngx_async_io_uring_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_int_t rc;
+
+	state->io_uring_task.handler = ngx_async_io_uring_read_completed;
+	state->io_uring_task.data = state;
+
+	rc = ngx_io_uring_read(&state->io_uring_task, state->file.fd, buf->last, size, offset, state->log);
+	if (rc != NGX_AGAIN)
+	{
+		// io_uring is not available, fall back to the other read methods
+		state->use_io_uring = 0;
+		return NGX_DECLINED;
+	}
+
+	state->r->main->blocked++;
+	state->r->aio = 1;
+
+	state->buf = buf;
+	return NGX_AGAIN;
+}
+
+#endif // NGX_HAVE_IO_URING
+
 #if (NGX_HAVE_FILE_AIO)
 
 static void
@@ -375,6 +621,8 @@ ngx_async_read_completed_callback(ngx_event_t *ev)
 		rc = NGX_OK;
 	}
 
+	ngx_vod_probe3(file_read_done, r, rc, bytes_read);
+
 	state->read_callback(state->callback_context, rc, NULL, bytes_read);
 
 	ngx_http_run_posted_requests(c);
@@ -387,6 +635,22 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
 
+	ngx_vod_probe3(file_read_start, state->r, offset, size);
+
+	ngx_file_reader_update_read_range(state, size, offset);
+
+	if (state->mapping != NULL)
+	{
+		return ngx_file_reader_mapped_read(state, buf, size, offset);
+	}
+
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring && ngx_async_io_uring_read(state, buf, size, offset) == NGX_AGAIN)
+	{
+		return NGX_AGAIN;
+	}
+#endif // NGX_HAVE_IO_URING
+
 	if (state->use_aio)
 	{
 		rc = ngx_file_aio_read(&state->file, buf->last, size, offset, state->r->pool);
@@ -408,6 +672,8 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 		rc = ngx_read_file(&state->file, buf->last, size, offset);
 	}
 
+	ngx_vod_probe3(file_read_done, state->r, rc < 0 ? rc : NGX_OK, rc < 0 ? 0 : rc);
+
 	if (rc < 0)
 	{
 		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read: ngx_file_aio_read failed rc=%z", rc);
@@ -429,7 +695,26 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
 
+	ngx_vod_probe3(file_read_start, state->r, offset, size);
+
+	ngx_file_reader_update_read_range(state, size, offset);
+
+	if (state->mapping != NULL)
+	{
+		return ngx_file_reader_mapped_read(state, buf, size, offset);
+	}
+
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring && ngx_async_io_uring_read(state, buf, size, offset) == NGX_AGAIN)
+	{
+		return NGX_AGAIN;
+	}
+#endif // NGX_HAVE_IO_URING
+
 	rc = ngx_read_file(&state->file, buf->last, size, offset);
+
+	ngx_vod_probe3(file_read_done, state->r, rc < 0 ? rc : NGX_OK, rc < 0 ? 0 : rc);
+
 	if (rc < 0)
 	{
 		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read: ngx_read_file failed rc=%z", rc);
@@ -11,10 +11,17 @@
 #include "ngx_async_open_file_cache.h"
 #endif // NGX_THREADS
 
+#if (NGX_HAVE_IO_URING)
+#include "ngx_io_uring.h"
+#endif // NGX_HAVE_IO_URING
+
 // constants
 #define OPEN_FILE_NO_CACHE (0x1)
+#define OPEN_FILE_IO_URING (0x2)
 
 // typedefs
+typedef struct ngx_file_reader_mapping_s ngx_file_reader_mapping_t;
+
 typedef void (*ngx_async_read_callback_t)(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
 
 typedef struct {
@@ -24,12 +31,22 @@ typedef struct {
 	ngx_flag_t log_not_found;
 	ngx_log_t* log;
 	off_t file_size;
+	off_t read_start;		// the range of the reads performed since the last ngx_file_reader_reset_read_range
+	off_t read_end;
+	ngx_file_reader_mapping_t* mapping;		// set by ngx_file_reader_enable_mmap
+	size_t mapping_padding;
 #if (NGX_HAVE_FILE_AIO)
 	ngx_flag_t use_aio;
+#endif // NGX_HAVE_FILE_AIO
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t use_io_uring;
+	ngx_io_uring_task_t io_uring_task;
+#endif // NGX_HAVE_IO_URING
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	ngx_async_read_callback_t read_callback;
 	void* callback_context;
 	ngx_buf_t* buf;
-#endif // NGX_HAVE_FILE_AIO
+#endif // NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING
 } ngx_file_reader_state_t;
 
 // functions
@@ -47,6 +64,7 @@ ngx_int_t ngx_file_reader_init_async(
 	ngx_file_reader_state_t* state,
 	void** context,
 	ngx_thread_pool_t *thread_pool,
+	ngx_async_open_file_params_t *open_params,
 	ngx_async_open_file_callback_t open_callback,
 	ngx_async_read_callback_t read_callback,
 	void* callback_context,
@@ -66,4 +84,16 @@ ngx_int_t ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, si
 
 ngx_int_t ngx_file_reader_enable_directio(ngx_file_reader_state_t* state);
 
+// maps the file to memory, the reads that follow are served from the mapping - a read into an empty buffer points the buffer
+//	at the mapped memory (buf->start is left unchanged), other reads copy the data. padding is the number of bytes that
+//	must be readable past the end of a read, reads that end too close to the end of the mapping are copied.
+//	the mapping is released when the request completes. the file must not be truncated while it is mapped (SIGBUS)
+ngx_int_t ngx_file_reader_enable_mmap(ngx_file_reader_state_t* state, size_t padding);
+
+void ngx_file_reader_reset_read_range(ngx_file_reader_state_t* state);
+
+// advises the kernel that the range will be read soon (will_need = 1) or will not be read again (will_need = 0),
+//	has no effect when posix_fadvise is not supported
+void ngx_file_reader_advise(ngx_file_reader_state_t* state, off_t offset, off_t size, ngx_flag_t will_need);
+
 #endif // _NGX_FILE_READER_H_INCLUDED_
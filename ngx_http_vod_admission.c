@@ -0,0 +1,182 @@
+// includes
+#include "ngx_http_vod_admission.h"
+#include "ngx_http_vod_submodule.h"
+#include "ngx_http_vod_module.h"
+#include "ngx_http_vod_conf.h"
+
+/*
+	the requests are divided into high and low priority classes by vod_low_priority_requests,
+	the state of the admission is kept per worker process -
+	1. the number of low priority requests that are in progress, limited by vod_low_priority_max_concurrency
+	2. a moving average of the latency of the high priority requests (the time from the start of the request
+		until the module completes it), compared to vod_shed_latency_threshold
+
+	a low priority request that arrives when either limit is exceeded is rejected with 503 and a
+	Retry-After header, so that the worker keeps its capacity for playback requests. the average is
+	ignored when no high priority request completed recently, otherwise a burst of slow requests
+	would block the low priority requests of an idle worker.
+*/
+
+// constants
+#define ADMISSION_LATENCY_WEIGHT_SHIFT (3)		// each sample has a weight of 1/8
+#define ADMISSION_LATENCY_VALID (10000)			// in msec
+
+// globals
+ngx_conf_bitmask_t ngx_http_vod_admission_classes[] = {
+	{ ngx_string("manifest"), ADMISSION_CLASS_MANIFEST },
+	{ ngx_string("segment"), ADMISSION_CLASS_SEGMENT },
+	{ ngx_string("thumb"), ADMISSION_CLASS_THUMB },
+	{ ngx_string("other"), ADMISSION_CLASS_OTHER },
+	{ ngx_string("volume_map"), ADMISSION_CLASS_VOLUME_MAP },
+	{ ngx_string("audio_filter"), ADMISSION_CLASS_AUDIO_FILTER },
+	{ ngx_null_string, 0 }
+};
+
+static ngx_uint_t ngx_http_vod_admission_active = 0;
+static ngx_msec_int_t ngx_http_vod_admission_latency = -1;
+static ngx_msec_t ngx_http_vod_admission_latency_updated = 0;
+
+ngx_uint_t
+ngx_http_vod_admission_get_class(ngx_uint_t request_class)
+{
+	if ((request_class & REQUEST_CLASS_SEGMENT) != 0)
+	{
+		return ADMISSION_CLASS_SEGMENT;
+	}
+
+	if ((request_class & REQUEST_CLASS_MANIFEST) != 0)
+	{
+		return ADMISSION_CLASS_MANIFEST;
+	}
+
+	if ((request_class & REQUEST_CLASS_THUMB) != 0)
+	{
+		return ADMISSION_CLASS_THUMB;
+	}
+
+	return ADMISSION_CLASS_OTHER;
+}
+
+ngx_flag_t
+ngx_http_vod_admission_is_low_priority(ngx_http_request_t* r, ngx_uint_t admission_class)
+{
+	ngx_http_vod_loc_conf_t* conf;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	return (conf->low_priority_requests & admission_class) != 0;
+}
+
+static void
+ngx_http_vod_admission_cleanup(void* data)
+{
+	ngx_http_vod_admission_active--;
+}
+
+static ngx_int_t
+ngx_http_vod_admission_reject(ngx_http_request_t* r, ngx_http_vod_loc_conf_t* conf)
+{
+	ngx_table_elt_t* h;
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_admission_reject: ngx_list_push failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+	if (h->value.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_admission_reject: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	h->hash = 1;
+	ngx_str_set(&h->key, "Retry-After");
+	h->value.len = ngx_sprintf(h->value.data, "%T", conf->shed_retry_after) - h->value.data;
+
+	return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+ngx_int_t
+ngx_http_vod_admission_acquire(ngx_http_request_t* r)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_pool_cleanup_t* cln;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	if (conf->low_priority_max_concurrency != 0 &&
+		ngx_http_vod_admission_active >= conf->low_priority_max_concurrency)
+	{
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+			"ngx_http_vod_admission_acquire: %ui low priority requests are in progress, rejecting",
+			ngx_http_vod_admission_active);
+		return ngx_http_vod_admission_reject(r, conf);
+	}
+
+	if (conf->shed_latency_threshold != 0 &&
+		ngx_http_vod_admission_latency > (ngx_msec_int_t)conf->shed_latency_threshold &&
+		ngx_current_msec - ngx_http_vod_admission_latency_updated < ADMISSION_LATENCY_VALID)
+	{
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+			"ngx_http_vod_admission_acquire: the average latency is %M ms, rejecting",
+			(ngx_msec_t)ngx_http_vod_admission_latency);
+		return ngx_http_vod_admission_reject(r, conf);
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_admission_acquire: ngx_pool_cleanup_add failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	cln->handler = ngx_http_vod_admission_cleanup;
+	cln->data = NULL;
+
+	ngx_http_vod_admission_active++;
+
+	return NGX_OK;
+}
+
+void
+ngx_http_vod_admission_request_done(ngx_http_request_t* r, ngx_uint_t admission_class)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_msec_int_t latency;
+	ngx_time_t* tp;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	if (conf->shed_latency_threshold == 0 ||
+		admission_class == 0 ||
+		(conf->low_priority_requests & admission_class) != 0)
+	{
+		return;
+	}
+
+	tp = ngx_timeofday();
+	latency = (ngx_msec_int_t)((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+	if (latency < 0)
+	{
+		latency = 0;
+	}
+
+	if (ngx_http_vod_admission_latency < 0 ||
+		ngx_current_msec - ngx_http_vod_admission_latency_updated >= ADMISSION_LATENCY_VALID)
+	{
+		// no recent samples, start over
+		ngx_http_vod_admission_latency = latency;
+	}
+	else
+	{
+		ngx_http_vod_admission_latency += (latency - ngx_http_vod_admission_latency) / (1 << ADMISSION_LATENCY_WEIGHT_SHIFT);
+	}
+
+	ngx_http_vod_admission_latency_updated = ngx_current_msec;
+}
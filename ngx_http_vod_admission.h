@@ -0,0 +1,32 @@
+#ifndef _NGX_HTTP_VOD_ADMISSION_H_INCLUDED_
+#define _NGX_HTTP_VOD_ADMISSION_H_INCLUDED_
+
+// includes
+#include <ngx_http.h>
+
+// constants
+// Note: the classes are used as an nginx bitmask, the first bit is reserved (NGX_CONF_BITMASK_SET)
+#define ADMISSION_CLASS_MANIFEST		(0x0002)
+#define ADMISSION_CLASS_SEGMENT			(0x0004)
+#define ADMISSION_CLASS_THUMB			(0x0008)
+#define ADMISSION_CLASS_OTHER			(0x0010)
+#define ADMISSION_CLASS_VOLUME_MAP		(0x0020)
+#define ADMISSION_CLASS_AUDIO_FILTER	(0x0040)
+
+// globals
+extern ngx_conf_bitmask_t ngx_http_vod_admission_classes[];
+
+// functions
+// returns the admission class of a request class (REQUEST_CLASS_XXX)
+ngx_uint_t ngx_http_vod_admission_get_class(ngx_uint_t request_class);
+
+ngx_flag_t ngx_http_vod_admission_is_low_priority(ngx_http_request_t* r, ngx_uint_t admission_class);
+
+// admits a low priority request, returns NGX_HTTP_SERVICE_UNAVAILABLE (with a Retry-After header) if the worker
+//	is overloaded. the request is counted as in progress until its pool is destroyed
+ngx_int_t ngx_http_vod_admission_acquire(ngx_http_request_t* r);
+
+// updates the latency of the high priority requests, should be called once the handling of the request completes
+void ngx_http_vod_admission_request_done(ngx_http_request_t* r, ngx_uint_t admission_class);
+
+#endif // _NGX_HTTP_VOD_ADMISSION_H_INCLUDED_
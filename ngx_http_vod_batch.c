@@ -0,0 +1,345 @@
+// includes
+#include "ngx_http_vod_batch.h"
+#include "ngx_http_vod_module.h"
+#include "ngx_http_vod_utils.h"
+#include "ngx_http_vod_conf.h"
+
+/*
+	the response of a batch request is a multipart/mixed body, with one part per uri, in the order of the
+	request body. the parts are built by subrequests that run one at a time, so that the reads of the
+	segments are performed sequentially, and the metadata of the source files is parsed once (when
+	vod_metadata_cache is enabled, the subrequests that follow the first one reuse the cached metadata).
+	since the status of a part is known only after its body is sent, the last part of the response is an
+	index, with one line per uri - "<status> <content type> <uri>".
+*/
+
+// constants
+#define BATCH_MAX_URIS (256)
+#define BATCH_CONTENT_TYPE_PREFIX "multipart/mixed; boundary="
+#define BATCH_PART_HEADER_FORMAT "\r\n--%V\r\nContent-Location: %V\r\n\r\n"
+#define BATCH_INDEX_HEADER_FORMAT "\r\n--%V\r\nContent-Type: text/plain\r\n\r\n"
+#define BATCH_INDEX_LINE_FORMAT "%ui %V %V\n"
+#define BATCH_TRAILER_FORMAT "\r\n--%V--\r\n"
+
+// typedefs
+typedef struct {
+	ngx_http_vod_uri_list_item_t base;
+	ngx_str_t content_type;
+	ngx_http_post_subrequest_t ps;
+} ngx_http_vod_batch_item_t;
+
+typedef struct {
+	ngx_http_vod_batch_item_t* items;
+	ngx_uint_t count;
+	ngx_uint_t next;
+	ngx_flag_t active;
+	ngx_str_t boundary;
+} ngx_http_vod_batch_ctx_t;
+
+static ngx_str_t empty_content_type = ngx_string("-");
+
+static ngx_int_t
+ngx_http_vod_batch_output(ngx_http_request_t *r, u_char* start, u_char* end, ngx_flag_t last)
+{
+	ngx_chain_t out;
+	ngx_buf_t* b;
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_output: ngx_calloc_buf failed");
+		return NGX_ERROR;
+	}
+
+	b->pos = start;
+	b->last = end;
+	b->temporary = 1;
+	b->last_buf = last;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t
+ngx_http_vod_batch_send_index(ngx_http_request_t *r, ngx_http_vod_batch_ctx_t* ctx)
+{
+	ngx_http_vod_batch_item_t* cur_item;
+	ngx_http_vod_batch_item_t* items_end;
+	ngx_str_t* content_type;
+	size_t size;
+	u_char* start;
+	u_char* p;
+
+	items_end = ctx->items + ctx->count;
+
+	size = sizeof(BATCH_INDEX_HEADER_FORMAT) + sizeof(BATCH_TRAILER_FORMAT) + 2 * ctx->boundary.len;
+	for (cur_item = ctx->items; cur_item < items_end; cur_item++)
+	{
+		size += sizeof(BATCH_INDEX_LINE_FORMAT) + NGX_INT_T_LEN + 
+			ngx_max(cur_item->content_type.len, empty_content_type.len) + cur_item->base.line.len;
+	}
+
+	start = ngx_pnalloc(r->pool, size);
+	if (start == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_send_index: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	p = ngx_sprintf(start, BATCH_INDEX_HEADER_FORMAT, &ctx->boundary);
+
+	for (cur_item = ctx->items; cur_item < items_end; cur_item++)
+	{
+		content_type = cur_item->content_type.len > 0 ? &cur_item->content_type : &empty_content_type;
+		p = ngx_sprintf(p, BATCH_INDEX_LINE_FORMAT, cur_item->base.status, content_type, &cur_item->base.line);
+	}
+
+	p = ngx_sprintf(p, BATCH_TRAILER_FORMAT, &ctx->boundary);
+
+	return ngx_http_vod_batch_output(r, start, p, 1);
+}
+
+static ngx_int_t
+ngx_http_vod_batch_subrequest_finished(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+	ngx_http_vod_batch_item_t* item = data;
+	ngx_http_vod_batch_ctx_t* ctx;
+	ngx_http_request_t* r = sr->parent;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (rc >= NGX_HTTP_OK)
+	{
+		item->base.status = rc;
+	}
+	else if (rc == NGX_OK && sr->headers_out.status != 0)
+	{
+		item->base.status = sr->headers_out.status;
+	}
+	else
+	{
+		item->base.status = rc == NGX_OK ? NGX_HTTP_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (item->base.status < NGX_HTTP_SPECIAL_RESPONSE)
+	{
+		item->content_type = sr->headers_out.content_type;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_batch_subrequest_finished: %V returned %ui", &item->base.line, item->base.status);
+
+	ctx->active = 0;
+
+	return rc;
+}
+
+// starts the subrequest of the next valid uri, returns NGX_DONE when there are no more uris
+static ngx_int_t
+ngx_http_vod_batch_start_next(ngx_http_request_t *r, ngx_http_vod_batch_ctx_t* ctx)
+{
+	ngx_http_vod_batch_item_t* cur_item;
+	ngx_http_request_t* sr;
+	ngx_int_t rc;
+	u_char* start;
+	u_char* p;
+
+	while (ctx->next < ctx->count)
+	{
+		cur_item = &ctx->items[ctx->next++];
+		if (cur_item->base.status != 0)
+		{
+			// invalid uri, reported only in the index
+			continue;
+		}
+
+		start = ngx_pnalloc(r->pool, sizeof(BATCH_PART_HEADER_FORMAT) + ctx->boundary.len + cur_item->base.line.len);
+		if (start == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_batch_start_next: ngx_pnalloc failed");
+			return NGX_ERROR;
+		}
+
+		p = ngx_sprintf(start, BATCH_PART_HEADER_FORMAT, &ctx->boundary, &cur_item->base.line);
+
+		rc = ngx_http_vod_batch_output(r, start, p, 0);
+		if (rc == NGX_ERROR)
+		{
+			return rc;
+		}
+
+		cur_item->ps.handler = ngx_http_vod_batch_subrequest_finished;
+		cur_item->ps.data = cur_item;
+
+		// Note: the output of the subrequest is written to the client after the part header (postpone filter)
+		if (ngx_http_subrequest(r, &cur_item->base.uri, &cur_item->base.args, &sr, &cur_item->ps, 0) != NGX_OK)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_batch_start_next: ngx_http_subrequest failed for %V", &cur_item->base.line);
+			return NGX_ERROR;
+		}
+
+		ctx->active = 1;
+		return NGX_OK;
+	}
+
+	return NGX_DONE;
+}
+
+static void
+ngx_http_vod_batch_wake_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_batch_ctx_t* ctx;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (ctx->active)
+	{
+		return;
+	}
+
+	rc = ngx_http_vod_batch_start_next(r, ctx);
+	if (rc == NGX_OK)
+	{
+		return;
+	}
+
+	r->write_event_handler = ngx_http_request_empty_handler;
+
+	if (rc == NGX_DONE)
+	{
+		rc = ngx_http_vod_batch_send_index(r, ctx);
+	}
+
+	ngx_http_finalize_request(r, rc);
+}
+
+static ngx_int_t
+ngx_http_vod_batch_send_header(ngx_http_request_t *r, ngx_http_vod_batch_ctx_t* ctx)
+{
+	ngx_str_t content_type;
+	ngx_int_t rc;
+	u_char* p;
+
+	ctx->boundary.data = ngx_pnalloc(r->pool, 2 * NGX_INT32_LEN);
+	if (ctx->boundary.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_send_header: ngx_pnalloc failed (1)");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	// Note: the boundary is random, since the segments are binary and may contain any sequence of bytes
+	ctx->boundary.len = ngx_sprintf(ctx->boundary.data, "%08xD%08xD", 
+		(uint32_t)ngx_random(), (uint32_t)ngx_random()) - ctx->boundary.data;
+
+	content_type.data = ngx_pnalloc(r->pool, sizeof(BATCH_CONTENT_TYPE_PREFIX) - 1 + ctx->boundary.len);
+	if (content_type.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_send_header: ngx_pnalloc failed (2)");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = ngx_copy(content_type.data, BATCH_CONTENT_TYPE_PREFIX, sizeof(BATCH_CONTENT_TYPE_PREFIX) - 1);
+	p = ngx_copy(p, ctx->boundary.data, ctx->boundary.len);
+	content_type.len = p - content_type.data;
+
+	r->headers_out.content_type = content_type;
+	r->headers_out.content_type_len = content_type.len;
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = -1;
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_send_header: ngx_http_send_header failed %i", rc);
+		return rc;
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_batch_body_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_batch_ctx_t* ctx;
+	ngx_array_t items;
+	ngx_int_t rc;
+
+	ctx = ngx_pcalloc(r->pool, sizeof(*ctx));
+	if (ctx == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_batch_body_handler: ngx_pcalloc failed");
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	rc = ngx_http_vod_parse_uri_list(r, sizeof(ngx_http_vod_batch_item_t), &items);
+	if (rc != NGX_OK)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	if (items.nelts <= 0 || items.nelts > BATCH_MAX_URIS)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_batch_body_handler: invalid uri count %ui", items.nelts);
+		ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+		return;
+	}
+
+	ctx->items = items.elts;
+	ctx->count = items.nelts;
+	ngx_http_set_ctx(r, ctx, ngx_http_vod_module);
+
+	rc = ngx_http_vod_batch_send_header(r, ctx);
+	if (rc != NGX_OK)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	// the request is woken up whenever a subrequest completes
+	r->write_event_handler = ngx_http_vod_batch_wake_handler;
+
+	ngx_http_vod_batch_wake_handler(r);
+}
+
+ngx_int_t
+ngx_http_vod_batch_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	if (r != r->main)
+	{
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	if (r->method != NGX_HTTP_POST)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_batch_handler: unsupported method %ui, the uris must be posted", r->method);
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	r->request_body_in_single_buf = 1;
+
+	rc = ngx_http_read_client_request_body(r, ngx_http_vod_batch_body_handler);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+	{
+		return rc;
+	}
+
+	return NGX_DONE;
+}
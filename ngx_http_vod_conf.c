@@ -4,10 +4,16 @@
 #include "ngx_http_vod_submodule.h"
 #include "ngx_http_vod_module.h"
 #include "ngx_http_vod_status.h"
+#include "ngx_http_vod_warmup.h"
+#include "ngx_http_vod_batch.h"
+#include "ngx_http_vod_admission.h"
+#include "ngx_http_vod_ingest.h"
 #include "ngx_perf_counters.h"
 #include "ngx_buffer_cache.h"
+#include "ngx_cache_key.h"
 #include "vod/media_set_parser.h"
 #include "vod/buffer_pool.h"
+#include "vod/request_arena.h"
 #include "vod/common.h"
 #include "vod/udrm.h"
 
@@ -15,6 +21,9 @@
 #include "ngx_http_vod_thumb.h"
 #endif // NGX_HAVE_LIB_AV_CODEC
 
+// constants
+#define NGX_HTTP_VOD_MAX_MAPPING_DICTIONARY_SIZE (32768)		// zlib only uses the last 32KB of the dictionary
+
 // globals
 static ngx_str_t ngx_http_vod_last_modified_default_types[] = {
 	ngx_null_string
@@ -71,6 +80,7 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->submodule.parse_uri_file_name = NGX_CONF_UNSET_PTR;
 	conf->request_handler = NGX_CONF_UNSET_PTR;
 	conf->segmenter.segment_duration = NGX_CONF_UNSET_UINT;
+	conf->segmenter.part_duration = NGX_CONF_UNSET_UINT;
 	conf->segmenter.live_window_duration = NGX_CONF_UNSET;
 	conf->segmenter.bootstrap_segments = NGX_CONF_UNSET_PTR;
 	conf->segmenter.align_to_key_frames = NGX_CONF_UNSET;
@@ -84,15 +94,72 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->force_sequence_index = NGX_CONF_UNSET;
 	conf->initial_read_size = NGX_CONF_UNSET_SIZE;
 	conf->max_metadata_size = NGX_CONF_UNSET_SIZE;
+	conf->partial_moov_min_size = NGX_CONF_UNSET_SIZE;
 	conf->max_frames_size = NGX_CONF_UNSET_SIZE;
+	conf->max_request_memory = NGX_CONF_UNSET_SIZE;
 	conf->cache_buffer_size = NGX_CONF_UNSET_SIZE;
+	conf->parallel_frame_reads = NGX_CONF_UNSET;
+	conf->parallel_metadata_reads = NGX_CONF_UNSET;
+	conf->prefetch_next_segment = NGX_CONF_UNSET;
+	conf->prefetch_sibling_segments = NGX_CONF_UNSET;
+	conf->prefetch_max_concurrency = NGX_CONF_UNSET_UINT;
+	conf->max_coalesced_read_size = NGX_CONF_UNSET_SIZE;
+	conf->sendfile_frames = NGX_CONF_UNSET;
+	conf->output_chunk_size = NGX_CONF_UNSET_SIZE;
+	conf->max_unsent_output_size = NGX_CONF_UNSET_SIZE;
 	conf->max_upstream_headers_size = NGX_CONF_UNSET_SIZE;
+	conf->upstream_block_cache = NGX_CONF_UNSET_PTR;
+	conf->iframes_cache = NGX_CONF_UNSET_PTR;
+	conf->master_cache = NGX_CONF_UNSET_PTR;
+	conf->metadata_hint_cache = NGX_CONF_UNSET_PTR;
+	conf->segment_durations_cache = NGX_CONF_UNSET_PTR;
+	conf->segment_size_cache = NGX_CONF_UNSET_PTR;
+	conf->upstream_block_size = NGX_CONF_UNSET_SIZE;
+	conf->upstream_hedge_percentile = NGX_CONF_UNSET_UINT;
+	conf->upstream_hedge_min_delay = NGX_CONF_UNSET_MSEC;
+	conf->upstream_hedge_max_delay = NGX_CONF_UNSET_MSEC;
+	conf->upstream_max_concurrency = NGX_CONF_UNSET_UINT;
+	conf->upstream_max_queued = NGX_CONF_UNSET_UINT;
 	conf->ignore_edit_list = NGX_CONF_UNSET;
+	conf->coalesce_metadata_reads = NGX_CONF_UNSET;
+	conf->coalesce_frame_reads = NGX_CONF_UNSET;
+	conf->hot_file_min_uses = NGX_CONF_UNSET_UINT;
+	conf->fadvise = NGX_CONF_UNSET;
+	conf->mmap_frames = NGX_CONF_UNSET;
+	conf->metadata_cache_compact = NGX_CONF_UNSET;
+	conf->metadata_cache_sample_index = NGX_CONF_UNSET;
+	conf->metadata_cache_incremental = NGX_CONF_UNSET;
 	conf->parse_hdlr_name = NGX_CONF_UNSET;
+	conf->server_timing = NGX_CONF_UNSET;
+	conf->slow_request_threshold = NGX_CONF_UNSET_MSEC;
+	conf->low_priority_max_concurrency = NGX_CONF_UNSET_UINT;
+	conf->shed_latency_threshold = NGX_CONF_UNSET_MSEC;
+	conf->shed_retry_after = NGX_CONF_UNSET;
 	conf->max_mapping_response_size = NGX_CONF_UNSET_SIZE;
+	conf->mapping_parallel_requests = NGX_CONF_UNSET_UINT;
 
 	conf->metadata_cache = NGX_CONF_UNSET_PTR;
+	conf->parsed_metadata_cache = NGX_CONF_UNSET_PTR;
 	conf->dynamic_mapping_cache = NGX_CONF_UNSET_PTR;
+	conf->audio_filter_cache = NGX_CONF_UNSET_PTR;
+	conf->thumb_cache = NGX_CONF_UNSET_PTR;
+	conf->volume_map_cache = NGX_CONF_UNSET_PTR;
+	conf->segment_cache = NGX_CONF_UNSET_PTR;
+	conf->segment_store = NGX_CONF_UNSET_PTR;
+	conf->cmaf_segments = NGX_CONF_UNSET;
+	conf->segment_frames_cache = NGX_CONF_UNSET_PTR;
+	conf->resident_frames_cache = NGX_CONF_UNSET_PTR;
+	conf->ingest_zone = NGX_CONF_UNSET_PTR;
+	conf->clip_header_cache = NGX_CONF_UNSET_PTR;
+	conf->notification_cache = NGX_CONF_UNSET_PTR;
+	conf->fallback_cache = NGX_CONF_UNSET_PTR;
+	conf->cache_key_hash = NGX_CONF_UNSET_UINT;
+	conf->mapping_cache_msgpack = NGX_CONF_UNSET;
+	conf->mapping_cache_compress = NGX_CONF_UNSET;
+	conf->notification_background = NGX_CONF_UNSET;
+	conf->response_cache_zero_copy = NGX_CONF_UNSET;
+	conf->response_cache_gzip = NGX_CONF_UNSET;
+	conf->warmup_concurrency = NGX_CONF_UNSET_UINT;
 	for (type = 0; type < CACHE_TYPE_COUNT; type++)
 	{
 		conf->response_cache[type] = NGX_CONF_UNSET_PTR;
@@ -110,11 +177,23 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->drm_clear_lead_segment_count = NGX_CONF_UNSET_UINT;
 	conf->drm_max_info_length = NGX_CONF_UNSET_SIZE;
 	conf->drm_info_cache = NGX_CONF_UNSET_PTR;
+	conf->drm_info_refresh_ahead = NGX_CONF_UNSET;
 	conf->min_single_nalu_per_frame_segment = NGX_CONF_UNSET_UINT;
 
 #if (NGX_THREADS)
 	conf->open_file_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->open_file_not_found_valid = NGX_CONF_UNSET;
+	conf->open_file_immutable_valid = NGX_CONF_UNSET;
+	conf->parse_metadata_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->metadata_cache_disk_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->audio_filter_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->thumb_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->volume_map_thread_pool = NGX_CONF_UNSET_PTR;
+	conf->processing_thread_pool = NGX_CONF_UNSET_PTR;
 #endif // NGX_THREADS
+#if (NGX_HAVE_IO_URING)
+	conf->io_uring = NGX_CONF_UNSET;
+#endif // NGX_HAVE_IO_URING
 
 	// submodules
 	for (cur_module = submodules; *cur_module != NULL; cur_module++)
@@ -154,6 +233,7 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_str_value(conf->multi_uri_suffix, prev->multi_uri_suffix, ".urlset");
 
 	ngx_conf_merge_uint_value(conf->segmenter.segment_duration, prev->segmenter.segment_duration, 10000);
+	ngx_conf_merge_uint_value(conf->segmenter.part_duration, prev->segmenter.part_duration, 0);
 	ngx_conf_merge_value(conf->segmenter.live_window_duration, prev->segmenter.live_window_duration, 30000);
 	ngx_conf_merge_ptr_value(conf->segmenter.bootstrap_segments, prev->segmenter.bootstrap_segments, NULL);
 	ngx_conf_merge_value(conf->segmenter.align_to_key_frames, prev->segmenter.align_to_key_frames, 0);
@@ -187,13 +267,49 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	}
 
 	ngx_conf_merge_ptr_value(conf->metadata_cache, prev->metadata_cache, NULL);
+	ngx_conf_merge_str_value(conf->metadata_cache_disk_path, prev->metadata_cache_disk_path, "");
+	ngx_conf_merge_str_value(conf->metadata_cache_remote_location, prev->metadata_cache_remote_location, "");
+	ngx_conf_merge_str_value(conf->sidecar_index_location, prev->sidecar_index_location, "");
+	ngx_conf_merge_str_value(conf->sidecar_index_suffix, prev->sidecar_index_suffix, ".vodidx");
+	ngx_conf_merge_value(conf->coalesce_metadata_reads, prev->coalesce_metadata_reads, 0);
+	ngx_conf_merge_value(conf->coalesce_frame_reads, prev->coalesce_frame_reads, 0);
+	ngx_conf_merge_uint_value(conf->hot_file_min_uses, prev->hot_file_min_uses, 0);
+	ngx_conf_merge_value(conf->fadvise, prev->fadvise, 0);
+	ngx_conf_merge_value(conf->mmap_frames, prev->mmap_frames, 0);
+	ngx_conf_merge_value(conf->metadata_cache_compact, prev->metadata_cache_compact, 0);
+	ngx_conf_merge_value(conf->metadata_cache_sample_index, prev->metadata_cache_sample_index, 0);
+	ngx_conf_merge_value(conf->metadata_cache_incremental, prev->metadata_cache_incremental, 0);
+	ngx_conf_merge_ptr_value(conf->parsed_metadata_cache, prev->parsed_metadata_cache, NULL);
 	ngx_conf_merge_ptr_value(conf->dynamic_mapping_cache, prev->dynamic_mapping_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->audio_filter_cache, prev->audio_filter_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->thumb_cache, prev->thumb_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->volume_map_cache, prev->volume_map_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->segment_cache, prev->segment_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->segment_store, prev->segment_store, NULL);
+	ngx_conf_merge_value(conf->cmaf_segments, prev->cmaf_segments, 0);
+	ngx_conf_merge_ptr_value(conf->segment_frames_cache, prev->segment_frames_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->resident_frames_cache, prev->resident_frames_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->clip_header_cache, prev->clip_header_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->notification_cache, prev->notification_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->fallback_cache, prev->fallback_cache, NULL);
+	ngx_conf_merge_uint_value(conf->cache_key_hash, prev->cache_key_hash, CACHE_KEY_HASH_MD5);
+	if (conf->cache_key_hash == CACHE_KEY_HASH_SIPHASH &&
+		ngx_cache_key_init_secret(cf->log) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_conf_merge_value(conf->mapping_cache_msgpack, prev->mapping_cache_msgpack, 0);
+	ngx_conf_merge_value(conf->mapping_cache_compress, prev->mapping_cache_compress, 0);
+	ngx_conf_merge_str_value(conf->mapping_cache_dictionary, prev->mapping_cache_dictionary, "");
 
 	for (type = 0; type < CACHE_TYPE_COUNT; type++)
 	{
 		ngx_conf_merge_ptr_value(conf->response_cache[type], prev->response_cache[type], NULL);
 		ngx_conf_merge_ptr_value(conf->mapping_cache[type], prev->mapping_cache[type], NULL);
 	}
+	ngx_conf_merge_value(conf->response_cache_zero_copy, prev->response_cache_zero_copy, 0);
+	ngx_conf_merge_value(conf->response_cache_gzip, prev->response_cache_gzip, 0);
 
 	for (type = 0; type < EXPIRES_TYPE_COUNT; type++)
 	{
@@ -202,15 +318,55 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
 	ngx_conf_merge_size_value(conf->initial_read_size, prev->initial_read_size, 4096);
 	ngx_conf_merge_size_value(conf->max_metadata_size, prev->max_metadata_size, 128 * 1024 * 1024);
+	ngx_conf_merge_size_value(conf->partial_moov_min_size, prev->partial_moov_min_size, 0);
 	ngx_conf_merge_size_value(conf->max_frames_size, prev->max_frames_size, 16 * 1024 * 1024);
+	ngx_conf_merge_size_value(conf->max_request_memory, prev->max_request_memory, 0);
 	ngx_conf_merge_size_value(conf->cache_buffer_size, prev->cache_buffer_size, 256 * 1024);
+	ngx_conf_merge_value(conf->parallel_frame_reads, prev->parallel_frame_reads, 0);
+	ngx_conf_merge_value(conf->parallel_metadata_reads, prev->parallel_metadata_reads, 0);
+	ngx_conf_merge_value(conf->prefetch_next_segment, prev->prefetch_next_segment, 0);
+	ngx_conf_merge_value(conf->prefetch_sibling_segments, prev->prefetch_sibling_segments, 0);
+	ngx_conf_merge_uint_value(conf->prefetch_max_concurrency, prev->prefetch_max_concurrency, 0);
+	ngx_conf_merge_uint_value(conf->warmup_concurrency, prev->warmup_concurrency, 4);
+	ngx_conf_merge_ptr_value(conf->ingest_zone, prev->ingest_zone, NULL);
+	ngx_conf_merge_size_value(conf->max_coalesced_read_size, prev->max_coalesced_read_size, 0);
+	ngx_conf_merge_value(conf->sendfile_frames, prev->sendfile_frames, 0);
+	ngx_conf_merge_size_value(conf->output_chunk_size, prev->output_chunk_size, 0);
+	ngx_conf_merge_size_value(conf->max_unsent_output_size, prev->max_unsent_output_size, 0);
 	ngx_conf_merge_size_value(conf->max_upstream_headers_size, prev->max_upstream_headers_size, 4 * 1024);
+	ngx_conf_merge_ptr_value(conf->upstream_block_cache, prev->upstream_block_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->iframes_cache, prev->iframes_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->master_cache, prev->master_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->metadata_hint_cache, prev->metadata_hint_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->segment_durations_cache, prev->segment_durations_cache, NULL);
+	ngx_conf_merge_ptr_value(conf->segment_size_cache, prev->segment_size_cache, NULL);
+	ngx_conf_merge_size_value(conf->upstream_block_size, prev->upstream_block_size, 64 * 1024);
+	ngx_conf_merge_uint_value(conf->upstream_hedge_percentile, prev->upstream_hedge_percentile, 0);
+	ngx_conf_merge_msec_value(conf->upstream_hedge_min_delay, prev->upstream_hedge_min_delay, 10);
+	ngx_conf_merge_msec_value(conf->upstream_hedge_max_delay, prev->upstream_hedge_max_delay, 1000);
+	ngx_conf_merge_uint_value(conf->upstream_max_concurrency, prev->upstream_max_concurrency, 0);
+	ngx_conf_merge_uint_value(conf->upstream_max_queued, prev->upstream_max_queued, 0);
+	if (conf->upstream_limit_zone == NULL)
+	{
+		conf->upstream_limit_zone = prev->upstream_limit_zone;
+		conf->upstream_shared_max_concurrency = prev->upstream_shared_max_concurrency;
+	}
 	
 	if (conf->output_buffer_pool == NULL)
 	{
 		conf->output_buffer_pool = prev->output_buffer_pool;
 	}
 
+	if (conf->read_buffer_pool == NULL)
+	{
+		conf->read_buffer_pool = prev->read_buffer_pool;
+	}
+
+	if (conf->request_arena == NULL)
+	{
+		conf->request_arena = prev->request_arena;
+	}
+
 	ngx_conf_merge_value(conf->ignore_edit_list, prev->ignore_edit_list, 0);
 	ngx_conf_merge_value(conf->parse_hdlr_name, prev->parse_hdlr_name, 0);
 
@@ -232,10 +388,12 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_str_value(conf->path_response_prefix, prev->path_response_prefix, "{\"sequences\":[{\"clips\":[{\"type\":\"source\",\"path\":\"");
 	ngx_conf_merge_str_value(conf->path_response_postfix, prev->path_response_postfix, "\"}]}]}");
 	ngx_conf_merge_size_value(conf->max_mapping_response_size, prev->max_mapping_response_size, 1024);
+	ngx_conf_merge_uint_value(conf->mapping_parallel_requests, prev->mapping_parallel_requests, 1);
 	if (conf->notification_uri == NULL)
 	{
 		conf->notification_uri = prev->notification_uri;
 	}
+	ngx_conf_merge_value(conf->notification_background, prev->notification_background, 0);
 	if (conf->dynamic_clip_map_uri == NULL)
 	{
 		conf->dynamic_clip_map_uri = prev->dynamic_clip_map_uri;
@@ -252,6 +410,14 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	{
 		conf->media_set_map_uri = prev->media_set_map_uri;
 	}
+	if (conf->metadata_cache_partition == NULL)
+	{
+		conf->metadata_cache_partition = prev->metadata_cache_partition;
+	}
+	if (conf->cache_tag == NULL)
+	{
+		conf->cache_tag = prev->cache_tag;
+	}
 	if (conf->apply_dynamic_mapping == NULL)
 	{
 		conf->apply_dynamic_mapping = prev->apply_dynamic_mapping;
@@ -259,6 +425,7 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	if (conf->media_set_override_json == NULL)
 	{
 		conf->media_set_override_json = prev->media_set_override_json;
+		conf->media_set_override_template = prev->media_set_override_template;
 	}
 
 	ngx_conf_merge_str_value(conf->fallback_upstream_location, prev->fallback_upstream_location, "");
@@ -283,6 +450,7 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_str_value(conf->drm_upstream_location, prev->drm_upstream_location, "");
 	ngx_conf_merge_size_value(conf->drm_max_info_length, prev->drm_max_info_length, 4096);
 	ngx_conf_merge_ptr_value(conf->drm_info_cache, prev->drm_info_cache, NULL);
+	ngx_conf_merge_sec_value(conf->drm_info_refresh_ahead, prev->drm_info_refresh_ahead, 0);
 	if (conf->drm_request_uri == NULL)
 	{
 		conf->drm_request_uri = prev->drm_request_uri;
@@ -296,14 +464,43 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_str_value(conf->speed_param_name, prev->speed_param_name, "speed");
 	ngx_conf_merge_str_value(conf->lang_param_name, prev->lang_param_name, "lang");
 
+	ngx_conf_merge_value(conf->server_timing, prev->server_timing, 0);
+	ngx_conf_merge_msec_value(conf->slow_request_threshold, prev->slow_request_threshold, 0);
+	ngx_conf_merge_bitmask_value(conf->low_priority_requests, prev->low_priority_requests, 
+		(NGX_CONF_BITMASK_SET | ADMISSION_CLASS_THUMB | ADMISSION_CLASS_VOLUME_MAP | ADMISSION_CLASS_AUDIO_FILTER));
+	ngx_conf_merge_uint_value(conf->low_priority_max_concurrency, prev->low_priority_max_concurrency, 0);
+	ngx_conf_merge_msec_value(conf->shed_latency_threshold, prev->shed_latency_threshold, 0);
+	ngx_conf_merge_sec_value(conf->shed_retry_after, prev->shed_retry_after, 5);
+
 	if (conf->perf_counters_zone == NULL)
 	{
 		conf->perf_counters_zone = prev->perf_counters_zone;
 	}
 
+	if (conf->popularity_zone == NULL)
+	{
+		conf->popularity_zone = prev->popularity_zone;
+	}
+
+	if (conf->request_samples_zone == NULL)
+	{
+		conf->request_samples_zone = prev->request_samples_zone;
+	}
+
 #if (NGX_THREADS)
 	ngx_conf_merge_ptr_value(conf->open_file_thread_pool, prev->open_file_thread_pool, NULL);
+	ngx_conf_merge_sec_value(conf->open_file_not_found_valid, prev->open_file_not_found_valid, 0);
+	ngx_conf_merge_sec_value(conf->open_file_immutable_valid, prev->open_file_immutable_valid, 0);
+	ngx_conf_merge_ptr_value(conf->parse_metadata_thread_pool, prev->parse_metadata_thread_pool, NULL);
+	ngx_conf_merge_ptr_value(conf->metadata_cache_disk_thread_pool, prev->metadata_cache_disk_thread_pool, NULL);
+	ngx_conf_merge_ptr_value(conf->audio_filter_thread_pool, prev->audio_filter_thread_pool, NULL);
+	ngx_conf_merge_ptr_value(conf->thumb_thread_pool, prev->thumb_thread_pool, NULL);
+	ngx_conf_merge_ptr_value(conf->volume_map_thread_pool, prev->volume_map_thread_pool, NULL);
+	ngx_conf_merge_ptr_value(conf->processing_thread_pool, prev->processing_thread_pool, NULL);
 #endif // NGX_THREADS
+#if (NGX_HAVE_IO_URING)
+	ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
+#endif // NGX_HAVE_IO_URING
 
 	// validate vod_upstream / vod_upstream_host_header used when needed
 	if (conf->request_handler == ngx_http_vod_remote_request_handler)
@@ -316,6 +513,27 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		}
 	}
 
+	if (conf->upstream_hedge_percentile >= 100)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_upstream_hedge_percentile\" must be less than 100");
+		return NGX_CONF_ERROR;
+	}
+
+	if (conf->upstream_hedge_min_delay > conf->upstream_hedge_max_delay)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_upstream_hedge_min_delay\" must not be larger than \"vod_upstream_hedge_max_delay\"");
+		return NGX_CONF_ERROR;
+	}
+
+	if (conf->upstream_block_size == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_upstream_block_size\" must be positive");
+		return NGX_CONF_ERROR;
+	}
+
 	if (conf->segmenter.segment_duration <= 0)
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -323,6 +541,13 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		return NGX_CONF_ERROR;
 	}
 
+	if (conf->segmenter.part_duration >= conf->segmenter.segment_duration)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_part_duration\" must be lower than \"vod_segment_duration\"");
+		return NGX_CONF_ERROR;
+	}
+
 #if (NGX_HAVE_LIB_AV_CODEC)
 	if (conf->submodule.name == thumb.name)
 	{
@@ -346,6 +571,15 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 				"\"vod_drm_upstream_location\" is mandatory for drm");
 			return NGX_CONF_ERROR;
 		}
+
+		if (conf->drm_info_refresh_ahead > 0 &&
+			(conf->drm_info_cache == NULL || 
+			conf->drm_info_refresh_ahead >= ngx_buffer_cache_get_expiration(conf->drm_info_cache)))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"vod_drm_info_refresh_ahead\" requires a drm info cache with a longer expiration");
+			return NGX_CONF_ERROR;
+		}
 	}
 
 	// validate the lengths of uri parameters
@@ -628,8 +862,26 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
 	ngx_buffer_cache_t **cache = (ngx_buffer_cache_t **)((u_char*)conf + cmd->offset);
 	ngx_str_t  *value;
+	ngx_str_t persist_path;
+	ngx_str_t partition_name;
+	ngx_str_t str;
+	ngx_uint_t partition_index;
+	ngx_uint_t partition_count;
+	ssize_t partition_sizes[BUFFER_CACHE_MAX_PARTITIONS];
+	ngx_str_t partition_names[BUFFER_CACHE_MAX_PARTITIONS];
+	ngx_uint_t numa_node_count;
+	ngx_uint_t policy;
+	ngx_uint_t i;
+	ngx_flag_t huge_pages;
+	ngx_flag_t numa;
+	ngx_int_t local_count;
+	ngx_int_t min_uses;
+	ngx_int_t shards;
+	ssize_t local_max_entry_size;
+	ssize_t max_entry_size;
 	ssize_t size;
 	time_t expiration;
+	time_t stale;
 
 	value = cf->args->elts;
 
@@ -659,22 +911,258 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		return NGX_CONF_ERROR;
 	}
 
-	if (cf->args->nelts > 3)
+	expiration = 0;
+	stale = 0;
+	shards = 1;
+	policy = BUFFER_CACHE_POLICY_FIFO;
+	max_entry_size = 0;
+	min_uses = 0;
+	local_count = 0;
+	local_max_entry_size = 1024 * 1024;
+	numa = 0;
+	huge_pages = 0;
+	partition_count = 0;
+	ngx_str_null(&persist_path);
+
+	for (i = 3; i < cf->args->nelts; i++)
 	{
-		expiration = ngx_parse_time(&value[3], 1);
+		if (ngx_strncmp(value[i].data, "partition=", sizeof("partition=") - 1) == 0)
+		{
+			// partition=name:size
+			partition_name.data = value[i].data + sizeof("partition=") - 1;
+			str.data = ngx_strlchr(partition_name.data, value[i].data + value[i].len, ':');
+			if (str.data == NULL || str.data == partition_name.data)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid partition %V, it must be name:size", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			partition_name.len = str.data - partition_name.data;
+			str.data++;
+			str.len = value[i].data + value[i].len - str.data;
+
+			if (partition_count >= BUFFER_CACHE_MAX_PARTITIONS)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"too many partitions in \"%V\", the maximum is %d", &cmd->name, BUFFER_CACHE_MAX_PARTITIONS);
+				return NGX_CONF_ERROR;
+			}
+
+			partition_sizes[partition_count] = ngx_parse_size(&str);
+			if (partition_sizes[partition_count] == NGX_ERROR || partition_sizes[partition_count] >= size)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid partition size %V, it must be smaller than the cache size", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			for (partition_index = 0; partition_index < partition_count; partition_index++)
+			{
+				if (partition_names[partition_index].len == partition_name.len &&
+					ngx_strncmp(partition_names[partition_index].data, partition_name.data, partition_name.len) == 0)
+				{
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+						"duplicate partition %V", &partition_name);
+					return NGX_CONF_ERROR;
+				}
+			}
+
+			partition_names[partition_count] = partition_name;
+			partition_count++;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "max_entry_size=", sizeof("max_entry_size=") - 1) == 0)
+		{
+			str.data = value[i].data + sizeof("max_entry_size=") - 1;
+			str.len = value[i].len - (sizeof("max_entry_size=") - 1);
+
+			max_entry_size = ngx_parse_size(&str);
+			if (max_entry_size == NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid max entry size %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "local=", sizeof("local=") - 1) == 0)
+		{
+			local_count = ngx_atoi(value[i].data + sizeof("local=") - 1, value[i].len - (sizeof("local=") - 1));
+			if (local_count == NGX_ERROR || local_count < 1 || local_count > BUFFER_CACHE_MAX_LOCAL_COUNT ||
+				(local_count & (local_count - 1)) != 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid local count %V, it must be a power of 2 between 1 and %d", &value[i], BUFFER_CACHE_MAX_LOCAL_COUNT);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "local_max_entry_size=", sizeof("local_max_entry_size=") - 1) == 0)
+		{
+			str.data = value[i].data + sizeof("local_max_entry_size=") - 1;
+			str.len = value[i].len - (sizeof("local_max_entry_size=") - 1);
+
+			local_max_entry_size = ngx_parse_size(&str);
+			if (local_max_entry_size == NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid local max entry size %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "min_uses=", sizeof("min_uses=") - 1) == 0)
+		{
+			min_uses = ngx_atoi(value[i].data + sizeof("min_uses=") - 1, value[i].len - (sizeof("min_uses=") - 1));
+			if (min_uses == NGX_ERROR || min_uses < 1 || min_uses > BUFFER_CACHE_MAX_MIN_USES)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid min uses %V, it must be between 1 and %d", &value[i], BUFFER_CACHE_MAX_MIN_USES);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "persist=", sizeof("persist=") - 1) == 0)
+		{
+			persist_path.data = value[i].data + sizeof("persist=") - 1;
+			persist_path.len = value[i].len - (sizeof("persist=") - 1);
+
+			if (persist_path.len == 0 ||
+				ngx_conf_full_name(cf->cycle, &persist_path, 0) != NGX_OK)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid persist path %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data, "numa=on") == 0)
+		{
+#if (NGX_LINUX)
+			numa = 1;
+			continue;
+#else
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"numa\" is supported only on linux");
+			return NGX_CONF_ERROR;
+#endif // NGX_LINUX
+		}
+
+		if (ngx_strcmp(value[i].data, "numa=off") == 0)
+		{
+			numa = 0;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data, "huge_pages=on") == 0)
+		{
+#if (NGX_LINUX) && defined(MADV_HUGEPAGE)
+			huge_pages = 1;
+			continue;
+#else
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"huge_pages\" is not supported on this platform");
+			return NGX_CONF_ERROR;
+#endif // NGX_LINUX && MADV_HUGEPAGE
+		}
+
+		if (ngx_strcmp(value[i].data, "huge_pages=off") == 0)
+		{
+			huge_pages = 0;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "shards=", sizeof("shards=") - 1) == 0)
+		{
+			shards = ngx_atoi(value[i].data + sizeof("shards=") - 1, value[i].len - (sizeof("shards=") - 1));
+			if (shards == NGX_ERROR || shards < 1 || shards > BUFFER_CACHE_MAX_SHARDS)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid shard count %V, must be between 1 and %d", &value[i], BUFFER_CACHE_MAX_SHARDS);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "stale=", sizeof("stale=") - 1) == 0)
+		{
+			value[i].data += sizeof("stale=") - 1;
+			value[i].len -= sizeof("stale=") - 1;
+
+			stale = ngx_parse_time(&value[i], 1);
+			if (stale == (time_t)NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid stale time %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "policy=", sizeof("policy=") - 1) == 0)
+		{
+			if (ngx_strcmp(value[i].data + sizeof("policy=") - 1, "fifo") == 0)
+			{
+				policy = BUFFER_CACHE_POLICY_FIFO;
+			}
+			else if (ngx_strcmp(value[i].data + sizeof("policy=") - 1, "tinylfu") == 0)
+			{
+				policy = BUFFER_CACHE_POLICY_TINYLFU;
+			}
+			else
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid cache policy %V, it must be \"fifo\" or \"tinylfu\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (i > 3)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid parameter %V", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		expiration = ngx_parse_time(&value[i], 1);
 		if (expiration == (time_t)NGX_ERROR) 
 		{
 			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-				"invalid expiration %V", &value[3]);
+				"invalid expiration %V", &value[i]);
 			return NGX_CONF_ERROR;
 		}
 	}
-	else
+
+	if (stale > 0 && expiration == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"stale\" requires an expiration in \"%V\"", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	if (min_uses > 1 && policy != BUFFER_CACHE_POLICY_TINYLFU)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"min_uses\" requires \"policy=tinylfu\" in \"%V\"", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	if (partition_count > 0 && numa)
 	{
-		expiration = 0;
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"partition\" is not supported with \"numa=on\" in \"%V\"", &cmd->name);
+		return NGX_CONF_ERROR;
 	}
 
-	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, &ngx_http_vod_module);
+	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, stale, shards, policy, &ngx_http_vod_module);
 	if (*cache == NULL)
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -682,6 +1170,56 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		return NGX_CONF_ERROR;
 	}
 
+	ngx_buffer_cache_set_admission(*cache, max_entry_size, min_uses);
+
+	if (persist_path.len > 0)
+	{
+		ngx_buffer_cache_set_persist_path(*cache, &persist_path);
+	}
+
+	if (local_count > 0 &&
+		ngx_buffer_cache_set_local(cf, *cache, local_count, local_max_entry_size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (huge_pages)
+	{
+		ngx_buffer_cache_set_huge_pages(*cache);
+	}
+
+	if (numa)
+	{
+		numa_node_count = ngx_buffer_cache_detect_numa_node_count(cf->log);
+		if (numa_node_count > 1)
+		{
+			ngx_buffer_cache_set_numa(*cache, numa_node_count);
+		}
+	}
+
+	// Note: the partitions copy the settings of the cache, they must be added last
+	for (partition_index = 0; partition_index < partition_count; partition_index++)
+	{
+		size -= partition_sizes[partition_index];
+		if (size <= 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"the total size of the partitions must be smaller than the cache size in \"%V\"", &cmd->name);
+			return NGX_CONF_ERROR;
+		}
+
+		if (ngx_buffer_cache_add_partition(
+			cf, 
+			*cache, 
+			&partition_names[partition_index], 
+			partition_sizes[partition_index]) == NULL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"failed to add partition %V", &partition_names[partition_index]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
 	return NGX_CONF_OK;
 }
 
@@ -715,104 +1253,161 @@ ngx_http_vod_perf_counters_command(ngx_conf_t *cf, ngx_command_t *cmd, void *con
 	return NGX_CONF_OK;
 }
 
-static char*
-ngx_http_vod_buffer_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static char *
+ngx_http_vod_popularity_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-	buffer_pool_t** buffer_pool = (buffer_pool_t **)((u_char*)conf + cmd->offset);
+	ngx_popularity_t **zone = (ngx_popularity_t **)((u_char*)conf + cmd->offset);
 	ngx_str_t  *value;
-	ngx_int_t count;
-	ssize_t buffer_size;
+	ngx_uint_t i;
+	ngx_int_t top_count;
+	time_t decay;
+
+	value = cf->args->elts;
 
-	if (*buffer_pool != NULL)
+	if (*zone != NULL)
 	{
 		return "is duplicate";
 	}
 
-	value = cf->args->elts;
-
-	buffer_size = ngx_parse_size(&value[1]);
-	if (buffer_size == NGX_ERROR)
+	if (ngx_strcmp(value[1].data, "off") == 0)
 	{
-		return "invalid size";
+		*zone = NULL;
+		return NGX_CONF_OK;
 	}
 
-	count = ngx_atoi(value[2].data, value[2].len);
-	if (count == NGX_ERROR)
+	decay = 300;
+	top_count = 20;
+
+	for (i = 2; i < cf->args->nelts; i++)
 	{
-		return "invalid count";
+		if (ngx_strncmp(value[i].data, "decay=", sizeof("decay=") - 1) == 0)
+		{
+			value[i].data += sizeof("decay=") - 1;
+			value[i].len -= sizeof("decay=") - 1;
+
+			decay = ngx_parse_time(&value[i], 1);
+			if (decay == (time_t)NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid decay time %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "top=", sizeof("top=") - 1) == 0)
+		{
+			top_count = ngx_atoi(value[i].data + sizeof("top=") - 1, value[i].len - (sizeof("top=") - 1));
+			if (top_count == NGX_ERROR || top_count > POPULARITY_MAX_TOP_COUNT)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid top count %V, must be between 0 and %d", &value[i], POPULARITY_MAX_TOP_COUNT);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter %V", &value[i]);
+		return NGX_CONF_ERROR;
 	}
-	
-	*buffer_pool = buffer_pool_create(cf->pool, cf->log, buffer_size, count);
-	if (*buffer_pool == NULL)
+
+	*zone = ngx_popularity_create(cf, &value[1], decay, top_count, &ngx_http_vod_module);
+	if (*zone == NULL)
 	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to create popularity zone");
 		return NGX_CONF_ERROR;
 	}
-	
+
 	return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_vod(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_vod_media_set_override_json_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-	const ngx_http_vod_submodule_t** cur_module;
 	ngx_http_vod_loc_conf_t *vod_conf = conf;
-	ngx_http_core_loc_conf_t *clcf;
-	ngx_flag_t found_module;
 	ngx_str_t *value;
-	ngx_str_t module_names;
-	size_t module_names_size;
-	u_char* p;
+	char* rv;
 
-	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-	clcf->handler = ngx_http_vod_handler;
+	rv = ngx_http_set_complex_value_slot(cf, cmd, conf);
+	if (rv != NGX_CONF_OK)
+	{
+		return rv;
+	}
 
+	// parse the json once, when it is constant or has variables only inside strings
 	value = cf->args->elts;
 
-	// file serve
-	if (ngx_strcasecmp(value[1].data, (u_char *) "none") == 0)
+	if (ngx_http_vod_json_template_compile(cf, &value[1], &vod_conf->media_set_override_template) != NGX_OK)
 	{
-		ngx_memzero(&vod_conf->submodule, sizeof(vod_conf->submodule));
-		return NGX_CONF_OK;
+		return NGX_CONF_ERROR;
 	}
 
-	// submodule
-	found_module = 0;
-	module_names_size = 1;
-	for (cur_module = submodules; *cur_module != NULL; cur_module++)
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_request_samples_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_request_samples_t **zone = (ngx_request_samples_t **)((u_char*)conf + cmd->offset);
+	ngx_str_t  *value;
+	ngx_uint_t i;
+	ngx_int_t count;
+	ngx_int_t rate;
+
+	value = cf->args->elts;
+
+	if (*zone != NULL)
 	{
-		if (ngx_strcasecmp(value[1].data, (*cur_module)->name) == 0)
-		{
-			vod_conf->submodule = **cur_module;
-			found_module = 1;
-			break;
-		}
-		module_names_size += (*cur_module)->name_len + 1;
+		return "is duplicate";
 	}
 
-	if (!found_module)
+	if (ngx_strcmp(value[1].data, "off") == 0)
 	{
-		// combine the module names
-		module_names.data = ngx_palloc(cf->pool, module_names_size);
-		if (module_names.data == NULL)
+		*zone = NULL;
+		return NGX_CONF_OK;
+	}
+
+	count = 1024;
+	rate = 1000;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "count=", sizeof("count=") - 1) == 0)
 		{
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "failed to allocate modules names");
-			return NGX_CONF_ERROR;
+			count = ngx_atoi(value[i].data + sizeof("count=") - 1, value[i].len - (sizeof("count=") - 1));
+			if (count == NGX_ERROR || count <= 0 || count > REQUEST_SAMPLES_MAX_COUNT)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid sample count %V, must be between 1 and %d", &value[i], REQUEST_SAMPLES_MAX_COUNT);
+				return NGX_CONF_ERROR;
+			}
+			continue;
 		}
 
-		p = module_names.data;
-		for (cur_module = submodules; *cur_module != NULL; cur_module++)
+		if (ngx_strncmp(value[i].data, "rate=", sizeof("rate=") - 1) == 0)
 		{
-			*p++ = ',';
-			p = ngx_copy(p, (*cur_module)->name, (*cur_module)->name_len);
+			rate = ngx_atoi(value[i].data + sizeof("rate=") - 1, value[i].len - (sizeof("rate=") - 1));
+			if (rate == NGX_ERROR || rate <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid sample rate %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
 		}
-		*p = '\0';
-		module_names.len = p - module_names.data;
 
-		// print the error message
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-			"invalid value \"%s\" in \"%s\" directive, "
-			"it must be one of: none%V",
-			value[1].data, cmd->name.data, &module_names);
+			"invalid parameter %V", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	*zone = ngx_request_samples_create(cf, &value[1], count, rate, &ngx_http_vod_module);
+	if (*zone == NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to create request samples zone");
 		return NGX_CONF_ERROR;
 	}
 
@@ -820,22 +1415,494 @@ ngx_http_vod(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 static char *
-ngx_http_vod_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_vod_upstream_concurrency_zone_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-	ngx_http_core_loc_conf_t *clcf;
-
-	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-	clcf->handler = ngx_http_vod_status_handler;
+	ngx_http_vod_loc_conf_t *vod_conf = conf;
+	ngx_str_t  *value;
+	ngx_int_t max_concurrency;
 
-	return NGX_CONF_OK;
-}
+	value = cf->args->elts;
 
-static ngx_conf_enum_t manifest_duration_policies[] = {
+	if (vod_conf->upstream_limit_zone != NULL)
+	{
+		return "is duplicate";
+	}
+
+	max_concurrency = ngx_atoi(value[2].data, value[2].len);
+	if (max_concurrency == NGX_ERROR || max_concurrency <= 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid max concurrency %V", &value[2]);
+		return NGX_CONF_ERROR;
+	}
+
+	vod_conf->upstream_limit_zone = ngx_shared_limit_create(cf, &value[1], &ngx_http_vod_module);
+	if (vod_conf->upstream_limit_zone == NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to create upstream concurrency zone");
+		return NGX_CONF_ERROR;
+	}
+
+	vod_conf->upstream_shared_max_concurrency = max_concurrency;
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_segment_store_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_vod_loc_conf_t *vod_conf = conf;
+	ngx_str_t* thread_pool = NULL;
+	ngx_str_t  *value;
+	ngx_str_t path;
+	ngx_uint_t i;
+	time_t expiration = 0;
+	off_t max_size;
+
+	value = cf->args->elts;
+
+	if (vod_conf->segment_store != NGX_CONF_UNSET_PTR)
+	{
+		return "is duplicate";
+	}
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		if (cf->args->nelts != 2)
+		{
+			return "invalid number of arguments";
+		}
+
+		vod_conf->segment_store = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if (cf->args->nelts < 4)
+	{
+		return "invalid number of arguments";
+	}
+
+	path = value[2];
+	if (ngx_conf_full_name(cf->cycle, &path, 0) != NGX_OK)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid path %V", &value[2]);
+		return NGX_CONF_ERROR;
+	}
+
+	max_size = ngx_parse_offset(&value[3]);
+	if (max_size == NGX_ERROR || max_size <= 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid max size %V", &value[3]);
+		return NGX_CONF_ERROR;
+	}
+
+	for (i = 4; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "expiration=", sizeof("expiration=") - 1) == 0)
+		{
+			value[i].data += sizeof("expiration=") - 1;
+			value[i].len -= sizeof("expiration=") - 1;
+
+			expiration = ngx_parse_time(&value[i], 1);
+			if (expiration == (time_t)NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid expiration %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "thread_pool=", sizeof("thread_pool=") - 1) == 0)
+		{
+#if (NGX_THREADS)
+			thread_pool = &value[i];
+			thread_pool->data += sizeof("thread_pool=") - 1;
+			thread_pool->len -= sizeof("thread_pool=") - 1;
+			continue;
+#else
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"%V\" requires nginx to be built with threads", &value[i]);
+			return NGX_CONF_ERROR;
+#endif // NGX_THREADS
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	vod_conf->segment_store = ngx_segment_store_create(cf, &value[1], &path, max_size, expiration, thread_pool,
+		&ngx_http_vod_module);
+	if (vod_conf->segment_store == NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to create segment store");
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_object_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_object_cache_t **cache = (ngx_object_cache_t **)((u_char*)conf + cmd->offset);
+	ngx_str_t  *value;
+	ngx_str_t s;
+	ngx_int_t max_count;
+	ngx_uint_t i;
+	time_t valid;
+
+	value = cf->args->elts;
+
+	if (*cache != NGX_CONF_UNSET_PTR)
+	{
+		return "is duplicate";
+	}
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		*cache = NULL;
+		return NGX_CONF_OK;
+	}
+
+	max_count = ngx_atoi(value[1].data, value[1].len);
+	if (max_count == NGX_ERROR || max_count <= 0 || max_count > OBJECT_CACHE_MAX_COUNT)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid count %V, must be between 1 and %d", &value[1], OBJECT_CACHE_MAX_COUNT);
+		return NGX_CONF_ERROR;
+	}
+
+	valid = 30;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "valid=", sizeof("valid=") - 1) == 0)
+		{
+			s.data = value[i].data + sizeof("valid=") - 1;
+			s.len = value[i].len - (sizeof("valid=") - 1);
+
+			valid = ngx_parse_time(&s, 1);
+			if (valid == (time_t)NGX_ERROR || valid <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid valid time %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter %V", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	*cache = ngx_object_cache_create(cf, max_count, valid);
+	if (*cache == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static char*
+ngx_http_vod_buffer_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	buffer_pool_t** buffer_pool = (buffer_pool_t **)((u_char*)conf + cmd->offset);
+	ngx_str_t  *value;
+	ngx_int_t max_count;
+	ngx_int_t count;
+	ssize_t buffer_size;
+
+	value = cf->args->elts;
+
+	buffer_size = ngx_parse_size(&value[1]);
+	if (buffer_size == NGX_ERROR)
+	{
+		return "invalid size";
+	}
+
+	count = ngx_atoi(value[2].data, value[2].len);
+	if (count == NGX_ERROR)
+	{
+		return "invalid count";
+	}
+
+	if (cf->args->nelts > 3)
+	{
+		max_count = ngx_atoi(value[3].data, value[3].len);
+		if (max_count == NGX_ERROR)
+		{
+			return "invalid max count";
+		}
+	}
+	else
+	{
+		max_count = count;
+	}
+
+	// Note: the directive can be repeated in order to add more sizes to the pool
+	if (*buffer_pool == NULL)
+	{
+		*buffer_pool = buffer_pool_create(cf->pool, cf->log);
+		if (*buffer_pool == NULL)
+		{
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if (buffer_pool_add_size(*buffer_pool, cf->pool, cf->log, buffer_size, count, max_count) != VOD_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static char*
+ngx_http_vod_request_arena_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	request_arena_t** request_arena = (request_arena_t **)((u_char*)conf + cmd->offset);
+	ngx_str_t  *value;
+	ngx_int_t count;
+	ssize_t block_size;
+
+	if (*request_arena != NULL)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	block_size = ngx_parse_size(&value[1]);
+	if (block_size == NGX_ERROR)
+	{
+		return "invalid size";
+	}
+
+	count = ngx_atoi(value[2].data, value[2].len);
+	if (count == NGX_ERROR)
+	{
+		return "invalid count";
+	}
+
+	*request_arena = request_arena_create(cf->pool, cf->log, block_size, count);
+	if (*request_arena == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_mapping_cache_dictionary_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_vod_loc_conf_t *vod_conf = conf;
+	ngx_file_info_t fi;
+	ngx_file_t file;
+	ngx_str_t *value;
+	ssize_t n;
+	off_t size;
+	u_char* p;
+
+	if (vod_conf->mapping_cache_dictionary.data != NULL)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_conf_full_name(cf->cycle, &value[1], 1) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_memzero(&file, sizeof(file));
+	file.name = value[1];
+	file.log = cf->log;
+
+	file.fd = ngx_open_file(value[1].data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (file.fd == NGX_INVALID_FILE)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+			ngx_open_file_n " \"%V\" failed", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+			ngx_fd_info_n " \"%V\" failed", &value[1]);
+		goto failed;
+	}
+
+	size = ngx_file_size(&fi);
+	if (size <= 0 || size > NGX_HTTP_VOD_MAX_MAPPING_DICTIONARY_SIZE)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid size %O of dictionary \"%V\", must be between 1 and %d",
+			size, &value[1], NGX_HTTP_VOD_MAX_MAPPING_DICTIONARY_SIZE);
+		goto failed;
+	}
+
+	p = ngx_pnalloc(cf->pool, size);
+	if (p == NULL)
+	{
+		goto failed;
+	}
+
+	n = ngx_read_file(&file, p, size, 0);
+	if (n != size)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to read dictionary \"%V\", read %z bytes", &value[1], n);
+		goto failed;
+	}
+
+	ngx_close_file(file.fd);
+
+	vod_conf->mapping_cache_dictionary.data = p;
+	vod_conf->mapping_cache_dictionary.len = size;
+
+	return NGX_CONF_OK;
+
+failed:
+
+	ngx_close_file(file.fd);
+	return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_vod(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	const ngx_http_vod_submodule_t** cur_module;
+	ngx_http_vod_loc_conf_t *vod_conf = conf;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_flag_t found_module;
+	ngx_str_t *value;
+	ngx_str_t module_names;
+	size_t module_names_size;
+	u_char* p;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_handler;
+
+	value = cf->args->elts;
+
+	// file serve
+	if (ngx_strcasecmp(value[1].data, (u_char *) "none") == 0)
+	{
+		ngx_memzero(&vod_conf->submodule, sizeof(vod_conf->submodule));
+		return NGX_CONF_OK;
+	}
+
+	// submodule
+	found_module = 0;
+	module_names_size = 1;
+	for (cur_module = submodules; *cur_module != NULL; cur_module++)
+	{
+		if (ngx_strcasecmp(value[1].data, (*cur_module)->name) == 0)
+		{
+			vod_conf->submodule = **cur_module;
+			found_module = 1;
+			break;
+		}
+		module_names_size += (*cur_module)->name_len + 1;
+	}
+
+	if (!found_module)
+	{
+		// combine the module names
+		module_names.data = ngx_palloc(cf->pool, module_names_size);
+		if (module_names.data == NULL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "failed to allocate modules names");
+			return NGX_CONF_ERROR;
+		}
+
+		p = module_names.data;
+		for (cur_module = submodules; *cur_module != NULL; cur_module++)
+		{
+			*p++ = ',';
+			p = ngx_copy(p, (*cur_module)->name, (*cur_module)->name_len);
+		}
+		*p = '\0';
+		module_names.len = p - module_names.data;
+
+		// print the error message
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid value \"%s\" in \"%s\" directive, "
+			"it must be one of: none%V",
+			value[1].data, cmd->name.data, &module_names);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_status_handler;
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_warmup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_warmup_handler;
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_batch_handler;
+
+	return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_vod_ingest(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_ingest_handler;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_conf_enum_t manifest_duration_policies[] = {
 	{ ngx_string("max"), MDP_MAX },
 	{ ngx_string("min"), MDP_MIN },
 	{ ngx_null_string, 0 }
 };
 
+static ngx_conf_enum_t cache_key_hashes[] = {
+	{ ngx_string("md5"), CACHE_KEY_HASH_MD5 },
+	{ ngx_string("siphash"), CACHE_KEY_HASH_SIPHASH },
+	{ ngx_null_string, 0 }
+};
+
 ngx_command_t ngx_http_vod_commands[] = {
 
 	// basic parameters
@@ -860,6 +1927,41 @@ ngx_command_t ngx_http_vod_commands[] = {
 	0,
 	NULL },
 
+	{ ngx_string("vod_warmup"),
+	NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+	ngx_http_vod_warmup,
+	0,
+	0,
+	NULL },
+
+	{ ngx_string("vod_warmup_concurrency"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, warmup_concurrency),
+	NULL },
+
+	{ ngx_string("vod_batch"),
+	NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+	ngx_http_vod_batch,
+	0,
+	0,
+	NULL },
+
+	{ ngx_string("vod_ingest"),
+	NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+	ngx_http_vod_ingest,
+	0,
+	0,
+	NULL },
+
+	{ ngx_string("vod_ingest_zone"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, ingest_zone),
+	NULL },
+
 	// output generation parameters
 	{ ngx_string("vod_multi_uri_suffix"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -875,6 +1977,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, segmenter.segment_duration),
 	NULL },
 
+	{ ngx_string("vod_part_duration"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segmenter.part_duration),
+	NULL },
+
 	{ ngx_string("vod_live_window_duration"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_vod_set_signed_slot,
@@ -938,118 +2047,405 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, force_playlist_type_vod),
 	NULL },
 
-	{ ngx_string("vod_force_continuous_timestamps"),
+	{ ngx_string("vod_force_continuous_timestamps"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, force_continuous_timestamps),
+	NULL },
+
+	{ ngx_string("vod_force_sequence_index"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, force_sequence_index),
+	NULL },
+
+	{ ngx_string("vod_secret_key"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, secret_key),
+	NULL },
+
+	{ ngx_string("vod_encryption_iv_seed"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, encryption_iv_seed),
+	NULL },
+
+	{ ngx_string("vod_base_url"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, base_url),
+	NULL },
+
+	{ ngx_string("vod_segments_base_url"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segments_base_url),
+	NULL },
+	
+	// mp4 reading parameters
+	{ ngx_string("vod_metadata_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_partition"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_partition),
+	NULL },
+
+	{ ngx_string("vod_cache_tag"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_tag),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_disk_path"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_disk_path),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_remote_location"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_remote_location),
+	NULL },
+
+	{ ngx_string("vod_sidecar_index_location"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, sidecar_index_location),
+	NULL },
+
+	{ ngx_string("vod_sidecar_index_suffix"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, sidecar_index_suffix),
+	NULL },
+
+	{ ngx_string("vod_coalesce_metadata_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesce_metadata_reads),
+	NULL },
+
+	{ ngx_string("vod_coalesce_frame_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesce_frame_reads),
+	NULL },
+
+	{ ngx_string("vod_hot_file_min_uses"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, hot_file_min_uses),
+	NULL },
+
+	{ ngx_string("vod_fadvise"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, fadvise),
+	NULL },
+
+	{ ngx_string("vod_mmap_frames"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mmap_frames),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_compact"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_compact),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_sample_index"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_sample_index),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_incremental"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_incremental),
+	NULL },
+
+	{ ngx_string("vod_parsed_metadata_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+	ngx_http_vod_object_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, parsed_metadata_cache),
+	NULL },
+
+	{ ngx_string("vod_metadata_hint_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_hint_cache),
+	NULL },
+
+	{ ngx_string("vod_response_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
+	NULL },
+
+	{ ngx_string("vod_live_response_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_LIVE]),
+	NULL },
+
+	{ ngx_string("vod_response_cache_zero_copy"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, response_cache_zero_copy),
+	NULL },
+
+	{ ngx_string("vod_response_cache_gzip"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, response_cache_gzip),
+	NULL },
+
+	{ ngx_string("vod_hls_iframes_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, iframes_cache),
+	NULL },
+
+	{ ngx_string("vod_hls_master_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, master_cache),
+	NULL },
+
+	{ ngx_string("vod_segment_durations_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_durations_cache),
+	NULL },
+
+	{ ngx_string("vod_segment_size_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_size_cache),
+	NULL },
+
+	{ ngx_string("vod_initial_read_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, initial_read_size),
+	NULL },
+
+	{ ngx_string("vod_max_metadata_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_metadata_size),
+	NULL },
+
+	{ ngx_string("vod_partial_moov_min_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, partial_moov_min_size),
+	NULL },
+
+	{ ngx_string("vod_max_frames_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_frames_size),
+	NULL },
+
+	{ ngx_string("vod_max_request_memory"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_request_memory),
+	NULL },
+
+	{ ngx_string("vod_cache_buffer_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_buffer_size),
+	NULL },
+
+	{ ngx_string("vod_max_coalesced_read_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_coalesced_read_size),
+	NULL },
+
+	{ ngx_string("vod_parallel_frame_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, parallel_frame_reads),
+	NULL },
+
+	{ ngx_string("vod_parallel_metadata_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, parallel_metadata_reads),
+	NULL },
+
+	{ ngx_string("vod_prefetch_next_segment"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, prefetch_next_segment),
+	NULL },
+
+	{ ngx_string("vod_prefetch_sibling_segments"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, prefetch_sibling_segments),
+	NULL },
+
+	{ ngx_string("vod_prefetch_max_concurrency"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_flag_slot,
+	ngx_conf_set_num_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, force_continuous_timestamps),
+	offsetof(ngx_http_vod_loc_conf_t, prefetch_max_concurrency),
 	NULL },
 
-	{ ngx_string("vod_force_sequence_index"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	{ ngx_string("vod_sendfile_frames"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
 	ngx_conf_set_flag_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, force_sequence_index),
+	offsetof(ngx_http_vod_loc_conf_t, sendfile_frames),
 	NULL },
 
-	{ ngx_string("vod_secret_key"),
+	{ ngx_string("vod_output_chunk_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_http_set_complex_value_slot,
+	ngx_conf_set_size_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, secret_key),
+	offsetof(ngx_http_vod_loc_conf_t, output_chunk_size),
 	NULL },
 
-	{ ngx_string("vod_encryption_iv_seed"),
+	{ ngx_string("vod_max_unsent_output_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_http_set_complex_value_slot,
+	ngx_conf_set_size_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, encryption_iv_seed),
+	offsetof(ngx_http_vod_loc_conf_t, max_unsent_output_size),
 	NULL },
 
-	{ ngx_string("vod_base_url"),
+	{ ngx_string("vod_ignore_edit_list"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_http_set_complex_value_slot,
+	ngx_conf_set_flag_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, base_url),
+	offsetof(ngx_http_vod_loc_conf_t, ignore_edit_list),
 	NULL },
 
-	{ ngx_string("vod_segments_base_url"),
+	{ ngx_string("vod_parse_hdlr_name"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_http_set_complex_value_slot,
-	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, segments_base_url),
-	NULL },
-	
-	// mp4 reading parameters
-	{ ngx_string("vod_metadata_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
-	ngx_http_vod_cache_command,
+	ngx_conf_set_flag_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, metadata_cache),
+	offsetof(ngx_http_vod_loc_conf_t, parse_hdlr_name),
 	NULL },
 
-	{ ngx_string("vod_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
-	ngx_http_vod_cache_command,
+	// upstream parameters - only for mapped/remote modes
+	{ ngx_string("vod_max_upstream_headers_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
+	offsetof(ngx_http_vod_loc_conf_t, max_upstream_headers_size),
 	NULL },
 
-	{ ngx_string("vod_live_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	{ ngx_string("vod_upstream_block_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_LIVE]),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_block_cache),
 	NULL },
 
-	{ ngx_string("vod_initial_read_size"),
+	{ ngx_string("vod_upstream_block_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_size_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, initial_read_size),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_block_size),
 	NULL },
 
-	{ ngx_string("vod_max_metadata_size"),
+	{ ngx_string("vod_upstream_hedge_percentile"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_size_slot,
+	ngx_conf_set_num_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, max_metadata_size),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge_percentile),
 	NULL },
 
-	{ ngx_string("vod_max_frames_size"),
+	{ ngx_string("vod_upstream_hedge_min_delay"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_size_slot,
+	ngx_conf_set_msec_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, max_frames_size),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge_min_delay),
 	NULL },
 
-	{ ngx_string("vod_cache_buffer_size"),
+	{ ngx_string("vod_upstream_hedge_max_delay"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_size_slot,
+	ngx_conf_set_msec_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, cache_buffer_size),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge_max_delay),
 	NULL },
 
-	{ ngx_string("vod_ignore_edit_list"),
+	{ ngx_string("vod_upstream_max_concurrency"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_flag_slot,
+	ngx_conf_set_num_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, ignore_edit_list),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_max_concurrency),
 	NULL },
 
-	{ ngx_string("vod_parse_hdlr_name"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_flag_slot,
+	{ ngx_string("vod_upstream_concurrency_zone"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+	ngx_http_vod_upstream_concurrency_zone_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, parse_hdlr_name),
+	0,
 	NULL },
 
-	// upstream parameters - only for mapped/remote modes
-	{ ngx_string("vod_max_upstream_headers_size"),
+	{ ngx_string("vod_upstream_max_queued"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_conf_set_size_slot,
+	ngx_conf_set_num_slot,
 	NGX_HTTP_LOC_CONF_OFFSET,
-	offsetof(ngx_http_vod_loc_conf_t, max_upstream_headers_size),
+	offsetof(ngx_http_vod_loc_conf_t, upstream_max_queued),
 	NULL },
 
 	{ ngx_string("vod_upstream_location"),
@@ -1075,26 +2471,117 @@ ngx_command_t ngx_http_vod_commands[] = {
 
 	// path request parameters - mapped mode only
 	{ ngx_string("vod_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]),
 	NULL },
 
 	{ ngx_string("vod_live_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_LIVE]),
 	NULL },
 
 	{ ngx_string("vod_dynamic_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, dynamic_mapping_cache),
 	NULL },
 
+	{ ngx_string("vod_audio_filter_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, audio_filter_cache),
+	NULL },
+
+	{ ngx_string("vod_thumb_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, thumb_cache),
+	NULL },
+
+	{ ngx_string("vod_volume_map_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, volume_map_cache),
+	NULL },
+
+	{ ngx_string("vod_segment_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_cache),
+	NULL },
+
+	{ ngx_string("vod_segment_store"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_segment_store_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	0,
+	NULL },
+
+	{ ngx_string("vod_cmaf_segments"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cmaf_segments),
+	NULL },
+
+	{ ngx_string("vod_segment_frames_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_frames_cache),
+	NULL },
+
+	{ ngx_string("vod_resident_frames_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, resident_frames_cache),
+	NULL },
+
+	{ ngx_string("vod_clip_header_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, clip_header_cache),
+	NULL },
+
+	{ ngx_string("vod_notification_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, notification_cache),
+	NULL },
+
+	{ ngx_string("vod_mapping_cache_msgpack"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mapping_cache_msgpack),
+	NULL },
+
+	{ ngx_string("vod_mapping_cache_compress"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mapping_cache_compress),
+	NULL },
+
+	{ ngx_string("vod_mapping_cache_compress_dictionary"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_vod_mapping_cache_dictionary_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	0,
+	NULL },
+
 	{ ngx_string("vod_path_response_prefix"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_str_slot,
@@ -1116,6 +2603,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, max_mapping_response_size),
 	NULL },
 
+	{ ngx_string("vod_mapping_parallel_requests"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mapping_parallel_requests),
+	NULL },
+
 	{ ngx_string("vod_notification_uri"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_set_complex_value_slot,
@@ -1123,6 +2617,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, notification_uri),
 	NULL },
 
+	{ ngx_string("vod_notification_background"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, notification_background),
+	NULL },
+
 	{ ngx_string("vod_dynamic_clip_map_uri"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_set_complex_value_slot,
@@ -1160,7 +2661,7 @@ ngx_command_t ngx_http_vod_commands[] = {
 
 	{ ngx_string("vod_media_set_override_json"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-	ngx_http_set_complex_value_slot,
+	ngx_http_vod_media_set_override_json_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, media_set_override_json),
 	NULL },
@@ -1173,6 +2674,20 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, fallback_upstream_location),
 	NULL },
 
+	{ ngx_string("vod_fallback_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, fallback_cache),
+	NULL },
+
+	{ ngx_string("vod_cache_key_hash"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_enum_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_key_hash),
+	cache_key_hashes },
+
 	{ ngx_string("vod_proxy_header_name"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_str_slot,
@@ -1262,12 +2777,19 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 
 	{ ngx_string("vod_drm_info_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, drm_info_cache),
 	NULL },
 
+	{ ngx_string("vod_drm_info_refresh_ahead"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, drm_info_refresh_ahead),
+	NULL },
+
 	{ ngx_string("vod_drm_request_uri"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_set_complex_value_slot,
@@ -1333,13 +2855,83 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, perf_counters_zone),
 	NULL },
 
+	{ ngx_string("vod_popularity_zone"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	ngx_http_vod_popularity_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, popularity_zone),
+	NULL },
+
+	{ ngx_string("vod_request_samples"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	ngx_http_vod_request_samples_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, request_samples_zone),
+	NULL },
+
+	{ ngx_string("vod_server_timing"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, server_timing),
+	NULL },
+
+	{ ngx_string("vod_slow_request_threshold"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_msec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, slow_request_threshold),
+	NULL },
+
+	{ ngx_string("vod_low_priority_requests"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_conf_set_bitmask_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, low_priority_requests),
+	ngx_http_vod_admission_classes },
+
+	{ ngx_string("vod_low_priority_max_concurrency"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, low_priority_max_concurrency),
+	NULL },
+
+	{ ngx_string("vod_shed_latency_threshold"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_msec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, shed_latency_threshold),
+	NULL },
+
+	{ ngx_string("vod_shed_retry_after"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, shed_retry_after),
+	NULL },
+
 	{ ngx_string("vod_output_buffer_pool"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE23,
 	ngx_http_vod_buffer_pool_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, output_buffer_pool),
 	NULL },
 
+	{ ngx_string("vod_read_buffer_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE23,
+	ngx_http_vod_buffer_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, read_buffer_pool),
+	NULL },
+
+	{ ngx_string("vod_request_arena"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+	ngx_http_vod_request_arena_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, request_arena),
+	NULL },
+
 #if (NGX_THREADS)
 	{ ngx_string("vod_open_file_thread_pool"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
@@ -1347,8 +2939,73 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, open_file_thread_pool),
 	NULL },
+
+	{ ngx_string("vod_open_file_not_found_valid"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, open_file_not_found_valid),
+	NULL },
+
+	{ ngx_string("vod_open_file_immutable_valid"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, open_file_immutable_valid),
+	NULL },
+
+	{ ngx_string("vod_parse_metadata_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, parse_metadata_thread_pool),
+	NULL },
+
+	{ ngx_string("vod_metadata_cache_disk_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, metadata_cache_disk_thread_pool),
+	NULL },
+
+	{ ngx_string("vod_audio_filter_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, audio_filter_thread_pool),
+	NULL },
+
+	{ ngx_string("vod_thumb_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, thumb_thread_pool),
+	NULL },
+
+	{ ngx_string("vod_volume_map_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, volume_map_thread_pool),
+	NULL },
+
+	{ ngx_string("vod_processing_thread_pool"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+	ngx_http_vod_thread_pool_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, processing_thread_pool),
+	NULL },
 #endif // NGX_THREADS
 
+#if (NGX_HAVE_IO_URING)
+	{ ngx_string("vod_io_uring"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, io_uring),
+	NULL },
+#endif // NGX_HAVE_IO_URING
+
 #include "ngx_http_vod_dash_commands.h"
 #include "ngx_http_vod_hds_commands.h"
 #include "ngx_http_vod_hls_commands.h"
@@ -8,6 +8,12 @@
 #include "ngx_http_vod_hds_conf.h"
 #include "ngx_http_vod_hls_conf.h"
 #include "ngx_http_vod_mss_conf.h"
+#include "ngx_object_cache.h"
+#include "ngx_popularity.h"
+#include "ngx_request_samples.h"
+#include "ngx_http_vod_json_template.h"
+#include "ngx_shared_limit.h"
+#include "ngx_segment_store.h"
 #include "vod/segmenter.h"
 
 #if (NGX_HAVE_LIB_AV_CODEC)
@@ -47,29 +53,93 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_http_complex_value_t *base_url;
 	ngx_http_complex_value_t *segments_base_url;
 	ngx_buffer_cache_t* metadata_cache;
+	ngx_http_complex_value_t* metadata_cache_partition;
+	ngx_http_complex_value_t* cache_tag;
+	ngx_str_t metadata_cache_disk_path;
+	ngx_str_t metadata_cache_remote_location;
+	ngx_str_t sidecar_index_location;
+	ngx_str_t sidecar_index_suffix;
+	ngx_flag_t coalesce_metadata_reads;
+	ngx_flag_t coalesce_frame_reads;
+	ngx_uint_t hot_file_min_uses;
+	ngx_flag_t fadvise;
+	ngx_flag_t mmap_frames;
+	ngx_flag_t metadata_cache_compact;
+	ngx_flag_t metadata_cache_sample_index;
+	ngx_flag_t metadata_cache_incremental;
+	ngx_buffer_cache_t* metadata_hint_cache;
+	ngx_object_cache_t* parsed_metadata_cache;
 	ngx_buffer_cache_t* response_cache[CACHE_TYPE_COUNT];
+	ngx_flag_t response_cache_zero_copy;
+	ngx_flag_t response_cache_gzip;
+	ngx_buffer_cache_t* iframes_cache;
+	ngx_buffer_cache_t* master_cache;
+	ngx_buffer_cache_t* segment_durations_cache;
+	ngx_buffer_cache_t* segment_size_cache;
 	size_t initial_read_size;
 	size_t max_metadata_size;
+	size_t partial_moov_min_size;
 	size_t max_frames_size;
+	size_t max_request_memory;
 	size_t cache_buffer_size;
+	ngx_flag_t parallel_frame_reads;
+	ngx_flag_t parallel_metadata_reads;
+	ngx_flag_t prefetch_next_segment;
+	ngx_flag_t prefetch_sibling_segments;
+	ngx_uint_t prefetch_max_concurrency;
+	ngx_uint_t warmup_concurrency;
+	ngx_buffer_cache_t* ingest_zone;
+	size_t max_coalesced_read_size;
+	ngx_flag_t sendfile_frames;
+	size_t output_chunk_size;
+	size_t max_unsent_output_size;
 	buffer_pool_t* output_buffer_pool;
+	buffer_pool_t* read_buffer_pool;
+	request_arena_t* request_arena;
 	size_t max_upstream_headers_size;
+	ngx_buffer_cache_t* upstream_block_cache;
+	size_t upstream_block_size;
+	ngx_uint_t upstream_hedge_percentile;
+	ngx_msec_t upstream_hedge_min_delay;
+	ngx_msec_t upstream_hedge_max_delay;
+	ngx_uint_t upstream_max_concurrency;
+	ngx_shared_limit_t* upstream_limit_zone;
+	ngx_uint_t upstream_shared_max_concurrency;
+	ngx_uint_t upstream_max_queued;
 	ngx_flag_t ignore_edit_list;
 	ngx_flag_t parse_hdlr_name;
 	int parse_flags;
 	ngx_http_complex_value_t *upstream_extra_args;
 	ngx_buffer_cache_t* mapping_cache[CACHE_TYPE_COUNT];
 	ngx_buffer_cache_t* dynamic_mapping_cache;
+	ngx_buffer_cache_t* audio_filter_cache;
+	ngx_buffer_cache_t* thumb_cache;
+	ngx_buffer_cache_t* volume_map_cache;
+	ngx_buffer_cache_t* segment_cache;
+	ngx_segment_store_t* segment_store;
+	ngx_flag_t cmaf_segments;
+	ngx_buffer_cache_t* segment_frames_cache;
+	ngx_buffer_cache_t* resident_frames_cache;
+	ngx_buffer_cache_t* clip_header_cache;
+	ngx_buffer_cache_t* notification_cache;
+	ngx_buffer_cache_t* fallback_cache;
+	ngx_uint_t cache_key_hash;
+	ngx_flag_t mapping_cache_msgpack;
+	ngx_flag_t mapping_cache_compress;
+	ngx_str_t mapping_cache_dictionary;
 	ngx_str_t path_response_prefix;
 	ngx_str_t path_response_postfix;
 	size_t max_mapping_response_size;
+	ngx_uint_t mapping_parallel_requests;
 	ngx_http_complex_value_t* notification_uri;
+	ngx_flag_t notification_background;
 	ngx_http_complex_value_t* dynamic_clip_map_uri;
 	ngx_http_complex_value_t* source_clip_map_uri;
 	ngx_http_complex_value_t* redirect_segments_url;
 	ngx_http_complex_value_t* media_set_map_uri;
 	ngx_http_complex_value_t* apply_dynamic_mapping;
 	ngx_http_complex_value_t* media_set_override_json;
+	ngx_http_vod_json_template_t* media_set_override_template;
 	ngx_str_t fallback_upstream_location;
 	ngx_table_elt_t proxy_header;
 	ngx_flag_t force_playlist_type_vod;
@@ -87,6 +157,7 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_str_t drm_upstream_location;
 	size_t drm_max_info_length;
 	ngx_buffer_cache_t* drm_info_cache;
+	time_t drm_info_refresh_ahead;
 	ngx_http_complex_value_t *drm_request_uri;
 	ngx_uint_t min_single_nalu_per_frame_segment;
 
@@ -98,10 +169,29 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_str_t lang_param_name;
 
 	ngx_shm_zone_t* perf_counters_zone;
+	ngx_popularity_t* popularity_zone;
+	ngx_request_samples_t* request_samples_zone;
+	ngx_flag_t server_timing;
+	ngx_msec_t slow_request_threshold;
+	ngx_uint_t low_priority_requests;
+	ngx_uint_t low_priority_max_concurrency;
+	ngx_msec_t shed_latency_threshold;
+	time_t shed_retry_after;
 
 #if (NGX_THREADS)
 	ngx_thread_pool_t *open_file_thread_pool;
+	time_t open_file_not_found_valid;
+	time_t open_file_immutable_valid;
+	ngx_thread_pool_t *parse_metadata_thread_pool;
+	ngx_thread_pool_t *metadata_cache_disk_thread_pool;
+	ngx_thread_pool_t *audio_filter_thread_pool;
+	ngx_thread_pool_t *thumb_thread_pool;
+	ngx_thread_pool_t *volume_map_thread_pool;
+	ngx_thread_pool_t *processing_thread_pool;
 #endif // NGX_THREADS
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t io_uring;
+#endif // NGX_HAVE_IO_URING
 
 	// derived fields
 	ngx_hash_t uri_params_hash;
@@ -212,9 +212,11 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 		switch (rc)
 		{
 		case VOD_DONE:		// passthrough
+			ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 1);
 			break;
 
 		case VOD_OK:
+			ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 0);
 			segment_writer = &drm_writer;
 			reuse_buffers = TRUE;		// mp4_cenc_encrypt allocates new buffers
 			break;
@@ -255,6 +257,7 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 			&submodule_context->request_context,
 			submodule_context->media_set.sequences,
 			segment_writer->write_tail,
+			segment_writer->write_file,
 			segment_writer->context,
 			reuse_buffers,
 			&state);
@@ -456,6 +459,7 @@ static const ngx_http_vod_request_t dash_manifest_request = {
 	DASH_TIMESCALE,
 	ngx_http_vod_dash_handle_manifest,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_mp4_init_request = {
@@ -466,16 +470,18 @@ static const ngx_http_vod_request_t dash_mp4_init_request = {
 	DASH_TIMESCALE,
 	ngx_http_vod_dash_mp4_handle_init_segment,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_mp4_fragment_request = {
-	REQUEST_FLAG_SINGLE_TRACK,
+	REQUEST_FLAG_SINGLE_TRACK | REQUEST_FLAG_CMAF_FRAGMENT,
 	PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_INITIAL_PTS_DELAY,
 	REQUEST_CLASS_SEGMENT,
 	SUPPORTED_CODECS_MP4,
 	DASH_TIMESCALE,
 	NULL,
 	ngx_http_vod_dash_mp4_init_frame_processor,
+	NULL,
 };
 
 static const ngx_http_vod_request_t edash_mp4_fragment_request = {
@@ -486,6 +492,7 @@ static const ngx_http_vod_request_t edash_mp4_fragment_request = {
 	DASH_TIMESCALE,
 	NULL,
 	ngx_http_vod_dash_mp4_init_frame_processor,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_webm_init_request = {
@@ -496,6 +503,7 @@ static const ngx_http_vod_request_t dash_webm_init_request = {
 	DASH_TIMESCALE,
 	ngx_http_vod_dash_webm_handle_init_segment,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_webm_fragment_request = {
@@ -506,6 +514,7 @@ static const ngx_http_vod_request_t dash_webm_fragment_request = {
 	DASH_TIMESCALE,
 	NULL,
 	ngx_http_vod_dash_webm_init_frame_processor,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_webvtt_file_request = {
@@ -516,6 +525,7 @@ static const ngx_http_vod_request_t dash_webvtt_file_request = {
 	WEBVTT_TIMESCALE,
 	ngx_http_vod_dash_handle_vtt_file,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t dash_ttml_request = {
@@ -526,6 +536,7 @@ static const ngx_http_vod_request_t dash_ttml_request = {
 	TTML_TIMESCALE,
 	ngx_http_vod_dash_handle_ttml_fragment,
 	NULL,
+	NULL,
 };
 
 static void
@@ -584,63 +595,89 @@ ngx_http_vod_dash_parse_uri_file_name(
 	ngx_int_t rc;
 	uint32_t flags;
 
-	// fragment
-	if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, fragment_file_ext))
-	{
-		start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
-		end_pos -= (sizeof(fragment_file_ext) - 1);
-		*request = conf->drm_enabled ? &edash_mp4_fragment_request : &dash_mp4_fragment_request;
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// init segment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.init_file_name_prefix, init_segment_file_ext))
-	{
-		start_pos += conf->dash.mpd_config.init_file_name_prefix.len;
-		end_pos -= (sizeof(init_segment_file_ext) - 1);
-		*request = &dash_mp4_init_request;
-		flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
-	}
-	// webm fragment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, webm_file_ext))
-	{
-		start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
-		end_pos -= (sizeof(webm_file_ext) - 1);
-		*request = &dash_webm_fragment_request;
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// webm init segment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.init_file_name_prefix, webm_file_ext))
-	{
-		start_pos += conf->dash.mpd_config.init_file_name_prefix.len;
-		end_pos -= (sizeof(webm_file_ext) - 1);
-		*request = &dash_webm_init_request;
-		flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
-	}
-	// manifest
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.manifest_file_name_prefix, manifest_file_ext))
-	{
-		start_pos += conf->dash.manifest_file_name_prefix.len;
-		end_pos -= (sizeof(manifest_file_ext) - 1);
-		*request = &dash_manifest_request;
-		flags = PARSE_FILE_NAME_MULTI_STREAMS_PER_TYPE;
-	}
-	// smpte fragment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, ttml_file_ext))
-	{
-		start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
-		end_pos -= (sizeof(ttml_file_ext) - 1);
-		*request = &dash_ttml_request;
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// webvtt file
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.subtitle_file_name_prefix, vtt_file_ext))
+	// Note: the request type is dispatched on the last char of the extension, so that the common
+	//		segment requests are identified with a single prefix/postfix comparison
+	*request = NULL;
+	flags = 0;
+
+	switch (end_pos > start_pos ? end_pos[-1] : '\0')
 	{
-		start_pos += conf->dash.mpd_config.subtitle_file_name_prefix.len;
-		end_pos -= (sizeof(vtt_file_ext) - 1);
-		*request = &dash_webvtt_file_request;
-		flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
+	case 's':
+		// fragment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, fragment_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
+			end_pos -= (sizeof(fragment_file_ext) - 1);
+			*request = conf->drm_enabled ? &edash_mp4_fragment_request : &dash_mp4_fragment_request;
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
+		}
+		break;
+
+	case '4':
+		// init segment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.init_file_name_prefix, init_segment_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.init_file_name_prefix.len;
+			end_pos -= (sizeof(init_segment_file_ext) - 1);
+			*request = &dash_mp4_init_request;
+			flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
+		}
+		break;
+
+	case 'm':
+		// webm fragment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, webm_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
+			end_pos -= (sizeof(webm_file_ext) - 1);
+			*request = &dash_webm_fragment_request;
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
+		}
+		// webm init segment
+		else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.init_file_name_prefix, webm_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.init_file_name_prefix.len;
+			end_pos -= (sizeof(webm_file_ext) - 1);
+			*request = &dash_webm_init_request;
+			flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
+		}
+		break;
+
+	case 'd':
+		// manifest
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.manifest_file_name_prefix, manifest_file_ext))
+		{
+			start_pos += conf->dash.manifest_file_name_prefix.len;
+			end_pos -= (sizeof(manifest_file_ext) - 1);
+			*request = &dash_manifest_request;
+			flags = PARSE_FILE_NAME_MULTI_STREAMS_PER_TYPE;
+		}
+		break;
+
+	case 'l':
+		// smpte fragment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.fragment_file_name_prefix, ttml_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.fragment_file_name_prefix.len;
+			end_pos -= (sizeof(ttml_file_ext) - 1);
+			*request = &dash_ttml_request;
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
+		}
+		break;
+
+	case 't':
+		// webvtt file
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->dash.mpd_config.subtitle_file_name_prefix, vtt_file_ext))
+		{
+			start_pos += conf->dash.mpd_config.subtitle_file_name_prefix.len;
+			end_pos -= (sizeof(vtt_file_ext) - 1);
+			*request = &dash_webvtt_file_request;
+			flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
+		}
+		break;
 	}
-	else
+
+	if (*request == NULL)
 	{
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 			"ngx_http_vod_dash_parse_uri_file_name: unidentified request");
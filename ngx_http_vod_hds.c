@@ -147,6 +147,7 @@ static const ngx_http_vod_request_t hds_manifest_request = {
 	HDS_TIMESCALE,
 	ngx_http_vod_hds_handle_manifest,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hds_bootstrap_request = {
@@ -157,6 +158,7 @@ static const ngx_http_vod_request_t hds_bootstrap_request = {
 	HDS_TIMESCALE,
 	ngx_http_vod_hds_handle_bootstrap,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hds_fragment_request = {
@@ -167,6 +169,7 @@ static const ngx_http_vod_request_t hds_fragment_request = {
 	HDS_TIMESCALE,
 	NULL,
 	ngx_http_vod_hds_init_frame_processor,
+	NULL,
 };
 
 static void
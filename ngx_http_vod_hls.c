@@ -2,6 +2,7 @@
 #include <ngx_md5.h>
 #include "ngx_http_vod_submodule.h"
 #include "ngx_http_vod_utils.h"
+#include "ngx_cache_key.h"
 #include "vod/subtitle/webvtt_builder.h"
 #include "vod/hls/hls_muxer.h"
 #include "vod/mp4/mp4_muxer.h"
@@ -196,26 +197,34 @@ ngx_http_vod_hls_init_encryption_params(
 	return NGX_OK;
 }
 
+// returns NGX_DECLINED when the frames are encrypted while they are muxed (sample aes)
 static ngx_int_t
 ngx_http_vod_hls_init_segment_encryption(
 	ngx_http_vod_submodule_context_t* submodule_context,
 	segment_writer_t* segment_writer,
-	ngx_uint_t container_format,
-	hls_encryption_params_t* encryption_params)
+	ngx_uint_t container_format)
 {
 	aes_cbc_encrypt_context_t* encrypted_write_context;
+	hls_encryption_params_t encryption_params;
 	buffer_pool_t* buffer_pool;
 	vod_status_t rc;
 
-	rc = ngx_http_vod_hls_init_encryption_params(encryption_params, submodule_context, container_format);
-	if (rc != NGX_OK)
+	switch (submodule_context->conf->hls.encryption_method)
 	{
-		return rc;
+	case HLS_ENC_NONE:
+		return NGX_OK;
+
+	case HLS_ENC_AES_128:
+		break;
+
+	default:
+		return NGX_DECLINED;
 	}
 
-	if (encryption_params->type != HLS_ENC_AES_128)
+	rc = ngx_http_vod_hls_init_encryption_params(&encryption_params, submodule_context, container_format);
+	if (rc != NGX_OK)
 	{
-		return NGX_OK;
+		return rc;
 	}
 
 	if (container_format == HLS_CONTAINER_MPEGTS)
@@ -234,8 +243,9 @@ ngx_http_vod_hls_init_segment_encryption(
 		segment_writer->write_tail,
 		segment_writer->context,
 		buffer_pool,
-		encryption_params->key,
-		encryption_params->iv);
+		container_format == HLS_CONTAINER_MPEGTS,
+		encryption_params.key,
+		encryption_params.iv);
 	if (rc != VOD_OK)
 	{
 		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
@@ -244,11 +254,36 @@ ngx_http_vod_hls_init_segment_encryption(
 	}
 
 	segment_writer->write_tail = (write_callback_t)aes_cbc_encrypt_write;
+	segment_writer->write_file = NULL;
 	segment_writer->context = encrypted_write_context;
 	return NGX_OK;
 }
 #endif // NGX_HAVE_OPENSSL_EVP
 
+static ngx_int_t
+ngx_http_vod_hls_init_ts_segment_encryption(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	segment_writer_t* segment_writer)
+{
+#if (NGX_HAVE_OPENSSL_EVP)
+	return ngx_http_vod_hls_init_segment_encryption(submodule_context, segment_writer, HLS_CONTAINER_MPEGTS);
+#else
+	return NGX_OK;
+#endif // NGX_HAVE_OPENSSL_EVP
+}
+
+static ngx_int_t
+ngx_http_vod_hls_init_fmp4_segment_encryption(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	segment_writer_t* segment_writer)
+{
+#if (NGX_HAVE_OPENSSL_EVP)
+	return ngx_http_vod_hls_init_segment_encryption(submodule_context, segment_writer, HLS_CONTAINER_FMP4);
+#else
+	return NGX_OK;
+#endif // NGX_HAVE_OPENSSL_EVP
+}
+
 static ngx_int_t
 ngx_http_vod_hls_handle_master_playlist(
 	ngx_http_vod_submodule_context_t* submodule_context,
@@ -299,7 +334,9 @@ ngx_http_vod_hls_handle_index_playlist(
 	ngx_uint_t container_format;
 	ngx_str_t segments_base_url = ngx_null_string;
 	ngx_str_t base_url = ngx_null_string;
+	ngx_str_t skip;
 	vod_status_t rc;
+	bool_t delta_update;
 
 	if (conf->hls.absolute_index_urls)
 	{
@@ -361,6 +398,10 @@ ngx_http_vod_hls_handle_index_playlist(
 	encryption_params.type = HLS_ENC_NONE;
 #endif // NGX_HAVE_OPENSSL_EVP
 
+	// LL-HLS delta update
+	delta_update = ngx_http_arg(submodule_context->r, (u_char *) "_HLS_skip", sizeof("_HLS_skip") - 1, &skip) == NGX_OK &&
+		skip.len == sizeof("YES") - 1 && ngx_strncmp(skip.data, "YES", sizeof("YES") - 1) == 0;
+
 	rc = m3u8_builder_build_index_playlist(
 		&submodule_context->request_context,
 		&conf->hls.m3u8_config,
@@ -369,6 +410,7 @@ ngx_http_vod_hls_handle_index_playlist(
 		&encryption_params,
 		container_format,
 		&submodule_context->media_set,
+		delta_update,
 		response);
 	if (rc != VOD_OK)
 	{
@@ -383,6 +425,28 @@ ngx_http_vod_hls_handle_index_playlist(
 	return NGX_OK;
 }
 
+static void
+ngx_http_vod_hls_get_iframes_cache_key(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	u_char* key)
+{
+	ngx_http_vod_loc_conf_t* conf = submodule_context->conf;
+	ngx_cache_key_t hash;
+
+	// the iframe positions do not depend on the base url, unlike the playlist held in the response cache
+	ngx_cache_key_init(&hash, conf->cache_key_hash);
+	ngx_cache_key_update(&hash, submodule_context->r->uri.data, submodule_context->r->uri.len);
+	ngx_cache_key_update(&hash, &conf->hls.mpegts_muxer_config, sizeof(conf->hls.mpegts_muxer_config));
+	ngx_cache_key_update(&hash, &conf->segmenter.segment_duration, sizeof(conf->segmenter.segment_duration));
+	ngx_cache_key_update(&hash, &conf->segmenter.align_to_key_frames, sizeof(conf->segmenter.align_to_key_frames));
+	if (conf->segmenter.bootstrap_segments_count > 0)
+	{
+		ngx_cache_key_update(&hash, conf->segmenter.bootstrap_segments_durations, 
+			conf->segmenter.bootstrap_segments_count * sizeof(conf->segmenter.bootstrap_segments_durations[0]));
+	}
+	ngx_cache_key_final(key, &hash);
+}
+
 static ngx_int_t
 ngx_http_vod_hls_handle_iframe_playlist(
 	ngx_http_vod_submodule_context_t* submodule_context,
@@ -390,8 +454,14 @@ ngx_http_vod_hls_handle_iframe_playlist(
 	ngx_str_t* content_type)
 {
 	ngx_http_vod_loc_conf_t* conf = submodule_context->conf;
+	ngx_buffer_cache_t* cache;
 	ngx_str_t base_url = ngx_null_string;
+	ngx_str_t cache_buffer;
+	ngx_str_t iframes = ngx_null_string;
+	ngx_flag_t cache_hit = 0;
 	vod_status_t rc;
+	uint32_t token;
+	u_char cache_key[BUFFER_CACHE_KEY_SIZE];
 	
 	if (conf->hls.encryption_method != HLS_ENC_NONE)
 	{
@@ -425,12 +495,43 @@ ngx_http_vod_hls_handle_iframe_playlist(
 		return ngx_http_vod_status_to_ngx_error(submodule_context->r, VOD_BAD_REQUEST);
 	}
 
+	// try to get the iframe positions from the cache, in order to avoid the muxing simulation
+	cache = submodule_context->media_set.type == MEDIA_SET_VOD ? conf->iframes_cache : NULL;
+	if (cache != NULL)
+	{
+		ngx_http_vod_hls_get_iframes_cache_key(submodule_context, cache_key);
+
+		if (ngx_buffer_cache_fetch(cache, cache_key, &cache_buffer, &token))
+		{
+			iframes.data = ngx_palloc(submodule_context->request_context.pool, cache_buffer.len);
+			if (iframes.data != NULL)
+			{
+				ngx_memcpy(iframes.data, cache_buffer.data, cache_buffer.len);
+				iframes.len = cache_buffer.len;
+				cache_hit = 1;
+			}
+
+			ngx_buffer_cache_release(cache, cache_key, token);
+
+			if (iframes.data == NULL)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+					"ngx_http_vod_hls_handle_iframe_playlist: ngx_palloc failed");
+				return ngx_http_vod_status_to_ngx_error(submodule_context->r, VOD_ALLOC_FAILED);
+			}
+
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_handle_iframe_playlist: iframes cache hit, size is %uz", iframes.len);
+		}
+	}
+
 	rc = m3u8_builder_build_iframe_playlist(
 		&submodule_context->request_context,
 		&conf->hls.m3u8_config,
 		&conf->hls.mpegts_muxer_config,
 		&base_url,
 		&submodule_context->media_set,
+		cache != NULL ? &iframes : NULL,
 		response);
 	if (rc != VOD_OK)
 	{
@@ -439,6 +540,16 @@ ngx_http_vod_hls_handle_iframe_playlist(
 		return ngx_http_vod_status_to_ngx_error(submodule_context->r, rc);
 	}
 
+	// store the iframe positions of the simulation
+	if (cache != NULL && !cache_hit && iframes.len > 0)
+	{
+		if (ngx_buffer_cache_store(cache, cache_key, iframes.data, iframes.len))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_handle_iframe_playlist: stored in iframes cache");
+		}
+	}
+
 	content_type->data = m3u8_content_type;
 	content_type->len = sizeof(m3u8_content_type) - 1;
 	
@@ -485,14 +596,14 @@ ngx_http_vod_hls_init_ts_frame_processor(
 	hls_encryption_params_t encryption_params;
 	hls_muxer_state_t* state;
 	vod_status_t rc;
-	bool_t reuse_output_buffers;
+	bool_t chunked_output;
 
 #if (NGX_HAVE_OPENSSL_EVP)
-	rc = ngx_http_vod_hls_init_segment_encryption(
-		submodule_context,
-		segment_writer,
-		HLS_CONTAINER_MPEGTS,
-		&encryption_params);
+	// Note: aes-128 is applied by init_segment_encryption, on the writer that is passed here
+	rc = ngx_http_vod_hls_init_encryption_params(
+		&encryption_params, 
+		submodule_context, 
+		HLS_CONTAINER_MPEGTS);
 	if (rc != NGX_OK)
 	{
 		return rc;
@@ -504,13 +615,16 @@ ngx_http_vod_hls_init_ts_frame_processor(
 			"ngx_http_vod_hls_init_ts_frame_processor: sample aes cenc not supported with mpeg ts container");
 		return ngx_http_vod_status_to_ngx_error(submodule_context->r, VOD_BAD_REQUEST);
 	}
-
-	reuse_output_buffers = encryption_params.type == HLS_ENC_AES_128;
 #else
 	encryption_params.type = HLS_ENC_NONE;
-	reuse_output_buffers = FALSE;
 #endif // NGX_HAVE_OPENSSL_EVP
 
+	// when chunked output is enabled, skip the size simulation pass and stream the segment without a content length,
+	// range requests and head requests still require the size
+	chunked_output = submodule_context->conf->hls.mpegts_chunked_output &&
+		submodule_context->r->headers_in.range == NULL &&
+		!ngx_http_vod_submodule_size_only(submodule_context);
+
 	rc = hls_muxer_init_segment(
 		&submodule_context->request_context,
 		&submodule_context->conf->hls.mpegts_muxer_config,
@@ -519,8 +633,8 @@ ngx_http_vod_hls_init_ts_frame_processor(
 		&submodule_context->media_set,
 		segment_writer->write_tail,
 		segment_writer->context,
-		reuse_output_buffers,
-		response_size, 
+		FALSE,		// the buffers are passed to the writer, with aes-128 they are encrypted in place
+		chunked_output ? NULL : response_size, 
 		output_buffer,
 		&state);
 	if (rc != VOD_OK)
@@ -530,7 +644,11 @@ ngx_http_vod_hls_init_ts_frame_processor(
 		return ngx_http_vod_status_to_ngx_error(submodule_context->r, rc);
 	}
 
-	if (encryption_params.type == HLS_ENC_AES_128 && 
+	if (chunked_output)
+	{
+		*response_size = NGX_HTTP_VOD_STREAMED_RESPONSE_SIZE;
+	}
+	else if (encryption_params.type == HLS_ENC_AES_128 && 
 		*response_size != 0)
 	{
 		*response_size = aes_round_up_to_block(*response_size);
@@ -630,6 +748,7 @@ ngx_http_vod_hls_handle_mp4_init_segment(
 			NULL,
 			NULL,
 			NULL,
+			FALSE,
 			encryption_params.key,
 			encryption_params.iv);
 		if (rc != VOD_OK)
@@ -683,11 +802,11 @@ ngx_http_vod_hls_init_fmp4_frame_processor(
 	hls_encryption_params_t encryption_params;
 	segment_writer_t drm_writer;
 
-	rc = ngx_http_vod_hls_init_segment_encryption(
-		submodule_context,
-		segment_writer,
-		HLS_CONTAINER_FMP4,
-		&encryption_params);
+	// Note: aes-128 is applied by init_segment_encryption, on the writer that is passed here
+	rc = ngx_http_vod_hls_init_encryption_params(
+		&encryption_params, 
+		submodule_context, 
+		HLS_CONTAINER_FMP4);
 	if (rc != NGX_OK)
 	{
 		return rc;
@@ -774,9 +893,11 @@ ngx_http_vod_hls_init_fmp4_frame_processor(
 			switch (rc)
 			{
 			case VOD_DONE:		// passthrough
+				ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 1);
 				break;
 
 			case VOD_OK:
+				ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 0);
 				segment_writers = &drm_writer;
 				break;
 
@@ -816,6 +937,7 @@ ngx_http_vod_hls_init_fmp4_frame_processor(
 				&submodule_context->request_context,
 				submodule_context->media_set.sequences,
 				segment_writers[0].write_tail,
+				segment_writers[0].write_file,
 				segment_writers[0].context,
 				reuse_input_buffers,
 				&state);
@@ -872,13 +994,14 @@ ngx_http_vod_hls_handle_vtt_segment(
 }
 
 static const ngx_http_vod_request_t hls_master_request = {
-	0,
+	REQUEST_FLAG_MASTER_MANIFEST,
 	PARSE_FLAG_DURATION_LIMITS_AND_TOTAL_SIZE | PARSE_FLAG_KEY_FRAME_BITRATE | PARSE_FLAG_CODEC_NAME | PARSE_FLAG_PARSED_EXTRA_DATA_SIZE | PARSE_FLAG_CODEC_TRANSFER_CHAR,
 	REQUEST_CLASS_OTHER,
 	SUPPORTED_CODECS | VOD_CODEC_FLAG(WEBVTT),
 	HLS_TIMESCALE,
 	ngx_http_vod_hls_handle_master_playlist,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hls_index_request = {
@@ -889,6 +1012,7 @@ static const ngx_http_vod_request_t hls_index_request = {
 	HLS_TIMESCALE,
 	ngx_http_vod_hls_handle_index_playlist,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hls_iframes_request = {
@@ -899,6 +1023,7 @@ static const ngx_http_vod_request_t hls_iframes_request = {
 	HLS_TIMESCALE,
 	ngx_http_vod_hls_handle_iframe_playlist,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hls_enc_key_request = {
@@ -909,6 +1034,7 @@ static const ngx_http_vod_request_t hls_enc_key_request = {
 	HLS_TIMESCALE,
 	ngx_http_vod_hls_handle_encryption_key,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hls_ts_segment_request = {
@@ -919,16 +1045,18 @@ static const ngx_http_vod_request_t hls_ts_segment_request = {
 	HLS_TIMESCALE,
 	NULL,
 	ngx_http_vod_hls_init_ts_frame_processor,
+	ngx_http_vod_hls_init_ts_segment_encryption,
 };
 
 static const ngx_http_vod_request_t hls_mp4_segment_request = {
-	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE,
+	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE | REQUEST_FLAG_CMAF_FRAGMENT,
 	PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_INITIAL_PTS_DELAY,
 	REQUEST_CLASS_SEGMENT,
 	SUPPORTED_CODECS,
 	HLS_TIMESCALE,
 	NULL,
 	ngx_http_vod_hls_init_fmp4_frame_processor,
+	ngx_http_vod_hls_init_fmp4_segment_encryption,
 };
 
 static const ngx_http_vod_request_t hls_mp4_segment_request_cbcs = {
@@ -939,6 +1067,7 @@ static const ngx_http_vod_request_t hls_mp4_segment_request_cbcs = {
 	HLS_TIMESCALE,
 	NULL,
 	ngx_http_vod_hls_init_fmp4_frame_processor,
+	ngx_http_vod_hls_init_fmp4_segment_encryption,
 };
 
 static const ngx_http_vod_request_t hls_mp4_segment_request_cenc = {
@@ -949,6 +1078,7 @@ static const ngx_http_vod_request_t hls_mp4_segment_request_cenc = {
 	HLS_TIMESCALE,
 	NULL,
 	ngx_http_vod_hls_init_fmp4_frame_processor,
+	ngx_http_vod_hls_init_fmp4_segment_encryption,
 };
 
 static const ngx_http_vod_request_t hls_vtt_segment_request = {
@@ -959,6 +1089,7 @@ static const ngx_http_vod_request_t hls_vtt_segment_request = {
 	WEBVTT_TIMESCALE,
 	ngx_http_vod_hls_handle_vtt_segment,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t hls_mp4_init_request = {
@@ -969,6 +1100,7 @@ static const ngx_http_vod_request_t hls_mp4_init_request = {
 	HLS_TIMESCALE,
 	ngx_http_vod_hls_handle_mp4_init_segment,
 	NULL,
+	NULL,
 };
 
 static void
@@ -982,6 +1114,8 @@ ngx_http_vod_hls_create_loc_conf(
 	conf->mpegts_muxer_config.interleave_frames = NGX_CONF_UNSET;
 	conf->mpegts_muxer_config.align_frames = NGX_CONF_UNSET;
 	conf->mpegts_muxer_config.output_id3_timestamps = NGX_CONF_UNSET;
+	conf->mpegts_chunked_output = NGX_CONF_UNSET;
+	conf->can_skip_until = NGX_CONF_UNSET_MSEC;
 	conf->encryption_method = NGX_CONF_UNSET_UINT;
 	conf->m3u8_config.output_iframes_playlist = NGX_CONF_UNSET;
 	conf->m3u8_config.force_unmuxed_segments = NGX_CONF_UNSET;
@@ -1015,13 +1149,24 @@ ngx_http_vod_hls_merge_loc_conf(
 	}
 	ngx_conf_merge_value(conf->m3u8_config.force_unmuxed_segments, prev->m3u8_config.force_unmuxed_segments, 0);
 	ngx_conf_merge_uint_value(conf->m3u8_config.container_format, prev->m3u8_config.container_format, HLS_CONTAINER_AUTO);
+	ngx_conf_merge_msec_value(conf->can_skip_until, prev->can_skip_until, 0);
+	conf->m3u8_config.can_skip_until = conf->can_skip_until;
 
 	ngx_conf_merge_value(conf->mpegts_muxer_config.interleave_frames, prev->mpegts_muxer_config.interleave_frames, 0);
 	ngx_conf_merge_value(conf->mpegts_muxer_config.align_frames, prev->mpegts_muxer_config.align_frames, 1);
 	ngx_conf_merge_value(conf->mpegts_muxer_config.output_id3_timestamps, prev->mpegts_muxer_config.output_id3_timestamps, 0);
+	ngx_conf_merge_value(conf->mpegts_chunked_output, prev->mpegts_chunked_output, 0);
 	
 	ngx_conf_merge_uint_value(conf->encryption_method, prev->encryption_method, HLS_ENC_NONE);
 
+	if (conf->can_skip_until != 0 &&
+		conf->can_skip_until < 6 * (ngx_msec_t)base->segmenter.segment_duration)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_hls_can_skip_until\" must be at least 6 times \"vod_segment_duration\"");
+		return NGX_CONF_ERROR;
+	}
+
 	m3u8_builder_init_config(
 		&conf->m3u8_config,
 		base->segmenter.max_segment_duration, 
@@ -1073,48 +1218,65 @@ ngx_http_vod_hls_parse_uri_file_name(
 	uint32_t flags;
 	ngx_int_t rc;
 
-	// ts segment
-	if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, ts_file_ext))
-	{
-		start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
-		end_pos -= (sizeof(ts_file_ext) - 1);
-		*request = &hls_ts_segment_request;
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// fmp4 segment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, m4s_file_ext))
-	{
-		start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
-		end_pos -= (sizeof(m4s_file_ext) - 1);
+	// Note: the request type is dispatched on the last char of the extension, so that the common
+	//		segment requests are identified with a single prefix/postfix comparison
+	*request = NULL;
+	flags = 0;
 
-		switch (conf->hls.encryption_method)
+	switch (end_pos > start_pos ? end_pos[-1] : '\0')
+	{
+	case 's':
+		// ts segment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, ts_file_ext))
 		{
-		case HLS_ENC_SAMPLE_AES:
-			*request = &hls_mp4_segment_request_cbcs;
-			break;
+			start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
+			end_pos -= (sizeof(ts_file_ext) - 1);
+			*request = &hls_ts_segment_request;
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX | PARSE_FILE_NAME_ALLOW_PART_INDEX;
+		}
+		// fmp4 segment
+		else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, m4s_file_ext))
+		{
+			start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
+			end_pos -= (sizeof(m4s_file_ext) - 1);
 
-		case HLS_ENC_SAMPLE_AES_CENC:
-			*request = &hls_mp4_segment_request_cenc;
-			break;
+			switch (conf->hls.encryption_method)
+			{
+			case HLS_ENC_SAMPLE_AES:
+				*request = &hls_mp4_segment_request_cbcs;
+				break;
 
-		default:
-			*request = &hls_mp4_segment_request;
+			case HLS_ENC_SAMPLE_AES_CENC:
+				*request = &hls_mp4_segment_request_cenc;
+				break;
+
+			default:
+				*request = &hls_mp4_segment_request;
+				break;
+			}
+
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX | PARSE_FILE_NAME_ALLOW_PART_INDEX;
+		}
+		break;
+
+	case 't':
+		// vtt segment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, vtt_file_ext))
+		{
+			start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
+			end_pos -= (sizeof(vtt_file_ext) - 1);
+			*request = &hls_vtt_segment_request;
+			flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
+		}
+		break;
+
+	case '8':
+		// manifest
+		if (!ngx_http_vod_ends_with_static(start_pos, end_pos, m3u8_file_ext))
+		{
 			break;
 		}
 
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// vtt segment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, vtt_file_ext))
-	{
-		start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
-		end_pos -= (sizeof(vtt_file_ext) - 1);
-		*request = &hls_vtt_segment_request;
-		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
-	}
-	// manifest
-	else if (ngx_http_vod_ends_with_static(start_pos, end_pos, m3u8_file_ext))
-	{
 		end_pos -= (sizeof(m3u8_file_ext) - 1);
 
 		// make sure the file name begins with 'index' or 'iframes'
@@ -1142,26 +1304,34 @@ ngx_http_vod_hls_parse_uri_file_name(
 				"ngx_http_vod_hls_parse_uri_file_name: unidentified m3u8 request");
 			return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
 		}
+		break;
+
+	case 'y':
+		// encryption key
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.encryption_key_file_name, key_file_ext) &&
+			!conf->drm_enabled &&
+			conf->hls.encryption_method != HLS_ENC_NONE)
+		{
+			start_pos += conf->hls.m3u8_config.encryption_key_file_name.len;
+			end_pos -= (sizeof(key_file_ext) - 1);
+			*request = &hls_enc_key_request;
+			flags = 0;
+		}
+		break;
+
+	case '4':
+		// init segment
+		if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.init_file_name_prefix, mp4_file_ext))
+		{
+			start_pos += conf->hls.m3u8_config.init_file_name_prefix.len;
+			end_pos -= (sizeof(mp4_file_ext) - 1);
+			*request = &hls_mp4_init_request;
+			flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
+		}
+		break;
 	}
-	// encryption key
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.encryption_key_file_name, key_file_ext) &&
-		!conf->drm_enabled &&
-		conf->hls.encryption_method != HLS_ENC_NONE)
-	{
-		start_pos += conf->hls.m3u8_config.encryption_key_file_name.len;
-		end_pos -= (sizeof(key_file_ext) - 1);
-		*request = &hls_enc_key_request;
-		flags = 0;
-	}
-	// init segment
-	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.init_file_name_prefix, mp4_file_ext))
-	{
-		start_pos += conf->hls.m3u8_config.init_file_name_prefix.len;
-		end_pos -= (sizeof(mp4_file_ext) - 1);
-		*request = &hls_mp4_init_request;
-		flags = PARSE_FILE_NAME_ALLOW_CLIP_INDEX;
-	}
-	else
+
+	if (*request == NULL)
 	{
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 			"ngx_http_vod_hls_parse_uri_file_name: unidentified request");
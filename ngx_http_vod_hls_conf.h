@@ -13,6 +13,8 @@ typedef struct
 	ngx_flag_t absolute_iframe_urls;
 	ngx_str_t master_file_name_prefix;
 	hls_mpegts_muxer_conf_t mpegts_muxer_config;
+	ngx_flag_t mpegts_chunked_output;
+	ngx_msec_t can_skip_until;
 	vod_uint_t encryption_method;
 	ngx_http_complex_value_t* encryption_key_uri;
 
@@ -0,0 +1,455 @@
+// includes
+#include "ngx_http_vod_ingest.h"
+#include "ngx_http_vod_module.h"
+#include "ngx_http_vod_conf.h"
+#include "vod/mp4/mp4_parser_base.h"
+
+// Note: the ingest zone holds fragmented mp4 (CMAF) segments pushed by an encoder, keyed by the path
+//		that the uri of the segment maps to. the init segment of each directory is saved under an
+//		additional key, and is prepended to the media segments that are pushed to the directory -
+//		this way, each media segment in the zone is a self-contained fragmented mp4 file
+
+// constants
+#define INGEST_INIT_KEY_SUFFIX "\0init"		// paths do not contain nulls, can't collide with a segment key
+
+// typedefs
+typedef struct {
+	bool_t has_moov;
+	bool_t has_moof;
+} ngx_http_vod_ingest_atoms_t;
+
+static void
+ngx_http_vod_ingest_get_key(ngx_str_t* path, u_char* key)
+{
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, path->data, path->len);
+	ngx_md5_final(key, &md5);
+}
+
+static void
+ngx_http_vod_ingest_get_init_key(ngx_str_t* path, u_char* key)
+{
+	ngx_md5_t md5;
+	u_char* dir_end;
+
+	// the key of the init segment is derived from the directory of the segment
+	dir_end = path->data + path->len;
+	while (dir_end > path->data && dir_end[-1] != '/')
+	{
+		dir_end--;
+	}
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, path->data, dir_end - path->data);
+	ngx_md5_update(&md5, INGEST_INIT_KEY_SUFFIX, sizeof(INGEST_INIT_KEY_SUFFIX) - 1);
+	ngx_md5_final(key, &md5);
+}
+
+static vod_status_t
+ngx_http_vod_ingest_parse_atoms_callback(void* context, atom_info_t* atom_info)
+{
+	ngx_http_vod_ingest_atoms_t* atoms = context;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_MOOV:
+		atoms->has_moov = TRUE;
+		break;
+
+	case ATOM_NAME_MOOF:
+		atoms->has_moof = TRUE;
+		break;
+	}
+
+	return VOD_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_ingest_read_body(ngx_http_request_t *r, ngx_str_t* body)
+{
+	ngx_request_body_t* rb = r->request_body;
+	ngx_buf_t* buf;
+	ssize_t size;
+
+	if (rb == NULL || rb->bufs == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_read_body: empty request body");
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	// Note: the body is read into a single buffer, that may be backed by a temp file
+	buf = rb->bufs->buf;
+	if (!buf->in_file)
+	{
+		body->data = buf->pos;
+		body->len = buf->last - buf->pos;
+		return NGX_OK;
+	}
+
+	body->data = ngx_pnalloc(r->pool, buf->file_last - buf->file_pos);
+	if (body->data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_read_body: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	size = ngx_read_file(buf->file, body->data, buf->file_last - buf->file_pos, buf->file_pos);
+	if (size == NGX_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+			"ngx_http_vod_ingest_read_body: ngx_read_file failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	body->len = size;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_ingest_store(ngx_http_request_t *r, ngx_buffer_cache_t* zone, ngx_str_t* path, ngx_str_t* body)
+{
+	ngx_http_vod_ingest_atoms_t atoms;
+	request_context_t request_context;
+	u_char init_key[BUFFER_CACHE_KEY_SIZE];
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t parts[2];
+	ngx_str_t existing;
+	uint32_t token;
+	ngx_flag_t identical;
+	ngx_flag_t stored;
+	vod_status_t rc;
+
+	ngx_http_vod_ingest_get_key(path, key);
+
+	// segments are immutable, pushing an existing segment again (e.g. an encoder retry) is a no-op,
+	//	pushing a different segment to an existing path is rejected.
+	//	Note: the saved media segments are prefixed by the init segment, the body is compared to the suffix
+	if (ngx_buffer_cache_fetch(zone, key, &existing, &token))
+	{
+		identical = existing.len >= body->len &&
+			ngx_memcmp(existing.data + existing.len - body->len, body->data, body->len) == 0;
+
+		ngx_buffer_cache_release(zone, key, token);
+
+		if (!identical)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_ingest_store: %V already exists with a different content", path);
+			return NGX_HTTP_CONFLICT;
+		}
+
+		return NGX_HTTP_NO_CONTENT;
+	}
+
+	ngx_memzero(&request_context, sizeof(request_context));
+	request_context.pool = r->pool;
+	request_context.log = r->connection->log;
+
+	ngx_memzero(&atoms, sizeof(atoms));
+
+	rc = mp4_parser_parse_atoms(
+		&request_context,
+		body->data,
+		body->len,
+		TRUE,
+		ngx_http_vod_ingest_parse_atoms_callback,
+		&atoms);
+	if (rc != VOD_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_store: failed to parse the atoms of %V", path);
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	ngx_http_vod_ingest_get_init_key(path, init_key);
+
+	if (atoms.has_moov)
+	{
+		// init segment, the media segments that were already saved embed the init segment of the directory,
+		//	so it can't be replaced by a different one
+		if (ngx_buffer_cache_fetch(zone, init_key, &existing, &token))
+		{
+			identical = existing.len == body->len &&
+				ngx_memcmp(existing.data, body->data, body->len) == 0;
+
+			ngx_buffer_cache_release(zone, init_key, token);
+
+			if (!identical)
+			{
+				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+					"ngx_http_vod_ingest_store: the directory of %V already has a different init segment", path);
+				return NGX_HTTP_CONFLICT;
+			}
+
+			stored = ngx_buffer_cache_store(zone, key, body->data, body->len);
+		}
+		else
+		{
+			// the directory init is saved first, so that a retry after a failure completes the store
+			stored = ngx_buffer_cache_store(zone, init_key, body->data, body->len) &&
+				ngx_buffer_cache_store(zone, key, body->data, body->len);
+		}
+	}
+	else if (atoms.has_moof)
+	{
+		// media segment
+		if (!ngx_buffer_cache_fetch(zone, init_key, &parts[0], &token))
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_ingest_store: no init segment was pushed to the directory of %V", path);
+			return NGX_HTTP_CONFLICT;
+		}
+
+		parts[1] = *body;
+
+		stored = ngx_buffer_cache_store_gather(zone, key, parts, 2);
+
+		ngx_buffer_cache_release(zone, init_key, token);
+	}
+	else
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_store: %V is neither an init segment nor a media segment", path);
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	if (!stored)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_store: failed to store %V, size %uz", path, body->len);
+		return NGX_HTTP_INSUFFICIENT_STORAGE;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_ingest_store: stored %V, size %uz", path, body->len);
+
+	return NGX_HTTP_CREATED;
+}
+
+static void
+ngx_http_vod_ingest_body_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_str_t path;
+	ngx_str_t body;
+	ngx_int_t rc;
+	size_t root;
+	u_char* last;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	rc = ngx_http_vod_ingest_read_body(r, &body);
+	if (rc != NGX_OK)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+	if (last == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_body_handler: ngx_http_map_uri_to_path failed");
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	path.len = last - path.data;
+
+	rc = ngx_http_vod_ingest_store(r, conf->ingest_zone, &path, &body);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	r->headers_out.status = rc;
+	r->headers_out.content_length_n = 0;
+	r->header_only = 1;
+
+	ngx_http_finalize_request(r, ngx_http_send_header(r));
+}
+
+ngx_int_t
+ngx_http_vod_ingest_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_int_t rc;
+
+	if (r != r->main)
+	{
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	if (!(r->method & (NGX_HTTP_PUT | NGX_HTTP_POST)))
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_handler: unsupported method %ui, the segments must be put or posted", r->method);
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+	if (conf->ingest_zone == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_handler: vod_ingest_zone was not configured");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	r->request_body_in_single_buf = 1;
+
+	rc = ngx_http_read_client_request_body(r, ngx_http_vod_ingest_body_handler);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+	{
+		return rc;
+	}
+
+	return NGX_DONE;
+}
+
+////// Reader
+
+ngx_int_t
+ngx_http_vod_ingest_reader_open(ngx_http_request_t* r, ngx_str_t* path, uint32_t flags, void** context)
+{
+	ngx_http_vod_ingest_reader_state_t* state;
+	ngx_http_vod_loc_conf_t *conf;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t data;
+	uint32_t token;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	state = ngx_palloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_open: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	state->r = r;
+	state->path = *path;
+
+	ngx_http_vod_ingest_get_key(path, key);
+
+	if (!ngx_buffer_cache_fetch(conf->ingest_zone, key, &data, &token))
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_open: %V was not found in the ingest zone", path);
+		return NGX_HTTP_NOT_FOUND;
+	}
+
+	// Note: the segment is copied to the request pool, so that the zone entry is not locked for the lifetime 
+	//		of the request (a locked entry can't be evicted, and a slow client could hold it indefinitely)
+	state->data.data = ngx_pnalloc(r->pool, data.len);
+	if (state->data.data == NULL)
+	{
+		ngx_buffer_cache_release(conf->ingest_zone, key, token);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_open: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	state->data.len = data.len;
+	ngx_memcpy(state->data.data, data.data, data.len);
+
+	ngx_buffer_cache_release(conf->ingest_zone, key, token);
+
+	*context = state;
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_vod_ingest_reader_read(void* context, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_ingest_reader_state_t* state = context;
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->r->connection->log, 0,
+		"ngx_http_vod_ingest_reader_read: reading offset %O size %uz", offset, size);
+
+	if (offset >= (off_t)state->data.len)
+	{
+		return NGX_OK;
+	}
+
+	size = ngx_min(size, state->data.len - offset);
+	buf->last = ngx_copy(buf->last, state->data.data + offset, size);
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_vod_ingest_reader_dump_part(void* context, off_t start, off_t end)
+{
+	ngx_http_vod_ingest_reader_state_t* state = context;
+	ngx_http_request_t* r = state->r;
+	ngx_chain_t out;
+	ngx_buf_t* b;
+	ngx_int_t rc;
+
+	if (end == 0)
+	{
+		end = state->data.len;
+	}
+	else if (end > (off_t)state->data.len)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_dump_part: end offset %O exceeds segment size %uz", end, state->data.len);
+		return NGX_HTTP_NOT_FOUND;
+	}
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_dump_part: ngx_calloc_buf failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (end > start)
+	{
+		// the data was copied to the request pool when the reader was opened
+		b->pos = state->data.data + start;
+		b->last = state->data.data + end;
+		b->memory = 1;
+	}
+
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	rc = ngx_http_output_filter(r, &out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_ingest_reader_dump_part: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+
+	return NGX_OK;
+}
+
+size_t
+ngx_http_vod_ingest_reader_get_size(void* context)
+{
+	ngx_http_vod_ingest_reader_state_t* state = context;
+
+	return state->data.len;
+}
+
+void
+ngx_http_vod_ingest_reader_get_path(void* context, ngx_str_t* path)
+{
+	ngx_http_vod_ingest_reader_state_t* state = context;
+
+	*path = state->path;
+}
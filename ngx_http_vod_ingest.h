@@ -0,0 +1,29 @@
+#ifndef _NGX_HTTP_VOD_INGEST_H_INCLUDED_
+#define _NGX_HTTP_VOD_INGEST_H_INCLUDED_
+
+// includes
+#include <ngx_http.h>
+#include "ngx_buffer_cache.h"
+
+// typedefs
+typedef struct {
+	ngx_http_request_t* r;
+	ngx_str_t path;
+	ngx_str_t data;
+} ngx_http_vod_ingest_reader_state_t;
+
+// functions
+ngx_int_t ngx_http_vod_ingest_handler(ngx_http_request_t *r);
+
+// reader functions - serve the pushed segments from the ingest zone, instead of reading files
+ngx_int_t ngx_http_vod_ingest_reader_open(ngx_http_request_t* r, ngx_str_t* path, uint32_t flags, void** context);
+
+ngx_int_t ngx_http_vod_ingest_reader_read(void* context, ngx_buf_t *buf, size_t size, off_t offset);
+
+ngx_int_t ngx_http_vod_ingest_reader_dump_part(void* context, off_t start, off_t end);
+
+size_t ngx_http_vod_ingest_reader_get_size(void* context);
+
+void ngx_http_vod_ingest_reader_get_path(void* context, ngx_str_t* path);
+
+#endif // _NGX_HTTP_VOD_INGEST_H_INCLUDED_
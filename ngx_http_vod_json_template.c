@@ -0,0 +1,445 @@
+#include "ngx_http_vod_json_template.h"
+
+// typedefs
+typedef struct {
+	ngx_str_t* str;
+	ngx_http_complex_value_t value;
+} ngx_http_vod_json_template_slot_t;
+
+struct ngx_http_vod_json_template_s {
+	vod_json_value_t json;
+	ngx_array_t slots;		// ngx_http_vod_json_template_slot_t
+};
+
+typedef struct {
+	ngx_conf_t* cf;
+	ngx_http_vod_json_template_t* tpl;
+} ngx_http_vod_json_template_compile_ctx_t;
+
+typedef struct {
+	ngx_http_request_t* r;
+	ngx_http_vod_json_template_t* tpl;
+} ngx_http_vod_json_template_eval_ctx_t;
+
+// compile
+static ngx_int_t ngx_http_vod_json_template_compile_value(
+	ngx_http_vod_json_template_compile_ctx_t* ctx,
+	vod_json_value_t* value);
+
+static ngx_int_t
+ngx_http_vod_json_template_compile_str(ngx_http_vod_json_template_compile_ctx_t* ctx, ngx_str_t* str)
+{
+	ngx_http_compile_complex_value_t ccv;
+	ngx_http_vod_json_template_slot_t* slot;
+
+	if (ngx_strlchr(str->data, str->data + str->len, '$') == NULL ||
+		ngx_http_script_variables_count(str) == 0)
+	{
+		return NGX_OK;
+	}
+
+	slot = ngx_array_push(&ctx->tpl->slots);
+	if (slot == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	slot->str = str;
+
+	ngx_memzero(&ccv, sizeof(ccv));
+	ccv.cf = ctx->cf;
+	ccv.value = str;
+	ccv.complex_value = &slot->value;
+
+	return ngx_http_compile_complex_value(&ccv);
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_compile_object(ngx_http_vod_json_template_compile_ctx_t* ctx, vod_json_object_t* obj)
+{
+	vod_json_key_value_t* cur;
+	vod_json_key_value_t* last;
+	ngx_int_t rc;
+
+	cur = obj->elts;
+	last = cur + obj->nelts;
+	for (; cur < last; cur++)
+	{
+		if (ngx_strlchr(cur->key.data, cur->key.data + cur->key.len, '$') != NULL)
+		{
+			// the key hashes are calculated when the json is parsed, variables are not supported in keys
+			return NGX_DECLINED;
+		}
+
+		rc = ngx_http_vod_json_template_compile_value(ctx, &cur->value);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_compile_array(ngx_http_vod_json_template_compile_ctx_t* ctx, vod_json_array_t* arr)
+{
+	vod_array_part_t* part;
+	u_char* cur;
+	size_t size;
+	ngx_int_t rc;
+
+	switch (arr->type)
+	{
+	case VOD_JSON_STRING:
+		size = sizeof(ngx_str_t);
+		break;
+
+	case VOD_JSON_ARRAY:
+		size = sizeof(vod_json_array_t);
+		break;
+
+	case VOD_JSON_OBJECT:
+		size = sizeof(vod_json_object_t);
+		break;
+
+	default:
+		return NGX_OK;
+	}
+
+	for (part = &arr->part; part != NULL; part = part->next)
+	{
+		for (cur = part->first; cur < (u_char*)part->last; cur += size)
+		{
+			switch (arr->type)
+			{
+			case VOD_JSON_STRING:
+				rc = ngx_http_vod_json_template_compile_str(ctx, (ngx_str_t*)cur);
+				break;
+
+			case VOD_JSON_ARRAY:
+				rc = ngx_http_vod_json_template_compile_array(ctx, (vod_json_array_t*)cur);
+				break;
+
+			default:	// VOD_JSON_OBJECT
+				rc = ngx_http_vod_json_template_compile_object(ctx, (vod_json_object_t*)cur);
+				break;
+			}
+
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_compile_value(ngx_http_vod_json_template_compile_ctx_t* ctx, vod_json_value_t* value)
+{
+	switch (value->type)
+	{
+	case VOD_JSON_STRING:
+		return ngx_http_vod_json_template_compile_str(ctx, &value->v.str);
+
+	case VOD_JSON_ARRAY:
+		return ngx_http_vod_json_template_compile_array(ctx, &value->v.arr);
+
+	case VOD_JSON_OBJECT:
+		return ngx_http_vod_json_template_compile_object(ctx, &value->v.obj);
+	}
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_vod_json_template_compile(
+	ngx_conf_t* cf,
+	ngx_str_t* value,
+	ngx_http_vod_json_template_t** result)
+{
+	ngx_http_vod_json_template_compile_ctx_t ctx;
+	ngx_http_vod_json_template_t* tpl;
+	ngx_int_t rc;
+	u_char error[128];
+	u_char* str;
+
+	*result = NULL;
+
+	if (value->len <= 0)
+	{
+		return NGX_OK;
+	}
+
+	tpl = ngx_palloc(cf->pool, sizeof(*tpl));
+	if (tpl == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	// copy the string to make sure it's null terminated
+	str = ngx_pnalloc(cf->pool, value->len + 1);
+	if (str == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(str, value->data, value->len);
+	str[value->len] = '\0';
+
+	rc = vod_json_parse(cf->pool, str, &tpl->json, error, sizeof(error));
+	if (rc != VOD_JSON_OK)
+	{
+		if (ngx_http_script_variables_count(value) > 0)
+		{
+			// probably a variable outside a string, parse per request
+			return NGX_OK;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"failed to parse json %i: %s", rc, error);
+		return NGX_ERROR;
+	}
+
+	if (ngx_array_init(&tpl->slots, cf->pool, 1, sizeof(ngx_http_vod_json_template_slot_t)) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	ctx.cf = cf;
+	ctx.tpl = tpl;
+
+	rc = ngx_http_vod_json_template_compile_value(&ctx, &tpl->json);
+	switch (rc)
+	{
+	case NGX_OK:
+		break;
+
+	case NGX_DECLINED:
+		return NGX_OK;
+
+	default:
+		return NGX_ERROR;
+	}
+
+	*result = tpl;
+	return NGX_OK;
+}
+
+// eval
+static ngx_int_t ngx_http_vod_json_template_eval_value(
+	ngx_http_vod_json_template_eval_ctx_t* ctx,
+	vod_json_value_t* dest,
+	vod_json_value_t* src);
+
+static ngx_int_t
+ngx_http_vod_json_template_eval_str(ngx_http_vod_json_template_eval_ctx_t* ctx, ngx_str_t* dest, ngx_str_t* src)
+{
+	ngx_http_vod_json_template_slot_t* cur;
+	ngx_http_vod_json_template_slot_t* last;
+
+	cur = ctx->tpl->slots.elts;
+	last = cur + ctx->tpl->slots.nelts;
+	for (; cur < last; cur++)
+	{
+		if (cur->str != src)
+		{
+			continue;
+		}
+
+		// Note: the value is used as is, same as when the variable is part of the json text
+		if (ngx_http_complex_value(ctx->r, &cur->value, dest) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+				"ngx_http_vod_json_template_eval_str: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
+
+		return NGX_OK;
+	}
+
+	*dest = *src;
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_eval_object(
+	ngx_http_vod_json_template_eval_ctx_t* ctx,
+	vod_json_object_t* dest,
+	vod_json_object_t* src)
+{
+	vod_json_key_value_t* dest_cur;
+	vod_json_key_value_t* cur;
+	vod_json_key_value_t* last;
+	ngx_int_t rc;
+
+	if (src->nelts <= 0)
+	{
+		*dest = *src;
+		return NGX_OK;
+	}
+
+	if (ngx_array_init(dest, ctx->r->pool, src->nelts, sizeof(*cur)) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+			"ngx_http_vod_json_template_eval_object: ngx_array_init failed");
+		return NGX_ERROR;
+	}
+
+	dest->nelts = src->nelts;
+	dest_cur = dest->elts;
+
+	cur = src->elts;
+	last = cur + src->nelts;
+	for (; cur < last; cur++, dest_cur++)
+	{
+		dest_cur->key_hash = cur->key_hash;
+		dest_cur->key = cur->key;
+
+		rc = ngx_http_vod_json_template_eval_value(ctx, &dest_cur->value, &cur->value);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_eval_array(
+	ngx_http_vod_json_template_eval_ctx_t* ctx,
+	vod_json_array_t* dest,
+	vod_json_array_t* src)
+{
+	vod_array_part_t* part;
+	u_char* dest_cur;
+	u_char* cur;
+	size_t size;
+	ngx_int_t rc;
+
+	switch (src->type)
+	{
+	case VOD_JSON_STRING:
+		size = sizeof(ngx_str_t);
+		break;
+
+	case VOD_JSON_ARRAY:
+		size = sizeof(vod_json_array_t);
+		break;
+
+	case VOD_JSON_OBJECT:
+		size = sizeof(vod_json_object_t);
+		break;
+
+	default:
+		// arrays of simple types can not contain slots, and are not modified by vod_json_replace
+		*dest = *src;
+		return NGX_OK;
+	}
+
+	// copy to a single part
+	dest_cur = ngx_palloc(ctx->r->pool, size * src->count);
+	if (dest_cur == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+			"ngx_http_vod_json_template_eval_array: ngx_palloc failed");
+		return NGX_ERROR;
+	}
+
+	dest->type = src->type;
+	dest->count = src->count;
+	dest->part.first = dest_cur;
+	dest->part.last = dest_cur + size * src->count;
+	dest->part.count = src->count;
+	dest->part.next = NULL;
+
+	for (part = &src->part; part != NULL; part = part->next)
+	{
+		for (cur = part->first; cur < (u_char*)part->last; cur += size, dest_cur += size)
+		{
+			switch (src->type)
+			{
+			case VOD_JSON_STRING:
+				rc = ngx_http_vod_json_template_eval_str(ctx, (ngx_str_t*)dest_cur, (ngx_str_t*)cur);
+				break;
+
+			case VOD_JSON_ARRAY:
+				rc = ngx_http_vod_json_template_eval_array(ctx, (vod_json_array_t*)dest_cur, (vod_json_array_t*)cur);
+				break;
+
+			default:	// VOD_JSON_OBJECT
+				rc = ngx_http_vod_json_template_eval_object(ctx, (vod_json_object_t*)dest_cur, (vod_json_object_t*)cur);
+				break;
+			}
+
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_json_template_eval_value(
+	ngx_http_vod_json_template_eval_ctx_t* ctx,
+	vod_json_value_t* dest,
+	vod_json_value_t* src)
+{
+	dest->type = src->type;
+
+	switch (src->type)
+	{
+	case VOD_JSON_STRING:
+		return ngx_http_vod_json_template_eval_str(ctx, &dest->v.str, &src->v.str);
+
+	case VOD_JSON_ARRAY:
+		return ngx_http_vod_json_template_eval_array(ctx, &dest->v.arr, &src->v.arr);
+
+	case VOD_JSON_OBJECT:
+		return ngx_http_vod_json_template_eval_object(ctx, &dest->v.obj, &src->v.obj);
+	}
+
+	*dest = *src;
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_vod_json_template_eval(
+	ngx_http_request_t* r,
+	ngx_http_vod_json_template_t* tpl,
+	vod_json_value_t** result)
+{
+	ngx_http_vod_json_template_eval_ctx_t ctx;
+	vod_json_value_t* json;
+
+	if (tpl->slots.nelts <= 0)
+	{
+		*result = &tpl->json;
+		return NGX_OK;
+	}
+
+	json = ngx_palloc(r->pool, sizeof(*json));
+	if (json == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_json_template_eval: ngx_palloc failed");
+		return NGX_ERROR;
+	}
+
+	ctx.r = r;
+	ctx.tpl = tpl;
+
+	if (ngx_http_vod_json_template_eval_value(&ctx, json, &tpl->json) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	*result = json;
+	return NGX_OK;
+}
@@ -0,0 +1,28 @@
+#ifndef _NGX_HTTP_VOD_JSON_TEMPLATE_H_INCLUDED_
+#define _NGX_HTTP_VOD_JSON_TEMPLATE_H_INCLUDED_
+
+// includes
+#include <ngx_http.h>
+#include "vod/json_parser.h"
+
+// typedefs
+typedef struct ngx_http_vod_json_template_s ngx_http_vod_json_template_t;
+
+// functions
+
+// parses a json that may contain variables at configuration time. variables are supported only inside strings,
+// each string that contains variables becomes a slot that is evaluated per request.
+// result is set to NULL when the json can not be precompiled (e.g. a variable is used as a number),
+// in this case, the json should be evaluated and parsed per request
+ngx_int_t ngx_http_vod_json_template_compile(
+	ngx_conf_t* cf,
+	ngx_str_t* value,
+	ngx_http_vod_json_template_t** result);
+
+// returns the json of the request, when the template has no variables, the returned json is shared and must not be modified
+ngx_int_t ngx_http_vod_json_template_eval(
+	ngx_http_request_t* r,
+	ngx_http_vod_json_template_t* tpl,
+	vod_json_value_t** result);
+
+#endif // _NGX_HTTP_VOD_JSON_TEMPLATE_H_INCLUDED_
@@ -14,19 +14,35 @@
 #include "ngx_http_vod_conf.h"
 #include "ngx_file_reader.h"
 #include "ngx_buffer_cache.h"
+#include "ngx_cache_key.h"
+#include "ngx_probes.h"
+#include "ngx_disk_cache.h"
+#include "ngx_http_vod_warmup.h"
+#include "ngx_http_vod_ingest.h"
+#include "ngx_http_vod_admission.h"
 #include "vod/mp4/mp4_format.h"
 #include "vod/mkv/mkv_format.h"
 #include "vod/subtitle/webvtt_format.h"
 #include "vod/subtitle/cap_format.h"
 #include "vod/input/read_cache.h"
+#include "vod/sidecar_index.h"
+#include "vod/buffer_pool.h"
+#include "vod/input/frames_source_cache.h"
+#include "vod/input/frames_source_memory.h"
 #include "vod/filters/audio_filter.h"
 #include "vod/filters/dynamic_clip.h"
 #include "vod/filters/concat_clip.h"
 #include "vod/filters/rate_filter.h"
 #include "vod/filters/filter.h"
 #include "vod/media_set_parser.h"
+#include "vod/msgpack_parser.h"
 #include "vod/manifest_utils.h"
 #include "vod/input/silence_generator.h"
+#include "vod/input/mapped_media_info.h"
+
+#if (NGX_HAVE_ZLIB)
+#include <zlib.h>
+#endif // NGX_HAVE_ZLIB
 
 #if (NGX_HAVE_LIB_AV_CODEC)
 #include "ngx_http_vod_thumb.h"
@@ -44,12 +60,28 @@
 #define DEFINE_VAR(name) \
 	{ ngx_string("vod_" #name), ngx_http_vod_set_##name##_var, 0 }
 
+#if (NGX_THREADS)
+#define ngx_http_vod_disk_cache_thread_pool(conf) ((conf)->metadata_cache_disk_thread_pool)
+#else
+#define ngx_http_vod_disk_cache_thread_pool(conf) (NULL)
+#endif // NGX_THREADS
+
 // constants
 #define OPEN_FILE_FALLBACK_ENABLED (0x80000000)
 #define MAX_STALE_RETRIES (2)
 
 #define SEGMENT_REQUEST_MAX_FRAME_COUNT (64 * 1024)
 #define NON_SEGMENT_REQUEST_MAX_FRAME_COUNT (1024 * 1024)
+#define MAX_PARALLEL_FRAME_READS (16)
+#define MAX_PARALLEL_METADATA_READS (32)
+#define MAX_COALESCED_READ_GAP (64 * 1024)
+#define MAX_COALESCED_HTTP_READ_GAP (1024 * 1024)		// upstream requests have a much higher fixed cost
+#define MAX_UPSTREAM_BLOCKS_PER_READ (64)
+#define CACHE_REF_TOUCH_INTERVAL (2000)		// must be lower than the entry lock expiration of the buffer cache
+
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+#define NGX_HTTP_VOD_PREFETCH (1)
+#endif
 
 enum {
 	// mapping state machine
@@ -60,12 +92,17 @@ enum {
 	// main state machine
 	STATE_READ_DRM_INFO,
 	STATE_READ_METADATA_INITIAL,
+	STATE_READ_METADATA_PARSE_CACHED,
+	STATE_READ_METADATA_RESUME,
 	STATE_READ_METADATA_OPEN_FILE,
 	STATE_READ_METADATA_READ,
+	STATE_READ_METADATA_PARSE,
+	STATE_PREFETCH_METADATA,
 	STATE_READ_FRAMES_OPEN_FILE,
 	STATE_READ_FRAMES_READ,
 	STATE_OPEN_FILE,
 	STATE_FILTER_FRAMES,
+	STATE_PREFETCH_FRAMES,
 	STATE_PROCESS_FRAMES,
 	STATE_DUMP_OPEN_FILE,
 	STATE_DUMP_FILE_PART,
@@ -77,6 +114,12 @@ enum {
 	READER_COUNT
 };
 
+enum {
+	POPULARITY_UNKNOWN,
+	POPULARITY_HOT,
+	POPULARITY_COLD,
+};
+
 // typedefs
 struct ngx_http_vod_ctx_s;
 typedef struct ngx_http_vod_ctx_s ngx_http_vod_ctx_t;
@@ -92,6 +135,8 @@ typedef ngx_int_t(*ngx_http_vod_enable_directio_t)(void* context);
 typedef ngx_int_t(*ngx_http_vod_dump_request_t)(void* context);
 typedef ngx_int_t(*ngx_http_vod_mapping_apply_t)(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index);
 typedef ngx_int_t(*ngx_http_vod_mapping_get_uri_t)(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri);
+typedef ngx_int_t(*ngx_http_vod_mapping_encode_t)(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping);
+typedef media_clip_t*(*ngx_http_vod_mapping_next_clip_t)(media_clip_t* clip);
 
 typedef struct {
 	uint32_t type;
@@ -100,28 +145,102 @@ typedef struct {
 
 typedef struct {
 	size_t content_type_len;
+	size_t gzip_len;			// the size of the gzip encoded response, stored following the response
 	uint32_t media_set_type;
 } response_cache_header_t;
 
+// compressed mapping cache entries start with a zero byte, that can not start a json / msgpack mapping
+typedef struct {
+	u_char marker;
+	u_char padding[3];
+	uint32_t size;				// the size of the uncompressed mapping
+} mapping_cache_compressed_header_t;
+
+typedef struct {
+	uint64_t first_offset;
+	uint64_t last_offset;
+	uint64_t response_size;
+	size_t content_type_len;
+} clip_header_cache_header_t;
+
 typedef struct {
 	ngx_http_request_t* r;
 	ngx_chain_t* chain_head;
 	ngx_chain_t* chain_end;
 	size_t total_size;
+	ngx_flag_t defer_output;
+	ngx_flag_t discard_output;
+	ngx_chain_t* pending;
+	ngx_chain_t** pending_last;
+	size_t pending_size;
+	size_t output_chunk_size;		// when non-zero, the pending chain is sent once it reaches this size
 } ngx_http_vod_write_segment_context_t;
 
+typedef struct {
+	ngx_http_request_t* r;
+	segment_writer_t next;
+	ngx_array_t buffers;		// ngx_str_t, the first two are reserved for the cache header and content type
+} ngx_http_vod_segment_capture_t;
+
+typedef struct {
+	u_char file_key[MEDIA_CLIP_KEY_SIZE];
+	uint64_t offset;
+	uint64_t size;
+	uint32_t frame_count;
+} ngx_http_vod_frames_key_part_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	u_char key[MEDIA_CLIP_KEY_SIZE];
+	ngx_queue_t waiters;
+} ngx_http_vod_metadata_read_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	u_char key[MEDIA_CLIP_KEY_SIZE];
+	off_t offset;
+	size_t size;
+	ngx_queue_t waiters;
+} ngx_http_vod_frames_read_t;
+
 typedef struct {
 	ngx_http_request_t* r;
 	ngx_str_t cur_remote_suburi;
 	ngx_str_t upstream_location;
+	ngx_buffer_cache_t* block_cache;
+	size_t block_size;
+	off_t read_offset;
+	int perf_counter;
 } ngx_http_vod_http_reader_state_t;
 
+// a group of asynchronous operations that are started together, the state machine resumes once all of them complete
+typedef struct {
+	ngx_uint_t pending;
+	ngx_int_t rc;				// the first error of the group
+	ngx_flag_t starting;		// set while the operations of the group are started
+} ngx_http_vod_join_t;
+
+typedef struct ngx_http_vod_map_fetch_s ngx_http_vod_map_fetch_t;
+
+struct ngx_http_vod_map_fetch_s {
+	ngx_http_vod_map_fetch_t* next;
+	ngx_http_vod_ctx_t* ctx;
+	ngx_str_t uri;
+	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
+	ngx_str_t mapping;			// a copy of the cached mapping, on cache hit
+	int cache_index;
+	ngx_uint_t cache_state;
+	ngx_buf_t* buf;
+	ngx_buf_t* response;		// set when the upstream request succeeded
+};
+
 typedef struct {
 	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
 	ngx_str_t* cache_key_prefix;
 	ngx_buffer_cache_t** caches;
 	uint32_t cache_count;
 	uint32_t stale_retries;
+	ngx_flag_t compress;			// compress the mappings before they are saved to the cache
 
 	// reading abstraction (over file / http)
 	ngx_http_vod_reader_t* reader;
@@ -130,6 +249,13 @@ typedef struct {
 	size_t max_response_size;
 	ngx_http_vod_mapping_get_uri_t get_uri;
 	ngx_http_vod_mapping_apply_t apply;
+	ngx_http_vod_mapping_encode_t encode;		// set by apply when the mapping should be re-encoded before caching
+
+	// parallel clip mapping
+	ngx_http_vod_map_fetch_t* cur_fetch;		// consumed by ngx_http_vod_map_run_step in clip order
+	ngx_http_vod_map_fetch_t* fetch_queue;		// fetches that were not sent yet
+	ngx_http_vod_join_t fetch_join;
+	ngx_http_event_handler_pt original_write_event_handler;
 } ngx_http_vod_mapping_context_t;
 
 struct ngx_http_vod_reader_s {
@@ -142,6 +268,34 @@ struct ngx_http_vod_reader_s {
 	ngx_http_vod_async_read_func_t read;
 };
 
+typedef struct {
+	media_clip_source_t* source;
+	uint64_t offset;
+	uint64_t end_offset;
+	cache_buffer_t* target_buffer;
+	ngx_buf_t buf;
+} ngx_http_vod_prefetch_read_t;
+
+typedef struct {
+	segmenter_conf_t base;		// must be first
+	segmenter_get_segment_durations_t get_segment_durations;
+	ngx_buffer_cache_t* cache;
+} ngx_http_vod_segmenter_conf_t;
+
+// the range of the read that completed the metadata of a file, saved in vod_metadata_hint_cache
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+} ngx_http_vod_metadata_read_hint_t;
+
+// the initial metadata read of a source, issued in advance by ngx_http_vod_prefetch_metadata
+typedef struct {
+	media_clip_source_t* source;		// set to null once the buffer is used
+	size_t read_size;
+	ngx_http_vod_metadata_read_hint_t read_hint;
+	ngx_buf_t buf;
+} ngx_http_vod_metadata_prefetch_t;
+
 struct ngx_http_vod_ctx_s {
 	// base params
 	ngx_http_vod_submodule_context_t submodule_context;
@@ -149,10 +303,16 @@ struct ngx_http_vod_ctx_s {
 	int state;
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
 	u_char child_request_key[BUFFER_CACHE_KEY_SIZE];
+	u_char fallback_key[BUFFER_CACHE_KEY_SIZE];
 	ngx_http_vod_state_machine_t state_machine;
+	ngx_flag_t prefetch;
+	ngx_flag_t warmup;				// fill the caches without producing a response
+	ngx_uint_t admission_class;		// ADMISSION_CLASS_XXX
+	uint32_t file_video_track_count;	// the number of video tracks in the last parsed file
 
 	// iterators
 	media_sequence_t* cur_sequence;
+	ngx_str_t* drm_request_uris;		// [sequence_count]
 	media_clip_source_t* cur_source;
 	media_clip_t* cur_clip;
 
@@ -161,6 +321,16 @@ struct ngx_http_vod_ctx_s {
 	ngx_perf_counters_t* perf_counters;
 	ngx_perf_counter_context(perf_counter_context);
 	ngx_perf_counter_context(total_perf_counter_context);
+	ngx_perf_counter_context(thread_perf_counter_context);	// started when a thread pool task completes
+	ngx_perf_counters_request_t request_perf_counters;
+
+	// the tag of the cache entries that are stored by the request (vod_cache_tag), zero when not set
+	uint32_t cache_tag;
+
+	// request sampling (vod_request_samples)
+	ngx_flag_t sampled;
+	uint32_t cache_hits;			// bit mask of REQUEST_SAMPLE_CACHE_XXX
+	uint32_t cache_misses;
 
 	// mapping
 	ngx_http_vod_mapping_context_t mapping;
@@ -176,6 +346,42 @@ struct ngx_http_vod_ctx_s {
 	void* metadata_reader_context;
 	ngx_str_t* metadata_parts;
 	size_t metadata_part_count;
+	ngx_buffer_cache_t* metadata_cache;				// the metadata cache, or the partition of the request
+	uint32_t metadata_cache_token;
+	ngx_http_vod_metadata_read_hint_t metadata_read_hint;	// the last metadata read of a previous request
+	ngx_http_vod_metadata_read_hint_t metadata_last_read;
+	ngx_uint_t metadata_read_count;
+	media_format_read_request_t metadata_resume_req;		// the first read of a resumed metadata reader
+	ngx_flag_t metadata_resumed;
+	ngx_flag_t metadata_partial;		// only the tracks required by the request were read, not cached
+
+	// metadata read coalescing
+	ngx_http_vod_metadata_read_t* metadata_read;
+	ngx_pool_cleanup_t* metadata_read_cleanup;
+	media_clip_source_t* metadata_read_waited_source;
+	ngx_str_t metadata_remote_buffer;
+	media_clip_source_t* metadata_remote_fetched_source;
+	ngx_str_t metadata_disk_buffer;
+	media_clip_source_t* metadata_disk_fetched_source;
+	ngx_str_t sidecar_index_buffer;
+	media_clip_source_t* sidecar_index_fetched_source;
+	ngx_queue_t metadata_read_queue;
+	ngx_event_t metadata_read_event;
+
+	// parallel metadata reads
+	ngx_http_vod_metadata_prefetch_t* metadata_prefetch;
+	ngx_uint_t metadata_prefetch_count;
+	ngx_flag_t metadata_prefetch_started;
+
+	// frames read coalescing
+	ngx_http_vod_frames_read_t* frames_read;
+	ngx_pool_cleanup_t* frames_read_cleanup;
+	ngx_queue_t frames_read_queue;
+	ngx_event_t frames_read_event;
+	off_t frames_read_offset;
+	size_t frames_read_size;
+	size_t frames_read_copied;
+	ngx_flag_t frames_read_retry;
 
 	// read frames state
 	media_base_metadata_t* base_metadata;
@@ -189,6 +395,21 @@ struct ngx_http_vod_ctx_s {
 	// read state - file
 #if (NGX_THREADS)
 	void* async_open_context;
+	ngx_http_vod_join_t open_join;
+
+	// parse metadata thread
+	ngx_thread_task_t* parse_metadata_task;
+	ngx_int_t parse_metadata_rc;
+	ngx_flag_t parse_metadata_fetched_from_cache;
+	ngx_flag_t parse_metadata_completed;
+
+	// disk metadata cache thread
+	ngx_thread_task_t* metadata_disk_task;
+
+	// audio filter thread
+	ngx_thread_task_t* filter_task;
+	vod_status_t filter_rc;
+	ngx_flag_t filter_completed;
 #endif // NGX_THREADS
 
 	// read state - http
@@ -201,11 +422,26 @@ struct ngx_http_vod_ctx_s {
 	read_cache_state_t read_cache_state;
 	ngx_http_vod_frame_processor_t frame_processor;
 	void* frame_processor_state;
+	audio_filter_cache_t audio_filter_cache;
 	ngx_chain_t out;
 	segment_writer_t segment_writer;
 	ngx_http_vod_write_segment_context_t write_segment_buffer_context;
+	ngx_flag_t streamed_response;		// the segment is sent without a content length
+	ngx_flag_t output_paused;			// frame processing is paused until the client drains the unsent output
+	ngx_http_event_handler_pt original_write_event_handler;
+	ngx_http_vod_segment_capture_t* segment_capture;
+	ngx_http_vod_segment_capture_t* segment_store_capture;
+	u_char segment_key[BUFFER_CACHE_KEY_SIZE];
+	u_char* segment_cache_key;
+	u_char frames_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t frames_capture;
 	media_notification_t* notification;
 	uint32_t frames_bytes_read;
+	off_t bytes_read;
+	int bytes_read_counter;
+	ngx_http_vod_prefetch_read_t* prefetch_reads;
+	ngx_uint_t prefetch_count;
+	ngx_http_vod_join_t prefetch_join;
 };
 
 // typedefs
@@ -218,12 +454,18 @@ typedef struct {
 // forward declarations
 static ngx_int_t ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx);
 static ngx_int_t ngx_http_vod_send_notification(ngx_http_vod_ctx_t *ctx);
+static void ngx_http_vod_map_fetch_send_queued(ngx_http_vod_ctx_t *ctx);
+static void ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
 static ngx_int_t ngx_http_vod_init_process(ngx_cycle_t *cycle);
 static void ngx_http_vod_exit_process();
+#if (NGX_HTTP_VOD_PREFETCH)
+static void ngx_http_vod_prefetch_sibling_segments(ngx_http_vod_ctx_t *ctx);
+#endif // NGX_HTTP_VOD_PREFETCH
 
 static ngx_int_t ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context);
 static ngx_int_t ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context);
 static ngx_int_t ngx_http_vod_dump_file(void* context);
+static ngx_int_t ngx_http_vod_dump_ingest_segment(void* context);
 
 static ngx_int_t ngx_http_vod_http_reader_open_file(ngx_http_request_t* r, ngx_str_t* path, uint32_t flags, void** context);
 static ngx_int_t ngx_http_vod_dump_http_part(void* context, off_t start, off_t end);
@@ -292,6 +534,22 @@ static ngx_http_vod_reader_t reader_http = {
 	(ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read,
 };
 
+static ngx_http_vod_reader_t reader_ingest = {
+	ngx_http_vod_ingest_reader_open,
+	ngx_http_vod_ingest_reader_dump_part,
+	ngx_http_vod_dump_ingest_segment,
+	ngx_http_vod_ingest_reader_get_size,
+	ngx_http_vod_ingest_reader_get_path,
+	NULL,
+	ngx_http_vod_ingest_reader_read,
+};
+
+// metadata reads that are in progress in the current worker process
+static ngx_queue_t metadata_reads;
+
+// frame reads that are in progress in the current worker process
+static ngx_queue_t frames_reads;
+
 static const u_char wvm_file_magic[] = { 0x00, 0x00, 0x01, 0xba, 0x44, 0x00, 0x04, 0x00, 0x04, 0x01 };
 
 ////// Variables
@@ -681,6 +939,150 @@ ngx_http_vod_set_uint32_var(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 	return NGX_OK;
 }
 
+static ngx_int_t
+ngx_http_vod_set_bytes_read_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_vod_ctx_t *ctx;
+	u_char* p;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_bytes_read_var: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%O", ctx->bytes_read) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_set_frames_count_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_vod_ctx_t *ctx;
+	media_track_t* cur_track;
+	media_set_t* media_set;
+	uint32_t frames_count;
+	u_char* p;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL || 
+		ctx->request == NULL ||
+		ctx->request->request_class != REQUEST_CLASS_SEGMENT)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_INT32_LEN);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_frames_count_var: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	media_set = &ctx->submodule_context.media_set;
+
+	frames_count = 0;
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		frames_count += cur_track->frame_count;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%uD", frames_count) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_set_pool_size_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_pool_t* pool;
+	size_t size;
+	u_char* p;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_pool_size_var: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	// Note: large allocations do not record their size, only the pool blocks are counted
+	size = 0;
+	for (pool = r->pool; pool != NULL; pool = pool->d.next)
+	{
+		size += pool->d.end - (u_char*)pool;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%uz", size) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+static ngx_int_t
+ngx_http_vod_set_perf_counter_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_vod_ctx_t *ctx;
+	u_char* p;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL || ctx->request_perf_counters.count[data] == 0)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_perf_counter_var: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%ui", ctx->request_perf_counters.sum[data]) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
 static ngx_http_vod_variable_t ngx_http_vod_variables[] = {
 	DEFINE_VAR(status),
 	DEFINE_VAR(filepath),
@@ -693,6 +1095,14 @@ static ngx_http_vod_variable_t ngx_http_vod_variables[] = {
 	DEFINE_VAR(notification_id),
 	DEFINE_VAR(segment_duration),
 	{ ngx_string("vod_frames_bytes_read"), ngx_http_vod_set_uint32_var, offsetof(ngx_http_vod_ctx_t, frames_bytes_read) },
+	DEFINE_VAR(bytes_read),
+	DEFINE_VAR(frames_count),
+	DEFINE_VAR(pool_size),
+#ifdef NGX_PERF_COUNTERS_ENABLED
+#define PC(id, name, cpu) { ngx_string("vod_perf_" #name "_us"), ngx_http_vod_set_perf_counter_var, PC_##id },
+	#include "ngx_perf_counters_x.h"
+#undef PC
+#endif // NGX_PERF_COUNTERS_ENABLED
 };
 
 ngx_int_t
@@ -723,6 +1133,12 @@ ngx_http_vod_preconfiguration(ngx_conf_t *cf)
 
 	ngx_http_vod_set_status_index(rc);
 
+	// the read only tables are built in the master process, and shared by the workers
+	if (language_code_init(cf->log) != VOD_OK)
+	{
+		return NGX_ERROR;
+	}
+
 #if (NGX_HAVE_LIBXML2)
 	dfxp_init_process();
 #endif // NGX_HAVE_LIBXML2
@@ -736,6 +1152,20 @@ ngx_http_vod_preconfiguration(ngx_conf_t *cf)
 
 ////// Perf counter wrappers
 
+static ngx_inline size_t
+ngx_http_vod_get_buffers_size(ngx_str_t* buffers, size_t buffer_count)
+{
+	size_t result = 0;
+	size_t i;
+
+	for (i = 0; i < buffer_count; i++)
+	{
+		result += buffers[i].len;
+	}
+
+	return result;
+}
+
 static ngx_flag_t
 ngx_buffer_cache_fetch_perf(
 	ngx_perf_counters_t* perf_counters,
@@ -753,9 +1183,35 @@ ngx_buffer_cache_fetch_perf(
 
 	ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
 
+	ngx_vod_probe4(cache_fetch, cache, key, result, result ? buffer->len : 0);
+
+	return result;
+}
+
+static ngx_flag_t
+ngx_buffer_cache_fetch_stale_perf(
+	ngx_perf_counters_t* perf_counters,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_str_t* buffer,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+	
+	ngx_perf_counter_start(pcctx);
+
+	result = ngx_buffer_cache_fetch_stale(cache, key, buffer, token, state);
+
+	ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
+
+	ngx_vod_probe4(cache_fetch, cache, key, result, result ? buffer->len : 0);
+
 	return result;
 }
 
+// Note: stale entries are returned only when state is not null
 static int
 ngx_buffer_cache_fetch_multi_perf(
 	ngx_perf_counters_t* perf_counters,
@@ -763,7 +1219,8 @@ ngx_buffer_cache_fetch_multi_perf(
 	uint32_t cache_count,
 	u_char* key,
 	ngx_str_t* buffer,
-	uint32_t* token)
+	uint32_t* token,
+	ngx_uint_t* state)
 {
 	ngx_perf_counter_context(pcctx);
 	ngx_buffer_cache_t* cache;
@@ -780,7 +1237,17 @@ ngx_buffer_cache_fetch_multi_perf(
 			continue;
 		}
 
-		result = ngx_buffer_cache_fetch(cache, key, buffer, token);
+		if (state != NULL)
+		{
+			result = ngx_buffer_cache_fetch_stale(cache, key, buffer, token, state);
+		}
+		else
+		{
+			result = ngx_buffer_cache_fetch(cache, key, buffer, token);
+		}
+
+		ngx_vod_probe4(cache_fetch, cache, key, result, result ? buffer->len : 0);
+
 		if (!result)
 		{
 			continue;
@@ -816,7 +1283,8 @@ ngx_buffer_cache_fetch_copy_perf(
 		cache_count,
 		key,
 		&original_buffer,
-		&token);
+		&token,
+		NULL);
 	if (result < 0)
 	{
 		return result;
@@ -841,53 +1309,144 @@ ngx_buffer_cache_fetch_copy_perf(
 	return result;
 }
 
-static ngx_flag_t
-ngx_buffer_cache_store_perf(
-	ngx_perf_counters_t* perf_counters,
-	ngx_buffer_cache_t* cache,
-	u_char* key,
-	u_char* source_buffer,
-	size_t buffer_size)
+typedef struct {
+	ngx_buffer_cache_t* cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	uint32_t token;
+	ngx_event_t touch_event;
+} ngx_buffer_cache_ref_t;
+
+static void
+ngx_buffer_cache_ref_touch(ngx_event_t* ev)
 {
-	ngx_perf_counter_context(pcctx);
-	ngx_flag_t result;
+	ngx_buffer_cache_ref_t* ref = ev->data;
 
-	ngx_perf_counter_start(pcctx);
+	ngx_buffer_cache_touch(ref->cache, ref->key, ref->token);
 
-	result = ngx_buffer_cache_store(cache, key, source_buffer, buffer_size);
+	ngx_add_timer(ev, CACHE_REF_TOUCH_INTERVAL);
+}
 
-	ngx_perf_counter_end(perf_counters, pcctx, PC_STORE_CACHE);
+static void
+ngx_buffer_cache_ref_cleanup(void* data)
+{
+	ngx_buffer_cache_ref_t* ref = data;
 
-	return result;
+	if (ref->touch_event.timer_set)
+	{
+		ngx_del_timer(&ref->touch_event);
+	}
+
+	ngx_buffer_cache_release(ref->cache, ref->key, ref->token);
 }
 
-static ngx_flag_t 
-ngx_buffer_cache_store_gather_perf(
+// same as ngx_buffer_cache_fetch_copy_perf, but returns the buffer in the shared memory without copying it.
+// the entry is held until the request pool is destroyed, i.e. after the response was flushed to the client
+static int
+ngx_buffer_cache_fetch_ref_perf(
+	ngx_http_request_t* r,
 	ngx_perf_counters_t* perf_counters,
-	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_t** caches,
+	uint32_t cache_count,
 	u_char* key,
-	ngx_str_t* buffers,
-	size_t buffer_count)
+	ngx_str_t* buffer)
 {
-	ngx_perf_counter_context(pcctx);
-	ngx_flag_t result;
-
-	ngx_perf_counter_start(pcctx);
-
-	result = ngx_buffer_cache_store_gather(cache, key, buffers, buffer_count);
-
-	ngx_perf_counter_end(perf_counters, pcctx, PC_STORE_CACHE);
+	ngx_buffer_cache_ref_t* ref;
+	ngx_pool_cleanup_t* cln;
+	int result;
 
-	return result;
-}
+	// Note: the cleanup is allocated before the fetch, so that the reference cannot leak
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(*ref));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_buffer_cache_fetch_ref_perf: ngx_pool_cleanup_add failed");
+		return -1;
+	}
 
-////// Multipart cache functions
+	ref = cln->data;
 
-static ngx_flag_t 
-ngx_buffer_cache_store_multipart_perf(
-	ngx_http_vod_ctx_t *ctx,
+	result = ngx_buffer_cache_fetch_multi_perf(
+		perf_counters,
+		caches,
+		cache_count,
+		key,
+		buffer,
+		&ref->token,
+		NULL);
+	if (result < 0)
+	{
+		return result;
+	}
+
+	ref->cache = caches[result];
+	ngx_memcpy(ref->key, key, sizeof(ref->key));
+
+	ngx_memzero(&ref->touch_event, sizeof(ref->touch_event));
+	ref->touch_event.handler = ngx_buffer_cache_ref_touch;
+	ref->touch_event.data = ref;
+	ref->touch_event.log = r->connection->log;
+	ngx_add_timer(&ref->touch_event, CACHE_REF_TOUCH_INTERVAL);
+
+	cln->handler = ngx_buffer_cache_ref_cleanup;
+
+	return result;
+}
+
+static ngx_flag_t
+ngx_buffer_cache_store_perf(
+	ngx_perf_counters_t* perf_counters,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	uint32_t tag,
+	u_char* source_buffer,
+	size_t buffer_size)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+	ngx_str_t buffer;
+
+	buffer.data = source_buffer;
+	buffer.len = buffer_size;
+
+	ngx_perf_counter_start(pcctx);
+
+	result = ngx_buffer_cache_store_tagged(cache, key, tag, &buffer, 1);
+
+	ngx_perf_counter_end(perf_counters, pcctx, PC_STORE_CACHE);
+
+	ngx_vod_probe4(cache_store, cache, key, result, buffer_size);
+
+	return result;
+}
+
+static ngx_flag_t 
+ngx_buffer_cache_store_gather_perf(
+	ngx_perf_counters_t* perf_counters,
 	ngx_buffer_cache_t* cache,
 	u_char* key,
+	uint32_t tag,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+
+	ngx_perf_counter_start(pcctx);
+
+	result = ngx_buffer_cache_store_tagged(cache, key, tag, buffers, buffer_count);
+
+	ngx_perf_counter_end(perf_counters, pcctx, PC_STORE_CACHE);
+
+	ngx_vod_probe4(cache_store, cache, key, result, ngx_http_vod_get_buffers_size(buffers, buffer_count));
+
+	return result;
+}
+
+////// Multipart cache functions
+
+static ngx_str_t*
+ngx_buffer_cache_get_multipart_buffers(
+	ngx_http_vod_ctx_t *ctx,
 	multipart_cache_header_t* header,
 	ngx_str_t* parts)
 {
@@ -904,8 +1463,8 @@ ngx_buffer_cache_store_multipart_perf(
 	if (p == NULL)
 	{
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_store_multipart_perf: ngx_palloc failed");
-		return 0;
+			"ngx_buffer_cache_get_multipart_buffers: ngx_palloc failed");
+		return NULL;
 	}
 
 	buffers = (void*)p;
@@ -924,51 +1483,83 @@ ngx_buffer_cache_store_multipart_perf(
 		*cur_size++ = cur_part->len;
 	}
 
-	return ngx_buffer_cache_store_gather_perf(
+	return buffers;
+}
+
+static ngx_flag_t 
+ngx_buffer_cache_store_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_buffer_cache_t* cache,
+	ngx_str_t* disk_path,
+	u_char* key,
+	multipart_cache_header_t* header,
+	ngx_str_t* parts)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_str_t* buffers;
+	ngx_flag_t result;
+	uint32_t part_count = header->part_count;
+
+	buffers = ngx_buffer_cache_get_multipart_buffers(ctx, header, parts);
+	if (buffers == NULL)
+	{
+		return 0;
+	}
+
+	result = ngx_buffer_cache_store_gather_perf(
 		ctx->perf_counters,
 		cache,
 		key,
+		ctx->cache_tag,
 		buffers,
 		part_count + 1);
+
+	if (disk_path->len != 0)
+	{
+		ngx_perf_counter_start(pcctx);
+
+		if (ngx_disk_cache_store(
+			ctx->submodule_context.request_context.pool,
+			ctx->submodule_context.request_context.log,
+			disk_path,
+			key,
+			buffers,
+			part_count + 1,
+			ngx_http_vod_disk_cache_thread_pool(ctx->submodule_context.conf)))
+		{
+			result = 1;
+		}
+
+		ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, pcctx, PC_STORE_DISK_CACHE);
+	}
+
+	return result;
 }
 
 static ngx_flag_t
-ngx_buffer_cache_fetch_multipart_perf(
+ngx_buffer_cache_parse_multipart(
 	ngx_http_vod_ctx_t *ctx,
-	ngx_buffer_cache_t* cache,
-	u_char* key,
+	ngx_str_t* cache_buffer,
 	multipart_cache_header_t* header,
-	ngx_str_t** out_parts,
-	uint32_t* token)
+	ngx_str_t** out_parts)
 {
 	vod_str_t* cur_part;
 	vod_str_t* parts;
-	ngx_str_t cache_buffer;
 	uint32_t part_count;
 	size_t* part_sizes;
 	size_t cur_size;
 	u_char* end;
 	u_char* p;
 
-	if (!ngx_buffer_cache_fetch_perf(
-		ctx->perf_counters,
-		cache,
-		key,
-		&cache_buffer,
-		token))
-	{
-		return 0;
-	}
-
-	if (cache_buffer.len < sizeof(*header))
+	if (cache_buffer->len < sizeof(*header))
 	{
 		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: size %uz smaller than header size", cache_buffer.len);
+			"ngx_buffer_cache_parse_multipart: size %uz smaller than header size", cache_buffer->len);
 		return 0;
 	}
 
-	p = cache_buffer.data;
-	end = p + cache_buffer.len;
+	p = cache_buffer->data;
+	end = p + cache_buffer->len;
 
 	*header = *(multipart_cache_header_t*)p;
 	p += sizeof(*header);
@@ -977,8 +1568,8 @@ ngx_buffer_cache_fetch_multipart_perf(
 	if ((size_t)(end - p) < part_count * sizeof(part_sizes[0]))
 	{
 		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: size %uz too small to hold %uD parts", 
-			cache_buffer.len, part_count);
+			"ngx_buffer_cache_parse_multipart: size %uz too small to hold %uD parts", 
+			cache_buffer->len, part_count);
 		return 0;
 	}
 	part_sizes = (void*)p;
@@ -988,7 +1579,7 @@ ngx_buffer_cache_fetch_multipart_perf(
 	if (parts == NULL)
 	{
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: ngx_palloc failed");
+			"ngx_buffer_cache_parse_multipart: ngx_palloc failed");
 		return 0;
 	}
 
@@ -1000,7 +1591,7 @@ ngx_buffer_cache_fetch_multipart_perf(
 		if ((size_t)(end - p) < cur_size)
 		{
 			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_buffer_cache_fetch_multipart_perf: size left %uz smaller than part size %uz", 
+				"ngx_buffer_cache_parse_multipart: size left %uz smaller than part size %uz", 
 				(size_t)(end - p), cur_size);
 			return 0;
 		}
@@ -1016,8 +1607,119 @@ ngx_buffer_cache_fetch_multipart_perf(
 	return 1;
 }
 
+// Note: stale entries are returned only when state is not null
+static ngx_flag_t
+ngx_buffer_cache_fetch_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	multipart_cache_header_t* header,
+	ngx_str_t** out_parts,
+	uint32_t* token,
+	ngx_uint_t* state)
+{
+	ngx_str_t cache_buffer;
+	ngx_flag_t found;
+
+	if (state != NULL)
+	{
+		found = ngx_buffer_cache_fetch_stale_perf(
+			ctx->perf_counters,
+			cache,
+			key,
+			&cache_buffer,
+			token,
+			state);
+	}
+	else
+	{
+		found = ngx_buffer_cache_fetch_perf(
+			ctx->perf_counters,
+			cache,
+			key,
+			&cache_buffer,
+			token);
+	}
+
+	if (!found)
+	{
+		return 0;
+	}
+
+	return ngx_buffer_cache_parse_multipart(ctx, &cache_buffer, header, out_parts);
+}
+
 ////// Utility functions
 
+#ifdef NGX_PERF_COUNTERS_ENABLED
+// adds a Server-Timing header with the stages of the request that completed so far
+static ngx_int_t
+ngx_http_vod_set_server_timing(ngx_http_request_t* r, ngx_http_vod_ctx_t* ctx)
+{
+	ngx_perf_counters_request_t* counters = &ctx->request_perf_counters;
+	ngx_table_elt_t* h;
+	ngx_uint_t i;
+	size_t size;
+	u_char* p;
+
+	size = 0;
+	for (i = 0; i < PC_COUNT; i++)
+	{
+		if (counters->count[i] != 0)
+		{
+			size += perf_counters_names[i].len + sizeof(";dur=.000, ") - 1 + NGX_INT_T_LEN;
+		}
+	}
+
+	if (size == 0)
+	{
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, size);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_server_timing: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_server_timing: ngx_list_push failed");
+		return NGX_ERROR;
+	}
+
+	h->hash = 1;
+	ngx_str_set(&h->key, "Server-Timing");
+	h->value.data = p;
+
+	// the durations are in milliseconds
+	for (i = 0; i < PC_COUNT; i++)
+	{
+		if (counters->count[i] == 0)
+		{
+			continue;
+		}
+
+		if (p > h->value.data)
+		{
+			*p++ = ',';
+			*p++ = ' ';
+		}
+
+		p = ngx_sprintf(p, "%V;dur=%ui.%03ui", &perf_counters_names[i], 
+			counters->sum[i] / 1000, counters->sum[i] % 1000);
+	}
+
+	h->value.len = p - h->value.data;
+
+	return NGX_OK;
+}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
 static ngx_int_t
 ngx_http_vod_send_header(
 	ngx_http_request_t* r, 
@@ -1026,6 +1728,9 @@ ngx_http_vod_send_header(
 	uint32_t media_set_type,
 	const ngx_http_vod_request_t* request)
 {
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	ngx_http_vod_ctx_t* ctx;
+#endif // NGX_PERF_COUNTERS_ENABLED
 	ngx_http_vod_loc_conf_t* conf;
 	ngx_int_t rc;
 	time_t expires;
@@ -1038,7 +1743,10 @@ ngx_http_vod_send_header(
 		r->headers_out.content_type_len = content_type->len;
 	}
 	
-	r->headers_out.status = NGX_HTTP_OK;
+	if (r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT)		// set when the module applies the range itself
+	{
+		r->headers_out.status = NGX_HTTP_OK;
+	}
 	r->headers_out.content_length_n = content_length_n;
 
 	// last modified
@@ -1089,6 +1797,18 @@ ngx_http_vod_send_header(
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	if (conf->server_timing)
+	{
+		ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+		if (ctx != NULL &&
+			ngx_http_vod_set_server_timing(r, ctx) != NGX_OK)
+		{
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
 	// send the response headers
 	rc = ngx_http_send_header(r);
 	if (rc == NGX_ERROR || rc > NGX_OK)
@@ -1101,6 +1821,91 @@ ngx_http_vod_send_header(
 	return NGX_OK;
 }
 
+#ifdef NGX_PERF_COUNTERS_ENABLED
+// writes the timeline of the request to the error log, if the request took longer than vod_slow_request_threshold.
+// the events are split between several log lines, to avoid the log line size limit
+static void
+ngx_http_vod_log_slow_request(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_perf_counters_request_t* counters = &ctx->request_perf_counters;
+	ngx_perf_counter_event_t* cur_event;
+	ngx_perf_counter_event_t* last_event;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	u_char buffer[1024];
+	u_char* end = buffer + sizeof(buffer);
+	u_char* p;
+
+	if (counters->sum[PC_TOTAL] < ctx->submodule_context.conf->slow_request_threshold * 1000)
+	{
+		return;
+	}
+
+	ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+		"ngx_http_vod_log_slow_request: request took %ui.%03ui ms, %ui events, %ui dropped",
+		counters->sum[PC_TOTAL] / 1000, counters->sum[PC_TOTAL] % 1000,
+		counters->events->nelts, counters->dropped_events);
+
+	p = buffer;
+	cur_event = counters->events->elts;
+	last_event = cur_event + counters->events->nelts;
+	for (; cur_event < last_event; cur_event++)
+	{
+		// flush the line if the event may not fit
+		if (end - p < (ssize_t)(perf_counters_names[cur_event->type].len + 128))
+		{
+			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+				"ngx_http_vod_log_slow_request: %*s", p - buffer, buffer);
+			p = buffer;
+		}
+
+		p = ngx_sprintf(p, "%V@%ui.%03ui+%ui.%03ui", 
+			&perf_counters_names[cur_event->type],
+			cur_event->start / 1000, cur_event->start % 1000,
+			cur_event->duration / 1000, cur_event->duration % 1000);
+
+		if (cur_event->size != 0)
+		{
+			p = ngx_sprintf(p, "(%O:%uz)", cur_event->offset, cur_event->size);
+		}
+
+		*p++ = ' ';
+	}
+
+	if (p > buffer)
+	{
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"ngx_http_vod_log_slow_request: %*s", p - buffer, buffer);
+	}
+}
+
+// adds the request to the request samples ring (vod_request_samples), if the request was selected for sampling
+static void
+ngx_http_vod_add_request_sample(ngx_http_vod_ctx_t *ctx, ngx_int_t rc)
+{
+	ngx_perf_counters_request_t* counters = &ctx->request_perf_counters;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_request_sample_t sample;
+
+	sample.time = ngx_time();
+	sample.pid = ngx_pid;
+	sample.status = rc >= NGX_HTTP_SPECIAL_RESPONSE ? (ngx_uint_t)rc : r->headers_out.status;
+	sample.duration = counters->sum[PC_TOTAL];
+	sample.bytes_read = ctx->bytes_read;
+	sample.cache_hits = ctx->cache_hits;
+	sample.cache_misses = ctx->cache_misses;
+	ngx_memcpy(sample.stage_sum, counters->sum, sizeof(sample.stage_sum));
+	ngx_memcpy(sample.stage_count, counters->count, sizeof(sample.stage_count));
+
+	sample.uri_len = ngx_min(r->uri.len, sizeof(sample.uri));
+	ngx_memcpy(sample.uri, r->uri.data, sample.uri_len);
+
+	sample.content_type_len = ngx_min(r->headers_out.content_type.len, sizeof(sample.content_type));
+	ngx_memcpy(sample.content_type, r->headers_out.content_type.data, sample.content_type_len);
+
+	ngx_request_samples_add(ctx->submodule_context.conf->request_samples_zone, &sample);
+}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
 static void
 ngx_http_vod_finalize_request(ngx_http_vod_ctx_t *ctx, ngx_int_t rc)
 {
@@ -1109,15 +1914,56 @@ ngx_http_vod_finalize_request(ngx_http_vod_ctx_t *ctx, ngx_int_t rc)
 		rc = NGX_ERROR;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->total_perf_counter_context, PC_TOTAL);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->total_perf_counter_context, PC_TOTAL);
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	if (ctx->request_perf_counters.events != NULL)
+	{
+		ngx_http_vod_log_slow_request(ctx);
+	}
+
+	if (ctx->sampled)
+	{
+		ngx_http_vod_add_request_sample(ctx, rc);
+	}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
+	ngx_http_vod_admission_request_done(ctx->submodule_context.r, ctx->admission_class);
 
 	ngx_http_finalize_request(ctx->submodule_context.r, rc);
 }
 
+// updates the bytes read by the request, and the bytes read counter of the access mode
+static void
+ngx_http_vod_update_bytes_read(ngx_http_vod_ctx_t *ctx, size_t size)
+{
+	ctx->bytes_read += size;
+
+	if (ctx->perf_counters != NULL)
+	{
+		(void)ngx_atomic_fetch_add(&ctx->perf_counters->bytes[ctx->bytes_read_counter], size);
+	}
+}
+
+// records the outcome of a cache lookup of the request, reported in the request samples
+static ngx_inline void
+ngx_http_vod_set_cache_result(ngx_http_vod_ctx_t *ctx, ngx_uint_t cache, ngx_flag_t hit)
+{
+	if (hit)
+	{
+		ctx->cache_hits |= 1 << cache;
+	}
+	else
+	{
+		ctx->cache_misses |= 1 << cache;
+	}
+}
+
 static ngx_int_t
 ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, off_t alignment)
 {
 	u_char* start = ctx->read_buffer.start;
+	size_t buffer_size;
 
 	size += VOD_BUFFER_PADDING_SIZE;		// for null termination / ffmpeg padding
 
@@ -1125,7 +1971,16 @@ ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, off_t align
 		start + size > ctx->read_buffer.end ||					// buffer too small
 		((intptr_t)start & (alignment - 1)) != 0)	// buffer not conforming to alignment
 	{
-		if (alignment > 1)
+		start = buffer_pool_alloc_fit(
+			&ctx->submodule_context.request_context,
+			ctx->submodule_context.conf->read_buffer_pool,
+			size,
+			&buffer_size);
+		if (start != NULL && ((intptr_t)start & (alignment - 1)) == 0)
+		{
+			size = buffer_size;
+		}
+		else if (alignment > 1)
 		{
 			start = ngx_pmemalign(ctx->submodule_context.request_context.pool, size, alignment);
 		}
@@ -1141,6 +1996,11 @@ ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, off_t align
 			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
 		}
 
+		if (vod_request_memory_add(&ctx->submodule_context.request_context, size) != VOD_OK)
+		{
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+		}
+
 		ctx->read_buffer.start = start;
 		ctx->read_buffer.end = start + size;
 		ctx->read_buffer.temporary = 1;
@@ -1154,36 +2014,244 @@ ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, off_t align
 
 ////// DRM
 
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+} ngx_http_vod_drm_info_refresh_t;
+
 static void
-ngx_http_vod_copy_drm_info(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_get_drm_info_cache_key(
+	ngx_http_vod_loc_conf_t* conf,
+	ngx_str_t* base_uri,
+	time_t period_index,
+	u_char* key)
 {
-	media_sequence_t* ref_sequence = ctx->cur_sequence;
-	media_sequence_t* cur_sequence;
+	ngx_cache_key_t hash;
 
-	for (cur_sequence = ref_sequence + 1;
-		cur_sequence < ctx->submodule_context.media_set.sequences_end;
-		cur_sequence++)
+	ngx_cache_key_init(&hash, conf->cache_key_hash);
+	ngx_cache_key_update(&hash, conf->drm_upstream_location.data, conf->drm_upstream_location.len);
+	ngx_cache_key_update(&hash, base_uri->data, base_uri->len);
+	if (conf->drm_info_refresh_ahead > 0)
 	{
-		cur_sequence->drm_info = ref_sequence->drm_info;
+		// the cached drm info is renewed every period, the period index is part of the key, 
+		//	so that the info of the next period can be stored before the current one expires
+		ngx_cache_key_update(&hash, &period_index, sizeof(period_index));
 	}
+	ngx_cache_key_final(key, &hash);
+}
+
+static time_t
+ngx_http_vod_get_drm_info_period(ngx_http_vod_loc_conf_t* conf)
+{
+	// Note: an entry that is stored during a period, remains valid until the end of the following 
+	//	period, since period + refresh ahead = cache expiration
+	return ngx_buffer_cache_get_expiration(conf->drm_info_cache) - conf->drm_info_refresh_ahead;
 }
 
 static void
-ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+ngx_http_vod_drm_info_refresh_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
+	ngx_http_vod_drm_info_refresh_t* refresh = context;
 	ngx_http_vod_loc_conf_t *conf;
-	ngx_http_vod_ctx_t *ctx;
-	ngx_http_request_t *r = context;
+	ngx_http_vod_ctx_t *ctx = refresh->ctx;
+	ngx_log_t* log = ctx->submodule_context.request_context.log;
 	ngx_str_t drm_info;
+	void* parsed_drm_info;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
 	conf = ctx->submodule_context.conf;
 
 	if (rc != NGX_OK)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
-		goto finalize_request;
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: upstream request failed %i", rc);
+		return;
+	}
+
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: not enough room in buffer for null terminator");
+		return;
+	}
+
+	drm_info.data = response->pos;
+	drm_info.len = content_length;
+	*response->last = '\0';
+
+	// make sure the response is valid before saving it to cache
+	rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &parsed_drm_info);
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: invalid drm info response %V", &drm_info);
+		return;
+	}
+
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		conf->drm_info_cache,
+		refresh->key,
+		0,
+		drm_info.data,
+		drm_info.len))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: stored in drm info cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: failed to store drm info in cache");
+	}
+}
+
+// fetches the drm info in the background and saves it to cache under the supplied key.
+// errors are only logged, since the request uses drm info that was already fetched from cache
+static void
+ngx_http_vod_drm_info_start_refresh(ngx_http_vod_ctx_t *ctx, ngx_str_t* base_uri, u_char* key)
+{
+	ngx_http_vod_drm_info_refresh_t* refresh;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+	ngx_buf_t* b;
+
+	refresh = ngx_palloc(r->pool, sizeof(*refresh));
+	if (refresh == NULL)
+	{
+		return;
+	}
+
+	refresh->ctx = ctx;
+	ngx_memcpy(refresh->key, key, sizeof(refresh->key));
+
+	b = ngx_create_temp_buf(r->pool, conf->drm_max_info_length + conf->max_upstream_headers_size + 1);
+	if (b == NULL)
+	{
+		return;
+	}
+
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = *base_uri;
+	child_params.background = 1;
+	child_params.perf_counters = ctx->perf_counters;
+	child_params.perf_counter = PC_FETCH_DRM_INFO;
+	child_params.max_concurrency = conf->upstream_max_concurrency;
+	child_params.shared_limit = conf->upstream_limit_zone;
+	child_params.shared_max_concurrency = conf->upstream_shared_max_concurrency;
+	child_params.max_queued = conf->upstream_max_queued;
+
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_drm_info_refresh_finished,
+		refresh,
+		&conf->drm_upstream_location,
+		&child_params,
+		b);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_start_refresh: ngx_child_request_start failed %i", rc);
+		return;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_drm_info_start_refresh: started a background drm info request for %V", base_uri);
+}
+
+// fetches the drm info of the next period in the background, if the current period is about to end
+static void
+ngx_http_vod_drm_info_refresh_ahead(ngx_http_vod_ctx_t *ctx, ngx_str_t* base_uri, time_t period_index)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t drm_info;
+	uint32_t cache_token;
+	time_t period;
+
+	period = ngx_http_vod_get_drm_info_period(conf);
+	if (ngx_time() < (period_index + 1) * period - conf->drm_info_refresh_ahead)
+	{
+		return;
+	}
+
+	ngx_http_vod_get_drm_info_cache_key(conf, base_uri, period_index + 1, key);
+
+	// check whether the next period was already fetched
+	if (ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		conf->drm_info_cache,
+		key,
+		&drm_info,
+		&cache_token))
+	{
+		ngx_buffer_cache_release(
+			conf->drm_info_cache,
+			key,
+			cache_token);
+		return;
+	}
+
+	ngx_http_vod_drm_info_start_refresh(ctx, base_uri, key);
+}
+
+// returns 1 if an earlier sequence of the request has the same drm request uri, 
+//	in this case the drm info of the earlier sequence is used
+static ngx_flag_t
+ngx_http_vod_share_drm_info(ngx_http_vod_ctx_t *ctx, ngx_str_t* base_uri)
+{
+	media_sequence_t* sequences = ctx->submodule_context.media_set.sequences;
+	media_sequence_t* cur_sequence;
+	ngx_str_t* cur_uri;
+
+	for (cur_sequence = sequences; cur_sequence < ctx->cur_sequence; cur_sequence++)
+	{
+		cur_uri = &ctx->drm_request_uris[cur_sequence - sequences];
+		if (cur_sequence->drm_info != NULL &&
+			cur_uri->len == base_uri->len &&
+			ngx_memcmp(cur_uri->data, base_uri->data, base_uri->len) == 0)
+		{
+			ctx->cur_sequence->drm_info = cur_sequence->drm_info;
+			return 1;
+		}
+	}
+
+	ctx->drm_request_uris[ctx->cur_sequence - sequences] = *base_uri;
+	return 0;
+}
+
+static void
+ngx_http_vod_copy_drm_info(ngx_http_vod_ctx_t *ctx)
+{
+	media_sequence_t* ref_sequence = ctx->cur_sequence;
+	media_sequence_t* cur_sequence;
+
+	for (cur_sequence = ref_sequence + 1;
+		cur_sequence < ctx->submodule_context.media_set.sequences_end;
+		cur_sequence++)
+	{
+		cur_sequence->drm_info = ref_sequence->drm_info;
+	}
+}
+
+static void
+ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_http_request_t *r = context;
+	ngx_str_t drm_info;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
+		goto finalize_request;
 	}
 
 	if (response->last >= response->end)
@@ -1194,7 +2262,7 @@ ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* r
 		goto finalize_request;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
 
 	drm_info.data = response->pos;
 	drm_info.len = content_length;
@@ -1220,6 +2288,7 @@ ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* r
 			ctx->perf_counters,
 			conf->drm_info_cache,
 			ctx->child_request_key,
+			0,
 			drm_info.data,
 			drm_info.len))
 		{
@@ -1269,8 +2338,21 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 	ngx_int_t rc;
 	ngx_str_t drm_info;
 	ngx_str_t base_uri;
-	ngx_md5_t md5;
+	ngx_uint_t cache_state;
 	uint32_t cache_token;
+	time_t period_index = 0;
+
+	if (ctx->drm_request_uris == NULL)
+	{
+		ctx->drm_request_uris = ngx_pcalloc(r->pool, sizeof(ctx->drm_request_uris[0]) *
+			(ctx->submodule_context.media_set.sequences_end - ctx->submodule_context.media_set.sequences));
+		if (ctx->drm_request_uris == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info: ngx_pcalloc failed");
+			return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+		}
+	}
 
 	for (;
 		ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
@@ -1294,25 +2376,37 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 			base_uri = ctx->cur_sequence->stripped_uri;
 		}
 
+		if (ngx_http_vod_share_drm_info(ctx, &base_uri))
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info: using the drm info of an earlier sequence for %V", &base_uri);
+			continue;
+		}
+
 		if (conf->drm_info_cache != NULL)
 		{
 			// generate a request key
-			ngx_md5_init(&md5);
-			ngx_md5_update(&md5, conf->drm_upstream_location.data, conf->drm_upstream_location.len);
-			ngx_md5_update(&md5, base_uri.data, base_uri.len);
-			ngx_md5_final(ctx->child_request_key, &md5);
+			if (conf->drm_info_refresh_ahead > 0)
+			{
+				period_index = ngx_time() / ngx_http_vod_get_drm_info_period(conf);
+			}
+
+			ngx_http_vod_get_drm_info_cache_key(conf, &base_uri, period_index, ctx->child_request_key);
 
 			// try to read the drm info from cache
-			if (ngx_buffer_cache_fetch_perf(
+			if (ngx_buffer_cache_fetch_stale_perf(
 				ctx->perf_counters, 
 				conf->drm_info_cache, 
 				ctx->child_request_key,
 				&drm_info, 
-				&cache_token))
+				&cache_token,
+				&cache_state))
 			{
 				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 					"ngx_http_vod_state_machine_get_drm_info: drm info cache hit, size is %uz", drm_info.len);
 
+				ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_DRM_INFO, 1);
+
 				rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
 				if (rc != NGX_OK)
 				{
@@ -1326,6 +2420,15 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 					ctx->child_request_key, 
 					cache_token);
 
+				if (cache_state == BUFFER_CACHE_FETCH_STALE_REFRESH)
+				{
+					ngx_http_vod_drm_info_start_refresh(ctx, &base_uri, ctx->child_request_key);
+				}
+				else if (conf->drm_info_refresh_ahead > 0)
+				{
+					ngx_http_vod_drm_info_refresh_ahead(ctx, &base_uri, period_index);
+				}
+
 				if (conf->drm_single_key)
 				{
 					ngx_http_vod_copy_drm_info(ctx);
@@ -1338,6 +2441,8 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 			{
 				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 					"ngx_http_vod_state_machine_get_drm_info: drm info cache miss");
+
+				ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_DRM_INFO, 0);
 			}
 		}
 
@@ -1353,6 +2458,12 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 		ngx_memzero(&child_params, sizeof(child_params));
 		child_params.method = NGX_HTTP_GET;
 		child_params.base_uri = base_uri;
+		child_params.perf_counters = ctx->perf_counters;
+		child_params.perf_counter = PC_FETCH_DRM_INFO;
+		child_params.max_concurrency = conf->upstream_max_concurrency;
+		child_params.shared_limit = conf->upstream_limit_zone;
+		child_params.shared_max_concurrency = conf->upstream_shared_max_concurrency;
+		child_params.max_queued = conf->upstream_max_queued;
 
 		ngx_perf_counter_start(ctx->perf_counter_context);
 
@@ -1447,6 +2558,33 @@ ngx_http_vod_get_sequence_tracks_mask(
 	}
 }
 
+// returns whether the tracks of the source can be built from the media info supplied by the mapping,
+// this is possible when the request does not require the frames or any raw atoms of the file
+static bool_t
+ngx_http_vod_mapped_media_info_usable(
+	ngx_http_vod_ctx_t *ctx,
+	media_clip_source_t* cur_source)
+{
+	const ngx_http_vod_request_t* request = ctx->request;
+	int parse_type;
+
+	if (request == NULL ||
+		cur_source->media_infos.first == NULL ||
+		(request->request_class & (REQUEST_CLASS_MANIFEST | REQUEST_CLASS_OTHER)) == 0)
+	{
+		return FALSE;
+	}
+
+	parse_type = request->parse_type | ctx->submodule_context.conf->parse_flags;
+	if (request->request_class == REQUEST_CLASS_MANIFEST &&
+		ctx->submodule_context.media_set.timing.durations == NULL)
+	{
+		parse_type |= ctx->submodule_context.media_set.segmenter_conf->parse_type;
+	}
+
+	return (parse_type & (PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_SAVE_RAW_ATOMS)) == 0;
+}
+
 static void
 ngx_http_vod_init_parse_params_metadata(
 	ngx_http_vod_ctx_t *ctx,
@@ -1466,6 +2604,16 @@ ngx_http_vod_init_parse_params_metadata(
 			ctx->submodule_context.media_set.timing.durations == NULL)
 		{
 			parse_params->parse_type |= segmenter->parse_type;
+
+			// the manifest uses only the durations and key frames, keep them compact as long as
+			// the frames are not clipped, filtered or shifted
+			if ((request->parse_type & PARSE_FLAG_FRAMES_ALL) == 0 &&
+				cur_source->base.parent == NULL &&
+				cur_source->clip_to == ULLONG_MAX &&
+				ctx->submodule_context.request_params.pts_delay == 0)
+			{
+				parse_params->parse_type |= PARSE_FLAG_FRAMES_COMPACT;
+			}
 		}
 		parse_params->parse_type |= ctx->submodule_context.conf->parse_flags;
 		parse_params->codecs_mask = request->codecs_mask;
@@ -1501,6 +2649,7 @@ ngx_http_vod_init_parse_params_frames(
 	media_clip_source_t* cur_source = ctx->cur_source;
 	request_context_t* request_context = &ctx->submodule_context.request_context;
 	segmenter_conf_t* segmenter = ctx->submodule_context.media_set.segmenter_conf;
+	thumb_tiles_params_t* tiles;
 	vod_fraction_t rate;
 	vod_status_t rc;
 	uint64_t last_segment_end;
@@ -1508,6 +2657,17 @@ ngx_http_vod_init_parse_params_frames(
 
 	parse_params->max_frames_size = ctx->submodule_context.conf->max_frames_size;
 
+	// let the parser return the frames in the output timescale, when the frames are not shifted or filtered
+	if (cur_source->base.parent == NULL &&
+		ctx->submodule_context.request_params.pts_delay == 0)
+	{
+		parse_params->output_timescale = request->timescale;
+	}
+	else
+	{
+		parse_params->output_timescale = 0;
+	}
+
 	if ((request->request_class & (REQUEST_CLASS_MANIFEST | REQUEST_CLASS_OTHER)) != 0)
 	{
 		request_context->simulation_only = TRUE;
@@ -1586,11 +2746,25 @@ ngx_http_vod_init_parse_params_frames(
 			&clip_ranges);
 
 		ctx->submodule_context.media_set.initial_segment_clip_relative_index = clip_ranges.clip_relative_segment_index;
+
+		if (rc == VOD_OK &&
+			ctx->submodule_context.request_params.part_index != INVALID_PART_INDEX)
+		{
+			rc = segmenter_get_part_range(
+				request_context,
+				segmenter,
+				ctx->submodule_context.request_params.part_index,
+				&clip_ranges);
+		}
 	}
 	else
 	{
 		// thumbnail request
+		tiles = &ctx->submodule_context.request_params.tiles;
+
 		get_ranges_params.time = ctx->submodule_context.request_params.segment_time;
+		get_ranges_params.duration = tiles->columns > 0 ?
+			(uint64_t)tiles->interval * (tiles->columns * tiles->rows - 1) : 0;
 
 		rc = segmenter_get_start_end_ranges_gop(
 			&get_ranges_params,
@@ -1631,6 +2805,140 @@ ngx_http_vod_init_parse_params_frames(
 	return NGX_OK;
 }
 
+// returns whether the parsed metadata of the source can be shared with other requests of the worker.
+// the tracks of sources that have a label reference the mapping of the request, and are not shared.
+// Note: the frames parser updates the tracks (e.g. bitrate estimation), so the sharing is limited to segments
+static ngx_flag_t
+ngx_http_vod_parsed_metadata_cacheable(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+
+	return conf->parsed_metadata_cache != NULL &&
+		conf->parse_metadata_thread_pool == NULL &&
+		ctx->request->request_class == REQUEST_CLASS_SEGMENT &&
+		ctx->format->id == FORMAT_ID_MP4 &&
+		ctx->cur_source->sequence->label.len == 0;
+}
+
+static void
+ngx_http_vod_get_parsed_metadata_key(
+	ngx_http_vod_ctx_t *ctx,
+	media_parse_params_t* parse_params,
+	u_char* key)
+{
+	ngx_cache_key_t hash;
+	size_t i;
+
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	ngx_cache_key_update(&hash, ctx->cur_source->file_key, sizeof(ctx->cur_source->file_key));
+
+	// the size of the metadata changes when a growing file is refreshed
+	for (i = 0; i < ctx->metadata_part_count; i++)
+	{
+		ngx_cache_key_update(&hash, &ctx->metadata_parts[i].len, sizeof(ctx->metadata_parts[i].len));
+	}
+
+	ngx_cache_key_update(&hash, parse_params->required_tracks_mask, sizeof(uint32_t) * MEDIA_TYPE_COUNT);
+	if (parse_params->langs_mask != NULL)
+	{
+		ngx_cache_key_update(&hash, parse_params->langs_mask, LANG_MASK_SIZE);
+	}
+	ngx_cache_key_update(&hash, &parse_params->parse_type, sizeof(parse_params->parse_type));
+	ngx_cache_key_update(&hash, &parse_params->codecs_mask, sizeof(parse_params->codecs_mask));
+	ngx_cache_key_update(&hash, &parse_params->clip_from, sizeof(parse_params->clip_from));
+	ngx_cache_key_update(&hash, &parse_params->clip_to, sizeof(parse_params->clip_to));
+
+	// the frames parser sorts the tracks when aligning to key frames
+	ngx_cache_key_update(&hash, &ctx->submodule_context.media_set.segmenter_conf->align_to_key_frames, 
+		sizeof(ctx->submodule_context.media_set.segmenter_conf->align_to_key_frames));
+
+	ngx_cache_key_final(key, &hash);
+}
+
+// same as format->parse_metadata, but reuses the result of previous requests of the worker.
+// the metadata is copied to the pool of the cache entry, since the parsed tracks point into it
+static vod_status_t
+ngx_http_vod_parse_basic_metadata_cached(
+	ngx_http_vod_ctx_t *ctx,
+	media_parse_params_t* parse_params)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	request_context_t* request_context = &ctx->submodule_context.request_context;
+	ngx_object_cache_entry_t* entry;
+	ngx_pool_t* request_pool;
+	ngx_str_t* parts;
+	vod_status_t rc;
+	size_t i;
+	u_char key[OBJECT_CACHE_KEY_SIZE];
+
+	ngx_http_vod_get_parsed_metadata_key(ctx, parse_params, key);
+
+	ctx->base_metadata = ngx_object_cache_fetch(conf->parsed_metadata_cache, key, request_context->pool);
+	if (ctx->base_metadata != NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_basic_metadata_cached: parsed metadata cache hit");
+		return VOD_OK;
+	}
+
+	entry = ngx_object_cache_alloc(conf->parsed_metadata_cache, NGX_DEFAULT_POOL_SIZE, request_context->log);
+	if (entry == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	parts = ngx_palloc(entry->pool, sizeof(parts[0]) * ctx->metadata_part_count);
+	if (parts == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_basic_metadata_cached: ngx_palloc failed (1)");
+		ngx_object_cache_free(entry);
+		return VOD_ALLOC_FAILED;
+	}
+
+	for (i = 0; i < ctx->metadata_part_count; i++)
+	{
+		parts[i].len = ctx->metadata_parts[i].len;
+		parts[i].data = ngx_pnalloc(entry->pool, parts[i].len + 1);
+		if (parts[i].data == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_parse_basic_metadata_cached: ngx_pnalloc failed (2)");
+			ngx_object_cache_free(entry);
+			return VOD_ALLOC_FAILED;
+		}
+
+		ngx_memcpy(parts[i].data, ctx->metadata_parts[i].data, parts[i].len);
+	}
+
+	// build the parsed metadata on the pool of the entry
+	request_pool = request_context->pool;
+	request_context->pool = entry->pool;
+
+	rc = ctx->format->parse_metadata(
+		request_context,
+		parse_params,
+		parts,
+		ctx->metadata_part_count,
+		&ctx->base_metadata);
+
+	request_context->pool = request_pool;
+
+	if (rc != VOD_OK)
+	{
+		ngx_object_cache_free(entry);
+		return rc;
+	}
+
+	if (ngx_object_cache_store(entry, key, ctx->base_metadata, request_pool) != NGX_OK)
+	{
+		ngx_object_cache_free(entry);
+		return VOD_ALLOC_FAILED;
+	}
+
+	return VOD_OK;
+}
+
 static ngx_int_t 
 ngx_http_vod_parse_metadata(
 	ngx_http_vod_ctx_t *ctx, 
@@ -1702,21 +3010,47 @@ ngx_http_vod_parse_metadata(
 		return NGX_OK;
 	}
 
+	if (ngx_http_vod_mapped_media_info_usable(ctx, cur_source))
+	{
+		rc = mapped_media_info_get_tracks(
+			request_context,
+			&parse_params,
+			&cur_source->track_array);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_parse_metadata: mapped_media_info_get_tracks failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		}
+
+		ngx_http_vod_update_source_tracks(request_context, cur_source);
+		return NGX_OK;
+	}
+
 	ngx_perf_counter_start(ctx->perf_counter_context);
 
 	// parse the basic metadata
-	rc = ctx->format->parse_metadata(
-		request_context,
-		&parse_params,
-		ctx->metadata_parts,
-		ctx->metadata_part_count,
-		&ctx->base_metadata);
-	if (rc != VOD_OK)
+	if (ngx_http_vod_parsed_metadata_cacheable(ctx))
 	{
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
-			"ngx_http_vod_parse_metadata: parse_metadata(%V) failed %i", &ctx->format->name, rc);
-		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		rc = ngx_http_vod_parse_basic_metadata_cached(ctx, &parse_params);
 	}
+	else
+	{
+		rc = ctx->format->parse_metadata(
+			request_context,
+			&parse_params,
+			ctx->metadata_parts,
+			ctx->metadata_part_count,
+			&ctx->base_metadata);
+	}
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_metadata: parse_metadata(%V) failed %i", &ctx->format->name, rc);
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+	}
+
+	ctx->file_video_track_count = ctx->base_metadata->file_track_count[MEDIA_TYPE_VIDEO];
 
 	if (ctx->base_metadata->tracks.nelts == 0)
 	{
@@ -1767,7 +3101,155 @@ ngx_http_vod_parse_metadata(
 
 	ngx_http_vod_update_source_tracks(request_context, cur_source);
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE);
+
+	switch (ctx->format->id)
+	{
+	case FORMAT_ID_MP4:
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE_MP4);
+		break;
+
+	case FORMAT_ID_MKV:
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE_MKV);
+		break;
+
+	default:
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE_SUBTITLE);
+		break;
+	}
+
+	return NGX_OK;
+}
+
+#if (NGX_THREADS)
+static void
+ngx_http_vod_parse_metadata_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_http_vod_ctx_t *ctx = data;
+
+	ctx->parse_metadata_rc = ngx_http_vod_parse_metadata(ctx, ctx->parse_metadata_fetched_from_cache);
+
+	ngx_perf_counter_start(ctx->thread_perf_counter_context);
+}
+
+static void
+ngx_http_vod_parse_metadata_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_http_vod_ctx_t *ctx = ev->data;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_connection_t *c = r->connection;
+	ngx_int_t rc;
+
+	// the time from the completion of the task until the event loop runs its handler
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->thread_perf_counter_context, PC_EVENT_LOOP_DELAY);
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	ctx->parse_metadata_completed = 1;
+
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_finalize_request(ctx, rc);
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+#endif // NGX_THREADS
+
+// runs ngx_http_vod_parse_metadata on the thread pool, if configured.
+// returns NGX_DONE if a task was posted, in this case the state machine is called again when the parsing completes, 
+// and the second call returns the result of ngx_http_vod_parse_metadata
+static ngx_int_t
+ngx_http_vod_run_parse_metadata(ngx_http_vod_ctx_t *ctx, ngx_flag_t fetched_from_cache)
+{
+#if (NGX_THREADS)
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_thread_task_t* task;
+
+	if (ctx->parse_metadata_completed)
+	{
+		ctx->parse_metadata_completed = 0;
+		return ctx->parse_metadata_rc;
+	}
+
+	if (conf->parse_metadata_thread_pool == NULL)
+	{
+		return ngx_http_vod_parse_metadata(ctx, fetched_from_cache);
+	}
+
+	task = ctx->parse_metadata_task;
+	if (task == NULL)
+	{
+		task = ngx_thread_task_alloc(r->pool, 0);
+		if (task == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_run_parse_metadata: ngx_thread_task_alloc failed");
+			return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+		}
+
+		task->ctx = ctx;
+		task->handler = ngx_http_vod_parse_metadata_thread_handler;
+		task->event.data = ctx;
+		task->event.handler = ngx_http_vod_parse_metadata_thread_event_handler;
+
+		ctx->parse_metadata_task = task;
+	}
+
+	ctx->parse_metadata_fetched_from_cache = fetched_from_cache;
+
+	if (ngx_thread_task_post(conf->parse_metadata_thread_pool, task) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_run_parse_metadata: ngx_thread_task_post failed");
+		return ngx_http_vod_parse_metadata(ctx, fetched_from_cache);
+	}
+
+	// Note: the request is blocked until the task completes, so its pool is not accessed by the event loop
+	r->main->blocked++;
+	r->aio = 1;
+
+	return NGX_DONE;
+#else
+	return ngx_http_vod_parse_metadata(ctx, fetched_from_cache);
+#endif // NGX_THREADS
+}
+
+static ngx_int_t
+ngx_http_vod_init_partial_metadata_read(ngx_http_vod_ctx_t* ctx)
+{
+	media_parse_params_t* parse_params;
+	uint32_t* tracks_mask;
+
+	if (ctx->format != &mp4_format ||
+		ctx->submodule_context.conf->partial_moov_min_size == 0 ||
+		ctx->cur_source->reader != &reader_http ||
+		ctx->request == NULL ||
+		ctx->request->request_class != REQUEST_CLASS_SEGMENT)
+	{
+		return NGX_OK;
+	}
+
+	parse_params = ngx_pcalloc(ctx->submodule_context.r->pool,
+		sizeof(*parse_params) + sizeof(tracks_mask[0]) * MEDIA_TYPE_COUNT);
+	if (parse_params == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_init_partial_metadata_read: ngx_pcalloc failed");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+	}
+
+	tracks_mask = (uint32_t*)(parse_params + 1);
+
+	ngx_http_vod_init_parse_params_metadata(ctx, tracks_mask, parse_params);
+
+	mp4_metadata_reader_set_parse_params(
+		ctx->metadata_reader_context,
+		parse_params,
+		ctx->submodule_context.conf->partial_moov_min_size);
 
 	return NGX_OK;
 }
@@ -1821,7 +3303,7 @@ ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx, ngx_str_t* buffer)
 		break;
 	}
 
-	return NGX_OK;
+	return ngx_http_vod_init_partial_metadata_read(ctx);
 }
 
 static ngx_int_t
@@ -1924,6 +3406,7 @@ ngx_http_vod_async_read(ngx_http_vod_ctx_t* ctx, media_format_read_request_t* re
 	ctx->read_flags = read_req->flags;
 
 	ngx_perf_counter_start(ctx->perf_counter_context);
+	ngx_perf_counter_set_io(ctx->request_perf_counters, read_offset + prefix_size, read_size - prefix_size);
 
 	rc = ctx->cur_source->reader->read(
 		ctx->cur_source->reader_context,
@@ -1941,7 +3424,9 @@ ngx_http_vod_async_read(ngx_http_vod_ctx_t* ctx, media_format_read_request_t* re
 		return rc;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+	ngx_http_vod_update_bytes_read(ctx, ctx->read_buffer.last - ctx->read_buffer.pos);
 
 	return NGX_OK;
 }
@@ -2127,6 +3612,8 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 	vod_str_t read_buffer;
 	ngx_int_t rc;
 
+	result.partial = FALSE;
+
 	for (;;)
 	{
 		rc = ngx_http_vod_get_async_read_result(ctx, &read_buffer);
@@ -2135,6 +3622,8 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 			return rc;
 		}
 
+		ctx->metadata_read_count++;
+
 		if (ctx->metadata_reader_context == NULL)
 		{
 			// identify the format
@@ -2155,6 +3644,7 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 		{
 			ctx->metadata_parts = result.parts;
 			ctx->metadata_part_count = result.part_count;
+			ctx->metadata_partial = result.partial;
 			break;
 		}
 
@@ -2165,6 +3655,18 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
 		}
 
+		// the previous request of the file continued with the same offset, read the range it ended up reading
+		if (result.read_req.read_offset == ctx->metadata_read_hint.offset &&
+			result.read_req.read_size < ctx->metadata_read_hint.size &&
+			ctx->metadata_read_hint.size <= ctx->submodule_context.conf->max_metadata_size)
+		{
+			result.read_req.read_size = ctx->metadata_read_hint.size;
+		}
+
+		ctx->metadata_last_read.offset = result.read_req.read_offset;
+		ctx->metadata_last_read.size = result.read_req.read_size != 0 ? 
+			result.read_req.read_size : ctx->submodule_context.conf->initial_read_size;
+
 		// issue another read request
 		rc = ngx_http_vod_async_read(ctx, &result.read_req);
 		if (rc != NGX_OK)
@@ -2176,6 +3678,124 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 	return NGX_OK;
 }
 
+static ngx_int_t
+ngx_http_vod_resume_metadata_read(
+	ngx_http_vod_ctx_t* ctx,
+	multipart_cache_header_t* header,
+	uint32_t cache_token)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	vod_status_t rc;
+
+	if (ngx_http_vod_init_format(ctx, header->type) != NGX_OK)
+	{
+		rc = VOD_NOT_FOUND;
+	}
+	else if (ctx->format->resume_metadata_reader != NULL)
+	{
+		rc = ctx->format->resume_metadata_reader(
+			&ctx->submodule_context.request_context,
+			ctx->metadata_parts,
+			header->part_count,
+			conf->max_metadata_size,
+			&ctx->metadata_reader_context,
+			&ctx->metadata_resume_req);
+	}
+	else
+	{
+		rc = VOD_NOT_FOUND;
+	}
+
+	// Note: the reader copies the parts of the cached metadata that it uses
+	if (cache_token)
+	{
+		ngx_buffer_cache_release(
+			ctx->metadata_cache,
+			ctx->cur_source->file_key,
+			cache_token);
+	}
+
+	if (rc != VOD_OK)
+	{
+		// read the metadata from scratch, the result replaces the expired entry
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_resume_metadata_read: failed to resume the metadata read %i", rc);
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_resume_metadata_read: resuming the metadata read from offset %uL", ctx->metadata_resume_req.read_offset);
+
+	return NGX_OK;
+}
+
+static size_t
+ngx_http_vod_get_initial_read_size(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_str_t cache_buffer;
+
+	ctx->metadata_read_hint.offset = 0;
+	ctx->metadata_read_hint.size = 0;
+	ctx->metadata_read_count = 0;
+
+	if (conf->metadata_hint_cache == NULL)
+	{
+		return conf->initial_read_size;
+	}
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		ctx->submodule_context.r,
+		ctx->perf_counters,
+		&conf->metadata_hint_cache,
+		1,
+		ctx->cur_source->file_key,
+		&cache_buffer) < 0 ||
+		cache_buffer.len != sizeof(ctx->metadata_read_hint))
+	{
+		return conf->initial_read_size;
+	}
+
+	ngx_memcpy(&ctx->metadata_read_hint, cache_buffer.data, sizeof(ctx->metadata_read_hint));
+
+	// when the metadata starts within the initial read (e.g. a large moov of a fast start mp4), 
+	//	extend the initial read to cover it, instead of reading the rest of it in a second round trip
+	if (ctx->metadata_read_hint.offset < conf->initial_read_size &&
+		ctx->metadata_read_hint.offset + ctx->metadata_read_hint.size > conf->initial_read_size &&
+		ctx->metadata_read_hint.offset + ctx->metadata_read_hint.size <= conf->max_metadata_size)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_get_initial_read_size: using hint, offset %uL, size %uL",
+			ctx->metadata_read_hint.offset, ctx->metadata_read_hint.size);
+		return ctx->metadata_read_hint.offset + ctx->metadata_read_hint.size;
+	}
+
+	return conf->initial_read_size;
+}
+
+static void
+ngx_http_vod_metadata_hint_store(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+
+	// a single read means that the initial read was enough
+	if (conf->metadata_hint_cache == NULL ||
+		ctx->metadata_read_count <= 1 ||
+		(ctx->metadata_last_read.offset == ctx->metadata_read_hint.offset &&
+		ctx->metadata_last_read.size == ctx->metadata_read_hint.size))
+	{
+		return;
+	}
+
+	ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		conf->metadata_hint_cache,
+		ctx->cur_source->file_key,
+		ctx->cache_tag,
+		(u_char*)&ctx->metadata_last_read,
+		sizeof(ctx->metadata_last_read));
+}
+
 static ngx_int_t
 ngx_http_vod_read_frames(ngx_http_vod_ctx_t *ctx)
 {
@@ -2237,6 +3857,11 @@ ngx_http_vod_get_alloc_params(ngx_http_vod_ctx_t* ctx, ngx_http_vod_reader_t* re
 		*alignment = 1;
 		*alloc_extra_size = ctx->submodule_context.conf->max_upstream_headers_size + 1;		// the + 1 is discussed here : http://trac.nginx.org/nginx/ticket/680
 	}
+	else if (reader == &reader_ingest)
+	{
+		*alignment = 1;
+		*alloc_extra_size = 0;
+	}
 	else
 	{
 		clcf = ngx_http_get_module_loc_conf(ctx->submodule_context.r, ngx_http_core_module);
@@ -2249,6 +3874,12 @@ ngx_http_vod_get_alloc_params(ngx_http_vod_ctx_t* ctx, ngx_http_vod_reader_t* re
 static ngx_int_t
 ngx_http_vod_open_file(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
 {
+	// the file may have been opened in advance by ngx_http_vod_open_files_parallel
+	if (source->reader_context != NULL)
+	{
+		return NGX_OK;
+	}
+
 	switch (source->source_type)
 	{
 	case MEDIA_CLIP_SOURCE_FILE:
@@ -2269,2232 +3900,7275 @@ ngx_http_vod_open_file(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
 	return source->reader->open(ctx->submodule_context.r, &source->mapped_uri, 0, &source->reader_context);
 }
 
-static ngx_int_t
-ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
+static void
+ngx_http_vod_metadata_read_done(ngx_http_vod_ctx_t* ctx)
 {
-	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
-	multipart_cache_header_t multipart_header;
-	media_clip_source_t* cur_source;
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_int_t rc;
-	uint32_t cache_token;
-	bool_t metadata_loaded;
+	ngx_http_vod_metadata_read_t* read = ctx->metadata_read;
+	ngx_http_vod_ctx_t* waiter;
+	ngx_queue_t* q;
 
-	if (ctx->cur_source == NULL)
+	if (read == NULL)
 	{
-		return NGX_OK;
+		return;
 	}
 
-	for (;;)
+	ctx->metadata_read = NULL;
+	ngx_queue_remove(&read->queue);
+
+	// resume the waiting requests, they are expected to find the metadata in cache
+	while (!ngx_queue_empty(&read->waiters))
 	{
-		switch (ctx->state)
-		{
-		case STATE_READ_METADATA_INITIAL:
-			metadata_loaded = FALSE;
-			cache_token = 0;
-			cur_source = ctx->cur_source;
+		q = ngx_queue_head(&read->waiters);
+		ngx_queue_remove(q);
 
-			if (cur_source->mapped_uri.len == empty_file_string.len &&
-				ngx_strncasecmp(cur_source->mapped_uri.data, empty_file_string.data, empty_file_string.len) == 0)
-			{
-				// the string "empty" identifies an empty srt file
-				ctx->metadata_parts = ngx_palloc(ctx->submodule_context.request_context.pool,
-					sizeof(*ctx->metadata_parts) + 1);
-				if (ctx->metadata_parts == NULL)
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: ngx_palloc failed");
-					return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
-				}
+		waiter = ngx_queue_data(q, ngx_http_vod_ctx_t, metadata_read_queue);
+		ngx_post_event(&waiter->metadata_read_event, &ngx_posted_events);
+	}
+}
 
-				ctx->metadata_parts[0].len = 0;
-				ctx->metadata_parts[0].data = (void*)(ctx->metadata_parts + 1);
-				ctx->metadata_parts[0].data[0] = '\0';
-				multipart_header.type = FORMAT_ID_WEBVTT;
-				metadata_loaded = TRUE;
-			}
-			else if (conf->metadata_cache != NULL)
-			{
-				// try to fetch from cache
-				if (ngx_buffer_cache_fetch_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					&ctx->metadata_parts,
-					&cache_token))
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: metadata cache hit");
-					metadata_loaded = TRUE;
-				}
-				else
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: metadata cache miss");
-				}
-			}
+static void
+ngx_http_vod_metadata_read_cleanup(void* data)
+{
+	// the request was finalized before completing the read (e.g. error / client disconnect)
+	ngx_http_vod_metadata_read_done(data);
+}
 
-			if (metadata_loaded)
-			{
-				// parse the metadata
-				rc = ngx_http_vod_init_format(ctx, multipart_header.type);
-				if (rc != NGX_OK)
-				{
-					return rc;
-				}
+static void
+ngx_http_vod_metadata_read_wait_completed(ngx_event_t* ev)
+{
+	ngx_http_vod_ctx_t* ctx = ev->data;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
 
-				rc = ngx_http_vod_parse_metadata(ctx, 1);
+	r->main->blocked--;
+	r->aio = 0;
 
-				if (cache_token && 
-					ctx->request != NULL)		// in case of progressive, the metadata parts are used in clipper_build_header
-				{
-					ngx_buffer_cache_release(
-						conf->metadata_cache,
-						cur_source->file_key,
-						cache_token);
-				}
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_finalize_request(ctx, rc);
+	}
 
-				if (rc == NGX_OK)
-				{
-					ctx->cur_source = cur_source->next;
-					if (ctx->cur_source == NULL)
-					{
-						return NGX_OK;
-					}
-					break;
-				}
+	ngx_http_run_posted_requests(c);
+}
 
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
-					return rc;
-				}
-
-				ctx->state = STATE_READ_FRAMES_OPEN_FILE;
-			}
-			else
-			{
-				ctx->state = STATE_READ_METADATA_OPEN_FILE;
-			}
-
-			// open the file
-			rc = ngx_http_vod_open_file(ctx, cur_source);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: open_file failed %i", rc);
-				}
-				return rc;
-			}
-			break;
+// returns NGX_OK if the request should read the metadata, NGX_AGAIN if it should wait for another request
+static ngx_int_t
+ngx_http_vod_metadata_read_start(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
+{
+	ngx_http_vod_metadata_read_t* read;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_queue_t* q;
 
-		case STATE_READ_METADATA_OPEN_FILE:
-			// allocate the initial read buffer
-			cur_source = ctx->cur_source;
+	if (ctx->metadata_read != NULL &&
+		ngx_memcmp(ctx->metadata_read->key, source->file_key, sizeof(ctx->metadata_read->key)) == 0)
+	{
+		// already registered as the request performing the read (e.g. after a remote cache miss)
+		return NGX_OK;
+	}
 
-			rc = ngx_http_vod_alloc_read_buffer(ctx, conf->initial_read_size + cur_source->alloc_extra_size, cur_source->alignment);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+	for (q = ngx_queue_head(&metadata_reads);
+		q != ngx_queue_sentinel(&metadata_reads);
+		q = ngx_queue_next(q))
+	{
+		read = ngx_queue_data(q, ngx_http_vod_metadata_read_t, queue);
+		if (ngx_memcmp(read->key, source->file_key, sizeof(read->key)) != 0)
+		{
+			continue;
+		}
 
-			// read the file header
-			r->connection->log->action = "reading media header";
-			ctx->state = STATE_READ_METADATA_READ;
-			ctx->metadata_reader_context = NULL;
+		if (ctx->metadata_read_waited_source == source)
+		{
+			// already waited once for this source, the result was not saved to cache, read it independently
+			return NGX_OK;
+		}
 
-			ctx->read_offset = 0;
-			ctx->read_size = conf->initial_read_size;
-			ctx->requested_offset = 0;
-			ctx->read_flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_metadata_read_start: waiting for a concurrent metadata read");
 
-			ngx_perf_counter_start(ctx->perf_counter_context);
+		ctx->metadata_read_waited_source = source;
+		ctx->metadata_read_event.handler = ngx_http_vod_metadata_read_wait_completed;
+		ctx->metadata_read_event.data = ctx;
+		ctx->metadata_read_event.log = r->connection->log;
+		ngx_queue_insert_tail(&read->waiters, &ctx->metadata_read_queue);
 
-			rc = cur_source->reader->read(cur_source->reader_context, &ctx->read_buffer, conf->initial_read_size, 0);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: async_read failed %i", rc);
-				}
-				return rc;
-			}
+		r->main->blocked++;
+		r->aio = 1;
+		return NGX_AGAIN;
+	}
 
-			// read completed synchronously
-			ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
-			// fall through
+	// register as the request performing the read
+	if (ctx->metadata_read_cleanup == NULL)
+	{
+		ctx->metadata_read_cleanup = ngx_pool_cleanup_add(r->pool, 0);
+		if (ctx->metadata_read_cleanup == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_metadata_read_start: ngx_pool_cleanup_add failed");
+			return NGX_OK;
+		}
 
-		case STATE_READ_METADATA_READ:
-			// read the metadata
-			rc = ngx_http_vod_read_metadata(ctx);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_read_metadata failed %i", rc);
-				}
-				return rc;
-			}
+		ctx->metadata_read_cleanup->handler = ngx_http_vod_metadata_read_cleanup;
+		ctx->metadata_read_cleanup->data = ctx;
+	}
 
-			// parse the metadata
-			rc = ngx_http_vod_parse_metadata(ctx, 0);
-			if (rc != NGX_OK && rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
-				return rc;
-			}
+	ngx_http_vod_metadata_read_done(ctx);
 
-			// save the metadata to cache
-			cur_source = ctx->cur_source;
+	read = ngx_palloc(r->pool, sizeof(*read));
+	if (read == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_metadata_read_start: ngx_palloc failed");
+		return NGX_OK;
+	}
 
-			if (conf->metadata_cache != NULL)
-			{
-				multipart_header.type = ctx->format->id;
-				multipart_header.part_count = ctx->metadata_part_count;
+	ngx_memcpy(read->key, source->file_key, sizeof(read->key));
+	ngx_queue_init(&read->waiters);
+	ngx_queue_insert_tail(&metadata_reads, &read->queue);
+	ctx->metadata_read = read;
 
-				if (ngx_buffer_cache_store_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					ctx->metadata_parts))
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: stored metadata in cache");
-				}
-				else
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: failed to store metadata in cache");
-				}
-			}
+	return NGX_OK;
+}
 
-			if (ctx->request != NULL)
-			{
-				// no longer need the metadata buffer
-				ngx_pfree(ctx->submodule_context.r->pool, ctx->read_buffer.start);
-				ctx->read_buffer.start = NULL;
-			}
+////// Disk metadata cache
 
-			if (rc == NGX_OK)
-			{
-				// move to the next source
-				ctx->state = STATE_READ_METADATA_INITIAL;
+static void
+ngx_http_vod_disk_metadata_read(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
 
-				ctx->cur_source = cur_source->next;
-				if (ctx->cur_source == NULL)
-				{
-					return NGX_OK;
-				}
-				break;
-			}
-			// fall through
+	if (!ngx_disk_cache_fetch(
+		ctx->submodule_context.request_context.pool,
+		ctx->submodule_context.request_context.log,
+		&conf->metadata_cache_disk_path,
+		ctx->metadata_disk_fetched_source->file_key,
+		ngx_buffer_cache_get_expiration(ctx->metadata_cache),
+		&ctx->metadata_disk_buffer))
+	{
+		ctx->metadata_disk_buffer.len = 0;
+	}
+}
 
-		case STATE_READ_FRAMES_OPEN_FILE:
-			ctx->state = STATE_READ_FRAMES_READ;
-			ctx->read_buffer.start = NULL;			// don't reuse buffers from the metadata phase
-			ctx->read_size = 0;
+#if (NGX_THREADS)
+static void
+ngx_http_vod_disk_metadata_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_http_vod_ctx_t *ctx = data;
 
-			rc = ngx_http_vod_async_read(ctx, &ctx->frames_read_req);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-			// fall through
+	ngx_http_vod_disk_metadata_read(ctx);
+}
 
-		case STATE_READ_FRAMES_READ:
-			rc = ngx_http_vod_read_frames(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+static void
+ngx_http_vod_disk_metadata_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_http_vod_ctx_t *ctx = ev->data;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_connection_t *c = r->connection;
+	ngx_int_t rc;
 
-			// move to the next source
-			ctx->state = STATE_READ_METADATA_INITIAL;
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_FETCH_DISK_CACHE);
 
-			ctx->cur_source = ctx->cur_source->next;
-			if (ctx->cur_source == NULL)
-			{
-				return NGX_OK;
-			}
-			break;
+	r->main->blocked--;
+	r->aio = 0;
 
-		default:
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_state_machine_parse_metadata: invalid state %d", ctx->state);
-			return ngx_http_vod_status_to_ngx_error(r, VOD_UNEXPECTED);
-		}
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_finalize_request(ctx, rc);
 	}
 
-	return NGX_OK;
+	ngx_http_run_posted_requests(c);
 }
+#endif // NGX_THREADS
 
+// reads the metadata of the source from the disk cache into metadata_disk_buffer, on the thread pool, if configured.
+// returns NGX_AGAIN if a task was posted, in this case the state machine is called again when the read completes
 static ngx_int_t
-ngx_http_vod_validate_streams(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_disk_metadata_fetch(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
 {
-	if (ctx->submodule_context.media_set.total_track_count == 0)
-	{
-		if (ctx->request->request_class == REQUEST_CLASS_SEGMENT)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: no matching streams were found, probably invalid segment index");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_NO_STREAMS);
-		}
-		else
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: no matching streams were found");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
-		}
-	}
-	
-	if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
-	{
-		if (ctx->submodule_context.media_set.sequence_count != 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: request has more than one sequence while only one is supported");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
-		}
+#if (NGX_THREADS)
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_thread_task_t* task;
+#endif // NGX_THREADS
 
-		if (ctx->submodule_context.media_set.total_track_count != 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: got %uD streams while only a single stream is supported",
-				ctx->submodule_context.media_set.total_track_count);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
-		}
-	}
-	else if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
+	ctx->metadata_disk_fetched_source = source;
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+#if (NGX_THREADS)
+	if (conf->metadata_cache_disk_thread_pool != NULL)
 	{
-		if (ctx->submodule_context.media_set.sequence_count != 1 && ctx->submodule_context.media_set.sequence_count != 2)
+		task = ctx->metadata_disk_task;
+		if (task == NULL)
 		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: invalid sequence count %uD", ctx->submodule_context.media_set.sequence_count);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
-		}
+			task = ngx_thread_task_alloc(r->pool, 0);
+			if (task == NULL)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_disk_metadata_fetch: ngx_thread_task_alloc failed");
+				return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+			}
 
-		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO] > 1 ||
-			ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO] > 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: one stream at most per media type is allowed video=%uD audio=%uD",
-				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO],
-				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO]);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+			task->ctx = ctx;
+			task->handler = ngx_http_vod_disk_metadata_thread_handler;
+			task->event.data = ctx;
+			task->event.handler = ngx_http_vod_disk_metadata_thread_event_handler;
+
+			ctx->metadata_disk_task = task;
 		}
 
-		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_SUBTITLE] > 0 &&
-			ctx->submodule_context.media_set.total_track_count != 1)
+		if (ngx_thread_task_post(conf->metadata_cache_disk_thread_pool, task) == NGX_OK)
 		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: cannot have more than a single subtitle track and it cannot be mixed with other track types");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+			// Note: the request is blocked until the task completes, so its pool is not accessed by the event loop
+			r->main->blocked++;
+			r->aio = 1;
+
+			return NGX_AGAIN;
 		}
+
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_disk_metadata_fetch: ngx_thread_task_post failed");
 	}
-	
+#endif // NGX_THREADS
+
+	ngx_http_vod_disk_metadata_read(ctx);
+
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_FETCH_DISK_CACHE);
+
 	return NGX_OK;
 }
 
-static ngx_int_t
-ngx_http_vod_update_track_timescale(
-	ngx_http_vod_ctx_t *ctx, 
-	media_track_t* track, 
-	uint32_t new_timescale, 
-	uint32_t pts_delay)
-{
-	frame_list_part_t* part;
-	input_frame_t* last_frame;
-	input_frame_t* cur_frame;
-	uint64_t next_scaled_dts;
-	uint64_t last_frame_dts;
-	uint64_t clip_start_dts;
-	uint64_t clip_end_pts;
-	uint64_t clip_end_dts;
-	uint64_t scaled_dts;
-	uint64_t scaled_pts;
-	uint64_t dts;
-	uint64_t pts;
-	uint32_t cur_timescale = track->media_info.timescale;
+////// Remote metadata cache
 
-	// frames
-	dts = track->first_frame_time_offset;
-	scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
-	clip_start_dts = scaled_dts;
+static void
+ngx_http_vod_remote_metadata_fetch_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_ctx_t* ctx = context;
 
-	track->first_frame_time_offset = scaled_dts;
-	track->total_frames_duration = 0;
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_FETCH_REMOTE_CACHE);
 
-	// initialize the first part
-	part = &track->frames;
-	cur_frame = part->first_frame;
-	last_frame = part->last_frame;
-	if (part->clip_to != UINT_MAX && cur_frame < last_frame)
+	if (rc == NGX_OK && content_length > 0)
 	{
-		clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
-		if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
-		{
-			clip_end_pts = clip_end_dts + rescale_time(track->media_info.u.video.initial_pts_delay,
-				cur_timescale, new_timescale);
-		}
-		else
-		{
-			clip_end_pts = ULLONG_MAX;
-		}
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_remote_metadata_fetch_finished: remote metadata cache hit");
+
+		ctx->metadata_remote_buffer.data = response->pos;
+		ctx->metadata_remote_buffer.len = content_length;
 	}
 	else
 	{
-		clip_end_dts = ULLONG_MAX;
-		clip_end_pts = ULLONG_MAX;
+		// errors are ignored, the metadata will be read from the file
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_remote_metadata_fetch_finished: remote metadata cache miss %i", rc);
 	}
 
-	for (;; cur_frame++)
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
 	{
-		if (cur_frame >= last_frame)
-		{
-			if (clip_end_dts != ULLONG_MAX)
-			{
-				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
-				last_frame_dts = scaled_dts - cur_frame[-1].duration;
-
-				if (clip_end_dts > last_frame_dts)
-				{
-					cur_frame[-1].duration = clip_end_dts - last_frame_dts;
-					scaled_dts = clip_end_dts;
-				}
-				else
-				{
-					ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_update_track_timescale: last frame dts %uL greater than clip end dts %uL",
-						last_frame_dts, clip_end_dts);
-				}
-
-				track->total_frames_duration += scaled_dts - clip_start_dts;
-
-				dts = 0;
-				scaled_dts = 0;
-				clip_start_dts = 0;
-			}
+		return;
+	}
 
-			if (part->next == NULL)
-			{
-				break;
-			}
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
-			// initialize the next part
-			part = part->next;
-			cur_frame = part->first_frame;
-			last_frame = part->last_frame;
-			if (part->clip_to != UINT_MAX && cur_frame < last_frame)
-			{
-				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
-				if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
-				{
-					clip_end_pts = clip_end_dts + rescale_time(track->media_info.u.video.initial_pts_delay,
-						cur_timescale, new_timescale);
-				}
-			}
-			else
-			{
-				clip_end_dts = ULLONG_MAX;
-				clip_end_pts = ULLONG_MAX;
-			}
-		}
+static ngx_int_t
+ngx_http_vod_remote_metadata_fetch(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
+{
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_buf_t* response;
+	ngx_int_t rc;
+	u_char* p;
 
-		// get the pts delay
-		pts = dts + cur_frame->pts_delay;
-		scaled_pts = rescale_time(pts, cur_timescale, new_timescale);
-		if (scaled_pts > clip_end_pts)
-		{
-			scaled_pts = ngx_max(clip_end_pts, scaled_dts);
-		}
-		cur_frame->pts_delay = scaled_pts - scaled_dts + pts_delay;
+	ctx->metadata_remote_fetched_source = source;
 
-		// get the duration
-		dts += cur_frame->duration;
-		next_scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
-		cur_frame->duration = next_scaled_dts - scaled_dts;
-		scaled_dts = next_scaled_dts;
+	response = ngx_create_temp_buf(r->pool, conf->max_metadata_size + conf->max_upstream_headers_size + 1);
+	if (response == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_fetch: ngx_create_temp_buf failed");
+		return NGX_ERROR;
 	}
 
-	track->total_frames_duration += scaled_dts - clip_start_dts;
-	track->clip_from_frame_offset = rescale_time(track->clip_from_frame_offset, cur_timescale, new_timescale);
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.allow_not_found = 1;
 
-	// media info
-	track->media_info.duration = rescale_time(track->media_info.duration, cur_timescale, new_timescale);
-	track->media_info.full_duration = rescale_time(track->media_info.full_duration, cur_timescale, new_timescale);
-	if (track->media_info.full_duration == 0)
+	p = ngx_pnalloc(r->pool, MEDIA_CLIP_KEY_SIZE * 2);
+	if (p == NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_update_track_timescale: full duration is zero following rescale");
-		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_fetch: ngx_pnalloc failed");
+		return NGX_ERROR;
 	}
 
-	if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
-	{
-		if (track->media_info.min_frame_duration != 0)
-		{
-			track->media_info.min_frame_duration =
-				rescale_time(track->media_info.min_frame_duration, cur_timescale, new_timescale);
-			if (track->media_info.min_frame_duration == 0)
-			{
-				ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_update_track_timescale: min frame duration is zero following rescale");
-				track->media_info.min_frame_duration = 1;
-			}
-		}
+	child_params.base_uri.data = p;
+	child_params.base_uri.len = ngx_hex_dump(p, source->file_key, MEDIA_CLIP_KEY_SIZE) - p;
 
-		track->media_info.u.video.initial_pts_delay =
-			rescale_time(track->media_info.u.video.initial_pts_delay, cur_timescale, new_timescale);
-	}
+	r->connection->log->action = "reading remote metadata cache";
 
-	track->media_info.timescale = new_timescale;
-	track->media_info.frames_timescale = new_timescale;
+	ngx_perf_counter_start(ctx->perf_counter_context);
 
-	return NGX_OK;
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_remote_metadata_fetch_finished,
+		ctx,
+		&conf->metadata_cache_remote_location,
+		&child_params,
+		response);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_fetch: ngx_child_request_start failed %i", rc);
+	}
+	return rc;
 }
 
-static ngx_int_t
-ngx_http_vod_update_timescale(ngx_http_vod_ctx_t *ctx)
+static void
+ngx_http_vod_remote_metadata_store_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	media_set_t* media_set = &ctx->submodule_context.media_set;
-	media_track_t* track;
-	ngx_int_t rc;
+	ngx_http_vod_ctx_t* ctx = context;
 
-	for (track = media_set->filtered_tracks; track < media_set->filtered_tracks_end; track++)
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_STORE_REMOTE_CACHE);
+
+	if (rc != NGX_OK)
 	{
-		rc = ngx_http_vod_update_track_timescale(
-			ctx, 
-			track, 
-			ctx->request->timescale, 
-			ctx->submodule_context.request_params.pts_delay);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+		// errors are ignored, the metadata was already parsed
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_remote_metadata_store_finished: failed to store metadata in remote cache %i", rc);
 	}
 
-	return NGX_OK;
-}
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
 
-////// Metadata request handling
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
+// returns NGX_AGAIN when the store request was started, NGX_OK when it was skipped
 static ngx_int_t
-ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_remote_metadata_store(
+	ngx_http_vod_ctx_t* ctx,
+	media_clip_source_t* source,
+	multipart_cache_header_t* header,
+	ngx_str_t* parts)
 {
+	ngx_child_request_params_t child_params;
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
-	response_cache_header_t cache_header;
-	ngx_buffer_cache_t* cache;
-	ngx_str_t cache_buffers[3];
-	ngx_str_t content_type;
-	ngx_str_t response = ngx_null_string;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t* buffers;
+	ngx_str_t* cur_buffer;
+	ngx_str_t* buffers_end;
+	ngx_buf_t* response;
+	ngx_buf_t* b;
 	ngx_int_t rc;
-	int cache_type;
+	size_t size;
+	u_char* p;
 
-	rc = ngx_http_vod_update_timescale(ctx);
-	if (rc != NGX_OK)
+	buffers = ngx_buffer_cache_get_multipart_buffers(ctx, header, parts);
+	if (buffers == NULL)
 	{
-		return rc;
+		return NGX_OK;
 	}
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
-	
-	if(conf->force_sequence_index)
+	buffers_end = buffers + header->part_count + 1;
+
+	size = 0;
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
 	{
-		ctx->submodule_context.media_set.has_multi_sequences = TRUE;
+		size += cur_buffer->len;
 	}
-	
-	rc = ctx->request->handle_metadata_request(
-		&ctx->submodule_context,
-		&response,
-		&content_type);
-	if (rc != NGX_OK)
+
+	if (size > conf->max_metadata_size)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
-		return rc;
+		// would not fit in the buffer allocated for fetching from the remote cache
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: size %uz exceeds the max metadata size", size);
+		return NGX_OK;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+	// the parts point to the read buffer, which is freed after the metadata is parsed, must copy
+	b = ngx_create_temp_buf(r->pool, size);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: ngx_create_temp_buf failed");
+		return NGX_OK;
+	}
 
-	if (ctx->submodule_context.media_set.original_type != MEDIA_SET_LIVE ||
-		(ctx->request->flags & REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE) == 0)
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
 	{
-		cache_type = CACHE_TYPE_VOD;
+		b->last = ngx_copy(b->last, cur_buffer->data, cur_buffer->len);
 	}
-	else
+	b->last_buf = 1;
+
+	response = ngx_create_temp_buf(r->pool, conf->max_upstream_headers_size + 1);
+	if (response == NULL)
 	{
-		cache_type = CACHE_TYPE_LIVE;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: ngx_create_temp_buf failed (2)");
+		return NGX_OK;
 	}
 
-	cache = conf->response_cache[cache_type];
-	if (cache != NULL && response.data != NULL)
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_PUT;
+	child_params.request_body_length = size;
+
+	child_params.request_body = ngx_alloc_chain_link(r->pool);
+	if (child_params.request_body == NULL)
 	{
-		cache_header.content_type_len = content_type.len;
-		cache_header.media_set_type = ctx->submodule_context.media_set.type;
-		cache_buffers[0].data = (u_char*)&cache_header;
-		cache_buffers[0].len = sizeof(cache_header);
-		cache_buffers[1] = content_type;
-		cache_buffers[2] = response;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: ngx_alloc_chain_link failed");
+		return NGX_OK;
+	}
 
-		if (ngx_buffer_cache_store_gather_perf(ctx->perf_counters, cache, ctx->request_key, cache_buffers, 3))
-		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: stored in response cache");
-		}
-		else
-		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: failed to store response in cache");
-		}
-	}
+	child_params.request_body->buf = b;
+	child_params.request_body->next = NULL;
 
-	rc = ngx_http_vod_send_header(
-		ctx->submodule_context.r, 
-		response.len, 
-		&content_type, 
-		ctx->submodule_context.media_set.type, 
-		ctx->request);
-	if (rc != NGX_OK)
+	p = ngx_pnalloc(r->pool, MEDIA_CLIP_KEY_SIZE * 2);
+	if (p == NULL)
 	{
-		return rc;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: ngx_pnalloc failed");
+		return NGX_OK;
 	}
-	
-	return ngx_http_vod_send_response(ctx->submodule_context.r, &response, NULL);
-}
 
-////// Segment request handling
+	child_params.base_uri.data = p;
+	child_params.base_uri.len = ngx_hex_dump(p, source->file_key, MEDIA_CLIP_KEY_SIZE) - p;
 
-static ngx_int_t
-ngx_http_vod_state_machine_open_files(ngx_http_vod_ctx_t *ctx)
-{
-	media_clip_source_t* cur_source;
-	ngx_int_t rc;
+	r->connection->log->action = "writing remote metadata cache";
 
-	for (cur_source = ctx->cur_source;
-		cur_source != NULL;
-		cur_source = cur_source->next)
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_remote_metadata_store_finished,
+		ctx,
+		&conf->metadata_cache_remote_location,
+		&child_params,
+		response);
+	if (rc != NGX_AGAIN)
 	{
-		// open the file if not already opened
-		if (cur_source->reader_context != NULL)
-		{
-			continue;
-		}
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_remote_metadata_store: ngx_child_request_start failed %i", rc);
+	}
+	return rc;
+}
 
-		rc = ngx_http_vod_open_file(ctx, cur_source);
-		if (rc != NGX_OK)
-		{
-			if (rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_state_machine_open_files: open_file failed %i", rc);
-			}
+// saves metadata that was fetched in the format of the cache (e.g. from the remote cache) to the local caches
+static void
+ngx_http_vod_metadata_cache_store_buffer(
+	ngx_http_vod_ctx_t* ctx,
+	media_clip_source_t* source,
+	ngx_str_t* buffer)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
 
-			ctx->cur_source = cur_source;
-			return rc;
-		}
+	if (ctx->metadata_cache == NULL)
+	{
+		return;
 	}
 
-	ctx->cur_source = NULL;
-	return NGX_OK;
+	ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		ctx->metadata_cache,
+		source->file_key,
+		ctx->cache_tag,
+		buffer->data,
+		buffer->len);
+
+	if (conf->metadata_cache_disk_path.len != 0)
+	{
+		ngx_disk_cache_store(
+			ctx->submodule_context.request_context.pool,
+			ctx->submodule_context.request_context.log,
+			&conf->metadata_cache_disk_path,
+			source->file_key,
+			buffer,
+			1,
+			ngx_http_vod_disk_cache_thread_pool(conf));
+	}
 }
 
+////// Sidecar index
+
 static void
-ngx_http_vod_enable_directio(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_sidecar_index_fetch_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	media_clip_source_t* cur_source;
+	ngx_http_vod_ctx_t* ctx = context;
 
-	for (cur_source = ctx->submodule_context.media_set.sources_head;
-		cur_source != NULL;
-		cur_source = cur_source->next)
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_FETCH_SIDECAR_INDEX);
+
+	if (rc == NGX_OK && content_length > 0)
 	{
-		if (cur_source->reader->enable_directio != NULL)
-		{
-			cur_source->reader->enable_directio(cur_source->reader_context);
-		}
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_sidecar_index_fetch_finished: sidecar index found");
+
+		ctx->sidecar_index_buffer.data = response->pos;
+		ctx->sidecar_index_buffer.len = content_length;
+	}
+	else
+	{
+		// errors are ignored, the metadata will be read from the file
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_sidecar_index_fetch_finished: sidecar index not found %i", rc);
+	}
+
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
 	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
 }
 
-static vod_status_t
-ngx_http_vod_write_segment_header_buffer(void* ctx, u_char* buffer, uint32_t size)
+static ngx_int_t
+ngx_http_vod_sidecar_index_fetch(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source)
 {
-	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
-	ngx_chain_t *chain_head;
-	ngx_chain_t *chain;
-	ngx_buf_t *b;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_buf_t* response;
+	ngx_int_t rc;
+	u_char* p;
 
-	if (context->r->header_sent)
-	{
-		ngx_log_error(NGX_LOG_ERR, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: called after the headers were already sent");
-		return VOD_UNEXPECTED;
-	}
+	ctx->sidecar_index_fetched_source = source;
 
-	b = ngx_calloc_buf(context->r->pool);
-	if (b == NULL)
+	response = ngx_create_temp_buf(r->pool, sizeof(sidecar_index_header_t) + conf->max_metadata_size + 
+		conf->max_upstream_headers_size + 1);
+	if (response == NULL)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: ngx_calloc_buf failed");
-		return VOD_ALLOC_FAILED;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_sidecar_index_fetch: ngx_create_temp_buf failed");
+		return NGX_ERROR;
 	}
 
-	b->pos = buffer;
-	b->last = buffer + size;
-	b->temporary = 1;
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.allow_not_found = 1;
 
-	chain = ngx_alloc_chain_link(context->r->pool);
-	if (chain == NULL)
+	// the sidecar is named after the media file, e.g. /path/to/file.mp4.vodidx
+	p = ngx_pnalloc(r->pool, source->mapped_uri.len + conf->sidecar_index_suffix.len);
+	if (p == NULL)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: ngx_alloc_chain_link failed");
-		return VOD_ALLOC_FAILED;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_sidecar_index_fetch: ngx_pnalloc failed");
+		return NGX_ERROR;
 	}
 
-	chain_head = context->chain_head;
+	child_params.base_uri.data = p;
+	p = ngx_copy(p, source->mapped_uri.data, source->mapped_uri.len);
+	p = ngx_copy(p, conf->sidecar_index_suffix.data, conf->sidecar_index_suffix.len);
+	child_params.base_uri.len = p - child_params.base_uri.data;
 
-	chain->buf = chain_head->buf;
-	chain->next = chain_head->next;
+	r->connection->log->action = "reading sidecar index";
 
-	chain_head->buf = b;
-	chain_head->next = chain;
+	ngx_perf_counter_start(ctx->perf_counter_context);
 
-	if (chain_head == context->chain_end)
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_sidecar_index_fetch_finished,
+		ctx,
+		&conf->sidecar_index_location,
+		&child_params,
+		response);
+	if (rc != NGX_AGAIN)
 	{
-		context->chain_end = chain;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_sidecar_index_fetch: ngx_child_request_start failed %i", rc);
+	}
+	return rc;
+}
+
+// validates the header of a sidecar index, and returns the metadata that follows it
+static ngx_flag_t
+ngx_http_vod_sidecar_index_parse(ngx_http_vod_ctx_t* ctx, ngx_str_t* buffer, ngx_str_t* metadata)
+{
+	sidecar_index_header_t* header;
+
+	if (buffer->len < sizeof(*header))
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_sidecar_index_parse: size %uz smaller than header size", buffer->len);
+		return 0;
 	}
 
-	context->total_size += size;
+	header = (sidecar_index_header_t*)buffer->data;
+	if (header->magic != SIDECAR_INDEX_MAGIC ||
+		header->version != SIDECAR_INDEX_VERSION ||
+		header->size_t_size != sizeof(size_t))
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_sidecar_index_parse: unsupported sidecar index, magic 0x%uxD, version %uD, size_t size %uD",
+			header->magic, (uint32_t)header->version, (uint32_t)header->size_t_size);
+		return 0;
+	}
 
-	return VOD_OK;
+	metadata->data = buffer->data + sizeof(*header);
+	metadata->len = buffer->len - sizeof(*header);
+	return 1;
 }
 
-static vod_status_t 
-ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+// returns the metadata parts that should be saved to cache, falls back to the parsed parts on error
+static ngx_str_t*
+ngx_http_vod_get_cache_metadata_parts(ngx_http_vod_ctx_t *ctx, uint32_t* part_count)
 {
-	ngx_http_vod_write_segment_context_t* context;
-	ngx_buf_t *b;
-	ngx_chain_t *chain;
-	ngx_chain_t out;
-	ngx_int_t rc;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	request_context_t* request_context = &ctx->submodule_context.request_context;
+	ngx_str_t* result;
+	vod_status_t rc;
 
-	if (size <= 0)
+	*part_count = ctx->metadata_part_count;
+
+	if ((!conf->metadata_cache_compact || ctx->format->compact_metadata == NULL) &&
+		(!conf->metadata_cache_sample_index || ctx->format->build_metadata_index == NULL))
 	{
-		return VOD_OK;
+		return ctx->metadata_parts;
 	}
 
-	context = (ngx_http_vod_write_segment_context_t*)ctx;
-	
-	// create a wrapping ngx_buf_t
-	b = ngx_calloc_buf(context->r->pool);
-	if (b == NULL) 
+	// Note: allocating an extra part for the index
+	result = ngx_palloc(request_context->pool, sizeof(result[0]) * (ctx->metadata_part_count + 1));
+	if (result == NULL)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
-		return VOD_ALLOC_FAILED;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_get_cache_metadata_parts: ngx_palloc failed");
+		return ctx->metadata_parts;
 	}
 
-	b->pos = buffer;
-	b->last = buffer + size;
-	b->temporary = 1;
+	ngx_memcpy(result, ctx->metadata_parts, sizeof(result[0]) * ctx->metadata_part_count);
 
-	if (context->r->header_sent)
+	if (conf->metadata_cache_compact && ctx->format->compact_metadata != NULL)
 	{
-		// headers already sent, output the chunk
-		out.buf = b;
-		out.next = NULL;
-
-		rc = ngx_http_output_filter(context->r, &out);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
+		rc = ctx->format->compact_metadata(
+			request_context,
+			ctx->metadata_parts,
+			ctx->metadata_part_count,
+			result);
+		if (rc != VOD_OK)
 		{
-			// either the connection dropped, or some allocation failed
-			// in case the connection dropped, the error code doesn't matter anyway
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-				"ngx_http_vod_write_segment_buffer: ngx_http_output_filter failed %i", rc);
-			return VOD_ALLOC_FAILED;
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_get_cache_metadata_parts: compact_metadata failed %i", rc);
+			ngx_memcpy(result, ctx->metadata_parts, sizeof(result[0]) * ctx->metadata_part_count);
 		}
 	}
-	else
+
+	if (conf->metadata_cache_sample_index && ctx->format->build_metadata_index != NULL)
 	{
-		// headers not sent yet, add the buffer to the chain
-		if (context->chain_end->buf != NULL)
+		rc = ctx->format->build_metadata_index(
+			request_context,
+			result,
+			ctx->metadata_part_count,
+			&result[ctx->metadata_part_count]);
+		if (rc == VOD_OK)
 		{
-			chain = ngx_alloc_chain_link(context->r->pool);
-			if (chain == NULL) 
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-					"ngx_http_vod_write_segment_buffer: ngx_alloc_chain_link failed");
-				return VOD_ALLOC_FAILED;
-			}
-
-			context->chain_end->next = chain;
-			context->chain_end = chain;
+			(*part_count)++;
+		}
+		else
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_get_cache_metadata_parts: build_metadata_index failed %i", rc);
 		}
-		context->chain_end->buf = b;
 	}
 
-	context->total_size += size;
-
-	return VOD_OK;
+	return result;
 }
 
-static ngx_int_t 
-ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
+////// Asynchronous operation groups
+
+// the operations of a group are started between ngx_http_vod_join_start and ngx_http_vod_join_started.
+// on error, the operations that were already started are not cancelled, the error is returned once
+// all of them complete, so that their buffers are not released while they are in progress
+static ngx_inline void
+ngx_http_vod_join_start(ngx_http_vod_join_t* join)
 {
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_str_t output_buffer = ngx_null_string;
-	ngx_str_t content_type;
-	ngx_int_t rc;
-	off_t range_start;
-	off_t range_end;
+	join->pending = 0;
+	join->rc = NGX_OK;
+	join->starting = 1;
+}
 
-	rc = ngx_http_vod_update_timescale(ctx);
-	if (rc != NGX_OK)
+// rc is the result of starting an operation, NGX_AGAIN when the operation completes asynchronously
+static ngx_inline void
+ngx_http_vod_join_add(ngx_http_vod_join_t* join, ngx_int_t rc)
+{
+	if (rc == NGX_AGAIN)
 	{
-		return rc;
+		join->pending++;
+	}
+	else if (rc != NGX_OK && join->rc == NGX_OK)
+	{
+		join->rc = rc;
 	}
+}
 
-	// initialize the response writer
-	ctx->write_segment_buffer_context.r = r;
-	ctx->write_segment_buffer_context.chain_head = &ctx->out;
-	ctx->write_segment_buffer_context.chain_end = &ctx->out;
+// returns NGX_AGAIN when some operations are pending, otherwise, the result of the group
+static ngx_inline ngx_int_t
+ngx_http_vod_join_started(ngx_http_vod_join_t* join)
+{
+	join->starting = 0;
 
-	ctx->segment_writer.write_tail = ngx_http_vod_write_segment_buffer;
-	ctx->segment_writer.write_head = ngx_http_vod_write_segment_header_buffer;
-	ctx->segment_writer.context = &ctx->write_segment_buffer_context;
+	if (join->pending > 0)
+	{
+		return NGX_AGAIN;
+	}
 
-	// initialize the protocol specific frame processor
-	ngx_perf_counter_start(ctx->perf_counter_context);
+	return join->rc;
+}
 
-	rc = ctx->request->init_frame_processor(
-		&ctx->submodule_context,
-		&ctx->segment_writer,
-		&ctx->frame_processor,
-		&ctx->frame_processor_state,
-		&output_buffer,
-		&ctx->content_length,
-		&content_type);
-	if (rc != NGX_OK)
+// called when a pending operation completes
+static ngx_inline void
+ngx_http_vod_join_complete(ngx_http_vod_join_t* join, ngx_int_t rc)
+{
+	join->pending--;
+
+	if (rc != NGX_OK && join->rc == NGX_OK)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_frame_processing: init_frame_processor failed %i", rc);
-		return rc;
+		join->rc = rc;
 	}
+}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_INIT_FRAME_PROCESS);
+// returns TRUE when all the operations of the group completed
+static ngx_inline ngx_flag_t
+ngx_http_vod_join_done(ngx_http_vod_join_t* join)
+{
+	return join->pending == 0 && !join->starting;
+}
 
-	r->headers_out.content_type_len = content_type.len;
-	r->headers_out.content_type.len = content_type.len;
-	r->headers_out.content_type.data = content_type.data;
+#if (NGX_THREADS)
+static ngx_flag_t
+ngx_http_vod_parallel_open_enabled(ngx_http_vod_ctx_t *ctx)
+{
+	// Note: the fallback is not supported since it dumps the request
+	return ctx->submodule_context.conf->open_file_thread_pool != NULL &&
+		ctx->default_reader != &reader_file_with_fallback;
+}
 
-	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it
-	if (ctx->content_length != 0)
+// opens all the sources starting from cur_source at once, the opens that are performed on the thread pool
+// run in parallel, and the state machine resumes once all of them complete
+static ngx_int_t
+ngx_http_vod_open_files_parallel(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	ngx_int_t rc;
+
+	ngx_http_vod_join_start(&ctx->open_join);
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
 	{
-		// send the response header
-		rc = ngx_http_vod_send_header(r, ctx->content_length, NULL, MEDIA_SET_VOD, NULL);
-		if (rc != NGX_OK)
+		if (cur_source->reader_context != NULL ||
+			ngx_http_vod_mapped_media_info_usable(ctx, cur_source) ||
+			(cur_source->mapped_uri.len == empty_file_string.len &&
+			ngx_strncasecmp(cur_source->mapped_uri.data, empty_file_string.data, empty_file_string.len) == 0))
 		{
-			return rc;
+			continue;
 		}
 
-		if (r->header_only || r->method == NGX_HTTP_HEAD)
+		rc = ngx_http_vod_open_file(ctx, cur_source);
+		ngx_http_vod_join_add(&ctx->open_join, rc);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
 		{
-			return NGX_DONE;
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_open_files_parallel: open_file failed %i", rc);
+			break;
 		}
+	}
 
-		// in case of range request, get the end offset
-		if (ctx->submodule_context.r->headers_in.range != NULL &&
-			ngx_http_vod_range_parse(
-				&ctx->submodule_context.r->headers_in.range->value,
-				ctx->content_length,
-				&range_start,
-				&range_end) == NGX_OK)
+	return ngx_http_vod_join_started(&ctx->open_join);
+}
+#endif // NGX_THREADS
+
+// returns whether the initial metadata read of the source can be issued in advance
+static ngx_flag_t
+ngx_http_vod_metadata_prefetch_supported(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	return !ngx_http_vod_mapped_media_info_usable(ctx, source) &&
+		!(source->mapped_uri.len == empty_file_string.len &&
+		ngx_strncasecmp(source->mapped_uri.data, empty_file_string.data, empty_file_string.len) == 0);
+}
+
+// issues the initial metadata read of all the sources starting from cur_source in parallel, the metadata of
+// each source is then parsed by the state machine, using the prefetched buffer.
+// this is called when cur_source misses the metadata cache, the following sources of the media set are
+// assumed to miss it as well (e.g. a title that was not requested recently)
+static ngx_int_t
+ngx_http_vod_prefetch_metadata(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_metadata_prefetch_t* cur_read;
+	media_clip_source_t* cur_source = ctx->cur_source;
+	media_clip_source_t* source;
+	ngx_buf_t read_buffer;
+	ngx_int_t rc;
+
+	// open the files of the following sources
+#if (NGX_THREADS)
+	if (ngx_http_vod_parallel_open_enabled(ctx))
+	{
+		// Note: on NGX_AGAIN, the state machine runs again once all the files are opened
+		rc = ngx_http_vod_open_files_parallel(ctx);
+		if (rc != NGX_OK)
 		{
-			ctx->size_limit = range_end;
+			return rc;
 		}
 	}
-
-	// write the initial buffer if provided
-	if (output_buffer.len != 0)
+	else if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
 	{
-		rc = ctx->segment_writer.write_tail(
-			ctx->segment_writer.context, 
-			output_buffer.data, 
-			output_buffer.len);
-		if (rc != VOD_OK)
+		// the files are opened asynchronously, one at a time
+		ctx->metadata_prefetch_started = 1;
+		return NGX_OK;
+	}
+	else
+#endif // NGX_THREADS
+	if (ctx->default_reader != &reader_file_with_fallback)
+	{
+		for (source = cur_source->next; source != NULL; source = source->next)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_frame_processing: write_tail failed %i", rc);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+			if (!ngx_http_vod_metadata_prefetch_supported(ctx, source))
+			{
+				continue;
+			}
+
+			rc = ngx_http_vod_open_file(ctx, source);
+			if (rc != NGX_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_prefetch_metadata: open_file failed %i", rc);
+				return rc;
+			}
 		}
+	}
 
-		// in case of a range request that is fully contained in the output buffer (e.g. 0-0), we're done
-		if (ctx->size_limit != 0 && output_buffer.len >= ctx->size_limit && r->header_sent)
+	ctx->metadata_prefetch_started = 1;
+
+	ctx->metadata_prefetch = ngx_palloc(ctx->submodule_context.request_context.pool,
+		sizeof(ctx->metadata_prefetch[0]) * MAX_PARALLEL_METADATA_READS);
+	if (ctx->metadata_prefetch == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_prefetch_metadata: ngx_palloc failed");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+	}
+
+	ctx->metadata_prefetch_count = 0;
+	for (source = cur_source; 
+		source != NULL && ctx->metadata_prefetch_count < MAX_PARALLEL_METADATA_READS; 
+		source = source->next)
+	{
+		if (source->reader_context != NULL &&
+			ngx_http_vod_metadata_prefetch_supported(ctx, source))
 		{
-			return NGX_DONE;
+			ctx->metadata_prefetch[ctx->metadata_prefetch_count++].source = source;
 		}
 	}
 
-	rc = read_cache_allocate_buffer_slots(&ctx->read_cache_state, 0);
-	if (rc != VOD_OK)
+	if (ctx->metadata_prefetch_count < 2)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_frame_processing: read_cache_allocate_buffer_slots failed %i", rc);
-		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		// nothing to parallelize
+		ctx->metadata_prefetch_count = 0;
+		return NGX_OK;
 	}
 
-	return NGX_OK;
-}
+	// Note: the buffer of the previous source may still be referenced, a new buffer is allocated for each read
+	read_buffer = ctx->read_buffer;
 
-static ngx_int_t 
-ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
-{
-	read_cache_get_read_buffer_t read_buf;
-	size_t cache_buffer_size;
-	vod_status_t rc;
+	ngx_http_vod_join_start(&ctx->prefetch_join);
 
-	for (;;)
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	for (cur_read = ctx->metadata_prefetch; 
+		cur_read < ctx->metadata_prefetch + ctx->metadata_prefetch_count; 
+		cur_read++)
 	{
-		ngx_perf_counter_start(ctx->perf_counter_context);
+		source = cur_read->source;
 
-		rc = ctx->frame_processor(ctx->frame_processor_state);
+		// Note: the read size is determined according to the metadata hint of the source
+		ctx->cur_source = source;
+		cur_read->read_size = ngx_http_vod_get_initial_read_size(ctx);
+		cur_read->read_hint = ctx->metadata_read_hint;
+		ctx->cur_source = cur_source;
 
-		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_PROCESS_FRAMES);
+		ctx->read_buffer.start = NULL;
 
-		switch (rc)
+		rc = ngx_http_vod_alloc_read_buffer(ctx, cur_read->read_size + source->alloc_extra_size, source->alignment);
+		if (rc != NGX_OK)
 		{
-		case VOD_OK:
-			// we're done
-			return NGX_OK;
-
-		case VOD_AGAIN:
-			// handled outside the switch
+			ngx_http_vod_join_add(&ctx->prefetch_join, rc);
 			break;
+		}
 
-		default:
+		cur_read->buf = ctx->read_buffer;
+
+		ngx_perf_counter_set_io(ctx->request_perf_counters, 0, cur_read->read_size);
+
+		rc = source->reader->read(source->reader_context, &cur_read->buf, cur_read->read_size, 0);
+		ngx_http_vod_join_add(&ctx->prefetch_join, rc);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_process_media_frames: frame_processor failed %i", rc);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+				"ngx_http_vod_prefetch_metadata: async_read failed %i", rc);
+			break;
 		}
+	}
 
-		if (ctx->size_limit != 0 && 
-			ctx->write_segment_buffer_context.total_size >= ctx->size_limit && 
-			ctx->submodule_context.r->header_sent)
+	ctx->read_buffer = read_buffer;
+
+	rc = ngx_http_vod_join_started(&ctx->prefetch_join);
+	if (rc != NGX_OK)
+	{
+		if (rc == NGX_AGAIN)
 		{
-			return NGX_OK;
+			ctx->state = STATE_PREFETCH_METADATA;
 		}
+		return rc;
+	}
 
-		// get a buffer to read into
-		read_cache_get_read_buffer(
-			&ctx->read_cache_state,
-			&read_buf);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_READ_FILE);
 
-		cache_buffer_size = ctx->submodule_context.conf->cache_buffer_size;
+	return NGX_OK;
+}
 
-		ctx->read_buffer.start = read_buf.buffer;
-		if (read_buf.buffer != NULL)
-		{
-			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
-		}
+static void
+ngx_http_vod_prefetch_metadata_completed(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_metadata_prefetch_t* cur_read;
+	ngx_http_vod_metadata_prefetch_t* reads_end;
 
-		rc = ngx_http_vod_alloc_read_buffer(ctx, cache_buffer_size + read_buf.source->alloc_extra_size, read_buf.source->alignment);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
-		
-		// perform the read
-		ngx_perf_counter_start(ctx->perf_counter_context);
+	reads_end = ctx->metadata_prefetch + ctx->metadata_prefetch_count;
+	for (cur_read = ctx->metadata_prefetch; cur_read < reads_end; cur_read++)
+	{
+		ngx_http_vod_update_bytes_read(ctx, cur_read->buf.last - cur_read->buf.pos);
+	}
+}
 
-		rc = read_buf.source->reader->read(
-			read_buf.source->reader_context, 
-			&ctx->read_buffer, 
-			read_buf.size, 
-			read_buf.offset);
-		if (rc != NGX_OK)
+// uses the prefetched initial read of the source, if there is one. returns FALSE if the source was not prefetched
+static ngx_flag_t
+ngx_http_vod_get_prefetched_metadata(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_http_vod_metadata_prefetch_t* cur_read;
+	ngx_http_vod_metadata_prefetch_t* reads_end;
+
+	reads_end = ctx->metadata_prefetch + ctx->metadata_prefetch_count;
+	for (cur_read = ctx->metadata_prefetch; cur_read < reads_end; cur_read++)
+	{
+		if (cur_read->source != source)
 		{
-			if (rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_process_media_frames: async_read failed %i", rc);
-			}
-			return rc;
+			continue;
 		}
 
-		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+		cur_read->source = NULL;
 
-		// read completed synchronously, update the read cache
-		read_cache_read_completed(&ctx->read_cache_state, &ctx->read_buffer);
+		ctx->read_buffer = cur_read->buf;
+		ctx->read_offset = 0;
+		ctx->read_size = cur_read->read_size;
+		ctx->requested_offset = 0;
+		ctx->read_flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+
+		ctx->metadata_reader_context = NULL;
+		ctx->metadata_read_hint = cur_read->read_hint;
+		ctx->metadata_read_count = 0;
+		ctx->metadata_last_read.offset = 0;
+		ctx->metadata_last_read.size = cur_read->read_size;
+		return TRUE;
 	}
+
+	return FALSE;
 }
 
 static ngx_int_t
-ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	multipart_cache_header_t multipart_header;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t* r = ctx->submodule_context.r;
 	ngx_int_t rc;
+	ngx_str_t* cache_parts;
+	ngx_str_t sidecar_metadata;
+	ngx_int_t store_rc;
+	ngx_uint_t cache_state;
+	uint32_t cache_token;
+	bool_t metadata_loaded;
+	size_t read_size;
 
-	rc = ctx->segment_writer.write_tail(ctx->segment_writer.context, NULL, 0);
-	if (rc != VOD_OK)
+	if (ctx->cur_source == NULL)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_finalize_segment_response: write_tail failed %i", rc);
-		return ngx_http_vod_status_to_ngx_error(r, rc);
+		return NGX_OK;
 	}
 
-	// if we already sent the headers and all the buffers, just signal completion and return
-	if (r->header_sent)
+#if (NGX_THREADS)
+	// without a metadata cache, all the files are opened anyway
+	if (ctx->metadata_cache == NULL && 
+		ctx->state == STATE_READ_METADATA_INITIAL &&
+		ngx_http_vod_parallel_open_enabled(ctx))
 	{
-		if (ctx->write_segment_buffer_context.total_size != ctx->content_length &&
-			(ctx->size_limit == 0 || ctx->write_segment_buffer_context.total_size < ctx->size_limit))
-		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_finalize_segment_response: actual content length %uz is different than reported length %uz",
-				ctx->write_segment_buffer_context.total_size, ctx->content_length);
-		}
-
-		rc = ngx_http_send_special(r, NGX_HTTP_LAST);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
+		rc = ngx_http_vod_open_files_parallel(ctx);
+		if (rc != NGX_OK)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_finalize_segment_response: ngx_http_send_special failed %i", rc);
 			return rc;
 		}
-		return NGX_OK;
 	}
+#endif // NGX_THREADS
 
-	// mark the current buffer as last
-	if (ctx->write_segment_buffer_context.chain_end->buf == NULL)
+	for (;;)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_finalize_segment_response: no buffers were written");
-		return ngx_http_vod_status_to_ngx_error(r, VOD_UNEXPECTED);
-	}
+		switch (ctx->state)
+		{
+		case STATE_READ_METADATA_INITIAL:
+			metadata_loaded = FALSE;
+			cache_token = 0;
+			cache_state = BUFFER_CACHE_FETCH_FRESH;
+			cur_source = ctx->cur_source;
+			ctx->metadata_resumed = 0;
+			ctx->metadata_partial = 0;
 
-	ctx->write_segment_buffer_context.chain_end->next = NULL;
-	ctx->write_segment_buffer_context.chain_end->buf->last_buf = 1;
+			if (ngx_http_vod_mapped_media_info_usable(ctx, cur_source))
+			{
+				// the mapping supplied the media info, no need to read the file
+				rc = ngx_http_vod_parse_metadata(ctx, 0);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				ctx->cur_source = cur_source->next;
+				if (ctx->cur_source == NULL)
+				{
+					return NGX_OK;
+				}
+				break;
+			}
+
+			if (cur_source->mapped_uri.len == empty_file_string.len &&
+				ngx_strncasecmp(cur_source->mapped_uri.data, empty_file_string.data, empty_file_string.len) == 0)
+			{
+				// the string "empty" identifies an empty srt file
+				ctx->metadata_parts = ngx_palloc(ctx->submodule_context.request_context.pool,
+					sizeof(*ctx->metadata_parts) + 1);
+				if (ctx->metadata_parts == NULL)
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: ngx_palloc failed");
+					return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+				}
+
+				ctx->metadata_parts[0].len = 0;
+				ctx->metadata_parts[0].data = (void*)(ctx->metadata_parts + 1);
+				ctx->metadata_parts[0].data[0] = '\0';
+				multipart_header.type = FORMAT_ID_WEBVTT;
+				metadata_loaded = TRUE;
+			}
+			else if (ctx->metadata_remote_buffer.len != 0)
+			{
+				// got the metadata from the remote cache, save it locally
+				if (ngx_buffer_cache_parse_multipart(
+					ctx,
+					&ctx->metadata_remote_buffer,
+					&multipart_header,
+					&ctx->metadata_parts))
+				{
+					ngx_http_vod_metadata_cache_store_buffer(ctx, cur_source, &ctx->metadata_remote_buffer);
+					metadata_loaded = TRUE;
+				}
+
+				ctx->metadata_remote_buffer.len = 0;
+				ngx_http_vod_metadata_read_done(ctx);
+			}
+			else if (ctx->sidecar_index_buffer.len != 0)
+			{
+				// got the metadata from the sidecar index of the file, save it locally
+				if (ngx_http_vod_sidecar_index_parse(ctx, &ctx->sidecar_index_buffer, &sidecar_metadata) &&
+					ngx_buffer_cache_parse_multipart(
+						ctx,
+						&sidecar_metadata,
+						&multipart_header,
+						&ctx->metadata_parts))
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: loaded metadata from sidecar index");
+					ngx_http_vod_metadata_cache_store_buffer(ctx, cur_source, &sidecar_metadata);
+					metadata_loaded = TRUE;
+				}
+
+				ctx->sidecar_index_buffer.len = 0;
+				ngx_http_vod_metadata_read_done(ctx);
+			}
+			else if (ctx->metadata_disk_buffer.len != 0)
+			{
+				// got the metadata from the disk cache, save it back to the memory cache
+				if (ngx_buffer_cache_parse_multipart(
+					ctx,
+					&ctx->metadata_disk_buffer,
+					&multipart_header,
+					&ctx->metadata_parts))
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: disk cache hit");
+					ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_METADATA, 1);
+
+					ngx_buffer_cache_store_perf(
+						ctx->perf_counters,
+						ctx->metadata_cache,
+						cur_source->file_key,
+						ctx->cache_tag,
+						ctx->metadata_disk_buffer.data,
+						ctx->metadata_disk_buffer.len);
+					metadata_loaded = TRUE;
+				}
+
+				ctx->metadata_disk_buffer.len = 0;
+			}
+			else if (ctx->metadata_cache != NULL)
+			{
+				// try to fetch from cache
+				if (ngx_buffer_cache_fetch_multipart_perf(
+					ctx,
+					ctx->metadata_cache,
+					cur_source->file_key,
+					&multipart_header,
+					&ctx->metadata_parts,
+					&cache_token,
+					conf->metadata_cache_incremental ? &cache_state : NULL))
+				{
+					if (cache_state != BUFFER_CACHE_FETCH_STALE_REFRESH)
+					{
+						ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+							"ngx_http_vod_state_machine_parse_metadata: metadata cache hit");
+						ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_METADATA, 1);
+						metadata_loaded = TRUE;
+					}
+					else
+					{
+						// expired - read only the data that was appended to the file
+						ctx->metadata_resumed = ngx_http_vod_resume_metadata_read(
+							ctx,
+							&multipart_header,
+							cache_token) == NGX_OK;
+					}
+				}
+				else if (conf->metadata_cache_disk_path.len != 0 &&
+					ctx->metadata_disk_fetched_source != cur_source)
+				{
+					// try the disk cache, the state is executed again once the file is read
+					rc = ngx_http_vod_disk_metadata_fetch(ctx, cur_source);
+					if (rc != NGX_OK)
+					{
+						return rc;
+					}
+					continue;
+				}
+				else
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: metadata cache miss");
+					ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_METADATA, 0);
+				}
+			}
+
+			if (metadata_loaded)
+			{
+				// parse the metadata
+				rc = ngx_http_vod_init_format(ctx, multipart_header.type);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				ctx->metadata_part_count = multipart_header.part_count;
+				ctx->metadata_cache_token = cache_token;
+				ctx->state = STATE_READ_METADATA_PARSE_CACHED;
+				break;
+			}
+			else if (ctx->metadata_resumed)
+			{
+				ctx->state = STATE_READ_METADATA_RESUME;
+			}
+			else
+			{
+				if (conf->coalesce_metadata_reads && ctx->metadata_cache != NULL)
+				{
+					rc = ngx_http_vod_metadata_read_start(ctx, cur_source);
+					if (rc != NGX_OK)
+					{
+						return rc;
+					}
+				}
+
+				if (conf->sidecar_index_location.len != 0 &&
+					ctx->sidecar_index_fetched_source != cur_source)
+				{
+					// try to fetch the sidecar index of the file
+					return ngx_http_vod_sidecar_index_fetch(ctx, cur_source);
+				}
+
+				if (conf->metadata_cache_remote_location.len != 0 && 
+					ctx->metadata_cache != NULL &&
+					ctx->metadata_remote_fetched_source != cur_source)
+				{
+					// try to fetch from the remote cache
+					return ngx_http_vod_remote_metadata_fetch(ctx, cur_source);
+				}
+
+				ctx->state = STATE_READ_METADATA_OPEN_FILE;
+			}
+
+			// open the file
+			rc = ngx_http_vod_open_file(ctx, cur_source);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: open_file failed %i", rc);
+				}
+				return rc;
+			}
+			break;
+
+		case STATE_READ_METADATA_PARSE_CACHED:
+			cur_source = ctx->cur_source;
+
+			rc = ngx_http_vod_run_parse_metadata(ctx, 1);
+			if (rc == NGX_DONE)
+			{
+				return NGX_AGAIN;
+			}
+
+			if (ctx->metadata_cache_token && 
+				ctx->request != NULL)		// in case of progressive, the metadata parts are used in clipper_build_header
+			{
+				ngx_buffer_cache_release(
+					ctx->metadata_cache,
+					cur_source->file_key,
+					ctx->metadata_cache_token);
+			}
+
+			if (rc == NGX_OK)
+			{
+				ctx->state = STATE_READ_METADATA_INITIAL;
+
+				ctx->cur_source = cur_source->next;
+				if (ctx->cur_source == NULL)
+				{
+					return NGX_OK;
+				}
+				break;
+			}
+
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
+				return rc;
+			}
+
+			ctx->state = STATE_READ_FRAMES_OPEN_FILE;
+
+			// open the file
+			rc = ngx_http_vod_open_file(ctx, cur_source);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: open_file failed %i", rc);
+				}
+				return rc;
+			}
+			break;
+
+		case STATE_READ_METADATA_RESUME:
+			// continue the reading of the cached metadata
+			r->connection->log->action = "reading media header";
+			ctx->state = STATE_READ_METADATA_READ;
+			ctx->read_buffer.start = NULL;
+			ctx->read_size = 0;
+			ctx->metadata_read_count = 0;
+			ctx->metadata_read_hint.offset = 0;
+			ctx->metadata_read_hint.size = 0;
+
+			rc = ngx_http_vod_async_read(ctx, &ctx->metadata_resume_req);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+			break;
+
+		case STATE_READ_METADATA_OPEN_FILE:
+			cur_source = ctx->cur_source;
+
+			if (conf->parallel_metadata_reads && !ctx->metadata_prefetch_started)
+			{
+				rc = ngx_http_vod_prefetch_metadata(ctx);
+				if (rc != NGX_OK)
+				{
+					if (rc != NGX_AGAIN)
+					{
+						ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+							"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_prefetch_metadata failed %i", rc);
+					}
+					return rc;
+				}
+			}
+
+			if (ngx_http_vod_get_prefetched_metadata(ctx, cur_source))
+			{
+				// the file header was read in advance
+				r->connection->log->action = "reading media header";
+				ctx->state = STATE_READ_METADATA_READ;
+				break;
+			}
+
+			// allocate the initial read buffer
+			read_size = ngx_http_vod_get_initial_read_size(ctx);
+
+			rc = ngx_http_vod_alloc_read_buffer(ctx, read_size + cur_source->alloc_extra_size, cur_source->alignment);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// read the file header
+			r->connection->log->action = "reading media header";
+			ctx->state = STATE_READ_METADATA_READ;
+			ctx->metadata_reader_context = NULL;
+
+			ctx->read_offset = 0;
+			ctx->read_size = read_size;
+			ctx->requested_offset = 0;
+			ctx->read_flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+
+			ctx->metadata_last_read.offset = 0;
+			ctx->metadata_last_read.size = read_size;
+
+			ngx_perf_counter_start(ctx->perf_counter_context);
+			ngx_perf_counter_set_io(ctx->request_perf_counters, 0, read_size);
+
+			rc = cur_source->reader->read(cur_source->reader_context, &ctx->read_buffer, read_size, 0);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: async_read failed %i", rc);
+				}
+				return rc;
+			}
+
+			// read completed synchronously
+			ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+			ngx_http_vod_update_bytes_read(ctx, ctx->read_buffer.last - ctx->read_buffer.pos);
+			// fall through
+
+		case STATE_READ_METADATA_READ:
+			// read the metadata
+			rc = ngx_http_vod_read_metadata(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_read_metadata failed %i", rc);
+				}
+				return rc;
+			}
+
+			if (!ctx->metadata_resumed && !ctx->metadata_partial)
+			{
+				ngx_http_vod_metadata_hint_store(ctx);
+			}
+
+			ctx->state = STATE_READ_METADATA_PARSE;
+			// fall through
+
+		case STATE_READ_METADATA_PARSE:
+			// parse the metadata
+			rc = ngx_http_vod_run_parse_metadata(ctx, 0);
+			if (rc == NGX_DONE)
+			{
+				return NGX_AGAIN;
+			}
+
+			if (rc != NGX_OK && rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
+				return rc;
+			}
+
+			// save the metadata to cache
+			cur_source = ctx->cur_source;
+			store_rc = NGX_OK;
+
+			if (ctx->metadata_cache != NULL && !ctx->metadata_partial)
+			{
+				multipart_header.type = ctx->format->id;
+
+				cache_parts = ngx_http_vod_get_cache_metadata_parts(ctx, &multipart_header.part_count);
+
+				if (ngx_buffer_cache_store_multipart_perf(
+					ctx,
+					ctx->metadata_cache,
+					&conf->metadata_cache_disk_path,
+					cur_source->file_key,
+					&multipart_header,
+					cache_parts))
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: stored metadata in cache");
+				}
+				else
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: failed to store metadata in cache");
+				}
+
+				if (conf->metadata_cache_remote_location.len != 0)
+				{
+					store_rc = ngx_http_vod_remote_metadata_store(
+						ctx,
+						cur_source,
+						&multipart_header,
+						cache_parts);
+				}
+			}
+
+			ngx_http_vod_metadata_read_done(ctx);
+
+			if (ctx->request != NULL)
+			{
+				// no longer need the metadata buffers
+				if (ngx_pfree(ctx->submodule_context.r->pool, ctx->read_buffer.start) == NGX_OK)
+				{
+					vod_request_memory_release(&ctx->submodule_context.request_context,
+						ctx->read_buffer.end - ctx->read_buffer.start);
+				}
+				ctx->read_buffer.start = NULL;
+
+				if (ctx->metadata_reader_context != NULL && ctx->format->free_metadata_reader != NULL)
+				{
+					ctx->format->free_metadata_reader(ctx->metadata_reader_context);
+					ctx->metadata_reader_context = NULL;
+				}
+			}
+
+			if (rc == NGX_OK)
+			{
+				// move to the next source
+				ctx->state = STATE_READ_METADATA_INITIAL;
+
+				ctx->cur_source = cur_source->next;
+				if (store_rc != NGX_OK)
+				{
+					// wait for the remote cache store to complete
+					return store_rc;
+				}
+
+				if (ctx->cur_source == NULL)
+				{
+					return NGX_OK;
+				}
+				break;
+			}
+
+			if (store_rc != NGX_OK)
+			{
+				ctx->state = STATE_READ_FRAMES_OPEN_FILE;
+				return store_rc;
+			}
+			// fall through
+
+		case STATE_PREFETCH_METADATA:
+			if (ctx->prefetch_join.rc != NGX_OK)
+			{
+				return ctx->prefetch_join.rc;
+			}
+
+			ngx_http_vod_prefetch_metadata_completed(ctx);
+			ctx->state = STATE_READ_METADATA_OPEN_FILE;
+			break;
+
+		case STATE_READ_FRAMES_OPEN_FILE:
+			ctx->state = STATE_READ_FRAMES_READ;
+			ctx->read_buffer.start = NULL;			// don't reuse buffers from the metadata phase
+			ctx->read_size = 0;
+
+			rc = ngx_http_vod_async_read(ctx, &ctx->frames_read_req);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+			// fall through
+
+		case STATE_READ_FRAMES_READ:
+			rc = ngx_http_vod_read_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// move to the next source
+			ctx->state = STATE_READ_METADATA_INITIAL;
+
+			ctx->cur_source = ctx->cur_source->next;
+			if (ctx->cur_source == NULL)
+			{
+				return NGX_OK;
+			}
+			break;
+
+		default:
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_state_machine_parse_metadata: invalid state %d", ctx->state);
+			return ngx_http_vod_status_to_ngx_error(r, VOD_UNEXPECTED);
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_validate_streams(ngx_http_vod_ctx_t *ctx)
+{
+	if (ctx->submodule_context.media_set.total_track_count == 0)
+	{
+		if (ctx->request->request_class == REQUEST_CLASS_SEGMENT)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: no matching streams were found, probably invalid segment index");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_NO_STREAMS);
+		}
+		else
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: no matching streams were found");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+	}
+	
+	if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
+	{
+		if (ctx->submodule_context.media_set.sequence_count != 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: request has more than one sequence while only one is supported");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+
+		if (ctx->submodule_context.media_set.total_track_count != 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: got %uD streams while only a single stream is supported",
+				ctx->submodule_context.media_set.total_track_count);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+	}
+	else if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
+	{
+		if (ctx->submodule_context.media_set.sequence_count != 1 && ctx->submodule_context.media_set.sequence_count != 2)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: invalid sequence count %uD", ctx->submodule_context.media_set.sequence_count);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+
+		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO] > 1 ||
+			ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO] > 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: one stream at most per media type is allowed video=%uD audio=%uD",
+				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO],
+				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO]);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+
+		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_SUBTITLE] > 0 &&
+			ctx->submodule_context.media_set.total_track_count != 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: cannot have more than a single subtitle track and it cannot be mixed with other track types");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+	}
+	
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_update_track_timescale(
+	ngx_http_vod_ctx_t *ctx, 
+	media_track_t* track, 
+	uint32_t new_timescale, 
+	uint32_t pts_delay)
+{
+	frame_list_part_t* part;
+	input_frame_t* last_frame;
+	input_frame_t* cur_frame;
+	uint64_t next_scaled_dts;
+	uint64_t last_frame_dts;
+	uint64_t clip_start_dts;
+	uint64_t clip_end_pts;
+	uint64_t clip_end_dts;
+	uint64_t scaled_dts;
+	uint64_t scaled_pts;
+	uint64_t dts;
+	uint64_t pts;
+	uint32_t cur_timescale = track->media_info.timescale;
+
+	// frames
+	dts = track->first_frame_time_offset;
+	scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
+	clip_start_dts = scaled_dts;
+
+	track->first_frame_time_offset = scaled_dts;
+
+	if (track->compact_frames.first_run != NULL)
+	{
+		// Note: the duration runs remain in the original timescale, the segmenter rescales
+		//		the accumulated durations in the same way the frame durations are rescaled below
+		track->total_frames_duration = rescale_time(dts + track->total_frames_duration, cur_timescale, new_timescale) -
+			scaled_dts;
+		goto media_info;
+	}
+
+	if (cur_timescale == new_timescale && pts_delay == 0)
+	{
+		// the frames are already in the new timescale (e.g. converted by the parser), the pass
+		//		over the frames is required only when the clip end of some part has to be applied
+		for (part = &track->frames; part != NULL; part = part->next)
+		{
+			if (part->clip_to != UINT_MAX)
+			{
+				break;
+			}
+		}
+
+		if (part == NULL)
+		{
+			goto media_info;
+		}
+	}
+
+	track->total_frames_duration = 0;
+
+	// initialize the first part
+	part = &track->frames;
+	cur_frame = part->first_frame;
+	last_frame = part->last_frame;
+	if (part->clip_to != UINT_MAX && cur_frame < last_frame)
+	{
+		clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
+		if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
+		{
+			clip_end_pts = clip_end_dts + rescale_time(track->media_info.u.video.initial_pts_delay,
+				cur_timescale, new_timescale);
+		}
+		else
+		{
+			clip_end_pts = ULLONG_MAX;
+		}
+	}
+	else
+	{
+		clip_end_dts = ULLONG_MAX;
+		clip_end_pts = ULLONG_MAX;
+	}
+
+	for (;; cur_frame++)
+	{
+		if (cur_frame >= last_frame)
+		{
+			if (clip_end_dts != ULLONG_MAX)
+			{
+				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
+				last_frame_dts = scaled_dts - cur_frame[-1].duration;
+
+				if (clip_end_dts > last_frame_dts)
+				{
+					cur_frame[-1].duration = clip_end_dts - last_frame_dts;
+					scaled_dts = clip_end_dts;
+				}
+				else
+				{
+					ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_update_track_timescale: last frame dts %uL greater than clip end dts %uL",
+						last_frame_dts, clip_end_dts);
+				}
+
+				track->total_frames_duration += scaled_dts - clip_start_dts;
+
+				dts = 0;
+				scaled_dts = 0;
+				clip_start_dts = 0;
+			}
+
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			// initialize the next part
+			part = part->next;
+			cur_frame = part->first_frame;
+			last_frame = part->last_frame;
+			if (part->clip_to != UINT_MAX && cur_frame < last_frame)
+			{
+				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
+				if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
+				{
+					clip_end_pts = clip_end_dts + rescale_time(track->media_info.u.video.initial_pts_delay,
+						cur_timescale, new_timescale);
+				}
+			}
+			else
+			{
+				clip_end_dts = ULLONG_MAX;
+				clip_end_pts = ULLONG_MAX;
+			}
+		}
+
+		// get the pts delay
+		pts = dts + cur_frame->pts_delay;
+		scaled_pts = rescale_time(pts, cur_timescale, new_timescale);
+		if (scaled_pts > clip_end_pts)
+		{
+			scaled_pts = ngx_max(clip_end_pts, scaled_dts);
+		}
+		cur_frame->pts_delay = scaled_pts - scaled_dts + pts_delay;
+
+		// get the duration
+		dts += cur_frame->duration;
+		next_scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
+		cur_frame->duration = next_scaled_dts - scaled_dts;
+		scaled_dts = next_scaled_dts;
+	}
+
+	track->total_frames_duration += scaled_dts - clip_start_dts;
+
+media_info:
+
+	track->clip_from_frame_offset = rescale_time(track->clip_from_frame_offset, cur_timescale, new_timescale);
+
+	// media info
+	track->media_info.duration = rescale_time(track->media_info.duration, cur_timescale, new_timescale);
+	track->media_info.full_duration = rescale_time(track->media_info.full_duration, cur_timescale, new_timescale);
+	if (track->media_info.full_duration == 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_update_track_timescale: full duration is zero following rescale");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
+	}
+
+	if (track->media_info.media_type == MEDIA_TYPE_VIDEO)
+	{
+		if (track->media_info.min_frame_duration != 0)
+		{
+			track->media_info.min_frame_duration =
+				rescale_time(track->media_info.min_frame_duration, cur_timescale, new_timescale);
+			if (track->media_info.min_frame_duration == 0)
+			{
+				ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_update_track_timescale: min frame duration is zero following rescale");
+				track->media_info.min_frame_duration = 1;
+			}
+		}
+
+		track->media_info.u.video.initial_pts_delay =
+			rescale_time(track->media_info.u.video.initial_pts_delay, cur_timescale, new_timescale);
+	}
+
+	track->media_info.timescale = new_timescale;
+	track->media_info.frames_timescale = new_timescale;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_update_timescale(ngx_http_vod_ctx_t *ctx)
+{
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	media_track_t* track;
+	ngx_int_t rc;
+
+	for (track = media_set->filtered_tracks; track < media_set->filtered_tracks_end; track++)
+	{
+		rc = ngx_http_vod_update_track_timescale(
+			ctx, 
+			track, 
+			ctx->request->timescale, 
+			ctx->submodule_context.request_params.pts_delay);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+////// Metadata request handling
+
+static void
+ngx_http_vod_get_segment_durations_cache_key(
+	segmenter_conf_t* conf,
+	media_set_t* media_set,
+	media_sequence_t* sequence,
+	uint32_t media_type,
+	u_char* key)
+{
+	media_clip_source_t* source;
+	media_sequence_t* sequences_end;
+	media_sequence_t* cur_sequence;
+	media_track_t* last_track;
+	media_track_t* cur_track;
+	ngx_uint_t segment_count_mode;
+	ngx_md5_t md5;
+
+	if (conf->get_segment_count == segmenter_get_segment_count_last_short)
+	{
+		segment_count_mode = 0;
+	}
+	else if (conf->get_segment_count == segmenter_get_segment_count_last_long)
+	{
+		segment_count_mode = 1;
+	}
+	else
+	{
+		segment_count_mode = 2;
+	}
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, &conf->segment_duration, sizeof(conf->segment_duration));
+	ngx_md5_update(&md5, &conf->align_to_key_frames, sizeof(conf->align_to_key_frames));
+	ngx_md5_update(&md5, &conf->manifest_duration_policy, sizeof(conf->manifest_duration_policy));
+	ngx_md5_update(&md5, &segment_count_mode, sizeof(segment_count_mode));
+	if (conf->bootstrap_segments_count > 0)
+	{
+		ngx_md5_update(&md5, conf->bootstrap_segments_durations,
+			conf->bootstrap_segments_count * sizeof(conf->bootstrap_segments_durations[0]));
+	}
+	ngx_md5_update(&md5, &media_type, sizeof(media_type));
+	ngx_md5_update(&md5, &media_set->audio_filtering_needed, sizeof(media_set->audio_filtering_needed));
+
+	// the tracks that participate in the calculation
+	if (sequence != NULL)
+	{
+		cur_sequence = sequence;
+		sequences_end = sequence + 1;
+	}
+	else
+	{
+		cur_sequence = media_set->sequences;
+		sequences_end = media_set->sequences_end;
+	}
+
+	for (; cur_sequence < sequences_end; cur_sequence++)
+	{
+		last_track = cur_sequence->filtered_clips[0].last_track;
+		for (cur_track = cur_sequence->filtered_clips[0].first_track; cur_track < last_track; cur_track++)
+		{
+			if (media_type != MEDIA_TYPE_NONE && cur_track->media_info.media_type != media_type)
+			{
+				continue;
+			}
+
+			source = cur_track->file_info.source;
+			if (source != NULL)
+			{
+				ngx_md5_update(&md5, source->file_key, sizeof(source->file_key));
+				ngx_md5_update(&md5, &source->clip_from, sizeof(source->clip_from));
+				ngx_md5_update(&md5, &source->clip_to, sizeof(source->clip_to));
+			}
+
+			ngx_md5_update(&md5, &cur_track->media_info.media_type, sizeof(cur_track->media_info.media_type));
+			ngx_md5_update(&md5, &cur_track->media_info.track_id, sizeof(cur_track->media_info.track_id));
+			ngx_md5_update(&md5, &cur_track->media_info.timescale, sizeof(cur_track->media_info.timescale));
+		}
+	}
+
+	ngx_md5_final(key, &md5);
+}
+
+static vod_status_t
+ngx_http_vod_get_segment_durations_cached(
+	request_context_t* request_context,
+	segmenter_conf_t* conf,
+	media_set_t* media_set,
+	media_sequence_t* sequence,
+	uint32_t media_type,
+	segment_durations_t* result)
+{
+	ngx_http_vod_segmenter_conf_t* vod_conf = (ngx_http_vod_segmenter_conf_t*)conf;
+	ngx_buffer_cache_t* cache = vod_conf->cache;
+	segment_duration_item_t* items;
+	ngx_str_t cache_buffers[2];
+	ngx_str_t cache_buffer;
+	vod_status_t rc;
+	uint32_t token;
+	size_t items_size;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	ngx_http_vod_get_segment_durations_cache_key(conf, media_set, sequence, media_type, key);
+
+	if (ngx_buffer_cache_fetch(cache, key, &cache_buffer, &token))
+	{
+		items = NULL;
+		if (cache_buffer.len >= sizeof(*result))
+		{
+			ngx_memcpy(result, cache_buffer.data, sizeof(*result));
+			items_size = cache_buffer.len - sizeof(*result);
+
+			if (items_size == result->item_count * sizeof(result->items[0]) &&
+				items_size > 0)
+			{
+				items = ngx_palloc(request_context->pool, items_size);
+				if (items != NULL)
+				{
+					ngx_memcpy(items, cache_buffer.data + sizeof(*result), items_size);
+				}
+			}
+		}
+
+		ngx_buffer_cache_release(cache, key, token);
+
+		if (items != NULL)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_get_segment_durations_cached: cache hit, item count %uD", result->item_count);
+			result->items = items;
+			return VOD_OK;
+		}
+	}
+
+	rc = vod_conf->get_segment_durations(
+		request_context,
+		conf,
+		media_set,
+		sequence,
+		media_type,
+		result);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	cache_buffers[0].data = (u_char*)result;
+	cache_buffers[0].len = sizeof(*result);
+	cache_buffers[1].data = (u_char*)result->items;
+	cache_buffers[1].len = result->item_count * sizeof(result->items[0]);
+
+	if (ngx_buffer_cache_store_gather(cache, key, cache_buffers, 2))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_get_segment_durations_cached: stored in segment durations cache");
+	}
+
+	return VOD_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_init_segment_durations_cache(ngx_http_vod_ctx_t *ctx, ngx_buffer_cache_t* cache)
+{
+	ngx_http_vod_segmenter_conf_t* vod_conf;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+
+	// Note: the segmenter conf may have been replaced by the mapping response, so it is wrapped per request
+	vod_conf = ngx_palloc(ctx->submodule_context.r->pool, sizeof(*vod_conf));
+	if (vod_conf == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_init_segment_durations_cache: ngx_palloc failed");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+	}
+
+	vod_conf->base = *media_set->segmenter_conf;
+	vod_conf->get_segment_durations = vod_conf->base.get_segment_durations;
+	vod_conf->cache = cache;
+	vod_conf->base.get_segment_durations = ngx_http_vod_get_segment_durations_cached;
+	media_set->segmenter_conf = &vod_conf->base;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	response_cache_header_t cache_header;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t cache_buffers[4];
+	ngx_str_t content_type;
+	ngx_str_t response = ngx_null_string;
+	ngx_str_t gzip_response = ngx_null_string;
+	ngx_int_t rc;
+	int cache_type;
+
+	rc = ngx_http_vod_update_timescale(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+	
+	if(conf->force_sequence_index)
+	{
+		ctx->submodule_context.media_set.has_multi_sequences = TRUE;
+	}
+
+	if (conf->segment_durations_cache != NULL &&
+		ctx->submodule_context.media_set.type == MEDIA_SET_VOD &&
+		ctx->submodule_context.media_set.timing.durations == NULL &&
+		ctx->submodule_context.media_set.segmenter_conf->get_segment_durations == segmenter_get_segment_durations_accurate)
+	{
+		rc = ngx_http_vod_init_segment_durations_cache(ctx, conf->segment_durations_cache);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+	
+	rc = ctx->request->handle_metadata_request(
+		&ctx->submodule_context,
+		&response,
+		&content_type);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
+		return rc;
+	}
+
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+
+	if (ctx->submodule_context.media_set.original_type != MEDIA_SET_LIVE ||
+		(ctx->request->flags & REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE) == 0)
+	{
+		cache_type = CACHE_TYPE_VOD;
+	}
+	else
+	{
+		cache_type = CACHE_TYPE_LIVE;
+	}
+
+	if ((ctx->request->flags & REQUEST_FLAG_MASTER_MANIFEST) != 0 && conf->master_cache != NULL)
+	{
+		cache = conf->master_cache;
+	}
+	else
+	{
+		cache = conf->response_cache[cache_type];
+	}
+
+	if (cache != NULL && response.data != NULL)
+	{
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+		// store the gzip encoded response alongside the response, so that hits do not compress it again
+		if (conf->response_cache_gzip &&
+			ngx_http_vod_gzip_response(ctx->submodule_context.r, &response, &gzip_response) != NGX_OK)
+		{
+			gzip_response.len = 0;
+		}
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
+
+		cache_header.content_type_len = content_type.len;
+		cache_header.gzip_len = gzip_response.len;
+		cache_header.media_set_type = ctx->submodule_context.media_set.type;
+		cache_buffers[0].data = (u_char*)&cache_header;
+		cache_buffers[0].len = sizeof(cache_header);
+		cache_buffers[1] = content_type;
+		cache_buffers[2] = response;
+		cache_buffers[3] = gzip_response;
+
+		if (ngx_buffer_cache_store_gather_perf(ctx->perf_counters, cache, ctx->request_key, ctx->cache_tag, cache_buffers, 
+			gzip_response.len > 0 ? 4 : 3))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_metadata_request: stored in response cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_metadata_request: failed to store response in cache");
+		}
+	}
+
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+	if (gzip_response.len > 0)
+	{
+		rc = ngx_http_vod_set_gzip_encoding(ctx->submodule_context.r);
+		if (rc == NGX_OK)
+		{
+			response = gzip_response;
+		}
+		else if (rc != NGX_DECLINED)
+		{
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
+
+	rc = ngx_http_vod_send_header(
+		ctx->submodule_context.r, 
+		response.len, 
+		&content_type, 
+		ctx->submodule_context.media_set.type, 
+		ctx->request);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+	
+	return ngx_http_vod_send_response(ctx->submodule_context.r, &response, NULL);
+}
+
+////// Segment request handling
+
+static ngx_int_t
+ngx_http_vod_state_machine_open_files(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	ngx_int_t rc;
+
+#if (NGX_THREADS)
+	if (ngx_http_vod_parallel_open_enabled(ctx))
+	{
+		rc = ngx_http_vod_open_files_parallel(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		ctx->cur_source = NULL;
+		return NGX_OK;
+	}
+#endif // NGX_THREADS
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		// open the file if not already opened
+		if (cur_source->reader_context != NULL)
+		{
+			continue;
+		}
+
+		rc = ngx_http_vod_open_file(ctx, cur_source);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_state_machine_open_files: open_file failed %i", rc);
+			}
+
+			ctx->cur_source = cur_source;
+			return rc;
+		}
+	}
+
+	ctx->cur_source = NULL;
+	return NGX_OK;
+}
+
+static bool_t
+ngx_http_vod_is_file_passthrough_supported(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+
+	if (!ctx->submodule_context.conf->sendfile_frames)
+	{
+		return FALSE;
+	}
+
+	// the buffers must reference the files that were opened by the file reader
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader == NULL ||
+			cur_source->reader->read != (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// the popularity of a source is estimated by the number of recent fetches of its metadata from cache
+static ngx_uint_t
+ngx_http_vod_get_source_popularity(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_uint_t uses;
+
+	if (conf->hot_file_min_uses == 0)
+	{
+		return POPULARITY_UNKNOWN;
+	}
+
+	if (conf->popularity_zone != NULL)
+	{
+		uses = ngx_popularity_estimate(conf->popularity_zone, source->file_key);
+		return uses >= conf->hot_file_min_uses ? POPULARITY_HOT : POPULARITY_COLD;
+	}
+
+	if (ctx->metadata_cache == NULL ||
+		ngx_buffer_cache_get_uses(ctx->metadata_cache, source->file_key, &uses) != NGX_OK)
+	{
+		return POPULARITY_UNKNOWN;
+	}
+
+	return uses >= conf->hot_file_min_uses ? POPULARITY_HOT : POPULARITY_COLD;
+}
+
+static void
+ngx_http_vod_enable_directio(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	media_clip_source_t* cur_source;
+	bool_t passthrough;
+
+	// directio makes nginx read file buffers into memory, instead of using sendfile
+	passthrough = ngx_http_vod_is_file_passthrough_supported(ctx);
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader->read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+		{
+			// the reads that were performed so far are metadata reads
+			ngx_file_reader_reset_read_range(cur_source->reader_context);
+
+			// the frames of mapped files are read from the page cache without copying them,
+			//	cold files are not mapped, since reading them would block the worker on page faults
+			if (conf->mmap_frames && !passthrough &&
+				ngx_http_vod_get_source_popularity(ctx, cur_source) != POPULARITY_COLD &&
+				ngx_file_reader_enable_mmap(cur_source->reader_context, VOD_BUFFER_PADDING_SIZE) == NGX_OK)
+			{
+				continue;
+			}
+		}
+
+		if (passthrough || cur_source->reader->enable_directio == NULL)
+		{
+			continue;
+		}
+
+		// hot files are kept in the page cache
+		if (ngx_http_vod_get_source_popularity(ctx, cur_source) == POPULARITY_HOT)
+		{
+			continue;
+		}
+
+		cur_source->reader->enable_directio(cur_source->reader_context);
+	}
+}
+
+static void
+ngx_http_vod_advise_page_cache(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_file_reader_state_t* state;
+	media_clip_source_t* cur_source;
+	off_t size;
+
+	if (!ctx->submodule_context.conf->fadvise)
+	{
+		return;
+	}
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader == NULL ||
+			cur_source->reader->read != (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+		{
+			continue;
+		}
+
+		state = cur_source->reader_context;
+		if (state->read_end <= state->read_start || state->file.directio)
+		{
+			continue;
+		}
+
+		size = state->read_end - state->read_start;
+
+		if (ngx_http_vod_get_source_popularity(ctx, cur_source) == POPULARITY_COLD)
+		{
+			// long tail read, drop it so that it won't evict the data of popular files
+			ngx_file_reader_advise(state, state->read_start, size, 0);
+		}
+		else
+		{
+			// the next segment is expected to follow the range that was read by this one
+			ngx_file_reader_advise(state, state->read_end, size, 1);
+		}
+	}
+}
+
+static vod_status_t
+ngx_http_vod_write_segment_header_buffer(void* ctx, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	ngx_chain_t *chain_head;
+	ngx_chain_t *chain;
+	ngx_buf_t *b;
+
+	if (context->r->header_sent)
+	{
+		ngx_log_error(NGX_LOG_ERR, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: called after the headers were already sent");
+		return VOD_UNEXPECTED;
+	}
+
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->pos = buffer;
+	b->last = buffer + size;
+	b->temporary = 1;
+
+	chain = ngx_alloc_chain_link(context->r->pool);
+	if (chain == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: ngx_alloc_chain_link failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	chain_head = context->chain_head;
+
+	chain->buf = chain_head->buf;
+	chain->next = chain_head->next;
+
+	chain_head->buf = b;
+	chain_head->next = chain;
+
+	if (chain_head == context->chain_end)
+	{
+		context->chain_end = chain;
+	}
+
+	context->total_size += size;
+
+	return VOD_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_flush_segment_output(ngx_http_vod_write_segment_context_t* context)
+{
+	ngx_chain_t* pending;
+	ngx_int_t rc;
+
+	if (context->pending == NULL)
+	{
+		return NGX_OK;
+	}
+
+	pending = context->pending;
+	context->pending = NULL;
+	context->pending_last = &context->pending;
+	context->pending_size = 0;
+
+	// send the header buffers and the file ranges as a single chain
+	rc = ngx_http_output_filter(context->r, pending);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_flush_segment_output: ngx_http_output_filter failed %i", rc);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static vod_status_t
+ngx_http_vod_write_segment_buf(ngx_http_vod_write_segment_context_t* context, ngx_buf_t* b, uint32_t size)
+{
+	ngx_chain_t *chain;
+	ngx_chain_t out;
+	ngx_int_t rc;
+
+	if (context->discard_output)
+	{
+		context->total_size += size;
+		return VOD_OK;
+	}
+
+	if (context->r->header_sent && context->defer_output)
+	{
+		// headers already sent, add the buffer to the pending chain, the chain is sent when the frame processor returns,
+		// or when it reaches the output chunk size
+		chain = ngx_alloc_chain_link(context->r->pool);
+		if (chain == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+				"ngx_http_vod_write_segment_buf: ngx_alloc_chain_link failed (1)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		chain->buf = b;
+		chain->next = NULL;
+
+		*context->pending_last = chain;
+		context->pending_last = &chain->next;
+		context->pending_size += size;
+	}
+	else if (context->r->header_sent)
+	{
+		// headers already sent, output the chunk
+		out.buf = b;
+		out.next = NULL;
+
+		rc = ngx_http_output_filter(context->r, &out);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			// either the connection dropped, or some allocation failed
+			// in case the connection dropped, the error code doesn't matter anyway
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+				"ngx_http_vod_write_segment_buf: ngx_http_output_filter failed %i", rc);
+			return VOD_ALLOC_FAILED;
+		}
+	}
+	else
+	{
+		// headers not sent yet, add the buffer to the chain
+		if (context->chain_end->buf != NULL)
+		{
+			chain = ngx_alloc_chain_link(context->r->pool);
+			if (chain == NULL) 
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+					"ngx_http_vod_write_segment_buf: ngx_alloc_chain_link failed (2)");
+				return VOD_ALLOC_FAILED;
+			}
+
+			context->chain_end->next = chain;
+			context->chain_end = chain;
+		}
+		context->chain_end->buf = b;
+	}
+
+	context->total_size += size;
+
+	if (context->output_chunk_size != 0 && context->pending_size >= context->output_chunk_size &&
+		ngx_http_vod_flush_segment_output(context) != NGX_OK)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t 
+ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context;
+	ngx_buf_t *b;
+
+	if (size <= 0)
+	{
+		return VOD_OK;
+	}
+
+	context = (ngx_http_vod_write_segment_context_t*)ctx;
+	
+	// create a wrapping ngx_buf_t
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL) 
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->pos = buffer;
+	b->last = buffer + size;
+	b->temporary = 1;
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
+static vod_status_t
+ngx_http_vod_write_segment_file(void* ctx, void* source, uint64_t offset, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context;
+	ngx_file_reader_state_t* reader_state;
+	ngx_buf_t *b;
+
+	if (size <= 0)
+	{
+		return VOD_OK;
+	}
+
+	context = (ngx_http_vod_write_segment_context_t*)ctx;
+	reader_state = ((media_clip_source_t*)source)->reader_context;
+
+	// create a file ngx_buf_t, allowing nginx to send it using sendfile
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_file: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->in_file = 1;
+	b->file = &reader_state->file;
+	b->file_pos = offset;
+	b->file_last = offset + size;
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
+// returns whether the segment is built identically by all the protocols (single track fmp4 fragment)
+static ngx_flag_t
+ngx_http_vod_is_cmaf_segment(ngx_http_vod_ctx_t *ctx)
+{
+	return ctx->submodule_context.conf->cmaf_segments &&
+		(ctx->request->flags & REQUEST_FLAG_CMAF_FRAGMENT) != 0 &&
+		ctx->submodule_context.media_set.total_track_count == 1 &&
+		!ctx->submodule_context.media_set.audio_filtering_needed;
+}
+
+// returns the segment cache, if the segments of the request can be cached.
+// the segments are cached before they are encrypted, so only requests that encrypt the muxed segment are supported
+static ngx_buffer_cache_t*
+ngx_http_vod_get_segment_cache(ngx_http_vod_ctx_t *ctx)
+{
+	if ((ctx->request->init_segment_encryption == NULL && !ngx_http_vod_is_cmaf_segment(ctx)) ||
+		ctx->submodule_context.media_set.type != MEDIA_SET_VOD)
+	{
+		return NULL;
+	}
+
+	return ctx->submodule_context.conf->segment_cache;
+}
+
+static vod_status_t
+ngx_http_vod_segment_capture_write(void* context, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_segment_capture_t* capture = context;
+	ngx_str_t* cur_buffer;
+	u_char* p;
+
+	// Note: the buffer is copied before it is passed on, since the encryption may be performed in place
+	if (size > 0)
+	{
+		p = ngx_pnalloc(capture->r->pool, size);
+		if (p == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, capture->r->connection->log, 0,
+				"ngx_http_vod_segment_capture_write: ngx_pnalloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		cur_buffer = ngx_array_push(&capture->buffers);
+		if (cur_buffer == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, capture->r->connection->log, 0,
+				"ngx_http_vod_segment_capture_write: ngx_array_push failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		cur_buffer->data = p;
+		cur_buffer->len = size;
+		ngx_memcpy(p, buffer, size);
+	}
+
+	return capture->next.write_tail(capture->next.context, buffer, size);
+}
+
+// saves the segment as it is written, so that it can be stored in the segment cache / segment store.
+// the segment cache capture is installed after the encryption stage, so it saves the muxed segment before it is encrypted
+static ngx_int_t
+ngx_http_vod_segment_capture_init(ngx_http_vod_ctx_t *ctx, ngx_http_vod_segment_capture_t** result)
+{
+	ngx_http_vod_segment_capture_t* capture;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+
+	capture = ngx_palloc(r->pool, sizeof(*capture));
+	if (capture == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_capture_init: ngx_palloc failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
+
+	if (ngx_array_init(&capture->buffers, r->pool, 16, sizeof(ngx_str_t)) != NGX_OK ||
+		ngx_array_push_n(&capture->buffers, 2) == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_capture_init: ngx_array_init failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
+
+	capture->r = r;
+	capture->next = ctx->segment_writer;
+
+	ctx->segment_writer.write_tail = ngx_http_vod_segment_capture_write;
+	ctx->segment_writer.write_head = NULL;
+	ctx->segment_writer.write_file = NULL;
+	ctx->segment_writer.context = capture;
+
+	*result = capture;
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_segment_cache_store(ngx_http_vod_ctx_t *ctx)
+{
+	response_cache_header_t cache_header;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t* buffers;
+
+	cache = ngx_http_vod_get_segment_cache(ctx);
+	if (cache == NULL || ctx->segment_cache_key == NULL)
+	{
+		return;
+	}
+
+	// use the format of the response cache
+	cache_header.content_type_len = r->headers_out.content_type.len;
+	cache_header.gzip_len = 0;
+	cache_header.media_set_type = MEDIA_SET_VOD;
+
+	buffers = ctx->segment_capture->buffers.elts;
+	buffers[0].data = (u_char*)&cache_header;
+	buffers[0].len = sizeof(cache_header);
+	buffers[1] = r->headers_out.content_type;
+
+	if (ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters,
+		cache,
+		ctx->segment_cache_key,
+		ctx->cache_tag,
+		buffers,
+		ctx->segment_capture->buffers.nelts))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_cache_store: stored in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_cache_store: failed to store in cache");
+	}
+}
+
+// returns the segment store, if the segments of the location can be stored.
+// the store holds the segments as they were sent, and is checked before the encryption key is known (the key may
+// depend on the secret key / drm server response), so encrypted segments are never stored
+static ngx_segment_store_t*
+ngx_http_vod_get_segment_store(ngx_http_vod_loc_conf_t *conf)
+{
+	if (conf->drm_enabled || conf->secret_key != NULL)
+	{
+		return NULL;
+	}
+
+	return conf->segment_store;
+}
+
+// writes the segment that was sent to the segment store, the file is written on the thread pool of the store
+static void
+ngx_http_vod_segment_store_save(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	// Note: the first two buffers are reserved for the cache header and content type
+	rc = ngx_segment_store_save(
+		ctx->submodule_context.conf->segment_store,
+		r->connection->log,
+		ctx->request_key,
+		&r->headers_out.content_type,
+		(ngx_str_t*)ctx->segment_store_capture->buffers.elts + 2,
+		ctx->segment_store_capture->buffers.nelts - 2);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_store_save: ngx_segment_store_save failed %i", rc);
+	}
+}
+
+// sends a segment that was saved to the segment store by a previous request, using sendfile.
+// returns NGX_DECLINED if the segment is not in the store
+static ngx_int_t
+ngx_http_vod_segment_store_fetch(
+	ngx_http_request_t *r,
+	ngx_http_vod_loc_conf_t *conf,
+	const ngx_http_vod_request_t* request,
+	u_char* request_key)
+{
+	ngx_segment_store_entry_t entry;
+	ngx_chain_t out;
+	ngx_buf_t* b;
+	ngx_int_t rc;
+
+	rc = ngx_segment_store_open(conf->segment_store, r->pool, r->connection->log, request_key, &entry);
+	if (rc != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_segment_store_fetch: segment store hit, size is %O", entry.size);
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_store_fetch: ngx_calloc_buf failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
+
+	// update request flags
+	r->root_tested = !r->error_page;
+	r->allow_ranges = 1;
+
+	rc = ngx_http_vod_send_header(r, entry.size, &entry.content_type, MEDIA_SET_VOD, request);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_OK;
+	}
+
+	b->in_file = 1;
+	b->file = entry.file;
+	b->file_pos = entry.offset;
+	b->file_last = entry.offset + entry.size;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	rc = ngx_http_output_filter(r, &out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_store_fetch: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+
+	return NGX_OK;
+}
+
+// returns the segment frames cache, if the frames of the request can be cached.
+// the frames are cached before they are muxed, so the same entry is used by all the protocols / encryption schemes.
+// segments whose sources are all marked as resident in the mapping use the resident frames cache, so that 
+// the frames of shared clips (e.g. ad creatives) are not evicted by the long tail of the other content
+static ngx_buffer_cache_t*
+ngx_http_vod_get_segment_frames_cache(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	media_clip_source_t* cur_source;
+
+	if (ctx->request->request_class != REQUEST_CLASS_SEGMENT ||
+		ctx->submodule_context.media_set.type != MEDIA_SET_VOD ||
+		ctx->submodule_context.media_set.audio_filtering_needed)
+	{
+		return NULL;
+	}
+
+	if (conf->resident_frames_cache == NULL)
+	{
+		return conf->segment_frames_cache;
+	}
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		if (!cur_source->resident)
+		{
+			return conf->segment_frames_cache;
+		}
+	}
+
+	return conf->resident_frames_cache;
+}
+
+// calculates the key of the frames of the segment from the source file keys and the frame offsets.
+// returns NGX_DECLINED if some of the frames are not read directly from the source files (e.g. decrypted frames)
+static ngx_int_t
+ngx_http_vod_get_segment_frames_key(ngx_http_vod_ctx_t *ctx, size_t* total_size)
+{
+	ngx_http_vod_frames_key_part_t key_part;
+	media_clip_source_t* source;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	input_frame_t* cur_frame;
+	ngx_cache_key_t hash;
+
+	*total_size = 0;
+
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			ngx_memzero(&key_part, sizeof(key_part));
+
+			if (part->first_frame < part->last_frame)
+			{
+				source = get_frame_part_source_clip((*part));
+				if (source == NULL)
+				{
+					return NGX_DECLINED;
+				}
+
+				ngx_memcpy(key_part.file_key, source->file_key, sizeof(key_part.file_key));
+				key_part.offset = part->first_frame->offset;
+				key_part.frame_count = part->last_frame - part->first_frame;
+
+				for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+				{
+					key_part.size += cur_frame->size;
+				}
+			}
+
+			ngx_cache_key_update(&hash, &key_part, sizeof(key_part));
+			*total_size += key_part.size;
+		}
+	}
+
+	ngx_cache_key_final(ctx->frames_key, &hash);
+
+	return NGX_OK;
+}
+
+// returns the key of the segment in the segment cache. the key of cmaf segments is derived from their content,
+// so that the same entry is used by hls and dash, the key of other segments is the request key (host + uri)
+static u_char*
+ngx_http_vod_get_segment_cache_key(ngx_http_vod_ctx_t *ctx)
+{
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	media_track_t* cur_track;
+	ngx_cache_key_t hash;
+	size_t total_size;
+
+	if (ctx->segment_cache_key != NULL)
+	{
+		return ctx->segment_cache_key;
+	}
+
+	if (!ngx_http_vod_is_cmaf_segment(ctx))
+	{
+		ctx->segment_cache_key = ctx->request_key;
+		return ctx->segment_cache_key;
+	}
+
+	if (ngx_http_vod_get_segment_frames_key(ctx, &total_size) != NGX_OK ||
+		total_size == 0)
+	{
+		return NULL;
+	}
+
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	ngx_cache_key_update(&hash, "cmaf", sizeof("cmaf") - 1);
+	ngx_cache_key_update(&hash, ctx->frames_key, sizeof(ctx->frames_key));
+	ngx_cache_key_update(&hash, &ctx->submodule_context.request_params.segment_index, 
+		sizeof(ctx->submodule_context.request_params.segment_index));
+
+	// the fragment header contains the decode time of the first frame
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		ngx_cache_key_update(&hash, &cur_track->media_info.media_type, sizeof(cur_track->media_info.media_type));
+		ngx_cache_key_update(&hash, &cur_track->first_frame_time_offset, sizeof(cur_track->first_frame_time_offset));
+		ngx_cache_key_update(&hash, &cur_track->clip_start_time, sizeof(cur_track->clip_start_time));
+	}
+
+	ngx_cache_key_final(ctx->segment_key, &hash);
+
+	ctx->segment_cache_key = ctx->segment_key;
+	return ctx->segment_cache_key;
+}
+
+// copies the frames of the segment to a single buffer as they are read, so that they can be saved to the frames cache
+static ngx_int_t
+ngx_http_vod_segment_frames_capture_init(ngx_http_vod_ctx_t *ctx, size_t total_size)
+{
+	frames_source_cache_state_t* state;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	input_frame_t* cur_frame;
+	u_char* pos;
+
+	ctx->frames_capture.data = ngx_pnalloc(ctx->submodule_context.request_context.pool, total_size);
+	if (ctx->frames_capture.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_frames_capture_init: ngx_pnalloc failed");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+	}
+	ctx->frames_capture.len = total_size;
+
+	pos = ctx->frames_capture.data;
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			if (part->first_frame >= part->last_frame)
+			{
+				continue;
+			}
+
+			state = part->frames_source_context;
+			if (state->capture_pos != NULL)
+			{
+				// the frames source is shared by several parts, the frames are not captured in order
+				goto failed;
+			}
+
+			state->capture_pos = pos;
+
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+			{
+				pos += cur_frame->size;
+			}
+		}
+	}
+
+	return NGX_OK;
+
+failed:
+
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			if (part->first_frame < part->last_frame)
+			{
+				state = part->frames_source_context;
+				state->capture_pos = NULL;
+			}
+		}
+	}
+
+	ctx->frames_capture.data = NULL;
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_segment_frames_cache_store(ngx_http_vod_ctx_t *ctx)
+{
+	frames_source_cache_state_t* state;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	input_frame_t* cur_frame;
+	u_char* pos;
+
+	// make sure all the frames were read, the frames are not read when the segment is sent with sendfile
+	pos = ctx->frames_capture.data;
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			if (part->first_frame >= part->last_frame)
+			{
+				continue;
+			}
+
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+			{
+				pos += cur_frame->size;
+			}
+
+			state = part->frames_source_context;
+			if (state->capture_pos != pos)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_segment_frames_cache_store: not all frames were read");
+				return;
+			}
+		}
+	}
+
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		ngx_http_vod_get_segment_frames_cache(ctx),
+		ctx->frames_key,
+		ctx->cache_tag,
+		ctx->frames_capture.data,
+		ctx->frames_capture.len))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_frames_cache_store: stored in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_frames_cache_store: failed to store in cache");
+	}
+}
+
+// initializes the response writer, and wraps it with the encryption stage of the request.
+// returns NGX_DECLINED if the request does not have an encryption stage that is applied on the muxed segment
+static ngx_int_t
+ngx_http_vod_init_segment_writer(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	ctx->write_segment_buffer_context.r = r;
+	ctx->write_segment_buffer_context.chain_head = &ctx->out;
+	ctx->write_segment_buffer_context.chain_end = &ctx->out;
+
+	ctx->segment_writer.write_tail = ngx_http_vod_write_segment_buffer;
+	ctx->segment_writer.write_head = ngx_http_vod_write_segment_header_buffer;
+	ctx->segment_writer.write_file = ngx_http_vod_is_file_passthrough_supported(ctx) && 
+		!ctx->prefetch && ctx->frames_capture.data == NULL ? 
+		ngx_http_vod_write_segment_file : NULL;
+
+	// prefetch requests only warm the caches, the segment is built but not sent
+	ctx->write_segment_buffer_context.discard_output = ctx->prefetch;
+
+	// when sending file buffers, pass all the buffers of each frame processor run to the output filter together, 
+	// this lets nginx send them with fewer sendfile calls
+	ctx->write_segment_buffer_context.output_chunk_size = ctx->submodule_context.conf->output_chunk_size;
+	ctx->write_segment_buffer_context.defer_output = ctx->segment_writer.write_file != NULL || 
+		ctx->write_segment_buffer_context.output_chunk_size != 0;
+	ctx->write_segment_buffer_context.pending = NULL;
+	ctx->write_segment_buffer_context.pending_last = &ctx->write_segment_buffer_context.pending;
+	ctx->write_segment_buffer_context.pending_size = 0;
+	ctx->segment_writer.context = &ctx->write_segment_buffer_context;
+
+	// the segment store saves the segment as it is sent, range requests may complete before the whole segment is built
+	if (ngx_http_vod_get_segment_store(ctx->submodule_context.conf) != NULL &&
+		ctx->submodule_context.media_set.type == MEDIA_SET_VOD &&
+		r->headers_in.range == NULL &&
+		!ngx_http_vod_submodule_size_only(&ctx->submodule_context))
+	{
+		rc = ngx_http_vod_segment_capture_init(ctx, &ctx->segment_store_capture);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	if (ctx->request->init_segment_encryption == NULL)
+	{
+		// cmaf segments are not encrypted after they are muxed, the segment can be cached as is
+		return ngx_http_vod_is_cmaf_segment(ctx) ? NGX_OK : NGX_DECLINED;
+	}
+
+	rc = ctx->request->init_segment_encryption(&ctx->submodule_context, &ctx->segment_writer);
+	if (rc != NGX_OK && rc != NGX_DECLINED)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_segment_writer: init_segment_encryption failed %i", rc);
+	}
+
+	return rc;
+}
+
+// returns the size of a streamed segment that was saved by a previous request, or 0 if not found
+static size_t
+ngx_http_vod_segment_size_cache_fetch(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->segment_size_cache;
+	ngx_str_t buffer;
+	uint32_t token;
+	size_t result = 0;
+
+	if (cache == NULL ||
+		ctx->submodule_context.media_set.type != MEDIA_SET_VOD)
+	{
+		return 0;
+	}
+
+	if (!ngx_buffer_cache_fetch_perf(ctx->perf_counters, cache, ctx->request_key, &buffer, &token))
+	{
+		return 0;
+	}
+
+	if (buffer.len == sizeof(result))
+	{
+		ngx_memcpy(&result, buffer.data, sizeof(result));
+	}
+
+	ngx_buffer_cache_release(cache, ctx->request_key, token);
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_segment_size_cache_fetch: segment size cache hit, size is %uz", result);
+
+	return result;
+}
+
+static void
+ngx_http_vod_segment_size_cache_store(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->segment_size_cache;
+	size_t size = ctx->write_segment_buffer_context.total_size;
+
+	if (cache == NULL ||
+		ctx->submodule_context.media_set.type != MEDIA_SET_VOD ||
+		size == 0)
+	{
+		return;
+	}
+
+	if (ngx_buffer_cache_store_perf(ctx->perf_counters, cache, ctx->request_key, ctx->cache_tag, (u_char*)&size, sizeof(size)))
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_size_cache_store: stored segment size %uz", size);
+	}
+}
+
+static ngx_int_t 
+ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t output_buffer = ngx_null_string;
+	ngx_str_t content_type;
+	ngx_int_t rc;
+	off_t range_start;
+	off_t range_end;
+
+	rc = ngx_http_vod_update_timescale(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// initialize the response writer
+	rc = ngx_http_vod_init_segment_writer(ctx);
+	switch (rc)
+	{
+	case NGX_OK:
+		// range requests may complete before the whole segment is built, and are not saved to cache
+		if (ngx_http_vod_get_segment_cache(ctx) != NULL &&
+			ngx_http_vod_get_segment_cache_key(ctx) != NULL &&
+			r->headers_in.range == NULL &&
+			!ngx_http_vod_submodule_size_only(&ctx->submodule_context))
+		{
+			rc = ngx_http_vod_segment_capture_init(ctx, &ctx->segment_capture);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+		break;
+
+	case NGX_DECLINED:
+		break;
+
+	default:
+		return rc;
+	}
+
+	// initialize the protocol specific frame processor
+	ngx_vod_probe2(muxer_start, r, ctx->submodule_context.request_params.segment_index);
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ctx->request->init_frame_processor(
+		&ctx->submodule_context,
+		&ctx->segment_writer,
+		&ctx->frame_processor,
+		&ctx->frame_processor_state,
+		&output_buffer,
+		&ctx->content_length,
+		&content_type);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_frame_processing: init_frame_processor failed %i", rc);
+		return rc;
+	}
+
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_INIT_FRAME_PROCESS);
+
+	r->headers_out.content_type_len = content_type.len;
+	r->headers_out.content_type.len = content_type.len;
+	r->headers_out.content_type.data = content_type.data;
+
+	// a streamed response is sent without a content length (chunked), as it is being built,
+	// unless the size of the segment is known from a previous request
+	if (ctx->content_length == NGX_HTTP_VOD_STREAMED_RESPONSE_SIZE)
+	{
+		ctx->content_length = ngx_http_vod_segment_size_cache_fetch(ctx);
+		if (ctx->content_length == 0)
+		{
+			ctx->streamed_response = 1;
+
+			rc = ngx_http_vod_send_header(r, -1, NULL, MEDIA_SET_VOD, NULL);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			if (r->header_only || r->method == NGX_HTTP_HEAD)
+			{
+				return NGX_DONE;
+			}
+		}
+	}
+
+	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it
+	if (ctx->content_length != 0)
+	{
+		// send the response header
+		rc = ngx_http_vod_send_header(r, ctx->content_length, NULL, MEDIA_SET_VOD, NULL);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		if (r->header_only || r->method == NGX_HTTP_HEAD)
+		{
+			return NGX_DONE;
+		}
+
+		// in case of range request, get the end offset
+		if (ctx->submodule_context.r->headers_in.range != NULL &&
+			ngx_http_vod_range_parse(
+				&ctx->submodule_context.r->headers_in.range->value,
+				ctx->content_length,
+				&range_start,
+				&range_end) == NGX_OK)
+		{
+			ctx->size_limit = range_end;
+		}
+	}
+
+	// write the initial buffer if provided
+	if (output_buffer.len != 0)
+	{
+		rc = ctx->segment_writer.write_tail(
+			ctx->segment_writer.context, 
+			output_buffer.data, 
+			output_buffer.len);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_frame_processing: write_tail failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		}
+
+		// in case of a range request that is fully contained in the output buffer (e.g. 0-0), we're done
+		if (ctx->size_limit != 0 && output_buffer.len >= ctx->size_limit && r->header_sent)
+		{
+			return NGX_DONE;
+		}
+	}
+
+	rc = read_cache_allocate_buffer_slots(&ctx->read_cache_state, 0);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_frame_processing: read_cache_allocate_buffer_slots failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+	}
+
+	return NGX_OK;
+}
+
+static int
+ngx_http_vod_compare_read_ranges(const void* p1, const void* p2)
+{
+	const media_clip_read_range_t* range1 = p1;
+	const media_clip_read_range_t* range2 = p2;
+
+	if (range1->start_offset < range2->start_offset)
+	{
+		return -1;
+	}
+
+	return range1->start_offset > range2->start_offset ? 1 : 0;
+}
+
+// calculates the byte ranges of the frames that will be read from each source, coalescing nearby ranges,
+// this allows the read cache to fetch each range with a single read
+static ngx_int_t
+ngx_http_vod_init_read_ranges(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_read_range_t* cur_range;
+	media_clip_read_range_t* last_range;
+	media_clip_read_range_t* ranges_end;
+	media_clip_source_t* cur_source;
+	frame_list_part_t* part;
+	input_frame_t* cur_frame;
+	media_track_t* cur_track;
+	ngx_array_t ranges;
+	uint64_t end_offset;
+	uint64_t max_gap;
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		cur_source->read_ranges = NULL;
+		cur_source->read_range_count = 0;
+
+		// when reading over http, prefer a single spanning request over several requests to the same object
+		max_gap = cur_source->reader == &reader_http ? MAX_COALESCED_HTTP_READ_GAP : MAX_COALESCED_READ_GAP;
+
+		if (ngx_array_init(&ranges, ctx->submodule_context.request_context.pool, 8, sizeof(*cur_range)) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_init_read_ranges: ngx_array_init failed");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+		}
+
+		// build the ranges of each track, frames are usually stored in increasing offsets
+		for (cur_track = cur_source->track_array.first_track; 
+			cur_track < cur_source->track_array.last_track; 
+			cur_track++)
+		{
+			for (part = &cur_track->frames; part != NULL; part = part->next)
+			{
+				cur_range = NULL;
+
+				for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+				{
+					end_offset = cur_frame->offset + cur_frame->size;
+
+					if (cur_range != NULL &&
+						cur_frame->offset >= cur_range->start_offset &&
+						cur_frame->offset <= cur_range->end_offset + max_gap)
+					{
+						if (end_offset > cur_range->end_offset)
+						{
+							cur_range->end_offset = end_offset;
+						}
+						continue;
+					}
+
+					cur_range = ngx_array_push(&ranges);
+					if (cur_range == NULL)
+					{
+						ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+							"ngx_http_vod_init_read_ranges: ngx_array_push failed");
+						return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+					}
+
+					cur_range->start_offset = cur_frame->offset;
+					cur_range->end_offset = end_offset;
+				}
+			}
+		}
+
+		if (ranges.nelts == 0)
+		{
+			continue;
+		}
+
+		// merge the ranges of all tracks
+		ngx_qsort(ranges.elts, ranges.nelts, sizeof(*cur_range), ngx_http_vod_compare_read_ranges);
+
+		last_range = ranges.elts;
+		ranges_end = last_range + ranges.nelts;
+		for (cur_range = last_range + 1; cur_range < ranges_end; cur_range++)
+		{
+			if (cur_range->start_offset <= last_range->end_offset + max_gap)
+			{
+				if (cur_range->end_offset > last_range->end_offset)
+				{
+					last_range->end_offset = cur_range->end_offset;
+				}
+				continue;
+			}
+
+			last_range++;
+			*last_range = *cur_range;
+		}
+
+		cur_source->read_ranges = ranges.elts;
+		cur_source->read_range_count = last_range + 1 - (media_clip_read_range_t*)ranges.elts;
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_prefetch_add_part(ngx_http_vod_ctx_t *ctx, frame_list_part_t* part)
+{
+	ngx_http_vod_prefetch_read_t* cur_read;
+	ngx_http_vod_prefetch_read_t* reads_end;
+	media_clip_source_t* source;
+	input_frame_t* frame;
+
+	if (part->first_frame >= part->last_frame)
+	{
+		return;
+	}
+
+	source = get_frame_part_source_clip((*part));
+	if (source == NULL ||
+		source->reader == NULL || 
+		source->reader->read != (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+	{
+		return;
+	}
+
+	frame = part->first_frame;
+
+	reads_end = ctx->prefetch_reads + ctx->prefetch_count;
+	for (cur_read = ctx->prefetch_reads; cur_read < reads_end; cur_read++)
+	{
+		if (cur_read->source != source)
+		{
+			continue;
+		}
+
+		if (frame->offset < cur_read->offset)
+		{
+			cur_read->offset = frame->offset;
+			cur_read->end_offset = frame->offset + frame->size;
+		}
+		return;
+	}
+
+	if (ctx->prefetch_count >= MAX_PARALLEL_FRAME_READS)
+	{
+		return;
+	}
+
+	cur_read->source = source;
+	cur_read->offset = frame->offset;
+	cur_read->end_offset = frame->offset + frame->size;
+	ctx->prefetch_count++;
+}
+
+static void
+ngx_http_vod_prefetch_completed(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_prefetch_read_t* cur_read;
+	ngx_http_vod_prefetch_read_t* reads_end;
+
+	reads_end = ctx->prefetch_reads + ctx->prefetch_count;
+	for (cur_read = ctx->prefetch_reads; cur_read < reads_end; cur_read++)
+	{
+		if (cur_read->target_buffer == NULL)
+		{
+			continue;
+		}
+
+		ctx->frames_bytes_read += (cur_read->buf.last - cur_read->buf.pos);
+		ngx_http_vod_update_bytes_read(ctx, cur_read->buf.last - cur_read->buf.pos);
+		read_cache_buffer_read_completed(cur_read->target_buffer, &cur_read->buf);
+	}
+
+	ctx->prefetch_count = 0;
+}
+
+// issues the initial read of all the source files in parallel, instead of letting the frame processor 
+// read them one at a time
+static ngx_int_t
+ngx_http_vod_prefetch_frames(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_prefetch_read_t* cur_read;
+	ngx_http_vod_prefetch_read_t* reads_end;
+	read_cache_get_read_buffer_t read_buf;
+	read_cache_request_t cache_request;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	u_char* buffer;
+	uint32_t size;
+	size_t cache_buffer_size;
+	ngx_int_t rc;
+
+	ctx->prefetch_reads = ngx_palloc(ctx->submodule_context.request_context.pool, 
+		sizeof(ctx->prefetch_reads[0]) * MAX_PARALLEL_FRAME_READS);
+	if (ctx->prefetch_reads == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_prefetch_frames: ngx_palloc failed");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+	}
+
+	// find the first frame of each source
+	ctx->prefetch_count = 0;
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			ngx_http_vod_prefetch_add_part(ctx, part);
+		}
+	}
+
+	if (ctx->prefetch_count < 2)
+	{
+		// nothing to parallelize
+		ctx->prefetch_count = 0;
+		return NGX_OK;
+	}
+
+	rc = read_cache_allocate_buffer_slots(&ctx->read_cache_state, ctx->prefetch_count);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_prefetch_frames: read_cache_allocate_buffer_slots failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+	}
+
+	cache_buffer_size = ctx->submodule_context.conf->cache_buffer_size;
+
+	ngx_http_vod_join_start(&ctx->prefetch_join);
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	reads_end = ctx->prefetch_reads + ctx->prefetch_count;
+	for (cur_read = ctx->prefetch_reads; cur_read < reads_end; cur_read++)
+	{
+		cur_read->target_buffer = NULL;
+
+		cache_request.cache_slot_id = cur_read - ctx->prefetch_reads;
+		cache_request.source = cur_read->source;
+		cache_request.cur_offset = cur_read->offset;
+		cache_request.end_offset = cur_read->end_offset;
+		cache_request.hint.min_offset = ULLONG_MAX;
+
+		if (read_cache_get_from_cache(&ctx->read_cache_state, &cache_request, &buffer, &size))
+		{
+			continue;
+		}
+
+		read_cache_get_read_buffer(&ctx->read_cache_state, &read_buf);
+
+		cur_read->target_buffer = read_cache_detach_target_buffer(&ctx->read_cache_state);
+
+		ctx->read_buffer.start = read_buf.buffer;
+		if (read_buf.buffer != NULL)
+		{
+			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
+		}
+
+		rc = ngx_http_vod_alloc_read_buffer(ctx, ngx_max(cache_buffer_size, read_buf.size) + read_buf.source->alloc_extra_size, read_buf.source->alignment);
+		if (rc != NGX_OK)
+		{
+			ngx_http_vod_join_add(&ctx->prefetch_join, rc);
+			break;
+		}
+
+		cur_read->buf = ctx->read_buffer;
+		ctx->read_buffer.start = NULL;
+
+		rc = read_buf.source->reader->read(
+			read_buf.source->reader_context,
+			&cur_read->buf,
+			read_buf.size,
+			read_buf.offset);
+		ngx_http_vod_join_add(&ctx->prefetch_join, rc);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_prefetch_frames: async_read failed %i", rc);
+			break;
+		}
+	}
+
+	rc = ngx_http_vod_join_started(&ctx->prefetch_join);
+	if (rc != NGX_OK)
+	{
+		if (rc == NGX_AGAIN)
+		{
+			ctx->state = STATE_PREFETCH_FRAMES;
+		}
+		return rc;
+	}
+
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+	ngx_http_vod_prefetch_completed(ctx);
+
+	return NGX_OK;
+}
+
+static vod_status_t
+ngx_http_vod_audio_filter_cache_fetch(void* context, vod_str_t* key, vod_str_t* result)
+{
+	ngx_http_vod_ctx_t *ctx = context;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_cache_key_t hash;
+	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
+
+	ngx_cache_key_init(&hash, conf->cache_key_hash);
+	ngx_cache_key_update(&hash, key->data, key->len);
+	ngx_cache_key_final(cache_key, &hash);
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		ctx->submodule_context.r,
+		ctx->perf_counters,
+		&conf->audio_filter_cache,
+		1,
+		cache_key,
+		result) < 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_audio_filter_cache_fetch: audio filter cache hit, size is %uz", result->len);
+
+	return VOD_OK;
+}
+
+static void
+ngx_http_vod_audio_filter_cache_store(void* context, vod_str_t* key, vod_str_t* buffer)
+{
+	ngx_http_vod_ctx_t *ctx = context;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_cache_key_t hash;
+	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
+
+	ngx_cache_key_init(&hash, conf->cache_key_hash);
+	ngx_cache_key_update(&hash, key->data, key->len);
+	ngx_cache_key_final(cache_key, &hash);
+
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		conf->audio_filter_cache,
+		cache_key,
+		0,
+		buffer->data,
+		buffer->len))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_audio_filter_cache_store: stored in audio filter cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_audio_filter_cache_store: failed to store in audio filter cache");
+	}
+}
+
+#if (NGX_THREADS)
+static void
+ngx_http_vod_filter_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_http_vod_ctx_t *ctx = data;
+
+	ctx->filter_rc = ctx->frame_processor(ctx->frame_processor_state);
+
+	ngx_perf_counter_start(ctx->thread_perf_counter_context);
+}
+
+static void
+ngx_http_vod_filter_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_http_vod_ctx_t *ctx = ev->data;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_connection_t *c = r->connection;
+	ngx_int_t rc;
+
+	// the time from the completion of the task until the event loop runs its handler
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->thread_perf_counter_context, PC_EVENT_LOOP_DELAY);
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	ctx->filter_completed = 1;
+
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_finalize_request(ctx, rc);
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+#endif // NGX_THREADS
+
+// runs the frame processor, audio filtering, thumbnail capture, volume maps and the muxing / encryption of segments
+// are executed on their thread pool, if configured.
+// returns NGX_DONE if a task was posted, in this case the state machine is called again when the task completes, 
+// and the second call returns the result of the frame processor
+static ngx_int_t
+ngx_http_vod_run_frame_processor(ngx_http_vod_ctx_t *ctx)
+{
+#if (NGX_THREADS)
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_thread_pool_t* thread_pool;
+	ngx_thread_task_t* task;
+
+	if (ctx->filter_completed)
+	{
+		ctx->filter_completed = 0;
+		return ctx->filter_rc;
+	}
+
+	if (ctx->frame_processor == filter_run_state_machine)
+	{
+		thread_pool = conf->audio_filter_thread_pool;
+	}
+	else if (ctx->request->request_class == REQUEST_CLASS_THUMB)
+	{
+		thread_pool = conf->thumb_thread_pool;
+	}
+#if (NGX_HAVE_LIB_AV_CODEC)
+	else if (conf->submodule.name == volume_map.name)
+	{
+		thread_pool = conf->volume_map_thread_pool;
+	}
+#endif // NGX_HAVE_LIB_AV_CODEC
+	else
+	{
+		thread_pool = conf->processing_thread_pool;
+	}
+
+	if (thread_pool == NULL)
+	{
+		return ctx->frame_processor(ctx->frame_processor_state);
+	}
+
+	// the output filter must not be called from the thread, the output is sent when the frame processor returns
+	ctx->write_segment_buffer_context.defer_output = 1;
+	ctx->write_segment_buffer_context.output_chunk_size = 0;
+
+	task = ctx->filter_task;
+	if (task == NULL)
+	{
+		task = ngx_thread_task_alloc(r->pool, 0);
+		if (task == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_run_frame_processor: ngx_thread_task_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		task->ctx = ctx;
+		task->handler = ngx_http_vod_filter_thread_handler;
+		task->event.data = ctx;
+		task->event.handler = ngx_http_vod_filter_thread_event_handler;
+
+		ctx->filter_task = task;
+	}
+
+	if (ngx_thread_task_post(thread_pool, task) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_run_frame_processor: ngx_thread_task_post failed");
+		return ctx->frame_processor(ctx->frame_processor_state);
+	}
+
+	// Note: the request is blocked until the task completes, so its pool is not accessed by the event loop
+	r->main->blocked++;
+	r->aio = 1;
+
+	return NGX_DONE;
+#else
+	return ctx->frame_processor(ctx->frame_processor_state);
+#endif // NGX_THREADS
+}
+
+static void
+ngx_http_vod_frames_read_done(ngx_http_vod_ctx_t* ctx, ngx_buf_t* buf)
+{
+	ngx_http_vod_frames_read_t* read = ctx->frames_read;
+	ngx_http_vod_ctx_t* waiter;
+	ngx_queue_t* q;
+	size_t available;
+	size_t start;
+	size_t size;
+
+	if (read == NULL)
+	{
+		return;
+	}
+
+	ctx->frames_read = NULL;
+	ngx_queue_remove(&read->queue);
+
+	available = buf != NULL ? (size_t)(buf->last - buf->pos) : 0;
+
+	// copy the data to the waiting requests, when the read failed they read the data independently
+	while (!ngx_queue_empty(&read->waiters))
+	{
+		q = ngx_queue_head(&read->waiters);
+		ngx_queue_remove(q);
+
+		waiter = ngx_queue_data(q, ngx_http_vod_ctx_t, frames_read_queue);
+
+		waiter->frames_read_copied = 0;
+
+		start = waiter->frames_read_offset - read->offset;
+		if (start < available)
+		{
+			size = ngx_min(available - start, waiter->frames_read_size);
+			waiter->read_buffer.last = ngx_copy(waiter->read_buffer.last, buf->pos + start, size);
+			waiter->frames_read_copied = size;
+		}
+
+		ngx_post_event(&waiter->frames_read_event, &ngx_posted_events);
+	}
+}
+
+static void
+ngx_http_vod_frames_read_cleanup(void* data)
+{
+	// the request was finalized before completing the read (e.g. error / client disconnect)
+	ngx_http_vod_frames_read_done(data, NULL);
+}
+
+static void
+ngx_http_vod_frames_read_wait_completed(ngx_event_t* ev)
+{
+	ngx_http_vod_ctx_t* ctx = ev->data;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (ctx->frames_read_copied > 0)
+	{
+		ngx_http_vod_handle_read_completed(ctx, NGX_OK, NULL, ctx->frames_read_copied);
+	}
+	else
+	{
+		ctx->frames_read_retry = 1;
+
+		rc = ctx->state_machine(ctx);
+		if (rc != NGX_AGAIN)
+		{
+			ngx_http_vod_finalize_request(ctx, rc);
+		}
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+
+// returns NGX_AGAIN if the range is contained in a read that is in progress, the data is copied
+// to the read buffer of the request when the read completes
+static ngx_int_t
+ngx_http_vod_frames_read_attach(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source, off_t offset, size_t size)
+{
+	ngx_http_vod_frames_read_t* read;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_queue_t* q;
+
+	if (ctx->frames_read_retry)
+	{
+		ctx->frames_read_retry = 0;
+		return NGX_OK;
+	}
+
+	for (q = ngx_queue_head(&frames_reads);
+		q != ngx_queue_sentinel(&frames_reads);
+		q = ngx_queue_next(q))
+	{
+		read = ngx_queue_data(q, ngx_http_vod_frames_read_t, queue);
+		if (offset < read->offset ||
+			offset + size > read->offset + read->size ||
+			ngx_memcmp(read->key, source->file_key, sizeof(read->key)) != 0)
+		{
+			continue;
+		}
+
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_frames_read_attach: attaching to a concurrent read, offset %O size %uz", offset, size);
+
+		ctx->frames_read_offset = offset;
+		ctx->frames_read_size = size;
+		ctx->frames_read_event.handler = ngx_http_vod_frames_read_wait_completed;
+		ctx->frames_read_event.data = ctx;
+		ctx->frames_read_event.log = r->connection->log;
+		ngx_queue_insert_tail(&read->waiters, &ctx->frames_read_queue);
+
+		r->main->blocked++;
+		r->aio = 1;
+		return NGX_AGAIN;
+	}
+
+	return NGX_OK;
+}
+
+// registers an asynchronous read, so that concurrent requests for the same range can attach to it
+static void
+ngx_http_vod_frames_read_register(ngx_http_vod_ctx_t* ctx, media_clip_source_t* source, off_t offset, size_t size)
+{
+	ngx_http_vod_frames_read_t* read;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+
+	if (ctx->frames_read_cleanup == NULL)
+	{
+		ctx->frames_read_cleanup = ngx_pool_cleanup_add(r->pool, 0);
+		if (ctx->frames_read_cleanup == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_frames_read_register: ngx_pool_cleanup_add failed");
+			return;
+		}
+
+		ctx->frames_read_cleanup->handler = ngx_http_vod_frames_read_cleanup;
+		ctx->frames_read_cleanup->data = ctx;
+	}
+
+	read = ngx_palloc(r->pool, sizeof(*read));
+	if (read == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_frames_read_register: ngx_palloc failed");
+		return;
+	}
+
+	ngx_memcpy(read->key, source->file_key, sizeof(read->key));
+	read->offset = offset;
+	read->size = size;
+	ngx_queue_init(&read->waiters);
+	ngx_queue_insert_tail(&frames_reads, &read->queue);
+	ctx->frames_read = read;
+}
+
+static size_t
+ngx_http_vod_get_unsent_output_size(ngx_http_request_t *r)
+{
+	ngx_chain_t* cl;
+	size_t result = 0;
+
+	// Note: file buffers are not counted, since they do not hold memory
+	for (cl = r->out; cl != NULL; cl = cl->next)
+	{
+		if (ngx_buf_in_memory(cl->buf))
+		{
+			result += cl->buf->last - cl->buf->pos;
+		}
+	}
+
+	return result;
+}
+
+static ngx_int_t
+ngx_http_vod_wait_for_output(ngx_http_request_t *r)
+{
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_event_t* wev = r->connection->write;
+
+	clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
+
+	if (!wev->delayed)
+	{
+		ngx_add_timer(wev, clcf->send_timeout);
+	}
+
+	if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_wait_for_output: ngx_handle_write_event failed");
+		return NGX_ERROR;
+	}
+
+	return NGX_AGAIN;
+}
+
+static void
+ngx_http_vod_output_wev_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_connection_t* c = r->connection;
+	ngx_event_t* wev = c->write;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (wev->timedout)
+	{
+		ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+		c->timedout = 1;
+		rc = NGX_HTTP_REQUEST_TIME_OUT;
+		goto finalize_request;
+	}
+
+	// push the pending output to the socket
+	rc = ngx_http_output_filter(r, NULL);
+	if (rc == NGX_ERROR)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+			"ngx_http_vod_output_wev_handler: ngx_http_output_filter failed");
+		goto finalize_request;
+	}
+
+	// resume once the unsent output drops to half the limit, to avoid pausing on every frame processor run
+	if (ngx_http_vod_get_unsent_output_size(r) > ctx->submodule_context.conf->max_unsent_output_size / 2)
+	{
+		rc = ngx_http_vod_wait_for_output(r);
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
+
+		goto finalize_request;
+	}
+
+	if (wev->timer_set)
+	{
+		ngx_del_timer(wev);
+	}
+
+	r->write_event_handler = ctx->original_write_event_handler;
+	ctx->original_write_event_handler = NULL;
+
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
+	return;
+
+finalize_request:
+
+	r->write_event_handler = ctx->original_write_event_handler;
+	ctx->original_write_event_handler = NULL;
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+// pauses the frame processing when the client does not keep up with the output,
+// so that the output does not pile up in memory, and the read buffers are reused
+static ngx_int_t
+ngx_http_vod_pause_for_output(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	size_t max_size;
+
+	max_size = ctx->submodule_context.conf->max_unsent_output_size;
+	if (max_size == 0 ||
+		!r->header_sent ||
+		ctx->write_segment_buffer_context.discard_output ||
+		ngx_http_vod_get_unsent_output_size(r) <= max_size)
+	{
+		return NGX_OK;
+	}
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_pause_for_output: unsent output exceeds the limit, pausing");
+
+	ctx->output_paused = 1;
+	ctx->original_write_event_handler = r->write_event_handler;
+	r->write_event_handler = ngx_http_vod_output_wev_handler;
+
+	return ngx_http_vod_wait_for_output(r);
+}
+
+static ngx_int_t 
+ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
+{
+	read_cache_get_read_buffer_t read_buf;
+	size_t cache_buffer_size;
+	ngx_flag_t coalesce;
+	vod_status_t rc;
+
+	for (;;)
+	{
+		if (ctx->output_paused)
+		{
+			// the frame processor already consumed the data, continue with the next read
+			ctx->output_paused = 0;
+			goto read_frames;
+		}
+
+		ngx_perf_counter_start(ctx->perf_counter_context);
+
+		rc = ngx_http_vod_run_frame_processor(ctx);
+		if (rc == NGX_DONE)
+		{
+			return NGX_AGAIN;
+		}
+
+		ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_PROCESS_FRAMES);
+
+		if (ngx_http_vod_flush_segment_output(&ctx->write_segment_buffer_context) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+
+		switch (rc)
+		{
+		case VOD_OK:
+			// we're done
+			return NGX_OK;
+
+		case VOD_AGAIN:
+			// handled outside the switch
+			break;
+
+		default:
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_process_media_frames: frame_processor failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		}
+
+		if (ctx->size_limit != 0 && 
+			ctx->write_segment_buffer_context.total_size >= ctx->size_limit && 
+			ctx->submodule_context.r->header_sent)
+		{
+			return NGX_OK;
+		}
+
+		rc = ngx_http_vod_pause_for_output(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+read_frames:
+
+		// get a buffer to read into
+		read_cache_get_read_buffer(
+			&ctx->read_cache_state,
+			&read_buf);
+
+		cache_buffer_size = ctx->submodule_context.conf->cache_buffer_size;
+
+		ctx->read_buffer.start = read_buf.buffer;
+		if (read_buf.buffer != NULL)
+		{
+			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
+		}
+
+		rc = ngx_http_vod_alloc_read_buffer(ctx, ngx_max(cache_buffer_size, read_buf.size) + read_buf.source->alloc_extra_size, read_buf.source->alignment);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+		
+		// perform the read
+		ngx_perf_counter_start(ctx->perf_counter_context);
+		ngx_perf_counter_set_io(ctx->request_perf_counters, read_buf.offset, read_buf.size);
+
+		coalesce = ctx->submodule_context.conf->coalesce_frame_reads && 
+			read_buf.source->reader->read == (ngx_http_vod_async_read_func_t)ngx_async_file_read;
+		if (coalesce && 
+			ngx_http_vod_frames_read_attach(ctx, read_buf.source, read_buf.offset, read_buf.size) == NGX_AGAIN)
+		{
+			return NGX_AGAIN;
+		}
+
+		rc = read_buf.source->reader->read(
+			read_buf.source->reader_context, 
+			&ctx->read_buffer, 
+			read_buf.size, 
+			read_buf.offset);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_process_media_frames: async_read failed %i", rc);
+			}
+			else if (coalesce)
+			{
+				ngx_http_vod_frames_read_register(ctx, read_buf.source, read_buf.offset, read_buf.size);
+			}
+			return rc;
+		}
+
+		ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+		// read completed synchronously, update the read cache
+		ngx_http_vod_update_bytes_read(ctx, ctx->read_buffer.last - ctx->read_buffer.pos);
+		read_cache_read_completed(&ctx->read_cache_state, &ctx->read_buffer);
+	}
+}
+
+// returns the cache of the responses of frame processing requests, thumbnails and volume maps are cached
+static ngx_buffer_cache_t**
+ngx_http_vod_get_frames_response_cache(ngx_http_vod_loc_conf_t* conf, const ngx_http_vod_request_t* request)
+{
+	if ((request->request_class & REQUEST_CLASS_THUMB) != 0)
+	{
+		return conf->thumb_cache != NULL ? &conf->thumb_cache : NULL;
+	}
+
+#if (NGX_HAVE_LIB_AV_CODEC)
+	if (conf->submodule.name == volume_map.name)
+	{
+		return conf->volume_map_cache != NULL ? &conf->volume_map_cache : NULL;
+	}
+#endif // NGX_HAVE_LIB_AV_CODEC
+
+	return NULL;
+}
+
+static void
+ngx_http_vod_frames_response_cache_store(ngx_http_vod_ctx_t *ctx, ngx_buffer_cache_t* cache)
+{
+	response_cache_header_t cache_header;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_chain_t* cl;
+	ngx_str_t* cache_buffers;
+	ngx_str_t* cur_buffer;
+	size_t buffer_count;
+
+	buffer_count = 2;
+	for (cl = &ctx->out; cl != NULL; cl = cl->next)
+	{
+		buffer_count++;
+	}
+
+	cache_buffers = ngx_palloc(r->pool, sizeof(cache_buffers[0]) * buffer_count);
+	if (cache_buffers == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_frames_response_cache_store: ngx_palloc failed");
+		return;
+	}
+
+	// use the format of the response cache
+	cache_header.content_type_len = r->headers_out.content_type.len;
+	cache_header.gzip_len = 0;
+	cache_header.media_set_type = MEDIA_SET_VOD;
+	cache_buffers[0].data = (u_char*)&cache_header;
+	cache_buffers[0].len = sizeof(cache_header);
+	cache_buffers[1] = r->headers_out.content_type;
+
+	cur_buffer = cache_buffers + 2;
+	for (cl = &ctx->out; cl != NULL; cl = cl->next)
+	{
+		cur_buffer->data = cl->buf->pos;
+		cur_buffer->len = cl->buf->last - cl->buf->pos;
+		cur_buffer++;
+	}
+
+	if (ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters, 
+		cache, 
+		ctx->request_key, 
+		ctx->cache_tag, 
+		cache_buffers, 
+		buffer_count))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_frames_response_cache_store: stored in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_frames_response_cache_store: failed to store in cache");
+	}
+}
+
+static ngx_int_t
+ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_buffer_cache_t** cache;
+	ngx_int_t rc;
+
+	rc = ctx->segment_writer.write_tail(ctx->segment_writer.context, NULL, 0);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_finalize_segment_response: write_tail failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(r, rc);
+	}
+
+	ngx_vod_probe2(muxer_done, r, ctx->write_segment_buffer_context.total_size);
+
+	if (ctx->segment_capture != NULL)
+	{
+		ngx_http_vod_segment_cache_store(ctx);
+	}
+
+	if (ctx->segment_store_capture != NULL)
+	{
+		ngx_http_vod_segment_store_save(ctx);
+	}
+
+	if (ctx->frames_capture.data != NULL)
+	{
+		ngx_http_vod_segment_frames_cache_store(ctx);
+	}
+
+	if (ctx->write_segment_buffer_context.discard_output)
+	{
+		return NGX_OK;
+	}
+
+	// if we already sent the headers and all the buffers, just signal completion and return
+	if (r->header_sent)
+	{
+		if (ctx->streamed_response)
+		{
+			ngx_http_vod_segment_size_cache_store(ctx);
+		}
+
+		if (ctx->content_length != 0 &&
+			ctx->write_segment_buffer_context.total_size != ctx->content_length &&
+			(ctx->size_limit == 0 || ctx->write_segment_buffer_context.total_size < ctx->size_limit))
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_finalize_segment_response: actual content length %uz is different than reported length %uz",
+				ctx->write_segment_buffer_context.total_size, ctx->content_length);
+		}
+
+		rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_finalize_segment_response: ngx_http_send_special failed %i", rc);
+			return rc;
+		}
+		return NGX_OK;
+	}
+
+	// mark the current buffer as last
+	if (ctx->write_segment_buffer_context.chain_end->buf == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_finalize_segment_response: no buffers were written");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_UNEXPECTED);
+	}
+
+	ctx->write_segment_buffer_context.chain_end->next = NULL;
+	ctx->write_segment_buffer_context.chain_end->buf->last_buf = 1;
+
+	cache = ngx_http_vod_get_frames_response_cache(ctx->submodule_context.conf, ctx->request);
+	if (cache != NULL)
+	{
+		ngx_http_vod_frames_response_cache_store(ctx, *cache);
+	}
+
+	// send the response header
+	rc = ngx_http_vod_send_header(r, ctx->write_segment_buffer_context.total_size, NULL, MEDIA_SET_VOD, NULL);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_OK;
+	}
+
+	// send the response buffer chain
+	rc = ngx_http_output_filter(r, &ctx->out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_finalize_segment_response: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+	return NGX_OK;
+}
+
+// serves the segment from the segment cache, the encryption of the request is applied on the cached segment.
+// returns NGX_DECLINED on cache miss
+static ngx_int_t
+ngx_http_vod_segment_cache_fetch(ngx_http_vod_ctx_t *ctx)
+{
+	response_cache_header_t cache_header;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t cache_buffer;
+	ngx_str_t content_type;
+	ngx_str_t segment;
+	ngx_int_t rc;
+	u_char* key;
+
+	cache = ngx_http_vod_get_segment_cache(ctx);
+	if (cache == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	key = ngx_http_vod_get_segment_cache_key(ctx);
+	if (key == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	// Note: the cached segment is copied, since the encryption may be performed in place
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ctx->perf_counters,
+		&cache,
+		1,
+		key,
+		&cache_buffer) < 0 ||
+		cache_buffer.len <= sizeof(cache_header))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_cache_fetch: segment cache miss");
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_SEGMENT, 0);
+		return NGX_DECLINED;
+	}
+
+	ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_SEGMENT, 1);
+
+	ngx_memcpy(&cache_header, cache_buffer.data, sizeof(cache_header));
+	content_type.data = cache_buffer.data + sizeof(cache_header);
+	content_type.len = cache_header.content_type_len;
+
+	if (cache_buffer.len - sizeof(cache_header) <= content_type.len)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_segment_cache_fetch: invalid cached segment, size %uz", cache_buffer.len);
+		return NGX_DECLINED;
+	}
+
+	segment.data = content_type.data + content_type.len;
+	segment.len = cache_buffer.len - sizeof(cache_header) - content_type.len;
+
+	// the encryption method may have changed since the segment was cached
+	rc = ngx_http_vod_init_segment_writer(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_segment_cache_fetch: segment cache hit, size is %uz", segment.len);
+
+	r->headers_out.content_type_len = content_type.len;
+	r->headers_out.content_type = content_type;
+
+	rc = ctx->segment_writer.write_tail(ctx->segment_writer.context, segment.data, segment.len);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_cache_fetch: write_tail failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(r, rc);
+	}
+
+	return ngx_http_vod_finalize_segment_response(ctx);
+}
+
+// reads the frames of the segment from the segment frames cache, the frames are then muxed and encrypted from memory.
+// on cache miss, sets up the capture of the frames, so that they are saved once the segment is built.
+// returns NGX_DECLINED on cache miss
+static ngx_int_t
+ngx_http_vod_segment_frames_cache_fetch(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	input_frame_t* cur_frame;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t cache_buffer;
+	ngx_int_t rc;
+	size_t total_size;
+	u_char* pos;
+
+	cache = ngx_http_vod_get_segment_frames_cache(ctx);
+	if (cache == NULL ||
+		ngx_http_vod_get_segment_frames_key(ctx, &total_size) != NGX_OK ||
+		total_size == 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	// Note: the frames are copied, since they may be encrypted in place
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ctx->perf_counters,
+		&cache,
+		1,
+		ctx->frames_key,
+		&cache_buffer) < 0)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_segment_frames_cache_fetch: segment frames cache miss");
+
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_FRAMES, 0);
+
+		// range requests may complete before all the frames are read
+		if (r->headers_in.range != NULL ||
+			ngx_http_vod_submodule_size_only(&ctx->submodule_context))
+		{
+			return NGX_DECLINED;
+		}
+
+		rc = ngx_http_vod_segment_frames_capture_init(ctx, total_size);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		return NGX_DECLINED;
+	}
+
+	if (cache_buffer.len != total_size)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_segment_frames_cache_fetch: invalid cached frames size %uz, expected %uz",
+			cache_buffer.len, total_size);
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_segment_frames_cache_fetch: segment frames cache hit, size is %uz", cache_buffer.len);
+
+	ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_FRAMES, 1);
+
+	// read the frames from the cached buffer, the offset of memory frames is a pointer
+	pos = cache_buffer.data;
+	for (cur_track = media_set->filtered_tracks; cur_track < media_set->filtered_tracks_end; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			if (part->first_frame >= part->last_frame)
+			{
+				continue;
+			}
+
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+			{
+				cur_frame->offset = (uintptr_t)pos;
+				pos += cur_frame->size;
+			}
+
+			part->frames_source = &frames_source_memory;
+			rc = frames_source_memory_init(&ctx->submodule_context.request_context, &part->frames_source_context);
+			if (rc != VOD_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_segment_frames_cache_fetch: frames_source_memory_init failed %i", rc);
+				return ngx_http_vod_status_to_ngx_error(r, rc);
+			}
+		}
+	}
+
+	return NGX_OK;
+}
+
+////// Audio filtering
+
+// Note: the ffmpeg based components (audio filtering, thumbnails) are initialized on first use
+static ngx_int_t
+ngx_http_vod_init_process(ngx_cycle_t *cycle)
+{
+	ngx_queue_init(&metadata_reads);
+	ngx_queue_init(&frames_reads);
+
+	ngx_buffer_cache_init_numa_node(cycle->log);
+
+	return NGX_OK;
+}
+
+static void 
+ngx_http_vod_exit_process()
+{
+#if (VOD_HAVE_ICONV)
+	webvtt_exit_process();
+#endif // VOD_HAVE_ICONV
+
+#if (NGX_HAVE_LIBXML2)
+	dfxp_exit_process();
+#endif // NGX_HAVE_LIBXML2
+
+#if (NGX_HAVE_IO_URING)
+	ngx_io_uring_exit_process();
+#endif // NGX_HAVE_IO_URING
+}
+
+////// Clipping
+
+static void
+ngx_http_vod_get_clip_header_cache_key(ngx_http_vod_ctx_t *ctx, u_char* key)
+{
+	media_parse_params_t parse_params;
+	media_clip_source_t* source = ctx->cur_source;
+	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
+	ngx_cache_key_t hash;
+
+	// Note: request is null for clipping requests, so this only initializes the tracks and languages
+	ngx_http_vod_init_parse_params_metadata(ctx, tracks_mask, &parse_params);
+
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	ngx_cache_key_update(&hash, source->file_key, sizeof(source->file_key));
+	ngx_cache_key_update(&hash, &source->clip_from, sizeof(source->clip_from));
+	ngx_cache_key_update(&hash, &source->clip_to, sizeof(source->clip_to));
+	ngx_cache_key_update(&hash, tracks_mask, sizeof(tracks_mask));
+	if (parse_params.langs_mask != NULL)
+	{
+		ngx_cache_key_update(&hash, parse_params.langs_mask, LANG_MASK_SIZE);
+	}
+	ngx_cache_key_final(key, &hash);
+}
+
+static void
+ngx_http_vod_clip_header_cache_store(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_chain_t* out,
+	size_t response_size,
+	ngx_str_t* content_type)
+{
+	clip_header_cache_header_t cache_header;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_chain_t* cl;
+	ngx_str_t* buffers;
+	ngx_array_t parts;
+	u_char key[MEDIA_CLIP_KEY_SIZE];
+
+	if (ngx_array_init(&parts, r->pool, 32, sizeof(ngx_str_t)) != NGX_OK)
+	{
+		return;
+	}
+
+	buffers = ngx_array_push_n(&parts, 2);
+	if (buffers == NULL)
+	{
+		return;
+	}
+
+	cache_header.first_offset = ctx->clipper_parse_result->first_offset;
+	cache_header.last_offset = ctx->clipper_parse_result->last_offset;
+	cache_header.response_size = response_size;
+	cache_header.content_type_len = content_type->len;
+
+	buffers[0].data = (u_char*)&cache_header;
+	buffers[0].len = sizeof(cache_header);
+	buffers[1] = *content_type;
+
+	// Note: the header is stored as it was built, without the moov atom that it references, so a hit does not
+	//		require reading or parsing the source metadata
+	for (cl = out; cl != NULL; cl = cl->next)
+	{
+		if (cl->buf->last <= cl->buf->pos)
+		{
+			continue;
+		}
+
+		buffers = ngx_array_push(&parts);
+		if (buffers == NULL)
+		{
+			return;
+		}
+
+		buffers->data = cl->buf->pos;
+		buffers->len = cl->buf->last - cl->buf->pos;
+	}
+
+	ngx_http_vod_get_clip_header_cache_key(ctx, key);
+
+	if (ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->clip_header_cache,
+		key,
+		ctx->cache_tag,
+		parts.elts,
+		parts.nelts))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_clip_header_cache_store: stored in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_clip_header_cache_store: failed to store in cache");
+	}
+}
+
+// applies a range request on the clipped mp4, the part of the range that falls in the header is taken from the
+// header buffers, while the part that falls in the mdat is mapped directly to a range of the source file.
+// this way, seeking in the mdat does not require sending (or building, on clip header cache hit) the whole header
+static ngx_int_t
+ngx_http_vod_apply_clip_range(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_chain_t** out,
+	size_t response_size,
+	off_t range_start,
+	off_t range_end)
+{
+	media_clipper_parse_result_t* parse_result = ctx->clipper_parse_result;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_table_elt_t* content_range;
+	ngx_chain_t** ll;
+	ngx_chain_t* cl;
+	uint64_t first_offset;
+	off_t header_size;
+	off_t buf_start;
+	off_t buf_end;
+
+	header_size = response_size - (parse_result->last_offset - parse_result->first_offset);
+
+	// trim the header buffers
+	buf_start = 0;
+	ll = out;
+	for (cl = *out; cl != NULL; cl = cl->next)
+	{
+		buf_end = buf_start + (cl->buf->last - cl->buf->pos);
+		if (buf_end <= range_start || buf_start >= range_end)
+		{
+			buf_start = buf_end;
+			continue;
+		}
+
+		if (range_start > buf_start)
+		{
+			cl->buf->pos += range_start - buf_start;
+		}
+
+		if (range_end < buf_end)
+		{
+			cl->buf->last -= buf_end - range_end;
+		}
+
+		*ll = cl;
+		ll = &cl->next;
+		buf_start = buf_end;
+	}
+	*ll = NULL;
+
+	// map the mdat part to the source file
+	first_offset = parse_result->first_offset;
+	if (range_end <= header_size)
+	{
+		parse_result->last_offset = first_offset;
+	}
+	else
+	{
+		parse_result->last_offset = first_offset + (range_end - header_size);
+	}
+
+	if (range_start > header_size)
+	{
+		parse_result->first_offset = first_offset + (range_start - header_size);
+	}
+
+	// set the response headers
+	content_range = ngx_list_push(&r->headers_out.headers);
+	if (content_range == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_apply_clip_range: ngx_list_push failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	content_range->value.data = ngx_pnalloc(r->pool, sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+	if (content_range->value.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_apply_clip_range: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	content_range->hash = 1;
+	ngx_str_set(&content_range->key, "Content-Range");
+	content_range->value.len = ngx_sprintf(content_range->value.data, "bytes %O-%O/%O",
+		range_start, range_end - 1, (off_t)response_size) - content_range->value.data;
+
+	r->headers_out.content_range = content_range;
+	r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+	r->allow_ranges = 0;		// the range was applied, disable nginx's range filter
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_output_clip_header(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_chain_t* out,
+	size_t response_size,
+	ngx_str_t* content_type)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+	off_t content_length = response_size;
+	off_t range_start;
+	off_t range_end;
+
+	// Note: conditional (If-Range) and multi range requests are left to nginx's range filter,
+	//		in remote mode they are not supported, since the mdat is dumped from a subrequest
+	if (r->headers_in.range != NULL && 
+		(r->headers_in.if_range == NULL || 
+		ctx->submodule_context.conf->request_handler == ngx_http_vod_remote_request_handler))
+	{
+		rc = ngx_http_vod_range_parse(
+			&r->headers_in.range->value,
+			response_size,
+			&range_start,
+			&range_end);
+		if (rc == NGX_OK)
+		{
+			rc = ngx_http_vod_apply_clip_range(ctx, &out, response_size, range_start, range_end);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			content_length = range_end - range_start;
+		}
+		else if (ctx->submodule_context.conf->request_handler == ngx_http_vod_remote_request_handler)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_output_clip_header: failed to parse range header \"%V\"",
+				&r->headers_in.range->value);
+			return rc;
+		}
+	}
+
+	// send the response header
+	rc = ngx_http_vod_send_header(r, content_length, content_type, MEDIA_SET_VOD, NULL);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_DONE;
+	}
+
+	if (out == NULL)
+	{
+		// the range falls entirely in the mdat
+		return NGX_OK;
+	}
+
+	rc = ngx_http_output_filter(r, out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_output_clip_header: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+
+	return NGX_OK;
+}
+
+// sends the clipped mp4 header from the clip header cache, without reading the metadata of the source.
+// returns NGX_DECLINED on cache miss
+static ngx_int_t
+ngx_http_vod_clip_header_cache_fetch(ngx_http_vod_ctx_t *ctx)
+{
+	clip_header_cache_header_t cache_header;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->clip_header_cache;
+	ngx_chain_t* out;
+	ngx_str_t cache_buffer;
+	ngx_str_t content_type;
+	ngx_buf_t* b;
+	u_char key[MEDIA_CLIP_KEY_SIZE];
+
+	if (cache == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_http_vod_get_clip_header_cache_key(ctx, key);
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ctx->perf_counters,
+		&cache,
+		1,
+		key,
+		&cache_buffer) < 0 ||
+		cache_buffer.len <= sizeof(cache_header))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_clip_header_cache_fetch: clip header cache miss");
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_CLIP_HEADER, 0);
+		return NGX_DECLINED;
+	}
+
+	ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_CLIP_HEADER, 1);
+
+	ngx_memcpy(&cache_header, cache_buffer.data, sizeof(cache_header));
+	if (cache_buffer.len - sizeof(cache_header) <= cache_header.content_type_len ||
+		cache_header.first_offset > cache_header.last_offset)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_clip_header_cache_fetch: invalid cached header, size %uz", cache_buffer.len);
+		return NGX_DECLINED;
+	}
+
+	content_type.data = cache_buffer.data + sizeof(cache_header);
+	content_type.len = cache_header.content_type_len;
+
+	ctx->clipper_parse_result = ngx_pcalloc(r->pool, sizeof(*ctx->clipper_parse_result));
+	b = ngx_calloc_buf(r->pool);
+	out = ngx_alloc_chain_link(r->pool);
+	if (ctx->clipper_parse_result == NULL || b == NULL || out == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_clip_header_cache_fetch: alloc failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
+
+	ctx->clipper_parse_result->first_offset = cache_header.first_offset;
+	ctx->clipper_parse_result->last_offset = cache_header.last_offset;
+
+	b->pos = content_type.data + content_type.len;
+	b->last = cache_buffer.data + cache_buffer.len;
+	b->temporary = 1;
+
+	out->buf = b;
+	out->next = NULL;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_clip_header_cache_fetch: clip header cache hit, size is %uz", (size_t)(b->last - b->pos));
+
+	return ngx_http_vod_output_clip_header(ctx, out, cache_header.response_size, &content_type);
+}
+
+static ngx_int_t
+ngx_http_vod_send_clip_header(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_chain_t* out;
+	size_t response_size;
+	ngx_str_t content_type;
+	ngx_int_t rc;
+
+	rc = ctx->format->clipper_build_header(
+		&ctx->submodule_context.request_context,
+		ctx->metadata_parts,
+		ctx->metadata_part_count,
+		ctx->clipper_parse_result,
+		&out,
+		&response_size, 
+		&content_type);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_send_clip_header: clipper_build_header(%V) failed %i", &ctx->format->name, rc);
+		return ngx_http_vod_status_to_ngx_error(r, rc);
+	}
+
+	if (ctx->submodule_context.conf->clip_header_cache != NULL)
+	{
+		ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+		ngx_http_vod_clip_header_cache_store(ctx, out, response_size, &content_type);
+	}
+
+	return ngx_http_vod_output_clip_header(ctx, out, response_size, &content_type);
+}
+
+////// Common
+
+static ngx_flag_t
+ngx_http_vod_generator_matches(
+	media_parse_params_t* parse_params,
+	media_generator_t* generator)
+{
+	uint32_t media_type;
+
+	if ((parse_params->codecs_mask & generator->codec_mask) == 0)
+	{
+		return 0;
+	}
+
+	for (media_type = 0; media_type < MEDIA_TYPE_COUNT; media_type++)
+	{
+		if ((parse_params->required_tracks_mask[media_type] & generator->track_mask[media_type]) != 0)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static ngx_int_t
+ngx_http_vod_run_generators(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	media_parse_params_t parse_params;
+	media_generator_t* generator;
+	media_range_t range;
+	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
+	ngx_int_t rc;
+
+	for (cur_source = ctx->submodule_context.media_set.generators_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		ctx->cur_source = cur_source;
+
+		if (cur_source->clip_to >= UINT_MAX)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_run_generators: unbounded generator source");
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+		}
+
+		parse_params.clip_to = cur_source->clip_to;
+		parse_params.clip_from = 0;
+
+		ngx_http_vod_init_parse_params_metadata(ctx, tracks_mask, &parse_params);
+
+		// Note: currently, the only generator is the silence generator
+		generator = &silence_generator;
+
+		if (!ngx_http_vod_generator_matches(
+			&parse_params,
+			generator))
+		{
+			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
+			continue;
+		}
+
+		if (parse_params.langs_mask != NULL &&
+			!vod_is_bit_set(parse_params.langs_mask, cur_source->sequence->language))
+		{
+			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
+			continue;
+		}
+
+		rc = ngx_http_vod_init_parse_params_frames(
+			ctx,
+			&range,
+			&parse_params);
+		switch (rc)
+		{
+		case NGX_OK:
+			break;		// handled outside the switch
+
+		case NGX_DONE:
+			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
+			continue;
+
+		default:
+			return rc;
+		}
+
+		rc = generator->generate(
+			&ctx->submodule_context.request_context,
+			&parse_params,
+			&cur_source->track_array);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_run_generators: generator failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+		}
+
+		ngx_http_vod_update_source_tracks(&ctx->submodule_context.request_context, ctx->cur_source);
+	}
+
+	ctx->cur_source = NULL;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
+{
+	audio_filter_cache_t* audio_filter_cache;
+	ngx_int_t rc;
+	uint32_t max_frame_count;
+	uint32_t output_codec_id;
+
+	ngx_vod_probe2(state_machine, ctx->submodule_context.r, ctx->state);
+
+	switch (ctx->state)
+	{
+	case STATE_READ_DRM_INFO:
+		rc = ngx_http_vod_state_machine_get_drm_info(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		ctx->state = STATE_READ_METADATA_INITIAL;
+		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+		// fall through
+
+	case STATE_READ_METADATA_INITIAL:
+	case STATE_READ_METADATA_PARSE_CACHED:
+	case STATE_READ_METADATA_RESUME:
+	case STATE_READ_METADATA_OPEN_FILE:
+	case STATE_READ_METADATA_READ:
+	case STATE_READ_METADATA_PARSE:
+	case STATE_PREFETCH_METADATA:
+	case STATE_READ_FRAMES_OPEN_FILE:
+	case STATE_READ_FRAMES_READ:
+
+		// try the clip header cache before reading the metadata
+		if (ctx->request == NULL &&
+			!ctx->warmup &&
+			ctx->state == STATE_READ_METADATA_INITIAL &&
+			ctx->cur_source == ctx->submodule_context.media_set.sources_head)
+		{
+			rc = ngx_http_vod_clip_header_cache_fetch(ctx);
+			switch (rc)
+			{
+			case NGX_OK:
+				ctx->state = STATE_OPEN_FILE;
+				return ngx_http_vod_run_state_machine(ctx);
+
+			case NGX_DONE:
+				return NGX_OK;
+
+			case NGX_DECLINED:
+				break;
+
+			default:
+				return rc;
+			}
+		}
+
+		rc = ngx_http_vod_state_machine_parse_metadata(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		if (ctx->warmup)
+		{
+			// the metadata is in the caches, nothing to send
+			return NGX_HTTP_NO_CONTENT;
+		}
+
+		if (ctx->request == NULL)
+		{
+			rc = ngx_http_vod_send_clip_header(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc == NGX_DONE)
+				{
+					rc = NGX_OK;
+				}
+				else
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: ngx_http_vod_send_clip_header failed %i", rc);
+				}
+				return rc;
+			}
+		}
+		else
+		{
+			rc = ngx_http_vod_run_generators(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			rc = filter_init_filtered_clips(
+				&ctx->submodule_context.request_context,
+				&ctx->submodule_context.media_set, 
+				(ctx->request->parse_type & PARSE_FLAG_FRAMES_DURATION) != 0);
+			if (rc != VOD_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: filter_init_filtered_clips failed %i", rc);
+				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+			}
+
+			rc = ngx_http_vod_validate_streams(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// handle metadata requests
+			if (ctx->request->handle_metadata_request != NULL)
+			{
+				return ngx_http_vod_handle_metadata_request(ctx);
+			}
+
+			// initialize the read cache
+			read_cache_init(
+				&ctx->read_cache_state,
+				&ctx->submodule_context.request_context,
+				ctx->submodule_context.conf->cache_buffer_size,
+				ctx->submodule_context.conf->max_coalesced_read_size);
+
+			// try the segment cache before opening the files
+			rc = ngx_http_vod_segment_cache_fetch(ctx);
+			if (rc != NGX_DECLINED)
+			{
+				return rc;
+			}
+
+#if (NGX_HTTP_VOD_PREFETCH)
+			if (ctx->submodule_context.conf->prefetch_sibling_segments)
+			{
+				ngx_http_vod_prefetch_sibling_segments(ctx);
+			}
+#endif // NGX_HTTP_VOD_PREFETCH
+
+			rc = ngx_http_vod_segment_frames_cache_fetch(ctx);
+			switch (rc)
+			{
+			case NGX_OK:
+				// the frames are read from memory, no need to open the files
+				ctx->state = STATE_FILTER_FRAMES;
+				return ngx_http_vod_run_state_machine(ctx);
+
+			case NGX_DECLINED:
+				break;
+
+			default:
+				return rc;
+			}
+		}
+
+		ctx->state = STATE_OPEN_FILE;
+		ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+		// fall through
+
+	case STATE_OPEN_FILE:
+		rc = ngx_http_vod_state_machine_open_files(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		// enable directio if enabled in the configuration (ignore errors)
+		// Note that directio is set on transfer only to allow the kernel to cache the "moov" atom
+		ngx_http_vod_enable_directio(ctx);
+
+		if (ctx->request == NULL)
+		{
+			if (ctx->clipper_parse_result->first_offset < ctx->clipper_parse_result->last_offset)
+			{
+				ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+
+				ctx->state = STATE_DUMP_FILE_PART;
+
+				rc = ctx->cur_source->reader->dump_part(
+					ctx->cur_source->reader_context,
+					ctx->clipper_parse_result->first_offset,
+					ctx->clipper_parse_result->last_offset);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+			}
+
+			rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
+			if (rc != NGX_OK && rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
+				return rc;
+			}
+
+			return NGX_OK;
+		}
+
+		if (ctx->submodule_context.conf->max_coalesced_read_size != 0)
+		{
+			rc = ngx_http_vod_init_read_ranges(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		if (ctx->submodule_context.media_set.audio_filtering_needed)
+		{
+			// audio filtering may be low priority even when the request class is not
+			if (!ngx_http_vod_admission_is_low_priority(ctx->submodule_context.r, ctx->admission_class) &&
+				ngx_http_vod_admission_is_low_priority(ctx->submodule_context.r, ADMISSION_CLASS_AUDIO_FILTER))
+			{
+				rc = ngx_http_vod_admission_acquire(ctx->submodule_context.r);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				ctx->admission_class |= ADMISSION_CLASS_AUDIO_FILTER;
+			}
+
+			// initialize the filtering of audio frames
+			ctx->state = STATE_FILTER_FRAMES;
+			ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+
+			if ((ctx->request->request_class & (REQUEST_CLASS_MANIFEST | REQUEST_CLASS_OTHER)) != 0)
+			{
+				max_frame_count = NON_SEGMENT_REQUEST_MAX_FRAME_COUNT;
+			}
+			else
+			{
+				max_frame_count = SEGMENT_REQUEST_MAX_FRAME_COUNT;
+			}
+
+#if (NGX_HAVE_LIB_AV_CODEC)
+			if (ctx->submodule_context.conf->submodule.name == volume_map.name)
+			{
+				output_codec_id = VOD_CODEC_ID_VOLUME_MAP;
+			}
+			else
+#endif // NGX_HAVE_LIB_AV_CODEC
+			{
+				output_codec_id = VOD_CODEC_ID_AAC;
+			}
+
+			if (ctx->submodule_context.conf->audio_filter_cache != NULL)
+			{
+				ctx->audio_filter_cache.context = ctx;
+				ctx->audio_filter_cache.fetch = ngx_http_vod_audio_filter_cache_fetch;
+				ctx->audio_filter_cache.store = ngx_http_vod_audio_filter_cache_store;
+				audio_filter_cache = &ctx->audio_filter_cache;
+			}
+			else
+			{
+				audio_filter_cache = NULL;
+			}
+
+			rc = filter_init_state(
+				&ctx->submodule_context.request_context,
+				&ctx->read_cache_state,
+				&ctx->submodule_context.media_set,
+				max_frame_count,
+				output_codec_id,
+				audio_filter_cache,
+				&ctx->frame_processor_state);
+			if (rc != VOD_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: filter_init_state failed %i", rc);
+				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
+			}
+
+			ctx->frame_processor = filter_run_state_machine;
+		}
+
+		// fall through
+
+	case STATE_FILTER_FRAMES:
+		// if audio filtering already started, process frames
+		if (ctx->frame_processor != NULL)
+		{
+			rc = ngx_http_vod_process_media_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		// initialize the processing of the video/audio frames
+		rc = ngx_http_vod_init_frame_processing(ctx);
+		if (rc != NGX_OK)
+		{
+			if (rc == NGX_DONE)
+			{
+				rc = NGX_OK;
+			}
+			else
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_vod_init_frame_processing failed %i", rc);
+			}
+			return rc;
+		}
+
+		if (ctx->frame_processor_state == NULL)
+		{
+			return ngx_http_vod_finalize_segment_response(ctx);
+		}
+
+		ctx->submodule_context.request_context.log->action = "processing frames";
+
+		if (ctx->submodule_context.conf->parallel_frame_reads &&
+			ctx->segment_writer.write_file == NULL)
+		{
+			rc = ngx_http_vod_prefetch_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: ngx_http_vod_prefetch_frames failed %i", rc);
+				}
+				return rc;
+			}
+		}
+
+		ctx->state = STATE_PROCESS_FRAMES;
+		// fall through
+
+	case STATE_PREFETCH_FRAMES:
+		if (ctx->state == STATE_PREFETCH_FRAMES)
+		{
+			if (ctx->prefetch_join.rc != NGX_OK)
+			{
+				return ctx->prefetch_join.rc;
+			}
+
+			ngx_http_vod_prefetch_completed(ctx);
+			ctx->state = STATE_PROCESS_FRAMES;
+		}
+		// fall through
+
+	case STATE_PROCESS_FRAMES:
+		rc = ngx_http_vod_process_media_frames(ctx);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_vod_process_media_frames failed %i", rc);
+			}
+			return rc;
+		}
+
+		ngx_http_vod_advise_page_cache(ctx);
+
+		return ngx_http_vod_finalize_segment_response(ctx);
+
+	case STATE_DUMP_OPEN_FILE:
+		return ctx->cur_source->reader->dump_request(ctx->cur_source->reader_context);
+
+	case STATE_DUMP_FILE_PART:
+		rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
+			return rc;
+		}
+
+		return NGX_OK;
+	}
+
+	ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_run_state_machine: invalid state %d", ctx->state);
+	return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_UNEXPECTED);
+}
+
+static void
+ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	ssize_t expected_size;
+
+	if (ctx->state == STATE_PREFETCH_FRAMES || ctx->state == STATE_PREFETCH_METADATA)
+	{
+		// Note: the initial metadata read may return an empty buffer (e.g. an empty srt file)
+		if (rc != NGX_OK || (bytes_read <= 0 && ctx->state == STATE_PREFETCH_FRAMES))
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_read_completed: prefetch read failed %i, bytes read %z", rc, bytes_read);
+			if (rc == NGX_OK)
+			{
+				rc = ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
+			}
+		}
+
+		ngx_http_vod_join_complete(&ctx->prefetch_join, rc);
+		if (!ngx_http_vod_join_done(&ctx->prefetch_join))
+		{
+			// other reads are still in progress
+			ctx->submodule_context.r->aio = 1;
+			return;
+		}
+
+		ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+
+		rc = ctx->state_machine(ctx);
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
+
+		goto finalize_request;
+	}
 
-	// send the response header
-	rc = ngx_http_vod_send_header(r, ctx->write_segment_buffer_context.total_size, NULL, MEDIA_SET_VOD, NULL);
 	if (rc != NGX_OK)
 	{
-		return rc;
+		if (rc == NGX_AGAIN)
+		{
+			ngx_http_finalize_request(ctx->submodule_context.r, rc);
+			return;
+		}
+
+		if (ctx->state == STATE_MAP_READ && 
+			ctx->mapping.stale_retries > 0 && 
+			errno == ESTALE)
+		{
+			ctx->mapping.stale_retries--;
+			ctx->state = STATE_MAP_INITIAL;
+
+			rc = ctx->state_machine(ctx);
+			if (rc == NGX_AGAIN)
+			{
+				return;
+			}
+
+			goto finalize_request;
+		}
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_read_completed: read failed %i", rc);
+		ngx_http_vod_frames_read_done(ctx, NULL);
+		goto finalize_request;
 	}
 
-	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	if (ctx->state == STATE_DUMP_FILE_PART)
 	{
-		return NGX_OK;
+		expected_size = ctx->clipper_parse_result->last_offset - ctx->clipper_parse_result->first_offset;
+		if (bytes_read != expected_size)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_read_completed: read size %z different than expected %z, probably a truncated file", 
+				bytes_read, expected_size);
+			rc = ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
+			goto finalize_request;
+		}
 	}
+	else if (bytes_read <= 0)
+	{
+		switch (ctx->state)
+		{
+		case STATE_MAP_READ:		// the mapping state machine handles the case of empty mapping
+			break;
 
-	// send the response buffer chain
-	rc = ngx_http_output_filter(r, &ctx->out);
-	if (rc != NGX_OK && rc != NGX_AGAIN)
+		case STATE_READ_METADATA_READ:
+			if ((ctx->read_flags & MEDIA_READ_FLAG_ALLOW_EMPTY_READ) != 0)
+			{
+				break;
+			}
+			// fall through
+
+		default:
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_read_completed: bytes read is zero");
+			rc = ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
+			goto finalize_request;
+		}
+	}
+
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+
+	switch (ctx->state)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_finalize_segment_response: ngx_http_output_filter failed %i", rc);
-		return rc;
+	case STATE_FILTER_FRAMES:
+	case STATE_PROCESS_FRAMES:
+		if (buf == NULL)
+		{
+			buf = &ctx->read_buffer;
+		}
+		ngx_http_vod_frames_read_done(ctx, buf);
+		ctx->frames_bytes_read += (buf->last - buf->pos);
+		ngx_http_vod_update_bytes_read(ctx, buf->last - buf->pos);
+		read_cache_read_completed(&ctx->read_cache_state, buf);
+		break;
+
+	case STATE_MAP_READ:
+		if (buf != NULL)
+		{
+			ctx->read_buffer = *buf;
+		}
+		break;
+
+	default:
+		if (buf != NULL)
+		{
+			ctx->read_buffer = *buf;
+		}
+		ngx_http_vod_update_bytes_read(ctx, ctx->read_buffer.last - ctx->read_buffer.pos);
+		break;
 	}
-	return NGX_OK;
+
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+finalize_request:
+
+	ngx_http_vod_finalize_request(ctx, rc);
 }
 
-////// Audio filtering
+static void
+ngx_http_vod_init_file_key(media_clip_source_t* cur_source, ngx_str_t* prefix, ngx_uint_t hash_type)
+{
+	ngx_cache_key_t hash;
+
+	ngx_cache_key_init(&hash, hash_type);
+	if (prefix != NULL)
+	{
+		ngx_cache_key_update(&hash, prefix->data, prefix->len);
+	}
+	ngx_cache_key_update(&hash, cur_source->mapped_uri.data, cur_source->mapped_uri.len);
+	ngx_cache_key_final(cur_source->file_key, &hash);
+}
 
+// prev_seed holds the seed of the previous sequence, its data is NULL for the first sequence
 static ngx_int_t
-ngx_http_vod_init_process(ngx_cycle_t *cycle)
+ngx_http_vod_init_encryption_key(
+	ngx_http_request_t *r, 
+	ngx_http_vod_loc_conf_t* conf, 
+	media_sequence_t* cur_sequence,
+	ngx_str_t* prev_seed)
 {
-	vod_status_t rc;
-
-	audio_filter_process_init(cycle->log);
+	ngx_str_t encryption_key_seed;
+	ngx_md5_t md5;
 
-#if (NGX_HAVE_LIB_AV_CODEC)
-	audio_decoder_process_init(cycle->log);
-	audio_encoder_process_init(cycle->log);
-	thumb_grabber_process_init(cycle->log);
-#endif // NGX_HAVE_LIB_AV_CODEC
+	if (conf->secret_key != NULL)
+	{
+		// calculate the encryption key seed
+		if (ngx_http_complex_value(
+			r,
+			conf->secret_key,
+			&encryption_key_seed) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_encryption_key: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
+	}
+	else
+	{
+		encryption_key_seed = cur_sequence->mapped_uri;
+	}
 
-	rc = language_code_process_init(cycle->pool, cycle->log);
-	if (rc != VOD_OK)
+	// sequences that have the same seed (e.g. the secret key does not depend on the sequence) share the key
+	if (prev_seed->data != NULL &&
+		prev_seed->len == encryption_key_seed.len &&
+		ngx_memcmp(prev_seed->data, encryption_key_seed.data, encryption_key_seed.len) == 0)
 	{
-		return NGX_ERROR;
+		ngx_memcpy(cur_sequence->encryption_key, cur_sequence[-1].encryption_key, sizeof(cur_sequence->encryption_key));
+		return NGX_OK;
 	}
 
-	return NGX_OK;
-}
+	// hash the seed to get the key
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, encryption_key_seed.data, encryption_key_seed.len);
+	ngx_md5_final(cur_sequence->encryption_key, &md5);
 
-static void 
-ngx_http_vod_exit_process()
-{
-#if (VOD_HAVE_ICONV)
-	webvtt_exit_process();
-#endif // VOD_HAVE_ICONV
+	*prev_seed = encryption_key_seed;
 
-#if (NGX_HAVE_LIBXML2)
-	dfxp_exit_process();
-#endif // NGX_HAVE_LIBXML2
+	return NGX_OK;
 }
 
-////// Clipping
-
 static ngx_int_t
-ngx_http_vod_send_clip_header(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_start_processing_media_file(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_chain_t* out;
-	uint64_t first_offset;
-	uint64_t last_offset;
-	size_t response_size;
-	ngx_str_t content_type;
+	ngx_http_vod_loc_conf_t* conf;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t *r;
+	ngx_str_t prev_seed;
 	ngx_int_t rc;
-	off_t range_start;
-	off_t range_end;
-	off_t header_size;
-	off_t mdat_size;
-
-	rc = ctx->format->clipper_build_header(
-		&ctx->submodule_context.request_context,
-		ctx->metadata_parts,
-		ctx->metadata_part_count,
-		ctx->clipper_parse_result,
-		&out,
-		&response_size, 
-		&content_type);
-	if (rc != VOD_OK)
-	{
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_send_clip_header: clipper_build_header(%V) failed %i", &ctx->format->name, rc);
-		return ngx_http_vod_status_to_ngx_error(r, rc);
-	}
 
-	// send the response header
-	rc = ngx_http_vod_send_header(r, response_size, &content_type, MEDIA_SET_VOD, NULL);
-	if (rc != NGX_OK)
-	{
-		return rc;
-	}
+	// update request flags
+	r = ctx->submodule_context.r;
+	r->root_tested = !r->error_page;
+	r->allow_ranges = 1;
 
-	if (r->header_only || r->method == NGX_HTTP_HEAD)
-	{
-		return NGX_DONE;
-	}
+	// set the state machine
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	ctx->state_machine = ngx_http_vod_run_state_machine;
 
-	rc = ngx_http_output_filter(r, out);
-	if (rc != NGX_OK && rc != NGX_AGAIN)
-	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_send_clip_header: ngx_http_output_filter failed %i", rc);
-		return rc;
-	}
+	cur_source = ctx->submodule_context.media_set.sources_head;
 
-	if (ctx->submodule_context.conf->request_handler == ngx_http_vod_remote_request_handler && 
-		ctx->submodule_context.r->headers_in.range)
+	// handle serve requests
+	if (ctx->request == NULL &&
+		!ctx->warmup &&
+		cur_source->clip_from == 0 &&
+		cur_source->clip_to == ULLONG_MAX &&
+		cur_source->tracks_mask[MEDIA_TYPE_AUDIO] == 0xffffffff &&
+		cur_source->tracks_mask[MEDIA_TYPE_VIDEO] == 0xffffffff)
 	{
-		// in case of range request in remote mode, apply the requested range to the mdat dump offsets.
-		// nginx's range filter module does not touch the dumped part since it is written in the context
-		// a subrequest. 
+		ctx->state = STATE_DUMP_OPEN_FILE;
 
-		// TODO: apply the range on the mp4 header as well and return 206, to avoid making assumptions on
-		//		nginx subrequest/range filter implementations
+		ctx->cur_source = cur_source;
 
-		rc = ngx_http_vod_range_parse(
-			&ctx->submodule_context.r->headers_in.range->value,
-			response_size,
-			&range_start,
-			&range_end);
+		rc = ngx_http_vod_open_file(ctx, cur_source);
 		if (rc != NGX_OK)
 		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_send_clip_header: failed to parse range header \"%V\"",
-				&ctx->submodule_context.r->headers_in.range->value);
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_start_processing_media_file: open_file failed %i", rc);
+			}
 			return rc;
 		}
 
-		first_offset = ctx->clipper_parse_result->first_offset;
-		last_offset = ctx->clipper_parse_result->last_offset;
+		return cur_source->reader->dump_request(cur_source->reader_context);
+	}
 
-		mdat_size = last_offset - first_offset;
-		header_size = response_size - mdat_size;
+	// initialize the file keys
+	conf = ctx->submodule_context.conf;
 
-		if (range_end < header_size)
-		{
-			last_offset = 0;
-		}
-		else if (mdat_size > range_end - header_size)
+	for (; cur_source != NULL; cur_source = cur_source->next)
+	{
+		ngx_http_vod_init_file_key(cur_source, ctx->file_key_prefix, conf->cache_key_hash);
+
+		// track the popularity of the titles, prefetch / warmup requests do not reflect viewer demand
+		if (conf->popularity_zone != NULL && !ctx->prefetch && !ctx->warmup)
 		{
-			last_offset = first_offset + range_end - header_size;
+			ngx_popularity_increment(conf->popularity_zone, cur_source->file_key, &cur_source->mapped_uri);
 		}
+	}
 
-		if (range_start > header_size)
+	// prefetching the segments of unpopular files is not worth the extra load
+	if (ctx->prefetch)
+	{
+		for (cur_source = ctx->submodule_context.media_set.sources_head;
+			cur_source != NULL;
+			cur_source = cur_source->next)
 		{
-			first_offset += range_start - header_size;
+			if (ngx_http_vod_get_source_popularity(ctx, cur_source) == POPULARITY_COLD)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_start_processing_media_file: skipping the prefetch of a cold file");
+				return NGX_HTTP_NO_CONTENT;
+			}
 		}
-
-		ctx->clipper_parse_result->first_offset = first_offset;
-		ctx->clipper_parse_result->last_offset = last_offset;
 	}
 
-	return NGX_OK;
-}
+	// initialize the uri / encryption keys
+	if (conf->drm_enabled || conf->secret_key != NULL)
+	{
+		ngx_str_null(&prev_seed);
 
-////// Common
+		for (ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+			ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
+			ctx->cur_sequence++)
+		{
+			rc = ngx_http_vod_init_encryption_key(r, conf, ctx->cur_sequence, &prev_seed);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+	}
 
-static ngx_flag_t
-ngx_http_vod_generator_matches(
-	media_parse_params_t* parse_params,
-	media_generator_t* generator)
-{
-	uint32_t media_type;
+	// restart the file index/uri params
+	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
 
-	if ((parse_params->codecs_mask & generator->codec_mask) == 0)
+	if (ctx->submodule_context.conf->drm_enabled)
 	{
-		return 0;
+		ctx->state = STATE_READ_DRM_INFO;
+		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
 	}
-
-	for (media_type = 0; media_type < MEDIA_TYPE_COUNT; media_type++)
+	else
 	{
-		if ((parse_params->required_tracks_mask[media_type] & generator->track_mask[media_type]) != 0)
-		{
-			return 1;
-		}
+		ctx->state = STATE_READ_METADATA_INITIAL;
 	}
 
-	return 0;
+	return ngx_http_vod_run_state_machine(ctx);
 }
 
+////// Local & mapped modes
+
 static ngx_int_t
-ngx_http_vod_run_generators(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_map_uris_to_paths(ngx_http_vod_ctx_t *ctx)
 {
 	media_clip_source_t* cur_source;
-	media_parse_params_t parse_params;
-	media_generator_t* generator;
-	media_range_t range;
-	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
-	ngx_int_t rc;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_str_t original_uri;
+	u_char *last;
+	size_t root;
+	ngx_str_t path;
 
-	for (cur_source = ctx->submodule_context.media_set.generators_head;
+	original_uri = r->uri;
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
 		cur_source != NULL;
 		cur_source = cur_source->next)
 	{
 		ctx->cur_source = cur_source;
-
-		if (cur_source->clip_to >= UINT_MAX)
+		r->uri = cur_source->stripped_uri;
+		last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+		r->uri = original_uri;
+		if (last == NULL)
 		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_run_generators: unbounded generator source");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_map_uris_to_paths: ngx_http_map_uri_to_path failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
 		}
 
-		parse_params.clip_to = cur_source->clip_to;
-		parse_params.clip_from = 0;
+		path.len = last - path.data;
 
-		ngx_http_vod_init_parse_params_metadata(ctx, tracks_mask, &parse_params);
+		cur_source->mapped_uri = path;
+	}
 
-		// Note: currently, the only generator is the silence generator
-		generator = &silence_generator;
+	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
 
-		if (!ngx_http_vod_generator_matches(
-			&parse_params,
-			generator))
-		{
-			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
-			continue;
-		}
+	return NGX_OK;
+}
 
-		if (parse_params.langs_mask != NULL &&
-			!vod_is_bit_set(parse_params.langs_mask, cur_source->sequence->language))
-		{
-			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
-			continue;
-		}
+static ngx_int_t
+ngx_http_vod_dump_request_to_fallback(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_child_request_params_t child_params;
 
-		rc = ngx_http_vod_init_parse_params_frames(
-			ctx,
-			&range,
-			&parse_params);
-		switch (rc)
-		{
-		case NGX_OK:
-			break;		// handled outside the switch
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
 
-		case NGX_DONE:
-			ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
-			continue;
+	if (conf->fallback_upstream_location.len == 0)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_dump_request_to_fallback: no fallback configured");
+		return NGX_ERROR;
+	}
 
-		default:
-			return rc;
-		}
+	if (ngx_http_vod_header_exists(r, &conf->proxy_header.key))
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_dump_request_to_fallback: proxy header exists");
+		return NGX_ERROR;
+	}
+
+	// dump the request to the fallback upstream
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = r->method;
+	child_params.base_uri = r->uri;
+	child_params.extra_args = r->args;
+	child_params.extra_header = conf->proxy_header;
+	child_params.proxy_range = 1;
+	child_params.proxy_all_headers = 1;
+
+	return ngx_child_request_start(
+		r,
+		NULL,
+		NULL,
+		&conf->fallback_upstream_location,
+		&child_params,
+		NULL);
+}
+
+// checks whether the file was recently found missing, by any worker. when it was, the request is forwarded
+// to the fallback without trying to open the file
+static ngx_flag_t
+ngx_http_vod_fallback_cache_fetch(ngx_http_vod_ctx_t *ctx, ngx_str_t* path)
+{
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->fallback_cache;
+	ngx_str_t buffer;
+	uint32_t token;
+	ngx_cache_key_t hash;
 
-		rc = generator->generate(
-			&ctx->submodule_context.request_context,
-			&parse_params,
-			&cur_source->track_array);
-		if (rc != VOD_OK)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_run_generators: generator failed %i", rc);
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
-		}
+	if (cache == NULL)
+	{
+		return 0;
+	}
 
-		ngx_http_vod_update_source_tracks(&ctx->submodule_context.request_context, ctx->cur_source);
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	ngx_cache_key_update(&hash, path->data, path->len);
+	ngx_cache_key_final(ctx->fallback_key, &hash);
+
+	if (!ngx_buffer_cache_fetch_perf(ctx->perf_counters, cache, ctx->fallback_key, &buffer, &token))
+	{
+		return 0;
 	}
 
-	ctx->cur_source = NULL;
+	ngx_buffer_cache_release(cache, ctx->fallback_key, token);
 
-	return NGX_OK;
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_fallback_cache_fetch: file %V is known to be missing", path);
+
+	return 1;
 }
 
-static ngx_int_t
-ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
+static void
+ngx_http_vod_fallback_cache_store(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_int_t rc;
-	uint32_t max_frame_count;
-	uint32_t output_codec_id;
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->fallback_cache;
 
-	switch (ctx->state)
+	if (cache == NULL)
 	{
-	case STATE_READ_DRM_INFO:
-		rc = ngx_http_vod_state_machine_get_drm_info(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+		return;
+	}
 
-		ctx->state = STATE_READ_METADATA_INITIAL;
-		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
-		// fall through
+	// Note: the key was calculated by ngx_http_vod_fallback_cache_fetch before opening the file
+	if (!ngx_buffer_cache_store_perf(ctx->perf_counters, cache, ctx->fallback_key, 0, (u_char*)"1", 1))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fallback_cache_store: failed to store in cache");
+	}
+}
 
-	case STATE_READ_METADATA_INITIAL:
-	case STATE_READ_METADATA_OPEN_FILE:
-	case STATE_READ_METADATA_READ:
-	case STATE_READ_FRAMES_OPEN_FILE:
-	case STATE_READ_FRAMES_READ:
+#if (NGX_THREADS)
+static void
+ngx_http_vod_file_open_completed_internal(void* context, ngx_int_t rc, ngx_flag_t fallback)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
 
-		rc = ngx_http_vod_state_machine_parse_metadata(ctx);
-		if (rc != NGX_OK)
+	if (rc != NGX_OK)
+	{
+		if (fallback && rc == NGX_HTTP_NOT_FOUND)
 		{
-			return rc;
-		}
+			ngx_http_vod_fallback_cache_store(ctx);
 
-		if (ctx->request == NULL)
-		{
-			rc = ngx_http_vod_send_clip_header(ctx);
-			if (rc != NGX_OK)
+			// try the fallback
+			rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
+			if (rc == NGX_AGAIN)
 			{
-				if (rc == NGX_DONE)
-				{
-					rc = NGX_OK;
-				}
-				else
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_run_state_machine: ngx_http_vod_send_clip_header failed %i", rc);
-				}
-				return rc;
+				return;
 			}
+
+			rc = NGX_HTTP_NOT_FOUND;
+			goto finalize_request;
 		}
-		else
-		{
-			rc = ngx_http_vod_run_generators(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
 
-			rc = filter_init_filtered_clips(
-				&ctx->submodule_context.request_context,
-				&ctx->submodule_context.media_set, 
-				(ctx->request->parse_type & PARSE_FLAG_FRAMES_DURATION) != 0);
-			if (rc != VOD_OK)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: filter_init_filtered_clips failed %i", rc);
-				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
-			}
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.r->connection->log, 0,
+			"ngx_http_vod_file_open_completed_internal: read failed %i", rc);
+		goto finalize_request;
+	}
 
-			rc = ngx_http_vod_validate_streams(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
 
-			// handle metadata requests
-			if (ctx->request->handle_metadata_request != NULL)
-			{
-				return ngx_http_vod_handle_metadata_request(ctx);
-			}
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
 
-			// initialize the read cache
-			read_cache_init(
-				&ctx->read_cache_state,
-				&ctx->submodule_context.request_context,
-				ctx->submodule_context.conf->cache_buffer_size);
-		}
+finalize_request:
 
-		ctx->state = STATE_OPEN_FILE;
-		ctx->cur_source = ctx->submodule_context.media_set.sources_head;
-		// fall through
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
-	case STATE_OPEN_FILE:
-		rc = ngx_http_vod_state_machine_open_files(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+static void
+ngx_http_vod_parallel_open_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
 
-		// enable directio if enabled in the configuration (ignore errors)
-		// Note that directio is set on transfer only to allow the kernel to cache the "moov" atom
-		ngx_http_vod_enable_directio(ctx);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.r->connection->log, 0,
+			"ngx_http_vod_parallel_open_completed: open failed %i", rc);
+	}
 
-		if (ctx->request == NULL)
-		{
-			if (ctx->clipper_parse_result->first_offset < ctx->clipper_parse_result->last_offset)
-			{
-				ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	ngx_http_vod_join_complete(&ctx->open_join, rc);
+	if (!ngx_http_vod_join_done(&ctx->open_join))
+	{
+		// other opens are still in progress
+		ctx->submodule_context.r->aio = 1;
+		return;
+	}
 
-				ctx->state = STATE_DUMP_FILE_PART;
+	if (ctx->open_join.rc != NGX_OK)
+	{
+		ngx_http_vod_finalize_request(ctx, ctx->open_join.rc);
+		return;
+	}
 
-				rc = ctx->cur_source->reader->dump_part(
-					ctx->cur_source->reader_context,
-					ctx->clipper_parse_result->first_offset,
-					ctx->clipper_parse_result->last_offset);
-				if (rc != NGX_OK)
-				{
-					return rc;
-				}
-			}
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
 
-			rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
-			if (rc != NGX_OK && rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
-				return rc;
-			}
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
 
-			return NGX_OK;
-		}
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
-		if (ctx->submodule_context.media_set.audio_filtering_needed)
-		{
-			// initialize the filtering of audio frames
-			ctx->state = STATE_FILTER_FRAMES;
-			ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+static void
+ngx_http_vod_file_open_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_file_open_completed_internal(context, rc, 0);
+}
 
-			if ((ctx->request->request_class & (REQUEST_CLASS_MANIFEST | REQUEST_CLASS_OTHER)) != 0)
-			{
-				max_frame_count = NON_SEGMENT_REQUEST_MAX_FRAME_COUNT;
-			}
-			else
-			{
-				max_frame_count = SEGMENT_REQUEST_MAX_FRAME_COUNT;
-			}
+static void
+ngx_http_vod_file_open_completed_with_fallback(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_file_open_completed_internal(context, rc, 1);
+}
+#endif // NGX_THREADS
 
-#if (NGX_HAVE_LIB_AV_CODEC)
-			if (ctx->submodule_context.conf->submodule.name == volume_map.name)
-			{
-				output_codec_id = VOD_CODEC_ID_VOLUME_MAP;
-			}
-			else
-#endif // NGX_HAVE_LIB_AV_CODEC
-			{
-				output_codec_id = VOD_CODEC_ID_AAC;
-			}
+static ngx_int_t
+ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, void** context, uint32_t flags)
+{
+	ngx_file_reader_state_t* state;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_flag_t fallback = (flags & OPEN_FILE_FALLBACK_ENABLED) != 0;
+	ngx_int_t rc;
+#if (NGX_THREADS)
+	ngx_async_open_file_params_t open_params;
+	void* open_context;
+#endif // NGX_THREADS
 
-			rc = filter_init_state(
-				&ctx->submodule_context.request_context,
-				&ctx->read_cache_state,
-				&ctx->submodule_context.media_set,
-				max_frame_count,
-				output_codec_id,
-				&ctx->frame_processor_state);
-			if (rc != VOD_OK)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: filter_init_state failed %i", rc);
-				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
-			}
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (fallback && ngx_http_vod_fallback_cache_fetch(ctx, path))
+	{
+		rc = ngx_http_vod_dump_request_to_fallback(r);
+		if (rc != NGX_AGAIN)
+		{
+			return NGX_HTTP_NOT_FOUND;
+		}
+		return rc;
+	}
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	state = ngx_pcalloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_file_reader_internal: ngx_pcalloc failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
 
-			ctx->frame_processor = filter_run_state_machine;
-		}
+	*context = state;
 
-		// fall through
+	ngx_perf_counter_start(ctx->perf_counter_context);
 
-	case STATE_FILTER_FRAMES:
-		// if audio filtering already started, process frames
-		if (ctx->frame_processor != NULL)
-		{
-			rc = ngx_http_vod_process_media_frames(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-		}
+#if (NGX_HAVE_IO_URING)
+	if (ctx->submodule_context.conf->io_uring)
+	{
+		flags |= OPEN_FILE_IO_URING;
+	}
+#endif // NGX_HAVE_IO_URING
 
-		// initialize the processing of the video/audio frames
-		rc = ngx_http_vod_init_frame_processing(ctx);
-		if (rc != NGX_OK)
+#if (NGX_THREADS)
+	open_params.not_found_valid = ctx->submodule_context.conf->open_file_not_found_valid;
+	open_params.immutable_valid = ctx->submodule_context.conf->open_file_immutable_valid;
+
+	if (ctx->open_join.starting && !fallback)
+	{
+		// each open gets its own context since they run in parallel
+		open_context = NULL;
+
+		rc = ngx_file_reader_init_async(
+			state,
+			&open_context,
+			ctx->submodule_context.conf->open_file_thread_pool,
+			&open_params,
+			ngx_http_vod_parallel_open_completed,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			path,
+			flags);
+	}
+	else if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
+	{
+		rc = ngx_file_reader_init_async(
+			state,
+			&ctx->async_open_context,
+			ctx->submodule_context.conf->open_file_thread_pool,
+			&open_params,
+			fallback ? ngx_http_vod_file_open_completed_with_fallback : ngx_http_vod_file_open_completed,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			path,
+			flags);
+	}
+	else
+#endif // NGX_THREADS
+	{
+		rc = ngx_file_reader_init(
+			state,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			path,
+			flags);
+	}
+	if (rc != NGX_OK)
+	{
+		if (fallback && rc == NGX_HTTP_NOT_FOUND)
 		{
-			if (rc == NGX_DONE)
-			{
-				rc = NGX_OK;
-			}
-			else
+			ngx_http_vod_fallback_cache_store(ctx);
+
+			// try the fallback
+			rc = ngx_http_vod_dump_request_to_fallback(r);
+			if (rc != NGX_AGAIN)
 			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_vod_init_frame_processing failed %i", rc);
+				return NGX_HTTP_NOT_FOUND;
 			}
 			return rc;
 		}
 
-		if (ctx->frame_processor_state == NULL)
+		if (rc != NGX_AGAIN)
 		{
-			return ngx_http_vod_finalize_segment_response(ctx);
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
 		}
+		return rc;
+	}
 
-		ctx->submodule_context.request_context.log->action = "processing frames";
-		ctx->state = STATE_PROCESS_FRAMES;
-		// fall through
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
 
-	case STATE_PROCESS_FRAMES:
-		rc = ngx_http_vod_process_media_frames(ctx);
-		if (rc != NGX_OK)
-		{
-			if (rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_vod_process_media_frames failed %i", rc);
-			}
-			return rc;
-		}
+	return NGX_OK;
+}
 
-		return ngx_http_vod_finalize_segment_response(ctx);
+static ngx_int_t
+ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context)
+{
+	return ngx_http_vod_init_file_reader_internal(r, path, context, flags);
+}
 
-	case STATE_DUMP_OPEN_FILE:
-		return ctx->cur_source->reader->dump_request(ctx->cur_source->reader_context);
+static ngx_int_t
+ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context)
+{
+	return ngx_http_vod_init_file_reader_internal(r, path, context, flags | OPEN_FILE_FALLBACK_ENABLED);
+}
 
-	case STATE_DUMP_FILE_PART:
-		rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
-			return rc;
-		}
+// Note: this function initializes r->exten in order to have nginx select the correct mime type for the request
+//		the code was copied from nginx's ngx_http_set_exten
+static void
+ngx_http_vod_set_request_extension(ngx_http_request_t *r, ngx_str_t* path)
+{
+	ngx_int_t  i;
 
-		return NGX_OK;
+	ngx_str_null(&r->exten);
+
+	for (i = path->len - 1; i > 1; i--) {
+		if (path->data[i] == '.' && path->data[i - 1] != '/') {
+
+			r->exten.len = path->len - i - 1;
+			r->exten.data = &path->data[i + 1];
+
+			return;
+
+		}
+		else if (path->data[i] == '/') {
+			return;
+		}
 	}
 
-	ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-		"ngx_http_vod_run_state_machine: invalid state %d", ctx->state);
-	return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_UNEXPECTED);
+	return;
 }
 
-static void
-ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+static ngx_int_t
+ngx_http_vod_dump_file(void* context)
 {
-	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
-	ssize_t expected_size;
+	ngx_file_reader_state_t* state = context;
+	ngx_http_request_t* r = state->r;
+	ngx_int_t rc;
+
+	ngx_http_vod_set_request_extension(r, &state->file.name);
 
+	rc = ngx_http_set_content_type(r);
 	if (rc != NGX_OK)
 	{
-		if (rc == NGX_AGAIN)
-		{
-			ngx_http_finalize_request(ctx->submodule_context.r, rc);
-			return;
-		}
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_http_vod_dump_file: ngx_http_set_content_type failed %i", rc);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
 
-		if (ctx->state == STATE_MAP_READ && 
-			ctx->mapping.stale_retries > 0 && 
-			errno == ESTALE)
-		{
-			ctx->mapping.stale_retries--;
-			ctx->state = STATE_MAP_INITIAL;
+	// send the response header
+	rc = ngx_http_vod_send_header(r, state->file_size, NULL, MEDIA_SET_VOD, NULL);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
 
-			rc = ctx->state_machine(ctx);
-			if (rc == NGX_AGAIN)
-			{
-				return;
-			}
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_OK;
+	}
 
-			goto finalize_request;
-		}
+	ngx_file_reader_enable_directio(state);		// ignore errors
 
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_read_completed: read failed %i", rc);
-		goto finalize_request;
+	return ngx_file_reader_dump_file_part(state, 0, 0);
+}
+
+static ngx_int_t
+ngx_http_vod_dump_ingest_segment(void* context)
+{
+	ngx_http_vod_ingest_reader_state_t* state = context;
+	ngx_http_request_t* r = state->r;
+	ngx_int_t rc;
+
+	ngx_http_vod_set_request_extension(r, &state->path);
+
+	rc = ngx_http_set_content_type(r);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_dump_ingest_segment: ngx_http_set_content_type failed %i", rc);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	if (ctx->state == STATE_DUMP_FILE_PART)
+	// send the response header
+	rc = ngx_http_vod_send_header(r, state->data.len, NULL, MEDIA_SET_VOD, NULL);
+	if (rc != NGX_OK)
 	{
-		expected_size = ctx->clipper_parse_result->last_offset - ctx->clipper_parse_result->first_offset;
-		if (bytes_read != expected_size)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_read_completed: read size %z different than expected %z, probably a truncated file", 
-				bytes_read, expected_size);
-			rc = ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
-			goto finalize_request;
-		}
+		return rc;
 	}
-	else if (bytes_read <= 0)
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
 	{
-		switch (ctx->state)
-		{
-		case STATE_MAP_READ:		// the mapping state machine handles the case of empty mapping
-			break;
+		return NGX_OK;
+	}
 
-		case STATE_READ_METADATA_READ:
-			if ((ctx->read_flags & MEDIA_READ_FLAG_ALLOW_EMPTY_READ) != 0)
-			{
-				break;
-			}
-			// fall through
+	return ngx_http_vod_ingest_reader_dump_part(state, 0, 0);
+}
 
-		default:
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_read_completed: bytes read is zero");
-			rc = ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_DATA);
-			goto finalize_request;
-		}
+////// Remote & mapped modes
+
+static void
+ngx_http_vod_http_get_block_key(ngx_http_vod_http_reader_state_t *state, uint64_t block_index, u_char* key)
+{
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, state->upstream_location.data, state->upstream_location.len);
+	ngx_md5_update(&md5, state->cur_remote_suburi.data, state->cur_remote_suburi.len);
+	ngx_md5_update(&md5, &state->block_size, sizeof(state->block_size));
+	ngx_md5_update(&md5, &block_index, sizeof(block_index));
+	ngx_md5_final(key, &md5);
+}
+
+// tries to fill the requested range from the upstream block cache, the range is returned only if all the 
+// blocks that it spans are found in the cache
+static ngx_flag_t
+ngx_http_vod_http_block_cache_fetch(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	u_char keys[MAX_UPSTREAM_BLOCKS_PER_READ][BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t blocks[MAX_UPSTREAM_BLOCKS_PER_READ];
+	uint32_t tokens[MAX_UPSTREAM_BLOCKS_PER_READ];
+	uint64_t first_block;
+	uint64_t block_count;
+	uint64_t i;
+	size_t block_offset;
+	size_t copy_size;
+	ngx_flag_t result;
+
+	if (size == 0 || (size_t)(buf->end - buf->last) < size)
+	{
+		return 0;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+	first_block = offset / state->block_size;
+	block_count = (offset + size - 1) / state->block_size - first_block + 1;
+	if (block_count > MAX_UPSTREAM_BLOCKS_PER_READ)
+	{
+		return 0;
+	}
 
-	switch (ctx->state)
+	result = 1;
+	for (i = 0; i < block_count; i++)
 	{
-	case STATE_FILTER_FRAMES:
-	case STATE_PROCESS_FRAMES:
-		if (buf == NULL)
+		ngx_http_vod_http_get_block_key(state, first_block + i, keys[i]);
+
+		if (!ngx_buffer_cache_fetch(state->block_cache, keys[i], &blocks[i], &tokens[i]))
 		{
-			buf = &ctx->read_buffer;
+			result = 0;
+			break;
 		}
-		ctx->frames_bytes_read += (buf->last - buf->pos);
-		read_cache_read_completed(&ctx->read_cache_state, buf);
-		break;
+	}
 
-	default:
-		if (buf != NULL)
+	block_count = i;
+
+	if (result)
+	{
+		block_offset = offset - first_block * state->block_size;
+		for (i = 0; i < block_count; i++)
 		{
-			ctx->read_buffer = *buf;
+			copy_size = ngx_min(blocks[i].len - block_offset, size);
+			buf->last = ngx_copy(buf->last, blocks[i].data + block_offset, copy_size);
+			size -= copy_size;
+			block_offset = 0;
 		}
-		break;
 	}
 
-	// run the state machine
-	rc = ctx->state_machine(ctx);
-	if (rc == NGX_AGAIN)
+	for (i = 0; i < block_count; i++)
 	{
-		return;
+		ngx_buffer_cache_release(state->block_cache, keys[i], tokens[i]);
 	}
 
-finalize_request:
-
-	ngx_http_vod_finalize_request(ctx, rc);
+	return result;
 }
 
+// stores the complete blocks contained in an upstream response in the block cache, 
+// partial blocks (e.g. the last block of the file) are not stored
 static void
-ngx_http_vod_init_file_key(media_clip_source_t* cur_source, ngx_str_t* prefix)
+ngx_http_vod_http_block_cache_store(ngx_http_vod_http_reader_state_t *state, u_char* data, size_t size, off_t offset)
 {
-	ngx_md5_t md5;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	uint64_t block_index;
+	off_t block_start;
+	off_t end_offset;
 
-	ngx_md5_init(&md5);
-	if (prefix != NULL)
+	end_offset = offset + size;
+	block_index = (offset + state->block_size - 1) / state->block_size;
+	for (;; block_index++)
 	{
-		ngx_md5_update(&md5, prefix->data, prefix->len);
+		block_start = block_index * state->block_size;
+		if (block_start + (off_t)state->block_size > end_offset)
+		{
+			break;
+		}
+
+		ngx_http_vod_http_get_block_key(state, block_index, key);
+
+		ngx_buffer_cache_store(state->block_cache, key, data + (block_start - offset), state->block_size);
 	}
-	ngx_md5_update(&md5, cur_source->mapped_uri.data, cur_source->mapped_uri.len);
-	ngx_md5_final(cur_source->file_key, &md5);
 }
 
-static ngx_int_t
-ngx_http_vod_init_encryption_key(
-	ngx_http_request_t *r, 
-	ngx_http_vod_loc_conf_t* conf, 
-	media_sequence_t* cur_sequence)
+static void
+ngx_http_vod_http_block_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
 {
-	ngx_str_t encryption_key_seed;
-	ngx_md5_t md5;
+	ngx_http_vod_http_reader_state_t* state = context;
 
-	if (conf->secret_key != NULL)
+	if (rc == NGX_OK && buf != NULL)
 	{
-		// calculate the encryption key seed
-		if (ngx_http_complex_value(
-			r,
-			conf->secret_key,
-			&encryption_key_seed) != NGX_OK)
-		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_encryption_key: ngx_http_complex_value failed");
-			return NGX_ERROR;
-		}
+		ngx_http_vod_http_block_cache_store(state, buf->pos, buf->last - buf->pos, state->read_offset);
 	}
-	else
+
+	ngx_http_vod_handle_read_completed(
+		ngx_http_get_module_ctx(state->r, ngx_http_vod_module), 
+		rc, 
+		buf, 
+		bytes_read);
+}
+
+static ngx_int_t
+ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_child_request_params_t child_params;
+
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+
+	if (state->block_cache != NULL && 
+		ngx_http_vod_http_block_cache_fetch(state, buf, size, offset))
 	{
-		encryption_key_seed = cur_sequence->mapped_uri;
+		return NGX_OK;
 	}
 
-	// hash the seed to get the key
-	ngx_md5_init(&md5);
-	ngx_md5_update(&md5, encryption_key_seed.data, encryption_key_seed.len);
-	ngx_md5_final(cur_sequence->encryption_key, &md5);
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = offset;
+	child_params.range_end = offset + size;
+	child_params.perf_counters = ctx->perf_counters;
+	child_params.perf_counter = state->perf_counter;
+	child_params.hedge_percentile = ctx->submodule_context.conf->upstream_hedge_percentile;
+	child_params.hedge_min_delay = ctx->submodule_context.conf->upstream_hedge_min_delay;
+	child_params.hedge_max_delay = ctx->submodule_context.conf->upstream_hedge_max_delay;
+	child_params.max_concurrency = ctx->submodule_context.conf->upstream_max_concurrency;
+	child_params.shared_limit = ctx->submodule_context.conf->upstream_limit_zone;
+	child_params.shared_max_concurrency = ctx->submodule_context.conf->upstream_shared_max_concurrency;
+	child_params.max_queued = ctx->submodule_context.conf->upstream_max_queued;
+
+	if (state->block_cache != NULL)
+	{
+		state->read_offset = offset;
+
+		return ngx_child_request_start(
+			state->r,
+			ngx_http_vod_http_block_read_completed,
+			state,
+			&state->upstream_location,
+			&child_params,
+			buf);
+	}
 
-	return NGX_OK;
+	return ngx_child_request_start(
+		state->r,
+		ngx_http_vod_handle_read_completed,
+		ctx,
+		&state->upstream_location,
+		&child_params,
+		buf);
 }
 
 static ngx_int_t
-ngx_http_vod_start_processing_media_file(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_dump_http_part(void* context, off_t start, off_t end)
 {
-	ngx_http_vod_loc_conf_t* conf;
-	media_clip_source_t* cur_source;
-	ngx_http_request_t *r;
-	ngx_int_t rc;
+	ngx_http_vod_http_reader_state_t *state = context;
+	ngx_child_request_params_t child_params;
+	ngx_http_request_t* r = state->r;
+	ngx_http_vod_ctx_t *ctx;
 
-	// update request flags
-	r = ctx->submodule_context.r;
-	r->root_tested = !r->error_page;
-	r->allow_ranges = 1;
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = start;
+	child_params.range_end = end;
+
+	return ngx_child_request_start(
+		r,
+		ngx_http_vod_handle_read_completed,
+		ctx,
+		&state->upstream_location,
+		&child_params,
+		NULL);
+}
+
+static ngx_int_t
+ngx_http_vod_dump_http_request(void* context)
+{
+	ngx_http_vod_http_reader_state_t* state = context;
+	ngx_child_request_params_t child_params;
+	ngx_http_request_t* r = state->r;
+	ngx_http_vod_ctx_t *ctx;
 
-	// set the state machine
 	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-	ctx->state_machine = ngx_http_vod_run_state_machine;
 
-	cur_source = ctx->submodule_context.media_set.sources_head;
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = r->method;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.proxy_range = 1;
+	child_params.proxy_all_headers = 1;
 
-	// handle serve requests
-	if (ctx->request == NULL &&
-		cur_source->clip_from == 0 &&
-		cur_source->clip_to == ULLONG_MAX &&
-		cur_source->tracks_mask[MEDIA_TYPE_AUDIO] == 0xffffffff &&
-		cur_source->tracks_mask[MEDIA_TYPE_VIDEO] == 0xffffffff)
-	{
-		ctx->state = STATE_DUMP_OPEN_FILE;
+	return ngx_child_request_start(
+		r,
+		NULL,
+		NULL,
+		&state->upstream_location,
+		&child_params,
+		NULL);
+}
 
-		ctx->cur_source = cur_source;
+static ngx_int_t
+ngx_http_vod_http_reader_open_file(ngx_http_request_t* r, ngx_str_t* path, uint32_t flags, void** context)
+{
+	ngx_http_vod_http_reader_state_t* state;
+	ngx_http_vod_ctx_t *ctx;
 
-		rc = ngx_http_vod_open_file(ctx, cur_source);
-		if (rc != NGX_OK)
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	// initialize the upstream variables
+	if (ctx->upstream_extra_args.len == 0 &&
+		ctx->submodule_context.conf->upstream_extra_args != NULL)
+	{
+		if (ngx_http_complex_value(
+			ctx->submodule_context.r,
+			ctx->submodule_context.conf->upstream_extra_args,
+			&ctx->upstream_extra_args) != NGX_OK)
 		{
-			if (rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_start_processing_media_file: open_file failed %i", rc);
-			}
-			return rc;
+			return NGX_ERROR;
 		}
-
-		return cur_source->reader->dump_request(cur_source->reader_context);
 	}
 
-	// initialize the file keys
-	conf = ctx->submodule_context.conf;
+	state = ngx_palloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_http_reader_open_file: ngx_palloc failed");
+		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+	}
 
-	for (; cur_source != NULL; cur_source = cur_source->next)
+	// Note: for http, no need to open any files, just save the remote uri
+	state->r = r;
+	state->cur_remote_suburi = *path;
+	if (ctx->state == STATE_MAP_OPEN || ctx->submodule_context.conf->remote_upstream_location.len == 0)
+	{
+		state->upstream_location = ctx->submodule_context.conf->upstream_location;
+	}
+	else
 	{
-		ngx_http_vod_init_file_key(cur_source, ctx->file_key_prefix);
+		state->upstream_location = ctx->submodule_context.conf->remote_upstream_location;
 	}
 
-	// initialize the uri / encryption keys
-	if (conf->drm_enabled || conf->secret_key != NULL)
+	state->perf_counter = ctx->state == STATE_MAP_OPEN ? PC_FETCH_MAPPING : PC_FETCH_UPSTREAM;
+
+	// Note: mapping responses are not cached here, they have their own caches
+	if (ctx->state != STATE_MAP_OPEN && (flags & OPEN_FILE_NO_CACHE) == 0)
 	{
-		for (ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
-			ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
-			ctx->cur_sequence++)
-		{
-			rc = ngx_http_vod_init_encryption_key(r, conf, ctx->cur_sequence);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-		}
+		state->block_cache = ctx->submodule_context.conf->upstream_block_cache;
+	}
+	else
+	{
+		state->block_cache = NULL;
 	}
+	state->block_size = ctx->submodule_context.conf->upstream_block_size;
+	*context = state;
 
-	// restart the file index/uri params
-	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	return NGX_OK;
+}
 
-	if (ctx->submodule_context.conf->drm_enabled)
+static void	
+ngx_http_vod_http_reader_get_path(void* context, ngx_str_t* path)
+{
+	ngx_http_vod_http_reader_state_t* ctx = context;
+
+	*path = ctx->cur_remote_suburi;
+}
+
+////// Local mode only
+
+ngx_int_t
+ngx_http_vod_local_request_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	ctx->bytes_read_counter = PC_BYTES_READ_LOCAL;
+
+	// map all uris to paths
+	rc = ngx_http_vod_map_uris_to_paths(ctx);
+	if (rc != NGX_OK)
 	{
-		ctx->state = STATE_READ_DRM_INFO;
-		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+		return rc;
+	}
+
+	// initialize for reading files
+	if (ctx->submodule_context.conf->ingest_zone != NULL)
+	{
+		ctx->default_reader = &reader_ingest;
 	}
 	else
 	{
-		ctx->state = STATE_READ_METADATA_INITIAL;
+		ctx->default_reader = &reader_file_with_fallback;
+	}
+	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+
+	// start the state machine
+	rc = ngx_http_vod_start_processing_media_file(ctx);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_local_request_handler: ngx_http_vod_start_processing_media_file failed %i", rc);
 	}
 
-	return ngx_http_vod_run_state_machine(ctx);
+	return rc;
 }
 
-////// Local & mapped modes
+////// Mapped mode only
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_buffer_cache_t* cache;
+	ngx_flag_t compress;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+} ngx_http_vod_map_refresh_t;
 
+#if (NGX_HAVE_ZLIB)
+// compresses a mapping before it is saved to the cache, returns NGX_DECLINED if the mapping should be saved as is
 static ngx_int_t
-ngx_http_vod_map_uris_to_paths(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_map_compress(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, ngx_str_t* result)
 {
-	media_clip_source_t* cur_source;
-	ngx_http_request_t *r = ctx->submodule_context.r;
-	ngx_str_t original_uri;
-	u_char *last;
-	size_t root;
-	ngx_str_t path;
+	mapping_cache_compressed_header_t* header;
+	ngx_str_t* dictionary = &ctx->submodule_context.conf->mapping_cache_dictionary;
+	z_stream zstream;
+	u_char* buffer;
+	int zrc;
 
-	original_uri = r->uri;
-	for (cur_source = ctx->submodule_context.media_set.sources_head;
-		cur_source != NULL;
-		cur_source = cur_source->next)
+	if (mapping->len <= sizeof(*header) || mapping->len > UINT32_MAX)
 	{
-		ctx->cur_source = cur_source;
-		r->uri = cur_source->stripped_uri;
-		last = ngx_http_map_uri_to_path(r, &path, &root, 0);
-		r->uri = original_uri;
-		if (last == NULL)
+		return NGX_DECLINED;
+	}
+
+	// the output is limited to the size of the mapping, there is no point saving a larger buffer
+	buffer = ngx_pnalloc(ctx->submodule_context.r->pool, mapping->len);
+	if (buffer == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_compress: ngx_pnalloc failed");
+		return NGX_DECLINED;
+	}
+
+	ngx_memzero(&zstream, sizeof(zstream));
+
+	zrc = deflateInit(&zstream, Z_BEST_COMPRESSION);
+	if (zrc != Z_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_compress: deflateInit failed %d", zrc);
+		return NGX_DECLINED;
+	}
+
+	if (dictionary->len > 0)
+	{
+		zrc = deflateSetDictionary(&zstream, dictionary->data, dictionary->len);
+		if (zrc != Z_OK)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_map_uris_to_paths: ngx_http_map_uri_to_path failed");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_compress: deflateSetDictionary failed %d", zrc);
+			deflateEnd(&zstream);
+			return NGX_DECLINED;
 		}
+	}
 
-		path.len = last - path.data;
+	zstream.next_in = mapping->data;
+	zstream.avail_in = mapping->len;
+	zstream.next_out = buffer + sizeof(*header);
+	zstream.avail_out = mapping->len - sizeof(*header);
 
-		cur_source->mapped_uri = path;
+	zrc = deflate(&zstream, Z_FINISH);
+	deflateEnd(&zstream);
+
+	if (zrc != Z_STREAM_END)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_compress: mapping not compressed, rc %d", zrc);
+		return NGX_DECLINED;
 	}
 
-	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	header = (mapping_cache_compressed_header_t*)buffer;
+	ngx_memzero(header, sizeof(*header));
+	header->size = mapping->len;
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_map_compress: compressed mapping from %uz to %uz", 
+		mapping->len, sizeof(*header) + (size_t)zstream.total_out);
+
+	// Note: result may point to mapping
+	result->data = buffer;
+	result->len = sizeof(*header) + zstream.total_out;
 
 	return NGX_OK;
 }
 
+// uncompresses a cached mapping, the result is null terminated.
+// returns NGX_DECLINED if the cached mapping is not compressed
 static ngx_int_t
-ngx_http_vod_dump_request_to_fallback(ngx_http_request_t *r)
+ngx_http_vod_map_uncompress(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, ngx_str_t* result)
 {
-	ngx_http_vod_loc_conf_t* conf;
-	ngx_child_request_params_t child_params;
+	mapping_cache_compressed_header_t header;
+	ngx_str_t* dictionary = &ctx->submodule_context.conf->mapping_cache_dictionary;
+	z_stream zstream;
+	u_char* buffer;
+	int zrc;
 
-	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+	if (mapping->len <= sizeof(header) || mapping->data[0] != 0)
+	{
+		return NGX_DECLINED;
+	}
 
-	if (conf->fallback_upstream_location.len == 0)
+	ngx_memcpy(&header, mapping->data, sizeof(header));
+	if (header.size > ctx->submodule_context.conf->max_mapping_response_size)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_dump_request_to_fallback: no fallback configured");
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_uncompress: mapping size %uD greater than limit %uz",
+			header.size, ctx->submodule_context.conf->max_mapping_response_size);
 		return NGX_ERROR;
 	}
 
-	if (ngx_http_vod_header_exists(r, &conf->proxy_header.key))
+	buffer = ngx_pnalloc(ctx->submodule_context.r->pool, header.size + 1);
+	if (buffer == NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_dump_request_to_fallback: proxy header exists");
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_uncompress: ngx_pnalloc failed");
 		return NGX_ERROR;
 	}
 
-	// dump the request to the fallback upstream
-	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = r->method;
-	child_params.base_uri = r->uri;
-	child_params.extra_args = r->args;
-	child_params.extra_header = conf->proxy_header;
-	child_params.proxy_range = 1;
-	child_params.proxy_all_headers = 1;
+	ngx_memzero(&zstream, sizeof(zstream));
 
-	return ngx_child_request_start(
-		r,
-		NULL,
-		NULL,
-		&conf->fallback_upstream_location,
-		&child_params,
-		NULL);
-}
+	zrc = inflateInit(&zstream);
+	if (zrc != Z_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_uncompress: inflateInit failed %d", zrc);
+		return NGX_ERROR;
+	}
 
-#if (NGX_THREADS)
-static void
-ngx_http_vod_file_open_completed_internal(void* context, ngx_int_t rc, ngx_flag_t fallback)
-{
-	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	zstream.next_in = mapping->data + sizeof(header);
+	zstream.avail_in = mapping->len - sizeof(header);
+	zstream.next_out = buffer;
+	zstream.avail_out = header.size;
 
-	if (rc != NGX_OK)
+	zrc = inflate(&zstream, Z_FINISH);
+	if (zrc == Z_NEED_DICT && dictionary->len > 0)
 	{
-		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		// fails if the dictionary was changed since the mapping was compressed
+		zrc = inflateSetDictionary(&zstream, dictionary->data, dictionary->len);
+		if (zrc == Z_OK)
 		{
-			// try the fallback
-			rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
-			if (rc == NGX_AGAIN)
-			{
-				return;
-			}
-
-			rc = NGX_HTTP_NOT_FOUND;
-			goto finalize_request;
+			zrc = inflate(&zstream, Z_FINISH);
 		}
-
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.r->connection->log, 0,
-			"ngx_http_vod_file_open_completed_internal: read failed %i", rc);
-		goto finalize_request;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
+	inflateEnd(&zstream);
 
-	// run the state machine
-	rc = ctx->state_machine(ctx);
-	if (rc == NGX_AGAIN)
+	if (zrc != Z_STREAM_END || zstream.total_out != header.size)
 	{
-		return;
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_uncompress: inflate failed %d, size %uz", zrc, (size_t)zstream.total_out);
+		return NGX_ERROR;
 	}
 
-finalize_request:
+	buffer[header.size] = '\0';
 
-	ngx_http_vod_finalize_request(ctx, rc);
-}
+	result->data = buffer;
+	result->len = header.size;
 
-static void
-ngx_http_vod_file_open_completed(void* context, ngx_int_t rc)
-{
-	ngx_http_vod_file_open_completed_internal(context, rc, 0);
+	return NGX_OK;
 }
+#endif // NGX_HAVE_ZLIB
 
 static void
-ngx_http_vod_file_open_completed_with_fallback(void* context, ngx_int_t rc)
-{
-	ngx_http_vod_file_open_completed_internal(context, rc, 1);
-}
-#endif // NGX_THREADS
-
-static ngx_int_t
-ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, void** context, uint32_t flags)
+ngx_http_vod_map_refresh_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	ngx_file_reader_state_t* state;
-	ngx_http_core_loc_conf_t *clcf;
-	ngx_http_vod_ctx_t *ctx;
-	ngx_flag_t fallback = (flags & OPEN_FILE_FALLBACK_ENABLED) != 0;
-	ngx_int_t rc;
-
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	ngx_http_vod_map_refresh_t* refresh = context;
+	ngx_http_vod_ctx_t *ctx = refresh->ctx;
+	ngx_log_t* log = ctx->submodule_context.request_context.log;
+	ngx_str_t mapping;
 
-	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_map_refresh_finished: upstream request failed %i", rc);
+		return;
+	}
 
-	state = ngx_pcalloc(r->pool, sizeof(*state));
-	if (state == NULL)
+	if (response->last == response->pos)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_file_reader_internal: ngx_pcalloc failed");
-		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_map_refresh_finished: empty mapping response");
+		return;
 	}
 
-	*context = state;
+	// Note: the response is saved as is, the stale mapping that was applied by the request 
+	//		had already passed validation, and apply parses both the raw and the encoded formats
+	mapping.data = response->pos;
+	mapping.len = response->last - response->pos;
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+#if (NGX_HAVE_ZLIB)
+	if (refresh->compress)
+	{
+		(void)ngx_http_vod_map_compress(ctx, &mapping, &mapping);
+	}
+#endif // NGX_HAVE_ZLIB
 
-#if (NGX_THREADS)
-	if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		refresh->cache,
+		refresh->key,
+		ctx->cache_tag,
+		mapping.data,
+		mapping.len))
 	{
-		rc = ngx_file_reader_init_async(
-			state,
-			&ctx->async_open_context,
-			ctx->submodule_context.conf->open_file_thread_pool,
-			fallback ? ngx_http_vod_file_open_completed_with_fallback : ngx_http_vod_file_open_completed,
-			ngx_http_vod_handle_read_completed,
-			ctx,
-			r,
-			clcf,
-			path,
-			flags);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_map_refresh_finished: stored in mapping cache");
 	}
 	else
-#endif // NGX_THREADS
 	{
-		rc = ngx_file_reader_init(
-			state,
-			ngx_http_vod_handle_read_completed,
-			ctx,
-			r,
-			clcf,
-			path,
-			flags);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_map_refresh_finished: failed to store mapping in cache");
 	}
-	if (rc != NGX_OK)
+}
+
+// fetches a stale mapping in the background, the request continues with the stale mapping.
+// errors are only logged, so the stale mapping keeps being served until it is refreshed
+static void
+ngx_http_vod_map_start_refresh(ngx_http_vod_ctx_t *ctx, ngx_buffer_cache_t* cache, ngx_str_t* uri)
+{
+	ngx_http_vod_map_refresh_t* refresh;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+	ngx_buf_t* b;
+
+	if (ctx->upstream_extra_args.len == 0 &&
+		conf->upstream_extra_args != NULL)
 	{
-		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		if (ngx_http_complex_value(
+			r,
+			conf->upstream_extra_args,
+			&ctx->upstream_extra_args) != NGX_OK)
 		{
-			// try the fallback
-			rc = ngx_http_vod_dump_request_to_fallback(r);
-			if (rc != NGX_AGAIN)
-			{
-				return NGX_HTTP_NOT_FOUND;
-			}
-			return rc;
+			return;
 		}
+	}
 
-		if (rc != NGX_AGAIN)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
-		}
-		return rc;
+	refresh = ngx_palloc(r->pool, sizeof(*refresh));
+	if (refresh == NULL)
+	{
+		return;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
+	refresh->ctx = ctx;
+	refresh->cache = cache;
+	refresh->compress = ctx->mapping.compress;
+	ngx_memcpy(refresh->key, ctx->mapping.cache_key, sizeof(refresh->key));
 
-	return NGX_OK;
-}
+	b = ngx_create_temp_buf(r->pool, ctx->mapping.max_response_size + conf->max_upstream_headers_size + 1);
+	if (b == NULL)
+	{
+		return;
+	}
 
-static ngx_int_t
-ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context)
-{
-	return ngx_http_vod_init_file_reader_internal(r, path, context, flags);
-}
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = *uri;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = 0;
+	child_params.range_end = ctx->mapping.max_response_size;
+	child_params.background = 1;
+	child_params.perf_counters = ctx->perf_counters;
+	child_params.perf_counter = PC_FETCH_MAPPING;
+	child_params.max_concurrency = conf->upstream_max_concurrency;
+	child_params.shared_limit = conf->upstream_limit_zone;
+	child_params.shared_max_concurrency = conf->upstream_shared_max_concurrency;
+	child_params.max_queued = conf->upstream_max_queued;
+
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_map_refresh_finished,
+		refresh,
+		&conf->upstream_location,
+		&child_params,
+		b);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_map_start_refresh: ngx_child_request_start failed %i", rc);
+		return;
+	}
 
-static ngx_int_t
-ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, uint32_t flags, void** context)
-{
-	return ngx_http_vod_init_file_reader_internal(r, path, context, flags | OPEN_FILE_FALLBACK_ENABLED);
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_map_start_refresh: started a background mapping request for %V", uri);
 }
 
-// Note: this function initializes r->exten in order to have nginx select the correct mime type for the request
-//		the code was copied from nginx's ngx_http_set_exten
 static void
-ngx_http_vod_set_request_extension(ngx_http_request_t *r, ngx_str_t* path)
+ngx_http_vod_map_get_cache_key(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri, u_char* key)
 {
-	ngx_int_t  i;
-
-	ngx_str_null(&r->exten);
-
-	for (i = path->len - 1; i > 1; i--) {
-		if (path->data[i] == '.' && path->data[i - 1] != '/') {
-
-			r->exten.len = path->len - i - 1;
-			r->exten.data = &path->data[i + 1];
-
-			return;
+	ngx_str_t* prefix;
+	ngx_cache_key_t hash;
 
-		}
-		else if (path->data[i] == '/') {
-			return;
-		}
+	prefix = ctx->mapping.cache_key_prefix;
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	if (prefix != NULL)
+	{
+		ngx_cache_key_update(&hash, prefix->data, prefix->len);
 	}
-
-	return;
+	ngx_cache_key_update(&hash, uri->data, uri->len);
+	ngx_cache_key_final(key, &hash);
 }
 
-static ngx_int_t
-ngx_http_vod_dump_file(void* context)
+static void
+ngx_http_vod_map_fetch_wev_handler(ngx_http_request_t *r)
 {
-	ngx_file_reader_state_t* state = context;
-	ngx_http_request_t* r = state->r;
+	ngx_http_vod_ctx_t *ctx;
 	ngx_int_t rc;
 
-	ngx_http_vod_set_request_extension(r, &state->file.name);
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
 
-	rc = ngx_http_set_content_type(r);
-	if (rc != NGX_OK)
+	r->write_event_handler = ctx->mapping.original_write_event_handler;
+	ctx->mapping.original_write_event_handler = NULL;
+
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
-			"ngx_http_vod_dump_file: ngx_http_set_content_type failed %i", rc);
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return;
 	}
 
-	// send the response header
-	rc = ngx_http_vod_send_header(r, state->file_size, NULL, MEDIA_SET_VOD, NULL);
 	if (rc != NGX_OK)
 	{
-		return rc;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_map_fetch_wev_handler: state machine failed %i", rc);
 	}
 
-	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static void
+ngx_http_vod_map_fetch_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_map_fetch_t* fetch = context;
+	ngx_http_vod_ctx_t *ctx = fetch->ctx;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+
+	// Note: on failure, the mapping is requested again by the mapping state machine, 
+	//		in order to get the usual error handling
+	if (rc == NGX_OK)
 	{
-		return NGX_OK;
+		fetch->response = response;
+	}
+	else
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_map_fetch_finished: upstream request failed %i", rc);
 	}
 
-	ngx_file_reader_enable_directio(state);		// ignore errors
-
-	return ngx_file_reader_dump_file_part(state, 0, 0);
-}
+	// Note: the failed fetches are not reported to the group, see above
+	ngx_http_vod_join_complete(&ctx->mapping.fetch_join, NGX_OK);
 
-////// Remote & mapped modes
+	ngx_http_vod_map_fetch_send_queued(ctx);
 
-static ngx_int_t
-ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
-{
-	ngx_http_vod_ctx_t *ctx;
-	ngx_child_request_params_t child_params;
+	if (!ngx_http_vod_join_done(&ctx->mapping.fetch_join))
+	{
+		return;
+	}
 
-	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+	// all the mappings were fetched, resume the parent request
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_MAP_PATH);
 
-	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = NGX_HTTP_GET;
-	child_params.base_uri = state->cur_remote_suburi;
-	child_params.extra_args = ctx->upstream_extra_args;
-	child_params.range_start = offset;
-	child_params.range_end = offset + size;
+	ctx->mapping.original_write_event_handler = r->write_event_handler;
+	r->write_event_handler = ngx_http_vod_map_fetch_wev_handler;
 
-	return ngx_child_request_start(
-		state->r,
-		ngx_http_vod_handle_read_completed,
-		ctx,
-		&state->upstream_location,
-		&child_params,
-		buf);
+	ngx_http_post_request(r, NULL);
 }
 
-static ngx_int_t
-ngx_http_vod_dump_http_part(void* context, off_t start, off_t end)
+static void
+ngx_http_vod_map_fetch_send_queued(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_http_vod_http_reader_state_t *state = context;
 	ngx_child_request_params_t child_params;
-	ngx_http_request_t* r = state->r;
-	ngx_http_vod_ctx_t *ctx;
+	ngx_http_vod_map_fetch_t* fetch;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	while (ctx->mapping.fetch_join.pending < conf->mapping_parallel_requests)
+	{
+		fetch = ctx->mapping.fetch_queue;
+		if (fetch == NULL)
+		{
+			break;
+		}
 
-	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = NGX_HTTP_GET;
-	child_params.base_uri = state->cur_remote_suburi;
-	child_params.extra_args = ctx->upstream_extra_args;
-	child_params.range_start = start;
-	child_params.range_end = end;
+		ctx->mapping.fetch_queue = fetch->next;
 
-	return ngx_child_request_start(
-		r,
-		ngx_http_vod_handle_read_completed,
-		ctx,
-		&state->upstream_location,
-		&child_params,
-		NULL);
-}
+		if (fetch->mapping.data != NULL)
+		{
+			// cache hit
+			continue;
+		}
 
-static ngx_int_t
-ngx_http_vod_dump_http_request(void* context)
-{
-	ngx_http_vod_http_reader_state_t* state = context;
-	ngx_child_request_params_t child_params;
-	ngx_http_request_t* r = state->r;
-	ngx_http_vod_ctx_t *ctx;
+		fetch->buf = ngx_create_temp_buf(r->pool, ctx->mapping.max_response_size + conf->max_upstream_headers_size + 1);
+		if (fetch->buf == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_map_fetch_send_queued: ngx_create_temp_buf failed");
+			ctx->mapping.fetch_queue = NULL;
+			break;
+		}
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+		ngx_memzero(&child_params, sizeof(child_params));
+		child_params.method = NGX_HTTP_GET;
+		child_params.base_uri = fetch->uri;
+		child_params.extra_args = ctx->upstream_extra_args;
+		child_params.range_start = 0;
+		child_params.range_end = ctx->mapping.max_response_size;
+		child_params.background = 1;
+		child_params.perf_counters = ctx->perf_counters;
+		child_params.perf_counter = PC_FETCH_MAPPING;
+		child_params.max_concurrency = conf->upstream_max_concurrency;
+		child_params.shared_limit = conf->upstream_limit_zone;
+		child_params.shared_max_concurrency = conf->upstream_shared_max_concurrency;
+		child_params.max_queued = conf->upstream_max_queued;
 
-	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = r->method;
-	child_params.base_uri = state->cur_remote_suburi;
-	child_params.extra_args = ctx->upstream_extra_args;
-	child_params.proxy_range = 1;
-	child_params.proxy_all_headers = 1;
+		rc = ngx_child_request_start(
+			r,
+			ngx_http_vod_map_fetch_finished,
+			fetch,
+			&conf->upstream_location,
+			&child_params,
+			fetch->buf);
+		if (rc != NGX_AGAIN)
+		{
+			// the remaining mappings are fetched one at a time by the mapping state machine
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_map_fetch_send_queued: ngx_child_request_start failed %i", rc);
+			ctx->mapping.fetch_queue = NULL;
+			break;
+		}
 
-	return ngx_child_request_start(
-		r,
-		NULL,
-		NULL,
-		&state->upstream_location,
-		&child_params,
-		NULL);
+		ngx_http_vod_join_add(&ctx->mapping.fetch_join, rc);
+	}
 }
 
+// evaluates the mapping uris of all the clips starting from cur_clip, looks them up in the cache,
+// and fetches the ones that are missing concurrently. the mappings are applied in clip order by
+// ngx_http_vod_map_run_step, once all the fetches complete
 static ngx_int_t
-ngx_http_vod_http_reader_open_file(ngx_http_request_t* r, ngx_str_t* path, uint32_t flags, void** context)
+ngx_http_vod_map_fetch_all(ngx_http_vod_ctx_t *ctx, ngx_http_vod_mapping_next_clip_t next_clip)
 {
-	ngx_http_vod_http_reader_state_t* state;
-	ngx_http_vod_ctx_t *ctx;
+	ngx_http_vod_map_fetch_t** fetch_last;
+	ngx_http_vod_map_fetch_t* fetch;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	media_clip_t* first_clip = ctx->cur_clip;
+	media_clip_t* cur_clip;
+	ngx_str_t mapping;
+	ngx_uint_t miss_count;
+	uint32_t cache_token;
+	u_char* p;
+	ngx_int_t rc;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (conf->mapping_parallel_requests <= 1 ||
+		ctx->mapping.reader != &reader_http ||
+		next_clip(first_clip) == NULL)
+	{
+		return NGX_OK;
+	}
 
-	// initialize the upstream variables
 	if (ctx->upstream_extra_args.len == 0 &&
-		ctx->submodule_context.conf->upstream_extra_args != NULL)
+		conf->upstream_extra_args != NULL)
 	{
 		if (ngx_http_complex_value(
-			ctx->submodule_context.r,
-			ctx->submodule_context.conf->upstream_extra_args,
+			r,
+			conf->upstream_extra_args,
 			&ctx->upstream_extra_args) != NGX_OK)
 		{
 			return NGX_ERROR;
 		}
 	}
 
-	state = ngx_palloc(r->pool, sizeof(*state));
-	if (state == NULL)
-	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_http_reader_open_file: ngx_palloc failed");
-		return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
-	}
+	miss_count = 0;
+	fetch_last = &ctx->mapping.cur_fetch;
 
-	// Note: for http, no need to open any files, just save the remote uri
-	state->r = r;
-	state->cur_remote_suburi = *path;
-	if (ctx->state == STATE_MAP_OPEN || ctx->submodule_context.conf->remote_upstream_location.len == 0)
+	for (cur_clip = first_clip; cur_clip != NULL; cur_clip = next_clip(cur_clip))
 	{
-		state->upstream_location = ctx->submodule_context.conf->upstream_location;
+		fetch = ngx_pcalloc(r->pool, sizeof(*fetch));
+		if (fetch == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_map_fetch_all: ngx_pcalloc failed");
+			return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+		}
+
+		fetch->ctx = ctx;
+
+		// Note: the uri variables are evaluated against the current clip
+		ctx->cur_clip = cur_clip;
+
+		rc = ctx->mapping.get_uri(ctx, &fetch->uri);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		ngx_http_vod_map_get_cache_key(ctx, &fetch->uri, fetch->cache_key);
+
+		// the cached mapping is copied, since the cache entry can not be locked until all fetches complete
+		fetch->cache_index = ngx_buffer_cache_fetch_multi_perf(
+			ctx->perf_counters,
+			ctx->mapping.caches,
+			ctx->mapping.cache_count,
+			fetch->cache_key,
+			&mapping,
+			&cache_token,
+			&fetch->cache_state);
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_MAPPING, fetch->cache_index >= 0);
+		if (fetch->cache_index >= 0)
+		{
+#if (NGX_HAVE_ZLIB)
+			rc = ngx_http_vod_map_uncompress(ctx, &mapping, &fetch->mapping);
+			if (rc != NGX_DECLINED)
+			{
+				ngx_buffer_cache_release(
+					ctx->mapping.caches[fetch->cache_index],
+					fetch->cache_key,
+					cache_token);
+
+				if (rc != NGX_OK)
+				{
+					// fetch the mapping again
+					fetch->mapping.data = NULL;
+					fetch->cache_index = -1;
+					miss_count++;
+				}
+
+				*fetch_last = fetch;
+				fetch_last = &fetch->next;
+				continue;
+			}
+#endif // NGX_HAVE_ZLIB
+
+			p = ngx_palloc(r->pool, mapping.len + 1);
+			if (p != NULL)
+			{
+				ngx_memcpy(p, mapping.data, mapping.len);
+				p[mapping.len] = '\0';
+
+				fetch->mapping.data = p;
+				fetch->mapping.len = mapping.len;
+			}
+
+			ngx_buffer_cache_release(
+				ctx->mapping.caches[fetch->cache_index],
+				fetch->cache_key,
+				cache_token);
+
+			if (p == NULL)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_map_fetch_all: ngx_palloc failed");
+				return ngx_http_vod_status_to_ngx_error(r, VOD_ALLOC_FAILED);
+			}
+		}
+		else
+		{
+			miss_count++;
+		}
+
+		*fetch_last = fetch;
+		fetch_last = &fetch->next;
 	}
-	else
+
+	ctx->cur_clip = first_clip;
+
+	if (miss_count < 2)
 	{
-		state->upstream_location = ctx->submodule_context.conf->remote_upstream_location;
+		// nothing to parallelize, the single miss (if any) is fetched by the mapping state machine
+		return NGX_OK;
 	}
-	*context = state;
 
-	return NGX_OK;
-}
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_map_fetch_all: fetching %ui mappings", miss_count);
 
-static void	
-ngx_http_vod_http_reader_get_path(void* context, ngx_str_t* path)
-{
-	ngx_http_vod_http_reader_state_t* ctx = context;
+	ctx->submodule_context.request_context.log->action = "getting mapping";
 
-	*path = ctx->cur_remote_suburi;
-}
+	ngx_perf_counter_start(ctx->perf_counter_context);
 
-////// Local mode only
+	ctx->mapping.fetch_queue = ctx->mapping.cur_fetch;
+	ngx_http_vod_join_start(&ctx->mapping.fetch_join);
 
-ngx_int_t
-ngx_http_vod_local_request_handler(ngx_http_request_t *r)
+	ngx_http_vod_map_fetch_send_queued(ctx);
+
+	return ngx_http_vod_join_started(&ctx->mapping.fetch_join);
+}
+
+static ngx_int_t
+ngx_http_vod_map_apply_response(ngx_http_vod_ctx_t *ctx, ngx_buf_t* response)
 {
-	ngx_http_vod_ctx_t *ctx;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t mapping;
 	ngx_int_t rc;
+	int store_cache_index;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (response->last == response->pos)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_apply_response: empty mapping response");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_EMPTY_MAPPING);
+	}
 
-	// map all uris to paths
-	rc = ngx_http_vod_map_uris_to_paths(ctx);
+	// apply the mapping
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_apply_response: not enough room in buffer for null terminator");
+		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_MAPPING);
+	}
+
+	*response->last = '\0';
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_map_apply_response: mapping result %s", response->pos);
+
+	mapping.data = response->pos;
+	mapping.len = response->last - response->pos;
+	ctx->mapping.encode = NULL;
+	rc = ctx->mapping.apply(ctx, &mapping, &store_cache_index);
 	if (rc != NGX_OK)
 	{
 		return rc;
 	}
 
-	// initialize for reading files
-	ctx->default_reader = &reader_file_with_fallback;
-	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+	// save to cache
+	if (store_cache_index >= 0)
+	{
+		cache = ctx->mapping.caches[store_cache_index];
+	}
+	else
+	{
+		cache = NULL;
+	}
 
-	// start the state machine
-	rc = ngx_http_vod_start_processing_media_file(ctx);
-	if (rc != NGX_OK && rc != NGX_AGAIN)
+	if (cache != NULL)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_local_request_handler: ngx_http_vod_start_processing_media_file failed %i", rc);
+		if (ctx->mapping.encode != NULL &&
+			ctx->mapping.encode(ctx, &mapping) != NGX_OK)
+		{
+			// cache the original mapping
+			mapping.data = response->pos;
+			mapping.len = response->last - response->pos;
+		}
+
+#if (NGX_HAVE_ZLIB)
+		if (ctx->mapping.compress)
+		{
+			(void)ngx_http_vod_map_compress(ctx, &mapping, &mapping);
+		}
+#endif // NGX_HAVE_ZLIB
+
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			cache,
+			ctx->mapping.cache_key,
+			ctx->cache_tag,
+			mapping.data,
+			mapping.len))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_apply_response: stored in mapping cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_apply_response: failed to store mapping in cache");
+		}
 	}
 
-	return rc;
+	return NGX_OK;
 }
 
-////// Mapped mode only
-
 static ngx_int_t
 ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_buffer_cache_t* cache;
-	ngx_buf_t* response;
-	ngx_str_t* prefix;
+	ngx_http_vod_map_fetch_t* fetch;
 	ngx_str_t mapping;
 	ngx_str_t uri;
-	ngx_md5_t md5;
 	ngx_int_t rc;
 	size_t read_size;
 	int store_cache_index;
 	int fetch_cache_index;
 	uint32_t cache_token;
+	ngx_uint_t cache_state;
 	size_t alloc_extra_size;
 	off_t alignment;
 
 	switch (ctx->state)
 	{
 	case STATE_MAP_INITIAL:
+		fetch = ctx->mapping.cur_fetch;
+		if (fetch != NULL)
+		{
+			// the uri was evaluated and looked up in the cache by ngx_http_vod_map_fetch_all
+			ctx->mapping.cur_fetch = fetch->next;
+			uri = fetch->uri;
+			ngx_memcpy(ctx->mapping.cache_key, fetch->cache_key, sizeof(ctx->mapping.cache_key));
+
+			if (fetch->mapping.data != NULL)
+			{
+				rc = ctx->mapping.apply(ctx, &fetch->mapping, &store_cache_index);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				if (fetch->cache_state == BUFFER_CACHE_FETCH_STALE_REFRESH)
+				{
+					ngx_http_vod_map_start_refresh(ctx, ctx->mapping.caches[fetch->cache_index], &uri);
+				}
+
+				break;
+			}
+
+			if (fetch->response != NULL)
+			{
+				rc = ngx_http_vod_map_apply_response(ctx, fetch->response);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				break;
+			}
+
+			goto open_mapping;
+		}
+
 		// get the uri
 		rc = ctx->mapping.get_uri(ctx, &uri);
 		if (rc != NGX_OK)
@@ -4503,14 +11177,7 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 		}
 
 		// calculate the cache key
-		prefix = ctx->mapping.cache_key_prefix;
-		ngx_md5_init(&md5);
-		if (prefix != NULL)
-		{
-			ngx_md5_update(&md5, prefix->data, prefix->len);
-		}
-		ngx_md5_update(&md5, uri.data, uri.len);
-		ngx_md5_final(ctx->mapping.cache_key, &md5);
+		ngx_http_vod_map_get_cache_key(ctx, &uri, ctx->mapping.cache_key);
 
 		// try getting the mapping from cache
 		fetch_cache_index = ngx_buffer_cache_fetch_multi_perf(
@@ -4519,7 +11186,61 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 			ctx->mapping.cache_count,
 			ctx->mapping.cache_key,
 			&mapping,
-			&cache_token);
+			&cache_token,
+			&cache_state);
+		if (fetch_cache_index >= 0 && 
+			cache_state != BUFFER_CACHE_FETCH_FRESH &&
+			ctx->mapping.reader != &reader_http)
+		{
+			// Note: stale mappings are served only when reading over http, where the refresh
+			//		can be performed in the background
+			ngx_buffer_cache_release(
+				ctx->mapping.caches[fetch_cache_index],
+				ctx->mapping.cache_key,
+				cache_token);
+			fetch_cache_index = -1;
+		}
+
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_MAPPING, fetch_cache_index >= 0);
+
+#if (NGX_HAVE_ZLIB)
+		if (fetch_cache_index >= 0)
+		{
+			rc = ngx_http_vod_map_uncompress(ctx, &mapping, &mapping);
+			if (rc != NGX_DECLINED)
+			{
+				// the mapping was copied to the request pool, the cache entry can be released
+				ngx_buffer_cache_release(
+					ctx->mapping.caches[fetch_cache_index],
+					ctx->mapping.cache_key,
+					cache_token);
+
+				if (rc != NGX_OK)
+				{
+					fetch_cache_index = -1;
+				}
+				else
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_map_run_step: compressed mapping cache hit %V", &mapping);
+
+					rc = ctx->mapping.apply(ctx, &mapping, &store_cache_index);
+					if (rc != NGX_OK)
+					{
+						return rc;
+					}
+
+					if (cache_state == BUFFER_CACHE_FETCH_STALE_REFRESH)
+					{
+						ngx_http_vod_map_start_refresh(ctx, ctx->mapping.caches[fetch_cache_index], &uri);
+					}
+
+					break;
+				}
+			}
+		}
+#endif // NGX_HAVE_ZLIB
+
 		if (fetch_cache_index >= 0)
 		{
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
@@ -4537,6 +11258,11 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 				return rc;
 			}
 
+			if (cache_state == BUFFER_CACHE_FETCH_STALE_REFRESH)
+			{
+				ngx_http_vod_map_start_refresh(ctx, ctx->mapping.caches[fetch_cache_index], &uri);
+			}
+
 			break;
 		}
 		else
@@ -4545,6 +11271,8 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 				"ngx_http_vod_map_run_step: mapping cache miss");
 		}
 
+	open_mapping:
+
 		// open the mapping file
 		ctx->submodule_context.request_context.log->action = "getting mapping";
 
@@ -4610,71 +11338,18 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 			return rc;
 		}
 
-		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MAP_PATH);
+		ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, ctx->perf_counter_context, PC_MAP_PATH);
 
 		// fall through
 
 	case STATE_MAP_READ:
 
-		response = &ctx->read_buffer;
-
-		if (response->last == response->pos)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_map_run_step: empty mapping response");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_EMPTY_MAPPING);
-		}
-
-		// apply the mapping
-		if (response->last >= response->end)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_map_run_step: not enough room in buffer for null terminator");
-			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_MAPPING);
-		}
-
-		*response->last = '\0';
-
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_run_step: mapping result %s", response->pos);
-
-		mapping.data = response->pos;
-		mapping.len = response->last - response->pos;
-		rc = ctx->mapping.apply(ctx, &mapping, &store_cache_index);
+		rc = ngx_http_vod_map_apply_response(ctx, &ctx->read_buffer);
 		if (rc != NGX_OK)
 		{
 			return rc;
 		}
 
-		// save to cache
-		if (store_cache_index >= 0)
-		{
-			cache = ctx->mapping.caches[store_cache_index];
-		}
-		else
-		{
-			cache = NULL;
-		}
-
-		if (cache != NULL)
-		{
-			if (ngx_buffer_cache_store_perf(
-				ctx->perf_counters,
-				cache,
-				ctx->mapping.cache_key,
-				response->pos,
-				response->last - response->pos))
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_map_run_step: stored in mapping cache");
-			}
-			else
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_map_run_step: failed to store mapping in cache");
-			}
-		}
-
 		ctx->state = STATE_MAP_INITIAL;
 		break;
 
@@ -4695,7 +11370,12 @@ ngx_http_vod_map_source_clip_done(ngx_http_vod_ctx_t *ctx)
 	ngx_http_vod_loc_conf_t* conf;
 	conf = ctx->submodule_context.conf;
 
-	if (conf->remote_upstream_location.len == 0)
+	if (conf->ingest_zone != NULL)
+	{
+		// initialize for reading pushed segments
+		ctx->default_reader = &reader_ingest;
+	}
+	else if (conf->remote_upstream_location.len == 0)
 	{
 		// initialize for reading files
 		ctx->default_reader = &reader_file;
@@ -4777,10 +11457,19 @@ ngx_http_vod_map_source_clip_state_machine(ngx_http_vod_ctx_t *ctx)
 	return ngx_http_vod_map_source_clip_done(ctx);
 }
 
+static media_clip_t*
+ngx_http_vod_map_source_clip_next(media_clip_t* clip)
+{
+	media_clip_source_t* next = ((media_clip_source_t*)clip)->next;
+
+	return next != NULL ? &next->base : NULL;
+}
+
 static ngx_int_t
 ngx_http_vod_map_source_clip_start(ngx_http_vod_ctx_t *ctx)
 {
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_int_t rc;
 
 	if (conf->source_clip_map_uri == NULL)
 	{
@@ -4791,12 +11480,19 @@ ngx_http_vod_map_source_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = conf->mapping_cache;
 	ctx->mapping.cache_count = 1;
+	ctx->mapping.compress = conf->mapping_cache_compress;
 	ctx->mapping.get_uri = ngx_http_vod_map_source_clip_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_source_clip_apply;
 
 	ctx->cur_clip = &ctx->submodule_context.media_set.mapped_sources_head->base;
 	ctx->state_machine = ngx_http_vod_map_source_clip_state_machine;
 
+	rc = ngx_http_vod_map_fetch_all(ctx, ngx_http_vod_map_source_clip_next);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
 	return ngx_http_vod_map_source_clip_state_machine(ctx);
 }
 
@@ -4816,71 +11512,169 @@ ngx_http_vod_notification_finished(void* context, ngx_int_t rc, ngx_buf_t* buf,
 	}
 }
 
-static ngx_int_t
-ngx_http_vod_send_notification(ngx_http_vod_ctx_t *ctx)
+// returns TRUE if the notification was already sent by some worker, and marks it as sent otherwise
+static ngx_flag_t
+ngx_http_vod_notification_sent(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
 {
-	ngx_child_request_params_t child_params;
-	ngx_http_vod_loc_conf_t *conf;
-	media_notification_t* notification;
-	ngx_int_t rc;
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->notification_cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t buffer;
+	uint32_t token;
+	ngx_cache_key_t hash;
 
-	notification = ctx->submodule_context.media_set.notifications_head;
-	if (notification == NULL)
+	if (cache == NULL)
 	{
-		// sent all notifications, redirect the segment request
-		return ngx_http_send_response(
-			ctx->submodule_context.r,
-			NGX_HTTP_MOVED_TEMPORARILY,
-			NULL,
-			ctx->submodule_context.conf->redirect_segments_url);
+		return 0;
 	}
 
-	// remove the notification from list
-	ctx->submodule_context.media_set.notifications_head = notification->next;
+	ngx_cache_key_init(&hash, ctx->submodule_context.conf->cache_key_hash);
+	ngx_cache_key_update(&hash, uri->data, uri->len);
+	ngx_cache_key_final(key, &hash);
 
-	// get the notification uri
-	conf = ctx->submodule_context.conf;
-	if (conf->notification_uri == NULL)
+	if (ngx_buffer_cache_fetch_perf(ctx->perf_counters, cache, key, &buffer, &token))
 	{
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_send_notification: no notification uri was configured");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		ngx_buffer_cache_release(cache, key, token);
+		return 1;
 	}
 
-	ngx_memzero(&child_params, sizeof(child_params));
-	ctx->notification = notification;
+	// Note: two workers may send the same notification if they get here at the same time
+	(void)ngx_buffer_cache_store_perf(ctx->perf_counters, cache, key, 0, (u_char*)"1", 1);
 
-	if (ngx_http_complex_value(
-		ctx->submodule_context.r,
-		conf->notification_uri,
-		&child_params.base_uri) != NGX_OK)
-	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_send_notification: ngx_http_complex_value failed");
-		return NGX_ERROR;
-	}
+	return 0;
+}
 
-	ctx->notification = NULL;
+static void
+ngx_http_vod_notification_background_finished(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_request_t* r = context;
 
-	// send the notification
-	rc = ngx_http_vod_alloc_read_buffer(ctx, conf->max_upstream_headers_size + 1, 1);
 	if (rc != NGX_OK)
 	{
-		return rc;
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"ngx_http_vod_notification_background_finished: notification request failed %i", rc);
 	}
+}
 
-	child_params.method = NGX_HTTP_GET;
-	child_params.extra_args = ctx->upstream_extra_args;
-	child_params.range_start = 0;
-	child_params.range_end = 1;
+static ngx_int_t
+ngx_http_vod_send_notification(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t *conf;
+	media_notification_t* notification;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+	ngx_buf_t* b;
 
-	return ngx_child_request_start(
-		ctx->submodule_context.r,
-		ngx_http_vod_notification_finished,
-		ctx,
-		&conf->upstream_location,
-		&child_params,
-		&ctx->read_buffer);
+	conf = ctx->submodule_context.conf;
+
+	for (;;)
+	{
+		notification = ctx->submodule_context.media_set.notifications_head;
+		if (notification == NULL)
+		{
+			// sent all notifications, redirect the segment request
+			return ngx_http_send_response(
+				r,
+				NGX_HTTP_MOVED_TEMPORARILY,
+				NULL,
+				conf->redirect_segments_url);
+		}
+
+		// remove the notification from list
+		ctx->submodule_context.media_set.notifications_head = notification->next;
+
+		// get the notification uri
+		if (conf->notification_uri == NULL)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_send_notification: no notification uri was configured");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		ngx_memzero(&child_params, sizeof(child_params));
+		ctx->notification = notification;
+
+		if (ngx_http_complex_value(
+			r,
+			conf->notification_uri,
+			&child_params.base_uri) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_send_notification: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
+
+		ctx->notification = NULL;
+
+		if (ngx_http_vod_notification_sent(ctx, &child_params.base_uri))
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_send_notification: notification %V was already sent", &child_params.base_uri);
+			continue;
+		}
+
+		child_params.method = NGX_HTTP_GET;
+		child_params.extra_args = ctx->upstream_extra_args;
+		child_params.range_start = 0;
+		child_params.range_end = 1;
+		child_params.perf_counters = ctx->perf_counters;
+		child_params.perf_counter = PC_SEND_NOTIFICATION;
+		child_params.max_concurrency = conf->upstream_max_concurrency;
+		child_params.shared_limit = conf->upstream_limit_zone;
+		child_params.shared_max_concurrency = conf->upstream_shared_max_concurrency;
+		child_params.max_queued = conf->upstream_max_queued;
+
+		if (conf->notification_background)
+		{
+			b = ngx_create_temp_buf(r->pool, conf->max_upstream_headers_size + 1);
+			if (b == NULL)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_send_notification: ngx_create_temp_buf failed");
+				return NGX_ERROR;
+			}
+
+			child_params.background = 1;
+
+			rc = ngx_child_request_start(
+				r,
+				ngx_http_vod_notification_background_finished,
+				r,
+				&conf->upstream_location,
+				&child_params,
+				b);
+			if (rc == NGX_AGAIN)
+			{
+				continue;
+			}
+
+			if (rc != NGX_DECLINED)
+			{
+				// the response of the notification is ignored, so is the failure to send it
+				ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_send_notification: ngx_child_request_start failed %i", rc);
+				continue;
+			}
+
+			// background requests are not supported, send the notification and wait for it
+			child_params.background = 0;
+		}
+
+		// send the notification
+		rc = ngx_http_vod_alloc_read_buffer(ctx, conf->max_upstream_headers_size + 1, 1);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		return ngx_child_request_start(
+			r,
+			ngx_http_vod_notification_finished,
+			ctx,
+			&conf->upstream_location,
+			&child_params,
+			&ctx->read_buffer);
+	}
 }
 
 /// map dynamic clip
@@ -4962,10 +11756,19 @@ ngx_http_vod_map_dynamic_clip_state_machine(ngx_http_vod_ctx_t *ctx)
 	return ngx_http_vod_map_dynamic_clip_done(ctx);
 }
 
+static media_clip_t*
+ngx_http_vod_map_dynamic_clip_next(media_clip_t* clip)
+{
+	media_clip_dynamic_t* next = ((media_clip_dynamic_t*)clip)->next;
+
+	return next != NULL ? &next->base : NULL;
+}
+
 static ngx_int_t
 ngx_http_vod_map_dynamic_clip_start(ngx_http_vod_ctx_t *ctx)
 {
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_int_t rc;
 
 	// map the dynamic clips by calling the upstream
 	if (conf->dynamic_clip_map_uri == NULL)
@@ -4977,12 +11780,19 @@ ngx_http_vod_map_dynamic_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = &conf->dynamic_mapping_cache;
 	ctx->mapping.cache_count = 1;
+	ctx->mapping.compress = 0;
 	ctx->mapping.get_uri = ngx_http_vod_map_dynamic_clip_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_dynamic_clip_apply;
 
 	ctx->cur_clip = &ctx->submodule_context.media_set.dynamic_clips_head->base;
 	ctx->state_machine = ngx_http_vod_map_dynamic_clip_state_machine;
 
+	rc = ngx_http_vod_map_fetch_all(ctx, ngx_http_vod_map_dynamic_clip_next);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
 	return ngx_http_vod_map_dynamic_clip_state_machine(ctx);
 
 }
@@ -5080,9 +11890,36 @@ ngx_http_vod_handle_thumb_redirect(
 	ngx_str_set(&r->headers_out.location->key, "Location");
 	r->headers_out.location->value = location;
 
-	return r->headers_out.status;
+	return r->headers_out.status;
+}
+#endif // NGX_HAVE_LIB_AV_CODEC
+
+static ngx_int_t
+ngx_http_vod_map_media_set_encode(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping)
+{
+	vod_json_value_t json;
+	vod_status_t rc;
+	u_char error[128];
+
+	// Note: the mapping was already parsed successfully by media_set_parse_json
+	rc = vod_json_parse(ctx->submodule_context.request_context.pool, mapping->data, &json, error, sizeof(error));
+	if (rc != VOD_JSON_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_media_set_encode: vod_json_parse failed %i: %s", rc, error);
+		return NGX_ERROR;
+	}
+
+	rc = vod_msgpack_write(ctx->submodule_context.request_context.pool, &json, mapping);
+	if (rc != VOD_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_media_set_encode: vod_msgpack_write failed %i", rc);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
 }
-#endif // NGX_HAVE_LIB_AV_CODEC
 
 static ngx_int_t
 ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
@@ -5093,38 +11930,62 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 	media_clip_source_t* mapped_source;
 	media_sequence_t* sequence;
 	media_set_t mapped_media_set;
-	ngx_str_t override;
+	vod_json_value_t* override = NULL;
+	vod_json_value_t override_json;
+	ngx_str_t override_str;
 	ngx_str_t src_path;
 	ngx_str_t path;
 	ngx_int_t rc;
 	uint32_t request_flags;
-	u_char* override_str = NULL;
+	u_char error[128];
+	u_char* p;
 
-	if (conf->media_set_override_json != NULL)
+	if (conf->media_set_override_template != NULL)
+	{
+		// precompiled at configuration time
+		if (ngx_http_vod_json_template_eval(
+			ctx->submodule_context.r,
+			conf->media_set_override_template,
+			&override) != NGX_OK)
+		{
+			return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
+		}
+	}
+	else if (conf->media_set_override_json != NULL)
 	{
 		if (ngx_http_complex_value(
 			ctx->submodule_context.r,
 			conf->media_set_override_json,
-			&override) != NGX_OK)
+			&override_str) != NGX_OK)
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
 				"ngx_http_vod_map_media_set_apply: ngx_http_complex_value failed");
 			return NGX_ERROR;
 		}
 
-		if (override.len > 0)
+		if (override_str.len > 0)
 		{
 			// copy the string to make sure it's null terminated
-			override_str = ngx_pnalloc(ctx->submodule_context.request_context.pool, override.len + 1);
-			if (override_str == NULL)
+			p = ngx_pnalloc(ctx->submodule_context.request_context.pool, override_str.len + 1);
+			if (p == NULL)
 			{
 				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
 					"ngx_http_vod_map_media_set_apply: ngx_pnalloc failed");
 				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_ALLOC_FAILED);
 			}
 
-			ngx_memcpy(override_str, override.data, override.len);
-			override_str[override.len] = '\0';
+			ngx_memcpy(p, override_str.data, override_str.len);
+			p[override_str.len] = '\0';
+
+			rc = vod_json_parse(ctx->submodule_context.request_context.pool, p, &override_json, error, sizeof(error));
+			if (rc != VOD_JSON_OK)
+			{
+				ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_map_media_set_apply: failed to parse override json %i: %s", rc, error);
+				return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, VOD_BAD_REQUEST);
+			}
+
+			override = &override_json;
 		}
 	}
 
@@ -5135,7 +11996,7 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 			conf->path_response_postfix.data, conf->path_response_postfix.len) == 0 &&
 		memchr(mapping->data + conf->path_response_prefix.len, '"',
 			mapping->len - conf->path_response_prefix.len - conf->path_response_postfix.len) == NULL &&
-		override_str == NULL)
+		override == NULL)
 	{
 		src_path.len = mapping->len - conf->path_response_prefix.len - conf->path_response_postfix.len;
 		if (src_path.len <= 0)
@@ -5204,8 +12065,8 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 
 	rc = media_set_parse_json(
 		&ctx->submodule_context.request_context,
-		mapping->data,
-		override_str,
+		mapping,
+		override,
 		&ctx->submodule_context.request_params,
 		ctx->submodule_context.media_set.segmenter_conf,
 		cur_source,
@@ -5237,7 +12098,12 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 		return ngx_http_vod_status_to_ngx_error(ctx->submodule_context.r, rc);
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, perf_counter_context, PC_PARSE_MEDIA_SET);
+	ngx_perf_counter_end_request(ctx->perf_counters, ctx->request_perf_counters, perf_counter_context, PC_PARSE_MEDIA_SET);
+
+	if (conf->mapping_cache_msgpack && !vod_msgpack_is_map(mapping->data[0]))
+	{
+		ctx->mapping.encode = ngx_http_vod_map_media_set_encode;
+	}
 
 	if (mapped_media_set.sequence_count == 1 &&
 		mapped_media_set.timing.durations == NULL &&
@@ -5360,6 +12226,8 @@ ngx_http_vod_mapped_request_handler(ngx_http_request_t *r)
 	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
 	conf = ctx->submodule_context.conf;
 
+	ctx->bytes_read_counter = PC_BYTES_READ_MAPPED;
+
 	if (conf->upstream_location.len == 0)
 	{
 		// map the uris to files
@@ -5383,6 +12251,7 @@ ngx_http_vod_mapped_request_handler(ngx_http_request_t *r)
 	ctx->mapping.cache_key_prefix = (r->headers_in.host != NULL ? &r->headers_in.host->value : NULL);
 	ctx->mapping.caches = conf->mapping_cache;
 	ctx->mapping.cache_count = CACHE_TYPE_COUNT;
+	ctx->mapping.compress = conf->mapping_cache_compress;
 	ctx->mapping.max_response_size = conf->max_mapping_response_size;
 	ctx->mapping.get_uri = ngx_http_vod_map_media_set_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_media_set_apply;
@@ -5412,6 +12281,7 @@ ngx_http_vod_remote_request_handler(ngx_http_request_t *r)
 
 	ctx->default_reader = &reader_http;
 	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+	ctx->bytes_read_counter = PC_BYTES_READ_REMOTE;
 	ctx->file_key_prefix = (r->headers_in.host != NULL ? &r->headers_in.host->value : NULL);
 
 	rc = ngx_http_vod_start_processing_media_file(ctx);
@@ -5426,22 +12296,24 @@ ngx_http_vod_remote_request_handler(ngx_http_request_t *r)
 
 ////// Main
 
+// Note: only the file name is parsed here, the path is parsed by ngx_http_vod_parse_uri_sequences, 
+//		after the response cache is checked - the request key is derived from the uri, so a uri that
+//		was found in the cache has already been parsed successfully
 static ngx_int_t
 ngx_http_vod_parse_uri(
 	ngx_http_request_t *r, 
 	ngx_http_vod_loc_conf_t *conf, 
 	request_params_t* request_params,
-	media_set_t* media_set,
+	ngx_str_t* uri_path,
 	const ngx_http_vod_request_t** request)
 {
-	ngx_str_t uri_path;
 	ngx_str_t uri_file_name;
 	ngx_int_t rc;
 	int file_components;
 	
 	file_components = conf->submodule.get_file_path_components(&r->uri);
 
-	if (!ngx_http_vod_split_uri_file_name(&r->uri, file_components, &uri_path, &uri_file_name))
+	if (!ngx_http_vod_split_uri_file_name(&r->uri, file_components, uri_path, &uri_file_name))
 	{
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 			"ngx_http_vod_parse_uri: ngx_http_vod_split_uri_file_name failed");
@@ -5450,6 +12322,7 @@ ngx_http_vod_parse_uri(
 
 	request_params->segment_index = INVALID_SEGMENT_INDEX;
 	request_params->segment_time = INVALID_SEGMENT_TIME;
+	request_params->part_index = INVALID_PART_INDEX;
 
 	rc = conf->submodule.parse_uri_file_name(r, conf, uri_file_name.data, uri_file_name.data + uri_file_name.len, request_params, request);
 	if (rc != NGX_OK)
@@ -5459,34 +12332,48 @@ ngx_http_vod_parse_uri(
 		return rc;
 	}
 
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_parse_uri_sequences(
+	ngx_http_request_t *r, 
+	ngx_http_vod_loc_conf_t *conf, 
+	ngx_str_t* uri_path,
+	const ngx_http_vod_request_t* request,
+	request_params_t* request_params,
+	media_set_t* media_set)
+{
+	ngx_int_t rc;
+
 	rc = ngx_http_vod_parse_uri_path(
 		r, 
 		&conf->multi_uri_suffix, 
 		&conf->uri_params_hash, 
-		&uri_path, 
+		uri_path, 
 		request_params, 
 		media_set);
 	if (rc != NGX_OK)
 	{
 		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_parse_uri: ngx_http_vod_parse_uri_path failed %i", rc);
+			"ngx_http_vod_parse_uri_sequences: ngx_http_vod_parse_uri_path failed %i", rc);
 		return rc;
 	}
 
 	if (media_set->sequence_count != 1)
 	{
-		if (((*request)->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
+		if ((request->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
 		{
 			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_parse_uri: request has more than one sub uri while only one is supported");
+				"ngx_http_vod_parse_uri_sequences: request has more than one sub uri while only one is supported");
 			return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
 		}
 
 		if (media_set->sequence_count != 2 &&
-			((*request)->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
+			(request->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
 		{
 			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_parse_uri: request has more than two sub uris while only a single track per media type is allowed");
+				"ngx_http_vod_parse_uri_sequences: request has more than two sub uris while only a single track per media type is allowed");
 			return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
 		}
 	}
@@ -5494,6 +12381,228 @@ ngx_http_vod_parse_uri(
 	return NGX_OK;
 }
 
+// returns the admission class of the request, volume maps are classified by submodule since their requests are segment requests
+static ngx_uint_t
+ngx_http_vod_get_admission_class(ngx_http_vod_loc_conf_t* conf, const ngx_http_vod_request_t* request)
+{
+#if (NGX_HAVE_LIB_AV_CODEC)
+	if (conf->submodule.name == volume_map.name)
+	{
+		return ADMISSION_CLASS_VOLUME_MAP;
+	}
+#endif // NGX_HAVE_LIB_AV_CODEC
+
+	if (request == NULL)
+	{
+		// progressive download
+		return ADMISSION_CLASS_SEGMENT;
+	}
+
+	return ngx_http_vod_admission_get_class(request->request_class);
+}
+
+#if (NGX_HTTP_VOD_PREFETCH)
+// set as the module context of prefetch subrequests, before the handler runs
+static u_char ngx_http_vod_prefetch_marker;
+
+// the number of prefetch subrequests that are in progress in the current worker process
+static ngx_uint_t ngx_http_vod_prefetch_active;
+
+static ngx_int_t
+ngx_http_vod_prefetch_finished(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+	ngx_http_vod_prefetch_active--;
+	return rc;
+}
+
+// starts a background subrequest that builds the segment of the uri and discards the result
+static ngx_int_t
+ngx_http_vod_prefetch_uri(ngx_http_request_t *r, ngx_str_t* uri)
+{
+	ngx_http_post_subrequest_t* ps;
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_http_request_t* sr;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	if (conf->prefetch_max_concurrency != 0 &&
+		ngx_http_vod_prefetch_active >= conf->prefetch_max_concurrency)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_uri: %ui prefetches are in progress, skipping", ngx_http_vod_prefetch_active);
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_prefetch_uri: prefetching %V", uri);
+
+	ps = ngx_palloc(r->pool, sizeof(*ps));
+	if (ps == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_uri: ngx_palloc failed");
+		return NGX_ERROR;
+	}
+
+	ps->handler = ngx_http_vod_prefetch_finished;
+	ps->data = NULL;
+
+	// Note: background subrequests do not delay the response of the main request
+	if (ngx_http_subrequest(r, uri, &r->args, &sr, ps, NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_uri: ngx_http_subrequest failed");
+		return NGX_ERROR;
+	}
+
+	ngx_http_vod_prefetch_active++;
+
+	ngx_http_set_ctx(sr, &ngx_http_vod_prefetch_marker, ngx_http_vod_module);
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_prefetch_next_segment(ngx_http_request_t *r, request_params_t* request_params)
+{
+	ngx_str_t* index_str = &request_params->segment_index_str;
+	ngx_str_t uri;
+	ngx_int_t segment_index;
+	u_char* p;
+
+	// the segment index is parsed from the file name, make sure it points into the uri
+	if (index_str->data < r->uri.data ||
+		index_str->data + index_str->len > r->uri.data + r->uri.len)
+	{
+		return;
+	}
+
+	segment_index = ngx_atoi(index_str->data, index_str->len);
+	if (segment_index == NGX_ERROR)
+	{
+		return;
+	}
+
+	// build the uri of the next segment
+	uri.data = ngx_pnalloc(r->pool, r->uri.len + NGX_INT_T_LEN);
+	if (uri.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_next_segment: ngx_pnalloc failed");
+		return;
+	}
+
+	p = ngx_copy(uri.data, r->uri.data, index_str->data - r->uri.data);
+	p = ngx_sprintf(p, "%i", segment_index + 1);
+	p = ngx_copy(p, index_str->data + index_str->len, r->uri.data + r->uri.len - (index_str->data + index_str->len));
+	uri.len = p - uri.data;
+
+	ngx_http_vod_prefetch_uri(r, &uri);
+}
+
+// called on a segment cache miss of a request for a single video track, builds the same segment of the other 
+// video tracks of the file in the background. the renditions of a title are usually requested together, 
+// the siblings reuse the metadata that was just read, and save their segments to the segment cache
+static void
+ngx_http_vod_prefetch_sibling_segments(ngx_http_vod_ctx_t *ctx)
+{
+	request_params_t* request_params = &ctx->submodule_context.request_params;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	ngx_str_t* tracks_str = &request_params->tracks_str;
+	ngx_str_t uri;
+	uint32_t video_mask = request_params->tracks_mask[MEDIA_TYPE_VIDEO];
+	uint32_t track_count;
+	uint32_t track_index;
+	u_char* uri_end = r->uri.data + r->uri.len;
+	u_char* tracks_end;
+	u_char* index_end;
+	u_char* p;
+
+	if (r != r->main ||
+		r->method != NGX_HTTP_GET ||
+		ctx->prefetch ||
+		ctx->warmup ||
+		(ctx->request->request_class & REQUEST_CLASS_SEGMENT) == 0 ||
+		request_params->part_index != INVALID_PART_INDEX ||
+		media_set->sequence_count != 1 ||
+		media_set->sources_head == NULL ||
+		media_set->sources_head->next != NULL ||
+		ngx_http_vod_get_segment_cache(ctx) == NULL)
+	{
+		return;
+	}
+
+	track_count = ctx->file_video_track_count;
+	if (track_count <= 1)
+	{
+		return;
+	}
+
+	if (track_count > 32)
+	{
+		track_count = 32;		// the size of the tracks mask
+	}
+
+	// a single video track, without audio
+	if (video_mask == 0 ||
+		(video_mask & (video_mask - 1)) != 0 ||
+		request_params->tracks_mask[MEDIA_TYPE_AUDIO] != 0)
+	{
+		return;
+	}
+
+	// the tracks token must point into the uri and have the form v<index>
+	tracks_end = tracks_str->data + tracks_str->len;
+	if (tracks_str->len < 2 ||
+		tracks_str->data < r->uri.data ||
+		tracks_end > uri_end ||
+		tracks_str->data[0] != 'v')
+	{
+		return;
+	}
+
+	index_end = tracks_str->data + 1;
+	while (index_end < tracks_end && *index_end >= '0' && *index_end <= '9')
+	{
+		index_end++;
+	}
+
+	if (index_end == tracks_str->data + 1 ||
+		(index_end < tracks_end && *index_end != '-'))
+	{
+		return;
+	}
+
+	for (track_index = 0; track_index < track_count; track_index++)
+	{
+		if ((video_mask & (1 << track_index)) != 0)
+		{
+			continue;
+		}
+
+		// Note: ngx_http_subrequest does not copy the uri, a buffer is allocated per subrequest
+		uri.data = ngx_pnalloc(r->pool, r->uri.len + NGX_INT_T_LEN);
+		if (uri.data == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_prefetch_sibling_segments: ngx_pnalloc failed");
+			return;
+		}
+
+		p = ngx_copy(uri.data, r->uri.data, tracks_str->data + 1 - r->uri.data);
+		p = ngx_sprintf(p, "%uD", track_index + 1);
+		p = ngx_copy(p, index_end, uri_end - index_end);
+		uri.len = p - uri.data;
+
+		if (ngx_http_vod_prefetch_uri(r, &uri) != NGX_OK)
+		{
+			return;
+		}
+	}
+}
+#endif // NGX_HTTP_VOD_PREFETCH
+
 ngx_int_t
 ngx_http_vod_handler(ngx_http_request_t *r)
 {
@@ -5505,12 +12614,22 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	media_set_t media_set;
 	const ngx_http_vod_request_t* request;
 	ngx_http_vod_loc_conf_t *conf;
+	ngx_buffer_cache_t** frames_response_cache;
+	ngx_buffer_cache_t* segment_cache;
+	ngx_str_t uri_path;
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
-	ngx_md5_t md5;
+	ngx_cache_key_t hash;
 	ngx_str_t cache_buffer;
 	ngx_str_t content_type;
 	ngx_str_t response;
 	ngx_str_t base_url;
+	ngx_str_t skip_str;
+	ngx_str_t cache_partition;
+	ngx_str_t cache_tag;
+	ngx_flag_t response_cache_miss = 0;
+	ngx_flag_t prefetch = 0;
+	ngx_flag_t warmup;
+	ngx_uint_t admission_class;
 	ngx_int_t rc;
 	int cache_type;
 #if (NGX_DEBUG)
@@ -5561,7 +12680,7 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	ngx_memzero(&media_set, sizeof(media_set));
 	if (conf->submodule.parse_uri_file_name != NULL)
 	{
-		rc = ngx_http_vod_parse_uri(r, conf, &request_params, &media_set, &request);
+		rc = ngx_http_vod_parse_uri(r, conf, &request_params, &uri_path, &request);
 		if (rc != NGX_OK)
 		{
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -5599,11 +12718,19 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 		}
 	}
 
+	frames_response_cache = request != NULL ? ngx_http_vod_get_frames_response_cache(conf, request) : NULL;
+	segment_cache = request != NULL && request->init_segment_encryption != NULL ? conf->segment_cache : NULL;
+
+	// warmup requests skip the response cache, since the metadata has to be loaded anyway
+	warmup = ngx_http_get_module_ctx(r, ngx_http_vod_module) == (void*)&ngx_http_vod_warmup_marker;
+
 	if (request != NULL &&
-		request->handle_metadata_request != NULL)
+		!warmup &&
+		(request->handle_metadata_request != NULL || frames_response_cache != NULL || segment_cache != NULL || 
+		conf->segment_size_cache != NULL || ngx_http_vod_get_segment_store(conf) != NULL))
 	{
 		// calc request key from host + uri
-		ngx_md5_init(&md5);
+		ngx_cache_key_init(&hash, conf->cache_key_hash);
 
 		base_url.len = 0;
 		rc = ngx_http_vod_get_base_url(r, conf->base_url, &empty_string, &base_url);
@@ -5611,7 +12738,7 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 		{
 			return rc;
 		}
-		ngx_md5_update(&md5, base_url.data, base_url.len);
+		ngx_cache_key_update(&hash, base_url.data, base_url.len);
 
 		if (conf->segments_base_url != NULL)
 		{
@@ -5621,21 +12748,68 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 			{
 				return rc;
 			}
-			ngx_md5_update(&md5, base_url.data, base_url.len);
+			ngx_cache_key_update(&hash, base_url.data, base_url.len);
 		}
 
-		ngx_md5_update(&md5, r->uri.data, r->uri.len);
+		ngx_cache_key_update(&hash, r->uri.data, r->uri.len);
 
-		ngx_md5_final(request_key, &md5);
+		// HLS delta playlists are cached separately from the full playlists
+		if (ngx_http_arg(r, (u_char *) "_HLS_skip", sizeof("_HLS_skip") - 1, &skip_str) == NGX_OK)
+		{
+			ngx_cache_key_update(&hash, skip_str.data, skip_str.len);
+		}
 
-		// try to fetch from cache
-		cache_type = ngx_buffer_cache_fetch_copy_perf(
-			r,
-			perf_counters,
-			conf->response_cache,
-			CACHE_TYPE_COUNT,
-			request_key,
-			&cache_buffer);
+		ngx_cache_key_final(request_key, &hash);
+
+		// try to fetch from cache, thumbnails / volume maps use separate caches, so that they do not evict manifests
+		if ((request->flags & REQUEST_FLAG_MASTER_MANIFEST) != 0 && conf->master_cache != NULL)
+		{
+			cache_type = (conf->response_cache_zero_copy ? ngx_buffer_cache_fetch_ref_perf : ngx_buffer_cache_fetch_copy_perf)(
+				r,
+				perf_counters,
+				&conf->master_cache,
+				1,
+				request_key,
+				&cache_buffer);
+		}
+		else if (request->handle_metadata_request != NULL)
+		{
+			cache_type = (conf->response_cache_zero_copy ? ngx_buffer_cache_fetch_ref_perf : ngx_buffer_cache_fetch_copy_perf)(
+				r,
+				perf_counters,
+				conf->response_cache,
+				CACHE_TYPE_COUNT,
+				request_key,
+				&cache_buffer);
+		}
+		else if (frames_response_cache != NULL)
+		{
+			cache_type = (conf->response_cache_zero_copy ? ngx_buffer_cache_fetch_ref_perf : ngx_buffer_cache_fetch_copy_perf)(
+				r,
+				perf_counters,
+				frames_response_cache,
+				1,
+				request_key,
+				&cache_buffer);
+		}
+		else
+		{
+			// segments are fetched once the encryption params are known, see ngx_http_vod_segment_cache_fetch
+			cache_type = -1;
+
+			// the segment store holds the segments as they were sent, so it is checked before the metadata is loaded.
+			// Note: prefetch subrequests have a module context, and are not served from the store
+			if (ngx_http_vod_get_segment_store(conf) != NULL &&
+				(request->request_class & REQUEST_CLASS_SEGMENT) != 0 &&
+				ngx_http_get_module_ctx(r, ngx_http_vod_module) == NULL)
+			{
+				rc = ngx_http_vod_segment_store_fetch(r, conf, request, request_key);
+				if (rc != NGX_DECLINED)
+				{
+					goto done;
+				}
+			}
+		}
 		if (cache_type >= 0 &&
 			cache_buffer.len > sizeof(cache_header))
 		{
@@ -5650,11 +12824,28 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 			content_type.data = cache_buffer.data;
 			content_type.len = cache_header.content_type_len;
 
-			if (cache_buffer.len >= content_type.len)
+			if (cache_buffer.len >= content_type.len + cache_header.gzip_len)
 			{
 				// extract the response buffer
 				response.data = cache_buffer.data + content_type.len;
-				response.len = cache_buffer.len - content_type.len;
+				response.len = cache_buffer.len - content_type.len - cache_header.gzip_len;
+
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+				// use the gzip encoded response, if the client accepts it
+				if (cache_header.gzip_len > 0)
+				{
+					rc = ngx_http_vod_set_gzip_encoding(r);
+					if (rc == NGX_OK)
+					{
+						response.data += response.len;
+						response.len = cache_header.gzip_len;
+					}
+					else if (rc != NGX_DECLINED)
+					{
+						return NGX_HTTP_INTERNAL_SERVER_ERROR;
+					}
+				}
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
 
 				// update request flags
 				r->root_tested = !r->error_page;
@@ -5667,7 +12858,8 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 					return rc;
 				}
 
-				rc = ngx_http_vod_send_response(r, &response, NULL);
+				// Note: the response may point to the shared memory, so it must not be modified by the output filters
+				rc = ngx_http_vod_send_read_only_response(r, &response, NULL);
 				goto done;
 			}
 		}
@@ -5675,6 +12867,46 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 				"ngx_http_vod_handler: response cache miss");
+
+			// segments are not looked up in the response cache
+			response_cache_miss = request->handle_metadata_request != NULL || frames_response_cache != NULL;
+		}
+	}
+
+	if (request != NULL)
+	{
+		rc = ngx_http_vod_parse_uri_sequences(r, conf, &uri_path, request, &request_params, &media_set);
+		if (rc != NGX_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_handler: ngx_http_vod_parse_uri_sequences failed %i", rc);
+			goto done;
+		}
+	}
+
+#if (NGX_HTTP_VOD_PREFETCH)
+	prefetch = ngx_http_get_module_ctx(r, ngx_http_vod_module) == (void*)&ngx_http_vod_prefetch_marker;
+
+	if (conf->prefetch_next_segment &&
+		r == r->main &&
+		r->method == NGX_HTTP_GET &&
+		request != NULL &&
+		(request->request_class & REQUEST_CLASS_SEGMENT) != 0 &&
+		request_params.segment_index_str.len > 0 &&
+		request_params.part_index == INVALID_PART_INDEX)
+	{
+		ngx_http_vod_prefetch_next_segment(r, &request_params);
+	}
+#endif // NGX_HTTP_VOD_PREFETCH
+
+	// low priority requests that missed the caches are rejected when the worker is overloaded
+	admission_class = ngx_http_vod_get_admission_class(conf, request);
+	if (ngx_http_vod_admission_is_low_priority(r, admission_class))
+	{
+		rc = ngx_http_vod_admission_acquire(r);
+		if (rc != NGX_OK)
+		{
+			goto done;
 		}
 	}
 
@@ -5696,13 +12928,88 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	ctx->submodule_context.media_set.segmenter_conf = &conf->segmenter;
 	ctx->submodule_context.media_set.version = request_params.version;
 	ctx->request = request;
+	ctx->prefetch = prefetch;
+	ctx->warmup = warmup;
+	ctx->admission_class = admission_class;
 	ctx->cur_source = media_set.sources_head;
 	ctx->submodule_context.request_context.pool = r->pool;
 	ctx->submodule_context.request_context.log = r->connection->log;
 	ctx->submodule_context.request_context.output_buffer_pool = conf->output_buffer_pool;
+	ctx->submodule_context.request_context.max_memory = conf->max_request_memory;
+	ctx->submodule_context.request_context.arena = conf->request_arena;
+#if (NGX_THREADS)
+	if (conf->parse_metadata_thread_pool != NULL)
+	{
+		// the free lists of the arena are not thread safe
+		ctx->submodule_context.request_context.arena = NULL;
+	}
+
+	if (conf->processing_thread_pool != NULL)
+	{
+		// the free lists of the arena and the output buffer pool are not thread safe
+		ctx->submodule_context.request_context.arena = NULL;
+		ctx->submodule_context.request_context.output_buffer_pool = NULL;
+	}
+#endif // NGX_THREADS
 	ctx->perf_counters = perf_counters;
 	ngx_perf_counter_copy(ctx->total_perf_counter_context, pcctx);
 
+	ctx->metadata_cache = conf->metadata_cache;
+	if (conf->metadata_cache != NULL && conf->metadata_cache_partition != NULL)
+	{
+		if (ngx_http_complex_value(r, conf->metadata_cache_partition, &cache_partition) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_handler: ngx_http_complex_value failed");
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			goto done;
+		}
+
+		ctx->metadata_cache = ngx_buffer_cache_get_partition(conf->metadata_cache, &cache_partition);
+	}
+
+	if (conf->cache_tag != NULL)
+	{
+		if (ngx_http_complex_value(r, conf->cache_tag, &cache_tag) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_handler: ngx_http_complex_value failed");
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			goto done;
+		}
+
+		if (cache_tag.len > 0)
+		{
+			ctx->cache_tag = ngx_buffer_cache_get_tag(&cache_tag);
+		}
+	}
+
+	if (conf->request_samples_zone != NULL)
+	{
+		ctx->sampled = ngx_request_samples_select(conf->request_samples_zone);
+	}
+
+	if (response_cache_miss)
+	{
+		ngx_http_vod_set_cache_result(ctx, REQUEST_SAMPLE_CACHE_RESPONSE, 0);
+	}
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	if (conf->slow_request_threshold > 0)
+	{
+		ctx->request_perf_counters.events = ngx_array_create(r->pool, 16, sizeof(ngx_perf_counter_event_t));
+		if (ctx->request_perf_counters.events == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_handler: ngx_array_create failed");
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			goto done;
+		}
+
+		ctx->request_perf_counters.start = pcctx.start;
+	}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
 #if (NGX_DEBUG)
 	// in debug builds allow overriding the server time
 	if (ngx_http_arg(r, (u_char *) "time", sizeof("time") - 1, &time_str) == NGX_OK)
@@ -5725,7 +13032,29 @@ done:
 	}
 	else
 	{
-		ngx_perf_counter_end(perf_counters, pcctx, PC_TOTAL);
+		ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+		if (ctx != NULL)
+		{
+			ngx_perf_counter_end_request(perf_counters, ctx->request_perf_counters, pcctx, PC_TOTAL);
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+			if (ctx->request_perf_counters.events != NULL)
+			{
+				ngx_http_vod_log_slow_request(ctx);
+			}
+
+			if (ctx->sampled)
+			{
+				ngx_http_vod_add_request_sample(ctx, rc);
+			}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
+			ngx_http_vod_admission_request_done(r, ctx->admission_class);
+		}
+		else
+		{
+			ngx_perf_counter_end(perf_counters, pcctx, PC_TOTAL);
+		}
 	}
 
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_vod_handler: done");
@@ -116,9 +116,11 @@ ngx_http_vod_mss_init_frame_processor(
 		switch (rc)
 		{
 		case VOD_DONE:		// passthrough
+			ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 1);
 			break;
 
 		case VOD_OK:
+			ngx_http_vod_update_drm_counter(conf, &submodule_context->media_set, 0);
 			segment_writer = &drm_writer;
 			reuse_buffers = TRUE;		// mp4_cenc_encrypt allocates new buffers
 			break;
@@ -156,6 +158,7 @@ ngx_http_vod_mss_init_frame_processor(
 			&submodule_context->request_context,
 			submodule_context->media_set.sequences,
 			segment_writer->write_tail,
+			segment_writer->write_file,
 			segment_writer->context,
 			reuse_buffers,
 			&state);
@@ -210,6 +213,7 @@ static const ngx_http_vod_request_t mss_manifest_request = {
 	MSS_TIMESCALE,
 	ngx_http_vod_mss_handle_manifest,
 	NULL,
+	NULL,
 };
 
 static const ngx_http_vod_request_t mss_fragment_request = {
@@ -220,6 +224,7 @@ static const ngx_http_vod_request_t mss_fragment_request = {
 	MSS_TIMESCALE,
 	NULL,
 	ngx_http_vod_mss_init_frame_processor,
+	NULL,
 };
 
 static const ngx_http_vod_request_t mss_playready_fragment_request = {
@@ -230,6 +235,7 @@ static const ngx_http_vod_request_t mss_playready_fragment_request = {
 	MSS_TIMESCALE,
 	NULL,
 	ngx_http_vod_mss_init_frame_processor,
+	NULL,
 };
 
 static const ngx_http_vod_request_t mss_ttml_request = {
@@ -240,6 +246,7 @@ static const ngx_http_vod_request_t mss_ttml_request = {
 	TTML_TIMESCALE,
 	ngx_http_vod_mss_handle_ttml_fragment,
 	NULL,
+	NULL,
 };
 
 static void
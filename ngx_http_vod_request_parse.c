@@ -252,7 +252,9 @@ ngx_http_vod_parse_uri_file_name(
 			start_pos++;		// skip the -
 		}
 
+		result->segment_index_str.data = start_pos;
 		start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->segment_index);
+		result->segment_index_str.len = start_pos - result->segment_index_str.data;
 		if (result->segment_index <= 0)
 		{
 			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -261,6 +263,22 @@ ngx_http_vod_parse_uri_file_name(
 		}
 		result->segment_index--;		// convert to 0-based
 
+		// part index
+		if ((flags & PARSE_FILE_NAME_ALLOW_PART_INDEX) != 0 &&
+			end_pos - start_pos >= 2 && start_pos[0] == '.' && start_pos[1] >= '0' && start_pos[1] <= '9')
+		{
+			start_pos++;		// skip the .
+
+			start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->part_index);
+			if (result->part_index <= 0)
+			{
+				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+					"ngx_http_vod_parse_uri_file_name: failed to parse part index");
+				return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
+			}
+			result->part_index--;		// convert to 0-based
+		}
+
 		skip_dash(start_pos, end_pos);
 
 		// index shift
@@ -450,11 +468,14 @@ ngx_http_vod_parse_uri_file_name(
 	else if (*start_pos == 'v' || *start_pos == 'a')
 	{
 		// tracks
+		result->tracks_str.data = start_pos;
 		start_pos = ngx_http_vod_extract_track_tokens(start_pos, end_pos, result->tracks_mask);
 		if (start_pos == NULL)
 		{
+			result->tracks_str.len = end_pos - result->tracks_str.data;
 			return NGX_OK;
 		}
+		result->tracks_str.len = start_pos - result->tracks_str.data;
 	}
 
 	// pts delay
@@ -934,6 +955,7 @@ ngx_http_vod_extract_uri_params(
 
 				if (param_def->name_conf_offset == offsetof(ngx_http_vod_loc_conf_t, speed_param_name))
 				{
+					ngx_memzero(&request_context, sizeof(request_context));
 					request_context.pool = r->pool;
 					request_context.log = r->connection->log;
 
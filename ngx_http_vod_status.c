@@ -5,22 +5,104 @@
 #include "ngx_http_vod_conf.h"
 #include "ngx_perf_counters.h"
 #include "ngx_buffer_cache.h"
+#include "vod/buffer_pool.h"
 
 // macros
 #define DEFINE_STAT(x) { { sizeof(#x) - 1, (u_char *) #x }, offsetof(ngx_buffer_cache_stats_t, x) }
+#define DEFINE_HISTOGRAM(x, sum, min_bits)	\
+	{ { sizeof(#x) - 1, (u_char *) #x }, offsetof(ngx_buffer_cache_stats_t, x##_buckets), offsetof(ngx_buffer_cache_stats_t, sum), min_bits }
 
 // constants
 #define PATH_PERF_COUNTERS_OPEN "<performance_counters>\r\n"
 #define PATH_PERF_COUNTERS_CLOSE "</performance_counters>\r\n"
-#define PERF_COUNTER_FORMAT "<sum>%uA</sum>\r\n<count>%uA</count>\r\n<max>%uA</max>\r\n<max_time>%uA</max_time>\r\n<max_pid>%uA</max_pid>\r\n"
+#define PERF_COUNTER_FORMAT "<sum>%uA</sum>\r\n<cpu_sum>%uA</cpu_sum>\r\n<count>%uA</count>\r\n<max>%uA</max>\r\n<max_time>%uA</max_time>\r\n<max_pid>%uA</max_pid>\r\n"
+#define PERF_COUNTER_BYTES_READ_OPEN "<bytes_read>\r\n"
+#define PERF_COUNTER_BYTES_READ_CLOSE "</bytes_read>\r\n"
+#define PERF_COUNTER_BYTES_FORMAT "<%V>%uA</%V>\r\n"
+#define PERF_COUNTER_DRM_SEGMENTS_OPEN "<drm_segments>\r\n"
+#define PERF_COUNTER_DRM_SEGMENTS_CLOSE "</drm_segments>\r\n"
+#define PERF_COUNTER_HISTOGRAM_OPEN "<histogram>\r\n"
+#define PERF_COUNTER_HISTOGRAM_CLOSE "</histogram>\r\n"
+#define PERF_COUNTER_BUCKET_FORMAT "<bucket le=\"%ui\">%uA</bucket>\r\n"
+#define PERF_COUNTER_LAST_BUCKET_FORMAT "<bucket le=\"+Inf\">%uA</bucket>\r\n"
+
+#define PATH_POPULARITY_OPEN "<popularity>\r\n"
+#define PATH_POPULARITY_CLOSE "</popularity>\r\n"
+#define POPULARITY_TITLE_OPEN "<title>\r\n<name>"
+#define POPULARITY_TITLE_CLOSE_FORMAT "</name>\r\n<count>%ui</count>\r\n</title>\r\n"
+
+#define PATH_UPSTREAM_LIMITS_OPEN "<upstream_limits>\r\n"
+#define PATH_UPSTREAM_LIMITS_CLOSE "</upstream_limits>\r\n"
+#define UPSTREAM_LIMIT_OPEN "<upstream>\r\n<location>"
+#define UPSTREAM_LIMIT_CLOSE_FORMAT	\
+	"</location>\r\n<active>%uA</active>\r\n<queued>%uA</queued>\r\n<waited>%uA</waited>\r\n<rejected>%uA</rejected>\r\n</upstream>\r\n"
+
+#define PATH_CACHE_SHARD_OPEN "<shard>\r\n"
+#define PATH_CACHE_SHARD_CLOSE "</shard>\r\n"
+#define PATH_CACHE_SHARD_NUMA_NODE_FORMAT "<numa_node>%ui</numa_node>\r\n"
+#define PATH_CACHE_HUGE_PAGES_SIZE_FORMAT "<huge_pages_size>%uz</huge_pages_size>\r\n"
+#define PATH_CACHE_PARTITION_OPEN_FORMAT "<partition>\r\n<name>%V</name>\r\n"
+#define PATH_CACHE_PARTITION_CLOSE "</partition>\r\n"
+#define PATH_CACHE_HIT_RATIO_FORMAT "<hit_ratio>%ui.%03ui</hit_ratio>\r\n"
+#define PATH_CACHE_HISTOGRAM_OPEN_FORMAT "<%V_histogram>\r\n"
+#define PATH_CACHE_HISTOGRAM_CLOSE_FORMAT "</%V_histogram>\r\n"
+
+#define DUMP_RESULT_FORMAT "%V %ui\r\n"
+
+#define SAMPLES_JSON_PREFIX "{\"samples\":["
+#define SAMPLES_JSON_POSTFIX "]}\n"
+#define SAMPLE_JSON_FORMAT	\
+	"{\"time\":%T,\"pid\":%P,\"status\":%ui,\"duration_us\":%ui,\"bytes_read\":%ui,\"uri\":\""
+#define SAMPLE_JSON_CONTENT_TYPE "\",\"content_type\":\""
+#define SAMPLE_JSON_CACHE_OPEN "\",\"cache\":{"
+#define SAMPLE_JSON_CACHE_FORMAT "\"%V\":\"%s\","
+#define SAMPLE_JSON_STAGES_OPEN "},\"stages\":{"
+#define SAMPLE_JSON_STAGE_FORMAT "\"%V\":{\"sum_us\":%ui,\"count\":%ui},"
+#define SAMPLE_JSON_CLOSE "}},\n"
+
+#define BUFFER_POOL_SIZE_CLASS_FORMAT	\
+	"<size_class>\r\n<size>%uz</size>\r\n<count>%ui</count>\r\n<max_count>%ui</max_count>\r\n"	\
+	"<free>%ui</free>\r\n<hits>%ui</hits>\r\n<misses>%ui</misses>\r\n</size_class>\r\n"
 
 #define PROM_VOD_CACHE_METRIC_FORMAT "vod_cache_%V{cache=\"%V\"} %uA\n"
+#define PROM_VOD_CACHE_SHARD_METRIC_FORMAT "vod_cache_shard_%V{cache=\"%V\",shard=\"%ui\"} %uA\n"
+#define PROM_VOD_CACHE_NUMA_SHARD_METRIC_FORMAT "vod_cache_shard_%V{cache=\"%V\",numa_node=\"%ui\",shard=\"%ui\"} %uA\n"
+#define PROM_VOD_CACHE_PARTITION_METRIC_FORMAT "vod_cache_partition_%V{cache=\"%V\",partition=\"%V\"} %uA\n"
+#define PROM_VOD_CACHE_HUGE_PAGES_FORMAT "vod_cache_huge_pages_bytes{cache=\"%V\"} %uz\n"
+#define PROM_VOD_CACHE_BUCKET_FORMAT "vod_cache_%V_bucket{cache=\"%V\",le=\"%ui\"} %uA\n"
+#define PROM_VOD_CACHE_HISTOGRAM_METRICS							\
+	"vod_cache_%V_bucket{cache=\"%V\",le=\"+Inf\"} %uA\n"		\
+	"vod_cache_%V_sum{cache=\"%V\"} %uA\n"					\
+	"vod_cache_%V_count{cache=\"%V\"} %uA\n"					\
+
 #define PROM_PERF_COUNTER_METRICS						\
 	"vod_perf_counter_sum{action=\"%V\"} %uA\n"			\
+	"vod_perf_counter_cpu_sum{action=\"%V\"} %uA\n"		\
 	"vod_perf_counter_count{action=\"%V\"} %uA\n"		\
 	"vod_perf_counter_max{action=\"%V\"} %uA\n"			\
 	"vod_perf_counter_max_time{action=\"%V\"} %uA\n"	\
-	"vod_perf_counter_max_pid{action=\"%V\"} %uA\n\n"	\
+	"vod_perf_counter_max_pid{action=\"%V\"} %uA\n"		\
+
+#define PROM_UPSTREAM_LIMIT_METRICS								\
+	"vod_upstream_limit_active{location=\"%V\"} %uA\n"		\
+	"vod_upstream_limit_queued{location=\"%V\"} %uA\n"		\
+	"vod_upstream_limit_waited{location=\"%V\"} %uA\n"		\
+	"vod_upstream_limit_rejected{location=\"%V\"} %uA\n"	\
+
+#define PROM_PERF_COUNTER_BYTES_FORMAT "vod_bytes_read{mode=\"%V\"} %uA\n"
+#define PROM_PERF_COUNTER_DRM_SEGMENTS_FORMAT "vod_drm_segments{mode=\"%V\"} %uA\n"
+#define PROM_PERF_COUNTER_BUCKET_FORMAT "vod_perf_counter_duration_bucket{action=\"%V\",le=\"%ui\"} %uA\n"
+#define PROM_PERF_COUNTER_HISTOGRAM_METRICS								\
+	"vod_perf_counter_duration_bucket{action=\"%V\",le=\"+Inf\"} %uA\n"	\
+	"vod_perf_counter_duration_sum{action=\"%V\"} %uA\n"				\
+	"vod_perf_counter_duration_count{action=\"%V\"} %uA\n\n"			\
+
+#define PROM_BUFFER_POOL_METRICS												\
+	"vod_buffer_pool_count{pool=\"%V\",size=\"%uz\"} %ui\n"				\
+	"vod_buffer_pool_max_count{pool=\"%V\",size=\"%uz\"} %ui\n"			\
+	"vod_buffer_pool_free{pool=\"%V\",size=\"%uz\"} %ui\n"				\
+	"vod_buffer_pool_hits{pool=\"%V\",size=\"%uz\"} %ui\n"				\
+	"vod_buffer_pool_misses{pool=\"%V\",size=\"%uz\"} %ui\n\n"			\
 
 // typedefs
 typedef struct {
@@ -34,6 +116,13 @@ typedef struct {
 	unsigned offset;
 } ngx_http_vod_stat_def_t;
 
+typedef struct {
+	ngx_str_t name;
+	unsigned offset;			// BUFFER_CACHE_HISTOGRAM_BUCKETS counters
+	unsigned sum_offset;
+	ngx_uint_t min_bits;
+} ngx_http_vod_histogram_def_t;
+
 // constants
 static const u_char status_prefix[] = 
 	"<?xml version=\"1.0\" encoding=\"utf-8\" ?>\r\n"
@@ -43,6 +132,7 @@ static const u_char status_postfix[] = "</vod>\r\n";
 
 static ngx_str_t xml_content_type = ngx_string("text/xml");
 static ngx_str_t text_content_type = ngx_string("text/plain");
+static ngx_str_t json_content_type = ngx_string("application/json");
 static ngx_str_t reset_response = ngx_string("OK\r\n");
 
 static ngx_http_vod_stat_def_t buffer_cache_stat_defs[] = {
@@ -50,17 +140,33 @@ static ngx_http_vod_stat_def_t buffer_cache_stat_defs[] = {
 	DEFINE_STAT(store_bytes),
 	DEFINE_STAT(store_err),
 	DEFINE_STAT(store_exists),
+	DEFINE_STAT(store_rejected),
 	DEFINE_STAT(fetch_hit),
 	DEFINE_STAT(fetch_bytes),
 	DEFINE_STAT(fetch_miss),
+	DEFINE_STAT(fetch_stale),
+	DEFINE_STAT(fetch_local_hit),
 	DEFINE_STAT(evicted),
 	DEFINE_STAT(evicted_bytes),
+	DEFINE_STAT(evicted_expired),
+	DEFINE_STAT(evicted_no_entries),
+	DEFINE_STAT(evicted_no_space),
+	DEFINE_STAT(expire_limit_reached),
 	DEFINE_STAT(reset),
+	DEFINE_STAT(purged),
 	DEFINE_STAT(entries),
 	DEFINE_STAT(data_size),
 	{ ngx_null_string, 0 }
 };
 
+// Note: the histograms are reported only for the totals of each cache, not per shard / partition
+static ngx_http_vod_histogram_def_t buffer_cache_histogram_defs[] = {
+	DEFINE_HISTOGRAM(store_size, store_bytes, BUFFER_CACHE_SIZE_HISTOGRAM_MIN_BITS),
+	DEFINE_HISTOGRAM(evicted_age, evicted_age_sum, BUFFER_CACHE_AGE_HISTOGRAM_MIN_BITS),
+	DEFINE_HISTOGRAM(hit_age, hit_age_sum, BUFFER_CACHE_AGE_HISTOGRAM_MIN_BITS),
+	{ ngx_null_string, 0, 0, 0 }
+};
+
 static ngx_http_vod_cache_info_t cache_infos[] = {
 	{
 		offsetof(ngx_http_vod_loc_conf_t, metadata_cache),
@@ -92,8 +198,122 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<drm_info_cache>\r\n"),
 		ngx_string("</drm_info_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, upstream_block_cache),
+		ngx_string("<upstream_block_cache>\r\n"),
+		ngx_string("</upstream_block_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, iframes_cache),
+		ngx_string("<iframes_cache>\r\n"),
+		ngx_string("</iframes_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, master_cache),
+		ngx_string("<master_cache>\r\n"),
+		ngx_string("</master_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, metadata_hint_cache),
+		ngx_string("<metadata_hint_cache>\r\n"),
+		ngx_string("</metadata_hint_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, segment_durations_cache),
+		ngx_string("<segment_durations_cache>\r\n"),
+		ngx_string("</segment_durations_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, segment_size_cache),
+		ngx_string("<segment_size_cache>\r\n"),
+		ngx_string("</segment_size_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, audio_filter_cache),
+		ngx_string("<audio_filter_cache>\r\n"),
+		ngx_string("</audio_filter_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, thumb_cache),
+		ngx_string("<thumb_cache>\r\n"),
+		ngx_string("</thumb_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, volume_map_cache),
+		ngx_string("<volume_map_cache>\r\n"),
+		ngx_string("</volume_map_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, segment_cache),
+		ngx_string("<segment_cache>\r\n"),
+		ngx_string("</segment_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, segment_frames_cache),
+		ngx_string("<segment_frames_cache>\r\n"),
+		ngx_string("</segment_frames_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, resident_frames_cache),
+		ngx_string("<resident_frames_cache>\r\n"),
+		ngx_string("</resident_frames_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, clip_header_cache),
+		ngx_string("<clip_header_cache>\r\n"),
+		ngx_string("</clip_header_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, notification_cache),
+		ngx_string("<notification_cache>\r\n"),
+		ngx_string("</notification_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, fallback_cache),
+		ngx_string("<fallback_cache>\r\n"),
+		ngx_string("</fallback_cache>\r\n"),
+	},
 };
 
+// Note: the buffer pools are allocated in the memory of each worker, the reported values are of the worker 
+//		that handled the status request
+static ngx_http_vod_cache_info_t buffer_pool_infos[] = {
+	{
+		offsetof(ngx_http_vod_loc_conf_t, output_buffer_pool),
+		ngx_string("<output_buffer_pool>\r\n"),
+		ngx_string("</output_buffer_pool>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, read_buffer_pool),
+		ngx_string("<read_buffer_pool>\r\n"),
+		ngx_string("</read_buffer_pool>\r\n"),
+	},
+};
+
+static u_char*
+ngx_http_vod_append_buffer_pool_stats(u_char* p, buffer_pool_t* buffer_pool)
+{
+	buffer_pool_stats_t stats;
+	vod_uint_t count;
+	vod_uint_t i;
+
+	count = buffer_pool_get_size_class_count(buffer_pool);
+	for (i = 0; i < count; i++)
+	{
+		buffer_pool_get_stats(buffer_pool, i, &stats);
+
+		p = ngx_sprintf(p, BUFFER_POOL_SIZE_CLASS_FORMAT,
+			stats.size,
+			stats.count,
+			stats.max_count,
+			stats.free_count,
+			stats.hits,
+			stats.misses);
+	}
+
+	return p;
+}
+
 static u_char*
 ngx_http_vod_append_cache_stats(u_char* p, ngx_buffer_cache_stats_t* stats)
 {
@@ -123,12 +343,306 @@ ngx_http_vod_append_cache_stats(u_char* p, ngx_buffer_cache_stats_t* stats)
 	return p;
 }
 
+// appends the non-empty buckets of the histograms of a cache
+static u_char*
+ngx_http_vod_append_cache_histograms(u_char* p, ngx_buffer_cache_stats_t* stats)
+{
+	ngx_http_vod_histogram_def_t* cur_hist;
+	ngx_atomic_t* buckets;
+	ngx_uint_t i;
+
+	for (cur_hist = buffer_cache_histogram_defs; cur_hist->name.data != NULL; cur_hist++)
+	{
+		buckets = (ngx_atomic_t*)((u_char*)stats + cur_hist->offset);
+
+		p = ngx_sprintf(p, PATH_CACHE_HISTOGRAM_OPEN_FORMAT, &cur_hist->name);
+		for (i = 0; i < BUFFER_CACHE_HISTOGRAM_BUCKETS - 1; i++)
+		{
+			if (buckets[i] != 0)
+			{
+				p = ngx_sprintf(p, PERF_COUNTER_BUCKET_FORMAT, 
+					ngx_buffer_cache_get_histogram_bound(i, cur_hist->min_bits), buckets[i]);
+			}
+		}
+
+		if (buckets[i] != 0)
+		{
+			p = ngx_sprintf(p, PERF_COUNTER_LAST_BUCKET_FORMAT, buckets[i]);
+		}
+		p = ngx_sprintf(p, PATH_CACHE_HISTOGRAM_CLOSE_FORMAT, &cur_hist->name);
+	}
+
+	return p;
+}
+
+// appends the histograms of a cache in prometheus format, the bucket counts are cumulative
+static u_char*
+ngx_http_vod_append_prom_cache_histograms(u_char* p, ngx_str_t* cache_name, ngx_buffer_cache_stats_t* stats)
+{
+	ngx_http_vod_histogram_def_t* cur_hist;
+	ngx_atomic_t* buckets;
+	ngx_atomic_t total;
+	ngx_uint_t i;
+
+	for (cur_hist = buffer_cache_histogram_defs; cur_hist->name.data != NULL; cur_hist++)
+	{
+		buckets = (ngx_atomic_t*)((u_char*)stats + cur_hist->offset);
+
+		total = 0;
+		for (i = 0; i < BUFFER_CACHE_HISTOGRAM_BUCKETS - 1; i++)
+		{
+			total += buckets[i];
+			p = ngx_sprintf(p, PROM_VOD_CACHE_BUCKET_FORMAT, &cur_hist->name, cache_name, 
+				ngx_buffer_cache_get_histogram_bound(i, cur_hist->min_bits), total);
+		}
+
+		total += buckets[i];
+
+		p = ngx_sprintf(p, PROM_VOD_CACHE_HISTOGRAM_METRICS,
+			&cur_hist->name, cache_name, total,
+			&cur_hist->name, cache_name, *(ngx_atomic_t*)((u_char*)stats + cur_hist->sum_offset),
+			&cur_hist->name, cache_name, total);
+	}
+
+	return p;
+}
+
+// returns the totals of the counters of all the workers, or null if performance counters are not enabled
+static u_char*
+ngx_http_vod_append_cache_hit_ratio(u_char* p, ngx_buffer_cache_stats_t* stats)
+{
+	ngx_atomic_uint_t fetch_count;
+	ngx_uint_t ratio;
+
+	fetch_count = stats->fetch_hit + stats->fetch_miss;
+	ratio = fetch_count > 0 ? (ngx_uint_t)(stats->fetch_hit * 1000 / fetch_count) : 0;
+
+	return ngx_sprintf(p, PATH_CACHE_HIT_RATIO_FORMAT, ratio / 1000, ratio % 1000);
+}
+
+static ngx_int_t
+ngx_http_vod_status_get_perf_counters(
+	ngx_http_request_t *r, 
+	ngx_http_vod_loc_conf_t *conf, 
+	ngx_perf_counters_t** result)
+{
+	ngx_perf_counters_t* perf_counters;
+
+	if (ngx_perf_counter_get_state(conf->perf_counters_zone) == NULL)
+	{
+		*result = NULL;
+		return NGX_OK;
+	}
+
+	perf_counters = ngx_palloc(r->pool, sizeof(*perf_counters));
+	if (perf_counters == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_get_perf_counters: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ngx_perf_counters_get_totals(conf->perf_counters_zone, perf_counters);
+
+	*result = perf_counters;
+	return NGX_OK;
+}
+
+// appends the non-empty buckets of the histogram of a counter
+static u_char*
+ngx_http_vod_append_perf_counter_histogram(u_char* p, ngx_perf_counter_t* counter)
+{
+	ngx_atomic_t count;
+	ngx_uint_t i;
+
+	p = ngx_copy(p, PERF_COUNTER_HISTOGRAM_OPEN, sizeof(PERF_COUNTER_HISTOGRAM_OPEN) - 1);
+	for (i = 0; i < NGX_PERF_COUNTER_BUCKET_COUNT - 1; i++)
+	{
+		count = counter->buckets[i];
+		if (count != 0)
+		{
+			p = ngx_sprintf(p, PERF_COUNTER_BUCKET_FORMAT, ngx_perf_counter_get_bucket_bound(i), count);
+		}
+	}
+
+	count = counter->buckets[i];
+	if (count != 0)
+	{
+		p = ngx_sprintf(p, PERF_COUNTER_LAST_BUCKET_FORMAT, count);
+	}
+	p = ngx_copy(p, PERF_COUNTER_HISTOGRAM_CLOSE, sizeof(PERF_COUNTER_HISTOGRAM_CLOSE) - 1);
+
+	return p;
+}
+
+// appends the histogram of a counter in prometheus format, the bucket counts are cumulative
+static u_char*
+ngx_http_vod_append_prom_perf_counter_histogram(u_char* p, ngx_str_t* action, ngx_perf_counter_t* counter)
+{
+	ngx_atomic_t total;
+	ngx_uint_t i;
+
+	total = 0;
+	for (i = 0; i < NGX_PERF_COUNTER_BUCKET_COUNT - 1; i++)
+	{
+		total += counter->buckets[i];
+		p = ngx_sprintf(p, PROM_PERF_COUNTER_BUCKET_FORMAT, action, ngx_perf_counter_get_bucket_bound(i), total);
+	}
+
+	total += counter->buckets[i];
+
+	// Note: the count is taken from the buckets and not from the count field, since they are not updated atomically together
+	return ngx_sprintf(p, PROM_PERF_COUNTER_HISTOGRAM_METRICS, 
+		action, total,
+		action, counter->sum,
+		action, total);
+}
+
+static ngx_int_t
+ngx_http_vod_status_dump(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_buffer_cache_t *cur_cache;
+	ngx_str_t cache_name;
+	ngx_str_t response;
+	ngx_uint_t count;
+	ngx_int_t rc;
+	u_char* p;
+	size_t result_size;
+	unsigned i;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	result_size = 0;
+	for (i = 0; i < vod_array_entries(cache_infos); i++)
+	{
+		result_size += sizeof(DUMP_RESULT_FORMAT) + cache_infos[i].open_tag.len + NGX_INT_T_LEN;
+	}
+
+	response.data = ngx_pnalloc(r->pool, result_size);
+	if (response.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_dump: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = response.data;
+
+	// Note: the dump is performed synchronously, it blocks the worker process until the files are written
+	for (i = 0; i < vod_array_entries(cache_infos); i++)
+	{
+		cur_cache = *(ngx_buffer_cache_t **)((u_char*)conf + cache_infos[i].conf_offset);
+		if (cur_cache == NULL)
+		{
+			continue;
+		}
+
+		rc = ngx_buffer_cache_dump(cur_cache, r->connection->log, &count);
+		if (rc == NGX_DECLINED)
+		{
+			continue;
+		}
+
+		if (rc != NGX_OK)
+		{
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		cache_name.data = cache_infos[i].open_tag.data + 1;
+		cache_name.len = cache_infos[i].open_tag.len - 4;
+
+		p = ngx_sprintf(p, DUMP_RESULT_FORMAT, &cache_name, count);
+	}
+
+	response.len = p - response.data;
+
+	return ngx_http_vod_send_response(r, &response, &text_content_type);
+}
+
+static ngx_int_t
+ngx_http_vod_status_purge(ngx_http_request_t *r, ngx_str_t* value)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_buffer_cache_t *cur_cache;
+	ngx_str_t cache_name;
+	ngx_str_t response;
+	ngx_str_t name;
+	ngx_uint_t count;
+	uint32_t tag;
+	u_char* src;
+	u_char* p;
+	size_t result_size;
+	unsigned i;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	// the value is the result of vod_cache_tag in the locations that stored the entries
+	name.data = ngx_pnalloc(r->pool, value->len);
+	if (name.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_purge: ngx_pnalloc failed (1)");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = name.data;
+	src = value->data;
+	ngx_unescape_uri(&p, &src, value->len, NGX_UNESCAPE_URI_COMPONENT);
+	name.len = p - name.data;
+
+	tag = ngx_buffer_cache_get_tag(&name);
+
+	result_size = 0;
+	for (i = 0; i < vod_array_entries(cache_infos); i++)
+	{
+		result_size += sizeof(DUMP_RESULT_FORMAT) + cache_infos[i].open_tag.len + NGX_INT_T_LEN;
+	}
+
+	response.data = ngx_pnalloc(r->pool, result_size);
+	if (response.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_purge: ngx_pnalloc failed (2)");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = response.data;
+
+	for (i = 0; i < vod_array_entries(cache_infos); i++)
+	{
+		cur_cache = *(ngx_buffer_cache_t **)((u_char*)conf + cache_infos[i].conf_offset);
+		if (cur_cache == NULL)
+		{
+			continue;
+		}
+
+		count = ngx_buffer_cache_purge(cur_cache, tag);
+
+		cache_name.data = cache_infos[i].open_tag.data + 1;
+		cache_name.len = cache_infos[i].open_tag.len - 4;
+
+		p = ngx_sprintf(p, DUMP_RESULT_FORMAT, &cache_name, count);
+	}
+
+	response.len = p - response.data;
+
+	ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+		"ngx_http_vod_status_purge: purged \"%V\"", &name);
+
+	return ngx_http_vod_send_response(r, &response, &text_content_type);
+}
+
 static ngx_int_t
 ngx_http_vod_status_reset(ngx_http_request_t *r)
 {
 	ngx_http_vod_loc_conf_t *conf;
 	ngx_perf_counters_t* perf_counters;
+	ngx_buffer_cache_t **partitions;
 	ngx_buffer_cache_t *cur_cache;
+	buffer_pool_t* cur_pool;
+	ngx_uint_t partition_count;
+	ngx_uint_t j;
 	unsigned i;
 
 	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
@@ -143,18 +657,28 @@ ngx_http_vod_status_reset(ngx_http_request_t *r)
 		}
 
 		ngx_buffer_cache_reset_stats(cur_cache);
+
+		partition_count = ngx_buffer_cache_get_partitions(cur_cache, &partitions);
+		for (j = 0; j < partition_count; j++)
+		{
+			ngx_buffer_cache_reset_stats(partitions[j]);
+		}
 	}
 
-	if (perf_counters != NULL)
+	for (i = 0; i < vod_array_entries(buffer_pool_infos); i++)
 	{
-		for (i = 0; i < PC_COUNT; i++)
+		cur_pool = *(buffer_pool_t **)((u_char*)conf + buffer_pool_infos[i].conf_offset);
+		if (cur_pool == NULL)
 		{
-			perf_counters->counters[i].sum = 0;
-			perf_counters->counters[i].count = 0;
-			perf_counters->counters[i].max = 0;
-			perf_counters->counters[i].max_time = 0;
-			perf_counters->counters[i].max_pid = 0;
+			continue;
 		}
+
+		buffer_pool_reset_stats(cur_pool);
+	}
+
+	if (perf_counters != NULL)
+	{
+		ngx_perf_counters_reset(conf->perf_counters_zone);
 	}
 
 	return ngx_http_vod_send_response(r, &reset_response, &text_content_type);
@@ -166,16 +690,35 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 	ngx_buffer_cache_stats_t stats;
 	ngx_http_vod_loc_conf_t *conf;
 	ngx_http_vod_stat_def_t* cur_stat;
+	ngx_http_vod_histogram_def_t* cur_hist;
+	ngx_popularity_top_entry_t* top_entries = NULL;
+	ngx_shared_limit_counter_t* limit_counters = NULL;
 	ngx_perf_counters_t* perf_counters;
+	ngx_buffer_cache_t **partitions;
 	ngx_buffer_cache_t *cur_cache;
+	buffer_pool_t* cur_pool;
 	ngx_str_t response;
+	ngx_uint_t top_count = 0;
+	ngx_uint_t limit_count = 0;
+	ngx_uint_t numa_node_count;
+	ngx_uint_t partition_count;
+	ngx_uint_t shard_count;
+	ngx_uint_t shard;
+	ngx_uint_t j;
+	ngx_int_t rc;
 	u_char* p;
 	size_t cache_stats_len = 0;
+	size_t cache_histograms_len;
+	size_t huge_pages_size;
 	size_t result_size;
 	unsigned i;
 
 	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
-	perf_counters = ngx_perf_counter_get_state(conf->perf_counters_zone);
+	rc = ngx_http_vod_status_get_perf_counters(r, conf, &perf_counters);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
 
 	// calculate the buffer size
 	for (cur_stat = buffer_cache_stat_defs; cur_stat->name.data != NULL; cur_stat++)
@@ -183,6 +726,13 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 		cache_stats_len += sizeof("<></>\r\n") - 1 + 2 * cur_stat->name.len + NGX_ATOMIC_T_LEN;
 	}
 
+	cache_histograms_len = 0;
+	for (cur_hist = buffer_cache_histogram_defs; cur_hist->name.data != NULL; cur_hist++)
+	{
+		cache_histograms_len += sizeof(PATH_CACHE_HISTOGRAM_OPEN_FORMAT) + sizeof(PATH_CACHE_HISTOGRAM_CLOSE_FORMAT) + 
+			2 * cur_hist->name.len + (sizeof(PERF_COUNTER_BUCKET_FORMAT) + NGX_INT_T_LEN + NGX_ATOMIC_T_LEN) * BUFFER_CACHE_HISTOGRAM_BUCKETS;
+	}
+
 	result_size = sizeof(status_prefix) - 1;
 	for (i = 0; i < sizeof(cache_infos) / sizeof(cache_infos[0]); i++)
 	{
@@ -192,7 +742,34 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 			continue;
 		}
 
-		result_size += cache_infos[i].open_tag.len + cache_stats_len + cache_infos[i].close_tag.len;
+		result_size += cache_infos[i].open_tag.len + cache_stats_len + cache_histograms_len + cache_infos[i].close_tag.len +
+			sizeof(PATH_CACHE_HUGE_PAGES_SIZE_FORMAT) + NGX_SIZE_T_LEN;
+
+		shard_count = ngx_buffer_cache_get_shard_count(cur_cache);
+		if (shard_count > 1)
+		{
+			result_size += (sizeof(PATH_CACHE_SHARD_OPEN) - 1 + sizeof(PATH_CACHE_SHARD_NUMA_NODE_FORMAT) + NGX_INT_T_LEN + 
+				cache_stats_len + sizeof(PATH_CACHE_SHARD_CLOSE) - 1) * shard_count;
+		}
+
+		partition_count = ngx_buffer_cache_get_partitions(cur_cache, &partitions);
+		for (j = 0; j < partition_count; j++)
+		{
+			result_size += sizeof(PATH_CACHE_PARTITION_OPEN_FORMAT) + ngx_buffer_cache_get_partition_name(partitions[j])->len +
+				cache_stats_len + sizeof(PATH_CACHE_HIT_RATIO_FORMAT) + 2 * NGX_INT_T_LEN + sizeof(PATH_CACHE_PARTITION_CLOSE) - 1;
+		}
+	}
+
+	for (i = 0; i < vod_array_entries(buffer_pool_infos); i++)
+	{
+		cur_pool = *(buffer_pool_t **)((u_char*)conf + buffer_pool_infos[i].conf_offset);
+		if (cur_pool == NULL)
+		{
+			continue;
+		}
+
+		result_size += buffer_pool_infos[i].open_tag.len + buffer_pool_infos[i].close_tag.len +
+			(sizeof(BUFFER_POOL_SIZE_CLASS_FORMAT) + NGX_SIZE_T_LEN + 5 * NGX_INT_T_LEN) * buffer_pool_get_size_class_count(cur_pool);
 	}
 
 	if (perf_counters != NULL)
@@ -200,11 +777,58 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 		result_size += sizeof(PATH_PERF_COUNTERS_OPEN);
 		for (i = 0; i < PC_COUNT; i++)
 		{
-			result_size += perf_counters_open_tags[i].len + sizeof(PERF_COUNTER_FORMAT) + 5 * NGX_ATOMIC_T_LEN + perf_counters_close_tags[i].len;
+			result_size += perf_counters_open_tags[i].len + sizeof(PERF_COUNTER_FORMAT) + 6 * NGX_ATOMIC_T_LEN + 
+				sizeof(PERF_COUNTER_HISTOGRAM_OPEN) - 1 + 
+				(sizeof(PERF_COUNTER_BUCKET_FORMAT) + NGX_INT_T_LEN + NGX_ATOMIC_T_LEN) * NGX_PERF_COUNTER_BUCKET_COUNT +
+				sizeof(PERF_COUNTER_HISTOGRAM_CLOSE) - 1 + perf_counters_close_tags[i].len;
+		}
+
+		result_size += sizeof(PERF_COUNTER_BYTES_READ_OPEN) - 1 + sizeof(PERF_COUNTER_BYTES_READ_CLOSE) - 1;
+		for (i = 0; i < PC_BYTES_COUNT; i++)
+		{
+			result_size += sizeof(PERF_COUNTER_BYTES_FORMAT) + 2 * perf_counters_bytes_names[i].len + NGX_ATOMIC_T_LEN;
+		}
+
+		result_size += sizeof(PERF_COUNTER_DRM_SEGMENTS_OPEN) - 1 + sizeof(PERF_COUNTER_DRM_SEGMENTS_CLOSE) - 1;
+		for (i = 0; i < PC_DRM_COUNT; i++)
+		{
+			result_size += sizeof(PERF_COUNTER_BYTES_FORMAT) + 2 * perf_counters_drm_names[i].len + NGX_ATOMIC_T_LEN;
 		}
 		result_size += sizeof(PATH_PERF_COUNTERS_CLOSE);
 	}
 
+	if (conf->popularity_zone != NULL)
+	{
+		if (ngx_popularity_get_top(conf->popularity_zone, r->pool, &top_entries, &top_count) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_status_xml_handler: ngx_popularity_get_top failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		result_size += sizeof(PATH_POPULARITY_OPEN) - 1 + sizeof(PATH_POPULARITY_CLOSE) - 1;
+		for (i = 0; i < top_count; i++)
+		{
+			result_size += sizeof(POPULARITY_TITLE_OPEN) - 1 + top_entries[i].name.len +
+				ngx_escape_html(NULL, top_entries[i].name.data, top_entries[i].name.len) +
+				sizeof(POPULARITY_TITLE_CLOSE_FORMAT) + NGX_INT_T_LEN;
+		}
+	}
+
+	if (conf->upstream_limit_zone != NULL)
+	{
+		// Note: the count is sampled once, since other workers may add counters concurrently
+		limit_count = ngx_shared_limit_get_counters(conf->upstream_limit_zone, &limit_counters);
+
+		result_size += sizeof(PATH_UPSTREAM_LIMITS_OPEN) - 1 + sizeof(PATH_UPSTREAM_LIMITS_CLOSE) - 1;
+		for (i = 0; i < limit_count; i++)
+		{
+			result_size += sizeof(UPSTREAM_LIMIT_OPEN) - 1 + limit_counters[i].key_len +
+				ngx_escape_html(NULL, limit_counters[i].key, limit_counters[i].key_len) +
+				sizeof(UPSTREAM_LIMIT_CLOSE_FORMAT) + 4 * NGX_ATOMIC_T_LEN;
+		}
+	}
+
 	result_size += sizeof(status_postfix);
 
 	// allocate the buffer
@@ -231,9 +855,60 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 
 		p = ngx_copy(p, cache_infos[i].open_tag.data, cache_infos[i].open_tag.len);
 		p = ngx_http_vod_append_cache_stats(p, &stats);
+		p = ngx_http_vod_append_cache_histograms(p, &stats);
+
+		if (ngx_buffer_cache_get_huge_pages_size(cur_cache, r->connection->log, &huge_pages_size) == NGX_OK)
+		{
+			p = ngx_sprintf(p, PATH_CACHE_HUGE_PAGES_SIZE_FORMAT, huge_pages_size);
+		}
+
+		shard_count = ngx_buffer_cache_get_shard_count(cur_cache);
+		if (shard_count > 1)
+		{
+			numa_node_count = ngx_buffer_cache_get_numa_node_count(cur_cache);
+
+			for (shard = 0; shard < shard_count; shard++)
+			{
+				ngx_buffer_cache_get_shard_stats(cur_cache, shard, &stats);
+
+				p = ngx_copy(p, PATH_CACHE_SHARD_OPEN, sizeof(PATH_CACHE_SHARD_OPEN) - 1);
+				if (numa_node_count > 1)
+				{
+					// Note: the shards are grouped by node
+					p = ngx_sprintf(p, PATH_CACHE_SHARD_NUMA_NODE_FORMAT, shard / (shard_count / numa_node_count));
+				}
+				p = ngx_http_vod_append_cache_stats(p, &stats);
+				p = ngx_copy(p, PATH_CACHE_SHARD_CLOSE, sizeof(PATH_CACHE_SHARD_CLOSE) - 1);
+			}
+		}
+
+		partition_count = ngx_buffer_cache_get_partitions(cur_cache, &partitions);
+		for (j = 0; j < partition_count; j++)
+		{
+			ngx_buffer_cache_get_stats(partitions[j], &stats);
+
+			p = ngx_sprintf(p, PATH_CACHE_PARTITION_OPEN_FORMAT, ngx_buffer_cache_get_partition_name(partitions[j]));
+			p = ngx_http_vod_append_cache_stats(p, &stats);
+			p = ngx_http_vod_append_cache_hit_ratio(p, &stats);
+			p = ngx_copy(p, PATH_CACHE_PARTITION_CLOSE, sizeof(PATH_CACHE_PARTITION_CLOSE) - 1);
+		}
+
 		p = ngx_copy(p, cache_infos[i].close_tag.data, cache_infos[i].close_tag.len);
 	}
 
+	for (i = 0; i < vod_array_entries(buffer_pool_infos); i++)
+	{
+		cur_pool = *(buffer_pool_t **)((u_char*)conf + buffer_pool_infos[i].conf_offset);
+		if (cur_pool == NULL)
+		{
+			continue;
+		}
+
+		p = ngx_copy(p, buffer_pool_infos[i].open_tag.data, buffer_pool_infos[i].open_tag.len);
+		p = ngx_http_vod_append_buffer_pool_stats(p, cur_pool);
+		p = ngx_copy(p, buffer_pool_infos[i].close_tag.data, buffer_pool_infos[i].close_tag.len);
+	}
+
 	if (perf_counters != NULL)
 	{
 		p = ngx_copy(p, PATH_PERF_COUNTERS_OPEN, sizeof(PATH_PERF_COUNTERS_OPEN) - 1);
@@ -242,15 +917,62 @@ ngx_http_vod_status_xml_handler(ngx_http_request_t *r)
 			p = ngx_copy(p, perf_counters_open_tags[i].data, perf_counters_open_tags[i].len);
 			p = ngx_sprintf(p, PERF_COUNTER_FORMAT, 
 				perf_counters->counters[i].sum, 
+				perf_counters->counters[i].cpu_sum, 
 				perf_counters->counters[i].count, 
 				perf_counters->counters[i].max, 
 				perf_counters->counters[i].max_time, 
 				perf_counters->counters[i].max_pid);
+			p = ngx_http_vod_append_perf_counter_histogram(p, &perf_counters->counters[i]);
 			p = ngx_copy(p, perf_counters_close_tags[i].data, perf_counters_close_tags[i].len);
 		}
+
+		p = ngx_copy(p, PERF_COUNTER_BYTES_READ_OPEN, sizeof(PERF_COUNTER_BYTES_READ_OPEN) - 1);
+		for (i = 0; i < PC_BYTES_COUNT; i++)
+		{
+			p = ngx_sprintf(p, PERF_COUNTER_BYTES_FORMAT, 
+				&perf_counters_bytes_names[i], perf_counters->bytes[i], &perf_counters_bytes_names[i]);
+		}
+		p = ngx_copy(p, PERF_COUNTER_BYTES_READ_CLOSE, sizeof(PERF_COUNTER_BYTES_READ_CLOSE) - 1);
+
+		p = ngx_copy(p, PERF_COUNTER_DRM_SEGMENTS_OPEN, sizeof(PERF_COUNTER_DRM_SEGMENTS_OPEN) - 1);
+		for (i = 0; i < PC_DRM_COUNT; i++)
+		{
+			p = ngx_sprintf(p, PERF_COUNTER_BYTES_FORMAT,
+				&perf_counters_drm_names[i], perf_counters->drm_segments[i], &perf_counters_drm_names[i]);
+		}
+		p = ngx_copy(p, PERF_COUNTER_DRM_SEGMENTS_CLOSE, sizeof(PERF_COUNTER_DRM_SEGMENTS_CLOSE) - 1);
+
 		p = ngx_copy(p, PATH_PERF_COUNTERS_CLOSE, sizeof(PATH_PERF_COUNTERS_CLOSE) - 1);
 	}
 
+	if (conf->popularity_zone != NULL)
+	{
+		p = ngx_copy(p, PATH_POPULARITY_OPEN, sizeof(PATH_POPULARITY_OPEN) - 1);
+		for (i = 0; i < top_count; i++)
+		{
+			p = ngx_copy(p, POPULARITY_TITLE_OPEN, sizeof(POPULARITY_TITLE_OPEN) - 1);
+			p = (u_char*)ngx_escape_html(p, top_entries[i].name.data, top_entries[i].name.len);
+			p = ngx_sprintf(p, POPULARITY_TITLE_CLOSE_FORMAT, top_entries[i].count);
+		}
+		p = ngx_copy(p, PATH_POPULARITY_CLOSE, sizeof(PATH_POPULARITY_CLOSE) - 1);
+	}
+
+	if (conf->upstream_limit_zone != NULL)
+	{
+		p = ngx_copy(p, PATH_UPSTREAM_LIMITS_OPEN, sizeof(PATH_UPSTREAM_LIMITS_OPEN) - 1);
+		for (i = 0; i < limit_count; i++)
+		{
+			p = ngx_copy(p, UPSTREAM_LIMIT_OPEN, sizeof(UPSTREAM_LIMIT_OPEN) - 1);
+			p = (u_char*)ngx_escape_html(p, limit_counters[i].key, limit_counters[i].key_len);
+			p = ngx_sprintf(p, UPSTREAM_LIMIT_CLOSE_FORMAT,
+				limit_counters[i].active,
+				limit_counters[i].queued,
+				limit_counters[i].waited,
+				limit_counters[i].rejected);
+		}
+		p = ngx_copy(p, PATH_UPSTREAM_LIMITS_CLOSE, sizeof(PATH_UPSTREAM_LIMITS_CLOSE) - 1);
+	}
+
 	p = ngx_copy(p, status_postfix, sizeof(status_postfix) - 1);
 	
 	response.len = p - response.data;
@@ -271,19 +993,41 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 {
 	ngx_buffer_cache_stats_t stats;
 	ngx_http_vod_stat_def_t* cur_stat;
+	ngx_http_vod_histogram_def_t* cur_hist;
 	ngx_http_vod_loc_conf_t *conf;
+	ngx_shared_limit_counter_t* limit_counters = NULL;
 	ngx_perf_counters_t* perf_counters;
+	ngx_buffer_cache_t **partitions;
 	ngx_buffer_cache_t *cur_cache;
+	buffer_pool_stats_t pool_stats;
+	buffer_pool_t* cur_pool;
 	ngx_str_t response;
 	ngx_str_t cache_name;
+	ngx_str_t pool_name;
+	ngx_str_t location;
 	ngx_str_t action;
+	ngx_uint_t limit_count = 0;
+	vod_uint_t class_count;
+	vod_uint_t j;
+	ngx_uint_t numa_node_count;
+	ngx_uint_t partition_count;
+	ngx_uint_t shard_count;
+	ngx_uint_t shard;
+	ngx_uint_t k;
+	ngx_int_t rc;
 	unsigned i;
 	u_char* p;
+	size_t huge_pages_size;
 	size_t result_size;
 	size_t names_len;
+	size_t histograms_len;
 
 	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
-	perf_counters = ngx_perf_counter_get_state(conf->perf_counters_zone);
+	rc = ngx_http_vod_status_get_perf_counters(r, conf, &perf_counters);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
 
 	names_len = 0;
 	for (cur_stat = buffer_cache_stat_defs; cur_stat->name.data != NULL; cur_stat++)
@@ -291,6 +1035,14 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 		names_len += cur_stat->name.len;
 	}
 
+	histograms_len = 0;
+	for (cur_hist = buffer_cache_histogram_defs; cur_hist->name.data != NULL; cur_hist++)
+	{
+		histograms_len += (sizeof(PROM_VOD_CACHE_BUCKET_FORMAT) - 1 + cur_hist->name.len + NGX_INT_T_LEN + NGX_ATOMIC_T_LEN) *
+			(BUFFER_CACHE_HISTOGRAM_BUCKETS - 1) + sizeof(PROM_VOD_CACHE_HISTOGRAM_METRICS) - 1 + 
+			(cur_hist->name.len + NGX_ATOMIC_T_LEN) * 3;
+	}
+
 	result_size = 0;
 	for (i = 0; i < vod_array_entries(cache_infos); i++)
 	{
@@ -301,14 +1053,65 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 		}
 
 		result_size += (sizeof(PROM_VOD_CACHE_METRIC_FORMAT) - 1 + cache_infos[i].open_tag.len + NGX_ATOMIC_T_LEN) *
-			vod_array_entries(buffer_cache_stat_defs) + names_len + sizeof("\n") - 1;
+			vod_array_entries(buffer_cache_stat_defs) + names_len + sizeof("\n") - 1 +
+			sizeof(PROM_VOD_CACHE_HUGE_PAGES_FORMAT) - 1 + cache_infos[i].open_tag.len + NGX_SIZE_T_LEN +
+			histograms_len + (BUFFER_CACHE_HISTOGRAM_BUCKETS + 2) * vod_array_entries(buffer_cache_histogram_defs) * cache_infos[i].open_tag.len;
+
+		shard_count = ngx_buffer_cache_get_shard_count(cur_cache);
+		if (shard_count > 1)
+		{
+			result_size += ((sizeof(PROM_VOD_CACHE_NUMA_SHARD_METRIC_FORMAT) - 1 + cache_infos[i].open_tag.len + 3 * NGX_ATOMIC_T_LEN) *
+				vod_array_entries(buffer_cache_stat_defs) + names_len + sizeof("\n") - 1) * shard_count;
+		}
+
+		partition_count = ngx_buffer_cache_get_partitions(cur_cache, &partitions);
+		for (k = 0; k < partition_count; k++)
+		{
+			result_size += (sizeof(PROM_VOD_CACHE_PARTITION_METRIC_FORMAT) - 1 + cache_infos[i].open_tag.len + 
+				ngx_buffer_cache_get_partition_name(partitions[k])->len + NGX_ATOMIC_T_LEN) *
+				vod_array_entries(buffer_cache_stat_defs) + names_len + sizeof("\n") - 1;
+		}
+	}
+
+	for (i = 0; i < vod_array_entries(buffer_pool_infos); i++)
+	{
+		cur_pool = *(buffer_pool_t **)((u_char*)conf + buffer_pool_infos[i].conf_offset);
+		if (cur_pool == NULL)
+		{
+			continue;
+		}
+
+		result_size += (sizeof(PROM_BUFFER_POOL_METRICS) - 1 + (buffer_pool_infos[i].open_tag.len + NGX_SIZE_T_LEN + NGX_INT_T_LEN) * 5) *
+			buffer_pool_get_size_class_count(cur_pool);
 	}
 
 	if (perf_counters != NULL)
 	{
 		for (i = 0; i < PC_COUNT; i++)
 		{
-			result_size += sizeof(PROM_PERF_COUNTER_METRICS) - 1 + (perf_counters_open_tags[i].len + NGX_ATOMIC_T_LEN) * 5;
+			result_size += sizeof(PROM_PERF_COUNTER_METRICS) - 1 + (perf_counters_open_tags[i].len + NGX_ATOMIC_T_LEN) * 6 +
+				(sizeof(PROM_PERF_COUNTER_BUCKET_FORMAT) - 1 + perf_counters_open_tags[i].len + NGX_INT_T_LEN + NGX_ATOMIC_T_LEN) * 
+				(NGX_PERF_COUNTER_BUCKET_COUNT - 1) +
+				sizeof(PROM_PERF_COUNTER_HISTOGRAM_METRICS) - 1 + (perf_counters_open_tags[i].len + NGX_ATOMIC_T_LEN) * 3;
+		}
+
+		for (i = 0; i < PC_BYTES_COUNT; i++)
+		{
+			result_size += sizeof(PROM_PERF_COUNTER_BYTES_FORMAT) - 1 + perf_counters_bytes_names[i].len + NGX_ATOMIC_T_LEN;
+		}
+
+		for (i = 0; i < PC_DRM_COUNT; i++)
+		{
+			result_size += sizeof(PROM_PERF_COUNTER_DRM_SEGMENTS_FORMAT) - 1 + perf_counters_drm_names[i].len + NGX_ATOMIC_T_LEN;
+		}
+	}
+
+	if (conf->upstream_limit_zone != NULL)
+	{
+		limit_count = ngx_shared_limit_get_counters(conf->upstream_limit_zone, &limit_counters);
+		for (i = 0; i < limit_count; i++)
+		{
+			result_size += sizeof(PROM_UPSTREAM_LIMIT_METRICS) - 1 + (limit_counters[i].key_len + NGX_ATOMIC_T_LEN) * 4;
 		}
 	}
 
@@ -340,7 +1143,79 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 		{
 			p = ngx_sprintf(p, PROM_VOD_CACHE_METRIC_FORMAT, &cur_stat->name, &cache_name, *(ngx_atomic_t*)((u_char*)&stats + cur_stat->offset));
 		}
+
+		if (ngx_buffer_cache_get_huge_pages_size(cur_cache, r->connection->log, &huge_pages_size) == NGX_OK)
+		{
+			p = ngx_sprintf(p, PROM_VOD_CACHE_HUGE_PAGES_FORMAT, &cache_name, huge_pages_size);
+		}
+
+		p = ngx_http_vod_append_prom_cache_histograms(p, &cache_name, &stats);
 		*p++ = '\n';
+
+		partition_count = ngx_buffer_cache_get_partitions(cur_cache, &partitions);
+		for (k = 0; k < partition_count; k++)
+		{
+			ngx_buffer_cache_get_stats(partitions[k], &stats);
+
+			for (cur_stat = buffer_cache_stat_defs; cur_stat->name.data != NULL; cur_stat++)
+			{
+				p = ngx_sprintf(p, PROM_VOD_CACHE_PARTITION_METRIC_FORMAT, &cur_stat->name, &cache_name, 
+					ngx_buffer_cache_get_partition_name(partitions[k]), *(ngx_atomic_t*)((u_char*)&stats + cur_stat->offset));
+			}
+			*p++ = '\n';
+		}
+
+		shard_count = ngx_buffer_cache_get_shard_count(cur_cache);
+		if (shard_count <= 1)
+		{
+			continue;
+		}
+
+		numa_node_count = ngx_buffer_cache_get_numa_node_count(cur_cache);
+
+		for (shard = 0; shard < shard_count; shard++)
+		{
+			ngx_buffer_cache_get_shard_stats(cur_cache, shard, &stats);
+
+			for (cur_stat = buffer_cache_stat_defs; cur_stat->name.data != NULL; cur_stat++)
+			{
+				if (numa_node_count > 1)
+				{
+					p = ngx_sprintf(p, PROM_VOD_CACHE_NUMA_SHARD_METRIC_FORMAT, &cur_stat->name, &cache_name, 
+						shard / (shard_count / numa_node_count), shard, *(ngx_atomic_t*)((u_char*)&stats + cur_stat->offset));
+					continue;
+				}
+
+				p = ngx_sprintf(p, PROM_VOD_CACHE_SHARD_METRIC_FORMAT, &cur_stat->name, &cache_name, shard, *(ngx_atomic_t*)((u_char*)&stats + cur_stat->offset));
+			}
+			*p++ = '\n';
+		}
+	}
+
+	for (i = 0; i < vod_array_entries(buffer_pool_infos); i++)
+	{
+		cur_pool = *(buffer_pool_t **)((u_char*)conf + buffer_pool_infos[i].conf_offset);
+		if (cur_pool == NULL)
+		{
+			continue;
+		}
+
+		// strip the _buffer_pool suffix
+		pool_name.data = buffer_pool_infos[i].open_tag.data + 1;
+		pool_name.len = buffer_pool_infos[i].open_tag.len - 4 - (sizeof("_buffer_pool") - 1);
+
+		class_count = buffer_pool_get_size_class_count(cur_pool);
+		for (j = 0; j < class_count; j++)
+		{
+			buffer_pool_get_stats(cur_pool, j, &pool_stats);
+
+			p = ngx_sprintf(p, PROM_BUFFER_POOL_METRICS,
+				&pool_name, pool_stats.size, pool_stats.count,
+				&pool_name, pool_stats.size, pool_stats.max_count,
+				&pool_name, pool_stats.size, pool_stats.free_count,
+				&pool_name, pool_stats.size, pool_stats.hits,
+				&pool_name, pool_stats.size, pool_stats.misses);
+		}
 	}
 
 	if (perf_counters != NULL)
@@ -352,11 +1227,36 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 
 			p = ngx_sprintf(p, PROM_PERF_COUNTER_METRICS,
 				&action, perf_counters->counters[i].sum,
+				&action, perf_counters->counters[i].cpu_sum,
 				&action, perf_counters->counters[i].count,
 				&action, perf_counters->counters[i].max,
 				&action, perf_counters->counters[i].max_time,
 				&action, perf_counters->counters[i].max_pid);
+
+			p = ngx_http_vod_append_prom_perf_counter_histogram(p, &action, &perf_counters->counters[i]);
 		}
+
+		for (i = 0; i < PC_BYTES_COUNT; i++)
+		{
+			p = ngx_sprintf(p, PROM_PERF_COUNTER_BYTES_FORMAT, &perf_counters_bytes_names[i], perf_counters->bytes[i]);
+		}
+
+		for (i = 0; i < PC_DRM_COUNT; i++)
+		{
+			p = ngx_sprintf(p, PROM_PERF_COUNTER_DRM_SEGMENTS_FORMAT, &perf_counters_drm_names[i], perf_counters->drm_segments[i]);
+		}
+	}
+
+	for (i = 0; i < limit_count; i++)
+	{
+		location.data = limit_counters[i].key;
+		location.len = limit_counters[i].key_len;
+
+		p = ngx_sprintf(p, PROM_UPSTREAM_LIMIT_METRICS,
+			&location, limit_counters[i].active,
+			&location, limit_counters[i].queued,
+			&location, limit_counters[i].waited,
+			&location, limit_counters[i].rejected);
 	}
 
 	response.len = p - response.data;
@@ -372,6 +1272,142 @@ ngx_http_vod_status_prom_handler(ngx_http_request_t *r)
 	return ngx_http_vod_send_response(r, &response, &xml_content_type);
 }
 
+// removes the trailing comma of a non-empty json object
+static u_char*
+ngx_http_vod_status_json_trim(u_char* p)
+{
+	return p[-1] == ',' ? p - 1 : p;
+}
+
+static ngx_int_t
+ngx_http_vod_status_samples_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_request_sample_t* samples;
+	ngx_request_sample_t* cur;
+	ngx_request_sample_t* end;
+	ngx_str_t response;
+	ngx_uint_t count;
+	ngx_uint_t i;
+	size_t sample_size;
+	size_t result_size;
+	u_char* start;
+	u_char* p;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	if (conf->request_samples_zone == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_status_samples_handler: vod_request_samples is not configured");
+		return NGX_HTTP_NOT_FOUND;
+	}
+
+	if (ngx_request_samples_get(conf->request_samples_zone, r->pool, &samples, &count) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_samples_handler: ngx_request_samples_get failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	// calculate the size of a sample, excluding the strings
+	sample_size = sizeof(SAMPLE_JSON_FORMAT) + NGX_TIME_T_LEN + 4 * NGX_INT_T_LEN +
+		sizeof(SAMPLE_JSON_CONTENT_TYPE) + sizeof(SAMPLE_JSON_CACHE_OPEN) + 
+		sizeof(SAMPLE_JSON_STAGES_OPEN) + sizeof(SAMPLE_JSON_CLOSE);
+
+	for (i = 0; i < REQUEST_SAMPLE_CACHE_COUNT; i++)
+	{
+		sample_size += sizeof(SAMPLE_JSON_CACHE_FORMAT) + request_samples_cache_names[i].len + sizeof("miss");
+	}
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	for (i = 0; i < PC_COUNT; i++)
+	{
+		sample_size += sizeof(SAMPLE_JSON_STAGE_FORMAT) + perf_counters_names[i].len + 2 * NGX_INT_T_LEN;
+	}
+#endif // NGX_PERF_COUNTERS_ENABLED
+
+	result_size = sizeof(SAMPLES_JSON_PREFIX) + sizeof(SAMPLES_JSON_POSTFIX) + count * sample_size;
+
+	end = samples + count;
+	for (cur = samples; cur < end; cur++)
+	{
+		result_size += cur->uri_len + ngx_escape_json(NULL, cur->uri, cur->uri_len) +
+			cur->content_type_len + ngx_escape_json(NULL, cur->content_type, cur->content_type_len);
+	}
+
+	response.data = ngx_pnalloc(r->pool, result_size);
+	if (response.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_status_samples_handler: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = ngx_copy(response.data, SAMPLES_JSON_PREFIX, sizeof(SAMPLES_JSON_PREFIX) - 1);
+	start = p;
+
+	for (cur = samples; cur < end; cur++)
+	{
+		p = ngx_sprintf(p, SAMPLE_JSON_FORMAT, cur->time, cur->pid, cur->status, cur->duration, cur->bytes_read);
+		p = (u_char*)ngx_escape_json(p, cur->uri, cur->uri_len);
+		p = ngx_copy(p, SAMPLE_JSON_CONTENT_TYPE, sizeof(SAMPLE_JSON_CONTENT_TYPE) - 1);
+		p = (u_char*)ngx_escape_json(p, cur->content_type, cur->content_type_len);
+
+		p = ngx_copy(p, SAMPLE_JSON_CACHE_OPEN, sizeof(SAMPLE_JSON_CACHE_OPEN) - 1);
+		for (i = 0; i < REQUEST_SAMPLE_CACHE_COUNT; i++)
+		{
+			if ((cur->cache_misses & (1 << i)) != 0)
+			{
+				// a request may look up a cache more than once (e.g. the metadata of several clips), misses are reported
+				p = ngx_sprintf(p, SAMPLE_JSON_CACHE_FORMAT, &request_samples_cache_names[i], "miss");
+			}
+			else if ((cur->cache_hits & (1 << i)) != 0)
+			{
+				p = ngx_sprintf(p, SAMPLE_JSON_CACHE_FORMAT, &request_samples_cache_names[i], "hit");
+			}
+		}
+		p = ngx_http_vod_status_json_trim(p);
+
+		p = ngx_copy(p, SAMPLE_JSON_STAGES_OPEN, sizeof(SAMPLE_JSON_STAGES_OPEN) - 1);
+#ifdef NGX_PERF_COUNTERS_ENABLED
+		for (i = 0; i < PC_COUNT; i++)
+		{
+			if (cur->stage_count[i] == 0)
+			{
+				continue;
+			}
+
+			p = ngx_sprintf(p, SAMPLE_JSON_STAGE_FORMAT, &perf_counters_names[i], cur->stage_sum[i], cur->stage_count[i]);
+		}
+#endif // NGX_PERF_COUNTERS_ENABLED
+		p = ngx_http_vod_status_json_trim(p);
+
+		p = ngx_copy(p, SAMPLE_JSON_CLOSE, sizeof(SAMPLE_JSON_CLOSE) - 1);
+	}
+
+	// remove the trailing comma of the last sample
+	if (p > start)
+	{
+		p -= 2;
+		*p++ = '\n';
+	}
+
+	p = ngx_copy(p, SAMPLES_JSON_POSTFIX, sizeof(SAMPLES_JSON_POSTFIX) - 1);
+
+	response.len = p - response.data;
+
+	if (response.len > result_size)
+	{
+		ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+			"ngx_http_vod_status_samples_handler: response length %uz exceeded allocated length %uz",
+			response.len, result_size);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	return ngx_http_vod_send_response(r, &response, &json_content_type);
+}
+
 ngx_int_t
 ngx_http_vod_status_handler(ngx_http_request_t *r)
 {
@@ -384,6 +1420,19 @@ ngx_http_vod_status_handler(ngx_http_request_t *r)
 		return ngx_http_vod_status_reset(r);
 	}
 
+	if (ngx_http_arg(r, (u_char *) "dump", sizeof("dump") - 1, &value) == NGX_OK &&
+		value.len == 1 &&
+		value.data[0] == '1')
+	{
+		return ngx_http_vod_status_dump(r);
+	}
+
+	if (ngx_http_arg(r, (u_char *) "purge", sizeof("purge") - 1, &value) == NGX_OK &&
+		value.len > 0)
+	{
+		return ngx_http_vod_status_purge(r, &value);
+	}
+
 	if (ngx_http_arg(r, (u_char *) "format", sizeof("format") - 1, &value) == NGX_OK &&
 		value.len == sizeof("prom") - 1 &&
 		ngx_strncmp(value.data, "prom", sizeof("prom") - 1) == 0)
@@ -391,5 +1440,12 @@ ngx_http_vod_status_handler(ngx_http_request_t *r)
 		return ngx_http_vod_status_prom_handler(r);
 	}
 
+	if (ngx_http_arg(r, (u_char *) "format", sizeof("format") - 1, &value) == NGX_OK &&
+		value.len == sizeof("samples") - 1 &&
+		ngx_strncmp(value.data, "samples", sizeof("samples") - 1) == 0)
+	{
+		return ngx_http_vod_status_samples_handler(r);
+	}
+
 	return ngx_http_vod_status_xml_handler(r);
 }
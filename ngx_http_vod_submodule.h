@@ -26,6 +26,9 @@
 #define REQUEST_CLASS_THUMB		(0x04)
 #define REQUEST_CLASS_OTHER		(0x08)		// dash init segment, hls iframes manifest, hls master manifest, hls encryption key
 
+// init_frame_processor response size that indicates the response should be streamed without a content length
+#define NGX_HTTP_VOD_STREAMED_RESPONSE_SIZE	((size_t)-1)
+
 struct ngx_http_vod_loc_conf_s;
 
 // typedefs
@@ -74,6 +77,13 @@ struct ngx_http_vod_request_s {
 		ngx_str_t* output_buffer,
 		size_t* response_size,
 		ngx_str_t* content_type);
+
+	// optional, wraps the segment writer with an encryption stage that is applied on the muxed segment,
+	// called before init_frame_processor. returns NGX_DECLINED if the frames are encrypted while they 
+	// are muxed, in this case, the segment writer is not changed.
+	ngx_int_t (*init_segment_encryption)(
+		ngx_http_vod_submodule_context_t* submodule_context,
+		segment_writer_t* segment_writer);
 };
 
 typedef struct ngx_http_vod_request_s ngx_http_vod_request_t;
@@ -6,6 +6,7 @@
 #include "vod/parse_utils.h"
 
 #define THUMB_TIMESCALE (1000)
+#define THUMB_TILES_MAX_COUNT (1024)
 
 // macros
 #define skip_dash(start_pos, end_pos)	\
@@ -23,7 +24,27 @@
 	}
 
 static const u_char jpg_file_ext[] = ".jpg";
-static u_char jpeg_content_type[] = "image/jpeg";
+static const u_char webp_file_ext[] = ".webp";
+
+static ngx_str_t image_file_exts[THUMB_FORMAT_COUNT] = {
+	ngx_string(".jpg"),
+	ngx_string(".webp"),
+};
+
+static ngx_str_t image_content_types[THUMB_FORMAT_COUNT] = {
+	ngx_string("image/jpeg"),
+	ngx_string("image/webp"),
+};
+#if (NGX_HAVE_LIB_SW_SCALE)
+static const u_char vtt_file_ext[] = ".vtt";
+static u_char vtt_content_type[] = "text/vtt";
+
+static const char webvtt_header[] = "WEBVTT\n\n";
+static const char webvtt_cue_format[] = "%02uD:%02uD:%02uD.%03uD --> %02uD:%02uD:%02uD.%03uD\n";
+static const char webvtt_xywh_format[] = "#xywh=%uD,%uD,%uD,%uD\n\n";
+
+#define WEBVTT_TIMESTAMP_LEN (sizeof("00:00:00.000") - 1)
+#endif // NGX_HAVE_LIB_SW_SCALE
 
 ngx_int_t 
 ngx_http_vod_thumb_get_url(
@@ -36,6 +57,7 @@ ngx_http_vod_thumb_get_url(
 	request_params_t* request_params = &submodule_context->request_params;
 	ngx_str_t request_params_str;
 	ngx_str_t base_url = ngx_null_string;
+	ngx_str_t* file_ext = &image_file_exts[request_params->image_format];
 	vod_status_t rc;
 	size_t result_size;
 	u_char* p;
@@ -72,7 +94,7 @@ ngx_http_vod_thumb_get_url(
 
 	// get the result size
 	result_size = base_url.len + conf->thumb.file_name_prefix.len + 
-		1 + VOD_INT64_LEN + request_params_str.len + sizeof(jpg_file_ext) - 1;
+		1 + VOD_INT64_LEN + request_params_str.len + file_ext->len;
 
 	// allocate the result buffer
 	p = ngx_pnalloc(submodule_context->request_context.pool, result_size);
@@ -94,7 +116,7 @@ ngx_http_vod_thumb_get_url(
 	p = vod_copy(p, conf->thumb.file_name_prefix.data, conf->thumb.file_name_prefix.len);
 	p = vod_sprintf(p, "-%uL", request_params->segment_time);
 	p = vod_copy(p, request_params_str.data, request_params_str.len);
-	p = vod_copy(p, jpg_file_ext, sizeof(jpg_file_ext) - 1);
+	p = vod_copy(p, file_ext->data, file_ext->len);
 
 	result->len = p - result->data;
 
@@ -109,6 +131,22 @@ ngx_http_vod_thumb_get_url(
 	return NGX_OK;
 }
 
+static thumb_grabber_hw_device_t*
+ngx_http_vod_thumb_get_hw_device(ngx_http_vod_submodule_context_t* submodule_context)
+{
+	ngx_http_vod_thumb_loc_conf_t* conf = &submodule_context->conf->thumb;
+
+	if (conf->hw_device_type.len == 0)
+	{
+		return NULL;
+	}
+
+	return thumb_grabber_get_hw_device(
+		submodule_context->request_context.log,
+		&conf->hw_device_type,
+		&conf->hw_device);
+}
+
 static ngx_int_t
 ngx_http_vod_thumb_init_frame_processor(
 	ngx_http_vod_submodule_context_t* submodule_context,
@@ -125,7 +163,8 @@ ngx_http_vod_thumb_init_frame_processor(
 		&submodule_context->request_context,
 		submodule_context->media_set.filtered_tracks,
 		&submodule_context->request_params,
-		submodule_context->conf->thumb.accurate,
+		submodule_context->conf->thumb.accurate && !submodule_context->request_params.key_frame_only,
+		ngx_http_vod_thumb_get_hw_device(submodule_context),
 		segment_writer->write_tail,
 		segment_writer->context,
 		frame_processor_state);
@@ -138,8 +177,7 @@ ngx_http_vod_thumb_init_frame_processor(
 
 	*frame_processor = (ngx_http_vod_frame_processor_t)thumb_grabber_process;
 
-	content_type->len = sizeof(jpeg_content_type) - 1;
-	content_type->data = (u_char *)jpeg_content_type;
+	*content_type = image_content_types[submodule_context->request_params.image_format];
 
 	return NGX_OK;
 }
@@ -152,8 +190,176 @@ static const ngx_http_vod_request_t thumb_request = {
 	THUMB_TIMESCALE,
 	NULL,
 	ngx_http_vod_thumb_init_frame_processor,
+	NULL,
 };
 
+#if (NGX_HAVE_LIB_SW_SCALE)
+static ngx_int_t
+ngx_http_vod_thumb_init_tiles_frame_processor(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	segment_writer_t* segment_writer,
+	ngx_http_vod_frame_processor_t* frame_processor,
+	void** frame_processor_state,
+	ngx_str_t* output_buffer,
+	size_t* response_size,
+	ngx_str_t* content_type)
+{
+	vod_status_t rc;
+
+	rc = thumb_grabber_init_tiles_state(
+		&submodule_context->request_context,
+		submodule_context->media_set.filtered_tracks,
+		&submodule_context->request_params,
+		ngx_http_vod_thumb_get_hw_device(submodule_context),
+		segment_writer->write_tail,
+		segment_writer->context,
+		frame_processor_state);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+			"ngx_http_vod_thumb_init_tiles_frame_processor: thumb_grabber_init_tiles_state failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(submodule_context->r, rc);
+	}
+
+	*frame_processor = (ngx_http_vod_frame_processor_t)thumb_grabber_process;
+
+	*content_type = image_content_types[submodule_context->request_params.image_format];
+
+	return NGX_OK;
+}
+
+static u_char*
+ngx_http_vod_thumb_write_webvtt_cue_times(u_char* p, uint64_t start, uint64_t end)
+{
+	return ngx_sprintf(p, webvtt_cue_format,
+		(uint32_t)(start / 3600000), (uint32_t)((start / 60000) % 60), (uint32_t)((start / 1000) % 60), (uint32_t)(start % 1000),
+		(uint32_t)(end / 3600000), (uint32_t)((end / 60000) % 60), (uint32_t)((end / 1000) % 60), (uint32_t)(end % 1000));
+}
+
+// builds a webvtt that maps each time interval to its tile in the matching tiles jpg, using media fragments
+static ngx_int_t
+ngx_http_vod_thumb_handle_tiles_index(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	ngx_str_t* response,
+	ngx_str_t* content_type)
+{
+	thumb_tiles_params_t* tiles = &submodule_context->request_params.tiles;
+	media_set_t* media_set = &submodule_context->media_set;
+	media_track_t* track = media_set->filtered_tracks;
+	ngx_str_t image_name;
+	uint64_t start_time;
+	uint64_t end_time;
+	uint64_t media_end;
+	uint32_t tile_width;
+	uint32_t tile_height;
+	uint32_t count;
+	uint32_t i;
+	size_t result_size;
+	u_char* uri_end;
+	u_char* p;
+
+	// the image name is the name of the index, with a jpg extension
+	uri_end = submodule_context->r->uri.data + submodule_context->r->uri.len;
+	image_name.data = uri_end;
+	while (image_name.data > submodule_context->r->uri.data && image_name.data[-1] != '/')
+	{
+		image_name.data--;
+	}
+	image_name.len = uri_end - image_name.data - (sizeof(vtt_file_ext) - 1);
+
+	// get the tile size, must match the logic of thumb_grabber_init_tiles_state
+	thumb_grabber_get_output_size(&track->media_info, &submodule_context->request_params, &tile_width, &tile_height);
+	tile_width &= ~1;
+	tile_height &= ~1;
+
+	if (media_set->timing.durations != NULL)
+	{
+		media_end = media_set->timing.first_time + media_set->timing.total_duration;
+	}
+	else
+	{
+		media_end = media_set->timing.first_time + track->media_info.duration_millis;
+	}
+
+	count = tiles->columns * tiles->rows;
+
+	result_size = sizeof(webvtt_header) - 1 +
+		count * (sizeof(webvtt_cue_format) + 2 * WEBVTT_TIMESTAMP_LEN + 
+		image_name.len + sizeof(jpg_file_ext) - 1 +
+		sizeof(webvtt_xywh_format) + 4 * NGX_INT32_LEN);
+
+	p = ngx_pnalloc(submodule_context->request_context.pool, result_size);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+			"ngx_http_vod_thumb_handle_tiles_index: ngx_pnalloc failed");
+		return ngx_http_vod_status_to_ngx_error(submodule_context->r, VOD_ALLOC_FAILED);
+	}
+
+	response->data = p;
+
+	p = ngx_copy(p, webvtt_header, sizeof(webvtt_header) - 1);
+
+	start_time = tiles->start;
+	for (i = 0; i < count && start_time < media_end; i++)
+	{
+		end_time = start_time + tiles->interval;
+		if (end_time > media_end)
+		{
+			end_time = media_end;
+		}
+
+		p = ngx_http_vod_thumb_write_webvtt_cue_times(p, start_time, end_time);
+		p = ngx_copy(p, image_name.data, image_name.len);
+		p = ngx_copy(p, jpg_file_ext, sizeof(jpg_file_ext) - 1);
+		p = ngx_sprintf(p, webvtt_xywh_format,
+			(i % tiles->columns) * tile_width,
+			(i / tiles->columns) * tile_height,
+			tile_width,
+			tile_height);
+
+		start_time = end_time;
+	}
+
+	response->len = p - response->data;
+
+	if (response->len > result_size)
+	{
+		ngx_log_error(NGX_LOG_ERR, submodule_context->request_context.log, 0,
+			"ngx_http_vod_thumb_handle_tiles_index: result length %uz exceeded allocated length %uz",
+			response->len, result_size);
+		return ngx_http_vod_status_to_ngx_error(submodule_context->r, VOD_UNEXPECTED);
+	}
+
+	content_type->len = sizeof(vtt_content_type) - 1;
+	content_type->data = (u_char *)vtt_content_type;
+
+	return NGX_OK;
+}
+
+static const ngx_http_vod_request_t tiles_request = {
+	REQUEST_FLAG_SINGLE_TRACK,
+	PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_EXTRA_DATA,
+	REQUEST_CLASS_THUMB,
+	VOD_CODEC_FLAG(AVC) | VOD_CODEC_FLAG(HEVC) | VOD_CODEC_FLAG(VP8) | VOD_CODEC_FLAG(VP9),
+	THUMB_TIMESCALE,
+	NULL,
+	ngx_http_vod_thumb_init_tiles_frame_processor,
+	NULL,
+};
+
+static const ngx_http_vod_request_t tiles_index_request = {
+	REQUEST_FLAG_SINGLE_TRACK,
+	PARSE_BASIC_METADATA_ONLY,
+	REQUEST_CLASS_OTHER,
+	VOD_CODEC_FLAG(AVC) | VOD_CODEC_FLAG(HEVC) | VOD_CODEC_FLAG(VP8) | VOD_CODEC_FLAG(VP9),
+	THUMB_TIMESCALE,
+	ngx_http_vod_thumb_handle_tiles_index,
+	NULL,
+	NULL,
+};
+#endif // NGX_HAVE_LIB_SW_SCALE
+
 static void
 ngx_http_vod_thumb_create_loc_conf(
 	ngx_conf_t *cf,
@@ -170,7 +376,10 @@ ngx_http_vod_thumb_merge_loc_conf(
 	ngx_http_vod_thumb_loc_conf_t *prev)
 {
 	ngx_conf_merge_str_value(conf->file_name_prefix, prev->file_name_prefix, "thumb");
+	ngx_conf_merge_str_value(conf->tiles_file_name_prefix, prev->tiles_file_name_prefix, "tiles");
 	ngx_conf_merge_value(conf->accurate, prev->accurate, 1);
+	ngx_conf_merge_str_value(conf->hw_device_type, prev->hw_device_type, "");
+	ngx_conf_merge_str_value(conf->hw_device, prev->hw_device, "");
 	return NGX_CONF_OK;
 }
 
@@ -220,6 +429,47 @@ ngx_http_vod_thumb_parse_dimensions(
 
 	return start_pos;
 }
+
+static u_char*
+ngx_http_vod_thumb_parse_tiles(
+	u_char* start_pos,
+	u_char* end_pos,
+	thumb_tiles_params_t* result)
+{
+	skip_dash(start_pos, end_pos);
+
+	// interval
+	if (*start_pos == 'i')
+	{
+		start_pos++;		// skip the i
+
+		start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->interval);
+
+		skip_dash(start_pos, end_pos);
+	}
+
+	// columns
+	if (*start_pos == 'c')
+	{
+		start_pos++;		// skip the c
+
+		start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->columns);
+
+		skip_dash(start_pos, end_pos);
+	}
+
+	// rows
+	if (*start_pos == 'r')
+	{
+		start_pos++;		// skip the r
+
+		start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->rows);
+
+		skip_dash(start_pos, end_pos);
+	}
+
+	return start_pos;
+}
 #endif // NGX_HAVE_LIB_SW_SCALE
 
 static ngx_int_t
@@ -241,6 +491,34 @@ ngx_http_vod_thumb_parse_uri_file_name(
 		end_pos -= (sizeof(jpg_file_ext) - 1);
 		*request = &thumb_request;
 	}
+	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->thumb.file_name_prefix, webp_file_ext))
+	{
+		start_pos += conf->thumb.file_name_prefix.len;
+		end_pos -= (sizeof(webp_file_ext) - 1);
+		*request = &thumb_request;
+		request_params->image_format = THUMB_FORMAT_WEBP;
+	}
+#if (NGX_HAVE_LIB_SW_SCALE)
+	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->thumb.tiles_file_name_prefix, jpg_file_ext))
+	{
+		start_pos += conf->thumb.tiles_file_name_prefix.len;
+		end_pos -= (sizeof(jpg_file_ext) - 1);
+		*request = &tiles_request;
+	}
+	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->thumb.tiles_file_name_prefix, webp_file_ext))
+	{
+		start_pos += conf->thumb.tiles_file_name_prefix.len;
+		end_pos -= (sizeof(webp_file_ext) - 1);
+		*request = &tiles_request;
+		request_params->image_format = THUMB_FORMAT_WEBP;
+	}
+	else if (ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->thumb.tiles_file_name_prefix, vtt_file_ext))
+	{
+		start_pos += conf->thumb.tiles_file_name_prefix.len;
+		end_pos -= (sizeof(vtt_file_ext) - 1);
+		*request = &tiles_index_request;
+	}
+#endif // NGX_HAVE_LIB_SW_SCALE
 	else
 	{
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -292,6 +570,31 @@ ngx_http_vod_thumb_parse_uri_file_name(
 	}
 
 #if (NGX_HAVE_LIB_SW_SCALE)
+	if (*request != &thumb_request)
+	{
+		if (time_type != SEGMENT_TIME_ABSOLUTE)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_thumb_parse_uri_file_name: relative offsets are not supported for tiles");
+			return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
+		}
+
+		start_pos = ngx_http_vod_thumb_parse_tiles(start_pos, end_pos, &request_params->tiles);
+		if (request_params->tiles.interval <= 0 ||
+			request_params->tiles.columns <= 0 ||
+			request_params->tiles.rows <= 0 ||
+			request_params->tiles.columns > THUMB_TILES_MAX_COUNT ||
+			request_params->tiles.rows > THUMB_TILES_MAX_COUNT ||
+			request_params->tiles.columns * request_params->tiles.rows > THUMB_TILES_MAX_COUNT)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_thumb_parse_uri_file_name: failed to parse tiles interval/columns/rows");
+			return ngx_http_vod_status_to_ngx_error(r, VOD_BAD_REQUEST);
+		}
+
+		request_params->tiles.start = time;
+	}
+
 	start_pos = ngx_http_vod_thumb_parse_dimensions(r, start_pos, end_pos, request_params);
 	if (start_pos == NULL)
 	{
@@ -301,6 +604,19 @@ ngx_http_vod_thumb_parse_uri_file_name(
 	}
 #endif // NGX_HAVE_LIB_SW_SCALE
 
+	// key frame positioning
+	if (start_pos < end_pos && *start_pos == '-')
+	{
+		start_pos++;		// skip the -
+	}
+
+	if (start_pos < end_pos && *start_pos == 'k' &&
+		(start_pos + 1 >= end_pos || start_pos[1] == '-'))
+	{
+		start_pos++;		// skip the k
+		request_params->key_frame_only = TRUE;
+	}
+
 	// parse the required tracks string
 	rc = ngx_http_vod_parse_uri_file_name(r, start_pos, end_pos, 0, request_params);
 	if (rc != NGX_OK)
@@ -310,8 +626,14 @@ ngx_http_vod_thumb_parse_uri_file_name(
 		return rc;
 	}
 	
-	request_params->segment_time = time;
-	request_params->segment_time_type = time_type;
+#if (NGX_HAVE_LIB_SW_SCALE)
+	// the index does not read any frames, the offset is used only for building it
+	if (*request != &tiles_index_request)
+#endif // NGX_HAVE_LIB_SW_SCALE
+	{
+		request_params->segment_time = time;
+		request_params->segment_time_type = time_type;
+	}
 	request_params->tracks_mask[MEDIA_TYPE_AUDIO] = 0;
 	request_params->tracks_mask[MEDIA_TYPE_SUBTITLE] = 0;
 
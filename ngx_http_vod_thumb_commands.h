@@ -7,6 +7,13 @@
 	BASE_OFFSET + offsetof(ngx_http_vod_thumb_loc_conf_t, file_name_prefix),
 	NULL },
 
+	{ ngx_string("vod_thumb_tiles_file_name_prefix"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	BASE_OFFSET + offsetof(ngx_http_vod_thumb_loc_conf_t, tiles_file_name_prefix),
+	NULL },
+
 	{ ngx_string("vod_thumb_accurate_positioning"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_flag_slot,
@@ -14,4 +21,18 @@
 	BASE_OFFSET + offsetof(ngx_http_vod_thumb_loc_conf_t, accurate),
 	NULL },
 
+	{ ngx_string("vod_thumb_hw_device_type"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	BASE_OFFSET + offsetof(ngx_http_vod_thumb_loc_conf_t, hw_device_type),
+	NULL },
+
+	{ ngx_string("vod_thumb_hw_device"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	BASE_OFFSET + offsetof(ngx_http_vod_thumb_loc_conf_t, hw_device),
+	NULL },
+
 #undef BASE_OFFSET
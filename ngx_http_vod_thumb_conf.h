@@ -8,7 +8,10 @@
 typedef struct
 {
 	ngx_str_t file_name_prefix;
+	ngx_str_t tiles_file_name_prefix;
 	ngx_flag_t accurate;
+	ngx_str_t hw_device_type;
+	ngx_str_t hw_device;
 } ngx_http_vod_thumb_loc_conf_t;
 
 #endif // _NGX_HTTP_VOD_THUMB_CONF_H_INCLUDED_
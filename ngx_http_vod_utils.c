@@ -1,4 +1,13 @@
 #include "ngx_http_vod_utils.h"
+#include "ngx_perf_counters.h"
+
+#if (NGX_HAVE_OPENSSL_EVP)
+#include "vod/mp4/mp4_cenc_decrypt.h"
+#endif // NGX_HAVE_OPENSSL_EVP
+
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+#include <zlib.h>
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
 
 static const ngx_int_t error_map[VOD_ERROR_LAST - VOD_ERROR_FIRST] = {
 	NGX_HTTP_NOT_FOUND,				// VOD_BAD_DATA
@@ -35,8 +44,8 @@ void ngx_http_vod_set_status_index(ngx_uint_t index)
 	ngx_http_vod_status_index = index;
 }
 
-ngx_int_t
-ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type)
+static ngx_int_t
+ngx_http_vod_send_response_internal(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type, ngx_flag_t read_only)
 {
 	ngx_chain_t  out;
 	ngx_int_t    rc;
@@ -88,7 +97,14 @@ ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t
 	b->last = response->data + response->len;
 	if (response->len > 0)
 	{
-		b->temporary = 1;
+		if (read_only)
+		{
+			b->memory = 1;
+		}
+		else
+		{
+			b->temporary = 1;
+		}
 	}
 	b->last_buf = 1;  // this is the last buffer in the buffer chain
 
@@ -108,6 +124,18 @@ ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t
 	return NGX_OK;
 }
 
+ngx_int_t
+ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type)
+{
+	return ngx_http_vod_send_response_internal(r, response, content_type, 0);
+}
+
+ngx_int_t
+ngx_http_vod_send_read_only_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type)
+{
+	return ngx_http_vod_send_response_internal(r, response, content_type, 1);
+}
+
 ngx_int_t 
 ngx_http_vod_status_to_ngx_error(
 	ngx_http_request_t* r, 
@@ -524,3 +552,231 @@ ngx_http_vod_set_expires(ngx_http_request_t *r, time_t expires_time)
 
 	return NGX_OK;
 }
+
+ngx_int_t
+ngx_http_vod_parse_uri_list(
+	ngx_http_request_t *r,
+	size_t item_size,
+	ngx_array_t* result)
+{
+	ngx_http_vod_uri_list_item_t* cur_item;
+	ngx_request_body_t* rb = r->request_body;
+	ngx_uint_t flags;
+	ngx_buf_t* buf;
+	ssize_t size;
+	u_char* line_start;
+	u_char* line_end;
+	u_char* start;
+	u_char* end;
+	u_char* p;
+
+	if (ngx_array_init(result, r->pool, 16, item_size) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_parse_uri_list: ngx_array_init failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (rb == NULL || rb->bufs == NULL)
+	{
+		return NGX_OK;
+	}
+
+	// Note: the body is read into a single buffer, that may be backed by a temp file
+	buf = rb->bufs->buf;
+	if (buf->in_file)
+	{
+		start = ngx_pnalloc(r->pool, buf->file_last - buf->file_pos);
+		if (start == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_parse_uri_list: ngx_pnalloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		size = ngx_read_file(buf->file, start, buf->file_last - buf->file_pos, buf->file_pos);
+		if (size == NGX_ERROR)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+				"ngx_http_vod_parse_uri_list: ngx_read_file failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		end = start + size;
+	}
+	else
+	{
+		start = buf->pos;
+		end = buf->last;
+	}
+
+	for (p = start; p < end; p = line_end + 1)
+	{
+		line_end = ngx_strlchr(p, end, '\n');
+		if (line_end == NULL)
+		{
+			line_end = end;
+		}
+
+		line_start = p;
+		while (line_start < line_end && (*line_start == ' ' || *line_start == '\t'))
+		{
+			line_start++;
+		}
+
+		size = line_end - line_start;
+		while (size > 0 && (line_start[size - 1] == ' ' || line_start[size - 1] == '\t' || line_start[size - 1] == '\r'))
+		{
+			size--;
+		}
+
+		if (size <= 0 || *line_start == '#')
+		{
+			continue;
+		}
+
+		cur_item = ngx_array_push(result);
+		if (cur_item == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_parse_uri_list: ngx_array_push failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		ngx_memzero(cur_item, item_size);
+		cur_item->line.data = line_start;
+		cur_item->line.len = size;
+		cur_item->uri = cur_item->line;
+
+		flags = NGX_HTTP_LOG_UNSAFE;
+		if (*line_start != '/' ||
+			ngx_http_parse_unsafe_uri(r, &cur_item->uri, &cur_item->args, &flags) != NGX_OK)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_parse_uri_list: invalid uri %V", &cur_item->line);
+			cur_item->status = NGX_HTTP_BAD_REQUEST;
+		}
+	}
+
+	return NGX_OK;
+}
+
+#if (NGX_HAVE_OPENSSL_EVP)
+void
+ngx_http_vod_update_drm_counter(
+	ngx_http_vod_loc_conf_t* conf,
+	media_set_t* media_set,
+	ngx_flag_t passthrough)
+{
+	ngx_perf_counters_t* perf_counters;
+	media_track_t* track;
+	ngx_uint_t mode;
+
+	if (conf->perf_counters_zone == NULL)
+	{
+		return;
+	}
+
+	if (passthrough)
+	{
+		mode = PC_DRM_PASSTHROUGH;
+	}
+	else
+	{
+		// Note: when passthrough is not possible, encrypted sources keep the decryption frames source
+		track = media_set->sequences[0].filtered_clips[0].first_track;
+		mode = track->frames.frames_source == &mp4_cenc_decrypt_frames_source ? 
+			PC_DRM_REENCRYPT : PC_DRM_ENCRYPT;
+	}
+
+	perf_counters = ngx_perf_counters_get_worker_slot(conf->perf_counters_zone);
+	(void)ngx_atomic_fetch_add(&perf_counters->drm_segments[mode], 1);
+}
+#endif // NGX_HAVE_OPENSSL_EVP
+
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+ngx_int_t
+ngx_http_vod_gzip_response(
+	ngx_http_request_t* r,
+	ngx_str_t* response,
+	ngx_str_t* result)
+{
+	z_stream zstream;
+	u_char* buffer;
+	uLong alloc_size;
+	int zrc;
+
+	ngx_memzero(&zstream, sizeof(zstream));
+
+	// Note: the response is compressed once, when it is stored in the cache, so the default level is used
+	zrc = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (zrc != Z_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_gzip_response: deflateInit2 failed %d", zrc);
+		return NGX_ERROR;
+	}
+
+	alloc_size = deflateBound(&zstream, response->len);
+	if (alloc_size >= response->len)
+	{
+		alloc_size = response->len;
+	}
+
+	buffer = ngx_pnalloc(r->pool, alloc_size);
+	if (buffer == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_gzip_response: ngx_pnalloc failed");
+		deflateEnd(&zstream);
+		return NGX_ERROR;
+	}
+
+	zstream.next_in = response->data;
+	zstream.avail_in = response->len;
+	zstream.next_out = buffer;
+	zstream.avail_out = alloc_size;
+
+	// the output buffer is limited to the size of the response, if it fills up, there is no point compressing
+	zrc = deflate(&zstream, Z_FINISH);
+	deflateEnd(&zstream);
+
+	if (zrc != Z_STREAM_END || zstream.total_out >= response->len)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_gzip_response: response not compressed, rc %d, size %uz", zrc, response->len);
+		return NGX_DECLINED;
+	}
+
+	result->data = buffer;
+	result->len = zstream.total_out;
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_vod_set_gzip_encoding(ngx_http_request_t* r)
+{
+	ngx_table_elt_t* h;
+
+	if (ngx_http_gzip_ok(r) != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_gzip_encoding: ngx_list_push failed");
+		return NGX_ERROR;
+	}
+
+	h->hash = 1;
+	ngx_str_set(&h->key, "Content-Encoding");
+	ngx_str_set(&h->value, "gzip");
+	r->headers_out.content_encoding = h;
+
+	return NGX_OK;
+}
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
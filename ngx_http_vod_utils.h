@@ -7,11 +7,27 @@
 #include "ngx_http_vod_conf.h"
 #include "vod/common.h"
 
+// constants
+#if (NGX_HAVE_ZLIB && NGX_HTTP_GZIP)
+#define NGX_HTTP_VOD_RESPONSE_GZIP (1)
+#endif // NGX_HAVE_ZLIB && NGX_HTTP_GZIP
+
+// typedefs
+typedef struct {
+	ngx_str_t line;
+	ngx_str_t uri;
+	ngx_str_t args;
+	ngx_uint_t status;		// set to NGX_HTTP_BAD_REQUEST when the uri is invalid
+} ngx_http_vod_uri_list_item_t;
+
 // functions
 void ngx_http_vod_set_status_index(ngx_uint_t index);
 
 ngx_int_t ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type);
 
+// same as ngx_http_vod_send_response, but the response buffer is not modified by the output filters
+ngx_int_t ngx_http_vod_send_read_only_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t* content_type);
+
 ngx_int_t ngx_http_vod_status_to_ngx_error(
 	ngx_http_request_t* r,
 	vod_status_t rc);
@@ -40,4 +56,30 @@ ngx_int_t ngx_http_vod_set_expires(
 	ngx_http_request_t *r,
 	time_t expires_time);
 
+// parses a request body that contains one uri per line, empty lines and lines starting with # are ignored.
+// the elements of the result array are item_size bytes long, and start with ngx_http_vod_uri_list_item_t
+ngx_int_t ngx_http_vod_parse_uri_list(
+	ngx_http_request_t *r,
+	size_t item_size,
+	ngx_array_t* result);
+
+#if (NGX_HTTP_VOD_RESPONSE_GZIP)
+// compresses the response with gzip, returns NGX_DECLINED if the compressed response is not smaller
+ngx_int_t ngx_http_vod_gzip_response(
+	ngx_http_request_t* r,
+	ngx_str_t* response,
+	ngx_str_t* result);
+
+// returns NGX_OK and sets the content encoding of the response, if the client accepts gzip responses
+ngx_int_t ngx_http_vod_set_gzip_encoding(ngx_http_request_t* r);
+#endif // NGX_HTTP_VOD_RESPONSE_GZIP
+
+#if (NGX_HAVE_OPENSSL_EVP)
+// counts a drm segment in the perf counters by the way its samples were encrypted
+void ngx_http_vod_update_drm_counter(
+	ngx_http_vod_loc_conf_t* conf,
+	media_set_t* media_set,
+	ngx_flag_t passthrough);
+#endif // NGX_HAVE_OPENSSL_EVP
+
 #endif // _NGX_HTTP_VOD_UTILS_H_INCLUDED_
@@ -37,6 +37,12 @@ ngx_http_vod_volume_map_init_frame_processor(
 
 	*frame_processor = (ngx_http_vod_frame_processor_t)volume_map_writer_process;
 
+	// the response has to be built in full in order to store it in the cache
+	if (submodule_context->conf->volume_map_cache == NULL)
+	{
+		*response_size = NGX_HTTP_VOD_STREAMED_RESPONSE_SIZE;
+	}
+
 	*output_buffer = csv_header;
 	content_type->len = sizeof(csv_content_type) - 1;
 	content_type->data = (u_char *)csv_content_type;
@@ -52,6 +58,7 @@ static const ngx_http_vod_request_t volume_map_request = {
 	VOLUME_MAP_TIMESCALE,
 	NULL,
 	ngx_http_vod_volume_map_init_frame_processor,
+	NULL,
 };
 
 static void
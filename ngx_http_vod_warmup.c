@@ -0,0 +1,242 @@
+// includes
+#include "ngx_http_vod_warmup.h"
+#include "ngx_http_vod_module.h"
+#include "ngx_http_vod_utils.h"
+#include "ngx_http_vod_conf.h"
+
+// constants
+#define WARMUP_RESULT_FORMAT "%ui %V\n"
+#define WARMUP_SUMMARY_FORMAT "total: %ui, succeeded: %ui, failed: %ui\n"
+
+// typedefs
+typedef struct {
+	ngx_http_vod_uri_list_item_t base;
+	ngx_http_post_subrequest_t ps;
+} ngx_http_vod_warmup_item_t;
+
+typedef struct {
+	ngx_http_vod_warmup_item_t* items;
+	ngx_uint_t count;
+	ngx_uint_t next;
+	ngx_uint_t active;
+	ngx_uint_t done;
+	ngx_uint_t failed;
+	ngx_uint_t concurrency;
+} ngx_http_vod_warmup_ctx_t;
+
+// globals
+u_char ngx_http_vod_warmup_marker;
+
+static ngx_str_t text_content_type = ngx_string("text/plain");
+
+static ngx_int_t
+ngx_http_vod_warmup_send_report(ngx_http_request_t *r, ngx_http_vod_warmup_ctx_t* ctx)
+{
+	ngx_http_vod_warmup_item_t* cur_item;
+	ngx_http_vod_warmup_item_t* items_end;
+	ngx_str_t response;
+	size_t result_size;
+	u_char* p;
+
+	items_end = ctx->items + ctx->count;
+
+	result_size = sizeof(WARMUP_SUMMARY_FORMAT) + 3 * NGX_INT_T_LEN;
+	for (cur_item = ctx->items; cur_item < items_end; cur_item++)
+	{
+		result_size += sizeof(WARMUP_RESULT_FORMAT) + NGX_INT_T_LEN + cur_item->base.line.len;
+	}
+
+	response.data = ngx_pnalloc(r->pool, result_size);
+	if (response.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_warmup_send_report: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = response.data;
+	for (cur_item = ctx->items; cur_item < items_end; cur_item++)
+	{
+		p = ngx_sprintf(p, WARMUP_RESULT_FORMAT, cur_item->base.status, &cur_item->base.line);
+	}
+
+	p = ngx_sprintf(p, WARMUP_SUMMARY_FORMAT, ctx->count, ctx->count - ctx->failed, ctx->failed);
+
+	response.len = p - response.data;
+
+	return ngx_http_vod_send_response(r, &response, &text_content_type);
+}
+
+static void
+ngx_http_vod_warmup_item_finished(ngx_http_vod_warmup_ctx_t* ctx, ngx_http_vod_warmup_item_t* item, ngx_log_t* log)
+{
+	ctx->done++;
+	if (item->base.status >= NGX_HTTP_BAD_REQUEST)
+	{
+		ctx->failed++;
+	}
+
+	ngx_log_error(NGX_LOG_INFO, log, 0,
+		"ngx_http_vod_warmup_item_finished: %V returned %ui, %ui/%ui done, %ui failed",
+		&item->base.line, item->base.status, ctx->done, ctx->count, ctx->failed);
+}
+
+static ngx_int_t
+ngx_http_vod_warmup_subrequest_finished(ngx_http_request_t *sr, void *data, ngx_int_t rc);
+
+static void
+ngx_http_vod_warmup_start_subrequests(ngx_http_request_t *r, ngx_http_vod_warmup_ctx_t* ctx)
+{
+	ngx_http_vod_warmup_item_t* cur_item;
+	ngx_http_request_t* sr;
+
+	while (ctx->active < ctx->concurrency && ctx->next < ctx->count)
+	{
+		cur_item = &ctx->items[ctx->next++];
+		if (cur_item->base.status != 0)
+		{
+			// invalid uri
+			ngx_http_vod_warmup_item_finished(ctx, cur_item, r->connection->log);
+			continue;
+		}
+
+		cur_item->ps.handler = ngx_http_vod_warmup_subrequest_finished;
+		cur_item->ps.data = cur_item;
+
+		if (ngx_http_subrequest(r, &cur_item->base.uri, &cur_item->base.args, &sr, &cur_item->ps, NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_warmup_start_subrequests: ngx_http_subrequest failed for %V", &cur_item->base.line);
+			cur_item->base.status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			ngx_http_vod_warmup_item_finished(ctx, cur_item, r->connection->log);
+			continue;
+		}
+
+		ngx_http_set_ctx(sr, &ngx_http_vod_warmup_marker, ngx_http_vod_module);
+
+		ctx->active++;
+	}
+}
+
+static ngx_int_t
+ngx_http_vod_warmup_subrequest_finished(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+	ngx_http_vod_warmup_item_t* item = data;
+	ngx_http_vod_warmup_ctx_t* ctx;
+	ngx_http_request_t* r = sr->parent;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (rc >= NGX_HTTP_OK)
+	{
+		item->base.status = rc;
+	}
+	else if (rc == NGX_OK && sr->headers_out.status != 0)
+	{
+		item->base.status = sr->headers_out.status;
+	}
+	else
+	{
+		item->base.status = rc == NGX_OK ? NGX_HTTP_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->active--;
+	ngx_http_vod_warmup_item_finished(ctx, item, r->connection->log);
+
+	ngx_http_vod_warmup_start_subrequests(r, ctx);
+
+	// Note: the subrequest is finalized without a body, so that error pages are not added to the report
+	return NGX_HTTP_NO_CONTENT;
+}
+
+static void
+ngx_http_vod_warmup_wake_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_warmup_ctx_t* ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	if (ctx->done < ctx->count)
+	{
+		return;
+	}
+
+	r->write_event_handler = ngx_http_request_empty_handler;
+
+	ngx_http_finalize_request(r, ngx_http_vod_warmup_send_report(r, ctx));
+}
+
+static void
+ngx_http_vod_warmup_body_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_warmup_ctx_t* ctx;
+	ngx_array_t items;
+	ngx_int_t rc;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	ctx = ngx_pcalloc(r->pool, sizeof(*ctx));
+	if (ctx == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_warmup_body_handler: ngx_pcalloc failed");
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	rc = ngx_http_vod_parse_uri_list(r, sizeof(ngx_http_vod_warmup_item_t), &items);
+	if (rc != NGX_OK)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	ctx->items = items.elts;
+	ctx->count = items.nelts;
+
+	ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+		"ngx_http_vod_warmup_body_handler: warming up %ui uris, concurrency %ui", ctx->count, conf->warmup_concurrency);
+
+	ctx->concurrency = conf->warmup_concurrency;
+	ngx_http_set_ctx(r, ctx, ngx_http_vod_module);
+
+	// the request is woken up whenever a subrequest completes
+	r->write_event_handler = ngx_http_vod_warmup_wake_handler;
+
+	ngx_http_vod_warmup_start_subrequests(r, ctx);
+
+	if (ctx->active <= 0)
+	{
+		// no valid uris
+		ngx_http_vod_warmup_wake_handler(r);
+	}
+}
+
+ngx_int_t
+ngx_http_vod_warmup_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	if (r != r->main)
+	{
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	if (r->method != NGX_HTTP_POST)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_warmup_handler: unsupported method %ui, the uris must be posted", r->method);
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	r->request_body_in_single_buf = 1;
+
+	rc = ngx_http_read_client_request_body(r, ngx_http_vod_warmup_body_handler);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+	{
+		return rc;
+	}
+
+	return NGX_DONE;
+}
@@ -0,0 +1,14 @@
+#ifndef _NGX_HTTP_VOD_WARMUP_H_INCLUDED_
+#define _NGX_HTTP_VOD_WARMUP_H_INCLUDED_
+
+// includes
+#include <ngx_http.h>
+
+// globals
+// set as the module context of warmup subrequests, before the handler runs
+extern u_char ngx_http_vod_warmup_marker;
+
+// functions
+ngx_int_t ngx_http_vod_warmup_handler(ngx_http_request_t *r);
+
+#endif // _NGX_HTTP_VOD_WARMUP_H_INCLUDED_
@@ -0,0 +1,201 @@
+#include "ngx_io_uring.h"
+
+#if (NGX_HAVE_IO_URING)
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+/*
+	A per worker io_uring instance, integrated into the nginx event loop using an eventfd.
+	Reads are not submitted immediately, a posted event submits all the reads that were queued while 
+	processing the current batch of events with a single system call.
+*/
+
+// constants
+#define NGX_IO_URING_ENTRIES (256)
+
+// globals
+static struct io_uring ngx_io_uring_ring;
+static ngx_connection_t* ngx_io_uring_conn;
+static ngx_event_t ngx_io_uring_submit_event;
+static ngx_uint_t ngx_io_uring_state;		// 0 - not initialized, 1 - initialized, 2 - failed
+
+static void
+ngx_io_uring_submit(ngx_event_t* ev)
+{
+	int rc;
+
+	rc = io_uring_submit(&ngx_io_uring_ring);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ev->log, -rc,
+			"ngx_io_uring_submit: io_uring_submit failed");
+	}
+}
+
+static void
+ngx_io_uring_event_handler(ngx_event_t* ev)
+{
+	struct io_uring_cqe* cqe;
+	ngx_io_uring_task_t* task;
+	eventfd_t value;
+	ssize_t result;
+
+	// Note: the eventfd is non blocking, and registered as edge triggered
+	(void)eventfd_read(ngx_io_uring_conn->fd, &value);
+
+	while (io_uring_peek_cqe(&ngx_io_uring_ring, &cqe) == 0)
+	{
+		task = io_uring_cqe_get_data(cqe);
+		result = cqe->res;
+		io_uring_cqe_seen(&ngx_io_uring_ring, cqe);
+
+		task->handler(task, result);
+	}
+}
+
+static ngx_int_t
+ngx_io_uring_init(ngx_log_t* log)
+{
+	ngx_connection_t* c;
+	int fd;
+	int rc;
+
+	rc = io_uring_queue_init(NGX_IO_URING_ENTRIES, &ngx_io_uring_ring, 0);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, -rc,
+			"ngx_io_uring_init: io_uring_queue_init failed");
+		return NGX_ERROR;
+	}
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_io_uring_init: eventfd failed");
+		goto failed;
+	}
+
+	rc = io_uring_register_eventfd(&ngx_io_uring_ring, fd);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, -rc,
+			"ngx_io_uring_init: io_uring_register_eventfd failed");
+		close(fd);
+		goto failed;
+	}
+
+	c = ngx_get_connection(fd, log);
+	if (c == NULL)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, 0,
+			"ngx_io_uring_init: ngx_get_connection failed");
+		close(fd);
+		goto failed;
+	}
+
+	c->log = ngx_cycle->log;
+	c->read->log = c->log;
+	c->read->handler = ngx_io_uring_event_handler;
+
+	if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_CLEAR_EVENT) != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, 0,
+			"ngx_io_uring_init: ngx_add_event failed");
+		ngx_close_connection(c);
+		goto failed;
+	}
+
+	ngx_io_uring_conn = c;
+
+	ngx_io_uring_submit_event.handler = ngx_io_uring_submit;
+	ngx_io_uring_submit_event.log = ngx_cycle->log;
+
+	return NGX_OK;
+
+failed:
+
+	io_uring_queue_exit(&ngx_io_uring_ring);
+	return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_io_uring_read(
+	ngx_io_uring_task_t* task,
+	ngx_fd_t fd,
+	u_char* buf,
+	size_t size,
+	off_t offset,
+	ngx_log_t* log)
+{
+	struct io_uring_sqe* sqe;
+	int rc;
+
+	switch (ngx_io_uring_state)
+	{
+	case 0:
+		if (ngx_io_uring_init(log) != NGX_OK)
+		{
+			ngx_io_uring_state = 2;
+			return NGX_DECLINED;
+		}
+		ngx_io_uring_state = 1;
+		break;
+
+	case 2:
+		return NGX_DECLINED;
+	}
+
+	sqe = io_uring_get_sqe(&ngx_io_uring_ring);
+	if (sqe == NULL)
+	{
+		// the submission queue is full, flush it
+		rc = io_uring_submit(&ngx_io_uring_ring);
+		if (rc < 0)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, -rc,
+				"ngx_io_uring_read: io_uring_submit failed");
+			return NGX_DECLINED;
+		}
+
+		sqe = io_uring_get_sqe(&ngx_io_uring_ring);
+		if (sqe == NULL)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, 0,
+				"ngx_io_uring_read: io_uring_get_sqe failed");
+			return NGX_DECLINED;
+		}
+	}
+
+	io_uring_prep_read(sqe, fd, buf, size, offset);
+	io_uring_sqe_set_data(sqe, task);
+
+	if (!ngx_io_uring_submit_event.posted)
+	{
+		ngx_post_event(&ngx_io_uring_submit_event, &ngx_posted_events);
+	}
+
+	return NGX_AGAIN;
+}
+
+void
+ngx_io_uring_exit_process()
+{
+	if (ngx_io_uring_state != 1)
+	{
+		return;
+	}
+
+	if (ngx_io_uring_submit_event.posted)
+	{
+		ngx_delete_posted_event(&ngx_io_uring_submit_event);
+	}
+
+	ngx_close_connection(ngx_io_uring_conn);
+	io_uring_queue_exit(&ngx_io_uring_ring);
+
+	ngx_io_uring_state = 0;
+}
+
+#endif // NGX_HAVE_IO_URING
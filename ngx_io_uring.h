@@ -0,0 +1,34 @@
+#ifndef _NGX_IO_URING_H_INCLUDED_
+#define _NGX_IO_URING_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#if (NGX_HAVE_IO_URING)
+
+// typedefs
+typedef struct ngx_io_uring_task_s ngx_io_uring_task_t;
+
+typedef void(*ngx_io_uring_handler_pt)(ngx_io_uring_task_t* task, ssize_t result);
+
+struct ngx_io_uring_task_s {
+	ngx_io_uring_handler_pt handler;
+	void* data;
+};
+
+// functions
+ngx_int_t ngx_io_uring_read(
+	ngx_io_uring_task_t* task,
+	ngx_fd_t fd,
+	u_char* buf,
+	size_t size,
+	off_t offset,
+	ngx_log_t* log);
+
+void ngx_io_uring_exit_process();
+
+#endif // NGX_HAVE_IO_URING
+
+#endif // _NGX_IO_URING_H_INCLUDED_
@@ -0,0 +1,196 @@
+#include "ngx_object_cache.h"
+
+/*
+	the entries are kept in a queue, ordered by their last use (most recent first).
+	the lookup is linear, the cache is expected to hold a small number of entries (the titles that are
+	currently watched), and the cost of the lookup is negligible compared to the cost of building an object.
+	entries that are in use by some request are not freed when they are evicted, they are only detached
+	from the queue, and freed when the last request that uses them completes.
+*/
+
+// typedefs
+struct ngx_object_cache_s {
+	ngx_queue_t queue;
+	ngx_uint_t count;
+	ngx_uint_t max_count;
+	time_t valid;
+};
+
+ngx_object_cache_t*
+ngx_object_cache_create(ngx_conf_t *cf, ngx_uint_t max_count, time_t valid)
+{
+	ngx_object_cache_t* cache;
+
+	cache = ngx_pcalloc(cf->pool, sizeof(*cache));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	ngx_queue_init(&cache->queue);
+	cache->max_count = max_count;
+	cache->valid = valid;
+
+	return cache;
+}
+
+ngx_object_cache_entry_t*
+ngx_object_cache_alloc(ngx_object_cache_t* cache, size_t pool_size, ngx_log_t* log)
+{
+	ngx_object_cache_entry_t* entry;
+	ngx_pool_t* pool;
+
+	// Note: the pool is not related to any request, the log of the cycle is used
+	pool = ngx_create_pool(pool_size, ngx_cycle->log);
+	if (pool == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_object_cache_alloc: ngx_create_pool failed");
+		return NULL;
+	}
+
+	entry = ngx_pcalloc(pool, sizeof(*entry));
+	if (entry == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_object_cache_alloc: ngx_pcalloc failed");
+		ngx_destroy_pool(pool);
+		return NULL;
+	}
+
+	entry->cache = cache;
+	entry->pool = pool;
+
+	return entry;
+}
+
+void
+ngx_object_cache_free(ngx_object_cache_entry_t* entry)
+{
+	ngx_destroy_pool(entry->pool);
+}
+
+static void
+ngx_object_cache_remove(ngx_object_cache_entry_t* entry)
+{
+	ngx_queue_remove(&entry->queue);
+	entry->cache->count--;
+	entry->removed = 1;
+
+	if (entry->refs <= 0)
+	{
+		ngx_object_cache_free(entry);
+	}
+}
+
+static void
+ngx_object_cache_release(void* data)
+{
+	ngx_object_cache_entry_t* entry = data;
+
+	entry->refs--;
+	if (entry->refs <= 0 && entry->removed)
+	{
+		ngx_object_cache_free(entry);
+	}
+}
+
+static ngx_int_t
+ngx_object_cache_lock(ngx_object_cache_entry_t* entry, ngx_pool_t* pool)
+{
+	ngx_pool_cleanup_t* cln;
+
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pool->log, 0,
+			"ngx_object_cache_lock: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_object_cache_release;
+	cln->data = entry;
+
+	entry->refs++;
+
+	return NGX_OK;
+}
+
+void*
+ngx_object_cache_fetch(ngx_object_cache_t* cache, u_char* key, ngx_pool_t* pool)
+{
+	ngx_object_cache_entry_t* entry;
+	ngx_queue_t* q;
+
+	for (q = ngx_queue_head(&cache->queue);
+		q != ngx_queue_sentinel(&cache->queue);
+		q = ngx_queue_next(q))
+	{
+		entry = ngx_queue_data(q, ngx_object_cache_entry_t, queue);
+		if (ngx_memcmp(entry->key, key, OBJECT_CACHE_KEY_SIZE) != 0)
+		{
+			continue;
+		}
+
+		if (ngx_time() - entry->created >= cache->valid)
+		{
+			ngx_object_cache_remove(entry);
+			return NULL;
+		}
+
+		if (ngx_object_cache_lock(entry, pool) != NGX_OK)
+		{
+			return NULL;
+		}
+
+		// move to the head of the queue
+		ngx_queue_remove(q);
+		ngx_queue_insert_head(&cache->queue, q);
+
+		return entry->object;
+	}
+
+	return NULL;
+}
+
+ngx_int_t
+ngx_object_cache_store(ngx_object_cache_entry_t* entry, u_char* key, void* object, ngx_pool_t* pool)
+{
+	ngx_object_cache_t* cache = entry->cache;
+	ngx_object_cache_entry_t* cur;
+	ngx_queue_t* q;
+
+	if (ngx_object_cache_lock(entry, pool) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	// remove the previous entry of the key, if any
+	for (q = ngx_queue_head(&cache->queue);
+		q != ngx_queue_sentinel(&cache->queue);
+		q = ngx_queue_next(q))
+	{
+		cur = ngx_queue_data(q, ngx_object_cache_entry_t, queue);
+		if (ngx_memcmp(cur->key, key, OBJECT_CACHE_KEY_SIZE) == 0)
+		{
+			ngx_object_cache_remove(cur);
+			break;
+		}
+	}
+
+	// evict the least recently used entries
+	while (cache->count >= cache->max_count)
+	{
+		q = ngx_queue_last(&cache->queue);
+		ngx_object_cache_remove(ngx_queue_data(q, ngx_object_cache_entry_t, queue));
+	}
+
+	ngx_memcpy(entry->key, key, OBJECT_CACHE_KEY_SIZE);
+	entry->object = object;
+	entry->created = ngx_time();
+
+	ngx_queue_insert_head(&cache->queue, &entry->queue);
+	cache->count++;
+
+	return NGX_OK;
+}
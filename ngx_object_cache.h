@@ -0,0 +1,44 @@
+#ifndef _NGX_OBJECT_CACHE_H_INCLUDED_
+#define _NGX_OBJECT_CACHE_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+// constants
+#define OBJECT_CACHE_KEY_SIZE (16)
+#define OBJECT_CACHE_MAX_COUNT (1024)
+
+// typedefs
+typedef struct ngx_object_cache_s ngx_object_cache_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	ngx_object_cache_t* cache;
+	ngx_pool_t* pool;				// holds the object and everything it references
+	void* object;
+	ngx_uint_t refs;
+	time_t created;
+	unsigned removed:1;
+	u_char key[OBJECT_CACHE_KEY_SIZE];
+} ngx_object_cache_entry_t;
+
+// functions
+// creates a cache of objects that live in the memory of the worker process. an object is returned to
+//	requests for valid seconds after it was created, and is freed once it was evicted and all the requests
+//	that used it completed. the objects must not be modified after they are stored
+ngx_object_cache_t* ngx_object_cache_create(ngx_conf_t *cf, ngx_uint_t max_count, time_t valid);
+
+// returns the object of the key, or NULL. the object remains valid until the pool is destroyed
+void* ngx_object_cache_fetch(ngx_object_cache_t* cache, u_char* key, ngx_pool_t* pool);
+
+// allocates an entry, the caller builds the object on entry->pool and then either stores or frees it
+ngx_object_cache_entry_t* ngx_object_cache_alloc(ngx_object_cache_t* cache, size_t pool_size, ngx_log_t* log);
+
+// adds the entry to the cache, the object remains valid until the pool is destroyed.
+//	on error, the entry is not added and should be freed by the caller
+ngx_int_t ngx_object_cache_store(ngx_object_cache_entry_t* entry, u_char* key, void* object, ngx_pool_t* pool);
+
+void ngx_object_cache_free(ngx_object_cache_entry_t* entry);
+
+#endif // _NGX_OBJECT_CACHE_H_INCLUDED_
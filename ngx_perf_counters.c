@@ -2,22 +2,61 @@
 
 #define LOG_CONTEXT_FORMAT " in perf counters \"%V\"%Z"
 
+const ngx_str_t perf_counters_names[] = {
+#define PC(id, name, cpu) ngx_string(#name),
+#include "ngx_perf_counters_x.h"
+#undef PC
+};
+
 const ngx_str_t perf_counters_open_tags[] = {
-#define PC(id, name) { sizeof(#name) - 1 + 4, (u_char*)("<" #name ">\r\n") },
+#define PC(id, name, cpu) { sizeof(#name) - 1 + 4, (u_char*)("<" #name ">\r\n") },
 #include "ngx_perf_counters_x.h"
 #undef PC
 };
 
 const ngx_str_t perf_counters_close_tags[] = {
-#define PC(id, name) { sizeof(#name) - 1 + 5, (u_char*)("</" #name ">\r\n") },
+#define PC(id, name, cpu) { sizeof(#name) - 1 + 5, (u_char*)("</" #name ">\r\n") },
+#include "ngx_perf_counters_x.h"
+#undef PC
+};
+
+const u_char perf_counters_cpu[] = {
+#define PC(id, name, cpu) cpu,
 #include "ngx_perf_counters_x.h"
 #undef PC
 };
 
+#define ngx_perf_counters_slot(zone, index)	\
+	((ngx_perf_counters_t*)((zone)->slots + (index) * (zone)->slot_size))
+
+const ngx_str_t perf_counters_bytes_names[] = {
+	ngx_string("local"),
+	ngx_string("mapped"),
+	ngx_string("remote"),
+};
+
+const ngx_str_t perf_counters_drm_names[] = {
+	ngx_string("passthrough"),
+	ngx_string("reencrypt"),
+	ngx_string("encrypt"),
+};
+
+static ngx_uint_t
+ngx_perf_counters_get_slot_count()
+{
+	return ngx_ncpu > 0 ? ngx_ncpu : 1;
+}
+
+static size_t
+ngx_perf_counters_get_slot_size()
+{
+	return ngx_align(sizeof(ngx_perf_counters_t), ngx_cacheline_size);
+}
+
 static ngx_int_t
 ngx_perf_counters_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-	ngx_perf_counters_t *state;
+	ngx_perf_counters_zone_t *state;
 	ngx_slab_pool_t *shpool;
 	u_char* p;
 
@@ -43,21 +82,43 @@ ngx_perf_counters_init(ngx_shm_zone_t *shm_zone, void *data)
 	p = ngx_sprintf(shpool->log_ctx, LOG_CONTEXT_FORMAT, &shm_zone->shm.name);
 
 	// allocate the perf couonters state
-	state = (ngx_perf_counters_t*)p;
+	state = (ngx_perf_counters_zone_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+	p = (u_char*)(state + 1);
+
+	state->slot_count = ngx_perf_counters_get_slot_count();
+	state->slot_size = ngx_perf_counters_get_slot_size();
+	state->slots = ngx_align_ptr(p, ngx_cacheline_size);
 
-	ngx_memzero(state, sizeof(*state));
+	ngx_memzero(state->slots, state->slot_count * state->slot_size);
 
 	shpool->data = state;
 
 	return NGX_OK;
 }
 
+ngx_uint_t
+ngx_perf_counter_get_bucket_bound(ngx_uint_t index)
+{
+	if (index == 0)
+	{
+		return 1 << NGX_PERF_COUNTER_MIN_BUCKET_BITS;
+	}
+
+	index--;
+	return ((index & 1) ? 4 : 3) << (NGX_PERF_COUNTER_MIN_BUCKET_BITS - 1 + (index >> 1));
+}
+
 ngx_shm_zone_t*
 ngx_perf_counters_create_zone(ngx_conf_t *cf, ngx_str_t *name, void *tag)
 {
 	ngx_shm_zone_t* result;
+	size_t size;
+
+	size = sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len + 
+		sizeof(ngx_atomic_t) + sizeof(ngx_perf_counters_zone_t) + 
+		ngx_cacheline_size + ngx_perf_counters_get_slot_count() * ngx_perf_counters_get_slot_size();
 
-	result = ngx_shared_memory_add(cf, name, sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len + sizeof(ngx_perf_counters_t), tag);
+	result = ngx_shared_memory_add(cf, name, size, tag);
 	if (result == NULL)
 	{
 		return NULL;
@@ -66,3 +127,102 @@ ngx_perf_counters_create_zone(ngx_conf_t *cf, ngx_str_t *name, void *tag)
 	result->init = ngx_perf_counters_init;
 	return result;
 }
+
+ngx_perf_counters_t*
+ngx_perf_counters_get_worker_slot(ngx_shm_zone_t* shm_zone)
+{
+	ngx_perf_counters_zone_t* state = ((ngx_slab_pool_t *)shm_zone->shm.addr)->data;
+
+	// Note: when there are more workers than slots, some slots are shared, the updates are atomic
+	return ngx_perf_counters_slot(state, ngx_worker % state->slot_count);
+}
+
+void
+ngx_perf_counters_get_totals(ngx_shm_zone_t* shm_zone, ngx_perf_counters_t* result)
+{
+	ngx_perf_counters_zone_t* state = ((ngx_slab_pool_t *)shm_zone->shm.addr)->data;
+	ngx_perf_counter_t* src;
+	ngx_perf_counter_t* dst;
+	ngx_uint_t slot;
+	ngx_uint_t i;
+	ngx_uint_t j;
+
+	ngx_memzero(result, sizeof(*result));
+
+	for (slot = 0; slot < state->slot_count; slot++)
+	{
+		for (i = 0; i < PC_COUNT; i++)
+		{
+			src = &ngx_perf_counters_slot(state, slot)->counters[i];
+			dst = &result->counters[i];
+
+			dst->sum += src->sum;
+			dst->cpu_sum += src->cpu_sum;
+			dst->count += src->count;
+			if (src->max > dst->max)
+			{
+				dst->max = src->max;
+				dst->max_time = src->max_time;
+				dst->max_pid = src->max_pid;
+			}
+
+			for (j = 0; j < NGX_PERF_COUNTER_BUCKET_COUNT; j++)
+			{
+				dst->buckets[j] += src->buckets[j];
+			}
+		}
+
+		for (i = 0; i < PC_BYTES_COUNT; i++)
+		{
+			result->bytes[i] += ngx_perf_counters_slot(state, slot)->bytes[i];
+		}
+
+		for (i = 0; i < PC_DRM_COUNT; i++)
+		{
+			result->drm_segments[i] += ngx_perf_counters_slot(state, slot)->drm_segments[i];
+		}
+	}
+}
+
+void
+ngx_perf_counters_reset(ngx_shm_zone_t* shm_zone)
+{
+	ngx_perf_counters_zone_t* state = ((ngx_slab_pool_t *)shm_zone->shm.addr)->data;
+
+	ngx_memzero(state->slots, state->slot_count * state->slot_size);
+}
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+void
+ngx_perf_counters_add_event(
+	ngx_perf_counters_request_t* state,
+	ngx_uint_t type,
+	ngx_tick_count_t* end,
+	ngx_atomic_t duration)
+{
+	ngx_perf_counter_event_t* event;
+
+	if (state->events->nelts >= NGX_PERF_COUNTER_MAX_EVENTS)
+	{
+		state->dropped_events++;
+		state->io_size = 0;
+		return;
+	}
+
+	event = ngx_array_push(state->events);
+	if (event == NULL)
+	{
+		state->dropped_events++;
+		state->io_size = 0;
+		return;
+	}
+
+	event->type = type;
+	event->start = ngx_tick_count_diff(state->start, *end) - duration;
+	event->duration = duration;
+	event->offset = state->io_offset;
+	event->size = state->io_size;
+
+	state->io_size = 0;
+}
+#endif // NGX_PERF_COUNTERS_ENABLED
@@ -7,6 +7,12 @@
 // comment the line below to remove the support for performance counters
 #define NGX_PERF_COUNTERS_ENABLED
 
+// constants
+#define NGX_PERF_COUNTER_MAX_EVENTS (256)
+
+#define NGX_PERF_COUNTER_MIN_BUCKET_BITS (6)			// the first bucket holds durations up to 64 usec
+#define NGX_PERF_COUNTER_BUCKET_COUNT (42)			// the last bucket holds durations above ~67 sec
+
 // get tick count
 #if (NGX_HAVE_CLOCK_GETTIME)
 
@@ -28,22 +34,69 @@ typedef struct timeval ngx_tick_count_t;
 	
 #endif // NGX_HAVE_CLOCK_GETTIME
 
+// get the cpu time of the calling thread
+#if (NGX_HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+
+typedef struct timespec ngx_cpu_time_t;
+
+#define ngx_get_cpu_time(tp)  (void) clock_gettime(CLOCK_THREAD_CPUTIME_ID, tp)
+
+#define ngx_cpu_time_diff(start, end) ngx_tick_count_diff(start, end)
+
+#else
+
+typedef ngx_uint_t ngx_cpu_time_t;
+
+#define ngx_get_cpu_time(tp) *(tp) = 0
+
+#define ngx_cpu_time_diff(start, end) (0)
+
+#endif // NGX_HAVE_CLOCK_GETTIME && CLOCK_THREAD_CPUTIME_ID
+
 #ifdef NGX_PERF_COUNTERS_ENABLED
 
 // perf counters macros
+// returns the counters of the current worker process
 #define ngx_perf_counter_get_state(shm_zone)						\
-	(shm_zone != NULL ? ((ngx_slab_pool_t *)shm_zone->shm.addr)->data : NULL)
+	(shm_zone != NULL ? ngx_perf_counters_get_worker_slot(shm_zone) : NULL)
 
 #define ngx_perf_counter_context(ctx)								\
 	ngx_perf_counter_context_t ctx
 
 #define ngx_perf_counter_start(ctx)									\
-	ngx_get_tick_count(&ctx.start);
+	ngx_get_tick_count(&ctx.start);									\
+	ngx_get_cpu_time(&ctx.cpu_start);
 
 // Note: the calculation of 'max' has a race condition, the value can decrease since the condition
 //		and the assignment are not performed atomically. however, the value of max is expected to
 //		converge quickly so that its updates will be performed less and less frequently, so it 
 //		should be accurate enough.
+#define ngx_perf_counter_update(state, delta, type)					\
+	(void)ngx_atomic_fetch_add(&state->counters[type].sum, delta);	\
+	(void)ngx_atomic_fetch_add(&state->counters[type].count, 1);		\
+	(void)ngx_atomic_fetch_add(										\
+		&state->counters[type].buckets[ngx_perf_counter_get_bucket(delta)], 1);	\
+	if (delta > state->counters[type].max)							\
+	{																\
+		struct timeval __tv;										\
+		ngx_gettimeofday(&__tv);									\
+		state->counters[type].max = delta;							\
+		state->counters[type].max_time = __tv.tv_sec;				\
+		state->counters[type].max_pid = ngx_pid;					\
+	}
+
+// the cpu time is added only to the counters of stages that start and end on the same thread, without waiting
+//	for events in between (see ngx_perf_counters_x.h), otherwise it would include the work of other requests
+#define ngx_perf_counter_update_cpu(state, ctx, type)				\
+	if (perf_counters_cpu[type])									\
+	{																\
+		ngx_cpu_time_t __cpu_end;									\
+																	\
+		ngx_get_cpu_time(&__cpu_end);								\
+		(void)ngx_atomic_fetch_add(&state->counters[type].cpu_sum,	\
+			ngx_cpu_time_diff(ctx.cpu_start, __cpu_end));			\
+	}
+
 #define ngx_perf_counter_end(state, ctx, type)						\
 	if (state != NULL)												\
 	{																\
@@ -53,23 +106,42 @@ typedef struct timeval ngx_tick_count_t;
 		ngx_get_tick_count(&__end);									\
 																	\
 		__delta = ngx_tick_count_diff(ctx.start, __end);			\
-		(void)ngx_atomic_fetch_add(&state->counters[type].sum, __delta);	\
-		(void)ngx_atomic_fetch_add(&state->counters[type].count, 1);		\
-		if (__delta > state->counters[type].max)					\
+		ngx_perf_counter_update(state, __delta, type);				\
+		ngx_perf_counter_update_cpu(state, ctx, type);				\
+	}
+
+// same as ngx_perf_counter_end, but also adds the time to the per request counters (ngx_perf_counters_request_t)
+#define ngx_perf_counter_end_request(state, request_state, ctx, type)	\
+	{																\
+		ngx_tick_count_t __end;										\
+		ngx_atomic_t __delta;										\
+																	\
+		ngx_get_tick_count(&__end);									\
+																	\
+		__delta = ngx_tick_count_diff(ctx.start, __end);			\
+		(request_state).sum[type] += __delta;						\
+		(request_state).count[type]++;								\
+		if ((request_state).events != NULL)							\
 		{															\
-			struct timeval __tv;									\
-			ngx_gettimeofday(&__tv);								\
-			state->counters[type].max = __delta;					\
-			state->counters[type].max_time = __tv.tv_sec;			\
-			state->counters[type].max_pid = ngx_pid;				\
+			ngx_perf_counters_add_event(&(request_state), type, &__end, __delta);	\
+		}															\
+		if (state != NULL)											\
+		{															\
+			ngx_perf_counter_update(state, __delta, type);			\
+			ngx_perf_counter_update_cpu(state, ctx, type);			\
 		}															\
 	}
 
+// sets the offset / size of a read, they are attached to the next event of the request timeline
+#define ngx_perf_counter_set_io(request_state, offset, size)		\
+	(request_state).io_offset = offset;								\
+	(request_state).io_size = size;
+
 #define ngx_perf_counter_copy(target, source)	target = source
 
 // typedefs
 enum {
-#define PC(id, name) PC_##id,
+#define PC(id, name, cpu) PC_##id,
 	#include "ngx_perf_counters_x.h"
 #undef PC
 
@@ -78,8 +150,29 @@ enum {
 
 typedef struct {
 	ngx_tick_count_t start;
+	ngx_cpu_time_t cpu_start;
 } ngx_perf_counter_context_t;
 
+typedef struct {
+	ngx_uint_t type;
+	ngx_uint_t start;		// microseconds since the start of the request
+	ngx_uint_t duration;	// microseconds
+	off_t offset;
+	size_t size;			// zero if the event is not a read
+} ngx_perf_counter_event_t;
+
+typedef struct {
+	ngx_uint_t sum[PC_COUNT];		// microseconds
+	ngx_uint_t count[PC_COUNT];
+
+	// timeline, optional
+	ngx_array_t* events;			// ngx_perf_counter_event_t
+	ngx_uint_t dropped_events;
+	ngx_tick_count_t start;
+	off_t io_offset;
+	size_t io_size;
+} ngx_perf_counters_request_t;
+
 #else
 
 // empty macros
@@ -87,30 +180,120 @@ typedef struct {
 #define ngx_perf_counter_context(ctx)
 #define ngx_perf_counter_start(ctx)
 #define ngx_perf_counter_end(state, ctx, type)
+#define ngx_perf_counter_end_request(state, request_state, ctx, type)
+#define ngx_perf_counter_set_io(request_state, offset, size)
 #define ngx_perf_counter_copy(target, source)
 
 #define PC_COUNT (0)
 
+typedef struct {
+	ngx_uint_t unused;
+} ngx_perf_counters_request_t;
+
 #endif // NGX_PERF_COUNTERS_ENABLED
 
 // typedefs
 typedef struct {
 	ngx_atomic_t sum;
+	ngx_atomic_t cpu_sum;		// microseconds, the cpu time of the thread, see ngx_perf_counter_update_cpu
 	ngx_atomic_t count;
 	ngx_atomic_t max;
 	ngx_atomic_t max_time;
 	ngx_atomic_t max_pid;
+	ngx_atomic_t buckets[NGX_PERF_COUNTER_BUCKET_COUNT];		// duration histogram, see ngx_perf_counter_get_bucket
 } ngx_perf_counter_t;
 
+// the bytes read per access mode
+enum {
+	PC_BYTES_READ_LOCAL,
+	PC_BYTES_READ_MAPPED,
+	PC_BYTES_READ_REMOTE,
+
+	PC_BYTES_COUNT
+};
+
+// the encryption mode of drm segments
+enum {
+	PC_DRM_PASSTHROUGH,		// encrypted source with the output key, the samples are returned as is
+	PC_DRM_REENCRYPT,		// encrypted source, the samples are decrypted and encrypted with the output key
+	PC_DRM_ENCRYPT,			// clear source
+
+	PC_DRM_COUNT
+};
+
 typedef struct {
 	ngx_perf_counter_t counters[PC_COUNT];
+	ngx_atomic_t bytes[PC_BYTES_COUNT];
+	ngx_atomic_t drm_segments[PC_DRM_COUNT];
 } ngx_perf_counters_t;
 
+// each worker process updates a separate slot, the slots are aligned to cache lines, so that workers do not 
+// share the cache lines of the counters
+typedef struct {
+	ngx_uint_t slot_count;
+	size_t slot_size;
+	u_char* slots;
+} ngx_perf_counters_zone_t;
+
 // globals
+extern const ngx_str_t perf_counters_names[];
 extern const ngx_str_t perf_counters_open_tags[];
 extern const ngx_str_t perf_counters_close_tags[];
+extern const u_char perf_counters_cpu[];
+extern const ngx_str_t perf_counters_bytes_names[];
+extern const ngx_str_t perf_counters_drm_names[];
 
 // functions
 ngx_shm_zone_t* ngx_perf_counters_create_zone(ngx_conf_t *cf, ngx_str_t *name, void *tag);
 
+ngx_perf_counters_t* ngx_perf_counters_get_worker_slot(ngx_shm_zone_t* shm_zone);
+
+// sums the counters of all the worker processes
+void ngx_perf_counters_get_totals(ngx_shm_zone_t* shm_zone, ngx_perf_counters_t* result);
+
+void ngx_perf_counters_reset(ngx_shm_zone_t* shm_zone);
+
+#ifdef NGX_PERF_COUNTERS_ENABLED
+// adds an event to the timeline of the request, the number of events is limited to NGX_PERF_COUNTER_MAX_EVENTS
+void ngx_perf_counters_add_event(
+	ngx_perf_counters_request_t* state, 
+	ngx_uint_t type, 
+	ngx_tick_count_t* end, 
+	ngx_atomic_t duration);
+#endif // NGX_PERF_COUNTERS_ENABLED
+
+// returns the inclusive upper bound in usec of a histogram bucket, must not be called for the last bucket
+ngx_uint_t ngx_perf_counter_get_bucket_bound(ngx_uint_t index);
+
+// returns the histogram bucket of a duration in usec. the buckets are log-linear, with 2 buckets per power of 2, 
+// the upper bounds are 64, 96, 128, 192, 256, 384 ...
+static ngx_inline ngx_uint_t
+ngx_perf_counter_get_bucket(ngx_atomic_t delta)
+{
+	ngx_atomic_t value;
+	ngx_uint_t index;
+
+	// the bounds are inclusive
+	value = delta > 0 ? delta - 1 : 0;
+	if (value < (1 << NGX_PERF_COUNTER_MIN_BUCKET_BITS))
+	{
+		return 0;
+	}
+
+	// after the shift, value is at least 2, the bit below the most significant bit selects the bucket within the power of 2
+	index = 1;
+	for (value >>= NGX_PERF_COUNTER_MIN_BUCKET_BITS - 1; value >= 4; value >>= 1)
+	{
+		index += 2;
+	}
+
+	index += value - 2;
+	if (index >= NGX_PERF_COUNTER_BUCKET_COUNT)
+	{
+		index = NGX_PERF_COUNTER_BUCKET_COUNT - 1;
+	}
+
+	return index;
+}
+
 #endif // _NGX_PERF_COUNTERS_H_INCLUDED_
@@ -1,14 +1,30 @@
-PC(FETCH_CACHE,				fetch_cache)
-PC(STORE_CACHE,				store_cache)
-PC(MAP_PATH,				map_path)
-PC(PARSE_MEDIA_SET,			parse_media_set)
-PC(GET_DRM_INFO,			get_drm_info)
-PC(OPEN_FILE,				open_file)
-PC(ASYNC_OPEN_FILE,			async_open_file)
-PC(READ_FILE,				read_file)
-PC(ASYNC_READ_FILE,			async_read_file)
-PC(MEDIA_PARSE,				media_parse)
-PC(BUILD_MANIFEST,			build_manifest)
-PC(INIT_FRAME_PROCESS,		init_frame_processing)
-PC(PROCESS_FRAMES,			process_frames)
-PC(TOTAL,					total)
+// the third column is set for stages that start and end on the same thread without waiting for events,
+//	the cpu time of the thread is added to these counters
+PC(FETCH_CACHE,				fetch_cache,				1)
+PC(STORE_CACHE,				store_cache,				1)
+PC(FETCH_DISK_CACHE,			fetch_disk_cache,			1)
+PC(STORE_DISK_CACHE,			store_disk_cache,			1)
+PC(FETCH_REMOTE_CACHE,		fetch_remote_cache,			0)
+PC(STORE_REMOTE_CACHE,		store_remote_cache,			0)
+PC(FETCH_SIDECAR_INDEX,		fetch_sidecar_index,		0)
+PC(MAP_PATH,				map_path,					0)
+PC(PARSE_MEDIA_SET,			parse_media_set,			1)
+PC(GET_DRM_INFO,			get_drm_info,				0)
+PC(OPEN_FILE,				open_file,					1)
+PC(ASYNC_OPEN_FILE,			async_open_file,			0)
+PC(READ_FILE,				read_file,					1)
+PC(ASYNC_READ_FILE,			async_read_file,			0)
+PC(FETCH_UPSTREAM,			fetch_upstream,				0)
+PC(FETCH_UPSTREAM_KEEPALIVE,	fetch_upstream_keepalive,	0)
+PC(FETCH_MAPPING,			fetch_mapping,				0)
+PC(FETCH_DRM_INFO,			fetch_drm_info,				0)
+PC(SEND_NOTIFICATION,		send_notification,			0)
+PC(MEDIA_PARSE,				media_parse,				1)
+PC(MEDIA_PARSE_MP4,			media_parse_mp4,			1)
+PC(MEDIA_PARSE_MKV,			media_parse_mkv,			1)
+PC(MEDIA_PARSE_SUBTITLE,		media_parse_subtitle,		1)
+PC(BUILD_MANIFEST,			build_manifest,				1)
+PC(INIT_FRAME_PROCESS,		init_frame_processing,		1)
+PC(PROCESS_FRAMES,			process_frames,				1)
+PC(EVENT_LOOP_DELAY,		event_loop_delay,			0)
+PC(TOTAL,					total,						0)
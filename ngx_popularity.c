@@ -0,0 +1,403 @@
+#include "ngx_popularity.h"
+
+/*
+	shared memory layout:
+	0. ngx_slab_pool_t
+	1. log context
+	2. ngx_popularity_sh_t
+	3. sketch - SKETCH_DEPTH rows of 32 bit access counters (count-min sketch)
+	4. top - an array of the most popular keys and their names, protected by the mutex
+
+	the sketch is updated without locking, the mutex is taken only when the estimated
+	count of a key exceeds the lowest count in the top array.
+	every decay seconds, all the counters (including the counts of the top array) are halved,
+	so that the estimations reflect the recent popularity of the keys.
+*/
+
+#define LOG_CONTEXT_FORMAT " in popularity zone \"%V\"%Z"
+
+#define SKETCH_DEPTH (4)
+#define SKETCH_WIDTH (16384)		// must be a power of 2
+
+// typedefs
+typedef struct {
+	u_char key[POPULARITY_KEY_SIZE];
+	ngx_uint_t count;
+	size_t name_len;
+	u_char name[POPULARITY_MAX_NAME_LEN];
+} ngx_popularity_top_t;
+
+typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
+	ngx_atomic_t decaying;
+	time_t last_decay;
+	ngx_atomic_t top_min;
+	ngx_uint_t top_used;
+	ngx_popularity_top_t* top;
+	uint32_t* counters;
+} ngx_popularity_sh_t;
+
+struct ngx_popularity_s {
+	ngx_shm_zone_t* shm_zone;
+	ngx_popularity_sh_t* sh;
+	time_t decay;
+	ngx_uint_t top_count;
+};
+
+static ngx_int_t
+ngx_popularity_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_popularity_t* popularity = shm_zone->data;
+	ngx_popularity_t* old_popularity = data;
+	ngx_popularity_sh_t* sh;
+	ngx_slab_pool_t *shpool;
+	u_char* p;
+
+	if (old_popularity != NULL)
+	{
+		popularity->sh = old_popularity->sh;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		popularity->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	// start following the ngx_slab_pool_t that was allocated at the beginning of the chunk
+	p = shm_zone->shm.addr + sizeof(ngx_slab_pool_t);
+
+	// initialize the log context
+	shpool->log_ctx = p;
+	p = ngx_sprintf(shpool->log_ctx, LOG_CONTEXT_FORMAT, &shm_zone->shm.name);
+
+	// allocate the shared state
+	sh = (ngx_popularity_sh_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+	p = (u_char*)(sh + 1);
+
+	ngx_memzero(sh, sizeof(*sh));
+
+	if (ngx_shmtx_create(&sh->mutex, &sh->lock, NULL) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	sh->last_decay = ngx_time();
+
+	sh->counters = (uint32_t*)ngx_align_ptr(p, sizeof(uint32_t));
+	p = (u_char*)(sh->counters + SKETCH_DEPTH * SKETCH_WIDTH);
+	ngx_memzero(sh->counters, SKETCH_DEPTH * SKETCH_WIDTH * sizeof(sh->counters[0]));
+
+	sh->top = (ngx_popularity_top_t*)ngx_align_ptr(p, sizeof(void *));
+
+	shpool->data = sh;
+	popularity->sh = sh;
+
+	return NGX_OK;
+}
+
+ngx_popularity_t*
+ngx_popularity_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	time_t decay,
+	ngx_uint_t top_count,
+	void *tag)
+{
+	ngx_popularity_t* result;
+	ngx_shm_zone_t* shm_zone;
+	size_t size;
+
+	size = sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len +
+		sizeof(ngx_atomic_t) + sizeof(ngx_popularity_sh_t) +
+		sizeof(uint32_t) + SKETCH_DEPTH * SKETCH_WIDTH * sizeof(uint32_t) +
+		sizeof(void *) + top_count * sizeof(ngx_popularity_top_t);
+
+	shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+	if (shm_zone == NULL)
+	{
+		return NULL;
+	}
+
+	if (shm_zone->data != NULL)
+	{
+		// the zone is referenced more than once, the parameters of the first reference apply
+		return shm_zone->data;
+	}
+
+	result = ngx_pcalloc(cf->pool, sizeof(*result));
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	result->shm_zone = shm_zone;
+	result->decay = decay;
+	result->top_count = top_count;
+
+	shm_zone->init = ngx_popularity_init;
+	shm_zone->data = result;
+
+	return result;
+}
+
+static ngx_inline void
+ngx_popularity_sketch_indexes(const u_char* key, uint32_t* indexes)
+{
+	uint32_t i;
+
+	// Note: the keys are hash digests, so every 32 bit word of the key can be used as an independent hash
+	ngx_memcpy(indexes, key, SKETCH_DEPTH * sizeof(indexes[0]));
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		indexes[i] = i * SKETCH_WIDTH + (indexes[i] & (SKETCH_WIDTH - 1));
+	}
+}
+
+static ngx_uint_t
+ngx_popularity_sketch_estimate(ngx_popularity_sh_t* sh, const u_char* key)
+{
+	uint32_t indexes[SKETCH_DEPTH];
+	uint32_t i;
+	ngx_uint_t result;
+
+	ngx_popularity_sketch_indexes(key, indexes);
+
+	result = sh->counters[indexes[0]];
+	for (i = 1; i < SKETCH_DEPTH; i++)
+	{
+		result = ngx_min(result, sh->counters[indexes[i]]);
+	}
+
+	return result;
+}
+
+// Note: must be called while holding the mutex
+static void
+ngx_popularity_update_top_min(ngx_popularity_t* popularity)
+{
+	ngx_popularity_sh_t* sh = popularity->sh;
+	ngx_popularity_top_t* cur;
+	ngx_popularity_top_t* end;
+	ngx_uint_t min;
+
+	if (sh->top_used < popularity->top_count)
+	{
+		// the array is not full yet, any key can be added
+		sh->top_min = 0;
+		return;
+	}
+
+	min = NGX_MAX_UINT32_VALUE;
+	end = sh->top + sh->top_used;
+	for (cur = sh->top; cur < end; cur++)
+	{
+		min = ngx_min(min, cur->count);
+	}
+
+	sh->top_min = min;
+}
+
+static void
+ngx_popularity_decay(ngx_popularity_t* popularity)
+{
+	ngx_popularity_sh_t* sh = popularity->sh;
+	ngx_popularity_top_t* top_end;
+	ngx_popularity_top_t* top;
+	uint32_t* end;
+	uint32_t* cur;
+
+	if (!ngx_atomic_cmp_set(&sh->decaying, 0, 1))
+	{
+		return;		// another process is already decaying the counters
+	}
+
+	if (ngx_time() - sh->last_decay < popularity->decay)
+	{
+		// already decayed by another process
+		sh->decaying = 0;
+		return;
+	}
+
+	end = sh->counters + SKETCH_DEPTH * SKETCH_WIDTH;
+	for (cur = sh->counters; cur < end; cur++)
+	{
+		*cur >>= 1;
+	}
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	top_end = sh->top + sh->top_used;
+	for (top = sh->top; top < top_end; top++)
+	{
+		top->count >>= 1;
+	}
+
+	ngx_popularity_update_top_min(popularity);
+
+	ngx_shmtx_unlock(&sh->mutex);
+
+	sh->last_decay = ngx_time();
+	sh->decaying = 0;
+}
+
+static void
+ngx_popularity_update_top(ngx_popularity_t* popularity, u_char* key, ngx_str_t* name, ngx_uint_t count)
+{
+	ngx_popularity_sh_t* sh = popularity->sh;
+	ngx_popularity_top_t* victim = NULL;
+	ngx_popularity_top_t* end;
+	ngx_popularity_top_t* cur;
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	end = sh->top + sh->top_used;
+	for (cur = sh->top; cur < end; cur++)
+	{
+		if (ngx_memcmp(cur->key, key, POPULARITY_KEY_SIZE) == 0)
+		{
+			cur->count = count;
+			goto done;
+		}
+
+		if (victim == NULL || cur->count < victim->count)
+		{
+			victim = cur;
+		}
+	}
+
+	if (sh->top_used < popularity->top_count)
+	{
+		victim = sh->top + sh->top_used;
+		sh->top_used++;
+	}
+	else if (victim == NULL || victim->count >= count)
+	{
+		goto done;
+	}
+
+	ngx_memcpy(victim->key, key, POPULARITY_KEY_SIZE);
+	victim->count = count;
+	if (name != NULL)
+	{
+		victim->name_len = ngx_min(name->len, POPULARITY_MAX_NAME_LEN);
+		ngx_memcpy(victim->name, name->data, victim->name_len);
+	}
+	else
+	{
+		victim->name_len = 0;
+	}
+
+done:
+
+	ngx_popularity_update_top_min(popularity);
+
+	ngx_shmtx_unlock(&sh->mutex);
+}
+
+/* Note: the sketch is updated without the mutex, concurrent increments of the same counter may be lost,
+	this only makes the frequency estimation slightly less accurate */
+void
+ngx_popularity_increment(ngx_popularity_t* popularity, u_char* key, ngx_str_t* name)
+{
+	ngx_popularity_sh_t* sh = popularity->sh;
+	uint32_t indexes[SKETCH_DEPTH];
+	uint32_t* counter;
+	ngx_uint_t count;
+	uint32_t i;
+
+	if (popularity->decay > 0 && ngx_time() - sh->last_decay >= popularity->decay)
+	{
+		ngx_popularity_decay(popularity);
+	}
+
+	ngx_popularity_sketch_indexes(key, indexes);
+
+	count = NGX_MAX_UINT32_VALUE;
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		counter = sh->counters + indexes[i];
+		if (*counter < NGX_MAX_UINT32_VALUE)
+		{
+			(*counter)++;
+		}
+
+		count = ngx_min(count, *counter);
+	}
+
+	if (popularity->top_count <= 0 || count <= sh->top_min)
+	{
+		return;
+	}
+
+	ngx_popularity_update_top(popularity, key, name, count);
+}
+
+ngx_uint_t
+ngx_popularity_estimate(ngx_popularity_t* popularity, u_char* key)
+{
+	return ngx_popularity_sketch_estimate(popularity->sh, key);
+}
+
+static int ngx_libc_cdecl
+ngx_popularity_compare_top_entries(const void *one, const void *two)
+{
+	const ngx_popularity_top_entry_t* first = one;
+	const ngx_popularity_top_entry_t* second = two;
+
+	if (first->count == second->count)
+	{
+		return 0;
+	}
+
+	return first->count > second->count ? -1 : 1;
+}
+
+ngx_int_t
+ngx_popularity_get_top(
+	ngx_popularity_t* popularity,
+	ngx_pool_t* pool,
+	ngx_popularity_top_entry_t** result,
+	ngx_uint_t* count)
+{
+	ngx_popularity_top_entry_t* entries;
+	ngx_popularity_top_entry_t* dest;
+	ngx_popularity_sh_t* sh = popularity->sh;
+	ngx_popularity_top_t* end;
+	ngx_popularity_top_t* cur;
+	u_char* p;
+
+	entries = ngx_palloc(pool, popularity->top_count * (sizeof(entries[0]) + POPULARITY_MAX_NAME_LEN) + 1);
+	if (entries == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	p = (u_char*)(entries + popularity->top_count);
+	dest = entries;
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	end = sh->top + sh->top_used;
+	for (cur = sh->top; cur < end; cur++, dest++)
+	{
+		dest->name.data = p;
+		dest->name.len = cur->name_len;
+		p = ngx_copy(p, cur->name, cur->name_len);
+		dest->count = cur->count;
+	}
+
+	ngx_shmtx_unlock(&sh->mutex);
+
+	*count = dest - entries;
+	*result = entries;
+
+	ngx_qsort(entries, *count, sizeof(entries[0]), ngx_popularity_compare_top_entries);
+
+	return NGX_OK;
+}
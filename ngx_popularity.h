@@ -0,0 +1,42 @@
+#ifndef _NGX_POPULARITY_H_INCLUDED_
+#define _NGX_POPULARITY_H_INCLUDED_
+
+// includes
+#include <ngx_core.h>
+
+// constants
+#define POPULARITY_KEY_SIZE (16)
+#define POPULARITY_MAX_NAME_LEN (256)
+#define POPULARITY_MAX_TOP_COUNT (1024)
+
+// typedefs
+typedef struct ngx_popularity_s ngx_popularity_t;
+
+typedef struct {
+	ngx_str_t name;
+	ngx_uint_t count;
+} ngx_popularity_top_entry_t;
+
+// functions
+// creates a shared count-min sketch of the access frequency of keys, the counters are halved every
+//	decay seconds, and the top_count most popular keys are tracked along with their names
+ngx_popularity_t* ngx_popularity_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	time_t decay,
+	ngx_uint_t top_count,
+	void *tag);
+
+// Note: the key is expected to be a hash digest, e.g. a cache key
+void ngx_popularity_increment(ngx_popularity_t* popularity, u_char* key, ngx_str_t* name);
+
+ngx_uint_t ngx_popularity_estimate(ngx_popularity_t* popularity, u_char* key);
+
+// returns the most popular keys, sorted by count in descending order, the names are copied to the pool
+ngx_int_t ngx_popularity_get_top(
+	ngx_popularity_t* popularity,
+	ngx_pool_t* pool,
+	ngx_popularity_top_entry_t** result,
+	ngx_uint_t* count);
+
+#endif // _NGX_POPULARITY_H_INCLUDED_
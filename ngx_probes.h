@@ -0,0 +1,27 @@
+#ifndef _NGX_PROBES_H_INCLUDED_
+#define _NGX_PROBES_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+
+// USDT (user statically defined tracing) probes, the provider name is nginx_vod.
+//	each probe compiles to a single nop instruction and a note in the binary, the probes can be
+//	attached with bpftrace / perf / systemtap, e.g. bpftrace -l 'usdt:/usr/sbin/nginx:nginx_vod:*'.
+//	the arguments of the probes must be integers or pointers
+#if (NGX_HAVE_SYS_SDT)
+
+#include <sys/sdt.h>
+
+#define ngx_vod_probe2(name, a1, a2)					DTRACE_PROBE2(nginx_vod, name, a1, a2)
+#define ngx_vod_probe3(name, a1, a2, a3)				DTRACE_PROBE3(nginx_vod, name, a1, a2, a3)
+#define ngx_vod_probe4(name, a1, a2, a3, a4)			DTRACE_PROBE4(nginx_vod, name, a1, a2, a3, a4)
+
+#else
+
+#define ngx_vod_probe2(name, a1, a2)
+#define ngx_vod_probe3(name, a1, a2, a3)
+#define ngx_vod_probe4(name, a1, a2, a3, a4)
+
+#endif // NGX_HAVE_SYS_SDT
+
+#endif // _NGX_PROBES_H_INCLUDED_
@@ -0,0 +1,215 @@
+#include "ngx_request_samples.h"
+
+/*
+	shared memory layout:
+	0. ngx_slab_pool_t
+	1. log context
+	2. ngx_request_samples_sh_t
+	3. slots - a ring of count samples
+
+	a sample is written to the slot that follows the last written slot, the slots are not locked -
+	each slot has a version that is odd while the slot is being written, a writer that finds
+	the slot busy drops its sample, and a reader ignores the slots that changed while they were copied.
+*/
+
+#define LOG_CONTEXT_FORMAT " in request samples zone \"%V\"%Z"
+
+// typedefs
+typedef struct {
+	ngx_atomic_t version;			// zero when the slot was never written
+	ngx_request_sample_t sample;
+} ngx_request_samples_slot_t;
+
+typedef struct {
+	ngx_atomic_t next;
+	ngx_request_samples_slot_t* slots;
+} ngx_request_samples_sh_t;
+
+struct ngx_request_samples_s {
+	ngx_shm_zone_t* shm_zone;
+	ngx_request_samples_sh_t* sh;
+	ngx_uint_t count;
+	ngx_uint_t rate;
+	ngx_uint_t requests;			// per worker process, the sampling does not require updating the shared memory
+};
+
+// globals
+const ngx_str_t request_samples_cache_names[] = {
+	ngx_string("response"),
+	ngx_string("mapping"),
+	ngx_string("metadata"),
+	ngx_string("segment"),
+	ngx_string("frames"),
+	ngx_string("clip_header"),
+	ngx_string("drm_info"),
+};
+
+static ngx_int_t
+ngx_request_samples_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_request_samples_t* samples = shm_zone->data;
+	ngx_request_samples_t* old_samples = data;
+	ngx_request_samples_sh_t* sh;
+	ngx_slab_pool_t *shpool;
+	u_char* p;
+
+	if (old_samples != NULL)
+	{
+		samples->sh = old_samples->sh;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		samples->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	// start following the ngx_slab_pool_t that was allocated at the beginning of the chunk
+	p = shm_zone->shm.addr + sizeof(ngx_slab_pool_t);
+
+	// initialize the log context
+	shpool->log_ctx = p;
+	p = ngx_sprintf(shpool->log_ctx, LOG_CONTEXT_FORMAT, &shm_zone->shm.name);
+
+	// allocate the shared state
+	sh = (ngx_request_samples_sh_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+	p = (u_char*)(sh + 1);
+
+	sh->next = 0;
+	sh->slots = (ngx_request_samples_slot_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+	ngx_memzero(sh->slots, samples->count * sizeof(sh->slots[0]));
+
+	shpool->data = sh;
+	samples->sh = sh;
+
+	return NGX_OK;
+}
+
+ngx_request_samples_t*
+ngx_request_samples_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	ngx_uint_t count,
+	ngx_uint_t rate,
+	void *tag)
+{
+	ngx_request_samples_t* result;
+	ngx_shm_zone_t* shm_zone;
+	size_t size;
+
+	size = sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len +
+		sizeof(ngx_atomic_t) + sizeof(ngx_request_samples_sh_t) +
+		sizeof(ngx_atomic_t) + count * sizeof(ngx_request_samples_slot_t);
+
+	shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+	if (shm_zone == NULL)
+	{
+		return NULL;
+	}
+
+	if (shm_zone->data != NULL)
+	{
+		// the zone is referenced more than once, the parameters of the first reference apply
+		return shm_zone->data;
+	}
+
+	result = ngx_pcalloc(cf->pool, sizeof(*result));
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	result->shm_zone = shm_zone;
+	result->count = count;
+	result->rate = rate;
+
+	shm_zone->init = ngx_request_samples_init;
+	shm_zone->data = result;
+
+	return result;
+}
+
+ngx_flag_t
+ngx_request_samples_select(ngx_request_samples_t* samples)
+{
+	return (samples->requests++ % samples->rate) == 0;
+}
+
+void
+ngx_request_samples_add(ngx_request_samples_t* samples, ngx_request_sample_t* sample)
+{
+	ngx_request_samples_sh_t* sh = samples->sh;
+	ngx_request_samples_slot_t* slot;
+	ngx_atomic_uint_t version;
+
+	slot = &sh->slots[ngx_atomic_fetch_add(&sh->next, 1) % samples->count];
+
+	version = slot->version;
+	if ((version & 1) != 0 || !ngx_atomic_cmp_set(&slot->version, version, version + 1))
+	{
+		return;		// the slot is being written by another process
+	}
+
+	ngx_memory_barrier();
+
+	ngx_memcpy(&slot->sample, sample, sizeof(slot->sample));
+
+	ngx_memory_barrier();
+
+	slot->version = version + 2;
+}
+
+ngx_int_t
+ngx_request_samples_get(
+	ngx_request_samples_t* samples,
+	ngx_pool_t* pool,
+	ngx_request_sample_t** result,
+	ngx_uint_t* count)
+{
+	ngx_request_samples_sh_t* sh = samples->sh;
+	ngx_request_samples_slot_t* slot;
+	ngx_request_sample_t* dest;
+	ngx_atomic_uint_t version;
+	ngx_atomic_uint_t next;
+	ngx_uint_t i;
+
+	*result = ngx_palloc(pool, samples->count * sizeof(**result));
+	if (*result == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	dest = *result;
+	next = sh->next;
+
+	for (i = 1; i <= samples->count && i <= next; i++)
+	{
+		slot = &sh->slots[(next - i) % samples->count];
+
+		version = slot->version;
+		if (version == 0 || (version & 1) != 0)
+		{
+			continue;
+		}
+
+		ngx_memory_barrier();
+
+		ngx_memcpy(dest, &slot->sample, sizeof(*dest));
+
+		ngx_memory_barrier();
+
+		if (slot->version != version)
+		{
+			continue;		// overwritten while it was copied
+		}
+
+		dest++;
+	}
+
+	*count = dest - *result;
+
+	return NGX_OK;
+}
@@ -0,0 +1,71 @@
+#ifndef _NGX_REQUEST_SAMPLES_H_INCLUDED_
+#define _NGX_REQUEST_SAMPLES_H_INCLUDED_
+
+// includes
+#include <ngx_core.h>
+#include "ngx_perf_counters.h"
+
+// constants
+#define REQUEST_SAMPLES_MAX_COUNT (65536)
+#define REQUEST_SAMPLE_MAX_URI_LEN (256)
+#define REQUEST_SAMPLE_MAX_CONTENT_TYPE_LEN (64)
+
+// the caches whose outcome is recorded in the samples
+enum {
+	REQUEST_SAMPLE_CACHE_RESPONSE,
+	REQUEST_SAMPLE_CACHE_MAPPING,
+	REQUEST_SAMPLE_CACHE_METADATA,
+	REQUEST_SAMPLE_CACHE_SEGMENT,
+	REQUEST_SAMPLE_CACHE_FRAMES,
+	REQUEST_SAMPLE_CACHE_CLIP_HEADER,
+	REQUEST_SAMPLE_CACHE_DRM_INFO,
+
+	REQUEST_SAMPLE_CACHE_COUNT
+};
+
+// typedefs
+typedef struct ngx_request_samples_s ngx_request_samples_t;
+
+typedef struct {
+	time_t time;
+	ngx_pid_t pid;
+	ngx_uint_t status;
+	ngx_uint_t duration;			// microseconds
+	ngx_uint_t bytes_read;
+	uint32_t cache_hits;			// bit mask of REQUEST_SAMPLE_CACHE_XXX
+	uint32_t cache_misses;
+#ifdef NGX_PERF_COUNTERS_ENABLED
+	ngx_uint_t stage_sum[PC_COUNT];		// microseconds
+	ngx_uint_t stage_count[PC_COUNT];
+#endif // NGX_PERF_COUNTERS_ENABLED
+	size_t uri_len;
+	u_char uri[REQUEST_SAMPLE_MAX_URI_LEN];
+	size_t content_type_len;
+	u_char content_type[REQUEST_SAMPLE_MAX_CONTENT_TYPE_LEN];
+} ngx_request_sample_t;
+
+// globals
+extern const ngx_str_t request_samples_cache_names[];
+
+// functions
+// creates a shared ring of the last count sampled requests, one of every rate requests is sampled
+ngx_request_samples_t* ngx_request_samples_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	ngx_uint_t count,
+	ngx_uint_t rate,
+	void *tag);
+
+// returns whether the next request of the current worker process should be sampled
+ngx_flag_t ngx_request_samples_select(ngx_request_samples_t* samples);
+
+void ngx_request_samples_add(ngx_request_samples_t* samples, ngx_request_sample_t* sample);
+
+// returns the samples in the ring, the most recent first, the samples are copied to the pool
+ngx_int_t ngx_request_samples_get(
+	ngx_request_samples_t* samples,
+	ngx_pool_t* pool,
+	ngx_request_sample_t** result,
+	ngx_uint_t* count);
+
+#endif // _NGX_REQUEST_SAMPLES_H_INCLUDED_
@@ -0,0 +1,734 @@
+#include "ngx_segment_store.h"
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif // NGX_THREADS
+
+/*
+	Segment store - a persistent store of packaged segments on local disk (e.g. SSD).
+
+	Each segment is saved as a separate file in the store directory, the name of the file is the hex
+	representation of the key. The file contains a small header, the content type and the segment data,
+	the segment data is sent from the file using sendfile. The header holds the time the segment was written,
+	segments that are older than the expiration of the store are treated as missing, and are overwritten
+	by the next request that builds them.
+
+	Segments are written after they are sent - the buffers are copied to a pool that is owned by the write,
+	and the file is written on a thread pool (if configured). The file is written to a temporary file and
+	renamed to its final name, so that a concurrent open (possibly from another worker process) never sees
+	a partially written segment.
+
+	The total size of the directory is tracked in a shared memory zone. When it exceeds the max size, the
+	directory is scanned and the least recently used segments are deleted, until the total size drops below
+	90% of the max size. The directory is also scanned on the first write, to account for the segments that
+	were saved before the server was started. The modification time of the files is used as their access time
+	(atime is not updated on many file systems) - it is refreshed when a segment is opened.
+
+	shared memory layout:
+	0. ngx_slab_pool_t
+	1. log context
+	2. ngx_segment_store_sh_t
+*/
+
+#define LOG_CONTEXT_FORMAT " in segment store zone \"%V\"%Z"
+
+// constants
+#define SEGMENT_STORE_MAGIC (0x73646f76)		// vods
+#define SEGMENT_STORE_VERSION (2)
+#define SEGMENT_STORE_MAX_CONTENT_TYPE_LEN (128)
+#define SEGMENT_STORE_TOUCH_INTERVAL (60)		// the min interval in seconds between mtime updates of a file
+#define SEGMENT_STORE_FILE_NAME_LEN (BUFFER_CACHE_KEY_SIZE * 2)
+#define SEGMENT_STORE_SCAN_INITIAL_COUNT (1024)
+
+// typedefs
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t content_type_len;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t time;				// the time the segment was written
+} ngx_segment_store_header_t;
+
+typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;				// held while the directory is scanned
+	ngx_atomic_t total_size;
+	ngx_atomic_t scanned;
+} ngx_segment_store_sh_t;
+
+struct ngx_segment_store_s {
+	ngx_shm_zone_t* shm_zone;
+	ngx_segment_store_sh_t* sh;
+	ngx_str_t path;
+	off_t max_size;
+	time_t expiration;
+#if (NGX_THREADS)
+	ngx_thread_pool_t* thread_pool;
+#endif // NGX_THREADS
+};
+
+typedef struct {
+	ngx_segment_store_t* store;
+	ngx_pool_t* pool;
+	ngx_log_t* log;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t content_type;
+	ngx_str_t data;
+} ngx_segment_store_write_ctx_t;
+
+typedef struct {
+	u_char name[SEGMENT_STORE_FILE_NAME_LEN];
+	time_t mtime;
+	off_t size;
+} ngx_segment_store_file_t;
+
+// globals
+static ngx_atomic_t ngx_segment_store_temp_index;
+
+static ngx_int_t
+ngx_segment_store_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_segment_store_t* store = shm_zone->data;
+	ngx_segment_store_t* old_store = data;
+	ngx_segment_store_sh_t* sh;
+	ngx_slab_pool_t *shpool;
+	u_char* p;
+
+	if (old_store != NULL)
+	{
+		store->sh = old_store->sh;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		store->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	// start following the ngx_slab_pool_t that was allocated at the beginning of the chunk
+	p = shm_zone->shm.addr + sizeof(ngx_slab_pool_t);
+
+	// initialize the log context
+	shpool->log_ctx = p;
+	p = ngx_sprintf(shpool->log_ctx, LOG_CONTEXT_FORMAT, &shm_zone->shm.name);
+
+	// allocate the shared state
+	sh = (ngx_segment_store_sh_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+
+	ngx_memzero(sh, sizeof(*sh));
+
+	if (ngx_shmtx_create(&sh->mutex, &sh->lock, NULL) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	shpool->data = sh;
+	store->sh = sh;
+
+	return NGX_OK;
+}
+
+ngx_segment_store_t*
+ngx_segment_store_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	ngx_str_t *path,
+	off_t max_size,
+	time_t expiration,
+	ngx_str_t *thread_pool,
+	void *tag)
+{
+	ngx_segment_store_t* result;
+	ngx_shm_zone_t* shm_zone;
+	size_t size;
+
+	size = sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len +
+		sizeof(ngx_atomic_t) + sizeof(ngx_segment_store_sh_t);
+
+	// Note: nginx requires the size of a zone to be at least 8 pages
+	size = ngx_max(size, 8 * ngx_pagesize);
+
+	shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+	if (shm_zone == NULL)
+	{
+		return NULL;
+	}
+
+	if (shm_zone->data != NULL)
+	{
+		// the zone is referenced more than once
+		return shm_zone->data;
+	}
+
+	result = ngx_pcalloc(cf->pool, sizeof(*result));
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	// Note: the path is null terminated since it is passed to ngx_open_dir
+	result->path.len = path->len;
+	while (result->path.len > 1 && path->data[result->path.len - 1] == '/')
+	{
+		result->path.len--;
+	}
+
+	result->path.data = ngx_pnalloc(cf->pool, result->path.len + 1);
+	if (result->path.data == NULL)
+	{
+		return NULL;
+	}
+
+	ngx_memcpy(result->path.data, path->data, result->path.len);
+	result->path.data[result->path.len] = '\0';
+
+	result->max_size = max_size;
+	result->expiration = expiration;
+
+#if (NGX_THREADS)
+	if (thread_pool != NULL)
+	{
+		result->thread_pool = ngx_thread_pool_add(cf, thread_pool->len > 0 ? thread_pool : NULL);
+		if (result->thread_pool == NULL)
+		{
+			return NULL;
+		}
+	}
+#endif // NGX_THREADS
+
+	result->shm_zone = shm_zone;
+
+	shm_zone->init = ngx_segment_store_init;
+	shm_zone->data = result;
+
+	return result;
+}
+
+static u_char*
+ngx_segment_store_get_file_name(ngx_pool_t* pool, ngx_str_t* path, u_char* file_name, size_t extra_size)
+{
+	u_char* result;
+	u_char* p;
+
+	result = ngx_pnalloc(pool, path->len + sizeof("/") - 1 + SEGMENT_STORE_FILE_NAME_LEN + extra_size + 1);
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	p = ngx_copy(result, path->data, path->len);
+	*p++ = '/';
+	p = ngx_copy(p, file_name, SEGMENT_STORE_FILE_NAME_LEN);
+	*p = '\0';
+
+	return result;
+}
+
+ngx_int_t
+ngx_segment_store_open(
+	ngx_segment_store_t* store,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	ngx_segment_store_entry_t* result)
+{
+	ngx_segment_store_header_t header;
+	ngx_pool_cleanup_file_t* clnf;
+	ngx_pool_cleanup_t* cln;
+	ngx_file_info_t fi;
+	ngx_file_t* file;
+	ngx_fd_t fd;
+	ssize_t n;
+	u_char file_name[SEGMENT_STORE_FILE_NAME_LEN];
+	u_char* name;
+	u_char* buffer;
+
+	ngx_hex_dump(file_name, key, BUFFER_CACHE_KEY_SIZE);
+
+	name = ngx_segment_store_get_file_name(pool, &store->path, file_name, 0);
+	buffer = ngx_pnalloc(pool, sizeof(header) + SEGMENT_STORE_MAX_CONTENT_TYPE_LEN);
+	file = ngx_pcalloc(pool, sizeof(*file));
+	cln = ngx_pool_cleanup_add(pool, sizeof(ngx_pool_cleanup_file_t));
+	if (name == NULL || buffer == NULL || file == NULL || cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_open: alloc failed");
+		return NGX_ERROR;
+	}
+
+	fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		if (ngx_errno != NGX_ENOENT)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+				"ngx_segment_store_open: " ngx_open_file_n " \"%s\" failed", name);
+		}
+		return NGX_DECLINED;
+	}
+
+	// close the file when the request completes
+	cln->handler = ngx_pool_cleanup_file;
+	clnf = cln->data;
+	clnf->fd = fd;
+	clnf->name = name;
+	clnf->log = pool->log;
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_open: " ngx_fd_info_n " \"%s\" failed", name);
+		return NGX_DECLINED;
+	}
+
+	// read the header and the content type
+	n = ngx_read_fd(fd, buffer, sizeof(header) + SEGMENT_STORE_MAX_CONTENT_TYPE_LEN);
+	if (n < (ssize_t)sizeof(header))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_segment_store_open: failed to read the header of \"%s\"", name);
+		return NGX_DECLINED;
+	}
+
+	ngx_memcpy(&header, buffer, sizeof(header));
+
+	if (header.magic != SEGMENT_STORE_MAGIC ||
+		header.version != SEGMENT_STORE_VERSION ||
+		header.content_type_len > (size_t)n - sizeof(header) ||
+		header.size == 0 ||
+		(off_t)(sizeof(header) + header.content_type_len + header.size) != ngx_file_size(&fi))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_segment_store_open: invalid header in \"%s\"", name);
+		return NGX_DECLINED;
+	}
+
+	if (store->expiration > 0 &&
+		(time_t)header.time + store->expiration < ngx_time())
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_open: \"%s\" expired", name);
+		return NGX_DECLINED;
+	}
+
+	file->fd = fd;
+	file->name.data = name;
+	file->name.len = ngx_strlen(name);
+	file->log = log;
+
+	result->file = file;
+	result->offset = sizeof(header) + header.content_type_len;
+	result->size = header.size;
+	result->content_type.data = buffer + sizeof(header);
+	result->content_type.len = header.content_type_len;
+
+	// refresh the access time of the segment
+	if (ngx_file_mtime(&fi) + SEGMENT_STORE_TOUCH_INTERVAL < ngx_time() &&
+		ngx_set_file_time(name, fd, ngx_time()) != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_open: " ngx_set_file_time_n " \"%s\" failed", name);
+	}
+
+	return NGX_OK;
+}
+
+static int ngx_libc_cdecl
+ngx_segment_store_compare_files(const void *one, const void *two)
+{
+	const ngx_segment_store_file_t* file1 = one;
+	const ngx_segment_store_file_t* file2 = two;
+
+	if (file1->mtime < file2->mtime)
+	{
+		return -1;
+	}
+
+	return file1->mtime > file2->mtime ? 1 : 0;
+}
+
+// scans the directory, and deletes the least recently used segments if the max size is exceeded
+static void
+ngx_segment_store_evict(ngx_segment_store_t* store, ngx_pool_t* pool, ngx_log_t* log)
+{
+	ngx_segment_store_file_t* cur_file;
+	ngx_segment_store_file_t* last_file;
+	ngx_segment_store_sh_t* sh = store->sh;
+	ngx_array_t files;
+	ngx_uint_t evicted = 0;
+	ngx_dir_t dir;
+	ngx_err_t err;
+	off_t target_size;
+	off_t total_size;
+	u_char* name;
+
+	// only one process / thread scans the directory at a time
+	if (!ngx_shmtx_trylock(&sh->mutex))
+	{
+		return;
+	}
+
+	name = ngx_pnalloc(pool, store->path.len + sizeof("/") - 1 + SEGMENT_STORE_FILE_NAME_LEN + 1);
+	if (name == NULL ||
+		ngx_array_init(&files, pool, SEGMENT_STORE_SCAN_INITIAL_COUNT, sizeof(ngx_segment_store_file_t)) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_evict: alloc failed");
+		goto done;
+	}
+
+	ngx_memcpy(name, store->path.data, store->path.len);
+	name[store->path.len] = '/';
+	name[store->path.len + sizeof("/") - 1 + SEGMENT_STORE_FILE_NAME_LEN] = '\0';
+
+	if (ngx_open_dir(&store->path, &dir) == NGX_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_evict: " ngx_open_dir_n " \"%V\" failed", &store->path);
+		goto done;
+	}
+
+	total_size = 0;
+
+	for ( ;; )
+	{
+		ngx_set_errno(0);
+
+		if (ngx_read_dir(&dir) == NGX_ERROR)
+		{
+			err = ngx_errno;
+			if (err != NGX_ENOMOREFILES)
+			{
+				ngx_log_error(NGX_LOG_ERR, log, err,
+					"ngx_segment_store_evict: " ngx_read_dir_n " \"%V\" failed", &store->path);
+			}
+			break;
+		}
+
+		// Note: the temporary files have a longer name, and are skipped
+		if (ngx_de_namelen(&dir) != SEGMENT_STORE_FILE_NAME_LEN)
+		{
+			continue;
+		}
+
+		ngx_memcpy(name + store->path.len + sizeof("/") - 1, ngx_de_name(&dir), SEGMENT_STORE_FILE_NAME_LEN);
+
+		if (ngx_de_info(name, &dir) == NGX_FILE_ERROR || !ngx_de_is_file(&dir))
+		{
+			continue;
+		}
+
+		cur_file = ngx_array_push(&files);
+		if (cur_file == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_segment_store_evict: ngx_array_push failed");
+			ngx_close_dir(&dir);
+			goto done;
+		}
+
+		ngx_memcpy(cur_file->name, ngx_de_name(&dir), SEGMENT_STORE_FILE_NAME_LEN);
+		cur_file->mtime = ngx_de_mtime(&dir);
+		cur_file->size = ngx_de_size(&dir);
+		total_size += cur_file->size;
+	}
+
+	if (ngx_close_dir(&dir) == NGX_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_segment_store_evict: " ngx_close_dir_n " \"%V\" failed", &store->path);
+	}
+
+	if (total_size > store->max_size)
+	{
+		ngx_qsort(files.elts, files.nelts, sizeof(ngx_segment_store_file_t), ngx_segment_store_compare_files);
+
+		target_size = store->max_size / 10 * 9;
+
+		cur_file = files.elts;
+		last_file = cur_file + files.nelts;
+		for (; cur_file < last_file && total_size > target_size; cur_file++)
+		{
+			ngx_memcpy(name + store->path.len + sizeof("/") - 1, cur_file->name, SEGMENT_STORE_FILE_NAME_LEN);
+
+			if (ngx_delete_file(name) == NGX_FILE_ERROR)
+			{
+				err = ngx_errno;
+				if (err != NGX_ENOENT)
+				{
+					ngx_log_error(NGX_LOG_ERR, log, err,
+						"ngx_segment_store_evict: " ngx_delete_file_n " \"%s\" failed", name);
+					continue;
+				}
+			}
+
+			total_size -= cur_file->size;
+			evicted++;
+		}
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+		"ngx_segment_store_evict: scanned %ui files, evicted %ui, total size %O",
+		files.nelts, evicted, total_size);
+
+	sh->total_size = total_size;
+	sh->scanned = 1;
+
+done:
+
+	ngx_shmtx_unlock(&sh->mutex);
+}
+
+static ngx_flag_t
+ngx_segment_store_write_fd(ngx_fd_t fd, void* data, size_t size)
+{
+	ssize_t n;
+	u_char* p = data;
+
+	while (size > 0)
+	{
+		n = ngx_write_fd(fd, p, size);
+		if (n <= 0)
+		{
+			return 0;
+		}
+
+		p += n;
+		size -= n;
+	}
+
+	return 1;
+}
+
+static void
+ngx_segment_store_write(ngx_segment_store_write_ctx_t* ctx)
+{
+	ngx_segment_store_header_t header;
+	ngx_segment_store_t* store = ctx->store;
+	ngx_log_t* log = ctx->log;
+	ngx_fd_t fd;
+	u_char file_name[SEGMENT_STORE_FILE_NAME_LEN];
+	u_char* temp_name;
+	u_char* name;
+	u_char* p;
+
+	ngx_hex_dump(file_name, ctx->key, BUFFER_CACHE_KEY_SIZE);
+
+	name = ngx_segment_store_get_file_name(ctx->pool, &store->path, file_name, 0);
+	temp_name = ngx_segment_store_get_file_name(ctx->pool, &store->path, file_name,
+		sizeof(".") - 1 + NGX_INT_T_LEN + sizeof(".") - 1 + NGX_ATOMIC_T_LEN);
+	if (name == NULL || temp_name == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_write: ngx_pnalloc failed");
+		return;
+	}
+
+	// the pid and a sequence number are appended to the temp file name, to avoid collisions between
+	// different worker processes / threads
+	p = temp_name + store->path.len + sizeof("/") - 1 + SEGMENT_STORE_FILE_NAME_LEN;
+	p = ngx_sprintf(p, ".%P.%uA", ngx_pid, ngx_atomic_fetch_add(&ngx_segment_store_temp_index, 1));
+	*p = '\0';
+
+	ngx_memzero(&header, sizeof(header));
+	header.magic = SEGMENT_STORE_MAGIC;
+	header.version = SEGMENT_STORE_VERSION;
+	header.content_type_len = ctx->content_type.len;
+	header.size = ctx->data.len;
+	header.time = ngx_time();
+
+	fd = ngx_open_file(temp_name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_write: " ngx_open_file_n " \"%s\" failed", temp_name);
+		return;
+	}
+
+	if (!ngx_segment_store_write_fd(fd, &header, sizeof(header)) ||
+		!ngx_segment_store_write_fd(fd, ctx->content_type.data, ctx->content_type.len) ||
+		!ngx_segment_store_write_fd(fd, ctx->data.data, ctx->data.len))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_write: " ngx_write_fd_n " \"%s\" failed", temp_name);
+
+		if (ngx_close_file(fd) == NGX_FILE_ERROR)
+		{
+			ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+				"ngx_segment_store_write: " ngx_close_file_n " \"%s\" failed", temp_name);
+		}
+		goto delete;
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_write: " ngx_close_file_n " \"%s\" failed", temp_name);
+		goto delete;
+	}
+
+	if (ngx_rename_file(temp_name, name) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_write: " ngx_rename_file_n " \"%s\" to \"%s\" failed", temp_name, name);
+		goto delete;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+		"ngx_segment_store_write: saved \"%s\", size %uz", name, ctx->data.len);
+
+	(void)ngx_atomic_fetch_add(&store->sh->total_size, sizeof(header) + ctx->content_type.len + ctx->data.len);
+
+	if (!store->sh->scanned || (off_t)store->sh->total_size > store->max_size)
+	{
+		ngx_segment_store_evict(store, ctx->pool, log);
+	}
+
+	return;
+
+delete:
+
+	if (ngx_delete_file(temp_name) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_segment_store_write: " ngx_delete_file_n " \"%s\" failed", temp_name);
+	}
+}
+
+#if (NGX_THREADS)
+static void
+ngx_segment_store_write_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_segment_store_write(data);
+}
+
+static void
+ngx_segment_store_write_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_segment_store_write_ctx_t* ctx = ev->data;
+
+	// Note: the task is allocated on the pool
+	ngx_destroy_pool(ctx->pool);
+}
+#endif // NGX_THREADS
+
+ngx_int_t
+ngx_segment_store_save(
+	ngx_segment_store_t* store,
+	ngx_log_t* log,
+	u_char* key,
+	ngx_str_t* content_type,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_segment_store_write_ctx_t* ctx;
+	ngx_str_t* buffers_end = buffers + buffer_count;
+	ngx_str_t* cur_buffer;
+	ngx_pool_t* pool;
+	size_t size;
+	u_char* p;
+#if (NGX_THREADS)
+	ngx_thread_task_t* task = NULL;
+#endif // NGX_THREADS
+
+	size = 0;
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		size += cur_buffer->len;
+	}
+
+	if (size == 0 || content_type->len > SEGMENT_STORE_MAX_CONTENT_TYPE_LEN)
+	{
+		return NGX_DECLINED;
+	}
+
+	// Note: the write may complete after the request is freed, so it uses its own pool / log
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+	if (pool == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_save: ngx_create_pool failed");
+		return NGX_ERROR;
+	}
+
+#if (NGX_THREADS)
+	if (store->thread_pool != NULL)
+	{
+		task = ngx_thread_task_alloc(pool, sizeof(*ctx));
+		if (task == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_segment_store_save: ngx_thread_task_alloc failed");
+			goto failed;
+		}
+
+		ctx = task->ctx;
+	}
+	else
+#endif // NGX_THREADS
+	{
+		ctx = ngx_palloc(pool, sizeof(*ctx));
+		if (ctx == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_segment_store_save: ngx_palloc failed");
+			goto failed;
+		}
+	}
+
+	p = ngx_pnalloc(pool, content_type->len + size);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_segment_store_save: ngx_pnalloc failed");
+		goto failed;
+	}
+
+	ctx->store = store;
+	ctx->pool = pool;
+	ctx->log = ngx_cycle->log;
+	ngx_memcpy(ctx->key, key, sizeof(ctx->key));
+
+	ctx->content_type.data = p;
+	ctx->content_type.len = content_type->len;
+	p = ngx_copy(p, content_type->data, content_type->len);
+
+	ctx->data.data = p;
+	ctx->data.len = size;
+	for (cur_buffer = buffers; cur_buffer < buffers_end; cur_buffer++)
+	{
+		p = ngx_copy(p, cur_buffer->data, cur_buffer->len);
+	}
+
+#if (NGX_THREADS)
+	if (task != NULL)
+	{
+		task->handler = ngx_segment_store_write_thread_handler;
+		task->event.data = ctx;
+		task->event.handler = ngx_segment_store_write_thread_event_handler;
+
+		// Note: the post fails when the queue of the thread pool is full, the segment is not saved in this case
+		if (ngx_thread_task_post(store->thread_pool, task) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_segment_store_save: ngx_thread_task_post failed");
+			goto failed;
+		}
+
+		return NGX_OK;
+	}
+#endif // NGX_THREADS
+
+	ngx_segment_store_write(ctx);
+	ngx_destroy_pool(pool);
+	return NGX_OK;
+
+failed:
+
+	ngx_destroy_pool(pool);
+	return NGX_ERROR;
+}
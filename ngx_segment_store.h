@@ -0,0 +1,51 @@
+#ifndef _NGX_SEGMENT_STORE_H_INCLUDED_
+#define _NGX_SEGMENT_STORE_H_INCLUDED_
+
+// includes
+#include <ngx_core.h>
+#include "ngx_buffer_cache.h"
+
+// typedefs
+typedef struct ngx_segment_store_s ngx_segment_store_t;
+
+typedef struct {
+	ngx_file_t* file;
+	off_t offset;				// the offset of the segment data in the file
+	off_t size;					// the size of the segment data
+	ngx_str_t content_type;
+} ngx_segment_store_entry_t;
+
+// functions
+// creates a persistent store of segments in the directory path, the total size of the directory is tracked in
+//	a shared memory zone, once it exceeds max_size, the least recently used segments are deleted.
+//	segments that were written more than expiration seconds ago are not served (0 = no expiration).
+//	when thread_pool is not null, the segments are written on the thread pool with this name (empty = default pool)
+ngx_segment_store_t* ngx_segment_store_create(
+	ngx_conf_t *cf,
+	ngx_str_t *name,
+	ngx_str_t *path,
+	off_t max_size,
+	time_t expiration,
+	ngx_str_t *thread_pool,
+	void *tag);
+
+// opens the file of the segment, the file is closed when the pool is destroyed.
+//	returns NGX_DECLINED if the segment is not in the store
+ngx_int_t ngx_segment_store_open(
+	ngx_segment_store_t* store,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	ngx_segment_store_entry_t* result);
+
+// saves the segment to the store, the buffers are copied, when the store has a thread pool, the file is written
+//	on the thread pool after the function returns
+ngx_int_t ngx_segment_store_save(
+	ngx_segment_store_t* store,
+	ngx_log_t* log,
+	u_char* key,
+	ngx_str_t* content_type,
+	ngx_str_t* buffers,
+	size_t buffer_count);
+
+#endif // _NGX_SEGMENT_STORE_H_INCLUDED_
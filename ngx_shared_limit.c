@@ -0,0 +1,192 @@
+#include "ngx_shared_limit.h"
+
+/*
+	shared memory layout:
+	0. ngx_slab_pool_t
+	1. log context
+	2. ngx_shared_limit_sh_t - an array of SHARED_LIMIT_MAX_KEYS counters
+
+	the counters are added under the mutex, and are never removed. the slots of a counter are
+	taken and released with atomic operations, without locking.
+*/
+
+#define LOG_CONTEXT_FORMAT " in shared limit zone \"%V\"%Z"
+
+// typedefs
+typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
+	ngx_atomic_t count;
+	ngx_shared_limit_counter_t counters[SHARED_LIMIT_MAX_KEYS];
+} ngx_shared_limit_sh_t;
+
+struct ngx_shared_limit_s {
+	ngx_shm_zone_t* shm_zone;
+	ngx_shared_limit_sh_t* sh;
+};
+
+static ngx_int_t
+ngx_shared_limit_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_shared_limit_t* limit = shm_zone->data;
+	ngx_shared_limit_t* old_limit = data;
+	ngx_shared_limit_sh_t* sh;
+	ngx_slab_pool_t *shpool;
+	u_char* p;
+
+	if (old_limit != NULL)
+	{
+		limit->sh = old_limit->sh;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		limit->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	// start following the ngx_slab_pool_t that was allocated at the beginning of the chunk
+	p = shm_zone->shm.addr + sizeof(ngx_slab_pool_t);
+
+	// initialize the log context
+	shpool->log_ctx = p;
+	p = ngx_sprintf(shpool->log_ctx, LOG_CONTEXT_FORMAT, &shm_zone->shm.name);
+
+	// allocate the shared state
+	sh = (ngx_shared_limit_sh_t*)ngx_align_ptr(p, sizeof(ngx_atomic_t));
+
+	ngx_memzero(sh, sizeof(*sh));
+
+	if (ngx_shmtx_create(&sh->mutex, &sh->lock, NULL) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	shpool->data = sh;
+	limit->sh = sh;
+
+	return NGX_OK;
+}
+
+ngx_shared_limit_t*
+ngx_shared_limit_create(ngx_conf_t *cf, ngx_str_t *name, void *tag)
+{
+	ngx_shared_limit_t* result;
+	ngx_shm_zone_t* shm_zone;
+	size_t size;
+
+	size = sizeof(ngx_slab_pool_t) + sizeof(LOG_CONTEXT_FORMAT) + name->len +
+		sizeof(ngx_atomic_t) + sizeof(ngx_shared_limit_sh_t);
+
+	// Note: nginx requires the size of a zone to be at least 8 pages
+	size = ngx_max(size, 8 * ngx_pagesize);
+
+	shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+	if (shm_zone == NULL)
+	{
+		return NULL;
+	}
+
+	if (shm_zone->data != NULL)
+	{
+		// the zone is referenced more than once
+		return shm_zone->data;
+	}
+
+	result = ngx_pcalloc(cf->pool, sizeof(*result));
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	result->shm_zone = shm_zone;
+
+	shm_zone->init = ngx_shared_limit_init;
+	shm_zone->data = result;
+
+	return result;
+}
+
+ngx_shared_limit_counter_t*
+ngx_shared_limit_get_counter(ngx_shared_limit_t* limit, ngx_str_t* key)
+{
+	ngx_shared_limit_counter_t* counter;
+	ngx_shared_limit_counter_t* end;
+	ngx_shared_limit_sh_t* sh = limit->sh;
+	size_t key_len;
+
+	key_len = ngx_min(key->len, SHARED_LIMIT_MAX_KEY_LEN);
+
+	ngx_shmtx_lock(&sh->mutex);
+
+	end = sh->counters + sh->count;
+	for (counter = sh->counters; counter < end; counter++)
+	{
+		if (counter->key_len == key_len &&
+			ngx_memcmp(counter->key, key->data, key_len) == 0)
+		{
+			goto done;
+		}
+	}
+
+	if (sh->count >= SHARED_LIMIT_MAX_KEYS)
+	{
+		counter = NULL;
+		goto done;
+	}
+
+	counter->key_len = key_len;
+	ngx_memcpy(counter->key, key->data, key_len);
+
+	// Note: the counters are listed without the mutex, the key must be visible before the count is incremented
+	ngx_memory_barrier();
+	sh->count++;
+
+done:
+
+	ngx_shmtx_unlock(&sh->mutex);
+
+	return counter;
+}
+
+ngx_flag_t
+ngx_shared_limit_try_acquire(ngx_shared_limit_counter_t* counter, ngx_uint_t max)
+{
+	ngx_atomic_uint_t active;
+
+	for ( ;; )
+	{
+		active = counter->active;
+		if (active >= max)
+		{
+			return 0;
+		}
+
+		if (ngx_atomic_cmp_set(&counter->active, active, active + 1))
+		{
+			return 1;
+		}
+	}
+}
+
+void
+ngx_shared_limit_acquire(ngx_shared_limit_counter_t* counter)
+{
+	(void)ngx_atomic_fetch_add(&counter->active, 1);
+}
+
+void
+ngx_shared_limit_release(ngx_shared_limit_counter_t* counter)
+{
+	(void)ngx_atomic_fetch_add(&counter->active, -1);
+}
+
+ngx_uint_t
+ngx_shared_limit_get_counters(ngx_shared_limit_t* limit, ngx_shared_limit_counter_t** counters)
+{
+	*counters = limit->sh->counters;
+	return limit->sh->count;
+}
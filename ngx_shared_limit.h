@@ -0,0 +1,42 @@
+#ifndef _NGX_SHARED_LIMIT_H_INCLUDED_
+#define _NGX_SHARED_LIMIT_H_INCLUDED_
+
+// includes
+#include <ngx_core.h>
+
+// constants
+#define SHARED_LIMIT_MAX_KEYS (32)
+#define SHARED_LIMIT_MAX_KEY_LEN (128)
+
+// typedefs
+typedef struct ngx_shared_limit_s ngx_shared_limit_t;
+
+typedef struct {
+	ngx_atomic_t active;		// the number of slots that are held by all the worker processes
+	ngx_atomic_t queued;		// the number of requests that are currently waiting for a slot
+	ngx_atomic_t waited;		// the total number of requests that had to wait for a slot
+	ngx_atomic_t rejected;		// the total number of requests that were rejected since the queue was full
+	size_t key_len;
+	u_char key[SHARED_LIMIT_MAX_KEY_LEN];
+} ngx_shared_limit_counter_t;
+
+// functions
+// creates a shared memory zone that holds a semaphore per key (e.g. an upstream location),
+//	up to SHARED_LIMIT_MAX_KEYS keys are supported
+ngx_shared_limit_t* ngx_shared_limit_create(ngx_conf_t *cf, ngx_str_t *name, void *tag);
+
+// returns the counter of the key, the counter is added if it does not exist.
+//	returns NULL if the zone is full, keys longer than SHARED_LIMIT_MAX_KEY_LEN are truncated
+ngx_shared_limit_counter_t* ngx_shared_limit_get_counter(ngx_shared_limit_t* limit, ngx_str_t* key);
+
+// takes a slot of the counter, if less than max slots are taken
+ngx_flag_t ngx_shared_limit_try_acquire(ngx_shared_limit_counter_t* counter, ngx_uint_t max);
+
+void ngx_shared_limit_acquire(ngx_shared_limit_counter_t* counter);
+
+void ngx_shared_limit_release(ngx_shared_limit_counter_t* counter);
+
+// returns the counters that are in use, the returned array points to the shared memory
+ngx_uint_t ngx_shared_limit_get_counters(ngx_shared_limit_t* limit, ngx_shared_limit_counter_t** counters);
+
+#endif // _NGX_SHARED_LIMIT_H_INCLUDED_
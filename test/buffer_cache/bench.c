@@ -0,0 +1,706 @@
+// include
+#include "ngx_cycle.h"
+#include "ngx_buffer_cache_internal.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <sched.h>
+
+// forks several processes against a single shared buffer cache zone and measures the fetch / store
+// throughput, the fetch latency and the time the shard locks are held / waited for.
+// each process runs a read-through loop - fetch a key, on miss store it.
+
+// constants
+#define HIST_SUB_BITS (2)				// 4 buckets per power of 2
+#define HIST_BUCKET_COUNT (64 << HIST_SUB_BITS)
+#define TIME_UPDATE_INTERVAL (1024)		// ops between updates of the cached time
+#define LOCK_SPIN_COUNT (2048)
+
+// enums
+enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+};
+
+enum {
+	HIST_FETCH_HIT,
+	HIST_FETCH_MISS,
+	HIST_STORE,
+	HIST_LOCK_HOLD,
+	HIST_LOCK_WAIT,
+
+	HIST_COUNT
+};
+
+// typedefs
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKET_COUNT];
+} histogram_t;
+
+typedef struct {
+	uint64_t fetch;
+	uint64_t fetch_hit;
+	uint64_t store;
+	uint64_t store_ok;
+	uint64_t elapsed;
+	histogram_t hist[HIST_COUNT];
+} process_results_t;
+
+typedef struct {
+	ngx_uint_t processes;
+	size_t cache_size;
+	ngx_uint_t shard_count;
+	ngx_uint_t policy;
+	ngx_uint_t key_count;
+	ngx_uint_t distribution;
+	double zipf_exponent;
+	size_t min_entry_size;
+	size_t max_entry_size;
+	uint64_t ops;
+	unsigned int seed;
+} bench_params_t;
+
+// globals
+ngx_time_t ngx_time;
+ngx_shm_zone_t shm_zone;
+ngx_cycle_t cycle;
+volatile ngx_cycle_t  *ngx_cycle = &cycle;
+volatile ngx_time_t	 *ngx_cached_time = &ngx_time;
+
+static const char* hist_names[HIST_COUNT] = {
+	"fetch hit",
+	"fetch miss",
+	"store",
+	"lock hold",
+	"lock wait",
+};
+
+static process_results_t* cur_results;		// the results slot of the current process
+static uint64_t lock_start;
+
+// time
+static uint64_t
+get_time_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// histogram
+static ngx_uint_t
+hist_get_bucket(uint64_t value)
+{
+	ngx_uint_t msb;
+
+	if (value < (1 << HIST_SUB_BITS))
+	{
+		return value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// returns the exclusive upper bound of the values of a bucket
+static uint64_t
+hist_get_bucket_bound(ngx_uint_t index)
+{
+	ngx_uint_t shift;
+
+	if (index < (1 << HIST_SUB_BITS))
+	{
+		return index + 1;
+	}
+
+	shift = (index >> HIST_SUB_BITS) - 1;
+	return (uint64_t)((index & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS) + 1) << shift;
+}
+
+static void
+hist_add(histogram_t* hist, uint64_t value)
+{
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max)
+	{
+		hist->max = value;
+	}
+	hist->buckets[hist_get_bucket(value)]++;
+}
+
+static void
+hist_merge(histogram_t* dest, histogram_t* src)
+{
+	ngx_uint_t i;
+
+	dest->count += src->count;
+	dest->sum += src->sum;
+	if (src->max > dest->max)
+	{
+		dest->max = src->max;
+	}
+
+	for (i = 0; i < HIST_BUCKET_COUNT; i++)
+	{
+		dest->buckets[i] += src->buckets[i];
+	}
+}
+
+static uint64_t
+hist_get_percentile(histogram_t* hist, double percentile)
+{
+	uint64_t target;
+	uint64_t sum = 0;
+	ngx_uint_t i;
+
+	target = (uint64_t)ceil(hist->count * percentile / 100);
+	for (i = 0; i < HIST_BUCKET_COUNT; i++)
+	{
+		sum += hist->buckets[i];
+		if (sum >= target)
+		{
+			return ngx_min(hist_get_bucket_bound(i), hist->max);
+		}
+	}
+
+	return hist->max;
+}
+
+// nginx function stubs
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, va_list args)
+
+#endif
+{
+}
+
+void ngx_cdecl
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+	const char *fmt, ...)
+{
+}
+
+// Note: unlike the nginx mutex, the waiters only spin and yield, they never sleep on a semaphore
+ngx_int_t
+ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
+{
+	mtx->lock = &addr->lock;
+	mtx->spin = LOCK_SPIN_COUNT;
+	return NGX_OK;
+}
+
+void
+ngx_shmtx_lock(ngx_shmtx_t *mtx)
+{
+	ngx_atomic_int_t pid = getpid();
+	uint64_t start;
+	ngx_uint_t i;
+
+	start = get_time_ns();
+
+	for ( ;; )
+	{
+		if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, pid))
+		{
+			break;
+		}
+
+		for (i = 0; i < mtx->spin; i++)
+		{
+			ngx_cpu_pause();
+
+			if (*mtx->lock == 0)
+			{
+				break;
+			}
+		}
+
+		if (*mtx->lock != 0)
+		{
+			sched_yield();
+		}
+	}
+
+	// Note: a process holds at most one shard lock at a time
+	lock_start = get_time_ns();
+
+	if (cur_results != NULL)
+	{
+		hist_add(&cur_results->hist[HIST_LOCK_WAIT], lock_start - start);
+	}
+}
+
+void
+ngx_shmtx_unlock(ngx_shmtx_t *mtx)
+{
+	if (cur_results != NULL)
+	{
+		hist_add(&cur_results->hist[HIST_LOCK_HOLD], get_time_ns() - lock_start);
+	}
+
+	ngx_memory_barrier();
+	*mtx->lock = 0;
+}
+
+ngx_shm_zone_t *
+ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+	return &shm_zone;
+}
+
+// key distribution
+static uint32_t
+random_next(uint64_t* state)
+{
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (uint32_t)((*state * 2685821657736338717ULL) >> 32);
+}
+
+static double
+random_double(uint64_t* state)
+{
+	return (double)random_next(state) / 4294967296.0;
+}
+
+// returns the cumulative distribution of the zipf distribution over the keys,
+// the keys are ranked by their index
+static double*
+zipf_create_cdf(ngx_uint_t key_count, double exponent)
+{
+	double* cdf;
+	double sum = 0;
+	ngx_uint_t i;
+
+	cdf = malloc(sizeof(cdf[0]) * key_count);
+	if (cdf == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < key_count; i++)
+	{
+		sum += 1 / pow(i + 1, exponent);
+		cdf[i] = sum;
+	}
+
+	for (i = 0; i < key_count; i++)
+	{
+		cdf[i] /= sum;
+	}
+
+	return cdf;
+}
+
+static ngx_uint_t
+zipf_sample(double* cdf, ngx_uint_t key_count, uint64_t* state)
+{
+	ngx_uint_t left = 0;
+	ngx_uint_t right = key_count - 1;
+	ngx_uint_t mid;
+	double value;
+
+	value = random_double(state);
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (cdf[mid] < value)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+// the size and content of an entry are derived from the key, so that they are identical in all the processes
+static size_t
+get_entry_size(bench_params_t* params, uint32_t key_index)
+{
+	uint64_t state = (uint64_t)key_index * 0x9E3779B97F4A7C15ULL + 1;
+
+	if (params->max_entry_size <= params->min_entry_size)
+	{
+		return params->min_entry_size;
+	}
+
+	return params->min_entry_size + random_next(&state) % (params->max_entry_size - params->min_entry_size + 1);
+}
+
+// buffer cache initialization
+static ngx_flag_t
+init_buffer_cache(bench_params_t* params)
+{
+	ngx_conf_t cf;
+	static ngx_log_t log;
+
+	ngx_time.sec = time(NULL);
+	ngx_memzero(&shm_zone, sizeof(shm_zone));
+	shm_zone.shm.size = params->cache_size;
+	shm_zone.shm.addr = mmap(NULL, shm_zone.shm.size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (shm_zone.shm.addr == MAP_FAILED)
+	{
+		shm_zone.shm.addr = NULL;
+		return 0;
+	}
+
+	ngx_memzero(&cf, sizeof(cf));
+	cf.log = &log;
+	cf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+	if (cf.pool == NULL)
+	{
+		return 0;
+	}
+
+	if (ngx_buffer_cache_create(&cf, NULL, 0, 0, 0, params->shard_count, params->policy, NULL) == NULL)
+	{
+		return 0;
+	}
+
+	return shm_zone.init(&shm_zone, NULL) == NGX_OK;
+}
+
+static void
+free_buffer_cache(bench_params_t* params)
+{
+	munmap(shm_zone.shm.addr, shm_zone.shm.size);
+	shm_zone.shm.addr = NULL;
+}
+
+// benchmark
+static void
+run_process(bench_params_t* params, ngx_uint_t index, double* cdf, u_char* store_buffer, process_results_t* results)
+{
+	ngx_buffer_cache_t *cache = shm_zone.data;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t fetch_buffer;
+	uint64_t state;
+	uint64_t start;
+	uint64_t end;
+	uint64_t i;
+	uint32_t key_index;
+	uint32_t token;
+	size_t size;
+
+	cur_results = results;
+	state = ((uint64_t)params->seed << 32) + index + 1;
+
+	ngx_memzero(key, sizeof(key));
+
+	start = get_time_ns();
+
+	for (i = 0; i < params->ops; i++)
+	{
+		if ((i & (TIME_UPDATE_INTERVAL - 1)) == 0)
+		{
+			ngx_time.sec = time(NULL);
+		}
+
+		if (params->distribution == DIST_ZIPF)
+		{
+			key_index = zipf_sample(cdf, params->key_count, &state);
+		}
+		else
+		{
+			key_index = random_next(&state) % params->key_count;
+		}
+
+		((uint32_t*)key)[0] = key_index;
+
+		results->fetch++;
+		end = get_time_ns();
+		if (ngx_buffer_cache_fetch(cache, key, &fetch_buffer, &token))
+		{
+			hist_add(&results->hist[HIST_FETCH_HIT], get_time_ns() - end);
+			results->fetch_hit++;
+
+			ngx_buffer_cache_release(cache, key, token);
+			continue;
+		}
+		hist_add(&results->hist[HIST_FETCH_MISS], get_time_ns() - end);
+
+		size = get_entry_size(params, key_index);
+
+		results->store++;
+		end = get_time_ns();
+		if (ngx_buffer_cache_store(cache, key, store_buffer, size))
+		{
+			results->store_ok++;
+		}
+		hist_add(&results->hist[HIST_STORE], get_time_ns() - end);
+	}
+
+	results->elapsed = get_time_ns() - start;
+}
+
+static void
+print_histogram(const char* name, histogram_t* hist)
+{
+	printf("%-12s %12llu %10.0f %10llu %10llu %10llu %12llu\n",
+		name,
+		(unsigned long long)hist->count,
+		hist->count > 0 ? (double)hist->sum / hist->count : 0.0,
+		(unsigned long long)hist_get_percentile(hist, 50),
+		(unsigned long long)hist_get_percentile(hist, 99),
+		(unsigned long long)hist_get_percentile(hist, 99.9),
+		(unsigned long long)hist->max);
+}
+
+static void
+print_results(bench_params_t* params, process_results_t* results)
+{
+	ngx_buffer_cache_stats_t stats;
+	process_results_t total;
+	uint64_t elapsed = 0;
+	double seconds;
+	ngx_uint_t i;
+	ngx_uint_t j;
+
+	ngx_memzero(&total, sizeof(total));
+
+	for (i = 0; i < params->processes; i++)
+	{
+		total.fetch += results[i].fetch;
+		total.fetch_hit += results[i].fetch_hit;
+		total.store += results[i].store;
+		total.store_ok += results[i].store_ok;
+		if (results[i].elapsed > elapsed)
+		{
+			elapsed = results[i].elapsed;
+		}
+
+		for (j = 0; j < HIST_COUNT; j++)
+		{
+			hist_merge(&total.hist[j], &results[i].hist[j]);
+		}
+	}
+
+	ngx_buffer_cache_get_stats(shm_zone.data, &stats);
+
+	seconds = elapsed > 0 ? (double)elapsed / 1000000000 : 1;
+
+	printf("processes %lu, cache size %zu, shards %lu, policy %s, keys %lu, distribution %s",
+		(unsigned long)params->processes, params->cache_size, (unsigned long)params->shard_count,
+		params->policy == BUFFER_CACHE_POLICY_TINYLFU ? "tinylfu" : "fifo",
+		(unsigned long)params->key_count,
+		params->distribution == DIST_ZIPF ? "zipf" : "uniform");
+	if (params->distribution == DIST_ZIPF)
+	{
+		printf(" (s=%.2f)", params->zipf_exponent);
+	}
+	printf(", entry size %zu-%zu\n\n", params->min_entry_size, params->max_entry_size);
+
+	printf("elapsed %.3f sec\n", seconds);
+	printf("fetch %llu (%.0f/sec), hit ratio %.2f%%\n",
+		(unsigned long long)total.fetch, total.fetch / seconds,
+		total.fetch > 0 ? 100.0 * total.fetch_hit / total.fetch : 0.0);
+	printf("store %llu (%.0f/sec), ok %llu, exists %lu, rejected %lu, evicted %lu\n\n",
+		(unsigned long long)total.store, total.store / seconds,
+		(unsigned long long)total.store_ok,
+		(unsigned long)stats.store_exists, (unsigned long)stats.store_rejected, (unsigned long)stats.evicted);
+
+	printf("%-12s %12s %10s %10s %10s %10s %12s\n", "nsec", "count", "avg", "p50", "p99", "p99.9", "max");
+	for (j = 0; j < HIST_COUNT; j++)
+	{
+		print_histogram(hist_names[j], &total.hist[j]);
+	}
+}
+
+static int
+run_benchmark(bench_params_t* params)
+{
+	process_results_t* results;
+	u_char* store_buffer;
+	size_t results_size;
+	double* cdf = NULL;
+	ngx_uint_t i;
+	ngx_uint_t started;
+	int status;
+	int rc = 0;
+	pid_t pid;
+
+	if (params->distribution == DIST_ZIPF)
+	{
+		cdf = zipf_create_cdf(params->key_count, params->zipf_exponent);
+		if (cdf == NULL)
+		{
+			printf("Error: failed to allocate the zipf distribution\n");
+			return 0;
+		}
+	}
+
+	store_buffer = malloc(params->max_entry_size + 1);
+	if (store_buffer == NULL)
+	{
+		printf("Error: failed to allocate store buffer\n");
+		return 0;
+	}
+	memset(store_buffer, 0xAB, params->max_entry_size + 1);
+
+	results_size = sizeof(results[0]) * params->processes;
+	results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (results == MAP_FAILED)
+	{
+		printf("Error: failed to allocate the results buffer\n");
+		return 0;
+	}
+	ngx_memzero(results, results_size);
+
+	if (!init_buffer_cache(params))
+	{
+		printf("Error: failed to initialize the buffer cache\n");
+		return 0;
+	}
+
+	for (started = 0; started < params->processes; started++)
+	{
+		pid = fork();
+		if (pid < 0)
+		{
+			printf("Error: fork failed %d\n", errno);
+			break;
+		}
+
+		if (pid == 0)
+		{
+			run_process(params, started, cdf, store_buffer, &results[started]);
+			_exit(0);
+		}
+	}
+
+	for (i = 0; i < started; i++)
+	{
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			printf("Error: a benchmark process failed\n");
+			started = 0;
+		}
+	}
+
+	if (started == params->processes)
+	{
+		print_results(params, results);
+		rc = 1;
+	}
+
+	free_buffer_cache(params);
+	munmap(results, results_size);
+	free(store_buffer);
+	free(cdf);
+
+	return rc;
+}
+
+static void
+usage(const char* name)
+{
+	printf("Usage: %s [options]\n"
+		"  -p <count>      number of processes (default 4)\n"
+		"  -c <size>       cache size in MB (default 64)\n"
+		"  -s <count>      number of shards (default 1)\n"
+		"  -l              use the tinylfu policy (default fifo)\n"
+		"  -k <count>      number of keys (default 100000)\n"
+		"  -z <exponent>   zipf key distribution (default uniform)\n"
+		"  -e <min>[-<max>] entry size in bytes (default 1024-65536)\n"
+		"  -n <count>      operations per process (default 1000000)\n"
+		"  -r <seed>       random seed\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	bench_params_t params;
+	char* end;
+	int opt;
+
+	params.processes = 4;
+	params.cache_size = 64 * 1024 * 1024;
+	params.shard_count = 1;
+	params.policy = BUFFER_CACHE_POLICY_FIFO;
+	params.key_count = 100000;
+	params.distribution = DIST_UNIFORM;
+	params.zipf_exponent = 0;
+	params.min_entry_size = 1024;
+	params.max_entry_size = 65536;
+	params.ops = 1000000;
+	params.seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "p:c:s:lk:z:e:n:r:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			params.processes = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			params.cache_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+
+		case 's':
+			params.shard_count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			params.policy = BUFFER_CACHE_POLICY_TINYLFU;
+			break;
+
+		case 'k':
+			params.key_count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'z':
+			params.distribution = DIST_ZIPF;
+			params.zipf_exponent = strtod(optarg, NULL);
+			break;
+
+		case 'e':
+			params.min_entry_size = strtoul(optarg, &end, 10);
+			params.max_entry_size = *end == '-' ? strtoul(end + 1, NULL, 10) : params.min_entry_size;
+			break;
+
+		case 'n':
+			params.ops = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			params.seed = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (params.processes < 1 || params.key_count < 1 || params.shard_count < 1 ||
+		params.shard_count > BUFFER_CACHE_MAX_SHARDS || params.max_entry_size < params.min_entry_size)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("seed %u\n", params.seed);
+
+	return run_benchmark(&params) ? 0 : 1;
+}
@@ -9,7 +9,8 @@
 // globals
 ngx_time_t ngx_time;
 ngx_shm_zone_t shm_zone;
-volatile ngx_cycle_t  *ngx_cycle;
+ngx_cycle_t cycle;
+volatile ngx_cycle_t  *ngx_cycle = &cycle;
 volatile ngx_time_t	 *ngx_cached_time = &ngx_time;
 
 // nginx function stubs
@@ -35,6 +36,12 @@ ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
 {
 }
 
+ngx_int_t
+ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
+{
+	return NGX_OK;
+}
+
 void
 ngx_shmtx_lock(ngx_shmtx_t *mtx)
 {
@@ -71,7 +78,7 @@ init_buffer_cache(size_t size)
 	ngx_memzero(&log, sizeof(log));
 	cf.log = &log;
 	cf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
-	ngx_buffer_cache_create(&cf, NULL, 0, 0, NULL);
+	ngx_buffer_cache_create(&cf, NULL, 0, 0, 0, 1, BUFFER_CACHE_POLICY_FIFO, NULL);
 
 	shm_zone.init(&shm_zone, NULL);
 	return 1;
@@ -158,6 +165,7 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 	u_char key[BUFFER_CACHE_KEY_SIZE];
 	ngx_str_t fetch_buffer;
 	u_char* store_buffer;
+	uint32_t token;
 	size_t* sizes_buffer;
 	size_t size;
 	size_t max_size;
@@ -230,7 +238,7 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 		for (j = min_existing_index; j <= i; j++)
 		{
 			((uint32_t*)&key)[0] = j;
-			if (ngx_buffer_cache_fetch(cache, key, &fetch_buffer))
+			if (ngx_buffer_cache_fetch(cache, key, &fetch_buffer, &token))
 			{
 				if (sizes_buffer[j] != fetch_buffer.len)
 				{
@@ -243,6 +251,8 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 					printf("Error: invalid buffer content\n");
 					return 0;
 				}
+
+				ngx_buffer_cache_release(cache, key, token);
 			}
 			else
 			{
@@ -1,5 +1,6 @@
 #include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
 #include <ngx_core.h>
 #include <vod/json_parser.h>
 #include <vod/parse_utils.h>
@@ -286,9 +287,80 @@ void get_binary_string_tests()
 	}
 }
 
-int main()
+#define BENCHMARK_ITERATIONS (100)
+
+void benchmark(const char* file_name)
+{
+	struct timespec start, end;
+	vod_json_value_t result;
+	ngx_int_t rc;
+	u_char error[128];
+	u_char* buffer;
+	FILE* fp;
+	double elapsed;
+	long size;
+	int i;
+
+	fp = fopen(file_name, "rb");
+	if (fp == NULL)
+	{
+		printf("Error: failed to open %s\n", file_name);
+		return;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buffer = malloc(size + 1);
+	if (buffer == NULL || fread(buffer, 1, size, fp) != (size_t)size)
+	{
+		printf("Error: failed to read %s\n", file_name);
+		free(buffer);
+		fclose(fp);
+		return;
+	}
+	buffer[size] = '\0';
+	fclose(fp);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < BENCHMARK_ITERATIONS; i++)
+	{
+		rc = vod_json_parse(pool, buffer, &result, error, sizeof(error));
+		if (rc != VOD_JSON_OK)
+		{
+			printf("Error: failed to parse %s - %s\n", file_name, error);
+			break;
+		}
+
+		ngx_reset_pool(pool);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s: %ld bytes, %d iterations, %.3f sec, %.1f MB/sec\n", 
+		file_name, size, i, elapsed, elapsed > 0 ? (double)size * i / elapsed / (1024 * 1024) : 0);
+
+	free(buffer);
+}
+
+int main(int argc, char** argv)
 {
+	int i;
+
 	pool = ngx_create_pool(1024 * 1024, &ngx_log);
+
+	// benchmark mode - jsontest <mapping json file>...
+	if (argc > 1)
+	{
+		for (i = 1; i < argc; i++)
+		{
+			benchmark(argv[i]);
+		}
+		return 0;
+	}
 	
 	sanity_tests();
 	bad_jsons_test();
@@ -0,0 +1,349 @@
+from xml.dom.minidom import parseString
+from threading import Thread
+from threading import Lock
+import manifest_utils
+import urllib2
+import bisect
+import random
+import time
+import sys
+import os
+
+from load_test_params import *
+
+# simulates hls players - each player picks an entry from the catalog by popularity, fetches the master
+# playlist, picks a variant by its estimated bandwidth, fetches the index, the init segment and the media
+# segments in sequence, switching variants as the simulated bandwidth changes. live playlists (without
+# EXT-X-ENDLIST) are polled every target duration.
+# prints latency percentiles per request type and the diff of the server perf counters.
+
+REQUEST_TYPES = ['master', 'index', 'init', 'segment', 'key']
+
+outputLock = Lock()
+
+def writeOutput(msg):
+	outputLock.acquire()
+	sys.stdout.write('%s %s\n' % (time.strftime('%Y-%m-%d %H:%M:%S'), msg))
+	sys.stdout.flush()
+	outputLock.release()
+
+class RequestStats:
+	def __init__(self):
+		self.lock = Lock()
+		self.latencies = dict((x, []) for x in REQUEST_TYPES)
+		self.bytes = dict((x, 0) for x in REQUEST_TYPES)
+		self.statuses = dict((x, {}) for x in REQUEST_TYPES)
+		self.switches = 0
+
+	def add(self, requestType, status, latency, size):
+		self.lock.acquire()
+		self.latencies[requestType].append(latency)
+		self.bytes[requestType] += size
+		self.statuses[requestType].setdefault(status, 0)
+		self.statuses[requestType][status] += 1
+		self.lock.release()
+
+	def addSwitch(self):
+		self.lock.acquire()
+		self.switches += 1
+		self.lock.release()
+
+stats = RequestStats()
+
+def getUrl(requestType, url):
+	request = urllib2.Request(url, headers=EXTRA_HEADERS)
+	startTime = time.time()
+	try:
+		f = urllib2.urlopen(request)
+		body = f.read()
+		status = f.getcode()
+	except urllib2.HTTPError, e:
+		body = ''
+		status = e.getcode()
+	except Exception, e:
+		body = ''
+		status = 0
+	latency = time.time() - startTime
+	stats.add(requestType, status, latency, len(body))
+	return status, body, latency
+
+# catalog popularity
+class Catalog:
+	def __init__(self, fileName, exponent):
+		self.urls = filter(lambda x: len(x) > 0, map(lambda x: x.strip(), file(fileName).readlines()))
+		if len(self.urls) == 0:
+			raise Exception('catalog %s is empty' % fileName)
+		self.cdf = []
+		total = 0.0
+		for index in xrange(len(self.urls)):
+			total += 1.0 / pow(index + 1, exponent)
+			self.cdf.append(total)
+		self.cdf = map(lambda x: x / total, self.cdf)
+
+	def pick(self):
+		index = bisect.bisect_left(self.cdf, random.random())
+		return self.urls[min(index, len(self.urls) - 1)]
+
+# playlist parsing
+def parseAttributes(line):
+	result = {}
+	line = line.split(':', 1)[1] if ':' in line else ''
+	while len(line) > 0:
+		name, line = line.split('=', 1) if '=' in line else (line, '')
+		if line.startswith('"'):
+			value, line = line[1:].split('"', 1)
+			line = line[1:] if line.startswith(',') else line
+		else:
+			value, line = line.split(',', 1) if ',' in line else (line, '')
+		result[name.strip()] = value
+	return result
+
+def parseMasterPlaylist(baseUrl, body):
+	result = []
+	bandwidth = None
+	for curLine in body.split('\n'):
+		curLine = curLine.strip()
+		if curLine.startswith('#EXT-X-STREAM-INF:'):
+			bandwidth = int(parseAttributes(curLine).get('BANDWIDTH', '0'))
+		elif len(curLine) > 0 and not curLine.startswith('#') and bandwidth != None:
+			result.append((bandwidth, manifest_utils.getAbsoluteUrl(curLine, baseUrl)))
+			bandwidth = None
+	result.sort()
+	return result
+
+class MediaPlaylist:
+	def __init__(self, baseUrl, body):
+		self.targetDuration = 10
+		self.mediaSequence = 0
+		self.endList = False
+		self.initUrl = None
+		self.keyUrl = None
+		self.segments = []		# (sequence, duration, url)
+		duration = 0
+		for curLine in body.split('\n'):
+			curLine = curLine.strip()
+			if curLine.startswith('#EXT-X-TARGETDURATION:'):
+				self.targetDuration = int(curLine.split(':', 1)[1])
+			elif curLine.startswith('#EXT-X-MEDIA-SEQUENCE:'):
+				self.mediaSequence = int(curLine.split(':', 1)[1])
+			elif curLine.startswith('#EXT-X-ENDLIST'):
+				self.endList = True
+			elif curLine.startswith('#EXT-X-MAP:'):
+				self.initUrl = manifest_utils.getAbsoluteUrl(parseAttributes(curLine)['URI'], baseUrl)
+			elif curLine.startswith('#EXT-X-KEY:'):
+				uri = parseAttributes(curLine).get('URI')
+				self.keyUrl = manifest_utils.getAbsoluteUrl(uri, baseUrl) if uri != None else None
+			elif curLine.startswith('#EXTINF:'):
+				duration = float(curLine.split(':', 1)[1].split(',')[0])
+			elif len(curLine) > 0 and not curLine.startswith('#'):
+				sequence = self.mediaSequence + len(self.segments)
+				self.segments.append((sequence, duration, manifest_utils.getAbsoluteUrl(curLine, baseUrl)))
+
+# player
+class PlayerThread(Thread):
+	def __init__(self, index, catalog, endTime):
+		Thread.__init__(self)
+		self.index = index
+		self.catalog = catalog
+		self.endTime = endTime
+		self.bandwidth = random.uniform(MIN_BANDWIDTH, MAX_BANDWIDTH)
+
+	def shouldStop(self):
+		return time.time() >= self.endTime or os.path.exists(STOP_FILE)
+
+	def run(self):
+		while not self.shouldStop():
+			self.playSession(BASE_URL + self.catalog.pick())
+
+	def driftBandwidth(self):
+		self.bandwidth *= 1 + random.uniform(-BANDWIDTH_DRIFT, BANDWIDTH_DRIFT)
+		self.bandwidth = min(max(self.bandwidth, MIN_BANDWIDTH), MAX_BANDWIDTH)
+
+	def pickVariant(self, variants, estimate):
+		result = variants[0]
+		for variant in variants:
+			if variant[0] <= estimate * ABR_SAFETY_FACTOR:
+				result = variant
+		return result
+
+	def loadPlaylist(self, url):
+		status, body, _ = getUrl('index', url)
+		if status != 200:
+			return None
+		return MediaPlaylist(url.rsplit('/', 1)[0], body)
+
+	def playSession(self, masterUrl):
+		status, body, _ = getUrl('master', masterUrl)
+		if status != 200:
+			time.sleep(1)
+			return
+		variants = parseMasterPlaylist(masterUrl.rsplit('/', 1)[0], body)
+		if len(variants) == 0:
+			time.sleep(1)
+			return
+
+		sessionDuration = random.uniform(MIN_SESSION_DURATION, MAX_SESSION_DURATION)
+		estimate = self.bandwidth
+		variant = self.pickVariant(variants, estimate)
+		playlist = self.loadPlaylist(variant[1])
+		if playlist == None:
+			time.sleep(1)
+			return
+
+		loadedInit = None
+		loadedKey = None
+		nextSequence = None
+		played = 0.0
+		buffered = 0.0				# seconds of content downloaded and not played yet
+		lastTime = time.time()
+		lastPoll = lastTime
+
+		while played + buffered < sessionDuration and not self.shouldStop():
+			# live - start 3 segments from the end
+			if nextSequence == None:
+				nextSequence = playlist.mediaSequence
+				if not playlist.endList:
+					nextSequence += max(len(playlist.segments) - 3, 0)
+
+			segments = filter(lambda x: x[0] == nextSequence, playlist.segments)
+			if len(segments) == 0:
+				if playlist.endList:
+					break
+
+				# live - wait for the playlist to advance, the player polls every target duration
+				time.sleep(max(lastPoll + playlist.targetDuration - time.time(), 0))
+				lastPoll = time.time()
+				playlist = self.loadPlaylist(variant[1]) or playlist
+				if nextSequence < playlist.mediaSequence:
+					nextSequence = playlist.mediaSequence		# fell behind the live window
+				continue
+
+			sequence, duration, segmentUrl = segments[0]
+
+			if playlist.initUrl != None and playlist.initUrl != loadedInit:
+				getUrl('init', playlist.initUrl)
+				loadedInit = playlist.initUrl
+			if playlist.keyUrl != None and playlist.keyUrl != loadedKey:
+				getUrl('key', playlist.keyUrl)
+				loadedKey = playlist.keyUrl
+
+			status, body, latency = getUrl('segment', segmentUrl)
+			nextSequence += 1
+			if status == 200:
+				buffered += duration
+
+			# the measured throughput is capped by the simulated bandwidth of the player
+			self.driftBandwidth()
+			throughput = len(body) * 8 / max(latency, 0.001)
+			throughput = min(throughput, self.bandwidth)
+			estimate = ABR_EWMA_WEIGHT * throughput + (1 - ABR_EWMA_WEIGHT) * estimate
+
+			# play in real time, wait while the buffer is full
+			now = time.time()
+			playedNow = min(now - lastTime, buffered)
+			played += playedNow
+			buffered -= playedNow
+			lastTime = now
+			if buffered > MAX_BUFFER:
+				time.sleep(buffered - MAX_BUFFER)
+
+			# switch variants
+			newVariant = self.pickVariant(variants, estimate)
+			if newVariant != variant:
+				newPlaylist = self.loadPlaylist(newVariant[1])
+				if newPlaylist != None:
+					stats.addSwitch()
+					variant = newVariant
+					playlist = newPlaylist
+			elif not playlist.endList and time.time() >= lastPoll + playlist.targetDuration:
+				lastPoll = time.time()
+				playlist = self.loadPlaylist(variant[1]) or playlist
+
+# server perf counters
+def getPerfCounters():
+	if len(STATUS_URL) == 0:
+		return None
+	try:
+		dom = parseString(urllib2.urlopen(STATUS_URL).read())
+	except Exception, e:
+		writeOutput('Error: failed to get %s %s' % (STATUS_URL, e))
+		return None
+	result = {}
+	for perfCounters in dom.getElementsByTagName('performance_counters'):
+		for counter in perfCounters.childNodes:
+			if counter.nodeType != counter.ELEMENT_NODE or counter.tagName == 'bytes_read':
+				continue
+			values = {}
+			for field in ['sum', 'count', 'max']:
+				nodes = counter.getElementsByTagName(field)
+				values[field] = int(nodes[0].firstChild.data) if len(nodes) > 0 and nodes[0].firstChild != None else 0
+			result[counter.tagName] = values
+	return result
+
+def percentile(values, p):
+	if len(values) == 0:
+		return 0
+	return values[min(int(len(values) * p / 100), len(values) - 1)]
+
+def printResults(duration, startCounters, endCounters):
+	print '\nduration %.1f sec, players %s, variant switches %s\n' % (duration, PLAYER_COUNT, stats.switches)
+	print '%-10s %8s %8s %10s %8s %8s %8s %8s %8s  %s' % ('ms', 'count', 'req/sec', 'MB', 'avg', 'p50', 'p90', 'p99', 'max', 'statuses')
+	for requestType in REQUEST_TYPES:
+		latencies = sorted(stats.latencies[requestType])
+		if len(latencies) == 0:
+			continue
+		print '%-10s %8d %8.1f %10.1f %8.1f %8.1f %8.1f %8.1f %8.1f  %s' % (
+			requestType,
+			len(latencies),
+			len(latencies) / duration,
+			stats.bytes[requestType] / 1048576.0,
+			sum(latencies) * 1000 / len(latencies),
+			percentile(latencies, 50) * 1000,
+			percentile(latencies, 90) * 1000,
+			percentile(latencies, 99) * 1000,
+			latencies[-1] * 1000,
+			stats.statuses[requestType])
+
+	if startCounters == None or endCounters == None:
+		return
+
+	# Note: the max values cannot be diffed, they are printed only if they changed during the test
+	print '\n%-30s %10s %12s %12s' % ('server perf counters (usec)', 'count', 'avg', 'max')
+	for name in sorted(endCounters.keys()):
+		end = endCounters[name]
+		start = startCounters.get(name, {'sum': 0, 'count': 0, 'max': 0})
+		count = end['count'] - start['count']
+		if count <= 0:
+			continue
+		maxValue = '%12d' % end['max'] if end['max'] != start['max'] else '%12s' % '-'
+		print '%-30s %10d %12.1f %s' % (name, count, float(end['sum'] - start['sum']) / count, maxValue)
+
+def main():
+	catalog = Catalog(CATALOG_FILE, ZIPF_EXPONENT)
+	writeOutput('Info: loaded %s catalog entries' % len(catalog.urls))
+
+	startCounters = getPerfCounters()
+
+	startTime = time.time()
+	endTime = startTime + TEST_DURATION
+	threads = []
+	for index in xrange(PLAYER_COUNT):
+		curThread = PlayerThread(index, catalog, endTime)
+		curThread.daemon = True
+		curThread.start()
+		threads.append(curThread)
+		time.sleep(PLAYER_START_INTERVAL)
+
+	writeOutput('Info: started %s players' % len(threads))
+
+	for curThread in threads:
+		while curThread.isAlive():
+			curThread.join(1)
+
+	duration = time.time() - startTime
+	writeOutput('Info: done')
+
+	printResults(duration, startCounters, getPerfCounters())
+
+if __name__ == '__main__':
+	main()
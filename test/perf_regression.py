@@ -0,0 +1,187 @@
+from xml.dom.minidom import parseString
+import subprocess
+import urllib2
+import json
+import time
+import sys
+import os
+import re
+
+from perf_regression_params import *
+
+# runs a fixed corpus (see perf_regression_params.py.template) through the vod cli and through a local nginx,
+# and saves the per stage timings, the allocations and the memory usage of the build to a json report.
+# two reports (e.g. of the previous release and of the current build) can then be compared.
+#
+# usage:
+#	perf_regression.py run <build name> <report file>
+#	perf_regression.py compare <baseline report> <report>
+
+CLI_STAGE_LINE = re.compile(r'^  (\S+)\s+(\d+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)$')
+
+def writeOutput(msg):
+	sys.stdout.write('%s %s\n' % (time.strftime('%Y-%m-%d %H:%M:%S'), msg))
+	sys.stdout.flush()
+
+# vod cli
+def runCli(path):
+	cmdLine = [VOD_CLI, '-n', str(CLI_ITERATIONS), '-s', str(CLI_SEGMENT_DURATION), path]
+	p = subprocess.Popen(cmdLine, stdout=subprocess.PIPE)
+	output = p.stdout.read()
+	_, status, usage = os.wait4(p.pid, 0)
+	if status != 0:
+		writeOutput('Error: %s failed, status %s' % (' '.join(cmdLine), status))
+		return None
+
+	# the stats of the file are printed before the totals, they are identical for a single file
+	stages = {}
+	for curLine in output.split('\n'):
+		if curLine == 'total':
+			break
+		m = CLI_STAGE_LINE.match(curLine)
+		if m == None:
+			continue
+		stages[m.group(1)] = {
+			'avg_us': float(m.group(4)),
+			'allocs': float(m.group(6)),
+			'alloc_kb': float(m.group(7)),
+		}
+
+	return {'stages': stages, 'rss_kb': usage.ru_maxrss}
+
+# nginx
+def getUrl(url):
+	request = urllib2.Request(url, headers=EXTRA_HEADERS)
+	try:
+		f = urllib2.urlopen(request)
+		f.read()
+		return f.getcode()
+	except urllib2.HTTPError, e:
+		return e.getcode()
+	except urllib2.URLError, e:
+		return 0
+
+def getPerfCounters():
+	dom = parseString(urllib2.urlopen(STATUS_URL).read())
+	result = {}
+	for perfCounters in dom.getElementsByTagName('performance_counters'):
+		for counter in perfCounters.childNodes:
+			if counter.nodeType != counter.ELEMENT_NODE or counter.tagName in ['bytes_read', 'drm_segments']:
+				continue
+			values = {}
+			for field in ['sum', 'count']:
+				nodes = counter.getElementsByTagName(field)
+				values[field] = int(nodes[0].firstChild.data) if len(nodes) > 0 and nodes[0].firstChild != None else 0
+			if values['count'] > 0:
+				result[counter.tagName] = {'avg_us': float(values['sum']) / values['count'], 'count': values['count']}
+	return result
+
+def getWorkersRss():
+	masterPid = file(NGINX_PID_FILE).read().strip()
+	result = 0
+	for pid in os.listdir('/proc'):
+		if not pid.isdigit():
+			continue
+		try:
+			stat = file('/proc/%s/stat' % pid).read()
+			if stat[(stat.rfind(')') + 2):].split(' ')[1] != masterPid:
+				continue
+			for curLine in file('/proc/%s/status' % pid):
+				if curLine.startswith('VmRSS:'):
+					result += int(curLine.split()[1])
+		except IOError:
+			continue		# the process exited
+	return result
+
+def runNginx(urls):
+	statuses = {}
+	for _ in xrange(WARMUP_ROUNDS):
+		for url in urls:
+			getUrl(BASE_URL + url)
+
+	urllib2.urlopen(STATUS_URL + '?reset=1').read()
+
+	startTime = time.time()
+	for _ in xrange(MEASURED_ROUNDS):
+		for url in urls:
+			status = getUrl(BASE_URL + url)
+			statuses.setdefault(status, 0)
+			statuses[status] += 1
+	duration = time.time() - startTime
+
+	return {
+		'stages': getPerfCounters(),
+		'req_per_sec': len(urls) * MEASURED_ROUNDS / duration,
+		'statuses': statuses,
+	}
+
+def run(buildName, reportFile):
+	report = {'build': buildName, 'time': int(time.time()), 'cli': {}, 'nginx': {}}
+
+	for title in CORPUS:
+		if len(VOD_CLI) > 0 and title['file'] != None:
+			writeOutput('Info: running the cli on %s' % title['name'])
+			result = runCli(title['file'])
+			if result != None:
+				report['cli'][title['name']] = result
+
+		if len(BASE_URL) > 0:
+			writeOutput('Info: running nginx on %s' % title['name'])
+			report['nginx'][title['name']] = runNginx(title['urls'])
+
+	if len(BASE_URL) > 0:
+		report['nginx_rss_kb'] = getWorkersRss()
+
+	file(reportFile, 'wb').write(json.dumps(report, indent=1, sort_keys=True))
+	writeOutput('Info: saved %s' % reportFile)
+
+# compare
+def compareValue(label, base, cur, higherIsBetter = False):
+	if base == 0:
+		return False
+	change = float(cur - base) / base
+	regression = (-change if higherIsBetter else change) > REGRESSION_THRESHOLD
+	print '%-50s %12.1f %12.1f %+8.1f%%%s' % (label, base, cur, change * 100, '  REGRESSION' if regression else '')
+	return regression
+
+def compareStages(prefix, base, cur):
+	regressions = 0
+	for stage in sorted(set(base.keys()) & set(cur.keys())):
+		for field in ['avg_us', 'allocs', 'alloc_kb']:
+			if field in base[stage] and field in cur[stage]:
+				if compareValue('%s %s %s' % (prefix, stage, field), base[stage][field], cur[stage][field]):
+					regressions += 1
+	return regressions
+
+def compare(baseFile, curFile):
+	base = json.loads(file(baseFile).read())
+	cur = json.loads(file(curFile).read())
+	print '%-50s %12s %12s %9s' % ('metric', base['build'], cur['build'], 'change')
+
+	regressions = 0
+	for title in sorted(set(base['cli'].keys()) & set(cur['cli'].keys())):
+		regressions += compareStages('cli %s' % title, base['cli'][title]['stages'], cur['cli'][title]['stages'])
+		if compareValue('cli %s rss_kb' % title, base['cli'][title]['rss_kb'], cur['cli'][title]['rss_kb']):
+			regressions += 1
+
+	for title in sorted(set(base['nginx'].keys()) & set(cur['nginx'].keys())):
+		regressions += compareStages('nginx %s' % title, base['nginx'][title]['stages'], cur['nginx'][title]['stages'])
+		if compareValue('nginx %s req_per_sec' % title,
+			base['nginx'][title]['req_per_sec'], cur['nginx'][title]['req_per_sec'], True):
+			regressions += 1
+
+	if 'nginx_rss_kb' in base and 'nginx_rss_kb' in cur:
+		if compareValue('nginx rss_kb', base['nginx_rss_kb'], cur['nginx_rss_kb']):
+			regressions += 1
+
+	print '\n%s regressions above %d%%' % (regressions, REGRESSION_THRESHOLD * 100)
+	return regressions
+
+if __name__ == '__main__':
+	if len(sys.argv) == 4 and sys.argv[1] == 'run':
+		run(sys.argv[2], sys.argv[3])
+	elif len(sys.argv) == 4 and sys.argv[1] == 'compare':
+		sys.exit(1 if compare(sys.argv[2], sys.argv[3]) > 0 else 0)
+	else:
+		print 'Usage:\n\t%s run <build name> <report file>\n\t%s compare <baseline report> <report>' % (sys.argv[0], sys.argv[0])
+		sys.exit(1)
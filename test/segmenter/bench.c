@@ -0,0 +1,628 @@
+// includes
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vod/cli/vod_cli_shim.h>
+#include <vod/media_set.h>
+#include <vod/language_code.h>
+#include <vod/filters/filter.h>
+#include <vod/hls/m3u8_builder.h>
+#include <vod/dash/dash_packager.h>
+
+// runs the segmenter and the manifest builders over synthetic media sets, and reports the time per call and
+// per output segment, so that algorithmic changes to the segmenter can be measured without any media files.
+// the media sets are -
+//	title - a single long clip (default 24h) with a video track with irregular gops and an audio track,
+//		segmented with the accurate policy (aligned to key frames)
+//	playlist - a vod playlist of many clips of random durations, with discontinuity
+//	live - a live playlist of many clips, sliding a window over its end
+//
+// the library objects are linked with vod/cli/vod_cli_shim.c instead of the nginx pool / log / time objects,
+// see build.sh
+
+// constants
+#define BENCH_POOL_SIZE (16 * 1024)
+#define BENCH_VIDEO_TIMESCALE (90000)
+#define BENCH_VIDEO_FRAME_DURATION (3600)		// 25 fps
+#define BENCH_AUDIO_TIMESCALE (48000)
+#define BENCH_AUDIO_FRAME_DURATION (1024)
+#define BENCH_TRACK_COUNT (2)					// video + audio
+#define BENCH_MIN_CLIP_DURATION (5000)
+#define BENCH_MAX_CLIP_DURATION (120000)
+#define BENCH_LIVE_FIRST_TIME (1500000000000ULL)
+
+// macros
+#define RAND(min, max) (rand() % ((max) - (min) + 1) + (min))
+
+// enums
+enum {
+	BENCH_TITLE,
+	BENCH_PLAYLIST,
+	BENCH_LIVE,
+
+	BENCH_SET_COUNT
+};
+
+// typedefs
+typedef struct {
+	uint32_t iterations;
+	uint32_t title_hours;
+	uint32_t min_gop;			// millis
+	uint32_t max_gop;			// millis
+	uint32_t clip_count;
+	uintptr_t segment_duration;
+	uint32_t live_window;		// millis
+	unsigned int seed;
+} bench_params_t;
+
+typedef struct {
+	ngx_log_t log;
+	request_context_t request_context;
+	bench_params_t params;
+
+	// conf
+	segmenter_conf_t segmenter;
+	m3u8_config_t m3u8_config;
+	dash_manifest_config_t mpd_config;
+} bench_ctx_t;
+
+typedef struct {
+	const char* name;
+	media_set_t media_set;
+	media_sequence_t sequence;
+	media_clip_source_t source;
+	media_clip_t* clip;
+	media_track_t tracks[BENCH_TRACK_COUNT];
+	frame_duration_run_t audio_run;
+	uint32_t segment_count;
+
+	// the state that is modified by segmenter_get_live_window
+	media_set_t saved_media_set;
+	media_sequence_t saved_sequence;
+	uint32_t* saved_durations;
+	uint64_t* saved_times;
+} bench_media_set_t;
+
+typedef vod_status_t(*bench_run_t)(bench_ctx_t* ctx, bench_media_set_t* set);
+
+// time
+static uint64_t
+bench_get_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// media sets
+static void
+bench_init_tracks(bench_media_set_t* set, uint64_t duration_millis)
+{
+	media_track_t* video = &set->tracks[MEDIA_TYPE_VIDEO];
+	media_track_t* audio = &set->tracks[MEDIA_TYPE_AUDIO];
+
+	video->media_info.media_type = MEDIA_TYPE_VIDEO;
+	video->media_info.track_id = 1;
+	video->media_info.timescale = BENCH_VIDEO_TIMESCALE;
+	video->media_info.frames_timescale = BENCH_VIDEO_TIMESCALE;
+	video->media_info.duration = duration_millis * BENCH_VIDEO_TIMESCALE / 1000;
+	video->media_info.full_duration = video->media_info.duration;
+	video->media_info.duration_millis = duration_millis;
+	video->media_info.bitrate = 2000000;
+	video->media_info.avg_bitrate = 2000000;
+	video->media_info.min_frame_duration = BENCH_VIDEO_FRAME_DURATION;
+	video->media_info.codec_id = VOD_CODEC_ID_AVC;
+	ngx_str_set(&video->media_info.codec_name, "avc1.64001f");
+	video->media_info.u.video.width = 1280;
+	video->media_info.u.video.height = 720;
+
+	audio->media_info.media_type = MEDIA_TYPE_AUDIO;
+	audio->media_info.track_id = 2;
+	audio->media_info.timescale = BENCH_AUDIO_TIMESCALE;
+	audio->media_info.frames_timescale = BENCH_AUDIO_TIMESCALE;
+	audio->media_info.duration = duration_millis * BENCH_AUDIO_TIMESCALE / 1000;
+	audio->media_info.full_duration = audio->media_info.duration;
+	audio->media_info.duration_millis = duration_millis;
+	audio->media_info.bitrate = 128000;
+	audio->media_info.avg_bitrate = 128000;
+	audio->media_info.codec_id = VOD_CODEC_ID_AAC;
+	ngx_str_set(&audio->media_info.codec_name, "mp4a.40.2");
+	audio->media_info.u.audio.object_type_id = 0x40;
+	audio->media_info.u.audio.channels = 2;
+	audio->media_info.u.audio.bits_per_sample = 16;
+	audio->media_info.u.audio.sample_rate = BENCH_AUDIO_TIMESCALE;
+
+	video->file_info.source = &set->source;
+	audio->file_info.source = &set->source;
+
+	set->source.track_array.first_track = set->tracks;
+	set->source.track_array.last_track = set->tracks + BENCH_TRACK_COUNT;
+	set->source.track_array.total_track_count = BENCH_TRACK_COUNT;
+	set->source.track_array.track_count[MEDIA_TYPE_VIDEO] = 1;
+	set->source.track_array.track_count[MEDIA_TYPE_AUDIO] = 1;
+}
+
+// a single sequence with a single source clip, same as vod_cli_parse
+static void
+bench_init_media_set(bench_ctx_t* ctx, bench_media_set_t* set, const char* name, uint32_t type)
+{
+	media_clip_source_t* source = &set->source;
+	media_sequence_t* sequence = &set->sequence;
+	media_set_t* media_set = &set->media_set;
+
+	set->name = name;
+
+	source->base.type = MEDIA_CLIP_SOURCE;
+	source->clip_to = ULLONG_MAX;
+	vod_memset(source->tracks_mask, 0xff, sizeof(source->tracks_mask));
+	source->sequence = sequence;
+
+	set->clip = &source->base;
+
+	sequence->clips = &set->clip;
+
+	media_set->segmenter_conf = &ctx->segmenter;
+	media_set->type = type;
+	media_set->original_type = type;
+	media_set->sequences = sequence;
+	media_set->sequences_end = sequence + 1;
+	media_set->sequence_count = 1;
+	media_set->sources_head = source;
+	media_set->clip_count = 1;
+	media_set->presentation_end = type == MEDIA_SET_VOD;
+	media_set->timing.total_count = 1;
+}
+
+static vod_status_t
+bench_init_title(bench_ctx_t* ctx, bench_media_set_t* set)
+{
+	bench_params_t* params = &ctx->params;
+	request_context_t* request_context = &ctx->request_context;
+	media_track_t* video = &set->tracks[MEDIA_TYPE_VIDEO];
+	media_track_t* audio = &set->tracks[MEDIA_TYPE_AUDIO];
+	input_frame_t* cur_frame;
+	input_frame_t* frames;
+	uint64_t duration_millis = (uint64_t)params->title_hours * 3600 * 1000;
+	uint32_t frame_count;
+	uint32_t gop_left = 0;
+
+	bench_init_media_set(ctx, set, "title", MEDIA_SET_VOD);
+	bench_init_tracks(set, duration_millis);
+
+	// the video frames
+	frame_count = duration_millis * BENCH_VIDEO_TIMESCALE / 1000 / BENCH_VIDEO_FRAME_DURATION;
+
+	frames = vod_alloc(request_context->pool, sizeof(frames[0]) * frame_count);
+	if (frames == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(frames, sizeof(frames[0]) * frame_count);
+
+	for (cur_frame = frames; cur_frame < frames + frame_count; cur_frame++)
+	{
+		cur_frame->duration = BENCH_VIDEO_FRAME_DURATION;
+		cur_frame->size = 10000;
+
+		if (gop_left <= 0)
+		{
+			cur_frame->key_frame = 1;
+			video->key_frame_count++;
+			gop_left = (uint64_t)RAND(params->min_gop, params->max_gop) * BENCH_VIDEO_TIMESCALE / 1000 /
+				BENCH_VIDEO_FRAME_DURATION;
+		}
+
+		if (gop_left > 0)
+		{
+			gop_left--;
+		}
+	}
+
+	video->frames.first_frame = frames;
+	video->frames.last_frame = frames + frame_count;
+	video->frame_count = frame_count;
+	video->total_frames_duration = (uint64_t)frame_count * BENCH_VIDEO_FRAME_DURATION;
+	video->total_frames_size = (uint64_t)frame_count * 10000;
+
+	// the audio frames, a single run of fixed duration frames, as returned by the mp4 parser for compact tracks
+	set->audio_run.count = duration_millis * BENCH_AUDIO_TIMESCALE / 1000 / BENCH_AUDIO_FRAME_DURATION;
+	set->audio_run.duration = BENCH_AUDIO_FRAME_DURATION;
+
+	audio->compact_frames.first_run = &set->audio_run;
+	audio->compact_frames.last_run = &set->audio_run + 1;
+	audio->compact_frames.timescale = BENCH_AUDIO_TIMESCALE;
+	audio->frame_count = set->audio_run.count;
+	audio->total_frames_duration = (uint64_t)set->audio_run.count * BENCH_AUDIO_FRAME_DURATION;
+
+	return filter_init_filtered_clips(request_context, &set->media_set, TRUE);
+}
+
+static vod_status_t
+bench_init_playlist(bench_ctx_t* ctx, bench_media_set_t* set, uint32_t type)
+{
+	media_clip_timing_t* timing = &set->media_set.timing;
+	request_context_t* request_context = &ctx->request_context;
+	uint64_t total_duration = 0;
+	uint64_t cur_time;
+	uint32_t clip_count = ctx->params.clip_count;
+	uint32_t i;
+	vod_status_t rc;
+
+	bench_init_media_set(ctx, set, type == MEDIA_SET_VOD ? "playlist" : "live", type);
+
+	timing->durations = vod_alloc(request_context->pool, sizeof(timing->durations[0]) * clip_count);
+	timing->times = vod_alloc(request_context->pool, sizeof(timing->times[0]) * clip_count);
+	set->saved_durations = vod_alloc(request_context->pool, sizeof(set->saved_durations[0]) * clip_count);
+	set->saved_times = vod_alloc(request_context->pool, sizeof(set->saved_times[0]) * clip_count);
+	if (timing->durations == NULL || timing->times == NULL ||
+		set->saved_durations == NULL || set->saved_times == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	cur_time = type == MEDIA_SET_VOD ? 0 : BENCH_LIVE_FIRST_TIME;
+	for (i = 0; i < clip_count; i++)
+	{
+		timing->durations[i] = RAND(BENCH_MIN_CLIP_DURATION, BENCH_MAX_CLIP_DURATION);
+		timing->times[i] = cur_time;
+		cur_time += timing->durations[i];
+		total_duration += timing->durations[i];
+	}
+
+	timing->total_count = clip_count;
+	timing->total_duration = total_duration;
+	timing->original_times = timing->times;
+	timing->first_time = timing->times[0];
+	timing->original_first_time = timing->times[0];
+	timing->segment_base_time = SEGMENT_BASE_TIME_RELATIVE;
+
+	rc = segmenter_init_clip_offsets(request_context, &ctx->segmenter, timing);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	set->media_set.use_discontinuity = TRUE;
+	set->media_set.original_use_discontinuity = TRUE;
+	set->media_set.initial_clip_index = 0;
+
+	// the media info of the last clip, assuming the same encoding for all clips (as in live)
+	bench_init_tracks(set, timing->durations[clip_count - 1]);
+
+	rc = filter_init_filtered_clips(request_context, &set->media_set, FALSE);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (type == MEDIA_SET_LIVE)
+	{
+		// a negative window ends at the end of the last clip, instead of at the current time
+		set->media_set.live_window_duration = -(int64_t)ctx->params.live_window;
+		set->segment_count = ctx->params.live_window / ctx->params.segment_duration;
+	}
+
+	vod_memcpy(set->saved_durations, timing->durations, sizeof(set->saved_durations[0]) * clip_count);
+	vod_memcpy(set->saved_times, timing->times, sizeof(set->saved_times[0]) * clip_count);
+	set->saved_media_set = set->media_set;
+	set->saved_sequence = set->sequence;
+
+	return VOD_OK;
+}
+
+// runs
+static vod_status_t
+bench_run_durations(bench_ctx_t* ctx, bench_media_set_t* set)
+{
+	segment_durations_t result;
+	vod_status_t rc;
+
+	rc = segmenter_get_segment_durations_accurate(
+		&ctx->request_context,
+		&ctx->segmenter,
+		&set->media_set,
+		NULL,
+		MEDIA_TYPE_NONE,
+		&result);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	set->segment_count = result.segment_count;
+	return VOD_OK;
+}
+
+static vod_status_t
+bench_run_hls_index(bench_ctx_t* ctx, bench_media_set_t* set)
+{
+	hls_encryption_params_t encryption_params;
+	vod_str_t base_url = vod_null_string;
+	vod_str_t result;
+
+	vod_memzero(&encryption_params, sizeof(encryption_params));
+	encryption_params.type = HLS_ENC_NONE;
+
+	return m3u8_builder_build_index_playlist(
+		&ctx->request_context,
+		&ctx->m3u8_config,
+		&base_url,
+		&base_url,
+		&encryption_params,
+		HLS_CONTAINER_FMP4,
+		&set->media_set,
+		FALSE,
+		&result);
+}
+
+static vod_status_t
+bench_run_dash_mpd(bench_ctx_t* ctx, bench_media_set_t* set)
+{
+	dash_manifest_extensions_t extensions;
+	vod_str_t base_url = vod_null_string;
+	vod_str_t result;
+
+	vod_memzero(&extensions, sizeof(extensions));
+
+	return dash_packager_build_mpd(
+		&ctx->request_context,
+		&ctx->mpd_config,
+		&base_url,
+		&set->media_set,
+		&extensions,
+		&result);
+}
+
+static vod_status_t
+bench_run_live_window(bench_ctx_t* ctx, bench_media_set_t* set)
+{
+	get_clip_ranges_result_t clip_ranges;
+	media_clip_timing_t* timing = &set->media_set.timing;
+	uint32_t base_clip_index = 0;
+	uint32_t end_clip_index;
+	vod_status_t rc;
+
+	rc = segmenter_get_live_window(
+		&ctx->request_context,
+		&ctx->segmenter,
+		&set->media_set,
+		FALSE,
+		&clip_ranges,
+		&base_clip_index);
+
+	// restore the clips that were trimmed to the window, and the pointers that were shifted
+	end_clip_index = base_clip_index + timing->total_count - 1;
+	set->saved_media_set.timing.durations[base_clip_index] = set->saved_durations[base_clip_index];
+	set->saved_media_set.timing.durations[end_clip_index] = set->saved_durations[end_clip_index];
+	set->saved_media_set.timing.times[base_clip_index] = set->saved_times[base_clip_index];
+
+	set->media_set = set->saved_media_set;
+	set->sequence = set->saved_sequence;
+
+	return rc;
+}
+
+static bool_t
+bench_measure(bench_ctx_t* ctx, bench_media_set_t* set, const char* stage, bench_run_t run)
+{
+	request_context_t* request_context = &ctx->request_context;
+	vod_pool_t* saved_pool = request_context->pool;
+	uint64_t elapsed = 0;
+	uint64_t start;
+	uint32_t i;
+	vod_status_t rc;
+
+	for (i = 0; i < ctx->params.iterations; i++)
+	{
+		request_context->pool = ngx_create_pool(BENCH_POOL_SIZE, &ctx->log);
+		if (request_context->pool == NULL)
+		{
+			request_context->pool = saved_pool;
+			return FALSE;
+		}
+
+		start = bench_get_time();
+		rc = run(ctx, set);
+		elapsed += bench_get_time() - start;
+
+		ngx_destroy_pool(request_context->pool);
+		request_context->pool = saved_pool;
+
+		if (rc != VOD_OK)
+		{
+			printf("Error: %s %s failed %" PRIdPTR "\n", set->name, stage, (intptr_t)rc);
+			return FALSE;
+		}
+	}
+
+	printf("  %-10s %-14s %10" PRIu32 " %12.1f %12.1f\n",
+		set->name,
+		stage,
+		set->segment_count,
+		(double)elapsed / ctx->params.iterations / 1000,
+		set->segment_count > 0 ? (double)elapsed / ctx->params.iterations / set->segment_count : 0);
+
+	return TRUE;
+}
+
+// init
+static vod_status_t
+bench_init_conf(bench_ctx_t* ctx)
+{
+	vod_status_t rc;
+
+	ctx->segmenter.segment_duration = ctx->params.segment_duration;
+	ctx->segmenter.align_to_key_frames = TRUE;
+	ctx->segmenter.live_window_duration = ctx->params.live_window;
+	ctx->segmenter.get_segment_count = segmenter_get_segment_count_last_short;
+	ctx->segmenter.get_segment_durations = segmenter_get_segment_durations_accurate;
+	ctx->segmenter.manifest_duration_policy = MDP_MAX;
+	ctx->segmenter.gop_look_ahead = 1000;
+	ctx->segmenter.gop_look_behind = 10000;
+
+	rc = segmenter_init_config(&ctx->segmenter, ctx->request_context.pool);
+	if (rc != VOD_OK)
+	{
+		printf("Error: segmenter_init_config failed %" PRIdPTR "\n", (intptr_t)rc);
+		return rc;
+	}
+
+	// the defaults of the nginx configuration
+	ctx->m3u8_config.container_format = HLS_CONTAINER_AUTO;
+	ngx_str_set(&ctx->m3u8_config.index_file_name_prefix, "index");
+	ngx_str_set(&ctx->m3u8_config.iframes_file_name_prefix, "iframes");
+	ngx_str_set(&ctx->m3u8_config.segment_file_name_prefix, "seg");
+	ngx_str_set(&ctx->m3u8_config.init_file_name_prefix, "init");
+	ngx_str_set(&ctx->m3u8_config.encryption_key_file_name, "encryption");
+	m3u8_builder_init_config(&ctx->m3u8_config, ctx->segmenter.max_segment_duration, HLS_ENC_NONE);
+
+	ngx_str_set(&ctx->mpd_config.profiles, "urn:mpeg:dash:profile:isoff-main:2011");
+	ngx_str_set(&ctx->mpd_config.init_file_name_prefix, "init");
+	ngx_str_set(&ctx->mpd_config.fragment_file_name_prefix, "fragment");
+	ngx_str_set(&ctx->mpd_config.subtitle_file_name_prefix, "sub");
+	ctx->mpd_config.manifest_format = FORMAT_SEGMENT_TIMELINE;
+	ctx->mpd_config.subtitle_format = SUBTITLE_FORMAT_WEBVTT;
+	ctx->mpd_config.duplicate_bitrate_threshold = 4096;
+
+	rc = language_code_init(&ctx->log);
+	if (rc != VOD_OK)
+	{
+		printf("Error: language_code_init failed %" PRIdPTR "\n", (intptr_t)rc);
+		return rc;
+	}
+
+	return VOD_OK;
+}
+
+static bool_t
+run_benchmark(bench_ctx_t* ctx)
+{
+	static bench_media_set_t sets[BENCH_SET_COUNT];
+	bench_media_set_t* set;
+
+	if (bench_init_title(ctx, &sets[BENCH_TITLE]) != VOD_OK ||
+		bench_init_playlist(ctx, &sets[BENCH_PLAYLIST], MEDIA_SET_VOD) != VOD_OK ||
+		bench_init_playlist(ctx, &sets[BENCH_LIVE], MEDIA_SET_LIVE) != VOD_OK)
+	{
+		printf("Error: failed to initialize the media sets\n");
+		return FALSE;
+	}
+
+	printf("  %-10s %-14s %10s %12s %12s\n", "set", "stage", "segments", "usec/call", "nsec/segment");
+
+	// Note: the durations run sets the segment count of the set, it must run first
+	for (set = sets; set < sets + BENCH_LIVE; set++)
+	{
+		if (!bench_measure(ctx, set, "durations", bench_run_durations) ||
+			!bench_measure(ctx, set, "hls_index", bench_run_hls_index) ||
+			!bench_measure(ctx, set, "dash_mpd", bench_run_dash_mpd))
+		{
+			return FALSE;
+		}
+	}
+
+	return bench_measure(ctx, &sets[BENCH_LIVE], "live_window", bench_run_live_window);
+}
+
+static void
+usage(const char* name)
+{
+	printf("Usage: %s [options]\n"
+		"  -n <count>      iterations per stage (default 100)\n"
+		"  -t <hours>      duration of the title (default 24)\n"
+		"  -g <min>[-<max>] gop duration in ms (default 1000-5000)\n"
+		"  -c <count>      number of clips of the playlists (default 2000)\n"
+		"  -s <millis>     segment duration (default 4000)\n"
+		"  -w <millis>     live window duration (default 7200000)\n"
+		"  -r <seed>       random seed\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	static bench_ctx_t ctx;
+	bench_params_t* params = &ctx.params;
+	vod_pool_t* pool;
+	char* end;
+	int opt;
+	int rc;
+
+	params->iterations = 100;
+	params->title_hours = 24;
+	params->min_gop = 1000;
+	params->max_gop = 5000;
+	params->clip_count = 2000;
+	params->segment_duration = 4000;
+	params->live_window = 7200000;
+	params->seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "n:t:g:c:s:w:r:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			params->iterations = strtoul(optarg, NULL, 10);
+			break;
+
+		case 't':
+			params->title_hours = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'g':
+			params->min_gop = strtoul(optarg, &end, 10);
+			params->max_gop = *end == '-' ? strtoul(end + 1, NULL, 10) : params->min_gop;
+			break;
+
+		case 'c':
+			params->clip_count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 's':
+			params->segment_duration = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'w':
+			params->live_window = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			params->seed = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (params->iterations < 1 || params->title_hours < 1 || params->clip_count < 2 || params->min_gop < 1 ||
+		params->max_gop < params->min_gop || params->segment_duration < MIN_SEGMENT_DURATION ||
+		params->live_window < params->segment_duration)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("seed %u\n", params->seed);
+	srand(params->seed);
+
+	vod_cli_shim_init(&ctx.log, NGX_LOG_WARN);
+	ctx.request_context.log = &ctx.log;
+
+	pool = ngx_create_pool(BENCH_POOL_SIZE, &ctx.log);
+	if (pool == NULL)
+	{
+		return 1;
+	}
+
+	ctx.request_context.pool = pool;
+
+	rc = bench_init_conf(&ctx) == VOD_OK && run_benchmark(&ctx) ? 0 : 1;
+
+	ngx_destroy_pool(pool);
+
+	return rc;
+}
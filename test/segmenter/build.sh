@@ -0,0 +1,16 @@
+#!/bin/bash
+
+if [ -z "$NGX_ROOT" ]; then 
+	echo "NGX_ROOT not set"
+	exit 1
+fi
+
+if [ -z "$VOD_ROOT" ]; then 
+	echo "VOD_ROOT not set"
+	exit 1
+fi
+
+# NGX_ROOT must contain an nginx build that includes the module (configure & make), the vod library objects are
+# taken from objs/addon, same as vod/cli. the libraries of optional features that were detected by configure
+# (e.g. libxml2, ffmpeg) should be added, they can be copied from the link command in objs/Makefile.
+cc -Wall -O2 -osegbench $VOD_ROOT/test/segmenter/bench.c $VOD_ROOT/vod/cli/vod_cli_shim.c `ls $NGX_ROOT/objs/addon/*/*.o | grep -v /ngx_` $NGX_ROOT/objs/src/core/ngx_array.o $NGX_ROOT/objs/src/core/ngx_string.o $NGX_ROOT/objs/src/core/ngx_hash.o $NGX_ROOT/objs/src/core/ngx_crc32.o $NGX_ROOT/objs/src/core/ngx_rbtree.o $NGX_ROOT/objs/src/core/ngx_queue.o $NGX_ROOT/objs/src/os/unix/ngx_alloc.o -I $NGX_ROOT/src/core -I $NGX_ROOT/src/event -I $NGX_ROOT/src/event/modules -I $NGX_ROOT/src/os/unix -I $NGX_ROOT/objs -I $VOD_ROOT -lcrypto -lz -lm
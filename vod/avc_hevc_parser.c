@@ -1,5 +1,43 @@
 #include "avc_hevc_parser.h"
 
+// constants
+#define AVC_HEVC_PARSER_CACHE_SIZE (16)
+#define AVC_HEVC_PARSER_CACHE_POOL_SIZE (4096)
+
+// typedefs
+typedef struct {
+	vod_pool_t* pool;
+	avc_hevc_parse_extra_data_t parse_extra_data;
+	vod_str_t extra_data;
+	avc_hevc_parse_ctx_t* ctx;
+	uint32_t nal_packet_size_length;
+	uint32_t min_packet_size;
+	uint32_t ref_count;
+	uint32_t last_used;
+	bool_t evicted;
+} avc_hevc_parser_cache_entry_t;
+
+typedef struct {
+	avc_hevc_parser_cache_entry_t* entry;
+	vod_log_t* log;
+} avc_hevc_parser_cache_ref_t;
+
+// globals
+static avc_hevc_parser_cache_entry_t* avc_hevc_parser_cache[AVC_HEVC_PARSER_CACHE_SIZE];
+static uint32_t avc_hevc_parser_cache_clock;
+
+// Note: the cache is used by metadata parsing, that may run on a thread pool, while the references are
+//		released on the main thread, when the request pool is destroyed
+#if (VOD_THREADS)
+static pthread_mutex_t avc_hevc_parser_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define avc_hevc_parser_cache_lock() pthread_mutex_lock(&avc_hevc_parser_cache_mutex)
+#define avc_hevc_parser_cache_unlock() pthread_mutex_unlock(&avc_hevc_parser_cache_mutex)
+#else
+#define avc_hevc_parser_cache_lock()
+#define avc_hevc_parser_cache_unlock()
+#endif // VOD_THREADS
+
 bool_t
 avc_hevc_parser_rbsp_trailing_bits(bit_reader_state_t* reader)
 {
@@ -69,20 +107,105 @@ avc_hevc_parser_get_ptr_array_item(vod_array_t* arr, size_t index, size_t size)
 }
 
 // emulation prevention
+/*
+	The search for two consecutive zero bytes (the prefix of start codes and emulation prevention sequences)
+	is vectorized, 16 bytes are tested at a time by comparing two overlapping loads. sse2 is part of the
+	x86_64 baseline and neon is always available on aarch64, so no runtime cpu check is needed.
+*/
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+
+const u_char*
+avc_hevc_parser_find_zero_pair(const u_char* cur_pos, const u_char* limit)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+	int mask;
+
+	// Note: the loads read up to cur_pos + 16, which is valid since the caller can read limit[1]
+	for (; limit - cur_pos >= 16; cur_pos += 16)
+	{
+		v = _mm_or_si128(
+			_mm_loadu_si128((const __m128i*)cur_pos),
+			_mm_loadu_si128((const __m128i*)(cur_pos + 1)));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (mask != 0)
+		{
+			return cur_pos + __builtin_ctz(mask);
+		}
+	}
+
+	for (; cur_pos < limit; cur_pos++)
+	{
+		if (cur_pos[0] == 0 && cur_pos[1] == 0)
+		{
+			return cur_pos;
+		}
+	}
+
+	return cur_pos;
+}
+
+#else
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+const u_char*
+avc_hevc_parser_find_zero_pair(const u_char* cur_pos, const u_char* limit)
+{
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	uint8x16_t v;
+
+	// Note: the loads read up to cur_pos + 16, which is valid since the caller can read limit[1]
+	for (; limit - cur_pos >= 16; cur_pos += 16)
+	{
+		v = vorrq_u8(vld1q_u8(cur_pos), vld1q_u8(cur_pos + 1));
+		if (vminvq_u8(v) == 0)
+		{
+			break;		// the exact position is found by the loop below
+		}
+	}
+#endif
+
+	for (; cur_pos < limit; cur_pos++)
+	{
+		if (cur_pos[0] == 0 && cur_pos[1] == 0)
+		{
+			return cur_pos;
+		}
+	}
+
+	return cur_pos;
+}
+
+#endif
+
 uint32_t
 avc_hevc_parser_emulation_prevention_encode_bytes(
 	const u_char* cur_pos,
 	const u_char* end_pos)
 {
+	const u_char* limit = end_pos - 2;
 	uint32_t result = 0;
 
-	end_pos -= 2;
-	for (; cur_pos < end_pos; cur_pos++)
+	for (;;)
 	{
-		if (cur_pos[0] == 0 && cur_pos[1] == 0 && cur_pos[2] <= 3)
+		cur_pos = avc_hevc_parser_find_zero_pair(cur_pos, limit);
+		if (cur_pos >= limit)
+		{
+			break;
+		}
+
+		if (cur_pos[2] <= 3)
 		{
 			result++;
-			cur_pos += 2;
+			cur_pos += 3;
+		}
+		else
+		{
+			cur_pos++;
 		}
 	}
 
@@ -97,26 +220,24 @@ avc_hevc_parser_emulation_prevention_decode(
 	uint32_t size)
 {
 	const u_char* cur_pos;
+	const u_char* copy_pos;
 	const u_char* end_pos = buffer + size;
 	const u_char* limit = end_pos - 2;
 	u_char* output;
-	u_char cur_byte;
-	bool_t requires_strip;
 
-	requires_strip = FALSE;
-	for (cur_pos = buffer; cur_pos < limit; cur_pos++)
+	for (cur_pos = buffer; ; cur_pos++)
 	{
-		if (cur_pos[0] == 0 && cur_pos[1] == 0 && cur_pos[2] == 3)
+		cur_pos = avc_hevc_parser_find_zero_pair(cur_pos, limit);
+		if (cur_pos >= limit)
 		{
-			requires_strip = TRUE;
-			break;
+			bit_read_stream_init(reader, buffer, size);
+			return VOD_OK;
 		}
-	}
 
-	if (!requires_strip)
-	{
-		bit_read_stream_init(reader, buffer, size);
-		return VOD_OK;
+		if (cur_pos[2] == 3)
+		{
+			break;
+		}
 	}
 
 	output = vod_alloc(request_context->pool, size);
@@ -129,26 +250,30 @@ avc_hevc_parser_emulation_prevention_decode(
 
 	bit_read_stream_init(reader, output, 0);	// size updated later
 
-	for (cur_pos = buffer; cur_pos < limit; )
+	// copy the spans between the emulation prevention bytes
+	copy_pos = buffer;
+	for (;;)
 	{
-		cur_byte = *cur_pos;
-		if (cur_byte == 0 && cur_pos[1] == 0 && cur_pos[2] == 3)
+		output = vod_copy(output, copy_pos, cur_pos + 2 - copy_pos);
+		cur_pos += 3;
+		copy_pos = cur_pos;
+
+		for (;; cur_pos++)
 		{
-			*output++ = 0;
-			*output++ = 0;
-			cur_pos += 3;
+			cur_pos = avc_hevc_parser_find_zero_pair(cur_pos, limit);
+			if (cur_pos >= limit || cur_pos[2] == 3)
+			{
+				break;
+			}
 		}
-		else
+
+		if (cur_pos >= limit)
 		{
-			*output++ = cur_byte;
-			cur_pos++;
+			break;
 		}
 	}
 
-	while (cur_pos < end_pos)
-	{
-		*output++ = *cur_pos++;
-	}
+	output = vod_copy(output, copy_pos, end_pos - copy_pos);
 
 	reader->stream.end_pos = output;
 	return VOD_OK;
@@ -203,3 +328,217 @@ avc_hevc_parser_init_ctx(
 	return VOD_OK;
 }
 
+
+static void
+avc_hevc_parser_cache_free_entry(avc_hevc_parser_cache_entry_t* entry, vod_log_t* log)
+{
+	// the log of the request that created the entry may no longer exist
+	entry->pool->log = log;
+	vod_destroy_pool(entry->pool);
+}
+
+static void
+avc_hevc_parser_cache_release(void* data)
+{
+	avc_hevc_parser_cache_ref_t* ref = data;
+	avc_hevc_parser_cache_entry_t* entry = ref->entry;
+
+	avc_hevc_parser_cache_lock();
+
+	entry->ref_count--;
+	if (entry->ref_count <= 0 && entry->evicted)
+	{
+		avc_hevc_parser_cache_free_entry(entry, ref->log);
+	}
+
+	avc_hevc_parser_cache_unlock();
+}
+
+static vod_status_t
+avc_hevc_parser_cache_create_entry(
+	request_context_t* request_context,
+	avc_hevc_parse_extra_data_t parse_extra_data,
+	vod_str_t* extra_data,
+	avc_hevc_parser_cache_entry_t** result)
+{
+	avc_hevc_parser_cache_entry_t* entry;
+	request_context_t entry_request_context;
+	vod_status_t rc;
+	vod_pool_t* pool;
+	void* ctx;
+
+	pool = vod_create_pool(AVC_HEVC_PARSER_CACHE_POOL_SIZE, request_context->log);
+	if (pool == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"avc_hevc_parser_cache_create_entry: vod_create_pool failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	entry = vod_alloc(pool, sizeof(*entry) + extra_data->len);
+	if (entry == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"avc_hevc_parser_cache_create_entry: vod_alloc failed");
+		rc = VOD_ALLOC_FAILED;
+		goto failed;
+	}
+
+	// parse the parameter sets into the pool of the entry
+	entry_request_context = *request_context;
+	entry_request_context.pool = pool;
+
+	rc = avc_hevc_parser_init_ctx(&entry_request_context, &ctx);
+	if (rc != VOD_OK)
+	{
+		goto failed;
+	}
+
+	rc = parse_extra_data(
+		ctx,
+		extra_data,
+		&entry->nal_packet_size_length,
+		&entry->min_packet_size);
+	if (rc != VOD_OK)
+	{
+		goto failed;
+	}
+
+	entry->pool = pool;
+	entry->parse_extra_data = parse_extra_data;
+	entry->extra_data.data = (u_char*)(entry + 1);
+	entry->extra_data.len = extra_data->len;
+	vod_memcpy(entry->extra_data.data, extra_data->data, extra_data->len);
+	entry->ctx = ctx;
+	entry->ctx->request_context = NULL;
+	entry->ref_count = 0;
+	entry->evicted = FALSE;
+
+	*result = entry;
+
+	return VOD_OK;
+
+failed:
+
+	vod_destroy_pool(pool);
+	return rc;
+}
+
+vod_status_t
+avc_hevc_parser_get_cached_ctx(
+	request_context_t* request_context,
+	avc_hevc_parse_extra_data_t parse_extra_data,
+	vod_str_t* extra_data,
+	uint32_t* nal_packet_size_length,
+	uint32_t* min_packet_size,
+	void** result)
+{
+	avc_hevc_parser_cache_entry_t** slot = NULL;
+	avc_hevc_parser_cache_entry_t* entry = NULL;
+	avc_hevc_parser_cache_entry_t* cur;
+	avc_hevc_parser_cache_ref_t* ref;
+	avc_hevc_parse_ctx_t* ctx;
+	vod_pool_cleanup_t* cln;
+	vod_status_t rc;
+	unsigned i;
+
+	ctx = vod_alloc(request_context->pool, sizeof(*ctx));
+	if (ctx == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"avc_hevc_parser_get_cached_ctx: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cln = vod_pool_cleanup_add(request_context->pool, sizeof(*ref));
+	if (cln == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"avc_hevc_parser_get_cached_ctx: vod_pool_cleanup_add failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	avc_hevc_parser_cache_lock();
+
+	// look up the extra data, and find the slot that will be replaced if it is not found (empty / least recently used)
+	for (i = 0; i < AVC_HEVC_PARSER_CACHE_SIZE; i++)
+	{
+		cur = avc_hevc_parser_cache[i];
+		if (cur == NULL)
+		{
+			if (slot == NULL || *slot != NULL)
+			{
+				slot = &avc_hevc_parser_cache[i];
+			}
+			continue;
+		}
+
+		if (cur->parse_extra_data == parse_extra_data && vod_str_equals(cur->extra_data, *extra_data))
+		{
+			entry = cur;
+			break;
+		}
+
+		if (slot == NULL || (*slot != NULL && cur->last_used < (*slot)->last_used))
+		{
+			slot = &avc_hevc_parser_cache[i];
+		}
+	}
+
+	if (entry == NULL)
+	{
+		rc = avc_hevc_parser_cache_create_entry(
+			request_context,
+			parse_extra_data,
+			extra_data,
+			&entry);
+		if (rc != VOD_OK)
+		{
+			avc_hevc_parser_cache_unlock();
+			return rc;
+		}
+
+		// entries that are still referenced are freed when the last request that uses them completes
+		cur = *slot;
+		if (cur != NULL)
+		{
+			if (cur->ref_count <= 0)
+			{
+				avc_hevc_parser_cache_free_entry(cur, request_context->log);
+			}
+			else
+			{
+				cur->evicted = TRUE;
+			}
+		}
+
+		*slot = entry;
+	}
+
+	entry->last_used = ++avc_hevc_parser_cache_clock;
+	entry->ref_count++;
+
+	avc_hevc_parser_cache_unlock();
+
+	ref = cln->data;
+	ref->entry = entry;
+	ref->log = request_context->log;
+	cln->handler = avc_hevc_parser_cache_release;
+
+	*ctx = *entry->ctx;
+	ctx->request_context = request_context;
+
+	if (nal_packet_size_length != NULL)
+	{
+		*nal_packet_size_length = entry->nal_packet_size_length;
+	}
+
+	if (min_packet_size != NULL)
+	{
+		*min_packet_size = entry->min_packet_size;
+	}
+
+	*result = ctx;
+
+	return VOD_OK;
+}
@@ -18,11 +18,55 @@ typedef struct {
 	vod_array_t pps;
 } avc_hevc_parse_ctx_t;
 
+typedef vod_status_t(*avc_hevc_parse_extra_data_t)(
+	void* ctx,
+	vod_str_t* extra_data,
+	uint32_t* nal_packet_size_length,
+	uint32_t* min_packet_size);
+
 // bit stream inlines
+#if defined(__GNUC__)
+// returns the number of bits of the exp-golomb code at the head of the cache, or 0 if the code is not fully cached
+static vod_inline int
+bit_read_stream_cached_exp_bits(bit_reader_state_t* reader)
+{
+	int zero_count;
+
+	if (reader->cache_bits < 32)
+	{
+		bit_read_stream_refill(reader);
+	}
+
+	if (reader->cache == 0)
+	{
+		return 0;
+	}
+
+	zero_count = __builtin_clzll(reader->cache);
+	if (zero_count > 31 || 2 * zero_count + 1 > reader->cache_bits)
+	{
+		return 0;
+	}
+
+	return 2 * zero_count + 1;
+}
+#else
+#define bit_read_stream_cached_exp_bits(reader) (0)
+#endif // __GNUC__
+
 static vod_inline void
 bit_read_stream_skip_unsigned_exp(bit_reader_state_t* reader)
 {
 	int zero_count;
+	int bits;
+
+	bits = bit_read_stream_cached_exp_bits(reader);
+	if (bits > 0)
+	{
+		reader->cache <<= bits;
+		reader->cache_bits -= bits;
+		return;
+	}
 
 	for (zero_count = 0; bit_read_stream_get_one(reader) == 0 && !reader->stream.eof_reached; zero_count++);
 
@@ -32,7 +76,19 @@ bit_read_stream_skip_unsigned_exp(bit_reader_state_t* reader)
 static vod_inline uint32_t
 bit_read_stream_get_unsigned_exp(bit_reader_state_t* reader)
 {
+	uint32_t result;
 	int zero_count;
+	int bits;
+
+	bits = bit_read_stream_cached_exp_bits(reader);
+	if (bits > 0)
+	{
+		// the value of the code is the bits following the zeros, prefixed by the one bit, minus one
+		result = (uint32_t)(reader->cache >> (64 - bits)) - 1;
+		reader->cache <<= bits;
+		reader->cache_bits -= bits;
+		return result;
+	}
 
 	for (zero_count = 0; bit_read_stream_get_one(reader) == 0 && !reader->stream.eof_reached; zero_count++);
 
@@ -62,6 +118,10 @@ bool_t avc_hevc_parser_rbsp_trailing_bits(bit_reader_state_t* reader);
 
 void* avc_hevc_parser_get_ptr_array_item(vod_array_t* arr, size_t index, size_t size);
 
+// returns the first position before limit that starts two zero bytes, or a position >= limit if there is none.
+// limit[1] must be readable
+const u_char* avc_hevc_parser_find_zero_pair(const u_char* cur_pos, const u_char* limit);
+
 uint32_t avc_hevc_parser_emulation_prevention_encode_bytes(
 	const u_char* cur_pos,
 	const u_char* end_pos);
@@ -78,4 +138,16 @@ vod_status_t avc_hevc_parser_init_ctx(
 	request_context_t* request_context,
 	void** result);
 
+// returns a parser context initialized with the parameter sets of the extra data. the parsed parameter sets
+// are kept in a per process cache keyed by the extra data, and are shared by all the requests that use it.
+// the cache is guarded by a mutex when threads are enabled, the returned context can be used until the request
+// pool is destroyed.
+vod_status_t avc_hevc_parser_get_cached_ctx(
+	request_context_t* request_context,
+	avc_hevc_parse_extra_data_t parse_extra_data,
+	vod_str_t* extra_data,
+	uint32_t* nal_packet_size_length,
+	uint32_t* min_packet_size,
+	void** result);
+
 #endif //__AVC_HEVC_PARSER_H__
@@ -827,7 +827,7 @@ avc_parser_get_slice_header_size(
 		return rc;
 	}
 
-	start_pos = reader.stream.cur_pos;
+	start_pos = bit_read_stream_get_pos(&reader);
 
 	nal_ref_idc = (buffer[0] >> 5) & 0x3;
 	nal_unit_type = buffer[0] & 0x1f;
@@ -981,13 +981,13 @@ avc_parser_get_slice_header_size(
 		return VOD_BAD_DATA;
 	}
 	
-	*result = AVC_NAL_HEADER_SIZE + (reader.stream.cur_pos - start_pos);
+	*result = AVC_NAL_HEADER_SIZE + (bit_read_stream_get_pos(&reader) - start_pos);
 
 	if (start_pos != buffer + AVC_NAL_HEADER_SIZE)
 	{
 		*result += avc_hevc_parser_emulation_prevention_encode_bytes(
 			start_pos, 
-			reader.stream.cur_pos);
+			bit_read_stream_get_pos(&reader));
 	}
 
 	return VOD_OK;
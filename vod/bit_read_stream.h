@@ -4,11 +4,30 @@
 // includes
 #include "read_stream.h"
 
+/*
+	The bits are read from a 64 bit msb-aligned cache, that is refilled with an unaligned big endian load of
+	the following bytes. Reads that do not exceed the cached bits (the common case in sps / slice parsing)
+	are a shift, and exp-golomb codes are decoded with a single count-leading-zeros.
+	The bits in the cache that follow the first cache_bits are either zero, or the bits that follow them in
+	the stream (a refill loads 8 bytes and consumes only the bytes that fit) - either way, or-ing the next
+	bytes of the stream into the cache gives the same result.
+	Reading past the end of the stream sets stream.eof_reached and returns zero bits, stream.cur_pos points
+	to the first byte that was not loaded to the cache, bit_read_stream_get_pos returns the position
+	following the byte of the last bit that was read.
+*/
+
+// macros
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define bit_read_stream_load_be64(p, v) { vod_memcpy(&(v), (p), sizeof(v)); v = __builtin_bswap64(v); }
+#else
+#define bit_read_stream_load_be64(p, v) { v = parse_be64(p); }
+#endif // __GNUC__ && __ORDER_LITTLE_ENDIAN__
+
 // typedefs
 typedef struct {
 	simple_read_stream_t stream;
-	u_char cur_byte;
-	signed char cur_bit;
+	uint64_t cache;
+	int cache_bits;
 } bit_reader_state_t;
 
 // functions
@@ -18,59 +37,102 @@ bit_read_stream_init(bit_reader_state_t* state, const u_char* buffer, int size)
 	state->stream.cur_pos = buffer;
 	state->stream.end_pos = buffer + size;
 	state->stream.eof_reached = FALSE;
-	state->cur_byte = 0;
-	state->cur_bit = -1;
+	state->cache = 0;
+	state->cache_bits = 0;
+}
+
+static vod_inline const u_char*
+bit_read_stream_get_pos(bit_reader_state_t* state)
+{
+	return state->stream.cur_pos - (state->cache_bits >> 3);
 }
 
+// returns the number of bits that were not read yet in the byte of the last bit that was read
 static vod_inline int
-bit_read_stream_get_one(bit_reader_state_t* state)
+bit_read_stream_bits_left_in_byte(bit_reader_state_t* state)
 {
-	int result;
+	return state->cache_bits & 7;
+}
+
+// loads as many whole bytes as fit in the cache, at least 57 bits are cached unless the stream ends
+static vod_inline void
+bit_read_stream_refill(bit_reader_state_t* state)
+{
+	const u_char* cur_pos = state->stream.cur_pos;
+	uint64_t value;
+	int bytes;
+
+	bytes = (64 - state->cache_bits) >> 3;
 
-	if (state->cur_bit < 0)
+	if (state->stream.end_pos - cur_pos >= (ssize_t)sizeof(value))
 	{
-		state->cur_byte = read_stream_get_byte(&state->stream);
-		state->cur_bit = 7;
+		bit_read_stream_load_be64(cur_pos, value);
+		state->cache |= value >> state->cache_bits;
+		state->cache_bits += bytes << 3;
+		state->stream.cur_pos = cur_pos + bytes;
+		return;
 	}
 
-	result = ((state->cur_byte >> state->cur_bit) & 1);
-	state->cur_bit--;
+	for (; bytes > 0 && cur_pos < state->stream.end_pos; bytes--)
+	{
+		state->cache |= (uint64_t)*cur_pos++ << (56 - state->cache_bits);
+		state->cache_bits += 8;
+	}
 
-	return result;
+	state->stream.cur_pos = cur_pos;
 }
 
-static vod_inline void
-bit_read_stream_skip(bit_reader_state_t* state, int count)
+static vod_inline int
+bit_read_stream_get_one(bit_reader_state_t* state)
 {
-	int skip_bytes;
+	int result;
 
-	state->cur_bit -= count - 1;
-	if (state->cur_bit < 0)
+	if (state->cache_bits <= 0)
 	{
-		skip_bytes = ((-state->cur_bit + 7) >> 3);
-		read_stream_skip(&state->stream, skip_bytes - 1);
-		state->cur_byte = read_stream_get_byte(&state->stream);
-		state->cur_bit += (skip_bytes << 3);
+		bit_read_stream_refill(state);
+		if (state->cache_bits <= 0)
+		{
+			state->stream.eof_reached = TRUE;
+			return 0;
+		}
 	}
-	state->cur_bit--;
+
+	result = (int)(state->cache >> 63);
+	state->cache <<= 1;
+	state->cache_bits--;
+
+	return result;
 }
 
+// count must not exceed 32
 static vod_inline int 
 bit_read_stream_get(bit_reader_state_t* state, int count)
 {
-	int result = 0;
-	
-	for (; count; count--)
+	int result;
+
+	if (count <= 0)
+	{
+		return 0;
+	}
+
+	if (state->cache_bits < count)
 	{
-		if (state->cur_bit < 0)
+		bit_read_stream_refill(state);
+		if (state->cache_bits < count)
 		{
-			state->cur_byte = read_stream_get_byte(&state->stream);
-			state->cur_bit = 7;
+			// the missing bits are read as zeros
+			state->stream.eof_reached = TRUE;
+			result = (int)(state->cache >> (64 - count));
+			state->cache = 0;
+			state->cache_bits = 0;
+			return result;
 		}
-	
-		result = (result << 1) | ((state->cur_byte >> state->cur_bit) & 1);
-		state->cur_bit--;
 	}
+
+	result = (int)(state->cache >> (64 - count));
+	state->cache <<= count;
+	state->cache_bits -= count;
+
 	return result;
 }
 
@@ -79,18 +141,37 @@ bit_read_stream_get_long(bit_reader_state_t* state, int count)
 {
 	int64_t result = 0;
 
-	for (; count; count--)
+	for (; count > 32; count -= 32)
 	{
-		if (state->cur_bit < 0)
-		{
-			state->cur_byte = read_stream_get_byte(&state->stream);
-			state->cur_bit = 7;
-		}
+		result = (result << 32) | (uint32_t)bit_read_stream_get(state, 32);
+	}
+
+	return (result << count) | (uint32_t)bit_read_stream_get(state, count);
+}
 
-		result = (result << 1) | ((state->cur_byte >> state->cur_bit) & 1);
-		state->cur_bit--;
+static vod_inline void
+bit_read_stream_skip(bit_reader_state_t* state, int count)
+{
+	if (count <= 0)
+	{
+		return;
 	}
-	return result;
+
+	if (count < state->cache_bits)
+	{
+		state->cache <<= count;
+		state->cache_bits -= count;
+		return;
+	}
+
+	// drop the cache and skip whole bytes in the stream
+	count -= state->cache_bits;
+	state->cache = 0;
+	state->cache_bits = 0;
+
+	read_stream_skip(&state->stream, count >> 3);
+
+	(void)bit_read_stream_get(state, count & 7);
 }
 
 #endif // __BIT_READ_STREAM_H__
@@ -1,109 +1,287 @@
 #include "buffer_pool.h"
 
+// constants
+#define BUFFER_POOL_ALIGNMENT (4096)		// allows using the buffers for reading files with directio
+
 // macros
 #define next_buffer(buf) (*(void**)buf)
 
 // typedefs
-struct buffer_pool_s {
+typedef struct {
 	size_t size;
 	void* head;
+	vod_uint_t count;
+	vod_uint_t max_count;
+	vod_uint_t free_count;
+	vod_uint_t hits;
+	vod_uint_t misses;
+} buffer_pool_size_class_t;
+
+struct buffer_pool_s {
+	buffer_pool_size_class_t classes[BUFFER_POOL_MAX_SIZE_CLASSES];
+	buffer_pool_size_class_t* classes_end;
 };
 
 typedef struct {
-	buffer_pool_t* buffer_pool;
+	buffer_pool_size_class_t* size_class;
 	void* buffer;
 } buffer_pool_cleanup_t;
 
 buffer_pool_t*
-buffer_pool_create(vod_pool_t* pool, vod_log_t* log, size_t buffer_size, size_t count)
+buffer_pool_create(vod_pool_t* pool, vod_log_t* log)
 {
 	buffer_pool_t* buffer_pool;
+
+	buffer_pool = vod_alloc(pool, sizeof(*buffer_pool));
+	if (buffer_pool == NULL) 
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
+			"buffer_pool_create: vod_alloc failed");
+		return NULL;
+	}
+
+	buffer_pool->classes_end = buffer_pool->classes;
+
+	return buffer_pool;
+}
+
+vod_status_t
+buffer_pool_add_size(
+	buffer_pool_t* buffer_pool,
+	vod_pool_t* pool,
+	vod_log_t* log,
+	size_t buffer_size,
+	size_t count,
+	size_t max_count)
+{
+	buffer_pool_size_class_t* size_class;
 	u_char* cur_buffer;
+	size_t left;
 	void* head;
 
 	if ((buffer_size & 0x0F) != 0)
 	{
 		vod_log_error(VOD_LOG_ERR, log, 0,
-			"buffer_pool_create: invalid size %uz must be a multiple of 16", buffer_size);
-		return NULL;
+			"buffer_pool_add_size: invalid size %uz must be a multiple of 16", buffer_size);
+		return VOD_BAD_REQUEST;
 	}
 
-	buffer_pool = vod_alloc(pool, sizeof(*buffer_pool));
-	if (buffer_pool == NULL) 
+	if (max_count < count)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
-			"buffer_pool_create: vod_alloc failed (1)");
-		return NULL;
+		vod_log_error(VOD_LOG_ERR, log, 0,
+			"buffer_pool_add_size: max count %uz smaller than count %uz", max_count, count);
+		return VOD_BAD_REQUEST;
 	}
 
-	cur_buffer = vod_alloc(pool, buffer_size * count);
-	if (cur_buffer == NULL)
+	if (buffer_pool->classes_end >= buffer_pool->classes + BUFFER_POOL_MAX_SIZE_CLASSES)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
-			"buffer_pool_create: vod_alloc failed (2)");
-		return NULL;
+		vod_log_error(VOD_LOG_ERR, log, 0,
+			"buffer_pool_add_size: number of sizes exceeds the limit %d", BUFFER_POOL_MAX_SIZE_CLASSES);
+		return VOD_BAD_REQUEST;
+	}
+
+	// find the insert position, the classes are sorted by size
+	for (size_class = buffer_pool->classes; size_class < buffer_pool->classes_end; size_class++)
+	{
+		if (size_class->size == buffer_size)
+		{
+			vod_log_error(VOD_LOG_ERR, log, 0,
+				"buffer_pool_add_size: duplicate size %uz", buffer_size);
+			return VOD_BAD_REQUEST;
+		}
+
+		if (size_class->size > buffer_size)
+		{
+			break;
+		}
 	}
 
 	head = NULL;
-	for (; count > 0; count--, cur_buffer += buffer_size)
+	if (count > 0)
 	{
-		next_buffer(cur_buffer) = head;
-		head = cur_buffer;
+		cur_buffer = vod_memalign(pool, buffer_size * count, BUFFER_POOL_ALIGNMENT);
+		if (cur_buffer == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
+				"buffer_pool_add_size: vod_memalign failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		for (left = count; left > 0; left--, cur_buffer += buffer_size)
+		{
+			next_buffer(cur_buffer) = head;
+			head = cur_buffer;
+		}
 	}
 
-	buffer_pool->size = buffer_size;
-	buffer_pool->head = head;
+	vod_memmove(size_class + 1, size_class, (u_char*)buffer_pool->classes_end - (u_char*)size_class);
+	buffer_pool->classes_end++;
 
-	return buffer_pool;
+	size_class->size = buffer_size;
+	size_class->head = head;
+	size_class->count = count;
+	size_class->max_count = max_count;
+	size_class->free_count = count;
+	size_class->hits = 0;
+	size_class->misses = 0;
+
+	return VOD_OK;
 }
 
 static void
 buffer_pool_buffer_cleanup(void *data)
 {
 	buffer_pool_cleanup_t* c = data;
-	buffer_pool_t* buffer_pool = c->buffer_pool;
+	buffer_pool_size_class_t* size_class = c->size_class;
 	void* buffer = c->buffer;
 
-	next_buffer(buffer) = buffer_pool->head;
-	buffer_pool->head = buffer;
+	next_buffer(buffer) = size_class->head;
+	size_class->head = buffer;
+	size_class->free_count++;
 }
 
-void*
-buffer_pool_alloc(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t* buffer_size)
+// returns a free buffer of the size class, when the class has no free buffers, a new buffer is allocated 
+// if the class did not reach its max count
+static void*
+buffer_pool_get_buffer(request_context_t* request_context, buffer_pool_size_class_t* size_class)
 {
 	buffer_pool_cleanup_t* buf_cln;
 	vod_pool_cleanup_t* cln;
 	void* result;
 
-	if (buffer_pool == NULL)
-	{
-		return vod_alloc(request_context->pool, *buffer_size);
-	}
-
-	if (buffer_pool->head == NULL)
+	if (size_class->head == NULL && size_class->count >= size_class->max_count)
 	{
-		*buffer_size = buffer_pool->size;
-		return vod_alloc(request_context->pool, *buffer_size);
+		size_class->misses++;
+		return NULL;
 	}
 
 	cln = vod_pool_cleanup_add(request_context->pool, sizeof(buffer_pool_cleanup_t));
 	if (cln == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"buffer_pool_alloc: vod_pool_cleanup_add failed");
+			"buffer_pool_get_buffer: vod_pool_cleanup_add failed");
 		return NULL;
 	}
 
-	result = buffer_pool->head;
-	buffer_pool->head = next_buffer(result);
+	if (size_class->head != NULL)
+	{
+		result = size_class->head;
+		size_class->head = next_buffer(result);
+		size_class->free_count--;
+		size_class->hits++;
+	}
+	else
+	{
+		// Note: the buffer is never freed, it is returned to the pool when the request completes
+		result = vod_heap_memalign(BUFFER_POOL_ALIGNMENT, size_class->size, request_context->log);
+		if (result == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"buffer_pool_get_buffer: vod_heap_memalign failed");
+			return NULL;
+		}
+
+		size_class->count++;
+		size_class->misses++;
+	}
 
 	cln->handler = buffer_pool_buffer_cleanup;
 
 	buf_cln = cln->data;
 	buf_cln->buffer = result;
-	buf_cln->buffer_pool = buffer_pool;
+	buf_cln->size_class = size_class;
 
-	*buffer_size = buffer_pool->size;
+	return result;
+}
+
+void*
+buffer_pool_alloc(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t* buffer_size)
+{
+	buffer_pool_size_class_t* size_class;
+	void* result;
+
+	if (buffer_pool == NULL)
+	{
+		return vod_alloc(request_context->pool, *buffer_size);
+	}
+
+	for (size_class = buffer_pool->classes; size_class + 1 < buffer_pool->classes_end; size_class++)
+	{
+		if (size_class->size >= *buffer_size)
+		{
+			break;
+		}
+	}
+
+	*buffer_size = size_class->size;
+
+	result = buffer_pool_get_buffer(request_context, size_class);
+	if (result == NULL)
+	{
+		return vod_alloc(request_context->pool, *buffer_size);
+	}
 
 	return result;
 }
+
+void*
+buffer_pool_alloc_fit(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t size, size_t* buffer_size)
+{
+	buffer_pool_size_class_t* size_class;
+	void* result;
+
+	if (buffer_pool == NULL)
+	{
+		return NULL;
+	}
+
+	for (size_class = buffer_pool->classes; size_class < buffer_pool->classes_end; size_class++)
+	{
+		if (size_class->size < size)
+		{
+			continue;
+		}
+
+		result = buffer_pool_get_buffer(request_context, size_class);
+		if (result == NULL)
+		{
+			return NULL;
+		}
+
+		*buffer_size = size_class->size;
+		return result;
+	}
+
+	return NULL;
+}
+
+vod_uint_t
+buffer_pool_get_size_class_count(buffer_pool_t* buffer_pool)
+{
+	return buffer_pool->classes_end - buffer_pool->classes;
+}
+
+void
+buffer_pool_get_stats(buffer_pool_t* buffer_pool, vod_uint_t index, buffer_pool_stats_t* stats)
+{
+	buffer_pool_size_class_t* size_class = &buffer_pool->classes[index];
+
+	stats->size = size_class->size;
+	stats->count = size_class->count;
+	stats->max_count = size_class->max_count;
+	stats->free_count = size_class->free_count;
+	stats->hits = size_class->hits;
+	stats->misses = size_class->misses;
+}
+
+void
+buffer_pool_reset_stats(buffer_pool_t* buffer_pool)
+{
+	buffer_pool_size_class_t* size_class;
+
+	for (size_class = buffer_pool->classes; size_class < buffer_pool->classes_end; size_class++)
+	{
+		size_class->hits = 0;
+		size_class->misses = 0;
+	}
+}
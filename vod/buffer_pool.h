@@ -4,8 +4,41 @@
 // includes
 #include "common.h"
 
+// constants
+#define BUFFER_POOL_MAX_SIZE_CLASSES (8)
+
+// typedefs
+typedef struct {
+	size_t size;
+	vod_uint_t count;			// the number of buffers owned by the pool
+	vod_uint_t max_count;
+	vod_uint_t free_count;
+	vod_uint_t hits;
+	vod_uint_t misses;
+} buffer_pool_stats_t;
+
 // functions
-buffer_pool_t* buffer_pool_create(vod_pool_t* pool, vod_log_t* log, size_t buffer_size, size_t count);
+buffer_pool_t* buffer_pool_create(vod_pool_t* pool, vod_log_t* log);
+
+vod_status_t buffer_pool_add_size(
+	buffer_pool_t* buffer_pool, 
+	vod_pool_t* pool, 
+	vod_log_t* log, 
+	size_t buffer_size, 
+	size_t count, 
+	size_t max_count);
+
+// allocates a buffer of the smallest size class that is not smaller than buffer_size, or of the largest size class
+// if there is no such class. buffer_size is updated to the size of the buffer.
 void* buffer_pool_alloc(request_context_t* reqeust_context, buffer_pool_t* buffer_pool, size_t* buffer_size);
 
+// returns a pooled buffer that is not smaller than size, or null if there is no free buffer that fits
+void* buffer_pool_alloc_fit(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t size, size_t* buffer_size);
+
+vod_uint_t buffer_pool_get_size_class_count(buffer_pool_t* buffer_pool);
+
+void buffer_pool_get_stats(buffer_pool_t* buffer_pool, vod_uint_t index, buffer_pool_stats_t* stats);
+
+void buffer_pool_reset_stats(buffer_pool_t* buffer_pool);
+
 #endif // __BUFFER_POOL_H__
@@ -1,77 +1,1489 @@
-// gcc -Wall -g -o repack adts_encoder.c buffer_filter.c mp4_parser.c mp4_to_annexb.c mpegts_encoder.c repackTs.c vod_array.c muxer.c read_cache.c
-// ./repack /opt/kaltura/app/alpha/web/repack.ts 0 10
+// an offline benchmark of the vod library - runs the main request flows (manifest building, segment muxing,
+// encryption and parsing) over a set of media files and reports the time, throughput and allocations of each stage.
+// the library is linked against vod_cli_shim.c instead of the nginx pool / log / time objects, so that no
+// worker, connection or request objects are required.
+//
+// build - configure & make nginx with the module, the object files of the vod library are created under
+// objs/addon. then, from the nginx source directory (a single command):
+//
+//	cc -O2 -o vod_cli -I src/core -I src/event -I src/os/unix -I objs
+//		/path/to/nginx-vod-module/vod/cli/vod_cli_main.c /path/to/nginx-vod-module/vod/cli/vod_cli_shim.c
+//		`ls objs/addon/*/*.o | grep -v /ngx_`
+//		objs/src/core/ngx_array.o objs/src/core/ngx_string.o objs/src/core/ngx_hash.o objs/src/core/ngx_crc32.o
+//		objs/src/core/ngx_rbtree.o objs/src/core/ngx_queue.o objs/src/os/unix/ngx_alloc.o
+//		-lcrypto -lz -lm
+//
+// the libraries of any other optional feature that was detected by configure (e.g. libxml2, ffmpeg) should be
+// added as well, they can be copied from the link command in objs/Makefile.
+//
+// usage:
+//	./vod_cli [-n iterations] [-s segment duration (ms)] [-v] [-x] <file or dir> ...
+//
+// the throughput of the parse stages is measured on the metadata (e.g. the moov atom), the throughput of the
+// other stages is measured on their output.
+//
+// when -x is specified, instead of running the benchmark, the tool writes a sidecar index next to each media file
+// (<file>.vodidx), that holds the metadata in the format of the metadata cache - compacted, and with the sample
+// index of mp4 files. the module loads it when vod_sidecar_index_location is set. the index must be regenerated
+// whenever the media file changes, and it must be generated by a build of the same version / architecture as
+// the servers that use it.
 
 #include <sys/stat.h>
-#include <unistd.h>
+#include <inttypes.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vod_cli_shim.h"
+#include "../media_set.h"
+#include "../language_code.h"
+#include "../filters/filter.h"
+#include "../input/read_cache.h"
+#include "../mp4/mp4_format.h"
+#include "../mp4/mp4_fragment.h"
+#include "../mkv/mkv_format.h"
+#include "../hls/m3u8_builder.h"
+#include "../hls/hls_muxer.h"
+#include "../dash/dash_packager.h"
+#include "../mss/mss_packager.h"
+#include "../sidecar_index.h"
+
+#if (VOD_HAVE_OPENSSL_EVP)
+#include "../hls/aes_cbc_encrypt.h"
+#endif // VOD_HAVE_OPENSSL_EVP
+
+// constants
+#define VOD_CLI_POOL_SIZE (16 * 1024)
+#define VOD_CLI_CACHE_BUFFER_SIZE (256 * 1024)
+#define VOD_CLI_MAX_METADATA_SIZE (128 * 1024 * 1024)
+#define VOD_CLI_MAX_FRAMES_SIZE (16 * 1024 * 1024)
+#define VOD_CLI_SEGMENT_MAX_FRAME_COUNT (64 * 1024)
+#define VOD_CLI_MANIFEST_MAX_FRAME_COUNT (1024 * 1024)
+#define VOD_CLI_DEFAULT_SEGMENT_DURATION (10000)
+#define VOD_CLI_SIDECAR_INDEX_SUFFIX ".vodidx"
+
+#define VOD_CLI_MANIFEST_PARSE_FLAGS (PARSE_FLAG_DURATION_LIMITS_AND_TOTAL_SIZE | PARSE_FLAG_KEY_FRAME_BITRATE | \
+	PARSE_FLAG_CODEC_NAME | PARSE_FLAG_PARSED_EXTRA_DATA_SIZE | PARSE_FLAG_INITIAL_PTS_DELAY)
+#define VOD_CLI_SEGMENT_PARSE_FLAGS (PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_PARSED_EXTRA_DATA | PARSE_FLAG_INITIAL_PTS_DELAY)
+
+#define VOD_CLI_CODECS (VOD_CODEC_FLAG(AVC) | VOD_CODEC_FLAG(HEVC) | VOD_CODEC_FLAG(AAC) | \
+	VOD_CODEC_FLAG(AC3) | VOD_CODEC_FLAG(EAC3) | VOD_CODEC_FLAG(MP3) | VOD_CODEC_FLAG(DTS))
+
+// enums
+enum {
+	STAGE_PARSE_METADATA,
+	STAGE_PARSE_FRAMES,
+	STAGE_HLS_MASTER,
+	STAGE_HLS_INDEX,
+	STAGE_DASH_MANIFEST,
+	STAGE_MSS_MANIFEST,
+	STAGE_HLS_SEGMENT,
+	STAGE_HLS_SEGMENT_AES,
+	STAGE_DASH_FRAGMENT,
+	STAGE_MSS_FRAGMENT,
+
+	STAGE_COUNT
+};
+
+// typedefs
+typedef vod_status_t(*vod_cli_frame_processor_t)(void* context);
+
+typedef struct {
+	uint64_t runs;
+	uint64_t time;			// nsec
+	uint64_t bytes;
+	uint64_t alloc_count;
+	uint64_t alloc_size;
+} vod_cli_stage_stats_t;
+
+typedef struct {
+	uint64_t start;
+	vod_cli_alloc_stats_t alloc;
+} vod_cli_timer_t;
+
+typedef struct {
+	ngx_log_t log;
+	request_context_t request_context;
+	uint32_t iterations;
+	bool_t write_index;
 
-#include "mp4_parser.h"
-#include "read_cache.h"
-#include "muxer.h"
+	// conf
+	segmenter_conf_t segmenter;
+	m3u8_config_t m3u8_config;
+	hls_mpegts_muxer_conf_t mpegts_config;
+	dash_manifest_config_t mpd_config;
+	mss_manifest_config_t mss_config;
 
-static bool_t 
-write_file(void* context, const u_char* buffer, uint32_t size)
+	// stats
+	vod_cli_stage_stats_t file_stats[STAGE_COUNT];
+	vod_cli_stage_stats_t total_stats[STAGE_COUNT];
+} vod_cli_ctx_t;
+
+typedef struct {
+	vod_str_t path;
+	vod_str_t data;
+	uint32_t duration;			// millis
+	uint32_t fragment_tracks_mask[MEDIA_TYPE_COUNT];
+} vod_cli_file_t;
+
+typedef struct {
+	media_set_t media_set;
+	media_sequence_t sequence;
+	media_clip_source_t source;
+	media_clip_t* clip;
+	media_range_t range;
+	read_cache_state_t read_cache_state;
+	uint32_t duration;			// millis
+	size_t metadata_size;
+} vod_cli_media_set_t;
+
+typedef struct {
+	uint64_t size;
+} vod_cli_output_t;
+
+// globals
+static media_format_t* vod_cli_formats[] = {
+	&mp4_format,
+	&mkv_format,
+	NULL
+};
+
+static const char* vod_cli_stage_names[STAGE_COUNT] = {
+	"parse_metadata",
+	"parse_frames",
+	"hls_master",
+	"hls_index",
+	"dash_manifest",
+	"mss_manifest",
+	"hls_segment",
+	"hls_segment_aes",
+	"dash_fragment",
+	"mss_fragment",
+};
+
+static uint32_t vod_cli_all_tracks[MEDIA_TYPE_COUNT] = { 0xffffffff, 0xffffffff, 0xffffffff };
+
+#if (VOD_HAVE_OPENSSL_EVP)
+static u_char vod_cli_encryption_key[AES_BLOCK_SIZE] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+#endif // VOD_HAVE_OPENSSL_EVP
+
+// timing
+static uint64_t
+vod_cli_get_time()
 {
-	int* output_fd = (int*)context;
-	int rc;
-	
-	rc = write(*output_fd, buffer, size);
-	if (rc < size)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+vod_cli_stage_start(vod_cli_timer_t* timer)
+{
+	timer->alloc = vod_cli_alloc_stats;
+	timer->start = vod_cli_get_time();
+}
+
+static void
+vod_cli_stage_end(vod_cli_ctx_t* ctx, vod_cli_timer_t* timer, int stage, uint64_t bytes)
+{
+	vod_cli_stage_stats_t* stats = &ctx->file_stats[stage];
+
+	stats->time += vod_cli_get_time() - timer->start;
+	stats->runs++;
+	stats->bytes += bytes;
+	stats->alloc_count += vod_cli_alloc_stats.count - timer->alloc.count;
+	stats->alloc_size += vod_cli_alloc_stats.size - timer->alloc.size;
+}
+
+// io
+static vod_status_t
+vod_cli_write(void* context, u_char* buffer, uint32_t size)
+{
+	vod_cli_output_t* output = context;
+
+	output->size += size;
+
+	return VOD_OK;
+}
+
+static void
+vod_cli_get_buffer(vod_cli_file_t* file, uint64_t offset, vod_str_t* result)
+{
+	if (offset >= file->data.len)
+	{
+		result->data = file->data.data + file->data.len;
+		result->len = 0;
+		return;
+	}
+
+	// the whole file is in memory, every read request returns everything from the requested offset
+	result->data = file->data.data + offset;
+	result->len = file->data.len - offset;
+}
+
+static vod_status_t
+vod_cli_load_file(vod_cli_ctx_t* ctx, vod_cli_file_t* file)
+{
+	struct stat st;
+	ssize_t rc;
+	size_t pos;
+	int fd;
+
+	fd = open((char*)file->path.data, O_RDONLY);
+	if (fd == -1)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, ngx_errno,
+			"vod_cli_load_file: open \"%V\" failed", &file->path);
+		return VOD_NOT_FOUND;
+	}
+
+	if (fstat(fd, &st) == -1)
 	{
-		return FALSE;
+		vod_log_error(VOD_LOG_ERR, &ctx->log, ngx_errno,
+			"vod_cli_load_file: fstat \"%V\" failed", &file->path);
+		close(fd);
+		return VOD_UNEXPECTED;
 	}
-	
-	return TRUE;
+
+	file->data.len = st.st_size;
+	file->data.data = malloc(file->data.len + VOD_BUFFER_PADDING_SIZE);
+	if (file->data.data == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, 0,
+			"vod_cli_load_file: malloc failed, size=%uz", file->data.len);
+		close(fd);
+		return VOD_ALLOC_FAILED;
+	}
+
+	for (pos = 0; pos < file->data.len; pos += rc)
+	{
+		rc = read(fd, file->data.data + pos, file->data.len - pos);
+		if (rc <= 0)
+		{
+			vod_log_error(VOD_LOG_ERR, &ctx->log, ngx_errno,
+				"vod_cli_load_file: read \"%V\" failed", &file->path);
+			free(file->data.data);
+			close(fd);
+			return VOD_UNEXPECTED;
+		}
+	}
+
+	close(fd);
+
+	vod_memzero(file->data.data + file->data.len, VOD_BUFFER_PADDING_SIZE);
+
+	return VOD_OK;
 }
 
-static size_t 
-read_file(void* context, u_char *buf, size_t size, off_t offset)
+// parsing
+static vod_status_t
+vod_cli_read_metadata(
+	vod_cli_ctx_t* ctx,
+	vod_cli_file_t* file,
+	media_format_t** result_format,
+	media_format_read_metadata_result_t* metadata)
 {
-	int* input_fd = (int*)context;
-	
-	return pread(*input_fd, buf, size, offset);
+	request_context_t* request_context = &ctx->request_context;
+	media_format_t** cur_format_ptr;
+	media_format_t* format;
+	vod_status_t rc;
+	vod_str_t buffer;
+	uint64_t offset;
+	void* reader_context;
+
+	// identify the format
+	for (cur_format_ptr = vod_cli_formats; ; cur_format_ptr++)
+	{
+		format = *cur_format_ptr;
+		if (format == NULL)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_read_metadata: failed to identify the file format of %V", &file->path);
+			return VOD_BAD_DATA;
+		}
+
+		rc = format->init_metadata_reader(
+			request_context,
+			&file->data,
+			VOD_CLI_MAX_METADATA_SIZE,
+			&reader_context);
+		if (rc == VOD_NOT_FOUND)
+		{
+			continue;
+		}
+
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_read_metadata: init_metadata_reader(%V) failed %i", &format->name, rc);
+			return rc;
+		}
+
+		break;
+	}
+
+	// read the metadata
+	offset = 0;
+	for (;;)
+	{
+		vod_cli_get_buffer(file, offset, &buffer);
+
+		rc = format->read_metadata(
+			reader_context,
+			offset,
+			&buffer,
+			metadata);
+		if (rc == VOD_OK)
+		{
+			break;
+		}
+
+		if (rc != VOD_AGAIN)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_read_metadata: read_metadata(%V) failed %i", &format->name, rc);
+			return rc;
+		}
+
+		offset = metadata->read_req.read_offset;
+	}
+
+	*result_format = format;
+	return VOD_OK;
 }
 
-int 
-main(int argc, const char *argv[])
+static vod_status_t
+vod_cli_parse(
+	vod_cli_ctx_t* ctx,
+	vod_cli_file_t* file,
+	uint32_t* tracks_mask,
+	uint32_t parse_type,
+	uint32_t segment_index,
+	vod_cli_media_set_t* result)
 {
-	read_cache_state_t read_cache_state;
-	hls_muxer_state_t muxer;
-	media_track_array_t track_array;
-	input_params_t input_params;
-	int output_fd;
-	int input_fd;
+	media_format_read_metadata_result_t metadata;
+	get_clip_ranges_params_t get_ranges_params;
+	get_clip_ranges_result_t clip_ranges;
+	media_format_read_request_t read_req;
+	media_base_metadata_t* base_metadata;
+	media_parse_params_t parse_params;
+	request_context_t* request_context = &ctx->request_context;
+	media_clip_source_t* source = &result->source;
+	media_sequence_t* sequence = &result->sequence;
+	media_format_t* format;
+	media_set_t* media_set = &result->media_set;
+	media_track_t* cur_track;
+	vod_status_t rc;
+	vod_str_t buffer;
+	uint32_t duration;
+	size_t i;
+
+	vod_memzero(result, sizeof(*result));
+
+	// a single sequence with a single source clip, same as a local / remote request without a mapping
+	source->base.type = MEDIA_CLIP_SOURCE;
+	source->clip_to = ULLONG_MAX;
+	vod_memset(source->tracks_mask, 0xff, sizeof(source->tracks_mask));
+	source->uri = file->path;
+	source->stripped_uri = file->path;
+	source->mapped_uri = file->path;
+	source->sequence = sequence;
+
+	result->clip = &source->base;
+
+	sequence->clips = &result->clip;
+	sequence->stripped_uri = file->path;
+	sequence->mapped_uri = file->path;
+
+	media_set->segmenter_conf = &ctx->segmenter;
+	media_set->type = MEDIA_SET_VOD;
+	media_set->uri = file->path;
+	media_set->sequences = sequence;
+	media_set->sequences_end = sequence + 1;
+	media_set->sequence_count = 1;
+	media_set->sources_head = source;
+	media_set->timing.total_count = 1;
+	media_set->clip_count = 1;
+	media_set->presentation_end = TRUE;
+
+	read_cache_init(&result->read_cache_state, request_context, VOD_CLI_CACHE_BUFFER_SIZE, 0);
+
+	rc = vod_cli_read_metadata(ctx, file, &format, &metadata);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	for (i = 0; i < metadata.part_count; i++)
+	{
+		result->metadata_size += metadata.parts[i].len;
+	}
+
+	// parse the metadata
+	vod_memzero(&parse_params, sizeof(parse_params));
+	parse_params.required_tracks_mask = tracks_mask;
+	parse_params.clip_to = UINT_MAX;
+	parse_params.max_frames_size = VOD_CLI_MAX_FRAMES_SIZE;
+	parse_params.parse_type = parse_type;
+	parse_params.codecs_mask = VOD_CLI_CODECS;
+	parse_params.source = source;
+
+	rc = format->parse_metadata(
+		request_context,
+		&parse_params,
+		metadata.parts,
+		metadata.part_count,
+		&base_metadata);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_parse: parse_metadata(%V) failed %i", &format->name, rc);
+		return rc;
+	}
+
+	if (base_metadata->tracks.nelts == 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	duration = rescale_time(base_metadata->duration, base_metadata->timescale, 1000);
+	result->duration = duration;
+
+	// get the range, same as ngx_http_vod_init_parse_params_frames
+	if (segment_index == INVALID_SEGMENT_INDEX)
+	{
+		request_context->simulation_only = TRUE;
+
+		parse_params.max_frame_count = VOD_CLI_MANIFEST_MAX_FRAME_COUNT;
+		result->range.timescale = 1000;
+		result->range.end = ULLONG_MAX;
+		parse_params.range = &result->range;
+	}
+	else
+	{
+		request_context->simulation_only = FALSE;
+
+		parse_params.max_frame_count = VOD_CLI_SEGMENT_MAX_FRAME_COUNT;
+
+		vod_memzero(&get_ranges_params, sizeof(get_ranges_params));
+		get_ranges_params.request_context = request_context;
+		get_ranges_params.conf = &ctx->segmenter;
+		get_ranges_params.segment_index = segment_index;
+		get_ranges_params.last_segment_end = ULLONG_MAX;
+		get_ranges_params.allow_last_segment = TRUE;
+		get_ranges_params.timing.durations = &duration;
+		get_ranges_params.timing.total_count = 1;
+		get_ranges_params.timing.total_duration = duration;
+		get_ranges_params.timing.times = &get_ranges_params.timing.first_time;
+		get_ranges_params.timing.original_times = &get_ranges_params.timing.first_time;
+
+		rc = segmenter_get_start_end_ranges_no_discontinuity(
+			&get_ranges_params,
+			&clip_ranges);
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_parse: segmenter_get_start_end_ranges_no_discontinuity failed %i", rc);
+			return rc;
+		}
+
+		if (clip_ranges.clip_count == 0)
+		{
+			return VOD_NOT_FOUND;
+		}
+
+		media_set->initial_segment_clip_relative_index = clip_ranges.clip_relative_segment_index;
+		media_set->segment_start_time = clip_ranges.clip_ranges->start;
+		if (clip_ranges.clip_ranges->end == ULLONG_MAX)
+		{
+			media_set->segment_duration = duration - clip_ranges.clip_ranges->start;
+		}
+		else
+		{
+			media_set->segment_duration = clip_ranges.clip_ranges->end - clip_ranges.clip_ranges->start;
+		}
+
+		parse_params.range = clip_ranges.clip_ranges;
+	}
+
+	// read the frames
+	rc = format->read_frames(
+		request_context,
+		base_metadata,
+		&parse_params,
+		&ctx->segmenter,
+		&result->read_cache_state,
+		NULL,
+		&read_req,
+		&source->track_array);
+	while (rc == VOD_AGAIN)
+	{
+		vod_cli_get_buffer(file, read_req.read_offset, &buffer);
+
+		rc = format->read_frames(
+			request_context,
+			base_metadata,
+			NULL,
+			&ctx->segmenter,
+			&result->read_cache_state,
+			&buffer,
+			&read_req,
+			&source->track_array);
+	}
+
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_parse: read_frames(%V) failed %i", &format->name, rc);
+		return rc;
+	}
+
+	for (cur_track = source->track_array.first_track;
+		cur_track < source->track_array.last_track;
+		cur_track++)
+	{
+		cur_track->file_info.source = source;
+		cur_track->file_info.uri = file->path;
+	}
+
+	rc = filter_init_filtered_clips(
+		request_context,
+		media_set,
+		(parse_type & PARSE_FLAG_FRAMES_DURATION) != 0);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_parse: filter_init_filtered_clips failed %i", rc);
+		return rc;
+	}
+
+	if (media_set->total_track_count == 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+vod_cli_parse_segment(
+	vod_cli_ctx_t* ctx,
+	vod_cli_file_t* file,
+	uint32_t* tracks_mask,
+	uint32_t segment_index,
+	vod_cli_media_set_t* result)
+{
+	vod_cli_timer_t timer;
+	vod_status_t rc;
+
+	vod_cli_stage_start(&timer);
+
+	rc = vod_cli_parse(ctx, file, tracks_mask, VOD_CLI_SEGMENT_PARSE_FLAGS, segment_index, result);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_PARSE_FRAMES, result->metadata_size);
+
+	return VOD_OK;
+}
+
+// frame processing, same as ngx_http_vod_process_media_frames with a reader that completes synchronously
+static vod_status_t
+vod_cli_process_frames(
+	vod_cli_ctx_t* ctx,
+	vod_cli_file_t* file,
+	read_cache_state_t* read_cache_state,
+	vod_cli_frame_processor_t processor,
+	void* processor_state)
+{
+	read_cache_get_read_buffer_t read_buf;
+	vod_status_t rc;
+	vod_buf_t buf;
+	vod_str_t buffer;
+
+	rc = read_cache_allocate_buffer_slots(read_cache_state, 0);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	for (;;)
+	{
+		rc = processor(processor_state);
+		if (rc != VOD_AGAIN)
+		{
+			return rc;
+		}
+
+		read_cache_get_read_buffer(read_cache_state, &read_buf);
+
+		vod_cli_get_buffer(file, read_buf.offset, &buffer);
+		if (buffer.len == 0)
+		{
+			vod_log_error(VOD_LOG_ERR, &ctx->log, 0,
+				"vod_cli_process_frames: read offset %uL exceeds the file size %uz", read_buf.offset, file->data.len);
+			return VOD_BAD_DATA;
+		}
+
+		// point the cache buffer to the file data instead of copying it
+		vod_memzero(&buf, sizeof(buf));
+		buf.start = buf.pos = buffer.data;
+		buf.last = buf.end = buffer.data + vod_min(buffer.len, read_buf.size);
+
+		read_cache_read_completed(read_cache_state, &buf);
+	}
+}
+
+// stages
+static vod_status_t
+vod_cli_run_manifests(vod_cli_ctx_t* ctx, vod_cli_file_t* file)
+{
+	hls_encryption_params_t encryption_params;
+	dash_manifest_extensions_t extensions;
+	vod_cli_media_set_t state;
+	request_context_t* request_context = &ctx->request_context;
+	vod_cli_timer_t timer;
+	vod_status_t rc;
+	vod_str_t base_url = vod_null_string;
+	vod_str_t result;
+
+	vod_cli_stage_start(&timer);
+
+	rc = vod_cli_parse(ctx, file, vod_cli_all_tracks, VOD_CLI_MANIFEST_PARSE_FLAGS, INVALID_SEGMENT_INDEX, &state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_PARSE_METADATA, state.metadata_size);
+
+	// save the info required for the segment stages
+	file->duration = state.duration;
+
+	vod_memzero(file->fragment_tracks_mask, sizeof(file->fragment_tracks_mask));
+	if (state.media_set.track_count[MEDIA_TYPE_VIDEO] > 0)
+	{
+		file->fragment_tracks_mask[MEDIA_TYPE_VIDEO] = 1;
+	}
+	else
+	{
+		file->fragment_tracks_mask[MEDIA_TYPE_AUDIO] = 1;
+	}
+
+	// hls
+	vod_cli_stage_start(&timer);
+
+	rc = m3u8_builder_build_master_playlist(
+		request_context,
+		&ctx->m3u8_config,
+		HLS_ENC_NONE,
+		&base_url,
+		&state.media_set,
+		&result);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_manifests: m3u8_builder_build_master_playlist failed %i", rc);
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_HLS_MASTER, result.len);
+
+	vod_memzero(&encryption_params, sizeof(encryption_params));
+	encryption_params.type = HLS_ENC_NONE;
+
+	vod_cli_stage_start(&timer);
+
+	rc = m3u8_builder_build_index_playlist(
+		request_context,
+		&ctx->m3u8_config,
+		&base_url,
+		&base_url,
+		&encryption_params,
+		HLS_CONTAINER_MPEGTS,
+		&state.media_set,
+		FALSE,
+		&result);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_manifests: m3u8_builder_build_index_playlist failed %i", rc);
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_HLS_INDEX, result.len);
+
+	// dash
+	vod_memzero(&extensions, sizeof(extensions));
+
+	vod_cli_stage_start(&timer);
+
+	rc = dash_packager_build_mpd(
+		request_context,
+		&ctx->mpd_config,
+		&base_url,
+		&state.media_set,
+		&extensions,
+		&result);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_manifests: dash_packager_build_mpd failed %i", rc);
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_DASH_MANIFEST, result.len);
+
+	// mss
+	vod_cli_stage_start(&timer);
+
+	rc = mss_packager_build_manifest(
+		request_context,
+		&ctx->mss_config,
+		&state.media_set,
+		0,
+		NULL,
+		NULL,
+		&result);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_manifests: mss_packager_build_manifest failed %i", rc);
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, STAGE_MSS_MANIFEST, result.len);
+
+	return VOD_OK;
+}
+
+static vod_status_t
+vod_cli_run_hls_segment(vod_cli_ctx_t* ctx, vod_cli_file_t* file, uint32_t segment_index, int stage)
+{
+	hls_encryption_params_t encryption_params;
+	hls_muxer_state_t* muxer;
+	vod_cli_media_set_t state;
+	request_context_t* request_context = &ctx->request_context;
+	write_callback_t write_callback;
+	vod_cli_output_t output;
+	vod_cli_timer_t timer;
+	vod_status_t rc;
+	vod_str_t header;
+	size_t response_size;
+	void* write_context;
+#if (VOD_HAVE_OPENSSL_EVP)
+	aes_cbc_encrypt_context_t* encrypt_context;
+#endif // VOD_HAVE_OPENSSL_EVP
+
+	rc = vod_cli_parse_segment(ctx, file, vod_cli_all_tracks, segment_index, &state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_cli_stage_start(&timer);
+
+	output.size = 0;
+	write_callback = vod_cli_write;
+	write_context = &output;
+
+	vod_memzero(&encryption_params, sizeof(encryption_params));
+	encryption_params.type = HLS_ENC_NONE;
+
+#if (VOD_HAVE_OPENSSL_EVP)
+	if (stage == STAGE_HLS_SEGMENT_AES)
+	{
+		encryption_params.type = HLS_ENC_AES_128;
+		encryption_params.key = vod_cli_encryption_key;
+		encryption_params.iv = encryption_params.iv_buf;
+		encryption_params.iv_buf[12] = (segment_index >> 24) & 0xff;
+		encryption_params.iv_buf[13] = (segment_index >> 16) & 0xff;
+		encryption_params.iv_buf[14] = (segment_index >> 8) & 0xff;
+		encryption_params.iv_buf[15] = segment_index & 0xff;
+
+		rc = aes_cbc_encrypt_init(
+			&encrypt_context,
+			request_context,
+			vod_cli_write,
+			&output,
+			NULL,
+			TRUE,
+			encryption_params.key,
+			encryption_params.iv);
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_run_hls_segment: aes_cbc_encrypt_init failed %i", rc);
+			return rc;
+		}
+
+		write_callback = (write_callback_t)aes_cbc_encrypt_write;
+		write_context = encrypt_context;
+	}
+#endif // VOD_HAVE_OPENSSL_EVP
+
+	rc = hls_muxer_init_segment(
+		request_context,
+		&ctx->mpegts_config,
+		&encryption_params,
+		segment_index,
+		&state.media_set,
+		write_callback,
+		write_context,
+		FALSE,
+		&response_size,
+		&header,
+		&muxer);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_hls_segment: hls_muxer_init_segment failed %i", rc);
+		return rc;
+	}
+
+	if (header.len > 0)
+	{
+		rc = write_callback(write_context, header.data, header.len);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	rc = vod_cli_process_frames(ctx, file, &state.read_cache_state, (vod_cli_frame_processor_t)hls_muxer_process, muxer);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_hls_segment: hls_muxer_process failed %i", rc);
+		return rc;
+	}
+
+	if (write_callback != vod_cli_write)
+	{
+		// flush the encryption
+		rc = write_callback(write_context, NULL, 0);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	vod_cli_stage_end(ctx, &timer, stage, output.size);
+
+	return VOD_OK;
+}
+
+static vod_status_t
+vod_cli_run_fragment(vod_cli_ctx_t* ctx, vod_cli_file_t* file, uint32_t segment_index, int stage)
+{
+	dash_fragment_header_extensions_t extensions;
+	fragment_writer_state_t* writer;
+	vod_cli_media_set_t state;
+	request_context_t* request_context = &ctx->request_context;
+	vod_cli_output_t output;
+	vod_cli_timer_t timer;
+	vod_status_t rc;
+	vod_str_t header;
+	size_t total_size;
+
+	rc = vod_cli_parse_segment(ctx, file, file->fragment_tracks_mask, segment_index, &state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_cli_stage_start(&timer);
+
+	output.size = 0;
+
+	if (stage == STAGE_DASH_FRAGMENT)
+	{
+		vod_memzero(&extensions, sizeof(extensions));
+
+		rc = dash_packager_build_fragment_header(
+			request_context,
+			&state.media_set,
+			segment_index,
+			0,
+			&extensions,
+			FALSE,
+			&header,
+			&total_size);
+	}
+	else
+	{
+		rc = mss_packager_build_fragment_header(
+			request_context,
+			&state.media_set,
+			segment_index,
+			0,
+			NULL,
+			NULL,
+			FALSE,
+			&header,
+			&total_size);
+	}
+
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_fragment: build_fragment_header(%s) failed %i", vod_cli_stage_names[stage], rc);
+		return rc;
+	}
+
+	vod_cli_write(&output, header.data, header.len);
+
+	rc = mp4_fragment_frame_writer_init(
+		request_context,
+		state.media_set.sequences,
+		vod_cli_write,
+		NULL,
+		&output,
+		FALSE,
+		&writer);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_fragment: mp4_fragment_frame_writer_init failed %i", rc);
+		return rc;
+	}
+
+	rc = vod_cli_process_frames(ctx, file, &state.read_cache_state, (vod_cli_frame_processor_t)mp4_fragment_frame_writer_process, writer);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_run_fragment: mp4_fragment_frame_writer_process failed %i", rc);
+		return rc;
+	}
+
+	vod_cli_stage_end(ctx, &timer, stage, output.size);
+
+	return VOD_OK;
+}
+
+typedef vod_status_t(*vod_cli_segment_stage_t)(vod_cli_ctx_t* ctx, vod_cli_file_t* file, uint32_t segment_index, int stage);
+
+// runs a stage on a fresh pool, so that the memory of the request is released when it completes
+static vod_status_t
+vod_cli_run_segment_stage(
+	vod_cli_ctx_t* ctx,
+	vod_cli_file_t* file,
+	uint32_t segment_index,
+	vod_cli_segment_stage_t handler,
+	int stage)
+{
+	vod_status_t rc;
+
+	ctx->request_context.pool = ngx_create_pool(VOD_CLI_POOL_SIZE, &ctx->log);
+	if (ctx->request_context.pool == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	rc = handler(ctx, file, segment_index, stage);
+
+	ngx_destroy_pool(ctx->request_context.pool);
+	ctx->request_context.pool = NULL;
+
+	if (rc == VOD_NOT_FOUND)
+	{
+		// no frames in this segment
+		return VOD_OK;
+	}
 
-	vod_memzero(&track_array, sizeof(track_array));
-	input_params.start_sec = atoi(argv[2]);
-	input_params.end_sec = atoi(argv[3]);
+	return rc;
+}
 
-	input_fd = open("/web/content/r70v1/entry/data/80/655/0_vriq23ct_0_g0vnoj5i_1.mp4", O_RDONLY);
-	if (input_fd == -1)
+static vod_status_t
+vod_cli_run_file(vod_cli_ctx_t* ctx, vod_cli_file_t* file)
+{
+	uint32_t segment_count;
+	uint32_t segment_index;
+	uint32_t iteration;
+	vod_status_t rc;
+
+	for (iteration = 0; iteration < ctx->iterations; iteration++)
 	{
+		ctx->request_context.pool = ngx_create_pool(VOD_CLI_POOL_SIZE, &ctx->log);
+		if (ctx->request_context.pool == NULL)
+		{
+			return VOD_ALLOC_FAILED;
+		}
+
+		rc = vod_cli_run_manifests(ctx, file);
+
+		ngx_destroy_pool(ctx->request_context.pool);
+		ctx->request_context.pool = NULL;
+
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		segment_count = ctx->segmenter.get_segment_count(&ctx->segmenter, file->duration);
+		if (segment_count == INVALID_SEGMENT_COUNT)
+		{
+			vod_log_error(VOD_LOG_ERR, &ctx->log, 0,
+				"vod_cli_run_file: segment count is invalid, duration=%uD", file->duration);
+			return VOD_BAD_DATA;
+		}
+
+		for (segment_index = 0; segment_index < segment_count; segment_index++)
+		{
+			rc = vod_cli_run_segment_stage(ctx, file, segment_index, vod_cli_run_hls_segment, STAGE_HLS_SEGMENT);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+#if (VOD_HAVE_OPENSSL_EVP)
+			rc = vod_cli_run_segment_stage(ctx, file, segment_index, vod_cli_run_hls_segment, STAGE_HLS_SEGMENT_AES);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+#endif // VOD_HAVE_OPENSSL_EVP
+
+			rc = vod_cli_run_segment_stage(ctx, file, segment_index, vod_cli_run_fragment, STAGE_DASH_FRAGMENT);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			rc = vod_cli_run_segment_stage(ctx, file, segment_index, vod_cli_run_fragment, STAGE_MSS_FRAGMENT);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+		}
 	}
 
-	output_fd = creat(argv[1], S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (output_fd == -1)
+	return VOD_OK;
+}
+
+// sidecar index
+static vod_status_t
+vod_cli_write_index(vod_cli_ctx_t* ctx, vod_cli_file_t* file, size_t* index_size)
+{
+	media_format_read_metadata_result_t metadata;
+	sidecar_index_header_t header;
+	request_context_t* request_context = &ctx->request_context;
+	media_format_t* format;
+	vod_str_t* parts;
+	vod_status_t rc;
+	uint32_t part_header[2];
+	uint32_t part_count;
+	uint32_t i;
+	size_t part_size;
+	char temp_path[PATH_MAX];
+	char path[PATH_MAX];
+	FILE* fp;
+
+	rc = vod_cli_read_metadata(ctx, file, &format, &metadata);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// same as the parts saved to the metadata cache - compacted, with an additional sample index part
+	parts = vod_alloc(request_context->pool, sizeof(parts[0]) * (metadata.part_count + 1));
+	if (parts == NULL)
 	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_cli_write_index: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
 	}
-	
-	if (!parse_mpeg_file(read_file, &input_fd, &track_array, &input_params))
+
+	vod_memcpy(parts, metadata.parts, sizeof(parts[0]) * metadata.part_count);
+	part_count = metadata.part_count;
+
+	if (format->compact_metadata != NULL)
 	{
+		rc = format->compact_metadata(
+			request_context,
+			metadata.parts,
+			metadata.part_count,
+			parts);
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_write_index: compact_metadata(%V) failed %i", &format->name, rc);
+			return rc;
+		}
 	}
 
-	if (!read_cache_init(&read_cache_state, read_file, &input_fd))
+	if (format->build_metadata_index != NULL)
 	{
+		rc = format->build_metadata_index(
+			request_context,
+			parts,
+			metadata.part_count,
+			&parts[part_count]);
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"vod_cli_write_index: build_metadata_index(%V) failed %i", &format->name, rc);
+			return rc;
+		}
+
+		part_count++;
 	}
 
-	if (!hls_muxer_init(&muxer, &track_array, &read_cache_state, write_file, &output_fd))
+	// write to a temp file and rename, so that the server never reads a partially written index
+	snprintf(path, sizeof(path), "%s" VOD_CLI_SIDECAR_INDEX_SUFFIX, (char*)file->path.data);
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	fp = fopen(temp_path, "wb");
+	if (fp == NULL)
 	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, ngx_errno,
+			"vod_cli_write_index: fopen \"%s\" failed", temp_path);
+		return VOD_UNEXPECTED;
 	}
-	
-	hls_muxer_process(&muxer);
-	
-	close(output_fd);
-	close(input_fd);
+
+	header.magic = SIDECAR_INDEX_MAGIC;
+	header.version = SIDECAR_INDEX_VERSION;
+	header.size_t_size = sizeof(size_t);
+
+	part_header[0] = format->id;
+	part_header[1] = part_count;
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(part_header, sizeof(part_header), 1, fp);
+	*index_size = sizeof(header) + sizeof(part_header);
+
+	for (i = 0; i < part_count; i++)
+	{
+		part_size = parts[i].len;
+		fwrite(&part_size, sizeof(part_size), 1, fp);
+		*index_size += sizeof(part_size);
+	}
+
+	for (i = 0; i < part_count; i++)
+	{
+		fwrite(parts[i].data, 1, parts[i].len, fp);
+		*index_size += parts[i].len;
+	}
+
+	if (ferror(fp) || fclose(fp) != 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, ngx_errno,
+			"vod_cli_write_index: write \"%s\" failed", temp_path);
+		unlink(temp_path);
+		return VOD_UNEXPECTED;
+	}
+
+	if (rename(temp_path, path) != 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, ngx_errno,
+			"vod_cli_write_index: rename \"%s\" failed", temp_path);
+		unlink(temp_path);
+		return VOD_UNEXPECTED;
+	}
+
+	return VOD_OK;
+}
+
+static void
+vod_cli_index_file(vod_cli_ctx_t* ctx, vod_cli_file_t* file)
+{
+	vod_status_t rc;
+	size_t index_size = 0;
+
+	ctx->request_context.pool = ngx_create_pool(VOD_CLI_POOL_SIZE, &ctx->log);
+	if (ctx->request_context.pool == NULL)
+	{
+		return;
+	}
+
+	rc = vod_cli_write_index(ctx, file, &index_size);
+
+	ngx_destroy_pool(ctx->request_context.pool);
+	ctx->request_context.pool = NULL;
+
+	if (rc != VOD_OK)
+	{
+		printf("%s: failed to write index %" PRIdPTR "\n", (char*)file->path.data, (intptr_t)rc);
+		return;
+	}
+
+	printf("%s: wrote index, %zu bytes\n", (char*)file->path.data, index_size);
+}
+
+// reporting
+static void
+vod_cli_print_stats(vod_cli_stage_stats_t* stats)
+{
+	vod_cli_stage_stats_t* cur;
+	int stage;
+
+	printf("  %-16s %8s %12s %12s %10s %12s %14s\n",
+		"stage", "runs", "total ms", "avg us", "MB/s", "allocs/run", "alloc KB/run");
+
+	for (stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		cur = &stats[stage];
+		if (cur->runs == 0)
+		{
+			continue;
+		}
+
+		printf("  %-16s %8" PRIu64 " %12.3f %12.1f %10.1f %12.1f %14.1f\n",
+			vod_cli_stage_names[stage],
+			cur->runs,
+			cur->time / 1e6,
+			cur->time / 1e3 / cur->runs,
+			cur->time > 0 ? cur->bytes * 1e3 / cur->time : 0.,
+			(double)cur->alloc_count / cur->runs,
+			cur->alloc_size / 1024. / cur->runs);
+	}
+}
+
+static void
+vod_cli_bench_file(vod_cli_ctx_t* ctx, char* path)
+{
+	vod_cli_file_t file;
+	vod_status_t rc;
+	int stage;
+
+	vod_memzero(&file, sizeof(file));
+	file.path.data = (u_char*)path;
+	file.path.len = vod_strlen(path);
+
+	rc = vod_cli_load_file(ctx, &file);
+	if (rc != VOD_OK)
+	{
+		return;
+	}
+
+	if (ctx->write_index)
+	{
+		vod_cli_index_file(ctx, &file);
+		free(file.data.data);
+		return;
+	}
+
+	vod_memzero(ctx->file_stats, sizeof(ctx->file_stats));
+
+	rc = vod_cli_run_file(ctx, &file);
+
+	free(file.data.data);
+
+	if (rc != VOD_OK)
+	{
+		printf("%s: failed %" PRIdPTR "\n", path, (intptr_t)rc);
+		return;
+	}
+
+	printf("%s (%.1f MB, %" PRIu32 " ms)\n", path, file.data.len / 1048576., file.duration);
+	vod_cli_print_stats(ctx->file_stats);
+
+	for (stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		ctx->total_stats[stage].runs += ctx->file_stats[stage].runs;
+		ctx->total_stats[stage].time += ctx->file_stats[stage].time;
+		ctx->total_stats[stage].bytes += ctx->file_stats[stage].bytes;
+		ctx->total_stats[stage].alloc_count += ctx->file_stats[stage].alloc_count;
+		ctx->total_stats[stage].alloc_size += ctx->file_stats[stage].alloc_size;
+	}
+}
+
+static void
+vod_cli_bench_path(vod_cli_ctx_t* ctx, char* path)
+{
+	struct dirent* entry;
+	struct stat st;
+	char file_path[PATH_MAX];
+	size_t len;
+	DIR* dir;
+
+	if (stat(path, &st) == -1)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, ngx_errno,
+			"vod_cli_bench_path: stat \"%s\" failed", path);
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		vod_cli_bench_file(ctx, path);
+		return;
+	}
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, ngx_errno,
+			"vod_cli_bench_path: opendir \"%s\" failed", path);
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		len = vod_strlen(entry->d_name);
+		if (len >= sizeof(VOD_CLI_SIDECAR_INDEX_SUFFIX) - 1 &&
+			vod_strcmp(entry->d_name + len - (sizeof(VOD_CLI_SIDECAR_INDEX_SUFFIX) - 1), VOD_CLI_SIDECAR_INDEX_SUFFIX) == 0)
+		{
+			continue;
+		}
+
+		snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
+
+		if (stat(file_path, &st) == -1 || !S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+
+		vod_cli_bench_file(ctx, file_path);
+	}
+
+	closedir(dir);
+}
+
+// init
+static vod_status_t
+vod_cli_init_conf(vod_cli_ctx_t* ctx, vod_pool_t* pool, uintptr_t segment_duration)
+{
+	vod_status_t rc;
+
+	ctx->segmenter.segment_duration = segment_duration;
+	ctx->segmenter.live_window_duration = 30000;
+	ctx->segmenter.get_segment_count = segmenter_get_segment_count_last_short;
+	ctx->segmenter.get_segment_durations = segmenter_get_segment_durations_estimate;
+	ctx->segmenter.manifest_duration_policy = MDP_MAX;
+	ctx->segmenter.gop_look_ahead = 1000;
+	ctx->segmenter.gop_look_behind = 10000;
+
+	rc = segmenter_init_config(&ctx->segmenter, pool);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, 0,
+			"vod_cli_init_conf: segmenter_init_config failed %i", rc);
+		return rc;
+	}
+
+	// the defaults of the nginx configuration
+	ctx->m3u8_config.container_format = HLS_CONTAINER_AUTO;
+	ctx->m3u8_config.output_iframes_playlist = TRUE;
+	ngx_str_set(&ctx->m3u8_config.index_file_name_prefix, "index");
+	ngx_str_set(&ctx->m3u8_config.iframes_file_name_prefix, "iframes");
+	ngx_str_set(&ctx->m3u8_config.segment_file_name_prefix, "seg");
+	ngx_str_set(&ctx->m3u8_config.init_file_name_prefix, "init");
+	ngx_str_set(&ctx->m3u8_config.encryption_key_file_name, "encryption");
+	m3u8_builder_init_config(&ctx->m3u8_config, ctx->segmenter.max_segment_duration, HLS_ENC_NONE);
+
+	ctx->mpegts_config.align_frames = TRUE;
+
+	ngx_str_set(&ctx->mpd_config.profiles, "urn:mpeg:dash:profile:isoff-main:2011");
+	ngx_str_set(&ctx->mpd_config.init_file_name_prefix, "init");
+	ngx_str_set(&ctx->mpd_config.fragment_file_name_prefix, "fragment");
+	ngx_str_set(&ctx->mpd_config.subtitle_file_name_prefix, "sub");
+	ctx->mpd_config.manifest_format = FORMAT_SEGMENT_TIMELINE;
+	ctx->mpd_config.subtitle_format = SUBTITLE_FORMAT_WEBVTT;
+	ctx->mpd_config.duplicate_bitrate_threshold = 4096;
+
+	ctx->mss_config.duplicate_bitrate_threshold = 4096;
+
+	rc = language_code_init(&ctx->log);
+	if (rc != VOD_OK)
+	{
+		vod_log_error(VOD_LOG_ERR, &ctx->log, 0,
+			"vod_cli_init_conf: language_code_init failed %i", rc);
+		return rc;
+	}
+
+	return VOD_OK;
+}
+
+static void
+vod_cli_usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-s segment duration (ms)] [-v] [-x] <file or dir> ...\n", name);
+}
+
+int
+main(int argc, char* argv[])
+{
+	static vod_cli_ctx_t ctx;
+	uintptr_t segment_duration = VOD_CLI_DEFAULT_SEGMENT_DURATION;
+	ngx_uint_t log_level = NGX_LOG_WARN;
+	vod_pool_t* pool;
+	int opt;
+
+	ctx.iterations = 1;
+
+	while ((opt = getopt(argc, argv, "n:s:vx")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			ctx.iterations = atoi(optarg);
+			break;
+
+		case 's':
+			segment_duration = atoi(optarg);
+			break;
+
+		case 'v':
+			log_level = log_level < NGX_LOG_INFO ? NGX_LOG_INFO : (NGX_LOG_DEBUG | NGX_LOG_DEBUG_ALL);
+			break;
+
+		case 'x':
+			ctx.write_index = TRUE;
+			break;
+
+		default:
+			vod_cli_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || ctx.iterations <= 0 || segment_duration <= 0)
+	{
+		vod_cli_usage(argv[0]);
+		return 1;
+	}
+
+	vod_cli_shim_init(&ctx.log, log_level);
+	ctx.request_context.log = &ctx.log;
+
+	pool = ngx_create_pool(VOD_CLI_POOL_SIZE, &ctx.log);
+	if (pool == NULL)
+	{
+		return 1;
+	}
+
+	if (vod_cli_init_conf(&ctx, pool, segment_duration) != VOD_OK)
+	{
+		ngx_destroy_pool(pool);
+		return 1;
+	}
+
+	for (; optind < argc; optind++)
+	{
+		vod_cli_bench_path(&ctx, argv[optind]);
+	}
+
+	if (!ctx.write_index)
+	{
+		printf("total\n");
+		vod_cli_print_stats(ctx.total_stats);
+	}
+
+	ngx_destroy_pool(pool);
 
 	return 0;
 }
@@ -0,0 +1,278 @@
+#include "vod_cli_shim.h"
+#include <stdio.h>
+
+// replaces the pool, log and time objects of nginx (ngx_palloc.o, ngx_log.o, ngx_times.o) in order to allow
+// the vod library to run outside of an nginx worker. every allocation is a separate malloc, so that the
+// allocations of each stage can be counted exactly.
+
+// constants
+#define VOD_CLI_ALIGNMENT (16)
+
+// typedefs
+typedef struct vod_cli_block_s {
+	struct vod_cli_block_s* prev;
+	struct vod_cli_block_s* next;
+	void* base;				// the pointer returned by posix_memalign
+	size_t size;
+} vod_cli_block_t;
+
+typedef struct {
+	ngx_pool_t pool;
+	vod_cli_block_t blocks;		// sentinel of a circular list
+} vod_cli_pool_t;
+
+// globals
+vod_cli_alloc_stats_t vod_cli_alloc_stats;
+
+static ngx_time_t vod_cli_cached_time;
+volatile ngx_time_t* ngx_cached_time = &vod_cli_cached_time;
+
+static const char* vod_cli_log_levels[] = {
+	"", "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug"
+};
+
+void
+vod_cli_shim_init(ngx_log_t* log, ngx_uint_t log_level)
+{
+	ngx_memzero(log, sizeof(*log));
+	log->log_level = log_level;
+
+	ngx_pagesize = getpagesize();
+	ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+	vod_cli_cached_time.sec = time(NULL);
+}
+
+// pool
+ngx_pool_t*
+ngx_create_pool(size_t size, ngx_log_t* log)
+{
+	vod_cli_pool_t* p;
+
+	p = malloc(sizeof(*p));
+	if (p == NULL)
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			"ngx_create_pool: malloc(%uz) failed", sizeof(*p));
+		return NULL;
+	}
+
+	ngx_memzero(&p->pool, sizeof(p->pool));
+	p->pool.max = size;
+	p->pool.current = &p->pool;
+	p->pool.log = log;
+
+	p->blocks.prev = &p->blocks;
+	p->blocks.next = &p->blocks;
+
+	return &p->pool;
+}
+
+void
+ngx_destroy_pool(ngx_pool_t* pool)
+{
+	vod_cli_pool_t* p = (vod_cli_pool_t*)pool;
+	vod_cli_block_t* cur;
+	vod_cli_block_t* next;
+	ngx_pool_cleanup_t* c;
+
+	for (c = pool->cleanup; c != NULL; c = c->next)
+	{
+		if (c->handler != NULL)
+		{
+			c->handler(c->data);
+		}
+	}
+
+	for (cur = p->blocks.next; cur != &p->blocks; cur = next)
+	{
+		next = cur->next;
+		free(cur->base);
+	}
+
+	free(p);
+}
+
+static void*
+vod_cli_palloc(ngx_pool_t* pool, size_t size, size_t alignment)
+{
+	vod_cli_pool_t* p = (vod_cli_pool_t*)pool;
+	vod_cli_block_t* block;
+	size_t header_size;
+	u_char* result;
+	void* base;
+	int err;
+
+	header_size = ngx_align(sizeof(*block), alignment);
+
+	err = posix_memalign(&base, alignment, header_size + size);
+	if (err != 0)
+	{
+		ngx_log_error(NGX_LOG_EMERG, pool->log, err,
+			"vod_cli_palloc: posix_memalign(%uz, %uz) failed", alignment, header_size + size);
+		return NULL;
+	}
+
+	result = (u_char*)base + header_size;
+
+	block = (vod_cli_block_t*)result - 1;
+	block->base = base;
+	block->size = size;
+
+	block->next = p->blocks.next;
+	block->prev = &p->blocks;
+	p->blocks.next->prev = block;
+	p->blocks.next = block;
+
+	vod_cli_alloc_stats.count++;
+	vod_cli_alloc_stats.size += size;
+
+	return result;
+}
+
+void*
+ngx_palloc(ngx_pool_t* pool, size_t size)
+{
+	return vod_cli_palloc(pool, size, VOD_CLI_ALIGNMENT);
+}
+
+void*
+ngx_pnalloc(ngx_pool_t* pool, size_t size)
+{
+	return vod_cli_palloc(pool, size, VOD_CLI_ALIGNMENT);
+}
+
+void*
+ngx_pcalloc(ngx_pool_t* pool, size_t size)
+{
+	void* p;
+
+	p = vod_cli_palloc(pool, size, VOD_CLI_ALIGNMENT);
+	if (p != NULL)
+	{
+		ngx_memzero(p, size);
+	}
+
+	return p;
+}
+
+void*
+ngx_pmemalign(ngx_pool_t* pool, size_t size, size_t alignment)
+{
+	return vod_cli_palloc(pool, size, ngx_max(alignment, VOD_CLI_ALIGNMENT));
+}
+
+ngx_int_t
+ngx_pfree(ngx_pool_t* pool, void* p)
+{
+	vod_cli_block_t* block = (vod_cli_block_t*)p - 1;
+
+	block->prev->next = block->next;
+	block->next->prev = block->prev;
+	free(block->base);
+
+	return NGX_OK;
+}
+
+ngx_pool_cleanup_t*
+ngx_pool_cleanup_add(ngx_pool_t* p, size_t size)
+{
+	ngx_pool_cleanup_t* c;
+
+	c = ngx_palloc(p, sizeof(ngx_pool_cleanup_t));
+	if (c == NULL)
+	{
+		return NULL;
+	}
+
+	if (size)
+	{
+		c->data = ngx_palloc(p, size);
+		if (c->data == NULL)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		c->data = NULL;
+	}
+
+	c->handler = NULL;
+	c->next = p->cleanup;
+
+	p->cleanup = c;
+
+	return c;
+}
+
+// log
+static void
+vod_cli_log_write(ngx_uint_t level, ngx_err_t err, const char* fmt, va_list args)
+{
+	u_char errstr[NGX_MAX_ERROR_STR];
+	u_char* last = errstr + NGX_MAX_ERROR_STR;
+	u_char* p;
+
+	p = ngx_vslprintf(errstr, last, fmt, args);
+	if (err != 0)
+	{
+		p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+	}
+
+	fprintf(stderr, "[%s] %.*s\n",
+		level < vod_array_entries(vod_cli_log_levels) ? vod_cli_log_levels[level] : "",
+		(int)(p - errstr), errstr);
+}
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t* log, ngx_err_t err, const char* fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vod_cli_log_write(level, err, fmt, args);
+	va_end(args);
+}
+
+#else
+
+void ngx_cdecl
+ngx_log_error(ngx_uint_t level, ngx_log_t* log, ngx_err_t err, const char* fmt, ...)
+{
+	va_list args;
+
+	if (log->log_level < level)
+	{
+		return;
+	}
+
+	va_start(args, fmt);
+	vod_cli_log_write(level, err, fmt, args);
+	va_end(args);
+}
+
+void ngx_cdecl
+ngx_log_debug_core(ngx_log_t* log, ngx_err_t err, const char* fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vod_cli_log_write(NGX_LOG_DEBUG, err, fmt, args);
+	va_end(args);
+}
+
+#endif // NGX_HAVE_VARIADIC_MACROS
+
+// time
+void
+ngx_gmtime(time_t t, ngx_tm_t* tp)
+{
+	gmtime_r(&t, tp);
+
+	// nginx uses 1 based months and full years
+	tp->ngx_tm_mon++;
+	tp->ngx_tm_year += 1900;
+}
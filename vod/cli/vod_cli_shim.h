@@ -0,0 +1,19 @@
+#ifndef __VOD_CLI_SHIM_H__
+#define __VOD_CLI_SHIM_H__
+
+// includes
+#include "../common.h"
+
+// typedefs
+typedef struct {
+	uint64_t count;
+	uint64_t size;
+} vod_cli_alloc_stats_t;
+
+// globals
+extern vod_cli_alloc_stats_t vod_cli_alloc_stats;
+
+// functions
+void vod_cli_shim_init(ngx_log_t* log, ngx_uint_t log_level);
+
+#endif // __VOD_CLI_SHIM_H__
@@ -202,7 +202,7 @@ codec_config_hevc_config_parse(
 
 	if (end_pos != NULL)
 	{
-		*end_pos = reader.stream.cur_pos + (reader.cur_bit >= 0 ? 1 : 0);
+		*end_pos = bit_read_stream_get_pos(&reader);
 	}
 
 	return VOD_OK;
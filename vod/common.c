@@ -34,3 +34,25 @@ vod_append_hex_string(u_char* p, const u_char* buffer, uint32_t buffer_size)
 	}
 	return p;
 }
+
+vod_status_t
+vod_request_memory_add(request_context_t* request_context, size_t size)
+{
+	request_context->memory_used += size;
+
+	if (request_context->max_memory != 0 && request_context->memory_used > request_context->max_memory)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"vod_request_memory_add: request memory %uz exceeds the limit %uz",
+			request_context->memory_used, request_context->max_memory);
+		return VOD_ALLOC_FAILED;
+	}
+
+	return VOD_OK;
+}
+
+void
+vod_request_memory_release(request_context_t* request_context, size_t size)
+{
+	request_context->memory_used -= vod_min(size, request_context->memory_used);
+}
@@ -56,6 +56,10 @@
 // memory alloc functions
 #define vod_alloc(pool, size) malloc(size)
 #define vod_free(pool, ptr) free(ptr)
+#define vod_heap_alloc(size, log) malloc(size)
+#define vod_heap_free(ptr) free(ptr)
+#define vod_heap_memalign(alignment, size, log) malloc(size)
+#define vod_memalign(pool, size, alignment) malloc(size)
 
 #include "vod_array.h"
 
@@ -103,8 +107,11 @@ void vod_log_error(vod_uint_t level, vod_log_t *log, int err,
 #define VOD_HAVE_LIBXML2 NGX_HAVE_LIBXML2
 #define VOD_HAVE_ICONV NGX_HAVE_ICONV
 #define VOD_HAVE_ZLIB NGX_HAVE_ZLIB
+#define VOD_HAVE_SSE41 NGX_HAVE_SSE41
+#define VOD_HAVE_AVX2 NGX_HAVE_AVX2
 
 #define VOD_DEBUG NGX_DEBUG
+#define VOD_THREADS NGX_THREADS
 
 #if (VOD_HAVE_LIB_AV_CODEC)
 #include <libavcodec/avcodec.h>
@@ -143,7 +150,13 @@ void vod_log_error(vod_uint_t level, vod_log_t *log, int err,
 // memory alloc functions
 #define vod_alloc(pool, size) ngx_palloc(pool, size)
 #define vod_free(pool, ptr) ngx_pfree(pool, ptr)
+#define vod_heap_alloc(size, log) ngx_alloc(size, log)
+#define vod_heap_free(ptr) ngx_free(ptr)
+#define vod_heap_memalign(alignment, size, log) ngx_memalign(alignment, size, log)
+#define vod_memalign(pool, size, alignment) ngx_pmemalign(pool, size, alignment)
 #define vod_pool_cleanup_add(pool, size) ngx_pool_cleanup_add(pool, size)
+#define vod_create_pool(size, log) ngx_create_pool(size, log)
+#define vod_destroy_pool(pool) ngx_destroy_pool(pool)
 #define vod_align(d, a) ngx_align(d, a)
 
 // string functions
@@ -156,6 +169,7 @@ void vod_log_error(vod_uint_t level, vod_log_t *log, int err,
 #define vod_strlen ngx_strlen
 #define vod_strncmp(s1, s2, n) ngx_strncmp(s1, s2, n)
 #define vod_strncasecmp(s1, s2, n) ngx_strncasecmp(s1, s2, n)
+#define vod_strcspn(s1, s2) strcspn((const char*)s1, s2)
 #define vod_pstrdup(pool, src) ngx_pstrdup(pool, src)
 #define vod_hextoi(line, n) ngx_hextoi(line, n)
 #define vod_escape_json(dst, src, size) ngx_escape_json(dst, src, size)
@@ -325,20 +339,31 @@ typedef struct vod_array_part_s {
 
 typedef vod_status_t(*write_callback_t)(void* context, u_char* buffer, uint32_t size);
 
+// writes a range of a source file as is, without reading it (source is a media_clip_source_t)
+typedef vod_status_t(*write_file_callback_t)(void* context, void* source, uint64_t offset, uint32_t size);
+
 typedef struct {
 	write_callback_t write_tail;
 	write_callback_t write_head;
+	write_file_callback_t write_file;		// optional
 	void* context;
 } segment_writer_t;
 
 struct buffer_pool_s;
 typedef struct buffer_pool_s buffer_pool_t;
 
+struct request_arena_s;
+typedef struct request_arena_s request_arena_t;
+
 typedef struct {
 	vod_pool_t* pool;
 	vod_log_t *log;
 	buffer_pool_t* output_buffer_pool;
+	request_arena_t* arena;
+	struct request_arena_state_s* arena_state;
 	bool_t simulation_only;
+	size_t max_memory;				// the limit on memory_used, zero = unlimited
+	size_t memory_used;				// the large buffers that were allocated by the request and not released
 #if (VOD_DEBUG)
 	time_t time;
 #endif
@@ -359,4 +384,9 @@ uint32_t vod_get_number_of_set_bits(uint32_t i);
 
 u_char* vod_append_hex_string(u_char* p, const u_char* buffer, uint32_t buffer_size);
 
+// accounts a large allocation of the request, fails when the request exceeds its memory limit
+vod_status_t vod_request_memory_add(request_context_t* request_context, size_t size);
+
+void vod_request_memory_release(request_context_t* request_context, size_t size);
+
 #endif // __COMMON_H__
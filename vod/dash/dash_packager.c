@@ -202,6 +202,19 @@
 #define MAX_FILE_EXT_SIZE (sizeof("webm") - 1)
 
 //typedefs
+typedef struct {
+	segment_duration_item_t* first_item;
+	segment_duration_item_t* last_item;
+	u_char* data;				// points to the output buffer
+	size_t len;
+} segment_timeline_cache_t;
+
+typedef struct {
+	media_track_t* track;		// the track that was used to write the header
+	u_char* data;				// points to the output buffer
+	size_t len;
+} representation_header_cache_t;
+
 typedef struct {
 	dash_manifest_config_t* conf;
 	vod_str_t base_url;
@@ -210,6 +223,8 @@ typedef struct {
 	u_char* base_url_temp_buffer;
 	segment_durations_t segment_durations[MEDIA_TYPE_COUNT];
 	segment_duration_item_t** cur_duration_items;
+	segment_timeline_cache_t timelines[MEDIA_TYPE_COUNT];
+	representation_header_cache_t* representation_headers;
 	uint32_t clip_index;
 	uint64_t clip_start_time;
 	uint64_t segment_base_time;
@@ -464,6 +479,7 @@ dash_packager_write_segment_timeline(
 	media_track_t* reference_track,
 	segment_durations_t* segment_durations,
 	segment_duration_item_t** cur_item_ptr,
+	segment_timeline_cache_t* cache,
 	vod_str_t* base_url)
 {
 	segment_duration_item_t* cur_item;
@@ -471,6 +487,7 @@ dash_packager_write_segment_timeline(
 	uint64_t start_time;
 	uint32_t duration;
 	bool_t first_time = TRUE;
+	u_char* timeline_start;
 
 	if (segment_durations->start_time > clip_start_time)
 	{
@@ -494,6 +511,17 @@ dash_packager_write_segment_timeline(
 		&dash_codecs[reference_track->media_info.codec_id].init_file_ext,
 		start_number + 1);
 
+	// the timeline depends only on the duration items, reuse it for other adaptation sets of the same media type
+	if (cache->first_item == *cur_item_ptr)
+	{
+		p = vod_copy(p, cache->data, cache->len);
+		*cur_item_ptr = cache->last_item;
+
+		p = vod_copy(p, VOD_DASH_MANIFEST_SEGMENT_TEMPLATE_FOOTER, sizeof(VOD_DASH_MANIFEST_SEGMENT_TEMPLATE_FOOTER) - 1);
+		return p;
+	}
+
+	timeline_start = p;
 	for (cur_item = *cur_item_ptr; cur_item < last_item; cur_item++)
 	{
 		// stop on discontinuity, will get called again for the next period
@@ -532,6 +560,11 @@ dash_packager_write_segment_timeline(
 		first_time = FALSE;
 	}
 
+	cache->first_item = *cur_item_ptr;
+	cache->last_item = cur_item;
+	cache->data = timeline_start;
+	cache->len = p - timeline_start;
+
 	*cur_item_ptr = cur_item;
 
 	p = vod_copy(p, VOD_DASH_MANIFEST_SEGMENT_TEMPLATE_FOOTER, sizeof(VOD_DASH_MANIFEST_SEGMENT_TEMPLATE_FOOTER) - 1);
@@ -708,11 +741,123 @@ dash_packager_get_eac3_channel_config(media_info_t* media_info)
 	return result;
 }
 
+static u_char*
+dash_packager_write_representation_header(
+	u_char* p,
+	media_set_t* media_set,
+	media_track_t* cur_track)
+{
+	vod_str_t representation_id;
+	vod_str_t frame_rate;
+	u_char representation_id_buffer[MAX_TRACK_SPEC_LENGTH];
+	u_char frame_rate_buffer[VOD_DASH_MAX_FRAME_RATE_LEN];
+
+	frame_rate.data = frame_rate_buffer;
+	representation_id.data = representation_id_buffer;
+
+	dash_packager_get_track_spec(
+		&representation_id, 
+		media_set, 
+		cur_track->file_info.source->sequence->index, 
+		cur_track->index, 
+		cur_track->media_info.media_type);
+
+	switch (cur_track->media_info.media_type)
+	{
+	case MEDIA_TYPE_VIDEO:
+		dash_packager_write_frame_rate(
+			cur_track->media_info.min_frame_duration,
+			DASH_TIMESCALE,
+			&frame_rate);
+
+		p = vod_sprintf(p,
+			VOD_DASH_MANIFEST_REPRESENTATION_HEADER_VIDEO,
+			&representation_id,
+			&dash_codecs[cur_track->media_info.codec_id].mime_type,
+			&cur_track->media_info.codec_name,
+			(uint32_t)cur_track->media_info.u.video.width,
+			(uint32_t)cur_track->media_info.u.video.height,
+			&frame_rate,
+			cur_track->media_info.bitrate
+			);
+		break;
+
+	case MEDIA_TYPE_AUDIO:
+		p = vod_sprintf(p,
+			VOD_DASH_MANIFEST_REPRESENTATION_HEADER_AUDIO,
+			&representation_id,
+			&dash_codecs[cur_track->media_info.codec_id].mime_type,
+			&cur_track->media_info.codec_name,
+			cur_track->media_info.u.audio.sample_rate,
+			cur_track->media_info.bitrate);
+		break;
+
+	case MEDIA_TYPE_SUBTITLE:
+		if (representation_id.len > 0 && representation_id.data[representation_id.len - 1] == '-')
+		{
+			representation_id.len--;
+		}
+
+		p = vod_sprintf(p,
+			VOD_DASH_MANIFEST_REPRESENTATION_HEADER_SUBTITLE_SMPTE_TT,
+			&representation_id);
+		break;
+	}
+
+	return p;
+}
+
+static bool_t
+dash_packager_representation_header_equals(media_track_t* track1, media_track_t* track2)
+{
+	media_info_t* media_info1 = &track1->media_info;
+	media_info_t* media_info2 = &track2->media_info;
+
+	if (track1 == track2)
+	{
+		return TRUE;
+	}
+
+	if (track1->index != track2->index ||
+		track1->file_info.source->sequence->index != track2->file_info.source->sequence->index ||
+		media_info1->media_type != media_info2->media_type)
+	{
+		return FALSE;
+	}
+
+	switch (media_info1->media_type)
+	{
+	case MEDIA_TYPE_VIDEO:
+		if (media_info1->u.video.width != media_info2->u.video.width ||
+			media_info1->u.video.height != media_info2->u.video.height ||
+			media_info1->min_frame_duration != media_info2->min_frame_duration)
+		{
+			return FALSE;
+		}
+		break;
+
+	case MEDIA_TYPE_AUDIO:
+		if (media_info1->u.audio.sample_rate != media_info2->u.audio.sample_rate)
+		{
+			return FALSE;
+		}
+		break;
+
+	case MEDIA_TYPE_SUBTITLE:
+		return TRUE;
+	}
+
+	return media_info1->codec_id == media_info2->codec_id &&
+		media_info1->bitrate == media_info2->bitrate &&
+		vod_str_equals(media_info1->codec_name, media_info2->codec_name);
+}
+
 static u_char* 
 dash_packager_write_mpd_period(
 	u_char* p,
 	write_period_context_t* context)
 {
+	representation_header_cache_t* cur_header = context->representation_headers;
 	segment_duration_item_t** cur_duration_items;
 	media_sequence_t* cur_sequence;
 	adaptation_set_t* adaptation_set;
@@ -972,6 +1117,7 @@ dash_packager_write_mpd_period(
 				reference_track,
 				&context->segment_durations[media_type],
 				cur_duration_items,
+				&context->timelines[media_type],
 				&context->base_url);
 			break;
 
@@ -992,58 +1138,24 @@ dash_packager_write_mpd_period(
 		// print the representations
 		for (cur_track_ptr = adaptation_set->first;
 			cur_track_ptr < adaptation_set->last;
-			cur_track_ptr++)
+			cur_track_ptr++, cur_header++)
 		{
 			cur_track = (*cur_track_ptr) + filtered_clip_offset;
 			cur_sequence = cur_track->file_info.source->sequence;
 
-			dash_packager_get_track_spec(
-				&representation_id, 
-				media_set, 
-				cur_sequence->index, 
-				cur_track->index, 
-				cur_track->media_info.media_type);
-
-			switch (media_type)
+			// the header does not depend on the period, reuse the one written for the previous period
+			if (cur_header->track != NULL &&
+				dash_packager_representation_header_equals(cur_header->track, cur_track))
 			{
-			case MEDIA_TYPE_VIDEO:
-				dash_packager_write_frame_rate(
-					cur_track->media_info.min_frame_duration,
-					DASH_TIMESCALE,
-					&frame_rate);
-
-				p = vod_sprintf(p,
-					VOD_DASH_MANIFEST_REPRESENTATION_HEADER_VIDEO,
-					&representation_id,
-					&dash_codecs[cur_track->media_info.codec_id].mime_type,
-					&cur_track->media_info.codec_name,
-					(uint32_t)cur_track->media_info.u.video.width,
-					(uint32_t)cur_track->media_info.u.video.height,
-					&frame_rate,
-					cur_track->media_info.bitrate
-					);
-				break;
-
-			case MEDIA_TYPE_AUDIO:
-				p = vod_sprintf(p,
-					VOD_DASH_MANIFEST_REPRESENTATION_HEADER_AUDIO,
-					&representation_id,
-					&dash_codecs[cur_track->media_info.codec_id].mime_type,
-					&cur_track->media_info.codec_name,
-					cur_track->media_info.u.audio.sample_rate,
-					cur_track->media_info.bitrate);
-				break;
-
-			case MEDIA_TYPE_SUBTITLE:
-				if (representation_id.len > 0 && representation_id.data[representation_id.len - 1] == '-')
-				{
-					representation_id.len--;
-				}
+				p = vod_copy(p, cur_header->data, cur_header->len);
+			}
+			else
+			{
+				cur_header->track = cur_track;
+				cur_header->data = p;
 
-				p = vod_sprintf(p,
-					VOD_DASH_MANIFEST_REPRESENTATION_HEADER_SUBTITLE_SMPTE_TT,
-					&representation_id);
-				break;
+				p = dash_packager_write_representation_header(p, media_set, cur_track);
+				cur_header->len = p - cur_header->data;
 			}
 
 			if (context->conf->manifest_format == FORMAT_SEGMENT_LIST)
@@ -1520,8 +1632,22 @@ dash_packager_build_mpd(
 		return VOD_ALLOC_FAILED;
 	}
 
+	// Note: the representations of all periods are written in the same order, one cache entry per representation
+	context.representation_headers = vod_alloc(request_context->pool,
+		sizeof(context.representation_headers[0]) * media_set->total_track_count);
+	if (context.representation_headers == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"dash_packager_build_mpd: vod_alloc failed (3)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(context.representation_headers,
+		sizeof(context.representation_headers[0]) * media_set->total_track_count);
+
 	// initialize the duration items pointers to the beginning (according to the media type)
 	context.cur_duration_items = (void*)(context.base_url_temp_buffer + base_url_temp_buffer_size);
+	vod_memzero(context.timelines, sizeof(context.timelines));
 
 	for (adaptation_set = context.adaptation_sets.first, cur_duration_items = context.cur_duration_items;
 		adaptation_set < context.adaptation_sets.last;
@@ -1663,7 +1789,10 @@ dash_packager_get_earliest_pres_time(media_set_t* media_set, media_track_t* trac
 
 	if (track->frame_count > 0)
 	{
-		result += track->frames.first_frame[0].pts_delay;
+		if (track->compact_frames.first_run == NULL)		// compact frames have no pts delay
+		{
+			result += track->frames.first_frame[0].pts_delay;
+		}
 
 #ifndef DISABLE_PTS_DELAY_COMPENSATION
 		if (track->media_info.media_type == MEDIA_TYPE_VIDEO &&
@@ -53,6 +53,9 @@
 typedef struct {
 	u_char* temp_buffer;
 	bool_t write_playready_kid;
+	drm_info_t* last_drm_info;
+	u_char* last_tags;
+	size_t last_tags_size;
 } write_content_protection_context_t;
 
 ////// mpd functions
@@ -105,12 +108,22 @@ edash_packager_write_content_protection(void* ctx, u_char* p, media_track_t* tra
 	drm_system_info_t* cur_info;
 	vod_str_t base64;
 	vod_str_t pssh;
+	u_char* start;
 
 	if (track->media_info.media_type > MEDIA_TYPE_AUDIO)	// ignore subtitles
 	{
 		return p;
 	}
 
+	// the tags depend only on the drm info, when it is shared with the previous track, copy the tags that were 
+	// already rendered to the output instead of encoding the psshs again
+	if (drm_info == context->last_drm_info)
+	{
+		return vod_copy(p, context->last_tags, context->last_tags_size);
+	}
+
+	start = p;
+
 	p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC) - 1);
 	for (cur_info = drm_info->pssh_array.first; cur_info < drm_info->pssh_array.last; cur_info++)
 	{
@@ -154,6 +167,11 @@ edash_packager_write_content_protection(void* ctx, u_char* p, media_track_t* tra
 			p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC_PART4, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC_PART4) - 1);
 		}
 	}
+
+	context->last_drm_info = drm_info;
+	context->last_tags = start;
+	context->last_tags_size = p - start;
+
 	return p;
 }
 
@@ -224,6 +242,7 @@ edash_packager_build_mpd(
 	}
 
 	context.write_playready_kid = conf->write_playready_kid;
+	context.last_drm_info = NULL;
 	if (max_pssh_size > 0)
 	{
 		context.temp_buffer = vod_alloc(request_context->pool, max_pssh_size);
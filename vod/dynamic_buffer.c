@@ -28,8 +28,9 @@ vod_dynamic_buf_reserve(vod_dynamic_buf_t* buffer, size_t size)
 		return VOD_OK;
 	}
 
+	used_buffer_size = buffer->pos - buffer->start;
 	new_size = 2 * (buffer->end - buffer->start);
-	new_size = vod_max(new_size, size);
+	new_size = vod_max(new_size, used_buffer_size + size);
 
 	new_buffer = vod_alloc(buffer->request_context->pool, new_size);
 	if (new_buffer == NULL)
@@ -39,7 +40,6 @@ vod_dynamic_buf_reserve(vod_dynamic_buf_t* buffer, size_t size)
 		return VOD_ALLOC_FAILED;
 	}
 
-	used_buffer_size = buffer->pos - buffer->start;
 	vod_memcpy(new_buffer, buffer->start, used_buffer_size);
 	buffer->start = new_buffer;
 	buffer->end = new_buffer + new_size;
@@ -2,11 +2,15 @@
 
 // globals
 static AVCodec *decoder_codec = NULL;
+static bool_t init_done = FALSE;
 static bool_t initialized = FALSE;
 
-void
-audio_decoder_process_init(vod_log_t* log)
+// called on first use, workers that do not decode audio do not load the codec
+static void
+audio_decoder_global_init(vod_log_t* log)
 {
+	init_done = TRUE;
+
 	#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
 		avcodec_register_all();
 	#endif
@@ -15,7 +19,7 @@ audio_decoder_process_init(vod_log_t* log)
 	if (decoder_codec == NULL)
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"audio_decoder_process_init: failed to get AAC decoder, audio decoding is disabled");
+			"audio_decoder_global_init: failed to get AAC decoder, audio decoding is disabled");
 		return;
 	}
 
@@ -83,6 +87,11 @@ audio_decoder_init(
 	input_frame_t* cur_frame;
 	vod_status_t rc;
 
+	if (!init_done)
+	{
+		audio_decoder_global_init(request_context->log);
+	}
+
 	if (!initialized)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
@@ -27,8 +27,6 @@ typedef struct {
 } audio_decoder_state_t;
 
 // functions
-void audio_decoder_process_init(vod_log_t* log);
-
 vod_status_t audio_decoder_init(
 	audio_decoder_state_t* state,
 	request_context_t* request_context,
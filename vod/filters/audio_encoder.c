@@ -15,6 +15,7 @@ typedef struct
 
 // globals
 static AVCodec *encoder_codec = NULL;
+static bool_t init_done = FALSE;
 static bool_t initialized = FALSE;
 
 static bool_t
@@ -33,9 +34,12 @@ audio_encoder_is_format_supported(AVCodec *codec, enum AVSampleFormat sample_fmt
 	return FALSE;
 }
 
-void
-audio_encoder_process_init(vod_log_t* log)
+// called on first use, workers that do not encode audio do not load the codec
+static void
+audio_encoder_global_init(vod_log_t* log)
 {
+	init_done = TRUE;
+
 	#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
 		avcodec_register_all();
 	#endif
@@ -44,14 +48,14 @@ audio_encoder_process_init(vod_log_t* log)
 	if (encoder_codec == NULL)
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"audio_encoder_process_init: failed to get AAC encoder, audio encoding is disabled. recompile libavcodec with libfdk_aac to enable it");
+			"audio_encoder_global_init: failed to get AAC encoder, audio encoding is disabled. recompile libavcodec with libfdk_aac to enable it");
 		return;
 	}
 
 	if (!audio_encoder_is_format_supported(encoder_codec, AUDIO_ENCODER_INPUT_SAMPLE_FORMAT))
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"audio_encoder_process_init: encoder does not support the required input format, audio encoding is disabled");
+			"audio_encoder_global_init: encoder does not support the required input format, audio encoding is disabled");
 		return;
 	}
 
@@ -69,6 +73,11 @@ audio_encoder_init(
 	AVCodecContext* encoder;
 	int avrc;
 
+	if (!init_done)
+	{
+		audio_encoder_global_init(request_context->log);
+	}
+
 	if (!initialized)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
@@ -19,9 +19,6 @@ typedef struct
 } audio_encoder_params_t;
 
 // functions
-void audio_encoder_process_init(
-	vod_log_t* log);
-
 vod_status_t audio_encoder_init(
 	request_context_t* request_context,
 	audio_encoder_params_t* params,
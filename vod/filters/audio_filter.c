@@ -12,6 +12,34 @@
 #include "volume_map.h"
 #include "../input/frames_source_memory.h"
 
+/*
+	A mix of media sources that already match the output sample rate and channel layout is performed natively,
+	without a filter graph - the decoded planar float samples are accumulated, each source scaled by 1 / source count
+	(same as the default of amix), and clipped before encoding.
+	The accumulation and the clipping are vectorized, on x86, an avx2 implementation is used when it is
+	supported by the cpu (checked in runtime). On aarch64, neon is always available.
+*/
+
+#if (VOD_HAVE_AVX2)
+#include <immintrin.h>
+
+#define audio_filter_has_simd() (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+
+#define AUDIO_FILTER_SIMD_ATTR __attribute__((target("avx2,fma")))
+
+#define AUDIO_FILTER_SIMD_WIDTH (8)
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define AUDIO_FILTER_NEON (1)
+
+#define audio_filter_has_simd() (1)
+
+#define AUDIO_FILTER_SIMD_WIDTH (4)
+
+#endif
+
 // constants
 #define BUFFERSRC_ARGS_FORMAT ("time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%uxL%Z")
 #define MAX_SAMPLE_FORMAT_NAME_LEN (10)
@@ -25,6 +53,9 @@
 #define BUFFERSINK_PARAM_CHANNEL_LAYOUTS ("channel_layouts")
 #define BUFFERSINK_PARAM_SAMPLE_RATES ("sample_rates")
 
+#define MIXER_DEFAULT_FRAME_SIZE (1024)
+#define MIXER_MAX_INPUT_FRAME_SIZE (4096)		// the decoded aac frames are up to 2048 samples (he-aac)
+
 // uncomment to save intermediate streams to temporary files
 /*
 #define AUDIO_FILTER_DEBUG
@@ -46,8 +77,38 @@ typedef struct
 	audio_decoder_state_t decoder;
 	AVFilterContext *buffer_src;
 	bool_t buffersrc_flushed;
+
+	// native mixer
+	uint32_t mix_pos;
+	bool_t mix_done;
 } audio_filter_source_t;
 
+typedef struct {
+	u_char file_key[MEDIA_CLIP_KEY_SIZE];
+	uint64_t clip_from;
+	uint64_t first_frame_offset;
+	uint64_t first_frame_time_offset;
+	uint32_t track_id;
+	uint32_t frame_count;
+} audio_filter_cache_key_source_t;
+
+typedef struct {
+	uint64_t channel_layout;
+	uint32_t sample_rate;
+	uint32_t bitrate;
+	uint32_t codec_id;
+} audio_filter_cache_key_output_t;
+
+// cached track layout - header, frames, extra data, frames data
+typedef struct {
+	uint64_t duration;
+	uint32_t timescale;
+	uint32_t bitrate;
+	uint32_t frame_count;
+	uint32_t extra_data_size;
+	audio_media_info_t audio;
+} audio_filter_cache_header_t;
+
 typedef struct
 {
 	AVFilterContext *buffer_sink;
@@ -56,6 +117,18 @@ typedef struct
 	vod_array_t frames_array;
 } audio_filter_sink_t;
 
+typedef struct
+{
+	float** planes;
+	uint32_t channels;
+	uint32_t capacity;
+	uint32_t frame_size;
+	uint32_t sample_rate;
+	uint64_t channel_layout;
+	float weight;
+	int64_t pts;
+} audio_filter_mixer_t;
+
 // constants
 static audio_filter_encoder_t libav_encoder = {
 	AUDIO_ENCODER_INPUT_SAMPLE_FORMAT,
@@ -256,23 +329,34 @@ typedef struct {
 	audio_filter_source_t* sources;
 	audio_filter_source_t* sources_end;
 
+	// native mixer (replaces the filter graph)
+	audio_filter_mixer_t* mixer;
+
 	// output
 	media_sequence_t* sequence;
 	media_track_t* output;
 
 	// processing state
 	audio_filter_source_t* cur_source;
+
+	// cache
+	audio_filter_cache_t* cache;
+	vod_str_t cache_key;
 } audio_filter_state_t;
 
 // globals
 static const AVFilter *buffersrc_filter = NULL;
 static const AVFilter *buffersink_filter = NULL;
 
+static bool_t init_done = FALSE;
 static bool_t initialized = FALSE;
 
-void 
-audio_filter_process_init(vod_log_t* log)
+// called on first use, workers that do not filter audio do not initialize libavfilter
+static void
+audio_filter_global_init(vod_log_t* log)
 {
+	init_done = TRUE;
+
 	#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
 		avfilter_register_all();
 	#endif
@@ -281,7 +365,7 @@ audio_filter_process_init(vod_log_t* log)
 	if (buffersrc_filter == NULL)
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"audio_filter_process_init: failed to get buffer source filter, audio filtering is disabled");
+			"audio_filter_global_init: failed to get buffer source filter, audio filtering is disabled");
 		return;
 	}
 
@@ -289,7 +373,7 @@ audio_filter_process_init(vod_log_t* log)
 	if (buffersink_filter == NULL)
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"audio_filter_process_init: failed to get buffer sink filter, audio filtering is disabled");
+			"audio_filter_global_init: failed to get buffer sink filter, audio filtering is disabled");
 		return;
 	}
 
@@ -538,138 +622,328 @@ audio_filter_init_sources_and_graph_desc(audio_filter_init_context_t* state, med
 	return VOD_OK;
 }
 
-vod_status_t
-audio_filter_alloc_state(
-	request_context_t* request_context,
-	media_sequence_t* sequence,
+static u_char*
+audio_filter_append_cache_key(u_char* p, media_clip_t* clip)
+{
+	audio_filter_cache_key_source_t key_source;
+	media_clip_source_t* source;
+	media_track_t* cur_track;
+	media_clip_t** sources_end;
+	media_clip_t** sources_cur;
+
+	if (media_clip_is_source(clip->type))
+	{
+		source = vod_container_of(clip, media_clip_source_t, base);
+
+		for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+		{
+			if (cur_track->media_info.media_type == MEDIA_TYPE_AUDIO)
+			{
+				break;
+			}
+		}
+
+		// Note: the audio track was validated in audio_filter_walk_filters_prepare_init
+		vod_memzero(&key_source, sizeof(key_source));
+		vod_memcpy(key_source.file_key, source->file_key, sizeof(key_source.file_key));
+		key_source.clip_from = source->clip_from;
+		key_source.first_frame_offset = cur_track->frames.first_frame < cur_track->frames.last_frame ?
+			cur_track->frames.first_frame->offset : 0;
+		key_source.first_frame_time_offset = cur_track->first_frame_time_offset;
+		key_source.track_id = cur_track->media_info.track_id;
+		key_source.frame_count = cur_track->frame_count;
+
+		// Note: the key is not aligned, since it contains the filter descriptions
+		return vod_copy(p, &key_source, sizeof(key_source));
+	}
+
+	sources_end = clip->sources + clip->source_count;
+	for (sources_cur = clip->sources; sources_cur < sources_end; sources_cur++)
+	{
+		if (*sources_cur == NULL)
+		{
+			continue;
+		}
+
+		p = audio_filter_append_cache_key(p, *sources_cur);
+	}
+
+	return clip->audio_filter->append_filter_desc(p, clip);
+}
+
+static vod_status_t
+audio_filter_get_cache_key(
+	audio_filter_init_context_t* init_context,
 	media_clip_t* clip,
 	media_track_t* output_track,
-	uint32_t max_frame_count,
 	uint32_t output_codec_id,
-	size_t* cache_buffer_count,
-	void** result)
+	vod_str_t* result)
 {
-	audio_filter_init_context_t init_context;
-	u_char filter_name[VOD_INT32_LEN + 1];
-	audio_encoder_params_t encoder_params;
-	audio_filter_state_t* state;
-	vod_pool_cleanup_t *cln;
-	AVFilterLink* sink_link;
-	AVFilterInOut *outputs = NULL;
-	AVFilterInOut *inputs = NULL;
+	audio_filter_cache_key_output_t* key_output;
+	u_char* p;
+
+	p = vod_alloc(init_context->request_context->pool, sizeof(*key_output) + 
+		sizeof(audio_filter_cache_key_source_t) * init_context->source_count + init_context->graph_desc_size);
+	if (p == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, init_context->request_context->log, 0,
+			"audio_filter_get_cache_key: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->data = p;
+
+	key_output = (void*)p;
+	vod_memzero(key_output, sizeof(*key_output));
+	key_output->channel_layout = output_track->media_info.u.audio.channel_layout;
+	key_output->sample_rate = output_track->media_info.u.audio.sample_rate;
+	key_output->bitrate = output_track->media_info.bitrate;
+	key_output->codec_id = output_codec_id;
+	p += sizeof(*key_output);
+
+	p = audio_filter_append_cache_key(p, clip);
+
+	result->len = p - result->data;
+
+	return VOD_OK;
+}
+
+// applies a cached filter output to the track, equivalent to audio_filter_update_track
+static vod_status_t
+audio_filter_apply_cached(
+	request_context_t* request_context,
+	media_sequence_t* sequence,
+	media_track_t* output,
+	vod_str_t* buffer)
+{
+	audio_filter_cache_header_t* header;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint32_t old_timescale;
+	uint64_t total_size;
 	vod_status_t rc;
-	uint32_t initial_alloc_size;
-	size_t frame_size;
-	int avrc;
+	u_char* extra_data;
+	u_char* data_pos;
 
-	// get the source count and graph desc size
-	init_context.request_context = request_context;
-	init_context.graph_desc_size = 0;
-	init_context.source_count = 0;
-	init_context.output_frame_count = 0;
+	if (buffer->len < sizeof(*header))
+	{
+		return VOD_BAD_DATA;
+	}
 
-	rc = audio_filter_walk_filters_prepare_init(&init_context, &clip, 100, 100);
+	header = (void*)buffer->data;
+	if (header->frame_count > (buffer->len - sizeof(*header)) / sizeof(*cur_frame))
+	{
+		return VOD_BAD_DATA;
+	}
+
+	cur_frame = (void*)(header + 1);
+	last_frame = cur_frame + header->frame_count;
+	extra_data = (u_char*)last_frame;
+	data_pos = extra_data + header->extra_data_size;
+
+	// validate the frame sizes and update the offsets
+	total_size = data_pos - buffer->data;
+	for (; cur_frame < last_frame; cur_frame++)
+	{
+		total_size += cur_frame->size;
+		if (total_size > buffer->len)
+		{
+			return VOD_BAD_DATA;
+		}
+
+		cur_frame->offset = (uintptr_t)data_pos;
+		data_pos += cur_frame->size;
+	}
+
+	if (total_size != buffer->len)
+	{
+		return VOD_BAD_DATA;
+	}
+
+	// update the frames
+	sequence->total_frame_count -= output->frame_count;
+	sequence->total_frame_size -= output->total_frames_size;
+	output->total_frames_size = 0;
+	output->total_frames_duration = 0;
+
+	if (header->frame_count == 0)
+	{
+		output->frames.first_frame = NULL;
+		output->frames.last_frame = NULL;
+		output->frames.next = NULL;
+		output->frame_count = 0;
+		return VOD_OK;
+	}
+
+	output->frame_count = header->frame_count;
+	output->frames.first_frame = (void*)(header + 1);
+	output->frames.last_frame = last_frame;
+	output->frames.next = NULL;
+
+	rc = frames_source_memory_init(request_context, &output->frames.frames_source_context);
 	if (rc != VOD_OK)
 	{
 		return rc;
 	}
 
-	if (clip == NULL || init_context.source_count <= 0)
+	output->frames.frames_source = &frames_source_memory;
+
+	for (cur_frame = output->frames.first_frame; cur_frame < last_frame; cur_frame++)
 	{
-		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: unexpected - no sources found");
-		return VOD_UNEXPECTED;
+		output->total_frames_size += cur_frame->size;
+		output->total_frames_duration += cur_frame->duration;
 	}
 
-	if (media_clip_is_source(clip->type))
+	// update the media info
+	old_timescale = output->media_info.timescale;
+
+	output->media_info.timescale = header->timescale;
+	output->media_info.bitrate = header->bitrate;
+	output->media_info.u.audio = header->audio;
+	output->media_info.extra_data.data = extra_data;
+	output->media_info.extra_data.len = header->extra_data_size;
+
+	output->media_info.duration = rescale_time(output->media_info.duration, old_timescale, output->media_info.timescale);
+
+	output->key_frame_count = 0;
+	output->first_frame_time_offset = rescale_time(output->first_frame_time_offset, old_timescale, output->media_info.timescale);
+
+	if (output->media_info.codec_name.data != NULL)
 	{
-		// got left with a source, following a mix of a single source, nothing to do
-		return VOD_OK;
+		rc = codec_config_get_audio_codec_name(request_context, &output->media_info);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
 	}
 
-	if (!initialized)
+	sequence->total_frame_count += output->frame_count;
+	sequence->total_frame_size += output->total_frames_size;
+
+	return VOD_OK;
+}
+
+static void
+audio_filter_store_cache(audio_filter_state_t* state)
+{
+	audio_filter_cache_header_t* header;
+	media_track_t* output = state->output;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	input_frame_t* dest_frame;
+	vod_str_t buffer;
+	u_char* p;
+
+	buffer.len = sizeof(*header) +
+		sizeof(*cur_frame) * output->frame_count +
+		output->media_info.extra_data.len +
+		output->total_frames_size;
+
+	buffer.data = vod_alloc(state->request_context->pool, buffer.len);
+	if (buffer.data == NULL)
 	{
-		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: module failed to initialize successfully");
-		return VOD_UNEXPECTED;
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"audio_filter_store_cache: vod_alloc failed");
+		return;
 	}
 
-	if (init_context.output_frame_count > max_frame_count)
+	header = (void*)buffer.data;
+	header->duration = output->media_info.duration;
+	header->timescale = output->media_info.timescale;
+	header->bitrate = output->media_info.bitrate;
+	header->frame_count = output->frame_count;
+	header->extra_data_size = output->frame_count > 0 ? output->media_info.extra_data.len : 0;
+	header->audio = output->media_info.u.audio;
+
+	// Note: always a single part here
+	dest_frame = (void*)(header + 1);
+	last_frame = output->frames.last_frame;
+	for (cur_frame = output->frames.first_frame; cur_frame < last_frame; cur_frame++, dest_frame++)
 	{
-		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: expected output frame count %uD too big", init_context.output_frame_count);
-		return VOD_BAD_REQUEST;
+		*dest_frame = *cur_frame;
+		dest_frame->offset = 0;
 	}
 
-	// allocate the state
-	state = vod_alloc(request_context->pool, sizeof(*state));
-	if (state == NULL)
+	p = vod_copy((u_char*)dest_frame, output->media_info.extra_data.data, header->extra_data_size);
+
+	for (cur_frame = output->frames.first_frame; cur_frame < last_frame; cur_frame++)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"audio_filter_alloc_state: vod_alloc failed (1)");
-		return VOD_ALLOC_FAILED;
+		p = vod_copy(p, (u_char*)(uintptr_t)cur_frame->offset, cur_frame->size);
 	}
-	vod_memzero(state, sizeof(*state));
-	
-	// add to the cleanup pool
-	cln = vod_pool_cleanup_add(request_context->pool, 0);
-	if (cln == NULL)
+
+	buffer.len = p - buffer.data;
+
+	state->cache->store(state->cache->context, &state->cache_key, &buffer);
+}
+
+static vod_status_t
+audio_filter_init_encoder(
+	audio_filter_state_t* state,
+	uint32_t output_codec_id,
+	audio_encoder_params_t* encoder_params)
+{
+	if (output_codec_id == VOD_CODEC_ID_VOLUME_MAP)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"audio_filter_alloc_state: vod_pool_cleanup_add failed");
-		return VOD_ALLOC_FAILED;
+		return volume_map_encoder_init(
+			state->request_context,
+			encoder_params->timescale,
+			&state->sink.frames_array,
+			&state->sink.encoder_context);
 	}
 
-	cln->handler = audio_filter_free_state;
-	cln->data = state;
+	return audio_encoder_init(
+		state->request_context,
+		encoder_params,
+		&state->sink.frames_array,
+		&state->sink.encoder_context);
+}
+
+static vod_status_t
+audio_filter_init_graph(
+	audio_filter_init_context_t* init_context,
+	audio_filter_state_t* state,
+	media_clip_t* clip,
+	media_track_t* output_track,
+	uint32_t output_codec_id)
+{
+	request_context_t* request_context = init_context->request_context;
+	u_char filter_name[VOD_INT32_LEN + 1];
+	audio_encoder_params_t encoder_params;
+	AVFilterLink* sink_link;
+	AVFilterInOut *outputs = NULL;
+	AVFilterInOut *inputs = NULL;
+	vod_status_t rc;
+	size_t frame_size;
+	int avrc;
 
 	// allocate the filter graph
 	state->filter_graph = avfilter_graph_alloc();
 	if (state->filter_graph == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: avfilter_graph_alloc failed");
-		return VOD_ALLOC_FAILED;
-	}
-
-	// allocate the graph desc and sources
-	init_context.graph_desc = vod_alloc(request_context->pool, init_context.graph_desc_size + 
-		sizeof(state->sources[0]) * init_context.source_count);
-	if (init_context.graph_desc == NULL)
-	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"audio_filter_alloc_state: vod_alloc failed (2)");
+			"audio_filter_init_graph: avfilter_graph_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
-	state->sources = (void*)(init_context.graph_desc + init_context.graph_desc_size);
-	state->sources_end = state->sources + init_context.source_count;
-	vod_memzero(state->sources, (u_char*)state->sources_end - (u_char*)state->sources);
+	// disable slice threading, otherwise every graph spawns (and joins) a thread per cpu, 
+	// the audio filters that are used here do not support slice threading anyway
+	state->filter_graph->thread_type = 0;
+	state->filter_graph->nb_threads = 1;
 
 	// initialize the sources and the graph description
-	init_context.filter_graph = state->filter_graph;
-	init_context.outputs = &outputs;
-	init_context.cur_source = state->sources;
-	init_context.graph_desc_pos = init_context.graph_desc;
-	init_context.cache_slot_id = 0;
+	init_context->filter_graph = state->filter_graph;
+	init_context->outputs = &outputs;
+	init_context->cur_source = state->sources;
+	init_context->graph_desc_pos = init_context->graph_desc;
+	init_context->cache_slot_id = 0;
 
-	rc = audio_filter_init_sources_and_graph_desc(&init_context, clip);
+	rc = audio_filter_init_sources_and_graph_desc(init_context, clip);
 	if (rc != VOD_OK)
 	{
 		goto end;
 	}
 
-	*init_context.graph_desc_pos = '\0';
-
-	// init the encoder
-	if (output_codec_id == VOD_CODEC_ID_VOLUME_MAP)
-	{
-		state->sink.encoder = &volume_map_encoder;
-	}
-	else
-	{
-		state->sink.encoder = &libav_encoder;
-	}
+	*init_context->graph_desc_pos = '\0';
 
 	// initialize the sink
 	vod_sprintf(filter_name, "%uD%Z", clip->id);
@@ -688,11 +962,11 @@ audio_filter_alloc_state(
 	}
 
 	// parse the graph description
-	avrc = avfilter_graph_parse_ptr(state->filter_graph, (char*)init_context.graph_desc, &inputs, &outputs, NULL);
+	avrc = avfilter_graph_parse_ptr(state->filter_graph, (char*)init_context->graph_desc, &inputs, &outputs, NULL);
 	if (avrc < 0)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: avfilter_graph_parse_ptr failed %d", avrc);
+			"audio_filter_init_graph: avfilter_graph_parse_ptr failed %d", avrc);
 		rc = VOD_UNEXPECTED;
 		goto end;
 	}
@@ -702,7 +976,7 @@ audio_filter_alloc_state(
 	if (avrc < 0)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: avfilter_graph_config failed %d", avrc);
+			"audio_filter_init_graph: avfilter_graph_config failed %d", avrc);
 		rc = VOD_UNEXPECTED;
 		goto end;
 	}
@@ -712,53 +986,372 @@ audio_filter_alloc_state(
 	if (sink_link->time_base.num != 1)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"audio_filter_alloc_state: unexpected buffer sink time base %d/%d",
+			"audio_filter_init_graph: unexpected buffer sink time base %d/%d",
 			sink_link->time_base.num, sink_link->time_base.den);
 		rc = VOD_UNEXPECTED;
 		goto end;
 	}
 
-	if (output_codec_id == VOD_CODEC_ID_VOLUME_MAP)
+	encoder_params.channels = sink_link->channels;
+	encoder_params.channel_layout = sink_link->channel_layout;
+	encoder_params.sample_rate = sink_link->sample_rate;
+	encoder_params.timescale = sink_link->time_base.den;
+	encoder_params.bitrate = output_track->media_info.bitrate;
+
+	rc = audio_filter_init_encoder(state, output_codec_id, &encoder_params);
+	if (rc != VOD_OK)
 	{
-		rc = volume_map_encoder_init(
-			request_context,
-			sink_link->time_base.den,
-			&state->sink.frames_array,
-			&state->sink.encoder_context);
-		if (rc != VOD_OK)
-		{
-			goto end;
-		}
+		goto end;
 	}
-	else
+
+	// set the buffer sink frame size
+	if (state->sink.encoder->get_frame_size != NULL)
+	{
+		frame_size = state->sink.encoder->get_frame_size(
+			state->sink.encoder_context);
+		if (frame_size != 0)
+		{
+			av_buffersink_set_frame_size(state->sink.buffer_sink, frame_size);
+		}
+	}
+
+end:
+
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+
+	return rc;
+}
+
+static media_track_t*
+audio_filter_get_audio_track(media_clip_t* clip)
+{
+	media_clip_source_t* source;
+	media_track_t* cur_track;
+
+	source = vod_container_of(clip, media_clip_source_t, base);
+
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+	{
+		if (cur_track->media_info.media_type == MEDIA_TYPE_AUDIO)
+		{
+			return cur_track;
+		}
+	}
+
+	return NULL;
+}
+
+// returns VOD_NOT_FOUND when the clip can not be mixed natively, and a filter graph should be used
+static vod_status_t
+audio_filter_init_mixer(
+	audio_filter_init_context_t* init_context,
+	audio_filter_state_t* state,
+	media_clip_t* clip,
+	media_track_t* output_track,
+	uint32_t output_codec_id)
+{
+	request_context_t* request_context = init_context->request_context;
+	audio_encoder_params_t encoder_params;
+	audio_filter_source_t* cur_source;
+	audio_filter_mixer_t* mixer;
+	media_info_t* output_info = &output_track->media_info;
+	media_info_t* media_info;
+	AVCodecContext* decoder;
+	media_clip_t** sources_end;
+	media_clip_t** sources_cur;
+	vod_status_t rc;
+	uint32_t channel;
+	size_t frame_size;
+	float* plane;
+
+	if (clip->type != MEDIA_CLIP_MIX_FILTER)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	sources_end = clip->sources + clip->source_count;
+	for (sources_cur = clip->sources; sources_cur < sources_end; sources_cur++)
 	{
-		encoder_params.channels = sink_link->channels;
-		encoder_params.channel_layout = sink_link->channel_layout;
-		encoder_params.sample_rate = sink_link->sample_rate;
-		encoder_params.timescale = sink_link->time_base.den;
-		encoder_params.bitrate = output_track->media_info.bitrate;
+		if (*sources_cur == NULL)
+		{
+			continue;
+		}
 
-		rc = audio_encoder_init(
+		if (!media_clip_is_source((*sources_cur)->type))
+		{
+			return VOD_NOT_FOUND;
+		}
+
+		// Note: the audio track was validated in audio_filter_walk_filters_prepare_init
+		media_info = &audio_filter_get_audio_track(*sources_cur)->media_info;
+		if (media_info->u.audio.sample_rate != output_info->u.audio.sample_rate ||
+			media_info->u.audio.channels != output_info->u.audio.channels ||
+			media_info->u.audio.channel_layout != output_info->u.audio.channel_layout)
+		{
+			return VOD_NOT_FOUND;
+		}
+	}
+
+	// initialize the decoders
+	init_context->cache_slot_id = 0;
+
+	cur_source = state->sources;
+	for (sources_cur = clip->sources; sources_cur < sources_end; sources_cur++)
+	{
+		if (*sources_cur == NULL)
+		{
+			continue;
+		}
+
+		rc = audio_decoder_init(
+			&cur_source->decoder,
 			request_context,
-			&encoder_params,
-			&state->sink.frames_array,
-			&state->sink.encoder_context);
+			audio_filter_get_audio_track(*sources_cur),
+			init_context->cache_slot_id++);
 		if (rc != VOD_OK)
 		{
-			goto end;
+			return rc;
+		}
+
+		// the decoder may output a different rate than the container reports (e.g. he-aac)
+		decoder = cur_source->decoder.decoder;
+		cur_source++;
+
+		if (decoder->sample_fmt != AV_SAMPLE_FMT_FLTP ||
+			decoder->sample_rate != (int)output_info->u.audio.sample_rate ||
+			decoder->channels != output_info->u.audio.channels)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"audio_filter_init_mixer: decoder output does not match the output track, using a filter graph");
+
+			while (cur_source > state->sources)
+			{
+				cur_source--;
+				audio_decoder_free(&cur_source->decoder);
+			}
+
+			vod_memzero(state->sources, (u_char*)state->sources_end - (u_char*)state->sources);
+			return VOD_NOT_FOUND;
 		}
 	}
 
-	// set the buffer sink frame size
+	// initialize the encoder
+	encoder_params.channels = output_info->u.audio.channels;
+	encoder_params.channel_layout = output_info->u.audio.channel_layout;
+	encoder_params.sample_rate = output_info->u.audio.sample_rate;
+	encoder_params.timescale = output_info->u.audio.sample_rate;
+	encoder_params.bitrate = output_info->bitrate;
+
+	rc = audio_filter_init_encoder(state, output_codec_id, &encoder_params);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	frame_size = 0;
 	if (state->sink.encoder->get_frame_size != NULL)
 	{
 		frame_size = state->sink.encoder->get_frame_size(
 			state->sink.encoder_context);
-		if (frame_size != 0)
+	}
+
+	if (frame_size == 0)
+	{
+		frame_size = MIXER_DEFAULT_FRAME_SIZE;
+	}
+
+	// allocate the mixer and the accumulation buffers
+	mixer = vod_alloc(request_context->pool, sizeof(*mixer) + 
+		(sizeof(mixer->planes[0]) + sizeof(float) * (frame_size + MIXER_MAX_INPUT_FRAME_SIZE)) * encoder_params.channels);
+	if (mixer == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"audio_filter_init_mixer: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	mixer->planes = (void*)(mixer + 1);
+	mixer->channels = encoder_params.channels;
+	mixer->capacity = frame_size + MIXER_MAX_INPUT_FRAME_SIZE;
+	mixer->frame_size = frame_size;
+	mixer->sample_rate = encoder_params.sample_rate;
+	mixer->channel_layout = encoder_params.channel_layout;
+	mixer->weight = 1.0f / init_context->source_count;
+	mixer->pts = 0;
+
+	plane = (void*)(mixer->planes + mixer->channels);
+	vod_memzero(plane, sizeof(float) * mixer->capacity * mixer->channels);
+
+	for (channel = 0; channel < mixer->channels; channel++)
+	{
+		mixer->planes[channel] = plane;
+		plane += mixer->capacity;
+	}
+
+	state->mixer = mixer;
+
+	return VOD_OK;
+}
+
+vod_status_t
+audio_filter_alloc_state(
+	request_context_t* request_context,
+	media_sequence_t* sequence,
+	media_clip_t* clip,
+	media_track_t* output_track,
+	uint32_t max_frame_count,
+	uint32_t output_codec_id,
+	audio_filter_cache_t* cache,
+	size_t* cache_buffer_count,
+	void** result)
+{
+	audio_filter_init_context_t init_context;
+	vod_str_t cache_key;
+	vod_str_t cached;
+	audio_filter_state_t* state;
+	vod_pool_cleanup_t *cln;
+	vod_status_t rc;
+	uint32_t initial_alloc_size;
+
+	// get the source count and graph desc size
+	init_context.request_context = request_context;
+	init_context.graph_desc_size = 0;
+	init_context.source_count = 0;
+	init_context.output_frame_count = 0;
+
+	rc = audio_filter_walk_filters_prepare_init(&init_context, &clip, 100, 100);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (clip == NULL || init_context.source_count <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"audio_filter_alloc_state: unexpected - no sources found");
+		return VOD_UNEXPECTED;
+	}
+
+	if (media_clip_is_source(clip->type))
+	{
+		// got left with a source, following a mix of a single source, nothing to do
+		return VOD_OK;
+	}
+
+	if (!init_done)
+	{
+		audio_filter_global_init(request_context->log);
+	}
+
+	if (!initialized)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"audio_filter_alloc_state: module failed to initialize successfully");
+		return VOD_UNEXPECTED;
+	}
+
+	if (init_context.output_frame_count > max_frame_count)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"audio_filter_alloc_state: expected output frame count %uD too big", init_context.output_frame_count);
+		return VOD_BAD_REQUEST;
+	}
+
+	if (cache != NULL)
+	{
+		rc = audio_filter_get_cache_key(&init_context, clip, output_track, output_codec_id, &cache_key);
+		if (rc != VOD_OK)
 		{
-			av_buffersink_set_frame_size(state->sink.buffer_sink, frame_size);
+			return rc;
+		}
+
+		rc = cache->fetch(cache->context, &cache_key, &cached);
+		switch (rc)
+		{
+		case VOD_OK:
+			rc = audio_filter_apply_cached(request_context, sequence, output_track, &cached);
+			if (rc == VOD_OK)
+			{
+				return VOD_OK;
+			}
+
+			if (rc != VOD_BAD_DATA)
+			{
+				return rc;
+			}
+
+			vod_log_error(VOD_LOG_WARN, request_context->log, 0,
+				"audio_filter_alloc_state: invalid cached filter output, size=%uz", cached.len);
+			break;
+
+		case VOD_NOT_FOUND:
+			break;
+
+		default:
+			return rc;
 		}
 	}
+
+	// allocate the state
+	state = vod_alloc(request_context->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"audio_filter_alloc_state: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+	vod_memzero(state, sizeof(*state));
+	
+	// add to the cleanup pool
+	cln = vod_pool_cleanup_add(request_context->pool, 0);
+	if (cln == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"audio_filter_alloc_state: vod_pool_cleanup_add failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cln->handler = audio_filter_free_state;
+	cln->data = state;
+
+	state->request_context = request_context;
+
+	// allocate the graph desc and sources
+	init_context.graph_desc = vod_alloc(request_context->pool, init_context.graph_desc_size + 
+		sizeof(state->sources[0]) * init_context.source_count);
+	if (init_context.graph_desc == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"audio_filter_alloc_state: vod_alloc failed (2)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->sources = (void*)(init_context.graph_desc + init_context.graph_desc_size);
+	state->sources_end = state->sources + init_context.source_count;
+	vod_memzero(state->sources, (u_char*)state->sources_end - (u_char*)state->sources);
+
+	// init the encoder
+	if (output_codec_id == VOD_CODEC_ID_VOLUME_MAP)
+	{
+		state->sink.encoder = &volume_map_encoder;
+	}
+	else
+	{
+		state->sink.encoder = &libav_encoder;
+	}
+
+	// use the native mixer when possible, otherwise, build a filter graph
+	rc = audio_filter_init_mixer(&init_context, state, clip, output_track, output_codec_id);
+	if (rc == VOD_NOT_FOUND)
+	{
+		rc = audio_filter_init_graph(&init_context, state, clip, output_track, output_codec_id);
+	}
+
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
 	
 	// allocate frame
 	state->filtered_frame = av_frame_alloc();
@@ -766,8 +1359,7 @@ audio_filter_alloc_state(
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
 			"audio_filter_alloc_state: av_frame_alloc failed");
-		rc = VOD_ALLOC_FAILED;
-		goto end;
+		return VOD_ALLOC_FAILED;
 	}
 
 	// initialize the output arrays
@@ -777,23 +1369,22 @@ audio_filter_alloc_state(
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
 			"audio_filter_alloc_state: vod_array_init failed");
-		rc = VOD_ALLOC_FAILED;
-		goto end;
+		return VOD_ALLOC_FAILED;
 	}
 
-	state->request_context = request_context;
 	state->sequence = sequence;
 	state->output = output_track;
 
+	if (cache != NULL)
+	{
+		state->cache = cache;
+		state->cache_key = cache_key;
+	}
+
 	*cache_buffer_count = init_context.cache_slot_id;
 	*result = state;
 
-end:
-
-	avfilter_inout_free(&inputs);
-	avfilter_inout_free(&outputs);
-
-	return rc;
+	return VOD_OK;
 }
 
 void
@@ -1081,6 +1672,349 @@ audio_filter_choose_source(audio_filter_state_t* state)
 	return VOD_OK;
 }
 
+// native mixer
+#if (VOD_HAVE_AVX2)
+
+AUDIO_FILTER_SIMD_ATTR static void
+audio_filter_mix_add_simd(float* dest, const float* src, float weight, size_t count)
+{
+	const float* end = src + count;
+	__m256 w = _mm256_set1_ps(weight);
+
+	for (; src < end; src += AUDIO_FILTER_SIMD_WIDTH, dest += AUDIO_FILTER_SIMD_WIDTH)
+	{
+		_mm256_storeu_ps(dest, _mm256_fmadd_ps(_mm256_loadu_ps(src), w, _mm256_loadu_ps(dest)));
+	}
+}
+
+AUDIO_FILTER_SIMD_ATTR static void
+audio_filter_mix_clip_simd(float* cur, size_t count)
+{
+	float* end = cur + count;
+	__m256 max = _mm256_set1_ps(1.0f);
+	__m256 min = _mm256_set1_ps(-1.0f);
+
+	for (; cur < end; cur += AUDIO_FILTER_SIMD_WIDTH)
+	{
+		_mm256_storeu_ps(cur, _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(cur), max), min));
+	}
+}
+
+#elif (AUDIO_FILTER_NEON)
+
+static void
+audio_filter_mix_add_simd(float* dest, const float* src, float weight, size_t count)
+{
+	const float* end = src + count;
+	float32x4_t w = vdupq_n_f32(weight);
+
+	for (; src < end; src += AUDIO_FILTER_SIMD_WIDTH, dest += AUDIO_FILTER_SIMD_WIDTH)
+	{
+		vst1q_f32(dest, vfmaq_f32(vld1q_f32(dest), vld1q_f32(src), w));
+	}
+}
+
+static void
+audio_filter_mix_clip_simd(float* cur, size_t count)
+{
+	float* end = cur + count;
+	float32x4_t max = vdupq_n_f32(1.0f);
+	float32x4_t min = vdupq_n_f32(-1.0f);
+
+	for (; cur < end; cur += AUDIO_FILTER_SIMD_WIDTH)
+	{
+		vst1q_f32(cur, vmaxq_f32(vminq_f32(vld1q_f32(cur), max), min));
+	}
+}
+
+#endif
+
+static void
+audio_filter_mix_add(float* dest, const float* src, float weight, size_t count)
+{
+	const float* end;
+#ifdef audio_filter_has_simd
+	size_t simd_count;
+
+	simd_count = count & ~(AUDIO_FILTER_SIMD_WIDTH - 1);
+	if (simd_count > 0 && audio_filter_has_simd())
+	{
+		audio_filter_mix_add_simd(dest, src, weight, simd_count);
+		dest += simd_count;
+		src += simd_count;
+		count -= simd_count;
+	}
+#endif
+
+	for (end = src + count; src < end; src++, dest++)
+	{
+		*dest += *src * weight;
+	}
+}
+
+static void
+audio_filter_mix_clip(float* cur, size_t count)
+{
+	float* end;
+#ifdef audio_filter_has_simd
+	size_t simd_count;
+
+	simd_count = count & ~(AUDIO_FILTER_SIMD_WIDTH - 1);
+	if (simd_count > 0 && audio_filter_has_simd())
+	{
+		audio_filter_mix_clip_simd(cur, simd_count);
+		cur += simd_count;
+		count -= simd_count;
+	}
+#endif
+
+	for (end = cur + count; cur < end; cur++)
+	{
+		if (*cur > 1.0f)
+		{
+			*cur = 1.0f;
+		}
+		else if (*cur < -1.0f)
+		{
+			*cur = -1.0f;
+		}
+	}
+}
+
+static vod_status_t
+audio_filter_mixer_add_frame(audio_filter_state_t* state, audio_filter_source_t* source, AVFrame* frame)
+{
+	audio_filter_mixer_t* mixer = state->mixer;
+	uint32_t channel;
+
+	if (frame->format != AV_SAMPLE_FMT_FLTP ||
+		frame->channels != (int)mixer->channels ||
+		frame->sample_rate != (int)mixer->sample_rate)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"audio_filter_mixer_add_frame: unexpected decoded frame, format=%d channels=%d sample_rate=%d",
+			frame->format, frame->channels, frame->sample_rate);
+		return VOD_UNEXPECTED;
+	}
+
+	if (frame->nb_samples > (int)(mixer->capacity - source->mix_pos))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"audio_filter_mixer_add_frame: decoded frame too big, samples=%d", frame->nb_samples);
+		return VOD_UNEXPECTED;
+	}
+
+	for (channel = 0; channel < mixer->channels; channel++)
+	{
+		audio_filter_mix_add(
+			mixer->planes[channel] + source->mix_pos,
+			(const float*)frame->extended_data[channel],
+			mixer->weight,
+			frame->nb_samples);
+	}
+
+	source->mix_pos += frame->nb_samples;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+audio_filter_mixer_write_frame(audio_filter_state_t* state, uint32_t sample_count, uint32_t buffered_count)
+{
+	audio_filter_source_t* sources_cur;
+	audio_filter_mixer_t* mixer = state->mixer;
+	AVFrame* frame = state->filtered_frame;
+	int16_t* dest;
+	float* src;
+	float* end;
+	uint32_t channel;
+	int avrc;
+
+	frame->format = state->sink.encoder->format;
+	frame->channels = mixer->channels;
+	frame->channel_layout = mixer->channel_layout;
+	frame->sample_rate = mixer->sample_rate;
+	frame->nb_samples = sample_count;
+	frame->pts = mixer->pts;
+
+	avrc = av_frame_get_buffer(frame, 0);
+	if (avrc < 0)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"audio_filter_mixer_write_frame: av_frame_get_buffer failed %d", avrc);
+		return VOD_ALLOC_FAILED;
+	}
+
+	for (channel = 0; channel < mixer->channels; channel++)
+	{
+		src = mixer->planes[channel];
+		audio_filter_mix_clip(src, sample_count);
+
+		if (frame->format == AV_SAMPLE_FMT_FLTP)
+		{
+			vod_memcpy(frame->extended_data[channel], src, sizeof(float) * sample_count);
+		}
+		else
+		{
+			// interleaved s16
+			dest = (int16_t*)frame->data[0] + channel;
+			for (end = src + sample_count; src < end; src++, dest += mixer->channels)
+			{
+				*dest = (int16_t)(*src * 32767.0f + (*src >= 0 ? 0.5f : -0.5f));
+			}
+		}
+
+		// shift the remaining samples to the beginning of the buffer
+		src = mixer->planes[channel];
+		vod_memmove(src, src + sample_count, sizeof(float) * (buffered_count - sample_count));
+		vod_memzero(src + buffered_count - sample_count, sizeof(float) * sample_count);
+	}
+
+	for (sources_cur = state->sources; sources_cur < state->sources_end; sources_cur++)
+	{
+		sources_cur->mix_pos = sources_cur->mix_pos > sample_count ? sources_cur->mix_pos - sample_count : 0;
+	}
+
+	mixer->pts += sample_count;
+
+	// Note: the encoder unrefs the frame
+	return state->sink.encoder->write(state->sink.encoder_context, frame);
+}
+
+static vod_status_t
+audio_filter_mixer_write_frames(audio_filter_state_t* state)
+{
+	audio_filter_source_t* sources_cur;
+	audio_filter_mixer_t* mixer = state->mixer;
+	vod_status_t rc;
+	uint32_t buffered_count;
+	uint32_t ready_count;
+	bool_t done;
+
+	for (;;)
+	{
+		// the samples are ready when all the active sources passed them
+		buffered_count = 0;
+		ready_count = UINT_MAX;
+		for (sources_cur = state->sources; sources_cur < state->sources_end; sources_cur++)
+		{
+			if (sources_cur->mix_pos > buffered_count)
+			{
+				buffered_count = sources_cur->mix_pos;
+			}
+
+			if (!sources_cur->mix_done && sources_cur->mix_pos < ready_count)
+			{
+				ready_count = sources_cur->mix_pos;
+			}
+		}
+
+		done = ready_count == UINT_MAX;
+		if (done)
+		{
+			ready_count = buffered_count;
+		}
+
+		if (ready_count < mixer->frame_size)
+		{
+			// flush the last (partial) frame
+			if (done && ready_count > 0)
+			{
+				return audio_filter_mixer_write_frame(state, ready_count, buffered_count);
+			}
+
+			return VOD_OK;
+		}
+
+		rc = audio_filter_mixer_write_frame(state, mixer->frame_size, buffered_count);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+}
+
+static vod_status_t
+audio_filter_mixer_process(audio_filter_state_t* state)
+{
+	audio_filter_source_t* sources_cur;
+	audio_filter_source_t* best_source;
+	vod_status_t rc;
+	AVFrame* frame;
+
+	for (;;)
+	{
+		// choose the source that is the most behind
+		best_source = NULL;
+		for (sources_cur = state->sources; sources_cur < state->sources_end; sources_cur++)
+		{
+			if (!sources_cur->mix_done &&
+				(best_source == NULL || sources_cur->mix_pos < best_source->mix_pos))
+			{
+				best_source = sources_cur;
+			}
+		}
+
+		if (best_source == NULL)
+		{
+			return VOD_OK;
+		}
+
+		rc = audio_decoder_get_frame(&best_source->decoder, &frame);
+		switch (rc)
+		{
+		case VOD_OK:
+			rc = audio_filter_mixer_add_frame(state, best_source, frame);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+			break;
+
+		case VOD_DONE:
+			best_source->mix_done = TRUE;
+			break;
+
+		default:
+			return rc;
+		}
+
+		rc = audio_filter_mixer_write_frames(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+}
+
+static vod_status_t
+audio_filter_finish(audio_filter_state_t* state)
+{
+	vod_status_t rc;
+
+	if (state->sink.encoder->flush != NULL)
+	{
+		rc = state->sink.encoder->flush(state->sink.encoder_context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	rc = audio_filter_update_track(state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (state->cache != NULL)
+	{
+		audio_filter_store_cache(state);
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t
 audio_filter_process(void* context)
 {
@@ -1088,6 +2022,17 @@ audio_filter_process(void* context)
 	vod_status_t rc;
 	AVFrame* frame;
 
+	if (state->mixer != NULL)
+	{
+		rc = audio_filter_mixer_process(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		return audio_filter_finish(state);
+	}
+
 	for (;;)
 	{
 		// choose a source if needed
@@ -1097,16 +2042,7 @@ audio_filter_process(void* context)
 			if (rc == VOD_NOT_FOUND)
 			{
 				// done
-				if (state->sink.encoder->flush != NULL)
-				{
-					rc = state->sink.encoder->flush(state->sink.encoder_context);
-					if (rc != VOD_OK)
-					{
-						return rc;
-					}
-				}
-
-				return audio_filter_update_track(state);
+				return audio_filter_finish(state);
 			}
 
 			if (rc != VOD_OK)
@@ -1136,11 +2072,6 @@ audio_filter_process(void* context)
 #else
 
 // empty stubs in case libavfilter/libavcodec are missing
-void 
-audio_filter_process_init(vod_log_t* log)
-{
-}
-
 vod_status_t
 audio_filter_alloc_state(
 	request_context_t* request_context,
@@ -1149,6 +2080,7 @@ audio_filter_alloc_state(
 	media_track_t* output_track,
 	uint32_t max_frame_count,
 	uint32_t output_codec_id,
+	audio_filter_cache_t* cache,
 	size_t* cache_buffer_count,
 	void** result)
 {
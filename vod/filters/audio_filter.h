@@ -12,9 +12,14 @@ struct audio_filter_s {
 
 typedef struct audio_filter_s audio_filter_t;
 
-// functions
-void audio_filter_process_init(vod_log_t* log);
+// cache of filtered tracks, the key is an opaque buffer that identifies the filter graph and its input
+typedef struct {
+	void* context;
+	vod_status_t (*fetch)(void* context, vod_str_t* key, vod_str_t* result);	// returns VOD_NOT_FOUND on miss, result is allocated on the request pool
+	void (*store)(void* context, vod_str_t* key, vod_str_t* buffer);
+} audio_filter_cache_t;
 
+// functions
 vod_status_t audio_filter_alloc_state(
 	request_context_t* request_context,
 	media_sequence_t* sequence,
@@ -22,6 +27,7 @@ vod_status_t audio_filter_alloc_state(
 	media_track_t* output_track,
 	uint32_t max_frame_count,
 	uint32_t output_codec_id,
+	audio_filter_cache_t* cache,
 	size_t* cache_buffer_count,
 	void** result);
 
@@ -1,6 +1,7 @@
 #include "filter.h"
 #include "audio_filter.h"
 #include "rate_filter.h"
+#include "gain_filter.h"
 #include "concat_clip.h"
 #include "../media_set.h"
 #include "../segmenter.h"
@@ -29,6 +30,7 @@ typedef struct {
 	void* audio_filter;
 	uint32_t max_frame_count;
 	uint32_t output_codec_id;
+	audio_filter_cache_t* cache;
 } apply_filters_state_t;
 
 static void
@@ -428,7 +430,19 @@ filter_init_filtered_clips(
 						init_state.audio_reference_track_speed_denom);
 				}
 
-				if (!parsed_frames || init_state.has_audio_frames)
+				if (gain_filter_is_compressed(input_clip, new_track))
+				{
+					// the gain is applied on the aac frames as they are read, no decoding / encoding
+					if (parsed_frames)
+					{
+						rc = gain_filter_init_compressed(request_context, input_clip, new_track);
+						if (rc != VOD_OK)
+						{
+							return rc;
+						}
+					}
+				}
+				else if (!parsed_frames || init_state.has_audio_frames)
 				{
 					new_track->source_clip = input_clip;
 					media_set->audio_filtering_needed = TRUE;
@@ -476,6 +490,7 @@ filter_init_state(
 	media_set_t* media_set,
 	uint32_t max_frame_count,
 	uint32_t output_codec_id,
+	audio_filter_cache_t* cache,
 	void** context)
 {
 	apply_filters_state_t* state;
@@ -496,6 +511,7 @@ filter_init_state(
 	state->cur_track = state->output_clip->first_track;
 	state->max_frame_count = max_frame_count;
 	state->output_codec_id = output_codec_id;
+	state->cache = cache;
 	state->audio_filter = NULL;
 
 	*context = state;
@@ -560,6 +576,7 @@ filter_run_state_machine(void* context)
 			state->cur_track,
 			state->max_frame_count,
 			state->output_codec_id,
+			state->cache,
 			&cache_buffer_count,
 			&state->audio_filter);
 		if (rc != VOD_OK)
@@ -5,6 +5,13 @@
 // macros
 #define GAIN_FILTER_DESC_PATTERN "[%uD]volume=volume=%uD.%02uD[%uD]"
 
+// constants
+#define AAC_OBJECT_TYPE_LC (2)
+#define AAC_CHANNEL_CONFIG_MONO (1)
+#define AAC_ID_SCE (0)
+#define AAC_MAX_GLOBAL_GAIN (255)
+#define AAC_MIN_FRAME_BUFFER_SIZE (2048)
+
 // enums
 enum {
 	GAIN_FILTER_PARAM_GAIN,
@@ -19,6 +26,18 @@ typedef struct {
 	vod_fraction_t gain;
 } media_clip_gain_filter_t;
 
+typedef struct {
+	request_context_t* request_context;
+	frames_source_t* frames_source;
+	void* frames_source_context;
+	int gain_steps;
+	bool_t reuse_buffers;
+	u_char* buffer;
+	uint32_t buffer_size;
+	uint32_t frame_size;
+	uint32_t frame_pos;
+} gain_filter_compressed_state_t;
+
 // constants
 static json_object_key_def_t gain_filter_params[] = {
 	{ vod_string("gain"), VOD_JSON_FRAC, GAIN_FILTER_PARAM_GAIN },
@@ -160,3 +179,253 @@ gain_filter_parser_init(
 
 	return VOD_OK;
 }
+
+/*
+	compressed gain - the spectral values of an aac frame are scaled by 2^((global_gain - 100) / 4),
+	so adding n to the global gain of all the channel elements amplifies the audio by 1.5n db.
+	the global gain is the first field of the individual channel stream, in a single channel element
+	it follows the element id and tag, the channel pair elements would require parsing the whole
+	spectral data of the first channel, and therefore only mono aac-lc is handled in the compressed domain.
+*/
+
+static int
+gain_filter_get_compressed_steps(vod_fraction_t* gain)
+{
+	double value = (double)gain->num / gain->denom;
+	double power;
+	int steps = 0;
+
+	// steps = round(4 * log2(gain)), i.e. 2^(steps - 0.5) <= gain^4 < 2^(steps + 0.5)
+	power = value * value * value * value;
+	while (power >= 1.4142135623730951)
+	{
+		power /= 2;
+		steps++;
+	}
+
+	while (power < 0.7071067811865476)
+	{
+		power *= 2;
+		steps--;
+	}
+
+	return steps;
+}
+
+static void
+gain_filter_apply_compressed(u_char* p, uint32_t size, int steps)
+{
+	int global_gain;
+
+	if (size < 2 || (p[0] >> 5) != AAC_ID_SCE)
+	{
+		return;
+	}
+
+	// id_syn_ele (3 bits), element_instance_tag (4 bits), global_gain (8 bits)
+	global_gain = ((p[0] & 0x01) << 7) | (p[1] >> 1);
+	global_gain = vod_max(0, vod_min(global_gain + steps, AAC_MAX_GLOBAL_GAIN));
+
+	p[0] = (p[0] & 0xfe) | (global_gain >> 7);
+	p[1] = (p[1] & 0x01) | ((global_gain & 0x7f) << 1);
+}
+
+static void
+gain_filter_compressed_set_cache_slot_id(void* ctx, int cache_slot_id)
+{
+	gain_filter_compressed_state_t* state = ctx;
+
+	state->frames_source->set_cache_slot_id(state->frames_source_context, cache_slot_id);
+}
+
+static vod_status_t
+gain_filter_compressed_start_frame(void* ctx, input_frame_t* frame, read_cache_hint_t* cache_hint)
+{
+	gain_filter_compressed_state_t* state = ctx;
+	vod_status_t rc;
+
+	rc = state->frames_source->start_frame(state->frames_source_context, frame, cache_hint);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// Note: the frame is copied since the source buffers may be shared (e.g. the read cache)
+	if (!state->reuse_buffers || frame->size > state->buffer_size)
+	{
+		state->buffer_size = vod_max(frame->size, AAC_MIN_FRAME_BUFFER_SIZE);
+		state->buffer = vod_alloc(state->request_context->pool, state->buffer_size);
+		if (state->buffer == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"gain_filter_compressed_start_frame: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+	}
+
+	state->frame_size = frame->size;
+	state->frame_pos = 0;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+gain_filter_compressed_read(void* ctx, u_char** buffer, uint32_t* size, bool_t* frame_done)
+{
+	gain_filter_compressed_state_t* state = ctx;
+	vod_status_t rc;
+	uint32_t read_size;
+	u_char* read_buffer;
+	bool_t read_done;
+
+	// Note: the position is kept on the state, a read that returns VOD_AGAIN resumes where it stopped
+	do
+	{
+		rc = state->frames_source->read(state->frames_source_context, &read_buffer, &read_size, &read_done);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		if (read_size > state->frame_size - state->frame_pos)
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"gain_filter_compressed_read: read size %uD exceeds the frame size %uD",
+				read_size, state->frame_size - state->frame_pos);
+			return VOD_UNEXPECTED;
+		}
+
+		vod_memcpy(state->buffer + state->frame_pos, read_buffer, read_size);
+		state->frame_pos += read_size;
+	} while (!read_done);
+
+	gain_filter_apply_compressed(state->buffer, state->frame_pos, state->gain_steps);
+
+	*buffer = state->buffer;
+	*size = state->frame_pos;
+	*frame_done = TRUE;
+
+	return VOD_OK;
+}
+
+static void
+gain_filter_compressed_disable_buffer_reuse(void* ctx)
+{
+	gain_filter_compressed_state_t* state = ctx;
+
+	state->reuse_buffers = FALSE;
+
+	state->frames_source->disable_buffer_reuse(state->frames_source_context);
+}
+
+static vod_status_t
+gain_filter_compressed_skip_frames(void* ctx, uint32_t skip_count)
+{
+	gain_filter_compressed_state_t* state = ctx;
+
+	return state->frames_source->skip_frames(state->frames_source_context, skip_count);
+}
+
+static frames_source_t gain_filter_compressed_frames_source = {
+	gain_filter_compressed_set_cache_slot_id,
+	gain_filter_compressed_start_frame,
+	gain_filter_compressed_read,
+	gain_filter_compressed_disable_buffer_reuse,
+	gain_filter_compressed_skip_frames,
+};
+
+bool_t
+gain_filter_is_compressed(media_clip_t* clip, media_track_t* track)
+{
+	media_clip_source_t* source;
+	media_track_t* cur_track;
+	uint32_t audio_tracks = 0;
+
+	if (clip->type != MEDIA_CLIP_GAIN_FILTER ||
+		clip->sources[0]->type != MEDIA_CLIP_SOURCE)
+	{
+		return FALSE;
+	}
+
+	if (track->media_info.codec_id != VOD_CODEC_ID_AAC ||
+		track->media_info.u.audio.codec_config.object_type != AAC_OBJECT_TYPE_LC ||
+		track->media_info.u.audio.codec_config.channel_config != AAC_CHANNEL_CONFIG_MONO)
+	{
+		return FALSE;
+	}
+
+	// the audio filter outputs a single track, a source with more audio tracks is left to the filter graph
+	source = vod_container_of(clip->sources[0], media_clip_source_t, base);
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+	{
+		if (cur_track->media_info.media_type == MEDIA_TYPE_AUDIO)
+		{
+			audio_tracks++;
+		}
+	}
+
+	return audio_tracks == 1;
+}
+
+vod_status_t
+gain_filter_init_compressed(
+	request_context_t* request_context,
+	media_clip_t* clip,
+	media_track_t* track)
+{
+	media_clip_gain_filter_t* filter = vod_container_of(clip, media_clip_gain_filter_t, base);
+	gain_filter_compressed_state_t* state;
+	frame_list_part_t* next_part;
+	frame_list_part_t* part;
+	int gain_steps;
+
+	gain_steps = gain_filter_get_compressed_steps(&filter->gain);
+	if (gain_steps == 0)
+	{
+		return VOD_OK;
+	}
+
+	for (part = &track->frames; ; part = part->next)
+	{
+		state = vod_alloc(request_context->pool, sizeof(*state));
+		if (state == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"gain_filter_init_compressed: vod_alloc failed (1)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		state->request_context = request_context;
+		state->frames_source = part->frames_source;
+		state->frames_source_context = part->frames_source_context;
+		state->gain_steps = gain_steps;
+		state->reuse_buffers = TRUE;
+		state->buffer = NULL;
+		state->buffer_size = 0;
+
+		part->frames_source = &gain_filter_compressed_frames_source;
+		part->frames_source_context = state;
+
+		if (part->next == NULL)
+		{
+			break;
+		}
+
+		// the following parts are shared with the source track, replace them with copies
+		next_part = vod_alloc(request_context->pool, sizeof(*next_part));
+		if (next_part == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"gain_filter_init_compressed: vod_alloc failed (2)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		*next_part = *part->next;
+		part->next = next_part;
+	}
+
+	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"gain_filter_init_compressed: applying %d global gain steps", gain_steps);
+
+	return VOD_OK;
+}
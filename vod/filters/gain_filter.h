@@ -2,6 +2,7 @@
 #define __GAIN_FILTER_H__
 
 // includes
+#include "../media_set.h"
 #include "../json_parser.h"
 
 // functions
@@ -14,4 +15,14 @@ vod_status_t gain_filter_parser_init(
 	vod_pool_t* pool,
 	vod_pool_t* temp_pool);
 
+// returns whether the gain of the clip can be applied on the compressed frames of the track,
+//	without decoding and encoding the audio (a gain filter over a source with a single mono aac-lc track)
+bool_t gain_filter_is_compressed(media_clip_t* clip, media_track_t* track);
+
+// applies the gain of the clip on the frames of the track as they are read
+vod_status_t gain_filter_init_compressed(
+	request_context_t* request_context,
+	media_clip_t* clip,
+	media_track_t* track);
+
 #endif // __GAIN_FILTER_H__
@@ -3,6 +3,32 @@
 #include "audio_decoder.h"
 #include "../write_buffer.h"
 
+/*
+	The sum of squares of the samples is vectorized, on x86, an avx2 implementation is used when it is 
+	supported by the cpu (checked in runtime). On aarch64, neon is always available.
+	The squares are accumulated as doubles, as in the scalar code.
+*/
+
+#if (VOD_HAVE_AVX2)
+#include <immintrin.h>
+
+#define volume_map_has_simd() (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+
+#define VOLUME_MAP_SIMD_ATTR __attribute__((target("avx2,fma")))
+
+#define VOLUME_MAP_SIMD_WIDTH (8)
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define VOLUME_MAP_NEON (1)
+
+#define volume_map_has_simd() (1)
+
+#define VOLUME_MAP_SIMD_WIDTH (4)
+
+#endif
+
 // constants
 #define RMS_LEVEL_PRECISION (100)
 #define RMS_LEVEL_FORMAT "%uD.%02uD\n"
@@ -43,6 +69,83 @@ typedef struct {
 } volume_map_writer_state_t;
 
 // common
+#if (VOD_HAVE_AVX2)
+
+VOLUME_MAP_SIMD_ATTR static double
+volume_map_sum_squares_simd(const float* cur, size_t count)
+{
+	const float* end = cur + count;
+	__m256d sum1 = _mm256_setzero_pd();
+	__m256d sum2 = _mm256_setzero_pd();
+	__m256d d;
+	__m256 v;
+	double sums[4];
+
+	for (; cur < end; cur += VOLUME_MAP_SIMD_WIDTH)
+	{
+		v = _mm256_loadu_ps(cur);
+		d = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+		sum1 = _mm256_fmadd_pd(d, d, sum1);
+		d = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+		sum2 = _mm256_fmadd_pd(d, d, sum2);
+	}
+
+	_mm256_storeu_pd(sums, _mm256_add_pd(sum1, sum2));
+	return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+#elif (VOLUME_MAP_NEON)
+
+static double
+volume_map_sum_squares_simd(const float* cur, size_t count)
+{
+	const float* end = cur + count;
+	float64x2_t sum1 = vdupq_n_f64(0);
+	float64x2_t sum2 = vdupq_n_f64(0);
+	float64x2_t d;
+	float32x4_t v;
+
+	for (; cur < end; cur += VOLUME_MAP_SIMD_WIDTH)
+	{
+		v = vld1q_f32(cur);
+		d = vcvt_f64_f32(vget_low_f32(v));
+		sum1 = vfmaq_f64(sum1, d, d);
+		d = vcvt_high_f64_f32(v);
+		sum2 = vfmaq_f64(sum2, d, d);
+	}
+
+	return vaddvq_f64(vaddq_f64(sum1, sum2));
+}
+
+#endif
+
+static double
+volume_map_sum_squares(const float* cur, size_t count)
+{
+	const float* end;
+	double sum_squares = 0;
+	double sample;
+#ifdef volume_map_has_simd
+	size_t simd_count;
+
+	simd_count = count & ~(VOLUME_MAP_SIMD_WIDTH - 1);
+	if (simd_count > 0 && volume_map_has_simd())
+	{
+		sum_squares = volume_map_sum_squares_simd(cur, simd_count);
+		cur += simd_count;
+		count -= simd_count;
+	}
+#endif
+
+	for (end = cur + count; cur < end; cur++)
+	{
+		sample = *cur;
+		sum_squares += sample * sample;
+	}
+
+	return sum_squares;
+}
+
 static vod_status_t
 volume_map_calc_frame(
 	request_context_t* request_context,
@@ -51,10 +154,7 @@ volume_map_calc_frame(
 {
 	const float** channel_cur;
 	const float** channel_end;
-	const float* cur;
-	const float* end;
 	double sum_squares;
-	double sample;
 
 	switch (frame->format)
 	{
@@ -64,13 +164,7 @@ volume_map_calc_frame(
 		channel_end = channel_cur + frame->channels;
 		for (; channel_cur < channel_end; channel_cur++)
 		{
-			cur = *channel_cur;
-			end = cur + frame->nb_samples;
-			for (; cur < end; cur++)
-			{
-				sample = *cur;
-				sum_squares += sample * sample;
-			}
+			sum_squares += volume_map_sum_squares(*channel_cur, frame->nb_samples);
 		}
 		break;
 
@@ -406,6 +500,18 @@ volume_map_writer_process(void* context)
 			continue;
 		}
 
+		if (rc == VOD_AGAIN)
+		{
+			// send the lines that were calculated so far, while waiting for the next read
+			rc = write_buffer_flush(&state->write_buffer, FALSE);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			return VOD_AGAIN;
+		}
+
 		if (rc != VOD_OK)
 		{
 			return rc;
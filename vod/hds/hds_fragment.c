@@ -5,6 +5,7 @@
 #include "../mp4/mp4_defs.h"
 #include "../mp4/mp4_fragment.h"
 #include "../aes_defs.h"
+#include "../stream_heap.h"
 
 // adobe mux packet definitions
 #define TAG_TYPE_AUDIO (8)
@@ -98,8 +99,8 @@ typedef struct {
 	int media_type;
 	uint8_t sound_info;
 	uint32_t frame_count;
-	uint32_t index;
 	uint32_t tag_size;
+	u_char tag_header[sizeof(adobe_mux_packet_header_t) + sizeof(video_tag_header_avc)];	// template, see hds_muxer_write_tag_header
 
 	uint64_t first_frame_time_offset;
 	uint64_t next_frame_time_offset;
@@ -110,9 +111,8 @@ typedef struct {
 	input_frame_t* cur_frame;
 	media_clip_source_t* source;
 
-	// frame output offsets
-	uint32_t* first_frame_output_offset;
-	uint32_t* cur_frame_output_offset;
+	// moof writing state
+	u_char* trun_pos;
 } hds_muxer_stream_state_t;
 
 struct hds_muxer_state_s {
@@ -123,6 +123,7 @@ struct hds_muxer_state_s {
 
 	hds_muxer_stream_state_t* first_stream;
 	hds_muxer_stream_state_t* last_stream;
+	stream_heap_t stream_heap;		// used when there are many streams, nodes is null otherwise
 	uint32_t codec_config_size;
 
 	write_buffer_state_t write_buffer_state;
@@ -586,6 +587,76 @@ hds_muxer_get_tag_size(media_track_t* cur_track)
 	}
 }
 
+static void
+hds_muxer_init_tag_header(hds_muxer_state_t* state, hds_muxer_stream_state_t* cur_stream)
+{
+	// the fields that change per frame are set by hds_muxer_write_tag_header
+	switch (cur_stream->media_type)
+	{
+	case MEDIA_TYPE_VIDEO:
+		hds_write_video_tag_header(
+			cur_stream->tag_header,
+			state->video_tag_type,
+			0,
+			0,
+			FRAME_TYPE_INTER_FRAME,
+			AVC_PACKET_TYPE_NALU,
+			0);
+		break;
+
+	case MEDIA_TYPE_AUDIO:
+		if ((cur_stream->sound_info >> 4) == SOUND_FORMAT_AAC)
+		{
+			hds_write_audio_tag_header_aac(
+				cur_stream->tag_header,
+				state->audio_tag_type,
+				0,
+				0,
+				cur_stream->sound_info,
+				AAC_PACKET_TYPE_RAW);
+		}
+		else
+		{
+			hds_write_audio_tag_header(
+				cur_stream->tag_header,
+				state->audio_tag_type,
+				0,
+				0,
+				cur_stream->sound_info);
+		}
+		break;
+	}
+}
+
+static u_char*
+hds_muxer_write_tag_header(
+	u_char* p,
+	hds_muxer_stream_state_t* cur_stream,
+	input_frame_t* frame,
+	uint32_t frame_size,
+	uint32_t timestamp)
+{
+	uint32_t data_size = frame_size + cur_stream->tag_size - sizeof(adobe_mux_packet_header_t);
+	u_char* result;
+
+	result = vod_copy(p, cur_stream->tag_header, cur_stream->tag_size);
+
+	p++;		// tag type
+	write_be24(p, data_size);
+	write_be24(p, timestamp);
+	*p++ = timestamp >> 24;
+
+	if (cur_stream->media_type == MEDIA_TYPE_VIDEO)
+	{
+		p += 3;		// stream id
+		*p++ = ((frame->key_frame ? FRAME_TYPE_KEY_FRAME : FRAME_TYPE_INTER_FRAME) << 4) | CODEC_ID_AVC;
+		p++;		// avc packet type
+		write_be24(p, frame->pts_delay);
+	}
+
+	return result;
+}
+
 ////// Muxer
 
 static vod_status_t
@@ -622,6 +693,7 @@ hds_muxer_init_track(
 	}
 	
 	cur_stream->tag_size = hds_muxer_get_tag_size(cur_track);
+	hds_muxer_init_tag_header(state, cur_stream);
 
 	return VOD_OK;
 }
@@ -635,6 +707,7 @@ hds_muxer_reinit_tracks(hds_muxer_state_t* state)
 
 	state->first_time = TRUE;
 	state->codec_config_size = 0;
+	stream_heap_reset(&state->stream_heap);
 
 	cur_track = state->first_clip_track;
 	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++, cur_track++)
@@ -658,6 +731,58 @@ hds_muxer_reinit_tracks(hds_muxer_state_t* state)
 	return VOD_OK;
 }
 
+// the heap contains the streams that have frames, keyed by the dts of their next frame.
+// the top of the heap is the stream that was chosen last, and moved to its next frame since.
+static void
+hds_muxer_heap_init(hds_muxer_state_t* state)
+{
+	hds_muxer_stream_state_t* cur_stream;
+
+	stream_heap_reset(&state->stream_heap);
+
+	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
+	{
+		if (cur_stream->cur_frame >= cur_stream->cur_frame_part.last_frame)
+		{
+			continue;
+		}
+
+		stream_heap_push(&state->stream_heap, cur_stream, cur_stream->next_frame_time_offset);
+	}
+}
+
+static vod_status_t
+hds_muxer_heap_choose_stream(hds_muxer_state_t* state, hds_muxer_stream_state_t** result)
+{
+	hds_muxer_stream_state_t* cur_stream = stream_heap_top(&state->stream_heap);
+
+	if (cur_stream->cur_frame >= cur_stream->cur_frame_part.last_frame &&
+		cur_stream->cur_frame_part.next != NULL)
+	{
+		cur_stream->cur_frame_part = *cur_stream->cur_frame_part.next;
+		cur_stream->cur_frame = cur_stream->cur_frame_part.first_frame;
+		cur_stream->source = get_frame_part_source_clip(cur_stream->cur_frame_part);
+		state->first_time = TRUE;
+	}
+
+	if (cur_stream->cur_frame < cur_stream->cur_frame_part.last_frame)
+	{
+		stream_heap_update_top(&state->stream_heap, cur_stream->next_frame_time_offset);
+	}
+	else
+	{
+		stream_heap_pop(&state->stream_heap);
+		if (state->stream_heap.count <= 0)
+		{
+			// fall back to a full scan, that handles the switch to the next clip
+			return VOD_NOT_FOUND;
+		}
+	}
+
+	*result = stream_heap_top(&state->stream_heap);
+	return VOD_OK;
+}
+
 static vod_status_t
 hds_muxer_choose_stream(hds_muxer_state_t* state, hds_muxer_stream_state_t** result)
 {
@@ -665,6 +790,15 @@ hds_muxer_choose_stream(hds_muxer_state_t* state, hds_muxer_stream_state_t** res
 	hds_muxer_stream_state_t* min_dts = NULL;
 	vod_status_t rc;
 
+	if (state->stream_heap.count > 0)
+	{
+		rc = hds_muxer_heap_choose_stream(state, result);
+		if (rc != VOD_NOT_FOUND)
+		{
+			return rc;
+		}
+	}
+
 	for (;;)
 	{
 		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
@@ -690,6 +824,11 @@ hds_muxer_choose_stream(hds_muxer_state_t* state, hds_muxer_stream_state_t** res
 
 		if (min_dts != NULL)
 		{
+			if (state->stream_heap.nodes != NULL)
+			{
+				hds_muxer_heap_init(state);
+			}
+
 			*result = min_dts;
 			return VOD_OK;
 		}
@@ -756,9 +895,22 @@ hds_calculate_output_offsets_and_write_afra_entries(
 			cur_offset += ENCRYPTION_TAG_HEADER_SIZE;
 		}
 
-		// set the offset (points to the beginning of the actual data)
-		*selected_stream->cur_frame_output_offset = cur_offset;
-		selected_stream->cur_frame_output_offset++;
+		// write the trun atom (the offset points to the beginning of the actual data)
+		if (selected_stream->trun_pos != NULL)
+		{
+			switch (selected_stream->media_type)
+			{
+			case MEDIA_TYPE_VIDEO:
+				selected_stream->trun_pos = hds_write_single_video_frame_trun_atom(
+					selected_stream->trun_pos, state->enc_type, selected_stream->cur_frame, cur_offset);
+				break;
+
+			case MEDIA_TYPE_AUDIO:
+				selected_stream->trun_pos = hds_write_single_audio_frame_trun_atom(
+					selected_stream->trun_pos, state->enc_type, selected_stream->cur_frame, cur_offset);
+				break;
+			}
+		}
 
 		// move to the end of the frame
 		if (state->enc_type != HDS_ENC_NONE)
@@ -788,20 +940,16 @@ hds_calculate_output_offsets_and_write_afra_entries(
 				"hds_calculate_output_offsets_and_write_afra_entries: unexpected - hds_muxer_reinit_tracks failed %i", rc);
 			return rc;
 		}
-
-		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
-		{
-			cur_stream->cur_frame_output_offset = cur_stream->first_frame_output_offset;
-		}
 	}
 	else
 	{
+		stream_heap_reset(&state->stream_heap);
+
 		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
 		{
 			cur_stream->cur_frame_part = *cur_stream->first_frame_part;
 			cur_stream->cur_frame = cur_stream->cur_frame_part.first_frame;
 			cur_stream->source = get_frame_part_source_clip(cur_stream->cur_frame_part);
-			cur_stream->cur_frame_output_offset = cur_stream->first_frame_output_offset;
 			cur_stream->next_frame_time_offset = cur_stream->first_frame_time_offset;
 		}
 	}
@@ -824,7 +972,6 @@ hds_muxer_init_state(
 	hds_muxer_stream_state_t* cur_stream;
 	hds_muxer_state_t* state;
 	uint32_t clip_index;
-	uint32_t index;
 	vod_status_t rc;
 
 	// allocate the state and stream states
@@ -846,6 +993,21 @@ hds_muxer_init_state(
 		return VOD_ALLOC_FAILED;
 	}
 	state->last_stream = state->first_stream + media_set->total_track_count;
+
+	if (media_set->total_track_count >= STREAM_HEAP_MIN_STREAMS)
+	{
+		rc = stream_heap_init(request_context, &state->stream_heap, media_set->total_track_count);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+	else
+	{
+		state->stream_heap.nodes = NULL;
+		state->stream_heap.count = 0;
+	}
+
 	state->request_context = request_context;
 	state->cur_frame = NULL;
 	state->first_time = TRUE;
@@ -854,14 +1016,27 @@ hds_muxer_init_state(
 
 	write_buffer_init(&state->write_buffer_state, request_context, write_callback, write_context, FALSE);
 
+	// Note: the encryption must be initialized before the tracks, since the tag types are used by the tag templates
+	state->enc_type = encryption_params->type;
+	if (state->enc_type != HDS_ENC_NONE)
+	{
+		rc = hds_muxer_encrypt_init(state, encryption_params);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+	else
+	{
+		state->video_tag_type = TAG_TYPE_VIDEO;
+		state->audio_tag_type = TAG_TYPE_AUDIO;
+	}
+
 	state->codec_config_size = 0;
 
-	index = 0;
 	cur_track = media_set->filtered_tracks;
-	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++, cur_track++, index++)
+	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++, cur_track++)
 	{
-		cur_stream->index = index;
-
 		// get total frame count for this stream
 		cur_stream->frame_count = cur_track->frame_count;
 		for (clip_index = 1; clip_index < media_set->clip_count; clip_index++)
@@ -869,17 +1044,7 @@ hds_muxer_init_state(
 			cur_stream->frame_count += cur_track[clip_index * media_set->total_track_count].frame_count;
 		}
 
-		// allocate the output offset
-		cur_stream->first_frame_output_offset = vod_alloc(
-			request_context->pool,
-			cur_stream->frame_count * sizeof(uint32_t));
-		if (cur_stream->first_frame_output_offset == NULL)
-		{
-			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-				"hds_muxer_init_state: vod_alloc failed (3)");
-			return VOD_ALLOC_FAILED;
-		}
-		cur_stream->cur_frame_output_offset = cur_stream->first_frame_output_offset;
+		cur_stream->trun_pos = NULL;
 
 		// init the stream
 		rc = hds_muxer_init_track(state, cur_stream, cur_track);
@@ -900,21 +1065,6 @@ hds_muxer_init_state(
 
 	state->first_clip_track = cur_track;
 
-	state->enc_type = encryption_params->type;
-	if (state->enc_type != HDS_ENC_NONE)
-	{
-		rc = hds_muxer_encrypt_init(state, encryption_params);
-		if (rc != VOD_OK)
-		{
-			return rc;
-		}
-	}
-	else
-	{
-		state->video_tag_type = TAG_TYPE_VIDEO;
-		state->audio_tag_type = TAG_TYPE_AUDIO;
-	}
-
 	*result = state;
 
 	return VOD_OK;
@@ -981,24 +1131,21 @@ hds_muxer_init_fragment(
 	size_t* total_fragment_size,
 	hds_muxer_state_t** processor_state)
 {
-	media_track_t* cur_track;
 	hds_muxer_stream_state_t* cur_stream;
-	frame_list_part_t* part;
 	media_sequence_t* sequence;
-	input_frame_t* cur_frame;
-	input_frame_t* last_frame;
 	hds_muxer_state_t* state;
 	vod_status_t rc;
 	uint32_t video_key_frame_count = 0;
 	uint32_t track_id = 1;
-	uint32_t clip_index;
-	uint32_t* output_offset;
 	uint32_t mdat_header_size;
 	size_t afra_atom_size;
 	size_t moof_atom_size;
 	size_t traf_atom_size;
 	size_t mdat_atom_size = 0;
 	size_t result_size;
+	u_char* moof_start;
+	u_char* moof_end;
+	u_char* traf_end;
 	u_char* p;
 
 	// get the total video key frame count
@@ -1090,6 +1237,30 @@ hds_muxer_init_fragment(
 
 	if (conf->generate_moof_atom)
 	{
+		// moof - the trun atoms are written while calculating the output offsets
+		moof_start = header->data + afra_atom_size;
+		moof_end = moof_start;
+
+		write_atom_header(moof_end, moof_atom_size, 'm', 'o', 'o', 'f');
+
+		// moof.mfhd
+		moof_end = mp4_fragment_write_mfhd_atom(moof_end, segment_index);
+
+		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
+		{
+			// moof.traf
+			traf_atom_size = hds_get_traf_atom_size(cur_stream);
+			traf_end = moof_end + traf_atom_size;
+			write_atom_header(moof_end, traf_atom_size, 't', 'r', 'a', 'f');
+
+			// moof.traf.tfhd
+			moof_end = hds_write_tfhd_atom(moof_end, track_id, ATOM_HEADER_SIZE + sizeof(afra_atom_t) + moof_atom_size);
+
+			// moof.traf.trun
+			cur_stream->trun_pos = moof_end;
+			moof_end = traf_end;
+		}
+
 		// afra
 		p = hds_write_afra_atom_header(p, afra_atom_size, video_key_frame_count);
 
@@ -1104,6 +1275,19 @@ hds_muxer_init_fragment(
 			return rc;
 		}
 
+		if (p != moof_start)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"hds_muxer_init_fragment: afra size %uz different than allocated size %uz",
+				(size_t)(p - header->data), afra_atom_size);
+			return VOD_UNEXPECTED;
+		}
+
+		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
+		{
+			cur_stream->trun_pos = NULL;
+		}
+
 		mdat_atom_size += mdat_header_size;
 
 		// calculate the total size now that we have the mdat size
@@ -1112,93 +1296,7 @@ hds_muxer_init_fragment(
 			moof_atom_size +
 			mdat_atom_size;
 
-		// moof
-		write_atom_header(p, moof_atom_size, 'm', 'o', 'o', 'f');
-
-		// moof.mfhd
-		p = mp4_fragment_write_mfhd_atom(p, segment_index);
-
-		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
-		{
-			// moof.traf
-			traf_atom_size = hds_get_traf_atom_size(cur_stream);
-			write_atom_header(p, traf_atom_size, 't', 'r', 'a', 'f');
-
-			// moof.traf.tfhd
-			p = hds_write_tfhd_atom(p, track_id, ATOM_HEADER_SIZE + sizeof(afra_atom_t) + moof_atom_size);
-
-			// moof.traf.trun
-			switch (cur_stream->media_type)
-			{
-			case MEDIA_TYPE_VIDEO:
-				clip_index = 0;
-				cur_track = media_set->filtered_tracks + cur_stream->index;
-				output_offset = cur_stream->first_frame_output_offset;
-				for (;;)
-				{
-					part = &cur_track->frames;
-					last_frame = part->last_frame;
-					for (cur_frame = part->first_frame; ;
-						cur_frame++, output_offset++)
-					{
-						if (cur_frame >= last_frame)
-						{
-							if (part->next == NULL)
-							{
-								break;
-							}
-							part = part->next;
-							cur_frame = part->first_frame;
-							last_frame = part->last_frame;
-						}
-
-						p = hds_write_single_video_frame_trun_atom(p, state->enc_type, cur_frame, *output_offset);
-					}
-
-					clip_index++;
-					if (clip_index >= media_set->clip_count)
-					{
-						break;
-					}
-					cur_track += media_set->total_track_count;
-				}
-				break;
-
-			case MEDIA_TYPE_AUDIO:
-				clip_index = 0;
-				cur_track = media_set->filtered_tracks + cur_stream->index;
-				output_offset = cur_stream->first_frame_output_offset;
-				for (;;)
-				{
-					part = &cur_track->frames;
-					last_frame = part->last_frame;
-					for (cur_frame = part->first_frame; ;
-						cur_frame++, output_offset++)
-					{
-						if (cur_frame >= last_frame)
-						{
-							if (part->next == NULL)
-							{
-								break;
-							}
-							part = part->next;
-							cur_frame = part->first_frame;
-							last_frame = part->last_frame;
-						}
-
-						p = hds_write_single_audio_frame_trun_atom(p, state->enc_type, cur_frame, *output_offset);
-					}
-
-					clip_index++;
-					if (clip_index >= media_set->clip_count)
-					{
-						break;
-					}
-					cur_track += media_set->total_track_count;
-				}
-				break;
-			}
-		}
+		p = moof_end;
 	}
 
 	// mdat
@@ -1264,7 +1362,6 @@ hds_muxer_start_frame(hds_muxer_state_t* state)
 	state->frames_source = selected_stream->cur_frame_part.frames_source;
 	state->frames_source_context = selected_stream->cur_frame_part.frames_source_context;
 	selected_stream->cur_frame++;
-	selected_stream->cur_frame_output_offset++;
 
 	cur_frame_dts = selected_stream->next_frame_time_offset;
 	selected_stream->next_frame_time_offset += state->cur_frame->duration;
@@ -1305,40 +1402,7 @@ hds_muxer_start_frame(hds_muxer_state_t* state)
 		p = hds_muxer_write_codec_config(p, state, cur_frame_dts);
 	}
 
-	switch (selected_stream->media_type)
-	{
-	case MEDIA_TYPE_VIDEO:
-		p = hds_write_video_tag_header(
-			p,
-			state->video_tag_type,
-			frame_size,
-			cur_frame_dts,
-			state->cur_frame->key_frame ? FRAME_TYPE_KEY_FRAME : FRAME_TYPE_INTER_FRAME,
-			AVC_PACKET_TYPE_NALU,
-			state->cur_frame->pts_delay);
-		break;
-
-	case MEDIA_TYPE_AUDIO:
-		if ((selected_stream->sound_info >> 4) == SOUND_FORMAT_AAC)
-		{
-			p = hds_write_audio_tag_header_aac(
-				p,
-				state->audio_tag_type,
-				frame_size,
-				cur_frame_dts,
-				selected_stream->sound_info,
-				AAC_PACKET_TYPE_RAW);
-		}
-		else
-		{
-			p = hds_write_audio_tag_header(
-				p,
-				state->audio_tag_type,
-				frame_size,
-				cur_frame_dts,
-				selected_stream->sound_info);
-		}
-	}
+	p = hds_muxer_write_tag_header(p, selected_stream, state->cur_frame, frame_size, cur_frame_dts);
 
 	if (state->enc_type != HDS_ENC_NONE)
 	{
@@ -141,6 +141,7 @@ typedef struct {
 typedef struct {
 	segment_durations_t durations;
 	uint32_t zero_segments;
+	vod_str_t abst;					// the base64 encoded abst atom, points to the manifest buffer
 } hds_segment_durations_t;
 
 static void
@@ -290,6 +291,41 @@ hds_write_abst_atom(
 	return p;
 }
 
+static bool_t
+hds_segment_durations_equal(hds_segment_durations_t* segments1, hds_segment_durations_t* segments2)
+{
+	segment_durations_t* durations1 = &segments1->durations;
+	segment_durations_t* durations2 = &segments2->durations;
+	segment_duration_item_t* last_item;
+	segment_duration_item_t* item1;
+	segment_duration_item_t* item2;
+
+	if (durations1->item_count != durations2->item_count ||
+		durations1->segment_count != durations2->segment_count ||
+		durations1->discontinuities != durations2->discontinuities ||
+		durations1->end_time != durations2->end_time ||
+		segments1->zero_segments != segments2->zero_segments)
+	{
+		return FALSE;
+	}
+
+	// Note: comparing field by field, the items may contain uninitialized padding
+	last_item = durations1->items + durations1->item_count;
+	for (item1 = durations1->items, item2 = durations2->items; item1 < last_item; item1++, item2++)
+	{
+		if (item1->segment_index != item2->segment_index ||
+			item1->repeat_count != item2->repeat_count ||
+			item1->time != item2->time ||
+			item1->duration != item2->duration ||
+			item1->discontinuity != item2->discontinuity)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static u_char*
 hds_write_base64_abst_atom(u_char* p, u_char* temp_buffer, media_set_t* media_set, hds_segment_durations_t* segment_durations)
 {
@@ -373,6 +409,8 @@ hds_packager_build_manifest(
 	media_track_t** cur_track_ptr;
 	media_track_t* tracks_array[MEDIA_TYPE_COUNT];
 	media_track_t* track;
+	hds_segment_durations_t* cur_segments;
+	hds_segment_durations_t* prev_segments;
 	vod_str_t* drm_metadata;
 	uint32_t initial_muxed_tracks;
 	uint32_t muxed_tracks;
@@ -587,7 +625,28 @@ hds_packager_build_manifest(
 			{
 			case MEDIA_SET_VOD:
 				p = vod_sprintf(p, HDS_BOOTSTRAP_VOD_HEADER, index);
-				p = hds_write_base64_abst_atom(p, temp_buffer, media_set, &segment_durations[index]);
+
+				// the abst atom is usually identical in all medias, reuse a previous one if possible
+				cur_segments = &segment_durations[index];
+				for (prev_segments = segment_durations; prev_segments < cur_segments; prev_segments++)
+				{
+					if (hds_segment_durations_equal(prev_segments, cur_segments))
+					{
+						break;
+					}
+				}
+
+				cur_segments->abst.data = p;
+				if (prev_segments < cur_segments)
+				{
+					p = vod_copy(p, prev_segments->abst.data, prev_segments->abst.len);
+				}
+				else
+				{
+					p = hds_write_base64_abst_atom(p, temp_buffer, media_set, cur_segments);
+				}
+				cur_segments->abst.len = p - cur_segments->abst.data;
+
 				p = vod_copy(p, HDS_BOOTSTRAP_VOD_FOOTER, sizeof(HDS_BOOTSTRAP_VOD_FOOTER) - 1);
 				break;
 
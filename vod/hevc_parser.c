@@ -1625,7 +1625,7 @@ hevc_parser_get_slice_header_size(
 		return rc;
 	}
 
-	start_pos = reader.stream.cur_pos;
+	start_pos = bit_read_stream_get_pos(&reader);
 
 	nal_unit_type = (buffer[0] >> 1) & 0x3f;
 
@@ -1896,7 +1896,7 @@ hevc_parser_get_slice_header_size(
 		return VOD_BAD_DATA;
 	}
 
-	while (reader.cur_bit > 0 && !reader.stream.eof_reached)
+	while (bit_read_stream_bits_left_in_byte(&reader) > 1 && !reader.stream.eof_reached)
 	{
 		if (bit_read_stream_get_one(&reader) != 0)			// alignment_bit_equal_to_zero
 		{
@@ -1913,13 +1913,13 @@ hevc_parser_get_slice_header_size(
 		return VOD_BAD_DATA;
 	}
 
-	*result = HEVC_NAL_HEADER_SIZE + (reader.stream.cur_pos - start_pos);
+	*result = HEVC_NAL_HEADER_SIZE + (bit_read_stream_get_pos(&reader) - start_pos);
 
 	if (start_pos != buffer + HEVC_NAL_HEADER_SIZE)
 	{
 		*result += avc_hevc_parser_emulation_prevention_encode_bytes(
 			start_pos,
-			reader.stream.cur_pos);
+			bit_read_stream_get_pos(&reader));
 	}
 
 	return VOD_OK;
@@ -1,4 +1,5 @@
 #include "adts_encoder_filter.h"
+#include "../request_arena.h"
 #include "../codec_config.h"
 
 // macros
@@ -86,11 +87,11 @@ adts_encoder_init(
 	request_context_t* request_context = context->request_context;
 
 	// allocate state
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"adts_encoder_init: vod_alloc failed");
+			"adts_encoder_init: request_arena_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -1,9 +1,23 @@
 #include "aes_cbc_encrypt.h"
 #include "../buffer_pool.h"
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+#define EVP_CIPHER_CTX_reset(ctx) EVP_CIPHER_CTX_cleanup(ctx)
+#endif
+
+// a cipher context that is kept for the next request, saves the allocation of the context
+static EVP_CIPHER_CTX* aes_cbc_encrypt_free_cipher = NULL;
+
 static void 
 aes_cbc_encrypt_cleanup(aes_cbc_encrypt_context_t* state)
 {
+	if (aes_cbc_encrypt_free_cipher == NULL &&
+		EVP_CIPHER_CTX_reset(state->cipher) == 1)
+	{
+		aes_cbc_encrypt_free_cipher = state->cipher;
+		return;
+	}
+
 	EVP_CIPHER_CTX_free(state->cipher);
 }
 
@@ -14,6 +28,7 @@ aes_cbc_encrypt_init(
 	write_callback_t callback,
 	void* callback_context,
 	buffer_pool_t* buffer_pool,
+	bool_t in_place,
 	const u_char* key,
 	const u_char* iv)
 {
@@ -36,7 +51,16 @@ aes_cbc_encrypt_init(
 		return VOD_ALLOC_FAILED;
 	}
 	
-	state->cipher = EVP_CIPHER_CTX_new();
+	if (aes_cbc_encrypt_free_cipher != NULL)
+	{
+		state->cipher = aes_cbc_encrypt_free_cipher;
+		aes_cbc_encrypt_free_cipher = NULL;
+	}
+	else
+	{
+		state->cipher = EVP_CIPHER_CTX_new();
+	}
+
 	if (state->cipher == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
@@ -51,6 +75,8 @@ aes_cbc_encrypt_init(
 	state->callback_context = callback_context;
 	state->request_context = request_context;
 	state->buffer_pool = buffer_pool;
+	state->in_place = in_place;
+	state->pending_size = 0;
 	
 	if (1 != EVP_EncryptInit_ex(state->cipher, EVP_aes_128_cbc(), NULL, key, iv))
 	{
@@ -136,6 +162,8 @@ aes_cbc_encrypt_write(
 	u_char* encrypted_buffer;
 	size_t required_size;
 	size_t buffer_size;
+	uint32_t aligned_size;
+	vod_status_t rc;
 	int out_size;
 
 	// zero size means flush
@@ -144,6 +172,33 @@ aes_cbc_encrypt_write(
 		return aes_cbc_encrypt_flush(state);
 	}
 
+	// when there is no pending partial block, the block aligned part of the buffer can be encrypted 
+	// in place, since its encrypted size equals the input size. only the remainder requires a buffer.
+	if (state->in_place && state->pending_size == 0)
+	{
+		aligned_size = size & ~(AES_BLOCK_SIZE - 1);
+		if (aligned_size > 0)
+		{
+			if (1 != EVP_EncryptUpdate(state->cipher, buffer, &out_size, buffer, aligned_size))
+			{
+				vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+					"aes_cbc_encrypt_write: EVP_EncryptUpdate failed (1)");
+				return VOD_UNEXPECTED;
+			}
+
+			rc = state->callback(state->callback_context, buffer, out_size);
+			if (rc != VOD_OK || aligned_size >= size)
+			{
+				return rc;
+			}
+
+			buffer += aligned_size;
+			size -= aligned_size;
+		}
+	}
+
+	state->pending_size = (state->pending_size + size) & (AES_BLOCK_SIZE - 1);
+
 	required_size = aes_round_up_to_block(size);
 	buffer_size = required_size;
 
@@ -170,7 +225,7 @@ aes_cbc_encrypt_write(
 	if (1 != EVP_EncryptUpdate(state->cipher, encrypted_buffer, &out_size, buffer, size))
 	{
 		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: EVP_EncryptUpdate failed");
+			"aes_cbc_encrypt_write: EVP_EncryptUpdate failed (2)");
 		return VOD_UNEXPECTED;
 	}
 
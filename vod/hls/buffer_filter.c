@@ -1,16 +1,35 @@
 #include "buffer_filter.h"
 #include "mpegts_encoder_filter.h"
+#include "../request_arena.h"
 
 // macros
 #define THIS_FILTER (MEDIA_FILTER_BUFFER)
 #define get_context(ctx) ((buffer_filter_t*)ctx->context[THIS_FILTER])
 
+#define buffer_filter_is_owned(state, pos) ((pos) >= (state)->start_pos && (pos) < (state)->end_pos)
+
 #define BUFFERED_FRAMES_QUEUE_SIZE (28)		// 28 = ceil(188/7) + 1, 188 = ts packet size, 7 = min audio frame size (adts header)
+#define BUFFERED_SEGMENTS_SIZE (BUFFERED_FRAMES_QUEUE_SIZE * 3)		// adts header + frame body, that may span 2 read buffers
+#define MIN_REFERENCE_SIZE (64)				// smaller writes are copied
+
+/*
+	The buffered data is kept as a list of segments, a segment either points to data that was copied to the
+	buffer of the filter, or, when the input is stable (read cache buffers), directly to the written buffer.
+	The references remain valid until the next read cache miss, the muxer calls buffer_filter_detach before
+	returning VOD_AGAIN, in order to copy the referenced data to the buffer of the filter.
+	Two buffers are used alternately, when a flush leaves unflushed data, it is copied to the other buffer,
+	so that the copied data of the active buffer is always ordered and bounded by the filter size.
+*/
 
 // typedefs
+typedef struct {
+	const u_char* pos;
+	uint32_t size;
+} buffered_segment_t;
+
 typedef struct {
 	output_frame_t frame;
-	u_char* end_pos;
+	uint32_t end_segment;
 } buffered_frame_info_t;
 
 typedef struct {
@@ -27,19 +46,24 @@ typedef struct {
 	uint32_t size;
 
 	// fixed
-	u_char* start_pos;
-	u_char* end_pos;
+	u_char* buffers[2];
 
 	// state
 	int cur_state;
 	output_frame_t cur_frame;
 	output_frame_t last_frame;
+	bool_t reference_input;
+	u_char* start_pos;
+	u_char* end_pos;
 	u_char* cur_pos;
-	u_char* last_flush_pos;
+	bool_t extend_segment;
+	buffered_segment_t segments[BUFFERED_SEGMENTS_SIZE];
+	uint32_t segment_count;
+	uint32_t last_flush_segment;
 
 	buffered_frames_queue_t buffered_frames;
 
-	// simulation mode
+	// buffered sizes (used in simulation mode as well)
 	uint32_t used_size;
 	uint32_t last_flush_size;
 } buffer_filter_t;
@@ -77,16 +101,73 @@ buffer_filter_start_frame(media_filter_context_t* context, output_frame_t* frame
 	return VOD_OK;
 }
 
+static vod_status_t
+buffer_filter_write_segments(media_filter_context_t* context, uint32_t first, uint32_t last)
+{
+	buffer_filter_t* state = get_context(context);
+	buffered_segment_t* cur_segment;
+	buffered_segment_t* last_segment;
+	vod_status_t rc;
+
+	last_segment = state->segments + last;
+	for (cur_segment = state->segments + first; cur_segment < last_segment; cur_segment++)
+	{
+		rc = state->next_filter.write(context, cur_segment->pos, cur_segment->size);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	return VOD_OK;
+}
+
+static void
+buffer_filter_remove_flushed_segments(buffer_filter_t* state)
+{
+	buffered_segment_t* src;
+	buffered_segment_t* dest;
+	buffered_segment_t* end;
+	u_char* buffer;
+
+	// copy the unflushed data to the other buffer
+	buffer = state->start_pos == state->buffers[0] ? state->buffers[1] : state->buffers[0];
+
+	dest = state->segments;
+	end = state->segments + state->segment_count;
+	state->cur_pos = buffer;
+	for (src = state->segments + state->last_flush_segment; src < end; src++, dest++)
+	{
+		dest->size = src->size;
+		if (!buffer_filter_is_owned(state, src->pos))
+		{
+			dest->pos = src->pos;
+			continue;
+		}
+
+		dest->pos = state->cur_pos;
+		state->cur_pos = vod_copy(state->cur_pos, src->pos, src->size);
+	}
+
+	state->start_pos = buffer;
+	state->end_pos = buffer + state->size;
+
+	state->segment_count -= state->last_flush_segment;
+	state->last_flush_segment = 0;
+	state->used_size -= state->last_flush_size;
+	state->last_flush_size = 0;
+}
+
 vod_status_t 
 buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_frame)
 {
 	buffer_filter_t* state = get_context(context);
 	vod_status_t rc;
-	u_char* np;
-	u_char* p;
+	uint32_t next_segment;
+	uint32_t cur_segment;
 
 	// if nothing was written since the last frame flush, nothing to do
-	if (state->last_flush_pos <= state->start_pos)
+	if (state->last_flush_segment <= 0)
 	{
 		return VOD_OK;
 	}
@@ -116,11 +197,11 @@ buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_fr
 
 		// when the frames are not aligned, need to write each frame separately since the pts
 		// that is outputted may be the pts of some previous frame
-		p = state->start_pos;
+		cur_segment = 0;
 
 		while (state->buffered_frames.write_pos != state->buffered_frames.read_pos)
 		{
-			if (p > state->start_pos)
+			if (cur_segment > 0)
 			{
 				rc = mpegts_encoder_start_sub_frame(context, &state->buffered_frames.data[state->buffered_frames.read_pos].frame);
 				if (rc != VOD_OK)
@@ -129,15 +210,15 @@ buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_fr
 				}
 			}
 
-			np = state->buffered_frames.data[state->buffered_frames.read_pos].end_pos;
+			next_segment = state->buffered_frames.data[state->buffered_frames.read_pos].end_segment;
 
-			rc = state->next_filter.write(context, p, np - p);
+			rc = buffer_filter_write_segments(context, cur_segment, next_segment);
 			if (rc != VOD_OK)
 			{
 				return rc;
 			}
 
-			p = np;
+			cur_segment = next_segment;
 
 			state->buffered_frames.read_pos++;
 			if (state->buffered_frames.read_pos >= BUFFERED_FRAMES_QUEUE_SIZE)
@@ -148,7 +229,7 @@ buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_fr
 	}
 	else
 	{
-		rc = state->next_filter.write(context, state->start_pos, state->last_flush_pos - state->start_pos);
+		rc = buffer_filter_write_segments(context, 0, state->last_flush_segment);
 		if (rc != VOD_OK)
 		{
 			return rc;
@@ -162,9 +243,7 @@ buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_fr
 	}
 	
 	// move back any remaining data
-	vod_memmove(state->start_pos, state->last_flush_pos, state->cur_pos - state->last_flush_pos);
-	state->cur_pos -= (state->last_flush_pos - state->start_pos);
-	state->last_flush_pos = state->start_pos;
+	buffer_filter_remove_flushed_segments(state);
 
 	switch (state->cur_state)
 	{
@@ -180,6 +259,42 @@ buffer_filter_force_flush(media_filter_context_t* context, bool_t last_stream_fr
 	return VOD_OK;
 }
 
+static void
+buffer_filter_append(buffer_filter_t* state, const u_char* buffer, uint32_t size)
+{
+	buffered_segment_t* cur_segment;
+
+	if (size <= 0)
+	{
+		return;
+	}
+
+	state->used_size += size;
+
+	if (state->reference_input && size >= MIN_REFERENCE_SIZE)
+	{
+		cur_segment = &state->segments[state->segment_count++];
+		cur_segment->pos = buffer;
+		cur_segment->size = size;
+		state->extend_segment = FALSE;
+		return;
+	}
+
+	if (state->extend_segment)
+	{
+		state->segments[state->segment_count - 1].size += size;
+	}
+	else
+	{
+		cur_segment = &state->segments[state->segment_count++];
+		cur_segment->pos = state->cur_pos;
+		cur_segment->size = size;
+		state->extend_segment = TRUE;
+	}
+
+	state->cur_pos = vod_copy(state->cur_pos, buffer, size);
+}
+
 static vod_status_t 
 buffer_filter_write(media_filter_context_t* context, const u_char* buffer, uint32_t size)
 {
@@ -202,7 +317,7 @@ buffer_filter_write(media_filter_context_t* context, const u_char* buffer, uint3
 	}
 	
 	// if there is not enough room try flushing the buffer
-	if (state->cur_pos + size > state->end_pos)
+	if (state->used_size + size > state->size || state->segment_count >= BUFFERED_SEGMENTS_SIZE)
 	{
 		rc = buffer_filter_force_flush(context, FALSE);
 		if (rc != VOD_OK)
@@ -211,10 +326,10 @@ buffer_filter_write(media_filter_context_t* context, const u_char* buffer, uint3
 		}
 	}
 	
-	// if there is enough room in the buffer, copy the input data
-	if (state->cur_pos + size <= state->end_pos)
+	// if there is enough room in the buffer, add the input data
+	if (state->used_size + size <= state->size && state->segment_count < BUFFERED_SEGMENTS_SIZE)
 	{
-		state->cur_pos = vod_copy(state->cur_pos, buffer, size);
+		buffer_filter_append(state, buffer, size);
 		return VOD_OK;
 	}
 	
@@ -227,14 +342,18 @@ buffer_filter_write(media_filter_context_t* context, const u_char* buffer, uint3
 		return rc;
 	}
 	
-	if (state->cur_pos > state->start_pos)
+	if (state->segment_count > 0)
 	{
-		rc = state->next_filter.write(context, state->start_pos, state->cur_pos - state->start_pos);
+		rc = buffer_filter_write_segments(context, 0, state->segment_count);
 		if (rc != VOD_OK)
 		{
 			return rc;
 		}
+
+		state->segment_count = 0;
+		state->used_size = 0;
 		state->cur_pos = state->start_pos;
+		state->extend_segment = FALSE;
 	}
 	
 	rc = state->next_filter.write(context, buffer, size);
@@ -260,7 +379,7 @@ buffer_filter_flush_frame(media_filter_context_t* context, bool_t last_stream_fr
 		{
 			// add the frame to the buffered frames queue
 			state->buffered_frames.data[state->buffered_frames.write_pos].frame = state->last_frame;
-			state->buffered_frames.data[state->buffered_frames.write_pos].end_pos = state->cur_pos;
+			state->buffered_frames.data[state->buffered_frames.write_pos].end_segment = state->segment_count;
 			state->buffered_frames.write_pos++;
 			if (state->buffered_frames.write_pos >= BUFFERED_FRAMES_QUEUE_SIZE)
 			{
@@ -274,7 +393,9 @@ buffer_filter_flush_frame(media_filter_context_t* context, bool_t last_stream_fr
 		}
 
 		// update the last flush position
-		state->last_flush_pos = state->cur_pos;
+		state->last_flush_segment = state->segment_count;
+		state->last_flush_size = state->used_size;
+		state->extend_segment = FALSE;		// the segments of the next frame start after this position
 		state->cur_state = STATE_FRAME_FLUSHED;
 
 		if (last_stream_frame)
@@ -303,6 +424,38 @@ buffer_filter_flush_frame(media_filter_context_t* context, bool_t last_stream_fr
 	return VOD_OK;
 }
 
+void
+buffer_filter_set_reference_input(media_filter_context_t* context, bool_t reference_input)
+{
+	buffer_filter_t* state = get_context(context);
+
+	state->reference_input = reference_input;
+}
+
+void
+buffer_filter_detach(media_filter_context_t* context)
+{
+	buffer_filter_t* state = get_context(context);
+	buffered_segment_t* cur_segment;
+	buffered_segment_t* last_segment;
+
+	last_segment = state->segments + state->segment_count;
+	for (cur_segment = state->segments; cur_segment < last_segment; cur_segment++)
+	{
+		if (buffer_filter_is_owned(state, cur_segment->pos))
+		{
+			continue;
+		}
+
+		// Note: the copied size is bounded by used_size, so it always fits in the buffer
+		vod_memcpy(state->cur_pos, cur_segment->pos, cur_segment->size);
+		cur_segment->pos = state->cur_pos;
+		state->cur_pos += cur_segment->size;
+	}
+
+	state->extend_segment = FALSE;
+}
+
 bool_t 
 buffer_filter_get_dts(media_filter_context_t* context, uint64_t* dts)
 {
@@ -446,11 +599,11 @@ buffer_filter_init(
 	buffer_filter_t* state;
 	request_context_t* request_context = context->request_context;
 
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"buffer_filter_init: vod_alloc failed (1)");
+			"buffer_filter_init: request_arena_alloc failed (1)");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -471,16 +624,22 @@ buffer_filter_init(
 		return VOD_OK;
 	}
 
-	state->start_pos = vod_alloc(request_context->pool, size);
-	if (state->start_pos == NULL)
+	state->buffers[0] = request_arena_alloc(request_context, size * 2);
+	if (state->buffers[0] == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"buffer_filter_init: vod_alloc failed (2)");
+			"buffer_filter_init: request_arena_alloc failed (2)");
 		return VOD_ALLOC_FAILED;
 	}
+	state->buffers[1] = state->buffers[0] + size;
+
+	state->start_pos = state->buffers[0];
 	state->end_pos = state->start_pos + size;
 	state->cur_pos = state->start_pos;
-	state->last_flush_pos = state->cur_pos;
+	state->reference_input = FALSE;
+	state->extend_segment = FALSE;
+	state->segment_count = 0;
+	state->last_flush_segment = 0;
 
 	state->buffered_frames.read_pos = 0;
 	state->buffered_frames.write_pos = 0;
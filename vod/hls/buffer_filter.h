@@ -15,6 +15,16 @@ vod_status_t buffer_filter_force_flush(
 	media_filter_context_t* context, 
 	bool_t last_stream_frame);
 
+// when set, writes of the current frame may be referenced instead of copied, the written buffers
+// must remain valid until the frame is flushed or buffer_filter_detach is called
+void buffer_filter_set_reference_input(
+	media_filter_context_t* context, 
+	bool_t reference_input);
+
+// copies any referenced data to the buffer of the filter
+void buffer_filter_detach(
+	media_filter_context_t* context);
+
 bool_t buffer_filter_get_dts(
 	media_filter_context_t* context, 
 	uint64_t* dts);
@@ -6,9 +6,8 @@
 
 #include "aes_cbc_encrypt.h"
 
-#define FRAME_ENCRYPT_KEY_SIZE (16)
 #define CLEAR_LEAD_SIZE (16)
-#define ENCRYPTED_BUFFER_SIZE (256)
+#define ENCRYPTED_BUFFER_SIZE (4096)		// the max size of an e-ac3 sync frame, audio frames are usually encrypted in one call
 
 // typedefs
 typedef struct
@@ -17,7 +16,6 @@ typedef struct
 	media_filter_start_frame_t start_frame;
 	media_filter_write_t write;
 	u_char iv[AES_BLOCK_SIZE];
-	u_char key[FRAME_ENCRYPT_KEY_SIZE];
 
 	// state
 	EVP_CIPHER_CTX* cipher;
@@ -35,8 +33,8 @@ frame_encrypt_start_frame(media_filter_context_t* context, output_frame_t* frame
 
 	if (state->max_encrypt_offset > CLEAR_LEAD_SIZE)
 	{
-		// reset the IV (it is ok to call EVP_EncryptInit_ex several times without cleanup)
-		if (1 != EVP_EncryptInit_ex(state->cipher, EVP_aes_128_cbc(), NULL, state->key, state->iv))
+		// reset the IV, the key schedule is set once in frame_encrypt_filter_init
+		if (1 != EVP_EncryptInit_ex(state->cipher, NULL, NULL, NULL, state->iv))
 		{
 			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
 				"frame_encrypt_start_frame: EVP_EncryptInit_ex failed");
@@ -167,8 +165,14 @@ frame_encrypt_filter_init(
 	cln->handler = (vod_pool_cleanup_pt)frame_encrypt_cleanup;
 	cln->data = state;
 
+	if (1 != EVP_EncryptInit_ex(state->cipher, EVP_aes_128_cbc(), NULL, encryption_params->key, NULL))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"frame_encrypt_filter_init: EVP_EncryptInit_ex failed");
+		return VOD_ALLOC_FAILED;
+	}
+
 	vod_memcpy(state->iv, encryption_params->iv, sizeof(state->iv));
-	vod_memcpy(state->key, encryption_params->key, sizeof(state->key));
 
 	// save required functions
 	state->start_frame = filter->start_frame;
@@ -1,4 +1,5 @@
 #include "frame_joiner_filter.h"
+#include "../request_arena.h"
 #include "mpegts_encoder_filter.h"
 
 // macros
@@ -119,11 +120,11 @@ frame_joiner_init(
 	request_context_t* request_context = context->request_context;
 
 	// allocate state
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"frame_joiner_init: vod_alloc failed");
+			"frame_joiner_init: request_arena_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
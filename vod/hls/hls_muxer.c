@@ -3,6 +3,7 @@
 #include "frame_joiner_filter.h"
 #include "id3_encoder_filter.h"
 #include "hls_muxer.h"
+#include "../request_arena.h"
 
 #if (VOD_HAVE_OPENSSL_EVP)
 #include "frame_encrypt_filter.h"
@@ -331,12 +332,12 @@ hls_muxer_init_base(
 	}
 
 	// allocate the streams
-	state->first_stream = vod_alloc(request_context->pool, 
+	state->first_stream = request_arena_alloc(request_context, 
 		sizeof(*state->first_stream) * (media_set->total_track_count + 1));
 	if (state->first_stream == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"hls_muxer_init_base: vod_alloc failed");
+			"hls_muxer_init_base: request_arena_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -411,6 +412,9 @@ hls_muxer_init_base(
 				{
 					return rc;
 				}
+
+				// Note: the sample aes filters write the encrypted frames from their own buffers
+				cur_stream->buffer_references = encryption_params->type != HLS_ENC_SAMPLE_AES;
 			}
 
 			if (track->media_info.codec_id == VOD_CODEC_ID_AAC)
@@ -482,6 +486,20 @@ hls_muxer_init_base(
 
 	mpegts_encoder_finalize_streams(&init_streams_state, response_header);
 
+	if (state->last_stream - state->first_stream >= STREAM_HEAP_MIN_STREAMS)
+	{
+		rc = stream_heap_init(request_context, &state->stream_heap, state->last_stream - state->first_stream);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+	else
+	{
+		state->stream_heap.nodes = NULL;
+		state->stream_heap.count = 0;
+	}
+
 	if (media_set->timing.durations != NULL)
 	{
 		state->video_duration = media_set->timing.total_duration;
@@ -507,12 +525,14 @@ hls_muxer_init_segment(
 	hls_muxer_state_t* state;
 	bool_t simulation_supported;
 	vod_status_t rc;
+	size_t header_size;
+	u_char* p;
 
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"hls_muxer_init_segment: vod_alloc failed");
+			"hls_muxer_init_segment: request_arena_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -538,7 +558,8 @@ hls_muxer_init_segment(
 		return rc;
 	}
 
-	if (simulation_supported)
+	// response_size is null when the caller does not need the size in advance
+	if (simulation_supported && response_size != NULL)
 	{
 		rc = hls_muxer_simulate_get_segment_size(state, response_size);
 		if (rc != VOD_OK)
@@ -549,6 +570,25 @@ hls_muxer_init_segment(
 		hls_muxer_simulation_reset(state);
 	}
 
+	header_size = response_header->len;
+	if (encryption_params->type == HLS_ENC_AES_128 && header_size > 0)
+	{
+		// write the PAT/PMT to the queue instead of returning them separately, this keeps the queue buffers 
+		// aligned to the AES block size, so that they can be encrypted in place
+		state->queue.cur_offset = 0;
+
+		p = write_buffer_queue_get_buffer(&state->queue, header_size, NULL);
+		if (p == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"hls_muxer_init_segment: write_buffer_queue_get_buffer failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		vod_memcpy(p, response_header->data, header_size);
+		response_header->len = 0;
+	}
+
 	rc = hls_muxer_start_frame(state);
 	if (rc != VOD_OK)
 	{
@@ -558,6 +598,7 @@ hls_muxer_init_segment(
 		}
 
 		*processor_state = NULL;		// no frames, nothing to do
+		response_header->len = header_size;		// the queue is not flushed in this case
 	}
 	else
 	{
@@ -575,6 +616,7 @@ hls_muxer_reinit_tracks(hls_muxer_state_t* state)
 	vod_status_t rc;
 
 	state->first_time = TRUE;
+	stream_heap_reset(&state->stream_heap);
 
 	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
 	{
@@ -598,14 +640,93 @@ hls_muxer_reinit_tracks(hls_muxer_state_t* state)
 	return VOD_OK;
 }
 
+// the heap contains the streams that have frames before the segment limit, keyed by the dts of their next frame.
+// the top of the heap is the stream that was chosen last, and moved to its next frame since.
+static void
+hls_muxer_heap_init(hls_muxer_state_t* state)
+{
+	hls_muxer_stream_state_t* cur_stream;
+
+	stream_heap_reset(&state->stream_heap);
+
+	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
+	{
+		if (cur_stream->cur_frame >= cur_stream->cur_frame_part.last_frame ||
+			cur_stream->next_frame_time_offset >= cur_stream->segment_limit)
+		{
+			continue;
+		}
+
+		stream_heap_push(&state->stream_heap, cur_stream, cur_stream->next_frame_time_offset);
+	}
+}
+
+static vod_status_t
+hls_muxer_heap_choose_stream(hls_muxer_state_t* state, hls_muxer_stream_state_t** result)
+{
+	hls_muxer_stream_state_t* cur_stream = stream_heap_top(&state->stream_heap);
+
+	if (cur_stream->cur_frame >= cur_stream->cur_frame_part.last_frame &&
+		cur_stream->cur_frame_part.next != NULL)
+	{
+		cur_stream->cur_frame_part = *cur_stream->cur_frame_part.next;
+		cur_stream->cur_frame = cur_stream->cur_frame_part.first_frame;
+		cur_stream->source = get_frame_part_source_clip(cur_stream->cur_frame_part);
+		state->first_time = TRUE;
+	}
+
+	if (cur_stream->cur_frame < cur_stream->cur_frame_part.last_frame &&
+		cur_stream->next_frame_time_offset < cur_stream->segment_limit)
+	{
+		stream_heap_update_top(&state->stream_heap, cur_stream->next_frame_time_offset);
+	}
+	else
+	{
+		stream_heap_pop(&state->stream_heap);
+		if (state->stream_heap.count <= 0)
+		{
+			// fall back to a full scan, that handles the switch to the next clip
+			return VOD_NOT_FOUND;
+		}
+	}
+
+	*result = stream_heap_top(&state->stream_heap);
+	return VOD_OK;
+}
+
 static vod_status_t
 hls_muxer_choose_stream(hls_muxer_state_t* state, hls_muxer_stream_state_t** result)
 {
 	hls_muxer_stream_state_t* cur_stream;
 	hls_muxer_stream_state_t* min_dts = NULL;
+	hls_muxer_stream_state_t* other;
 	vod_status_t rc;
 	bool_t has_frames = FALSE;
 
+	if (state->stream_heap.count > 0)
+	{
+		rc = hls_muxer_heap_choose_stream(state, result);
+		if (rc != VOD_NOT_FOUND)
+		{
+			return rc;
+		}
+	}
+
+	// fast path - two streams (usually video + audio), both in the middle of their frame parts
+	if (state->last_stream - state->first_stream == 2)
+	{
+		cur_stream = state->first_stream;
+		other = cur_stream + 1;
+		if (cur_stream->cur_frame < cur_stream->cur_frame_part.last_frame &&
+			other->cur_frame < other->cur_frame_part.last_frame &&
+			cur_stream->next_frame_time_offset < cur_stream->segment_limit &&
+			other->next_frame_time_offset < other->segment_limit)
+		{
+			*result = other->next_frame_time_offset < cur_stream->next_frame_time_offset ? other : cur_stream;
+			return VOD_OK;
+		}
+	}
+
 	for (;;)
 	{
 		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
@@ -637,6 +758,11 @@ hls_muxer_choose_stream(hls_muxer_state_t* state, hls_muxer_stream_state_t** res
 
 		if (min_dts != NULL)
 		{
+			if (state->stream_heap.nodes != NULL)
+			{
+				hls_muxer_heap_init(state);
+			}
+
 			*result = min_dts;
 			return VOD_OK;
 		}
@@ -685,6 +811,14 @@ hls_muxer_start_frame(hls_muxer_state_t* state)
 	selected_stream->cur_frame++;
 	state->frames_source = selected_stream->cur_frame_part.frames_source;
 	state->frames_source_context = selected_stream->cur_frame_part.frames_source_context;
+
+	if (selected_stream->filter_context.context[MEDIA_FILTER_BUFFER] != NULL)
+	{
+		// the read cache buffers remain valid until the next read, see hls_muxer_detach_buffers
+		buffer_filter_set_reference_input(
+			&selected_stream->filter_context,
+			selected_stream->buffer_references && state->frames_source == &frames_source_cache);
+	}
 	cur_frame_time_offset = selected_stream->next_frame_time_offset;
 	cur_frame_dts = selected_stream->next_frame_time_offset;
 	selected_stream->next_frame_time_offset += state->cur_frame->duration;
@@ -756,6 +890,20 @@ hls_muxer_start_frame(hls_muxer_state_t* state)
 	return VOD_OK;
 }
 
+static void
+hls_muxer_detach_buffers(hls_muxer_state_t* state)
+{
+	hls_muxer_stream_state_t* cur_stream;
+
+	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
+	{
+		if (cur_stream->filter_context.context[MEDIA_FILTER_BUFFER] != NULL)
+		{
+			buffer_filter_detach(&cur_stream->filter_context);
+		}
+	}
+}
+
 static vod_status_t
 hls_muxer_send(hls_muxer_state_t* state)
 {
@@ -800,6 +948,9 @@ hls_muxer_process(hls_muxer_state_t* state)
 				return VOD_BAD_DATA;
 			}
 
+			// the read that follows may overwrite the read cache buffers referenced by the buffered audio
+			hls_muxer_detach_buffers(state);
+
 			rc = hls_muxer_send(state);
 			if (rc != VOD_OK)
 			{
@@ -907,6 +1058,8 @@ hls_muxer_simulation_set_segment_limit(
 {
 	hls_muxer_stream_state_t* cur_stream;
 
+	stream_heap_reset(&state->stream_heap);
+
 	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
 	{
 		cur_stream->segment_limit = (segment_end * HLS_TIMESCALE) / timescale - cur_stream->clip_from_frame_offset;
@@ -920,6 +1073,8 @@ hls_muxer_simulation_set_segment_limit_unlimited(
 {
 	hls_muxer_stream_state_t* cur_stream;
 
+	stream_heap_reset(&state->stream_heap);
+
 	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
 	{
 		cur_stream->segment_limit = ULLONG_MAX;
@@ -1251,6 +1406,8 @@ hls_muxer_simulation_reset(hls_muxer_state_t* state)
 	}
 	else
 	{
+		stream_heap_reset(&state->stream_heap);
+
 		for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++)
 		{
 			cur_stream->cur_frame_part = *cur_stream->first_frame_part;
@@ -8,6 +8,7 @@
 #include "buffer_filter.h"
 #include "../media_format.h"
 #include "../segmenter.h"
+#include "../stream_heap.h"
 
 // constants
 #define HLS_TIMESCALE (90000)
@@ -52,6 +53,7 @@ typedef struct {
 	// top filter
 	media_filter_t filter;
 	media_filter_context_t filter_context;
+	bool_t buffer_references;		// the buffer filter may reference the frames source buffers
 
 	// mpegts
 	mpegts_encoder_state_t mpegts_encoder_state;
@@ -63,6 +65,7 @@ typedef struct {
 	// fixed
 	hls_muxer_stream_state_t* first_stream;
 	hls_muxer_stream_state_t* last_stream;
+	stream_heap_t stream_heap;		// used when there are many streams, nodes is null otherwise
 	uint32_t video_duration;
 
 	// child states
@@ -10,6 +10,16 @@
 #define M3U8_HEADER_PART1 "#EXTM3U\n#EXT-X-TARGETDURATION:%uL\n#EXT-X-ALLOW-CACHE:YES\n"
 #define M3U8_HEADER_VOD "#EXT-X-PLAYLIST-TYPE:VOD\n"
 #define M3U8_HEADER_PART2 "#EXT-X-VERSION:%d\n#EXT-X-MEDIA-SEQUENCE:%uD\n"
+#define M3U8_SERVER_CONTROL "#EXT-X-SERVER-CONTROL:"
+#define M3U8_CAN_SKIP_UNTIL "CAN-SKIP-UNTIL=%uD.%03uD"
+#define M3U8_PART_HOLD_BACK "PART-HOLD-BACK=%uD.%03uD"
+#define M3U8_PART_INF "#EXT-X-PART-INF:PART-TARGET=%uD.%03uD\n"
+#define M3U8_SKIP "#EXT-X-SKIP:SKIPPED-SEGMENTS=%uD\n"
+
+#define M3U8_PART_SEGMENTS (3)			// number of segments at the end of a live playlist that are returned with parts
+#define M3U8_PART_HOLD_BACK_PARTS (3)
+
+#define M3U8_DELTA_UPDATE_VERSION (9)
 
 #define M3U8_EXT_MEDIA_BASE "#EXT-X-MEDIA:TYPE=%s,GROUP-ID=\"%s%uD\",NAME=\"%V\","
 #define M3U8_EXT_MEDIA_LANG "LANGUAGE=\"%s\","
@@ -39,6 +49,9 @@ static const char m3u8_stream_inf_audio[] = "#EXT-X-STREAM-INF:PROGRAM-ID=1,BAND
 static const char m3u8_average_bandwidth[] = ",AVERAGE-BANDWIDTH=%uD";
 static const char m3u8_iframe_stream_inf[] = "#EXT-X-I-FRAME-STREAM-INF:BANDWIDTH=%uD,RESOLUTION=%uDx%uD,CODECS=\"%V\",URI=\"";
 static const u_char m3u8_discontinuity[] = "#EXT-X-DISCONTINUITY\n";
+static const u_char m3u8_part_duration[] = "#EXT-X-PART:DURATION=";
+static const u_char m3u8_part_uri[] = ",URI=\"";
+static const u_char m3u8_part_independent[] = ",INDEPENDENT=YES";
 static const char byte_range_tag_format[] = "#EXT-X-BYTERANGE:%uD@%uD\n";
 static const u_char m3u8_url_suffix[] = ".m3u8";
 static const u_char m3u8_map_prefix[] = "#EXT-X-MAP:URI=\"";
@@ -72,6 +85,8 @@ typedef struct {
 	vod_str_t name_suffix;
 	vod_str_t* base_url;
 	vod_str_t* segment_file_name_prefix;
+	m3u8_iframe_t* iframes_pos;
+	m3u8_iframe_t* iframes_end;
 } write_segment_context_t;
 
 // Notes: 
@@ -107,6 +122,23 @@ m3u8_builder_format_double(u_char* p, uint32_t n, uint32_t scale)
 	return p;
 }
 
+// Note: faster than vod_sprintf, this function is called for every segment
+static u_char*
+m3u8_builder_write_uint32(u_char* p, uint32_t n)
+{
+	u_char buf[VOD_INT32_LEN];
+	u_char* end = buf + sizeof(buf);
+	u_char* cur = end;
+
+	do
+	{
+		*--cur = (u_char)('0' + n % 10);
+		n /= 10;
+	} while (n != 0);
+
+	return vod_copy(p, cur, end - cur);
+}
+
 static u_char*
 m3u8_builder_append_segment_name(
 	u_char* p, 
@@ -118,11 +150,48 @@ m3u8_builder_append_segment_name(
 	p = vod_copy(p, base_url->data, base_url->len);
 	p = vod_copy(p, segment_file_name_prefix->data, segment_file_name_prefix->len);
 	*p++ = '-';
-	p = vod_sprintf(p, "%uD", segment_index + 1);
+	p = m3u8_builder_write_uint32(p, segment_index + 1);
 	p = vod_copy(p, suffix->data, suffix->len);
 	return p;
 }
 
+static u_char*
+m3u8_builder_append_parts(
+	u_char* p,
+	vod_str_t* base_url,
+	vod_str_t* segment_file_name_prefix,
+	uint32_t segment_index,
+	vod_str_t* suffix,
+	uint32_t segment_duration,
+	uint32_t part_duration,
+	bool_t independent)
+{
+	uint32_t part_index;
+	uint32_t offset;
+
+	for (part_index = 0, offset = 0; offset < segment_duration; part_index++, offset += part_duration)
+	{
+		p = vod_copy(p, m3u8_part_duration, sizeof(m3u8_part_duration) - 1);
+		p = m3u8_builder_format_double(p, vod_min(part_duration, segment_duration - offset), 1000);
+		p = vod_copy(p, m3u8_part_uri, sizeof(m3u8_part_uri) - 1);
+		p = vod_copy(p, base_url->data, base_url->len);
+		p = vod_copy(p, segment_file_name_prefix->data, segment_file_name_prefix->len);
+		*p++ = '-';
+		p = m3u8_builder_write_uint32(p, segment_index + 1);
+		*p++ = '.';
+		p = m3u8_builder_write_uint32(p, part_index + 1);
+		p = vod_copy(p, suffix->data, suffix->len);
+		*p++ = '"';
+		if (independent && part_index == 0)
+		{
+			p = vod_copy(p, m3u8_part_independent, sizeof(m3u8_part_independent) - 1);
+		}
+		*p++ = '\n';
+	}
+
+	return p;
+}
+
 static u_char*
 m3u8_builder_append_extinf_tag(u_char* p, uint32_t duration, uint32_t scale)
 {
@@ -138,6 +207,16 @@ m3u8_builder_append_iframe_string(void* context, uint32_t segment_index, uint32_
 {
 	write_segment_context_t* ctx = (write_segment_context_t*)context;
 
+	// save the position, so that it can be used to rebuild the playlist without simulation
+	if (ctx->iframes_pos < ctx->iframes_end)
+	{
+		ctx->iframes_pos->segment_index = segment_index;
+		ctx->iframes_pos->duration = frame_duration;
+		ctx->iframes_pos->offset = frame_start;
+		ctx->iframes_pos->size = frame_size;
+		ctx->iframes_pos++;
+	}
+
 	ctx->p = m3u8_builder_append_extinf_tag(ctx->p, frame_duration, 1000);
 	ctx->p = vod_sprintf(ctx->p, byte_range_tag_format, frame_size, frame_start);
 	ctx->p = m3u8_builder_append_segment_name(
@@ -219,12 +298,16 @@ m3u8_builder_build_iframe_playlist(
 	hls_mpegts_muxer_conf_t* muxer_conf,
 	vod_str_t* base_url,
 	media_set_t* media_set,
+	vod_str_t* iframes,
 	vod_str_t* result)
 {
 	hls_encryption_params_t encryption_params;
 	write_segment_context_t ctx;
 	segment_durations_t segment_durations;
 	segmenter_conf_t* segmenter_conf = media_set->segmenter_conf;
+	m3u8_iframe_t* cur_iframe;
+	m3u8_iframe_t* last_iframe;
+	uint32_t key_frame_count;
 	size_t iframe_length;
 	size_t result_size;
 	uint64_t duration_millis;
@@ -280,9 +363,11 @@ m3u8_builder_build_iframe_playlist(
 		sizeof(byte_range_tag_format) + VOD_INT32_LEN + vod_get_int_print_len(MAX_FRAME_SIZE) - (sizeof("%uD%uD") - 1) +
 		base_url->len + conf->segment_file_name_prefix.len + 1 + vod_get_int_print_len(segment_durations.segment_count) + ctx.name_suffix.len;
 
+	key_frame_count = media_set->sequences[0].video_key_frame_count;
+
 	result_size =
 		conf->iframes_m3u8_header_len +
-		iframe_length * media_set->sequences[0].video_key_frame_count +
+		iframe_length * key_frame_count +
 		sizeof(m3u8_footer);
 
 	// allocate the buffer
@@ -290,18 +375,58 @@ m3u8_builder_build_iframe_playlist(
 	if (result->data == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"m3u8_builder_build_iframe_playlist: vod_alloc failed");
+			"m3u8_builder_build_iframe_playlist: vod_alloc failed (1)");
 		return VOD_ALLOC_FAILED;
 	}
 
 	// fill out the buffer
 	ctx.p = vod_copy(result->data, conf->iframes_m3u8_header, conf->iframes_m3u8_header_len);
 
-	if (media_set->sequences[0].video_key_frame_count > 0)
+	ctx.base_url = base_url;
+	ctx.segment_file_name_prefix = &conf->segment_file_name_prefix;
+	ctx.iframes_pos = NULL;
+	ctx.iframes_end = NULL;
+
+	// use the iframe positions of a previous simulation, if provided
+	if (iframes != NULL && iframes->data != NULL)
 	{
-		ctx.base_url = base_url;
-		ctx.segment_file_name_prefix = &conf->segment_file_name_prefix;
-	
+		if (iframes->len % sizeof(*cur_iframe) != 0 ||
+			iframes->len / sizeof(*cur_iframe) > key_frame_count)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"m3u8_builder_build_iframe_playlist: invalid iframes buffer size %uz", iframes->len);
+			return VOD_UNEXPECTED;
+		}
+
+		cur_iframe = (m3u8_iframe_t*)iframes->data;
+		last_iframe = (m3u8_iframe_t*)(iframes->data + iframes->len);
+		for (; cur_iframe < last_iframe; cur_iframe++)
+		{
+			m3u8_builder_append_iframe_string(
+				&ctx,
+				cur_iframe->segment_index,
+				cur_iframe->duration,
+				cur_iframe->offset,
+				cur_iframe->size);
+		}
+	}
+	else if (key_frame_count > 0)
+	{
+		if (iframes != NULL)
+		{
+			// save the positions, so that the caller can cache them
+			ctx.iframes_pos = vod_alloc(request_context->pool, sizeof(*ctx.iframes_pos) * key_frame_count);
+			if (ctx.iframes_pos == NULL)
+			{
+				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+					"m3u8_builder_build_iframe_playlist: vod_alloc failed (2)");
+				return VOD_ALLOC_FAILED;
+			}
+
+			ctx.iframes_end = ctx.iframes_pos + key_frame_count;
+			iframes->data = (u_char*)ctx.iframes_pos;
+		}
+
 		rc = hls_muxer_simulate_get_iframes(
 			request_context,
 			&segment_durations, 
@@ -314,6 +439,11 @@ m3u8_builder_build_iframe_playlist(
 		{
 			return rc;
 		}
+
+		if (iframes != NULL)
+		{
+			iframes->len = (u_char*)ctx.iframes_pos - iframes->data;
+		}
 	}
 
 	ctx.p = vod_copy(ctx.p, m3u8_footer, sizeof(m3u8_footer) - 1);
@@ -384,9 +514,11 @@ m3u8_builder_build_index_playlist(
 	hls_encryption_params_t* encryption_params,
 	vod_uint_t container_format,
 	media_set_t* media_set,
+	bool_t delta_update,
 	vod_str_t* result)
 {
 	segment_durations_t segment_durations;
+	segment_duration_item_t* first_item;
 	segment_duration_item_t* cur_item;
 	segment_duration_item_t* last_item;
 	hls_encryption_type_t encryption_type;
@@ -397,13 +529,26 @@ m3u8_builder_build_index_playlist(
 	uint32_t conf_max_segment_duration;
 	uint64_t max_segment_duration;
 	uint64_t duration_millis;
+	uint64_t skip_boundary;
+	uint64_t cur_time;
+	uint32_t first_segment_skip = 0;
+	uint32_t skipped_segments = 0;
+	uint32_t parts_start_index = 0;
+	uint32_t part_duration = 0;
+	uint32_t part_count = 0;
+	uint32_t cur_duration;
 	uint32_t segment_index;
 	uint32_t last_segment_index;
 	uint32_t clip_index = 0;
 	uint32_t scale;
 	size_t segment_length;
 	size_t result_size;
+	size_t name_prefix_len;
+	size_t part_length;
 	vod_status_t rc;
+	bool_t output_parts;
+	bool_t can_skip;
+	int version;
 	u_char* p;
 
 #if (NGX_HAVE_OPENSSL_EVP)
@@ -455,6 +600,47 @@ m3u8_builder_build_index_playlist(
 		return rc;
 	}
 	last_item = segment_durations.items + segment_durations.item_count;
+	first_item = segment_durations.items;
+
+	can_skip = media_set->type == MEDIA_SET_LIVE && conf->can_skip_until != 0;
+	if (can_skip && delta_update)
+	{
+		// find the segments that end before the skip boundary, they are replaced with EXT-X-SKIP.
+		//	skipping stops at the first discontinuity since EXT-X-DISCONTINUITY-SEQUENCE is not returned
+		skip_boundary = 0;
+		for (cur_item = segment_durations.items; cur_item < last_item; cur_item++)
+		{
+			skip_boundary += cur_item->duration * cur_item->repeat_count;
+		}
+
+		cur_time = (uint64_t)conf->can_skip_until * segment_durations.timescale / 1000;
+		skip_boundary = skip_boundary > cur_time ? skip_boundary - cur_time : 0;
+
+		// Note: the boundary is lower than the total duration, so the loop always stops before the last segment
+		cur_time = 0;
+		for (; first_item < last_item; first_item++)
+		{
+			if (first_item->discontinuity && first_item > segment_durations.items)
+			{
+				break;
+			}
+
+			if (first_item->duration == 0)
+			{
+				continue;
+			}
+
+			if (cur_time + first_item->duration * first_item->repeat_count > skip_boundary)
+			{
+				first_segment_skip = (skip_boundary - cur_time) / first_item->duration;
+				skipped_segments += first_segment_skip;
+				break;
+			}
+
+			skipped_segments += first_item->repeat_count;
+			cur_time += first_item->duration * first_item->repeat_count;
+		}
+	}
 
 	// get the required buffer length
 	duration_millis = segment_durations.duration;
@@ -462,11 +648,37 @@ m3u8_builder_build_index_playlist(
 	segment_length = sizeof("#EXTINF:.000,\n") - 1 + vod_get_int_print_len(vod_div_ceil(duration_millis, 1000)) +
 		segments_base_url->len + conf->segment_file_name_prefix.len + 1 + vod_get_int_print_len(last_segment_index) + name_suffix.len;
 
+	// parts are returned for the last segments of live playlists
+	output_parts = media_set->type == MEDIA_SET_LIVE && segmenter_conf->part_duration != 0 && suffix != &m3u8_vtt_suffix;
+	if (output_parts)
+	{
+		part_duration = segmenter_conf->part_duration;
+		parts_start_index = last_segment_index > M3U8_PART_SEGMENTS ? last_segment_index - M3U8_PART_SEGMENTS : 0;
+
+		for (cur_item = first_item; cur_item < last_item; cur_item++)
+		{
+			segment_index = cur_item->segment_index + cur_item->repeat_count;
+			if (segment_index <= parts_start_index || cur_item->duration == 0)
+			{
+				continue;
+			}
+
+			cur_duration = rescale_time(cur_item->duration, segment_durations.timescale, 1000);
+			part_count += vod_min(segment_index - parts_start_index, cur_item->repeat_count) *
+				vod_div_ceil(cur_duration, part_duration);
+		}
+	}
+
+	part_length = sizeof(m3u8_part_duration) - 1 + VOD_INT32_LEN + sizeof(".000") - 1 +
+		sizeof(m3u8_part_uri) - 1 + segment_length + 1 + VOD_INT32_LEN +		// 1 = '.'
+		sizeof(m3u8_part_independent) + 1;		// '"', '\n'
+
 	result_size =
 		sizeof(M3U8_HEADER_PART1) + VOD_INT64_LEN +
 		sizeof(M3U8_HEADER_VOD) +
 		sizeof(M3U8_HEADER_PART2) + VOD_INT64_LEN + VOD_INT32_LEN +
 		segment_length * segment_durations.segment_count +
+		part_length * part_count +
 		segment_durations.discontinuities * (sizeof(m3u8_discontinuity) - 1) +
 		(sizeof(m3u8_map_prefix) - 1 +
 		 base_url->len +
@@ -477,6 +689,16 @@ m3u8_builder_build_index_playlist(
 		(segment_durations.discontinuities + 1) +
 		sizeof(m3u8_footer);
 
+	if (can_skip || output_parts)
+	{
+		result_size +=
+			sizeof(M3U8_SERVER_CONTROL) +
+			sizeof(M3U8_CAN_SKIP_UNTIL) + 2 * VOD_INT32_LEN +
+			sizeof(M3U8_PART_HOLD_BACK) + 2 * VOD_INT32_LEN +
+			sizeof(M3U8_PART_INF) + 2 * VOD_INT32_LEN +
+			sizeof(M3U8_SKIP) + VOD_INT32_LEN;
+	}
+
 	if (encryption_type != HLS_ENC_NONE)
 	{
 		result_size +=
@@ -646,12 +868,44 @@ m3u8_builder_build_index_playlist(
 		*p++ = '\n';
 	}
 
+	version = container_format == HLS_CONTAINER_FMP4 ? 6 : conf->m3u8_version;
+	if (skipped_segments > 0 && version < M3U8_DELTA_UPDATE_VERSION)
+	{
+		version = M3U8_DELTA_UPDATE_VERSION;
+	}
+
 	p = vod_sprintf(
 		p,
 		M3U8_HEADER_PART2,
-		container_format == HLS_CONTAINER_FMP4 ? 6 : conf->m3u8_version, 
+		version, 
 		segment_durations.items[0].segment_index + 1);
 
+	if (can_skip || output_parts)
+	{
+		p = vod_copy(p, M3U8_SERVER_CONTROL, sizeof(M3U8_SERVER_CONTROL) - 1);
+		if (can_skip)
+		{
+			p = vod_sprintf(p, M3U8_CAN_SKIP_UNTIL, conf->can_skip_until / 1000, conf->can_skip_until % 1000);
+		}
+
+		if (output_parts)
+		{
+			if (can_skip)
+			{
+				*p++ = ',';
+			}
+
+			cur_duration = M3U8_PART_HOLD_BACK_PARTS * part_duration;
+			p = vod_sprintf(p, M3U8_PART_HOLD_BACK, cur_duration / 1000, cur_duration % 1000);
+		}
+		*p++ = '\n';
+
+		if (output_parts)
+		{
+			p = vod_sprintf(p, M3U8_PART_INF, part_duration / 1000, part_duration % 1000);
+		}
+	}
+
 	if (container_format == HLS_CONTAINER_FMP4)
 	{
 		p = vod_copy(p, m3u8_map_prefix, sizeof(m3u8_map_prefix) - 1);
@@ -667,13 +921,23 @@ m3u8_builder_build_index_playlist(
 		p = vod_copy(p, m3u8_map_suffix, sizeof(m3u8_map_suffix) - 1);
 	}
 
+	if (skipped_segments > 0)
+	{
+		p = vod_sprintf(p, M3U8_SKIP, skipped_segments);
+	}
+
 	// write the segments
-	for (cur_item = segment_durations.items; cur_item < last_item; cur_item++)
+	for (cur_item = first_item; cur_item < last_item; cur_item++)
 	{
 		segment_index = cur_item->segment_index;
 		last_segment_index = segment_index + cur_item->repeat_count;
 
-		if (cur_item->discontinuity)
+		if (cur_item == first_item && first_segment_skip > 0)
+		{
+			// the discontinuity of this item belongs to a skipped segment
+			segment_index += first_segment_skip;
+		}
+		else if (cur_item->discontinuity)
 		{
 			p = vod_copy(p, m3u8_discontinuity, sizeof(m3u8_discontinuity) - 1);
 			if (container_format == HLS_CONTAINER_FMP4 && 
@@ -695,18 +959,34 @@ m3u8_builder_build_index_playlist(
 			continue;
 		}
 
+		cur_duration = rescale_time(cur_item->duration, segment_durations.timescale, 1000);
+
 		// write the first segment
+		if (segment_index >= parts_start_index && output_parts)
+		{
+			p = m3u8_builder_append_parts(p, segments_base_url, &conf->segment_file_name_prefix, segment_index, &name_suffix,
+				cur_duration, part_duration, segmenter_conf->align_to_key_frames);
+		}
+
 		extinf.data = p;
 		p = m3u8_builder_append_extinf_tag(p, rescale_time(cur_item->duration, segment_durations.timescale, scale), scale);
 		extinf.len = p - extinf.data;
 		p = m3u8_builder_append_segment_name(p, segments_base_url, &conf->segment_file_name_prefix, segment_index, &name_suffix);
 		segment_index++;
 
-		// write any additional segments
+		// write any additional segments, copying the extinf tag and the url prefix of the first segment
+		name_prefix_len = segments_base_url->len + conf->segment_file_name_prefix.len + 1;		// 1 = '-'
 		for (; segment_index < last_segment_index; segment_index++)
 		{
-			p = vod_copy(p, extinf.data, extinf.len);
-			p = m3u8_builder_append_segment_name(p, segments_base_url, &conf->segment_file_name_prefix, segment_index, &name_suffix);
+			if (segment_index >= parts_start_index && output_parts)
+			{
+				p = m3u8_builder_append_parts(p, segments_base_url, &conf->segment_file_name_prefix, segment_index, &name_suffix,
+					cur_duration, part_duration, segmenter_conf->align_to_key_frames);
+			}
+
+			p = vod_copy(p, extinf.data, extinf.len + name_prefix_len);
+			p = m3u8_builder_write_uint32(p, segment_index + 1);
+			p = vod_copy(p, name_suffix.data, name_suffix.len);
 		}
 	}
 
@@ -18,6 +18,13 @@ enum {
 	HLS_CONTAINER_FMP4,
 };
 
+typedef struct {
+	uint32_t segment_index;
+	uint32_t duration;
+	uint32_t offset;
+	uint32_t size;
+} m3u8_iframe_t;
+
 typedef struct {
 	int m3u8_version;
 	vod_uint_t container_format;
@@ -32,6 +39,7 @@ typedef struct {
 	vod_str_t encryption_key_file_name;
 	vod_str_t encryption_key_format;
 	vod_str_t encryption_key_format_versions;
+	uint32_t can_skip_until;
 } m3u8_config_t;
 
 // functions
@@ -51,6 +59,7 @@ vod_status_t m3u8_builder_build_index_playlist(
 	hls_encryption_params_t* encryption_params,
 	vod_uint_t container_format,
 	media_set_t* media_set,
+	bool_t delta_update,
 	vod_str_t* result);
 
 vod_status_t m3u8_builder_build_iframe_playlist(
@@ -59,6 +68,7 @@ vod_status_t m3u8_builder_build_iframe_playlist(
 	hls_mpegts_muxer_conf_t* muxer_conf,
 	vod_str_t* base_url,
 	media_set_t* media_set,
+	vod_str_t* iframes,
 	vod_str_t* result);
 
 void m3u8_builder_init_config(
@@ -1,4 +1,5 @@
 #include "mp4_to_annexb_filter.h"
+#include "../request_arena.h"
 #include "../read_stream.h"
 #include "../avc_defs.h"
 
@@ -22,6 +23,7 @@ typedef struct {
 	const u_char* aud_nal_packet;
 	uint32_t aud_nal_packet_size;
 	bool_t sample_aes;
+	bool_t fast_path;		// nal units that are fully contained in the buffer are converted without the state machine
 
 	// data parsed from extra data
 	uint32_t nal_packet_size_length;
@@ -101,6 +103,10 @@ mp4_to_annexb_set_media_info(
 	state->extra_data = media_info->extra_data.data;
 	state->extra_data_size = media_info->extra_data.len;
 
+	// Note: with 4 byte lengths and no encryption, each length is substituted in place by a start code of
+	//		the same size, the only inspection required is the nal type byte, for dropping aud units
+	state->fast_path = state->nal_packet_size_length == 4 && !state->sample_aes;
+
 	return VOD_OK;
 }
 
@@ -173,6 +179,65 @@ mp4_to_annexb_start_frame(media_filter_context_t* context, output_frame_t* frame
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_to_annexb_write_nal_units(media_filter_context_t* context, const u_char** buffer_ptr, const u_char* buffer_end)
+{
+	mp4_to_annexb_state_t* state = get_context(context);
+	const u_char* buffer = *buffer_ptr;
+	uint32_t packet_size;
+	vod_status_t rc;
+
+	while (buffer_end - buffer > 4)
+	{
+		packet_size = parse_be32(buffer);
+		if (packet_size > (uint32_t)(buffer_end - buffer) - 4)
+		{
+			break;		// partial nal unit, handled by the state machine
+		}
+
+		if (packet_size <= 0)
+		{
+			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+				"mp4_to_annexb_write_nal_units: zero size packet");
+			return VOD_BAD_DATA;
+		}
+
+		buffer += 4;
+
+		if ((*buffer & state->unit_type_mask) != state->aud_unit_type)
+		{
+			if (state->first_frame_packet)
+			{
+				state->first_frame_packet = FALSE;
+				state->frame_size_left -= sizeof(nal_marker);
+				rc = state->next_filter.write(context, nal_marker, sizeof(nal_marker));
+			}
+			else
+			{
+				state->frame_size_left -= (sizeof(nal_marker) - 1);
+				rc = state->next_filter.write(context, nal_marker + 1, sizeof(nal_marker) - 1);
+			}
+
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			state->frame_size_left -= packet_size;
+			rc = state->next_filter.write(context, buffer, packet_size);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+		}
+
+		buffer += packet_size;
+	}
+
+	*buffer_ptr = buffer;
+	return VOD_OK;
+}
+
 static vod_status_t 
 mp4_to_annexb_write(media_filter_context_t* context, const u_char* buffer, uint32_t size)
 {
@@ -187,6 +252,28 @@ mp4_to_annexb_write(media_filter_context_t* context, const u_char* buffer, uint3
 		switch (state->cur_state)
 		{
 		case STATE_PACKET_SIZE:
+			if (state->fast_path && state->length_bytes_left == 4)
+			{
+				rc = mp4_to_annexb_write_nal_units(context, &buffer, buffer_end);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+
+				if (buffer >= buffer_end)
+				{
+					break;
+				}
+			}
+
+			if (state->length_bytes_left == 4 && buffer_end - buffer >= 4)
+			{
+				// the whole length is in the buffer (common case)
+				state->packet_size_left = parse_be32(buffer);
+				buffer += 4;
+				state->length_bytes_left = 0;
+			}
+
 			for (; state->length_bytes_left && buffer < buffer_end; state->length_bytes_left--)
 			{
 				state->packet_size_left = (state->packet_size_left << 8) | *buffer++;
@@ -340,11 +427,11 @@ mp4_to_annexb_init(
 #endif // VOD_HAVE_OPENSSL_EVP
 
 	// allocate state
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"mp4_to_annexb_init: vod_alloc failed");
+			"mp4_to_annexb_init: request_arena_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -174,6 +174,8 @@ static const uint32_t crc_table[256] = {
 	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
+// Note: the crc is calculated only on the PMT section, once per segment (less than a single TS packet),
+//		the PAT is constant and its crc is precomputed in pat_packet
 static uint32_t 
 mpegts_crc32(const u_char* data, int len)
 {
@@ -252,6 +254,33 @@ mpegts_get_pes_header_size(mpegts_stream_info_t* stream_info)
 	return result;
 }
 
+static void
+mpegts_init_pes_header_template(mpegts_stream_info_t* stream_info)
+{
+	u_char* p = stream_info->pes_header_template;
+	unsigned header_size;
+	unsigned flags;
+
+	header_size = SIZEOF_PES_PTS;
+	flags = 0x80; /* PTS */
+
+	if (stream_info->media_type == MEDIA_TYPE_VIDEO)
+	{
+		header_size += SIZEOF_PES_PTS;
+		flags |= 0x40; /* DTS */
+	}
+
+	*p++ = 0x00;
+	*p++ = 0x00;
+	*p++ = 0x01;
+	*p++ = (u_char) stream_info->sid;
+	*p++ = 0x00;	/* pes_size */
+	*p++ = 0x00;
+	*p++ = 0x80; /* H222 */
+	*p++ = (u_char) flags;
+	*p++ = (u_char) header_size;
+}
+
 static u_char *
 mpegts_write_pes_header(
 	u_char* cur_packet_start, 
@@ -260,7 +289,6 @@ mpegts_write_pes_header(
 	u_char** pes_size_ptr, 
 	bool_t data_aligned)
 {
-	unsigned header_size;
 	unsigned flags;
 	u_char* p = cur_packet_start + SIZEOF_MPEGTS_HEADER;
 	bool_t write_dts = stream_info->media_type == MEDIA_TYPE_VIDEO;
@@ -279,25 +307,15 @@ mpegts_write_pes_header(
 
 	/* PES header */
 
-	*p++ = 0x00;
-	*p++ = 0x00;
-	*p++ = 0x01;
-	*p++ = (u_char) stream_info->sid;
-
-	header_size = SIZEOF_PES_PTS;
-	flags = 0x80; /* PTS */
-
-	if (write_dts) 
+	vod_memcpy(p, stream_info->pes_header_template, sizeof(stream_info->pes_header_template));
+	*pes_size_ptr = p + SIZEOF_PES_HEADER - 2;		// updated later
+	if (data_aligned)
 	{
-		header_size += SIZEOF_PES_PTS;
-		flags |= 0x40; /* DTS */
+		p[SIZEOF_PES_HEADER] |= 0x04;
 	}
+	p += sizeof(stream_info->pes_header_template);
 
-	*pes_size_ptr = p;
-	p += 2;		// skip pes_size, updated later
-	*p++ = data_aligned ? 0x84 : 0x80; /* H222 */
-	*p++ = (u_char) flags;
-	*p++ = (u_char) header_size;
+	flags = write_dts ? 0xc0 : 0x80;
 
 	p = mpegts_write_pts(p, flags >> 6, f->pts + INITIAL_DTS);
 
@@ -520,6 +538,7 @@ mpegts_encoder_add_stream(
 	int pmt_entry_size;
 
 	stream_info->pid = stream_state->cur_pid++;
+	stream_info->pes_header_size = mpegts_get_pes_header_size(stream_info);
 
 	if (stream_state->pmt_packet_start == NULL)			// simulation only
 	{
@@ -623,6 +642,8 @@ mpegts_encoder_add_stream(
 		return VOD_BAD_REQUEST;
 	}
 
+	mpegts_init_pes_header_template(stream_info);
+
 	if (stream_state->pmt_packet_pos + pmt_entry_size + sizeof(uint32_t) >= 
 		stream_state->pmt_packet_end)
 	{
@@ -803,7 +824,7 @@ mpegts_encoder_start_frame(media_filter_context_t* context, output_frame_t* fram
 
 	state->send_queue_offset = state->last_queue_offset;
 
-	pes_header_size = mpegts_get_pes_header_size(&state->stream_info);
+	pes_header_size = state->stream_info.pes_header_size;
 
 	if (state->cur_pos >= state->cur_packet_end)
 	{
@@ -930,9 +951,12 @@ mpegts_encoder_write(media_filter_context_t* context, const u_char* buffer, uint
 {
 	mpegts_encoder_state_t* state = get_context(context);
 	uint32_t packet_used_size;
+	uint32_t packet_count;
+	uint32_t cur_count;
 	uint32_t cur_size;
 	uint32_t initial_size;
 	u_char* cur_packet;
+	u_char* packets_end;
 	vod_status_t rc;
 	bool_t write_direct;
 
@@ -998,22 +1022,42 @@ mpegts_encoder_write(media_filter_context_t* context, const u_char* buffer, uint
 	buffer += cur_size;
 	size -= cur_size;
 
-	// write full packets
+	// write full packets, allocating runs of packets from the queue
 	initial_size = size;
 
-	while (size >= MPEGTS_PACKET_USABLE_SIZE)
+	packet_count = size / MPEGTS_PACKET_USABLE_SIZE;
+	while (packet_count > 0)
 	{
-		rc = mpegts_encoder_init_packet(state, TRUE);
-		if (rc != VOD_OK)
+		cur_packet = write_buffer_queue_get_buffers(state->queue, MPEGTS_PACKET_SIZE, packet_count, state, &cur_count);
+		if (cur_packet == NULL)
 		{
-			return rc;
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mpegts_encoder_write: write_buffer_queue_get_buffers failed");
+			return VOD_ALLOC_FAILED;
 		}
 
-		vod_memcpy(state->cur_pos, buffer, MPEGTS_PACKET_USABLE_SIZE);
-		buffer += MPEGTS_PACKET_USABLE_SIZE;
-		size -= MPEGTS_PACKET_USABLE_SIZE;
+		packet_count -= cur_count;
+		packets_end = cur_packet + cur_count * MPEGTS_PACKET_SIZE;
+
+		for (; cur_packet < packets_end; cur_packet += MPEGTS_PACKET_SIZE)
+		{
+			mpegts_write_packet_header(cur_packet, state->stream_info.pid, state->cc);
+			state->cc++;
+
+			vod_memcpy(cur_packet + SIZEOF_MPEGTS_HEADER, buffer, MPEGTS_PACKET_USABLE_SIZE);
+			buffer += MPEGTS_PACKET_USABLE_SIZE;
+		}
+
+		// leave the state as if each packet was initialized by mpegts_encoder_init_packet
+		state->last_queue_offset = state->queue->cur_offset - MPEGTS_PACKET_SIZE;
+		state->last_frame_pts = NO_TIMESTAMP;
+		state->cur_packet_start = packets_end - MPEGTS_PACKET_SIZE;
+		state->cur_packet_end = packets_end;
+		state->cur_pos = packets_end;
 	}
 
+	size %= MPEGTS_PACKET_USABLE_SIZE;
+
 	state->flushed_frame_bytes += initial_size - size;
 
 	// write any residue
@@ -1216,7 +1260,7 @@ mpegts_encoder_simulated_start_frame(media_filter_context_t* context, output_fra
 	state->flushed_frame_bytes = 0;
 	state->header_size = frame->header_size;
 
-	state->temp_packet_size += mpegts_get_pes_header_size(&state->stream_info);
+	state->temp_packet_size += state->stream_info.pes_header_size;
 
 	if (state->temp_packet_size >= MPEGTS_PACKET_USABLE_SIZE)
 	{
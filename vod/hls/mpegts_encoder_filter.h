@@ -12,12 +12,15 @@
 #define HLS_DELAY (63000)			// 700 ms PCR delay
 #define INITIAL_DTS (9090)
 #define INITIAL_PCR (4590)
+#define MPEGTS_PES_HEADER_TEMPLATE_SIZE (9)		// pes header + pes optional header
 
 // typedefs
 typedef struct {
 	int media_type;
 	unsigned pid;
 	unsigned sid;
+	uint32_t pes_header_size;
+	u_char pes_header_template[MPEGTS_PES_HEADER_TEMPLATE_SIZE];		// the pes size and data alignment are set per frame
 } mpegts_stream_info_t;
 
 typedef struct {
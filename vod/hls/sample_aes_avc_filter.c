@@ -6,12 +6,15 @@
 
 #include <openssl/evp.h>
 #include "aes_cbc_encrypt.h"
+#include "../avc_hevc_parser.h"
 #include "../avc_defs.h"
 
 #define SAMPLE_AES_KEY_SIZE (16)
 #define MAX_UNENCRYPTED_UNIT_SIZE (48)
 #define FIRST_ENCRYPTED_OFFSET (32)
 #define ENCRYPTED_BLOCK_PERIOD (10)			// 1 out of 10 blocks is encrypted
+#define ENCRYPT_BATCH_BLOCK_COUNT (16)		// the number of blocks that are encrypted in a single call
+#define OUTPUT_BUFFER_SIZE (ENCRYPT_BATCH_BLOCK_COUNT * ENCRYPTED_BLOCK_PERIOD * AES_BLOCK_SIZE)
 
 typedef struct
 {
@@ -27,6 +30,15 @@ typedef struct
 	uint32_t next_encrypt_offset;
 	uint32_t max_encrypt_offset;
 	uint32_t zero_run;
+
+	// batch state - the protected blocks are gathered and encrypted in a single call, the output is assembled 
+	// in a buffer and passed through emulation prevention in a single pass
+	u_char blocks[ENCRYPT_BATCH_BLOCK_COUNT + 1][AES_BLOCK_SIZE];		// the last one holds a partial block
+	uint32_t block_offsets[ENCRYPT_BATCH_BLOCK_COUNT];
+	uint32_t block_count;
+	uint32_t block_size;		// the size of the partial block
+	u_char output[OUTPUT_BUFFER_SIZE];
+	uint32_t output_size;
 } sample_aes_avc_filter_state_t;
 
 static u_char emulation_prevention_byte[] = { 0x03 };
@@ -103,6 +115,12 @@ sample_aes_avc_write_emulation_prevention(
 
 	for (cur_pos = buffer; cur_pos < buffer_end; cur_pos++)
 	{
+		if (state->zero_run == 0)
+		{
+			// skip to the next pair of zeros, the state machine handles the bytes that follow it
+			cur_pos = avc_hevc_parser_find_zero_pair(cur_pos, buffer_end - 1);
+		}
+
 		if (state->zero_run < 2)
 		{
 			if (*cur_pos == 0)
@@ -161,6 +179,9 @@ sample_aes_avc_start_nal_unit(
 	state->next_encrypt_offset = FIRST_ENCRYPTED_OFFSET;
 	state->max_encrypt_offset = unit_size - AES_BLOCK_SIZE;
 	state->zero_run = 0;
+	state->block_count = 0;
+	state->block_size = 0;
+	state->output_size = 0;
 
 	// reset the IV (it is ok to call EVP_EncryptInit_ex several times without cleanup)
 	if (1 != EVP_EncryptInit_ex(state->cipher, EVP_aes_128_cbc(), NULL, state->key, state->iv))
@@ -173,6 +194,58 @@ sample_aes_avc_start_nal_unit(
 	return VOD_OK;
 }
 
+static vod_status_t
+sample_aes_avc_flush(media_filter_context_t* context)
+{
+	sample_aes_avc_filter_state_t* state = get_context(context);
+	uint32_t encrypt_size;
+	uint32_t i;
+	vod_status_t rc;
+	int out_size;
+
+	if (state->block_count > 0)
+	{
+		// encrypt all the complete blocks in place
+		encrypt_size = state->block_count * AES_BLOCK_SIZE;
+		if (1 != EVP_EncryptUpdate(state->cipher, state->blocks[0], &out_size, state->blocks[0], encrypt_size) ||
+			out_size != (int)encrypt_size)
+		{
+			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+				"sample_aes_avc_flush: EVP_EncryptUpdate failed");
+			return VOD_UNEXPECTED;
+		}
+
+		// scatter the encrypted blocks to the output
+		for (i = 0; i < state->block_count; i++)
+		{
+			vod_memcpy(state->output + state->block_offsets[i], state->blocks[i], AES_BLOCK_SIZE);
+		}
+
+		// move the partial block to the beginning
+		if (state->block_size > 0)
+		{
+			vod_memcpy(state->blocks[0], state->blocks[state->block_count], state->block_size);
+		}
+
+		state->block_count = 0;
+	}
+
+	if (state->output_size <= 0)
+	{
+		return VOD_OK;
+	}
+
+	rc = sample_aes_avc_write_emulation_prevention(context, state->output, state->output_size);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	state->output_size = 0;
+
+	return VOD_OK;
+}
+
 vod_status_t
 sample_aes_avc_filter_write_nal_body(
 	media_filter_context_t* context, 
@@ -182,9 +255,7 @@ sample_aes_avc_filter_write_nal_body(
 	sample_aes_avc_filter_state_t* state = get_context(context);
 	uint32_t end_offset;
 	uint32_t cur_size;
-	u_char encrypted_block[AES_BLOCK_SIZE];
 	vod_status_t rc;
-	int out_size;
 
 	if (!state->encrypt)
 	{
@@ -198,35 +269,54 @@ sample_aes_avc_filter_write_nal_body(
 		if (state->cur_offset < state->next_encrypt_offset)
 		{
 			// unencrypted part
-			cur_size = vod_min(state->next_encrypt_offset, end_offset) - state->cur_offset;
-			rc = sample_aes_avc_write_emulation_prevention(context, buffer, cur_size);
-			if (rc != VOD_OK)
+			if (state->output_size >= OUTPUT_BUFFER_SIZE)
 			{
-				return rc;
+				rc = sample_aes_avc_flush(context);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
 			}
+
+			cur_size = vod_min(state->next_encrypt_offset, end_offset) - state->cur_offset;
+			cur_size = vod_min(cur_size, OUTPUT_BUFFER_SIZE - state->output_size);
+			vod_memcpy(state->output + state->output_size, buffer, cur_size);
+			state->output_size += cur_size;
 			continue;
 		}
 
 		// encrypted block
 		cur_size = vod_min(state->next_encrypt_offset + AES_BLOCK_SIZE, end_offset) - state->cur_offset;
-
-		if (1 != EVP_EncryptUpdate(state->cipher, encrypted_block, &out_size, buffer, cur_size))
+		vod_memcpy(state->blocks[state->block_count] + state->block_size, buffer, cur_size);
+		state->block_size += cur_size;
+		if (state->block_size < AES_BLOCK_SIZE)
 		{
-			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-				"sample_aes_avc_filter_write_nal_body: EVP_EncryptUpdate failed");
-			return VOD_UNEXPECTED;
+			continue;
 		}
 
-		if (out_size <= 0)
+		// reserve space for the encrypted block in the output
+		if (state->output_size + AES_BLOCK_SIZE > OUTPUT_BUFFER_SIZE)
 		{
-			continue;
+			// Note: the flush moves the current block to the beginning of the blocks array
+			rc = sample_aes_avc_flush(context);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
 		}
 
-		// write the encrypted block
-		rc = sample_aes_avc_write_emulation_prevention(context, encrypted_block, AES_BLOCK_SIZE);
-		if (rc != VOD_OK)
+		state->block_offsets[state->block_count] = state->output_size;
+		state->output_size += AES_BLOCK_SIZE;
+		state->block_count++;
+		state->block_size = 0;
+
+		if (state->block_count >= ENCRYPT_BATCH_BLOCK_COUNT)
 		{
-			return rc;
+			rc = sample_aes_avc_flush(context);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
 		}
 
 		// find the next encrypt offset
@@ -237,5 +327,5 @@ sample_aes_avc_filter_write_nal_body(
 		}
 	}
 
-	return VOD_OK;
+	return sample_aes_avc_flush(context);
 }
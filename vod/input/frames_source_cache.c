@@ -22,6 +22,7 @@ frames_source_cache_init(
 	state->read_cache_state = read_cache_state;
 	state->req.source = source;
 	state->req.cache_slot_id = cache_slot_id;
+	state->capture_pos = NULL;
 
 	*result = state;
 
@@ -82,6 +83,12 @@ frames_source_cache_read(void* ctx, u_char** buffer, uint32_t* size, bool_t* fra
 		*frame_done = FALSE;
 		state->req.cur_offset = cur_end_offset;
 	}
+
+	if (state->capture_pos != NULL)
+	{
+		state->capture_pos = vod_copy(state->capture_pos, *buffer, *size);
+	}
+
 	return VOD_OK;
 }
 
@@ -13,6 +13,7 @@
 typedef struct {
 	read_cache_state_t* read_cache_state;
 	read_cache_request_t req;
+	u_char* capture_pos;		// when set, the frame data is copied here as it is read
 } frames_source_cache_state_t;
 
 // globals
@@ -0,0 +1,608 @@
+#include "mapped_media_info.h"
+#include "../media_set_parser.h"
+#include "../codec_config.h"
+#include "../parse_utils.h"
+#include "../read_stream.h"
+#include "../mp4/mp4_defs.h"
+
+/*
+	The mapping may supply the media info of the tracks of a source (codec, extra data, bitrate, dimensions,
+	duration etc.). Requests that do not need the frames (e.g. master playlists / MPDs) use it to build the
+	tracks without opening the file, requests that need the frames ignore it and read the file as usual.
+*/
+
+#define MAPPED_VIDEO_TIMESCALE (90000)
+#define MAPPED_DEFAULT_BITS_PER_SAMPLE (16)
+#define MAPPED_MAX_CHANNELS (64)
+
+// enums
+enum {
+	MAPPED_MEDIA_INFO_PARAM_TYPE,
+	MAPPED_MEDIA_INFO_PARAM_CODEC,
+	MAPPED_MEDIA_INFO_PARAM_EXTRA_DATA,
+	MAPPED_MEDIA_INFO_PARAM_DURATION,
+	MAPPED_MEDIA_INFO_PARAM_BITRATE,
+	MAPPED_MEDIA_INFO_PARAM_AVG_BITRATE,
+	MAPPED_MEDIA_INFO_PARAM_KEY_FRAME_BITRATE,
+	MAPPED_MEDIA_INFO_PARAM_WIDTH,
+	MAPPED_MEDIA_INFO_PARAM_HEIGHT,
+	MAPPED_MEDIA_INFO_PARAM_FRAME_RATE,
+	MAPPED_MEDIA_INFO_PARAM_SAMPLE_RATE,
+	MAPPED_MEDIA_INFO_PARAM_CHANNELS,
+	MAPPED_MEDIA_INFO_PARAM_BITS_PER_SAMPLE,
+
+	MAPPED_MEDIA_INFO_PARAM_COUNT
+};
+
+// constants
+static json_object_key_def_t mapped_media_info_params[] = {
+	{ vod_string("type"),				VOD_JSON_STRING,	MAPPED_MEDIA_INFO_PARAM_TYPE },
+	{ vod_string("codec"),				VOD_JSON_STRING,	MAPPED_MEDIA_INFO_PARAM_CODEC },
+	{ vod_string("extraData"),			VOD_JSON_STRING,	MAPPED_MEDIA_INFO_PARAM_EXTRA_DATA },
+	{ vod_string("duration"),			VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_DURATION },
+	{ vod_string("bitrate"),			VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_BITRATE },
+	{ vod_string("avgBitrate"),			VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_AVG_BITRATE },
+	{ vod_string("keyFrameBitrate"),	VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_KEY_FRAME_BITRATE },
+	{ vod_string("width"),				VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_WIDTH },
+	{ vod_string("height"),				VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_HEIGHT },
+	{ vod_string("frameRate"),			VOD_JSON_FRAC,		MAPPED_MEDIA_INFO_PARAM_FRAME_RATE },
+	{ vod_string("sampleRate"),			VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_SAMPLE_RATE },
+	{ vod_string("channels"),			VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_CHANNELS },
+	{ vod_string("bitsPerSample"),		VOD_JSON_INT,		MAPPED_MEDIA_INFO_PARAM_BITS_PER_SAMPLE },
+	{ vod_null_string, 0, 0 }
+};
+
+static vod_str_t media_type_video = vod_string("video");
+static vod_str_t media_type_audio = vod_string("audio");
+
+// globals
+static vod_hash_t mapped_media_info_hash;
+
+vod_status_t
+mapped_media_info_parser_init(
+	vod_pool_t* pool,
+	vod_pool_t* temp_pool)
+{
+	return vod_json_init_hash(
+		pool,
+		temp_pool,
+		"mapped_media_info_hash",
+		mapped_media_info_params,
+		sizeof(mapped_media_info_params[0]),
+		&mapped_media_info_hash);
+}
+
+static vod_status_t
+mapped_media_info_get_uint32(
+	request_context_t* request_context,
+	vod_json_value_t** params,
+	int index,
+	int64_t max_value,
+	uint32_t* result)
+{
+	int64_t value;
+
+	if (params[index] == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_get_uint32: missing %V", &mapped_media_info_params[index].key);
+		return VOD_BAD_MAPPING;
+	}
+
+	value = params[index]->v.num.num;
+	if (value <= 0 || value > max_value)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_get_uint32: invalid %V %L", &mapped_media_info_params[index].key, value);
+		return VOD_BAD_MAPPING;
+	}
+
+	*result = value;
+	return VOD_OK;
+}
+
+static vod_status_t
+mapped_media_info_parse_codec(
+	request_context_t* request_context,
+	vod_str_t* codec,
+	media_info_t* media_info,
+	bool_t* extra_data_required)
+{
+	if (codec->len != sizeof(uint32_t))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_codec: invalid codec \"%V\", expected a fourcc", codec);
+		return VOD_BAD_MAPPING;
+	}
+
+	// Note: using the same fourccs as the mp4 sample descriptions
+	media_info->format = parse_le32(codec->data);
+	media_info->codec_id = VOD_CODEC_ID_INVALID;
+	*extra_data_required = TRUE;
+
+	switch (media_info->media_type)
+	{
+	case MEDIA_TYPE_VIDEO:
+		switch (media_info->format)
+		{
+		case FORMAT_AVC1:
+		case FORMAT_h264:
+		case FORMAT_H264:
+			media_info->codec_id = VOD_CODEC_ID_AVC;
+			break;
+
+		case FORMAT_HEV1:
+		case FORMAT_HVC1:
+			media_info->codec_id = VOD_CODEC_ID_HEVC;
+			break;
+
+		case FORMAT_VP09:
+			media_info->codec_id = VOD_CODEC_ID_VP9;
+			break;
+
+		case FORMAT_AV1:
+			media_info->codec_id = VOD_CODEC_ID_AV1;
+			break;
+		}
+		break;
+
+	case MEDIA_TYPE_AUDIO:
+		switch (media_info->format)
+		{
+		case FORMAT_MP4A:
+			media_info->codec_id = VOD_CODEC_ID_AAC;
+			media_info->u.audio.object_type_id = 0x40;
+			break;
+
+		case FORMAT_AC3:
+			media_info->codec_id = VOD_CODEC_ID_AC3;
+			*extra_data_required = FALSE;
+			break;
+
+		case FORMAT_EAC3:
+			media_info->codec_id = VOD_CODEC_ID_EAC3;
+			*extra_data_required = FALSE;
+			break;
+
+		case FORMAT_OPUS:
+			media_info->codec_id = VOD_CODEC_ID_OPUS;
+			break;
+		}
+		break;
+	}
+
+	if (media_info->codec_id == VOD_CODEC_ID_INVALID)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_codec: unsupported codec \"%V\"", codec);
+		return VOD_BAD_MAPPING;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mapped_media_info_parse_video(
+	request_context_t* request_context,
+	vod_json_value_t** params,
+	media_info_t* media_info)
+{
+	vod_json_fraction_t* frame_rate;
+	uint32_t value;
+	vod_status_t rc;
+
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_WIDTH, 0xffff, &value);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+	media_info->u.video.width = value;
+
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_HEIGHT, 0xffff, &value);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+	media_info->u.video.height = value;
+
+	if (params[MAPPED_MEDIA_INFO_PARAM_KEY_FRAME_BITRATE] != NULL)
+	{
+		media_info->u.video.key_frame_bitrate = (uint32_t)params[MAPPED_MEDIA_INFO_PARAM_KEY_FRAME_BITRATE]->v.num.num;
+	}
+
+	if (params[MAPPED_MEDIA_INFO_PARAM_FRAME_RATE] == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_video: missing frameRate");
+		return VOD_BAD_MAPPING;
+	}
+
+	frame_rate = &params[MAPPED_MEDIA_INFO_PARAM_FRAME_RATE]->v.num;
+	if (frame_rate->num <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_video: invalid frameRate %L/%uL", frame_rate->num, frame_rate->denom);
+		return VOD_BAD_MAPPING;
+	}
+
+	media_info->timescale = MAPPED_VIDEO_TIMESCALE;
+	media_info->min_frame_duration = (uint32_t)((MAPPED_VIDEO_TIMESCALE * frame_rate->denom) / frame_rate->num);
+	if (media_info->min_frame_duration == 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_video: frameRate %L/%uL too large", frame_rate->num, frame_rate->denom);
+		return VOD_BAD_MAPPING;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mapped_media_info_parse_audio(
+	request_context_t* request_context,
+	vod_json_value_t** params,
+	media_info_t* media_info)
+{
+	uint32_t value;
+	vod_status_t rc;
+
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_SAMPLE_RATE, UINT_MAX, &value);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+	media_info->u.audio.sample_rate = value;
+
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_CHANNELS, MAPPED_MAX_CHANNELS, &value);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+	media_info->u.audio.channels = value;
+
+	switch (value)
+	{
+	case 1:
+		media_info->u.audio.channel_layout = VOD_CH_LAYOUT_MONO;
+		break;
+
+	case 2:
+		media_info->u.audio.channel_layout = VOD_CH_LAYOUT_STEREO;
+		break;
+	}
+
+	if (params[MAPPED_MEDIA_INFO_PARAM_BITS_PER_SAMPLE] != NULL)
+	{
+		rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_BITS_PER_SAMPLE, 0xffff, &value);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+		media_info->u.audio.bits_per_sample = value;
+	}
+	else
+	{
+		media_info->u.audio.bits_per_sample = MAPPED_DEFAULT_BITS_PER_SAMPLE;
+	}
+
+	media_info->timescale = media_info->u.audio.sample_rate;
+
+	if (media_info->codec_id == VOD_CODEC_ID_AAC)
+	{
+		rc = codec_config_mp4a_config_parse(
+			request_context,
+			&media_info->extra_data,
+			media_info);
+		if (rc != VOD_OK)
+		{
+			return VOD_BAD_MAPPING;
+		}
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mapped_media_info_parse_track(
+	request_context_t* request_context,
+	vod_json_object_t* element,
+	media_info_t* media_info)
+{
+	vod_json_value_t* params[MAPPED_MEDIA_INFO_PARAM_COUNT];
+	vod_str_t* type;
+	bool_t extra_data_required;
+	vod_status_t rc;
+
+	vod_memzero(params, sizeof(params));
+
+	vod_json_get_object_values(
+		element,
+		&mapped_media_info_hash,
+		params);
+
+	vod_memzero(media_info, sizeof(*media_info));
+
+	// media type
+	if (params[MAPPED_MEDIA_INFO_PARAM_TYPE] == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_track: missing type");
+		return VOD_BAD_MAPPING;
+	}
+
+	type = &params[MAPPED_MEDIA_INFO_PARAM_TYPE]->v.str;
+	if (type->len == media_type_video.len &&
+		vod_strncasecmp(type->data, media_type_video.data, media_type_video.len) == 0)
+	{
+		media_info->media_type = MEDIA_TYPE_VIDEO;
+	}
+	else if (type->len == media_type_audio.len &&
+		vod_strncasecmp(type->data, media_type_audio.data, media_type_audio.len) == 0)
+	{
+		media_info->media_type = MEDIA_TYPE_AUDIO;
+	}
+	else
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_track: invalid type \"%V\"", type);
+		return VOD_BAD_MAPPING;
+	}
+
+	// codec
+	if (params[MAPPED_MEDIA_INFO_PARAM_CODEC] == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_track: missing codec");
+		return VOD_BAD_MAPPING;
+	}
+
+	rc = mapped_media_info_parse_codec(
+		request_context,
+		&params[MAPPED_MEDIA_INFO_PARAM_CODEC]->v.str,
+		media_info,
+		&extra_data_required);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (params[MAPPED_MEDIA_INFO_PARAM_EXTRA_DATA] != NULL)
+	{
+		rc = parse_utils_parse_variable_base64_string(
+			request_context->pool,
+			&params[MAPPED_MEDIA_INFO_PARAM_EXTRA_DATA]->v.str,
+			&media_info->extra_data);
+		if (rc != VOD_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"mapped_media_info_parse_track: failed to parse extraData %V",
+				&params[MAPPED_MEDIA_INFO_PARAM_EXTRA_DATA]->v.str);
+			return VOD_BAD_MAPPING;
+		}
+	}
+	else if (extra_data_required)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse_track: missing extraData");
+		return VOD_BAD_MAPPING;
+	}
+
+	// bitrate
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_BITRATE, UINT_MAX, &media_info->bitrate);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (params[MAPPED_MEDIA_INFO_PARAM_AVG_BITRATE] != NULL)
+	{
+		media_info->avg_bitrate = (uint32_t)params[MAPPED_MEDIA_INFO_PARAM_AVG_BITRATE]->v.num.num;
+	}
+
+	// media type specific
+	switch (media_info->media_type)
+	{
+	case MEDIA_TYPE_VIDEO:
+		rc = mapped_media_info_parse_video(request_context, params, media_info);
+		break;
+
+	case MEDIA_TYPE_AUDIO:
+		rc = mapped_media_info_parse_audio(request_context, params, media_info);
+		break;
+	}
+
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// duration
+	rc = mapped_media_info_get_uint32(request_context, params, MAPPED_MEDIA_INFO_PARAM_DURATION, MAX_CLIP_DURATION, &media_info->duration_millis);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	media_info->frames_timescale = media_info->timescale;
+	media_info->full_duration = rescale_time(media_info->duration_millis, 1000, media_info->timescale);
+	media_info->duration = media_info->full_duration;
+
+	return VOD_OK;
+}
+
+vod_status_t
+mapped_media_info_parse(
+	void* ctx,
+	vod_json_value_t* value,
+	void* dest)
+{
+	media_filter_parse_context_t* context = ctx;
+	media_clip_source_media_infos_t* result = dest;
+	request_context_t* request_context = context->request_context;
+	vod_json_array_t* array = &value->v.arr;
+	vod_json_object_t* cur_pos;
+	vod_array_part_t* part;
+	media_info_t* output;
+	vod_status_t rc;
+
+	if (array->count < 1 || array->count > MAX_TRACK_COUNT)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse: invalid number of elements in the media info array %uz", array->count);
+		return VOD_BAD_MAPPING;
+	}
+
+	if (array->type != VOD_JSON_OBJECT)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mapped_media_info_parse: invalid media info type %d expected object", array->type);
+		return VOD_BAD_MAPPING;
+	}
+
+	output = vod_alloc(request_context->pool, sizeof(output[0]) * array->count);
+	if (output == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mapped_media_info_parse: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->first = output;
+
+	part = &array->part;
+	for (cur_pos = part->first; ; cur_pos++, output++)
+	{
+		if ((void*)cur_pos >= part->last)
+		{
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			cur_pos = part->first;
+		}
+
+		rc = mapped_media_info_parse_track(request_context, cur_pos, output);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		output->track_id = output - result->first + 1;
+	}
+
+	result->last = output;
+
+	return VOD_OK;
+}
+
+vod_status_t
+mapped_media_info_get_tracks(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	media_track_array_t* result)
+{
+	media_clip_source_t* source = parse_params->source;
+	media_sequence_t* sequence = source->sequence;
+	media_info_t* cur_info;
+	media_info_t* media_info;
+	media_track_t* cur_track;
+	vod_status_t rc;
+	uint32_t track_indexes[MEDIA_TYPE_COUNT];
+	uint32_t duration_millis;
+	uint32_t media_type;
+	uint32_t track_index;
+
+	vod_memzero(result, sizeof(*result));
+	vod_memzero(track_indexes, sizeof(track_indexes));
+
+	cur_track = vod_alloc(request_context->pool,
+		sizeof(*cur_track) * (source->media_infos.last - source->media_infos.first));
+	if (cur_track == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mapped_media_info_get_tracks: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->first_track = cur_track;
+
+	for (cur_info = source->media_infos.first; cur_info < source->media_infos.last; cur_info++)
+	{
+		// check whether we should include this track
+		media_type = cur_info->media_type;
+		track_index = track_indexes[media_type]++;
+		if ((parse_params->required_tracks_mask[media_type] & (1 << track_index)) == 0)
+		{
+			continue;
+		}
+
+		if (!vod_codec_in_mask(cur_info->codec_id, parse_params->codecs_mask))
+		{
+			vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mapped_media_info_get_tracks: codec %uD not supported, mask 0x%uxD",
+				cur_info->codec_id, parse_params->codecs_mask);
+			continue;
+		}
+
+		// filter by language
+		if (media_type == MEDIA_TYPE_AUDIO &&
+			parse_params->langs_mask != NULL &&
+			!vod_is_bit_set(parse_params->langs_mask, sequence->language))
+		{
+			continue;
+		}
+
+		// apply the clipping to the duration
+		if (cur_info->duration_millis <= parse_params->clip_from)
+		{
+			continue;
+		}
+
+		vod_memzero(cur_track, sizeof(*cur_track));
+		media_info = &cur_track->media_info;
+		*media_info = *cur_info;
+
+		// inherit the sequence language and label
+		media_info->label = sequence->label;
+		media_info->language = sequence->language;
+
+		duration_millis = vod_min(media_info->duration_millis, parse_params->clip_to) - parse_params->clip_from;
+		if (duration_millis != media_info->duration_millis)
+		{
+			media_info->duration_millis = duration_millis;
+			media_info->duration = rescale_time(duration_millis, 1000, media_info->timescale);
+		}
+
+		// the sequence bitrate overrides the mapped one, same as with files
+		if (sequence->bitrate[media_type] != 0)
+		{
+			media_info->bitrate = sequence->bitrate[media_type];
+		}
+
+		if (sequence->avg_bitrate[media_type] != 0)
+		{
+			media_info->avg_bitrate = sequence->avg_bitrate[media_type];
+		}
+
+		rc = media_format_finalize_track(
+			request_context,
+			parse_params->parse_type,
+			media_info);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		cur_track->index = track_index;
+
+		result->track_count[media_type]++;
+		cur_track++;
+	}
+
+	result->last_track = cur_track;
+	result->total_track_count = cur_track - result->first_track;
+
+	return VOD_OK;
+}
@@ -0,0 +1,23 @@
+#ifndef __MAPPED_MEDIA_INFO_H__
+#define __MAPPED_MEDIA_INFO_H__
+
+// includes
+#include "../media_clip.h"
+#include "../json_parser.h"
+
+// functions
+vod_status_t mapped_media_info_parser_init(
+	vod_pool_t* pool,
+	vod_pool_t* temp_pool);
+
+vod_status_t mapped_media_info_parse(
+	void* ctx,
+	vod_json_value_t* value,
+	void* dest);
+
+vod_status_t mapped_media_info_get_tracks(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	media_track_array_t* result);
+
+#endif // __MAPPED_MEDIA_INFO_H__
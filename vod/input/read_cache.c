@@ -4,10 +4,11 @@
 #define MIN_BUFFER_COUNT (2)
 
 void 
-read_cache_init(read_cache_state_t* state, request_context_t* request_context, size_t buffer_size)
+read_cache_init(read_cache_state_t* state, request_context_t* request_context, size_t buffer_size, size_t max_read_size)
 {
 	state->request_context = request_context;
 	state->buffer_size = buffer_size;
+	state->max_read_size = max_read_size;
 	state->buffer_count = 0;
 	state->reuse_buffers = TRUE;
 }
@@ -45,6 +46,34 @@ read_cache_allocate_buffer_slots(read_cache_state_t* state, size_t buffer_count)
 	return VOD_OK;
 }
 
+static uint32_t
+read_cache_get_read_size(read_cache_state_t* state, media_clip_source_t* source, uint64_t offset, size_t alignment)
+{
+	media_clip_read_range_t* cur_range;
+	media_clip_read_range_t* ranges_end;
+	uint64_t read_size;
+
+	// find the range that contains the offset, and read until its end
+	ranges_end = source->read_ranges + source->read_range_count;
+	for (cur_range = source->read_ranges; cur_range < ranges_end; cur_range++)
+	{
+		if (cur_range->end_offset <= offset)
+		{
+			continue;
+		}
+
+		read_size = ((cur_range->end_offset + alignment) & ~alignment) - offset;
+		if (read_size > state->max_read_size)
+		{
+			read_size = vod_max(state->max_read_size & ~alignment, state->buffer_size);
+		}
+
+		return read_size;
+	}
+
+	return state->buffer_size;
+}
+
 bool_t 
 read_cache_get_from_cache(
 	read_cache_state_t* state, 
@@ -94,7 +123,14 @@ read_cache_get_from_cache(
 	offset &= ~alignment;
 
 	// calculate the read size
-	read_size = state->buffer_size;
+	if (state->max_read_size != 0 && source->read_range_count > 0)
+	{
+		read_size = read_cache_get_read_size(state, source, offset, alignment);
+	}
+	else
+	{
+		read_size = state->buffer_size;
+	}
 	target_buffer = &state->buffers[cache_slot_id % state->buffer_count];
 
 	// don't read anything that is already in the cache
@@ -156,15 +192,29 @@ read_cache_get_read_buffer(
 
 void 
 read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf)
+{
+	read_cache_buffer_read_completed(state->target_buffer, buf);
+
+	// no longer have an active request
+	state->target_buffer = NULL;
+}
+
+cache_buffer_t*
+read_cache_detach_target_buffer(read_cache_state_t* state)
 {
 	cache_buffer_t* target_buffer = state->target_buffer;
 
+	state->target_buffer = NULL;
+
+	return target_buffer;
+}
+
+void
+read_cache_buffer_read_completed(cache_buffer_t* target_buffer, vod_buf_t* buf)
+{
 	// update the buffer size
 	target_buffer->buffer_start = buf->start;
 	target_buffer->buffer_pos = buf->pos;
 	target_buffer->buffer_size = buf->last - buf->pos;
 	target_buffer->end_offset = target_buffer->start_offset + target_buffer->buffer_size;
-
-	// no longer have an active request
-	state->target_buffer = NULL;
 }
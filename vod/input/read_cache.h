@@ -23,6 +23,7 @@ typedef struct {
 	cache_buffer_t* target_buffer;
 	size_t buffer_count;
 	size_t buffer_size;
+	size_t max_read_size;
 	bool_t reuse_buffers;
 } read_cache_state_t;
 
@@ -50,7 +51,8 @@ typedef struct {
 void read_cache_init(
 	read_cache_state_t* state, 
 	request_context_t* request_context, 
-	size_t buffer_size);
+	size_t buffer_size,
+	size_t max_read_size);
 	
 vod_status_t read_cache_allocate_buffer_slots(
 	read_cache_state_t* state,
@@ -71,4 +73,9 @@ void read_cache_get_read_buffer(
 	
 void read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf);
 
+// detaches the buffer of the pending read, in order to allow another read to be started before it completes
+cache_buffer_t* read_cache_detach_target_buffer(read_cache_state_t* state);
+
+void read_cache_buffer_read_completed(cache_buffer_t* target_buffer, vod_buf_t* buf);
+
 #endif // __READ_CACHE_H__
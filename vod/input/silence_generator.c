@@ -4,9 +4,159 @@
 #include "../mp4/mp4_defs.h"
 #include "../media_set.h"
 
+/*
+	The silence tracks are built from pre-encoded silent AAC frames. The media info of all the supported
+	configurations (sample rate / channels) is built once on init, so generating a silence track only
+	requires allocating the frames array, all frames point to the same static buffer.
+*/
+
 #define AAC_FRAME_SAMPLES (1024)
-#define AAC_SILENCE_FRAME ("\x21\x00\x49\x90\x02\x19\x00\x23\x80")
-#define AAC_SILENCE_FRAME_SIZE (sizeof(AAC_SILENCE_FRAME) - 1)
+#define AAC_MAX_CHANNELS (2)
+#define AAC_SILENCE_FRAME_MONO_SIZE (6)
+#define AAC_SILENCE_FRAME_STEREO_SIZE (9)
+
+#define SILENCE_DEFAULT_SAMPLE_RATE (44100)
+#define SILENCE_DEFAULT_CHANNELS (2)
+
+// enums
+enum {
+	SILENCE_PARAM_SAMPLE_RATE,
+	SILENCE_PARAM_CHANNELS,
+
+	SILENCE_PARAM_COUNT
+};
+
+// typedefs
+typedef struct {
+	media_info_t media_info;
+	u_char extra_data[2];
+	u_char* frame;
+	uint32_t frame_size;
+} silence_generator_config_t;
+
+// constants
+static json_object_key_def_t silence_generator_params[] = {
+	{ vod_string("sampleRate"),	VOD_JSON_INT,	SILENCE_PARAM_SAMPLE_RATE },
+	{ vod_string("channels"),	VOD_JSON_INT,	SILENCE_PARAM_CHANNELS },
+	{ vod_null_string, 0, 0 }
+};
+
+// indexed by the mpeg4 sampling frequency index
+static const uint32_t aac_sample_rates[] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000,
+};
+
+static const uint64_t aac_channel_layouts[AAC_MAX_CHANNELS] = {
+	VOD_CH_LAYOUT_MONO,
+	VOD_CH_LAYOUT_STEREO,
+};
+
+// globals
+static vod_hash_t silence_generator_hash;
+
+// Note: the buffers are not const, since decoders temporarily overwrite the padding (with zeroes)
+static u_char aac_silence_frame_mono[AAC_SILENCE_FRAME_MONO_SIZE + VOD_BUFFER_PADDING_SIZE] = {
+	0x00, 0xc8, 0x00, 0x80, 0x23, 0x80
+};
+
+static u_char aac_silence_frame_stereo[AAC_SILENCE_FRAME_STEREO_SIZE + VOD_BUFFER_PADDING_SIZE] = {
+	0x21, 0x00, 0x49, 0x90, 0x02, 0x19, 0x00, 0x23, 0x80
+};
+
+static silence_generator_config_t silence_generator_configs[vod_array_entries(aac_sample_rates)][AAC_MAX_CHANNELS];
+
+vod_status_t
+silence_generator_parser_init(
+	vod_pool_t* pool,
+	vod_pool_t* temp_pool)
+{
+	silence_generator_config_t* config;
+	media_info_t* media_info;
+	uint32_t sample_rate_index;
+	uint32_t channels;
+	vod_status_t rc;
+
+	rc = vod_json_init_hash(
+		pool,
+		temp_pool,
+		"silence_generator_hash",
+		silence_generator_params,
+		sizeof(silence_generator_params[0]),
+		&silence_generator_hash);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	for (sample_rate_index = 0; sample_rate_index < vod_array_entries(aac_sample_rates); sample_rate_index++)
+	{
+		for (channels = 1; channels <= AAC_MAX_CHANNELS; channels++)
+		{
+			config = &silence_generator_configs[sample_rate_index][channels - 1];
+
+			if (channels == 1)
+			{
+				config->frame = aac_silence_frame_mono;
+				config->frame_size = AAC_SILENCE_FRAME_MONO_SIZE;
+			}
+			else
+			{
+				config->frame = aac_silence_frame_stereo;
+				config->frame_size = AAC_SILENCE_FRAME_STEREO_SIZE;
+			}
+
+			// audio specific config - object type (5 bits), frequency index (4 bits), channel config (4 bits)
+			config->extra_data[0] = (2 << 3) | (sample_rate_index >> 1);
+			config->extra_data[1] = ((sample_rate_index & 1) << 7) | (channels << 3);
+
+			media_info = &config->media_info;
+			vod_memzero(media_info, sizeof(*media_info));
+
+			media_info->media_type = MEDIA_TYPE_AUDIO;
+			media_info->format = FORMAT_MP4A;
+			media_info->codec_id = VOD_CODEC_ID_AAC;
+			media_info->bitrate = 131072;
+			media_info->extra_data.data = config->extra_data;
+			media_info->extra_data.len = sizeof(config->extra_data);
+			media_info->u.audio.object_type_id = 0x40;
+			media_info->u.audio.channels = channels;
+			media_info->u.audio.channel_layout = aac_channel_layouts[channels - 1];
+			media_info->u.audio.bits_per_sample = 16;
+			media_info->u.audio.packet_size = 0;
+			media_info->u.audio.sample_rate = aac_sample_rates[sample_rate_index];
+			media_info->u.audio.codec_config.object_type = 2;
+			media_info->u.audio.codec_config.sample_rate_index = sample_rate_index;
+			media_info->u.audio.codec_config.channel_config = channels;
+
+			media_info->track_id = 2;
+			media_info->timescale = media_info->u.audio.sample_rate;
+			media_info->frames_timescale = media_info->u.audio.sample_rate;
+		}
+	}
+
+	return VOD_OK;
+}
+
+static silence_generator_config_t*
+silence_generator_get_config(uint32_t sample_rate, uint32_t channels)
+{
+	uint32_t sample_rate_index;
+
+	if (channels < 1 || channels > AAC_MAX_CHANNELS)
+	{
+		return NULL;
+	}
+
+	for (sample_rate_index = 0; sample_rate_index < vod_array_entries(aac_sample_rates); sample_rate_index++)
+	{
+		if (aac_sample_rates[sample_rate_index] == sample_rate)
+		{
+			return &silence_generator_configs[sample_rate_index][channels - 1];
+		}
+	}
+
+	return NULL;
+}
 
 vod_status_t
 silence_generator_parse(
@@ -15,7 +165,41 @@ silence_generator_parse(
 	void** result)
 {
 	media_filter_parse_context_t* context = ctx;
+	silence_generator_config_t* config;
 	media_clip_source_t* source;
+	vod_json_value_t* params[SILENCE_PARAM_COUNT];
+	int64_t sample_rate = SILENCE_DEFAULT_SAMPLE_RATE;
+	int64_t channels = SILENCE_DEFAULT_CHANNELS;
+
+	vod_memzero(params, sizeof(params));
+
+	vod_json_get_object_values(
+		element,
+		&silence_generator_hash,
+		params);
+
+	if (params[SILENCE_PARAM_SAMPLE_RATE] != NULL)
+	{
+		sample_rate = params[SILENCE_PARAM_SAMPLE_RATE]->v.num.num;
+	}
+
+	if (params[SILENCE_PARAM_CHANNELS] != NULL)
+	{
+		channels = params[SILENCE_PARAM_CHANNELS]->v.num.num;
+	}
+
+	config = NULL;
+	if (sample_rate > 0 && sample_rate <= UINT_MAX)
+	{
+		config = silence_generator_get_config(sample_rate, channels);
+	}
+
+	if (config == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+			"silence_generator_parse: unsupported configuration, sample rate %L channels %L", sample_rate, channels);
+		return VOD_BAD_MAPPING;
+	}
 
 	source = vod_alloc(context->request_context->pool, sizeof(*source));
 	if (source == NULL)
@@ -33,6 +217,7 @@ silence_generator_parse(
 	source->range = context->range;
 	source->clip_time = context->clip_time;
 	source->tracks_mask[MEDIA_TYPE_AUDIO] = 1;
+	source->generator_context = config;
 
 	if (context->duration == UINT_MAX)
 	{
@@ -60,6 +245,7 @@ silence_generator_generate(
 	media_parse_params_t* parse_params,
 	media_track_array_t* result)
 {
+	silence_generator_config_t* config = parse_params->source->generator_context;
 	media_sequence_t* sequence = parse_params->source->sequence;
 	input_frame_t* cur_frame;
 	media_track_t* track;
@@ -67,7 +253,6 @@ silence_generator_generate(
 	vod_status_t rc;
 	uint64_t start_time;
 	uint64_t end_time;
-	u_char* data;
 
 	track = vod_alloc(request_context->pool, sizeof(*track));
 	if (track == NULL)
@@ -80,25 +265,7 @@ silence_generator_generate(
 	vod_memzero(track, sizeof(*track));
 
 	// media info
-	track->media_info.media_type = MEDIA_TYPE_AUDIO;
-	track->media_info.format = FORMAT_MP4A;
-	track->media_info.codec_id = VOD_CODEC_ID_AAC;
-	track->media_info.bitrate = 131072;
-	track->media_info.extra_data.data = (u_char*)"\x12\x10";
-	track->media_info.extra_data.len = 2;
-	track->media_info.u.audio.object_type_id = 0x40;
-	track->media_info.u.audio.channels = 2;
-	track->media_info.u.audio.channel_layout = VOD_CH_LAYOUT_STEREO;
-	track->media_info.u.audio.bits_per_sample = 16;
-	track->media_info.u.audio.packet_size = 0;
-	track->media_info.u.audio.sample_rate = 44100;
-	track->media_info.u.audio.codec_config.object_type = 2;
-	track->media_info.u.audio.codec_config.sample_rate_index = 4;
-	track->media_info.u.audio.codec_config.channel_config = 2;
-
-	track->media_info.track_id = 2;
-	track->media_info.timescale = track->media_info.u.audio.sample_rate;
-	track->media_info.frames_timescale = track->media_info.u.audio.sample_rate;
+	track->media_info = config->media_info;
 	track->media_info.duration_millis = parse_params->clip_to - parse_params->clip_from;
 	track->media_info.full_duration = (uint64_t)track->media_info.duration_millis * track->media_info.timescale;
 	track->media_info.duration = track->media_info.full_duration;
@@ -148,7 +315,7 @@ silence_generator_generate(
 	}
 
 	track->first_frame_time_offset = (uint64_t)AAC_FRAME_SAMPLES * track->first_frame_index;
-	track->total_frames_size = (uint64_t)AAC_SILENCE_FRAME_SIZE * track->frame_count;
+	track->total_frames_size = (uint64_t)config->frame_size * track->frame_count;
 	track->total_frames_duration = (uint64_t)AAC_FRAME_SAMPLES * track->frame_count;
 
 	cur_frame = vod_alloc(request_context->pool, sizeof(track->frames.first_frame[0]) * track->frame_count);
@@ -172,20 +339,10 @@ silence_generator_generate(
 		track->frames.clip_to = UINT_MAX;
 	}
 
-	data = vod_alloc(request_context->pool, AAC_SILENCE_FRAME_SIZE + VOD_BUFFER_PADDING_SIZE);
-	if (data == NULL)
-	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"silence_generator_generate: vod_alloc failed (3)");
-		return VOD_ALLOC_FAILED;
-	}
-
-	vod_memcpy(data, AAC_SILENCE_FRAME, AAC_SILENCE_FRAME_SIZE);
-
 	for (; cur_frame < track->frames.last_frame; cur_frame++)
 	{
-		cur_frame->offset = (uintptr_t)data;
-		cur_frame->size = AAC_SILENCE_FRAME_SIZE;
+		cur_frame->offset = (uintptr_t)config->frame;
+		cur_frame->size = config->frame_size;
 		cur_frame->duration = AAC_FRAME_SAMPLES;
 		cur_frame->key_frame = 0;
 		cur_frame->pts_delay = 0;
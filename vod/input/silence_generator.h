@@ -9,6 +9,10 @@
 extern media_generator_t silence_generator;
 
 // functions
+vod_status_t silence_generator_parser_init(
+	vod_pool_t* pool,
+	vod_pool_t* temp_pool);
+
 vod_status_t silence_generator_parse(
 	void* ctx,
 	vod_json_object_t* element,
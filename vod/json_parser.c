@@ -1,13 +1,15 @@
 #include "json_parser.h"
-#include <ctype.h>
 
 // constants
 #define MAX_JSON_ELEMENTS (524288)
 #define MAX_RECURSION_DEPTH (32)
-#define FIRST_PART_COUNT (1)		// XXXXX increase this ! only for testing purpose
+#define FIRST_PART_COUNT (16)
 #define MAX_PART_SIZE (65536)
 
 // macros
+#define json_is_digit(ch) ((u_char)((ch) - '0') <= 9)
+#define json_is_space(ch) ((ch) == ' ' || (ch) == '\n' || (ch) == '\r' || (ch) == '\t')
+
 #define ASSERT_CHAR(state, ch)										\
 	if (*(state)->cur_pos != ch)									\
 	{																\
@@ -110,13 +112,13 @@ vod_json_get_value_type(vod_json_parser_state_t* state, vod_json_type_t** result
 		cur_pos++;
 	}
 
-	if (!isdigit(*cur_pos))
+	if (!json_is_digit(*cur_pos))
 	{
 		vod_snprintf(state->error, state->error_size, "expected digit got 0x%xd%Z", (int)*cur_pos);
 		return VOD_JSON_BAD_DATA;
 	}
 
-	while (isdigit(*cur_pos))
+	while (json_is_digit(*cur_pos))
 	{
 		cur_pos++;
 	}
@@ -135,7 +137,7 @@ vod_json_get_value_type(vod_json_parser_state_t* state, vod_json_type_t** result
 static void 
 vod_json_skip_spaces(vod_json_parser_state_t* state)
 {
-	for (; *state->cur_pos && isspace(*state->cur_pos); state->cur_pos++);
+	for (; json_is_space(*state->cur_pos); state->cur_pos++);
 }
 
 static vod_json_status_t
@@ -149,29 +151,30 @@ vod_json_parse_string(vod_json_parser_state_t* state, vod_str_t* result)
 
 	for (;;)
 	{
+		// skip the plain characters in bulk, strcspn is vectorized by the libc
+		state->cur_pos += vod_strcspn(state->cur_pos, "\"\\");
+
 		c = *state->cur_pos;
 		if (!c)
 		{
 			break;
 		}
 
-		switch (c)
+		if (c == '"')
 		{
-		case '\\':
-			state->cur_pos++;
-			if (!*state->cur_pos)
-			{
-				vod_snprintf(state->error, state->error_size, "end of data while parsing string (1)%Z");
-				return VOD_JSON_BAD_DATA;
-			}
-			break;
-
-		case '"':
 			result->len = state->cur_pos - result->data;
 			state->cur_pos++;
 			return VOD_JSON_OK;
 		}
 
+		// backslash
+		state->cur_pos++;
+		if (!*state->cur_pos)
+		{
+			vod_snprintf(state->error, state->error_size, "end of data while parsing string (1)%Z");
+			return VOD_JSON_BAD_DATA;
+		}
+
 		state->cur_pos++;
 	}
 	vod_snprintf(state->error, state->error_size, "end of data while parsing string (2)%Z");
@@ -244,7 +247,7 @@ vod_json_parse_int(vod_json_parser_state_t* state, int64_t* result, bool_t* nega
 		*negative = FALSE;
 	}
 
-	if (!isdigit(*state->cur_pos))
+	if (!json_is_digit(*state->cur_pos))
 	{
 		vod_snprintf(state->error, state->error_size, "expected digit got 0x%xd%Z", (int)*state->cur_pos);
 		return VOD_JSON_BAD_DATA;
@@ -262,7 +265,7 @@ vod_json_parse_int(vod_json_parser_state_t* state, int64_t* result, bool_t* nega
 
 		value = value * 10 + (*state->cur_pos - '0');
 		state->cur_pos++;
-	} while (isdigit(*state->cur_pos));
+	} while (json_is_digit(*state->cur_pos));
 
 	*result = value;
 
@@ -287,7 +290,7 @@ vod_json_parse_fraction(vod_json_parser_state_t* state, vod_json_fraction_t* res
 	{
 		state->cur_pos++;
 
-		if (!isdigit(*state->cur_pos))
+		if (!json_is_digit(*state->cur_pos))
 		{
 			vod_snprintf(state->error, state->error_size, "expected digit got 0x%xd%Z", (int)*state->cur_pos);
 			return VOD_JSON_BAD_DATA;
@@ -304,7 +307,7 @@ vod_json_parse_fraction(vod_json_parser_state_t* state, vod_json_fraction_t* res
 			value = value * 10 + (*state->cur_pos - '0');
 			denom *= 10;
 			state->cur_pos++;
-		} while (isdigit(*state->cur_pos));
+		} while (json_is_digit(*state->cur_pos));
 	}
 
 	if (negative)
@@ -1007,7 +1010,7 @@ vod_json_get_object_value(vod_json_object_t* object, vod_uint_t key_hash, vod_st
 }
 
 static vod_status_t
-vod_json_replace_object(vod_json_object_t* object1, vod_json_object_t* object2)
+vod_json_replace_object(vod_pool_t* pool, vod_json_object_t* object1, vod_json_object_t* object2)
 {
 	vod_json_key_value_t* cur_element;
 	vod_json_key_value_t* last_element;
@@ -1020,7 +1023,7 @@ vod_json_replace_object(vod_json_object_t* object1, vod_json_object_t* object2)
 		dest_element = vod_json_get_object_value(object1, cur_element->key_hash, &cur_element->key);
 		if (dest_element != NULL)
 		{
-			vod_json_replace(&dest_element->value, &cur_element->value);
+			vod_json_replace(pool, &dest_element->value, &cur_element->value);
 			continue;
 		}
 
@@ -1037,10 +1040,11 @@ vod_json_replace_object(vod_json_object_t* object1, vod_json_object_t* object2)
 }
 
 static vod_status_t
-vod_json_replace_array(vod_json_array_t* array1, vod_json_array_t* array2)
+vod_json_replace_array(vod_pool_t* pool, vod_json_array_t* array1, vod_json_array_t* array2)
 {
 	vod_json_object_t* cur_object1;
 	vod_json_object_t* cur_object2;
+	vod_array_part_t* new_part;
 	vod_array_part_t* part1;
 	vod_array_part_t* part2;
 	vod_status_t rc;
@@ -1073,9 +1077,21 @@ vod_json_replace_array(vod_json_array_t* array1, vod_json_array_t* array2)
 		{
 			if (part1->next == NULL)
 			{
-				// append the second array to the first
-				part2->first = cur_object2;
-				part2->count = (vod_json_object_t*)part2->last - cur_object2;
+				// append the second array to the first (the second array is not modified, it may be shared)
+				if (cur_object2 != part2->first)
+				{
+					new_part = vod_alloc(pool, sizeof(*new_part));
+					if (new_part == NULL)
+					{
+						return VOD_ALLOC_FAILED;
+					}
+
+					*new_part = *part2;
+					new_part->first = cur_object2;
+					new_part->count = (vod_json_object_t*)part2->last - cur_object2;
+					part2 = new_part;
+				}
+
 				part1->next = part2;
 				array1->count = array2->count;
 				break;
@@ -1085,7 +1101,7 @@ vod_json_replace_array(vod_json_array_t* array1, vod_json_array_t* array2)
 			cur_object1 = part1->first;
 		}
 
-		rc = vod_json_replace_object(cur_object1, cur_object2);
+		rc = vod_json_replace_object(pool, cur_object1, cur_object2);
 		if (rc != VOD_OK)
 		{
 			return rc;
@@ -1096,7 +1112,7 @@ vod_json_replace_array(vod_json_array_t* array1, vod_json_array_t* array2)
 }
 
 vod_status_t
-vod_json_replace(vod_json_value_t* json1, vod_json_value_t* json2)
+vod_json_replace(vod_pool_t* pool, vod_json_value_t* json1, vod_json_value_t* json2)
 {
 	if (json1->type != json2->type)
 	{
@@ -1107,10 +1123,10 @@ vod_json_replace(vod_json_value_t* json1, vod_json_value_t* json2)
 	switch (json1->type)
 	{
 	case VOD_JSON_OBJECT:
-		return vod_json_replace_object(&json1->v.obj, &json2->v.obj);
+		return vod_json_replace_object(pool, &json1->v.obj, &json2->v.obj);
 
 	case VOD_JSON_ARRAY:
-		return vod_json_replace_array(&json1->v.arr, &json2->v.arr);
+		return vod_json_replace_array(pool, &json1->v.arr, &json2->v.arr);
 
 	default:
 		*json1 = *json2;
@@ -126,7 +126,9 @@ vod_status_t vod_json_parse_union(
 	void** dest);
 
 // misc
+// merges json2 into json1, json2 is not modified, and can be shared between requests
 vod_status_t vod_json_replace(
+	vod_pool_t* pool,
 	vod_json_value_t* json1,
 	vod_json_value_t* json2);
 
@@ -35,26 +35,25 @@ typedef struct {
 
 #include "languages_hash_params.h"
 
-static language_id_t* iso639_3_hash;
+// Note: the hash is built once, before the worker processes are forked, and is not modified afterwards
+static language_id_t iso639_3_hash[ISO639_3_HASH_TOTAL_SIZE];
+static bool_t iso639_3_hash_initialized = FALSE;
 
 vod_status_t
-language_code_process_init(vod_pool_t* pool, vod_log_t* log)
+language_code_init(vod_log_t* log)
 {
 	const language_hash_offsets_t* hash_offsets;
 	uint16_t int_code1;
 	uint16_t int_code2;
 	uint16_t index;
 	unsigned i;
-	
-	iso639_3_hash = vod_alloc(pool, ISO639_3_HASH_TOTAL_SIZE * sizeof(iso639_3_hash[0]));
-	if (iso639_3_hash == NULL)
+
+	if (iso639_3_hash_initialized)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
-			"language_code_process_init: vod_alloc failed");
-		return VOD_ALLOC_FAILED;
+		return VOD_OK;
 	}
-	
-	vod_memzero(iso639_3_hash, ISO639_3_HASH_TOTAL_SIZE * sizeof(iso639_3_hash[0]));
+
+	vod_memzero(iso639_3_hash, sizeof(iso639_3_hash));
 			
 	for (i = 1; i < vod_array_entries(iso639_3_codes); i++)
 	{
@@ -66,7 +65,7 @@ language_code_process_init(vod_pool_t* pool, vod_log_t* log)
 		if (iso639_3_hash[index] != 0)
 		{
 			vod_log_error(VOD_LOG_ERR, log, 0,
-				"language_code_process_init: hash table collision in index %uD lang %s",
+				"language_code_init: hash table collision in index %uD lang %s",
 				(uint32_t)index, iso639_3_codes[i]);
 			return VOD_UNEXPECTED;
 		}
@@ -91,14 +90,16 @@ language_code_process_init(vod_pool_t* pool, vod_log_t* log)
 		if (iso639_3_hash[index] != 0)
 		{
 			vod_log_error(VOD_LOG_ERR, log, 0,
-				"language_code_process_init: hash table collision in index %uD lang %s",
+				"language_code_init: hash table collision in index %uD lang %s",
 				(uint32_t)index, iso639_2b_codes[i]);
 			return VOD_UNEXPECTED;
 		}
 
 		iso639_3_hash[index] = i;
 	}
-	
+
+	iso639_3_hash_initialized = TRUE;
+
 	return VOD_OK;
 }
 
@@ -26,7 +26,7 @@ enum {
 typedef uint16_t language_id_t;
 
 // functions
-vod_status_t language_code_process_init(vod_pool_t* pool, vod_log_t* log);
+vod_status_t language_code_init(vod_log_t* log);
 
 language_id_t lang_parse_iso639_3_code(uint16_t code);
 
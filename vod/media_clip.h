@@ -52,12 +52,22 @@ typedef enum {
 	MCS_ENC_AES_CBC,
 } media_clip_source_enc_scheme_t;
 
+typedef struct {
+	uint64_t start_offset;
+	uint64_t end_offset;
+} media_clip_read_range_t;
+
 typedef struct {
 	media_clip_source_enc_scheme_t scheme;
 	ngx_str_t key;
 	ngx_str_t iv;
 } media_clip_source_enc_t;
 
+typedef struct {
+	media_info_t* first;
+	media_info_t* last;
+} media_clip_source_media_infos_t;
+
 struct media_clip_source_s;
 typedef struct media_clip_source_s media_clip_source_t;
 typedef struct ngx_http_vod_reader_s ngx_http_vod_reader_t;
@@ -70,6 +80,7 @@ struct media_clip_source_s {
 	media_track_array_t track_array;
 	struct media_sequence_s* sequence;
 	uint64_t clip_to;
+	void* generator_context;	// generator specific, e.g. the configuration of the silence generator
 
 	// TODO: the fields below are not required for generators, consider adding another struct
 
@@ -80,6 +91,8 @@ struct media_clip_source_s {
 	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
 	uint32_t time_shift[MEDIA_TYPE_COUNT];
 	media_clip_source_enc_t encryption;
+	bool_t resident;			// frames are cached in the resident frames cache, e.g. shared ad creatives
+	media_clip_source_media_infos_t media_infos;	// supplied by the mapping, used to build manifests without reading the file
 
 	// derived params
 	vod_str_t stripped_uri;		// without any params like clipTo
@@ -94,6 +107,8 @@ struct media_clip_source_s {
 
 	media_clip_source_t* next;
 	uint64_t last_offset;
+	media_clip_read_range_t* read_ranges;		// sorted, coalesced byte ranges of the frames of the request
+	uint32_t read_range_count;
 };
 
 typedef struct {
@@ -32,8 +32,12 @@ media_format_finalize_track(
 			break;
 		}
 
-		rc = avc_hevc_parser_init_ctx(
+		rc = avc_hevc_parser_get_cached_ctx(
 			request_context,
+			media_info->codec_id == VOD_CODEC_ID_AVC ? avc_parser_parse_extra_data : hevc_parser_parse_extra_data,
+			&media_info->extra_data,
+			NULL,
+			NULL,
 			&parser_ctx);
 		if (rc != VOD_OK)
 		{
@@ -42,31 +46,11 @@ media_format_finalize_track(
 
 		if (media_info->codec_id == VOD_CODEC_ID_AVC)
 		{
-			rc = avc_parser_parse_extra_data(
-				parser_ctx,
-				&media_info->extra_data,
-				NULL,
-				NULL);
-			if (rc != VOD_OK)
-			{
-				return rc;
-			}
-
 			media_info->u.video.transfer_characteristics = avc_parser_get_transfer_characteristics(
 				parser_ctx);
 		}
 		else
 		{
-			rc = hevc_parser_parse_extra_data(
-				parser_ctx,
-				&media_info->extra_data,
-				NULL,
-				NULL);
-			if (rc != VOD_OK)
-			{
-				return rc;
-			}
-
 			media_info->u.video.transfer_characteristics = hevc_parser_get_transfer_characteristics(
 				parser_ctx);
 		}
@@ -46,6 +46,7 @@
 #define PARSE_FLAG_RELATIVE_TIMESTAMPS	(0x00800000)		// relative to segment
 #define PARSE_FLAG_INITIAL_PTS_DELAY	(0x01000000)
 #define PARSE_FLAG_KEY_FRAME_BITRATE	(0x02000000)
+#define PARSE_FLAG_FRAMES_COMPACT		(0x04000000)		// mp4 only, duration runs + key frame bitmap instead of frames
 
 // flag groups
 #define PARSE_FLAG_FRAMES_ALL (PARSE_FLAG_FRAMES_DURATION | PARSE_FLAG_FRAMES_PTS_DELAY | PARSE_FLAG_FRAMES_SIZE | PARSE_FLAG_FRAMES_OFFSET | PARSE_FLAG_FRAMES_IS_KEY)
@@ -63,6 +64,8 @@
 #define REQUEST_FLAG_LOOK_AHEAD_SEGMENTS			(0x10)
 #define REQUEST_FLAG_NO_DISCONTINUITY				(0x20)
 #define REQUEST_FLAG_FORCE_PLAYLIST_TYPE_VOD		(0x40)
+#define REQUEST_FLAG_MASTER_MANIFEST				(0x80)
+#define REQUEST_FLAG_CMAF_FRAGMENT					(0x100)		// built by the mp4 fragment writer, same bytes in all protocols
 
 // audio channels (aligned with ffmpeg AV_CH_XXX)
 #define VOD_CH_FRONT_LEFT				0x00000001
@@ -164,6 +167,7 @@ typedef struct {
 	media_range_t* range;
 	uint32_t max_frame_count;
 	size_t max_frames_size;
+	uint32_t output_timescale;	// when non-zero, the frames may be returned in this timescale, if it is a multiple of the track timescale
 	int parse_type;
 	int codecs_mask;
 	struct media_clip_source_s* source;
@@ -229,6 +233,7 @@ typedef struct {
 	void* drm_info;
 } file_info_t;
 
+// Note: the trun writers in mp4_fragment.c load size, key_frame, duration and pts_delay together, in this order
 struct input_frame_s {
 	uint64_t offset;
 	uint32_t size;
@@ -248,6 +253,19 @@ typedef struct frame_list_part_s {
 	void* frames_source_context;
 } frame_list_part_t;
 
+typedef struct {
+	uint32_t count;
+	uint32_t duration;
+} frame_duration_run_t;
+
+typedef struct {		// mp4 only
+	frame_duration_run_t* first_run;	// NULL when the track uses the frames list
+	frame_duration_run_t* last_run;
+	u_char* key_frames;					// bitmap, NULL when the track has no key frames
+	uint32_t timescale;					// the timescale of the run durations
+	uint64_t first_dts;					// in timescale
+} compact_frame_list_t;
+
 typedef struct {		// mp4 only
 	u_char* auxiliary_info;
 	u_char* auxiliary_info_end;
@@ -261,6 +279,7 @@ typedef struct media_track_s {
 	file_info_t file_info;
 	uint32_t index;
 	frame_list_part_t frames;
+	compact_frame_list_t compact_frames;
 	uint32_t frame_count;
 	uint32_t key_frame_count;
 	uint64_t total_frames_size;
@@ -296,6 +315,7 @@ typedef struct {
 	// used when returning VOD_OK
 	vod_str_t* parts;
 	size_t part_count;
+	bool_t partial;			// the parts contain only the data required by the request, should not be cached
 } media_format_read_metadata_result_t;
 
 typedef struct {
@@ -307,8 +327,11 @@ typedef struct {
 	vod_array_t tracks;
 	uint64_t duration;
 	uint32_t timescale;
+	uint32_t file_track_count[MEDIA_TYPE_COUNT];	// all the tracks of the file, including tracks that were not requested
 } media_base_metadata_t;
 
+// Note: the formats (mp4, mkv, webvtt, dfxp, cap) are initialized positionally, 
+//	a member that is added here must be added to all of them, optional members are set to NULL
 typedef struct {
 	// basic info
 	uint32_t id;			// FORMAT_ID_xxx
@@ -363,6 +386,32 @@ typedef struct {
 		media_format_read_request_t* read_req,		// VOD_AGAIN
 		media_track_array_t* result);				// VOD_OK
 
+	// metadata cache
+	vod_status_t(*compact_metadata)(
+		request_context_t* request_context,
+		vod_str_t* metadata_parts,
+		size_t metadata_part_count,
+		vod_str_t* result);							// metadata_part_count parts, may point to the input
+
+	vod_status_t(*build_metadata_index)(
+		request_context_t* request_context,
+		vod_str_t* metadata_parts,
+		size_t metadata_part_count,
+		vod_str_t* result);							// saved to cache as an additional metadata part
+
+	// returns a metadata reader that continues the reading of expired cached metadata,
+	//	VOD_NOT_FOUND when the metadata can only be read from scratch
+	vod_status_t(*resume_metadata_reader)(
+		request_context_t* request_context,
+		vod_str_t* metadata_parts,
+		size_t metadata_part_count,
+		size_t max_metadata_size,
+		void** ctx,
+		media_format_read_request_t* read_req);		// the first read of the resumed reader
+
+	// releases the buffers of the metadata reader once the metadata was parsed, optional
+	void(*free_metadata_reader)(void* ctx);
+
 } media_format_t;
 
 // functions
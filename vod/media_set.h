@@ -11,6 +11,7 @@
 #define INVALID_SEQUENCE_INDEX (UINT_MAX)
 #define INVALID_SEGMENT_INDEX (UINT_MAX)
 #define INVALID_SEGMENT_TIME (LLONG_MAX)
+#define INVALID_PART_INDEX (UINT_MAX)
 #define INVALID_CLIP_INDEX (UINT_MAX)
 
 #define MAX_LOOK_AHEAD_SEGMENTS (2)
@@ -96,6 +97,13 @@ typedef struct {
 	uint64_t original_first_time;		// start time of the first clip before it was trimmed to the live window
 	uint64_t first_clip_start_offset;	// difference between first clip time and the original first time of this clip
 	uint32_t first_segment_alignment_offset;	// difference between unaligned first segment time and first_time
+
+	// prefix sums, set by segmenter_init_clip_offsets when there are multiple clips, NULL otherwise.
+	// the arrays are shifted along with durations, their first / last entries are not updated when 
+	// the first / last clips are trimmed, see segmenter_get_clips_duration
+	uint64_t* duration_offsets;			// [total_count + 1] sum of the durations of the preceding clips
+	uint32_t* segment_offsets;			// [total_count + 1] sum of the segment counts of the preceding clips, 
+										// NULL when bootstrap segments are used
 } media_clip_timing_t;
 
 typedef struct media_notification_s {
@@ -159,21 +167,34 @@ typedef struct {
 	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
 } sequence_tracks_mask_t;
 
+typedef struct {
+	uint64_t start;
+	uint32_t interval;
+	uint32_t columns;			// zero when the request is not a tiles request
+	uint32_t rows;
+} thumb_tiles_params_t;
+
 typedef struct {
 	int64_t segment_time;		// used in mss
 	segment_time_type_t segment_time_type;
 	uint32_t segment_index;
+	vod_str_t segment_index_str;	// the segment index token of the uri, points into the uri
+	uint32_t part_index;
 	uint32_t clip_index;
 	uint32_t pts_delay;
 	uint32_t sequences_mask;
 	vod_str_t sequence_ids[MAX_SEQUENCE_IDS];
 	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
+	vod_str_t tracks_str;			// the tracks token of the uri, points into the uri, empty when the tracks are selected per sequence
 	sequence_tracks_mask_t* sequence_tracks_mask;
 	sequence_tracks_mask_t* sequence_tracks_mask_end;
 	uint8_t* langs_mask;			// [LANG_MASK_SIZE]
 	uint32_t version;
 	uint32_t width;
 	uint32_t height;
+	bool_t key_frame_only;
+	uint32_t image_format;
+	thumb_tiles_params_t tiles;
 } request_params_t;
 
 #endif //__MEDIA_SET_H__
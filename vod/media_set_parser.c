@@ -1,5 +1,6 @@
 #include "media_set_parser.h"
 #include "json_parser.h"
+#include "msgpack_parser.h"
 #include "segmenter.h"
 #include "filters/gain_filter.h"
 #include "filters/rate_filter.h"
@@ -7,6 +8,7 @@
 #include "filters/concat_clip.h"
 #include "filters/dynamic_clip.h"
 #include "input/silence_generator.h"
+#include "input/mapped_media_info.h"
 #include "parse_utils.h"
 
 #if (VOD_HAVE_OPENSSL_EVP)
@@ -96,6 +98,7 @@ static vod_status_t media_set_parse_language(void* ctx, vod_json_value_t* value,
 static vod_status_t media_set_parse_clips_array(void* ctx, vod_json_value_t* value, void* dest);
 static vod_status_t media_set_parse_bitrate(void* ctx, vod_json_value_t* value, void* dest);
 static vod_status_t media_set_parse_source_type(void* ctx, vod_json_value_t* value, void* dest);
+static vod_status_t media_set_parse_bool(void* ctx, vod_json_value_t* value, void* dest);
 
 // constants
 static json_parser_union_type_def_t media_clip_union_params[] = {
@@ -117,6 +120,8 @@ static json_object_value_def_t media_clip_source_params[] = {
 	{ vod_string("encryptionKey"),	VOD_JSON_STRING,	offsetof(media_clip_source_t, encryption.key), media_set_parse_base64_string },
 	{ vod_string("encryptionIv"),	VOD_JSON_STRING,	offsetof(media_clip_source_t, encryption.iv), media_set_parse_base64_string },
 	{ vod_string("sourceType"),		VOD_JSON_STRING,	offsetof(media_clip_source_t, source_type), media_set_parse_source_type },
+	{ vod_string("resident"),		VOD_JSON_BOOL,		offsetof(media_clip_source_t, resident), media_set_parse_bool },
+	{ vod_string("mediaInfo"),		VOD_JSON_ARRAY,		offsetof(media_clip_source_t, media_infos), mapped_media_info_parse },
 	{ vod_null_string, 0, 0, NULL }
 };
 
@@ -186,6 +191,8 @@ static parser_init_t parser_init_funcs[] = {
 	rate_filter_parser_init,
 	concat_clip_parser_init,
 	dynamic_clip_parser_init,
+	silence_generator_parser_init,
+	mapped_media_info_parser_init,
 	NULL
 };
 
@@ -299,6 +306,16 @@ media_set_parse_int64(
 	return VOD_OK;
 }
 
+static vod_status_t
+media_set_parse_bool(
+	void* ctx,
+	vod_json_value_t* value,
+	void* dest)
+{
+	*(bool_t*)dest = value->v.boolean;
+	return VOD_OK;
+}
+
 static vod_status_t
 media_set_parse_source_type(
 	void* ctx,
@@ -914,6 +931,8 @@ media_set_parse_sequences(
 	return VOD_OK;
 }
 
+// builds only the clips of clip_ranges - on segment requests, the clips that overlap the segment, located by the segmenter
+// using a binary search over the clip times / offsets, the other elements of the clips array remain unparsed json
 static vod_status_t 
 media_set_parse_sequence_clips(
 	media_set_parse_context_t* context,
@@ -2063,6 +2082,7 @@ media_set_apply_clip_from(
 	timing->durations += clip_index;
 	timing->original_times += clip_index;
 	timing->total_count -= clip_index;
+	segmenter_shift_clip_offsets(timing, clip_index);
 
 	timing->total_duration -= clip_offset;
 	timing->durations[0] -= clip_offset;
@@ -2171,8 +2191,8 @@ media_set_apply_clip_to(
 vod_status_t
 media_set_parse_json(
 	request_context_t* request_context, 
-	u_char* string, 
-	u_char* override,
+	vod_str_t* mapping, 
+	vod_json_value_t* override,
 	request_params_t* request_params,
 	segmenter_conf_t* segmenter,
 	media_clip_source_t* source,
@@ -2182,7 +2202,6 @@ media_set_parse_json(
 	media_set_parse_context_t context;
 	get_clip_ranges_params_t get_ranges_params;
 	vod_json_value_t* params[MEDIA_SET_PARAM_COUNT];
-	vod_json_value_t override_json;
 	vod_json_value_t json;
 	vod_status_t rc;
 	uint64_t last_clip_end;
@@ -2193,25 +2212,30 @@ media_set_parse_json(
 	u_char error[128];
 
 	// parse the json and get the media set object values
-	rc = vod_json_parse(request_context->pool, string, &json, error, sizeof(error));
-	if (rc != VOD_JSON_OK)
+	if (mapping->len > 0 && vod_msgpack_is_map(mapping->data[0]))
 	{
-		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"media_set_parse_json: failed to parse json %i: %s", rc, error);
-		return VOD_BAD_MAPPING;
+		rc = vod_msgpack_parse(request_context->pool, mapping->data, mapping->len, &json, error, sizeof(error));
+		if (rc != VOD_JSON_OK)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"media_set_parse_json: failed to parse msgpack %i: %s", rc, error);
+			return VOD_BAD_MAPPING;
+		}
 	}
-
-	if (override != NULL)
+	else
 	{
-		rc = vod_json_parse(request_context->pool, override, &override_json, error, sizeof(error));
+		rc = vod_json_parse(request_context->pool, mapping->data, &json, error, sizeof(error));
 		if (rc != VOD_JSON_OK)
 		{
 			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-				"media_set_parse_json: failed to parse override json %i: %s", rc, error);
-			return VOD_BAD_REQUEST;
+				"media_set_parse_json: failed to parse json %i: %s", rc, error);
+			return VOD_BAD_MAPPING;
 		}
+	}
 
-		rc = vod_json_replace(&json, &override_json);
+	if (override != NULL)
+	{
+		rc = vod_json_replace(request_context->pool, &json, override);
 		if (rc != VOD_OK)
 		{
 			return rc;
@@ -2414,6 +2438,12 @@ media_set_parse_json(
 		return rc;
 	}
 
+	rc = segmenter_init_clip_offsets(request_context, segmenter, &result->timing);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
 	// sequences
 	rc = media_set_parse_sequences(
 		request_context,
@@ -2623,6 +2653,19 @@ media_set_parse_json(
 			}
 
 			result->initial_segment_clip_relative_index = context.clip_ranges.clip_relative_segment_index;
+
+			if (request_params->part_index != INVALID_PART_INDEX)
+			{
+				rc = segmenter_get_part_range(
+					request_context,
+					segmenter,
+					request_params->part_index,
+					&context.clip_ranges);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+			}
 		}
 		else
 		{
@@ -2654,6 +2697,8 @@ media_set_parse_json(
 			}
 
 			get_ranges_params.time = request_params->segment_time;
+			get_ranges_params.duration = request_params->tiles.columns > 0 ?
+				(uint64_t)request_params->tiles.interval * (request_params->tiles.columns * request_params->tiles.rows - 1) : 0;
 			rc = segmenter_get_start_end_ranges_gop(
 				&get_ranges_params,
 				&context.clip_ranges);
@@ -24,10 +24,12 @@ vod_status_t media_set_parser_init(
 	vod_pool_t* pool,
 	vod_pool_t* temp_pool);
 
+// the mapping may be either a null terminated json or a messagepack buffer,
+// the override (optional) is merged into the mapping, and is not modified
 vod_status_t media_set_parse_json(
 	request_context_t* request_context,
-	u_char* string,
-	u_char* override,
+	vod_str_t* mapping,
+	vod_json_value_t* override,
 	request_params_t* request_params,
 	struct segmenter_conf_s* segmenter,
 	media_clip_source_t* source,
@@ -1,7 +1,14 @@
 #include "ebml.h"
+#include "../read_stream.h"
 
 // macros
+#if defined(__GNUC__)
+// Note: a zero byte is handled as 1, as in the table - both are translated to size 8
+#define ebml_num_size(first_byte) (__builtin_clz((unsigned)(first_byte) | 1) - (sizeof(unsigned) * 8 - 9))
+#else
 #define log2_byte(value) ((log2_table[(value) >> 2] >> (((value) & 2) << 1)) & 0xf)
+#define ebml_num_size(first_byte) (8 - log2_byte(first_byte))
+#endif
 
 // constants
 #define EBML_ID_HEADER             (0x1A45DFA3)
@@ -17,6 +24,7 @@
 #define EBML_VERSION (1)
 
 // globals
+#if !defined(__GNUC__)
 static const uint8_t log2_table[] = {
 	0x10, 0x22, 0x33, 0x33, 0x44, 0x44, 0x44, 0x44,
 	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
@@ -27,6 +35,7 @@ static const uint8_t log2_table[] = {
 	0x77, 0x77, 0x77, 0x77, 0x77, 0x77, 0x77, 0x77,
 	0x77, 0x77, 0x77, 0x77, 0x77, 0x77, 0x77, 0x77,
 };
+#endif
 
 static const uint64_t ebml_max_sizes[] = {
 	0,			// none
@@ -57,7 +66,6 @@ ebml_read_num(ebml_context_t* context, uint64_t* result, size_t max_size, int re
 	uint64_t value;
 	uint8_t first_byte;
 	size_t num_size;
-	int log2_first_byte;
 	int bytes_to_read;
 
 	if (context->cur_pos >= context->end_pos)
@@ -67,10 +75,9 @@ ebml_read_num(ebml_context_t* context, uint64_t* result, size_t max_size, int re
 		return VOD_BAD_DATA;
 	}
 
-	first_byte = *context->cur_pos++;
-	log2_first_byte = log2_byte(first_byte);
+	first_byte = *context->cur_pos;
 
-	num_size = 8 - log2_first_byte;
+	num_size = ebml_num_size(first_byte);
 	if (num_size > max_size)
 	{
 		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
@@ -78,20 +85,32 @@ ebml_read_num(ebml_context_t* context, uint64_t* result, size_t max_size, int re
 		return VOD_BAD_DATA;
 	}
 
-	bytes_to_read = num_size - 1;
-	if (bytes_to_read > context->end_pos - context->cur_pos)
+	if (context->end_pos - context->cur_pos >= (ssize_t)sizeof(uint64_t))
 	{
-		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-			"ebml_read_num: stream overflow (2)");
-		return VOD_BAD_DATA;
+		// fast path - a single 64 bit read, the extra bytes are shifted out
+		value = parse_be64(context->cur_pos) >> (64 - 8 * num_size);
+		context->cur_pos += num_size;
 	}
-
-	value = first_byte & ~(remove_first_bit << log2_first_byte);
-	for (; bytes_to_read > 0; bytes_to_read--)
+	else
 	{
-		value = (value << 8) | (*context->cur_pos++);
+		bytes_to_read = num_size - 1;
+		if (bytes_to_read > context->end_pos - context->cur_pos - 1)
+		{
+			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+				"ebml_read_num: stream overflow (2)");
+			return VOD_BAD_DATA;
+		}
+
+		value = *context->cur_pos++;
+		for (; bytes_to_read > 0; bytes_to_read--)
+		{
+			value = (value << 8) | (*context->cur_pos++);
+		}
 	}
 
+	// the length marker is the highest set bit
+	value &= ~((uint64_t)remove_first_bit << (7 * num_size));
+
 	*result = value;
 	return num_size;
 }
@@ -97,10 +97,8 @@ typedef struct {
 	input_frame_t* cur_frame;
 	bool_t first_time;
 	bool_t frame_started;
-	uint64_t relative_dts;
-	uint32_t timescale;
-	bool_t key_frame;
 	u_char* frame_headers;
+	u_char* frame_headers_end;
 } mkv_fragment_writer_state_t;
 
 static uint32_t frame_header_size_by_enc_type[] = {
@@ -132,6 +130,10 @@ static vod_str_t mkv_writing_app = vod_string("nginx-vod-module");
 static int 
 ebml_num_size(uint64_t num)
 {
+#if defined(__GNUC__)
+	// all ones signifies unknown size, hence the + 1
+	return (64 - __builtin_clzll(num + 1) + 6) / 7;
+#else
 	int result = 0;
 
 	num += 1;		// all ones signifies unknown size
@@ -142,6 +144,21 @@ ebml_num_size(uint64_t num)
 	} while (num);
 
 	return result;
+#endif
+}
+
+// returns the size of an ebml number according to its first byte (must not be zero)
+static int
+ebml_encoded_num_size(u_char first_byte)
+{
+#if defined(__GNUC__)
+	return __builtin_clz(first_byte) - (sizeof(unsigned) * 8 - 9);
+#else
+	int result;
+
+	for (result = 1; (first_byte & 0x80) == 0; first_byte <<= 1, result++);
+	return result;
+#endif
 }
 
 static int
@@ -517,6 +534,91 @@ mkv_build_init_segment(
 	return VOD_OK;
 }
 
+static u_char*
+mkv_builder_write_clear_frame_header(
+	u_char* p, 
+	size_t data_size, 
+	uint16_t timecode, 
+	uint32_t key_frame)
+{
+	write_id8(p, MKV_ID_SIMPLEBLOCK);
+	p = ebml_write_num(p, data_size, 0);
+
+	ebml_write_num_1(p, 1);		// track number
+	write_be16(p, timecode);
+	*p++ = key_frame ? 0x80 : 0;		// flags
+
+	return p;
+}
+
+// writes the headers of all the frames of the sequence, the iv of encrypted frames is not
+// written, since it is set only when the frame is output
+static u_char*
+mkv_builder_write_frame_headers(
+	u_char* p,
+	media_sequence_t* sequence,
+	uint32_t frame_header_size,
+	mkv_encryption_type_t encryption_type)
+{
+	media_clip_filtered_t* cur_clip;
+	frame_list_part_t* part;
+	media_track_t* track;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint64_t relative_dts = 0;
+	uint32_t timescale;
+	uint16_t timecode;
+	bool_t key_frame;
+
+	for (cur_clip = sequence->filtered_clips; cur_clip < sequence->filtered_clips_end; cur_clip++)
+	{
+		track = cur_clip->first_track;
+		timescale = track->media_info.timescale;
+		key_frame = (track->media_info.media_type == MEDIA_TYPE_AUDIO);
+
+		part = &track->frames;
+		last_frame = part->last_frame;
+		for (cur_frame = part->first_frame; ; cur_frame++)
+		{
+			if (cur_frame >= last_frame)
+			{
+				if (part->next == NULL)
+				{
+					break;
+				}
+				part = part->next;
+				cur_frame = part->first_frame;
+				last_frame = part->last_frame;
+			}
+
+			timecode = rescale_time(relative_dts + cur_frame->pts_delay, timescale, MKV_TIMESCALE);
+
+			p = mkv_builder_write_clear_frame_header(
+				p,
+				frame_header_size + cur_frame->size,
+				timecode,
+				cur_frame->key_frame || key_frame);
+
+			switch (encryption_type)
+			{
+			case MKV_CLEAR_LEAD:
+				*p++ = 0x00;	// clear
+				break;
+
+			case MKV_ENCRYPTED:
+				*p++ = 0x01;	// encrypted
+				break;
+
+			default:;
+			}
+
+			relative_dts += cur_frame->duration;
+		}
+	}
+
+	return p;
+}
+
 static void
 mkv_builder_init_track(mkv_fragment_writer_state_t* state, media_track_t* track)
 {
@@ -524,8 +626,6 @@ mkv_builder_init_track(mkv_fragment_writer_state_t* state, media_track_t* track)
 	state->first_frame_part = &track->frames;
 	state->cur_frame_part = track->frames;
 	state->cur_frame = track->frames.first_frame;
-	state->timescale = track->media_info.timescale;
-	state->key_frame = (track->media_info.media_type == MEDIA_TYPE_AUDIO);
 
 	if (!state->reuse_buffers)
 	{
@@ -559,7 +659,9 @@ mkv_builder_frame_writer_init(
 	size_t cluster_size;
 	size_t alloc_size;
 	size_t 	frame_headers_size;
+	size_t frame_headers_alloc_size;
 	uint32_t frame_header_size;
+	uint32_t frame_count;
 	u_char* p;
 #if (VOD_HAVE_OPENSSL_EVP)
 	vod_status_t rc;
@@ -569,6 +671,7 @@ mkv_builder_frame_writer_init(
 
 	// calculate the total frame headers size
 	frame_headers_size = 0;
+	frame_count = 0;
 	for (cur_clip = sequence->filtered_clips; cur_clip < sequence->filtered_clips_end; cur_clip++)
 	{
 		part = &cur_clip->first_track->frames;
@@ -590,6 +693,7 @@ mkv_builder_frame_writer_init(
 			frame_headers_size += 
 				1 + ebml_num_size(block_data_size) +			// simple block
 				frame_header_size;
+			frame_count++;
 		}
 	}
 
@@ -678,21 +782,40 @@ mkv_builder_frame_writer_init(
 
 		state->reuse_buffers = TRUE;
 		vod_memcpy(state->iv, iv, sizeof(state->iv));
+
+		frame_headers_alloc_size = frame_headers_size - frame_count * MP4_AES_CTR_IV_SIZE;
 	}
 	else
 #endif // VOD_HAVE_OPENSSL_EVP
 	{
-		state->frame_headers = vod_alloc(request_context->pool, frame_headers_size);
-		if (state->frame_headers == NULL)
-		{
-			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-				"mkv_builder_frame_writer_init: vod_alloc failed (3)");
-			return VOD_ALLOC_FAILED;
-		}
-
 		state->write_callback = write_callback;
 		state->write_context = write_context;
 		state->reuse_buffers = reuse_buffers;
+
+		frame_headers_alloc_size = frame_headers_size;
+	}
+
+	// write all the frame headers, the sizes are known, so the buffer can be allocated once
+	state->frame_headers = vod_alloc(request_context->pool, frame_headers_alloc_size);
+	if (state->frame_headers == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mkv_builder_frame_writer_init: vod_alloc failed (3)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->frame_headers_end = mkv_builder_write_frame_headers(
+		state->frame_headers,
+		sequence,
+		frame_header_size,
+		encryption_type);
+
+	if ((size_t)(state->frame_headers_end - state->frame_headers) != frame_headers_alloc_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mkv_builder_frame_writer_init: frame headers size %uz different than allocated size %uz",
+			(size_t)(state->frame_headers_end - state->frame_headers), frame_headers_alloc_size);
+		return VOD_UNEXPECTED;
 	}
 
 	state->request_context = request_context;
@@ -701,7 +824,6 @@ mkv_builder_frame_writer_init(
 	state->frame_started = FALSE;
 	state->sequence = sequence;
 	state->cur_clip = sequence->filtered_clips;
-	state->relative_dts = 0;
 
 	mkv_builder_init_track(state, state->cur_clip->first_track);
 
@@ -709,32 +831,34 @@ mkv_builder_frame_writer_init(
 	return VOD_OK;
 }
 
-static u_char*
-mkv_builder_write_clear_frame_header(
-	u_char* p, 
-	size_t data_size, 
-	uint16_t timecode, 
-	uint32_t key_frame)
-{
-	write_id8(p, MKV_ID_SIMPLEBLOCK);
-	p = ebml_write_num(p, data_size, 0);
-
-	ebml_write_num_1(p, 1);		// track number
-	write_be16(p, timecode);
-	*p++ = key_frame ? 0x80 : 0;		// flags
-
-	return p;
-}
-
 static vod_status_t
 mkv_builder_write_frame_header(mkv_fragment_writer_state_t* state)
 {
-	input_frame_t* cur_frame = state->cur_frame;
-	size_t data_size = state->frame_header_size + cur_frame->size;
-	uint64_t relative_pts = state->relative_dts + cur_frame->pts_delay;
-	uint16_t timecode = rescale_time(relative_pts, state->timescale, MKV_TIMESCALE);
-	u_char* p;
+	u_char* header = state->frame_headers;
+	size_t header_size;
 	vod_status_t rc;
+#if (VOD_HAVE_OPENSSL_EVP)
+	u_char* p;
+#endif // VOD_HAVE_OPENSSL_EVP
+
+	// the headers were written on init, only need to get the size of the current one
+	header_size = 1 + ebml_encoded_num_size(header[1]) + state->frame_header_size;
+
+#if (VOD_HAVE_OPENSSL_EVP)
+	if (state->encryption_type == MKV_ENCRYPTED)
+	{
+		header_size -= MP4_AES_CTR_IV_SIZE;
+	}
+#endif // VOD_HAVE_OPENSSL_EVP
+
+	if (header + header_size > state->frame_headers_end)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mkv_builder_write_frame_header: frame header exceeds the headers buffer");
+		return VOD_UNEXPECTED;
+	}
+
+	state->frame_headers += header_size;
 
 #if (VOD_HAVE_OPENSSL_EVP)
 	if (state->encryption_type == MKV_ENCRYPTED)
@@ -742,7 +866,7 @@ mkv_builder_write_frame_header(mkv_fragment_writer_state_t* state)
 		// write to write_buffer
 		rc = write_buffer_get_bytes(
 			&state->write_buffer, 
-			1 + ebml_num_size(data_size) + MKV_FRAME_HEADER_SIZE_ENCRYPTED, 
+			header_size + MP4_AES_CTR_IV_SIZE, 
 			NULL, 
 			&p);
 		if (rc != VOD_OK)
@@ -750,45 +874,22 @@ mkv_builder_write_frame_header(mkv_fragment_writer_state_t* state)
 			return rc;
 		}
 
-		p = mkv_builder_write_clear_frame_header(
-			p, 
-			data_size, 
-			timecode, 
-			cur_frame->key_frame || state->key_frame);
-
-		*p++ = 0x01;	// encrypted
+		p = vod_copy(p, header, header_size);
 		p = vod_copy(p, state->iv, MP4_AES_CTR_IV_SIZE);
 
 		mp4_aes_ctr_set_iv(&state->cipher, state->iv);
 		mp4_aes_ctr_increment_be64(state->iv);
+
+		return VOD_OK;
 	}
-	else
 #endif // VOD_HAVE_OPENSSL_EVP
-	{
-		// write to frame_headers
-		p = state->frame_headers;
-
-		p = mkv_builder_write_clear_frame_header(
-			p, 
-			data_size, 
-			timecode, 
-			cur_frame->key_frame || state->key_frame);
-
-		if (state->encryption_type == MKV_CLEAR_LEAD)
-		{
-			*p++ = 0x00;	// clear
-		}
 
-		rc = state->write_callback(state->write_context, state->frame_headers, p - state->frame_headers);
-		if (rc != VOD_OK)
-		{
-			return rc;
-		}
-		state->frame_headers = p;
+	rc = state->write_callback(state->write_context, header, header_size);
+	if (rc != VOD_OK)
+	{
+		return rc;
 	}
 
-	state->relative_dts += cur_frame->duration;
-
 	return VOD_OK;
 }
 
@@ -3,6 +3,7 @@
 #include "ebml.h"
 #include "../input/frames_source_memory.h"
 #include "../read_stream.h"
+#include "../write_stream.h"
 #include "../segmenter.h"
 
 // constants
@@ -206,10 +207,17 @@ typedef struct {
 	mkv_section_pos_t positions[SECTION_FILE_COUNT];
 } mkv_file_layout_t;
 
+// the cue points of the cues section, saved to the metadata cache as an additional part
+typedef struct {
+	u_char time[8];
+	u_char cluster_pos[8];
+} mkv_cue_index_entry_t;
+
 typedef struct {
 	media_base_metadata_t base;
 	mkv_base_layout_t base_layout;
 	vod_str_t cues;
+	vod_str_t cue_index;		// empty if the metadata was not loaded from cache with an index
 	uint64_t start_time;
 	uint64_t end_time;
 	uint32_t max_frame_count;
@@ -911,12 +919,87 @@ mkv_metadata_parse(
 
 	metadata->base.timescale = timescale;
 	metadata->base.duration = info.duration;
+	vod_memcpy(metadata->base.file_track_count, track_indexes, sizeof(metadata->base.file_track_count));
 	metadata->cues = metadata_parts[SECTION_CUES];
+
+	if (metadata_part_count > SECTION_COUNT &&
+		metadata_parts[SECTION_COUNT].len > 0 &&
+		metadata_parts[SECTION_COUNT].len % sizeof(mkv_cue_index_entry_t) == 0)
+	{
+		metadata->cue_index = metadata_parts[SECTION_COUNT];
+	}
+	else
+	{
+		metadata->cue_index.len = 0;
+	}
 	metadata->base_layout = *(mkv_base_layout_t*)metadata_parts[SECTION_LAYOUT].data;
 	*result = &metadata->base;
 	return VOD_OK;
 }
 
+// returns the first entry whose time is greater than or equal to time
+static uint32_t
+mkv_cue_index_lower_bound(const mkv_cue_index_entry_t* entries, uint32_t left, uint32_t right, uint64_t time)
+{
+	uint32_t mid;
+
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (parse_be64(entries[mid].time) < time)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+// finds the same clusters as the scan of the cues in mkv_get_read_frames_request, the index is sorted by time
+static void
+mkv_get_cluster_range_indexed(
+	mkv_base_metadata_t* metadata,
+	uint64_t end_time,
+	uint64_t* start_pos,
+	uint64_t* end_pos)
+{
+	const mkv_cue_index_entry_t* entries = (const void*)metadata->cue_index.data;
+	uint32_t count = metadata->cue_index.len / sizeof(entries[0]);
+	uint32_t start_index;
+	uint32_t end_index;
+
+	// the scan stops on the first cue that starts at or after the end time
+	end_index = mkv_cue_index_lower_bound(entries, 0, count, end_time);
+	if (end_index < count)
+	{
+		*end_pos = parse_be64(entries[end_index].cluster_pos);
+	}
+	else
+	{
+		*end_pos = metadata->base_layout.segment_size;
+	}
+
+	// the start is the cluster of the cue preceding the first cue (excluding the first) that starts after the start time
+	start_index = mkv_cue_index_lower_bound(entries, 1, vod_min(end_index + 1, count), metadata->start_time + 1);
+	if (start_index < count && start_index <= end_index)
+	{
+		*start_pos = parse_be64(entries[start_index - 1].cluster_pos);
+	}
+	else if (end_index >= count && count > 0 && metadata->start_time < metadata->base.duration)
+	{
+		// the virtual cue at the end of the segment
+		*start_pos = parse_be64(entries[count - 1].cluster_pos);
+	}
+	else
+	{
+		*start_pos = ULLONG_MAX;
+	}
+}
+
 static vod_status_t
 mkv_get_read_frames_request(
 	request_context_t* request_context,
@@ -927,6 +1010,7 @@ mkv_get_read_frames_request(
 	ebml_context_t context;
 	uint64_t prev_cluster_pos;
 	uint64_t end_time;
+	uint64_t end_cluster_pos;
 	mkv_index_t index;
 	vod_status_t rc;
 	bool_t done = FALSE;
@@ -938,6 +1022,16 @@ mkv_get_read_frames_request(
 	read_req->read_offset = ULLONG_MAX;
 	read_req->flags = 0;
 
+	if (metadata->cue_index.len > 0)
+	{
+		mkv_get_cluster_range_indexed(
+			metadata,
+			end_time,
+			&read_req->read_offset,
+			&end_cluster_pos);
+		goto found;
+	}
+
 	prev_cluster_pos = ULLONG_MAX;
 
 	context.request_context = request_context;
@@ -978,21 +1072,25 @@ mkv_get_read_frames_request(
 		prev_cluster_pos = index.cluster_pos;
 	}
 
+	end_cluster_pos = index.cluster_pos;
+
+found:
+
 	if (read_req->read_offset == ULLONG_MAX)
 	{
 		// no frames
 		return VOD_OK;
 	}
 
-	if (index.cluster_pos <= read_req->read_offset)
+	if (end_cluster_pos <= read_req->read_offset)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
 			"mkv_get_read_frames_request: end cue pos %uL is less than start cue pos %uL",
-			index.cluster_pos, read_req->read_offset);
+			end_cluster_pos, read_req->read_offset);
 		return VOD_BAD_DATA;
 	}
 
-	read_req->read_size = index.cluster_pos - read_req->read_offset;
+	read_req->read_size = end_cluster_pos - read_req->read_offset;
 	read_req->read_offset += metadata->base_layout.position_reference;
 
 	return VOD_AGAIN;
@@ -1731,6 +1829,90 @@ mkv_read_frames(
 	return mkv_parse_frames_estimate_bitrate(request_context, base, frame_data, result);
 }
 
+// Note: must parse the cues in the same way mkv_get_read_frames_request does
+static vod_status_t
+mkv_build_cue_index(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	mkv_cue_index_entry_t* entry;
+	ebml_context_t context;
+	mkv_index_t index;
+	vod_array_t entries;
+	vod_status_t rc;
+	uint64_t prev_time = 0;
+	u_char* p;
+
+	if (metadata_part_count < SECTION_COUNT ||
+		metadata_parts[SECTION_CUES].len <= 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	if (vod_array_init(&entries, request_context->pool, 64, sizeof(*entry)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mkv_build_cue_index: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	context.request_context = request_context;
+	context.cur_pos = metadata_parts[SECTION_CUES].data;
+	context.end_pos = context.cur_pos + metadata_parts[SECTION_CUES].len;
+
+	// Note: not resetting index between the cues, the fields of a cue missing some elements are inherited
+	vod_memzero(&index, sizeof(index));
+
+	while (context.cur_pos < context.end_pos)
+	{
+		rc = ebml_parse_single(&context, mkv_spec_index, &index);
+		if (rc != VOD_OK)
+		{
+			vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mkv_build_cue_index: ebml_parse_single failed %i", rc);
+			return rc;
+		}
+
+		if (index.time < prev_time)
+		{
+			// the index is searched by time, the cues are scanned without it
+			vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mkv_build_cue_index: cue time %uL is less than the previous cue time %uL",
+				index.time, prev_time);
+			return VOD_NOT_FOUND;
+		}
+
+		prev_time = index.time;
+
+		entry = vod_array_push(&entries);
+		if (entry == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mkv_build_cue_index: vod_array_push failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		p = entry->time;
+		write_be64(p, index.time);
+		write_be64(p, index.cluster_pos);
+	}
+
+	if (entries.nelts <= 0 || entries.nelts > UINT_MAX / sizeof(*entry))
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	result->data = entries.elts;
+	result->len = entries.nelts * sizeof(*entry);
+
+	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mkv_build_cue_index: %ui cues", entries.nelts);
+
+	return VOD_OK;
+}
+
 media_format_t mkv_format = {
 	FORMAT_ID_MKV,
 	vod_string("mkv"),
@@ -1740,4 +1922,8 @@ media_format_t mkv_format = {
 	NULL,
 	mkv_metadata_parse,
 	mkv_read_frames,
+	NULL,
+	mkv_build_cue_index,
+	NULL,			// resume_metadata_reader
+	NULL,			// free_metadata_reader
 };
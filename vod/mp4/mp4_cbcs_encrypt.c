@@ -45,15 +45,7 @@ typedef struct {
 } mp4_cbcs_encrypt_stream_state_t;
 
 typedef struct {
-	vod_status_t (*init_ctx)(
-		request_context_t* request_context,
-		void** ctx);
-
-	vod_status_t (*parse_extra_data)(
-		void* ctx,
-		vod_str_t* extra_data,
-		uint32_t* nal_packet_size_length,
-		uint32_t* min_packet_size);
+	avc_hevc_parse_extra_data_t parse_extra_data;
 
 	vod_status_t (*is_slice)(
 		void* ctx,
@@ -68,10 +60,18 @@ typedef struct {
 
 } slice_parser_t;
 
+typedef struct {
+	void* context;
+	uint32_t nal_packet_size_length;
+	uint32_t min_packet_size;
+} mp4_cbcs_encrypt_clip_parser_t;
+
 typedef struct {
 	mp4_cbcs_encrypt_stream_state_t base;
 
 	slice_parser_t slice_parser;
+	media_track_t* first_track;
+	mp4_cbcs_encrypt_clip_parser_t* clip_parsers;		// the parameter sets are resolved upfront, per clip
 	void* slice_parser_context;
 	uint32_t nal_packet_size_length;
 	uint32_t min_packet_size;
@@ -99,14 +99,12 @@ enum {
 };
 
 static slice_parser_t avc_parser = {
-	avc_hevc_parser_init_ctx,
 	avc_parser_parse_extra_data,
 	avc_parser_is_slice,
 	avc_parser_get_slice_header_size,
 };
 
 static slice_parser_t hevc_parser = {
-	avc_hevc_parser_init_ctx,
 	hevc_parser_parse_extra_data,
 	hevc_parser_is_slice,
 	hevc_parser_get_slice_header_size,
@@ -305,18 +303,14 @@ static vod_status_t
 mp4_cbcs_encrypt_video_init_track(mp4_cbcs_encrypt_video_stream_state_t* stream_state)
 {
 	mp4_cbcs_encrypt_state_t* state = stream_state->base.state;
-	media_track_t* track = stream_state->base.cur_track;
-	vod_status_t rc;
+	mp4_cbcs_encrypt_clip_parser_t* clip_parser;
 
-	rc = stream_state->slice_parser.parse_extra_data(
-		stream_state->slice_parser_context,
-		&track->media_info.extra_data,
-		&stream_state->nal_packet_size_length,
-		&stream_state->min_packet_size);
-	if (rc != VOD_OK)
-	{
-		return rc;
-	}
+	clip_parser = &stream_state->clip_parsers[
+		(stream_state->base.cur_track - stream_state->first_track) / stream_state->base.total_track_count];
+
+	stream_state->slice_parser_context = clip_parser->context;
+	stream_state->nal_packet_size_length = clip_parser->nal_packet_size_length;
+	stream_state->min_packet_size = clip_parser->min_packet_size;
 
 	if (stream_state->nal_packet_size_length < 1 || stream_state->nal_packet_size_length > 4)
 	{
@@ -653,6 +647,55 @@ mp4_cbcs_encrypt_video_write_buffer(void* context, u_char* buffer, uint32_t size
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_cbcs_encrypt_video_init_clip_parsers(mp4_cbcs_encrypt_video_stream_state_t* stream_state)
+{
+	mp4_cbcs_encrypt_clip_parser_t* clip_parser;
+	mp4_cbcs_encrypt_stream_state_t* base = &stream_state->base;
+	request_context_t* request_context = base->state->request_context;
+	media_track_t* prev_track = NULL;
+	media_track_t* cur_track;
+	vod_status_t rc;
+
+	// the writer may run on a thread pool, while the parsed parameter sets can be fetched only from the main thread
+	stream_state->first_track = base->cur_track;
+	stream_state->clip_parsers = vod_alloc(request_context->pool,
+		sizeof(stream_state->clip_parsers[0]) * vod_div_ceil(base->last_track - base->cur_track, base->total_track_count));
+	if (stream_state->clip_parsers == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_cbcs_encrypt_video_init_clip_parsers: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	clip_parser = stream_state->clip_parsers;
+	for (cur_track = base->cur_track; cur_track < base->last_track; cur_track += base->total_track_count, clip_parser++)
+	{
+		if (prev_track != NULL &&
+			vod_str_equals(prev_track->media_info.extra_data, cur_track->media_info.extra_data))
+		{
+			clip_parser[0] = clip_parser[-1];
+			continue;
+		}
+
+		rc = avc_hevc_parser_get_cached_ctx(
+			request_context,
+			stream_state->slice_parser.parse_extra_data,
+			&cur_track->media_info.extra_data,
+			&clip_parser->nal_packet_size_length,
+			&clip_parser->min_packet_size,
+			&clip_parser->context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		prev_track = cur_track;
+	}
+
+	return VOD_OK;
+}
+
 static vod_status_t
 mp4_cbcs_encrypt_video_get_fragment_writer(
 	mp4_cbcs_encrypt_state_t* state,
@@ -690,20 +733,21 @@ mp4_cbcs_encrypt_video_get_fragment_writer(
 		return VOD_BAD_REQUEST;
 	}
 
-	rc = stream_state->slice_parser.init_ctx(request_context, &stream_state->slice_parser_context);
-	if (rc != VOD_OK)
-	{
-		return rc;
-	}
-
 	mp4_cbcs_encrypt_init_stream_state(
 		&stream_state->base,
 		state,
 		media_set, 
 		track);
 
+	rc = mp4_cbcs_encrypt_video_init_clip_parsers(stream_state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
 	segment_writer->write_tail = mp4_cbcs_encrypt_video_write_buffer;
 	segment_writer->write_head = NULL;
+	segment_writer->write_file = NULL;
 	segment_writer->context = stream_state;
 
 	// init writing for the first track
@@ -832,6 +876,7 @@ mp4_cbcs_encrypt_audio_get_fragment_writer(
 
 	segment_writer->write_tail = mp4_cbcs_encrypt_audio_write_buffer;
 	segment_writer->write_head = NULL;
+	segment_writer->write_file = NULL;
 	segment_writer->context = stream_state;
 
 	if (!mp4_cbcs_encrypt_move_to_next_frame(stream_state, NULL))
@@ -137,6 +137,15 @@ mp4_cenc_decrypt_start_frame(void* ctx, input_frame_t* frame, read_cache_hint_t*
 		return VOD_BAD_DATA;
 	}
 
+	// validate the whole subsample map of the frame, so that it can be applied without bounds checks
+	if ((size_t)(state->auxiliary_info_end - state->auxiliary_info_pos) <
+		(size_t)state->subsample_count * sizeof(cenc_sample_auxiliary_data_subsample_t))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_cenc_decrypt_start_frame: subsample map overflows the auxiliary info");
+		return VOD_BAD_DATA;
+	}
+
 	read_be16(state->auxiliary_info_pos, state->clear_bytes);
 	read_be32(state->auxiliary_info_pos, state->encrypted_bytes);
 
@@ -167,13 +176,6 @@ mp4_cenc_decrypt_process(
 				return VOD_BAD_DATA;
 			}
 
-			if (state->auxiliary_info_pos + sizeof(cenc_sample_auxiliary_data_subsample_t) > state->auxiliary_info_end)
-			{
-				vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-					"mp4_cenc_decrypt_process: failed to get subsample info from auxiliary info");
-				return VOD_BAD_DATA;
-			}
-
 			read_be16(state->auxiliary_info_pos, state->clear_bytes);
 			read_be32(state->auxiliary_info_pos, state->encrypted_bytes);
 
@@ -218,28 +220,6 @@ mp4_cenc_decrypt_read(void* ctx, u_char** buffer, uint32_t* size, bool_t* frame_
 	uint32_t cur_size;
 	size_t buffer_size;
 
-	// make sure there is some output space
-	if (state->output_pos + MIN_BUFFER_SIZE >= state->output_end)
-	{
-		if (!state->reuse_buffers || state->output_start == NULL)
-		{
-			buffer_size = BUFFER_SIZE;
-			state->output_start = buffer_pool_alloc(
-				state->request_context, 
-				state->request_context->output_buffer_pool, 
-				&buffer_size);
-			if (state->output_start == NULL)
-			{
-				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
-					"mp4_cenc_decrypt_read: vod_alloc failed");
-				return VOD_ALLOC_FAILED;
-			}
-			state->output_end = state->output_start + buffer_size - VOD_BUFFER_PADDING_SIZE;
-		}
-
-		state->output_pos = state->output_start;
-	}
-
 	// make sure there is some input buffer
 	if (state->input_size <= 0)
 	{
@@ -254,6 +234,33 @@ mp4_cenc_decrypt_read(void* ctx, u_char** buffer, uint32_t* size, bool_t* frame_
 		}
 	}
 
+	// make sure there is some output space
+	if (state->reuse_buffers && state->output_start != NULL)
+	{
+		// Note: when buffers are reused, the previous output was already consumed (same as the read cache buffers),
+		//		rewinding when the input does not fit, decrypts the whole input buffer in a single pass
+		if ((uint32_t)(state->output_end - state->output_pos) < state->input_size)
+		{
+			state->output_pos = state->output_start;
+		}
+	}
+	else if (state->output_pos + MIN_BUFFER_SIZE >= state->output_end)
+	{
+		buffer_size = BUFFER_SIZE;
+		state->output_start = buffer_pool_alloc(
+			state->request_context, 
+			state->request_context->output_buffer_pool, 
+			&buffer_size);
+		if (state->output_start == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mp4_cenc_decrypt_read: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+		state->output_end = state->output_start + buffer_size - VOD_BUFFER_PADDING_SIZE;
+		state->output_pos = state->output_start;
+	}
+
 	// process the min of input size and output size
 	cur_size = state->output_end - state->output_pos;
 	cur_size = vod_min(cur_size, state->input_size);
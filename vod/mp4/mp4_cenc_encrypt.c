@@ -863,6 +863,7 @@ mp4_cenc_encrypt_video_get_fragment_writer(
 	}
 
 	segment_writer->write_head = NULL;
+	segment_writer->write_file = NULL;
 	segment_writer->context = state;
 
 	return VOD_OK;
@@ -996,6 +997,7 @@ mp4_cenc_encrypt_audio_get_fragment_writer(
 
 	segment_writer->write_tail = mp4_cenc_encrypt_audio_write_buffer;
 	segment_writer->write_head = NULL;
+	segment_writer->write_file = NULL;
 	segment_writer->context = state;
 
 	if (!mp4_cenc_encrypt_move_to_next_frame(state, NULL))
@@ -10,11 +10,13 @@ mp4_cenc_passthrough_init(mp4_cenc_passthrough_context_t* context, media_sequenc
 	media_clip_filtered_t* cur_clip;
 	media_track_t* first_track = sequence->filtered_clips[0].first_track;
 	media_track_t* cur_track;
+	uint32_t frame_count;
 
 	context->default_auxiliary_sample_size = first_track->encryption_info.default_auxiliary_sample_size;
 	context->use_subsamples = first_track->encryption_info.use_subsamples;
 	context->saiz_atom_size = ATOM_HEADER_SIZE + sizeof(saiz_atom_t);
 	context->auxiliary_info_size = 0;
+	frame_count = 0;
 
 	for (cur_clip = sequence->filtered_clips; cur_clip < sequence->filtered_clips_end; cur_clip++)
 	{
@@ -30,22 +32,29 @@ mp4_cenc_passthrough_init(mp4_cenc_passthrough_context_t* context, media_sequenc
 			return FALSE;
 		}
 
-		// do not passthrough in case multiple tracks have different encryption parameters
-		if (cur_track->encryption_info.default_auxiliary_sample_size != context->default_auxiliary_sample_size ||
-			cur_track->encryption_info.use_subsamples != context->use_subsamples)
+		// do not passthrough in case multiple tracks have different subsample settings, the senc flags apply to all samples
+		if (cur_track->encryption_info.use_subsamples != context->use_subsamples)
 		{
 			return FALSE;
 		}
 
-		// update sizes
-		if (context->default_auxiliary_sample_size == 0)
+		// tracks with different default sizes are written with explicit per sample sizes
+		if (cur_track->encryption_info.default_auxiliary_sample_size != context->default_auxiliary_sample_size)
 		{
-			context->saiz_atom_size += cur_track->frame_count;
+			context->default_auxiliary_sample_size = 0;
 		}
 
+		// update sizes
+		frame_count += cur_track->frame_count;
+
 		context->auxiliary_info_size += cur_track->encryption_info.auxiliary_info_end - cur_track->encryption_info.auxiliary_info;
 	}
 
+	if (context->default_auxiliary_sample_size == 0)
+	{
+		context->saiz_atom_size += frame_count;
+	}
+
 	context->sequence = sequence;
 	context->saio_atom_size = ATOM_HEADER_SIZE + sizeof(saio_atom_t);
 	context->total_size = context->saiz_atom_size + context->saio_atom_size + context->auxiliary_info_size;
@@ -83,6 +92,13 @@ mp4_cenc_passthrough_write_saiz_saio(
 		for (cur_clip = sequence->filtered_clips; cur_clip < sequence->filtered_clips_end; cur_clip++)
 		{
 			cur_track = cur_clip->first_track;
+			if (cur_track->encryption_info.default_auxiliary_sample_size != 0)
+			{
+				vod_memset(p, cur_track->encryption_info.default_auxiliary_sample_size, cur_track->frame_count);
+				p += cur_track->frame_count;
+				continue;
+			}
+
 			p = vod_copy(p,
 				cur_track->encryption_info.auxiliary_sample_sizes,
 				cur_track->frame_count);
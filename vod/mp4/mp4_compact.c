@@ -0,0 +1,363 @@
+#include "mp4_compact.h"
+#include "mp4_format.h"
+#include "mp4_parser_base.h"
+#include "mp4_write_stream.h"
+#include "../read_stream.h"
+
+/*
+	Compacts the moov atom before it is saved to the metadata cache.
+
+	The output is a valid moov atom that is parsed by the regular mp4 parser, the sample tables
+	are rewritten losslessly, to their smallest standard representation -
+	1. stts / ctts - adjacent entries with the same duration / offset are merged
+	2. stsc - entries that have the same samples per chunk and sample description as the previous entry are removed
+	3. stsz - a table in which all the samples have the same size is replaced by a uniform size
+	4. co64 - converted to stco when all the offsets fit in 32 bit
+	All other atoms are copied as is.
+*/
+
+// typedefs
+typedef struct {
+	request_context_t* request_context;
+	u_char* p;
+} mp4_compact_context_t;
+
+// implementation
+static u_char*
+mp4_compact_write_header(u_char* p, atom_info_t* atom_info, atom_name_t name, uint64_t size)
+{
+	u_char* name_ptr = (u_char*)&name;
+
+	if (atom_info->header_size == ATOM_HEADER64_SIZE)
+	{
+		write_atom_header64(p, size + ATOM_HEADER64_SIZE, name_ptr[0], name_ptr[1], name_ptr[2], name_ptr[3]);
+	}
+	else
+	{
+		write_atom_header(p, size + ATOM_HEADER_SIZE, name_ptr[0], name_ptr[1], name_ptr[2], name_ptr[3]);
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_compact_copy_atom(u_char* p, atom_info_t* atom_info)
+{
+	p = mp4_compact_write_header(p, atom_info, atom_info->name, atom_info->size);
+	return vod_copy(p, atom_info->ptr, atom_info->size);
+}
+
+// stts & ctts have the same structure
+static u_char*
+mp4_compact_stts_atom(u_char* p, atom_info_t* atom_info)
+{
+	const stts_atom_t* atom = (const stts_atom_t*)atom_info->ptr;
+	const stts_entry_t* cur_entry;
+	const stts_entry_t* last_entry;
+	stts_entry_t* output_entry;
+	uint32_t entries;
+	uint32_t count;
+	u_char* start;
+	u_char* q;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	entries = parse_be32(atom->entries);
+	if (entries <= 1 || entries > (atom_info->size - sizeof(*atom)) / sizeof(*cur_entry))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	cur_entry = (const stts_entry_t*)(atom + 1);
+	last_entry = cur_entry + entries;
+
+	start = p;
+	p += atom_info->header_size;
+	p = vod_copy(p, atom, sizeof(*atom));
+
+	output_entry = (stts_entry_t*)p;
+	*output_entry = *cur_entry;
+	entries = 1;
+
+	for (cur_entry++; cur_entry < last_entry; cur_entry++)
+	{
+		count = parse_be32(output_entry->count);
+		if (vod_memcmp(cur_entry->duration, output_entry->duration, sizeof(cur_entry->duration)) == 0 &&
+			count <= UINT_MAX - parse_be32(cur_entry->count))
+		{
+			count += parse_be32(cur_entry->count);
+			q = output_entry->count;
+			write_be32(q, count);
+			continue;
+		}
+
+		output_entry++;
+		*output_entry = *cur_entry;
+		entries++;
+	}
+
+	p = (u_char*)(output_entry + 1);
+
+	q = start + atom_info->header_size + offsetof(stts_atom_t, entries);
+	write_be32(q, entries);
+
+	mp4_compact_write_header(start, atom_info, atom_info->name, p - start - atom_info->header_size);
+
+	return p;
+}
+
+static u_char*
+mp4_compact_stsc_atom(u_char* p, atom_info_t* atom_info)
+{
+	const stsc_atom_t* atom = (const stsc_atom_t*)atom_info->ptr;
+	const stsc_entry_t* cur_entry;
+	const stsc_entry_t* last_entry;
+	stsc_entry_t* output_entry;
+	uint32_t entries;
+	u_char* start;
+	u_char* q;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	entries = parse_be32(atom->entries);
+	if (entries <= 1 || entries > (atom_info->size - sizeof(*atom)) / sizeof(*cur_entry))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	cur_entry = (const stsc_entry_t*)(atom + 1);
+	last_entry = cur_entry + entries;
+
+	start = p;
+	p += atom_info->header_size;
+	p = vod_copy(p, atom, sizeof(*atom));
+
+	output_entry = (stsc_entry_t*)p;
+	*output_entry = *cur_entry;
+	entries = 1;
+
+	for (cur_entry++; cur_entry < last_entry; cur_entry++)
+	{
+		if (vod_memcmp(cur_entry->samples_per_chunk, output_entry->samples_per_chunk, sizeof(cur_entry->samples_per_chunk)) == 0 &&
+			vod_memcmp(cur_entry->sample_desc, output_entry->sample_desc, sizeof(cur_entry->sample_desc)) == 0)
+		{
+			continue;
+		}
+
+		output_entry++;
+		*output_entry = *cur_entry;
+		entries++;
+	}
+
+	p = (u_char*)(output_entry + 1);
+
+	q = start + atom_info->header_size + offsetof(stsc_atom_t, entries);
+	write_be32(q, entries);
+
+	mp4_compact_write_header(start, atom_info, atom_info->name, p - start - atom_info->header_size);
+
+	return p;
+}
+
+static u_char*
+mp4_compact_stsz_atom(u_char* p, atom_info_t* atom_info)
+{
+	const stsz_atom_t* atom = (const stsz_atom_t*)atom_info->ptr;
+	const u_char* cur_pos;
+	const u_char* end_pos;
+	uint32_t uniform_size;
+	uint32_t entries;
+	stsz_atom_t* output;
+
+	if (atom_info->name != ATOM_NAME_STSZ || 
+		atom_info->size < sizeof(*atom) || 
+		parse_be32(atom->uniform_size) != 0)
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	entries = parse_be32(atom->entries);
+	if (entries <= 1 || entries > (atom_info->size - sizeof(*atom)) / sizeof(uint32_t))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	cur_pos = (const u_char*)(atom + 1);
+	end_pos = cur_pos + entries * sizeof(uint32_t);
+
+	uniform_size = parse_be32(cur_pos);
+	if (uniform_size == 0 || uniform_size > MAX_FRAME_SIZE)
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	for (cur_pos += sizeof(uint32_t); cur_pos < end_pos; cur_pos += sizeof(uint32_t))
+	{
+		if (parse_be32(cur_pos) != uniform_size)
+		{
+			return mp4_compact_copy_atom(p, atom_info);
+		}
+	}
+
+	p = mp4_compact_write_header(p, atom_info, atom_info->name, sizeof(*output));
+
+	output = (stsz_atom_t*)p;
+	*output = *atom;
+	p = output->uniform_size;
+	write_be32(p, uniform_size);
+
+	return (u_char*)(output + 1);
+}
+
+static u_char*
+mp4_compact_co64_atom(u_char* p, atom_info_t* atom_info)
+{
+	const stco_atom_t* atom = (const stco_atom_t*)atom_info->ptr;
+	const u_char* cur_pos;
+	const u_char* end_pos;
+	uint64_t offset;
+	uint32_t entries;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	entries = parse_be32(atom->entries);
+	if (entries > (atom_info->size - sizeof(*atom)) / sizeof(uint64_t))
+	{
+		return mp4_compact_copy_atom(p, atom_info);
+	}
+
+	cur_pos = (const u_char*)(atom + 1);
+	end_pos = cur_pos + entries * sizeof(uint64_t);
+
+	for (; cur_pos < end_pos; cur_pos += sizeof(uint64_t))
+	{
+		if (parse_be64(cur_pos) > UINT_MAX)
+		{
+			return mp4_compact_copy_atom(p, atom_info);
+		}
+	}
+
+	p = mp4_compact_write_header(p, atom_info, ATOM_NAME_STCO, sizeof(*atom) + entries * sizeof(uint32_t));
+	p = vod_copy(p, atom, sizeof(*atom));
+
+	for (cur_pos = (const u_char*)(atom + 1); cur_pos < end_pos; cur_pos += sizeof(uint64_t))
+	{
+		offset = parse_be64(cur_pos);
+		write_be32(p, offset);
+	}
+
+	return p;
+}
+
+static vod_status_t
+mp4_compact_atoms_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_compact_context_t* context = ctx;
+	vod_status_t rc;
+	u_char* start;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_TRAK:
+	case ATOM_NAME_MDIA:
+	case ATOM_NAME_MINF:
+	case ATOM_NAME_STBL:
+		start = context->p;
+		context->p += atom_info->header_size;
+
+		rc = mp4_parser_parse_atoms(
+			context->request_context,
+			atom_info->ptr,
+			atom_info->size,
+			TRUE,
+			mp4_compact_atoms_callback,
+			context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		mp4_compact_write_header(start, atom_info, atom_info->name, context->p - start - atom_info->header_size);
+		break;
+
+	case ATOM_NAME_STTS:
+	case ATOM_NAME_CTTS:
+		context->p = mp4_compact_stts_atom(context->p, atom_info);
+		break;
+
+	case ATOM_NAME_STSC:
+		context->p = mp4_compact_stsc_atom(context->p, atom_info);
+		break;
+
+	case ATOM_NAME_STSZ:
+		context->p = mp4_compact_stsz_atom(context->p, atom_info);
+		break;
+
+	case ATOM_NAME_CO64:
+		context->p = mp4_compact_co64_atom(context->p, atom_info);
+		break;
+
+	default:
+		context->p = mp4_compact_copy_atom(context->p, atom_info);
+		break;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_compact_metadata(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	mp4_compact_context_t context;
+	vod_str_t* moov = &metadata_parts[MP4_METADATA_PART_MOOV];
+	vod_status_t rc;
+	u_char* buffer;
+
+	// Note: the output is never larger than the input, since atom headers retain their size
+	buffer = vod_alloc(request_context->pool, moov->len);
+	if (buffer == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_compact_metadata: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	context.request_context = request_context;
+	context.p = buffer;
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		moov->data,
+		moov->len,
+		TRUE,
+		mp4_compact_atoms_callback,
+		&context);
+	if (rc != VOD_OK)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_compact_metadata: mp4_parser_parse_atoms failed %i", rc);
+		return rc;
+	}
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_compact_metadata: moov size reduced from %uz to %uz", moov->len, (size_t)(context.p - buffer));
+
+	vod_memcpy(result, metadata_parts, sizeof(result[0]) * metadata_part_count);
+	result[MP4_METADATA_PART_MOOV].data = buffer;
+	result[MP4_METADATA_PART_MOOV].len = context.p - buffer;
+
+	return VOD_OK;
+}
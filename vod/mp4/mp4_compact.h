@@ -0,0 +1,14 @@
+#ifndef __MP4_COMPACT_H__
+#define __MP4_COMPACT_H__
+
+// includes
+#include "../media_format.h"
+
+// functions
+vod_status_t mp4_compact_metadata(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result);
+
+#endif //__MP4_COMPACT_H__
@@ -49,6 +49,12 @@
 #define ATOM_NAME_DCOM (0x6d6f6364)		// data compression
 #define ATOM_NAME_CMVD (0x64766d63)		// compressed movie data
 #define ATOM_NAME_DOPS (0x73704f64)
+#define ATOM_NAME_MVEX (0x7865766d)		// movie extends
+#define ATOM_NAME_TREX (0x78657274)		// track extends
+#define ATOM_NAME_MOOF (0x666f6f6d)		// movie fragment
+#define ATOM_NAME_TRAF (0x66617274)		// track fragment
+#define ATOM_NAME_TFHD (0x64686674)		// track fragment header
+#define ATOM_NAME_TRUN (0x6e757274)		// track fragment run
 
 #define ATOM_NAME_NULL (0x00000000)
 
@@ -433,6 +439,22 @@ typedef struct {
 	u_char track_id[4];
 } tfhd_atom_t;
 
+typedef struct {
+	u_char version[1];
+	u_char flags[3];
+	u_char track_id[4];
+	u_char default_sample_description_index[4];
+	u_char default_sample_duration[4];
+	u_char default_sample_size[4];
+	u_char default_sample_flags[4];
+} trex_atom_t;
+
+typedef struct {
+	u_char version[1];
+	u_char flags[3];
+	u_char sample_count[4];
+} trun_header_atom_t;		// the mandatory fields of the trun atom, trun_atom_t includes the data offset
+
 typedef struct {
 	u_char data_format[4];
 } frma_atom_t;
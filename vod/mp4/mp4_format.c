@@ -1,6 +1,10 @@
 #include "mp4_format.h"
 #include "mp4_parser.h"
 #include "mp4_clipper.h"
+#include "mp4_compact.h"
+#include "mp4_fragmented.h"
+#include "mp4_partial_moov.h"
+#include "mp4_sample_index.h"
 
 // constants
 #define MAX_MOOV_START_READS (4)		// maximum number of attempts to find the moov atom start for non-fast-start files
@@ -9,6 +13,8 @@
 enum {
 	STATE_READ_MOOV_HEADER,
 	STATE_READ_MOOV_DATA,
+	STATE_READ_PARTIAL_MOOV,
+	STATE_READ_FRAGMENTS,
 };
 
 // typedefs
@@ -17,7 +23,14 @@ typedef struct {
 	size_t max_moov_size;
 	int moov_start_reads;
 	int state;
+	void* fragmented_state;
+	media_parse_params_t* partial_parse_params;
+	size_t partial_min_size;
+	void* partial_state;
+	uint64_t moov_file_offset;
 	vod_str_t parts[MP4_METADATA_PART_COUNT];
+	u_char* uncomp_buffer;
+	size_t uncomp_buffer_size;
 } mp4_read_metadata_state_t;
 
 static vod_status_t 
@@ -71,7 +84,10 @@ mp4_metadata_reader_init(
 	state->moov_start_reads = MAX_MOOV_START_READS;
 	state->max_moov_size = max_metadata_size;
 	state->state = STATE_READ_MOOV_HEADER;
+	state->partial_parse_params = NULL;
+	state->partial_min_size = 0;
 	state->parts[MP4_METADATA_PART_FTYP].len = 0;
+	state->uncomp_buffer = NULL;
 	*ctx = state;
 	return VOD_OK;
 }
@@ -87,10 +103,34 @@ mp4_metadata_reader_read(
 	const u_char* ftyp_ptr;
 	size_t ftyp_size;
 	u_char* uncomp_buffer;
+	uint64_t moov_end_offset;
 	off_t moov_offset;
 	size_t moov_size;
 	vod_status_t rc;
 
+	result->partial = FALSE;
+
+	if (state->state == STATE_READ_FRAGMENTS)
+	{
+		rc = mp4_fragmented_read(
+			state->fragmented_state,
+			offset,
+			buffer,
+			&result->read_req,
+			&state->parts[MP4_METADATA_PART_MOOV]);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		goto parts_done;
+	}
+
+	if (state->state == STATE_READ_PARTIAL_MOOV)
+	{
+		goto partial;
+	}
+
 	if (state->state == STATE_READ_MOOV_DATA)
 	{
 		// make sure we got the whole moov atom
@@ -207,6 +247,25 @@ mp4_metadata_reader_read(
 		return VOD_BAD_DATA;
 	}
 
+	if (state->partial_parse_params != NULL && moov_size >= state->partial_min_size)
+	{
+		state->moov_file_offset = offset + moov_offset;
+
+		rc = mp4_partial_moov_init(
+			state->request_context,
+			state->partial_parse_params,
+			state->moov_file_offset,
+			moov_size,
+			&state->partial_state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		state->state = STATE_READ_PARTIAL_MOOV;
+		goto partial;
+	}
+
 	state->state = STATE_READ_MOOV_DATA;
 	result->read_req.read_offset = offset + moov_offset;
 	result->read_req.read_size = moov_size;
@@ -214,8 +273,35 @@ mp4_metadata_reader_read(
 
 	return VOD_AGAIN;
 
+partial:
+
+	rc = mp4_partial_moov_read(
+		state->partial_state,
+		offset,
+		buffer,
+		&result->read_req,
+		&state->parts[MP4_METADATA_PART_MOOV]);
+	switch (rc)
+	{
+	case VOD_OK:
+		result->partial = TRUE;
+		goto parts_done;
+
+	case VOD_NOT_FOUND:
+		// fall back to reading the whole moov atom
+		state->state = STATE_READ_MOOV_DATA;
+		result->read_req.read_offset = state->moov_file_offset;
+		result->read_req.read_size = state->parts[MP4_METADATA_PART_MOOV].len;
+		result->read_req.flags = 0;
+		return VOD_AGAIN;
+
+	default:
+		return rc;
+	}
+
 done:
 
+	moov_end_offset = offset + moov_offset + moov_size;
 	state->parts[MP4_METADATA_PART_MOOV].data = buffer->data + moov_offset;
 
 	// uncompress the moov atom if needed
@@ -225,6 +311,7 @@ done:
 		moov_size,
 		state->max_moov_size,
 		&uncomp_buffer,
+		&state->uncomp_buffer_size,
 		&moov_offset,
 		&moov_size);
 	if (rc != VOD_OK)
@@ -236,16 +323,135 @@ done:
 
 	if (uncomp_buffer != NULL)
 	{
+		state->uncomp_buffer = uncomp_buffer;
 		state->parts[MP4_METADATA_PART_MOOV].data = uncomp_buffer + moov_offset;
 		state->parts[MP4_METADATA_PART_MOOV].len = moov_size;
 	}
 
+	// fragmented files - index the moof atoms that follow the moov
+	rc = mp4_fragmented_init(
+		state->request_context,
+		&state->parts[MP4_METADATA_PART_MOOV],
+		moov_end_offset,
+		state->max_moov_size,
+		&result->read_req,
+		&state->fragmented_state);
+	switch (rc)
+	{
+	case VOD_NOT_FOUND:
+		break;
+
+	case VOD_OK:
+		state->state = STATE_READ_FRAGMENTS;
+		return VOD_AGAIN;
+
+	default:
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_metadata_reader_read: mp4_fragmented_init failed %i", rc);
+		return rc;
+	}
+
+parts_done:
+
 	result->parts = state->parts;
 	result->part_count = MP4_METADATA_PART_COUNT;
 
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_metadata_reader_resume(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	size_t max_metadata_size,
+	void** ctx,
+	media_format_read_request_t* read_req)
+{
+	mp4_read_metadata_state_t* state;
+	vod_str_t* ftyp;
+	vod_status_t rc;
+
+	if (metadata_part_count < MP4_METADATA_PART_COUNT)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	state = vod_alloc(request_context->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_metadata_reader_resume: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->request_context = request_context;
+	state->moov_start_reads = 0;
+	state->max_moov_size = max_metadata_size;
+	state->state = STATE_READ_FRAGMENTS;
+	state->partial_parse_params = NULL;
+	state->partial_min_size = 0;
+	state->uncomp_buffer = NULL;
+
+	// fragmented files - continue the scan of the moof atoms
+	rc = mp4_fragmented_resume(
+		request_context,
+		&metadata_parts[MP4_METADATA_PART_MOOV],
+		max_metadata_size,
+		read_req,
+		&state->fragmented_state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// copy the ftyp atom, the cached metadata is released before the reads complete
+	ftyp = &metadata_parts[MP4_METADATA_PART_FTYP];
+	state->parts[MP4_METADATA_PART_FTYP].len = ftyp->len;
+	if (ftyp->len > 0)
+	{
+		state->parts[MP4_METADATA_PART_FTYP].data = vod_alloc(request_context->pool, ftyp->len);
+		if (state->parts[MP4_METADATA_PART_FTYP].data == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mp4_metadata_reader_resume: vod_alloc failed (2)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		vod_memcpy(state->parts[MP4_METADATA_PART_FTYP].data, ftyp->data, ftyp->len);
+	}
+
+	*ctx = state;
+	return VOD_OK;
+}
+
+static void
+mp4_metadata_reader_free(void* ctx)
+{
+	mp4_read_metadata_state_t* state = ctx;
+
+	if (state->uncomp_buffer == NULL)
+	{
+		return;
+	}
+
+	vod_free(state->request_context->pool, state->uncomp_buffer);
+	vod_request_memory_release(state->request_context, state->uncomp_buffer_size);
+	state->uncomp_buffer = NULL;
+}
+
+void
+mp4_metadata_reader_set_parse_params(
+	void* ctx,
+	media_parse_params_t* parse_params,
+	size_t min_moov_size)
+{
+	mp4_read_metadata_state_t* state = ctx;
+
+	state->partial_parse_params = parse_params;
+	state->partial_min_size = min_moov_size;
+}
+
 media_format_t mp4_format = {
 	FORMAT_ID_MP4,
 	vod_string("mp4"),
@@ -255,4 +461,8 @@ media_format_t mp4_format = {
 	mp4_clipper_build_header,
 	mp4_parser_parse_basic_metadata,
 	mp4_parser_parse_frames,
+	mp4_compact_metadata,
+	mp4_sample_index_build,
+	mp4_metadata_reader_resume,
+	mp4_metadata_reader_free,
 };
@@ -8,10 +8,20 @@
 enum {
 	MP4_METADATA_PART_FTYP,
 	MP4_METADATA_PART_MOOV,
-	MP4_METADATA_PART_COUNT
+	MP4_METADATA_PART_COUNT,
+
+	MP4_METADATA_PART_SAMPLE_INDEX = MP4_METADATA_PART_COUNT,		// optional, added when saving to cache
 };
 
 // globals
 extern media_format_t mp4_format;
 
+// functions
+// enables reading only the trak atoms required by parse_params, when the moov atom is at least min_moov_size.
+//	the metadata returned in this case is flagged as partial and must not be cached
+void mp4_metadata_reader_set_parse_params(
+	void* ctx,
+	media_parse_params_t* parse_params,
+	size_t min_moov_size);
+
 #endif //__MP4_FORMAT_H__
@@ -1,5 +1,33 @@
 #include "mp4_fragment.h"
 #include "mp4_defs.h"
+#include "../input/frames_source_cache.h"
+
+/*
+	The trun entries are written with simd when available, the checks follow read_array.c.
+	A single 16 byte load of an input frame returns size, key_frame, duration and pts_delay, these are
+	reordered and byte swapped to duration, size, flags and pts_delay with a single shuffle.
+*/
+
+#if (VOD_HAVE_SSE41)
+#include <smmintrin.h>
+
+#define mp4_fragment_has_simd() __builtin_cpu_supports("sse4.1")
+
+#define MP4_FRAGMENT_SIMD_ATTR __attribute__((target("sse4.1")))
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define MP4_FRAGMENT_NEON (1)
+
+#define mp4_fragment_has_simd() (1)
+
+#define MP4_FRAGMENT_SIMD_ATTR
+
+#endif
+
+// macros
+#define mp4_fragment_frame_fields(frame) ((const u_char*)(frame) + offsetof(input_frame_t, size))
 
 // content types
 static u_char mp4_video_content_type[] = "video/mp4";
@@ -79,6 +107,178 @@ mp4_fragment_get_trun_atom_size(uint32_t media_type, uint32_t frame_count)
 	return 0;
 }
 
+#if (VOD_HAVE_SSE41)
+
+MP4_FRAGMENT_SIMD_ATTR static u_char*
+mp4_fragment_write_video_trun_entries_simd(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	uint32_t initial_pts_delay,
+	uint32_t key_flags,
+	uint32_t non_key_flags)
+{
+	const __m128i shuffle_mask = _mm_set_epi8(12, 13, 14, 15, 4, 5, 6, 7, 0, 1, 2, 3, 8, 9, 10, 11);
+	const __m128i sub = _mm_set_epi32(initial_pts_delay, 0, 0, 0);
+	const __m128i flags_mask = _mm_set_epi32(0, 0, -1, 0);
+	const __m128i key = _mm_set_epi32(0, 0, key_flags, 0);
+	const __m128i non_key = _mm_set_epi32(0, 0, non_key_flags, 0);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i is_non_key;
+	__m128i v;
+
+	for (; cur_frame < last_frame; cur_frame++, p += sizeof(trun_video_frame_t))
+	{
+		v = _mm_loadu_si128((const __m128i*)mp4_fragment_frame_fields(cur_frame));
+		v = _mm_sub_epi32(v, sub);
+		is_non_key = _mm_cmpeq_epi32(v, zero);
+		v = _mm_or_si128(
+			_mm_andnot_si128(flags_mask, v),
+			_mm_or_si128(_mm_and_si128(is_non_key, non_key), _mm_andnot_si128(is_non_key, key)));
+		_mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(v, shuffle_mask));
+	}
+
+	return p;
+}
+
+MP4_FRAGMENT_SIMD_ATTR static u_char*
+mp4_fragment_write_audio_trun_entries_simd(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame)
+{
+	const __m128i shuffle_mask = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 2, 3, 8, 9, 10, 11);
+	__m128i v;
+
+	for (; cur_frame < last_frame; cur_frame++, p += sizeof(trun_audio_frame_t))
+	{
+		v = _mm_loadu_si128((const __m128i*)mp4_fragment_frame_fields(cur_frame));
+		_mm_storel_epi64((__m128i*)p, _mm_shuffle_epi8(v, shuffle_mask));
+	}
+
+	return p;
+}
+
+#elif (MP4_FRAGMENT_NEON)
+
+static u_char*
+mp4_fragment_write_video_trun_entries_simd(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	uint32_t initial_pts_delay,
+	uint32_t key_flags,
+	uint32_t non_key_flags)
+{
+	static const uint8_t shuffle_indexes[] = { 11, 10, 9, 8, 3, 2, 1, 0, 7, 6, 5, 4, 15, 14, 13, 12 };
+	const uint32_t sub_values[] = { 0, 0, 0, initial_pts_delay };
+	const uint32_t flags_mask_values[] = { 0, 0xffffffff, 0, 0 };
+	const uint32_t key_values[] = { 0, key_flags, 0, 0 };
+	const uint32_t non_key_values[] = { 0, non_key_flags, 0, 0 };
+	uint8x16_t shuffle_mask = vld1q_u8(shuffle_indexes);
+	uint32x4_t sub = vld1q_u32(sub_values);
+	uint32x4_t flags_mask = vld1q_u32(flags_mask_values);
+	uint32x4_t key = vld1q_u32(key_values);
+	uint32x4_t non_key = vld1q_u32(non_key_values);
+	uint32x4_t flags;
+	uint32x4_t v;
+
+	for (; cur_frame < last_frame; cur_frame++, p += sizeof(trun_video_frame_t))
+	{
+		v = vld1q_u32((const uint32_t*)mp4_fragment_frame_fields(cur_frame));
+		v = vsubq_u32(v, sub);
+		flags = vbslq_u32(vceqq_u32(v, vdupq_n_u32(0)), non_key, key);
+		v = vbslq_u32(flags_mask, flags, v);
+		vst1q_u8(p, vqtbl1q_u8(vreinterpretq_u8_u32(v), shuffle_mask));
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_fragment_write_audio_trun_entries_simd(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame)
+{
+	static const uint8_t shuffle_indexes[] = { 11, 10, 9, 8, 3, 2, 1, 0 };
+	uint8x8_t shuffle_mask = vld1_u8(shuffle_indexes);
+
+	for (; cur_frame < last_frame; cur_frame++, p += sizeof(trun_audio_frame_t))
+	{
+		vst1_u8(p, vqtbl1_u8(vld1q_u8(mp4_fragment_frame_fields(cur_frame)), shuffle_mask));
+	}
+
+	return p;
+}
+
+#endif
+
+u_char*
+mp4_fragment_write_video_trun_entries(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	uint32_t initial_pts_delay,
+	uint32_t key_flags,
+	uint32_t non_key_flags)
+{
+	int32_t pts_delay;
+
+#ifdef mp4_fragment_has_simd
+	if (mp4_fragment_has_simd())
+	{
+		return mp4_fragment_write_video_trun_entries_simd(
+			p,
+			cur_frame,
+			last_frame,
+			initial_pts_delay,
+			key_flags,
+			non_key_flags);
+	}
+#endif
+
+	for (; cur_frame < last_frame; cur_frame++)
+	{
+		write_be32(p, cur_frame->duration);
+		write_be32(p, cur_frame->size);
+		if (cur_frame->key_frame)
+		{
+			write_be32(p, key_flags);
+		}
+		else
+		{
+			write_be32(p, non_key_flags);
+		}
+		pts_delay = cur_frame->pts_delay - initial_pts_delay;
+		write_be32(p, pts_delay);
+	}
+
+	return p;
+}
+
+u_char*
+mp4_fragment_write_audio_trun_entries(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame)
+{
+#ifdef mp4_fragment_has_simd
+	if (mp4_fragment_has_simd())
+	{
+		return mp4_fragment_write_audio_trun_entries_simd(p, cur_frame, last_frame);
+	}
+#endif
+
+	for (; cur_frame < last_frame; cur_frame++)
+	{
+		write_be32(p, cur_frame->duration);
+		write_be32(p, cur_frame->size);
+	}
+
+	return p;
+}
+
 u_char*
 mp4_fragment_write_video_trun_atom(
 	u_char* p,
@@ -88,11 +288,8 @@ mp4_fragment_write_video_trun_atom(
 {
 	media_clip_filtered_t* cur_clip;
 	frame_list_part_t* part;
-	input_frame_t* cur_frame;
-	input_frame_t* last_frame;
 	uint32_t initial_pts_delay = 0;
 	uint32_t flags;
-	int32_t pts_delay;
 	size_t atom_size;
 
 	atom_size = ATOM_HEADER_SIZE + sizeof(trun_atom_t) + sequence->total_frame_count * sizeof(trun_video_frame_t);
@@ -110,33 +307,15 @@ mp4_fragment_write_video_trun_atom(
 			initial_pts_delay = cur_clip->first_track->media_info.u.video.initial_pts_delay;
 		}
 
-		part = &cur_clip->first_track->frames;
-		last_frame = part->last_frame;
-		for (cur_frame = part->first_frame;; cur_frame++)
+		for (part = &cur_clip->first_track->frames; part != NULL; part = part->next)
 		{
-			if (cur_frame >= last_frame)
-			{
-				if (part->next == NULL)
-				{
-					break;
-				}
-				part = part->next;
-				cur_frame = part->first_frame;
-				last_frame = part->last_frame;
-			}
-
-			write_be32(p, cur_frame->duration);
-			write_be32(p, cur_frame->size);
-			if (cur_frame->key_frame)
-			{
-				write_be32(p, 0x00000000);
-			}
-			else
-			{
-				write_be32(p, 0x00010000);
-			}
-			pts_delay = cur_frame->pts_delay - initial_pts_delay;
-			write_be32(p, pts_delay);
+			p = mp4_fragment_write_video_trun_entries(
+				p,
+				part->first_frame,
+				part->last_frame,
+				initial_pts_delay,
+				0x00000000,
+				0x00010000);		// non sync sample
 		}
 	}
 	return p;
@@ -150,8 +329,6 @@ mp4_fragment_write_audio_trun_atom(
 {
 	media_clip_filtered_t* cur_clip;
 	frame_list_part_t* part;
-	input_frame_t* cur_frame;
-	input_frame_t* last_frame;
 	size_t atom_size;
 
 	atom_size = ATOM_HEADER_SIZE + sizeof(trun_atom_t) + sequence->total_frame_count * sizeof(trun_audio_frame_t);
@@ -163,23 +340,9 @@ mp4_fragment_write_audio_trun_atom(
 
 	for (cur_clip = sequence->filtered_clips; cur_clip < sequence->filtered_clips_end; cur_clip++)
 	{
-		part = &cur_clip->first_track->frames;
-		last_frame = part->last_frame;
-		for (cur_frame = part->first_frame;; cur_frame++)
+		for (part = &cur_clip->first_track->frames; part != NULL; part = part->next)
 		{
-			if (cur_frame >= last_frame)
-			{
-				if (part->next == NULL)
-				{
-					break;
-				}
-				part = part->next;
-				cur_frame = part->first_frame;
-				last_frame = part->last_frame;
-			}
-
-			write_be32(p, cur_frame->duration);
-			write_be32(p, cur_frame->size);
+			p = mp4_fragment_write_audio_trun_entries(p, part->first_frame, part->last_frame);
 		}
 	}
 	return p;
@@ -227,6 +390,7 @@ mp4_fragment_frame_writer_init(
 	request_context_t* request_context,
 	media_sequence_t* sequence,
 	write_callback_t write_callback,
+	write_file_callback_t write_file_callback,
 	void* write_context, 
 	bool_t reuse_buffers,
 	fragment_writer_state_t** result)
@@ -243,6 +407,7 @@ mp4_fragment_frame_writer_init(
 
 	state->request_context = request_context;
 	state->write_callback = write_callback;
+	state->write_file_callback = reuse_buffers ? NULL : write_file_callback;
 	state->write_context = write_context;
 	state->reuse_buffers = reuse_buffers;
 	state->frame_started = FALSE;
@@ -255,29 +420,94 @@ mp4_fragment_frame_writer_init(
 	return VOD_OK;
 }
 
-static bool_t
-mp4_fragment_move_to_next_frame(fragment_writer_state_t* state)
+static vod_status_t
+mp4_fragment_write_file_frames(fragment_writer_state_t* state)
 {
-	while (state->cur_frame >= state->cur_frame_part.last_frame)
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	void* source;
+	vod_status_t rc;
+
+	source = get_frame_part_source_clip(state->cur_frame_part);
+	cur_frame = state->cur_frame;
+	last_frame = state->cur_frame_part.last_frame;
+
+	start_offset = cur_frame->offset;
+	end_offset = cur_frame->offset + cur_frame->size;
+
+	// write contiguous frames with a single call
+	for (cur_frame++; cur_frame < last_frame; cur_frame++)
 	{
-		if (state->cur_frame_part.next != NULL)
+		if (cur_frame->offset == end_offset &&
+			end_offset + cur_frame->size - start_offset <= UINT_MAX)
 		{
-			state->cur_frame_part = *state->cur_frame_part.next;
-			state->cur_frame = state->cur_frame_part.first_frame;
-			state->first_time = TRUE;
-			break;
+			end_offset += cur_frame->size;
+			continue;
 		}
 
-		state->cur_clip++;
-		if (state->cur_clip >= state->sequence->filtered_clips_end)
+		rc = state->write_file_callback(state->write_context, source, start_offset, end_offset - start_offset);
+		if (rc != VOD_OK)
 		{
-			return FALSE;
+			return rc;
 		}
 
-		mp4_fragment_init_track(state, state->cur_clip->first_track);
+		start_offset = cur_frame->offset;
+		end_offset = cur_frame->offset + cur_frame->size;
 	}
 
-	return TRUE;
+	rc = state->write_file_callback(state->write_context, source, start_offset, end_offset - start_offset);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	state->cur_frame = last_frame;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragment_move_to_next_frame(fragment_writer_state_t* state)
+{
+	vod_status_t rc;
+
+	for (;;)
+	{
+		while (state->cur_frame >= state->cur_frame_part.last_frame)
+		{
+			if (state->cur_frame_part.next != NULL)
+			{
+				state->cur_frame_part = *state->cur_frame_part.next;
+				state->cur_frame = state->cur_frame_part.first_frame;
+				state->first_time = TRUE;
+				break;
+			}
+
+			state->cur_clip++;
+			if (state->cur_clip >= state->sequence->filtered_clips_end)
+			{
+				return VOD_NOT_FOUND;
+			}
+
+			mp4_fragment_init_track(state, state->cur_clip->first_track);
+		}
+
+		if (state->write_file_callback == NULL ||
+			state->cur_frame_part.frames_source != &frames_source_cache ||
+			state->cur_frame >= state->cur_frame_part.last_frame)
+		{
+			return VOD_OK;
+		}
+
+		// the frames are sent as is, no need to read them
+		rc = mp4_fragment_write_file_frames(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
 }
 
 vod_status_t
@@ -293,9 +523,10 @@ mp4_fragment_frame_writer_process(fragment_writer_state_t* state)
 
 	if (!state->frame_started)
 	{
-		if (!mp4_fragment_move_to_next_frame(state))
+		rc = mp4_fragment_move_to_next_frame(state);
+		if (rc != VOD_OK)
 		{
-			return VOD_OK;
+			return rc == VOD_NOT_FOUND ? VOD_OK : rc;
 		}
 
 		rc = state->cur_frame_part.frames_source->start_frame(state->cur_frame_part.frames_source_context, state->cur_frame, NULL);
@@ -398,9 +629,10 @@ mp4_fragment_frame_writer_process(fragment_writer_state_t* state)
 				write_buffer_size = 0;
 			}
 
-			if (!mp4_fragment_move_to_next_frame(state))
+			rc = mp4_fragment_move_to_next_frame(state);
+			if (rc != VOD_OK)
 			{
-				return VOD_OK;
+				return rc == VOD_NOT_FOUND ? VOD_OK : rc;
 			}
 		}
 
@@ -39,6 +39,7 @@ typedef struct {
 typedef struct {
 	request_context_t* request_context;
 	write_callback_t write_callback;
+	write_file_callback_t write_file_callback;
 	void* write_context;
 	bool_t reuse_buffers;
 
@@ -62,6 +63,21 @@ u_char* mp4_fragment_write_tfdt64_atom(u_char* p, uint64_t earliest_pres_time);
 
 size_t mp4_fragment_get_trun_atom_size(uint32_t media_type, uint32_t frame_count);
 
+// writes the duration, size, flags and pts delay of the frames
+u_char* mp4_fragment_write_video_trun_entries(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	uint32_t initial_pts_delay,
+	uint32_t key_flags,
+	uint32_t non_key_flags);
+
+// writes the duration and size of the frames
+u_char* mp4_fragment_write_audio_trun_entries(
+	u_char* p,
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame);
+
 u_char* mp4_fragment_write_video_trun_atom(
 	u_char* p,
 	media_sequence_t* sequence,
@@ -84,6 +100,7 @@ vod_status_t mp4_fragment_frame_writer_init(
 	request_context_t* request_context,
 	media_sequence_t* sequence,
 	write_callback_t write_callback,
+	write_file_callback_t write_file_callback,
 	void* write_context,
 	bool_t reuse_buffers,
 	fragment_writer_state_t** result);
@@ -0,0 +1,1647 @@
+#include "mp4_fragmented.h"
+#include "mp4_parser_base.h"
+#include "mp4_write_stream.h"
+#include "../read_stream.h"
+
+/*
+	Indexes fragmented mp4 files (fmp4 / cmaf).
+
+	The moof atoms that follow the moov atom are scanned, and the samples of their track runs are
+	appended to per track sample tables. Once the whole file was scanned, a moov atom in which the
+	(empty) sample tables are replaced by the generated ones is returned, so that the rest of the
+	pipeline - the parser, the clipper, the metadata cache - handles the file as a progressive mp4.
+	Since the generated moov is saved to the metadata cache, the file is scanned only once, and
+	segment requests read the frames directly from the relevant mdat atoms.
+
+	Only the moof atoms are read, the mdat atoms between them are skipped. Encrypted fragments
+	(senc / saiz in traf) are not supported.
+
+	The generated moov atom keeps the mvex atom, and ends with a private vodf atom that holds the offset
+	of the first atom that was not indexed. The samples of a moof atom are indexed only once the mdat
+	atom that follows it is complete, so that files that are still being written (live ingest) can be
+	indexed as well. When the metadata of such a file is refreshed, the scan resumes from the saved
+	offset - the sample tables of the cached moov atom are extended with the new fragments, instead of
+	scanning the whole file again.
+*/
+
+// constants
+#define TFHD_FLAG_BASE_DATA_OFFSET			(0x000001)
+#define TFHD_FLAG_SAMPLE_DESC_INDEX			(0x000002)
+#define TFHD_FLAG_DEFAULT_SAMPLE_DURATION	(0x000008)
+#define TFHD_FLAG_DEFAULT_SAMPLE_SIZE		(0x000010)
+#define TFHD_FLAG_DEFAULT_SAMPLE_FLAGS		(0x000020)
+#define TFHD_FLAG_DEFAULT_BASE_IS_MOOF		(0x020000)
+
+#define TRUN_FLAG_DATA_OFFSET				(0x000001)
+#define TRUN_FLAG_FIRST_SAMPLE_FLAGS		(0x000004)
+#define TRUN_FLAG_SAMPLE_DURATION			(0x000100)
+#define TRUN_FLAG_SAMPLE_SIZE				(0x000200)
+#define TRUN_FLAG_SAMPLE_FLAGS				(0x000400)
+#define TRUN_FLAG_SAMPLE_PTS_DELAY			(0x000800)
+
+#define SAMPLE_FLAG_NON_SYNC				(0x00010000)
+
+#define ATOM_NAME_VODF (0x66646f76)		// private - the state of the fragments scan
+
+// upper bounds of the size of the generated sample tables
+#define SAMPLE_TABLES_HEADERS_SIZE (6 * (ATOM_HEADER_SIZE + sizeof(stsz_atom_t)))		// stts, ctts, stss, stsz, stsc, co64
+#define SAMPLE_TABLES_SAMPLE_SIZE (sizeof(stts_entry_t) + sizeof(ctts_entry_t) + 2 * sizeof(uint32_t))	// stts, ctts, stss, stsz
+#define SAMPLE_TABLES_CHUNK_SIZE (sizeof(stsc_entry_t) + sizeof(uint64_t))		// stsc, co64
+#define SAMPLE_TABLES_PREV_SAMPLE_SIZE (2 * sizeof(uint32_t))		// generated stss, expanded uniform stsz
+#define SAMPLE_TABLES_PREV_CHUNK_SIZE (sizeof(uint32_t))			// stco converted to co64
+
+// typedefs
+typedef struct {
+	u_char	version[1];
+	u_char	flags[3];
+	u_char	scan_offset[8];
+} vodf_atom_t;
+
+typedef struct {
+	const u_char* entries;		// null when the table does not exist
+	uint32_t count;
+} mp4_fragmented_table_t;
+
+typedef struct {
+	uint32_t duration;
+	uint32_t size;
+	uint32_t pts_delay;
+	uint32_t is_key;
+} mp4_fragmented_sample_t;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t sample_count;
+	uint32_t sample_desc;
+} mp4_fragmented_chunk_t;
+
+typedef struct {
+	uint32_t track_id;
+	uint32_t default_sample_desc;
+	uint32_t default_duration;
+	uint32_t default_size;
+	uint32_t default_flags;
+
+	// the sample tables of the moov atom, non-empty when resuming a previous scan
+	mp4_fragmented_table_t stts;
+	mp4_fragmented_table_t ctts;
+	mp4_fragmented_table_t stss;
+	mp4_fragmented_table_t stsz;
+	mp4_fragmented_table_t stsc;
+	mp4_fragmented_table_t stco;
+	uint32_t uniform_size;
+	bool_t co64;
+	uint64_t prev_duration;
+
+	// the new fragments
+	vod_array_t samples;		// mp4_fragmented_sample_t
+	vod_array_t chunks;			// mp4_fragmented_chunk_t
+	uint64_t duration;
+	uint32_t key_frame_count;
+	bool_t has_pts_delay;
+
+	// the state following the last complete fragment
+	vod_uint_t committed_samples;
+	vod_uint_t committed_chunks;
+	uint64_t committed_duration;
+	uint32_t committed_key_frame_count;
+} mp4_fragmented_track_t;
+
+typedef struct {
+	request_context_t* request_context;
+	vod_str_t moov;
+	size_t max_moov_size;
+	vod_array_t tracks;			// mp4_fragmented_track_t
+	size_t sample_tables_size;
+	size_t committed_tables_size;
+	uint64_t committed_offset;	// the offset of the first atom that was not indexed
+	uint32_t skipped_atom_name;
+	bool_t moof_pending;		// a moof atom was parsed, and the mdat atom that follows it was not reached yet
+	bool_t skip_read;			// the last read starts at the last byte of a skipped atom
+	bool_t moof_read;			// the last read was issued in order to read a whole moof atom
+} mp4_fragmented_state_t;
+
+typedef struct {
+	atom_info_t mvex;
+	atom_info_t vodf;
+	uint32_t trak_count;
+} mp4_fragmented_moov_info_t;
+
+typedef struct {
+	mp4_fragmented_state_t* state;
+	mp4_fragmented_track_t* track;
+} mp4_fragmented_index_context_t;
+
+typedef struct {
+	mp4_fragmented_state_t* state;
+	uint64_t moof_offset;
+	uint64_t data_end;			// the end offset of the data of the previous traf
+
+	// traf state
+	bool_t tfhd_found;
+	mp4_fragmented_track_t* track;
+	uint64_t next_data_offset;
+	uint64_t base_data_offset;
+	uint32_t sample_desc;
+	uint32_t default_duration;
+	uint32_t default_size;
+	uint32_t default_flags;
+} mp4_fragmented_moof_context_t;
+
+typedef struct {
+	request_context_t* request_context;
+	mp4_fragmented_state_t* state;
+	mp4_fragmented_track_t* track;
+	u_char* p;
+} mp4_fragmented_write_context_t;
+
+// implementation
+static mp4_fragmented_track_t*
+mp4_fragmented_get_track(mp4_fragmented_state_t* state, uint32_t track_id)
+{
+	mp4_fragmented_track_t* cur_track;
+	mp4_fragmented_track_t* last_track;
+
+	cur_track = state->tracks.elts;
+	last_track = cur_track + state->tracks.nelts;
+	for (; cur_track < last_track; cur_track++)
+	{
+		if (cur_track->track_id == track_id)
+		{
+			return cur_track;
+		}
+	}
+
+	return NULL;
+}
+
+static mp4_fragmented_track_t*
+mp4_fragmented_get_tkhd_track(mp4_fragmented_state_t* state, atom_info_t* atom_info)
+{
+	const tkhd_atom_t* atom = (const tkhd_atom_t*)atom_info->ptr;
+	const tkhd64_atom_t* atom64 = (const tkhd64_atom_t*)atom_info->ptr;
+
+	if (atom_info->size < sizeof(atom->version))
+	{
+		return NULL;
+	}
+
+	if (atom->version[0] == 1)
+	{
+		if (atom_info->size >= offsetof(tkhd64_atom_t, track_id) + sizeof(atom64->track_id))
+		{
+			return mp4_fragmented_get_track(state, parse_be32(atom64->track_id));
+		}
+	}
+	else
+	{
+		if (atom_info->size >= offsetof(tkhd_atom_t, track_id) + sizeof(atom->track_id))
+		{
+			return mp4_fragmented_get_track(state, parse_be32(atom->track_id));
+		}
+	}
+
+	return NULL;
+}
+
+static vod_status_t
+mp4_fragmented_moov_info_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_moov_info_t* moov_info = ctx;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_MVEX:
+		moov_info->mvex = *atom_info;
+		break;
+
+	case ATOM_NAME_VODF:
+		moov_info->vodf = *atom_info;
+		break;
+
+	case ATOM_NAME_TRAK:
+		moov_info->trak_count++;
+		break;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_trex_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_state_t* state = ctx;
+	mp4_fragmented_track_t* track;
+	const trex_atom_t* atom = (const trex_atom_t*)atom_info->ptr;
+	request_context_t* request_context = state->request_context;
+
+	if (atom_info->name != ATOM_NAME_TREX)
+	{
+		return VOD_OK;
+	}
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_trex_callback: atom size %uL too small", atom_info->size);
+		return VOD_BAD_DATA;
+	}
+
+	track = vod_array_push(&state->tracks);
+	if (track == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_trex_callback: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(track, sizeof(*track));
+
+	if (vod_array_init(&track->samples, request_context->pool, 64, sizeof(mp4_fragmented_sample_t)) != VOD_OK ||
+		vod_array_init(&track->chunks, request_context->pool, 16, sizeof(mp4_fragmented_chunk_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_trex_callback: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	track->track_id = parse_be32(atom->track_id);
+	track->default_sample_desc = parse_be32(atom->default_sample_description_index);
+	track->default_duration = parse_be32(atom->default_sample_duration);
+	track->default_size = parse_be32(atom->default_sample_size);
+	track->default_flags = parse_be32(atom->default_sample_flags);
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_parse_table(
+	request_context_t* request_context,
+	atom_info_t* atom_info,
+	size_t header_size,
+	size_t entry_size,
+	mp4_fragmented_table_t* table)
+{
+	uint32_t count;
+
+	if (atom_info->size < header_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_parse_table: atom size %uL too small", atom_info->size);
+		return VOD_BAD_DATA;
+	}
+
+	// Note: in all the sample tables, the entry count is the last field of the header
+	count = parse_be32(atom_info->ptr + header_size - sizeof(uint32_t));
+	if (entry_size > 0 && count > (atom_info->size - header_size) / entry_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_parse_table: atom size %uL too small to hold %uD entries", atom_info->size, count);
+		return VOD_BAD_DATA;
+	}
+
+	table->entries = atom_info->ptr + header_size;
+	table->count = count;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_index_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_index_context_t* context = ctx;
+	mp4_fragmented_track_t* track = context->track;
+	request_context_t* request_context = context->state->request_context;
+	const stz2_atom_t* stz2;
+	const stsz_atom_t* stsz;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_TRAK:
+		context->track = NULL;
+		// fall through
+
+	case ATOM_NAME_MDIA:
+	case ATOM_NAME_MINF:
+	case ATOM_NAME_STBL:
+		return mp4_parser_parse_atoms(
+			request_context,
+			atom_info->ptr,
+			atom_info->size,
+			TRUE,
+			mp4_fragmented_index_callback,
+			context);
+
+	case ATOM_NAME_TKHD:
+		context->track = mp4_fragmented_get_tkhd_track(context->state, atom_info);
+		return VOD_OK;
+	}
+
+	if (track == NULL)
+	{
+		return VOD_OK;
+	}
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_STTS:
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(stts_atom_t), sizeof(stts_entry_t), &track->stts);
+
+	case ATOM_NAME_CTTS:
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(ctts_atom_t), sizeof(ctts_entry_t), &track->ctts);
+
+	case ATOM_NAME_STSS:
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(stss_atom_t), sizeof(uint32_t), &track->stss);
+
+	case ATOM_NAME_STSC:
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(stsc_atom_t), sizeof(stsc_entry_t), &track->stsc);
+
+	case ATOM_NAME_STCO:
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(stco_atom_t), sizeof(uint32_t), &track->stco);
+
+	case ATOM_NAME_CO64:
+		track->co64 = TRUE;
+		return mp4_fragmented_parse_table(request_context, atom_info, sizeof(stco_atom_t), sizeof(uint64_t), &track->stco);
+
+	case ATOM_NAME_STSZ:
+		if (atom_info->size < sizeof(*stsz))
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"mp4_fragmented_index_callback: stsz atom size %uL too small", atom_info->size);
+			return VOD_BAD_DATA;
+		}
+
+		stsz = (const stsz_atom_t*)atom_info->ptr;
+		track->uniform_size = parse_be32(stsz->uniform_size);
+
+		return mp4_fragmented_parse_table(
+			request_context,
+			atom_info,
+			sizeof(stsz_atom_t),
+			track->uniform_size != 0 ? 0 : sizeof(uint32_t),
+			&track->stsz);
+
+	case ATOM_NAME_STZ2:
+		stz2 = (const stz2_atom_t*)atom_info->ptr;
+		if (atom_info->size >= sizeof(*stz2) && parse_be32(stz2->entries) == 0)
+		{
+			return VOD_OK;
+		}
+
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_index_callback: stz2 atoms are not supported in fragmented files");
+		return VOD_BAD_DATA;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_init_track(mp4_fragmented_state_t* state, mp4_fragmented_track_t* track)
+{
+	const stts_entry_t* cur_entry;
+	const stts_entry_t* last_entry;
+	uint64_t sample_count = 0;
+	uint32_t count;
+
+	// get the duration of the samples that were indexed in a previous scan
+	cur_entry = (const stts_entry_t*)track->stts.entries;
+	last_entry = cur_entry + track->stts.count;
+	for (; cur_entry < last_entry; cur_entry++)
+	{
+		count = parse_be32(cur_entry->count);
+		sample_count += count;
+		track->prev_duration += (uint64_t)count * parse_be32(cur_entry->duration);
+	}
+
+	if (track->stsz.count > state->max_moov_size / SAMPLE_TABLES_PREV_SAMPLE_SIZE)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_fragmented_init_track: sample count %uD exceeds the max moov size %uz", track->stsz.count, state->max_moov_size);
+		return VOD_BAD_DATA;
+	}
+
+	if (sample_count != track->stsz.count)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_fragmented_init_track: stts sample count %uL different than stsz sample count %uD",
+			sample_count, track->stsz.count);
+		return VOD_BAD_DATA;
+	}
+
+	state->sample_tables_size +=
+		track->stsz.count * SAMPLE_TABLES_PREV_SAMPLE_SIZE +
+		track->stco.count * SAMPLE_TABLES_PREV_CHUNK_SIZE +
+		sizeof(ctts_entry_t);
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_init_state(
+	request_context_t* request_context,
+	vod_str_t* moov,
+	mp4_fragmented_moov_info_t* moov_info,
+	uint64_t scan_offset,
+	size_t max_moov_size,
+	media_format_read_request_t* read_req,
+	void** result)
+{
+	mp4_fragmented_index_context_t index_context;
+	mp4_fragmented_state_t* state;
+	mp4_fragmented_track_t* cur_track;
+	mp4_fragmented_track_t* last_track;
+	vod_status_t rc;
+
+	state = vod_alloc(request_context->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_init_state: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->request_context = request_context;
+	state->max_moov_size = max_moov_size;
+	state->sample_tables_size = moov_info->trak_count * SAMPLE_TABLES_HEADERS_SIZE +
+		ATOM_HEADER_SIZE + sizeof(vodf_atom_t);
+	state->committed_offset = scan_offset;
+	state->moof_pending = FALSE;
+	state->skip_read = FALSE;
+	state->moof_read = FALSE;
+
+	if (vod_array_init(&state->tracks, request_context->pool, 2, sizeof(mp4_fragmented_track_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_init_state: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		moov_info->mvex.ptr,
+		moov_info->mvex.size,
+		TRUE,
+		mp4_fragmented_trex_callback,
+		state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (state->tracks.nelts <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_init_state: mvex atom does not contain any trex atoms");
+		return VOD_BAD_DATA;
+	}
+
+	// copy the moov atom, since the read buffer is replaced on the following reads
+	state->moov.data = vod_alloc(request_context->pool, moov->len);
+	if (state->moov.data == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_init_state: vod_alloc failed (2)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memcpy(state->moov.data, moov->data, moov->len);
+	state->moov.len = moov->len;
+
+	// find the sample tables of the tracks
+	index_context.state = state;
+	index_context.track = NULL;
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		state->moov.data,
+		state->moov.len,
+		TRUE,
+		mp4_fragmented_index_callback,
+		&index_context);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	cur_track = state->tracks.elts;
+	last_track = cur_track + state->tracks.nelts;
+	for (; cur_track < last_track; cur_track++)
+	{
+		rc = mp4_fragmented_init_track(state, cur_track);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	if (state->moov.len + state->sample_tables_size > max_moov_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_init_state: the fragment index exceeds the max moov size %uz", max_moov_size);
+		return VOD_BAD_DATA;
+	}
+
+	state->committed_tables_size = state->sample_tables_size;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_fragmented_init_state: scanning the fragments of %ui tracks from offset %uL",
+		state->tracks.nelts, scan_offset);
+
+	read_req->read_offset = scan_offset;
+	read_req->read_size = 0;
+	read_req->flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+
+	*result = state;
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_fragmented_init(
+	request_context_t* request_context,
+	vod_str_t* moov,
+	uint64_t moov_end_offset,
+	size_t max_moov_size,
+	media_format_read_request_t* read_req,
+	void** result)
+{
+	mp4_fragmented_moov_info_t moov_info;
+	vod_status_t rc;
+
+	vod_memzero(&moov_info, sizeof(moov_info));
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		moov->data,
+		moov->len,
+		TRUE,
+		mp4_fragmented_moov_info_callback,
+		&moov_info);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (moov_info.mvex.ptr == NULL)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	return mp4_fragmented_init_state(
+		request_context,
+		moov,
+		&moov_info,
+		moov_end_offset,
+		max_moov_size,
+		read_req,
+		result);
+}
+
+vod_status_t
+mp4_fragmented_resume(
+	request_context_t* request_context,
+	vod_str_t* moov,
+	size_t max_moov_size,
+	media_format_read_request_t* read_req,
+	void** result)
+{
+	mp4_fragmented_moov_info_t moov_info;
+	const vodf_atom_t* vodf;
+	vod_status_t rc;
+
+	vod_memzero(&moov_info, sizeof(moov_info));
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		moov->data,
+		moov->len,
+		TRUE,
+		mp4_fragmented_moov_info_callback,
+		&moov_info);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (moov_info.mvex.ptr == NULL || moov_info.vodf.ptr == NULL)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	if (moov_info.vodf.size < sizeof(*vodf))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_fragmented_resume: vodf atom size %uL too small", moov_info.vodf.size);
+		return VOD_BAD_DATA;
+	}
+
+	vodf = (const vodf_atom_t*)moov_info.vodf.ptr;
+
+	return mp4_fragmented_init_state(
+		request_context,
+		moov,
+		&moov_info,
+		parse_be64(vodf->scan_offset),
+		max_moov_size,
+		read_req,
+		result);
+}
+
+static vod_status_t
+mp4_fragmented_parse_tfhd_atom(mp4_fragmented_moof_context_t* context, atom_info_t* atom_info)
+{
+	const tfhd_atom_t* atom = (const tfhd_atom_t*)atom_info->ptr;
+	mp4_fragmented_track_t* track;
+	const u_char* cur_pos;
+	uint32_t flags;
+	size_t atom_size;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		vod_log_error(VOD_LOG_ERR, context->state->request_context->log, 0,
+			"mp4_fragmented_parse_tfhd_atom: atom size %uL too small (1)", atom_info->size);
+		return VOD_BAD_DATA;
+	}
+
+	flags = parse_be32(atom->version) & 0xffffff;
+
+	atom_size = sizeof(*atom);
+	if ((flags & TFHD_FLAG_BASE_DATA_OFFSET) != 0)
+	{
+		atom_size += sizeof(uint64_t);
+	}
+
+	if ((flags & TFHD_FLAG_SAMPLE_DESC_INDEX) != 0)
+	{
+		atom_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_DURATION) != 0)
+	{
+		atom_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_SIZE) != 0)
+	{
+		atom_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_FLAGS) != 0)
+	{
+		atom_size += sizeof(uint32_t);
+	}
+
+	if (atom_info->size < atom_size)
+	{
+		vod_log_error(VOD_LOG_ERR, context->state->request_context->log, 0,
+			"mp4_fragmented_parse_tfhd_atom: atom size %uL too small (2)", atom_info->size);
+		return VOD_BAD_DATA;
+	}
+
+	context->tfhd_found = TRUE;
+
+	track = mp4_fragmented_get_track(context->state, parse_be32(atom->track_id));
+	if (track == NULL)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, context->state->request_context->log, 0,
+			"mp4_fragmented_parse_tfhd_atom: ignoring fragment of unknown track %uD", parse_be32(atom->track_id));
+		return VOD_OK;
+	}
+
+	context->track = track;
+
+	cur_pos = (const u_char*)(atom + 1);
+
+	if ((flags & TFHD_FLAG_BASE_DATA_OFFSET) != 0)
+	{
+		read_be64(cur_pos, context->base_data_offset);
+	}
+	else if ((flags & TFHD_FLAG_DEFAULT_BASE_IS_MOOF) != 0)
+	{
+		context->base_data_offset = context->moof_offset;
+	}
+	else
+	{
+		context->base_data_offset = context->data_end;
+	}
+
+	context->next_data_offset = context->base_data_offset;
+
+	context->sample_desc = track->default_sample_desc;
+	context->default_duration = track->default_duration;
+	context->default_size = track->default_size;
+	context->default_flags = track->default_flags;
+
+	if ((flags & TFHD_FLAG_SAMPLE_DESC_INDEX) != 0)
+	{
+		read_be32(cur_pos, context->sample_desc);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_DURATION) != 0)
+	{
+		read_be32(cur_pos, context->default_duration);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_SIZE) != 0)
+	{
+		read_be32(cur_pos, context->default_size);
+	}
+
+	if ((flags & TFHD_FLAG_DEFAULT_SAMPLE_FLAGS) != 0)
+	{
+		read_be32(cur_pos, context->default_flags);
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_parse_trun_atom(mp4_fragmented_moof_context_t* context, atom_info_t* atom_info)
+{
+	const trun_header_atom_t* atom = (const trun_header_atom_t*)atom_info->ptr;
+	mp4_fragmented_sample_t* cur_sample;
+	mp4_fragmented_sample_t* last_sample;
+	mp4_fragmented_state_t* state = context->state;
+	mp4_fragmented_track_t* track = context->track;
+	mp4_fragmented_chunk_t* chunk;
+	const u_char* cur_pos;
+	uint64_t chunk_size;
+	uint32_t first_sample_flags;
+	uint32_t sample_count;
+	uint32_t sample_flags;
+	uint32_t data_offset;
+	uint32_t flags;
+	size_t header_size;
+	size_t sample_size;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_fragmented_parse_trun_atom: atom size %uL too small", atom_info->size);
+		return VOD_BAD_DATA;
+	}
+
+	flags = parse_be32(atom->version) & 0xffffff;
+	sample_count = parse_be32(atom->sample_count);
+
+	header_size = sizeof(*atom);
+	if ((flags & TRUN_FLAG_DATA_OFFSET) != 0)
+	{
+		header_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TRUN_FLAG_FIRST_SAMPLE_FLAGS) != 0)
+	{
+		header_size += sizeof(uint32_t);
+	}
+
+	sample_size = 0;
+	if ((flags & TRUN_FLAG_SAMPLE_DURATION) != 0)
+	{
+		sample_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TRUN_FLAG_SAMPLE_SIZE) != 0)
+	{
+		sample_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TRUN_FLAG_SAMPLE_FLAGS) != 0)
+	{
+		sample_size += sizeof(uint32_t);
+	}
+
+	if ((flags & TRUN_FLAG_SAMPLE_PTS_DELAY) != 0)
+	{
+		sample_size += sizeof(uint32_t);
+	}
+
+	if (atom_info->size < header_size ||
+		(sample_size > 0 && sample_count > (atom_info->size - header_size) / sample_size))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_fragmented_parse_trun_atom: atom size %uL too small to hold %uD samples", atom_info->size, sample_count);
+		return VOD_BAD_DATA;
+	}
+
+	if (sample_count <= 0)
+	{
+		return VOD_OK;
+	}
+
+	// validate the size of the generated moov atom
+	if (state->sample_tables_size > state->max_moov_size ||
+		sample_count > (state->max_moov_size - state->sample_tables_size) / SAMPLE_TABLES_SAMPLE_SIZE)
+	{
+		goto moov_too_big;
+	}
+
+	state->sample_tables_size += sample_count * SAMPLE_TABLES_SAMPLE_SIZE + SAMPLE_TABLES_CHUNK_SIZE;
+	if (state->moov.len + state->sample_tables_size > state->max_moov_size)
+	{
+		goto moov_too_big;
+	}
+
+	cur_pos = (const u_char*)(atom + 1);
+
+	chunk = vod_array_push(&track->chunks);
+	if (chunk == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_fragmented_parse_trun_atom: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	if ((flags & TRUN_FLAG_DATA_OFFSET) != 0)
+	{
+		read_be32(cur_pos, data_offset);
+		chunk->offset = context->base_data_offset + (int32_t)data_offset;
+	}
+	else
+	{
+		chunk->offset = context->next_data_offset;
+	}
+
+	chunk->sample_count = sample_count;
+	chunk->sample_desc = context->sample_desc;
+
+	first_sample_flags = context->default_flags;
+	if ((flags & TRUN_FLAG_FIRST_SAMPLE_FLAGS) != 0)
+	{
+		read_be32(cur_pos, first_sample_flags);
+	}
+
+	cur_sample = vod_array_push_n(&track->samples, sample_count);
+	if (cur_sample == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_fragmented_parse_trun_atom: vod_array_push_n failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	last_sample = cur_sample + sample_count;
+	sample_flags = first_sample_flags;
+	chunk_size = 0;
+
+	for (; cur_sample < last_sample; cur_sample++)
+	{
+		cur_sample->duration = context->default_duration;
+		if ((flags & TRUN_FLAG_SAMPLE_DURATION) != 0)
+		{
+			read_be32(cur_pos, cur_sample->duration);
+		}
+
+		cur_sample->size = context->default_size;
+		if ((flags & TRUN_FLAG_SAMPLE_SIZE) != 0)
+		{
+			read_be32(cur_pos, cur_sample->size);
+		}
+
+		if ((flags & TRUN_FLAG_SAMPLE_FLAGS) != 0)
+		{
+			read_be32(cur_pos, sample_flags);
+		}
+
+		cur_sample->pts_delay = 0;
+		if ((flags & TRUN_FLAG_SAMPLE_PTS_DELAY) != 0)
+		{
+			read_be32(cur_pos, cur_sample->pts_delay);
+		}
+
+		cur_sample->is_key = (sample_flags & SAMPLE_FLAG_NON_SYNC) == 0;
+		sample_flags = context->default_flags;
+
+		track->duration += cur_sample->duration;
+		track->key_frame_count += cur_sample->is_key;
+		if (cur_sample->pts_delay != 0)
+		{
+			track->has_pts_delay = TRUE;
+		}
+
+		chunk_size += cur_sample->size;
+	}
+
+	context->next_data_offset = chunk->offset + chunk_size;
+	context->data_end = context->next_data_offset;
+
+	return VOD_OK;
+
+moov_too_big:
+
+	vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+		"mp4_fragmented_parse_trun_atom: the fragment index exceeds the max moov size %uz", state->max_moov_size);
+	return VOD_BAD_DATA;
+}
+
+static vod_status_t
+mp4_fragmented_traf_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_moof_context_t* context = ctx;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_TFHD:
+		return mp4_fragmented_parse_tfhd_atom(context, atom_info);
+
+	case ATOM_NAME_TRUN:
+		if (!context->tfhd_found)
+		{
+			vod_log_error(VOD_LOG_ERR, context->state->request_context->log, 0,
+				"mp4_fragmented_traf_callback: trun atom is not preceded by a tfhd atom");
+			return VOD_BAD_DATA;
+		}
+
+		if (context->track == NULL)
+		{
+			return VOD_OK;
+		}
+
+		return mp4_fragmented_parse_trun_atom(context, atom_info);
+
+	case ATOM_NAME_SAIZ:
+	case ATOM_NAME_SENC:
+		if (context->track == NULL)
+		{
+			return VOD_OK;
+		}
+
+		vod_log_error(VOD_LOG_ERR, context->state->request_context->log, 0,
+			"mp4_fragmented_traf_callback: encrypted fragments are not supported");
+		return VOD_BAD_DATA;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_moof_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_moof_context_t* context = ctx;
+
+	if (atom_info->name != ATOM_NAME_TRAF)
+	{
+		return VOD_OK;
+	}
+
+	context->tfhd_found = FALSE;
+	context->track = NULL;
+
+	return mp4_parser_parse_atoms(
+		context->state->request_context,
+		atom_info->ptr,
+		atom_info->size,
+		TRUE,
+		mp4_fragmented_traf_callback,
+		context);
+}
+
+static vod_status_t
+mp4_fragmented_parse_moof_atom(
+	mp4_fragmented_state_t* state,
+	uint64_t moof_offset,
+	const u_char* buffer,
+	uint64_t size)
+{
+	mp4_fragmented_moof_context_t context;
+
+	context.state = state;
+	context.moof_offset = moof_offset;
+	context.data_end = moof_offset;
+
+	return mp4_parser_parse_atoms(
+		state->request_context,
+		buffer,
+		size,
+		TRUE,
+		mp4_fragmented_moof_callback,
+		&context);
+}
+
+static u_char*
+mp4_fragmented_write_header(u_char* p, atom_info_t* atom_info, uint64_t size)
+{
+	u_char* name_ptr = (u_char*)&atom_info->name;
+
+	if (atom_info->header_size == ATOM_HEADER64_SIZE)
+	{
+		write_atom_header64(p, size + ATOM_HEADER64_SIZE, name_ptr[0], name_ptr[1], name_ptr[2], name_ptr[3]);
+	}
+	else
+	{
+		write_atom_header(p, size + ATOM_HEADER_SIZE, name_ptr[0], name_ptr[1], name_ptr[2], name_ptr[3]);
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_copy_atom(u_char* p, atom_info_t* atom_info)
+{
+	p = mp4_fragmented_write_header(p, atom_info, atom_info->size);
+	return vod_copy(p, atom_info->ptr, atom_info->size);
+}
+
+// stts & ctts have the same structure
+static u_char*
+mp4_fragmented_write_stts_atom(u_char* p, mp4_fragmented_track_t* track, bool_t pts_delay)
+{
+	mp4_fragmented_sample_t* cur_sample = track->samples.elts;
+	mp4_fragmented_sample_t* last_sample = cur_sample + track->samples.nelts;
+	mp4_fragmented_table_t* table = pts_delay ? &track->ctts : &track->stts;
+	uint32_t version = 0;
+	uint32_t cur_value;
+	uint32_t entries = 0;
+	uint32_t count = 0;
+	uint32_t value = 0;
+	u_char* start = p;
+	size_t size;
+
+	p += ATOM_HEADER_SIZE + sizeof(stts_atom_t);
+
+	// the samples of the previous scan
+	if (table->entries != NULL)
+	{
+		version = parse_be32(table->entries - sizeof(stts_atom_t));
+		p = vod_copy(p, table->entries, table->count * sizeof(stts_entry_t));
+		entries = table->count;
+	}
+	else if (track->stsz.count > 0)
+	{
+		// a ctts atom is added, the previous samples have no pts delay
+		write_be32(p, track->stsz.count);
+		write_be32(p, 0);
+		entries++;
+	}
+
+	for (; cur_sample < last_sample; cur_sample++)
+	{
+		cur_value = pts_delay ? cur_sample->pts_delay : cur_sample->duration;
+		if (count > 0 && cur_value == value)
+		{
+			count++;
+			continue;
+		}
+
+		if (count > 0)
+		{
+			write_be32(p, count);
+			write_be32(p, value);
+			entries++;
+		}
+
+		value = cur_value;
+		count = 1;
+	}
+
+	if (count > 0)
+	{
+		write_be32(p, count);
+		write_be32(p, value);
+		entries++;
+	}
+
+	size = p - start;
+	if (pts_delay)
+	{
+		write_atom_header(start, size, 'c', 't', 't', 's');
+	}
+	else
+	{
+		write_atom_header(start, size, 's', 't', 't', 's');
+	}
+	write_be32(start, version);		// version + flags
+	write_be32(start, entries);
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_write_stss_atom(u_char* p, mp4_fragmented_track_t* track)
+{
+	mp4_fragmented_sample_t* cur_sample = track->samples.elts;
+	mp4_fragmented_sample_t* last_sample = cur_sample + track->samples.nelts;
+	uint32_t prev_count;
+	uint32_t index;
+
+	prev_count = track->stss.entries != NULL ? track->stss.count : track->stsz.count;
+
+	write_atom_header(p, ATOM_HEADER_SIZE + sizeof(stss_atom_t) + (prev_count + track->key_frame_count) * sizeof(uint32_t), 's', 't', 's', 's');
+	write_be32(p, 0);		// version + flags
+	write_be32(p, prev_count + track->key_frame_count);
+
+	if (track->stss.entries != NULL)
+	{
+		p = vod_copy(p, track->stss.entries, track->stss.count * sizeof(uint32_t));
+	}
+	else
+	{
+		// an stss atom is added, all the previous samples are key frames
+		for (index = 1; index <= track->stsz.count; index++)
+		{
+			write_be32(p, index);
+		}
+	}
+
+	for (index = track->stsz.count + 1; cur_sample < last_sample; cur_sample++, index++)
+	{
+		if (cur_sample->is_key)
+		{
+			write_be32(p, index);
+		}
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_write_stsz_atom(u_char* p, mp4_fragmented_track_t* track)
+{
+	mp4_fragmented_sample_t* cur_sample = track->samples.elts;
+	mp4_fragmented_sample_t* last_sample = cur_sample + track->samples.nelts;
+	uint32_t sample_count;
+	uint32_t index;
+
+	sample_count = track->stsz.count + track->samples.nelts;
+
+	write_atom_header(p, ATOM_HEADER_SIZE + sizeof(stsz_atom_t) + sample_count * sizeof(uint32_t), 's', 't', 's', 'z');
+	write_be32(p, 0);		// version + flags
+	write_be32(p, 0);		// uniform size
+	write_be32(p, sample_count);
+
+	if (track->uniform_size != 0)
+	{
+		for (index = 0; index < track->stsz.count; index++)
+		{
+			write_be32(p, track->uniform_size);
+		}
+	}
+	else if (track->stsz.count > 0)
+	{
+		p = vod_copy(p, track->stsz.entries, track->stsz.count * sizeof(uint32_t));
+	}
+
+	for (; cur_sample < last_sample; cur_sample++)
+	{
+		write_be32(p, cur_sample->size);
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_write_stsc_atom(u_char* p, mp4_fragmented_track_t* track)
+{
+	mp4_fragmented_chunk_t* first_chunk = track->chunks.elts;
+	mp4_fragmented_chunk_t* last_chunk = first_chunk + track->chunks.nelts;
+	mp4_fragmented_chunk_t* prev_chunk = NULL;
+	mp4_fragmented_chunk_t* cur_chunk;
+	uint32_t entries = 0;
+	u_char* start = p;
+	size_t size;
+
+	p += ATOM_HEADER_SIZE + sizeof(stsc_atom_t);
+
+	if (track->stsc.count > 0)
+	{
+		p = vod_copy(p, track->stsc.entries, track->stsc.count * sizeof(stsc_entry_t));
+		entries = track->stsc.count;
+	}
+
+	for (cur_chunk = first_chunk; cur_chunk < last_chunk; cur_chunk++)
+	{
+		if (prev_chunk != NULL &&
+			cur_chunk->sample_count == prev_chunk->sample_count &&
+			cur_chunk->sample_desc == prev_chunk->sample_desc)
+		{
+			continue;
+		}
+
+		write_be32(p, track->stco.count + (cur_chunk - first_chunk) + 1);
+		write_be32(p, cur_chunk->sample_count);
+		write_be32(p, cur_chunk->sample_desc);
+		entries++;
+
+		prev_chunk = cur_chunk;
+	}
+
+	size = p - start;
+	write_atom_header(start, size, 's', 't', 's', 'c');
+	write_be32(start, 0);		// version + flags
+	write_be32(start, entries);
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_write_co64_atom(u_char* p, mp4_fragmented_track_t* track)
+{
+	mp4_fragmented_chunk_t* cur_chunk = track->chunks.elts;
+	mp4_fragmented_chunk_t* last_chunk = cur_chunk + track->chunks.nelts;
+	const u_char* cur_offset;
+	const u_char* last_offset;
+	uint32_t chunk_count;
+
+	chunk_count = track->stco.count + track->chunks.nelts;
+
+	write_atom_header(p, ATOM_HEADER_SIZE + sizeof(stco_atom_t) + chunk_count * sizeof(uint64_t), 'c', 'o', '6', '4');
+	write_be32(p, 0);		// version + flags
+	write_be32(p, chunk_count);
+
+	if (track->co64)
+	{
+		p = vod_copy(p, track->stco.entries, track->stco.count * sizeof(uint64_t));
+	}
+	else if (track->stco.count > 0)
+	{
+		cur_offset = track->stco.entries;
+		last_offset = cur_offset + track->stco.count * sizeof(uint32_t);
+		for (; cur_offset < last_offset; cur_offset += sizeof(uint32_t))
+		{
+			write_be64(p, (uint64_t)parse_be32(cur_offset));
+		}
+	}
+
+	for (; cur_chunk < last_chunk; cur_chunk++)
+	{
+		write_be64(p, cur_chunk->offset);
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_fragmented_write_sample_tables(u_char* p, mp4_fragmented_track_t* track)
+{
+	p = mp4_fragmented_write_stts_atom(p, track, FALSE);
+
+	if (track->ctts.entries != NULL || track->has_pts_delay)
+	{
+		p = mp4_fragmented_write_stts_atom(p, track, TRUE);
+	}
+
+	if (track->stss.entries != NULL || track->key_frame_count < track->samples.nelts)
+	{
+		p = mp4_fragmented_write_stss_atom(p, track);
+	}
+
+	p = mp4_fragmented_write_stsz_atom(p, track);
+	p = mp4_fragmented_write_stsc_atom(p, track);
+	p = mp4_fragmented_write_co64_atom(p, track);
+
+	return p;
+}
+
+static void
+mp4_fragmented_set_duration(u_char* p, atom_info_t* atom_info, uint64_t duration)
+{
+	if (atom_info->size >= sizeof(mdhd64_atom_t) && p[0] == 1)
+	{
+		p += offsetof(mdhd64_atom_t, duration);
+		write_be64(p, duration);
+	}
+	else if (atom_info->size >= sizeof(mdhd_atom_t))
+	{
+		p += offsetof(mdhd_atom_t, duration);
+		write_be32(p, vod_min(duration, UINT_MAX));
+	}
+}
+
+static vod_status_t
+mp4_fragmented_write_atoms_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_fragmented_write_context_t* context = ctx;
+	vod_status_t rc;
+	u_char* start;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_VODF:
+		// replaced by the state of the current scan
+		break;
+
+	case ATOM_NAME_TRAK:
+		context->track = NULL;
+		// fall through
+
+	case ATOM_NAME_MDIA:
+	case ATOM_NAME_MINF:
+	case ATOM_NAME_STBL:
+		start = context->p;
+		context->p += atom_info->header_size;
+
+		rc = mp4_parser_parse_atoms(
+			context->request_context,
+			atom_info->ptr,
+			atom_info->size,
+			TRUE,
+			mp4_fragmented_write_atoms_callback,
+			context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		if (atom_info->name == ATOM_NAME_STBL && context->track != NULL)
+		{
+			context->p = mp4_fragmented_write_sample_tables(context->p, context->track);
+		}
+
+		mp4_fragmented_write_header(start, atom_info, context->p - start - atom_info->header_size);
+		break;
+
+	case ATOM_NAME_TKHD:
+		context->track = mp4_fragmented_get_tkhd_track(context->state, atom_info);
+		context->p = mp4_fragmented_copy_atom(context->p, atom_info);
+		break;
+
+	case ATOM_NAME_MDHD:
+		start = context->p + atom_info->header_size;
+		context->p = mp4_fragmented_copy_atom(context->p, atom_info);
+		if (context->track != NULL)
+		{
+			mp4_fragmented_set_duration(start, atom_info, context->track->prev_duration + context->track->duration);
+		}
+		break;
+
+	case ATOM_NAME_STTS:
+	case ATOM_NAME_CTTS:
+	case ATOM_NAME_STSS:
+	case ATOM_NAME_STSC:
+	case ATOM_NAME_STSZ:
+	case ATOM_NAME_STZ2:
+	case ATOM_NAME_STCO:
+	case ATOM_NAME_CO64:
+		if (context->track != NULL)
+		{
+			// replaced by the generated sample tables
+			break;
+		}
+		// fall through
+
+	default:
+		context->p = mp4_fragmented_copy_atom(context->p, atom_info);
+		break;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_fragmented_build_moov(mp4_fragmented_state_t* state, vod_str_t* result)
+{
+	mp4_fragmented_write_context_t context;
+	request_context_t* request_context = state->request_context;
+	vod_status_t rc;
+	u_char* buffer;
+	u_char* p;
+
+	buffer = vod_alloc(request_context->pool, state->moov.len + state->sample_tables_size);
+	if (buffer == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_build_moov: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	context.request_context = request_context;
+	context.state = state;
+	context.track = NULL;
+	context.p = buffer;
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		state->moov.data,
+		state->moov.len,
+		TRUE,
+		mp4_fragmented_write_atoms_callback,
+		&context);
+	if (rc != VOD_OK)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_fragmented_build_moov: mp4_parser_parse_atoms failed %i", rc);
+		return rc;
+	}
+
+	// save the scan offset, in order to resume the scan when the metadata is refreshed
+	p = context.p;
+	write_atom_header(p, ATOM_HEADER_SIZE + sizeof(vodf_atom_t), 'v', 'o', 'd', 'f');
+	write_be32(p, 0);		// version + flags
+	write_be64(p, state->committed_offset);
+
+	result->data = buffer;
+	result->len = p - buffer;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_fragmented_build_moov: generated moov size %uz, scan offset %uL", result->len, state->committed_offset);
+
+	return VOD_OK;
+}
+
+static void
+mp4_fragmented_commit(mp4_fragmented_state_t* state, uint64_t offset, uint32_t atom_name)
+{
+	mp4_fragmented_track_t* cur_track;
+	mp4_fragmented_track_t* last_track;
+
+	if (state->moof_pending)
+	{
+		// the samples of a moof atom are used only once the mdat atom that follows it is complete
+		if (atom_name != ATOM_NAME_MDAT)
+		{
+			return;
+		}
+
+		cur_track = state->tracks.elts;
+		last_track = cur_track + state->tracks.nelts;
+		for (; cur_track < last_track; cur_track++)
+		{
+			cur_track->committed_samples = cur_track->samples.nelts;
+			cur_track->committed_chunks = cur_track->chunks.nelts;
+			cur_track->committed_duration = cur_track->duration;
+			cur_track->committed_key_frame_count = cur_track->key_frame_count;
+		}
+
+		state->committed_tables_size = state->sample_tables_size;
+		state->moof_pending = FALSE;
+	}
+
+	state->committed_offset = offset;
+}
+
+static void
+mp4_fragmented_rollback(mp4_fragmented_state_t* state)
+{
+	mp4_fragmented_track_t* cur_track;
+	mp4_fragmented_track_t* last_track;
+
+	if (!state->moof_pending)
+	{
+		return;
+	}
+
+	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+		"mp4_fragmented_rollback: ignoring the incomplete fragments that follow offset %uL", state->committed_offset);
+
+	cur_track = state->tracks.elts;
+	last_track = cur_track + state->tracks.nelts;
+	for (; cur_track < last_track; cur_track++)
+	{
+		cur_track->samples.nelts = cur_track->committed_samples;
+		cur_track->chunks.nelts = cur_track->committed_chunks;
+		cur_track->duration = cur_track->committed_duration;
+		cur_track->key_frame_count = cur_track->committed_key_frame_count;
+	}
+
+	state->sample_tables_size = state->committed_tables_size;
+	state->moof_pending = FALSE;
+}
+
+vod_status_t
+mp4_fragmented_read(
+	void* ctx,
+	uint64_t offset,
+	vod_str_t* buffer,
+	media_format_read_request_t* read_req,
+	vod_str_t* moov)
+{
+	mp4_fragmented_state_t* state = ctx;
+	const u_char* start_pos = buffer->data;
+	const u_char* end_pos = buffer->data + buffer->len;
+	const u_char* atom_start;
+	const u_char* cur_pos;
+	uint64_t atom_offset;
+	uint64_t atom_size;
+	uint32_t atom_name;
+	size_t header_size;
+	bool_t moof_read;
+	vod_status_t rc;
+
+	moof_read = state->moof_read;
+	state->moof_read = FALSE;
+
+	if (state->skip_read)
+	{
+		state->skip_read = FALSE;
+
+		// the read started at the last byte of the skipped atom
+		if (buffer->len <= 0)
+		{
+			// the atom is not complete yet
+			goto done;
+		}
+
+		mp4_fragmented_commit(state, offset + 1, state->skipped_atom_name);
+
+		start_pos++;
+		offset++;
+	}
+
+	for (cur_pos = start_pos; ; cur_pos = atom_start + atom_size)
+	{
+		atom_start = cur_pos;
+		atom_offset = offset + (atom_start - start_pos);
+
+		if ((size_t)(end_pos - cur_pos) < ATOM_HEADER_SIZE)
+		{
+			break;
+		}
+
+		read_be32(cur_pos, atom_size);
+		read_le32(cur_pos, atom_name);
+
+		header_size = ATOM_HEADER_SIZE;
+		if (atom_size == 1)
+		{
+			if ((size_t)(end_pos - cur_pos) < sizeof(uint64_t))
+			{
+				break;
+			}
+
+			read_be64(cur_pos, atom_size);
+			header_size = ATOM_HEADER64_SIZE;
+		}
+		else if (atom_size == 0)
+		{
+			// the atom extends till the end of the file
+			mp4_fragmented_commit(state, atom_offset, atom_name);
+			goto done;
+		}
+
+		if (atom_size < header_size)
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"mp4_fragmented_read: atom size %uL is less than the atom header size %uz", atom_size, header_size);
+			return VOD_BAD_DATA;
+		}
+
+		if (atom_size <= (uint64_t)(end_pos - atom_start))
+		{
+			if (atom_name == ATOM_NAME_MOOF)
+			{
+				rc = mp4_fragmented_parse_moof_atom(state, atom_offset, cur_pos, atom_size - header_size);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+
+				state->moof_pending = TRUE;
+			}
+			else
+			{
+				mp4_fragmented_commit(state, atom_offset + atom_size, atom_name);
+			}
+			continue;
+		}
+
+		if (atom_name != ATOM_NAME_MOOF)
+		{
+			// skip the atom (usually mdat) without reading it, the read starts at its last byte,
+			//	in order to verify that the atom is complete
+			state->skip_read = TRUE;
+			state->skipped_atom_name = atom_name;
+
+			read_req->read_offset = atom_offset + atom_size - 1;
+			read_req->read_size = 0;
+			read_req->flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+			return VOD_AGAIN;
+		}
+
+		// read the whole moof atom, and the header of the atom that follows it
+		if (moof_read && atom_start == start_pos)
+		{
+			// the moof atom is not complete yet
+			goto done;
+		}
+
+		if (atom_size > state->max_moov_size)
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"mp4_fragmented_read: moof size %uL exceeds the max %uz", atom_size, state->max_moov_size);
+			return VOD_BAD_DATA;
+		}
+
+		state->moof_read = TRUE;
+		read_req->read_offset = atom_offset;
+		read_req->read_size = atom_size + ATOM_HEADER64_SIZE;
+		read_req->flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+		return VOD_AGAIN;
+	}
+
+	if (atom_start == start_pos)
+	{
+		// end of file
+		goto done;
+	}
+
+	// got a partial atom header, read again from its start
+	read_req->read_offset = atom_offset;
+	read_req->read_size = 0;
+	read_req->flags = MEDIA_READ_FLAG_ALLOW_EMPTY_READ;
+	return VOD_AGAIN;
+
+done:
+
+	mp4_fragmented_rollback(state);
+
+	return mp4_fragmented_build_moov(state, moov);
+}
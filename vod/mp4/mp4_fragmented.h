@@ -0,0 +1,30 @@
+#ifndef __MP4_FRAGMENTED_H__
+#define __MP4_FRAGMENTED_H__
+
+// includes
+#include "../media_format.h"
+
+// functions
+vod_status_t mp4_fragmented_init(
+	request_context_t* request_context,
+	vod_str_t* moov,
+	uint64_t moov_end_offset,
+	size_t max_moov_size,
+	media_format_read_request_t* read_req,
+	void** result);
+
+vod_status_t mp4_fragmented_resume(
+	request_context_t* request_context,
+	vod_str_t* moov,
+	size_t max_moov_size,
+	media_format_read_request_t* read_req,
+	void** result);
+
+vod_status_t mp4_fragmented_read(
+	void* ctx,
+	uint64_t offset,
+	vod_str_t* buffer,
+	media_format_read_request_t* read_req,
+	vod_str_t* moov);
+
+#endif //__MP4_FRAGMENTED_H__
@@ -45,16 +45,6 @@ typedef struct {
 	track_sizes_t track_sizes[1];
 } init_mp4_sizes_t;
 
-typedef struct {
-	u_char version[1];
-	u_char flags[3];
-	u_char track_id[4];
-	u_char default_sample_description_index[4];
-	u_char default_sample_duration[4];
-	u_char default_sample_size[4];
-	u_char default_sample_flags[4];
-} trex_atom_t;
-
 // fixed atoms
 
 static const u_char ftyp_atom[] = {
@@ -2,6 +2,7 @@
 #include "../input/frames_source_cache.h"
 #include "../mp4/mp4_defs.h"
 #include "../mp4/mp4_fragment.h"
+#include "../request_arena.h"
 
 // constants
 #define MDAT_HEADER_SIZE (ATOM_HEADER_SIZE)
@@ -53,6 +54,13 @@ struct mp4_muxer_state_s {
 	frames_source_t* frames_source;
 	void* frames_source_context;
 	bool_t first_time;
+
+	// file passthrough
+	write_file_callback_t write_file_callback;
+	void* write_file_context;
+	void* file_source;
+	uint64_t file_start_offset;
+	uint64_t file_end_offset;
 };
 
 static vod_status_t mp4_muxer_start_frame(mp4_muxer_state_t* state);
@@ -78,33 +86,6 @@ mp4_muxer_write_trun_header(
 	return p;
 }
 
-static u_char*
-mp4_muxer_write_video_trun_frame(u_char* p, input_frame_t* frame, uint32_t initial_pts_delay)
-{
-	int32_t pts_delay = frame->pts_delay - initial_pts_delay;
-
-	write_be32(p, frame->duration);
-	write_be32(p, frame->size);
-	if (frame->key_frame)
-	{
-		write_be32(p, 0x02000000);		// I-frame
-	}
-	else
-	{
-		write_be32(p, 0x01010000);		// not I-frame + non key sample
-	}
-	write_be32(p, pts_delay);
-	return p;
-}
-
-static u_char*
-mp4_muxer_write_audio_trun_frame(u_char* p, input_frame_t* frame)
-{
-	write_be32(p, frame->duration);
-	write_be32(p, frame->size);
-	return p;
-}
-
 static u_char*
 mp4_muxer_write_video_trun_atoms(
 	u_char* p,
@@ -129,46 +110,48 @@ mp4_muxer_write_video_trun_atoms(
 	initial_pts_delay = cur_track->media_info.u.video.initial_pts_delay;
 	for (;;)
 	{
-		part = &cur_track->frames;
-		last_frame = part->last_frame;
-		for (cur_frame = part->first_frame; ;
-			cur_frame++, output_offset++)
+		for (part = &cur_track->frames; part != NULL; part = part->next)
 		{
-			if (cur_frame >= last_frame)
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame = last_frame)
 			{
-				if (part->next == NULL)
+				if (*output_offset != cur_offset)
 				{
-					break;
+					if (trun_header != NULL)
+					{
+						// close current trun atom
+						mp4_muxer_write_trun_header(
+							trun_header, 
+							base_offset + start_offset, 
+							frame_count, 
+							sizeof(trun_video_frame_t), 
+							(1 << 24) | TRUN_VIDEO_FLAGS);		// version = 1
+					}
+
+					// start a new trun atom
+					trun_header = p;
+					p += ATOM_HEADER_SIZE + sizeof(trun_atom_t);
+					cur_offset = start_offset = *output_offset;
+					frame_count = 0;
 				}
-				part = part->next;
-				cur_frame = part->first_frame;
-				last_frame = part->last_frame;
-			}
 
-			if (*output_offset != cur_offset)
-			{
-				if (trun_header != NULL)
+				// add the frames that are written consecutively to the trun atom
+				last_frame = cur_frame;
+				do
 				{
-					// close current trun atom
-					mp4_muxer_write_trun_header(
-						trun_header, 
-						base_offset + start_offset, 
-						frame_count, 
-						sizeof(trun_video_frame_t), 
-						(1 << 24) | TRUN_VIDEO_FLAGS);		// version = 1
-				}
-
-				// start a new trun atom
-				trun_header = p;
-				p += ATOM_HEADER_SIZE + sizeof(trun_atom_t);
-				cur_offset = start_offset = *output_offset;
-				frame_count = 0;
+					cur_offset += last_frame->size;
+					last_frame++;
+					output_offset++;
+					frame_count++;
+				} while (last_frame < part->last_frame && *output_offset == cur_offset);
+
+				p = mp4_fragment_write_video_trun_entries(
+					p,
+					cur_frame,
+					last_frame,
+					initial_pts_delay,
+					0x02000000,			// I-frame
+					0x01010000);		// not I-frame + non key sample
 			}
-
-			// add the frame to the trun atom
-			p = mp4_muxer_write_video_trun_frame(p, cur_frame, initial_pts_delay);
-			frame_count++;
-			cur_offset += cur_frame->size;
 		}
 
 		clip_index++;
@@ -216,46 +199,42 @@ mp4_muxer_write_audio_trun_atoms(
 	cur_track = media_set->filtered_tracks + cur_stream->index;
 	for (;;)
 	{
-		part = &cur_track->frames;
-		last_frame = part->last_frame;
-		for (cur_frame = part->first_frame; ;
-			cur_frame++, output_offset++)
+		for (part = &cur_track->frames; part != NULL; part = part->next)
 		{
-			if (cur_frame >= last_frame)
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame = last_frame)
 			{
-				if (part->next == NULL)
+				if (*output_offset != cur_offset)
 				{
-					break;
+					if (trun_header != NULL)
+					{
+						// close current trun atom
+						mp4_muxer_write_trun_header(
+							trun_header,
+							base_offset + start_offset,
+							frame_count,
+							sizeof(trun_audio_frame_t),
+							TRUN_AUDIO_FLAGS);
+					}
+
+					// start a new trun atom
+					trun_header = p;
+					p += ATOM_HEADER_SIZE + sizeof(trun_atom_t);
+					cur_offset = start_offset = *output_offset;
+					frame_count = 0;
 				}
-				part = part->next;
-				cur_frame = part->first_frame;
-				last_frame = part->last_frame;
-			}
 
-			if (*output_offset != cur_offset)
-			{
-				if (trun_header != NULL)
+				// add the frames that are written consecutively to the trun atom
+				last_frame = cur_frame;
+				do
 				{
-					// close current trun atom
-					mp4_muxer_write_trun_header(
-						trun_header,
-						base_offset + start_offset,
-						frame_count,
-						sizeof(trun_audio_frame_t),
-						TRUN_AUDIO_FLAGS);
-				}
+					cur_offset += last_frame->size;
+					last_frame++;
+					output_offset++;
+					frame_count++;
+				} while (last_frame < part->last_frame && *output_offset == cur_offset);
 
-				// add the frame to the trun atom
-				trun_header = p;
-				p += ATOM_HEADER_SIZE + sizeof(trun_atom_t);
-				cur_offset = start_offset = *output_offset;
-				frame_count = 0;
+				p = mp4_fragment_write_audio_trun_entries(p, cur_frame, last_frame);
 			}
-
-			// add the frame to the trun atom
-			p = mp4_muxer_write_audio_trun_frame(p, cur_frame);
-			frame_count++;
-			cur_offset += cur_frame->size;
 		}
 
 		clip_index++;
@@ -470,21 +449,21 @@ mp4_muxer_init_state(
 	uint32_t index;
 
 	// allocate the state and stream states
-	state = vod_alloc(request_context->pool, sizeof(*state));
+	state = request_arena_alloc(request_context, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"mp4_muxer_init_state: vod_alloc failed (1)");
+			"mp4_muxer_init_state: request_arena_alloc failed (1)");
 		return VOD_ALLOC_FAILED;
 	}
 
-	state->first_stream = vod_alloc(
-		request_context->pool, 
+	state->first_stream = request_arena_alloc(
+		request_context, 
 		sizeof(state->first_stream[0]) * media_set->total_track_count);
 	if (state->first_stream == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"mp4_muxer_init_state: vod_alloc failed (2)");
+			"mp4_muxer_init_state: request_arena_alloc failed (2)");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -497,6 +476,20 @@ mp4_muxer_init_state(
 	state->selected_stream = NULL;
 	state->first_time = TRUE;
 
+	// the frames can be written from the file only when they are not modified
+	if (!reuse_buffers && !per_stream_writer)
+	{
+		state->write_file_callback = track_writers->write_file;
+		state->write_file_context = track_writers->context;
+	}
+	else
+	{
+		state->write_file_callback = NULL;
+	}
+	state->file_source = NULL;
+	state->file_start_offset = 0;
+	state->file_end_offset = 0;
+
 	index = 0;
 	cur_track = media_set->filtered_tracks;
 	for (cur_stream = state->first_stream; cur_stream < state->last_stream; cur_stream++, cur_track++, index++)
@@ -799,6 +792,58 @@ mp4_muxer_start_frame(mp4_muxer_state_t* state)
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_muxer_flush_file_range(mp4_muxer_state_t* state)
+{
+	vod_status_t rc;
+
+	if (state->file_end_offset <= state->file_start_offset)
+	{
+		return VOD_OK;
+	}
+
+	rc = state->write_file_callback(
+		state->write_file_context,
+		state->file_source,
+		state->file_start_offset,
+		state->file_end_offset - state->file_start_offset);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	state->file_start_offset = state->file_end_offset;
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_muxer_write_file_frame(mp4_muxer_state_t* state)
+{
+	input_frame_t* frame = state->cur_frame;
+	void* source = state->selected_stream->source;
+	vod_status_t rc;
+
+	// if the frame is contiguous to the previous one, just increment the size
+	if (source == state->file_source &&
+		frame->offset == state->file_end_offset &&
+		state->file_end_offset + frame->size - state->file_start_offset <= UINT_MAX)
+	{
+		state->file_end_offset += frame->size;
+		return VOD_OK;
+	}
+
+	rc = mp4_muxer_flush_file_range(state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	state->file_source = source;
+	state->file_start_offset = frame->offset;
+	state->file_end_offset = frame->offset + frame->size;
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_muxer_process_frames(mp4_muxer_state_t* state)
 {
@@ -814,6 +859,55 @@ mp4_muxer_process_frames(mp4_muxer_state_t* state)
 
 	for (;;)
 	{
+		// write frames that are sent as is directly from the file
+		while (state->write_file_callback != NULL &&
+			state->frames_source == &frames_source_cache)
+		{
+			if (write_buffer_size != 0)
+			{
+				// flush the write buffer
+				rc = last_stream->write_callback(last_stream->write_context, write_buffer, write_buffer_size);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+
+				write_buffer_size = 0;
+			}
+
+			rc = mp4_muxer_write_file_frame(state);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			processed_data = TRUE;
+
+			rc = mp4_muxer_start_frame(state);
+			if (rc != VOD_OK)
+			{
+				if (rc == VOD_NOT_FOUND)
+				{
+					return mp4_muxer_flush_file_range(state);		// done
+				}
+
+				vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+					"mp4_muxer_process_frames: mp4_muxer_start_frame failed %i", rc);
+				return rc;
+			}
+
+			selected_stream = state->selected_stream;
+		}
+
+		if (state->write_file_callback != NULL)
+		{
+			rc = mp4_muxer_flush_file_range(state);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+		}
+
 		// read some data from the frame
 		rc = state->frames_source->read(state->frames_source_context, &read_buffer, &read_size, &frame_done);
 		if (rc != VOD_OK)
@@ -1,13 +1,16 @@
 #include "mp4_parser.h"
 #include "mp4_format.h"
 #include "mp4_defs.h"
+#include "mp4_sample_index.h"
 #include "../media_format.h"
 #include "../input/frames_source_cache.h"
 #include "../read_stream.h"
+#include "../read_array.h"
 #include "../write_stream.h"
 #include "../codec_config.h"
 #include "../media_clip.h"
 #include "../segmenter.h"
+#include "../request_arena.h"
 #include "../common.h"
 
 #include <limits.h>
@@ -51,6 +54,7 @@
 #define MAX_TOTAL_SIZE_TEST_SAMPLES (100000)
 #define MAX_PTS_DELAY_TEST_SAMPLES (100)
 #define MAX_KEY_FRAME_BITRATE_TEST_SAMPLES (1000)
+#define READ_ARRAY_BATCH_SIZE (256)
 
 #define OPUS_EXTRA_DATA_MAGIC "OpusHead"
 
@@ -84,6 +88,8 @@ typedef struct {
 	uint32_t track_indexes[MEDIA_TYPE_COUNT];
 	vod_str_t ftyp_atom;
 	mp4_base_metadata_t* result;
+	uint32_t trak_count;
+	uint64_t* required_traks;		// when set, only the indexes of the required trak atoms are returned
 } process_moov_context_t;
 
 typedef struct {
@@ -104,6 +110,7 @@ typedef struct {
 	// input - reset between tracks
 	const uint32_t* stss_start_pos;			// initialized only when aligning keyframes
 	uint32_t stss_entries;					// initialized only when aligning keyframes
+	mp4_trak_sample_index_t* sample_index;
 
 	// output
 	uint32_t stss_start_index;
@@ -115,6 +122,9 @@ typedef struct {
 	int32_t clip_from_frame_offset;
 	input_frame_t* frames;
 	uint32_t frame_count;
+	frame_duration_run_t* runs;			// PARSE_FLAG_FRAMES_COMPACT only
+	uint32_t run_count;
+	u_char* key_frames;
 	uint64_t total_frames_size;
 	uint64_t total_frames_duration;
 	uint32_t key_frame_count;
@@ -131,6 +141,7 @@ typedef struct {
 	media_info_t media_info;
 	atom_info_t sinf_atom;
 	uint32_t track_index;
+	mp4_trak_sample_index_t sample_index;
 } mp4_track_base_metadata_t;
 
 typedef struct {
@@ -617,6 +628,93 @@ mp4_parser_parse_stts_atom_frame_duration_only(atom_info_t* atom_info, frames_pa
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_parser_push_frames(
+	frames_parse_context_t* context,
+	vod_array_t* runs,
+	uint32_t* frame_count,
+	uint32_t count,
+	uint32_t duration)
+{
+	frame_duration_run_t* last_run;
+
+	if (count > context->parse_params.max_frame_count - *frame_count)
+	{
+		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+			"mp4_parser_push_frames: frame count exceeds the limit %uD", context->parse_params.max_frame_count);
+		return VOD_BAD_DATA;
+	}
+
+	if (count <= 0)
+	{
+		return VOD_OK;
+	}
+
+	*frame_count += count;
+
+	// merge with the previous run when the duration did not change
+	if (runs->nelts > 0)
+	{
+		last_run = (frame_duration_run_t*)runs->elts + runs->nelts - 1;
+		if (last_run->duration == duration)
+		{
+			last_run->count += count;
+			return VOD_OK;
+		}
+	}
+
+	last_run = vod_array_push(runs);
+	if (last_run == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_push_frames: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	last_run->count = count;
+	last_run->duration = duration;
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_parser_materialize_frames(
+	frames_parse_context_t* context,
+	frame_duration_run_t* cur_run,
+	frame_duration_run_t* last_run,
+	uint32_t frame_count)
+{
+	input_frame_t* cur_frame_limit;
+	input_frame_t* cur_frame;
+
+	if (frame_count <= 0)
+	{
+		return VOD_OK;
+	}
+
+	// Note: the frame count is known at this point, allocating the exact size avoids
+	//		the copies and the unused memory of a growing array
+	cur_frame = request_arena_alloc(context->request_context, sizeof(*cur_frame) * frame_count);
+	if (cur_frame == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_materialize_frames: request_arena_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	context->frames = cur_frame;
+
+	for (; cur_run < last_run; cur_run++)
+	{
+		for (cur_frame_limit = cur_frame + cur_run->count; cur_frame < cur_frame_limit; cur_frame++)
+		{
+			cur_frame->duration = cur_run->duration;
+			cur_frame->pts_delay = 0;
+		}
+	}
+
+	return VOD_OK;
+}
+
 static vod_status_t 
 mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
@@ -637,15 +735,15 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	int64_t empty_duration;
 	uint32_t cur_count;
 	uint32_t skip_count;
-	uint32_t initial_alloc_size;
-	input_frame_t* cur_frame_limit;
-	input_frame_t* cur_frame;
-	vod_array_t frames_array;
+	vod_array_t runs;
+	uint32_t frame_count = 0;
 	uint32_t first_frame;
 	uint32_t frame_index = 0;
 	uint32_t key_frame_index;
 	uint32_t key_frame_stss_index;
 	const uint32_t* stss_entry;
+	const mp4_sample_index_entry_t* index_entry;
+	uint64_t seek_time;
 	vod_status_t rc;
 
 	// validate the atom
@@ -680,6 +778,30 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_OK;
 	}
 
+	// use the sample index to skip the entries that end before the first position we seek to
+	if (context->sample_index->stts.count > 0)
+	{
+		if (context->parse_params.clip_from > 0)
+		{
+			seek_time = (((uint64_t)context->parse_params.clip_from * timescale) / 1000);
+		}
+		else
+		{
+			seek_time = ((range->start + context->clip_from) * timescale) / range->timescale;
+		}
+
+		if (seek_time > accum_duration)
+		{
+			index_entry = mp4_sample_index_find_value(&context->sample_index->stts, seek_time - accum_duration);
+			if (index_entry != NULL && parse_be32(index_entry->entry_index) < entries)
+			{
+				cur_entry += parse_be32(index_entry->entry_index);
+				frame_index = parse_be32(index_entry->frame_index);
+				accum_duration += parse_be64(index_entry->value);
+			}
+		}
+	}
+
 	sample_duration = parse_be32(cur_entry->duration);
 	sample_count = parse_be32(cur_entry->count);
 	next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
@@ -873,54 +995,28 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	first_frame = frame_index;
 	context->first_frame_time_offset = accum_duration;
 
-	// calculate the end time and initial alloc size
-	initial_alloc_size = 128;
-
+	// calculate the end time
 	if (range->end == ULLONG_MAX)
 	{
 		end_time = ULLONG_MAX;
-
-		if (entries == 1)
-		{
-			// optimization - pre-allocate the correct size for constant frame rate
-			initial_alloc_size = sample_count;
-		}
 	}
 	else
 	{
 		end_time = ((range->end + context->clip_from) * timescale) / range->timescale;
 
-		if (entries == 1)
+		if (entries == 1 && sample_duration == 0)
 		{
-			// optimization - pre-allocate the correct size for constant frame rate
-			sample_duration = parse_be32(cur_entry->duration);
-			if (sample_duration == 0)
-			{
-				vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-					"mp4_parser_parse_stts_atom: sample duration is zero (1)");
-				return VOD_BAD_DATA;
-			}
-
-			initial_alloc_size = (end_time - start_time) / sample_duration + 1;
-			if (initial_alloc_size > sample_count)
-			{
-				initial_alloc_size = sample_count;
-			}
+			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+				"mp4_parser_parse_stts_atom: sample duration is zero (1)");
+			return VOD_BAD_DATA;
 		}
 	}
 
-	// initialize the frames array
-	if (initial_alloc_size > context->parse_params.max_frame_count)
-	{
-		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-			"mp4_parser_parse_stts_atom: initial alloc size %uD exceeds the max frame count %uD", initial_alloc_size, context->parse_params.max_frame_count);
-		return VOD_BAD_DATA;
-	}
-
-	if (vod_array_init(&frames_array, context->request_context->pool, initial_alloc_size, sizeof(input_frame_t)) != VOD_OK)
+	// initialize the duration runs array, a run is pushed per stts entry at most
+	if (request_arena_array_init(context->request_context, &runs, vod_min(entries, 128), sizeof(frame_duration_run_t)) != VOD_OK)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
-			"mp4_parser_parse_stts_atom: vod_array_init failed");
+			"mp4_parser_parse_stts_atom: request_arena_array_init failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -941,31 +1037,16 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 				cur_count = sample_count;
 			}
 
-			if (cur_count > context->parse_params.max_frame_count - frames_array.nelts)
-			{
-				vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-					"mp4_parser_parse_stts_atom: frame count exceeds the limit %uD", context->parse_params.max_frame_count);
-				return VOD_BAD_DATA;
-			}
-
-			cur_frame = vod_array_push_n(&frames_array, cur_count);
-			if (cur_frame == NULL)
+			rc = mp4_parser_push_frames(context, &runs, &frame_count, cur_count, sample_duration);
+			if (rc != VOD_OK)
 			{
-				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
-					"mp4_parser_parse_stts_atom: vod_array_push_n failed");
-				return VOD_ALLOC_FAILED;
+				return rc;
 			}
 
 			sample_count -= cur_count;
 			frame_index += cur_count;
 			accum_duration += (uint64_t)cur_count * sample_duration;
 
-			for (cur_frame_limit = cur_frame + cur_count; cur_frame < cur_frame_limit; cur_frame++)
-			{
-				cur_frame->duration = sample_duration;
-				cur_frame->pts_delay = 0;
-			}
-
 			if (accum_duration >= end_time)
 			{
 				break;
@@ -995,7 +1076,7 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	// parse the frame durations until the next key frame
 	if (context->stss_entries != 0)
 	{
-		if (frames_array.nelts == 0)
+		if (frame_count == 0)
 		{
 			context->first_frame_time_offset -= clip_from_accum_duration;
 			range->start = 0;
@@ -1027,29 +1108,14 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 				sample_count = vod_min(cur_count, sample_count);
 			}
 
-			if (sample_count > context->parse_params.max_frame_count - frames_array.nelts)
-			{
-				vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
-					"mp4_parser_parse_stts_atom: frame count exceeds the limit %uD", context->parse_params.max_frame_count);
-				return VOD_BAD_DATA;
-			}
-
-			cur_frame = vod_array_push_n(&frames_array, sample_count);
-			if (cur_frame == NULL)
+			rc = mp4_parser_push_frames(context, &runs, &frame_count, sample_count, sample_duration);
+			if (rc != VOD_OK)
 			{
-				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
-					"mp4_parser_parse_stts_atom: vod_array_push_n failed");
-				return VOD_ALLOC_FAILED;
+				return rc;
 			}
 
 			frame_index += sample_count;
 			accum_duration += (uint64_t)sample_count * sample_duration;
-			
-			for (cur_frame_limit = cur_frame + sample_count; cur_frame < cur_frame_limit; cur_frame++)
-			{
-				cur_frame->duration = sample_duration;
-				cur_frame->pts_delay = 0;
-			}
 
 			if (frame_index >= key_frame_index || accum_duration >= clip_to)
 			{
@@ -1086,7 +1152,7 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	}
 
 	context->first_frame = first_frame;
-	context->last_frame = first_frame + frames_array.nelts;
+	context->last_frame = first_frame + frame_count;
 
 	if (context->last_frame < context->first_frame)
 	{
@@ -1097,8 +1163,24 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 
 	context->total_frames_duration = accum_duration - context->first_frame_time_offset;
 	context->first_frame_time_offset -= clip_from_accum_duration;	
-	context->frames = frames_array.elts;
-	context->frame_count = frames_array.nelts;
+	context->frame_count = frame_count;
+	if ((context->parse_params.parse_type & PARSE_FLAG_FRAMES_COMPACT) != 0)
+	{
+		context->runs = runs.elts;
+		context->run_count = runs.nelts;
+	}
+	else
+	{
+		rc = mp4_parser_materialize_frames(
+			context,
+			runs.elts,
+			(frame_duration_run_t*)runs.elts + runs.nelts,
+			frame_count);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
 
 	if (clip_to != ULLONG_MAX &&
 		(cur_entry >= last_entry || (accum_duration - clip_from_accum_duration) > clip_to - clip_from))
@@ -1174,6 +1256,7 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	input_frame_t* cur_limit;
 	uint32_t sample_count;
 	int32_t sample_duration;
+	const mp4_sample_index_entry_t* index_entry;
 	uint32_t dts_shift = 0;
 	uint32_t entries;
 	uint32_t frame_index = 0;
@@ -1200,6 +1283,18 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_OK;
 	}
 
+	// use the sample index to skip to the entry that contains the first frame
+	if (context->sample_index->ctts.count > 0)
+	{
+		index_entry = mp4_sample_index_find_frame(&context->sample_index->ctts, context->first_frame);
+		if (index_entry != NULL && parse_be32(index_entry->entry_index) < entries)
+		{
+			cur_entry += parse_be32(index_entry->entry_index);
+			frame_index = parse_be32(index_entry->frame_index);
+			dts_shift = parse_be64(index_entry->value);
+		}
+	}
+
 	sample_duration = parse_be32(cur_entry->duration);
 	if (sample_duration < 0)
 	{
@@ -1279,9 +1374,13 @@ mp4_parser_parse_stco_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 {
 	input_frame_t* cur_frame = context->frames;
 	input_frame_t* last_frame = cur_frame + context->frame_count;
+	uint32_t offsets[READ_ARRAY_BATCH_SIZE];
+	uint32_t* cur_offset;
 	uint32_t entries;
 	const u_char* cur_pos;
 	uint32_t entry_size;
+	uint32_t batch_size;
+	uint32_t max_offset;
 	uint64_t cur_file_offset;
 	uint32_t cur_chunk_index;
 	vod_status_t rc;
@@ -1317,9 +1416,16 @@ mp4_parser_parse_stco_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		}
 		else
 		{
-			for (; cur_frame < last_frame; cur_frame++)
+			while (cur_frame < last_frame)
 			{
-				read_be32(cur_pos, cur_frame->offset);
+				batch_size = vod_min(last_frame - cur_frame, READ_ARRAY_BATCH_SIZE);
+				read_array_be32(offsets, cur_pos, batch_size, &max_offset);
+				cur_pos += batch_size * sizeof(uint32_t);
+
+				for (cur_offset = offsets; batch_size > 0; batch_size--, cur_frame++)
+				{
+					cur_frame->offset = *cur_offset++;
+				}
 			}
 		}
 		return VOD_OK;
@@ -1391,6 +1497,7 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	uint32_t samples_per_chunk;
 	uint32_t cur_sample;
 	uint32_t skip_chunks;
+	const mp4_sample_index_entry_t* index_entry;
 	vod_status_t rc;
 
 	rc = mp4_parser_validate_stsc_atom(context->request_context, atom_info, &entries);
@@ -1419,6 +1526,18 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_BAD_DATA;
 	}
 
+	// use the sample index to skip to an entry that precedes the first frame
+	if (context->sample_index->stsc.count > 0)
+	{
+		index_entry = mp4_sample_index_find_frame(&context->sample_index->stsc, context->first_frame);
+		if (index_entry != NULL && parse_be32(index_entry->entry_index) < entries)
+		{
+			cur_entry += parse_be32(index_entry->entry_index);
+			frame_index = parse_be32(index_entry->frame_index);
+			next_chunk = parse_be64(index_entry->value);
+		}
+	}
+
 	if (frame_index < context->first_frame)
 	{
 		// skip to the relevant entry
@@ -1716,11 +1835,7 @@ mp4_parser_parse_stsz_atom_total_size_estimate_only(atom_info_t* atom_info, fram
 	switch (field_size)
 	{
 	case 32:
-		end_pos = cur_pos + test_entries * sizeof(uint32_t);
-		for (; cur_pos < end_pos; cur_pos += sizeof(uint32_t))
-		{
-			context->total_frames_size += parse_be32(cur_pos);
-		}
+		context->total_frames_size += read_array_be32_sum(cur_pos, test_entries);
 		break;
 
 	case 16:
@@ -1762,8 +1877,11 @@ mp4_parser_parse_stsz_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	input_frame_t* cur_frame = context->frames;
 	input_frame_t* last_frame = cur_frame + context->frame_count;
 	uint32_t first_frame_index_in_chunk = context->first_frame - context->first_chunk_frame_index;
+	uint32_t sizes[READ_ARRAY_BATCH_SIZE];
+	uint32_t* cur_size_pos;
 	const u_char* cur_pos;
 	uint32_t uniform_size;
+	uint32_t batch_size;
 	uint32_t cur_size;
 	uint32_t entries;
 	unsigned field_size;
@@ -1790,21 +1908,25 @@ mp4_parser_parse_stsz_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	{
 	case 32:
 		cur_pos = atom_info->ptr + sizeof(stsz_atom_t) + context->first_chunk_frame_index * sizeof(uint32_t);
-		for (; first_frame_index_in_chunk; first_frame_index_in_chunk--, cur_pos += sizeof(uint32_t))
-		{
-			context->first_frame_chunk_offset += parse_be32(cur_pos);
-		}
-		for (; cur_frame < last_frame; cur_frame++)
+		context->first_frame_chunk_offset += read_array_be32_sum(cur_pos, first_frame_index_in_chunk);
+		cur_pos += first_frame_index_in_chunk * sizeof(uint32_t);
+
+		while (cur_frame < last_frame)
 		{
-			read_be32(cur_pos, cur_size);
+			batch_size = vod_min(last_frame - cur_frame, READ_ARRAY_BATCH_SIZE);
+			context->total_frames_size += read_array_be32(sizes, cur_pos, batch_size, &cur_size);
 			if (cur_size > MAX_FRAME_SIZE)
 			{
 				vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
 					"mp4_parser_parse_stsz_atom: frame size %uD too big", cur_size);
 				return VOD_BAD_DATA;
 			}
-			context->total_frames_size += cur_size;
-			cur_frame->size = cur_size;
+			cur_pos += batch_size * sizeof(uint32_t);
+
+			for (cur_size_pos = sizes; batch_size > 0; batch_size--, cur_frame++)
+			{
+				cur_frame->size = *cur_size_pos++;
+			}
 		}
 		break;
 
@@ -1850,6 +1972,76 @@ mp4_parser_parse_stsz_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_parser_parse_stss_atom_compact(atom_info_t* atom_info, frames_parse_context_t* context)
+{
+	const uint32_t* start_pos;
+	const uint32_t* cur_pos;
+	const uint32_t* end_pos;
+	uint32_t entries;
+	uint32_t frame_index;
+	u_char* bit;
+	u_char mask;
+	size_t size;
+	vod_status_t rc;
+
+	if (atom_info->size == 0 || context->frame_count <= 0)		// optional atom
+	{
+		return VOD_OK;
+	}
+
+	rc = mp4_parser_validate_stss_atom(context->request_context, atom_info, &entries);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	size = vod_div_ceil(context->frame_count, 8);
+	context->key_frames = vod_alloc(context->request_context->pool, size);
+	if (context->key_frames == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_parse_stss_atom_compact: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+	vod_memzero(context->key_frames, size);
+
+	start_pos = (const uint32_t*)(atom_info->ptr + sizeof(stss_atom_t));
+	end_pos = start_pos + entries;
+
+	if (context->stss_start_index == 0 && context->first_frame > 0)
+	{
+		context->stss_start_index = mp4_parser_find_stss_entry(context->first_frame, start_pos, entries);
+	}
+	cur_pos = start_pos + context->stss_start_index;
+	for (; cur_pos < end_pos; cur_pos++)
+	{
+		frame_index = parse_be32(cur_pos) - 1;		// 1 based index
+		if (frame_index < context->first_frame)
+		{
+			vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+				"mp4_parser_parse_stss_atom_compact: frame indexes are not strictly ascending");
+			return VOD_BAD_DATA;
+		}
+
+		if (frame_index >= context->last_frame)
+		{
+			break;
+		}
+
+		frame_index -= context->first_frame;
+		bit = &context->key_frames[frame_index >> 3];
+		mask = 1 << (frame_index & 7);
+		if ((*bit & mask) == 0)		// increment only once in case a frame is listed twice
+		{
+			*bit |= mask;
+			context->key_frame_count++;
+		}
+	}
+
+	return VOD_OK;
+}
+
 static vod_status_t 
 mp4_parser_parse_stss_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
@@ -1862,6 +2054,11 @@ mp4_parser_parse_stss_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	uint32_t frame_index;
 	vod_status_t rc;
 
+	if ((context->parse_params.parse_type & PARSE_FLAG_FRAMES_COMPACT) != 0)
+	{
+		return mp4_parser_parse_stss_atom_compact(atom_info, context);
+	}
+
 	for (; cur_frame < last_frame; cur_frame++)
 	{
 		cur_frame->key_frame = FALSE;
@@ -2633,6 +2830,7 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 	media_sequence_t* sequence;
 	uint32_t duration_millis;
 	uint32_t track_index;
+	uint32_t trak_index;
 	uint32_t bitrate;
 	bool_t extra_data_required;
 	vod_status_t rc;
@@ -2650,6 +2848,8 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 		return VOD_OK;
 	}
 
+	trak_index = context->trak_count++;
+
 	// find required trak atoms
 	vod_memzero(&trak_atom_infos, sizeof(trak_atom_infos));
 	save_atoms_context.relevant_atoms = relevant_atoms_trak;
@@ -2817,6 +3017,12 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 		return VOD_OK;
 	}
 
+	if (context->required_traks != NULL)
+	{
+		*context->required_traks |= (uint64_t)1 << trak_index;
+		return VOD_OK;
+	}
+
 	// parse the edit list
 	parse_type = context->parse_params.parse_type;
 
@@ -2972,6 +3178,8 @@ mp4_parser_parse_basic_metadata(
 	size_t metadata_part_count,
 	media_base_metadata_t** result)
 {
+	mp4_track_base_metadata_t* cur_track;
+	mp4_track_base_metadata_t* last_track;
 	process_moov_context_t context;
 	mp4_base_metadata_t* metadata;
 	vod_status_t rc;
@@ -2997,6 +3205,8 @@ mp4_parser_parse_basic_metadata(
 	vod_memzero(context.track_indexes, sizeof(context.track_indexes));
 	context.ftyp_atom = metadata_parts[MP4_METADATA_PART_FTYP];
 	context.result = metadata;
+	context.trak_count = 0;
+	context.required_traks = NULL;
 
 	rc = mp4_parser_parse_atoms(
 		request_context, 
@@ -3017,11 +3227,65 @@ mp4_parser_parse_basic_metadata(
 		return VOD_BAD_DATA;
 	}
 
+	vod_memcpy(metadata->base.file_track_count, context.track_indexes, sizeof(metadata->base.file_track_count));
+
+	// attach the sample index to the tracks
+	cur_track = (mp4_track_base_metadata_t*)metadata->base.tracks.elts;
+	last_track = cur_track + metadata->base.tracks.nelts;
+	for (; cur_track < last_track; cur_track++)
+	{
+		if (metadata_part_count <= MP4_METADATA_PART_SAMPLE_INDEX)
+		{
+			vod_memzero(&cur_track->sample_index, sizeof(cur_track->sample_index));
+			continue;
+		}
+
+		mp4_sample_index_get_trak(
+			&metadata_parts[MP4_METADATA_PART_SAMPLE_INDEX],
+			&metadata_parts[MP4_METADATA_PART_MOOV],
+			&cur_track->trak_atom_infos.stts,
+			&cur_track->trak_atom_infos.ctts,
+			&cur_track->trak_atom_infos.stsc,
+			&cur_track->sample_index);
+	}
+
 	*result = &metadata->base;
 
 	return VOD_OK;
 }
 
+vod_status_t
+mp4_parser_get_required_traks(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	vod_str_t* moov,
+	uint64_t* result)
+{
+	process_moov_context_t context;
+	mp4_base_metadata_t metadata;
+
+	vod_memzero(&metadata, sizeof(metadata));
+
+	context.request_context = request_context;
+	context.parse_params = *parse_params;
+	vod_memzero(context.track_indexes, sizeof(context.track_indexes));
+	context.ftyp_atom.data = NULL;
+	context.ftyp_atom.len = 0;
+	context.result = &metadata;
+	context.trak_count = 0;
+	context.required_traks = result;
+
+	*result = 0;
+
+	return mp4_parser_parse_atoms(
+		request_context,
+		moov->data,
+		moov->len,
+		TRUE,
+		&mp4_parser_process_moov_atom_callback,
+		&context);
+}
+
 static vod_status_t
 mp4_parser_copy_raw_atoms(request_context_t* request_context, raw_atom_t* dest, trak_atom_infos_t* source)
 {
@@ -3107,6 +3371,29 @@ mp4_parser_compare_tracks(const void *s1, const void *s2)
 	return track1->track_index - track2->track_index;
 }
 
+// converts the track to a timescale that is a multiple of its timescale, the result is identical
+//	to the per request rescale of the frames, since multiplying by an integer factor is exact
+static void
+mp4_parser_rescale_track(media_track_t* track, uint32_t factor)
+{
+	media_info_t* media_info = &track->media_info;
+
+	track->first_frame_time_offset *= factor;
+	track->total_frames_duration *= factor;
+	track->clip_from_frame_offset *= factor;
+
+	media_info->duration *= factor;
+	media_info->full_duration *= factor;
+	if (media_info->media_type == MEDIA_TYPE_VIDEO)
+	{
+		media_info->min_frame_duration *= factor;
+		media_info->u.video.initial_pts_delay *= factor;
+	}
+
+	media_info->timescale *= factor;
+	media_info->frames_timescale = media_info->timescale;
+}
+
 vod_status_t
 mp4_parser_parse_frames(
 	request_context_t* request_context,
@@ -3134,6 +3421,7 @@ mp4_parser_parse_frames(
 	vod_array_t tracks;
 	uint64_t last_offset;
 	uint32_t media_type;
+	uint32_t factor;
 
 	if (vod_array_init(&tracks, request_context->pool, 2, sizeof(media_track_t)) != VOD_OK)
 	{
@@ -3150,6 +3438,12 @@ mp4_parser_parse_frames(
 		parse_params->parse_type &= ~PARSE_FLAG_TOTAL_SIZE_ESTIMATE;
 	}
 
+	// the compact representation holds only durations and key frames
+	if ((parse_params->parse_type & (PARSE_FLAG_FRAMES_PTS_DELAY | PARSE_FLAG_FRAMES_SIZE | PARSE_FLAG_FRAMES_OFFSET)) != 0)
+	{
+		parse_params->parse_type &= ~PARSE_FLAG_FRAMES_COMPACT;
+	}
+
 	if (segmenter->align_to_key_frames)
 	{
 		// sort the streams - video first
@@ -3181,6 +3475,8 @@ mp4_parser_parse_frames(
 		vod_memzero((u_char*)&context + offsetof(frames_parse_context_t, stss_start_pos),
 			sizeof(context) - offsetof(frames_parse_context_t, stss_start_pos));
 
+		context.sample_index = &cur_track->sample_index;
+
 		if (cur_track == first_track &&
 			media_type == MEDIA_TYPE_VIDEO &&
 			cur_track->trak_atom_infos.stss.size != 0 &&
@@ -3300,10 +3596,25 @@ mp4_parser_parse_frames(
 		result_track->frames.next = NULL;
 		result_track->frames.frames_source = frames_source;
 		result_track->frames.frames_source_context = frames_source_context;
-		result_track->frames.first_frame = context.frames;
-		result_track->frames.last_frame = context.frames + context.frame_count;
 		result_track->frames.clip_to = context.clip_to;
 
+		if (context.runs != NULL)
+		{
+			result_track->frames.first_frame = NULL;
+			result_track->frames.last_frame = NULL;
+			result_track->compact_frames.first_run = context.runs;
+			result_track->compact_frames.last_run = context.runs + context.run_count;
+			result_track->compact_frames.key_frames = context.key_frames;
+			result_track->compact_frames.timescale = cur_track->media_info.timescale;
+			result_track->compact_frames.first_dts = context.first_frame_time_offset;
+		}
+		else
+		{
+			result_track->frames.first_frame = context.frames;
+			result_track->frames.last_frame = context.frames + context.frame_count;
+			vod_memzero(&result_track->compact_frames, sizeof(result_track->compact_frames));
+		}
+
 		// copy the result
 		result_track->media_info = cur_track->media_info;
 		result_track->encryption_info = context.encryption_info;
@@ -3345,11 +3656,29 @@ mp4_parser_parse_frames(
 		}
 
 		// add the dts_shift to the pts_delay
-		cur_frame = context.frames;
-		last_frame = cur_frame + context.frame_count;
-		for (; cur_frame < last_frame; cur_frame++)
+		cur_frame = result_track->frames.first_frame;
+		last_frame = result_track->frames.last_frame;
+		if (parse_params->output_timescale != 0 &&
+			context.runs == NULL &&
+			context.clip_to == UINT_MAX &&
+			parse_params->output_timescale % result_track->media_info.timescale == 0)
+		{
+			// convert the frames to the output timescale in the same pass, saves the caller from rescaling them
+			factor = parse_params->output_timescale / result_track->media_info.timescale;
+			for (; cur_frame < last_frame; cur_frame++)
+			{
+				cur_frame->duration *= factor;
+				cur_frame->pts_delay = (cur_frame->pts_delay + context.dts_shift) * factor;
+			}
+
+			mp4_parser_rescale_track(result_track, factor);
+		}
+		else
 		{
-			cur_frame->pts_delay += context.dts_shift;
+			for (; cur_frame < last_frame; cur_frame++)
+			{
+				cur_frame->pts_delay += context.dts_shift;
+			}
 		}
 
 		result->track_count[media_type]++;
@@ -3369,6 +3698,7 @@ mp4_parser_uncompress_moov(
 	size_t size,
 	size_t max_moov_size,
 	u_char** out_buffer,
+	size_t* out_buffer_size,
 	off_t* moov_offset,
 	size_t* moov_size)
 {
@@ -3438,6 +3768,12 @@ mp4_parser_uncompress_moov(
 	}
 
 	// uncompress to a new buffer
+	rc = vod_request_memory_add(request_context, alloc_size);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
 	uncomp_buffer = vod_alloc(request_context->pool, alloc_size);
 	if (uncomp_buffer == NULL)
 	{
@@ -3475,6 +3811,7 @@ mp4_parser_uncompress_moov(
 
 	// return the result
 	*out_buffer = uncomp_buffer;
+	*out_buffer_size = alloc_size;
 	*moov_offset = find_context.ptr - uncomp_buffer;
 	*moov_size = find_context.size;
 
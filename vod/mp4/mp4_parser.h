@@ -24,7 +24,8 @@ vod_status_t mp4_parser_uncompress_moov(
 	const u_char* buffer,
 	size_t size,
 	size_t max_moov_size,
-	u_char** out_buffer,
+	u_char** out_buffer,				// the buffer is accounted in the request memory
+	size_t* out_buffer_size,
 	off_t* moov_offset,
 	size_t* moov_size);
 
@@ -35,6 +36,14 @@ vod_status_t mp4_parser_parse_basic_metadata(
 	size_t metadata_part_count,
 	media_base_metadata_t** result);
 
+// returns a bit mask of the trak atoms (by their order in the moov atom) that are required by the parse params,
+//	the moov atom must not contain more than 64 trak atoms
+vod_status_t mp4_parser_get_required_traks(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	vod_str_t* moov,
+	uint64_t* result);
+
 vod_status_t mp4_parser_parse_frames(
 	request_context_t* request_context,
 	media_base_metadata_t* base,
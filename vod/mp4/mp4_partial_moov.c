@@ -0,0 +1,693 @@
+#include "mp4_partial_moov.h"
+#include "mp4_parser.h"
+#include "../read_stream.h"
+#include "../write_stream.h"
+
+/*
+	Reads only the parts of the moov atom that are required by the request.
+
+	The children of the moov atom are walked one by one, the atoms that are not included in the
+	previous read are probed with a small read. A trak atom that was not read in full is replaced by
+	a stub that ends with its stsd atom - the stub holds the atoms that identify the track (tkhd, mdhd,
+	hdlr, stsd), and the sizes of the atoms that enclose the stsd (trak, mdia, minf, stbl) are updated.
+	Once all the children were walked, the parser is run on a moov made of the stubs, in order to find
+	the required trak atoms, and these are read in full (adjacent trak atoms are read together).
+
+	The generated moov keeps the order of the trak atoms, so that the parser assigns the same track
+	indexes as it would on the original moov. Only mvhd and trak atoms are kept - compressed (cmov) and
+	fragmented (mvex) moov atoms are read in full.
+*/
+
+// constants
+#define PARTIAL_MOOV_PROBE_SIZE (4096)
+#define PARTIAL_MOOV_MAX_TRAKS (64)
+
+#define STUB_FOUND_TKHD (0x01)
+#define STUB_FOUND_MDHD (0x02)
+#define STUB_FOUND_HDLR (0x04)
+#define STUB_FOUND_ALL (STUB_FOUND_TKHD | STUB_FOUND_MDHD | STUB_FOUND_HDLR)
+
+// typedefs
+typedef struct {
+	uint64_t offset;		// file offset
+	uint64_t size;
+	vod_str_t data;			// the whole atom, or the stub of a trak atom
+	bool_t is_trak;
+	bool_t full;
+	bool_t required;
+} mp4_partial_moov_atom_t;
+
+typedef struct {
+	request_context_t* request_context;
+	media_parse_params_t* parse_params;
+	uint64_t moov_size;
+	uint64_t cur_offset;
+	uint64_t end_offset;
+	uint64_t read_offset;		// the last read request
+	size_t read_size;
+	vod_array_t atoms;			// mp4_partial_moov_atom_t
+	uint32_t trak_count;
+	vod_uint_t fetch_start;
+	vod_uint_t fetch_end;
+	bool_t walk_done;
+} mp4_partial_moov_state_t;
+
+typedef struct {
+	uint64_t offsets[4];		// trak, mdia, minf, stbl
+	uint8_t header_sizes[4];
+	uint64_t size;
+} mp4_partial_moov_stub_t;
+
+// globals
+static const atom_name_t stub_path[] = {
+	ATOM_NAME_TRAK,
+	ATOM_NAME_MDIA,
+	ATOM_NAME_MINF,
+	ATOM_NAME_STBL,
+	ATOM_NAME_STSD,
+};
+
+vod_status_t
+mp4_partial_moov_init(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	uint64_t moov_offset,
+	uint64_t moov_size,
+	void** result)
+{
+	mp4_partial_moov_state_t* state;
+
+	state = vod_alloc(request_context->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_partial_moov_init: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	if (vod_array_init(&state->atoms, request_context->pool, 8, sizeof(mp4_partial_moov_atom_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_partial_moov_init: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->request_context = request_context;
+	state->parse_params = parse_params;
+	state->moov_size = moov_size;
+	state->cur_offset = moov_offset;
+	state->end_offset = moov_offset + moov_size;
+	state->read_offset = ULLONG_MAX;
+	state->read_size = 0;
+	state->trak_count = 0;
+	state->fetch_start = 0;
+	state->fetch_end = 0;
+	state->walk_done = FALSE;
+
+	*result = state;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_partial_moov_parse_header(
+	const u_char* p,
+	uint64_t avail,
+	uint64_t* atom_size,
+	atom_name_t* name,
+	uint8_t* header_size)
+{
+	uint32_t size;
+
+	if (avail < ATOM_HEADER_SIZE)
+	{
+		return VOD_AGAIN;
+	}
+
+	read_be32(p, size);
+	read_le32(p, *name);
+
+	if (size == 1)
+	{
+		if (avail < ATOM_HEADER64_SIZE)
+		{
+			return VOD_AGAIN;
+		}
+
+		read_be64(p, *atom_size);
+		*header_size = ATOM_HEADER64_SIZE;
+	}
+	else
+	{
+		*atom_size = size;
+		*header_size = ATOM_HEADER_SIZE;
+	}
+
+	// Note: atoms that extend till the end of their parent (size 0) are not supported
+	if (*atom_size < *header_size)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	return VOD_OK;
+}
+
+// finds the stsd atom of a trak atom and the atoms that enclose it,
+//	returns VOD_NOT_FOUND if the stub cannot be located using the available data
+static vod_status_t
+mp4_partial_moov_get_stub(
+	const u_char* trak,
+	uint64_t avail,
+	uint64_t trak_size,
+	mp4_partial_moov_stub_t* stub)
+{
+	uint64_t container_end;
+	uint64_t atom_size;
+	uint64_t pos;
+	atom_name_t name;
+	uint32_t found;
+	uint8_t header_size;
+	unsigned level;
+
+	pos = 0;
+	container_end = trak_size;
+	level = 0;
+	found = 0;
+
+	while (pos < container_end)
+	{
+		if (mp4_partial_moov_parse_header(
+			trak + pos,
+			pos < avail ? avail - pos : 0,
+			&atom_size,
+			&name,
+			&header_size) != VOD_OK)
+		{
+			return VOD_NOT_FOUND;
+		}
+
+		if (atom_size > container_end - pos)
+		{
+			return VOD_NOT_FOUND;
+		}
+
+		if (name == stub_path[level])
+		{
+			if (level == vod_array_entries(stub_path) - 1)
+			{
+				// stsd - the parser requires the other atoms in order to identify the track
+				if (found != STUB_FOUND_ALL)
+				{
+					return VOD_NOT_FOUND;
+				}
+
+				stub->size = pos + atom_size;
+				return VOD_OK;
+			}
+
+			stub->offsets[level] = pos;
+			stub->header_sizes[level] = header_size;
+			container_end = pos + atom_size;
+			pos += header_size;
+			level++;
+			continue;
+		}
+
+		switch (name)
+		{
+		case ATOM_NAME_TKHD:
+			if (level == 1)
+			{
+				found |= STUB_FOUND_TKHD;
+			}
+			break;
+
+		case ATOM_NAME_MDHD:
+			if (level == 2)
+			{
+				found |= STUB_FOUND_MDHD;
+			}
+			break;
+
+		case ATOM_NAME_HDLR:
+			if (level == 2)
+			{
+				found |= STUB_FOUND_HDLR;
+			}
+			break;
+		}
+
+		pos += atom_size;
+	}
+
+	return VOD_NOT_FOUND;
+}
+
+// truncates the atoms that enclose the stsd atom, so that the stub ends with the stsd atom
+static void
+mp4_partial_moov_truncate_stub(u_char* data, mp4_partial_moov_stub_t* stub)
+{
+	uint64_t size;
+	unsigned level;
+	u_char* p;
+
+	for (level = 0; level < vod_array_entries(stub->offsets); level++)
+	{
+		p = data + stub->offsets[level];
+		size = stub->size - stub->offsets[level];
+
+		if (stub->header_sizes[level] == ATOM_HEADER64_SIZE)
+		{
+			p += ATOM_HEADER_SIZE;
+			write_be64(p, size);
+		}
+		else
+		{
+			write_be32(p, size);
+		}
+	}
+}
+
+static vod_status_t
+mp4_partial_moov_add_atom(
+	mp4_partial_moov_state_t* state,
+	bool_t is_trak,
+	uint64_t atom_size,
+	const u_char* data,
+	size_t data_size,
+	mp4_partial_moov_atom_t** result)
+{
+	mp4_partial_moov_atom_t* atom;
+
+	atom = vod_array_push(&state->atoms);
+	if (atom == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_partial_moov_add_atom: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	atom->data.data = vod_alloc(state->request_context->pool, data_size);
+	if (atom->data.data == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_partial_moov_add_atom: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memcpy(atom->data.data, data, data_size);
+	atom->data.len = data_size;
+	atom->offset = state->cur_offset;
+	atom->size = atom_size;
+	atom->is_trak = is_trak;
+	atom->full = data_size == atom_size;
+	atom->required = FALSE;
+
+	if (is_trak)
+	{
+		state->trak_count++;
+	}
+
+	*result = atom;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_partial_moov_read_request(
+	mp4_partial_moov_state_t* state,
+	uint64_t offset,
+	size_t size,
+	media_format_read_request_t* read_req)
+{
+	if (offset == state->read_offset && size <= state->read_size)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_partial_moov_read_request: read of %uz bytes at offset %uL returned less data than expected",
+			size, offset);
+		return VOD_BAD_DATA;
+	}
+
+	state->read_offset = offset;
+	state->read_size = size;
+
+	read_req->read_offset = offset;
+	read_req->read_size = size;
+	read_req->flags = 0;
+
+	return VOD_AGAIN;
+}
+
+static vod_status_t
+mp4_partial_moov_walk(
+	mp4_partial_moov_state_t* state,
+	uint64_t offset,
+	vod_str_t* buffer,
+	media_format_read_request_t* read_req)
+{
+	mp4_partial_moov_atom_t* atom;
+	mp4_partial_moov_stub_t stub;
+	const u_char* p;
+	uint64_t atom_size;
+	uint64_t read_size;
+	uint64_t avail;
+	atom_name_t name;
+	uint8_t header_size;
+	vod_status_t rc;
+
+	while (state->cur_offset < state->end_offset)
+	{
+		if (state->cur_offset >= offset && state->cur_offset < offset + buffer->len)
+		{
+			p = buffer->data + (state->cur_offset - offset);
+			avail = vod_min(offset + buffer->len, state->end_offset) - state->cur_offset;
+		}
+		else
+		{
+			p = NULL;
+			avail = 0;
+		}
+
+		rc = mp4_partial_moov_parse_header(p, avail, &atom_size, &name, &header_size);
+		switch (rc)
+		{
+		case VOD_OK:
+			break;
+
+		case VOD_AGAIN:
+			read_size = 0;
+			goto read;
+
+		default:
+			vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mp4_partial_moov_walk: unsupported atom size at offset %uL, reading the whole moov", state->cur_offset);
+			return VOD_NOT_FOUND;
+		}
+
+		if (atom_size > state->end_offset - state->cur_offset)
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"mp4_partial_moov_walk: atom size %uL overflows the moov atom", atom_size);
+			return VOD_BAD_DATA;
+		}
+
+		switch (name)
+		{
+		case ATOM_NAME_CMOV:
+		case ATOM_NAME_MVEX:
+			vod_log_debug2(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mp4_partial_moov_walk: found %*s atom, reading the whole moov", (size_t)sizeof(name), (char*)&name);
+			return VOD_NOT_FOUND;
+
+		case ATOM_NAME_MVHD:
+			if (avail < atom_size)
+			{
+				read_size = atom_size;
+				goto read;
+			}
+
+			rc = mp4_partial_moov_add_atom(state, FALSE, atom_size, p, atom_size, &atom);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+			break;
+
+		case ATOM_NAME_TRAK:
+			if (state->trak_count >= PARTIAL_MOOV_MAX_TRAKS)
+			{
+				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+					"mp4_partial_moov_walk: trak count exceeds the limit, reading the whole moov");
+				return VOD_NOT_FOUND;
+			}
+
+			if (avail >= atom_size)
+			{
+				rc = mp4_partial_moov_add_atom(state, TRUE, atom_size, p, atom_size, &atom);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+				break;
+			}
+
+			if (mp4_partial_moov_get_stub(p, avail, atom_size, &stub) == VOD_OK)
+			{
+				if (stub.size > avail)
+				{
+					read_size = stub.size;
+					goto read;
+				}
+
+				rc = mp4_partial_moov_add_atom(state, TRUE, atom_size, p, stub.size, &atom);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+
+				mp4_partial_moov_truncate_stub(atom->data.data, &stub);
+				break;
+			}
+
+			if (avail < vod_min(atom_size, PARTIAL_MOOV_PROBE_SIZE))
+			{
+				read_size = 0;
+				goto read;
+			}
+
+			// the probe does not contain the atoms that identify the track, read the whole trak
+			read_size = atom_size;
+			goto read;
+		}
+
+		state->cur_offset += atom_size;
+	}
+
+	return VOD_OK;
+
+read:
+
+	read_size = vod_max(read_size, PARTIAL_MOOV_PROBE_SIZE);
+	read_size = vod_min(read_size, state->end_offset - state->cur_offset);
+
+	return mp4_partial_moov_read_request(state, state->cur_offset, read_size, read_req);
+}
+
+static vod_status_t
+mp4_partial_moov_build(mp4_partial_moov_state_t* state, vod_str_t* result)
+{
+	mp4_partial_moov_atom_t* cur_atom;
+	mp4_partial_moov_atom_t* last_atom;
+	size_t size;
+	u_char* p;
+
+	cur_atom = state->atoms.elts;
+	last_atom = cur_atom + state->atoms.nelts;
+
+	size = 0;
+	for (; cur_atom < last_atom; cur_atom++)
+	{
+		size += cur_atom->data.len;
+	}
+
+	p = vod_alloc(state->request_context->pool, size);
+	if (p == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_partial_moov_build: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->data = p;
+	result->len = size;
+
+	for (cur_atom = state->atoms.elts; cur_atom < last_atom; cur_atom++)
+	{
+		p = vod_copy(p, cur_atom->data.data, cur_atom->data.len);
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_partial_moov_set_required(mp4_partial_moov_state_t* state)
+{
+	mp4_partial_moov_atom_t* cur_atom;
+	mp4_partial_moov_atom_t* last_atom;
+	uint64_t required_traks;
+	uint32_t trak_index;
+	vod_str_t moov;
+	vod_status_t rc;
+
+	rc = mp4_partial_moov_build(state, &moov);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	rc = mp4_parser_get_required_traks(
+		state->request_context,
+		state->parse_params,
+		&moov,
+		&required_traks);
+	if (rc != VOD_OK)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_partial_moov_set_required: mp4_parser_get_required_traks failed %i", rc);
+		return rc;
+	}
+
+	cur_atom = state->atoms.elts;
+	last_atom = cur_atom + state->atoms.nelts;
+	trak_index = 0;
+
+	for (; cur_atom < last_atom; cur_atom++)
+	{
+		if (!cur_atom->is_trak)
+		{
+			continue;
+		}
+
+		cur_atom->required = (required_traks & ((uint64_t)1 << trak_index)) != 0;
+		trak_index++;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_partial_moov_fetch_next(
+	mp4_partial_moov_state_t* state,
+	media_format_read_request_t* read_req)
+{
+	mp4_partial_moov_atom_t* atoms = state->atoms.elts;
+	vod_uint_t count = state->atoms.nelts;
+	vod_uint_t start;
+	vod_uint_t end;
+
+	for (start = state->fetch_end; start < count; start++)
+	{
+		if (atoms[start].required && !atoms[start].full)
+		{
+			break;
+		}
+	}
+
+	if (start >= count)
+	{
+		return VOD_OK;
+	}
+
+	// adjacent trak atoms are read together
+	for (end = start + 1; end < count; end++)
+	{
+		if (!atoms[end].required ||
+			atoms[end].full ||
+			atoms[end].offset != atoms[end - 1].offset + atoms[end - 1].size)
+		{
+			break;
+		}
+	}
+
+	state->fetch_start = start;
+	state->fetch_end = end;
+
+	return mp4_partial_moov_read_request(
+		state,
+		atoms[start].offset,
+		atoms[end - 1].offset + atoms[end - 1].size - atoms[start].offset,
+		read_req);
+}
+
+static vod_status_t
+mp4_partial_moov_save_fetched(
+	mp4_partial_moov_state_t* state,
+	uint64_t offset,
+	vod_str_t* buffer)
+{
+	mp4_partial_moov_atom_t* cur_atom;
+	mp4_partial_moov_atom_t* last_atom;
+
+	cur_atom = (mp4_partial_moov_atom_t*)state->atoms.elts + state->fetch_start;
+	last_atom = (mp4_partial_moov_atom_t*)state->atoms.elts + state->fetch_end;
+
+	for (; cur_atom < last_atom; cur_atom++)
+	{
+		if (cur_atom->offset < offset ||
+			cur_atom->offset + cur_atom->size > offset + buffer->len)
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"mp4_partial_moov_save_fetched: trak atom at offset %uL was not read", cur_atom->offset);
+			return VOD_BAD_DATA;
+		}
+
+		cur_atom->data.data = vod_alloc(state->request_context->pool, cur_atom->size);
+		if (cur_atom->data.data == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mp4_partial_moov_save_fetched: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		vod_memcpy(cur_atom->data.data, buffer->data + (cur_atom->offset - offset), cur_atom->size);
+		cur_atom->data.len = cur_atom->size;
+		cur_atom->full = TRUE;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_partial_moov_read(
+	void* ctx,
+	uint64_t offset,
+	vod_str_t* buffer,
+	media_format_read_request_t* read_req,
+	vod_str_t* moov)
+{
+	mp4_partial_moov_state_t* state = ctx;
+	vod_status_t rc;
+
+	if (!state->walk_done)
+	{
+		rc = mp4_partial_moov_walk(state, offset, buffer, read_req);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		rc = mp4_partial_moov_set_required(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		state->walk_done = TRUE;
+	}
+	else
+	{
+		rc = mp4_partial_moov_save_fetched(state, offset, buffer);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	rc = mp4_partial_moov_fetch_next(state, read_req);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	rc = mp4_partial_moov_build(state, moov);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+		"mp4_partial_moov_read: generated moov of size %uz, original size %uL",
+		moov->len, state->moov_size);
+
+	return VOD_OK;
+}
@@ -0,0 +1,23 @@
+#ifndef __MP4_PARTIAL_MOOV_H__
+#define __MP4_PARTIAL_MOOV_H__
+
+// includes
+#include "../media_format.h"
+
+// functions
+vod_status_t mp4_partial_moov_init(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	uint64_t moov_offset,			// the offset of the data of the moov atom (following its header)
+	uint64_t moov_size,
+	void** result);
+
+// returns VOD_NOT_FOUND when the moov atom should be read in full
+vod_status_t mp4_partial_moov_read(
+	void* ctx,
+	uint64_t offset,
+	vod_str_t* buffer,
+	media_format_read_request_t* read_req,
+	vod_str_t* moov);
+
+#endif //__MP4_PARTIAL_MOOV_H__
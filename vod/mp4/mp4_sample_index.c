@@ -0,0 +1,443 @@
+#include "mp4_sample_index.h"
+#include "mp4_format.h"
+#include "mp4_defs.h"
+#include "../read_stream.h"
+#include "../write_stream.h"
+
+/*
+	The sample index holds checkpoints into the stts, ctts and stsc atoms of the moov, one for every
+	MP4_SAMPLE_INDEX_INTERVAL entries. It is saved to the metadata cache alongside the moov atom, and
+	allows the frames parser to jump directly to the entry that contains the requested position,
+	instead of walking the tables from the beginning.
+
+	The index is bound to the moov atom it was built from, the moov size is saved in the header and it
+	is ignored if it does not match.
+*/
+
+// constants
+#define MP4_SAMPLE_INDEX_MAGIC (0x78697376)		// vsix
+#define MP4_SAMPLE_INDEX_INTERVAL (256)
+
+// typedefs
+typedef struct {
+	u_char magic[4];
+	u_char moov_size[4];
+	u_char atom_count[4];
+	u_char reserved[4];
+} mp4_sample_index_header_t;
+
+typedef struct {
+	u_char atom_offset[4];		// offset of the atom data within the moov atom
+	u_char entry_count[4];
+} mp4_sample_index_atom_t;
+
+typedef struct {
+	request_context_t* request_context;
+	const u_char* moov_start;
+	u_char* p;
+	uint32_t atom_count;
+} mp4_sample_index_build_context_t;
+
+// implementation
+static u_char*
+mp4_sample_index_write_entry(u_char* p, uint32_t entry_index, uint32_t frame_index, uint64_t value)
+{
+	write_be32(p, entry_index);
+	write_be32(p, frame_index);
+	write_be64(p, value);
+	return p;
+}
+
+static u_char*
+mp4_sample_index_build_stts(mp4_sample_index_build_context_t* context, atom_info_t* atom_info, u_char* p)
+{
+	const stts_entry_t* cur_entry;
+	uint64_t duration = 0;
+	uint32_t frame_index = 0;
+	uint32_t entry_index;
+	uint32_t entries;
+	uint32_t count;
+
+	if (mp4_parser_validate_stts_data(context->request_context, atom_info, &entries) != VOD_OK)
+	{
+		return p;
+	}
+
+	cur_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	for (entry_index = 0; entry_index < entries; entry_index++, cur_entry++)
+	{
+		if (entry_index > 0 && entry_index % MP4_SAMPLE_INDEX_INTERVAL == 0)
+		{
+			p = mp4_sample_index_write_entry(p, entry_index, frame_index, duration);
+		}
+
+		count = parse_be32(cur_entry->count);
+		if (count > UINT_MAX - frame_index)
+		{
+			break;
+		}
+
+		frame_index += count;
+		duration += (uint64_t)count * parse_be32(cur_entry->duration);
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_sample_index_build_ctts(mp4_sample_index_build_context_t* context, atom_info_t* atom_info, u_char* p)
+{
+	const ctts_entry_t* cur_entry;
+	uint32_t frame_index = 0;
+	uint32_t entry_index;
+	uint32_t dts_shift = 0;
+	uint32_t entries;
+	uint32_t count;
+	int32_t sample_duration;
+
+	if (mp4_parser_validate_ctts_atom(context->request_context, atom_info, &entries) != VOD_OK)
+	{
+		return p;
+	}
+
+	cur_entry = (const ctts_entry_t*)(atom_info->ptr + sizeof(ctts_atom_t));
+	for (entry_index = 0; entry_index < entries; entry_index++, cur_entry++)
+	{
+		if (entry_index > 0 && entry_index % MP4_SAMPLE_INDEX_INTERVAL == 0)
+		{
+			p = mp4_sample_index_write_entry(p, entry_index, frame_index, dts_shift);
+		}
+
+		count = parse_be32(cur_entry->count);
+		if (count > UINT_MAX - frame_index)
+		{
+			break;
+		}
+
+		frame_index += count;
+
+		sample_duration = parse_be32(cur_entry->duration);
+		if (sample_duration < 0 && (uint32_t)-sample_duration > dts_shift)
+		{
+			dts_shift = (uint32_t)-sample_duration;
+		}
+	}
+
+	return p;
+}
+
+static u_char*
+mp4_sample_index_build_stsc(mp4_sample_index_build_context_t* context, atom_info_t* atom_info, u_char* p)
+{
+	const stsc_entry_t* cur_entry;
+	uint64_t cur_entry_samples;
+	uint32_t samples_per_chunk;
+	uint32_t frame_index = 0;
+	uint32_t entry_index;
+	uint32_t next_chunk;
+	uint32_t cur_chunk;
+	uint32_t entries;
+
+	if (mp4_parser_validate_stsc_atom(context->request_context, atom_info, &entries) != VOD_OK ||
+		entries == 0)
+	{
+		return p;
+	}
+
+	cur_entry = (const stsc_entry_t*)(atom_info->ptr + sizeof(stsc_atom_t));
+	next_chunk = parse_be32(cur_entry->first_chunk);
+	if (next_chunk != 1)
+	{
+		return p;
+	}
+
+	// Note: the last entry is never indexed, since its number of samples is unknown
+	for (entry_index = 0; entry_index + 1 < entries; entry_index++, cur_entry++)
+	{
+		if (entry_index > 0 && entry_index % MP4_SAMPLE_INDEX_INTERVAL == 0)
+		{
+			p = mp4_sample_index_write_entry(p, entry_index, frame_index, next_chunk);
+		}
+
+		cur_chunk = next_chunk;
+		next_chunk = parse_be32(cur_entry[1].first_chunk);
+		samples_per_chunk = parse_be32(cur_entry->samples_per_chunk);
+		if (next_chunk <= cur_chunk || samples_per_chunk == 0)
+		{
+			break;
+		}
+
+		cur_entry_samples = (uint64_t)(next_chunk - cur_chunk) * samples_per_chunk;
+		if (cur_entry_samples > UINT_MAX - frame_index)
+		{
+			break;
+		}
+
+		frame_index += cur_entry_samples;
+	}
+
+	return p;
+}
+
+static vod_status_t
+mp4_sample_index_build_callback(void* ctx, atom_info_t* atom_info)
+{
+	mp4_sample_index_build_context_t* context = ctx;
+	mp4_sample_index_atom_t* atom;
+	u_char* entries_start;
+	u_char* p;
+	uint32_t entry_count;
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_TRAK:
+	case ATOM_NAME_MDIA:
+	case ATOM_NAME_MINF:
+	case ATOM_NAME_STBL:
+		return mp4_parser_parse_atoms(
+			context->request_context,
+			atom_info->ptr,
+			atom_info->size,
+			TRUE,
+			mp4_sample_index_build_callback,
+			context);
+
+	case ATOM_NAME_STTS:
+	case ATOM_NAME_CTTS:
+	case ATOM_NAME_STSC:
+		break;
+
+	default:
+		return VOD_OK;
+	}
+
+	atom = (mp4_sample_index_atom_t*)context->p;
+	entries_start = (u_char*)(atom + 1);
+
+	switch (atom_info->name)
+	{
+	case ATOM_NAME_STTS:
+		p = mp4_sample_index_build_stts(context, atom_info, entries_start);
+		break;
+
+	case ATOM_NAME_CTTS:
+		p = mp4_sample_index_build_ctts(context, atom_info, entries_start);
+		break;
+
+	default:		// ATOM_NAME_STSC
+		p = mp4_sample_index_build_stsc(context, atom_info, entries_start);
+		break;
+	}
+
+	entry_count = (p - entries_start) / sizeof(mp4_sample_index_entry_t);
+	if (entry_count == 0)
+	{
+		return VOD_OK;
+	}
+
+	p = atom->atom_offset;
+	write_be32(p, atom_info->ptr - context->moov_start);
+	write_be32(p, entry_count);
+
+	context->p = entries_start + entry_count * sizeof(mp4_sample_index_entry_t);
+	context->atom_count++;
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_sample_index_build(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	mp4_sample_index_build_context_t context;
+	mp4_sample_index_header_t* header;
+	vod_str_t* moov = &metadata_parts[MP4_METADATA_PART_MOOV];
+	vod_status_t rc;
+	size_t alloc_size;
+	u_char* p;
+
+	// Note: an indexed atom has more than MP4_SAMPLE_INDEX_INTERVAL entries of at least 8 bytes,
+	//		so its index is at most a quarter of its size
+	alloc_size = sizeof(*header) + moov->len / 4;
+
+	header = vod_alloc(request_context->pool, alloc_size);
+	if (header == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_sample_index_build: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	context.request_context = request_context;
+	context.moov_start = moov->data;
+	context.p = (u_char*)(header + 1);
+	context.atom_count = 0;
+
+	rc = mp4_parser_parse_atoms(
+		request_context,
+		moov->data,
+		moov->len,
+		TRUE,
+		mp4_sample_index_build_callback,
+		&context);
+	if (rc != VOD_OK)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_sample_index_build: mp4_parser_parse_atoms failed %i", rc);
+		return rc;
+	}
+
+	p = header->magic;
+	write_be32(p, MP4_SAMPLE_INDEX_MAGIC);
+	write_be32(p, moov->len);
+	write_be32(p, context.atom_count);
+	write_be32(p, 0);
+
+	result->data = (u_char*)header;
+	result->len = context.p - (u_char*)header;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_sample_index_build: indexed %uD atoms, size %uz", context.atom_count, result->len);
+
+	return VOD_OK;
+}
+
+void
+mp4_sample_index_get_trak(
+	vod_str_t* index,
+	vod_str_t* moov,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc,
+	mp4_trak_sample_index_t* result)
+{
+	const mp4_sample_index_header_t* header;
+	const mp4_sample_index_atom_t* atom;
+	mp4_sample_index_t* target;
+	const u_char* end;
+	uint32_t atom_count;
+	uint32_t entry_count;
+	size_t atom_offset;
+
+	vod_memzero(result, sizeof(*result));
+
+	if (index->len < sizeof(*header))
+	{
+		return;
+	}
+
+	header = (const mp4_sample_index_header_t*)index->data;
+	if (parse_be32(header->magic) != MP4_SAMPLE_INDEX_MAGIC ||
+		parse_be32(header->moov_size) != moov->len)
+	{
+		return;
+	}
+
+	end = index->data + index->len;
+	atom = (const mp4_sample_index_atom_t*)(header + 1);
+
+	for (atom_count = parse_be32(header->atom_count); atom_count > 0; atom_count--)
+	{
+		if ((size_t)(end - (const u_char*)atom) < sizeof(*atom))
+		{
+			return;
+		}
+
+		entry_count = parse_be32(atom->entry_count);
+		if ((size_t)(end - (const u_char*)(atom + 1)) / sizeof(mp4_sample_index_entry_t) < entry_count)
+		{
+			return;
+		}
+
+		atom_offset = parse_be32(atom->atom_offset);
+		if (stts->ptr != NULL && atom_offset == (size_t)(stts->ptr - moov->data))
+		{
+			target = &result->stts;
+		}
+		else if (ctts->ptr != NULL && atom_offset == (size_t)(ctts->ptr - moov->data))
+		{
+			target = &result->ctts;
+		}
+		else if (stsc->ptr != NULL && atom_offset == (size_t)(stsc->ptr - moov->data))
+		{
+			target = &result->stsc;
+		}
+		else
+		{
+			target = NULL;
+		}
+
+		if (target != NULL)
+		{
+			target->first = (const mp4_sample_index_entry_t*)(atom + 1);
+			target->count = entry_count;
+		}
+
+		atom = (const mp4_sample_index_atom_t*)((const mp4_sample_index_entry_t*)(atom + 1) + entry_count);
+	}
+}
+
+const mp4_sample_index_entry_t*
+mp4_sample_index_find_frame(
+	mp4_sample_index_t* index,
+	uint32_t frame_index)
+{
+	uint32_t left = 0;
+	uint32_t right = index->count;
+	uint32_t mid;
+
+	// find the first entry whose frame index is larger than frame_index
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (parse_be32(index->first[mid].frame_index) <= frame_index)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left == 0)
+	{
+		return NULL;
+	}
+
+	return &index->first[left - 1];
+}
+
+const mp4_sample_index_entry_t*
+mp4_sample_index_find_value(
+	mp4_sample_index_t* index,
+	uint64_t value)
+{
+	uint32_t left = 0;
+	uint32_t right = index->count;
+	uint32_t mid;
+
+	// find the first entry whose value is larger than or equal to value
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (parse_be64(index->first[mid].value) < value)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left == 0)
+	{
+		return NULL;
+	}
+
+	return &index->first[left - 1];
+}
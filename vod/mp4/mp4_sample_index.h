@@ -0,0 +1,52 @@
+#ifndef __MP4_SAMPLE_INDEX_H__
+#define __MP4_SAMPLE_INDEX_H__
+
+// includes
+#include "mp4_parser_base.h"
+
+// typedefs
+typedef struct {
+	u_char entry_index[4];		// index of the stts / ctts / stsc entry
+	u_char frame_index[4];		// index of the first frame of the entry
+	u_char value[8];			// stts - total duration of the preceding entries, 
+								// ctts - max negative offset of the preceding entries,
+								// stsc - first chunk of the entry
+} mp4_sample_index_entry_t;
+
+typedef struct {
+	const mp4_sample_index_entry_t* first;
+	uint32_t count;
+} mp4_sample_index_t;
+
+typedef struct {
+	mp4_sample_index_t stts;
+	mp4_sample_index_t ctts;
+	mp4_sample_index_t stsc;
+} mp4_trak_sample_index_t;
+
+// functions
+vod_status_t mp4_sample_index_build(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result);
+
+void mp4_sample_index_get_trak(
+	vod_str_t* index,
+	vod_str_t* moov,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc,
+	mp4_trak_sample_index_t* result);
+
+// returns the last index entry whose frame index is smaller than or equal to frame_index
+const mp4_sample_index_entry_t* mp4_sample_index_find_frame(
+	mp4_sample_index_t* index,
+	uint32_t frame_index);
+
+// returns the last index entry whose value is smaller than value
+const mp4_sample_index_entry_t* mp4_sample_index_find_value(
+	mp4_sample_index_t* index,
+	uint64_t value);
+
+#endif //__MP4_SAMPLE_INDEX_H__
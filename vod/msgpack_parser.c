@@ -0,0 +1,890 @@
+#include "msgpack_parser.h"
+
+// constants
+#define MAX_MSGPACK_ELEMENTS (524288)
+#define MAX_RECURSION_DEPTH (32)
+#define FRACTION_DENOM (1000000)
+#define MAX_FRACTION_VALUE (9.2e12)
+
+// macros
+#define CHECK_SIZE(state, size)										\
+	if ((size_t)((state)->end_pos - (state)->cur_pos) < (size))		\
+	{																\
+		vod_snprintf((state)->error, (state)->error_size, "unexpected end of data%Z"); \
+		return VOD_JSON_BAD_DATA;									\
+	}
+
+// typedefs
+typedef struct {
+	vod_pool_t* pool;
+	u_char* cur_pos;
+	u_char* end_pos;
+	int depth;
+	u_char* error;
+	size_t error_size;
+} vod_msgpack_parser_state_t;
+
+// forward declarations
+static vod_json_status_t vod_msgpack_parse_value(vod_msgpack_parser_state_t* state, vod_json_value_t* result);
+
+// globals
+static size_t vod_msgpack_type_size[] = {
+	0,									// VOD_JSON_NULL - not allowed in arrays
+	sizeof(bool_t),						// VOD_JSON_BOOL
+	sizeof(int64_t),					// VOD_JSON_INT
+	sizeof(vod_json_fraction_t),		// VOD_JSON_FRAC
+	sizeof(vod_str_t),					// VOD_JSON_STRING
+	sizeof(vod_json_array_t),			// VOD_JSON_ARRAY
+	sizeof(vod_json_object_t),			// VOD_JSON_OBJECT
+};
+
+static int
+vod_msgpack_get_type(u_char c)
+{
+	if (c <= 0x7f || c >= 0xe0 || (c >= 0xcc && c <= 0xd3))
+	{
+		return VOD_JSON_INT;
+	}
+
+	if (c <= 0x8f || c == 0xde || c == 0xdf)
+	{
+		return VOD_JSON_OBJECT;
+	}
+
+	if (c <= 0x9f || c == 0xdc || c == 0xdd)
+	{
+		return VOD_JSON_ARRAY;
+	}
+
+	if (c <= 0xbf || (c >= 0xd9 && c <= 0xdb))
+	{
+		return VOD_JSON_STRING;
+	}
+
+	switch (c)
+	{
+	case 0xc2:
+	case 0xc3:
+		return VOD_JSON_BOOL;
+
+	case 0xca:
+	case 0xcb:
+		return VOD_JSON_FRAC;
+	}
+
+	return VOD_JSON_NULL;
+}
+
+static uint64_t
+vod_msgpack_read_be(u_char* p, size_t size)
+{
+	uint64_t result = 0;
+
+	for (; size > 0; size--, p++)
+	{
+		result = (result << 8) | *p;
+	}
+
+	return result;
+}
+
+static vod_json_status_t
+vod_msgpack_read_length(vod_msgpack_parser_state_t* state, size_t size, size_t* result)
+{
+	CHECK_SIZE(state, size);
+
+	*result = vod_msgpack_read_be(state->cur_pos, size);
+	state->cur_pos += size;
+
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_int(vod_msgpack_parser_state_t* state, int64_t* result)
+{
+	uint64_t value;
+	size_t size;
+	u_char c;
+
+	CHECK_SIZE(state, 1);
+
+	c = *state->cur_pos++;
+	if (c <= 0x7f)
+	{
+		*result = c;
+		return VOD_JSON_OK;
+	}
+
+	if (c >= 0xe0)
+	{
+		*result = (int8_t)c;
+		return VOD_JSON_OK;
+	}
+
+	switch (c)
+	{
+	case 0xcc:		// uint 8/16/32/64
+	case 0xcd:
+	case 0xce:
+	case 0xcf:
+		size = 1 << (c - 0xcc);
+		CHECK_SIZE(state, size);
+		value = vod_msgpack_read_be(state->cur_pos, size);
+		state->cur_pos += size;
+
+		if (value > LLONG_MAX)
+		{
+			vod_snprintf(state->error, state->error_size, "number value overflow%Z");
+			return VOD_JSON_BAD_DATA;
+		}
+
+		*result = value;
+		return VOD_JSON_OK;
+
+	case 0xd0:		// int 8/16/32/64
+	case 0xd1:
+	case 0xd2:
+	case 0xd3:
+		size = 1 << (c - 0xd0);
+		CHECK_SIZE(state, size);
+		value = vod_msgpack_read_be(state->cur_pos, size);
+		state->cur_pos += size;
+
+		// sign extend
+		if (size < sizeof(value) && (value & (1ULL << (size * 8 - 1))))
+		{
+			value |= ~0ULL << (size * 8);
+		}
+
+		*result = (int64_t)value;
+		return VOD_JSON_OK;
+	}
+
+	state->cur_pos--;
+	vod_snprintf(state->error, state->error_size, "expected integer got 0x%xd%Z", (int)c);
+	return VOD_JSON_BAD_DATA;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_float(vod_msgpack_parser_state_t* state, size_t size, vod_json_fraction_t* result)
+{
+	uint64_t value;
+	uint32_t value32;
+	double d;
+	float f;
+
+	CHECK_SIZE(state, size);
+	value = vod_msgpack_read_be(state->cur_pos, size);
+	state->cur_pos += size;
+
+	if (size == sizeof(f))
+	{
+		value32 = value;
+		vod_memcpy(&f, &value32, sizeof(f));
+		d = f;
+	}
+	else
+	{
+		vod_memcpy(&d, &value, sizeof(d));
+	}
+
+	if (!(d < MAX_FRACTION_VALUE && d > -MAX_FRACTION_VALUE))
+	{
+		vod_snprintf(state->error, state->error_size, "number value overflow%Z");
+		return VOD_JSON_BAD_DATA;
+	}
+
+	// the fraction has a fixed precision of 6 decimal digits
+	result->num = (int64_t)(d * FRACTION_DENOM + (d < 0 ? -0.5 : 0.5));
+	result->denom = FRACTION_DENOM;
+
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_string(vod_msgpack_parser_state_t* state, size_t len, vod_str_t* result)
+{
+	u_char* end_pos;
+	u_char* src;
+	u_char* p;
+
+	CHECK_SIZE(state, len);
+
+	src = state->cur_pos;
+	state->cur_pos += len;
+
+	if (memchr(src, '\\', len) == NULL)
+	{
+		result->data = src;
+		result->len = len;
+		return VOD_JSON_OK;
+	}
+
+	// escape the backslashes, the consumers of the json tree use vod_json_decode_string
+	p = vod_alloc(state->pool, len * 2);
+	if (p == NULL)
+	{
+		return VOD_JSON_ALLOC_FAILED;
+	}
+
+	result->data = p;
+
+	for (end_pos = src + len; src < end_pos; src++)
+	{
+		if (*src == '\\')
+		{
+			*p++ = '\\';
+		}
+		*p++ = *src;
+	}
+
+	result->len = p - result->data;
+
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_key(vod_msgpack_parser_state_t* state, vod_json_key_value_t* result)
+{
+	vod_uint_t hash = 0;
+	vod_status_t rc;
+	u_char* end_pos;
+	u_char* p;
+	size_t len;
+	u_char c;
+
+	CHECK_SIZE(state, 1);
+
+	c = *state->cur_pos++;
+	if (c >= 0xa0 && c <= 0xbf)
+	{
+		len = c & 0x1f;
+	}
+	else if (c >= 0xd9 && c <= 0xdb)
+	{
+		rc = vod_msgpack_read_length(state, 1 << (c - 0xd9), &len);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+	}
+	else
+	{
+		vod_snprintf(state->error, state->error_size, "expected string key got 0x%xd%Z", (int)c);
+		return VOD_JSON_BAD_DATA;
+	}
+
+	CHECK_SIZE(state, len);
+
+	result->key.data = state->cur_pos;
+	result->key.len = len;
+	state->cur_pos += len;
+
+	for (p = result->key.data, end_pos = p + len; p < end_pos; p++)
+	{
+		c = *p;
+		if (c >= 'A' && c <= 'Z')
+		{
+			c |= 0x20;			// tolower
+			*p = c;
+		}
+
+		hash = vod_hash(hash, c);
+	}
+
+	result->key_hash = hash;
+
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_array(vod_msgpack_parser_state_t* state, size_t count, vod_json_array_t* result)
+{
+	vod_json_value_t value;
+	vod_status_t rc;
+	int64_t* cur_int;
+	u_char* cur_item;
+	size_t type_size;
+	size_t i;
+
+	result->count = count;
+	result->part.next = NULL;
+
+	if (count == 0)
+	{
+		result->type = VOD_JSON_NULL;
+		result->part.first = NULL;
+		result->part.last = NULL;
+		result->part.count = 0;
+		return VOD_JSON_OK;
+	}
+
+	// every element takes at least one byte
+	if (count > MAX_MSGPACK_ELEMENTS || count > (size_t)(state->end_pos - state->cur_pos))
+	{
+		vod_snprintf(state->error, state->error_size, "invalid array elements count %uz%Z", count);
+		return VOD_JSON_BAD_DATA;
+	}
+
+	if (state->depth >= MAX_RECURSION_DEPTH)
+	{
+		vod_snprintf(state->error, state->error_size, "max recursion depth exceeded%Z");
+		return VOD_JSON_BAD_DATA;
+	}
+	state->depth++;
+
+	// get the type of the array from the first element
+	result->type = vod_msgpack_get_type(*state->cur_pos);
+	if (result->type == VOD_JSON_NULL)
+	{
+		vod_snprintf(state->error, state->error_size, "unsupported array element type 0x%xd%Z", (int)*state->cur_pos);
+		return VOD_JSON_BAD_DATA;
+	}
+
+	type_size = vod_msgpack_type_size[result->type];
+
+	cur_item = vod_alloc(state->pool, type_size * count);
+	if (cur_item == NULL)
+	{
+		return VOD_JSON_ALLOC_FAILED;
+	}
+
+	result->part.first = cur_item;
+	result->part.last = cur_item + type_size * count;
+	result->part.count = count;
+
+	if (result->type == VOD_JSON_INT)
+	{
+		// fast path for the common integer arrays (durations, keyFrameDurations etc.)
+		cur_int = (int64_t*)cur_item;
+		for (i = 0; i < count; i++)
+		{
+			rc = vod_msgpack_parse_int(state, cur_int + i);
+			if (rc != VOD_JSON_OK)
+			{
+				return rc;
+			}
+		}
+
+		state->depth--;
+		return VOD_JSON_OK;
+	}
+
+	for (i = 0; i < count; i++, cur_item += type_size)
+	{
+		rc = vod_msgpack_parse_value(state, &value);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		if (value.type != result->type)
+		{
+			vod_snprintf(state->error, state->error_size, "array element type %d does not match the array type %d%Z",
+				value.type, result->type);
+			return VOD_JSON_BAD_DATA;
+		}
+
+		switch (value.type)
+		{
+		case VOD_JSON_BOOL:
+			*(bool_t*)cur_item = value.v.boolean;
+			break;
+
+		case VOD_JSON_FRAC:
+			*(vod_json_fraction_t*)cur_item = value.v.num;
+			break;
+
+		case VOD_JSON_STRING:
+			*(vod_str_t*)cur_item = value.v.str;
+			break;
+
+		case VOD_JSON_ARRAY:
+			*(vod_json_array_t*)cur_item = value.v.arr;
+			break;
+
+		case VOD_JSON_OBJECT:
+			*(vod_json_object_t*)cur_item = value.v.obj;
+			break;
+		}
+	}
+
+	state->depth--;
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_map(vod_msgpack_parser_state_t* state, size_t count, vod_json_object_t* result)
+{
+	vod_json_key_value_t* cur_item;
+	vod_status_t rc;
+	size_t i;
+
+	if (count == 0)
+	{
+		result->nelts = 0;
+		result->size = sizeof(*cur_item);
+		result->nalloc = 0;
+		result->pool = state->pool;
+		result->elts = NULL;
+		return VOD_JSON_OK;
+	}
+
+	// every element takes at least two bytes
+	if (count > MAX_MSGPACK_ELEMENTS || count > (size_t)(state->end_pos - state->cur_pos) / 2)
+	{
+		vod_snprintf(state->error, state->error_size, "invalid map elements count %uz%Z", count);
+		return VOD_JSON_BAD_DATA;
+	}
+
+	if (state->depth >= MAX_RECURSION_DEPTH)
+	{
+		vod_snprintf(state->error, state->error_size, "max recursion depth exceeded%Z");
+		return VOD_JSON_BAD_DATA;
+	}
+	state->depth++;
+
+	rc = vod_array_init(result, state->pool, count, sizeof(*cur_item));
+	if (rc != VOD_OK)
+	{
+		return VOD_JSON_ALLOC_FAILED;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		cur_item = (vod_json_key_value_t*)vod_array_push(result);
+		if (cur_item == NULL)
+		{
+			return VOD_JSON_ALLOC_FAILED;
+		}
+
+		rc = vod_msgpack_parse_key(state, cur_item);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		rc = vod_msgpack_parse_value(state, &cur_item->value);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+	}
+
+	state->depth--;
+	return VOD_JSON_OK;
+}
+
+static vod_json_status_t
+vod_msgpack_parse_value(vod_msgpack_parser_state_t* state, vod_json_value_t* result)
+{
+	vod_json_status_t rc;
+	size_t len;
+	u_char c;
+
+	CHECK_SIZE(state, 1);
+
+	c = *state->cur_pos;
+
+	if (vod_msgpack_get_type(c) == VOD_JSON_INT)
+	{
+		rc = vod_msgpack_parse_int(state, &result->v.num.num);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		result->type = VOD_JSON_INT;
+		result->v.num.denom = 1;
+		return VOD_JSON_OK;
+	}
+
+	state->cur_pos++;
+
+	if (c <= 0x8f)
+	{
+		result->type = VOD_JSON_OBJECT;
+		return vod_msgpack_parse_map(state, c & 0x0f, &result->v.obj);
+	}
+
+	if (c <= 0x9f)
+	{
+		result->type = VOD_JSON_ARRAY;
+		return vod_msgpack_parse_array(state, c & 0x0f, &result->v.arr);
+	}
+
+	if (c <= 0xbf)
+	{
+		result->type = VOD_JSON_STRING;
+		return vod_msgpack_parse_string(state, c & 0x1f, &result->v.str);
+	}
+
+	switch (c)
+	{
+	case 0xc0:
+		result->type = VOD_JSON_NULL;
+		return VOD_JSON_OK;
+
+	case 0xc2:
+	case 0xc3:
+		result->type = VOD_JSON_BOOL;
+		result->v.boolean = c == 0xc3;
+		return VOD_JSON_OK;
+
+	case 0xca:		// float 32/64
+	case 0xcb:
+		result->type = VOD_JSON_FRAC;
+		return vod_msgpack_parse_float(state, c == 0xca ? 4 : 8, &result->v.num);
+
+	case 0xd9:		// str 8/16/32
+	case 0xda:
+	case 0xdb:
+		rc = vod_msgpack_read_length(state, 1 << (c - 0xd9), &len);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		result->type = VOD_JSON_STRING;
+		return vod_msgpack_parse_string(state, len, &result->v.str);
+
+	case 0xdc:		// array 16/32
+	case 0xdd:
+		rc = vod_msgpack_read_length(state, c == 0xdc ? 2 : 4, &len);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		result->type = VOD_JSON_ARRAY;
+		return vod_msgpack_parse_array(state, len, &result->v.arr);
+
+	case 0xde:		// map 16/32
+	case 0xdf:
+		rc = vod_msgpack_read_length(state, c == 0xde ? 2 : 4, &len);
+		if (rc != VOD_JSON_OK)
+		{
+			return rc;
+		}
+
+		result->type = VOD_JSON_OBJECT;
+		return vod_msgpack_parse_map(state, len, &result->v.obj);
+	}
+
+	vod_snprintf(state->error, state->error_size, "unsupported type 0x%xd%Z", (int)c);
+	return VOD_JSON_BAD_DATA;
+}
+
+vod_json_status_t
+vod_msgpack_parse(vod_pool_t* pool, u_char* data, size_t size, vod_json_value_t* result, u_char* error, size_t error_size)
+{
+	vod_msgpack_parser_state_t state;
+	vod_json_status_t rc;
+
+	state.pool = pool;
+	state.cur_pos = data;
+	state.end_pos = data + size;
+	state.depth = 0;
+	state.error = error;
+	state.error_size = error_size;
+	error[0] = '\0';
+
+	rc = vod_msgpack_parse_value(&state, result);
+	if (rc != VOD_JSON_OK)
+	{
+		goto error;
+	}
+
+	if (state.cur_pos < state.end_pos)
+	{
+		vod_snprintf(error, error_size, "trailing data after msgpack value%Z");
+		rc = VOD_JSON_BAD_DATA;
+		goto error;
+	}
+
+	return VOD_JSON_OK;
+
+error:
+
+	error[error_size - 1] = '\0';			// make sure it's null terminated
+	return rc;
+}
+
+// writer
+static u_char*
+vod_msgpack_write_be(u_char* p, uint64_t value, size_t size)
+{
+	for (; size > 0; size--)
+	{
+		*p++ = (u_char)(value >> ((size - 1) * 8));
+	}
+	return p;
+}
+
+static u_char*
+vod_msgpack_write_header(u_char* p, u_char fix_marker, size_t fix_limit, u_char marker, size_t value)
+{
+	if (value <= fix_limit)
+	{
+		*p++ = fix_marker | value;
+		return p;
+	}
+
+	// marker is the 8 bit variant (0 for arrays/maps, which have no 8 bit variant)
+	if (marker != 0 && value <= 0xff)
+	{
+		*p++ = marker;
+		*p++ = (u_char)value;
+		return p;
+	}
+
+	if (value <= 0xffff)
+	{
+		*p++ = marker != 0 ? marker + 1 : fix_marker == 0x90 ? 0xdc : 0xde;
+		return vod_msgpack_write_be(p, value, 2);
+	}
+
+	*p++ = marker != 0 ? marker + 2 : fix_marker == 0x90 ? 0xdd : 0xdf;
+	return vod_msgpack_write_be(p, value, 4);
+}
+
+static u_char*
+vod_msgpack_write_int(u_char* p, int64_t value)
+{
+	if (value >= 0)
+	{
+		if (value <= 0x7f)
+		{
+			*p++ = (u_char)value;
+			return p;
+		}
+
+		if (value <= 0xff)
+		{
+			*p++ = 0xcc;
+			return vod_msgpack_write_be(p, value, 1);
+		}
+
+		if (value <= 0xffff)
+		{
+			*p++ = 0xcd;
+			return vod_msgpack_write_be(p, value, 2);
+		}
+
+		if (value <= 0xffffffff)
+		{
+			*p++ = 0xce;
+			return vod_msgpack_write_be(p, value, 4);
+		}
+
+		*p++ = 0xcf;
+		return vod_msgpack_write_be(p, value, 8);
+	}
+
+	if (value >= -32)
+	{
+		*p++ = (u_char)value;
+		return p;
+	}
+
+	if (value >= INT8_MIN)
+	{
+		*p++ = 0xd0;
+		return vod_msgpack_write_be(p, (uint64_t)value, 1);
+	}
+
+	if (value >= INT16_MIN)
+	{
+		*p++ = 0xd1;
+		return vod_msgpack_write_be(p, (uint64_t)value, 2);
+	}
+
+	if (value >= INT32_MIN)
+	{
+		*p++ = 0xd2;
+		return vod_msgpack_write_be(p, (uint64_t)value, 4);
+	}
+
+	*p++ = 0xd3;
+	return vod_msgpack_write_be(p, (uint64_t)value, 8);
+}
+
+static u_char*
+vod_msgpack_write_string(u_char* p, vod_str_t* str)
+{
+	vod_str_t decoded;
+	u_char* start;
+
+	if (memchr(str->data, '\\', str->len) == NULL)
+	{
+		p = vod_msgpack_write_header(p, 0xa0, 0x1f, 0xd9, str->len);
+		return vod_copy(p, str->data, str->len);
+	}
+
+	// unescape the string, then move it to follow the header
+	start = p;
+	decoded.data = p + 5;
+	decoded.len = 0;
+	if (vod_json_decode_string(&decoded, str) != VOD_JSON_OK)
+	{
+		return NULL;
+	}
+
+	p = vod_msgpack_write_header(start, 0xa0, 0x1f, 0xd9, decoded.len);
+	vod_memmove(p, decoded.data, decoded.len);
+	return p + decoded.len;
+}
+
+static size_t
+vod_msgpack_get_size(int type, void* value)
+{
+	vod_json_key_value_t* cur;
+	vod_json_key_value_t* last;
+	vod_json_object_t* obj;
+	vod_json_array_t* arr;
+	vod_array_part_t* part;
+	u_char* cur_item;
+	size_t type_size;
+	size_t result;
+
+	switch (type)
+	{
+	case VOD_JSON_STRING:
+		return 5 + ((vod_str_t*)value)->len;
+
+	case VOD_JSON_ARRAY:
+		arr = value;
+		result = 5;
+		if (arr->count == 0)
+		{
+			return result;
+		}
+
+		type_size = vod_msgpack_type_size[arr->type];
+		for (part = &arr->part; part != NULL; part = part->next)
+		{
+			for (cur_item = part->first; cur_item < (u_char*)part->last; cur_item += type_size)
+			{
+				result += vod_msgpack_get_size(arr->type, cur_item);
+			}
+		}
+		return result;
+
+	case VOD_JSON_OBJECT:
+		obj = value;
+		result = 5;
+		cur = obj->elts;
+		for (last = cur + obj->nelts; cur < last; cur++)
+		{
+			result += 5 + cur->key.len + vod_msgpack_get_size(cur->value.type, &cur->value.v);
+		}
+		return result;
+	}
+
+	return 9;		// null, bool, int, frac
+}
+
+static u_char*
+vod_msgpack_write_value(u_char* p, int type, void* value)
+{
+	vod_json_fraction_t* frac;
+	vod_json_key_value_t* cur;
+	vod_json_key_value_t* last;
+	vod_json_object_t* obj;
+	vod_json_array_t* arr;
+	vod_array_part_t* part;
+	u_char* cur_item;
+	uint64_t bits;
+	size_t type_size;
+	double d;
+
+	switch (type)
+	{
+	case VOD_JSON_NULL:
+		*p++ = 0xc0;
+		return p;
+
+	case VOD_JSON_BOOL:
+		*p++ = *(bool_t*)value ? 0xc3 : 0xc2;
+		return p;
+
+	case VOD_JSON_INT:
+		// Note: for both array elements and values, the int64 is at the start of the value
+		return vod_msgpack_write_int(p, *(int64_t*)value);
+
+	case VOD_JSON_FRAC:
+		frac = value;
+		d = (double)frac->num / frac->denom;
+		vod_memcpy(&bits, &d, sizeof(bits));
+		*p++ = 0xcb;
+		return vod_msgpack_write_be(p, bits, sizeof(bits));
+
+	case VOD_JSON_STRING:
+		return vod_msgpack_write_string(p, value);
+
+	case VOD_JSON_ARRAY:
+		arr = value;
+		p = vod_msgpack_write_header(p, 0x90, 0x0f, 0, arr->count);
+		if (arr->count == 0)
+		{
+			return p;
+		}
+
+		type_size = vod_msgpack_type_size[arr->type];
+		for (part = &arr->part; part != NULL; part = part->next)
+		{
+			for (cur_item = part->first; cur_item < (u_char*)part->last; cur_item += type_size)
+			{
+				p = vod_msgpack_write_value(p, arr->type, cur_item);
+				if (p == NULL)
+				{
+					return NULL;
+				}
+			}
+		}
+		return p;
+
+	case VOD_JSON_OBJECT:
+		obj = value;
+		p = vod_msgpack_write_header(p, 0x80, 0x0f, 0, obj->nelts);
+		cur = obj->elts;
+		for (last = cur + obj->nelts; cur < last; cur++)
+		{
+			p = vod_msgpack_write_header(p, 0xa0, 0x1f, 0xd9, cur->key.len);
+			p = vod_copy(p, cur->key.data, cur->key.len);
+
+			p = vod_msgpack_write_value(p, cur->value.type, &cur->value.v);
+			if (p == NULL)
+			{
+				return NULL;
+			}
+		}
+		return p;
+	}
+
+	return NULL;
+}
+
+vod_status_t
+vod_msgpack_write(vod_pool_t* pool, vod_json_value_t* value, vod_str_t* result)
+{
+	u_char* p;
+
+	p = vod_alloc(pool, vod_msgpack_get_size(value->type, &value->v));
+	if (p == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->data = p;
+
+	p = vod_msgpack_write_value(p, value->type, &value->v);
+	if (p == NULL)
+	{
+		return VOD_BAD_DATA;
+	}
+
+	result->len = p - result->data;
+
+	return VOD_OK;
+}
@@ -0,0 +1,30 @@
+#ifndef __MSGPACK_PARSER_H__
+#define __MSGPACK_PARSER_H__
+
+// includes
+#include "json_parser.h"
+
+// macros
+#define vod_msgpack_is_map(ch) (((ch) & 0xf0) == 0x80 || (ch) == 0xde || (ch) == 0xdf)
+
+// functions
+
+// parses a messagepack buffer into the same value tree that is built by vod_json_parse.
+// strings are returned escaped, as in the json parser, so that vod_json_decode_string
+// can be used on them. object keys are lowercased in place.
+vod_json_status_t vod_msgpack_parse(
+	vod_pool_t* pool,
+	u_char* data,
+	size_t size,
+	vod_json_value_t* result,
+	u_char* error,
+	size_t error_size);
+
+// encodes a value tree (e.g. the result of vod_json_parse) as messagepack.
+// the json strings are unescaped, fractions are encoded as 64 bit floats.
+vod_status_t vod_msgpack_write(
+	vod_pool_t* pool,
+	vod_json_value_t* value,
+	vod_str_t* result);
+
+#endif // __MSGPACK_PARSER_H__
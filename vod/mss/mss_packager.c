@@ -118,16 +118,18 @@ mss_write_manifest_chunks(u_char* p, segment_durations_t* segment_durations)
 {
 	segment_duration_item_t* cur_item;
 	segment_duration_item_t* last_item = segment_durations->items + segment_durations->item_count;
+	uint64_t duration;
 	uint32_t last_segment_index;
 	uint32_t segment_index;
 
 	for (cur_item = segment_durations->items; cur_item < last_item; cur_item++)
 	{
+		duration = rescale_time(cur_item->duration, segment_durations->timescale, MSS_TIMESCALE);
 		segment_index = cur_item->segment_index;
 		last_segment_index = segment_index + cur_item->repeat_count;
 		for (; segment_index < last_segment_index; segment_index++)
 		{
-			p = vod_sprintf(p, MSS_CHUNK_TAG, segment_index, rescale_time(cur_item->duration, segment_durations->timescale, MSS_TIMESCALE));
+			p = vod_sprintf(p, MSS_CHUNK_TAG, segment_index, duration);
 		}
 	}
 
@@ -139,6 +141,7 @@ mss_write_manifest_chunks_live(u_char* p, segment_durations_t* segment_durations
 {
 	segment_duration_item_t* cur_item;
 	segment_duration_item_t* last_item = segment_durations->items + segment_durations->item_count;
+	uint64_t duration;
 	uint32_t repeat_count;
 	bool_t first_time = TRUE;
 
@@ -151,12 +154,14 @@ mss_write_manifest_chunks_live(u_char* p, segment_durations_t* segment_durations
 			continue;
 		}
 
+		duration = rescale_time(cur_item->duration, segment_durations->timescale, MSS_TIMESCALE);
+
 		// output the timestamp in the first chunk
 		if (first_time)
 		{
 			p = vod_sprintf(p, MSS_CHUNK_TAG_LIVE_FIRST, 
 				mss_rescale_millis(segment_durations->start_time), 
-				rescale_time(cur_item->duration, segment_durations->timescale, MSS_TIMESCALE));
+				duration);
 			repeat_count--;
 			first_time = FALSE;
 		}
@@ -164,7 +169,7 @@ mss_write_manifest_chunks_live(u_char* p, segment_durations_t* segment_durations
 		// output only the duration in subsequent chunks
 		for (; repeat_count > 0; repeat_count--)
 		{
-			p = vod_sprintf(p, MSS_CHUNK_TAG_LIVE, rescale_time(cur_item->duration, segment_durations->timescale, MSS_TIMESCALE));
+			p = vod_sprintf(p, MSS_CHUNK_TAG_LIVE, duration);
 		}
 	}
 
@@ -322,6 +327,7 @@ mss_packager_build_manifest(
 	media_track_t* last_track;
 	media_track_t* cur_track;
 	segment_durations_t segment_durations[MEDIA_TYPE_COUNT];
+	vod_str_t chunks[MEDIA_TYPE_COUNT];
 	vod_str_t* fourcc;
 	uint64_t duration_100ns;
 	uint32_t media_type;
@@ -455,6 +461,8 @@ mss_packager_build_manifest(
 		return VOD_ALLOC_FAILED;
 	}
 
+	vod_memzero(chunks, sizeof(chunks));
+
 	// header
 	if (media_set->type != MEDIA_SET_LIVE)
 	{
@@ -580,16 +588,27 @@ mss_packager_build_manifest(
 			p = vod_copy(p, MSS_QUALITY_LEVEL_FOOTER, sizeof(MSS_QUALITY_LEVEL_FOOTER) - 1);
 		}
 
-		// print the chunk list
-		switch (media_set->type)
+		// print the chunk list, the list depends only on the media type, so it is rendered once
+		if (chunks[media_type].data != NULL)
 		{
-		case MEDIA_SET_VOD:
-			p = mss_write_manifest_chunks(p, &segment_durations[media_type]);
-			break;
+			p = vod_copy(p, chunks[media_type].data, chunks[media_type].len);
+		}
+		else
+		{
+			chunks[media_type].data = p;
 
-		case MEDIA_SET_LIVE:
-			p = mss_write_manifest_chunks_live(p, &segment_durations[media_type]);
-			break;
+			switch (media_set->type)
+			{
+			case MEDIA_SET_VOD:
+				p = mss_write_manifest_chunks(p, &segment_durations[media_type]);
+				break;
+
+			case MEDIA_SET_LIVE:
+				p = mss_write_manifest_chunks_live(p, &segment_durations[media_type]);
+				break;
+			}
+
+			chunks[media_type].len = p - chunks[media_type].data;
 		}
 
 		p = vod_copy(p, MSS_STREAM_INDEX_FOOTER, sizeof(MSS_STREAM_INDEX_FOOTER) - 1);
@@ -0,0 +1,175 @@
+#include "read_array.h"
+#include "read_stream.h"
+
+/*
+	Vectorized decoding of big endian arrays (mp4 sample tables).
+	On x86, an sse4.1 implementation is used when it is supported by the cpu, the check is performed
+	in runtime, so the binary can still be deployed on older cpus. On aarch64, neon is always available.
+*/
+
+#if (VOD_HAVE_SSE41)
+#include <smmintrin.h>
+
+#define read_array_has_simd() __builtin_cpu_supports("sse4.1")
+
+#define READ_ARRAY_SIMD_ATTR __attribute__((target("sse4.1")))
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define READ_ARRAY_NEON (1)
+
+#define read_array_has_simd() (1)
+
+#define READ_ARRAY_SIMD_ATTR
+
+#endif
+
+#if (VOD_HAVE_SSE41)
+
+READ_ARRAY_SIMD_ATTR static uint64_t
+read_array_be32_sum_simd(const u_char* src, size_t count)
+{
+	const __m128i swap_mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m128i zero = _mm_setzero_si128();
+	const u_char* end = src + count * sizeof(uint32_t);
+	uint64_t sums[2];
+	__m128i sum = zero;
+	__m128i v;
+
+	for (; src < end; src += sizeof(v))
+	{
+		v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), swap_mask);
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, zero));
+	}
+
+	_mm_storeu_si128((__m128i*)sums, sum);
+	return sums[0] + sums[1];
+}
+
+READ_ARRAY_SIMD_ATTR static uint64_t
+read_array_be32_simd(uint32_t* dest, const u_char* src, size_t count, uint32_t* max_value)
+{
+	const __m128i swap_mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m128i zero = _mm_setzero_si128();
+	const u_char* end = src + count * sizeof(uint32_t);
+	uint32_t maxs[4];
+	uint64_t sums[2];
+	__m128i sum = zero;
+	__m128i max = zero;
+	__m128i v;
+
+	for (; src < end; src += sizeof(v), dest += 4)
+	{
+		v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), swap_mask);
+		_mm_storeu_si128((__m128i*)dest, v);
+		max = _mm_max_epu32(max, v);
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, zero));
+	}
+
+	_mm_storeu_si128((__m128i*)maxs, max);
+	*max_value = vod_max(vod_max(maxs[0], maxs[1]), vod_max(maxs[2], maxs[3]));
+
+	_mm_storeu_si128((__m128i*)sums, sum);
+	return sums[0] + sums[1];
+}
+
+#elif (READ_ARRAY_NEON)
+
+static uint64_t
+read_array_be32_sum_simd(const u_char* src, size_t count)
+{
+	const u_char* end = src + count * sizeof(uint32_t);
+	uint64x2_t sum = vdupq_n_u64(0);
+	uint32x4_t v;
+
+	for (; src < end; src += sizeof(v))
+	{
+		v = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(src)));
+		sum = vpadalq_u32(sum, v);
+	}
+
+	return vaddvq_u64(sum);
+}
+
+static uint64_t
+read_array_be32_simd(uint32_t* dest, const u_char* src, size_t count, uint32_t* max_value)
+{
+	const u_char* end = src + count * sizeof(uint32_t);
+	uint64x2_t sum = vdupq_n_u64(0);
+	uint32x4_t max = vdupq_n_u32(0);
+	uint32x4_t v;
+
+	for (; src < end; src += sizeof(v), dest += 4)
+	{
+		v = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(src)));
+		vst1q_u32(dest, v);
+		max = vmaxq_u32(max, v);
+		sum = vpadalq_u32(sum, v);
+	}
+
+	*max_value = vmaxvq_u32(max);
+	return vaddvq_u64(sum);
+}
+
+#endif
+
+uint64_t
+read_array_be32_sum(const u_char* src, size_t count)
+{
+	uint64_t result = 0;
+#ifdef read_array_has_simd
+	size_t simd_count;
+
+	simd_count = count & ~3;
+	if (simd_count > 0 && read_array_has_simd())
+	{
+		result = read_array_be32_sum_simd(src, simd_count);
+		src += simd_count * sizeof(uint32_t);
+		count -= simd_count;
+	}
+#endif
+
+	for (; count > 0; count--, src += sizeof(uint32_t))
+	{
+		result += parse_be32(src);
+	}
+
+	return result;
+}
+
+uint64_t
+read_array_be32(uint32_t* dest, const u_char* src, size_t count, uint32_t* max_value)
+{
+	uint64_t result = 0;
+	uint32_t cur_value;
+	uint32_t max = 0;
+#ifdef read_array_has_simd
+	size_t simd_count;
+
+	simd_count = count & ~3;
+	if (simd_count > 0 && read_array_has_simd())
+	{
+		result = read_array_be32_simd(dest, src, simd_count, &max);
+		src += simd_count * sizeof(uint32_t);
+		dest += simd_count;
+		count -= simd_count;
+	}
+#endif
+
+	for (; count > 0; count--)
+	{
+		read_be32(src, cur_value);
+		*dest++ = cur_value;
+		result += cur_value;
+		if (cur_value > max)
+		{
+			max = cur_value;
+		}
+	}
+
+	*max_value = max;
+	return result;
+}
@@ -0,0 +1,15 @@
+#ifndef __READ_ARRAY_H__
+#define __READ_ARRAY_H__
+
+// includes
+#include "common.h"
+
+// functions
+
+// returns the sum of an array of big endian uint32 values
+uint64_t read_array_be32_sum(const u_char* src, size_t count);
+
+// converts an array of big endian uint32 values to host order, returns the sum of the values
+uint64_t read_array_be32(uint32_t* dest, const u_char* src, size_t count, uint32_t* max_value);
+
+#endif // __READ_ARRAY_H__
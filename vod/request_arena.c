@@ -0,0 +1,231 @@
+#include "request_arena.h"
+
+// constants
+#define REQUEST_ARENA_ALIGNMENT (16)
+#define REQUEST_ARENA_SIZE_CLASSES (8)		// block size, 2 x block size, 4 x block size ... 128 x block size
+
+// macros
+#define request_arena_header_size vod_align(sizeof(request_arena_chunk_t), REQUEST_ARENA_ALIGNMENT)
+
+// typedefs
+typedef struct request_arena_chunk_s {
+	struct request_arena_chunk_s* next;
+	vod_uint_t size_class;
+} request_arena_chunk_t;
+
+struct request_arena_s {
+	size_t block_size;
+	request_arena_chunk_t* free[REQUEST_ARENA_SIZE_CLASSES];
+	vod_uint_t cached[REQUEST_ARENA_SIZE_CLASSES];
+	vod_uint_t max_cached[REQUEST_ARENA_SIZE_CLASSES];
+};
+
+struct request_arena_state_s {
+	request_arena_t* arena;
+	request_arena_chunk_t* chunks;		// all the chunks taken by the request
+	u_char* pos;
+	u_char* end;
+};
+
+request_arena_t*
+request_arena_create(vod_pool_t* pool, vod_log_t* log, size_t block_size, size_t max_cached)
+{
+	request_arena_t* arena;
+	vod_uint_t i;
+
+	if (block_size < 2 * request_arena_header_size || (block_size & (REQUEST_ARENA_ALIGNMENT - 1)) != 0)
+	{
+		vod_log_error(VOD_LOG_ERR, log, 0,
+			"request_arena_create: invalid size %uz must be a multiple of %d", block_size, REQUEST_ARENA_ALIGNMENT);
+		return NULL;
+	}
+
+	arena = vod_alloc(pool, sizeof(*arena));
+	if (arena == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
+			"request_arena_create: vod_alloc failed");
+		return NULL;
+	}
+
+	arena->block_size = block_size;
+
+	// Note: the number of cached chunks of each size class is reduced as the size grows, so that the
+	//		memory kept by each size class is bounded by block_size * max_cached
+	for (i = 0; i < REQUEST_ARENA_SIZE_CLASSES; i++)
+	{
+		arena->free[i] = NULL;
+		arena->cached[i] = 0;
+		arena->max_cached[i] = vod_max(max_cached >> i, 1);
+	}
+
+	return arena;
+}
+
+static void
+request_arena_cleanup(void* data)
+{
+	struct request_arena_state_s* state = data;
+	request_arena_chunk_t* chunk;
+	request_arena_chunk_t* next;
+	request_arena_t* arena = state->arena;
+	vod_uint_t size_class;
+
+	for (chunk = state->chunks; chunk != NULL; chunk = next)
+	{
+		next = chunk->next;
+		size_class = chunk->size_class;
+
+		if (arena->cached[size_class] >= arena->max_cached[size_class])
+		{
+			vod_heap_free(chunk);
+			continue;
+		}
+
+		chunk->next = arena->free[size_class];
+		arena->free[size_class] = chunk;
+		arena->cached[size_class]++;
+	}
+}
+
+static struct request_arena_state_s*
+request_arena_init_state(request_context_t* request_context)
+{
+	struct request_arena_state_s* state;
+	vod_pool_cleanup_t* cln;
+
+	// Note: a single cleanup handler returns all the chunks of the request
+	cln = vod_pool_cleanup_add(request_context->pool, sizeof(*state));
+	if (cln == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"request_arena_init_state: vod_pool_cleanup_add failed");
+		return NULL;
+	}
+
+	state = cln->data;
+	state->arena = request_context->arena;
+	state->chunks = NULL;
+	state->pos = NULL;
+	state->end = NULL;
+
+	cln->handler = request_arena_cleanup;
+
+	request_context->arena_state = state;
+
+	return state;
+}
+
+static void*
+request_arena_get_chunk(request_context_t* request_context, struct request_arena_state_s* state, vod_uint_t size_class)
+{
+	request_arena_chunk_t* chunk;
+	request_arena_t* arena = state->arena;
+
+	chunk = arena->free[size_class];
+	if (chunk != NULL)
+	{
+		arena->free[size_class] = chunk->next;
+		arena->cached[size_class]--;
+	}
+	else
+	{
+		chunk = vod_heap_alloc(arena->block_size << size_class, request_context->log);
+		if (chunk == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"request_arena_get_chunk: vod_heap_alloc failed");
+			return NULL;
+		}
+	}
+
+	chunk->size_class = size_class;
+	chunk->next = state->chunks;
+	state->chunks = chunk;
+
+	return (u_char*)chunk + request_arena_header_size;
+}
+
+void*
+request_arena_alloc(request_context_t* request_context, size_t size)
+{
+	struct request_arena_state_s* state;
+	request_arena_t* arena;
+	vod_uint_t size_class;
+	u_char* result;
+
+	state = request_context->arena_state;
+	if (state == NULL)
+	{
+		if (request_context->arena == NULL)
+		{
+			return vod_alloc(request_context->pool, size);
+		}
+
+		state = request_arena_init_state(request_context);
+		if (state == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	size = vod_align(size, REQUEST_ARENA_ALIGNMENT);
+
+	// bump allocation from the current block
+	if (size <= (size_t)(state->end - state->pos))
+	{
+		result = state->pos;
+		state->pos += size;
+		return result;
+	}
+
+	arena = state->arena;
+
+	if (size > arena->block_size - request_arena_header_size)
+	{
+		// large allocation - take a dedicated chunk of the smallest size class that fits
+		for (size_class = 1; size_class < REQUEST_ARENA_SIZE_CLASSES; size_class++)
+		{
+			if (size <= (arena->block_size << size_class) - request_arena_header_size)
+			{
+				return request_arena_get_chunk(request_context, state, size_class);
+			}
+		}
+
+		return vod_alloc(request_context->pool, size);
+	}
+
+	// start a new block, the remainder of the current block is lost
+	result = request_arena_get_chunk(request_context, state, 0);
+	if (result == NULL)
+	{
+		return NULL;
+	}
+
+	state->pos = result + size;
+	state->end = result + arena->block_size - request_arena_header_size;
+
+	return result;
+}
+
+vod_status_t
+request_arena_array_init(
+	request_context_t* request_context,
+	vod_array_t* array,
+	vod_uint_t n,
+	size_t size)
+{
+	// Note: if the array grows beyond n, ngx_array_push_n moves it to the request pool
+	array->elts = request_arena_alloc(request_context, n * size);
+	if (array->elts == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	array->nelts = 0;
+	array->size = size;
+	array->nalloc = n;
+	array->pool = request_context->pool;
+
+	return VOD_OK;
+}
@@ -0,0 +1,20 @@
+#ifndef __REQUEST_ARENA_H__
+#define __REQUEST_ARENA_H__
+
+// includes
+#include "common.h"
+
+// functions
+request_arena_t* request_arena_create(vod_pool_t* pool, vod_log_t* log, size_t block_size, size_t max_cached);
+
+// allocates request scoped memory, the memory is returned to the arena when the request pool is destroyed.
+// when the request has no arena, the memory is allocated from the request pool.
+void* request_arena_alloc(request_context_t* request_context, size_t size);
+
+vod_status_t request_arena_array_init(
+	request_context_t* request_context,
+	vod_array_t* array,
+	vod_uint_t n,
+	size_t size);
+
+#endif // __REQUEST_ARENA_H__
@@ -32,6 +32,24 @@ typedef struct {
 	uint32_t last_boundary;
 } segmenter_boundary_iterator_context_t;
 
+typedef struct {
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+
+	// compact frames
+	frame_duration_run_t* cur_run;
+	frame_duration_run_t* last_run;
+	u_char* key_frames;
+	uint32_t run_left;
+	uint32_t frame_index;
+	uint64_t dts;
+	uint64_t scaled_first_dts;
+	uint32_t timescale;
+	uint32_t scaled_timescale;
+
+	uint64_t accum_duration;
+} segmenter_frame_iterator_t;
+
 vod_status_t
 segmenter_init_config(segmenter_conf_t* conf, vod_pool_t* pool)
 {
@@ -261,31 +279,305 @@ segmenter_align_to_key_frames(
 	int64_t offset, 
 	int64_t limit)
 {
-	int64_t cur_duration;
+	int64_t cur_offset = context->offset;
+	int64_t* cur_pos = context->cur_pos;
+	int64_t* last_pos = context->part->last;
+	int64_t target;
+
+	// Note: the result is capped by the limit, so it is enough to stop at min(offset, limit).
+	//		the position is kept in locals, since writing it through the context on each key frame
+	//		can not be optimized away (the context may alias the key frame durations)
+	target = vod_min(offset, limit);
 
-	while (context->offset < offset)
+	for (;;)
 	{
-		if ((void*)context->cur_pos >= context->part->last)
+		while (cur_offset < target && cur_pos < last_pos)
 		{
-			if (context->part->next == NULL)
-			{
-				return limit;
-			}
-
-			context->part = context->part->next;
-			context->cur_pos = context->part->first;
+			cur_offset += *cur_pos++;
 		}
 
-		cur_duration = *context->cur_pos++;
+		if (cur_offset >= target)
+		{
+			break;
+		}
 
-		context->offset += cur_duration;
-		if (context->offset >= limit)
+		if (context->part->next == NULL)
 		{
+			context->offset = cur_offset;
+			context->cur_pos = cur_pos;
 			return limit;
 		}
+
+		context->part = context->part->next;
+		cur_pos = context->part->first;
+		last_pos = context->part->last;
+	}
+
+	context->offset = cur_offset;
+	context->cur_pos = cur_pos;
+
+	return vod_min(cur_offset, limit);
+}
+
+// returns the number of segments of a clip when the segment base time is relative, 
+//	without bootstrap segments, the result does not depend on the index of the first segment of the clip
+static vod_inline uint32_t
+segmenter_get_clip_segment_count(segmenter_conf_t* conf, uint32_t duration)
+{
+	uint32_t result;
+
+	result = conf->get_segment_count(conf, duration);
+	return result > 1 ? result : 1;
+}
+
+vod_status_t
+segmenter_init_clip_offsets(
+	request_context_t* request_context,
+	segmenter_conf_t* conf,
+	media_clip_timing_t* timing)
+{
+	uint64_t* duration_offsets;
+	uint32_t* segment_offsets;
+	uint64_t duration_offset;
+	uint32_t segment_offset;
+	uint32_t segment_count;
+	uint32_t i;
+
+	timing->duration_offsets = NULL;
+	timing->segment_offsets = NULL;
+
+	if (timing->total_count <= 1)
+	{
+		return VOD_OK;
+	}
+
+	duration_offsets = vod_alloc(request_context->pool, sizeof(duration_offsets[0]) * (timing->total_count + 1));
+	if (duration_offsets == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"segmenter_init_clip_offsets: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	if (conf->bootstrap_segments_count == 0)
+	{
+		segment_offsets = vod_alloc(request_context->pool, sizeof(segment_offsets[0]) * (timing->total_count + 1));
+		if (segment_offsets == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"segmenter_init_clip_offsets: vod_alloc failed (2)");
+			return VOD_ALLOC_FAILED;
+		}
+	}
+	else
+	{
+		segment_offsets = NULL;
+	}
+
+	duration_offset = 0;
+	segment_offset = 0;
+	for (i = 0; i < timing->total_count; i++)
+	{
+		duration_offsets[i] = duration_offset;
+		duration_offset += timing->durations[i];
+
+		if (segment_offsets == NULL)
+		{
+			continue;
+		}
+
+		segment_offsets[i] = segment_offset;
+
+		segment_count = segmenter_get_clip_segment_count(conf, timing->durations[i]);
+		if (segment_count == INVALID_SEGMENT_COUNT || segment_offset > UINT_MAX - segment_count)
+		{
+			// the lookups fall back to iterating the clips, which reports the error
+			segment_offsets = NULL;
+			continue;
+		}
+
+		segment_offset += segment_count;
+	}
+
+	duration_offsets[i] = duration_offset;
+	if (segment_offsets != NULL)
+	{
+		segment_offsets[i] = segment_offset;
+	}
+
+	timing->duration_offsets = duration_offsets;
+	timing->segment_offsets = segment_offsets;
+
+	return VOD_OK;
+}
+
+void
+segmenter_shift_clip_offsets(media_clip_timing_t* timing, uint32_t clip_index)
+{
+	if (timing->duration_offsets != NULL)
+	{
+		timing->duration_offsets += clip_index;
+	}
+
+	if (timing->segment_offsets != NULL)
+	{
+		timing->segment_offsets += clip_index;
+	}
+}
+
+// returns the total duration of the clips that precede clip_index, clip_index must be smaller than total_count
+static uint64_t
+segmenter_get_clips_duration(media_clip_timing_t* timing, uint32_t clip_index)
+{
+	uint64_t result;
+	uint32_t i;
+
+	if (clip_index <= 0)
+	{
+		return 0;
+	}
+
+	if (timing->duration_offsets != NULL)
+	{
+		// Note: the first clip may have been trimmed after the offsets were built, so its duration is taken as is.
+		//		the last clip is not included, since it may have been trimmed as well
+		return timing->durations[0] + timing->duration_offsets[clip_index] - timing->duration_offsets[1];
+	}
+
+	result = 0;
+	for (i = 0; i < clip_index; i++)
+	{
+		result += timing->durations[i];
+	}
+
+	return result;
+}
+
+// returns the number of segments in the clips that precede clip_index, clip_index must be smaller than total_count.
+//	must be called only when segment_offsets is set
+static uint32_t
+segmenter_get_clips_segment_count(segmenter_conf_t* conf, media_clip_timing_t* timing, uint32_t clip_index)
+{
+	if (clip_index <= 0)
+	{
+		return 0;
+	}
+
+	return segmenter_get_clip_segment_count(conf, timing->durations[0]) + 
+		timing->segment_offsets[clip_index] - timing->segment_offsets[1];
+}
+
+// returns the index of the last clip whose start offset (relative to the first clip) is smaller than offset,
+//	or equal to it, when inclusive is set. returns 0 if there is no such clip
+static uint32_t
+segmenter_find_clip_by_offset(media_clip_timing_t* timing, uint64_t offset, bool_t inclusive)
+{
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+	uint64_t cur_offset;
+
+	left = 0;
+	right = timing->total_count;
+	while (right - left > 1)
+	{
+		mid = left + (right - left) / 2;
+
+		cur_offset = segmenter_get_clips_duration(timing, mid);
+		if (cur_offset < offset || (inclusive && cur_offset == offset))
+		{
+			left = mid;
+		}
+		else
+		{
+			right = mid;
+		}
 	}
 
-	return vod_min(context->offset, limit);
+	return left;
+}
+
+// returns the index of the last clip whose first segment index (relative to the first clip) is less than or equal to 
+//	segment_index, must be called only when segment_offsets is set
+static uint32_t
+segmenter_find_clip_by_segment_index(segmenter_conf_t* conf, media_clip_timing_t* timing, uint32_t segment_index)
+{
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+
+	left = 0;
+	right = timing->total_count;
+	while (right - left > 1)
+	{
+		mid = left + (right - left) / 2;
+
+		if (segmenter_get_clips_segment_count(conf, timing, mid) <= segment_index)
+		{
+			left = mid;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+// returns the index of the first clip that starts at or after the given time, or total_count if there is no such clip.
+//	Note: the clip times are increasing, and the clips do not overlap (validated by the media set parser)
+static uint32_t
+segmenter_find_clip_by_start_time(media_clip_timing_t* timing, uint64_t time)
+{
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+
+	left = 0;
+	right = timing->total_count;
+	while (left < right)
+	{
+		mid = left + (right - left) / 2;
+
+		if (timing->times[mid] < time)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+// returns the index of the first clip that ends after the given time, or total_count if there is no such clip
+static uint32_t
+segmenter_find_clip_by_end_time(media_clip_timing_t* timing, uint64_t time)
+{
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+
+	left = 0;
+	right = timing->total_count;
+	while (left < right)
+	{
+		mid = left + (right - left) / 2;
+
+		if (timing->times[mid] + timing->durations[mid] <= time)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
 }
 
 uint32_t
@@ -328,6 +620,29 @@ segmenter_get_segment_index_discontinuity(
 	uint32_t segment_index = initial_segment_index;
 	uint64_t clip_time;
 	uint64_t* cur_clip_time = timing->times;
+	uint32_t clip_index;
+
+	if (timing->segment_offsets != NULL)
+	{
+		clip_index = segmenter_find_clip_by_end_time(timing, time_millis);
+		if (clip_index >= timing->total_count)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"segmenter_get_segment_index_discontinuity: invalid segment time %uD (1)", time_millis);
+			return VOD_BAD_REQUEST;
+		}
+
+		clip_time = timing->times[clip_index];
+		if (time_millis < clip_time)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"segmenter_get_segment_index_discontinuity: invalid segment time %uD (2)", time_millis);
+			return VOD_BAD_REQUEST;
+		}
+
+		segment_index += segmenter_get_clips_segment_count(conf, timing, clip_index);
+		goto found;
+	}
 
 	for (cur_duration = timing->durations; ; cur_duration++)
 	{
@@ -374,6 +689,8 @@ segmenter_get_segment_index_discontinuity(
 		segment_index = clip_segment_limit;
 	}
 
+found:
+
 	// check bootstrap segments
 	time_millis -= clip_time;
 
@@ -450,7 +767,7 @@ segmenter_get_start_end_ranges_gop(
 		start = 0;
 	}
 
-	end = time - clip_time + conf->gop_look_ahead;
+	end = time - clip_time + params->duration + conf->gop_look_ahead;
 	if (end > clip_duration)
 	{
 		end = clip_duration;
@@ -685,7 +1002,6 @@ segmenter_get_start_end_ranges_discontinuity(
 	request_context_t* request_context = params->request_context;
 	segmenter_conf_t* conf = params->conf;
 	media_range_t* cur_clip_range;
-	uint64_t* cur_clip_time;
 	uint32_t* end_duration = params->timing.durations + params->timing.total_count;
 	uint32_t* cur_duration;
 	uint64_t clip_start_offset;
@@ -699,7 +1015,42 @@ segmenter_get_start_end_ranges_discontinuity(
 	uint32_t clip_index;
 	uint32_t clip_duration;
 
-	if (params->timing.segment_base_time == SEGMENT_BASE_TIME_RELATIVE)
+	if (params->timing.segment_base_time == SEGMENT_BASE_TIME_RELATIVE && 
+		params->timing.segment_offsets != NULL &&
+		segment_index >= params->initial_segment_index)
+	{
+		// find the clip that contains segment_index
+		clip_index = segmenter_find_clip_by_segment_index(
+			conf, 
+			&params->timing, 
+			segment_index - params->initial_segment_index);
+
+		cur_duration = params->timing.durations + clip_index;
+		clip_duration = *cur_duration;
+
+		last_segment_limit = params->initial_segment_index + 
+			segmenter_get_clips_segment_count(conf, &params->timing, clip_index);
+		cur_segment_limit = last_segment_limit + segmenter_get_clip_segment_count(conf, clip_duration);
+		if (segment_index >= cur_segment_limit)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"segmenter_get_start_end_ranges_discontinuity: invalid segment index %uD (1)", segment_index);
+			return VOD_BAD_REQUEST;
+		}
+
+		segmenter_get_start_offset(conf, last_segment_limit, &clip_start_offset);
+
+		// get the start/end times relative to clip_start_offset
+		segmenter_get_start_end_offsets(
+			conf,
+			segment_index,
+			&start,
+			&end);
+
+		clip_time = params->timing.times[clip_index];
+		clip_initial_segment_index = last_segment_limit;
+	}
+	else if (params->timing.segment_base_time == SEGMENT_BASE_TIME_RELATIVE)
 	{
 		// find the clip that contains segment_index
 		last_segment_limit = params->initial_segment_index;
@@ -771,26 +1122,17 @@ segmenter_get_start_end_ranges_discontinuity(
 		end += params->timing.segment_base_time;
 
 		// find the clip that intersects start-end
-		for (cur_duration = params->timing.durations, cur_clip_time = params->timing.times;
-			; 
-			cur_duration++, cur_clip_time++)
+		clip_index = segmenter_find_clip_by_end_time(&params->timing, start);
+		if (clip_index >= params->timing.total_count || 
+			end <= params->timing.times[clip_index])
 		{
-			if (cur_duration >= end_duration)
-			{
-				vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-					"segmenter_get_start_end_ranges_discontinuity: invalid segment index %uD (2)", segment_index);
-				return VOD_BAD_REQUEST;
-			}
-
-			clip_time = *cur_clip_time;
-			clip_duration = *cur_duration;
-			if (end > clip_time && start < clip_time + clip_duration)
-			{
-				break;
-			}
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"segmenter_get_start_end_ranges_discontinuity: invalid segment index %uD (2)", segment_index);
+			return VOD_BAD_REQUEST;
 		}
 
-		clip_index = cur_duration - params->timing.durations;
+		clip_time = params->timing.times[clip_index];
+		clip_duration = params->timing.durations[clip_index];
 		clip_start_offset = clip_time;
 
 		clip_initial_segment_index = segmenter_get_segment_index_no_discontinuity(
@@ -899,6 +1241,7 @@ segmenter_get_live_window_start_end(
 	media_sequence_t* sequence = media_set->sequences;
 	int64_t live_window_duration = media_set->live_window_duration;
 	uint64_t segment_base_time;
+	uint64_t clips_duration;
 	uint64_t clip_end_time;
 	uint64_t clip_time;
 	uint64_t end_time;
@@ -963,14 +1306,8 @@ segmenter_get_live_window_start_end(
 			return VOD_BAD_MAPPING;
 		}
 
-		for (end_clip_index = timing->total_count - 1;; end_clip_index--)
-		{
-			clip_time = timing->times[end_clip_index];
-			if (end_time > clip_time)
-			{
-				break;
-			}
-		}
+		end_clip_index = segmenter_find_clip_by_start_time(timing, end_time) - 1;
+		clip_time = timing->times[end_clip_index];
 
 		if (end_time < clip_time + timing->durations[end_clip_index])
 		{
@@ -1049,6 +1386,24 @@ segmenter_get_live_window_start_end(
 		start_clip_index = end_clip_index;
 		start_clip_offset = end_clip_offset - live_window_duration;
 	}
+	else if (timing->duration_offsets != NULL)
+	{
+		// find the last clip that starts at least live_window_duration before the end
+		clips_duration = segmenter_get_clips_duration(timing, end_clip_index) + end_clip_offset;
+		if (clips_duration <= (uint64_t)live_window_duration)
+		{
+			start_clip_index = 0;
+			start_clip_offset = 0;
+			start_time = timing->times[0];
+		}
+		else
+		{
+			clips_duration -= live_window_duration;
+			start_clip_index = segmenter_find_clip_by_offset(timing, clips_duration, TRUE);
+			start_clip_offset = clips_duration - segmenter_get_clips_duration(timing, start_clip_index);
+			start_time = timing->times[start_clip_index] + start_clip_offset;
+		}
+	}
 	else
 	{
 		live_window_duration -= end_clip_offset;
@@ -1179,10 +1534,18 @@ segmenter_get_live_window(
 		{
 			timing->first_segment_alignment_offset = window.start_clip_offset % conf->segment_duration;
 
-			durations_end = timing->durations + window.start_clip_index;
-			for (durations_cur = timing->durations; durations_cur < durations_end; durations_cur++)
+			if (timing->segment_offsets != NULL)
 			{
-				media_set->initial_segment_index += vod_div_ceil(*durations_cur, conf->segment_duration);
+				// Note: live requires the last_short policy, the segment count of a clip is div_ceil(duration, segment_duration)
+				media_set->initial_segment_index += segmenter_get_clips_segment_count(conf, timing, window.start_clip_index);
+			}
+			else
+			{
+				durations_end = timing->durations + window.start_clip_index;
+				for (durations_cur = timing->durations; durations_cur < durations_end; durations_cur++)
+				{
+					media_set->initial_segment_index += vod_div_ceil(*durations_cur, conf->segment_duration);
+				}
 			}
 
 			media_set->initial_segment_clip_relative_index = window.start_clip_offset / conf->segment_duration;
@@ -1206,6 +1569,8 @@ segmenter_get_live_window(
 		temp_timing = media_set->timing;
 		temp_timing.total_count = 1;
 		temp_timing.durations = &total_duration;
+		temp_timing.duration_offsets = NULL;
+		temp_timing.segment_offsets = NULL;
 
 		rc = segmenter_get_live_window_start_end(
 			request_context,
@@ -1219,24 +1584,11 @@ segmenter_get_live_window(
 		}
 
 		// calculate the clip indexes / offsets of start / end
-		for (durations_cur = timing->durations;
-			window.start_clip_offset >= *durations_cur;
-			durations_cur++)
-		{
-			window.start_clip_offset -= *durations_cur;
-			window.end_clip_offset -= *durations_cur;
-			window.start_clip_index++;
-		}
-
-		window.end_clip_index = window.start_clip_index;
+		window.start_clip_index = segmenter_find_clip_by_offset(timing, window.start_clip_offset, TRUE);
+		window.end_clip_index = segmenter_find_clip_by_offset(timing, window.end_clip_offset, FALSE);
 
-		for (;
-			window.end_clip_offset > *durations_cur;
-			durations_cur++)
-		{
-			window.end_clip_offset -= *durations_cur;
-			window.end_clip_index++;
-		}
+		window.start_clip_offset -= segmenter_get_clips_duration(timing, window.start_clip_index);
+		window.end_clip_offset -= segmenter_get_clips_duration(timing, window.end_clip_index);
 
 		media_set->initial_segment_clip_relative_index = segmenter_get_segment_index_no_discontinuity(
 			conf, 
@@ -1250,22 +1602,20 @@ segmenter_get_live_window(
 		media_set->initial_clip_index += window.start_clip_index;
 	}
 
+	// recalculate the total duration
+	timing->total_duration = segmenter_get_clips_duration(timing, window.end_clip_index) - 
+		segmenter_get_clips_duration(timing, window.start_clip_index) -
+		window.start_clip_offset + window.end_clip_offset;
+
 	// trim the durations array
 	// Note: start_clip_index and end_clip_index can be identical
 	timing->durations[window.end_clip_index] = window.end_clip_offset;
 	timing->durations += window.start_clip_index;
 	timing->durations[0] -= window.start_clip_offset;
+	segmenter_shift_clip_offsets(timing, window.start_clip_index);
 
 	timing->total_count = window.end_clip_index + 1 - window.start_clip_index;
 
-	// recalculate the total duration
-	timing->total_duration = 0;
-	durations_end = timing->durations + timing->total_count;
-	for (durations_cur = timing->durations; durations_cur < durations_end; durations_cur++)
-	{
-		timing->total_duration += *durations_cur;
-	}
-
 	// adjust the first key frame offsets
 	for (sequence = media_set->sequences; sequence < media_set->sequences_end; sequence++)
 	{
@@ -1791,6 +2141,85 @@ segmenter_boundary_iterator_skip(segmenter_boundary_iterator_context_t* context,
 	}
 }
 
+static void
+segmenter_frame_iterator_init(segmenter_frame_iterator_t* iterator, media_track_t* track, uint32_t timescale)
+{
+	compact_frame_list_t* compact = &track->compact_frames;
+
+	iterator->accum_duration = 0;
+
+	// Note: assuming a single frame list part
+	iterator->cur_frame = track->frames.first_frame;
+	iterator->last_frame = track->frames.last_frame;
+
+	iterator->cur_run = compact->first_run;
+	iterator->last_run = compact->last_run;
+	if (iterator->cur_run == NULL)
+	{
+		return;
+	}
+
+	iterator->key_frames = compact->key_frames;
+	iterator->run_left = iterator->cur_run < iterator->last_run ? iterator->cur_run->count : 0;
+	iterator->frame_index = 0;
+	iterator->dts = compact->first_dts;
+	iterator->timescale = compact->timescale;
+	iterator->scaled_timescale = timescale;
+	iterator->scaled_first_dts = rescale_time(iterator->dts, iterator->timescale, timescale);
+}
+
+static vod_inline bool_t
+segmenter_frame_iterator_done(segmenter_frame_iterator_t* iterator)
+{
+	if (iterator->cur_run == NULL)
+	{
+		return iterator->cur_frame >= iterator->last_frame;
+	}
+
+	return iterator->cur_run >= iterator->last_run;
+}
+
+static vod_inline bool_t
+segmenter_frame_iterator_key_frame(segmenter_frame_iterator_t* iterator)
+{
+	if (iterator->cur_run == NULL)
+	{
+		return iterator->cur_frame->key_frame;
+	}
+
+	return iterator->key_frames != NULL &&
+		(iterator->key_frames[iterator->frame_index >> 3] & (1 << (iterator->frame_index & 7))) != 0;
+}
+
+static vod_inline void
+segmenter_frame_iterator_next(segmenter_frame_iterator_t* iterator)
+{
+	if (iterator->cur_run == NULL)
+	{
+		iterator->accum_duration += iterator->cur_frame->duration;
+		iterator->cur_frame++;
+		return;
+	}
+
+	// Note: the runs hold the durations in the original timescale, rescaling the dts (rather than the duration)
+	//		yields the same durations as the ones set on the frames by ngx_http_vod_update_track_timescale
+	iterator->dts += iterator->cur_run->duration;
+	iterator->accum_duration = rescale_time(iterator->dts, iterator->timescale, iterator->scaled_timescale) -
+		iterator->scaled_first_dts;
+	iterator->frame_index++;
+
+	iterator->run_left--;
+	while (iterator->run_left <= 0)
+	{
+		iterator->cur_run++;
+		if (iterator->cur_run >= iterator->last_run)
+		{
+			break;
+		}
+		iterator->run_left = iterator->cur_run->count;
+	}
+}
+
 vod_status_t 
 segmenter_get_segment_durations_accurate(
 	request_context_t* request_context,
@@ -1801,6 +2230,7 @@ segmenter_get_segment_durations_accurate(
 	segment_durations_t* result)
 {
 	segmenter_boundary_iterator_context_t boundary_iterator;
+	segmenter_frame_iterator_t frame_iterator;
 	media_track_t* cur_track;
 	media_track_t* last_track;
 	media_track_t* main_track = NULL;
@@ -1808,8 +2238,6 @@ segmenter_get_segment_durations_accurate(
 	segment_duration_item_t* cur_item;
 	media_sequence_t* sequences_end;
 	media_sequence_t* cur_sequence;
-	input_frame_t* last_frame;
-	input_frame_t* cur_frame;
 	uint64_t total_duration;
 	uint32_t segment_index = 0;
 	uint64_t accum_duration = 0;
@@ -1942,10 +2370,8 @@ segmenter_get_segment_durations_accurate(
 	result->timescale = main_track->media_info.timescale;
 	result->discontinuities = 0;
 
-	// Note: assuming a single frame list part
 	cur_item = result->items - 1;
-	last_frame = main_track->frames.last_frame;
-	cur_frame = main_track->frames.first_frame;
+	segmenter_frame_iterator_init(&frame_iterator, main_track, result->timescale);
 
 	align_to_key_frames = conf->align_to_key_frames && main_track->media_info.media_type == MEDIA_TYPE_VIDEO;
 
@@ -1954,10 +2380,11 @@ segmenter_get_segment_durations_accurate(
 	{
 		segment_limit = rescale_time(conf->bootstrap_segments_end[0], 1000, result->timescale);
 
-		for (; cur_frame < last_frame; cur_frame++)
+		for (; !segmenter_frame_iterator_done(&frame_iterator); segmenter_frame_iterator_next(&frame_iterator))
 		{
+			accum_duration = frame_iterator.accum_duration;
 			while (accum_duration >= segment_limit && segment_index + 1 < result->segment_count &&
-				(!align_to_key_frames || cur_frame->key_frame))
+				(!align_to_key_frames || segmenter_frame_iterator_key_frame(&frame_iterator)))
 			{
 				// get the current duration and update to array
 				cur_duration = accum_duration - segment_start;
@@ -1981,7 +2408,6 @@ segmenter_get_segment_durations_accurate(
 				}
 				segment_limit = rescale_time(conf->bootstrap_segments_end[segment_index], 1000, result->timescale);
 			}
-			accum_duration += cur_frame->duration;
 		}
 	}
 
@@ -1991,10 +2417,11 @@ post_bootstrap:
 	segment_limit_millis = conf->bootstrap_segments_total_duration + conf->segment_duration;
 	segment_limit = rescale_time(segment_limit_millis, 1000, result->timescale);
 
-	for (; cur_frame < last_frame; cur_frame++)
+	for (; !segmenter_frame_iterator_done(&frame_iterator); segmenter_frame_iterator_next(&frame_iterator))
 	{
+		accum_duration = frame_iterator.accum_duration;
 		while (accum_duration >= segment_limit && segment_index + 1 < result->segment_count &&
-			(!align_to_key_frames || cur_frame->key_frame))
+			(!align_to_key_frames || segmenter_frame_iterator_key_frame(&frame_iterator)))
 		{
 			// get the current duration and update to array
 			cur_duration = accum_duration - segment_start;
@@ -2015,8 +2442,8 @@ post_bootstrap:
 			segment_limit_millis += conf->segment_duration;
 			segment_limit = rescale_time(segment_limit_millis, 1000, result->timescale);
 		}
-		accum_duration += cur_frame->duration;
 	}
+	accum_duration = frame_iterator.accum_duration;
 	
 	// in case the main video track is shorter than the audio track, add the estimated durations of the remaining audio-only segments
 	if (main_track->media_info.duration_millis < duration_millis && 
@@ -2092,3 +2519,59 @@ post_bootstrap:
 
 	return VOD_OK;
 }
+
+vod_status_t
+segmenter_get_part_range(
+	request_context_t* request_context,
+	segmenter_conf_t* conf,
+	uint32_t part_index,
+	get_clip_ranges_result_t* result)
+{
+	media_range_t* range;
+	uint64_t start;
+	uint64_t end;
+
+	if (conf->part_duration <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"segmenter_get_part_range: parts are not enabled");
+		return VOD_BAD_REQUEST;
+	}
+
+	if (result->clip_count <= 0)
+	{
+		return VOD_OK;
+	}
+
+	if (result->clip_count > 1)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"segmenter_get_part_range: parts are not supported in segments that span multiple clips");
+		return VOD_BAD_REQUEST;
+	}
+
+	// Note: parts are aligned to the segment start, only the first part of the segment starts with a key frame
+	range = result->clip_ranges;
+	start = range->start + (uint64_t)part_index * conf->part_duration * range->timescale / 1000;
+	end = start + (uint64_t)conf->part_duration * range->timescale / 1000;
+
+	if (range->end != ULLONG_MAX)
+	{
+		if (start >= range->end)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"segmenter_get_part_range: part index %uD exceeds the segment duration", part_index);
+			return VOD_BAD_REQUEST;
+		}
+
+		if (end > range->end)
+		{
+			end = range->end;
+		}
+	}
+
+	range->start = start;
+	range->end = end;
+
+	return VOD_OK;
+}
@@ -57,6 +57,7 @@ typedef struct {
 
 	// gop
 	uint64_t time;
+	uint64_t duration;			// the range that follows time, e.g. the span of a thumbnail tiles request
 } get_clip_ranges_params_t;
 
 typedef struct {
@@ -81,6 +82,7 @@ typedef vod_status_t (*segmenter_get_segment_durations_t)(
 struct segmenter_conf_s {
 	// config fields
 	uintptr_t segment_duration;
+	uintptr_t part_duration;				// 0 = parts disabled
 	vod_array_t* bootstrap_segments;		// array of vod_str_t
 	bool_t align_to_key_frames;
 	intptr_t live_window_duration;
@@ -159,6 +161,15 @@ vod_status_t segmenter_get_segment_durations_accurate(
 	uint32_t media_type,
 	segment_durations_t* result);
 
+// builds the clip prefix sums of the timing, so that clip lookups in long media sets are binary searches
+vod_status_t segmenter_init_clip_offsets(
+	request_context_t* request_context,
+	segmenter_conf_t* conf,
+	media_clip_timing_t* timing);
+
+// updates the clip prefix sums after the first clip_index clips were removed from the timing
+void segmenter_shift_clip_offsets(media_clip_timing_t* timing, uint32_t clip_index);
+
 // get segment index
 uint32_t segmenter_get_segment_index_no_discontinuity(
 	segmenter_conf_t* conf,
@@ -185,4 +196,11 @@ vod_status_t segmenter_get_start_end_ranges_discontinuity(
 	get_clip_ranges_params_t* params,
 	get_clip_ranges_result_t* result);
 
+// parts
+vod_status_t segmenter_get_part_range(
+	request_context_t* request_context,
+	segmenter_conf_t* conf,
+	uint32_t part_index,
+	get_clip_ranges_result_t* result);
+
 #endif // __SEGMENTER_H__
@@ -0,0 +1,23 @@
+#ifndef __SIDECAR_INDEX_H__
+#define __SIDECAR_INDEX_H__
+
+// includes
+#include "common.h"
+
+// constants
+#define SIDECAR_INDEX_MAGIC (0x78646976)		// vidx
+#define SIDECAR_INDEX_VERSION (1)
+
+// typedefs
+
+// the header of a sidecar index file (written offline by vod_cli -x), it is followed by the metadata in the
+//	format of the metadata cache - uint32_t format id, uint32_t part count, size_t part sizes[part count], parts.
+//	the file is written in the byte order of the machine that generated it, and is rejected by the module when
+//	the version or the size of size_t do not match
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size_t_size;
+} sidecar_index_header_t;
+
+#endif //__SIDECAR_INDEX_H__
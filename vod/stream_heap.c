@@ -0,0 +1,101 @@
+#include "stream_heap.h"
+
+// macros
+#define stream_heap_node_less(n1, n2) \
+	((n1)->key < (n2)->key || ((n1)->key == (n2)->key && (u_char*)(n1)->item < (u_char*)(n2)->item))
+
+vod_status_t
+stream_heap_init(
+	request_context_t* request_context,
+	stream_heap_t* heap,
+	uint32_t capacity)
+{
+	heap->nodes = vod_alloc(request_context->pool, sizeof(heap->nodes[0]) * capacity);
+	if (heap->nodes == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"stream_heap_init: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	heap->count = 0;
+
+	return VOD_OK;
+}
+
+static void
+stream_heap_sift_down(stream_heap_t* heap, uint32_t index)
+{
+	stream_heap_node_t* nodes = heap->nodes;
+	stream_heap_node_t node = nodes[index];
+	uint32_t child;
+
+	for (;;)
+	{
+		child = 2 * index + 1;
+		if (child >= heap->count)
+		{
+			break;
+		}
+
+		if (child + 1 < heap->count && stream_heap_node_less(&nodes[child + 1], &nodes[child]))
+		{
+			child++;
+		}
+
+		if (!stream_heap_node_less(&nodes[child], &node))
+		{
+			break;
+		}
+
+		nodes[index] = nodes[child];
+		index = child;
+	}
+
+	nodes[index] = node;
+}
+
+void
+stream_heap_push(stream_heap_t* heap, void* item, uint64_t key)
+{
+	stream_heap_node_t* nodes = heap->nodes;
+	stream_heap_node_t node;
+	uint32_t parent;
+	uint32_t index;
+
+	node.key = key;
+	node.item = item;
+
+	for (index = heap->count++; index > 0; index = parent)
+	{
+		parent = (index - 1) / 2;
+		if (!stream_heap_node_less(&node, &nodes[parent]))
+		{
+			break;
+		}
+
+		nodes[index] = nodes[parent];
+	}
+
+	nodes[index] = node;
+}
+
+void
+stream_heap_update_top(stream_heap_t* heap, uint64_t key)
+{
+	heap->nodes[0].key = key;
+	stream_heap_sift_down(heap, 0);
+}
+
+void
+stream_heap_pop(stream_heap_t* heap)
+{
+	heap->count--;
+	if (heap->count <= 0)
+	{
+		return;
+	}
+
+	heap->nodes[0] = heap->nodes[heap->count];
+	stream_heap_sift_down(heap, 0);
+}
@@ -0,0 +1,41 @@
+#ifndef __STREAM_HEAP_H__
+#define __STREAM_HEAP_H__
+
+// includes
+#include "common.h"
+
+// constants
+#define STREAM_HEAP_MIN_STREAMS (4)		// below this count, a linear scan of the streams is faster
+
+// macros
+#define stream_heap_reset(heap) (heap)->count = 0
+#define stream_heap_top(heap) ((heap)->nodes[0].item)
+
+// typedefs
+typedef struct {
+	uint64_t key;
+	void* item;
+} stream_heap_node_t;
+
+// a min heap of muxer streams keyed by the dts of their next frame.
+// nodes with equal keys are ordered by the address of the item, so that when the items are elements of
+// an array, the result matches a linear scan that picks the first stream with the minimum dts.
+typedef struct {
+	stream_heap_node_t* nodes;
+	uint32_t count;
+} stream_heap_t;
+
+// functions
+vod_status_t stream_heap_init(
+	request_context_t* request_context,
+	stream_heap_t* heap,
+	uint32_t capacity);
+
+void stream_heap_push(stream_heap_t* heap, void* item, uint64_t key);
+
+// updates the key of the top item, after its stream moved to the next frame
+void stream_heap_update_top(stream_heap_t* heap, uint64_t key);
+
+void stream_heap_pop(stream_heap_t* heap);
+
+#endif // __STREAM_HEAP_H__
@@ -2,6 +2,7 @@
 #include "../media_clip.h"
 #include "../media_set.h"
 #include "subtitle_format.h"
+#include "../read_stream.h"
 #include <ctype.h>
 
 // macros
@@ -140,6 +141,22 @@ cap_get_duration(vod_str_t* source)
 	return result;
 }
 
+static uint64_t
+cap_get_end_time(u_char* cur_pos, u_char* next, u_char hours_base, uint64_t start_time)
+{
+	if ((cur_pos[1] & CAP_FLAG_HAS_END_TIME) != 0)
+	{
+		return cap_parse_timestamp(cur_pos + CAP_END_TIME_OFFSET, hours_base);
+	}
+
+	if (next != NULL)
+	{
+		return cap_parse_timestamp(next + CAP_START_TIME_OFFSET, hours_base);
+	}
+
+	return start_time + CAP_LAST_FRAME_DURATION;
+}
+
 static vod_status_t
 cap_parse(
 	request_context_t* request_context,
@@ -148,6 +165,17 @@ cap_parse(
 	size_t metadata_part_count,
 	media_base_metadata_t** result)
 {
+	if (subtitle_is_cue_list(source))
+	{
+		// the source was replaced by the cue list when it was saved to the metadata cache
+		return subtitle_cue_list_parse(
+			request_context,
+			parse_params,
+			source,
+			metadata_part_count,
+			result);
+	}
+
 	return subtitle_parse(
 		request_context,
 		parse_params,
@@ -270,6 +298,7 @@ cap_parse_frames(
 	media_format_read_request_t* read_req,
 	media_track_array_t* result)
 {
+	const subtitle_cue_index_entry_t* index_entry;
 	subtitle_base_metadata_t* metadata = vod_container_of(base, subtitle_base_metadata_t, base);
 	media_track_t* track = base->tracks.elts;
 	input_frame_t* cur_frame = NULL;
@@ -292,7 +321,16 @@ cap_parse_frames(
 	u_char hours_base = 0;
 	bool_t first_time = TRUE;
 	size_t frame_size;
-	
+
+	if (metadata->cue_list != NULL)
+	{
+		return subtitle_cue_list_parse_frames(
+			request_context,
+			metadata,
+			parse_params,
+			result);
+	}
+
 	vod_memzero(result, sizeof(*result));
 	result->first_track = track;
 	result->last_track = track + 1;
@@ -330,7 +368,24 @@ cap_parse_frames(
 		end = parse_params->range->end;		// Note: not adding clip_from, since end is checked after the clipping is applied to the timestamps
 	}
 
-	for (cur_pos = cap_get_next_block(cur_pos, end_pos); ; cur_pos = next)
+	cur_pos = cap_get_next_block(cur_pos, end_pos);
+
+	// skip the blocks that end before the start time
+	if (metadata->cue_index.len > 0 && cur_pos != NULL)
+	{
+		index_entry = subtitle_cue_index_find(&metadata->cue_index, source->len, start);
+		if (index_entry != NULL)
+		{
+			// the hours base is set by the first block
+			first_time = FALSE;
+			hours_base = cur_pos[CAP_START_TIME_OFFSET];
+
+			cur_pos = cap_get_next_block(source->data + parse_be32(index_entry->offset), end_pos);
+			track->first_frame_index = parse_be32(index_entry->frame_index);
+		}
+	}
+
+	for (; ; cur_pos = next)
 	{
 		if (cur_pos == NULL)
 		{
@@ -352,21 +407,7 @@ cap_parse_frames(
 		}
 
 		start_time = cap_parse_timestamp(cur_pos + CAP_START_TIME_OFFSET, hours_base);
-		if ((cur_pos[1] & CAP_FLAG_HAS_END_TIME) != 0)
-		{
-			end_time = cap_parse_timestamp(cur_pos + CAP_END_TIME_OFFSET, hours_base);
-		}
-		else
-		{
-			if (next != NULL)
-			{
-				end_time = cap_parse_timestamp(next + CAP_START_TIME_OFFSET, hours_base);
-			}
-			else
-			{
-				end_time = start_time + CAP_LAST_FRAME_DURATION;
-			}
-		}
+		end_time = cap_get_end_time(cur_pos, next, hours_base, start_time);
 		
 		if (end_time < start)
 		{
@@ -476,6 +517,155 @@ cap_parse_frames(
 	return VOD_OK;
 }
 
+// Note: must walk the blocks in the same way cap_parse_frames skips the blocks that end before the start time
+static vod_status_t
+cap_build_cue_index(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	subtitle_cue_index_builder_t builder;
+	vod_status_t rc;
+	uint64_t start_time;
+	uint64_t end_time;
+	u_char* start_pos = metadata_parts[0].data;
+	u_char* end_pos = start_pos + metadata_parts[0].len;
+	u_char* cur_pos;
+	u_char* next;
+	u_char hours_base;
+
+	if (metadata_parts[0].len < CAP_DATA_START_OFFSET ||
+		subtitle_is_cue_list(&metadata_parts[0]))
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	cur_pos = cap_get_next_block(start_pos + CAP_DATA_START_OFFSET, end_pos);
+	if (cur_pos == NULL)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	rc = subtitle_cue_index_init(&builder, request_context);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	hours_base = cur_pos[CAP_START_TIME_OFFSET];
+
+	for (; cur_pos != NULL; cur_pos = next)
+	{
+		next = cap_get_next_block(cur_pos + cur_pos[0], end_pos);
+
+		start_time = cap_parse_timestamp(cur_pos + CAP_START_TIME_OFFSET, hours_base);
+		end_time = cap_get_end_time(cur_pos, next, hours_base, start_time);
+
+		rc = subtitle_cue_index_add(&builder, cur_pos - start_pos, end_time);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	return subtitle_cue_index_get_result(&builder, result);
+}
+
+// Note: must walk the blocks in the same way cap_parse_frames does
+static vod_status_t
+cap_build_cue_list(
+	request_context_t* request_context,
+	vod_str_t* source,
+	vod_str_t* result)
+{
+	subtitle_cue_list_builder_t builder;
+	vod_str_t header;
+	vod_status_t rc;
+	uint64_t start_time;
+	uint64_t end_time;
+	u_char* end_pos = source->data + source->len;
+	u_char* cur_pos;
+	u_char* next;
+	u_char* text_start;
+	u_char* text_end;
+	u_char hours_base = 0;
+	size_t text_size;
+
+	if (source->len < CAP_DATA_START_OFFSET)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	header.data = (u_char*)WEBVTT_HEADER_NEWLINES;
+	header.len = sizeof(WEBVTT_HEADER_NEWLINES) - 1;
+
+	rc = subtitle_cue_list_init(&builder, request_context, source->len, &header);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	cur_pos = cap_get_next_block(source->data + CAP_DATA_START_OFFSET, end_pos);
+	if (cur_pos != NULL)
+	{
+		hours_base = cur_pos[CAP_START_TIME_OFFSET];
+	}
+
+	for (; cur_pos != NULL; cur_pos = next)
+	{
+		next = cap_get_next_block(cur_pos + cur_pos[0], end_pos);
+
+		start_time = cap_parse_timestamp(cur_pos + CAP_START_TIME_OFFSET, hours_base);
+		end_time = cap_get_end_time(cur_pos, next, hours_base, start_time);
+
+		if ((cur_pos[1] & CAP_FLAG_HAS_END_TIME) != 0)
+		{
+			text_start = cur_pos + CAP_HEADER_SIZE_END_TIME;
+		}
+		else
+		{
+			text_start = cur_pos + CAP_HEADER_SIZE_NO_END_TIME;
+		}
+		text_end = cur_pos + cur_pos[0] - 1;
+
+		text_size = cap_get_max_text_len(text_start, text_end);
+
+		rc = subtitle_cue_list_start_cue(&builder, start_time, end_time, 0);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		rc = vod_dynamic_buf_reserve(&builder.buf, text_size);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		builder.buf.pos = cap_parse_text(builder.buf.pos, text_start, text_end);
+
+		subtitle_cue_list_end_cue(&builder);
+	}
+
+	return subtitle_cue_list_get_result(&builder, source->len, cap_get_duration(source), result);
+}
+
+static vod_status_t
+cap_compact_metadata(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	if (subtitle_is_cue_list(&metadata_parts[0]))
+	{
+		return VOD_OK;
+	}
+
+	return cap_build_cue_list(request_context, &metadata_parts[0], &result[0]);
+}
+
 media_format_t cap_format = {
 	FORMAT_ID_CAP,
 	vod_string("cap"),
@@ -485,4 +675,8 @@ media_format_t cap_format = {
 	NULL,
 	cap_parse,
 	cap_parse_frames,
+	cap_compact_metadata,
+	cap_build_cue_index,
+	NULL,			// resume_metadata_reader
+	NULL,			// free_metadata_reader
 };
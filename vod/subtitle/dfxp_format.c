@@ -2,17 +2,18 @@
 #include "../media_clip.h"
 #include "../media_set.h"
 #include "subtitle_format.h"
+#include "../write_stream.h"
 
 #include <libxml/parser.h>
-#include <libxml/tree.h>
 
 #define DFXP_PREFIX "<tt"
 #define DFXP_XML_PREFIX1 "<?xml"
 #define DFXP_XML_PREFIX2 "<xml"
 
-#define DFXP_DURATION_ESTIMATE_NODES (10)
 #define DFXP_MAX_STACK_DEPTH (10)
 #define DFXP_FRAME_RATE (30)
+#define DFXP_MAX_TIMESTAMP_LEN (32)
+#define DFXP_TIMESTAMP_MISSING (-2)
 
 #define DFXP_ELEMENT_P (u_char*)"p"
 #define DFXP_ELEMENT_BR (u_char*)"br"
@@ -22,6 +23,18 @@
 #define DFXP_ATTR_END (u_char*)"end"
 #define DFXP_ATTR_DUR (u_char*)"dur"
 
+// typedefs
+typedef struct {
+	request_context_t* request_context;
+	xmlParserCtxtPtr ctxt;
+	subtitle_cue_list_builder_t cue_list;
+	vod_status_t rc;
+	uint64_t duration;
+	unsigned depth;
+	unsigned p_depth;				// depth of the p element that is being read, zero when outside p
+	unsigned skip_depth;			// while non-zero, the content of the element at this depth is ignored
+} dfxp_sax_state_t;
+
 static vod_status_t
 dfxp_reader_init(
 	request_context_t* request_context,
@@ -55,24 +68,6 @@ dfxp_reader_init(
 		ctx);
 }
 
-// a simplified version of xmlGetProp that does not copy memory, but is also limited to a single child
-static xmlChar* 
-dfxp_get_xml_prop(xmlNode* node, xmlChar* name)
-{
-	xmlAttrPtr prop;
-
-	prop = xmlHasProp(node, name);
-	if (prop == NULL ||
-		prop->children == NULL ||
-		prop->children->next != NULL ||
-		(prop->children->type != XML_TEXT_NODE && prop->children->type != XML_CDATA_SECTION_NODE))
-	{
-		return NULL;
-	}
-
-	return prop->children->content;
-}
-
 static int64_t 
 dfxp_parse_timestamp(u_char* ts)
 {
@@ -223,108 +218,34 @@ dfxp_parse_timestamp(u_char* ts)
 	return -1;
 }
 
-static int64_t 
-dfxp_get_end_time(xmlNode *cur_node)
+static int64_t
+dfxp_get_attr_timestamp(const xmlChar** attributes, int nb_attributes, u_char* name)
 {
-	xmlChar* attr;
-	int64_t begin;
-	int64_t dur;
-	
-	// prefer the end attribute
-	attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_END);
-	if (attr != NULL)
-	{
-		return dfxp_parse_timestamp(attr);
-	}
-	
-	// fall back to dur + start
-	attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_DUR);
-	if (attr == NULL)
-	{
-		return -1;
-	}
-	
-	dur = dfxp_parse_timestamp(attr);
-	if (dur < 0)
-	{
-		return -1;
-	}
-	
-	attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_BEGIN);
-	if (attr == NULL)
-	{
-		return -1;
-	}
-	
-	begin = dfxp_parse_timestamp(attr);
-	if (begin < 0)
-	{
-		return -1;
-	}
-	
-	return begin + dur;
-}
+	u_char buf[DFXP_MAX_TIMESTAMP_LEN + 1];
+	size_t len;
+	int i;
 
-static uint64_t
-dfxp_get_duration(xmlDoc *doc)
-{
-	xmlNode* node_stack[DFXP_MAX_STACK_DEPTH];
-	xmlNode* cur_node;
-	xmlNode temp_node;
-	unsigned node_stack_pos = 0;
-	int nodes_left = DFXP_DURATION_ESTIMATE_NODES;
-	int64_t result = 0;
-	int64_t cur;
-
-	for (cur_node = xmlDocGetRootElement(doc); ; cur_node = cur_node->prev)
+	// each attribute is a localname / prefix / URI / value / end tuple
+	for (i = 0; i < nb_attributes; i++, attributes += 5)
 	{
-		// traverse the tree dfs order (reverse child order)
-		if (cur_node == NULL)
-		{
-			if (node_stack_pos <= 0)
-			{
-				break;
-			}
-
-			cur_node = node_stack[--node_stack_pos];
-			continue;
-		}
-
-		if (cur_node->type != XML_ELEMENT_NODE)
+		if (vod_strcmp(attributes[0], name) != 0)
 		{
 			continue;
 		}
 
-		// recurse into non-p nodes
-		if (vod_strcmp(cur_node->name, DFXP_ELEMENT_P) != 0)
+		len = attributes[4] - attributes[3];
+		if (len > DFXP_MAX_TIMESTAMP_LEN)
 		{
-			if (cur_node->last == NULL || 
-				node_stack_pos >= vod_array_entries(node_stack))
-			{
-				continue;
-			}
-
-			node_stack[node_stack_pos++] = cur_node;
-			temp_node.prev = cur_node->last;
-			cur_node = &temp_node;
-			continue;
+			return -1;
 		}
 
-		// get the end time of this p node
-		cur = dfxp_get_end_time(cur_node);
-		if (cur > result)
-		{
-			result = cur;
-		}
+		vod_memcpy(buf, attributes[3], len);
+		buf[len] = '\0';
 
-		nodes_left--;
-		if (nodes_left <= 0)
-		{
-			break;
-		}
+		return dfxp_parse_timestamp(buf);
 	}
-	
-	return result;
+
+	return DFXP_TIMESTAMP_MISSING;
 }
 
 static void
@@ -348,14 +269,11 @@ dfxp_strip_new_lines(u_char* buf, size_t n)
 static void vod_cdecl
 dfxp_xml_sax_error(void *data, const char *msg, ...)
 {
-	xmlParserCtxtPtr ctxt = data;
-	request_context_t* request_context;
+	dfxp_sax_state_t* state = data;
 	va_list args;
 	u_char buf[VOD_MAX_ERROR_STR];
 	size_t n;
 
-	request_context = ctxt->sax->_private;
-
 	buf[0] = '\0';
 
 	va_start(args, msg);
@@ -366,312 +284,345 @@ dfxp_xml_sax_error(void *data, const char *msg, ...)
 
 	dfxp_strip_new_lines(buf, n);
 
-	vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+	vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
 		"dfxp_xml_sax_error: libxml2 error: %*s", n + 1, buf);
 }
 
-static void vod_cdecl
-dfxp_xml_schema_error(void *data, const char *msg, ...)
+static void
+dfxp_sax_set_error(dfxp_sax_state_t* state, vod_status_t rc)
 {
-	xmlParserCtxtPtr ctxt = data;
-	request_context_t* request_context;
-	va_list args;
-	u_char buf[VOD_MAX_ERROR_STR];
-	size_t n;
+	state->rc = rc;
+	xmlStopParser(state->ctxt);
+}
 
-	request_context = ctxt->sax->_private;
+static void
+dfxp_sax_start_cue(
+	dfxp_sax_state_t* state,
+	const xmlChar** attributes,
+	int nb_attributes)
+{
+	int64_t start_time;
+	int64_t end_time;
+	int64_t duration;
 
-	buf[0] = '\0';
+	// prefer the end attribute, fall back to dur + begin
+	end_time = dfxp_get_attr_timestamp(attributes, nb_attributes, DFXP_ATTR_END);
+	if (end_time == DFXP_TIMESTAMP_MISSING)
+	{
+		duration = dfxp_get_attr_timestamp(attributes, nb_attributes, DFXP_ATTR_DUR);
+		if (duration < 0)
+		{
+			return;
+		}
 
-	va_start(args, msg);
-	n = (size_t)vsnprintf((char *)buf, VOD_MAX_ERROR_STR, msg, args);
-	va_end(args);
+		start_time = dfxp_get_attr_timestamp(attributes, nb_attributes, DFXP_ATTR_BEGIN);
+		if (start_time < 0)
+		{
+			return;
+		}
 
-	while (--n && (buf[n] == CR || buf[n] == LF)) { /* void */ }
+		end_time = start_time + duration;
+	}
+	else
+	{
+		if (end_time < 0)
+		{
+			return;
+		}
 
-	dfxp_strip_new_lines(buf, n);
+		// Note: a missing begin is checked only when the frames are parsed, the cue is still counted
+		//		in the frame index if it ends before the segment
+		start_time = dfxp_get_attr_timestamp(attributes, nb_attributes, DFXP_ATTR_BEGIN);
+	}
+
+	if (subtitle_cue_list_start_cue(&state->cue_list, start_time, end_time, 0) != VOD_OK ||
+		vod_dynamic_buf_reserve(&state->cue_list.buf, 1) != VOD_OK)
+	{
+		dfxp_sax_set_error(state, VOD_ALLOC_FAILED);
+		return;
+	}
+
+	state->cue_list.buf.pos++;		// save space for prepending \n
 
-	vod_log_error(VOD_LOG_WARN, request_context->log, 0,
-		"dfxp_xml_schema_error: libxml2 error: %*s", n + 1, buf);
+	if ((uint64_t)end_time > state->duration)
+	{
+		state->duration = end_time;
+	}
+
+	state->p_depth = state->depth;
 }
 
 static void
-dfxp_free_xml_doc(void *data)
+dfxp_sax_end_cue(dfxp_sax_state_t* state)
 {
-	xmlFreeDoc(data);
-}
+	subtitle_cue_t* cue;
+	u_char* text;
+	u_char* start;
+	u_char* end;
+	size_t len;
+	u_char* p;
 
-static vod_status_t
-dfxp_parse(
-	request_context_t* request_context,
-	media_parse_params_t* parse_params,
-	vod_str_t* source,
-	size_t metadata_part_count,
-	media_base_metadata_t** result)
-{
-	vod_pool_cleanup_t *cln;
-	xmlParserCtxtPtr ctxt;
-	xmlDoc *doc;
+	// trim spaces
+	text = state->cue_list.buf.start + state->cue_list.cue_offset + sizeof(*cue);
+	start = text + 1;
+	end = state->cue_list.buf.pos;
 
-	// parse the xml
-	cln = vod_pool_cleanup_add(request_context->pool, 0);
-	if (cln == NULL)
-	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"dfxp_parse: vod_pool_cleanup_add failed");
-		return VOD_ALLOC_FAILED;
-	}
+	for (; start < end && isspace(start[0]); start++);
+	for (; end > start && isspace(end[-1]); end--);
 
-	ctxt = xmlCreateDocParserCtxt(source->data);
-	if (ctxt == NULL)
+	len = end - start;
+	if (len <= 0)
 	{
-		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"dfxp_parse: xmlCreateDocParserCtxt failed");
-		return VOD_ALLOC_FAILED;
+		// Note: a cue without text is handled as a cue without begin, so that it is still counted
+		//		in the frame index if it ends before the segment
+		cue = (void*)(state->cue_list.buf.start + state->cue_list.cue_offset);
+		p = cue->start_time;
+		write_be64(p, (uint64_t)-1);
+
+		state->cue_list.buf.pos = text;
+		subtitle_cue_list_end_cue(&state->cue_list);
+		return;
 	}
 
-	xmlCtxtUseOptions(ctxt, XML_PARSE_RECOVER | XML_PARSE_NOWARNING | XML_PARSE_NONET);
-	
-	ctxt->sax->setDocumentLocator = NULL;
-	ctxt->sax->error = dfxp_xml_sax_error;
-	ctxt->sax->fatalError = dfxp_xml_sax_error;
-	ctxt->vctxt.error = dfxp_xml_schema_error;
-	ctxt->sax->_private = request_context;
-
-	if (xmlParseDocument(ctxt) != 0 ||
-		ctxt->myDoc == NULL ||
-		(!ctxt->wellFormed && !ctxt->recovery))
+	// add leading/trailing newlines
+	vod_memmove(text + 1, start, len);
+	text[0] = '\n';
+	state->cue_list.buf.pos = text + 1 + len;
+
+	if (vod_dynamic_buf_reserve(&state->cue_list.buf, 2) != VOD_OK)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"dfxp_parse: xml parsing failed");
-		if (ctxt->myDoc != NULL)
-		{
-			xmlFreeDoc(ctxt->myDoc);
-		}
-		xmlFreeParserCtxt(ctxt);
-		return VOD_BAD_DATA;
+		dfxp_sax_set_error(state, VOD_ALLOC_FAILED);
+		return;
 	}
 
-	doc = ctxt->myDoc;
-	ctxt->myDoc = NULL;
+	*state->cue_list.buf.pos++ = '\n';
+	*state->cue_list.buf.pos++ = '\n';
 
-	xmlFreeParserCtxt(ctxt);
-
-	cln->handler = dfxp_free_xml_doc;
-	cln->data = doc;
-
-	return subtitle_parse(
-		request_context,
-		parse_params,
-		source,
-		doc,
-		dfxp_get_duration(doc),
-		metadata_part_count,
-		result);
+	subtitle_cue_list_end_cue(&state->cue_list);
 }
 
-static u_char* 
-dfxp_append_string(u_char* p, u_char* s)
+static void
+dfxp_sax_start_element(
+	void* ctx,
+	const xmlChar* localname,
+	const xmlChar* prefix,
+	const xmlChar* URI,
+	int nb_namespaces,
+	const xmlChar** namespaces,
+	int nb_attributes,
+	int nb_defaulted,
+	const xmlChar** attributes)
 {
-	// Note: not using strcpy as it would require an extra strlen to get the end position
-	while (*s)
+	dfxp_sax_state_t* state = ctx;
+
+	state->depth++;
+
+	if (state->skip_depth != 0)
 	{
-		*p++ = *s++;
+		return;
 	}
-	return p;
-}
 
-static size_t
-dfxp_get_text_content_len(xmlNode* cur_node)
-{
-	xmlNode* node_stack[DFXP_MAX_STACK_DEPTH];
-	unsigned node_stack_pos = 0;
-	size_t result = 0;
-
-	for (;;)
+	if (state->p_depth == 0)
 	{
-		// traverse the tree dfs order
-		if (cur_node == NULL)
+		if (vod_strcmp(localname, DFXP_ELEMENT_P) == 0)
 		{
-			if (node_stack_pos <= 0)
+			dfxp_sax_start_cue(state, attributes, nb_attributes);
+			if (state->p_depth == 0)
 			{
-				break;
+				state->skip_depth = state->depth;
 			}
-
-			cur_node = node_stack[--node_stack_pos];
-			continue;
 		}
-
-		switch (cur_node->type)
+		else if (state->depth > DFXP_MAX_STACK_DEPTH)
 		{
-		case XML_TEXT_NODE:
-		case XML_CDATA_SECTION_NODE:
-			result += vod_strlen(cur_node->content);
-			break;
-
-		case XML_ELEMENT_NODE:
-			if (vod_strcmp(cur_node->name, DFXP_ELEMENT_BR) == 0)
-			{
-				result++;		// \n
-				break;
-			}
-
-			if (vod_strcmp(cur_node->name, DFXP_ELEMENT_SPAN) != 0 ||
-				cur_node->children == NULL ||
-				node_stack_pos >= vod_array_entries(node_stack))
-			{
-				break;
-			}
-
-			node_stack[node_stack_pos++] = cur_node->next;
-			cur_node = cur_node->children;
-			continue;
+			state->skip_depth = state->depth;
+		}
+		return;
+	}
 
-		default:
-			break;
+	// inside p, only text, br and span elements are used
+	if (vod_strcmp(localname, DFXP_ELEMENT_BR) == 0)
+	{
+		if (vod_dynamic_buf_reserve(&state->cue_list.buf, 1) != VOD_OK)
+		{
+			dfxp_sax_set_error(state, VOD_ALLOC_FAILED);
+			return;
 		}
 
-		cur_node = cur_node->next;
+		*state->cue_list.buf.pos++ = '\n';
+	}
+	else if (vod_strcmp(localname, DFXP_ELEMENT_SPAN) == 0 &&
+		state->depth - state->p_depth <= DFXP_MAX_STACK_DEPTH)
+	{
+		return;
 	}
 
-	return result;
+	state->skip_depth = state->depth;
 }
 
-static u_char* 
-dfxp_append_text_content(xmlNode* cur_node, u_char* p)
+static void
+dfxp_sax_end_element(
+	void* ctx,
+	const xmlChar* localname,
+	const xmlChar* prefix,
+	const xmlChar* URI)
 {
-	xmlNode* node_stack[DFXP_MAX_STACK_DEPTH];
-	unsigned node_stack_pos = 0;
+	dfxp_sax_state_t* state = ctx;
 
-	for (;;)
+	if (state->skip_depth != 0)
 	{
-		// traverse the tree dfs order
-		if (cur_node == NULL)
+		if (state->skip_depth == state->depth)
 		{
-			if (node_stack_pos <= 0)
-			{
-				break;
-			}
-
-			cur_node = node_stack[--node_stack_pos];
-			continue;
+			state->skip_depth = 0;
 		}
+	}
+	else if (state->p_depth == state->depth)
+	{
+		dfxp_sax_end_cue(state);
+		state->p_depth = 0;
+	}
 
-		switch (cur_node->type)
-		{
-		case XML_TEXT_NODE:
-		case XML_CDATA_SECTION_NODE:
-			p = dfxp_append_string(p, cur_node->content);
-			break;
-
-		case XML_ELEMENT_NODE:
-			if (vod_strcmp(cur_node->name, DFXP_ELEMENT_BR) == 0)
-			{
-				*p++ = '\n';
-				break;
-			}
-
-			if (vod_strcmp(cur_node->name, DFXP_ELEMENT_SPAN) != 0 ||
-				cur_node->children == NULL ||
-				node_stack_pos >= vod_array_entries(node_stack))
-			{
-				break;
-			}
+	state->depth--;
+}
 
-			node_stack[node_stack_pos++] = cur_node->next;
-			cur_node = cur_node->children;
-			continue;
+static void
+dfxp_sax_characters(void* ctx, const xmlChar* ch, int len)
+{
+	dfxp_sax_state_t* state = ctx;
 
-		default:
-			break;
-		}
+	if (state->p_depth == 0 || state->skip_depth != 0)
+	{
+		return;
+	}
 
-		cur_node = cur_node->next;
+	if (vod_dynamic_buf_reserve(&state->cue_list.buf, len) != VOD_OK)
+	{
+		dfxp_sax_set_error(state, VOD_ALLOC_FAILED);
+		return;
 	}
 
-	return p;
+	state->cue_list.buf.pos = vod_copy(state->cue_list.buf.pos, ch, len);
 }
 
+// extracts the cues of the xml in a single pass, without building a document tree
 static vod_status_t
-dfxp_get_frame_body(
-	request_context_t* request_context, 
-	xmlNode* cur_node, 
+dfxp_build_cue_list(
+	request_context_t* request_context,
+	vod_str_t* source,
 	vod_str_t* result)
 {
-	size_t alloc_size;
-	u_char* start;
-	u_char* end;
-	
-	// get the buffer length
-	alloc_size = dfxp_get_text_content_len(cur_node);
-	if (alloc_size == 0)
+	dfxp_sax_state_t state;
+	xmlSAXHandler sax;
+	vod_str_t header;
+	vod_status_t rc;
+
+	if (source->len > INT_MAX)
 	{
-		return VOD_NOT_FOUND;
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"dfxp_build_cue_list: source size %uz too big", source->len);
+		return VOD_BAD_DATA;
 	}
 
-	alloc_size += 3;		// \n * 3
+	vod_memzero(&state, sizeof(state));
+	state.request_context = request_context;
+	state.rc = VOD_OK;
+
+	header.data = (u_char*)WEBVTT_HEADER_NEWLINES;
+	header.len = sizeof(WEBVTT_HEADER_NEWLINES) - 1;
 
-	// get the text content
-	start = vod_alloc(request_context->pool, alloc_size);
-	if (start == NULL)
+	// the text is usually a small part of the xml
+	rc = subtitle_cue_list_init(&state.cue_list, request_context, source->len / 4, &header);
+	if (rc != VOD_OK)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"dfxp_get_frame_body: vod_alloc failed");
-		return VOD_ALLOC_FAILED;
+		return rc;
 	}
 
-	start++;	// save space for prepending \n
-
-	end = dfxp_append_text_content(cur_node, start);
-	if ((size_t)(end - start + 2) > alloc_size)
+	vod_memzero(&sax, sizeof(sax));
+	sax.initialized = XML_SAX2_MAGIC;
+	sax.startElementNs = dfxp_sax_start_element;
+	sax.endElementNs = dfxp_sax_end_element;
+	sax.characters = dfxp_sax_characters;
+	sax.ignorableWhitespace = dfxp_sax_characters;
+	sax.cdataBlock = dfxp_sax_characters;
+	sax.error = dfxp_xml_sax_error;
+	sax.fatalError = dfxp_xml_sax_error;
+
+	state.ctxt = xmlCreatePushParserCtxt(&sax, &state, NULL, 0, NULL);
+	if (state.ctxt == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"dfxp_get_frame_body: result length %uz exceeded allocated length %uz",
-			(size_t)(end - start + 2), alloc_size);
-		return VOD_UNEXPECTED;
+			"dfxp_build_cue_list: xmlCreatePushParserCtxt failed");
+		return VOD_ALLOC_FAILED;
 	}
 
-	// trim spaces
-	for (;;)
+	xmlCtxtUseOptions(state.ctxt, XML_PARSE_RECOVER | XML_PARSE_NOWARNING | XML_PARSE_NONET);
+
+	if (xmlParseChunk(state.ctxt, (const char*)source->data, source->len, 1) != 0 ||
+		!state.ctxt->wellFormed)
 	{
-		if (start >= end)
+		if (state.rc == VOD_OK)
 		{
-			return VOD_NOT_FOUND;
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"dfxp_build_cue_list: xml parsing failed");
+			state.rc = VOD_BAD_DATA;
 		}
+	}
 
-		if (!isspace(start[0]))
-		{
-			break;
-		}
+	xmlFreeParserCtxt(state.ctxt);
 
-		start++;
+	if (state.rc != VOD_OK)
+	{
+		return state.rc;
 	}
 
-	for (;;)
-	{
-		if (start >= end)
-		{
-			return VOD_NOT_FOUND;
-		}
+	return subtitle_cue_list_get_result(&state.cue_list, source->len, state.duration, result);
+}
 
-		if (!isspace(end[-1]))
+static vod_status_t
+dfxp_parse(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	vod_str_t* source,
+	size_t metadata_part_count,
+	media_base_metadata_t** result)
+{
+	vod_str_t cue_list;
+	vod_status_t rc;
+
+	if (subtitle_is_cue_list(source))
+	{
+		// the xml was replaced by the cue list when it was saved to the metadata cache
+		cue_list = *source;
+	}
+	else
+	{
+		rc = dfxp_build_cue_list(request_context, source, &cue_list);
+		if (rc != VOD_OK)
 		{
-			break;
+			return rc;
 		}
-
-		end--;
 	}
 
-	// add leading/trailing newlines
-	start--;
-	*start = '\n';
-	*end++ = '\n';
-	*end++ = '\n';
+	return subtitle_cue_list_parse(
+		request_context,
+		parse_params,
+		&cue_list,
+		metadata_part_count,
+		result);
+}
 
-	result->data = start;
-	result->len = end - start;
+static vod_status_t
+dfxp_compact_metadata(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	if (subtitle_is_cue_list(&metadata_parts[0]))
+	{
+		return VOD_OK;
+	}
 
-	return VOD_OK;
+	return dfxp_build_cue_list(request_context, &metadata_parts[0], &result[0]);
 }
 
 static vod_status_t
@@ -686,248 +637,12 @@ dfxp_parse_frames(
 	media_track_array_t* result)
 {
 	subtitle_base_metadata_t* metadata = vod_container_of(base, subtitle_base_metadata_t, base);
-	media_track_t* track = base->tracks.elts;
-	input_frame_t* cur_frame = NULL;
-	vod_array_t frames;
-	vod_str_t* header = &track->media_info.extra_data;
-	uint64_t base_time;
-	uint64_t clip_to;
-	uint64_t start;
-	uint64_t end;
-	int64_t last_start_time = 0;
-	int64_t start_time = 0;
-	int64_t end_time = 0;
-	int64_t duration;
-	xmlNode* node_stack[DFXP_MAX_STACK_DEPTH];
-	xmlNode* cur_node;
-	xmlNode temp_node;
-	xmlChar* attr;
-	unsigned node_stack_pos = 0;
-	vod_str_t text;
-	vod_status_t rc;
-
-	// initialize the result
-	vod_memzero(result, sizeof(*result));
-	result->first_track = track;
-	result->last_track = track + 1;
-	result->track_count[MEDIA_TYPE_SUBTITLE] = 1;
-	result->total_track_count = 1;
-
-	header->len = sizeof(WEBVTT_HEADER_NEWLINES) - 1;
-	header->data = (u_char*)WEBVTT_HEADER_NEWLINES;
-	
-	if ((parse_params->parse_type & PARSE_FLAG_FRAMES_ALL) == 0)
-	{
-		return VOD_OK;
-	}
-
-	// init the frames array
-	if (vod_array_init(&frames, request_context->pool, 5, sizeof(*cur_frame)) != VOD_OK)
-	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"dfxp_parse_frames: vod_array_init failed");
-		return VOD_ALLOC_FAILED;
-	}
-
-	// get the start / end offsets
-	start = parse_params->range->start + parse_params->clip_from;
-
-	if ((parse_params->parse_type & PARSE_FLAG_RELATIVE_TIMESTAMPS) != 0)
-	{
-		base_time = start;
-		clip_to = parse_params->range->end - parse_params->range->start;
-		end = clip_to;
-	}
-	else
-	{
-		base_time = parse_params->clip_from;
-		clip_to = parse_params->clip_to;
-		end = parse_params->range->end;		// Note: not adding clip_from, since end is checked after the clipping is applied to the timestamps
-	}
-
-	for (cur_node = xmlDocGetRootElement(metadata->context); ; cur_node = cur_node->next)
-	{
-		// traverse the tree dfs order
-		if (cur_node == NULL)
-		{
-			if (node_stack_pos <= 0)
-			{
-				if (cur_frame != NULL)
-				{
-					cur_frame->duration = end_time - start_time;
-					track->total_frames_duration = end_time - track->first_frame_time_offset;
-				}
-				break;
-			}
-
-			cur_node = node_stack[--node_stack_pos];
-			continue;
-		}
 
-		if (cur_node->type != XML_ELEMENT_NODE)
-		{
-			continue;
-		}
-
-		if (vod_strcmp(cur_node->name, DFXP_ELEMENT_P) != 0)
-		{
-			if (cur_node->children == NULL ||
-				node_stack_pos >= vod_array_entries(node_stack))
-			{
-				continue;
-			}
-
-			node_stack[node_stack_pos++] = cur_node;
-			temp_node.next = cur_node->children;
-			cur_node = &temp_node;
-			continue;
-		}
-
-		// handle p element
-		attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_END);
-		if (attr != NULL)
-		{
-			// has end time
-			end_time = dfxp_parse_timestamp(attr);
-			if (end_time < 0)
-			{
-				continue;
-			}
-
-			if ((uint64_t)end_time < start)
-			{
-				track->first_frame_index++;
-				continue;
-			}
-
-			attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_BEGIN);
-			if (attr == NULL)
-			{
-				continue;
-			}
-
-			start_time = dfxp_parse_timestamp(attr);
-			if (start_time < 0)
-			{
-				continue;
-			}
-		}
-		else
-		{
-			// no end time
-			attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_DUR);
-			if (attr == NULL)
-			{
-				continue;
-			}
-
-			duration = dfxp_parse_timestamp(attr);
-			if (duration < 0)
-			{
-				continue;
-			}
-
-			attr = dfxp_get_xml_prop(cur_node, DFXP_ATTR_BEGIN);
-			if (attr == NULL)
-			{
-				continue;
-			}
-
-			start_time = dfxp_parse_timestamp(attr);
-			if (start_time < 0)
-			{
-				continue;
-			}
-
-			end_time = start_time + duration;
-			if ((uint64_t)end_time < start)
-			{
-				track->first_frame_index++;
-				continue;
-			}
-		}
-
-		if (start_time >= end_time)
-		{
-			continue;
-		}
-
-		// apply clipping
-		if (start_time >= (int64_t)base_time)
-		{
-			start_time -= base_time;
-			if ((uint64_t)start_time > clip_to)
-			{
-				start_time = clip_to;
-			}
-		}
-		else
-		{
-			start_time = 0;
-		}
-
-		end_time -= base_time;
-		if ((uint64_t)end_time > clip_to)
-		{
-			end_time = clip_to;
-		}
-
-		// get the text
-		rc = dfxp_get_frame_body(
-			request_context,
-			cur_node->children,
-			&text);
-		switch (rc)
-		{
-		case VOD_NOT_FOUND:
-			continue;
-
-		case VOD_OK:
-			break;
-
-		default:
-			return rc;
-		}
-
-		// adjust the duration of the previous frame
-		if (cur_frame != NULL)
-		{
-			cur_frame->duration = start_time - last_start_time;
-		}
-		else
-		{
-			track->first_frame_time_offset = start_time;
-		}
-
-		if ((uint64_t)start_time >= end)
-		{
-			track->total_frames_duration = start_time - track->first_frame_time_offset;
-			break;
-		}
-
-		// add the frame
-		cur_frame = vod_array_push(&frames);
-		if (cur_frame == NULL)
-		{
-			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-				"dfxp_parse_frames: vod_array_push failed");
-			return VOD_ALLOC_FAILED;
-		}
-
-		cur_frame->offset = (uintptr_t)text.data;
-		cur_frame->size = text.len;
-		cur_frame->pts_delay = end_time - start_time;
-		cur_frame->key_frame = 0;
-		track->total_frames_size += cur_frame->size;
-
-		last_start_time = start_time;
-	}
-
-	track->frame_count = frames.nelts;
-	track->frames.first_frame = frames.elts;
-	track->frames.last_frame = track->frames.first_frame + frames.nelts;
-
-	return VOD_OK;
+	return subtitle_cue_list_parse_frames(
+		request_context,
+		metadata,
+		parse_params,
+		result);
 }
 
 void
@@ -951,4 +666,8 @@ media_format_t dfxp_format = {
 	NULL,
 	dfxp_parse,
 	dfxp_parse_frames,
+	dfxp_compact_metadata,
+	NULL,
+	NULL,			// resume_metadata_reader
+	NULL,			// free_metadata_reader
 };
@@ -1,5 +1,7 @@
 #include "subtitle_format.h"
 #include "../media_set.h"
+#include "../read_stream.h"
+#include "../write_stream.h"
 
 // typedefs
 typedef struct {
@@ -81,6 +83,8 @@ subtitle_parse(
 	}
 
 	*result = &metadata->base;
+	metadata->cue_list = NULL;
+	vod_memzero(metadata->base.file_track_count, sizeof(metadata->base.file_track_count));
 
 	if (!vod_codec_in_mask(VOD_CODEC_ID_WEBVTT, parse_params->codecs_mask))
 	{
@@ -146,9 +150,506 @@ subtitle_parse(
 
 	metadata->source = *source;
 	metadata->context = context;
+
+	// the cue index is saved to the metadata cache as an additional part
+	if (metadata_part_count > 1)
+	{
+		metadata->cue_index = source[1];
+	}
+	else
+	{
+		metadata->cue_index.len = 0;
+	}
+
 	metadata->base.duration = duration;
 	metadata->base.timescale = 1000;
 
 	return VOD_OK;
 }
 
+
+vod_status_t
+subtitle_cue_index_init(
+	subtitle_cue_index_builder_t* builder,
+	request_context_t* request_context)
+{
+	if (vod_array_init(&builder->entries, request_context->pool, 16, sizeof(subtitle_cue_index_entry_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"subtitle_cue_index_init: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	builder->request_context = request_context;
+	builder->cue_count = 0;
+	builder->max_end_time = 0;
+
+	return VOD_OK;
+}
+
+vod_status_t
+subtitle_cue_index_add(
+	subtitle_cue_index_builder_t* builder,
+	size_t offset,
+	uint64_t end_time)
+{
+	subtitle_cue_index_entry_t* entry;
+	u_char* p;
+
+	if (builder->cue_count > 0 &&
+		builder->cue_count % SUBTITLE_CUE_INDEX_INTERVAL == 0)
+	{
+		if (offset > UINT_MAX)
+		{
+			return VOD_OK;
+		}
+
+		entry = vod_array_push(&builder->entries);
+		if (entry == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+				"subtitle_cue_index_add: vod_array_push failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		p = entry->offset;
+		write_be32(p, offset);
+		write_be32(p, builder->cue_count);
+		write_be64(p, builder->max_end_time);
+	}
+
+	builder->cue_count++;
+	if (end_time > builder->max_end_time)
+	{
+		builder->max_end_time = end_time;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+subtitle_cue_index_get_result(
+	subtitle_cue_index_builder_t* builder,
+	vod_str_t* result)
+{
+	if (builder->entries.nelts <= 0)
+	{
+		// too few cues, the frames are found quickly without an index
+		return VOD_NOT_FOUND;
+	}
+
+	result->data = builder->entries.elts;
+	result->len = builder->entries.nelts * sizeof(subtitle_cue_index_entry_t);
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+		"subtitle_cue_index_get_result: %uD cues, %ui checkpoints", builder->cue_count, builder->entries.nelts);
+
+	return VOD_OK;
+}
+
+const subtitle_cue_index_entry_t*
+subtitle_cue_index_find(
+	vod_str_t* cue_index,
+	size_t source_size,
+	uint64_t start)
+{
+	const subtitle_cue_index_entry_t* first = (const void*)cue_index->data;
+	const subtitle_cue_index_entry_t* result;
+	uint32_t left = 0;
+	uint32_t right = cue_index->len / sizeof(*first);
+	uint32_t mid;
+
+	// find the first entry that has a preceding cue ending at or after start,
+	// the max end time is non decreasing, since it is the max of all preceding cues
+	while (left < right)
+	{
+		mid = (left + right) / 2;
+		if (parse_be64(first[mid].max_end_time) < start)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left == 0)
+	{
+		return NULL;
+	}
+
+	result = &first[left - 1];
+	if (parse_be32(result->offset) > source_size)
+	{
+		return NULL;
+	}
+
+	return result;
+}
+
+bool_t
+subtitle_is_cue_list(vod_str_t* source)
+{
+	return source->len >= sizeof(subtitle_cue_list_header_t) &&
+		vod_memcmp(source->data, SUBTITLE_CUE_LIST_MAGIC, sizeof(((subtitle_cue_list_header_t*)NULL)->magic)) == 0;
+}
+
+vod_status_t
+subtitle_cue_list_init(
+	subtitle_cue_list_builder_t* builder,
+	request_context_t* request_context,
+	size_t initial_size,
+	vod_str_t* header)
+{
+	subtitle_cue_list_header_t* list_header;
+	vod_status_t rc;
+	u_char* p;
+
+	rc = vod_dynamic_buf_init(&builder->buf, request_context, sizeof(subtitle_cue_list_header_t) + header->len + initial_size);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	builder->request_context = request_context;
+	builder->cue_count = 0;
+
+	// the other header fields are set in subtitle_cue_list_get_result
+	list_header = (void*)builder->buf.start;
+	p = list_header->header_len;
+	write_be32(p, header->len);
+
+	builder->buf.pos = vod_copy((u_char*)(list_header + 1), header->data, header->len);
+
+	return VOD_OK;
+}
+
+vod_status_t
+subtitle_cue_list_start_cue(
+	subtitle_cue_list_builder_t* builder,
+	int64_t start_time,
+	int64_t end_time,
+	uint32_t id_len)
+{
+	vod_status_t rc;
+	u_char* p;
+
+	rc = vod_dynamic_buf_reserve(&builder->buf, sizeof(subtitle_cue_t));
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	builder->cue_offset = builder->buf.pos - builder->buf.start;
+
+	p = builder->buf.pos;
+	write_be64(p, start_time);
+	write_be64(p, end_time);
+	write_be32(p, id_len);
+
+	builder->buf.pos += sizeof(subtitle_cue_t);
+
+	return VOD_OK;
+}
+
+void
+subtitle_cue_list_end_cue(
+	subtitle_cue_list_builder_t* builder)
+{
+	subtitle_cue_t* cue;
+	u_char* p;
+
+	cue = (void*)(builder->buf.start + builder->cue_offset);
+	p = cue->size;
+	write_be32(p, builder->buf.pos - (u_char*)(cue + 1));
+
+	builder->cue_count++;
+}
+
+vod_status_t
+subtitle_cue_list_get_result(
+	subtitle_cue_list_builder_t* builder,
+	size_t source_size,
+	uint64_t duration,
+	vod_str_t* result)
+{
+	subtitle_cue_list_header_t* header;
+	u_char* p;
+
+	result->data = builder->buf.start;
+	result->len = builder->buf.pos - builder->buf.start;
+
+	if (result->len > UINT_MAX || source_size > UINT_MAX)
+	{
+		vod_log_error(VOD_LOG_ERR, builder->request_context->log, 0,
+			"subtitle_cue_list_get_result: cue list size %uz / source size %uz too big", result->len, source_size);
+		return VOD_BAD_DATA;
+	}
+
+	header = (void*)result->data;
+
+	p = result->data;
+	p = vod_copy(p, SUBTITLE_CUE_LIST_MAGIC, sizeof(header->magic));
+	write_be32(p, result->len);
+	write_be32(p, source_size);
+	write_be32(p, builder->cue_count);
+	write_be64(p, duration);
+
+	vod_log_debug3(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+		"subtitle_cue_list_get_result: %uD cues, source size %uz, cue list size %uz",
+		builder->cue_count, source_size, result->len);
+
+	return VOD_OK;
+}
+
+vod_status_t
+subtitle_cue_list_parse(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	vod_str_t* source,
+	size_t metadata_part_count,
+	media_base_metadata_t** result)
+{
+	subtitle_cue_list_header_t* header = (void*)source->data;
+	subtitle_base_metadata_t* metadata;
+	media_track_t* track;
+	vod_status_t rc;
+
+	// Note: the cue list may have been loaded from the metadata cache, the sizes are validated
+	if (parse_be32(header->size) != source->len ||
+		parse_be32(header->header_len) > source->len - sizeof(*header))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"subtitle_cue_list_parse: invalid cue list, size %uD, header size %uD, buffer size %uz",
+			parse_be32(header->size), parse_be32(header->header_len), source->len);
+		return VOD_BAD_DATA;
+	}
+
+	rc = subtitle_parse(
+		request_context,
+		parse_params,
+		source,
+		NULL,
+		parse_be64(header->duration),
+		metadata_part_count,
+		result);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	metadata = vod_container_of(*result, subtitle_base_metadata_t, base);
+	metadata->cue_list = header;
+
+	if (metadata->base.tracks.nelts <= 0)
+	{
+		return VOD_OK;
+	}
+
+	// the bitrate is estimated from the size of the original source
+	track = metadata->base.tracks.elts;
+	track->media_info.bitrate = ((uint64_t)parse_be32(header->source_size) * 1000 * 8) /
+		track->media_info.full_duration;
+
+	return VOD_OK;
+}
+
+vod_status_t
+subtitle_cue_list_parse_frames(
+	request_context_t* request_context,
+	subtitle_base_metadata_t* metadata,
+	media_parse_params_t* parse_params,
+	media_track_array_t* result)
+{
+	subtitle_cue_list_header_t* list_header = metadata->cue_list;
+	media_track_t* track = metadata->base.tracks.elts;
+	input_frame_t* cur_frame = NULL;
+	subtitle_cue_t* cue;
+	vod_array_t frames;
+	vod_str_t* header = &track->media_info.extra_data;
+	vod_str_t data;
+	uint64_t base_time;
+	uint64_t clip_to;
+	uint64_t start;
+	uint64_t end;
+	uint32_t cues_left;
+	int64_t last_start_time = 0;
+	int64_t start_time = 0;
+	int64_t end_time = 0;
+	u_char* cur_pos;
+	u_char* end_pos;
+	u_char* p;
+
+	vod_memzero(result, sizeof(*result));
+	result->first_track = track;
+	result->last_track = track + 1;
+	result->track_count[MEDIA_TYPE_SUBTITLE] = 1;
+	result->total_track_count = 1;
+
+	if ((parse_params->parse_type & (PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_EXTRA_DATA | PARSE_FLAG_EXTRA_DATA_SIZE)) == 0)
+	{
+		return VOD_OK;
+	}
+
+	// Note: the cue list may be in the metadata cache, that is released after parsing, so the
+	//		header and cues are copied
+	cur_pos = (u_char*)(list_header + 1);
+	end_pos = (u_char*)list_header + parse_be32(list_header->size);
+
+	header->len = parse_be32(list_header->header_len);
+	header->data = cur_pos;
+	header->data = vod_pstrdup(request_context->pool, header);
+	if (header->data == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"subtitle_cue_list_parse_frames: vod_pstrdup failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cur_pos += header->len;
+
+	if ((parse_params->parse_type & PARSE_FLAG_FRAMES_ALL) == 0)
+	{
+		return VOD_OK;
+	}
+
+	if (vod_array_init(&frames, request_context->pool, 5, sizeof(*cur_frame)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"subtitle_cue_list_parse_frames: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	start = parse_params->range->start + parse_params->clip_from;
+
+	if ((parse_params->parse_type & PARSE_FLAG_RELATIVE_TIMESTAMPS) != 0)
+	{
+		base_time = start;
+		clip_to = parse_params->range->end - parse_params->range->start;
+		end = clip_to;
+	}
+	else
+	{
+		base_time = parse_params->clip_from;
+		clip_to = parse_params->clip_to;
+		end = parse_params->range->end;		// Note: not adding clip_from, since end is checked after the clipping is applied to the timestamps
+	}
+
+	for (cues_left = parse_be32(list_header->cue_count); ; cues_left--)
+	{
+		if (cues_left <= 0)
+		{
+			if (cur_frame != NULL)
+			{
+				cur_frame->duration = end_time - start_time;
+				track->total_frames_duration = end_time - track->first_frame_time_offset;
+			}
+			break;
+		}
+
+		if ((size_t)(end_pos - cur_pos) < sizeof(*cue))
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"subtitle_cue_list_parse_frames: cue list overflow");
+			return VOD_BAD_DATA;
+		}
+
+		cue = (void*)cur_pos;
+		data.data = (u_char*)(cue + 1);
+		data.len = parse_be32(cue->size);
+		if (data.len > (size_t)(end_pos - data.data) ||
+			parse_be32(cue->id_len) > data.len)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"subtitle_cue_list_parse_frames: invalid cue size %uz", data.len);
+			return VOD_BAD_DATA;
+		}
+
+		cur_pos = data.data + data.len;
+
+		end_time = parse_be64(cue->end_time);
+		if ((uint64_t)end_time < start)
+		{
+			track->first_frame_index++;
+			continue;
+		}
+
+		start_time = parse_be64(cue->start_time);
+		if (start_time < 0 || start_time >= end_time)
+		{
+			continue;
+		}
+
+		// apply clipping
+		if (start_time >= (int64_t)base_time)
+		{
+			start_time -= base_time;
+			if ((uint64_t)start_time > clip_to)
+			{
+				start_time = clip_to;
+			}
+		}
+		else
+		{
+			start_time = 0;
+		}
+
+		end_time -= base_time;
+		if ((uint64_t)end_time > clip_to)
+		{
+			end_time = clip_to;
+		}
+
+		// adjust the duration of the previous frame
+		if (cur_frame != NULL)
+		{
+			cur_frame->duration = start_time - last_start_time;
+		}
+		else
+		{
+			track->first_frame_time_offset = start_time;
+		}
+
+		if ((uint64_t)start_time >= end)
+		{
+			track->total_frames_duration = start_time - track->first_frame_time_offset;
+			break;
+		}
+
+		// add the frame
+		cur_frame = vod_array_push(&frames);
+		if (cur_frame == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"subtitle_cue_list_parse_frames: vod_array_push failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		p = vod_alloc(request_context->pool, data.len);
+		if (p == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"subtitle_cue_list_parse_frames: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		vod_memcpy(p, data.data, data.len);
+
+		// Note: same mapping of cue into input_frame_t as the formats - offset points to the cue id,
+		//		cue settings list and cue payload, key_frame = cue id length
+		cur_frame->offset = (uintptr_t)p;
+		cur_frame->size = data.len;
+		cur_frame->pts_delay = end_time - start_time;
+		cur_frame->key_frame = parse_be32(cue->id_len);
+		track->total_frames_size += cur_frame->size;
+
+		last_start_time = start_time;
+	}
+
+	track->frame_count = frames.nelts;
+	track->frames.first_frame = frames.elts;
+	track->frames.last_frame = track->frames.first_frame + frames.nelts;
+
+	return VOD_OK;
+}
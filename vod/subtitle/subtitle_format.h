@@ -3,15 +3,62 @@
 
 // includes
 #include "../media_format.h"
+#include "../dynamic_buffer.h"
 
 // constants
 #define WEBVTT_HEADER_NEWLINES ("WEBVTT\r\n\r\n")
 #define UTF8_BOM ("\xEF\xBB\xBF")
 
+// the index holds a checkpoint for every SUBTITLE_CUE_INDEX_INTERVAL cues
+#define SUBTITLE_CUE_INDEX_INTERVAL (64)
+
+// a cue list starts with this magic, subtitle sources can never start with a null char
+#define SUBTITLE_CUE_LIST_MAGIC "\0cue"
+
 // typedefs
+typedef struct {
+	u_char offset[4];			// offset in the source from which the cue is searched
+	u_char frame_index[4];		// number of preceding cues
+	u_char max_end_time[8];		// max end time of the preceding cues
+} subtitle_cue_index_entry_t;
+
+typedef struct {
+	request_context_t* request_context;
+	vod_array_t entries;
+	uint32_t cue_count;
+	uint64_t max_end_time;
+} subtitle_cue_index_builder_t;
+
+// a cue list is a format independent representation of the cues of a subtitle source, it is built
+// once when the source is saved to the metadata cache, and replaces the source in the cache
+typedef struct {
+	u_char magic[4];
+	u_char size[4];				// size of the cue list, including the header
+	u_char source_size[4];		// size of the original source
+	u_char cue_count[4];
+	u_char duration[8];
+	u_char header_len[4];		// followed by the webvtt header
+} subtitle_cue_list_header_t;
+
+typedef struct {
+	u_char start_time[8];		// negative if the cue has no valid start time
+	u_char end_time[8];
+	u_char id_len[4];
+	u_char size[4];				// followed by the cue id, cue settings list and cue payload (same as the frames)
+} subtitle_cue_t;
+
+typedef struct {
+	request_context_t* request_context;
+	vod_dynamic_buf_t buf;		// the cue data is written directly to the buffer
+	uint32_t cue_count;
+	size_t cue_offset;			// offset of the current subtitle_cue_t in buf
+} subtitle_cue_list_builder_t;
+
 typedef struct {
 	media_base_metadata_t base;
 	vod_str_t source;
+	vod_str_t cue_index;		// empty if the metadata was not loaded from cache with an index
+	subtitle_cue_list_header_t* cue_list;	// null unless the source is a cue list
 	void* context;
 } subtitle_base_metadata_t;
 
@@ -35,4 +82,64 @@ vod_status_t subtitle_parse(
 	size_t metadata_part_count,
 	media_base_metadata_t** result);
 
+// cue index
+vod_status_t subtitle_cue_index_init(
+	subtitle_cue_index_builder_t* builder,
+	request_context_t* request_context);
+
+// must be called in the order of the cues in the source, offset is the position from which the cue is searched
+vod_status_t subtitle_cue_index_add(
+	subtitle_cue_index_builder_t* builder,
+	size_t offset,
+	uint64_t end_time);
+
+vod_status_t subtitle_cue_index_get_result(
+	subtitle_cue_index_builder_t* builder,
+	vod_str_t* result);
+
+// returns the last checkpoint whose preceding cues all end before start, NULL if there is none
+const subtitle_cue_index_entry_t* subtitle_cue_index_find(
+	vod_str_t* cue_index,
+	size_t source_size,
+	uint64_t start);
+
+// cue list
+bool_t subtitle_is_cue_list(vod_str_t* source);
+
+vod_status_t subtitle_cue_list_init(
+	subtitle_cue_list_builder_t* builder,
+	request_context_t* request_context,
+	size_t initial_size,
+	vod_str_t* header);
+
+// the cue data is appended to builder->buf after calling this function
+vod_status_t subtitle_cue_list_start_cue(
+	subtitle_cue_list_builder_t* builder,
+	int64_t start_time,
+	int64_t end_time,
+	uint32_t id_len);
+
+void subtitle_cue_list_end_cue(
+	subtitle_cue_list_builder_t* builder);
+
+vod_status_t subtitle_cue_list_get_result(
+	subtitle_cue_list_builder_t* builder,
+	size_t source_size,
+	uint64_t duration,
+	vod_str_t* result);
+
+// used by the formats in place of subtitle_parse / their parse_frames when the source is a cue list
+vod_status_t subtitle_cue_list_parse(
+	request_context_t* request_context,
+	media_parse_params_t* parse_params,
+	vod_str_t* source,
+	size_t metadata_part_count,
+	media_base_metadata_t** result);
+
+vod_status_t subtitle_cue_list_parse_frames(
+	request_context_t* request_context,
+	subtitle_base_metadata_t* metadata,
+	media_parse_params_t* parse_params,
+	media_track_array_t* result);
+
 #endif //__SUBTITLE_FORMAT_H__
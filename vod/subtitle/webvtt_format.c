@@ -2,6 +2,7 @@
 #include "../media_clip.h"
 #include "../media_set.h"
 #include "subtitle_format.h"
+#include "../read_stream.h"
 #include <ctype.h>
 
 // macros
@@ -422,7 +423,20 @@ webvtt_parse(
 #if (VOD_HAVE_ICONV)
 	u_char* p = source->data;
 	vod_status_t rc;
+#endif // VOD_HAVE_ICONV
+
+	if (subtitle_is_cue_list(source))
+	{
+		// the source was replaced by the cue list when it was saved to the metadata cache
+		return subtitle_cue_list_parse(
+			request_context,
+			parse_params,
+			source,
+			metadata_part_count,
+			result);
+	}
 
+#if (VOD_HAVE_ICONV)
 	if (webvtt_is_utf16le_bom(p))
 	{
 		// skip the bom
@@ -461,6 +475,94 @@ webvtt_parse(
 		result);
 }
 
+// parses the file magic line and the blocks that precede the first cue, cue_pos is set to the position
+// from which the cues are searched, or to NULL if the file has no cues
+static vod_status_t
+webvtt_parse_header(
+	request_context_t* request_context,
+	vod_str_t* source,
+	u_char** start_pos,
+	u_char** cue_pos,
+	vod_str_t* header)
+{
+	u_char* cur_pos = source->data;
+	u_char* prev_line;
+
+	// skip the file magic line
+	if (vod_strncmp(cur_pos, UTF8_BOM, sizeof(UTF8_BOM) - 1) == 0)
+	{
+		cur_pos += sizeof(UTF8_BOM) - 1;
+	}
+
+	*start_pos = cur_pos;
+
+	if (vod_strncmp(cur_pos, WEBVTT_HEADER, sizeof(WEBVTT_HEADER) - 1) != 0)
+	{
+		header->len = sizeof(WEBVTT_HEADER_NEWLINES) - 1;
+		header->data = (u_char*)WEBVTT_HEADER_NEWLINES;
+		*cue_pos = cur_pos;
+		return VOD_OK;
+	}
+
+	header->data = cur_pos;
+	cur_pos += sizeof(WEBVTT_HEADER) - 1;
+
+	for (;;)
+	{
+		if (*cur_pos == '\r')
+		{
+			cur_pos++;
+			if (*cur_pos == '\n')
+			{
+				cur_pos++;
+			}
+			break;
+		}
+		else if (*cur_pos == '\n')
+		{
+			cur_pos++;
+			break;
+		}
+		else if (*cur_pos == '\0')
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"webvtt_parse_header: eof while reading file magic line");
+			return VOD_BAD_DATA;
+		}
+
+		cur_pos++;
+	}
+
+	// find the start of the first cue
+	cur_pos = webvtt_find_next_cue(cur_pos);
+	if (cur_pos == NULL)
+	{
+		header->len = source->len;
+		*cue_pos = NULL;
+		return VOD_OK;
+	}
+
+	cur_pos = webvtt_find_prev_newline_no_limit(cur_pos);
+
+	prev_line = webvtt_skip_newline_reverse_no_limit(cur_pos);
+	if (*prev_line != '\r' && *prev_line != '\n')
+	{
+		cur_pos = webvtt_find_prev_newline(prev_line, *start_pos);
+		if (cur_pos == NULL)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"webvtt_parse_header: failed to extract cue identifier");
+			return VOD_BAD_DATA;
+		}
+	}
+
+	cur_pos++;		// \r or \n
+	header->len = cur_pos - header->data;
+	*cue_pos = cur_pos;
+
+	return VOD_OK;
+}
+
 static vod_status_t
 webvtt_parse_frames(
 	request_context_t* request_context,
@@ -472,6 +574,7 @@ webvtt_parse_frames(
 	media_format_read_request_t* read_req,
 	media_track_array_t* result)
 {
+	const subtitle_cue_index_entry_t* index_entry;
 	subtitle_base_metadata_t* metadata = vod_container_of(base, subtitle_base_metadata_t, base);
 	media_track_t* track = base->tracks.elts;
 	input_frame_t* cur_frame = NULL;
@@ -487,14 +590,24 @@ webvtt_parse_frames(
 	int64_t start_time = 0;
 	int64_t end_time = 0;
 	u_char* timings_end;
-	u_char* cur_pos = source->data;
+	u_char* cur_pos;
 	u_char* start_pos;
 	u_char* cue_start;
 	u_char* prev_line;
 	u_char* p;
+	vod_status_t rc;
 
 	// XXXXX consider adding a separate segmenter for subtitles
 
+	if (metadata->cue_list != NULL)
+	{
+		return subtitle_cue_list_parse_frames(
+			request_context,
+			metadata,
+			parse_params,
+			result);
+	}
+
 	vod_memzero(result, sizeof(*result));
 	result->first_track = track;
 	result->last_track = track + 1;
@@ -506,91 +619,25 @@ webvtt_parse_frames(
 		return VOD_OK;
 	}
 
-	// skip the file magic line
-	if (vod_strncmp(cur_pos, UTF8_BOM, sizeof(UTF8_BOM) - 1) == 0)
+	rc = webvtt_parse_header(request_context, source, &start_pos, &cur_pos, header);
+	if (rc != VOD_OK)
 	{
-		cur_pos += sizeof(UTF8_BOM) - 1;
+		return rc;
 	}
 
-	start_pos = cur_pos;
-	header->data = cur_pos;
-
-	if (vod_strncmp(cur_pos, WEBVTT_HEADER, sizeof(WEBVTT_HEADER) - 1) == 0)
+	if (header->data != (u_char*)WEBVTT_HEADER_NEWLINES)
 	{
-		cur_pos += sizeof(WEBVTT_HEADER) - 1;
-
-		for (;;)
-		{
-			if (*cur_pos == '\r')
-			{
-				cur_pos++;
-				if (*cur_pos == '\n')
-				{
-					cur_pos++;
-				}
-				break;
-			}
-			else if (*cur_pos == '\n')
-			{
-				cur_pos++;
-				break;
-			}
-			else if (*cur_pos == '\0')
-			{
-				vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-					"webvtt_parse_frames: eof while reading file magic line");
-				return VOD_BAD_DATA;
-			}
-
-			cur_pos++;
-		}
-
-		// find the start of the first cue
-		cur_pos = webvtt_find_next_cue(cur_pos);
-		if (cur_pos == NULL)
-		{
-			header->len = source->len;
-			header->data = vod_pstrdup(request_context->pool, header);
-			if (header->data == NULL)
-			{
-				vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-					"webvtt_parse_frames: vod_pstrdup failed (1)");
-				return VOD_ALLOC_FAILED;
-			}
-			return VOD_OK;
-		}
-
-		cur_pos = webvtt_find_prev_newline_no_limit(cur_pos);
-
-		prev_line = webvtt_skip_newline_reverse_no_limit(cur_pos);
-		if (*prev_line != '\r' && *prev_line != '\n')
-		{
-			cur_pos = webvtt_find_prev_newline(prev_line, start_pos);
-			if (cur_pos == NULL)
-			{
-				vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-					"webvtt_parse_frames: failed to extract cue identifier");
-				return VOD_BAD_DATA;
-			}
-		}
-
-		cur_pos++;		// \r or \n
-		header->len = cur_pos - header->data;
 		header->data = vod_pstrdup(request_context->pool, header);
 		if (header->data == NULL)
 		{
 			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-				"webvtt_parse_frames: vod_pstrdup failed (2)");
+				"webvtt_parse_frames: vod_pstrdup failed");
 			return VOD_ALLOC_FAILED;
 		}
 	}
-	else
-	{
-		header->len = sizeof(WEBVTT_HEADER_NEWLINES) - 1;
-		header->data = (u_char*)WEBVTT_HEADER_NEWLINES;
-	}
 
-	if ((parse_params->parse_type & PARSE_FLAG_FRAMES_ALL) == 0)
+	if (cur_pos == NULL ||
+		(parse_params->parse_type & PARSE_FLAG_FRAMES_ALL) == 0)
 	{
 		return VOD_OK;
 	}
@@ -618,6 +665,18 @@ webvtt_parse_frames(
 		end = parse_params->range->end;		// Note: not adding clip_from, since end is checked after the clipping is applied to the timestamps
 	}
 
+	// skip the cues that end before the start time
+	if (metadata->cue_index.len > 0)
+	{
+		index_entry = subtitle_cue_index_find(&metadata->cue_index, source->len, start);
+		if (index_entry != NULL &&
+			source->data + parse_be32(index_entry->offset) > cur_pos)
+		{
+			cur_pos = source->data + parse_be32(index_entry->offset);
+			track->first_frame_index = parse_be32(index_entry->frame_index);
+		}
+	}
+
 	for (;;)
 	{
 		// find next cue
@@ -765,6 +824,198 @@ webvtt_parse_frames(
 	return VOD_OK;
 }
 
+// Note: must walk the cues in the same way webvtt_parse_frames skips the cues that end before the start time
+static vod_status_t
+webvtt_build_cue_index(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	subtitle_cue_index_builder_t builder;
+	vod_status_t rc;
+	int64_t end_time;
+	u_char* start_pos = metadata_parts[0].data;
+	u_char* cur_pos = start_pos;
+	u_char* cue_start;
+	size_t offset;
+
+	if (subtitle_is_cue_list(&metadata_parts[0]))
+	{
+		// the cue list is parsed without an index
+		return VOD_NOT_FOUND;
+	}
+
+	rc = subtitle_cue_index_init(&builder, request_context);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	for (;;)
+	{
+		offset = cur_pos - start_pos;
+
+		cue_start = webvtt_find_next_cue(cur_pos);
+		if (cue_start == NULL)
+		{
+			break;
+		}
+
+		cur_pos = cue_start;
+		for (; *cur_pos == ' ' || *cur_pos == '\t'; cur_pos++);
+
+		end_time = webvtt_read_timestamp(cur_pos, NULL);
+		if (end_time < 0)
+		{
+			continue;
+		}
+
+		rc = subtitle_cue_index_add(&builder, offset, end_time);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	return subtitle_cue_index_get_result(&builder, result);
+}
+
+// Note: must extract the cues in the same way webvtt_parse_frames does
+static vod_status_t
+webvtt_build_cue_list(
+	request_context_t* request_context,
+	vod_str_t* source,
+	vod_str_t* result)
+{
+	subtitle_cue_list_builder_t builder;
+	vod_str_t cue_id = vod_null_string;
+	vod_str_t header;
+	vod_status_t rc;
+	int64_t start_time;
+	int64_t end_time;
+	u_char* timings_end;
+	u_char* cur_pos;
+	u_char* start_pos;
+	u_char* cue_start;
+	u_char* cue_end;
+	u_char* prev_line;
+
+	rc = webvtt_parse_header(request_context, source, &start_pos, &cur_pos, &header);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// the cues take about the same size as the source
+	rc = subtitle_cue_list_init(&builder, request_context, source->len, &header);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	while (cur_pos != NULL)
+	{
+		// find next cue
+		cue_start = webvtt_find_next_cue(cur_pos);
+		if (cue_start == NULL)
+		{
+			break;
+		}
+
+		// parse end time
+		cur_pos = cue_start;
+		for (; *cur_pos == ' ' || *cur_pos == '\t'; cur_pos++);
+
+		end_time = webvtt_read_timestamp(cur_pos, &timings_end);
+		if (end_time < 0)
+		{
+			continue;
+		}
+
+		// start time
+		cue_start = webvtt_find_prev_newline_no_limit(cue_start - (sizeof(WEBVTT_CUE_MARKER) - 1));
+
+		start_time = webvtt_read_timestamp(cue_start + 1, NULL);
+		if (start_time < 0)
+		{
+			// Note: saving the cue without data, since it is counted in the frame index if it ends before the segment
+			rc = subtitle_cue_list_start_cue(&builder, -1, end_time, 0);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			subtitle_cue_list_end_cue(&builder);
+			continue;
+		}
+
+		// identifier
+		prev_line = webvtt_skip_newline_reverse_no_limit(cue_start);
+		if (*prev_line != '\r' && *prev_line != '\n')
+		{
+			cue_id.data = webvtt_find_prev_newline(prev_line, start_pos);
+			if (cue_id.data == NULL)
+			{
+				cue_id.data = start_pos;
+			}
+			else
+			{
+				cue_id.data++;
+			}
+			cue_id.len = cue_start + 1 - cue_id.data;
+		}
+		else
+		{
+			cue_id.len = 0;
+		}
+
+		// find the end of the cue
+		cue_end = webvtt_find_next_empty_line(timings_end, FALSE);
+		if (cue_end == NULL)
+		{
+			cue_end = source->data + source->len;
+		}
+
+		// same data as the frames - cue id, cue settings list, cue payload
+		rc = subtitle_cue_list_start_cue(&builder, start_time, end_time, cue_id.len);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		rc = vod_dynamic_buf_reserve(&builder.buf, cue_id.len + (cue_end - timings_end));
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		builder.buf.pos = vod_copy(builder.buf.pos, cue_id.data, cue_id.len);
+		builder.buf.pos = vod_copy(builder.buf.pos, timings_end, cue_end - timings_end);
+
+		subtitle_cue_list_end_cue(&builder);
+
+		cur_pos = cue_end;
+	}
+
+	return subtitle_cue_list_get_result(&builder, source->len, webvtt_estimate_duration(source), result);
+}
+
+static vod_status_t
+webvtt_compact_metadata(
+	request_context_t* request_context,
+	vod_str_t* metadata_parts,
+	size_t metadata_part_count,
+	vod_str_t* result)
+{
+	if (subtitle_is_cue_list(&metadata_parts[0]))
+	{
+		return VOD_OK;
+	}
+
+	return webvtt_build_cue_list(request_context, &metadata_parts[0], &result[0]);
+}
+
 media_format_t webvtt_format = {
 	FORMAT_ID_WEBVTT,
 	vod_string("webvtt"),
@@ -774,4 +1025,8 @@ media_format_t webvtt_format = {
 	NULL,
 	webvtt_parse,
 	webvtt_parse_frames,
+	webvtt_compact_metadata,
+	webvtt_build_cue_index,
+	NULL,			// resume_metadata_reader
+	NULL,			// free_metadata_reader
 };
@@ -3,12 +3,48 @@
 
 #include <libavcodec/avcodec.h>
 
+// avcodec_get_hw_config was added in ffmpeg 4.0
+#define THUMB_GRABBER_HW_DECODE (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100))
+
+#if (THUMB_GRABBER_HW_DECODE)
+#include <libavutil/hwcontext.h>
+#endif // THUMB_GRABBER_HW_DECODE
+
 #if (VOD_HAVE_LIB_SW_SCALE)
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
 #endif // VOD_HAVE_LIB_SW_SCALE
 
+// constants
+#define THUMB_TILES_MAX_DIMENSION (8192)
+#define THUMB_GRABBER_MAX_HW_DEVICES (4)
+
 // typedefs
+#if (VOD_HAVE_LIB_SW_SCALE)
+typedef struct
+{
+	uint32_t* frame_indexes;		// [count] the index of the key frame of each tile, relative to the first frame
+	uint32_t count;
+	uint32_t cur_tile;
+	uint32_t cur_frame_index;
+	uint32_t columns;
+	uint32_t width;
+	uint32_t height;
+	AVFrame* frame;
+	struct SwsContext* sws_ctx;
+} thumb_grabber_tiles_t;
+#endif // VOD_HAVE_LIB_SW_SCALE
+
+#if (THUMB_GRABBER_HW_DECODE)
+struct thumb_grabber_hw_device_s
+{
+	vod_str_t type_name;
+	vod_str_t device;
+	enum AVHWDeviceType type;
+	AVBufferRef* device_ctx;		// NULL if the device could not be created
+};
+#endif // THUMB_GRABBER_HW_DECODE
+
 typedef struct
 {
 	// fixed
@@ -23,6 +59,7 @@ typedef struct
 	AVPacket output_packet;
 	void* resize_buffer;
 	int has_frame;
+	enum AVPixelFormat hw_pix_fmt;
 
 	// frame state
 	frame_list_part_t cur_frame_part;
@@ -38,6 +75,10 @@ typedef struct
 	u_char* frame_buffer;
 	uint32_t cur_frame_pos;
 
+#if (VOD_HAVE_LIB_SW_SCALE)
+	// tiles state
+	thumb_grabber_tiles_t* tiles;
+#endif // VOD_HAVE_LIB_SW_SCALE
 } thumb_grabber_state_t;
 
 typedef struct {
@@ -46,9 +87,21 @@ typedef struct {
 	const char* name;
 } codec_id_mapping_t;
 
+typedef struct {
+	enum AVCodecID av_codec_id;
+	enum AVPixelFormat pix_fmt;
+	const char* name;
+} image_format_mapping_t;
+
 // globals
 static AVCodec *decoder_codec[VOD_CODEC_ID_COUNT];
-static AVCodec *encoder_codec = NULL;
+static AVCodec *encoder_codec[THUMB_FORMAT_COUNT];
+static bool_t init_done = FALSE;
+
+#if (THUMB_GRABBER_HW_DECODE)
+static thumb_grabber_hw_device_t hw_devices[THUMB_GRABBER_MAX_HW_DEVICES];
+static uint32_t hw_device_count = 0;
+#endif // THUMB_GRABBER_HW_DECODE
 
 static codec_id_mapping_t codec_mappings[] = {
 	{ VOD_CODEC_ID_AVC, AV_CODEC_ID_H264, "h264" },
@@ -57,23 +110,42 @@ static codec_id_mapping_t codec_mappings[] = {
 	{ VOD_CODEC_ID_VP9, AV_CODEC_ID_VP9, "vp9" },
 };
 
-void
-thumb_grabber_process_init(vod_log_t* log)
+static image_format_mapping_t image_format_mappings[THUMB_FORMAT_COUNT] = {
+	{ AV_CODEC_ID_MJPEG, AV_PIX_FMT_YUVJ420P, "jpeg" },
+	{ AV_CODEC_ID_WEBP, AV_PIX_FMT_YUV420P, "webp" },
+};
+
+// called on first use, workers that do not capture thumbnails do not load the codecs
+static void
+thumb_grabber_global_init(vod_log_t* log)
 {
 	AVCodec *cur_decoder_codec;
 	codec_id_mapping_t* mapping_cur;
 	codec_id_mapping_t* mapping_end;
+	uint32_t format;
+
+	init_done = TRUE;
 
 	#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
 		avcodec_register_all();
 	#endif
 	vod_memzero(decoder_codec, sizeof(decoder_codec));
 
-	encoder_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
-	if (encoder_codec == NULL)
+	for (format = 0; format < THUMB_FORMAT_COUNT; format++)
+	{
+		encoder_codec[format] = avcodec_find_encoder(image_format_mappings[format].av_codec_id);
+		if (encoder_codec[format] == NULL && format != THUMB_FORMAT_JPEG)
+		{
+			vod_log_error(VOD_LOG_WARN, log, 0,
+				"thumb_grabber_global_init: failed to get %s encoder, %s thumbnail capture is disabled",
+				image_format_mappings[format].name, image_format_mappings[format].name);
+		}
+	}
+
+	if (encoder_codec[THUMB_FORMAT_JPEG] == NULL)
 	{
 		vod_log_error(VOD_LOG_WARN, log, 0,
-			"thumb_grabber_process_init: failed to get jpeg encoder, thumbnail capture is disabled");
+			"thumb_grabber_global_init: failed to get jpeg encoder, thumbnail capture is disabled");
 		return;
 	}
 
@@ -84,7 +156,7 @@ thumb_grabber_process_init(vod_log_t* log)
 		if (cur_decoder_codec == NULL)
 		{
 			vod_log_error(VOD_LOG_WARN, log, 0,
-				"thumb_grabber_process_init: failed to get %s decoder, thumbnail capture is disabled for this codec", 
+				"thumb_grabber_global_init: failed to get %s decoder, thumbnail capture is disabled for this codec", 
 				mapping_cur->name);
 			continue;
 		}
@@ -98,6 +170,14 @@ thumb_grabber_free_state(void* context)
 {
 	thumb_grabber_state_t* state = (thumb_grabber_state_t*)context;
 
+#if (VOD_HAVE_LIB_SW_SCALE)
+	if (state->tiles != NULL)
+	{
+		sws_freeContext(state->tiles->sws_ctx);
+		av_frame_free(&state->tiles->frame);
+	}
+#endif // VOD_HAVE_LIB_SW_SCALE
+
 	av_packet_unref(&state->output_packet);
 	if (state->resize_buffer != NULL)
 	{
@@ -110,10 +190,168 @@ thumb_grabber_free_state(void* context)
 	av_free(state->decoder);
 }
 
+#if (THUMB_GRABBER_HW_DECODE)
+thumb_grabber_hw_device_t*
+thumb_grabber_get_hw_device(vod_log_t* log, vod_str_t* type_name, vod_str_t* device)
+{
+	thumb_grabber_hw_device_t* cur_device;
+	thumb_grabber_hw_device_t* last_device = hw_devices + hw_device_count;
+	int avrc;
+
+	// the devices are created on first use, since they can not be shared across processes
+	for (cur_device = hw_devices; cur_device < last_device; cur_device++)
+	{
+		if (cur_device->type_name.len == type_name->len &&
+			vod_memcmp(cur_device->type_name.data, type_name->data, type_name->len) == 0 &&
+			cur_device->device.len == device->len &&
+			vod_memcmp(cur_device->device.data, device->data, device->len) == 0)
+		{
+			return cur_device->device_ctx != NULL ? cur_device : NULL;
+		}
+	}
+
+	if (hw_device_count >= THUMB_GRABBER_MAX_HW_DEVICES)
+	{
+		vod_log_error(VOD_LOG_WARN, log, 0,
+			"thumb_grabber_get_hw_device: too many hw devices, using software decoding");
+		return NULL;
+	}
+
+	cur_device->type_name = *type_name;
+	cur_device->device = *device;
+	cur_device->device_ctx = NULL;
+	hw_device_count++;
+
+	// Note: the strings are allocated on the conf pool, and are null terminated
+	cur_device->type = av_hwdevice_find_type_by_name((char*)type_name->data);
+	if (cur_device->type == AV_HWDEVICE_TYPE_NONE)
+	{
+		vod_log_error(VOD_LOG_WARN, log, 0,
+			"thumb_grabber_get_hw_device: unknown hw device type \"%V\", using software decoding", type_name);
+		return NULL;
+	}
+
+	avrc = av_hwdevice_ctx_create(&cur_device->device_ctx, cur_device->type, 
+		device->len > 0 ? (char*)device->data : NULL, NULL, 0);
+	if (avrc < 0)
+	{
+		cur_device->device_ctx = NULL;
+		vod_log_error(VOD_LOG_WARN, log, 0,
+			"thumb_grabber_get_hw_device: av_hwdevice_ctx_create(%V) failed %d, using software decoding", type_name, avrc);
+		return NULL;
+	}
+
+	return cur_device;
+}
+#else
+thumb_grabber_hw_device_t*
+thumb_grabber_get_hw_device(vod_log_t* log, vod_str_t* type_name, vod_str_t* device)
+{
+	vod_log_error(VOD_LOG_WARN, log, 0,
+		"thumb_grabber_get_hw_device: hw decoding is not supported by this libavcodec version, using software decoding");
+	return NULL;
+}
+#endif // THUMB_GRABBER_HW_DECODE
+
+#if (THUMB_GRABBER_HW_DECODE)
+static enum AVPixelFormat
+thumb_grabber_get_format(AVCodecContext* decoder, const enum AVPixelFormat* formats)
+{
+	enum AVPixelFormat* hw_pix_fmt = decoder->opaque;
+	const enum AVPixelFormat* cur_format;
+
+	for (cur_format = formats; *cur_format != AV_PIX_FMT_NONE; cur_format++)
+	{
+		if (*cur_format == *hw_pix_fmt)
+		{
+			return *cur_format;
+		}
+	}
+
+	// the stream can not be decoded by the device, fall back to software decoding
+	*hw_pix_fmt = AV_PIX_FMT_NONE;
+	return avcodec_default_get_format(decoder, formats);
+}
+
+static void
+thumb_grabber_init_hw_decoder(
+	AVCodecContext *decoder,
+	const AVCodec *codec,
+	thumb_grabber_hw_device_t* hw_device, 
+	enum AVPixelFormat* hw_pix_fmt)
+{
+	const AVCodecHWConfig* config;
+	int i;
+
+	for (i = 0;; i++)
+	{
+		config = avcodec_get_hw_config(codec, i);
+		if (config == NULL)
+		{
+			return;
+		}
+
+		if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) != 0 &&
+			config->device_type == hw_device->type)
+		{
+			break;
+		}
+	}
+
+	decoder->hw_device_ctx = av_buffer_ref(hw_device->device_ctx);
+	if (decoder->hw_device_ctx == NULL)
+	{
+		return;
+	}
+
+	*hw_pix_fmt = config->pix_fmt;
+	decoder->opaque = hw_pix_fmt;
+	decoder->get_format = thumb_grabber_get_format;
+}
+
+// copies a frame decoded by the hw device to system memory
+static vod_status_t
+thumb_grabber_download_frame(thumb_grabber_state_t* state)
+{
+	AVFrame* sw_frame;
+	int avrc;
+
+	if (state->hw_pix_fmt == AV_PIX_FMT_NONE ||
+		state->decoded_frame->format != state->hw_pix_fmt)
+	{
+		return VOD_OK;
+	}
+
+	sw_frame = av_frame_alloc();
+	if (sw_frame == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"thumb_grabber_download_frame: av_frame_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	avrc = av_hwframe_transfer_data(sw_frame, state->decoded_frame, 0);
+	if (avrc < 0)
+	{
+		av_frame_free(&sw_frame);
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"thumb_grabber_download_frame: av_hwframe_transfer_data failed %d", avrc);
+		return VOD_UNEXPECTED;
+	}
+
+	av_frame_free(&state->decoded_frame);
+	state->decoded_frame = sw_frame;
+
+	return VOD_OK;
+}
+#endif // THUMB_GRABBER_HW_DECODE
+
 static vod_status_t
 thumb_grabber_init_decoder(
 	request_context_t* request_context,
 	media_info_t* media_info,
+	thumb_grabber_hw_device_t* hw_device,
+	enum AVPixelFormat* hw_pix_fmt,
 	AVCodecContext** result)
 {
 	AVCodecContext *decoder;
@@ -138,6 +376,14 @@ thumb_grabber_init_decoder(
 	decoder->width = media_info->u.video.width;
 	decoder->height = media_info->u.video.height;
 
+	*hw_pix_fmt = AV_PIX_FMT_NONE;
+#if (THUMB_GRABBER_HW_DECODE)
+	if (hw_device != NULL)
+	{
+		thumb_grabber_init_hw_decoder(decoder, decoder_codec[media_info->codec_id], hw_device, hw_pix_fmt);
+	}
+#endif // THUMB_GRABBER_HW_DECODE
+
 	avrc = avcodec_open2(decoder, decoder_codec[media_info->codec_id], NULL);
 	if (avrc < 0)
 	{
@@ -152,6 +398,7 @@ thumb_grabber_init_decoder(
 static vod_status_t
 thumb_grabber_init_encoder(
 	request_context_t* request_context,
+	uint32_t format,
 	uint32_t width,
 	uint32_t height,
 	AVCodecContext** result)
@@ -159,7 +406,7 @@ thumb_grabber_init_encoder(
 	AVCodecContext *encoder;
 	int avrc;
 
-	encoder = avcodec_alloc_context3(encoder_codec);
+	encoder = avcodec_alloc_context3(encoder_codec[format]);
 	if (encoder == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
@@ -172,9 +419,9 @@ thumb_grabber_init_encoder(
 	encoder->width = width;
 	encoder->height = height;
 	encoder->time_base = (AVRational){ 1, 1 };
-	encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	encoder->pix_fmt = image_format_mappings[format].pix_fmt;
 
-	avrc = avcodec_open2(encoder, encoder_codec, NULL);
+	avrc = avcodec_open2(encoder, encoder_codec[format], NULL);
 	if (avrc < 0)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
@@ -311,51 +558,96 @@ thumb_grabber_truncate_frames(
 	return VOD_OK;
 }
 
-vod_status_t
-thumb_grabber_init_state(
-	request_context_t* request_context,
-	media_track_t* track, 
+void
+thumb_grabber_get_output_size(
+	media_info_t* media_info,
 	request_params_t* request_params,
-	bool_t accurate,
-	write_callback_t write_callback,
-	void* write_context,
-	void** result)
+	uint32_t* width,
+	uint32_t* height)
 {
-	thumb_grabber_state_t* state;
-	vod_pool_cleanup_t *cln;
-	vod_status_t rc;
-	uint32_t output_width;
-	uint32_t output_height;
-	uint32_t frame_index;
+	if (request_params->width != 0)
+	{
+		*width = request_params->width;
+		if (request_params->height != 0)
+		{
+			*height = request_params->height;
+		}
+		else
+		{
+			*height = ((uint64_t)media_info->u.video.height * request_params->width) / media_info->u.video.width;
+		}
+	}
+	else
+	{
+		if (request_params->height != 0)
+		{
+			*width = ((uint64_t)media_info->u.video.width * request_params->height) / media_info->u.video.height;
+			*height = request_params->height;
+		}
+		else
+		{
+			*width = media_info->u.video.width;
+			*height = media_info->u.video.height;
+		}
+	}
+}
+
+static vod_status_t
+thumb_grabber_validate_track(
+	request_context_t* request_context,
+	media_track_t* track,
+	uint32_t format)
+{
+	if (!init_done)
+	{
+		thumb_grabber_global_init(request_context->log);
+	}
+
+	if (format >= THUMB_FORMAT_COUNT || encoder_codec[format] == NULL)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"thumb_grabber_validate_track: no encoder was initialized for format %uD", format);
+		return VOD_BAD_REQUEST;
+	}
 
 	if (decoder_codec[track->media_info.codec_id] == NULL)
 	{
 		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"thumb_grabber_init_state: no decoder was initialized for codec %uD", track->media_info.codec_id);
+			"thumb_grabber_validate_track: no decoder was initialized for codec %uD", track->media_info.codec_id);
 		return VOD_BAD_REQUEST;
 	}
 
 	if (track->media_info.u.video.width <= 0 || track->media_info.u.video.height <= 0)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"thumb_grabber_init_state: input width/height is zero");
+			"thumb_grabber_validate_track: input width/height is zero");
 		return VOD_BAD_DATA;
 	}
 
-	rc = thumb_grabber_truncate_frames(request_context, track, request_params->segment_time, accurate, &frame_index);
-	if (rc != VOD_OK)
-	{
-		return rc;
-	}
+	return VOD_OK;
+}
 
-	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-		"thumb_grabber_init_state: frame index is %uD", frame_index);
+static vod_status_t
+thumb_grabber_alloc_state(
+	request_context_t* request_context,
+	media_track_t* track,
+	uint32_t format,
+	uint32_t output_width,
+	uint32_t output_height,
+	thumb_grabber_hw_device_t* hw_device,
+	write_callback_t write_callback,
+	void* write_context,
+	thumb_grabber_state_t** result)
+{
+	thumb_grabber_state_t* state;
+	vod_pool_cleanup_t *cln;
+	vod_status_t rc;
 
 	state = vod_alloc(request_context->pool, sizeof(*state));
 	if (state == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"thumb_grabber_init_state: vod_alloc failed (1)");
+			"thumb_grabber_alloc_state: vod_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -367,93 +659,396 @@ thumb_grabber_init_state(
 	av_init_packet(&state->output_packet);
 	state->output_packet.data = NULL;
 	state->output_packet.size = 0;
+#if (VOD_HAVE_LIB_SW_SCALE)
+	state->tiles = NULL;
+#endif // VOD_HAVE_LIB_SW_SCALE
 
 	// add to the cleanup pool
 	cln = vod_pool_cleanup_add(request_context->pool, 0);
 	if (cln == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"thumb_grabber_init_state: vod_pool_cleanup_add failed");
+			"thumb_grabber_alloc_state: vod_pool_cleanup_add failed");
 		return VOD_ALLOC_FAILED;
 	}
 
 	cln->handler = thumb_grabber_free_state;
 	cln->data = state;
 
-	rc = thumb_grabber_init_decoder(request_context, &track->media_info, &state->decoder);
+	rc = thumb_grabber_init_decoder(
+		request_context, 
+		&track->media_info, 
+		hw_device, 
+		&state->hw_pix_fmt, 
+		&state->decoder);
 	if (rc != VOD_OK)
 	{
 		return rc;
 	}
 
-	if (request_params->width != 0)
+	// TODO: postpone the initialization of the encoder to after a frame is decoded
+
+	rc = thumb_grabber_init_encoder(request_context, format, output_width, output_height, &state->encoder);
+	if (rc != VOD_OK)
 	{
-		output_width = request_params->width;
-		if (request_params->height != 0)
+		return rc;
+	}
+
+	state->decoded_frame = av_frame_alloc();
+	if (state->decoded_frame == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_alloc_state: av_frame_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->request_context = request_context;
+	state->write_callback = write_callback;
+	state->write_context = write_context;
+	state->cur_frame_part = track->frames;
+	state->cur_frame = track->frames.first_frame;
+	state->frame_buffer = NULL;
+	state->cur_frame_pos = 0;
+	state->first_time = TRUE;
+	state->frame_started = FALSE;
+	state->missing_frames = 0;
+	state->dts = 0;
+	state->has_frame = 0;
+
+	*result = state;
+
+	return VOD_OK;
+}
+
+vod_status_t
+thumb_grabber_init_state(
+	request_context_t* request_context,
+	media_track_t* track, 
+	request_params_t* request_params,
+	bool_t accurate,
+	thumb_grabber_hw_device_t* hw_device,
+	write_callback_t write_callback,
+	void* write_context,
+	void** result)
+{
+	thumb_grabber_state_t* state;
+	vod_status_t rc;
+	uint32_t output_width;
+	uint32_t output_height;
+	uint32_t frame_index;
+
+	rc = thumb_grabber_validate_track(request_context, track, request_params->image_format);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	rc = thumb_grabber_truncate_frames(request_context, track, request_params->segment_time, accurate, &frame_index);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"thumb_grabber_init_state: frame index is %uD", frame_index);
+
+	thumb_grabber_get_output_size(&track->media_info, request_params, &output_width, &output_height);
+
+	if (output_width <= 0 || output_height <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_init_state: output width/height is zero");
+		return VOD_BAD_REQUEST;
+	}
+
+	rc = thumb_grabber_alloc_state(
+		request_context,
+		track,
+		request_params->image_format,
+		output_width,
+		output_height,
+		hw_device,
+		write_callback,
+		write_context,
+		&state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	state->max_frame_size = thumb_grabber_get_max_frame_size(track, frame_index + 1);
+	state->skip_count = frame_index;
+
+	*result = state;
+
+	return VOD_OK;
+}
+
+#if (VOD_HAVE_LIB_SW_SCALE)
+// sets the index of the key frame that is closest to the time of each tile,
+// the tile count is reduced in case some of the tiles are after the end of the track
+static vod_status_t
+thumb_grabber_get_tile_frames(
+	request_context_t* request_context,
+	media_track_t* track,
+	thumb_tiles_params_t* params,
+	uint32_t* frame_indexes,
+	uint32_t* count)
+{
+	frame_list_part_t* part;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint64_t dts = track->clip_start_time + track->first_frame_time_offset;
+	uint64_t start_time;
+	uint64_t tile_time;
+	uint64_t prev_pts = 0;
+	uint64_t pts;
+	uint32_t prev_index = 0;
+	uint32_t cur_tile = 0;
+	uint32_t index;
+	bool_t has_key_frame = FALSE;
+
+	if (track->frame_count <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_get_tile_frames: did not find any frames (1)");
+		return VOD_BAD_REQUEST;
+	}
+
+	part = &track->frames;
+	last_frame = part->last_frame;
+	cur_frame = part->first_frame;
+
+	start_time = params->start + cur_frame->pts_delay;
+	tile_time = start_time;
+
+	for (index = 0;; cur_frame++, index++)
+	{
+		if (cur_frame >= last_frame)
 		{
-			output_height = request_params->height;
+			if (part->next == NULL)
+			{
+				break;
+			}
+			part = part->next;
+			cur_frame = part->first_frame;
+			last_frame = part->last_frame;
 		}
-		else
+
+		if (cur_frame->key_frame)
 		{
-			output_height = ((uint64_t)track->media_info.u.video.height * request_params->width) / track->media_info.u.video.width;
+			pts = dts + cur_frame->pts_delay;
+
+			// assign the tiles that precede this key frame
+			for (; cur_tile < *count && tile_time <= pts; cur_tile++)
+			{
+				frame_indexes[cur_tile] = has_key_frame && tile_time - prev_pts < pts - tile_time ?
+					prev_index : index;
+				tile_time += params->interval;
+			}
+
+			prev_pts = pts;
+			prev_index = index;
+			has_key_frame = TRUE;
 		}
+
+		dts += cur_frame->duration;
 	}
-	else
+
+	if (!has_key_frame)
 	{
-		if (request_params->height != 0)
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_get_tile_frames: did not find any frames (2)");
+		return VOD_BAD_REQUEST;
+	}
+
+	// assign the tiles that follow the last key frame, until the end of the track
+	for (; cur_tile < *count && tile_time < dts; cur_tile++)
+	{
+		frame_indexes[cur_tile] = prev_index;
+		tile_time += params->interval;
+	}
+
+	if (cur_tile <= 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_get_tile_frames: start time %uL is after the end of the track", params->start);
+		return VOD_BAD_REQUEST;
+	}
+
+	*count = cur_tile;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+thumb_grabber_skip_frames(thumb_grabber_state_t* state, uint32_t count)
+{
+	vod_status_t rc;
+	uint32_t cur_count;
+
+	while (count > 0)
+	{
+		if (state->cur_frame >= state->cur_frame_part.last_frame)
 		{
-			output_width = ((uint64_t)track->media_info.u.video.width * request_params->height) / track->media_info.u.video.height;
-			output_height = request_params->height;
+			state->cur_frame_part = *state->cur_frame_part.next;
+			state->cur_frame = state->cur_frame_part.first_frame;
 		}
-		else
+
+		cur_count = state->cur_frame_part.last_frame - state->cur_frame;
+		if (cur_count > count)
+		{
+			cur_count = count;
+		}
+
+		rc = state->cur_frame_part.frames_source->skip_frames(
+			state->cur_frame_part.frames_source_context,
+			cur_count);
+		if (rc != VOD_OK)
 		{
-			output_width = track->media_info.u.video.width;
-			output_height = track->media_info.u.video.height;
+			return rc;
 		}
+
+		state->cur_frame += cur_count;
+		count -= cur_count;
 	}
 
-	if (output_width <= 0 || output_height <= 0)
+	return VOD_OK;
+}
+
+vod_status_t
+thumb_grabber_init_tiles_state(
+	request_context_t* request_context,
+	media_track_t* track,
+	request_params_t* request_params,
+	thumb_grabber_hw_device_t* hw_device,
+	write_callback_t write_callback,
+	void* write_context,
+	void** result)
+{
+	thumb_grabber_tiles_t* tiles;
+	thumb_grabber_state_t* state;
+	AVFrame* frame;
+	vod_status_t rc;
+	uint32_t tile_width;
+	uint32_t tile_height;
+	uint32_t count;
+	int avrc;
+
+	rc = thumb_grabber_validate_track(request_context, track, request_params->image_format);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// get the tile size, must be even for the chroma planes
+	thumb_grabber_get_output_size(&track->media_info, request_params, &tile_width, &tile_height);
+	tile_width &= ~1;
+	tile_height &= ~1;
+
+	if (tile_width <= 0 || tile_height <= 0 ||
+		tile_width * request_params->tiles.columns > THUMB_TILES_MAX_DIMENSION ||
+		tile_height * request_params->tiles.rows > THUMB_TILES_MAX_DIMENSION)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"thumb_grabber_init_state: output width/height is zero");
+			"thumb_grabber_init_tiles_state: invalid tile size %uDx%uD", tile_width, tile_height);
 		return VOD_BAD_REQUEST;
 	}
 
-	// TODO: postpone the initialization of the encoder to after a frame is decoded
+	tiles = vod_alloc(request_context->pool, sizeof(*tiles));
+	if (tiles == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"thumb_grabber_init_tiles_state: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	count = request_params->tiles.columns * request_params->tiles.rows;
 
-	rc = thumb_grabber_init_encoder(request_context, output_width, output_height, &state->encoder);
+	tiles->frame_indexes = vod_alloc(request_context->pool, sizeof(tiles->frame_indexes[0]) * count);
+	if (tiles->frame_indexes == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"thumb_grabber_init_tiles_state: vod_alloc failed (2)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	rc = thumb_grabber_get_tile_frames(request_context, track, &request_params->tiles, tiles->frame_indexes, &count);
 	if (rc != VOD_OK)
 	{
 		return rc;
 	}
 
-	state->decoded_frame = av_frame_alloc();
-	if (state->decoded_frame == NULL)
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"thumb_grabber_init_tiles_state: tile count is %uD, last frame index is %uD", count, tiles->frame_indexes[count - 1]);
+
+	rc = thumb_grabber_alloc_state(
+		request_context,
+		track,
+		request_params->image_format,
+		tile_width * request_params->tiles.columns,
+		tile_height * request_params->tiles.rows,
+		hw_device,
+		write_callback,
+		write_context,
+		&state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	tiles->count = count;
+	tiles->cur_tile = 0;
+	tiles->cur_frame_index = tiles->frame_indexes[0];
+	tiles->columns = request_params->tiles.columns;
+	tiles->width = tile_width;
+	tiles->height = tile_height;
+	tiles->sws_ctx = NULL;
+	tiles->frame = NULL;
+	state->tiles = tiles;
+
+	// allocate the tiles frame, tiles after the end of the track remain black
+	frame = av_frame_alloc();
+	if (frame == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"thumb_grabber_init_state: av_frame_alloc failed");
+			"thumb_grabber_init_tiles_state: av_frame_alloc failed");
 		return VOD_ALLOC_FAILED;
 	}
 
-	state->request_context = request_context;
-	state->write_callback = write_callback;
-	state->write_context = write_context;
-	state->cur_frame_part = track->frames;
-	state->cur_frame = track->frames.first_frame;
-	state->max_frame_size = thumb_grabber_get_max_frame_size(track, frame_index + 1);
-	state->frame_buffer = NULL;
-	state->skip_count = frame_index;
-	state->cur_frame_pos = 0;
-	state->first_time = TRUE;
-	state->frame_started = FALSE;
-	state->missing_frames = 0;
-	state->dts = 0;
-	state->has_frame = 0;
+	tiles->frame = frame;
+
+	frame->width = state->encoder->width;
+	frame->height = state->encoder->height;
+	frame->format = AV_PIX_FMT_YUV420P;
+
+	avrc = av_frame_get_buffer(frame, 32);
+	if (avrc < 0)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"thumb_grabber_init_tiles_state: av_frame_get_buffer failed %d", avrc);
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memset(frame->data[0], 0, frame->linesize[0] * frame->height);
+	vod_memset(frame->data[1], 0x80, frame->linesize[1] * (frame->height / 2));
+	vod_memset(frame->data[2], 0x80, frame->linesize[2] * (frame->height / 2));
+
+	// only the key frames of the tiles are read
+	state->max_frame_size = thumb_grabber_get_max_frame_size(track, tiles->frame_indexes[count - 1] + 1);
+	state->skip_count = 0;
+
+	rc = thumb_grabber_skip_frames(state, tiles->cur_frame_index);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
 
 	*result = state;
 
 	return VOD_OK;
 }
+#endif // VOD_HAVE_LIB_SW_SCALE
 
 static vod_status_t
 thumb_grabber_decode_flush(thumb_grabber_state_t* state)
@@ -644,9 +1239,20 @@ thumb_grabber_write_frame(thumb_grabber_state_t* state)
 		return VOD_UNEXPECTED;
 	}
 
+#if (THUMB_GRABBER_HW_DECODE)
+	rc = thumb_grabber_download_frame(state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+#endif // THUMB_GRABBER_HW_DECODE
+
 #if (VOD_HAVE_LIB_SW_SCALE)
+	// Note: frames downloaded from a hw device are usually nv12
 	if (state->encoder->width != state->decoded_frame->width ||
-		state->encoder->height != state->decoded_frame->height)
+		state->encoder->height != state->decoded_frame->height ||
+		(state->decoded_frame->format != AV_PIX_FMT_YUV420P &&
+		state->decoded_frame->format != AV_PIX_FMT_YUVJ420P))
 	{
 		rc = thumb_grabber_resize_frame(state);
 		if (rc != VOD_OK)
@@ -681,6 +1287,105 @@ thumb_grabber_write_frame(thumb_grabber_state_t* state)
 	return VOD_OK;
 }
 
+#if (VOD_HAVE_LIB_SW_SCALE)
+// scales the decoded frame into all the tiles that use it, and moves to the key frame of the next tile
+static vod_status_t
+thumb_grabber_add_tiles(thumb_grabber_state_t* state)
+{
+	thumb_grabber_tiles_t* tiles = state->tiles;
+	AVFrame* input_frame;
+	AVFrame* output_frame = tiles->frame;
+	uint8_t* data[4];
+	vod_status_t rc;
+	uint32_t x;
+	uint32_t y;
+	
+	if (state->missing_frames > 0)
+	{
+		rc = thumb_grabber_decode_flush(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		// the decoder was drained, reset it so that it accepts the next key frame
+		avcodec_flush_buffers(state->decoder);
+	}
+
+	if (!state->has_frame)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"thumb_grabber_add_tiles: no frames were decoded");
+		return VOD_UNEXPECTED;
+	}
+
+#if (THUMB_GRABBER_HW_DECODE)
+	rc = thumb_grabber_download_frame(state);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+#endif // THUMB_GRABBER_HW_DECODE
+
+	input_frame = state->decoded_frame;
+
+	tiles->sws_ctx = sws_getCachedContext(tiles->sws_ctx,
+		input_frame->width, input_frame->height, input_frame->format,
+		tiles->width, tiles->height, output_frame->format,
+		SWS_BICUBIC, NULL, NULL, NULL);
+	if (tiles->sws_ctx == NULL)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"thumb_grabber_add_tiles: sws_getCachedContext failed");
+		return VOD_UNEXPECTED;
+	}
+
+	// the same key frame can be the closest one to several tiles
+	do
+	{
+		x = (tiles->cur_tile % tiles->columns) * tiles->width;
+		y = (tiles->cur_tile / tiles->columns) * tiles->height;
+
+		data[0] = output_frame->data[0] + y * output_frame->linesize[0] + x;
+		data[1] = output_frame->data[1] + (y / 2) * output_frame->linesize[1] + x / 2;
+		data[2] = output_frame->data[2] + (y / 2) * output_frame->linesize[2] + x / 2;
+		data[3] = NULL;
+
+		sws_scale(tiles->sws_ctx,
+			(const uint8_t* const*)input_frame->data, input_frame->linesize, 0, input_frame->height,
+			data, output_frame->linesize);
+
+		tiles->cur_tile++;
+	} while (tiles->cur_tile < tiles->count &&
+		tiles->frame_indexes[tiles->cur_tile] == tiles->cur_frame_index);
+
+	if (tiles->cur_tile >= tiles->count)
+	{
+		// write the tiles frame
+		av_frame_free(&state->decoded_frame);
+		state->decoded_frame = output_frame;
+		tiles->frame = NULL;
+		return VOD_OK;
+	}
+
+	// skip the frames up to the key frame of the next tile
+	state->cur_frame++;
+	state->frame_started = FALSE;
+
+	tiles->cur_frame_index++;
+
+	rc = thumb_grabber_skip_frames(state, tiles->frame_indexes[tiles->cur_tile] - tiles->cur_frame_index);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	tiles->cur_frame_index = tiles->frame_indexes[tiles->cur_tile];
+
+	return VOD_AGAIN;
+}
+#endif // VOD_HAVE_LIB_SW_SCALE
+
 vod_status_t
 thumb_grabber_process(void* context)
 {
@@ -777,6 +1482,25 @@ thumb_grabber_process(void* context)
 			return rc;
 		}
 
+#if (VOD_HAVE_LIB_SW_SCALE)
+		if (state->tiles != NULL)
+		{
+			rc = thumb_grabber_add_tiles(state);
+			if (rc == VOD_AGAIN)
+			{
+				// more tiles are needed
+				continue;
+			}
+
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			return thumb_grabber_write_frame(state);
+		}
+#endif // VOD_HAVE_LIB_SW_SCALE
+
 		// if the target frame was reached, write it
 		if (state->skip_count <= 0)
 		{
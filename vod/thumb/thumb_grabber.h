@@ -5,18 +5,52 @@
 #include "../media_format.h"
 #include "../media_set.h"
 
+// enums
+enum {
+	THUMB_FORMAT_JPEG,
+	THUMB_FORMAT_WEBP,
+
+	THUMB_FORMAT_COUNT
+};
+
+// typedefs
+typedef struct thumb_grabber_hw_device_s thumb_grabber_hw_device_t;
+
 // functions
-void thumb_grabber_process_init(vod_log_t* log);
+// returns a hw decoding device of the given type, the device is created on first use.
+// returns NULL if the device could not be created, software decoding should be used in this case.
+thumb_grabber_hw_device_t* thumb_grabber_get_hw_device(
+	vod_log_t* log, 
+	vod_str_t* type_name, 
+	vod_str_t* device);
 
 vod_status_t thumb_grabber_init_state(
 	request_context_t* request_context,
 	media_track_t* track,
 	request_params_t* request_params,
 	bool_t accurate,
+	thumb_grabber_hw_device_t* hw_device,
+	write_callback_t write_callback,
+	void* write_context,
+	void** result);
+
+#if (VOD_HAVE_LIB_SW_SCALE)
+vod_status_t thumb_grabber_init_tiles_state(
+	request_context_t* request_context,
+	media_track_t* track,
+	request_params_t* request_params,
+	thumb_grabber_hw_device_t* hw_device,
 	write_callback_t write_callback,
 	void* write_context,
 	void** result);
+#endif // VOD_HAVE_LIB_SW_SCALE
 
 vod_status_t thumb_grabber_process(void* context);
 
+void thumb_grabber_get_output_size(
+	media_info_t* media_info,
+	request_params_t* request_params,
+	uint32_t* width,
+	uint32_t* height);
+
 #endif //__THUMB_GRABBER_H__
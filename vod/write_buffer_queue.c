@@ -99,6 +99,34 @@ write_buffer_queue_get_buffer(write_buffer_queue_t* queue, uint32_t size, void*
 	return result;
 }
 
+u_char*
+write_buffer_queue_get_buffers(
+	write_buffer_queue_t* queue, 
+	uint32_t unit_size, 
+	uint32_t max_count, 
+	void* writer_context, 
+	uint32_t* count)
+{
+	buffer_header_t* write_buffer = queue->cur_write_buffer;
+	uint32_t size;
+
+	// return as many units as fit in the current buffer
+	if (write_buffer != NULL && write_buffer->cur_pos + unit_size <= write_buffer->end_pos)
+	{
+		*count = vod_min((write_buffer->end_pos - write_buffer->cur_pos) / unit_size, max_count);
+		size = *count * unit_size;
+
+		write_buffer->cur_pos += size;
+		queue->cur_offset += size;
+		queue->last_writer_context = writer_context;
+		return write_buffer->cur_pos - size;
+	}
+
+	// no room in the current buffer, return a single unit from the next buffer
+	*count = 1;
+	return write_buffer_queue_get_buffer(queue, unit_size, writer_context);
+}
+
 vod_status_t
 write_buffer_queue_send(write_buffer_queue_t* queue, off_t max_offset)
 {